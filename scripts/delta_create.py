@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+
+# Touhou Community Reliant Automatic Patcher
+# Scripts
+#
+# ----
+#
+"""Creates a binary delta between two versions of a patch file, which the
+updater downloads instead of the new file if the user has the old one.
+
+The delta is written next to the new file as
+<file name>.<old CRC32>-<new CRC32>.delta, which is the name the updater
+asks for. See thcrap/src/delta.h for the format."""
+
+import argparse
+import os
+import struct
+import zlib
+
+DELTA_MAGIC = b'THDELTA1'
+HEADER = struct.Struct('<8sII')
+RECORD = struct.Struct('<IiI')
+# Matches are searched for at this granularity.
+BLOCK = 32
+# A match is extended past differing bytes for as long as at least half of
+# the bytes still match, but no further than this beyond the last good
+# position, like bsdiff does.
+EXTEND_LOOKAHEAD = 256
+
+parser = argparse.ArgumentParser(
+    description=__doc__
+)
+parser.add_argument(
+    'old',
+    help='Previous version of the file.'
+)
+parser.add_argument(
+    'new',
+    help='Current version of the file.'
+)
+parser.add_argument(
+    '-o', '--output-dir',
+    help='Directory for the delta. Defaults to the directory of the new '
+         'file.'
+)
+parser.add_argument(
+    '-m', '--min-savings',
+    help='Only write the delta if it is at most this percentage of the '
+         'size of the new file. (Default: 50)',
+    type=int,
+    default=50
+)
+
+
+def match_extend(old, new, old_pos, new_pos):
+    """Returns the length of the region at [old_pos] and [new_pos] that is
+    worth encoding as a difference, maximizing 2 * matches - length."""
+    best_len = 0
+    best_score = 0
+    score = 0
+    i = 0
+    max_len = min(len(old) - old_pos, len(new) - new_pos)
+    while i < max_len and i - best_len <= EXTEND_LOOKAHEAD:
+        score += 1 if old[old_pos + i] == new[new_pos + i] else -1
+        i += 1
+        if score > best_score:
+            best_score = score
+            best_len = i
+    return best_len
+
+
+def delta_records(old, new):
+    """Yields (extra, seek, diff) for every record."""
+    blocks = {}
+    for pos in range(len(old) - BLOCK, -1, -BLOCK):
+        # Iterating backwards keeps the first occurrence of every block.
+        blocks[old[pos:pos + BLOCK]] = pos
+
+    old_pos = 0
+    extra_start = 0
+    new_pos = 0
+    while new_pos + BLOCK <= len(new):
+        match = blocks.get(new[new_pos:new_pos + BLOCK])
+        if match is None:
+            new_pos += 1
+            continue
+        diff_len = match_extend(old, new, match, new_pos)
+        diff = bytes(
+            (new[new_pos + i] - old[match + i]) & 0xff for i in range(diff_len)
+        )
+        yield new[extra_start:new_pos], match - old_pos, diff
+        old_pos = match + diff_len
+        new_pos += diff_len
+        extra_start = new_pos
+    if extra_start < len(new):
+        yield new[extra_start:], 0, b''
+
+
+def delta_build(old, new):
+    if len(old) > 0xffffffff or len(new) > 0xffffffff:
+        raise ValueError('Deltas only support files smaller than 4 GiB')
+    comp = zlib.compressobj(9, zlib.DEFLATED, -zlib.MAX_WBITS)
+    ret = bytearray(HEADER.pack(DELTA_MAGIC, len(old), len(new)))
+    for extra, seek, diff in delta_records(old, new):
+        ret += comp.compress(RECORD.pack(len(extra), seek, len(diff)))
+        ret += comp.compress(extra)
+        ret += comp.compress(diff)
+    ret += comp.flush()
+    return ret
+
+
+def delta_fn(new_fn, old, new):
+    return '{}.{:08x}-{:08x}.delta'.format(
+        os.path.basename(new_fn), zlib.crc32(old), zlib.crc32(new)
+    )
+
+
+if __name__ == '__main__':
+    arg = parser.parse_args()
+    with open(arg.old, 'rb') as f:
+        old = f.read()
+    with open(arg.new, 'rb') as f:
+        new = f.read()
+    delta = delta_build(old, new)
+    if len(delta) * 100 > len(new) * arg.min_savings:
+        print('{}: delta would be {} bytes for {} bytes, not worth it'.format(
+            arg.new, len(delta), len(new)
+        ))
+    else:
+        out_dir = arg.output_dir or os.path.dirname(arg.new)
+        out_fn = os.path.join(out_dir, delta_fn(arg.new, old, new))
+        with open(out_fn, 'wb') as f:
+            f.write(delta)
+        print('{}: {} bytes for {} bytes'.format(out_fn, len(delta), len(new)))
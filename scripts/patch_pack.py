@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+
+# Touhou Community Reliant Automatic Patcher
+# Scripts
+#
+# ----
+#
+"""Packs the files of a patch into a single patch.thpack file, which thcrap
+maps into memory instead of looking up every file in the patch directory.
+Files in the directory that are not part of the pack are still used, so
+that a pack can be amended with loose files during development."""
+
+import argparse
+import os
+import struct
+import zlib
+
+PACK_FN = 'patch.thpack'
+PACK_MAGIC = 0x4b504854  # "THPK"
+PACK_VERSION = 1
+HEADER = struct.Struct('<4I')
+ENTRY = struct.Struct('<6I')
+METHOD_STORED = 0
+METHOD_DEFLATE = 8
+# File data is aligned to this many bytes inside the pack.
+DATA_ALIGN = 16
+# Never packed, since they are read or rewritten by the updater.
+IGNORED = {'files.js', 'patch.js', PACK_FN}
+
+parser = argparse.ArgumentParser(
+    description=__doc__
+)
+parser.add_argument(
+    'patch',
+    help='Patch directory.'
+)
+parser.add_argument(
+    '-c', '--compress',
+    help='Deflate files if that saves at least 10%% of their size. Only '
+         'stored files can be mapped without a copy, so this trades memory '
+         'for disk space.',
+    action='store_true'
+)
+parser.add_argument(
+    '-r', '--remove',
+    help='Delete the loose files after packing them.',
+    action='store_true'
+)
+
+
+def pack_name(rel_fn):
+    """Normalizes [rel_fn] the same way as thcrap's patch file index: forward
+    slashes, and lowercase ASCII letters only."""
+    rel_fn = rel_fn.replace('\\', '/')
+    return ''.join(c.lower() if c.isascii() else c for c in rel_fn)
+
+
+def pack_files_walk(patch_dir):
+    for root, dirs, files in os.walk(patch_dir):
+        dirs.sort()
+        for fn in sorted(files):
+            full_fn = os.path.join(root, fn)
+            rel_fn = os.path.relpath(full_fn, patch_dir)
+            if rel_fn in IGNORED:
+                continue
+            yield full_fn, pack_name(rel_fn).encode('utf-8')
+
+
+def pack_build(patch_dir, compress):
+    """Returns the pack for [patch_dir] as bytes, and the list of packed
+    files."""
+    files = sorted(pack_files_walk(patch_dir), key=lambda f: f[1])
+    for prev, cur in zip(files, files[1:]):
+        if prev[1] == cur[1]:
+            raise ValueError('{} and {} only differ in case'.format(
+                prev[0], cur[0]
+            ))
+
+    names = b''.join(name for _, name in files)
+    names_offset = HEADER.size + len(files) * ENTRY.size
+    data_offset = names_offset + len(names)
+    data = bytearray()
+    entries = []
+    name_offset = names_offset
+    for full_fn, name in files:
+        with open(full_fn, 'rb') as f:
+            content = f.read()
+        method = METHOD_STORED
+        stored = content
+        if compress and content:
+            comp = zlib.compressobj(9, zlib.DEFLATED, -zlib.MAX_WBITS)
+            deflated = comp.compress(content) + comp.flush()
+            if len(deflated) <= len(content) * 0.9:
+                method = METHOD_DEFLATE
+                stored = deflated
+        data += b'\0' * (-(data_offset + len(data)) % DATA_ALIGN)
+        entries.append(ENTRY.pack(
+            name_offset, len(name), data_offset + len(data),
+            len(stored), len(content), method
+        ))
+        name_offset += len(name)
+        data += stored
+
+    pack = bytearray(HEADER.pack(PACK_MAGIC, PACK_VERSION, len(files), 0))
+    for entry in entries:
+        pack += entry
+    pack += names
+    pack += data
+    if len(pack) > 0xffffffff:
+        raise ValueError('Patch packs must be smaller than 4 GiB')
+    return pack, [full_fn for full_fn, _ in files]
+
+
+if __name__ == '__main__':
+    arg = parser.parse_args()
+    pack, packed = pack_build(arg.patch, arg.compress)
+    with open(os.path.join(arg.patch, PACK_FN), 'wb') as f:
+        f.write(pack)
+    print('{}: {} files, {} bytes'.format(arg.patch, len(packed), len(pack)))
+    if arg.remove:
+        for fn in packed:
+            os.remove(fn)
@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+
+# Touhou Community Reliant Automatic Patcher
+# Scripts
+#
+# ----
+#
+"""Converts the PNGs in a patch to pre-converted raw images, which thcrap
+loads instead of a PNG with the same name in the same patch, without having
+to decode it.
+
+Raw images are larger than the PNGs they replace, so this trades disk space
+and download size for load times. See thcrap/src/raw_image.h for the
+format. Requires Pillow."""
+
+import argparse
+import os
+import struct
+import zlib
+
+from PIL import Image
+
+RAW_IMAGE_EXT = '.thri'
+RAW_IMAGE_MAGIC = 0x49524854  # "THRI"
+HEADER = struct.Struct('<IHHIIII')
+FORMAT_BGRA8 = 0
+FORMAT_BGR8 = 1
+METHOD_STORED = 0
+METHOD_DEFLATE = 8
+# Rows are padded to this many bytes.
+PITCH_ALIGN = 4
+
+parser = argparse.ArgumentParser(
+    description=__doc__
+)
+parser.add_argument(
+    'paths',
+    help='PNG files, or directories to search for PNG files.',
+    nargs='+'
+)
+parser.add_argument(
+    '-c', '--compress',
+    help='Deflate the pixel data if that saves at least 10%% of its size. '
+         'Stored images only have to be copied, so this trades load time '
+         'for disk space.',
+    action='store_true'
+)
+parser.add_argument(
+    '-r', '--remove',
+    help='Delete the PNGs after converting them. Game versions or plugins '
+         'that only support PNGs will then no longer find the images.',
+    action='store_true'
+)
+
+
+def raw_image_build(png_fn, compress):
+    img = Image.open(png_fn)
+    has_alpha = img.mode in ('RGBA', 'LA', 'PA') or (
+        img.mode == 'P' and 'transparency' in img.info
+    )
+    if has_alpha:
+        img = img.convert('RGBA')
+        fmt, raw_mode, channels = FORMAT_BGRA8, 'BGRA', 4
+    else:
+        img = img.convert('RGB')
+        fmt, raw_mode, channels = FORMAT_BGR8, 'BGR', 3
+    width, height = img.size
+    rowbytes = width * channels
+    padding = b'\0' * (-rowbytes % PITCH_ALIGN)
+    pitch = rowbytes + len(padding)
+    pixels = img.tobytes('raw', raw_mode)
+    data = b''.join(
+        pixels[y * rowbytes:(y + 1) * rowbytes] + padding
+        for y in range(height)
+    )
+
+    method = METHOD_STORED
+    if compress:
+        comp = zlib.compressobj(9, zlib.DEFLATED, -zlib.MAX_WBITS)
+        deflated = comp.compress(data) + comp.flush()
+        if len(deflated) <= len(data) * 0.9:
+            method = METHOD_DEFLATE
+            data = deflated
+    if len(data) > 0xffffffff:
+        raise ValueError('{} is too large'.format(png_fn))
+    return HEADER.pack(
+        RAW_IMAGE_MAGIC, fmt, method, width, height, pitch, len(data)
+    ) + data
+
+
+def png_files_walk(paths):
+    for path in paths:
+        if not os.path.isdir(path):
+            yield path
+            continue
+        for root, dirs, files in os.walk(path):
+            dirs.sort()
+            for fn in sorted(files):
+                if fn.lower().endswith('.png'):
+                    yield os.path.join(root, fn)
+
+
+if __name__ == '__main__':
+    arg = parser.parse_args()
+    for png_fn in png_files_walk(arg.paths):
+        raw = raw_image_build(png_fn, arg.compress)
+        raw_fn = os.path.splitext(png_fn)[0] + RAW_IMAGE_EXT
+        with open(raw_fn, 'wb') as f:
+            f.write(raw)
+        print('{}: {} bytes for {} bytes'.format(
+            raw_fn, len(raw), os.path.getsize(png_fn)
+        ))
+        if arg.remove:
+            os.remove(png_fn)
@@ -12,6 +12,7 @@ import shutil
 import os
 import argparse
 import zlib
+import zipfile
 import sys
 import utils
 try:
@@ -25,7 +26,11 @@ except ModuleNotFoundError:
 system.)""", file=sys.stderr)
     sys.exit(1)
 
-IGNORED_BY_DEFAULT = {'files.js', 'Thumbs.db', 'thcrap_ignore.txt'}
+IGNORED_BY_DEFAULT = {
+    'files.js', 'Thumbs.db', 'thcrap_ignore.txt', 'bundle.js', 'bundle.zip',
+    # Created by delta_create.py on the server side
+    '*.delta'
+}
 
 parser = argparse.ArgumentParser(
     description=__doc__
@@ -50,6 +55,13 @@ parser.add_argument(
     dest='t'
 )
 
+parser.add_argument(
+    '-b', '--bundle',
+    help='Also pack every patch into a bundle.zip, which clients download '
+         'instead of single files for first-time installs and large updates.',
+    action='store_true'
+)
+
 
 def str_slash_normalize(string):
     return string.replace('\\', '/')
@@ -96,9 +108,29 @@ def patch_files_walk(repo_top, path, ignored):
                 yield i.path
 
 
-def patch_build(patch_id, servers, f, t, ignored):
+def bundle_build(t_path, files_js):
+    """Writes bundle.zip with all files in [files_js] from [t_path], and
+    bundle.js with the CRC32 of the bundle and of every file inside."""
+    bundle_fn = os.path.join(t_path, 'bundle.zip')
+    bundle_files = {}
+    with zipfile.ZipFile(bundle_fn, 'w', zipfile.ZIP_DEFLATED) as z:
+        for fn, crc in sorted(files_js.items()):
+            if crc is None:
+                continue
+            z.write(os.path.join(t_path, fn), fn)
+            bundle_files[fn] = crc
+    with open(bundle_fn, 'rb') as f:
+        bundle_crc = zlib.crc32(f.read()) & 0xffffffff
+    utils.json_store('bundle.js', {
+        'crc32': bundle_crc,
+        'files': bundle_files,
+    }, dirs=[t_path])
+
+
+def patch_build(patch_id, servers, f, t, ignored, bundle):
     """Updates the patch in the [f]/[patch_id] directory, ignoring the files
-    that match [ignored].
+    that match [ignored]. If [bundle] is set, the patch is also packed into
+    a bundle in [t]/[patch_id].
 
     Ensures that patch.js contains all necessary keys and values, then updates
     the checksums in files.js and, if [t] differs from [f], copies all patch
@@ -160,6 +192,8 @@ def patch_build(patch_id, servers, f, t, ignored):
             shutil.copy2(f_fn, t_fn)
 
     utils.json_store('files.js', files_js, dirs=[f_path, t_path])
+    if bundle:
+        bundle_build(t_path, files_js)
     print(
         '{num} files, {size}'.format(
             num=len({k: v for k, v in files_js.items() if v is not None}),
@@ -169,7 +203,7 @@ def patch_build(patch_id, servers, f, t, ignored):
     return patch_js['title']
 
 
-def repo_build(f, t):
+def repo_build(f, t, bundle):
     try:
         f_repo_fn = os.path.join(f, 'repo.js')
         repo_js = utils.json_load(f_repo_fn)
@@ -198,7 +232,7 @@ def repo_build(f, t):
         if 'patch.js' in files:
             patch_id = os.path.basename(root)
             repo_js['patches'][patch_id] = patch_build(
-                patch_id, repo_js['servers'], f, t, ignored
+                patch_id, repo_js['servers'], f, t, ignored, bundle
             )
     print('Done.')
     utils.json_store('repo.js', repo_js, dirs=[f, t])
@@ -206,4 +240,4 @@ def repo_build(f, t):
 
 if __name__ == '__main__':
     arg = parser.parse_args()
-    repo_build(arg.f, arg.t)
+    repo_build(arg.f, arg.t, arg.bundle)
@@ -0,0 +1,325 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Asynchronous file I/O.
+  */
+
+#include "thcrap.h"
+
+// Largest single ReadFile() or WriteFile() call. Anything larger is split.
+#define ASYNC_IO_CHUNK_MAX (16 * 1024 * 1024)
+// How long async_io_mod_exit() waits for pending operations.
+#define ASYNC_IO_EXIT_TIMEOUT 5000
+#define ASYNC_IO_KEY_FILE 1
+#define ASYNC_IO_KEY_QUIT 2
+
+struct async_io_t {
+	// Has to come first, since completions only return this pointer.
+	OVERLAPPED ov;
+	HANDLE file;
+	// Whether [file] was opened with FILE_FLAG_OVERLAPPED
+	bool overlapped;
+	bool write;
+	BYTE *buf;
+	size_t size;
+	// Bytes transferred so far
+	size_t done;
+	int error;
+
+	SRWLOCK lock;
+	CONDITION_VARIABLE done_cv;
+	bool finished;
+	async_io_callback_t callback;
+	void *param;
+	task_priority_t priority;
+};
+
+static HANDLE async_io_port = NULL;
+static HANDLE async_io_thread = NULL;
+static bool async_io_started = false;
+static SRWLOCK async_io_start_lock = SRWLOCK_INIT;
+// Operations that have been issued, but not yet completed
+static volatile LONG async_io_pending = 0;
+
+static void async_io_callback_task(void *param)
+{
+	auto *op = (async_io_t *)param;
+	op->callback(op->param, op->error, op->buf, op->size);
+	delete op;
+}
+
+static void async_io_finish(async_io_t *op, int error)
+{
+	if(op->file != INVALID_HANDLE_VALUE) {
+		CloseHandle(op->file);
+		op->file = INVALID_HANDLE_VALUE;
+	}
+	if(error && !op->write) {
+		free(op->buf);
+		op->buf = NULL;
+		op->size = 0;
+	}
+	op->error = error;
+
+	AcquireSRWLockExclusive(&op->lock);
+	op->finished = true;
+	const bool has_callback = op->callback != NULL;
+	if(!has_callback) {
+		WakeAllConditionVariable(&op->done_cv);
+	}
+	ReleaseSRWLockExclusive(&op->lock);
+	if(has_callback) {
+		task_submit(op->priority, NULL, async_io_callback_task, op);
+	}
+}
+
+// Issues the next chunk of [op].
+static void async_io_issue(async_io_t *op)
+{
+	const DWORD len = (DWORD)MIN(op->size - op->done, (size_t)ASYNC_IO_CHUNK_MAX);
+	const uint64_t offset = op->done;
+	op->ov.Offset = (DWORD)offset;
+	op->ov.OffsetHigh = (DWORD)(offset >> 32);
+	const BOOL ok = op->write
+		? WriteFile(op->file, op->buf + op->done, len, NULL, &op->ov)
+		: ReadFile(op->file, op->buf + op->done, len, NULL, &op->ov);
+	// Synchronous completions still queue a completion packet.
+	const DWORD error = ok ? 0 : GetLastError();
+	if(!ok && error != ERROR_IO_PENDING) {
+		InterlockedDecrement(&async_io_pending);
+		async_io_finish(op, error);
+	}
+}
+
+static DWORD WINAPI async_io_completion_proc(void *)
+{
+	for(;;) {
+		DWORD bytes = 0;
+		ULONG_PTR key = 0;
+		OVERLAPPED *ov = NULL;
+		const BOOL ok = GetQueuedCompletionStatus(async_io_port, &bytes, &key, &ov, INFINITE);
+		if(!ov) {
+			if(!ok || key == ASYNC_IO_KEY_QUIT) {
+				break;
+			}
+			continue;
+		}
+		auto *op = (async_io_t *)ov;
+		int error = ok ? 0 : GetLastError();
+		op->done += bytes;
+		if(!error && bytes && op->done < op->size) {
+			async_io_issue(op);
+			continue;
+		}
+		// The file got shorter since we asked for its size.
+		if(!error && op->done < op->size) {
+			error = ERROR_HANDLE_EOF;
+		}
+		InterlockedDecrement(&async_io_pending);
+		async_io_finish(op, error);
+	}
+	return 0;
+}
+
+// Returns whether the completion port is running.
+static bool async_io_start(void)
+{
+	if(async_io_started) {
+		return async_io_thread != NULL;
+	}
+	AcquireSRWLockExclusive(&async_io_start_lock);
+	if(!async_io_started) {
+		async_io_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+		if(async_io_port) {
+			async_io_thread = CreateThread(NULL, 0, async_io_completion_proc, NULL, 0, NULL);
+			if(!async_io_thread) {
+				CloseHandle(async_io_port);
+				async_io_port = NULL;
+			}
+		}
+		if(!async_io_thread) {
+			log_print("(Async I/O) Couldn't create the completion port, falling back on synchronous I/O\n");
+		}
+		async_io_started = true;
+	}
+	ReleaseSRWLockExclusive(&async_io_start_lock);
+	return async_io_thread != NULL;
+}
+
+static async_io_t* async_io_new(bool write)
+{
+	auto *op = new async_io_t();
+	op->file = INVALID_HANDLE_VALUE;
+	op->write = write;
+	InitializeSRWLock(&op->lock);
+	InitializeConditionVariable(&op->done_cv);
+	return op;
+}
+
+// Associates the already opened file of [op] with the port and issues the
+// first chunk, or does all of it synchronously without a port.
+static void async_io_begin(async_io_t *op)
+{
+	if(!op->size) {
+		async_io_finish(op, 0);
+		return;
+	}
+	if(op->overlapped && !CreateIoCompletionPort(op->file, async_io_port, ASYNC_IO_KEY_FILE, 0)) {
+		async_io_finish(op, GetLastError());
+		return;
+	}
+	if(!op->overlapped) {
+		while(op->done < op->size) {
+			const DWORD len = (DWORD)MIN(op->size - op->done, (size_t)ASYNC_IO_CHUNK_MAX);
+			DWORD byte_ret = 0;
+			const BOOL ok = op->write
+				? WriteFile(op->file, op->buf + op->done, len, &byte_ret, NULL)
+				: ReadFile(op->file, op->buf + op->done, len, &byte_ret, NULL);
+			if(!ok || !byte_ret) {
+				async_io_finish(op, ok ? ERROR_HANDLE_EOF : GetLastError());
+				return;
+			}
+			op->done += byte_ret;
+		}
+		async_io_finish(op, 0);
+		return;
+	}
+	InterlockedIncrement(&async_io_pending);
+	async_io_issue(op);
+}
+
+async_io_t* async_io_read(const char *fn)
+{
+	async_io_t *op = async_io_new(false);
+	if(!fn) {
+		async_io_finish(op, ERROR_INVALID_PARAMETER);
+		return op;
+	}
+	op->overlapped = async_io_start();
+	op->file = CreateFile(
+		fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | (op->overlapped ? FILE_FLAG_OVERLAPPED : 0), NULL
+	);
+	if(op->file == INVALID_HANDLE_VALUE) {
+		async_io_finish(op, GetLastError());
+		return op;
+	}
+	LARGE_INTEGER file_size;
+	if(!GetFileSizeEx(op->file, &file_size) || (uint64_t)file_size.QuadPart > SIZE_MAX) {
+		async_io_finish(op, ERROR_FILE_TOO_LARGE);
+		return op;
+	}
+	op->size = (size_t)file_size.QuadPart;
+	if(op->size) {
+		op->buf = (BYTE *)malloc(op->size);
+		if(!op->buf && cache_mgr_reclaim(op->size)) {
+			op->buf = (BYTE *)malloc(op->size);
+		}
+		if(!op->buf) {
+			async_io_finish(op, ERROR_NOT_ENOUGH_MEMORY);
+			return op;
+		}
+	}
+	async_io_begin(op);
+	return op;
+}
+
+async_io_t* async_io_write(const char *fn, const void *buf, size_t size)
+{
+	async_io_t *op = async_io_new(true);
+	op->buf = (BYTE *)buf;
+	op->size = size;
+	if(!fn || !buf || !size) {
+		async_io_finish(op, ERROR_INVALID_PARAMETER);
+		return op;
+	}
+	dir_create_for_fn(fn);
+	op->overlapped = async_io_start();
+	op->file = CreateFile(
+		fn, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | (op->overlapped ? FILE_FLAG_OVERLAPPED : 0), NULL
+	);
+	if(op->file == INVALID_HANDLE_VALUE) {
+		async_io_finish(op, GetLastError());
+		return op;
+	}
+	async_io_begin(op);
+	return op;
+}
+
+void async_io_then(async_io_t *op, task_priority_t priority, async_io_callback_t callback, void *param)
+{
+	if(!op) {
+		return;
+	}
+	if(!callback) {
+		async_io_wait(op, NULL, NULL);
+		return;
+	}
+	AcquireSRWLockExclusive(&op->lock);
+	op->priority = priority;
+	op->param = param;
+	op->callback = callback;
+	const bool finished = op->finished;
+	ReleaseSRWLockExclusive(&op->lock);
+	if(finished) {
+		task_submit(priority, NULL, async_io_callback_task, op);
+	}
+}
+
+int async_io_wait(async_io_t *op, void **buf, size_t *size)
+{
+	if(buf) {
+		*buf = NULL;
+	}
+	if(size) {
+		*size = 0;
+	}
+	if(!op) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	AcquireSRWLockExclusive(&op->lock);
+	while(!op->finished) {
+		SleepConditionVariableSRW(&op->done_cv, &op->lock, INFINITE, 0);
+	}
+	ReleaseSRWLockExclusive(&op->lock);
+
+	const int ret = op->error;
+	if(!op->write) {
+		if(buf) {
+			if(size && op->buf) {
+				*size = op->size;
+			}
+			*buf = op->buf;
+			op->buf = NULL;
+		}
+		free(op->buf);
+	}
+	delete op;
+	return ret;
+}
+
+void async_io_mod_exit(void)
+{
+	AcquireSRWLockExclusive(&async_io_start_lock);
+	// No new port after this point.
+	async_io_started = true;
+	ReleaseSRWLockExclusive(&async_io_start_lock);
+	if(!async_io_thread) {
+		return;
+	}
+	// Unfinished writes would leave truncated files behind.
+	const DWORD start = GetTickCount();
+	while(async_io_pending > 0 && GetTickCount() - start < ASYNC_IO_EXIT_TIMEOUT) {
+		Sleep(1);
+	}
+	PostQueuedCompletionStatus(async_io_port, 0, ASYNC_IO_KEY_QUIT, NULL);
+	WaitForSingleObject(async_io_thread, ASYNC_IO_EXIT_TIMEOUT);
+	CloseHandle(async_io_thread);
+	CloseHandle(async_io_port);
+	async_io_thread = NULL;
+	async_io_port = NULL;
+}
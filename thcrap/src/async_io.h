@@ -0,0 +1,45 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Asynchronous file I/O.
+  *
+  * Whole-file reads and writes are issued as overlapped I/O on a single
+  * completion port, so that the calling thread only pays for opening the
+  * file. One thread collects the completions and either wakes up whoever
+  * waits for the operation, or hands its result to a callback on the task
+  * scheduler. If the port can't be created, operations run synchronously on
+  * the calling thread instead, with the same results.
+  */
+
+#pragma once
+
+typedef struct async_io_t async_io_t;
+
+// Receives the result of an operation. [error] is 0 or a Win32 error code.
+// For reads, [buf] is the file's contents (NULL for empty files or on
+// error), has to be free()d by the callback, and [size] is its size. For
+// writes, [buf] and [size] are the ones that were passed to
+// async_io_write(), which can now be released.
+typedef void (*async_io_callback_t)(void *param, int error, void *buf, size_t size);
+
+// Starts reading all of [fn] into a new buffer.
+async_io_t* async_io_read(const char *fn);
+
+// Starts writing [size] bytes of [buf] to [fn], replacing the file and
+// creating its directory if necessary. [buf] has to stay valid until the
+// operation has completed.
+async_io_t* async_io_write(const char *fn, const void *buf, size_t size);
+
+// Has [callback] called with [param] on the task scheduler once [op] has
+// completed, or right away if it already has. Releases [op].
+void async_io_then(async_io_t *op, task_priority_t priority, async_io_callback_t callback, void *param);
+
+// Waits until [op] has completed, releases it, and returns its error code.
+// For reads, [buf] and [size] receive the buffer and its size, with the
+// same semantics as file_stream_read().
+int async_io_wait(async_io_t *op, void **buf, size_t *size);
+
+void async_io_mod_exit(void);
@@ -10,6 +10,9 @@
 #include "thcrap.h"
 #include <math.h>
 #include <locale.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 /*
  * Grumble, grumble, C is garbage and will only do string→float conversion
@@ -65,7 +68,7 @@ hackpoint_addr_t* hackpoint_addrs_from_json(json_t* addr_array)
 
 	json_t *it;
 	json_flex_array_foreach_scoped(size_t, i, addr_array, it) {
-		if (json_is_integer(it) || json_is_string(it)) {
+		if (json_is_integer(it) || json_is_string(it) || json_is_object(it)) {
 			++addr_count;
 		}
 	}
@@ -89,6 +92,18 @@ hackpoint_addr_t* hackpoint_addrs_from_json(json_t* addr_array)
 			ret[addr_count].type = RAW_ADDR;
 			++addr_count;
 		}
+		else if (json_is_object(it)) {
+			const char* pattern_str = json_object_get_string(it, "pattern");
+			json_t* offset = json_object_get(it, "offset");
+			ret[addr_count].pattern = sigscan_pattern_parse(
+				pattern_str, json_is_integer(offset) ? (ptrdiff_t)json_integer_value(offset) : 0
+			);
+			ret[addr_count].type = ret[addr_count].pattern ? PATTERN_ADDR : INVALID_ADDR;
+			if (!ret[addr_count].pattern) {
+				ret[addr_count].raw = 0;
+			}
+			++addr_count;
+		}
 	}
 
 	return ret;
@@ -99,6 +114,12 @@ inline bool eval_hackpoint_addr(hackpoint_addr_t* hackpoint_addr, size_t* out, H
 
 	if (hackpoint_addr) {
 		size_t addr = 0;
+		if (hackpoint_addr->type == PATTERN_ADDR) {
+			sigscan_pattern_t* pattern = hackpoint_addr->pattern;
+			hackpoint_addr->type = RAW_ADDR;
+			hackpoint_addr->raw = sigscan_find(hMod, pattern);
+			sigscan_pattern_free(pattern);
+		}
 		switch (int8_t addr_type = hackpoint_addr->type) {
 			case STR_ADDR:
 				eval_expr(hackpoint_addr->str, '\0', &addr, NULL, (size_t)hMod);
@@ -577,6 +598,166 @@ static size_t binhacks_total_count(const binhack_t *binhacks, size_t binhacks_co
 	return ret;
 }
 
+/// Parallel rendering
+/// ------------------
+// Rendering only reads the function and option tables, and every binhack
+// only ever writes to its own address array and output buffers. All of
+// them can therefore be rendered on the task workers, and only the actual
+// patching is done serially afterwards.
+
+// Don't bother handing out fewer binhacks than this to a worker.
+#define BINHACK_RENDER_MIN_PER_WORKER 16
+
+struct binhack_rendered_addr_t {
+	size_t addr;
+	size_t asm_offset;
+	bool code_invalid;
+	bool expected_invalid;
+	bool verify;
+	bool cache_hit;
+	// Set if this rendering should be added to the cache
+	bool cacheable;
+	std::string cache_key;
+	std::string deps;
+};
+
+struct binhack_rendered_t {
+	size_t asm_size;
+	// Size of a mismatched expected string, 0 if they match
+	size_t exp_size_mismatch;
+	// Unmodified binhack_calc_size() of the expected string
+	size_t exp_size_raw;
+	std::vector<binhack_rendered_addr_t> addrs;
+	std::vector<BYTE> buf;
+};
+
+static void binhack_render_one(const binhack_t *cur, binhack_rendered_t *out, HMODULE hMod)
+{
+	// Sizes are only calculated once the first address misses the cache.
+	bool sizes_calculated = false;
+	bool sizes_cacheable = false;
+	std::string size_deps;
+	size_t asm_size = 0;
+	size_t exp_size = 0;
+	auto calc_sizes = [&]() {
+		if (sizes_calculated) {
+			return;
+		}
+		sizes_calculated = true;
+		expr_deps_begin(&size_deps);
+		// calculated byte size of the hack
+		asm_size = out->asm_size = binhack_calc_size(cur->code);
+		exp_size = out->exp_size_raw = asm_size ? binhack_calc_size(cur->expected) : 0;
+		sizes_cacheable = expr_deps_end();
+		out->exp_size_mismatch = 0;
+		if (exp_size > 0 && exp_size != asm_size) {
+			out->exp_size_mismatch = exp_size;
+			exp_size = 0;
+		}
+	};
+
+	size_t addr;
+	for (hackpoint_addr_t* cur_addr = cur->addr;
+		 eval_hackpoint_addr(cur_addr, &addr, hMod);
+		 ++cur_addr) {
+
+		if (!addr) {
+			// NULL_ADDR
+			continue;
+		}
+
+		binhack_rendered_addr_t r = {};
+		r.addr = addr;
+		r.asm_offset = out->buf.size();
+		r.cache_key = binhack_cache_key('b', cur->name, cur->code, cur->expected, addr);
+
+		if (const binhack_cache_entry_t *cached = binhack_cache_get(r.cache_key)) {
+			if (!sizes_calculated) {
+				out->asm_size = cached->code.size();
+				out->exp_size_raw = cached->expected_size;
+				out->exp_size_mismatch = (cached->expected_size && cached->expected_size != cached->code.size())
+					? cached->expected_size : 0;
+			}
+			if (cached->code.size() == out->asm_size) {
+				out->buf.insert(out->buf.end(), cached->code.begin(), cached->code.end());
+				out->buf.insert(out->buf.end(), cached->expected.begin(), cached->expected.end());
+				r.verify = !cached->expected.empty();
+				r.cache_hit = true;
+				out->addrs.push_back(r);
+				continue;
+			}
+		}
+
+		calc_sizes();
+		if (!asm_size) {
+			return;
+		}
+		out->buf.resize(r.asm_offset + asm_size + exp_size);
+		expr_deps_begin(&r.deps);
+		if (binhack_render(&out->buf[r.asm_offset], addr, cur->code)) {
+			r.code_invalid = true;
+			out->buf.resize(r.asm_offset);
+		} else if (exp_size > 0 && binhack_render(&out->buf[r.asm_offset + asm_size], addr, cur->expected)) {
+			r.expected_invalid = true;
+			exp_size = 0;
+			out->buf.resize(r.asm_offset + asm_size);
+		}
+		r.cacheable = expr_deps_end() && sizes_cacheable && !r.code_invalid && !r.expected_invalid;
+		r.deps.insert(0, size_deps);
+		r.verify = !r.code_invalid && exp_size > 0;
+		out->addrs.push_back(r);
+	}
+}
+
+static void binhacks_render(const binhack_t *binhacks, binhack_rendered_t *out, size_t count, HMODULE hMod)
+{
+	// The injection thread helps out, and takes care of everything by
+	// itself for small binhack sets.
+	const size_t max_threads = count / BINHACK_RENDER_MIN_PER_WORKER;
+	parallel_for(count, max_threads ? max_threads : 1, [binhacks, out, hMod](size_t i) {
+		binhack_render_one(&binhacks[i], &out[i], hMod);
+	});
+}
+/// ------------------
+
+/// Reverting
+/// ---------
+// Every hackpoint written by binhacks_apply(), together with the bytes it
+// overwrote, so that binhacks_revert() can undo it on repatching.
+struct binhack_written_t {
+	size_t addr;
+	std::vector<BYTE> orig;
+	std::vector<BYTE> code;
+};
+
+static std::unordered_map<std::string, std::vector<binhack_written_t>> binhacks_written;
+static SRWLOCK binhacks_written_srwlock = SRWLOCK_INIT;
+
+size_t binhacks_revert(const char *name)
+{
+	std::vector<binhack_written_t> written;
+	AcquireSRWLockExclusive(&binhacks_written_srwlock);
+	auto it = binhacks_written.find(name);
+	if (it != binhacks_written.end()) {
+		written = std::move(it->second);
+		binhacks_written.erase(it);
+	}
+	ReleaseSRWLockExclusive(&binhacks_written_srwlock);
+
+	std::vector<patch_region_t> regions;
+	for (const auto& w : written) {
+		regions.push_back({ (void*)w.addr, w.code.data(), w.orig.data(), w.orig.size(), 0 });
+	}
+	const size_t ret = PatchRegions(regions.data(), regions.size());
+	for (const auto& region : regions) {
+		if (!region.applied) {
+			log_printf("%s at 0x%p: bytes were changed since the binary hack was applied, not reverting...\n", name, region.ptr);
+		}
+	}
+	return ret;
+}
+/// ---------
+
 int binhacks_apply(const binhack_t *binhacks, size_t binhacks_count, HMODULE hMod)
 {
 	if (!binhacks_count) {
@@ -593,73 +774,96 @@ int binhacks_apply(const binhack_t *binhacks, size_t binhacks_count, HMODULE hMo
 		"------------------------"
 	);
 
-	size_t current_asm_buf_size = BINHACK_BUFSIZE_MIN;
-	BYTE* asm_buf = (BYTE*)malloc(BINHACK_BUFSIZE_MIN);
-	size_t current_exp_buf_size = BINHACK_BUFSIZE_MIN;
-	BYTE* exp_buf = (BYTE*)malloc(BINHACK_BUFSIZE_MIN);
+	binhack_cache_load();
+	std::vector<binhack_rendered_t> rendered(binhacks_count);
+	binhacks_render(binhacks, rendered.data(), binhacks_count, hMod);
+
+	// Everything is written in a single PatchRegions() session, which
+	// saves a VirtualProtect() round trip for every single hackpoint.
+	struct region_source_t {
+		size_t binhack;
+		size_t addr;
+	};
+	std::vector<patch_region_t> regions;
+	std::vector<region_source_t> sources;
 
 	for(size_t i = 0; i < binhacks_count; i++) {
 		const binhack_t *const cur = &binhacks[i];
+		const binhack_rendered_t& r = rendered[i];
 
 		if (cur->title) {
 			log_printf("\n(%2d/%2d) %s (%s)... ", i + 1, binhacks_total, cur->title, cur->name);
 		} else {
 			log_printf("\n(%2d/%2d) %s... ", i + 1, binhacks_total, cur->name);
 		}
-		
-		// calculated byte size of the hack
-		const size_t asm_size = binhack_calc_size(cur->code);
-		if(!asm_size) {
+		if(!r.asm_size) {
 			log_printf("invalid code string size, skipping...\n");
 			continue;
 		}
-		if (asm_size > current_asm_buf_size) {
-			asm_buf = (BYTE*)realloc(asm_buf, asm_size);
-			current_asm_buf_size = asm_size;
-		}
-
-		size_t exp_size = binhack_calc_size(cur->expected);
-		if (exp_size > 0 && exp_size != asm_size) {
-			log_printf("different sizes for expected and new code (%z != %z), skipping verification... ", exp_size, asm_size);
-			exp_size = 0;
-		} else {
-			if (exp_size > current_exp_buf_size) {
-				exp_buf = (BYTE*)realloc(exp_buf, exp_size);
-				current_exp_buf_size = exp_size;
-			}
+		if (r.exp_size_mismatch) {
+			log_printf("different sizes for expected and new code (%z != %z), skipping verification... ", r.exp_size_mismatch, r.asm_size);
 		}
-		
-		size_t addr;
-		for (hackpoint_addr_t* cur_addr = cur->addr;
-			 eval_hackpoint_addr(cur_addr, &addr, hMod);
-			 ++cur_addr) {
-
-			if (!addr) {
-				// NULL_ADDR
-				continue;
+		for (const auto& a : r.addrs) {
+			log_printf("\nat 0x%p... ", a.addr);
+			if (a.cache_hit) {
+				binhack_cache_use(a.cache_key);
+			} else if (a.cacheable) {
+				binhack_cache_entry_t entry = {};
+				entry.deps = a.deps;
+				entry.code.assign(&r.buf[a.asm_offset], &r.buf[a.asm_offset] + r.asm_size);
+				if (a.verify) {
+					entry.expected.assign(&r.buf[a.asm_offset + r.asm_size], &r.buf[a.asm_offset + r.asm_size] + r.asm_size);
+				}
+				entry.expected_size = (uint32_t)r.exp_size_raw;
+				binhack_cache_put(a.cache_key, std::move(entry));
 			}
-
-			log_printf("\nat 0x%p... ", addr);
-
-			if(binhack_render(asm_buf, addr, cur->code)) {
+			if (a.code_invalid) {
 				log_printf("invalid code string, skipping...");
 				continue;
 			}
-			if (exp_size > 0 && binhack_render(exp_buf, addr, cur->expected)) {
+			if (a.expected_invalid) {
 				log_printf("invalid expected string, skipping verification... ");
-				exp_size = 0;
-			}
-			if(PatchRegion((void*)addr, exp_size ? exp_buf : NULL, asm_buf, asm_size)) {
-				log_printf("OK");
-				failed--;
-			} else {
-				log_printf("expected bytes not matched, skipping... ");
 			}
+			regions.push_back({
+				(void*)a.addr,
+				a.verify ? &r.buf[a.asm_offset + r.asm_size] : NULL,
+				&r.buf[a.asm_offset],
+				r.asm_size,
+				0
+			});
+			sources.push_back({ i, a.addr });
 		}
 	}
-	free(asm_buf);
-	free(exp_buf);
 	log_printf("\n");
+
+	std::vector<std::vector<BYTE>> originals(regions.size());
+	for (size_t i = 0; i < regions.size(); i++) {
+		const BYTE *ptr = (const BYTE*)regions[i].ptr;
+		if (VirtualCheckRegion(ptr, regions[i].len)) {
+			originals[i].assign(ptr, ptr + regions[i].len);
+		}
+	}
+
+	failed -= PatchRegions(regions.data(), regions.size());
+	binhack_cache_store();
+	sigscan_cache_store();
+
+	AcquireSRWLockExclusive(&binhacks_written_srwlock);
+	for (size_t i = 0; i < regions.size(); i++) {
+		if (!regions[i].applied) {
+			log_printf(
+				"%s at 0x%p: expected bytes not matched, skipping...\n",
+				binhacks[sources[i].binhack].name, sources[i].addr
+			);
+			continue;
+		}
+		const BYTE *code = (const BYTE*)regions[i].New;
+		binhacks_written[binhacks[sources[i].binhack].name].push_back({
+			sources[i].addr, std::move(originals[i]), { code, code + regions[i].len }
+		});
+	}
+	ReleaseSRWLockExclusive(&binhacks_written_srwlock);
+	log_printf("%d/%d binary hacks applied.\n", binhacks_total - failed, binhacks_total);
 	return failed;
 }
 
@@ -818,48 +1022,15 @@ int codecaves_apply(const codecave_t *codecaves, size_t codecaves_count) {
 		"------------------------\n"
 	);
 
-	const size_t codecave_sep_size_min = 1;
-
-	//One size for each valid access flag combo
-	size_t codecaves_alloc_size[5] = { 0, 0, 0, 0, 0 };
-
 	size_t codecave_export_count = 0;
-
-	VLA(size_t, codecaves_full_size, codecaves_count * sizeof(size_t));
-
-	// First pass: calc the complete codecave size
 	for (size_t i = 0; i < codecaves_count; ++i) {
 		if (codecaves[i].export_codecave) {
 			++codecave_export_count;
 		}
-		const size_t size = codecaves[i].size + codecave_sep_size_min;
-		codecaves_full_size[i] = AlignUpToMultipleOf2(size, 16);
-		codecaves_alloc_size[codecaves[i].access_type] += codecaves_full_size[i];
-	}
-
-	BYTE* codecave_buf[5] = { NULL, NULL, NULL, NULL, NULL };
-	for (int i = 0; i < 5; ++i) {
-		if (codecaves_alloc_size[i] > 0) {
-			codecave_buf[i] = (BYTE*)VirtualAlloc(NULL, codecaves_alloc_size[i], MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-			if (codecave_buf[i]) {
-				/*
-				*  TODO: Profile whether it's faster to memset the whole block
-				*  here or just the extra padding required after each codecave.
-				*  Apply the same thing to breakpoint sourcecaves.
-				*/
-				//memset(codecave_buf[i], 0xCC, codecaves_total_size[i]);
-			}
-			else {
-				//Should probably put an abort error here
-			}
-		}
 	}
 
-	// Second pass: Gather the addresses, so that codecaves can refer to each other.
-	BYTE* current_cave[5];
-	for (int i = 0; i < 5; ++i) {
-		current_cave[i] = codecave_buf[i];
-	}
+	// First pass: Gather the addresses, so that codecaves can refer to each other.
+	VLA(BYTE*, codecave_addrs, codecaves_count);
 
 	exported_func_t* codecaves_export_table;
 	if (codecave_export_count > 0) {
@@ -870,55 +1041,55 @@ int codecaves_apply(const codecave_t *codecaves, size_t codecaves_count) {
 	size_t export_index = 0;
 	
 	for (size_t i = 0; i < codecaves_count; i++) {
-		const CodecaveAccessType access = codecaves[i].access_type;
+		BYTE *const cave = codecave_addrs[i] = cave_arena_alloc(codecaves[i].size, codecaves[i].access_type, NULL);
+		cave_arena_name(cave, codecaves[i].size, codecaves[i].name);
 
-		log_printf("Recording codecave: \"%s\" at %p\n", codecaves[i].name, (size_t)current_cave[access]);
-		func_add(codecaves[i].name, (size_t)current_cave[access]);
+		log_printf("Recording codecave: \"%s\" at %p\n", codecaves[i].name, (size_t)cave);
+		func_add(codecaves[i].name, (size_t)cave);
 
 		if (codecaves[i].export_codecave) {
 			codecaves_export_table[export_index].name = codecaves[i].name;
-			codecaves_export_table[export_index].func = (UINT_PTR)current_cave[access];
+			codecaves_export_table[export_index].func = (UINT_PTR)cave;
 			++export_index;
 		}
-
-		current_cave[access] += codecaves_full_size[i];
-	}
-
-	// Third pass: Write all of the code
-	for (int i = 0; i < 5; ++i) {
-		current_cave[i] = codecave_buf[i];
 	}
 
+	// Second pass: Write all of the code
+	binhack_cache_load();
 	for (size_t i = 0; i < codecaves_count; i++) {
+		BYTE *const cave = codecave_addrs[i];
 		const char* code = codecaves[i].code;
-		const CodecaveAccessType access = codecaves[i].access_type;
-		if (codecaves[i].fill) {
-			// VirtualAlloc zeroes memory, so don't bother when fill is 0
-			memset(current_cave[access], codecaves[i].fill, codecaves[i].size);
+		if (!cave) {
+			continue;
 		}
-		if (code) {
-			binhack_render(current_cave[access], (size_t)current_cave[access], code);
+		// The arena is filled with INT3, so this is needed even for 0.
+		memset(cave, codecaves[i].fill, codecaves[i].size);
+		if (!code) {
+			continue;
 		}
-
-		current_cave[access] += codecaves[i].size;
-		for (size_t j = codecaves[i].size; j < codecaves_full_size[i]; ++j) {
-			*(current_cave[access]++) = 0xCC;
+		const std::string key = binhack_cache_key('c', codecaves[i].name, code, NULL, (size_t)cave);
+		const binhack_cache_entry_t *cached = binhack_cache_get(key);
+		if (cached && cached->code.size() <= codecaves[i].size) {
+			memcpy(cave, cached->code.data(), cached->code.size());
+			binhack_cache_use(key);
+			continue;
+		}
+		binhack_cache_entry_t entry = {};
+		expr_deps_begin(&entry.deps);
+		const size_t code_size = binhack_calc_size(code);
+		const bool rendered = !binhack_render(cave, (size_t)cave, code);
+		if (expr_deps_end() && rendered && code_size <= codecaves[i].size) {
+			entry.code.assign(cave, cave + code_size);
+			binhack_cache_put(key, std::move(entry));
 		}
 	}
+	binhack_cache_store();
 
 	if (codecave_export_count > 0) {
 		patch_func_init(codecaves_export_table, codecave_export_count);
 		free((void*)codecaves_export_table);
 	}
-	VLA_FREE(codecaves_full_size);
-
-	const DWORD page_access_type_array[5] = { PAGE_READONLY, PAGE_READWRITE, PAGE_EXECUTE, PAGE_EXECUTE_READ, PAGE_EXECUTE_READWRITE };
-	DWORD idgaf;
-
-	for (int i = 0; i < 5; ++i) {
-		if (codecave_buf[i]) {
-			VirtualProtect(codecave_buf[i], codecaves_alloc_size[i], page_access_type_array[i], &idgaf);
-		}
-	}
+	VLA_FREE(codecave_addrs);
+	cave_arena_seal();
 	return 0;
 }
@@ -25,6 +25,10 @@
   * • Anything else not matching these types is ignored.
   *
   * They can also be disabled by setting "ignore" to true.
+  *
+  * Addresses can be given as integers, expression strings, or objects of the
+  * form { "pattern": "<byte signature>", "offset": <integer> }, which are
+  * resolved by searching the game's code (see sigscan.h).
   */
 
 #pragma once
@@ -36,13 +40,16 @@ typedef enum {
 	INVALID_ADDR = -1,
 	END_ADDR = 0,
 	STR_ADDR = 1,
-	RAW_ADDR = 2
+	RAW_ADDR = 2,
+	PATTERN_ADDR = 3
 } hackpoint_addr_type;
 
 typedef struct {
 	union {
 		char* str;
 		size_t raw;
+		// See sigscan.h
+		sigscan_pattern_t* pattern;
 	};
 	int8_t type;
 } hackpoint_addr_t;
@@ -112,6 +119,11 @@ int binhack_render(BYTE *binhack_buf, size_t target_addr, const char *binhack_st
 // Returns the number of binary hacks that could not be applied.
 int binhacks_apply(const binhack_t *binhacks, size_t binhacks_count, HMODULE hMod);
 
+// Restores the original bytes at every address that binhacks_apply() wrote
+// the binary hack [name] to, unless something else has overwritten them
+// since. Returns the number of addresses that were restored.
+size_t binhacks_revert(const char *name);
+
 
 // Adds every codecave in [codecaves] on the current process.
 // The codecaves can then be called from binhacks similar to plugin functions. For example:
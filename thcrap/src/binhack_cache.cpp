@@ -0,0 +1,196 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Persistent cache of rendered binary hacks and codecaves.
+  */
+
+#include "thcrap.h"
+#include <unordered_map>
+
+/// File format
+/// -----------
+// After the header, the file contains [count] entries of
+//
+//	str key; str deps; str code; str expected; uint32_t expected_size
+//
+// with every str being a uint32_t length followed by that many bytes.
+#define BINHACK_CACHE_MAGIC "THBC"
+#define BINHACK_CACHE_VERSION 1
+#define BINHACK_CACHE_DISK_NS "binhacks"
+
+struct binhack_cache_header_t {
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+};
+/// -----------
+
+static std::unordered_map<std::string, binhack_cache_entry_t> binhack_cache;
+static bool binhack_cache_loaded = false;
+static bool binhack_cache_dirty = false;
+
+// One disk cache entry per game build.
+static std::string binhack_cache_disk_key(void)
+{
+	const char *game = runconfig_game_get();
+	const char *build = runconfig_build_get();
+	if(!game || !build) {
+		return "";
+	}
+	return std::string(game) + '.' + build;
+}
+
+struct binhack_cache_reader_t {
+	const BYTE *p;
+	const BYTE *end;
+
+	bool read(void *dst, size_t len) {
+		if((size_t)(end - p) < len) {
+			return false;
+		}
+		memcpy(dst, p, len);
+		p += len;
+		return true;
+	}
+
+	template <typename T>
+	bool read_str(T& out) {
+		uint32_t len;
+		if(!read(&len, sizeof(len)) || (size_t)(end - p) < len) {
+			return false;
+		}
+		out.assign(p, p + len);
+		p += len;
+		return true;
+	}
+};
+
+void binhack_cache_load(void)
+{
+	if(binhack_cache_loaded) {
+		return;
+	}
+	binhack_cache_loaded = true;
+
+	std::string disk_key = binhack_cache_disk_key();
+	size_t size;
+	BYTE *file = disk_key.empty() ? NULL : (BYTE*)disk_cache_get(BINHACK_CACHE_DISK_NS, disk_key.c_str(), &size);
+	if(!file) {
+		return;
+	}
+	binhack_cache_reader_t reader = { file, file + size };
+	binhack_cache_header_t header;
+	if(
+		reader.read(&header, sizeof(header))
+		&& !memcmp(header.magic, BINHACK_CACHE_MAGIC, sizeof(header.magic))
+		&& header.version == BINHACK_CACHE_VERSION
+	) {
+		for(uint32_t i = 0; i < header.count; i++) {
+			std::string key;
+			binhack_cache_entry_t entry = {};
+			if(!(
+				reader.read_str(key)
+				&& reader.read_str(entry.deps)
+				&& reader.read_str(entry.code)
+				&& reader.read_str(entry.expected)
+				&& reader.read(&entry.expected_size, sizeof(entry.expected_size))
+			)) {
+				// Damaged, so don't trust any of it.
+				binhack_cache.clear();
+				break;
+			}
+			binhack_cache[std::move(key)] = std::move(entry);
+		}
+	}
+	free(file);
+	log_debugf("(Binhack cache) %u entries loaded for %s\n", (unsigned)binhack_cache.size(), disk_key.c_str());
+}
+
+std::string binhack_cache_key(char kind, const char *name, const char *code, const char *expected, size_t addr)
+{
+	std::string ret(1, kind);
+	ret += name ? name : "";
+	ret += '\0';
+	ret += code ? code : "";
+	ret += '\0';
+	ret += expected ? expected : "";
+	ret += '\0';
+	ret.append((const char*)&addr, sizeof(addr));
+	return ret;
+}
+
+const binhack_cache_entry_t* binhack_cache_get(const std::string& key)
+{
+	auto it = binhack_cache.find(key);
+	if(it == binhack_cache.end() || !expr_deps_valid(it->second.deps)) {
+		return NULL;
+	}
+	return &it->second;
+}
+
+void binhack_cache_use(const std::string& key)
+{
+	auto it = binhack_cache.find(key);
+	if(it != binhack_cache.end() && !it->second.used) {
+		it->second.used = true;
+		binhack_cache_dirty = true;
+	}
+}
+
+void binhack_cache_put(const std::string& key, binhack_cache_entry_t&& entry)
+{
+	entry.used = true;
+	binhack_cache[key] = std::move(entry);
+	binhack_cache_dirty = true;
+}
+
+static void binhack_cache_write(std::vector<BYTE>& buffer, const void *src, size_t len)
+{
+	buffer.insert(buffer.end(), (const BYTE*)src, (const BYTE*)src + len);
+}
+
+template <typename T>
+static void binhack_cache_write_str(std::vector<BYTE>& buffer, const T& str)
+{
+	uint32_t len = (uint32_t)str.size();
+	binhack_cache_write(buffer, &len, sizeof(len));
+	binhack_cache_write(buffer, str.data(), len);
+}
+
+void binhack_cache_store(void)
+{
+	if(!binhack_cache_dirty) {
+		return;
+	}
+	binhack_cache_dirty = false;
+	std::string disk_key = binhack_cache_disk_key();
+	if(disk_key.empty()) {
+		return;
+	}
+
+	binhack_cache_header_t header;
+	memcpy(header.magic, BINHACK_CACHE_MAGIC, sizeof(header.magic));
+	header.version = BINHACK_CACHE_VERSION;
+	header.count = 0;
+
+	// Entries that weren't used during this run belong to older patch
+	// stacks, and are dropped.
+	std::vector<BYTE> buffer(sizeof(header));
+	for(const auto& it : binhack_cache) {
+		const binhack_cache_entry_t& entry = it.second;
+		if(!entry.used) {
+			continue;
+		}
+		binhack_cache_write_str(buffer, it.first);
+		binhack_cache_write_str(buffer, entry.deps);
+		binhack_cache_write_str(buffer, entry.code);
+		binhack_cache_write_str(buffer, entry.expected);
+		binhack_cache_write(buffer, &entry.expected_size, sizeof(entry.expected_size));
+		header.count++;
+	}
+	memcpy(buffer.data(), &header, sizeof(header));
+	disk_cache_put(BINHACK_CACHE_DISK_NS, disk_key.c_str(), buffer.data(), buffer.size(), 0);
+}
@@ -0,0 +1,53 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Persistent cache of rendered binary hacks and codecaves.
+  * For a fixed game build, rendering a given code string at a given address
+  * always produces the same bytes, as long as the options, CPU features and
+  * function addresses it refers to stay the same. The rendered bytes are
+  * stored together with these dependencies, so that the next launch can
+  * validate them and skip parsing entirely.
+  */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct binhack_cache_entry_t {
+	// As recorded by expr_deps_begin()
+	std::string deps;
+	std::vector<BYTE> code;
+	// Empty if the expected bytes aren't verified
+	std::vector<BYTE> expected;
+	// binhack_calc_size() of the expected string, even if it didn't match
+	uint32_t expected_size;
+	bool used;
+};
+
+// Loads the cache for the current game build, unless it already has been.
+// Must be called before binhack_cache_get(), on the thread that applies
+// the hacks.
+void binhack_cache_load(void);
+
+// Returns the lookup key for rendering [code] and [expected] of the hack
+// or codecave [name] at [addr]. [kind] separates binhacks from codecaves.
+std::string binhack_cache_key(char kind, const char *name, const char *code, const char *expected, size_t addr);
+
+// Returns the cached rendering for [key], or NULL if there is none or any of
+// its dependencies have changed. Can be called from multiple threads at
+// once, as long as nobody calls any of the functions below at the same time.
+const binhack_cache_entry_t* binhack_cache_get(const std::string& key);
+
+// Keeps the entry for [key] in the cache file.
+void binhack_cache_use(const std::string& key);
+
+// Adds or replaces the entry for [key].
+void binhack_cache_put(const std::string& key, binhack_cache_entry_t&& entry);
+
+// Writes every entry that was used or added during this run back to disk,
+// if anything changed since the last call.
+void binhack_cache_store(void);
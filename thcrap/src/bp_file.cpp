@@ -8,11 +8,230 @@
   */
 
 #include "thcrap.h"
-#include <map>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <algorithm>
+#include <atomic>
 
 #define POST_JSON_SIZE(fr) (fr)->pre_json_size + (fr)->patch_size
 
+// Replacement files smaller than this are still read into a heap buffer,
+// since every view takes up at least 64 KiB of address space.
+#define FILE_REP_MAP_THRESHOLD (64 * 1024)
+
+// Amount of the original file read at once when patching it while reading.
+#define FRAGMENTED_STREAM_WINDOW (64 * 1024)
+
+// State of a fragmented file that is patched while being read.
+struct fragmented_stream_t {
+	patch_stream_t hook;
+	func_patch_stream_t func;
+
+	// Original file data that was read, but not consumed by [func] yet.
+	std::vector<BYTE> in;
+	// Bytes of the original file read so far.
+	size_t in_read;
+
+	// Patched data that wasn't read by the game yet, starting at
+	// [out_pos] into the patched file.
+	std::vector<BYTE> out;
+	size_t out_pos;
+
+	bool done;
+};
+
+static void fragmented_stream_write(patch_stream_t *hook, const void *data, size_t size)
+{
+	auto *out = (std::vector<BYTE> *)hook->write_param;
+	out->insert(out->end(), (const BYTE *)data, (const BYTE *)data + size);
+}
+
+static fragmented_stream_t *fragmented_stream_new(const file_rep_t *fr, func_patch_stream_t func)
+{
+	auto *stream = new fragmented_stream_t {};
+	stream->func = func;
+	stream->hook.fn = fr->name;
+	stream->hook.patch = fr->patch;
+	stream->hook.write = fragmented_stream_write;
+	stream->hook.write_param = &stream->out;
+	return stream;
+}
+
+/// Replacement buffer budget
+/// -------------------------
+/**
+  * Replacement buffers live until their file is closed, and games that keep
+  * many files open at once can run a 32-bit heap out of memory that way.
+  * Once the heap buffers of all open files exceed the budget from the run
+  * configuration, unmodified replacement files are mapped regardless of
+  * their size, and buffers that have to be written to become views of
+  * temporary files, whose pages the OS can write back to disk rather than
+  * keeping them committed.
+  */
+static std::atomic<size_t> rep_heap_size(0);
+
+// Returns true if another [size] bytes of heap buffers would exceed the
+// budget.
+static bool file_rep_over_budget(size_t size)
+{
+	const size_t budget = (size_t)runconfig_file_rep_budget_get() * 1024 * 1024;
+	return budget && rep_heap_size.load(std::memory_order_relaxed) + size > budget;
+}
+
+// Creates a temporary file of [size] bytes, which is deleted once the handle
+// returned in [spill] is closed, and returns a writable view of it.
+static void* file_rep_spill_create(size_t size, HANDLE *spill)
+{
+	wchar_t temp_dir[MAX_PATH];
+	wchar_t temp_fn[MAX_PATH];
+	if (
+		!size
+		|| !GetTempPathW(MAX_PATH, temp_dir)
+		|| !GetTempFileNameW(temp_dir, L"thc", 0, temp_fn)
+	) {
+		return nullptr;
+	}
+	HANDLE hFile = CreateFileW(
+		temp_fn, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr
+	);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		DeleteFileW(temp_fn);
+		return nullptr;
+	}
+	const uint64_t size64 = size;
+	HANDLE hMap = CreateFileMappingW(
+		hFile, nullptr, PAGE_READWRITE, (DWORD)(size64 >> 32), (DWORD)size64, nullptr
+	);
+	void *view = hMap ? MapViewOfFile(hMap, FILE_MAP_WRITE, 0, 0, size) : nullptr;
+	if (hMap) {
+		CloseHandle(hMap);
+	}
+	if (!view) {
+		CloseHandle(hFile);
+		return nullptr;
+	}
+	*spill = hFile;
+	return view;
+}
+
+// Adds [fr->rep_buffer] to or removes it from the memory statistics.
+// Views count with their full size, since they take up address space all
+// the same, but only heap buffers count toward the budget.
+static void file_rep_buffer_account(file_rep_t *fr, bool add)
+{
+	if (!fr->rep_buffer) {
+		return;
+	}
+	(add ? memstats_add : memstats_remove)(MEMSTATS_FILE_REP, fr->rep_size);
+	if (!fr->rep_mapped && !fr->rep_spill) {
+		if (add) {
+			rep_heap_size += fr->rep_size;
+		} else {
+			rep_heap_size -= fr->rep_size;
+		}
+	}
+}
+
+// Frees [fr->rep_buffer], whatever kind of memory it is.
+static void file_rep_buffer_release(file_rep_t *fr)
+{
+	file_rep_buffer_account(fr, false);
+	if (fr->rep_mapped) {
+		file_unmap(fr->rep_buffer);
+	} else if (fr->rep_spill) {
+		UnmapViewOfFile(fr->rep_buffer);
+		CloseHandle(fr->rep_spill);
+	} else {
+		buffer_pool_free(fr->rep_buffer);
+	}
+	fr->rep_buffer = nullptr;
+	fr->rep_mapped = false;
+	fr->rep_spill = nullptr;
+	fr->rep_size = 0;
+}
+/// -------------------------
+
+// Same as file_stream_read(), but with a buffer from the large buffer pool.
+static void* file_rep_stream_read(HANDLE stream, size_t *file_size)
+{
+	*file_size = 0;
+	if (stream == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+	void *ret = nullptr;
+	DWORD size = GetFileSize(stream, nullptr);
+	if (size != 0 && size != INVALID_FILE_SIZE) {
+		ret = buffer_pool_alloc(size);
+		DWORD byte_ret;
+		if (ret && ReadFile(stream, ret, size, &byte_ret, nullptr) && byte_ret == size) {
+			*file_size = size;
+		} else {
+			buffer_pool_free(ret);
+			ret = nullptr;
+		}
+	}
+	CloseHandle(stream);
+	return ret;
+}
+
+// Resolves the replacement file, hooks and JSON patch for [fr->name].
+static void file_rep_load(file_rep_t *fr)
+{
+	const patch_pack_t *pack = patch_pack_prebaked();
+	const patch_pack_entry_t *entry = nullptr;
+	if (pack && patch_pack_find_fn(pack, fr->name, &entry) == PATCH_INDEX_FILE) {
+		// Already the output of all hooks, nothing left to do.
+		fr->hooks = nullptr;
+		fr->rep_buffer = (void *)patch_pack_map(pack, entry, &fr->pre_json_size);
+		fr->rep_mapped = fr->rep_buffer != nullptr;
+		fr->rep_size = fr->rep_buffer ? fr->pre_json_size : 0;
+		file_rep_buffer_account(fr, true);
+		return;
+	}
+
+	fr->hooks = patchhooks_build(fr->name);
+
+	patch_stats_t *owner_prev = patch_stats_owner_begin();
+	HANDLE rep_stream = stack_game_file_stream_packed(fr->name, &pack, &entry);
+	if (entry) {
+		// Stored files in a pack are already mapped, so views cost nothing.
+		if (!fr->hooks || file_rep_over_budget(entry->size)) {
+			fr->rep_buffer = (void *)patch_pack_map(pack, entry, &fr->pre_json_size);
+			fr->rep_mapped = fr->rep_buffer != nullptr;
+		} else {
+			fr->rep_buffer = patch_pack_load(pack, entry, &fr->pre_json_size);
+			fr->rep_mapped = false;
+		}
+	} else if (rep_stream != INVALID_HANDLE_VALUE && (
+		(!fr->hooks && GetFileSize(rep_stream, nullptr) >= FILE_REP_MAP_THRESHOLD)
+		|| file_rep_over_budget(GetFileSize(rep_stream, nullptr))
+	)) {
+		fr->rep_buffer = (void *)file_stream_map(rep_stream, &fr->pre_json_size);
+		fr->rep_mapped = fr->rep_buffer != nullptr;
+	} else {
+		fr->rep_buffer = file_rep_stream_read(rep_stream, &fr->pre_json_size);
+		fr->rep_mapped = false;
+	}
+	fr->rep_size = fr->rep_buffer ? fr->pre_json_size : 0;
+	file_rep_buffer_account(fr, true);
+	if (fr->hooks) {
+		fr->patch = patchhooks_load_diff(fr->hooks, fr->name, &fr->patch_size);
+	}
+	fr->stats = patch_stats_owner_end(owner_prev);
+}
+
+static bool file_prefetch_take(file_rep_t *fr);
+
+typedef enum {
+	FILE_TRACE_REP_INIT,
+	FILE_TRACE_FRAGMENTED_OPEN,
+} file_trace_source_t;
+
+static void file_trace_record(const char *name, file_trace_source_t source);
+
 int file_rep_init(file_rep_t *fr, const char *file_name)
 {
 	size_t fn_len;
@@ -22,39 +241,101 @@ int file_rep_init(file_rep_t *fr, const char *file_name)
 	}
 	fn_len = strlen(file_name) + 1;
 	fr->name = EnsureUTF8(file_name, fn_len);
-	fr->rep_buffer = stack_game_file_resolve(fr->name, &fr->pre_json_size);
-	fr->offset = SIZE_MAX;
-	fr->hooks = patchhooks_build(fr->name);
-	if (fr->hooks) {
-		fr->patch = patchhooks_load_diff(fr->hooks, fr->name, &fr->patch_size);
+	file_trace_record(fr->name, FILE_TRACE_REP_INIT);
+	if (!file_prefetch_take(fr)) {
+		file_rep_load(fr);
 	}
+	fr->offset = SIZE_MAX;
 	InitializeCriticalSection(&fr->cs);
 	return 1;
 }
 
+// Runs the patch hooks of [fr] on [buffer], or copies their result from the
+// hook output cache if the same file was already patched before.
+static int file_rep_hooks_run_on(file_rep_t *fr, void *buffer)
+{
+	const size_t size_out = POST_JSON_SIZE(fr);
+	hook_cache_key_t key;
+	const bool cacheable = patchhooks_cacheable(fr->hooks)
+		&& hook_cache_key(&key, fr->name, fr->patch, buffer, fr->pre_json_size, size_out);
+	int ret;
+	if (cacheable) {
+		const bool hit = hook_cache_get(&key, buffer, &ret);
+		patch_stats_cache(fr->stats, hit);
+		if (hit) {
+			return ret;
+		}
+	}
+	const LONGLONG start = patch_stats_now();
+	ret = patchhooks_run(fr->hooks, buffer, size_out, fr->pre_json_size, fr->name, fr->patch);
+	patch_stats_hooks(fr->stats, start);
+	if (cacheable && ret >= 0) {
+		hook_cache_put(&key, buffer, ret);
+	}
+	return ret;
+}
+
 static int file_rep_hooks_run(file_rep_t *fr)
 {
-	return patchhooks_run(
-		fr->hooks, fr->game_buffer, POST_JSON_SIZE(fr), fr->pre_json_size, fr->name, fr->patch
-	);
+	return file_rep_hooks_run_on(fr, fr->game_buffer);
 }
 
-int file_rep_clear(file_rep_t *fr)
+void file_rep_buffer_resize(file_rep_t *fr, size_t size)
 {
-	if(!fr) {
-		return -1;
+	const bool heap = fr->rep_buffer && !fr->rep_mapped && !fr->rep_spill;
+	const size_t heap_growth = heap ? (size > fr->rep_size ? size - fr->rep_size : 0) : size;
+	if (heap && !file_rep_over_budget(heap_growth)) {
+		file_rep_buffer_account(fr, false);
+		fr->rep_buffer = buffer_pool_realloc(fr->rep_buffer, size);
+		fr->rep_size = size;
+		file_rep_buffer_account(fr, true);
+		return;
+	}
+
+	HANDLE spill = nullptr;
+	void *rep_buffer = nullptr;
+	if (file_rep_over_budget(heap_growth)) {
+		rep_buffer = file_rep_spill_create(size, &spill);
+	}
+	if (!rep_buffer) {
+		rep_buffer = buffer_pool_alloc(size);
 	}
-	SAFE_FREE(fr->rep_buffer);
+	if (fr->rep_buffer) {
+		memcpy(rep_buffer, fr->rep_buffer, MIN(size, fr->rep_size));
+	}
+	file_rep_buffer_release(fr);
+	fr->rep_buffer = rep_buffer;
+	fr->rep_spill = spill;
+	fr->rep_size = size;
+	file_rep_buffer_account(fr, true);
+}
+
+// Frees everything in [fr] except for its critical section.
+static void file_rep_data_clear(file_rep_t *fr)
+{
+	file_rep_buffer_release(fr);
 	fr->game_buffer = nullptr;
 	fr->patch = json_decref_safe(fr->patch);
-	SAFE_FREE(fr->hooks);
+	fr->hooks = nullptr;
+	fr->stats = nullptr;
 	fr->patch_size = 0;
 	fr->pre_json_size = 0;
 	fr->offset = SIZE_MAX;
+	fr->read_handle = nullptr;
+	delete fr->stream;
+	fr->stream = nullptr;
 	fr->orig_size = 0;
 	fr->object = NULL;
-	DeleteCriticalSection(&fr->cs);
 	SAFE_FREE(fr->name);
+}
+
+int file_rep_clear(file_rep_t *fr)
+{
+	if(!fr) {
+		return -1;
+	}
+	file_rep_data_clear(fr);
+	DeleteCriticalSection(&fr->cs);
 	return 0;
 }
 
@@ -64,6 +345,444 @@ THREAD_LOCAL(file_rep_t, fr_tls, NULL, file_rep_clear);
 THREAD_LOCAL(file_rep_t*, fr_ptr_tls, NULL, NULL);
 /// --------------------
 
+/// Prefetching
+/// -----------
+/**
+  * A single worker thread resolves queued files ahead of time, exactly like
+  * file_rep_init() would, and keeps the results around until file_rep_init()
+  * is called for the same name. To bound memory and address space usage, the
+  * worker pauses once FILE_PREFETCH_BUDGET bytes of results are waiting to
+  * be picked up.
+  */
+#define FILE_PREFETCH_BUDGET (32 * 1024 * 1024)
+
+typedef enum {
+	PREFETCH_QUEUED,
+	PREFETCH_LOADING,
+	PREFETCH_DONE,
+} file_prefetch_state_t;
+
+struct file_prefetch_t
+{
+	// Only [name] and the fields set by file_rep_load() are used.
+	file_rep_t fr;
+	file_prefetch_state_t state;
+	// Set for entries that were dropped while the worker was loading them.
+	// The worker then frees the result on its own.
+	bool orphaned;
+	// Signaled once [state] becomes PREFETCH_DONE.
+	HANDLE done;
+};
+
+static CRITICAL_SECTION prefetch_cs;
+static std::unordered_map<std::string, file_prefetch_t*> prefetches;
+static std::deque<file_prefetch_t*> prefetch_queue;
+// Size of all finished results that haven't been picked up yet.
+static size_t prefetch_bytes = 0;
+static HANDLE prefetch_thread = NULL;
+static HANDLE prefetch_event_work = NULL;
+static HANDLE prefetch_event_budget = NULL;
+static HANDLE prefetch_event_shutdown = NULL;
+
+/**
+  * Every queued file is also handed to a second thread that merely reads the
+  * replacement file into the OS file cache and throws the data away. Since it
+  * holds on to nothing, it isn't bound by the budget and can run through the
+  * whole queue right away, so that neither the prefetcher nor the game has
+  * to wait for the disk once they get to a file. This mostly matters for
+  * HDDs and network shares. The thread runs in background mode, so that its
+  * I/O doesn't compete with the game's own.
+  */
+#define FILE_WARM_CHUNK (256 * 1024)
+
+static std::deque<std::string> warm_queue;
+static HANDLE warm_thread = NULL;
+static HANDLE warm_event_work = NULL;
+
+static size_t file_prefetch_size(const file_prefetch_t *pf)
+{
+	return pf->fr.rep_buffer ? POST_JSON_SIZE(&pf->fr) : pf->fr.patch_size;
+}
+
+static void file_prefetch_free(file_prefetch_t *pf)
+{
+	file_rep_data_clear(&pf->fr);
+	CloseHandle(pf->done);
+	delete pf;
+}
+
+static DWORD WINAPI file_prefetch_worker(void*)
+{
+	HANDLE events_work[] = { prefetch_event_shutdown, prefetch_event_work };
+	HANDLE events_budget[] = { prefetch_event_shutdown, prefetch_event_budget };
+	while (1) {
+		EnterCriticalSection(&prefetch_cs);
+		if (prefetch_queue.empty() || prefetch_bytes >= FILE_PREFETCH_BUDGET) {
+			HANDLE *events = prefetch_queue.empty() ? events_work : events_budget;
+			LeaveCriticalSection(&prefetch_cs);
+			if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+				return 0;
+			}
+			continue;
+		}
+		file_prefetch_t *pf = prefetch_queue.front();
+		prefetch_queue.pop_front();
+		pf->state = PREFETCH_LOADING;
+		LeaveCriticalSection(&prefetch_cs);
+
+		log_printf("(Prefetch) %s\n", pf->fr.name);
+		file_rep_load(&pf->fr);
+
+		EnterCriticalSection(&prefetch_cs);
+		pf->state = PREFETCH_DONE;
+		if (pf->orphaned) {
+			LeaveCriticalSection(&prefetch_cs);
+			file_prefetch_free(pf);
+			continue;
+		}
+		prefetch_bytes += file_prefetch_size(pf);
+		// Has to happen inside the critical section, as [pf] may be freed
+		// right afterwards.
+		SetEvent(pf->done);
+		LeaveCriticalSection(&prefetch_cs);
+	}
+}
+
+// Reads the replacement file for [name] into the OS file cache.
+static void file_warm(const char *name, void *chunk)
+{
+	const patch_pack_t *pack;
+	const patch_pack_entry_t *entry;
+	HANDLE rep_stream = stack_game_file_stream_packed(name, &pack, &entry);
+	if (entry) {
+		patch_pack_prefetch(pack, entry);
+		return;
+	} else if (rep_stream == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	DWORD byte_ret;
+	while (
+		WaitForSingleObject(prefetch_event_shutdown, 0) == WAIT_TIMEOUT
+		&& ReadFile(rep_stream, chunk, FILE_WARM_CHUNK, &byte_ret, nullptr)
+		&& byte_ret != 0
+	) {
+	}
+	CloseHandle(rep_stream);
+}
+
+static DWORD WINAPI file_warm_worker(void*)
+{
+	HANDLE events[] = { prefetch_event_shutdown, warm_event_work };
+	void *chunk = malloc(FILE_WARM_CHUNK);
+	SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+	while (1) {
+		EnterCriticalSection(&prefetch_cs);
+		if (warm_queue.empty()) {
+			LeaveCriticalSection(&prefetch_cs);
+			if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+				break;
+			}
+			continue;
+		}
+		std::string name = std::move(warm_queue.front());
+		warm_queue.pop_front();
+		LeaveCriticalSection(&prefetch_cs);
+
+		file_warm(name.c_str(), chunk);
+	}
+	free(chunk);
+	return 0;
+}
+
+void file_prefetch(const char *file_name)
+{
+	if (!file_name) {
+		return;
+	}
+	size_t fn_len = strlen(file_name) + 1;
+	char *name = EnsureUTF8(file_name, fn_len);
+
+	EnterCriticalSection(&prefetch_cs);
+	if (!prefetch_thread) {
+		DWORD thread_id;
+		prefetch_event_work = CreateEvent(NULL, FALSE, FALSE, NULL);
+		prefetch_event_budget = CreateEvent(NULL, FALSE, FALSE, NULL);
+		prefetch_event_shutdown = CreateEvent(NULL, TRUE, FALSE, NULL);
+		prefetch_thread = CreateThread(NULL, 0, file_prefetch_worker, NULL, 0, &thread_id);
+		warm_event_work = CreateEvent(NULL, FALSE, FALSE, NULL);
+		warm_thread = CreateThread(NULL, 0, file_warm_worker, NULL, 0, &thread_id);
+	}
+	if (prefetch_thread && prefetches.find(name) == prefetches.end()) {
+		auto *pf = new file_prefetch_t {};
+		pf->fr.name = name;
+		pf->fr.offset = SIZE_MAX;
+		pf->state = PREFETCH_QUEUED;
+		pf->done = CreateEvent(NULL, TRUE, FALSE, NULL);
+		name = nullptr;
+		prefetches[pf->fr.name] = pf;
+		prefetch_queue.push_back(pf);
+		SetEvent(prefetch_event_work);
+		if (warm_thread) {
+			warm_queue.push_back(pf->fr.name);
+			SetEvent(warm_event_work);
+		}
+	}
+	LeaveCriticalSection(&prefetch_cs);
+	SAFE_FREE(name);
+}
+
+void file_prefetch_clear(void)
+{
+	EnterCriticalSection(&prefetch_cs);
+	for (auto& it : prefetches) {
+		file_prefetch_t *pf = it.second;
+		if (pf->state == PREFETCH_LOADING) {
+			pf->orphaned = true;
+			continue;
+		} else if (pf->state == PREFETCH_DONE) {
+			prefetch_bytes -= file_prefetch_size(pf);
+		}
+		file_prefetch_free(pf);
+	}
+	prefetches.clear();
+	prefetch_queue.clear();
+	warm_queue.clear();
+	LeaveCriticalSection(&prefetch_cs);
+	if (prefetch_event_budget) {
+		SetEvent(prefetch_event_budget);
+	}
+}
+
+// Moves a prefetched result for [fr->name] into [fr], waiting for the worker
+// if it's still loading that file. Returns false if the file hasn't been
+// loaded by the worker, in which case the caller has to do it on its own.
+static bool file_prefetch_take(file_rep_t *fr)
+{
+	if (!prefetch_thread) {
+		return false;
+	}
+	EnterCriticalSection(&prefetch_cs);
+	auto it = prefetches.find(fr->name);
+	if (it == prefetches.end()) {
+		LeaveCriticalSection(&prefetch_cs);
+		return false;
+	}
+	file_prefetch_t *pf = it->second;
+	prefetches.erase(it);
+	if (pf->state == PREFETCH_QUEUED) {
+		// Not worth waiting for.
+		prefetch_queue.erase(std::find(prefetch_queue.begin(), prefetch_queue.end(), pf));
+		LeaveCriticalSection(&prefetch_cs);
+		file_prefetch_free(pf);
+		return false;
+	}
+	LeaveCriticalSection(&prefetch_cs);
+
+	WaitForSingleObject(pf->done, INFINITE);
+
+	EnterCriticalSection(&prefetch_cs);
+	prefetch_bytes -= file_prefetch_size(pf);
+	LeaveCriticalSection(&prefetch_cs);
+	SetEvent(prefetch_event_budget);
+
+	fr->hooks = pf->fr.hooks;
+	fr->stats = pf->fr.stats;
+	fr->rep_buffer = pf->fr.rep_buffer;
+	fr->rep_mapped = pf->fr.rep_mapped;
+	fr->rep_spill = pf->fr.rep_spill;
+	fr->rep_size = pf->fr.rep_size;
+	fr->pre_json_size = pf->fr.pre_json_size;
+	fr->patch = pf->fr.patch;
+	fr->patch_size = pf->fr.patch_size;
+	pf->fr.rep_buffer = nullptr;
+	pf->fr.rep_mapped = false;
+	pf->fr.rep_spill = nullptr;
+	pf->fr.rep_size = 0;
+	pf->fr.patch = nullptr;
+	file_prefetch_free(pf);
+	return true;
+}
+
+// Queues all file names in the game-local prefetch.js manifest.
+static void file_prefetch_manifest(void)
+{
+	json_t *manifest = stack_game_json_resolve("prefetch.js", NULL);
+	size_t i;
+	json_t *val;
+	json_array_foreach(manifest, i, val) {
+		file_prefetch(json_string_value(val));
+	}
+	json_decref_safe(manifest);
+}
+/// -----------
+
+/// Access traces
+/// -------------
+/**
+  * With [file_trace] enabled in the run configuration, every file name that
+  * goes through file_rep_init() or BP_fragmented_open_file() is recorded in
+  * the order of its first access, together with the time since
+  * initialization. On exit, the trace is written to
+  * cache/<game>.<build>.trace in the thcrap directory. If such a trace exists,
+  * it is replayed into the prefetcher on startup, regardless of the setting.
+  *
+  * Format: A file_trace_header_t, followed by [count] file_trace_record_t
+  * structures, each directly followed by [name_len] bytes of the UTF-8 file
+  * name.
+  */
+#define FILE_TRACE_MAGIC 0x52544854 // "THTR"
+#define FILE_TRACE_VERSION 1
+
+#pragma pack(push, 1)
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+} file_trace_header_t;
+
+typedef struct {
+	// Milliseconds since initialization
+	uint32_t time;
+	uint16_t name_len;
+	// file_trace_source_t
+	uint8_t source;
+} file_trace_record_t;
+#pragma pack(pop)
+
+static CRITICAL_SECTION trace_cs;
+static bool trace_enabled = false;
+static DWORD trace_start;
+static std::unordered_set<std::string> trace_seen;
+static std::vector<BYTE> trace_buffer;
+static uint32_t trace_count = 0;
+
+static std::string file_trace_fn(void)
+{
+	const char *thcrap_dir = runconfig_thcrap_dir_get();
+	const char *game = runconfig_game_get();
+	const char *build = runconfig_build_get();
+	if (!game || !build) {
+		return "";
+	}
+	std::string ret = thcrap_dir ? std::string(thcrap_dir) + "/" : "";
+	return ret + "cache/" + game + "." + build + ".trace";
+}
+
+static void file_trace_record(const char *name, file_trace_source_t source)
+{
+	if (!trace_enabled || !name) {
+		return;
+	}
+	size_t name_len = strlen(name);
+	if (name_len > UINT16_MAX) {
+		return;
+	}
+	EnterCriticalSection(&trace_cs);
+	if (trace_seen.insert(name).second) {
+		file_trace_record_t rec;
+		rec.time = GetTickCount() - trace_start;
+		rec.name_len = (uint16_t)name_len;
+		rec.source = (uint8_t)source;
+		trace_buffer.insert(trace_buffer.end(), (BYTE *)&rec, (BYTE *)(&rec + 1));
+		trace_buffer.insert(trace_buffer.end(), (BYTE *)name, (BYTE *)name + name_len);
+		trace_count++;
+	}
+	LeaveCriticalSection(&trace_cs);
+}
+
+static void file_trace_replay(void)
+{
+	std::string fn = file_trace_fn();
+	if (fn.empty()) {
+		return;
+	}
+	size_t trace_size;
+	auto *trace = (BYTE *)file_read(fn.c_str(), &trace_size);
+	if (!trace) {
+		return;
+	}
+	auto *header = (file_trace_header_t *)trace;
+	if (
+		trace_size < sizeof(*header)
+		|| header->magic != FILE_TRACE_MAGIC
+		|| header->version != FILE_TRACE_VERSION
+	) {
+		log_printf("(Trace) %s is invalid, ignoring\n", fn.c_str());
+		free(trace);
+		return;
+	}
+	log_printf("(Trace) Replaying %u files from %s\n", header->count, fn.c_str());
+	size_t pos = sizeof(*header);
+	for (uint32_t i = 0; i < header->count; i++) {
+		if (trace_size - pos < sizeof(file_trace_record_t)) {
+			break;
+		}
+		auto *rec = (file_trace_record_t *)(trace + pos);
+		pos += sizeof(*rec);
+		if (trace_size - pos < rec->name_len) {
+			break;
+		}
+		std::string name((const char *)(trace + pos), rec->name_len);
+		pos += rec->name_len;
+		file_prefetch(name.c_str());
+	}
+	free(trace);
+}
+
+static void file_trace_write(void)
+{
+	if (!trace_enabled || !trace_count) {
+		return;
+	}
+	std::string fn = file_trace_fn();
+	if (fn.empty()) {
+		return;
+	}
+	EnterCriticalSection(&trace_cs);
+	file_trace_header_t header = { FILE_TRACE_MAGIC, FILE_TRACE_VERSION, trace_count };
+	trace_buffer.insert(trace_buffer.begin(), (BYTE *)&header, (BYTE *)(&header + 1));
+	if (file_write(fn.c_str(), trace_buffer.data(), trace_buffer.size())) {
+		log_printf("(Trace) Couldn't write %s\n", fn.c_str());
+	}
+	trace_buffer.clear();
+	trace_seen.clear();
+	trace_count = 0;
+	trace_enabled = false;
+	LeaveCriticalSection(&trace_cs);
+}
+/// -------------
+
+/// Breakpoint parameter schemas
+/// ----------------------------
+enum {
+	FILE_BUFFER_FILE_BUFFER,
+	FILE_BUFFER_PARAM_COUNT
+};
+
+static const breakpoint_param_desc_t file_buffer_schema[FILE_BUFFER_PARAM_COUNT] = {
+	{ "file_buffer", BP_PARAM_POINTER },
+};
+
+enum {
+	FILE_LOAD_FILE_NAME,
+	FILE_LOAD_FILE_SIZE,
+	FILE_LOAD_FILE_BUFFER,
+	FILE_LOAD_FILE_BUFFER_ADDR_COPY,
+	FILE_LOAD_STACK_CLEAR_SIZE,
+	FILE_LOAD_EIP_JUMP_DIST,
+	FILE_LOAD_PARAM_COUNT
+};
+
+static const breakpoint_param_desc_t file_load_schema[FILE_LOAD_PARAM_COUNT] = {
+	{ "file_name", BP_PARAM_POINTER },
+	{ "file_size", BP_PARAM_POINTER },
+	{ "file_buffer", BP_PARAM_POINTER },
+	{ "file_buffer_addr_copy", BP_PARAM_POINTER },
+	{ "stack_clear_size", BP_PARAM_HEX },
+	{ "eip_jump_dist", BP_PARAM_HEX },
+};
+/// ----------------------------
+
 /// Replace a file loaded entirely in memory
 /// ----------------------------------------
 int BP_file_buffer(x86_reg_t *regs, json_t *bp_info)
@@ -72,7 +791,9 @@ int BP_file_buffer(x86_reg_t *regs, json_t *bp_info)
 
 	// Parameters
 	// ----------
-	auto file_buffer = (BYTE**)json_object_get_pointer(bp_info, regs, "file_buffer");
+	breakpoint_param_t params_buf[FILE_BUFFER_PARAM_COUNT];
+	auto params = breakpoint_params_get(bp_info, file_buffer_schema, FILE_BUFFER_PARAM_COUNT, params_buf);
+	auto file_buffer = (BYTE**)json_pointer_value(params[FILE_BUFFER_FILE_BUFFER].val, regs);
 	// ----------
 	if(file_buffer) {
 		fr->game_buffer = *file_buffer;
@@ -84,11 +805,17 @@ int BP_file_load(x86_reg_t *regs, json_t *bp_info)
 {
 	file_rep_t *fr = fr_tls_get();
 
+	breakpoint_param_t params_buf[FILE_LOAD_PARAM_COUNT];
+	auto params = breakpoint_params_get(bp_info, file_load_schema, FILE_LOAD_PARAM_COUNT, params_buf);
+
 	// Mandatory parameters
 	// --------------------
-	auto file_name = (char**)json_object_get_pointer(bp_info, regs, "file_name");
-	auto file_size = json_object_get_pointer(bp_info, regs, "file_size");
-	BP_file_buffer(regs, bp_info);
+	auto file_name = (char**)json_pointer_value(params[FILE_LOAD_FILE_NAME].val, regs);
+	auto file_size = json_pointer_value(params[FILE_LOAD_FILE_SIZE].val, regs);
+	auto file_buffer = (BYTE**)json_pointer_value(params[FILE_LOAD_FILE_BUFFER].val, regs);
+	if(file_buffer) {
+		fr->game_buffer = *file_buffer;
+	}
 	// -----------------
 
 	if(file_name) {
@@ -122,9 +849,9 @@ int BP_file_load(x86_reg_t *regs, json_t *bp_info)
 
 	// Load-specific parameters
 	// ------------------------
-	auto file_buffer_addr_copy = json_object_get_pointer(bp_info, regs, "file_buffer_addr_copy");
-	size_t stack_clear_size = json_object_get_hex(bp_info, "stack_clear_size");
-	size_t eip_jump_dist = json_object_get_hex(bp_info, "eip_jump_dist");
+	auto file_buffer_addr_copy = json_pointer_value(params[FILE_LOAD_FILE_BUFFER_ADDR_COPY].val, regs);
+	size_t stack_clear_size = params[FILE_LOAD_STACK_CLEAR_SIZE].hex;
+	size_t eip_jump_dist = params[FILE_LOAD_EIP_JUMP_DIST].hex;
 	// ------------------------
 
 	// Let's do it
@@ -167,16 +894,64 @@ int DumpDatFile(const char *dir, const file_rep_t *fr)
 
 		sprintf(fn, "%s/%s", dir, fr->name);
 
-		if(!PathFileExists(fn)) {
-			file_write(fn, fr->game_buffer, fr->pre_json_size);
+		if(!dump_queue_exists(fn)) {
+			// The game buffer gets patched right after this, so the dump
+			// needs its own copy.
+			void *copy = malloc(fr->pre_json_size);
+			if(copy) {
+				memcpy(copy, fr->game_buffer, fr->pre_json_size);
+				dump_queue_write(fn, copy, fr->pre_json_size);
+			}
 		}
 		VLA_FREE(fn);
 	}
 	return 0;
 }
 
+// Returns the absolute position of a ReadFile() call on [hFile].
+// For synchronous reads, the position after the last read is remembered, so
+// that sequential reads don't need to query the file pointer every time.
+static size_t fragmented_read_pos(file_rep_t *fr, HANDLE hFile, const OVERLAPPED *lpOverlapped)
+{
+	if (lpOverlapped) {
+		return lpOverlapped->Offset;
+	}
+	if (fr->read_handle == hFile) {
+		return fr->read_pos;
+	}
+	return SetFilePointer(hFile, 0, NULL, FILE_CURRENT);
+}
+
+// Reads [size] bytes at [pos] from [hFile] into [buffer], without moving
+// the file pointer of synchronous handles, and waiting for the read to
+// finish on overlapped ones.
+static bool fragmented_read_orig(HANDLE hFile, void *buffer, DWORD size, size_t pos, bool overlapped)
+{
+	OVERLAPPED ol = {};
+	ol.Offset = pos;
+	HANDLE event = NULL;
+	if (overlapped) {
+		event = CreateEvent(NULL, TRUE, FALSE, NULL);
+		// Setting the low bit keeps the read from being reported to any
+		// I/O completion port the game might have associated with the file.
+		ol.hEvent = (HANDLE)((UINT_PTR)event | 1);
+	}
+	DWORD byte_ret = 0;
+	BOOL ret = ReadFile(hFile, buffer, size, &byte_ret, &ol);
+	if (!ret && GetLastError() == ERROR_IO_PENDING) {
+		ret = GetOverlappedResult(hFile, &ol, &byte_ret, TRUE);
+	}
+	if (event) {
+		CloseHandle(event);
+	}
+	else {
+		SetFilePointer(hFile, pos, NULL, FILE_BEGIN);
+	}
+	return ret && byte_ret == size;
+}
+
 // DumpDatFile, fragmented loading style.
-int DumpDatFragmentedFile(const char *dir, file_rep_t *fr, HANDLE hFile, fragmented_read_file_hook_t post_read)
+int DumpDatFragmentedFile(const char *dir, file_rep_t *fr, HANDLE hFile, size_t pos, bool overlapped, fragmented_read_file_hook_t post_read)
 {
 	if (!fr || !hFile || hFile == INVALID_HANDLE_VALUE || !fr->name || fr->offset != SIZE_MAX) {
 		return -1;
@@ -187,19 +962,18 @@ int DumpDatFragmentedFile(const char *dir, file_rep_t *fr, HANDLE hFile, fragmen
 
 		sprintf(fn, "%s/%s", dir, fr->name);
 
-		if (!PathFileExists(fn)) {
-			// Read the file
-			DWORD nbOfBytesRead;
+		if (!dump_queue_exists(fn)) {
+			// Read the file. This has to happen on the game's thread, but
+			// writing it doesn't.
 			BYTE* buffer = (BYTE*)malloc(fr->orig_size);
-			ReadFile(hFile, buffer, fr->orig_size, &nbOfBytesRead, NULL);
-			SetFilePointer(hFile, -(LONG)nbOfBytesRead, NULL, FILE_CURRENT);
+			fragmented_read_orig(hFile, buffer, fr->orig_size, pos, overlapped);
 
 			if (post_read) {
-				fr->offset = SetFilePointer(hFile, 0, NULL, FILE_CURRENT); // Needed by nsml
+				fr->offset = pos; // Needed by nsml
 				post_read(fr, buffer, fr->orig_size);
 				fr->offset = SIZE_MAX;
 			}
-			file_write(fn, buffer, fr->orig_size);
+			dump_queue_write(fn, buffer, fr->orig_size);
 		}
 		VLA_FREE(fn);
 	}
@@ -232,37 +1006,193 @@ int BP_file_loaded(x86_reg_t *regs, json_t *bp_info)
 /// Replace a file loaded by fragments
 /// ----------------------------------
 
+// Open-addressing hash table with linear probing and backward-shift
+// deletion, looked up on every fragmented read. [Traits] provides the hash
+// and equality functions for [K], with a nullptr key marking empty slots.
+template <typename K, typename V, typename Traits> class file_rep_table_t
+{
+	struct slot_t {
+		size_t hash;
+		K key;
+		V val;
+	};
+	std::vector<slot_t> slots;
+	size_t count = 0;
+
+	size_t mask() const {
+		return slots.size() - 1;
+	}
+
+	// Returns the slot for [key], or the empty one where it would go.
+	size_t probe(K key, size_t hash) const {
+		size_t i = hash & mask();
+		while (slots[i].key && !(slots[i].hash == hash && Traits::equal(slots[i].key, key))) {
+			i = (i + 1) & mask();
+		}
+		return i;
+	}
+
+	void grow() {
+		std::vector<slot_t> old(slots.empty() ? 16 : slots.size() * 2);
+		old.swap(slots);
+		for (auto& slot : old) {
+			if (slot.key) {
+				slots[probe(slot.key, slot.hash)] = slot;
+			}
+		}
+	}
+
+public:
+	bool empty() const {
+		return count == 0;
+	}
+
+	V find(K key) const {
+		if (count == 0) {
+			return nullptr;
+		}
+		const slot_t &slot = slots[probe(key, Traits::hash(key))];
+		return slot.key ? slot.val : nullptr;
+	}
+
+	void set(K key, V val) {
+		// Keep the load factor at or below 3/4.
+		if ((count + 1) * 4 > slots.size() * 3) {
+			grow();
+		}
+		size_t hash = Traits::hash(key);
+		slot_t &slot = slots[probe(key, hash)];
+		if (!slot.key) {
+			count++;
+		}
+		slot = { hash, key, val };
+	}
+
+	void erase(K key) {
+		if (count == 0) {
+			return;
+		}
+		size_t i = probe(key, Traits::hash(key));
+		if (!slots[i].key) {
+			return;
+		}
+		// Move back any following entry whose probe sequence passes
+		// through the freed slot.
+		size_t j = i;
+		while (1) {
+			j = (j + 1) & mask();
+			if (!slots[j].key) {
+				break;
+			}
+			size_t home = slots[j].hash & mask();
+			if (((j - home) & mask()) >= ((j - i) & mask())) {
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+		slots[i] = {};
+		count--;
+	}
+};
+
+// Integer finalizer from MurmurHash3, so that the low bits used for the slot
+// index depend on all bits of the key.
+static size_t file_rep_hash_mix(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+struct file_rep_name_traits_t {
+	static size_t hash(const char *key) {
+		// FNV-1a
+		uint32_t h = 2166136261u;
+		for (; *key; key++) {
+			h = (h ^ (uint8_t)*key) * 16777619u;
+		}
+		return file_rep_hash_mix(h);
+	}
+	static bool equal(const char *a, const char *b) {
+		return strcmp(a, b) == 0;
+	}
+};
+
+struct file_rep_object_traits_t {
+	static size_t hash(const void *key) {
+		return file_rep_hash_mix((uint32_t)(uintptr_t)key);
+	}
+	static bool equal(const void *a, const void *b) {
+		return a == b;
+	}
+};
+
+// Stable storage for the file_rep_t objects in [files_list], which are never
+// removed once created. std::deque doesn't move its elements on insertion at
+// the end.
+struct file_rep_slab_entry_t {
+	std::string name;
+	file_rep_t fr;
+};
+static std::deque<file_rep_slab_entry_t> file_rep_slab;
+
 // For these files, we need to know the full file size beforehand.
 // So we need a breakpoint in the file header.
-std::map<std::string, file_rep_t> files_list;
-std::map<const void*, file_rep_t*> file_object_to_rep_list;
-static CRITICAL_SECTION cs;
+// The keys of [files_list] point into the [name] of their slab entry.
+static file_rep_table_t<const char*, file_rep_t*, file_rep_name_traits_t> files_list;
+static file_rep_table_t<const void*, file_rep_t*, file_rep_object_traits_t> file_object_to_rep_list;
+// Both tables are read on every fragmented read, but only written when a
+// file is opened for the first time or gets a new object, so concurrent
+// loader threads only take these locks in shared mode. Each table has its
+// own lock, so that registering an object doesn't block name lookups.
+static SRWLOCK files_srwlock = SRWLOCK_INIT;
+static SRWLOCK objects_srwlock = SRWLOCK_INIT;
 
 file_rep_t *file_rep_get(const char *filename)
 {
-	EnterCriticalSection(&cs);
-	auto it = files_list.find(filename);
-	if (it != files_list.end()) {
-		LeaveCriticalSection(&cs);
-		return &it->second;
+	AcquireSRWLockShared(&files_srwlock);
+	file_rep_t *ret = files_list.find(filename);
+	ReleaseSRWLockShared(&files_srwlock);
+	return ret;
+}
+
+// Returns the file_rep_t for [filename], creating an empty one if necessary.
+static file_rep_t *file_rep_get_create(const char *filename)
+{
+	file_rep_t *ret = file_rep_get(filename);
+	if (ret) {
+		return ret;
 	}
-	else {
-		LeaveCriticalSection(&cs);
-		return nullptr;
+	AcquireSRWLockExclusive(&files_srwlock);
+	// Another thread might have created it in the meantime.
+	ret = files_list.find(filename);
+	if (!ret) {
+		file_rep_slab.emplace_back();
+		auto& entry = file_rep_slab.back();
+		entry.name = filename;
+		ret = &entry.fr;
+		memset(ret, 0, sizeof(file_rep_t));
+		ret->offset = SIZE_MAX;
+		files_list.set(entry.name.c_str(), ret);
 	}
+	ReleaseSRWLockExclusive(&files_srwlock);
+	return ret;
 }
 
 void file_rep_set_object(file_rep_t *fr, void *object)
 {
-	EnterCriticalSection(&cs);
+	AcquireSRWLockExclusive(&objects_srwlock);
 	if (fr->object) {
 		file_object_to_rep_list.erase(fr->object);
 	}
 	fr->object = object;
 	if (object) {
-		file_object_to_rep_list[object] = fr;
+		file_object_to_rep_list.set(object, fr);
 	}
-	LeaveCriticalSection(&cs);
+	ReleaseSRWLockExclusive(&objects_srwlock);
 }
 
 file_rep_t *file_rep_get_by_object(const void *object)
@@ -271,16 +1201,10 @@ file_rep_t *file_rep_get_by_object(const void *object)
 		return nullptr;
 	}
 
-	EnterCriticalSection(&cs);
-	auto it = file_object_to_rep_list.find(object);
-	if (it != file_object_to_rep_list.end()) {
-		LeaveCriticalSection(&cs);
-		return it->second;
-	}
-	else {
-		LeaveCriticalSection(&cs);
-		return nullptr;
-	}
+	AcquireSRWLockShared(&objects_srwlock);
+	file_rep_t *ret = file_object_to_rep_list.find(object);
+	ReleaseSRWLockShared(&objects_srwlock);
+	return ret;
 }
 
 int BP_file_header(x86_reg_t *regs, json_t *bp_info)
@@ -294,15 +1218,10 @@ int BP_file_header(x86_reg_t *regs, json_t *bp_info)
 	if (!filename || !size)
 		return 1;
 
-	file_rep_t *fr = file_rep_get(filename);
-	if (fr == nullptr) {
-		fr = &files_list[filename];
-		memset(fr, 0, sizeof(file_rep_t));
-		file_rep_clear(fr);
-	}
+	file_rep_t *fr = file_rep_get_create(filename);
 	file_rep_init(fr, filename);
 	if (fr->rep_buffer && fr->patch_size) {
-		fr->rep_buffer = realloc(fr->rep_buffer, POST_JSON_SIZE(fr));
+		file_rep_buffer_resize(fr, POST_JSON_SIZE(fr));
 	}
 
 	const char* dat_dump = runconfig_dat_dump_get();
@@ -331,6 +1250,12 @@ int BP_fragmented_open_file(x86_reg_t *regs, json_t *bp_info)
 	if (file_name) {
 		if (files_list.empty() == false) {
 			// We got a files list in the file header
+			if (trace_enabled) {
+				size_t fn_len = strlen(file_name) + 1;
+				char *name = EnsureUTF8(file_name, fn_len);
+				file_trace_record(name, FILE_TRACE_FRAGMENTED_OPEN);
+				free(name);
+			}
 			fr = file_rep_get(file_name);
 			*fr_ptr_tls_get() = fr;
 		}
@@ -341,7 +1266,7 @@ int BP_fragmented_open_file(x86_reg_t *regs, json_t *bp_info)
 			file_rep_clear(fr);
 			file_rep_init(fr, file_name);
 			if (fr->rep_buffer && fr->patch_size) {
-				fr->rep_buffer = realloc(fr->rep_buffer, POST_JSON_SIZE(fr));
+				file_rep_buffer_resize(fr, POST_JSON_SIZE(fr));
 			}
 			*fr_ptr_tls_get() = fr;
 		}
@@ -350,6 +1275,9 @@ int BP_fragmented_open_file(x86_reg_t *regs, json_t *bp_info)
 	if (fr && file_object) {
 		file_rep_set_object(fr, file_object);
 	}
+	if (fr) {
+		fr->read_handle = nullptr;
+	}
 
 	if (fr && file_size) {
 		fr->orig_size = *file_size;
@@ -359,14 +1287,86 @@ int BP_fragmented_open_file(x86_reg_t *regs, json_t *bp_info)
 	return 1;
 }
 
+// Writes [size] bytes at [offset] into the patched version of [fr] to
+// [buffer], patching as much of the original file as necessary.
+static void fragmented_stream_read(file_rep_t *fr, const fragmented_read_file_t *ctx, HANDLE hFile, bool overlapped, BYTE *buffer, size_t offset, size_t size)
+{
+	fragmented_stream_t *stream = fr->stream;
+	if (offset < stream->out_pos) {
+		// The game went back, so we have to start over.
+		func_patch_stream_t func = stream->func;
+		delete stream;
+		stream = fr->stream = fragmented_stream_new(fr, func);
+	}
+	while (true) {
+		// Drop everything before [offset], the game won't need it again.
+		size_t drop = MIN(offset - stream->out_pos, stream->out.size());
+		stream->out.erase(stream->out.begin(), stream->out.begin() + drop);
+		stream->out_pos += drop;
+		if (stream->done || (stream->out_pos + stream->out.size()) >= (offset + size)) {
+			break;
+		}
+
+		const size_t in_prev = stream->in.size();
+		const DWORD chunk = MIN(fr->orig_size - stream->in_read, FRAGMENTED_STREAM_WINDOW);
+		stream->in.resize(in_prev + chunk);
+		if (chunk) {
+			BYTE *in = stream->in.data() + in_prev;
+			fragmented_read_orig(hFile, in, chunk, fr->offset + stream->in_read, overlapped);
+			if (ctx->post_read_chunk) {
+				ctx->post_read_chunk(fr, stream->in_read, in, chunk);
+			}
+			stream->in_read += chunk;
+		}
+		const bool last = stream->in_read == fr->orig_size;
+		const size_t consumed = stream->func(&stream->hook, stream->in.data(), stream->in.size(), last);
+		stream->in.erase(stream->in.begin(), stream->in.begin() + MIN(consumed, stream->in.size()));
+		if (last) {
+			stream->in.clear();
+			stream->in.shrink_to_fit();
+			stream->done = true;
+			if (stream->out_pos + stream->out.size() > POST_JSON_SIZE(fr)) {
+				log_printf("%s: patched file doesn't fit inside the rep buffer, truncating!\n", fr->name);
+			}
+		}
+	}
+
+	// Past the end of the patched data, the file is padded with zeroes.
+	size_t avail = 0;
+	if (offset < stream->out_pos + stream->out.size()) {
+		avail = MIN(stream->out_pos + stream->out.size() - offset, size);
+		memcpy(buffer, stream->out.data() + (offset - stream->out_pos), avail);
+	}
+	memset(buffer + avail, 0, size - avail);
+}
+
 int BP_fragmented_read_file(x86_reg_t *regs, json_t *bp_info)
 {
-	file_rep_t *fr = *fr_ptr_tls_get();
+	fragmented_read_file_t ctx;
+	ctx.fr = *fr_ptr_tls_get();
 
 	// Parameters
 	// ----------
 	const char *file_name   = (const char*)json_object_get_immediate(bp_info, regs, "file_name");
 	const void *file_object = (const void*)json_object_get_immediate(bp_info, regs, "file_object");
+	ctx.post_read  = (fragmented_read_file_hook_t)json_object_get_immediate(bp_info, regs, "post_read");
+	ctx.post_patch = (fragmented_read_file_hook_t)json_object_get_immediate(bp_info, regs, "post_patch");
+	// ----------
+
+	if (file_name) {
+		ctx.fr = file_rep_get(file_name);
+	}
+	else if (file_object) {
+		ctx.fr = file_rep_get_by_object(file_object);
+	}
+	return fragmented_read_file(regs, &ctx);
+}
+
+int fragmented_read_file(x86_reg_t *regs, const fragmented_read_file_t *ctx)
+{
+	file_rep_t *fr = ctx->fr;
+	*fr_ptr_tls_get() = fr;
+
 	// Stack
 	// ----------
 	HANDLE       hFile                = ((HANDLE*)      regs->esp)[1];
@@ -376,82 +1376,120 @@ int BP_fragmented_read_file(x86_reg_t *regs, json_t *bp_info)
 	LPOVERLAPPED lpOverlapped         = ((LPOVERLAPPED*)regs->esp)[5];
 	// ----------
 
-	if (file_name) {
-		fr = file_rep_get(file_name);
-		*fr_ptr_tls_get() = fr;
-	}
-	else if (file_object) {
-		fr = file_rep_get_by_object(file_object);
-		*fr_ptr_tls_get() = fr;
-	}
 	if (!fr || !fr->name || !fr->orig_size) {
 		return 1;
 	}
 
 	const char *dat_dump = runconfig_dat_dump_get();
-	if (dat_dump) {
-		DumpDatFragmentedFile(dat_dump, fr, hFile, (fragmented_read_file_hook_t)json_object_get_immediate(bp_info, regs, "post_read"));
+	if (!fr->rep_buffer && !fr->patch && !fr->hooks && !dat_dump) {
+		return 1;
 	}
 
-	if (!fr->rep_buffer && !fr->patch && !fr->hooks) {
-		return 1;
+	EnterCriticalSection(&fr->cs);
+	const size_t pos = fragmented_read_pos(fr, hFile, lpOverlapped);
+	if (dat_dump) {
+		DumpDatFragmentedFile(dat_dump, fr, hFile, pos, lpOverlapped != nullptr, ctx->post_read);
 	}
-	if (lpOverlapped) {
-		// Overlapped operations are not supported.
-		// We'd better leave that file alone rather than ignoring that.
+	if (!fr->rep_buffer && !fr->patch && !fr->hooks) {
+		LeaveCriticalSection(&fr->cs);
 		return 1;
 	}
 
-	EnterCriticalSection(&fr->cs);
 	bool has_rep = fr->rep_buffer != nullptr;
 	if (fr->offset == SIZE_MAX) {
-		fr->offset = SetFilePointer(hFile, 0, NULL, FILE_CURRENT);
+		fr->offset = pos;
 
-		// Read the original file if we don't have a replacement one
-		if (!fr->rep_buffer) {
-			DWORD nbOfBytesRead;
-			fr->rep_buffer = malloc(fr->orig_size + fr->patch_size);
-			fr->pre_json_size = fr->orig_size;
-			ReadFile(hFile, fr->rep_buffer, fr->orig_size, &nbOfBytesRead, NULL);
-			SetFilePointer(hFile, fr->offset, NULL, FILE_BEGIN);
+		const bool chunked =
+			(!ctx->post_read || ctx->post_read_chunk)
+			&& (!ctx->post_patch || ctx->post_patch_chunk);
+		func_patch_stream_t stream_func = patchhooks_stream_func(fr->hooks);
+		fr->post_patch_chunked = false;
 
-			fragmented_read_file_hook_t post_read = (fragmented_read_file_hook_t)json_object_get_immediate(bp_info, regs, "post_read");
-			if (post_read) {
-				post_read(fr, (BYTE*)fr->rep_buffer, fr->orig_size);
-			}
-		}
-		// Patch the game
-		if (patchhooks_run(fr->hooks, fr->rep_buffer, POST_JSON_SIZE(fr), fr->pre_json_size, fr->name, fr->patch)) {
-			has_rep = 1;
+		if (chunked && !fr->rep_buffer && stream_func) {
+			// Patch the original file while the game reads it.
+			fr->pre_json_size = fr->orig_size;
+			fr->stream = fragmented_stream_new(fr, stream_func);
+			fr->post_patch_chunked = ctx->post_patch_chunk != nullptr;
 		}
-		fragmented_read_file_hook_t post_patch = (fragmented_read_file_hook_t)json_object_get_immediate(bp_info, regs, "post_patch");
-		if (post_patch) {
-			post_patch(fr, (BYTE*)fr->rep_buffer, POST_JSON_SIZE(fr));
+		else if (chunked && fr->rep_buffer && !fr->hooks && ctx->post_patch) {
+			// Pure replacement file, which only needs to be passed
+			// through [post_patch_chunk].
+			fr->post_patch_chunked = true;
 		}
+		else {
+			// Read the original file if we don't have a replacement one
+			if (!fr->rep_buffer) {
+				file_rep_buffer_resize(fr, fr->orig_size + fr->patch_size);
+				fr->pre_json_size = fr->orig_size;
+				fragmented_read_orig(hFile, fr->rep_buffer, fr->orig_size, fr->offset, lpOverlapped != nullptr);
+
+				if (ctx->post_read) {
+					ctx->post_read(fr, (BYTE*)fr->rep_buffer, fr->orig_size);
+				}
+			}
+			if (fr->rep_mapped && (fr->hooks || ctx->post_patch)) {
+				file_rep_buffer_resize(fr, POST_JSON_SIZE(fr));
+			}
+			// Patch the game
+			if (file_rep_hooks_run_on(fr, fr->rep_buffer) > 0) {
+				has_rep = 1;
+			}
+			if (ctx->post_patch) {
+				ctx->post_patch(fr, (BYTE*)fr->rep_buffer, POST_JSON_SIZE(fr));
+			}
 
-		// If we didn't change the file in any way, we can free the rep buffer.
-		if (!has_rep) {
-			SAFE_FREE(fr->rep_buffer);
+			// If we didn't change the file in any way, we can free the rep buffer.
+			if (!has_rep) {
+				file_rep_buffer_release(fr);
+			}
 		}
 	}
-	if (!fr->rep_buffer) {
+	if (!fr->rep_buffer && !fr->stream) {
+		fr->read_handle = nullptr;
 		LeaveCriticalSection(&fr->cs);
 		return 1;
 	}
 
 	log_printf("Patching %s\n", fr->name);
-	DWORD offset = SetFilePointer(hFile, 0, NULL, FILE_CURRENT) - fr->offset;
+	DWORD offset = pos - fr->offset;
+	DWORD byte_ret = 0;
 	if (offset <= POST_JSON_SIZE(fr)) {
-		*lpNumberOfBytesRead = MIN(POST_JSON_SIZE(fr) - offset, nNumberOfBytesToRead);
+		byte_ret = MIN(POST_JSON_SIZE(fr) - offset, nNumberOfBytesToRead);
+	}
+	if (fr->stream) {
+		fragmented_stream_read(fr, ctx, hFile, lpOverlapped != nullptr, lpBuffer, offset, byte_ret);
 	}
 	else {
-		*lpNumberOfBytesRead = 0;
+		memcpy(lpBuffer, (BYTE*)fr->rep_buffer + offset, byte_ret);
+	}
+	if (fr->post_patch_chunked) {
+		ctx->post_patch_chunk(fr, offset, lpBuffer, byte_ret);
+	}
+	if (lpNumberOfBytesRead) {
+		*lpNumberOfBytesRead = byte_ret;
 	}
 
-	memcpy(lpBuffer, (BYTE*)fr->rep_buffer + offset, *lpNumberOfBytesRead);
-	SetFilePointer(hFile, *lpNumberOfBytesRead, NULL, FILE_CURRENT);
+	if (lpOverlapped) {
+		// Complete the request right away, the same way the kernel does
+		// for overlapped reads that finish synchronously. The file
+		// pointer isn't used for those.
+		// Note that we can't queue a completion packet, and therefore
+		// don't support handles associated with an I/O completion port.
+		lpOverlapped->Internal = 0; // STATUS_SUCCESS
+		lpOverlapped->InternalHigh = byte_ret;
+		HANDLE event = (HANDLE)((UINT_PTR)lpOverlapped->hEvent & ~(UINT_PTR)1);
+		if (event) {
+			SetEvent(event);
+		}
+	}
+	else {
+		SetFilePointer(hFile, pos + byte_ret, NULL, FILE_BEGIN);
+		fr->read_handle = hFile;
+		fr->read_pos = pos + byte_ret;
+	}
 
-	if (offset + *lpNumberOfBytesRead == POST_JSON_SIZE(fr)) {
+	if (offset + byte_ret == POST_JSON_SIZE(fr)) {
+		fr->read_handle = nullptr;
 		*fr_ptr_tls_get() = nullptr;
 	}
 
@@ -477,8 +1515,15 @@ int BP_fragmented_close_file(x86_reg_t *regs, json_t *bp_info)
 		}
 	}
 
-	if (fr && files_list.empty() == false) {
+	if (fr) {
+		fr->read_handle = nullptr;
+	}
+	if (fr && files_list.empty()) {
 		// If we didn't use a header, we need to free the file_rep we allocated.
+		if (fr->object) {
+			file_rep_set_object(fr, nullptr);
+		}
+		file_rep_clear(fr);
 		free(fr);
 	}
 
@@ -488,11 +1533,54 @@ int BP_fragmented_close_file(x86_reg_t *regs, json_t *bp_info)
 
 extern "C" int file_mod_init()
 {
-	InitializeCriticalSection(&cs);
+	InitializeCriticalSection(&prefetch_cs);
+	InitializeCriticalSection(&trace_cs);
+	breakpoint_schema_register("BP_file_buffer", file_buffer_schema, FILE_BUFFER_PARAM_COUNT);
+	breakpoint_schema_register("BP_file_loaded", file_buffer_schema, FILE_BUFFER_PARAM_COUNT);
+	breakpoint_schema_register("BP_file_load", file_load_schema, FILE_LOAD_PARAM_COUNT);
+	breakpoint_schema_register("BP_file_name", file_load_schema, FILE_LOAD_PARAM_COUNT);
+	breakpoint_schema_register("BP_file_size", file_load_schema, FILE_LOAD_PARAM_COUNT);
 	return 0;
 }
 
+extern "C" void file_mod_post_init()
+{
+	file_trace_replay();
+	file_prefetch_manifest();
+	trace_start = GetTickCount();
+	trace_enabled = runconfig_file_trace_get();
+}
+
+extern "C" void file_mod_repatch(json_t *files_changed)
+{
+	if (json_object_size(files_changed) > 0) {
+		file_prefetch_clear();
+	}
+}
+
 extern "C" void file_mod_exit()
 {
-	DeleteCriticalSection(&cs);
+	file_trace_write();
+	if (prefetch_thread) {
+		SetEvent(prefetch_event_shutdown);
+		WaitForSingleObject(prefetch_thread, INFINITE);
+		CloseHandle(prefetch_thread);
+		prefetch_thread = NULL;
+		if (warm_thread) {
+			WaitForSingleObject(warm_thread, INFINITE);
+			CloseHandle(warm_thread);
+			warm_thread = NULL;
+		}
+		CloseHandle(warm_event_work);
+		warm_event_work = NULL;
+		file_prefetch_clear();
+		CloseHandle(prefetch_event_work);
+		CloseHandle(prefetch_event_budget);
+		CloseHandle(prefetch_event_shutdown);
+		prefetch_event_work = NULL;
+		prefetch_event_budget = NULL;
+		prefetch_event_shutdown = NULL;
+	}
+	DeleteCriticalSection(&trace_cs);
+	DeleteCriticalSection(&prefetch_cs);
 }
@@ -17,14 +17,28 @@ typedef struct {
 	// Combined JSON patch to be applied to the file, and its maximum size
 	json_t *patch;
 	size_t patch_size;
-	// JSON array of hook functions to be run on this file
-	struct patchhook_t *hooks;
+	// Array of hook functions to be run on this file, from patchhooks_build()
+	const struct patchhook_t *hooks;
+	// Patch that [hooks] are charged to, see patch_stats.h
+	struct patch_stats_t *stats;
 
 	// File name. Enforced to be in UTF-8
 	char *name;
 
 	// Potential replacement file, applied before the JSON patch
 	void *rep_buffer;
+	// Set if [rep_buffer] is a read-only view from file_stream_map().
+	// This is done for files without patch hooks, since nothing will
+	// modify the replacement file in that case, and for all files once the
+	// replacement buffer budget is exceeded. Use file_rep_buffer_resize()
+	// before writing to [rep_buffer].
+	bool rep_mapped;
+	// Handle of the temporary file if [rep_buffer] is a writable view of
+	// one, which file_rep_buffer_resize() uses instead of the heap once the
+	// replacement buffer budget is exceeded. NULL otherwise.
+	HANDLE rep_spill;
+	// Size of the memory block behind [rep_buffer].
+	size_t rep_size;
 	// Size of [rep_buffer] if we have one; otherwise, size of the original
 	// game file. [game_buffer] is guaranteed to be at least this large.
 	size_t pre_json_size;
@@ -42,6 +56,16 @@ typedef struct {
 	// Offset of the file in the archive.
 	size_t offset;
 
+	// File handle used by the last synchronous fragmented read, and the
+	// file pointer position after that read. Lets sequential reads skip
+	// querying the file pointer.
+	HANDLE read_handle;
+	size_t read_pos;
+	// Set if the file is patched while being read. Only used by the fragmented read engine.
+	struct fragmented_stream_t *stream;
+	// Set if [post_patch_chunk] has to be run on every read.
+	bool post_patch_chunked;
+
 	// Used to mitigate a race condition in BP_fragmented_read_file where
 	// the game opens the same file simultaneously from 2 threads.
 	// The real fix would be to make more state thread-local (instead of
@@ -57,6 +81,12 @@ int file_rep_init(file_rep_t *fr, const char *file_name);
 // Clears a file_rep_t object.
 int file_rep_clear(file_rep_t *fr);
 
+// Turns [rep_buffer] into a writable buffer of [size] bytes, copying a
+// mapped view if necessary. Over the replacement buffer budget (see
+// runconfig_file_rep_budget_get()), the buffer is a view of a temporary
+// file rather than a heap block.
+void file_rep_buffer_resize(file_rep_t *fr, size_t size);
+
 // Retrieves a file_rep_t object cached by BP_file_header
 file_rep_t *file_rep_get(const char *filename);
 
@@ -73,6 +103,21 @@ file_rep_t* fr_tls_get(void);
 void fr_tls_free(file_rep_t *fr);
 /// --------------------
 
+/// Prefetching
+/// -----------
+// Queues the game file [file_name] to be resolved on a background thread.
+// The next file_rep_init() call for the same name then picks up the result,
+// waiting for the background thread if it is currently loading that file.
+// Independently of that, a second background thread reads the replacement
+// file into the OS file cache right away.
+// The game-local prefetch.js manifest, a JSON array of file names, is queued
+// automatically after initialization.
+void file_prefetch(const char *file_name);
+
+// Drops all queued and finished prefetches. Called on every repatch.
+void file_prefetch_clear(void);
+/// -----------
+
 /**
   * Reads the file buffer address and stores it in the local file_rep_t object.
   *
@@ -214,6 +259,10 @@ int BP_fragmented_open_file(x86_reg_t *regs, json_t *bp_info);
   * When apply is not true, this breakpoint just stores the filename for the next call.
   * When apply is true, this breakpoint must be exactly over a ReadFile call.
   * Parameters will be taken directly on the stack.
+  * Sequential synchronous reads and overlapped reads are both supported.
+  * Overlapped reads complete immediately, and signal their event if they
+  * have one; handles associated with an I/O completion port are not
+  * supported, since no completion packet is queued.
   *
   * Own JSON parameters
   * -------------------
@@ -243,6 +292,30 @@ int BP_fragmented_open_file(x86_reg_t *regs, json_t *bp_info);
   */
 int BP_fragmented_read_file(x86_reg_t *regs, json_t *bp_info);
 typedef void (*fragmented_read_file_hook_t)(const file_rep_t *fr, BYTE *buffer, size_t size);
+typedef void (*fragmented_read_chunk_hook_t)(const file_rep_t *fr, size_t offset, BYTE *buffer, size_t size);
+
+// Native version of BP_fragmented_read_file, for plugins that already know
+// which file is being read, and would otherwise have to build a new
+// [bp_info] object for every single ReadFile call.
+typedef struct {
+	// File being read. Also becomes the last file used by the thread.
+	file_rep_t *fr;
+	// Same as the JSON parameters of the same name. Both are optional.
+	fragmented_read_file_hook_t post_read;
+	fragmented_read_file_hook_t post_patch;
+	// Optional versions of [post_read] and [post_patch] that work on the
+	// [size] bytes at [offset] into the file. If every hook that is set
+	// has one, files can be patched while they are read, instead of all at
+	// once on the first read, with hooks that support it (see
+	// patchhook_register_stream()). Files without any patch hooks are then
+	// also passed through without copying them.
+	fragmented_read_chunk_hook_t post_read_chunk;
+	fragmented_read_chunk_hook_t post_patch_chunk;
+} fragmented_read_file_t;
+
+// Must be called on the ReadFile call, with [regs] coming from a
+// breakpoint. Returns the value the breakpoint should return.
+int fragmented_read_file(x86_reg_t *regs, const fragmented_read_file_t *ctx);
 
 /**
   * Used when the a fragmented file reader closes its file.
@@ -8,6 +8,10 @@
   */
 
 #include "thcrap.h"
+#include <intrin.h>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
 
 /// Functions
 /// ---------
@@ -15,9 +19,11 @@
 // is written to every breakpoint's address.
 extern "C" void bp_entry(void);
 
-// Performs breakpoint lookup, invocation and stack adjustments. Returns the
-// number of bytes the stack has to be moved downwards by breakpoint_entry().
-extern "C" size_t __cdecl breakpoint_process(breakpoint_local_t *bp_local, size_t cave_addr, x86_reg_t *regs);
+// Wraps breakpoint_process(), updates the breakpoint's profile counters and
+// records a trace event. Only called by breakpoints that were applied while
+// profiling or breakpoint tracing was enabled, so that the others don't pay
+// anything for it.
+extern "C" size_t __cdecl breakpoint_process_profiled(breakpoint_local_t *bp_local, size_t cave_addr, x86_reg_t *regs);
 /// ---------
 
 /// Constants
@@ -29,6 +35,120 @@ extern "C" size_t __cdecl breakpoint_process(breakpoint_local_t *bp_local, size_
 #define x86_INT3 0xCC
 /// ---------
 
+// Breakpoint whose function is currently running on this thread, used to
+// find the precompiled form of the expressions in its JSON object.
+static TLSSlot bp_current;
+
+static const breakpoint_expr_t* breakpoint_expr_find(const json_t *val)
+{
+	const breakpoint_local_t *bp = (const breakpoint_local_t*)tls_slot_get(bp_current.slot);
+	if (bp) {
+		for (size_t i = 0; i < bp->expr_count; ++i) {
+			if (bp->exprs[i].val == val) {
+				return &bp->exprs[i];
+			}
+		}
+	}
+	return NULL;
+}
+
+static void breakpoint_exprs_compile(json_t *val, std::vector<breakpoint_expr_t>& exprs)
+{
+	if (json_is_string(val)) {
+		const char *expr = json_string_value(val);
+		breakpoint_expr_t bp_expr = { val, expr_compile(expr, '\0', nullptr), nullptr };
+		if (expr[0] == '[') {
+			const char *expr_end;
+			bp_expr.ptr = expr_compile(expr + 1, ']', &expr_end);
+			// Leftover bytes are warned about by json_pointer_value()
+			if (bp_expr.ptr && expr_end[strspn(expr_end, " ]")] != '\0') {
+				expr_code_free(bp_expr.ptr);
+				bp_expr.ptr = nullptr;
+			}
+		}
+		if (bp_expr.imm || bp_expr.ptr) {
+			exprs.push_back(bp_expr);
+		}
+	}
+	else if (json_is_object(val)) {
+		const char *key;
+		json_t *sub;
+		json_object_foreach(val, key, sub) {
+			breakpoint_exprs_compile(sub, exprs);
+		}
+	}
+	else if (json_is_array(val)) {
+		size_t i;
+		json_t *sub;
+		json_array_foreach(val, i, sub) {
+			breakpoint_exprs_compile(sub, exprs);
+		}
+	}
+}
+
+void breakpoint_cache_free(breakpoint_local_t *bp)
+{
+	for (size_t i = 0; i < bp->expr_count; ++i) {
+		expr_code_free(bp->exprs[i].imm);
+		expr_code_free(bp->exprs[i].ptr);
+	}
+	SAFE_FREE(bp->exprs);
+	bp->expr_count = 0;
+	SAFE_FREE(bp->params);
+	bp->schema = nullptr;
+}
+
+/// Parameter schemas
+/// -----------------
+struct breakpoint_schema_t {
+	const breakpoint_param_desc_t *params;
+	size_t count;
+};
+
+static std::unordered_map<std::string, breakpoint_schema_t> breakpoint_schemas;
+
+void breakpoint_schema_register(const char *func_name, const breakpoint_param_desc_t *schema, size_t count)
+{
+	breakpoint_schemas[func_name] = { schema, count };
+}
+
+static void breakpoint_params_resolve(
+	const char *name, json_t *bp_info, const breakpoint_param_desc_t *schema, size_t count, breakpoint_param_t *params
+) {
+	for (size_t i = 0; i < count; ++i) {
+		json_t *val = json_object_get(bp_info, schema[i].key);
+		switch (schema[i].type) {
+			case BP_PARAM_HEX:
+				params[i].hex = json_hex_value(val);
+				continue;
+			case BP_PARAM_IMMEDIATE:
+				if (val && !json_is_string(val) && !json_is_integer(val) && !json_is_null(val)) {
+					log_printf("breakpoint %s: %s must be either an integer or a string\n", name, schema[i].key);
+					val = nullptr;
+				}
+				break;
+			default:
+				if (val && !json_is_string(val)) {
+					log_printf("breakpoint %s: %s must be a string\n", name, schema[i].key);
+					val = nullptr;
+				}
+				break;
+		}
+		params[i].val = val;
+	}
+}
+
+const breakpoint_param_t* breakpoint_params_get(json_t *bp_info, const breakpoint_param_desc_t *schema, size_t count, breakpoint_param_t *params_buf)
+{
+	const breakpoint_local_t *bp = (const breakpoint_local_t*)tls_slot_get(bp_current.slot);
+	if (bp && bp->params && bp->schema == schema && bp->json_obj == bp_info) {
+		return bp->params;
+	}
+	breakpoint_params_resolve(bp ? bp->name : "", bp_info, schema, count, params_buf);
+	return params_buf;
+}
+/// -----------------
+
 size_t json_immediate_value(json_t *val, x86_reg_t *regs)
 {
 	if (!val || json_is_null(val)) {
@@ -41,6 +161,10 @@ size_t json_immediate_value(json_t *val, x86_reg_t *regs)
 		log_func_printf("the expression must be either an integer or a string.\n");
 		return 0;
 	}
+	const breakpoint_expr_t *bp_expr = regs ? breakpoint_expr_find(val) : NULL;
+	if (bp_expr && bp_expr->imm) {
+		return expr_code_eval(bp_expr->imm, regs);
+	}
 	const char *expr = json_string_value(val);
 	size_t ret = 0;
 	eval_expr(expr, '\0', &ret, regs, NULL);
@@ -66,8 +190,13 @@ size_t *json_pointer_value(json_t *val, x86_reg_t *regs)
 		return ptr;
 	}
 	else if (expr[0] == '[') {
+		const breakpoint_expr_t *bp_expr = regs ? breakpoint_expr_find(val) : NULL;
+		if (bp_expr && bp_expr->ptr) {
+			return (size_t*)expr_code_eval(bp_expr->ptr, regs);
+		}
+		// eval_expr() stops at the closing bracket, or at the whitespace before it
 		expr_end = eval_expr(expr + 1, ']', (size_t*)&ptr, regs, NULL);
-		if (expr_end && expr_end[0] != '\0') {
+		if (expr_end && (expr_end += strspn(expr_end, " ]"))[0] != '\0') {
 			log_func_printf("Warning: leftover bytes after dereferencing: '%s'\n", expr_end);
 		}
 		return ptr;
@@ -109,7 +238,10 @@ size_t __cdecl breakpoint_process(breakpoint_local_t *bp, size_t cave_addr, x86_
 	// to be able to manipulate it.
 	size_t esp_prev = regs->esp;
 
+	void *bp_prev = tls_slot_get(bp_current.slot);
+	tls_slot_set(bp_current.slot, bp);
 	int cave_exec = bp->func(regs, bp->json_obj);
+	tls_slot_set(bp_current.slot, bp_prev);
 	if(cave_exec) {
 		// Point return address to codecave.
 		regs->retaddr = cave_addr;
@@ -123,6 +255,269 @@ size_t __cdecl breakpoint_process(breakpoint_local_t *bp, size_t cave_addr, x86_
 	return esp_diff;
 }
 
+/// Merged dispatch
+/// ---------------
+typedef size_t (__cdecl *breakpoint_process_func_t)(breakpoint_local_t *bp, size_t cave_addr, x86_reg_t *regs);
+
+// Breakpoints at the same address, sharing a single entry stub and codecave.
+// Like the caves, these stay alive for the lifetime of the process.
+struct breakpoint_group_t {
+	breakpoint_process_func_t process;
+	// In the order they would have run in if chained, i.e. the breakpoint
+	// applied last comes first.
+	std::vector<breakpoint_local_t*> bps;
+};
+
+// Runs every breakpoint of [group] on the same set of registers, just like
+// a chain of separate entry stubs would, and stops at the first one that
+// doesn't want the codecave to be executed.
+static size_t __cdecl breakpoint_process_group(breakpoint_group_t *group, size_t cave_addr, x86_reg_t *regs)
+{
+	const uint32_t retaddr = regs->retaddr;
+	size_t esp_diff = 0;
+	for (breakpoint_local_t *bp : group->bps) {
+		const size_t diff = group->process(bp, cave_addr, regs);
+		regs = (x86_reg_t*)((BYTE*)regs + diff);
+		esp_diff += diff;
+		if (regs->retaddr != cave_addr) {
+			return esp_diff;
+		}
+		regs->retaddr = retaddr;
+	}
+	regs->retaddr = cave_addr;
+	return esp_diff;
+}
+/// ---------------
+
+/// Profiling
+/// ---------
+struct breakpoint_profile_set_t {
+	breakpoint_local_t *bps;
+	size_t count;
+};
+
+struct breakpoint_profile_row_t {
+	const char *name;
+	LONG64 hits;
+	LONG64 cycles;
+	LONG64 cycles_max;
+};
+
+static SRWLOCK bp_profile_srwlock = { SRWLOCK_INIT };
+static std::vector<breakpoint_profile_set_t> bp_profile_sets;
+
+// RDTSC and performance counter values at the start of the current
+// profiling interval, used to convert cycles into milliseconds.
+static uint64_t bp_profile_tsc_start;
+static LARGE_INTEGER bp_profile_qpc_start;
+
+// Cycles spent in all profiled breakpoints, never reset.
+static volatile LONG64 bp_profile_cycles_total = 0;
+
+static HANDLE bp_profile_thread = NULL;
+static HANDLE bp_profile_event_shutdown = NULL;
+
+size_t __cdecl breakpoint_process_profiled(breakpoint_local_t *bp, size_t cave_addr, x86_reg_t *regs)
+{
+	LONGLONG trace_start = trace_event_start(TRACE_BP);
+	uint64_t start = __rdtsc();
+	size_t ret = breakpoint_process(bp, cave_addr, regs);
+	LONG64 cycles = (LONG64)(__rdtsc() - start);
+	trace_event_complete(TRACE_BP, trace_start, bp->name, nullptr);
+
+	breakpoint_profile_t *profile = &bp->profile;
+	InterlockedIncrement64(&profile->hits);
+	InterlockedExchangeAdd64(&profile->cycles, cycles);
+	InterlockedExchangeAdd64(&bp_profile_cycles_total, cycles);
+	LONG64 max_prev = profile->cycles_max;
+	while (cycles > max_prev) {
+		LONG64 max_seen = InterlockedCompareExchange64(&profile->cycles_max, cycles, max_prev);
+		if (max_seen == max_prev) {
+			break;
+		}
+		max_prev = max_seen;
+	}
+	return ret;
+}
+
+LONG64 breakpoint_profile_cycles_total(void)
+{
+	return bp_profile_cycles_total;
+}
+
+static DWORD WINAPI breakpoint_profile_hotkey_thread(void*)
+{
+	bool held = false;
+	while (WaitForSingleObject(bp_profile_event_shutdown, 100) == WAIT_TIMEOUT) {
+		bool pressed = (GetAsyncKeyState(VK_CONTROL) & 0x8000) && (GetAsyncKeyState(VK_F12) & 0x8000);
+		if (pressed && !held) {
+			// GetAsyncKeyState() doesn't care about focus.
+			DWORD pid = 0;
+			GetWindowThreadProcessId(GetForegroundWindow(), &pid);
+			if (pid == GetCurrentProcessId()) {
+				breakpoint_profile_dump();
+			}
+		}
+		held = pressed;
+	}
+	return 0;
+}
+
+static void breakpoint_profile_add(breakpoint_local_t *breakpoints, size_t bp_count)
+{
+	AcquireSRWLockExclusive(&bp_profile_srwlock);
+	if (bp_profile_sets.empty()) {
+		bp_profile_tsc_start = __rdtsc();
+		QueryPerformanceCounter(&bp_profile_qpc_start);
+	}
+	bp_profile_sets.push_back({ breakpoints, bp_count });
+	ReleaseSRWLockExclusive(&bp_profile_srwlock);
+
+	if (!bp_profile_thread) {
+		bp_profile_event_shutdown = CreateEvent(NULL, TRUE, FALSE, NULL);
+		bp_profile_thread = CreateThread(NULL, 0, breakpoint_profile_hotkey_thread, NULL, 0, NULL);
+	}
+}
+
+void breakpoint_profile_dump(void)
+{
+	std::vector<breakpoint_profile_row_t> rows;
+	LONG64 cycles_total = 0;
+
+	AcquireSRWLockExclusive(&bp_profile_srwlock);
+	if (bp_profile_sets.empty()) {
+		ReleaseSRWLockExclusive(&bp_profile_srwlock);
+		return;
+	}
+	uint64_t tsc_now = __rdtsc();
+	LARGE_INTEGER qpc_now;
+	LARGE_INTEGER qpc_freq;
+	QueryPerformanceCounter(&qpc_now);
+	QueryPerformanceFrequency(&qpc_freq);
+	double interval_ms = (double)(qpc_now.QuadPart - bp_profile_qpc_start.QuadPart) * 1000.0 / (double)qpc_freq.QuadPart;
+	double cycles_per_ms = interval_ms > 0.0 ? (double)(tsc_now - bp_profile_tsc_start) / interval_ms : 0.0;
+	bp_profile_tsc_start = tsc_now;
+	bp_profile_qpc_start = qpc_now;
+
+	for (const auto& set : bp_profile_sets) {
+		for (size_t i = 0; i < set.count; i++) {
+			breakpoint_profile_t *profile = &set.bps[i].profile;
+			breakpoint_profile_row_t row;
+			row.name = set.bps[i].name;
+			row.hits = InterlockedExchange64(&profile->hits, 0);
+			row.cycles = InterlockedExchange64(&profile->cycles, 0);
+			row.cycles_max = InterlockedExchange64(&profile->cycles_max, 0);
+			if (row.hits) {
+				cycles_total += row.cycles;
+				rows.push_back(row);
+			}
+		}
+	}
+	ReleaseSRWLockExclusive(&bp_profile_srwlock);
+
+	std::sort(rows.begin(), rows.end(), [](const breakpoint_profile_row_t& a, const breakpoint_profile_row_t& b) {
+		return a.cycles > b.cycles;
+	});
+
+	auto to_ms = [cycles_per_ms](LONG64 cycles) {
+		return cycles_per_ms > 0.0 ? (double)cycles / cycles_per_ms : 0.0;
+	};
+
+	log_printf(
+		"-------------------\n"
+		"Breakpoint profile:\n"
+		"-------------------\n"
+		"%.3f ms of %.0f ms spent in %u breakpoints\n"
+		"      hits    total ms      avg us      max us  name\n",
+		to_ms(cycles_total), interval_ms, (unsigned int)rows.size()
+	);
+
+	std::string csv = "name,hits,cycles,cycles_max,total_ms,avg_us,max_us\n";
+	char line[512];
+	for (const auto& row : rows) {
+		double total_ms = to_ms(row.cycles);
+		double avg_us = total_ms * 1000.0 / (double)row.hits;
+		double max_us = to_ms(row.cycles_max) * 1000.0;
+		log_printf("%10lld %11.3f %11.3f %11.3f  %s\n",
+			row.hits, total_ms, avg_us, max_us, row.name
+		);
+		snprintf(line, sizeof(line), "%s,%lld,%lld,%lld,%.3f,%.3f,%.3f\n",
+			row.name, row.hits, row.cycles, row.cycles_max, total_ms, avg_us, max_us
+		);
+		csv += line;
+	}
+	log_print("-------------------\n");
+
+	const char *thcrap_dir = runconfig_thcrap_dir_get();
+	std::string fn = thcrap_dir ? std::string(thcrap_dir) + "/" : "";
+	fn += "logs/bp_profile.csv";
+	if (file_write(fn.c_str(), csv.data(), csv.size())) {
+		log_printf("(Profile) Couldn't write %s\n", fn.c_str());
+	}
+}
+
+extern "C" void breakpoint_mod_exit(void)
+{
+	breakpoint_profile_dump();
+	if (bp_profile_thread) {
+		SetEvent(bp_profile_event_shutdown);
+		WaitForSingleObject(bp_profile_thread, INFINITE);
+		CloseHandle(bp_profile_thread);
+		CloseHandle(bp_profile_event_shutdown);
+		bp_profile_thread = NULL;
+		bp_profile_event_shutdown = NULL;
+	}
+	AcquireSRWLockExclusive(&bp_profile_srwlock);
+	bp_profile_sets.clear();
+	ReleaseSRWLockExclusive(&bp_profile_srwlock);
+}
+/// ---------
+
+static uint32_t breakpoint_regs_from_json(const char *name, json_t *regs_json)
+{
+	static const struct {
+		const char *name;
+		uint32_t reg;
+	} reg_names[] = {
+		{ "eax", BP_REG_EAX }, { "ax", BP_REG_EAX }, { "al", BP_REG_EAX }, { "ah", BP_REG_EAX },
+		{ "ecx", BP_REG_ECX }, { "cx", BP_REG_ECX }, { "cl", BP_REG_ECX }, { "ch", BP_REG_ECX },
+		{ "edx", BP_REG_EDX }, { "dx", BP_REG_EDX }, { "dl", BP_REG_EDX }, { "dh", BP_REG_EDX },
+		{ "ebx", BP_REG_EBX }, { "bx", BP_REG_EBX }, { "bl", BP_REG_EBX }, { "bh", BP_REG_EBX },
+		{ "esp", BP_REG_ESP }, { "sp", BP_REG_ESP },
+		{ "ebp", BP_REG_EBP }, { "bp", BP_REG_EBP },
+		{ "esi", BP_REG_ESI }, { "si", BP_REG_ESI },
+		{ "edi", BP_REG_EDI }, { "di", BP_REG_EDI },
+		{ "eflags", BP_REG_FLAGS }, { "flags", BP_REG_FLAGS },
+	};
+
+	if (!regs_json) {
+		return BP_REGS_ALL;
+	}
+	if (!json_is_array(regs_json)) {
+		log_printf("breakpoint %s: \"regs\" must be an array, saving all registers\n", name);
+		return BP_REGS_ALL;
+	}
+	uint32_t ret = 0;
+	size_t i;
+	json_t *it;
+	json_array_foreach(regs_json, i, it) {
+		const char *reg = json_string_value(it);
+		uint32_t reg_bit = 0;
+		for (const auto& reg_name : reg_names) {
+			if (reg && !strcmp(reg, reg_name.name)) {
+				reg_bit = reg_name.reg;
+				break;
+			}
+		}
+		if (!reg_bit) {
+			log_printf("breakpoint %s: unknown register in \"regs\", saving all registers\n", name);
+			return BP_REGS_ALL;
+		}
+		ret |= reg_bit;
+	}
+	return ret;
+}
+
 bool breakpoint_from_json(const char *name, json_t *in, breakpoint_local_t *out) {
 	if (!json_is_object(in)) {
 		log_printf("breakpoint %s: not an object\n", name);
@@ -161,6 +556,19 @@ bool breakpoint_from_json(const char *name, json_t *in, breakpoint_local_t *out)
 	out->json_obj = json_incref(in);
 	out->func = nullptr;
 	out->addr = addrs;
+	out->schema = nullptr;
+	out->params = nullptr;
+	out->regs = breakpoint_regs_from_json(name, json_object_get(in, "regs"));
+	memset(&out->profile, 0, sizeof(out->profile));
+
+	std::vector<breakpoint_expr_t> exprs;
+	breakpoint_exprs_compile(in, exprs);
+	out->expr_count = exprs.size();
+	out->exprs = nullptr;
+	if (!exprs.empty()) {
+		out->exprs = (breakpoint_expr_t*)malloc(exprs.size() * sizeof(breakpoint_expr_t));
+		memcpy(out->exprs, exprs.data(), exprs.size() * sizeof(breakpoint_expr_t));
+	}
 
 	return true;
 }
@@ -182,9 +590,8 @@ static inline void __fastcall cave_fix(BYTE *cave, BYTE *bp_addr)
 	/// ------------------
 }
 
-static bool __fastcall breakpoint_local_init(
-	breakpoint_local_t *bp_local
-) {
+bool breakpoint_local_init(breakpoint_local_t *bp_local)
+{
 
 	const char *const key = bp_local->name;
 	// Multi-slot support
@@ -204,6 +611,14 @@ static bool __fastcall breakpoint_local_init(
 	if (!func_found) {
 		hackpoints_error_function_not_found(bp_key, 0);
 	}
+	else if (!bp_local->params) {
+		auto schema = breakpoint_schemas.find(bp_key);
+		if (schema != breakpoint_schemas.end()) {
+			bp_local->schema = schema->second.params;
+			bp_local->params = (breakpoint_param_t*)malloc(schema->second.count * sizeof(breakpoint_param_t));
+			breakpoint_params_resolve(bp_local->name, bp_local->json_obj, schema->second.params, schema->second.count, bp_local->params);
+		}
+	}
 	VLA_FREE(bp_key);
 	return func_found;
 }
@@ -220,6 +635,70 @@ static const size_t bp_entry_cave = &bp_entry_caveptr + 1 - (uint8_t*)&bp_entry;
 static const size_t bp_entry_local = &bp_entry_localptr + 1 - (uint8_t*)&bp_entry;
 static const size_t bp_entry_call = &bp_entry_callptr + 1 - (uint8_t*)&bp_entry;
 
+// Renders an entry stub for a breakpoint that declared the registers it
+// uses into [stub], which must be at least bp_entry_size bytes large.
+// It builds the same x86_reg_t as bp_entry, but replaces POPFD and POPAD,
+// the two expensive instructions on the way out, wherever possible.
+static void breakpoint_entry_render(BYTE *stub, uint32_t regs, size_t cave, const void *bp, size_t process_func)
+{
+	BYTE *p = stub;
+	*p++ = 0x60; // PUSHAD
+	// The slot is still needed for the structure layout.
+	*p++ = (regs & BP_REG_FLAGS) ? 0x9C : 0x50; // PUSHFD / PUSH EAX
+	*p++ = 0xFC; // CLD
+	*p++ = 0x54; // PUSH ESP
+	*p++ = 0x68; // PUSH cave
+	*(size_t*)p = cave;
+	p += sizeof(size_t);
+	*p++ = 0x68; // PUSH bp
+	*(const void**)p = bp;
+	p += sizeof(void*);
+	*p++ = x86_CALL_NEAR_REL32;
+	*(size_t*)p = process_func - ((size_t)p + sizeof(size_t));
+	p += sizeof(size_t);
+	// LEA ESP, [ESP+EAX+0xC]
+	*p++ = 0x8D; *p++ = 0x64; *p++ = 0x04; *p++ = 0x0C;
+	// POPFD / POP ECX, which gets its real value back below
+	*p++ = (regs & BP_REG_FLAGS) ? 0x9D : 0x59;
+	if (regs & (BP_REG_EBX | BP_REG_EBP | BP_REG_ESI | BP_REG_EDI)) {
+		*p++ = 0x61; // POPAD
+	} else {
+		// EBX, EBP, ESI and EDI are preserved by the breakpoint function
+		// itself, only the caller-saved registers need to be restored.
+		*p++ = 0x83; *p++ = 0xC4; *p++ = 0x14; // ADD ESP, 0x14
+		*p++ = 0x5A; // POP EDX
+		*p++ = 0x59; // POP ECX
+		*p++ = 0x58; // POP EAX
+	}
+	*p++ = 0xC3; // RET
+	assert((size_t)(p - stub) <= bp_entry_size);
+}
+
+// Translates the precompiled expressions of every rendered breakpoint into
+// native code, which becomes executable with the cave_arena_seal() below.
+static void breakpoints_jit(breakpoint_local_t *breakpoints, size_t bp_count, const size_t *breakpoint_total_size)
+{
+	size_t jit_count = 0;
+	size_t expr_count = 0;
+	for (size_t i = 0; i < bp_count; ++i) {
+		if (!breakpoint_total_size[i]) {
+			continue;
+		}
+		const breakpoint_local_t *const cur = &breakpoints[i];
+		for (size_t j = 0; j < cur->expr_count; ++j) {
+			for (expr_code_t *code : { cur->exprs[j].imm, cur->exprs[j].ptr }) {
+				if (code) {
+					expr_count++;
+					jit_count += expr_code_jit(code);
+				}
+			}
+		}
+	}
+	if (expr_count) {
+		log_printf("\nCompiled %u of %u breakpoint expressions to native code.\n", jit_count, expr_count);
+	}
+}
+
 int breakpoints_apply(breakpoint_local_t *breakpoints, size_t bp_count, HMODULE hMod)
 {
 	if(!breakpoints || !bp_count) {
@@ -275,30 +754,81 @@ int breakpoints_apply(breakpoint_local_t *breakpoints, size_t bp_count, HMODULE
 			}
 			++cur_valid_addrs;
 			log_printf("OK");
-			sourcecaves_total_size += AlignUpToMultipleOf2(cavesize + CALL_LEN, 16);
-			//breakpoint_total_size[i] = AlignUpToMultipleOf2(cavesize + CALL_LEN, 16);
-			//sourcecaves_total_size += breakpoint_total_size[i];
+			sourcecaves_total_size += AlignUpToMultipleOf2(cavesize + CALL_LEN, CAVE_ARENA_ALIGN);
 		}
 
 		if (!cur_valid_addrs) {
 			continue;
 		}
-		breakpoint_total_size[i] = AlignUpToMultipleOf2(cavesize + CALL_LEN, 16);
+		breakpoint_total_size[i] = AlignUpToMultipleOf2(cavesize + CALL_LEN, CAVE_ARENA_ALIGN);
 		total_valid_addrs += cur_valid_addrs;
 		
 		++valid_breakpoint_count;
 	}
+	sigscan_cache_store();
+
+	// Breakpoints sharing an address and a cave size are merged into a
+	// single stub that saves the registers once, rather than having each
+	// one chained behind the cave of the next. The group is rendered at the
+	// last of these breakpoints, which would have ended up on top.
+	const bool profile = runconfig_bp_profile_get();
+	const bool trace = trace_event_enabled(TRACE_BP);
+	auto *const process_func = (profile || trace) ? &breakpoint_process_profiled : &breakpoint_process;
+
+	std::unordered_map<size_t, std::vector<size_t>> addr_bps;
+	for (size_t i = 0; i < bp_count; ++i) {
+		if (!breakpoint_total_size[i]) {
+			continue;
+		}
+		size_t addr;
+		for (hackpoint_addr_t* cur_addr = breakpoints[i].addr;
+			 eval_hackpoint_addr(cur_addr, &addr, hMod);
+			 ++cur_addr) {
+			if (addr) {
+				addr_bps[addr].push_back(i);
+			}
+		}
+	}
+	struct breakpoint_group_slot_t {
+		size_t owner;
+		breakpoint_group_t *group;
+	};
+	std::unordered_map<size_t, breakpoint_group_slot_t> groups;
+	for (auto& [addr, indices] : addr_bps) {
+		if (indices.size() < 2) {
+			continue;
+		}
+		const size_t cavesize = breakpoints[indices[0]].cavesize;
+		if (!std::all_of(indices.begin(), indices.end(), [&](size_t i) {
+			return breakpoints[i].cavesize == cavesize;
+		})) {
+			continue;
+		}
+		auto *group = new breakpoint_group_t;
+		group->process = process_func;
+		for (auto it = indices.rbegin(); it != indices.rend(); ++it) {
+			group->bps.push_back(&breakpoints[*it]);
+		}
+		groups[addr] = { indices.back(), group };
+		// Only one entry stub and codecave are needed for all of them.
+		total_valid_addrs -= indices.size() - 1;
+		sourcecaves_total_size -= (indices.size() - 1) * breakpoint_total_size[indices[0]];
+	}
 
 	if (!total_valid_addrs) {
 		log_printf("No breakpoints to render.\n");
 		return 0;
 	}
 
-	uint8_t *const cave_source = (BYTE*)VirtualAlloc(0, sourcecaves_total_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-	memset(cave_source, x86_INT3, sourcecaves_total_size);
+	// The arena already fills everything with INT3.
+	uint8_t *const cave_source = cave_arena_alloc(sourcecaves_total_size, EXECUTE, hMod);
 
 	const size_t callcaves_total_size = total_valid_addrs * bp_entry_size;
-	uint8_t *const cave_call = (BYTE*)VirtualAlloc(0, callcaves_total_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	uint8_t *const cave_call = cave_arena_alloc(callcaves_total_size, EXECUTE, hMod);
+	if (!cave_source || !cave_call) {
+		VLA_FREE(breakpoint_total_size);
+		return bp_count;
+	}
 
 	for (uint8_t *callcave_fill = cave_call, *const callcave_fill_end = cave_call + callcaves_total_size;
 		 callcave_fill < callcave_fill_end;
@@ -315,6 +845,11 @@ int breakpoints_apply(breakpoint_local_t *breakpoints, size_t bp_count, HMODULE
 
 	BYTE *sourcecave_p = cave_source;
 	BYTE *callcave_p = cave_call;
+	cave_arena_name(cave_call, callcaves_total_size, "breakpoint entry");
+
+	if (profile) {
+		breakpoint_profile_add(breakpoints, bp_count);
+	}
 
 	size_t current_asm_buf_size = BINHACK_BUFSIZE_MIN;
 	BYTE* asm_buf = (BYTE*)malloc(BINHACK_BUFSIZE_MIN);
@@ -352,9 +887,31 @@ int breakpoints_apply(breakpoint_local_t *breakpoints, size_t bp_count, HMODULE
 					continue;
 				}
 
-				PatchBPEntryInst(callcave_p, bp_entry_cave, size_t, sourcecave_p);
-				PatchBPEntryInst(callcave_p, bp_entry_local, const breakpoint_local_t*, cur);
-				PatchBPEntryInst(callcave_p, bp_entry_call, size_t, (size_t)&breakpoint_process - (size_t)bp_instance_ptr - sizeof(void*));
+				auto group_it = groups.find(addr);
+				if (group_it != groups.end()) {
+					if (group_it->second.owner != i) {
+						continue;
+					}
+					const breakpoint_group_t *group = group_it->second.group;
+					log_printf("merging %u breakpoints at 0x%p\n", (unsigned int)group->bps.size(), addr);
+					uint32_t regs = 0;
+					for (const breakpoint_local_t *bp : group->bps) {
+						regs |= bp->regs;
+					}
+					if (regs != BP_REGS_ALL) {
+						breakpoint_entry_render(callcave_p, regs, (size_t)sourcecave_p, group, (size_t)&breakpoint_process_group);
+					} else {
+						PatchBPEntryInst(callcave_p, bp_entry_cave, size_t, sourcecave_p);
+						PatchBPEntryInst(callcave_p, bp_entry_local, const breakpoint_group_t*, group);
+						PatchBPEntryInst(callcave_p, bp_entry_call, size_t, (size_t)&breakpoint_process_group - (size_t)bp_instance_ptr - sizeof(void*));
+					}
+				} else if (cur->regs != BP_REGS_ALL) {
+					breakpoint_entry_render(callcave_p, cur->regs, (size_t)sourcecave_p, cur, (size_t)process_func);
+				} else {
+					PatchBPEntryInst(callcave_p, bp_entry_cave, size_t, sourcecave_p);
+					PatchBPEntryInst(callcave_p, bp_entry_local, const breakpoint_local_t*, cur);
+					PatchBPEntryInst(callcave_p, bp_entry_call, size_t, (size_t)process_func - (size_t)bp_instance_ptr - sizeof(void*));
+				}
 
 				// CALL bp_entry
 				const size_t bp_dist = (size_t)callcave_p - (addr + CALL_LEN);
@@ -373,16 +930,18 @@ int breakpoints_apply(breakpoint_local_t *breakpoints, size_t bp_count, HMODULE
 				*(size_t*)&sourcecave_p[cavesize + 1] = cave_dist;
 
 				PatchRegion((void*)addr, NULL, asm_buf, cavesize);
+				cave_arena_name(sourcecave_p, breakpoint_total_size[i], cur->name);
 				sourcecave_p += breakpoint_total_size[i];
 			}
 		}
 	}
 	free(asm_buf);
+	if (runconfig_expr_jit_get()) {
+		breakpoints_jit(breakpoints, bp_count, breakpoint_total_size);
+	}
 	VLA_FREE(breakpoint_total_size);
 
-	DWORD idgaf;
-	VirtualProtect(cave_source, sourcecaves_total_size, PAGE_EXECUTE, &idgaf);
-	VirtualProtect(cave_call, callcaves_total_size, PAGE_EXECUTE, &idgaf);
+	cave_arena_seal();
 
 	return bp_count - valid_breakpoint_count;
 }
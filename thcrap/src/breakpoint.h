@@ -32,6 +32,86 @@
   */
 typedef int (__cdecl *BreakpointFunc_t)(x86_reg_t *regs, json_t *bp_info);
 
+/**
+  * Breakpoint parameter schemas.
+  * A breakpoint function can declare the parameters it reads from [bp_info]
+  * with breakpoint_schema_register(). The JSON lookups and type checks for
+  * them then only run once in breakpoints_apply(), and the function gets the
+  * resolved values from breakpoint_params_get() on every hit.
+  */
+typedef enum {
+	// String, to be read with json_pointer_value()
+	BP_PARAM_POINTER,
+
+	// String or integer, to be read with json_immediate_value()
+	BP_PARAM_IMMEDIATE,
+
+	// String, to be read with json_register_pointer()
+	BP_PARAM_REGISTER,
+
+	// Constant, resolved once with json_hex_value()
+	BP_PARAM_HEX
+} breakpoint_param_type_t;
+
+typedef struct {
+	const char *key;
+	breakpoint_param_type_t type;
+} breakpoint_param_desc_t;
+
+// Resolved value of a parameter. [hex] is used for BP_PARAM_HEX,
+// [val] for everything else.
+typedef union {
+	json_t *val;
+	size_t hex;
+} breakpoint_param_t;
+
+// Precompiled forms of an expression string in a breakpoint's JSON object.
+typedef struct {
+	const json_t *val;
+
+	// The whole string, as evaluated by json_immediate_value()
+	expr_code_t *imm;
+
+	// The string without its top-level dereferencing, as evaluated
+	// by json_pointer_value()
+	expr_code_t *ptr;
+} breakpoint_expr_t;
+
+// Hit counters for a breakpoint, only updated if the "bp_profile" run
+// configuration option was enabled when the breakpoints were applied.
+typedef struct {
+	LONG64 hits;
+	// Cycles spent in the breakpoint function, as measured by RDTSC
+	LONG64 cycles;
+	LONG64 cycles_max;
+} breakpoint_profile_t;
+
+/**
+  * Register subsets.
+  * By default, the entry stub of a breakpoint restores every register and
+  * the flags from [regs] once the breakpoint function returns. A breakpoint
+  * can instead list the registers its function reads or writes in a "regs"
+  * array, using their expression names ("eax", "cl", "flags", ...), and gets
+  * a stub that skips the expensive parts of that:
+  * • All registers can still be read, but writes to an unlisted EBX, EBP,
+  *   ESI or EDI are lost.
+  * • Unless "flags" is listed, the flags are neither readable nor preserved
+  *   across the breakpoint, so it must only be used where the game code
+  *   doesn't depend on them.
+  */
+typedef enum {
+	BP_REG_EAX = 1 << 0,
+	BP_REG_ECX = 1 << 1,
+	BP_REG_EDX = 1 << 2,
+	BP_REG_EBX = 1 << 3,
+	BP_REG_ESP = 1 << 4,
+	BP_REG_EBP = 1 << 5,
+	BP_REG_ESI = 1 << 6,
+	BP_REG_EDI = 1 << 7,
+	BP_REG_FLAGS = 1 << 8,
+	BP_REGS_ALL = (1 << 9) - 1
+} breakpoint_reg_t;
+
 // Represents a breakpoint.
 typedef struct {
 	/**
@@ -62,6 +142,22 @@ typedef struct {
 
 	// Function to be called when the breakpoint is hit
 	BreakpointFunc_t func;
+
+	// Expression strings in [json_obj], compiled by breakpoint_from_json()
+	// so that they don't have to be parsed again on every hit.
+	breakpoint_expr_t *exprs;
+	size_t expr_count;
+
+	// Parameter schema registered for [func], and the values
+	// of its parameters in [json_obj]
+	const breakpoint_param_desc_t *schema;
+	breakpoint_param_t *params;
+
+	// Registers declared in the "regs" array of [json_obj],
+	// or BP_REGS_ALL if there is none
+	uint32_t regs;
+
+	breakpoint_profile_t profile;
 } breakpoint_local_t;
 
 typedef struct {
@@ -100,6 +196,36 @@ size_t json_object_get_immediate(json_t *object, x86_reg_t *regs, const char *ke
 // Parses a json breakpoint entry and returns a breakpoint object
 bool breakpoint_from_json(const char *name, json_t *in, breakpoint_local_t *out);
 
+// Looks up the function of a breakpoint created by breakpoint_from_json(),
+// and resolves its parameter schema. Done for every breakpoint by
+// breakpoints_apply(), and only needs to be called separately to run
+// breakpoints through breakpoint_process() without applying them.
+// Returns false if the function doesn't exist.
+bool breakpoint_local_init(breakpoint_local_t *bp_local);
+
+// Performs breakpoint invocation and stack adjustments, as done by bp_entry
+// whenever a breakpoint is hit. [regs->retaddr] is set to [cave_addr] if the
+// codecave should be executed. Returns the number of bytes the stack has to
+// be moved downwards by bp_entry. [regs] itself is moved by that amount as
+// well, and therefore has to be followed by enough writable memory.
+size_t __cdecl breakpoint_process(breakpoint_local_t *bp_local, size_t cave_addr, x86_reg_t *regs);
+
+// Frees everything breakpoint_from_json() and breakpoints_apply()
+// precomputed for [bp].
+void breakpoint_cache_free(breakpoint_local_t *bp);
+
+// Registers the [count] parameters in [schema] for the breakpoint function
+// [func_name] (including the "BP_" prefix). [schema] must stay valid for as
+// long as the function can be called.
+void breakpoint_schema_register(const char *func_name, const breakpoint_param_desc_t *schema, size_t count);
+
+// Returns the parameters in [schema] for [bp_info], in the same order.
+// These are the values resolved in breakpoints_apply() if the breakpoint
+// function running on this thread was registered with [schema] and called
+// with [bp_info]. Otherwise, they're looked up into [params_buf], which
+// must hold [count] elements.
+const breakpoint_param_t* breakpoint_params_get(json_t *bp_info, const breakpoint_param_desc_t *schema, size_t count, breakpoint_param_t *params_buf);
+
 // Returns 0 if "cave_exec" in [bp_info] is set to false, 1 otherwise.
 // Should be used as the return value for a breakpoint function after it made
 // changes to a register which could require original code to be skipped
@@ -111,6 +237,17 @@ int breakpoint_cave_exec_flag(json_t *bp_info);
 // for relative addresses.
 int breakpoints_apply(breakpoint_local_t *breakpoints, size_t breakpoints_count, HMODULE hMod);
 
+// Writes the breakpoint profile collected since the last call to the log
+// and to logs/bp_profile.csv, sorted by the total time spent in each
+// breakpoint, and resets all counters. Does nothing unless "bp_profile"
+// is enabled in the run configuration.
+// Also done on exit and whenever Ctrl+F12 is pressed.
+void breakpoint_profile_dump(void);
+
+// Returns the RDTSC cycles spent in all profiled breakpoints since startup.
+// Unlike the counters of every single breakpoint, this is never reset.
+LONG64 breakpoint_profile_cycles_total(void);
+
 // Removes all breakpoints in the given set.
 // TODO: Implement!
 // int breakpoints_remove();
@@ -0,0 +1,199 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Pool of large buffers.
+  */
+
+#include "thcrap.h"
+#include <unordered_map>
+#include <vector>
+
+// Smallest and largest size class, as powers of two. Anything larger is
+// still allocated with VirtualAlloc(), but never kept for reuse.
+#define BUFFER_POOL_CLASS_MIN 16 // 64 KiB, the allocation granularity
+#define BUFFER_POOL_CLASS_MAX 26 // 64 MiB
+#define BUFFER_POOL_CLASSES (BUFFER_POOL_CLASS_MAX - BUFFER_POOL_CLASS_MIN + 1)
+
+// Maximum total size of the free buffers that are kept for reuse. They also
+// count against the shared cache budget, and are the first thing to go.
+#define BUFFER_POOL_RETAIN (24 * 1024 * 1024)
+
+static SRWLOCK pool_srwlock = { SRWLOCK_INIT };
+// Capacity of every buffer handed out by the pool.
+static std::unordered_map<const void *, size_t> pool_live;
+static std::vector<void *> pool_free[BUFFER_POOL_CLASSES];
+static size_t pool_free_size = 0;
+static cache_mgr_entry_t *pool_cache_mgr = NULL;
+
+// Returns the size class index for [size], or -1 if it's larger than the
+// largest class.
+static int buffer_pool_class(size_t size)
+{
+	int shift = BUFFER_POOL_CLASS_MIN;
+	while(((size_t)1 << shift) < size) {
+		if(++shift > BUFFER_POOL_CLASS_MAX) {
+			return -1;
+		}
+	}
+	return shift - BUFFER_POOL_CLASS_MIN;
+}
+
+static size_t buffer_pool_class_size(int cls)
+{
+	return (size_t)1 << (cls + BUFFER_POOL_CLASS_MIN);
+}
+
+// Releases free buffers, largest first, until at least [bytes] bytes are
+// returned to the OS.
+static size_t buffer_pool_evict(size_t bytes)
+{
+	std::vector<void *> released;
+	size_t ret = 0;
+	AcquireSRWLockExclusive(&pool_srwlock);
+	for(int cls = BUFFER_POOL_CLASSES - 1; cls >= 0 && ret < bytes; cls--) {
+		const size_t capacity = buffer_pool_class_size(cls);
+		while(!pool_free[cls].empty() && ret < bytes) {
+			released.push_back(pool_free[cls].back());
+			pool_free[cls].pop_back();
+			ret += capacity;
+		}
+	}
+	pool_free_size -= ret;
+	memstats_remove(MEMSTATS_POOL, ret);
+	cache_mgr_remove(pool_cache_mgr, ret);
+	ReleaseSRWLockExclusive(&pool_srwlock);
+	for(void *buf : released) {
+		VirtualFree(buf, 0, MEM_RELEASE);
+	}
+	return ret;
+}
+
+static void buffer_pool_register(void)
+{
+	static cache_mgr_entry_t *mgr = pool_cache_mgr = cache_mgr_register("Buffer pool", 1, buffer_pool_evict);
+	(void)mgr;
+}
+
+void* buffer_pool_alloc(size_t size)
+{
+	if(size < ((size_t)1 << BUFFER_POOL_CLASS_MIN)) {
+		return malloc(size ? size : 1);
+	}
+	buffer_pool_register();
+	const int cls = buffer_pool_class(size);
+	size_t capacity = size;
+	void *ret = NULL;
+	if(cls >= 0) {
+		capacity = buffer_pool_class_size(cls);
+		AcquireSRWLockExclusive(&pool_srwlock);
+		if(!pool_free[cls].empty()) {
+			ret = pool_free[cls].back();
+			pool_free[cls].pop_back();
+			pool_free_size -= capacity;
+			memstats_remove(MEMSTATS_POOL, capacity);
+			cache_mgr_remove(pool_cache_mgr, capacity);
+			pool_live[ret] = capacity;
+		}
+		ReleaseSRWLockExclusive(&pool_srwlock);
+		if(ret) {
+			return ret;
+		}
+	}
+	ret = VirtualAlloc(NULL, capacity, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if(!ret && cache_mgr_reclaim(capacity)) {
+		ret = VirtualAlloc(NULL, capacity, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+	if(!ret) {
+		// The heap might still have a large enough hole.
+		return malloc(size);
+	}
+	AcquireSRWLockExclusive(&pool_srwlock);
+	pool_live[ret] = capacity;
+	ReleaseSRWLockExclusive(&pool_srwlock);
+	return ret;
+}
+
+size_t buffer_pool_capacity(const void *buf)
+{
+	size_t ret = 0;
+	if(buf) {
+		AcquireSRWLockShared(&pool_srwlock);
+		auto it = pool_live.find(buf);
+		if(it != pool_live.end()) {
+			ret = it->second;
+		}
+		ReleaseSRWLockShared(&pool_srwlock);
+	}
+	return ret;
+}
+
+void* buffer_pool_realloc(void *buf, size_t size)
+{
+	if(!buf) {
+		return buffer_pool_alloc(size);
+	}
+	size_t old_size = buffer_pool_capacity(buf);
+	if(old_size >= size) {
+		return buf;
+	}
+	if(!old_size) {
+		if(size < ((size_t)1 << BUFFER_POOL_CLASS_MIN)) {
+			return realloc(buf, size);
+		}
+		old_size = _msize(buf);
+	}
+	void *ret = buffer_pool_alloc(size);
+	if(ret) {
+		memcpy(ret, buf, MIN(old_size, size));
+		buffer_pool_free(buf);
+	}
+	return ret;
+}
+
+void buffer_pool_free(void *buf)
+{
+	if(!buf) {
+		return;
+	}
+	AcquireSRWLockExclusive(&pool_srwlock);
+	auto it = pool_live.find(buf);
+	if(it == pool_live.end()) {
+		ReleaseSRWLockExclusive(&pool_srwlock);
+		free(buf);
+		return;
+	}
+	const size_t capacity = it->second;
+	pool_live.erase(it);
+	const int cls = buffer_pool_class(capacity);
+	bool keep = cls >= 0 && pool_free_size + capacity <= BUFFER_POOL_RETAIN;
+	if(keep) {
+		pool_free[cls].push_back(buf);
+		pool_free_size += capacity;
+		memstats_add(MEMSTATS_POOL, capacity);
+		cache_mgr_add(pool_cache_mgr, capacity);
+	}
+	ReleaseSRWLockExclusive(&pool_srwlock);
+	if(!keep) {
+		VirtualFree(buf, 0, MEM_RELEASE);
+	} else {
+		cache_mgr_trim();
+	}
+}
+
+void buffer_pool_mod_exit(void)
+{
+	AcquireSRWLockExclusive(&pool_srwlock);
+	for(auto &list : pool_free) {
+		for(void *buf : list) {
+			VirtualFree(buf, 0, MEM_RELEASE);
+		}
+		list.clear();
+	}
+	memstats_remove(MEMSTATS_POOL, pool_free_size);
+	cache_mgr_remove(pool_cache_mgr, pool_free_size);
+	pool_free_size = 0;
+	ReleaseSRWLockExclusive(&pool_srwlock);
+}
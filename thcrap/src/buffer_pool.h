@@ -0,0 +1,36 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Pool of large buffers.
+  *
+  * Replacement files and decoded images are multi-megabyte blocks that only
+  * live for a short time. Allocating them on the CRT heap over and over
+  * fragments a 32-bit address space over a long session, so they come from
+  * their own VirtualAlloc() regions instead. Sizes are rounded up to powers
+  * of two, and freed regions are kept around for reuse up to a limit, so
+  * that most allocations after the first few don't touch the address space
+  * at all. Sizes below the smallest class just go through malloc().
+  */
+
+#pragma once
+
+// Returns a buffer of at least [size] bytes, or NULL on failure. Has to be
+// released with buffer_pool_free().
+void* buffer_pool_alloc(size_t size);
+
+// Grows or shrinks [buf] to at least [size] bytes, keeping its contents, and
+// returns the new buffer, which might be [buf] itself if it's large
+// enough already. [buf] can also be NULL, or a block from malloc(), which
+// is then freed. Returns NULL on failure, leaving [buf] untouched.
+void* buffer_pool_realloc(void *buf, size_t size);
+
+// Releases [buf], which can also come from malloc().
+void buffer_pool_free(void *buf);
+
+// Returns the usable size of [buf], or 0 if it didn't come from the pool.
+size_t buffer_pool_capacity(const void *buf);
+
+void buffer_pool_mod_exit(void);
@@ -0,0 +1,154 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Shared memory budget for in-memory caches.
+  */
+
+#include "thcrap.h"
+
+#define CACHE_MGR_MAX 16
+// Trimming evicts down to this fraction of the budget, so that the next
+// insertion doesn't immediately trigger another round.
+#define CACHE_MGR_TRIM_TARGET(budget) ((budget) / 8 * 7)
+
+struct cache_mgr_entry_t {
+	const char *name;
+	unsigned int cost;
+	cache_mgr_evict_t evict;
+	volatile LONG size;
+	// GetTickCount() of the last hit or insertion
+	volatile LONG last_use;
+};
+
+static cache_mgr_entry_t cache_mgr_caches[CACHE_MGR_MAX];
+static volatile LONG cache_mgr_count = 0;
+static volatile LONG cache_mgr_total = 0;
+static volatile LONG cache_mgr_trimming = 0;
+static SRWLOCK cache_mgr_srwlock = { SRWLOCK_INIT };
+
+cache_mgr_entry_t* cache_mgr_register(const char *name, unsigned int cost, cache_mgr_evict_t evict)
+{
+	cache_mgr_entry_t *ret = NULL;
+	AcquireSRWLockExclusive(&cache_mgr_srwlock);
+	if(cache_mgr_count < CACHE_MGR_MAX) {
+		ret = &cache_mgr_caches[cache_mgr_count];
+		ret->name = name;
+		ret->cost = cost ? cost : 1;
+		ret->evict = evict;
+		ret->size = 0;
+		ret->last_use = (LONG)GetTickCount();
+		// Published last, since evicting threads don't take the lock.
+		InterlockedIncrement(&cache_mgr_count);
+	}
+	ReleaseSRWLockExclusive(&cache_mgr_srwlock);
+	return ret;
+}
+
+void cache_mgr_add(cache_mgr_entry_t *cache, size_t size)
+{
+	if(cache) {
+		InterlockedExchangeAdd(&cache->size, (LONG)size);
+		InterlockedExchangeAdd(&cache_mgr_total, (LONG)size);
+		cache->last_use = (LONG)GetTickCount();
+	}
+}
+
+void cache_mgr_remove(cache_mgr_entry_t *cache, size_t size)
+{
+	if(cache) {
+		InterlockedExchangeAdd(&cache->size, -(LONG)size);
+		InterlockedExchangeAdd(&cache_mgr_total, -(LONG)size);
+	}
+}
+
+void cache_mgr_touch(cache_mgr_entry_t *cache)
+{
+	if(cache) {
+		cache->last_use = (LONG)GetTickCount();
+	}
+}
+
+size_t cache_mgr_budget(void)
+{
+	return (size_t)runconfig_cache_budget_get() * 1024 * 1024;
+}
+
+// Returns the cache that should be evicted from next, skipping the ones in
+// the [exhausted] bitmask, or -1 if there is none.
+static int cache_mgr_victim(uint32_t exhausted)
+{
+	const DWORD now = GetTickCount();
+	const LONG count = cache_mgr_count;
+	int ret = -1;
+	double ret_score = 0;
+	for(LONG i = 0; i < count; i++) {
+		const cache_mgr_entry_t &cache = cache_mgr_caches[i];
+		if((exhausted & (1u << i)) || cache.size <= 0) {
+			continue;
+		}
+		// Large, idle and cheap caches go first.
+		const double idle = (double)(DWORD)(now - (DWORD)cache.last_use) + 1000.0;
+		const double score = (double)cache.size * idle / cache.cost;
+		if(score > ret_score) {
+			ret = i;
+			ret_score = score;
+		}
+	}
+	return ret;
+}
+
+// Evicts from the caches until their total drops to [target] or nothing is
+// left to evict, and returns the number of bytes released.
+static size_t cache_mgr_evict_until(size_t target)
+{
+	size_t ret = 0;
+	uint32_t exhausted = 0;
+	while((size_t)cache_mgr_total > target) {
+		const int victim = cache_mgr_victim(exhausted);
+		if(victim < 0) {
+			break;
+		}
+		cache_mgr_entry_t &cache = cache_mgr_caches[victim];
+		const size_t excess = (size_t)cache_mgr_total - target;
+		const size_t released = cache.evict(MIN(excess, (size_t)cache.size));
+		if(!released) {
+			exhausted |= 1u << victim;
+		}
+		ret += released;
+	}
+	return ret;
+}
+
+void cache_mgr_trim(void)
+{
+	const size_t budget = cache_mgr_budget();
+	if(!budget || (size_t)cache_mgr_total <= budget) {
+		return;
+	}
+	if(InterlockedCompareExchange(&cache_mgr_trimming, 1, 0) != 0) {
+		return;
+	}
+	cache_mgr_evict_until(CACHE_MGR_TRIM_TARGET(budget));
+	InterlockedExchange(&cache_mgr_trimming, 0);
+}
+
+size_t cache_mgr_reclaim(size_t bytes)
+{
+	const size_t total = (size_t)cache_mgr_total;
+	const size_t released = cache_mgr_evict_until(total > bytes ? total - bytes : 0);
+	log_printf("(Cache manager) Low on memory, released %zu of %zu requested bytes\n", released, bytes);
+	return released;
+}
+
+void cache_mgr_print(void)
+{
+	const LONG count = cache_mgr_count;
+	log_printf("Caches (budget: %.2f MiB):\n", cache_mgr_budget() / (1024.0 * 1024.0));
+	for(LONG i = 0; i < count; i++) {
+		const cache_mgr_entry_t &cache = cache_mgr_caches[i];
+		log_printf("  %-16s %9.2f MiB (cost %u)\n", cache.name, cache.size / (1024.0 * 1024.0), cache.cost);
+	}
+}
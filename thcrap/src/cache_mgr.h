@@ -0,0 +1,57 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Shared memory budget for in-memory caches.
+  *
+  * Every cache that holds on to memory only to save work later registers
+  * here, reports the size of its entries, and provides a callback that
+  * evicts its least recently used ones. Whenever the total of all caches
+  * exceeds the "cache_budget" from the run configuration, the manager asks
+  * the caches to evict, starting with the one whose memory is the cheapest
+  * to rebuild relative to its size and how long ago it was last used.
+  * The same happens when an allocation for a replacement file fails.
+  */
+
+#pragma once
+
+typedef struct cache_mgr_entry_t cache_mgr_entry_t;
+
+// Evicts the cache's least recently used entries until at least [bytes]
+// bytes were released or the cache is empty, and returns the number of
+// bytes released. Called from any thread, without any of the manager's
+// locks held.
+typedef size_t (*cache_mgr_evict_t)(size_t bytes);
+
+// Registers the cache [name]. [cost] is the relative cost of rebuilding one
+// byte of it, 1 being something that is just read from a file again.
+// Caches are never unregistered.
+cache_mgr_entry_t* cache_mgr_register(const char *name, unsigned int cost, cache_mgr_evict_t evict);
+
+// Adds or removes [size] bytes to or from the size of [cache]. Only updates
+// the accounting, and can be called with the cache's own lock held.
+void cache_mgr_add(cache_mgr_entry_t *cache, size_t size);
+void cache_mgr_remove(cache_mgr_entry_t *cache, size_t size);
+
+// Records a hit in [cache].
+void cache_mgr_touch(cache_mgr_entry_t *cache);
+
+// Returns the budget for all caches together in bytes, or 0 if there is
+// none.
+size_t cache_mgr_budget(void);
+
+// Evicts entries until all caches fit into the budget. Caches call this
+// after cache_mgr_add(), once they have released any lock that their evict
+// function takes. Returns immediately if another thread is already
+// trimming.
+void cache_mgr_trim(void);
+
+// Evicts at least [bytes] bytes from the caches, regardless of the budget,
+// to make room for an allocation that failed. Returns the number of bytes
+// actually released.
+size_t cache_mgr_reclaim(size_t bytes);
+
+// Logs the size of every registered cache.
+void cache_mgr_print(void);
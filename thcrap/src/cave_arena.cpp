@@ -0,0 +1,212 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Shared memory arena for codecaves, breakpoint caves and plugin stubs.
+  */
+
+#include "thcrap.h"
+#include <map>
+#include <string>
+#include <vector>
+
+struct cave_chunk_t {
+	BYTE *base;
+	size_t size;
+	size_t used;
+	// Bytes actually requested by callers, without alignment padding
+	size_t requested;
+	CodecaveAccessType access;
+	bool sealed;
+};
+
+struct cave_label_t {
+	size_t size;
+	std::string name;
+};
+
+static std::vector<cave_chunk_t> cave_chunks;
+// Named caves by start address. Never removed, since caves aren't either.
+static std::map<size_t, cave_label_t> cave_labels;
+static SRWLOCK cave_srwlock = { SRWLOCK_INIT };
+
+static const DWORD cave_page_access[5] = {
+	PAGE_READONLY, PAGE_READWRITE, PAGE_EXECUTE, PAGE_EXECUTE_READ, PAGE_EXECUTE_READWRITE
+};
+static const char *const cave_access_names[5] = {
+	"r", "rw", "x", "rx", "rwx"
+};
+
+// Tries to reserve [size] bytes in the first free region after the end of
+// [hMod]'s image, falling back on wherever the system puts it.
+static BYTE* cave_chunk_alloc_near(size_t size, HMODULE hMod)
+{
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	const size_t granularity = si.dwAllocationGranularity;
+
+	if(!hMod) {
+		hMod = GetModuleHandle(NULL);
+	}
+	MEMORY_BASIC_INFORMATION mbi;
+	size_t addr = 0;
+	if(VirtualQuery(hMod, &mbi, sizeof(mbi))) {
+		addr = (size_t)mbi.AllocationBase;
+	}
+	while(
+		addr
+		&& addr < (size_t)si.lpMaximumApplicationAddress
+		&& VirtualQuery((void*)addr, &mbi, sizeof(mbi))
+	) {
+		const size_t region_end = (size_t)mbi.BaseAddress + mbi.RegionSize;
+		if(mbi.State == MEM_FREE) {
+			const size_t start = AlignUpToMultipleOf2((size_t)mbi.BaseAddress, granularity);
+			if(start >= (size_t)mbi.BaseAddress && start + size <= region_end) {
+				void *ret = VirtualAlloc((void*)start, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+				if(ret) {
+					return (BYTE*)ret;
+				}
+			}
+		}
+		if(region_end <= addr) {
+			break;
+		}
+		addr = region_end;
+	}
+	return (BYTE*)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+BYTE* cave_arena_alloc(size_t size, CodecaveAccessType access, HMODULE hMod)
+{
+	if((unsigned)access >= elementsof(cave_page_access)) {
+		return NULL;
+	}
+	// At least one INT3 byte after every cave.
+	const size_t full_size = AlignUpToMultipleOf2(size + 1, CAVE_ARENA_ALIGN);
+
+	AcquireSRWLockExclusive(&cave_srwlock);
+	cave_chunk_t *chunk = NULL;
+	for(auto& cur : cave_chunks) {
+		if(!cur.sealed && cur.access == access && cur.size - cur.used >= full_size) {
+			chunk = &cur;
+			break;
+		}
+	}
+	if(!chunk) {
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		const size_t chunk_size = AlignUpToMultipleOf2(full_size, (size_t)si.dwAllocationGranularity);
+		BYTE *base = cave_chunk_alloc_near(chunk_size, hMod);
+		if(!base) {
+			ReleaseSRWLockExclusive(&cave_srwlock);
+			log_printf("(Cave arena) Couldn't allocate %zu bytes\n", chunk_size);
+			return NULL;
+		}
+		// Filling the whole chunk at once is cheaper than padding every
+		// cave individually, and the pages are touched anyway.
+		memset(base, 0xCC, chunk_size);
+		memstats_add(MEMSTATS_CAVE, chunk_size);
+		cave_chunks.push_back({ base, chunk_size, 0, 0, access, false });
+		chunk = &cave_chunks.back();
+	}
+	BYTE *ret = chunk->base + chunk->used;
+	chunk->used += full_size;
+	chunk->requested += size;
+	ReleaseSRWLockExclusive(&cave_srwlock);
+	return ret;
+}
+
+void cave_arena_seal(void)
+{
+	AcquireSRWLockExclusive(&cave_srwlock);
+	for(auto& chunk : cave_chunks) {
+		if(chunk.sealed) {
+			continue;
+		}
+		DWORD idgaf;
+		VirtualProtect(chunk.base, chunk.size, cave_page_access[chunk.access], &idgaf);
+		if(chunk.access >= EXECUTE) {
+			FlushInstructionCache(GetCurrentProcess(), chunk.base, chunk.used);
+		}
+		chunk.sealed = true;
+	}
+	ReleaseSRWLockExclusive(&cave_srwlock);
+}
+
+void cave_arena_name(const BYTE *cave, size_t size, const char *name)
+{
+	if(!cave || !name) {
+		return;
+	}
+	AcquireSRWLockExclusive(&cave_srwlock);
+	cave_labels[(size_t)cave] = { size, name };
+	ReleaseSRWLockExclusive(&cave_srwlock);
+}
+
+const char* cave_arena_lookup(const void *addr)
+{
+	const char *ret = NULL;
+	const size_t addr_val = (size_t)addr;
+	AcquireSRWLockShared(&cave_srwlock);
+	for(const auto& chunk : cave_chunks) {
+		if(addr_val >= (size_t)chunk.base && addr_val < (size_t)chunk.base + chunk.size) {
+			ret = "";
+			break;
+		}
+	}
+	if(ret) {
+		auto it = cave_labels.upper_bound(addr_val);
+		if(it != cave_labels.begin()) {
+			--it;
+			if(addr_val < it->first + it->second.size) {
+				ret = it->second.name.c_str();
+			}
+		}
+	}
+	ReleaseSRWLockShared(&cave_srwlock);
+	return ret;
+}
+
+json_t* cave_arena_stats(void)
+{
+	json_t *ret = json_object();
+	size_t total_size = 0;
+	size_t total_used = 0;
+	size_t total_requested = 0;
+
+	AcquireSRWLockShared(&cave_srwlock);
+	for(size_t i = 0; i < elementsof(cave_page_access); i++) {
+		size_t count = 0;
+		size_t size = 0;
+		size_t used = 0;
+		size_t requested = 0;
+		for(const auto& chunk : cave_chunks) {
+			if((size_t)chunk.access == i) {
+				count++;
+				size += chunk.size;
+				used += chunk.used;
+				requested += chunk.requested;
+			}
+		}
+		if(count) {
+			json_object_set_new(ret, cave_access_names[i], json_pack("{s:I, s:I, s:I, s:I}",
+				"chunks", (json_int_t)count,
+				"reserved", (json_int_t)size,
+				"used", (json_int_t)used,
+				"requested", (json_int_t)requested
+			));
+		}
+		total_size += size;
+		total_used += used;
+		total_requested += requested;
+	}
+	ReleaseSRWLockShared(&cave_srwlock);
+
+	// Padding between caves, and unused space at the end of sealed chunks.
+	json_object_set_new(ret, "padding", json_integer(total_used - total_requested));
+	json_object_set_new(ret, "unused", json_integer(total_size - total_used));
+	json_object_set_new(ret, "reserved", json_integer(total_size));
+	return ret;
+}
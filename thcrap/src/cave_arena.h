@@ -0,0 +1,39 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Shared memory arena for codecaves, breakpoint caves and plugin stubs.
+  * Caves are packed into chunks per access type, placed as close to their
+  * target module as possible so that rel32 jumps always reach. Every cave
+  * starts on a cache line, and all unused bytes are filled with INT3.
+  */
+
+#pragma once
+
+#define CAVE_ARENA_ALIGN 64
+
+// Returns [size] bytes of writable memory for a cave that will end up with
+// the [access] protection, placed near [hMod] (or the main module if NULL).
+// The memory stays writable until the next call to cave_arena_seal(), and
+// is followed by at least one INT3 byte. Returns NULL on failure.
+BYTE* cave_arena_alloc(size_t size, CodecaveAccessType access, HMODULE hMod);
+
+// Applies the final protection to every cave allocated since the last call,
+// and flushes the instruction cache for them. Chunks are closed after
+// sealing, so later allocations always go into fresh pages.
+void cave_arena_seal(void);
+
+// Names the [size] bytes at [cave], which has to be memory returned by
+// cave_arena_alloc(), for cave_arena_lookup().
+void cave_arena_name(const BYTE *cave, size_t size, const char *name);
+
+// Returns the name of the cave containing [addr], an empty string if that
+// cave has no name, or NULL if [addr] isn't part of the arena at all. The
+// string stays valid until the process exits.
+const char* cave_arena_lookup(const void *addr);
+
+// Returns an object describing the current usage and fragmentation of the
+// arena, for the startup profile.
+json_t* cave_arena_stats(void);
@@ -0,0 +1,325 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Binary cache of resolved game configurations.
+  */
+
+#include "thcrap.h"
+#include <string>
+#include <vector>
+
+/// File format
+/// -----------
+// After the header, the file contains the validation key (see
+// cfg_cache_key()), followed by the configuration itself. Every JSON value
+// is one type byte, followed by
+//
+//	'o': uint32_t count; { uint32_t len; char key[len]; value; } [count]
+//	'a': uint32_t count; value[count]
+//	's': uint32_t len; char str[len]
+//	'i': int64_t
+//	'r': double
+//	't', 'f', 'n': nothing
+#define CFG_CACHE_MAGIC "THCC"
+#define CFG_CACHE_VERSION 1
+#define CFG_CACHE_DISK_NS "cfg"
+// Nesting limit, so that a damaged file can't overflow the stack
+#define CFG_CACHE_MAX_DEPTH 256
+
+struct cfg_cache_header_t {
+	char magic[4];
+	uint32_t version;
+	uint32_t key_len;
+};
+
+struct cfg_cache_reader_t {
+	const BYTE *p;
+	const BYTE *end;
+
+	bool read(void *dst, size_t len) {
+		if((size_t)(end - p) < len) {
+			return false;
+		}
+		memcpy(dst, p, len);
+		p += len;
+		return true;
+	}
+
+	const char* read_str(uint32_t *len) {
+		if(!read(len, sizeof(*len)) || (size_t)(end - p) < *len) {
+			return NULL;
+		}
+		const char *ret = (const char*)p;
+		p += *len;
+		return ret;
+	}
+
+	json_t* read_value(int depth) {
+		BYTE type;
+		if(depth > CFG_CACHE_MAX_DEPTH || !read(&type, sizeof(type))) {
+			return NULL;
+		}
+		switch(type) {
+		case 'o': {
+			uint32_t count;
+			if(!read(&count, sizeof(count))) {
+				return NULL;
+			}
+			json_t *ret = json_object();
+			for(uint32_t i = 0; i < count; i++) {
+				uint32_t key_len;
+				const char *key = read_str(&key_len);
+				json_t *value = key ? read_value(depth + 1) : NULL;
+				if(!value) {
+					json_decref(ret);
+					return NULL;
+				}
+				std::string key_str(key, key_len);
+				json_object_set_new(ret, key_str.c_str(), value);
+			}
+			return ret;
+		}
+		case 'a': {
+			uint32_t count;
+			if(!read(&count, sizeof(count))) {
+				return NULL;
+			}
+			json_t *ret = json_array();
+			for(uint32_t i = 0; i < count; i++) {
+				json_t *value = read_value(depth + 1);
+				if(!value) {
+					json_decref(ret);
+					return NULL;
+				}
+				json_array_append_new(ret, value);
+			}
+			return ret;
+		}
+		case 's': {
+			uint32_t len;
+			const char *str = read_str(&len);
+			return str ? json_stringn_nocheck(str, len) : NULL;
+		}
+		case 'i': {
+			int64_t value;
+			return read(&value, sizeof(value)) ? json_integer(value) : NULL;
+		}
+		case 'r': {
+			double value;
+			return read(&value, sizeof(value)) ? json_real(value) : NULL;
+		}
+		case 't':
+			return json_true();
+		case 'f':
+			return json_false();
+		case 'n':
+			return json_null();
+		default:
+			return NULL;
+		}
+	}
+};
+
+static void cfg_cache_write(std::vector<BYTE>& buffer, const void *src, size_t len)
+{
+	buffer.insert(buffer.end(), (const BYTE*)src, (const BYTE*)src + len);
+}
+
+static void cfg_cache_write_str(std::vector<BYTE>& buffer, const char *str, size_t len)
+{
+	uint32_t len32 = (uint32_t)len;
+	cfg_cache_write(buffer, &len32, sizeof(len32));
+	cfg_cache_write(buffer, str, len);
+}
+
+static void cfg_cache_write_value(std::vector<BYTE>& buffer, const json_t *value)
+{
+	BYTE type;
+	switch(json_typeof(value)) {
+	case JSON_OBJECT: {
+		type = 'o';
+		uint32_t count = (uint32_t)json_object_size(value);
+		cfg_cache_write(buffer, &type, sizeof(type));
+		cfg_cache_write(buffer, &count, sizeof(count));
+		const char *key;
+		json_t *child;
+		json_object_foreach((json_t*)value, key, child) {
+			cfg_cache_write_str(buffer, key, strlen(key));
+			cfg_cache_write_value(buffer, child);
+		}
+		break;
+	}
+	case JSON_ARRAY: {
+		type = 'a';
+		uint32_t count = (uint32_t)json_array_size(value);
+		cfg_cache_write(buffer, &type, sizeof(type));
+		cfg_cache_write(buffer, &count, sizeof(count));
+		size_t i;
+		json_t *child;
+		json_array_foreach(value, i, child) {
+			cfg_cache_write_value(buffer, child);
+		}
+		break;
+	}
+	case JSON_STRING:
+		type = 's';
+		cfg_cache_write(buffer, &type, sizeof(type));
+		cfg_cache_write_str(buffer, json_string_value(value), json_string_length(value));
+		break;
+	case JSON_INTEGER: {
+		type = 'i';
+		int64_t i = json_integer_value(value);
+		cfg_cache_write(buffer, &type, sizeof(type));
+		cfg_cache_write(buffer, &i, sizeof(i));
+		break;
+	}
+	case JSON_REAL: {
+		type = 'r';
+		double r = json_real_value(value);
+		cfg_cache_write(buffer, &type, sizeof(type));
+		cfg_cache_write(buffer, &r, sizeof(r));
+		break;
+	}
+	case JSON_TRUE:
+		type = 't';
+		cfg_cache_write(buffer, &type, sizeof(type));
+		break;
+	case JSON_FALSE:
+		type = 'f';
+		cfg_cache_write(buffer, &type, sizeof(type));
+		break;
+	default:
+		type = 'n';
+		cfg_cache_write(buffer, &type, sizeof(type));
+		break;
+	}
+}
+/// -----------
+
+/// Validation
+/// ----------
+// Everything stack_cfg_resolve() depends on: the file name, the build, and
+// for every patch its location, its runconfig settings, and the size and
+// modification time of each file in the chain.
+static std::string cfg_cache_key(const char *fn)
+{
+	std::string key = fn;
+	key += '\n';
+	const char *build = runconfig_build_get();
+	if(build) {
+		key += build;
+	}
+	key += '\n';
+
+	std::vector<std::string> files = { "global.js" };
+	chain_buf_t chain;
+	resolve_chain_build(chain, fn);
+	for(size_t i = 0; i < chain.size(); i++) {
+		files.push_back(chain.get()[i]);
+	}
+
+	stack_foreach_cpp([&key, &files](const patch_t *patch) {
+		key += patch->archive ? patch->archive : "";
+		key += '\n';
+		char *config = patch->config ? json_dumps(patch->config, JSON_COMPACT | JSON_SORT_KEYS) : NULL;
+		if(config) {
+			key += config;
+			free(config);
+		}
+		key += '\n';
+		for(const std::string& file : files) {
+			const char *patch_fn = fn_for_patch_tls(patch, file.c_str());
+			WIN32_FILE_ATTRIBUTE_DATA attr;
+			char line[64];
+			if(patch_fn && GetFileAttributesEx(patch_fn, GetFileExInfoStandard, &attr)) {
+				snprintf(line, sizeof(line), " %08lx%08lx %08lx%08lx\n",
+					attr.nFileSizeHigh, attr.nFileSizeLow,
+					attr.ftLastWriteTime.dwHighDateTime, attr.ftLastWriteTime.dwLowDateTime
+				);
+			} else {
+				snprintf(line, sizeof(line), " -\n");
+			}
+			key += file;
+			key += line;
+		}
+	});
+	return key;
+}
+
+// One disk cache entry per game configuration and patch stack, so that
+// switching between run configurations doesn't throw the snapshots away.
+// The file times are left out, since they only validate the snapshot, and
+// a changed file should replace it rather than add another one.
+static std::string cfg_cache_disk_key(const char *fn)
+{
+	std::string ret = fn;
+	ret += '\n';
+	const char *build = runconfig_build_get();
+	ret += build ? build : "";
+	ret += '\n';
+	stack_foreach_cpp([&ret](const patch_t *patch) {
+		ret += patch->archive ? patch->archive : "";
+		ret += '\n';
+	});
+	return ret;
+}
+/// ----------
+
+json_t* cfg_cache_load(const char *fn)
+{
+	if(!fn) {
+		return NULL;
+	}
+	size_t size;
+	BYTE *cache = (BYTE *)disk_cache_get(CFG_CACHE_DISK_NS, cfg_cache_disk_key(fn).c_str(), &size);
+	if(!cache) {
+		return NULL;
+	}
+
+	json_t *ret = NULL;
+	cfg_cache_reader_t reader = { cache, cache + size };
+	cfg_cache_header_t header;
+	if(
+		reader.read(&header, sizeof(header))
+		&& !memcmp(header.magic, CFG_CACHE_MAGIC, sizeof(header.magic))
+		&& header.version == CFG_CACHE_VERSION
+		&& (size_t)(reader.end - reader.p) >= header.key_len
+	) {
+		std::string key = cfg_cache_key(fn);
+		if(key.length() == header.key_len && !memcmp(reader.p, key.data(), key.length())) {
+			reader.p += header.key_len;
+			ret = reader.read_value(0);
+			// Anything left over means that the file is damaged.
+			if(reader.p != reader.end) {
+				ret = json_decref_safe(ret);
+			}
+		}
+	}
+	free(cache);
+	if(ret) {
+		log_debugf("(JSON) Using cached configuration for %s\n", fn);
+	}
+	return ret;
+}
+
+void cfg_cache_store(const char *fn, const json_t *cfg)
+{
+	if(!fn || !cfg) {
+		return;
+	}
+	std::string key = cfg_cache_key(fn);
+	cfg_cache_header_t header;
+	memcpy(header.magic, CFG_CACHE_MAGIC, sizeof(header.magic));
+	header.version = CFG_CACHE_VERSION;
+	header.key_len = (uint32_t)key.length();
+
+	std::vector<BYTE> buffer;
+	cfg_cache_write(buffer, &header, sizeof(header));
+	cfg_cache_write(buffer, key.data(), key.length());
+	cfg_cache_write_value(buffer, cfg);
+
+	disk_cache_put(CFG_CACHE_DISK_NS, cfg_cache_disk_key(fn).c_str(), buffer.data(), buffer.size(), 0);
+}
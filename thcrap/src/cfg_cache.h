@@ -0,0 +1,23 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Binary cache of resolved game configurations.
+  * Resolving a game configuration parses and merges global.js, [game].js and
+  * [game].[build].js from every patch in the stack on every launch. As long
+  * as the stack and all of these files stay the same, the merged result is
+  * instead read back from a binary snapshot.
+  */
+
+#pragma once
+
+// Returns the result of stack_cfg_resolve([fn]) stored by the last call to
+// cfg_cache_store(), or NULL if the patch stack, the game build or any of
+// the files that went into it have changed since then.
+json_t* cfg_cache_load(const char *fn);
+
+// Stores [cfg], the result of stack_cfg_resolve([fn]), for later calls to
+// cfg_cache_load().
+void cfg_cache_store(const char *fn, const json_t *cfg);
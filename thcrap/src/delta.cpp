@@ -0,0 +1,127 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Binary deltas between two versions of a file.
+  */
+
+#include "thcrap.h"
+#include <zlib.h>
+
+#pragma pack(push, 1)
+typedef struct {
+	char magic[8]; // = DELTA_MAGIC
+	uint32_t old_size;
+	uint32_t new_size;
+} delta_header_t;
+
+typedef struct {
+	uint32_t extra_len;
+	int32_t seek;
+	uint32_t diff_len;
+} delta_record_t;
+#pragma pack(pop)
+
+// Inflates exactly [len] bytes from [strm] into [dst].
+static bool delta_read(z_stream &strm, void *dst, size_t len)
+{
+	strm.next_out = (BYTE *)dst;
+	strm.avail_out = (uInt)len;
+	while(strm.avail_out) {
+		int ret = inflate(&strm, Z_NO_FLUSH);
+		if(ret == Z_STREAM_END) {
+			return strm.avail_out == 0;
+		} else if(ret != Z_OK) {
+			// The whole input is there from the start, so running out of it
+			// (Z_BUF_ERROR) means that the delta is truncated.
+			return false;
+		}
+	}
+	return true;
+}
+
+void* delta_apply(const void *old, size_t old_size, const void *delta, size_t delta_size, size_t *new_size)
+{
+	size_t new_size_tmp;
+	if(!new_size) {
+		new_size = &new_size_tmp;
+	}
+	*new_size = 0;
+	if(!old || !delta || delta_size < sizeof(delta_header_t)) {
+		return NULL;
+	}
+	const auto header = (const delta_header_t *)delta;
+	if(memcmp(header->magic, DELTA_MAGIC, sizeof(header->magic)) || header->old_size != old_size) {
+		return NULL;
+	}
+
+	const size_t out_size = header->new_size;
+	BYTE *out = (BYTE *)malloc(out_size ? out_size : 1);
+	if(!out) {
+		return NULL;
+	}
+	const BYTE *old_p = (const BYTE *)old;
+
+	z_stream strm = {};
+	strm.next_in = (BYTE *)(header + 1);
+	strm.avail_in = (uInt)(delta_size - sizeof(delta_header_t));
+	if(inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+		free(out);
+		return NULL;
+	}
+
+	bool ok = true;
+	size_t out_pos = 0;
+	size_t old_pos = 0;
+	while(ok && out_pos < out_size) {
+		delta_record_t rec;
+		if(
+			!delta_read(strm, &rec, sizeof(rec))
+			|| rec.extra_len > out_size - out_pos
+			|| !delta_read(strm, out + out_pos, rec.extra_len)
+		) {
+			ok = false;
+			break;
+		}
+		out_pos += rec.extra_len;
+
+		// Checked in 64 bits, since [seek] may be negative.
+		const int64_t seek_pos = (int64_t)old_pos + rec.seek;
+		if(
+			seek_pos < 0
+			|| (uint64_t)seek_pos > old_size
+			|| rec.diff_len > old_size - (size_t)seek_pos
+			|| rec.diff_len > out_size - out_pos
+		) {
+			ok = false;
+			break;
+		}
+		old_pos = (size_t)seek_pos;
+
+		BYTE *diff = out + out_pos;
+		if(!delta_read(strm, diff, rec.diff_len)) {
+			ok = false;
+			break;
+		}
+		for(size_t i = 0; i < rec.diff_len; i++) {
+			diff[i] += old_p[old_pos + i];
+		}
+		out_pos += rec.diff_len;
+		old_pos += rec.diff_len;
+
+		if(rec.extra_len == 0 && rec.diff_len == 0 && out_pos < out_size) {
+			// Would loop forever.
+			ok = false;
+		}
+	}
+	inflateEnd(&strm);
+
+	if(!ok) {
+		free(out);
+		return NULL;
+	}
+	*new_size = out_size;
+	return out;
+}
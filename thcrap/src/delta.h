@@ -0,0 +1,36 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Binary deltas between two versions of a file.
+  *
+  * Created by scripts/delta_create.py. Modeled after bsdiff, but with a
+  * single raw Deflate stream instead of three bzip2 ones, since zlib is what
+  * we already have:
+  *
+  *	"THDELTA1"
+  *	uint32_t old_size
+  *	uint32_t new_size
+  *	Deflate stream of records, until [new_size] bytes have been written:
+  *		uint32_t extra_len
+  *		int32_t seek
+  *		uint32_t diff_len
+  *		BYTE extra[extra_len]
+  *		BYTE diff[diff_len]
+  *
+  * Every record appends [extra] to the output, moves the position in the old
+  * file by [seek], and then appends [diff_len] bytes of the old file, each
+  * one added to the corresponding byte of [diff].
+  */
+
+#pragma once
+
+#define DELTA_MAGIC "THDELTA1"
+
+// Applies [delta] to [old] and returns the new file in a buffer that has to
+// be free()d by the caller, or NULL if the delta is invalid or doesn't
+// belong to [old]. The caller still has to verify the result against the
+// CRC32 it expects.
+void* delta_apply(const void *old, size_t old_size, const void *delta, size_t delta_size, size_t *new_size);
@@ -322,7 +322,7 @@ size_t sz_or_ord_build(BYTE *dst, const BYTE **src, const stringref_t *rep)
 		size_t dst_len = sz_or_ord_size(src);
 
 		if(rep && rep->str) {
-			dst_len = StringToUTF16((wchar_t*)dst, rep->str, rep->len + 1) * sizeof(wchar_t);
+			dst_len = utf8_to_utf16((wchar_t*)dst, rep->str, rep->len + 1) * sizeof(wchar_t);
 		} else if(src_sz->ord_flag == 0 || src_sz->ord_flag == 0xffff) {
 			memcpy(dst, src_sz, dst_len);
 		} else {
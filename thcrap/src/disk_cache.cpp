@@ -0,0 +1,470 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Shared on-disk cache for derived data.
+  */
+
+#include "thcrap.h"
+#include <zlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Smaller entries aren't worth compressing.
+#define DISK_CACHE_DEFLATE_MIN 256
+// Trimming deletes entries until the cache is down to this fraction of the
+// budget, so that it doesn't have to run again on the next put.
+#define DISK_CACHE_TRIM_TARGET(budget) ((budget) / 4 * 3)
+
+// Total size of all entries, counted on the first put. Only an estimate,
+// since other processes can write to the cache at the same time.
+static uint64_t disk_cache_total = 0;
+static bool disk_cache_scanned = false;
+static SRWLOCK disk_cache_srwlock = { SRWLOCK_INIT };
+
+uint64_t disk_cache_hash(uint64_t hash, const void *data, size_t len)
+{
+	const BYTE *p = (const BYTE *)data;
+	for(size_t i = 0; i < len; i++) {
+		hash = (hash ^ p[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+static std::string disk_cache_root(void)
+{
+	const char *thcrap_dir = runconfig_thcrap_dir_get();
+	std::string ret = thcrap_dir ? std::string(thcrap_dir) + "/" : "";
+	return ret + DISK_CACHE_DIR "/";
+}
+
+static std::string disk_cache_fn(const char *ns, const char *key)
+{
+	const uint64_t hash = disk_cache_hash(DISK_CACHE_HASH_INIT, key, strlen(key));
+	char name[16 + 4 + 1];
+	snprintf(name, sizeof(name), "%08x%08x.bin", (uint32_t)(hash >> 32), (uint32_t)hash);
+	return disk_cache_root() + ns + "/" + name;
+}
+
+static bool disk_cache_args_valid(const char *ns, const char *key)
+{
+	return ns && ns[0] && key && !strpbrk(ns, "/\\:.");
+}
+
+// Entries are written next to their final name and moved in place, so that
+// another game starting at the same time never sees half of one.
+static std::string disk_cache_tmp_fn(const std::string &fn)
+{
+	return fn + "." + std::to_string(GetCurrentProcessId())
+		+ "." + std::to_string(GetCurrentThreadId()) + ".tmp";
+}
+
+static uint64_t disk_cache_file_size(const char *fn)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	if(!GetFileAttributesEx(fn, GetFileExInfoStandard, &attr)) {
+		return 0;
+	}
+	return ((uint64_t)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+}
+
+struct disk_cache_entry_t {
+	std::string fn;
+	uint64_t size;
+	uint64_t time;
+};
+
+static void disk_cache_enumerate(std::vector<disk_cache_entry_t> &entries)
+{
+	const std::string root = disk_cache_root();
+	WIN32_FIND_DATAA ns_fd;
+	HANDLE hNs = FindFirstFile((root + "*").c_str(), &ns_fd);
+	if(hNs == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	do {
+		if(!(ns_fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || ns_fd.cFileName[0] == '.') {
+			continue;
+		}
+		const std::string dir = root + ns_fd.cFileName + "/";
+		WIN32_FIND_DATAA w32fd;
+		HANDLE hFind = FindFirstFile((dir + "*.bin").c_str(), &w32fd);
+		if(hFind == INVALID_HANDLE_VALUE) {
+			continue;
+		}
+		do {
+			if(w32fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				continue;
+			}
+			entries.push_back({
+				dir + w32fd.cFileName,
+				((uint64_t)w32fd.nFileSizeHigh << 32) | w32fd.nFileSizeLow,
+				((uint64_t)w32fd.ftLastWriteTime.dwHighDateTime << 32) | w32fd.ftLastWriteTime.dwLowDateTime,
+			});
+		} while(FindNextFile(hFind, &w32fd));
+		FindClose(hFind);
+	} while(FindNextFile(hNs, &ns_fd));
+	FindClose(hNs);
+}
+
+// Has to be called with the lock held.
+static void disk_cache_scan(void)
+{
+	if(disk_cache_scanned) {
+		return;
+	}
+	std::vector<disk_cache_entry_t> entries;
+	disk_cache_enumerate(entries);
+	disk_cache_total = 0;
+	for(const auto &entry : entries) {
+		disk_cache_total += entry.size;
+	}
+	disk_cache_scanned = true;
+}
+
+// Moves the finished entry at [tmp_fn] to [fn] and accounts for its
+// [file_size]. Deletes [tmp_fn] on failure.
+static int disk_cache_commit(const std::string &tmp_fn, const std::string &fn, uint64_t file_size)
+{
+	AcquireSRWLockExclusive(&disk_cache_srwlock);
+	disk_cache_scan();
+	const uint64_t prev_size = disk_cache_file_size(fn.c_str());
+	if(!MoveFileEx(tmp_fn.c_str(), fn.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		const int ret = GetLastError();
+		ReleaseSRWLockExclusive(&disk_cache_srwlock);
+		DeleteFile(tmp_fn.c_str());
+		return ret;
+	}
+	disk_cache_total -= MIN(disk_cache_total, prev_size);
+	disk_cache_total += file_size;
+	const uint64_t budget = (uint64_t)runconfig_disk_cache_budget_get() * 1024 * 1024;
+	const bool over_budget = budget && disk_cache_total > budget;
+	ReleaseSRWLockExclusive(&disk_cache_srwlock);
+
+	if(over_budget) {
+		disk_cache_trim();
+	}
+	return 0;
+}
+
+// Marks the entry opened as [hFile] as recently used.
+static void disk_cache_touch(HANDLE hFile)
+{
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	SetFileTime(hFile, nullptr, nullptr, &now);
+}
+
+void* disk_cache_get(const char *ns, const char *key, size_t *size)
+{
+	if(size) {
+		*size = 0;
+	}
+	if(!disk_cache_args_valid(ns, key)) {
+		return NULL;
+	}
+	const std::string fn = disk_cache_fn(ns, key);
+	HANDLE hFile = CreateFile(
+		fn.c_str(), GENERIC_READ | FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr
+	);
+	if(hFile == INVALID_HANDLE_VALUE) {
+		return NULL;
+	}
+	std::vector<BYTE> file;
+	DWORD file_size = GetFileSize(hFile, nullptr);
+	DWORD byte_ret = 0;
+	if(file_size != INVALID_FILE_SIZE && file_size >= sizeof(disk_cache_header_t)) {
+		file.resize(file_size);
+		if(!ReadFile(hFile, file.data(), file_size, &byte_ret, nullptr) || byte_ret != file_size) {
+			file.clear();
+		}
+	}
+
+	const size_t key_len = strlen(key);
+	const auto *header = (const disk_cache_header_t *)file.data();
+	if(
+		file.empty()
+		|| header->magic != DISK_CACHE_MAGIC
+		|| header->version != DISK_CACHE_VERSION
+		|| header->key_len != key_len
+		|| file.size() - sizeof(disk_cache_header_t) < key_len
+		|| header->size_stored != file.size() - sizeof(disk_cache_header_t) - key_len
+		|| memcmp(header + 1, key, key_len)
+	) {
+		CloseHandle(hFile);
+		return NULL;
+	}
+	const BYTE *stored = file.data() + sizeof(disk_cache_header_t) + key_len;
+
+	BYTE *ret = (BYTE *)malloc(header->size ? header->size : 1);
+	bool ok = ret != NULL;
+	if(ok && header->method == 0) {
+		ok = header->size == header->size_stored;
+		if(ok) {
+			memcpy(ret, stored, header->size);
+		}
+	} else if(ok && header->method == 8) {
+		z_stream strm = {};
+		strm.next_in = (BYTE *)stored;
+		strm.avail_in = header->size_stored;
+		strm.next_out = ret;
+		strm.avail_out = header->size;
+		ok = inflateInit2(&strm, -MAX_WBITS) == Z_OK;
+		if(ok) {
+			ok = inflate(&strm, Z_FINISH) == Z_STREAM_END && strm.avail_out == 0;
+			inflateEnd(&strm);
+		}
+	} else {
+		ok = false;
+	}
+	ok = ok && crc32(0, ret, header->size) == header->crc;
+	if(!ok) {
+		free(ret);
+		CloseHandle(hFile);
+		return NULL;
+	}
+
+	disk_cache_touch(hFile);
+	CloseHandle(hFile);
+
+	if(size) {
+		*size = header->size;
+	}
+	return ret;
+}
+
+int disk_cache_put(const char *ns, const char *key, const void *data, size_t size, unsigned int flags)
+{
+	if(!disk_cache_args_valid(ns, key) || !data || size > UINT32_MAX) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	const size_t key_len = strlen(key);
+
+	disk_cache_header_t header = {};
+	header.magic = DISK_CACHE_MAGIC;
+	header.version = DISK_CACHE_VERSION;
+	header.key_len = (uint32_t)key_len;
+	header.size = (uint32_t)size;
+	header.crc = crc32(0, (const BYTE *)data, (uInt)size);
+
+	std::vector<BYTE> file(sizeof(header) + key_len);
+	memcpy(file.data() + sizeof(header), key, key_len);
+
+	if(!(flags & DISK_CACHE_STORED) && size >= DISK_CACHE_DEFLATE_MIN) {
+		// Only kept if it saves at least 10%, like patch packs.
+		const size_t limit = size - size / 10;
+		file.resize(sizeof(header) + key_len + limit);
+		z_stream strm = {};
+		strm.next_in = (BYTE *)data;
+		strm.avail_in = (uInt)size;
+		strm.next_out = file.data() + sizeof(header) + key_len;
+		strm.avail_out = (uInt)limit;
+		if(deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+			if(deflate(&strm, Z_FINISH) == Z_STREAM_END) {
+				header.method = 8;
+				header.size_stored = (uint32_t)strm.total_out;
+			}
+			deflateEnd(&strm);
+		}
+	}
+	if(header.method == 0) {
+		header.size_stored = (uint32_t)size;
+		file.resize(sizeof(header) + key_len);
+		file.insert(file.end(), (const BYTE *)data, (const BYTE *)data + size);
+	} else {
+		file.resize(sizeof(header) + key_len + header.size_stored);
+	}
+	memcpy(file.data(), &header, sizeof(header));
+
+	const std::string fn = disk_cache_fn(ns, key);
+	const std::string tmp_fn = disk_cache_tmp_fn(fn);
+	const int ret = file_write(tmp_fn.c_str(), file.data(), file.size());
+	if(ret) {
+		return ret;
+	}
+	return disk_cache_commit(tmp_fn, fn, file.size());
+}
+
+/// Streaming
+/// ---------
+struct disk_cache_writer_t {
+	std::string fn;
+	std::string tmp_fn;
+	HANDLE hFile;
+	disk_cache_header_t header;
+	uint64_t file_size;
+};
+
+disk_cache_writer_t* disk_cache_write_begin(const char *ns, const char *key)
+{
+	if(!disk_cache_args_valid(ns, key)) {
+		return NULL;
+	}
+	const size_t key_len = strlen(key);
+	auto *writer = new disk_cache_writer_t();
+	writer->fn = disk_cache_fn(ns, key);
+	writer->tmp_fn = disk_cache_tmp_fn(writer->fn);
+	writer->header.magic = DISK_CACHE_MAGIC;
+	writer->header.version = DISK_CACHE_VERSION;
+	writer->header.key_len = (uint32_t)key_len;
+
+	dir_create_for_fn(writer->tmp_fn.c_str());
+	writer->hFile = CreateFile(
+		writer->tmp_fn.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr
+	);
+	if(writer->hFile == INVALID_HANDLE_VALUE) {
+		delete writer;
+		return NULL;
+	}
+	// The header is rewritten with the actual sizes once the data is done.
+	std::vector<BYTE> head(sizeof(writer->header) + key_len);
+	memcpy(head.data(), &writer->header, sizeof(writer->header));
+	memcpy(head.data() + sizeof(writer->header), key, key_len);
+	DWORD byte_ret;
+	if(!WriteFile(writer->hFile, head.data(), head.size(), &byte_ret, nullptr) || byte_ret != head.size()) {
+		disk_cache_write_end(writer, false);
+		return NULL;
+	}
+	writer->file_size = head.size();
+	return writer;
+}
+
+int disk_cache_write(disk_cache_writer_t *writer, const void *data, size_t size)
+{
+	if(!writer || (!data && size)) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	if((uint64_t)writer->header.size + size > UINT32_MAX) {
+		return ERROR_FILE_TOO_LARGE;
+	}
+	DWORD byte_ret;
+	if(!WriteFile(writer->hFile, data, size, &byte_ret, nullptr) || byte_ret != size) {
+		return GetLastError();
+	}
+	writer->file_size += size;
+	writer->header.size += (uint32_t)size;
+	writer->header.crc = crc32(writer->header.crc, (const BYTE *)data, (uInt)size);
+	return 0;
+}
+
+int disk_cache_write_end(disk_cache_writer_t *writer, bool commit)
+{
+	if(!writer) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	int ret = commit ? 0 : ERROR_CANCELLED;
+	if(!ret) {
+		writer->header.method = 0;
+		writer->header.size_stored = writer->header.size;
+		DWORD byte_ret;
+		if(
+			SetFilePointer(writer->hFile, 0, nullptr, FILE_BEGIN) != 0
+			|| !WriteFile(writer->hFile, &writer->header, sizeof(writer->header), &byte_ret, nullptr)
+		) {
+			ret = GetLastError();
+		}
+	}
+	CloseHandle(writer->hFile);
+	if(!ret) {
+		ret = disk_cache_commit(writer->tmp_fn, writer->fn, writer->file_size);
+	} else {
+		DeleteFile(writer->tmp_fn.c_str());
+	}
+	delete writer;
+	return ret;
+}
+
+HANDLE disk_cache_open(const char *ns, const char *key, uint64_t *offset, size_t *size)
+{
+	if(!disk_cache_args_valid(ns, key) || !offset || !size) {
+		return INVALID_HANDLE_VALUE;
+	}
+	const std::string fn = disk_cache_fn(ns, key);
+	HANDLE hFile = CreateFile(
+		fn.c_str(), GENERIC_READ | FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr
+	);
+	if(hFile == INVALID_HANDLE_VALUE) {
+		return INVALID_HANDLE_VALUE;
+	}
+	const size_t key_len = strlen(key);
+	std::vector<BYTE> head(sizeof(disk_cache_header_t) + key_len);
+	const auto *header = (const disk_cache_header_t *)head.data();
+	DWORD byte_ret;
+	LARGE_INTEGER file_size;
+	if(
+		!ReadFile(hFile, head.data(), head.size(), &byte_ret, nullptr)
+		|| byte_ret != head.size()
+		|| header->magic != DISK_CACHE_MAGIC
+		|| header->version != DISK_CACHE_VERSION
+		|| header->key_len != key_len
+		|| header->method != 0
+		|| header->size_stored != header->size
+		|| memcmp(header + 1, key, key_len)
+		|| !GetFileSizeEx(hFile, &file_size)
+		|| (uint64_t)file_size.QuadPart != head.size() + (uint64_t)header->size
+	) {
+		CloseHandle(hFile);
+		return INVALID_HANDLE_VALUE;
+	}
+	disk_cache_touch(hFile);
+	*offset = head.size();
+	*size = header->size;
+	return hFile;
+}
+/// ---------
+
+void disk_cache_remove(const char *ns, const char *key)
+{
+	if(!disk_cache_args_valid(ns, key)) {
+		return;
+	}
+	const std::string fn = disk_cache_fn(ns, key);
+	AcquireSRWLockExclusive(&disk_cache_srwlock);
+	const uint64_t size = disk_cache_file_size(fn.c_str());
+	if(DeleteFile(fn.c_str())) {
+		disk_cache_total -= MIN(disk_cache_total, size);
+	}
+	ReleaseSRWLockExclusive(&disk_cache_srwlock);
+}
+
+void disk_cache_trim(void)
+{
+	const uint64_t budget = (uint64_t)runconfig_disk_cache_budget_get() * 1024 * 1024;
+	if(!budget) {
+		return;
+	}
+	AcquireSRWLockExclusive(&disk_cache_srwlock);
+	// Recounted from scratch, to pick up whatever other processes did.
+	std::vector<disk_cache_entry_t> entries;
+	disk_cache_enumerate(entries);
+	uint64_t total = 0;
+	for(const auto &entry : entries) {
+		total += entry.size;
+	}
+	if(total > budget) {
+		std::sort(entries.begin(), entries.end(), [](const disk_cache_entry_t &a, const disk_cache_entry_t &b) {
+			return a.time < b.time;
+		});
+		const uint64_t target = DISK_CACHE_TRIM_TARGET(budget);
+		size_t deleted = 0;
+		for(const auto &entry : entries) {
+			if(total <= target) {
+				break;
+			}
+			if(DeleteFile(entry.fn.c_str())) {
+				total -= entry.size;
+				deleted++;
+			}
+		}
+		log_printf("(Disk cache) Evicted %zu entries, %llu KiB left\n", deleted, total / 1024);
+	}
+	disk_cache_total = total;
+	disk_cache_scanned = true;
+	ReleaseSRWLockExclusive(&disk_cache_srwlock);
+}
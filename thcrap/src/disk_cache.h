@@ -0,0 +1,101 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Shared on-disk cache for derived data.
+  *
+  * Entries live in [DISK_CACHE_DIR]/<namespace>/ below the thcrap directory
+  * (or the current one, if that isn't known yet), one file per key, named
+  * after a hash of the key. Every entry stores its full key, so that a hash
+  * collision is just a miss. Callers put everything
+  * the data is derived from into the key: a version number for the format,
+  * and hashes of the source files (see disk_cache_hash()). An entry whose
+  * sources changed is then never looked up again, and eventually evicted.
+  *
+  * Entries are written to a temporary file and moved in place, so that
+  * concurrently running games never see half of one. Reading an entry
+  * updates its last write time, and whenever the total size exceeds the
+  * "disk_cache_budget" from the run configuration, the least recently used
+  * entries are deleted.
+  *
+  * Layout of an entry (all integers little-endian):
+  *
+  *	disk_cache_header_t
+  *	Key, not null-terminated
+  *	Data, stored or raw Deflate
+  */
+
+#pragma once
+
+#define DISK_CACHE_DIR "cache/store"
+#define DISK_CACHE_MAGIC 0x45434854 // "THCE"
+#define DISK_CACHE_VERSION 1
+
+typedef enum {
+	// Don't try to compress the data, because it already is.
+	DISK_CACHE_STORED = 0x1,
+} disk_cache_flags_t;
+
+#pragma pack(push, 1)
+typedef struct {
+	uint32_t magic; // = DISK_CACHE_MAGIC
+	uint32_t version; // = DISK_CACHE_VERSION
+	uint32_t key_len;
+	uint32_t method; // 0 = stored, 8 = raw Deflate
+	uint32_t size_stored;
+	uint32_t size;
+	// CRC32 of the uncompressed data
+	uint32_t crc;
+	uint32_t reserved;
+} disk_cache_header_t;
+#pragma pack(pop)
+
+// Continues the 64-bit FNV-1a hash [hash] with [len] bytes at [data].
+// Start with DISK_CACHE_HASH_INIT.
+#define DISK_CACHE_HASH_INIT 0xcbf29ce484222325ull
+uint64_t disk_cache_hash(uint64_t hash, const void *data, size_t len);
+
+// Returns the data stored for [key] in [ns] in a new buffer that has to be
+// free()d by the caller, or NULL if there is no valid entry. [ns] has to be
+// usable as a directory name.
+void* disk_cache_get(const char *ns, const char *key, size_t *size);
+
+// Stores [size] bytes of [data] for [key] in [ns], replacing any previous
+// entry. [flags] is a combination of disk_cache_flags_t values. Returns 0 on
+// success, or a Win32 error code.
+int disk_cache_put(const char *ns, const char *key, const void *data, size_t size, unsigned int flags);
+
+// Deletes the entry for [key] in [ns], if there is one.
+void disk_cache_remove(const char *ns, const char *key);
+
+// Deletes the least recently used entries until the cache fits into the
+// budget. Called automatically by disk_cache_put().
+void disk_cache_trim(void);
+
+/// Streaming
+/// ---------
+// For entries too large to be held in memory at once. These are always
+// stored without compression, so that they can be mapped in place.
+typedef struct disk_cache_writer_t disk_cache_writer_t;
+
+// Starts writing a new entry for [key] in [ns]. Returns NULL on failure.
+disk_cache_writer_t* disk_cache_write_begin(const char *ns, const char *key);
+
+// Appends [size] bytes of [data] to the entry. Returns 0 on success, or a
+// Win32 error code.
+int disk_cache_write(disk_cache_writer_t *writer, const void *data, size_t size);
+
+// Finishes and frees [writer]. If [commit] is true, the entry replaces any
+// previous one for its key, otherwise it is discarded. Returns 0 if the
+// entry was committed, or a Win32 error code.
+int disk_cache_write_end(disk_cache_writer_t *writer, bool commit);
+
+// Opens the uncompressed entry for [key] in [ns] for reading, and sets
+// [offset] and [size] to the position and size of its data in the file.
+// Unlike disk_cache_get(), the CRC isn't checked. Returns a file handle that
+// has to be closed by the caller, or INVALID_HANDLE_VALUE if there is no
+// such entry.
+HANDLE disk_cache_open(const char *ns, const char *key, uint64_t *offset, size_t *size);
+/// ---------
@@ -0,0 +1,125 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Background writer for dat dumps.
+  */
+
+#include "thcrap.h"
+#include <unordered_set>
+
+// Memory held by pending jobs before dump_queue_run() starts blocking.
+// A single job larger than this is still accepted if the queue is empty.
+#define DUMP_QUEUE_MAX_BYTES (64 * 1024 * 1024)
+
+static SRWLOCK dump_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE dump_done_cv = CONDITION_VARIABLE_INIT;
+static std::unordered_set<std::string> dump_names;
+// Memory held by jobs that are queued or running
+static size_t dump_pending_bytes = 0;
+// Jobs that are queued or running
+static size_t dump_pending_count = 0;
+static bool dump_quit = false;
+
+bool dump_queue_exists(const char *fn)
+{
+	if(!fn) {
+		return false;
+	}
+	AcquireSRWLockShared(&dump_lock);
+	bool ret = dump_names.find(fn) != dump_names.end();
+	ReleaseSRWLockShared(&dump_lock);
+	return ret || PathFileExists(fn);
+}
+
+// Blocks until [size] more bytes fit into the queue, and accounts for them.
+// Must be called with the lock held.
+static void dump_pending_add(size_t size)
+{
+	while(!dump_quit && dump_pending_count && dump_pending_bytes + size > DUMP_QUEUE_MAX_BYTES) {
+		SleepConditionVariableSRW(&dump_done_cv, &dump_lock, INFINITE, 0);
+	}
+	dump_pending_bytes += size;
+	dump_pending_count++;
+}
+
+// Must be called with the lock held.
+static void dump_pending_remove(size_t size)
+{
+	dump_pending_bytes -= size;
+	dump_pending_count--;
+	WakeAllConditionVariable(&dump_done_cv);
+}
+
+bool dump_queue_run(const char *fn, size_t size, std::function<void()> &&func)
+{
+	if(!fn) {
+		return false;
+	}
+	AcquireSRWLockExclusive(&dump_lock);
+	if(!dump_names.emplace(fn).second) {
+		ReleaseSRWLockExclusive(&dump_lock);
+		return false;
+	}
+	dump_pending_add(size);
+	ReleaseSRWLockExclusive(&dump_lock);
+	task_submit_func(TASK_PRIORITY_BACKGROUND, nullptr, [size, func = std::move(func)]() {
+		func();
+		AcquireSRWLockExclusive(&dump_lock);
+		dump_pending_remove(size);
+		ReleaseSRWLockExclusive(&dump_lock);
+	});
+	return true;
+}
+
+static void dump_write_done(void *, int, void *buf, size_t size)
+{
+	free(buf);
+	AcquireSRWLockExclusive(&dump_lock);
+	dump_pending_remove(size);
+	ReleaseSRWLockExclusive(&dump_lock);
+}
+
+void dump_queue_write(const char *fn, void *buffer, size_t size)
+{
+	if(!fn || !buffer) {
+		free(buffer);
+		return;
+	}
+	if(dump_queue_exists(fn)) {
+		free(buffer);
+		return;
+	}
+	// Plain buffers don't need a worker, just the I/O completion port.
+	AcquireSRWLockExclusive(&dump_lock);
+	if(!dump_names.emplace(fn).second) {
+		ReleaseSRWLockExclusive(&dump_lock);
+		free(buffer);
+		return;
+	}
+	dump_pending_add(size);
+	ReleaseSRWLockExclusive(&dump_lock);
+	async_io_then(async_io_write(fn, buffer, size), TASK_PRIORITY_BACKGROUND, dump_write_done, NULL);
+}
+
+void dump_queue_flush(void)
+{
+	AcquireSRWLockExclusive(&dump_lock);
+	while(dump_pending_count) {
+		SleepConditionVariableSRW(&dump_done_cv, &dump_lock, INFINITE, 0);
+	}
+	ReleaseSRWLockExclusive(&dump_lock);
+}
+
+void dump_queue_mod_exit(void)
+{
+	// Queued jobs are run by task_mod_exit(), and writes on the completion
+	// port still finish on their own. Just make sure that nothing blocks on
+	// the queue anymore.
+	AcquireSRWLockExclusive(&dump_lock);
+	dump_quit = true;
+	WakeAllConditionVariable(&dump_done_cv);
+	ReleaseSRWLockExclusive(&dump_lock);
+}
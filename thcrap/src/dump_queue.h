@@ -0,0 +1,38 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Background writer for dat dumps.
+  *
+  * Dumping every file a game loads would otherwise stall its loading thread
+  * on disk writes and PNG encoding. Instead, dumps are queued as background
+  * tasks on the shared task scheduler. The queue is bounded by the memory its pending jobs
+  * hold on to, and blocks new dumps once that is exceeded, so that a game
+  * loading faster than the disk can write doesn't run out of memory.
+  */
+
+#pragma once
+
+// Returns true if [fn] has been queued during this run, or already exists.
+// Use this instead of PathFileExists() to avoid dumping the same file twice.
+bool dump_queue_exists(const char *fn);
+
+// Queues writing [size] bytes of [buffer] to [fn]. The queue takes ownership
+// of [buffer], which must have been allocated with malloc().
+// Does nothing (but free [buffer]) if [fn] was already dumped.
+void dump_queue_write(const char *fn, void *buffer, size_t size);
+
+#ifdef __cplusplus
+// Queues [func] to create [fn], holding on to [size] bytes of memory until
+// it has run. Returns false without calling [func] if [fn] was already
+// dumped, in which case the caller still owns everything [func] would have
+// cleaned up.
+bool dump_queue_run(const char *fn, size_t size, std::function<void()> &&func);
+#endif
+
+// Waits until every queued dump has been written.
+void dump_queue_flush(void);
+
+void dump_queue_mod_exit(void);
@@ -112,6 +112,10 @@ LONG WINAPI exception_filter(LPEXCEPTION_POINTERS lpEI)
 		"===\n"
 		"\n"
 	);
+	// Running out of address space is a common cause of crashes.
+	memstats_print();
+	// The process might not survive this exception.
+	log_flush();
 	return EXCEPTION_CONTINUE_SEARCH;
 }
 
@@ -9,6 +9,8 @@
 
 #include "thcrap.h"
 #include <intrin.h>
+#include <unordered_map>
+#include <vector>
 
 //#define EnableExpressionLogging
 
@@ -164,6 +166,108 @@ struct CPUID_Data_t {
 
 static const CPUID_Data_t CPUID_Data;
 
+/// Dependency recording
+/// --------------------
+struct expr_deps_tls_t {
+	std::string *deps;
+	bool uncacheable;
+};
+THREAD_LOCAL(expr_deps_tls_t, expr_deps_tls, nullptr, nullptr);
+// Number of threads currently recording, so that breakpoints evaluating
+// expressions at runtime don't even have to look at the TLS slot.
+static volatile LONG expr_deps_recording = 0;
+
+void expr_deps_begin(std::string *deps)
+{
+	expr_deps_tls_t *tls = expr_deps_tls_get();
+	if (tls && !tls->deps) {
+		tls->deps = deps;
+		tls->uncacheable = false;
+		InterlockedIncrement(&expr_deps_recording);
+	}
+}
+
+bool expr_deps_end(void)
+{
+	expr_deps_tls_t *tls = expr_deps_tls_get();
+	if (!tls || !tls->deps) {
+		return false;
+	}
+	tls->deps = nullptr;
+	InterlockedDecrement(&expr_deps_recording);
+	return !tls->uncacheable;
+}
+
+static expr_deps_tls_t* expr_deps_active(void)
+{
+	if (!expr_deps_recording) {
+		return nullptr;
+	}
+	expr_deps_tls_t *tls = expr_deps_tls_get();
+	return (tls && tls->deps) ? tls : nullptr;
+}
+
+// Anything that logs a warning or an error can't be cached, since the
+// message wouldn't be shown again when using the cached result.
+static void expr_deps_uncacheable(void)
+{
+	if (expr_deps_tls_t *tls = expr_deps_active()) {
+		tls->uncacheable = true;
+	}
+}
+
+// [value] is only called while recording.
+template <typename F>
+static void expr_deps_record(char kind, std::string_view name, F value)
+{
+	if (expr_deps_tls_t *tls = expr_deps_active()) {
+		*tls->deps += kind;
+		*tls->deps += name;
+		*tls->deps += '\t';
+		*tls->deps += value();
+		*tls->deps += '\n';
+	}
+}
+
+static std::string expr_dep_hex(const void *data, size_t len)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string ret;
+	ret.reserve(len * 2);
+	for (size_t i = 0; i < len; i++) {
+		ret += digits[((const BYTE*)data)[i] >> 4];
+		ret += digits[((const BYTE*)data)[i] & 0xF];
+	}
+	return ret;
+}
+
+static std::string expr_dep_option(const patch_val_t *option)
+{
+	if (!option) {
+		return "-";
+	}
+	std::string ret = expr_dep_hex(&option->type, sizeof(option->type));
+	ret += ':';
+	switch (option->type) {
+		case VT_STRING:
+		case VT_CODE:
+			ret += expr_dep_hex(option->str.ptr, option->str.len);
+			break;
+		case VT_WSTRING:
+			ret += expr_dep_hex(option->wstr.ptr, option->wstr.len * sizeof(wchar_t));
+			break;
+		default:
+			ret += expr_dep_hex(option->byte_array, sizeof(option->byte_array));
+	}
+	return ret;
+}
+
+static std::string expr_dep_addr(size_t addr)
+{
+	return expr_dep_hex(&addr, sizeof(addr));
+}
+/// --------------------
+
 #define breakpoint_test_var data_refs->regs
 #define is_breakpoint (breakpoint_test_var)
 #define is_binhack (!breakpoint_test_var)
@@ -177,14 +281,17 @@ static const CPUID_Data_t CPUID_Data;
 } while (0)
 
 static __declspec(noinline) void IncDecWarningMessage(void) {
+	expr_deps_uncacheable();
 	WarnOnce(log_printf("EXPRESSION WARNING 0: Prefix increment and decrement operators do not currently function as expected because it is not possible to modify the value of an option in an expression. These operators only function to add one to a value, but do not actually modify it.\n"));
 }
 
 static __declspec(noinline) void AssignmentWarningMessage(void) {
+	expr_deps_uncacheable();
 	WarnOnce(log_printf("EXPRESSION WARNING 1: Assignment operators do not currently function as expected because it is not possible to modify the value of an option in an expression. These operators are only included for future compatibility and operator precedence reasons.\n"));
 }
 
 static __declspec(noinline) void PatchValueWarningMessage(const char *const name) {
+	expr_deps_uncacheable();
 	log_printf("EXPRESSION WARNING 2: Unknown patch value type \"%s\", using value 0\n", name);
 }
 
@@ -196,48 +303,59 @@ void DisableCodecaveNotFoundWarning(bool state) {
 	DisableCodecaveNotFound = state;
 }
 static __declspec(noinline) void CodecaveNotFoundWarningMessage(const char *const name) {
+	expr_deps_uncacheable();
 	if (!DisableCodecaveNotFound) {
 		log_printf("EXPRESSION WARNING 3: Codecave \"%s\" not found! Returning NULL...\n", name);
 	}
 }
 
 static __declspec(noinline) void PostIncDecWarningMessage(void) {
+	expr_deps_uncacheable();
 	WarnOnce(log_printf("EXPRESSION WARNING 4: Postfix increment and decrement operators do not currently function as expected because it is not possible to modify the value of an option in an expression. These operators do nothing and are only included for future compatibility and operator precedence reasons.\n"));
 }
 
 static __declspec(noinline) void InvalidCPUFeatureWarningMessage(const char *const name) {
+	expr_deps_uncacheable();
 	log_printf("EXPRESSION WARNING 5: Unknown CPU feature \"%s\"! Assuming feature is present and returning 1...\n");
 }
 
 static __declspec(noinline) void InvalidCodeOptionWarningMessage(void) {
+	expr_deps_uncacheable();
 	log_printf("EXPRESSION WARNING 6: Code options are not valid in expressions! Returning NULL...\n");
 }
 
 static __declspec(noinline) void NullDerefWarningMessage(void) {
+	expr_deps_uncacheable();
 	log_printf("EXPRESSION WARNING 7: Attempted to dereference NULL value! Returning NULL...\n");
 }
 
 static __declspec(noinline) void ExpressionErrorMessage(void) {
+	expr_deps_uncacheable();
 	log_printf("EXPRESSION ERROR: Error parsing expression!\n");
 }
 
 static __declspec(noinline) void GroupingBracketErrorMessage(void) {
+	expr_deps_uncacheable();
 	log_printf("EXPRESSION ERROR 0: Unmatched grouping brackets\n");
 }
 
 static __declspec(noinline) void ValueBracketErrorMessage(void) {
+	expr_deps_uncacheable();
 	log_printf("EXPRESSION ERROR 1: Unmatched patch value brackets\n");
 }
 
 static __declspec(noinline) void BadCharacterErrorMessage(void) {
+	expr_deps_uncacheable();
 	log_printf("EXPRESSION ERROR 2: Unknown character\n");
 }
 
-static __declspec(noinline) void OptionNotFoundErrorMessage(const char *const name) {
-	log_printf("EXPRESSION ERROR 3: Option \"%s\" not found\n", name);
+static __declspec(noinline) void OptionNotFoundErrorMessage(const char *const name, const size_t name_length) {
+	expr_deps_uncacheable();
+	log_printf("EXPRESSION ERROR 3: Option \"%.*s\" not found\n", (int)name_length, name);
 }
 
 static __declspec(noinline) void InvalidValueErrorMessage(const char *const str) {
+	expr_deps_uncacheable();
 	log_printf("EXPRESSION ERROR 4: Invalid value \"%s\"\n", str);
 }
 
@@ -877,22 +995,25 @@ static size_t ApplyOperator(const size_t value, const size_t arg, const op_t op)
 	}
 }
 
+static inline const patch_val_t* GetOptionSlotValue(const char *const name, const size_t name_length) {
+	const patch_val_t *const slot = patch_opt_slot(name, name_length);
+	return slot->type != VT_NONE ? slot : NULL;
+}
+
 static __declspec(noinline) const patch_val_t* GetOptionValue(const char *const name, const size_t name_length) {
-	const char *const name_buffer = strndup(name, name_length);
-	ExpressionLogging("Option: \"%s\"\n", name_buffer);
-	const patch_val_t *const option = patch_opt_get(name_buffer);
+	ExpressionLogging("Option: \"%.*s\"\n", (int)name_length, name);
+	const patch_val_t *const option = GetOptionSlotValue(name, name_length);
 	if (!option) {
-		OptionNotFoundErrorMessage(name_buffer);
+		OptionNotFoundErrorMessage(name, name_length);
 	}
-	free((void*)name_buffer);
+	expr_deps_record('o', std::string_view(name, name_length), [option] { return expr_dep_option(option); });
 	return option;
 }
 
 static __declspec(noinline) const patch_val_t* GetPatchTestValue(const char *const name, const size_t name_length) {
-	const char *const name_buffer = strndup(name, name_length);
-	ExpressionLogging("PatchTest: \"%s\"\n", name_buffer);
-	const patch_val_t *const patch_test = patch_opt_get(name_buffer);
-	free((void*)name_buffer);
+	ExpressionLogging("PatchTest: \"%.*s\"\n", (int)name_length, name);
+	const patch_val_t *const patch_test = GetOptionSlotValue(name, name_length);
+	expr_deps_record('o', std::string_view(name, name_length), [patch_test] { return expr_dep_option(patch_test); });
 	return patch_test;
 }
 
@@ -991,6 +1112,7 @@ static __declspec(noinline) bool GetCPUFeatureTest(const char *const name, const
 InvalidCPUFeatureError:
 			InvalidCPUFeatureWarningMessage(name_buffer);
 	}
+	expr_deps_record('c', name_buffer, [ret] { return std::string(ret ? "1" : "0"); });
 	free((void*)name_buffer);
 	return ret;
 }
@@ -1005,6 +1127,7 @@ static __declspec(noinline) size_t GetCodecaveAddress(const char *const name, co
 		*user_offset_expr++ = '\0';
 	}
 	size_t cave_addr = func_get(name_buffer);
+	expr_deps_record('f', name_buffer, [cave_addr] { return expr_dep_addr(cave_addr); });
 	if (!cave_addr) {
 		CodecaveNotFoundWarningMessage(name_buffer);
 	}
@@ -1037,6 +1160,7 @@ static __declspec(noinline) size_t GetBPFuncOrRawAddress(const char *const name,
 	const char *const name_buffer = strndup(name, name_length);
 	ExpressionLogging("BPFuncOrRawAddress: \"%s\"\n", name_buffer);
 	size_t addr = func_get(name_buffer);
+	expr_deps_record('f', name_buffer, [addr] { return expr_dep_addr(addr); });
 	switch (addr) {
 		case 0: // Will be null if the name was not a BP function
 			if (!eval_expr_new_impl(name_buffer, '\0', &addr, StartNoOp, 0, data_refs)) {
@@ -1061,6 +1185,8 @@ static __declspec(noinline) patch_val_t GetMultibyteNOP(const char *const name,
 	nop_str.type = VT_CODE;
 	nop_str.str.len = 0;
 	eval_expr_new_impl(name_buffer, '\0', &nop_str.str.len, StartNoOp, 0, data_refs);
+	// Some of the sequences differ between manufacturers.
+	expr_deps_record('m', "amd", [] { return std::string(CPUID_Data.Manufacturer == AMD ? "1" : "0"); });
 	switch (nop_str.str.len) {
 		case 0xF: nop_str.str.ptr = CPUID_Data.Manufacturer == AMD ?
 										"0F1F80000000000F1F840000000000" :
@@ -1761,3 +1887,804 @@ ExpressionError:
 	);
 	return expr;
 }
+
+/// Precompiled breakpoint expressions
+/// ----------------------------------
+// The compiler below mirrors eval_expr_new_impl() and consume_value_impl()
+// step by step, but builds a tree of nodes instead of computing values.
+// Everything that makes the control flow of the parser depend on the values
+// themselves (ternaries, assignments, increments) or that can change between
+// two evaluations (patch values) is rejected, leaving those to eval_expr().
+// The only patch values that are compiled are options, which are read
+// straight from their interned slot, and function and codecave names, which
+// are interned as symbols whose cached address is revalidated against
+// [func_generation].
+
+enum : uint8_t {
+	ExprCodeImm,		// Push [imm]
+	ExprCodeReg,		// Push the [arg] byte register at offset [imm] in x86_reg_t
+	ExprCodeRegAddr,	// Push the address of the register at offset [imm] in x86_reg_t
+	ExprCodeDeref,		// Replace top with the value of type [arg] it points to
+	ExprCodeCast,		// Convert top to type [arg]
+	ExprCodeUnary,		// Apply unary operator [arg] to top
+	ExprCodeBinary,		// Pop arg and apply binary operator [arg] to top and arg
+	ExprCodeSym,		// Push the address of the expr_symbol_t at [imm]
+	ExprCodeOpt			// Push the value of the option slot at [imm]
+};
+
+// Unary operators
+enum : uint8_t {
+	ExprUnaryNot = '~',
+	ExprUnaryLogicalNot = '!',
+	ExprUnaryNegate = '-',
+	ExprUnaryBool = 'b'
+};
+
+#define EXPR_CODE_STACK_MAX 16
+#define EXPR_CODE_NODES_MAX 256
+
+struct expr_insn_t {
+	uint8_t code;
+	uint8_t arg;
+	uint32_t imm;
+};
+
+struct expr_code_t {
+	// Set by expr_code_jit()
+	size_t (__fastcall *native)(x86_reg_t* regs);
+	size_t insn_count;
+	expr_insn_t insn[];
+};
+
+struct expr_symbol_t {
+	std::string name;
+	volatile UINT_PTR value;
+	// [func_generation] at the time [value] was looked up
+	volatile LONG generation;
+};
+
+// Never freed, since any number of compiled expressions can refer to them.
+static std::unordered_map<std::string, expr_symbol_t> expr_symbols;
+static SRWLOCK expr_symbols_srwlock = { SRWLOCK_INIT };
+
+static expr_symbol_t* expr_symbol_intern(std::string&& name) {
+	AcquireSRWLockExclusive(&expr_symbols_srwlock);
+	auto it = expr_symbols.find(name);
+	if (it == expr_symbols.end()) {
+		it = expr_symbols.emplace(name, expr_symbol_t{ name, 0, func_generation - 1 }).first;
+	}
+	expr_symbol_t* ret = &it->second;
+	ReleaseSRWLockExclusive(&expr_symbols_srwlock);
+	return ret;
+}
+
+static inline UINT_PTR expr_symbol_value(expr_symbol_t* sym) {
+	const LONG generation = func_generation;
+	if (sym->generation != generation) {
+		sym->value = func_get(sym->name.c_str());
+		sym->generation = generation;
+	}
+	return sym->value;
+}
+
+struct ExprNode {
+	uint8_t code;
+	uint8_t arg;
+	uint32_t imm;
+	uint16_t lhs;
+	uint16_t rhs;
+};
+
+struct ExprCompiler {
+	std::vector<ExprNode> nodes;
+
+	bool add(uint16_t& out, uint8_t code, uint8_t arg, uint32_t imm, uint16_t lhs = 0, uint16_t rhs = 0) {
+		if (nodes.size() >= EXPR_CODE_NODES_MAX) {
+			return false;
+		}
+		out = (uint16_t)nodes.size();
+		nodes.push_back({ code, arg, imm, lhs, rhs });
+		return true;
+	}
+};
+
+static constexpr struct {
+	char name[4];
+	uint8_t offset;
+	uint8_t size;
+} ExprRegisters[] = {
+	{ "eax", offsetof(x86_reg_t, eax), 4 }, { "ecx", offsetof(x86_reg_t, ecx), 4 },
+	{ "edx", offsetof(x86_reg_t, edx), 4 }, { "ebx", offsetof(x86_reg_t, ebx), 4 },
+	{ "esp", offsetof(x86_reg_t, esp), 4 }, { "ebp", offsetof(x86_reg_t, ebp), 4 },
+	{ "esi", offsetof(x86_reg_t, esi), 4 }, { "edi", offsetof(x86_reg_t, edi), 4 },
+	{ "ax", offsetof(x86_reg_t, ax), 2 }, { "al", offsetof(x86_reg_t, al), 1 }, { "ah", offsetof(x86_reg_t, ah), 1 },
+	{ "cx", offsetof(x86_reg_t, cx), 2 }, { "cl", offsetof(x86_reg_t, cl), 1 }, { "ch", offsetof(x86_reg_t, ch), 1 },
+	{ "dx", offsetof(x86_reg_t, dx), 2 }, { "dl", offsetof(x86_reg_t, dl), 1 }, { "dh", offsetof(x86_reg_t, dh), 1 },
+	{ "bx", offsetof(x86_reg_t, bx), 2 }, { "bl", offsetof(x86_reg_t, bl), 1 }, { "bh", offsetof(x86_reg_t, bh), 1 },
+	{ "di", offsetof(x86_reg_t, di), 2 }, { "si", offsetof(x86_reg_t, si), 2 },
+	{ "bp", offsetof(x86_reg_t, bp), 2 }, { "sp", offsetof(x86_reg_t, sp), 2 }
+};
+
+// Same register names as is_reg_name(), but returns the register's location
+// instead of reading it.
+static const char* compile_reg_name(const char* expr, ExprCompiler& cc, uint16_t& out) {
+	const bool deref = expr[0] != '&';
+	expr += !deref;
+	for (const auto& reg : ExprRegisters) {
+		const size_t len = reg.size == 4 ? 3 : 2;
+		if (strnicmp(expr, reg.name, len) == 0) {
+			if (!(deref
+				? cc.add(out, ExprCodeReg, reg.size, reg.offset)
+				: cc.add(out, ExprCodeRegAddr, 0, reg.offset)
+			)) {
+				return NULL;
+			}
+			return expr + len;
+		}
+	}
+	return NULL;
+}
+
+// Operators that are either warned about by ApplyOperator() or
+// need the evaluated value to continue parsing.
+static inline bool compile_op_rejected(const op_t op) {
+	switch (op) {
+		case BadBrackets: case TernaryConditional: case StandaloneTernaryEnd:
+		case Assign: case AddAssign: case SubtractAssign: case MultiplyAssign:
+		case DivideAssign: case ModuloAssign:
+		case ArithmeticLeftShiftAssign: case ArithmeticRightShiftAssign:
+		case LogicalLeftShiftAssign: case LogicalRightShiftAssign:
+		case CircularLeftShiftAssign: case CircularRightShiftAssign:
+		case AndAssign: case NandAssign: case XorAssign:
+		case XnorAssign: case OrAssign: case NorAssign:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool compile_apply_op(ExprCompiler& cc, uint16_t& out, const uint16_t value, const uint16_t arg, const op_t op) {
+	switch (op) {
+		// ApplyOperator() returns [arg] unchanged for these
+		case StartNoOp: case NullOp: case EndGroupOp: case Comma: case Gomma:
+			out = arg;
+			return true;
+	}
+	const ExprNode& lhs = cc.nodes[value];
+	const ExprNode& rhs = cc.nodes[arg];
+	if (lhs.code == ExprCodeImm && rhs.code == ExprCodeImm && !((op == Divide || op == Modulo) && !rhs.imm)) {
+		return cc.add(out, ExprCodeImm, 0, ApplyOperator(lhs.imm, rhs.imm, op));
+	}
+	return cc.add(out, ExprCodeBinary, op, 0, value, arg);
+}
+
+static const char* compile_expr_impl(const char* expr, char end, ExprCompiler& cc, uint16_t& out, const op_t start_op, const uint16_t start_value);
+
+static inline const char* compile_postfix_check(const char* expr) {
+	return ((expr[0] == '+' || expr[0] == '-') && expr[0] == expr[1]) ? NULL : expr;
+}
+
+// Accepts <codecave:name> and <name> for function names, exactly as long as
+// GetCodecaveAddress() and GetBPFuncOrRawAddress() would look up [name] and
+// nothing else.
+static const char* compile_symbol(const char* expr, expr_symbol_t*& sym) {
+	const char* const end = find_matching_end(expr, TextInt('<', '>'));
+	if (!end) {
+		return NULL;
+	}
+	const char* name = expr + 1;
+	const bool is_codecave = strnicmp(name, "codecave:", 9) == 0;
+	if (!is_codecave && (
+		strnicmp(name, "option:", 7) == 0 || strnicmp(name, "patch:", 6) == 0
+		|| strnicmp(name, "cpuid:", 6) == 0 || strnicmp(name, "nop:", 4) == 0
+	)) {
+		return NULL;
+	}
+	std::string name_str(name, end);
+	// Offsets are evaluated by GetCodecaveAddress() itself, and unknown
+	// names are parsed as expressions by GetBPFuncOrRawAddress().
+	if (name_str.find('+') != std::string::npos || !func_get(name_str.c_str())) {
+		return NULL;
+	}
+	sym = expr_symbol_intern(std::move(name_str));
+	return end + 1;
+}
+
+// Interns <option:name> and <patch:id> references. Options that aren't set
+// or can't be read as a number are left to eval_expr(), which reports them.
+static const char* compile_option(const char* expr, const patch_val_t*& opt) {
+	const char* const end = find_matching_end(expr, TextInt('<', '>'));
+	if (!end) {
+		return NULL;
+	}
+	const char* name = expr + 1;
+	if (strnicmp(name, "option:", 7) == 0) {
+		name += 7;
+	} else if (strnicmp(name, "patch:", 6) != 0) {
+		return NULL;
+	}
+	opt = patch_opt_slot(name, PtrDiffStrlen(end, name));
+	if (opt->type == VT_NONE || opt->type == VT_CODE) {
+		return NULL;
+	}
+	return end + 1;
+}
+
+// Same conversion as consume_value_impl() does for patch values.
+static inline size_t expr_option_value(const patch_val_t* opt) {
+	switch (opt->type) {
+		case VT_BYTE: return (uint32_t)opt->b;
+		case VT_SBYTE: return (uint32_t)opt->sb;
+		case VT_WORD: return (uint32_t)opt->w;
+		case VT_SWORD: return (uint32_t)opt->sw;
+		case VT_DWORD: return (uint32_t)opt->i;
+		case VT_SDWORD: return (uint32_t)opt->si;
+		case VT_QWORD: return (uint32_t)opt->q;
+		case VT_SQWORD: return (uint32_t)opt->sq;
+		case VT_FLOAT: return (uint32_t)opt->f;
+		case VT_DOUBLE: return (uint32_t)opt->d;
+		case VT_STRING: return (uint32_t)opt->str.ptr;
+		case VT_WSTRING: return (uint32_t)opt->wstr.ptr;
+		default: return 0;
+	}
+}
+
+static const char* compile_value_impl(const char* expr, ExprCompiler& cc, uint16_t& out) {
+	uint8_t type = VT_DWORD;
+	uint16_t zero;
+
+	--expr;
+	while (1) {
+		switch ((uint8_t)*++expr) {
+			case '\0':
+				return NULL;
+			case ' ': case '\t': case '\v': case '\f':
+				continue;
+			case 'b': case 'B':
+				if (strnicmp(expr, "byte ptr", 8) == 0) {
+					type = VT_BYTE;
+					expr += 7;
+					continue;
+				}
+				goto RawValueOrRegister;
+			case 'w': case 'W':
+				if (strnicmp(expr, "word ptr", 8) == 0) {
+					type = VT_WORD;
+					expr += 7;
+					continue;
+				}
+				return NULL;
+			case 'd': case 'D':
+				if (strnicmp(expr, "dword ptr", 9) == 0) {
+					type = VT_DWORD;
+					expr += 8;
+					continue;
+				}
+				if (strnicmp(expr, "double ptr", 10) == 0) {
+					type = VT_DOUBLE;
+					expr += 9;
+					continue;
+				}
+				goto RawValueOrRegister;
+			case 'f': case 'F':
+				if (strnicmp(expr, "float ptr", 9) == 0) {
+					type = VT_FLOAT;
+					expr += 8;
+					continue;
+				}
+				goto RawValue;
+			case 'q': case 'Q':
+				if (strnicmp(expr, "qword ptr", 9) == 0) {
+					type = VT_QWORD;
+					expr += 8;
+					continue;
+				}
+				return NULL;
+			case '!': case '~': case '+': case '-': {
+				const char* expr_next = compile_value_impl(expr + 1 + (expr[0] == expr[1]), cc, out);
+				if (!expr_next) return NULL;
+				switch ((uint8_t)expr[0] << (uint8_t)(expr[0] == expr[1])) {
+					case '~': if (!cc.add(out, ExprCodeUnary, ExprUnaryNot, 0, out)) return NULL; break;
+					case '!': if (!cc.add(out, ExprCodeUnary, ExprUnaryLogicalNot, 0, out)) return NULL; break;
+					case '-': if (!cc.add(out, ExprCodeUnary, ExprUnaryNegate, 0, out)) return NULL; break;
+					case '!' << 1: if (!cc.add(out, ExprCodeUnary, ExprUnaryBool, 0, out)) return NULL; break;
+					case '-' << 1: case '+' << 1: return NULL;
+				}
+				return compile_postfix_check(expr_next);
+			}
+			case '*': {
+				const char* expr_next = compile_value_impl(expr + 1, cc, out);
+				if (!expr_next || !cc.add(out, ExprCodeDeref, type, 0, out)) return NULL;
+				return compile_postfix_check(expr_next);
+			}
+			case '(': {
+				++expr;
+				const char* expr_next = CheckCastType(expr, &type);
+				if (expr_next) {
+					expr_next = compile_value_impl(expr_next, cc, out);
+					// The closing bracket is skipped without looking at it
+					if (!expr_next || !expr_next[0]) return NULL;
+					++expr_next;
+					if (!cc.add(out, ExprCodeCast, type, 0, out)) return NULL;
+				}
+				else {
+					if (!cc.add(zero, ExprCodeImm, 0, 0)) return NULL;
+					expr_next = compile_expr_impl(expr, ')', cc, out, StartNoOp, zero);
+					if (!expr_next) return NULL;
+					++expr_next;
+				}
+				return compile_postfix_check(expr_next);
+			}
+			case '[': case '{': {
+				if (!cc.add(zero, ExprCodeImm, 0, 0)) return NULL;
+				const char* expr_next = compile_expr_impl(expr + 1, expr[0] == '[' ? ']' : '}', cc, out, StartNoOp, zero);
+				if (!expr_next || !cc.add(out, ExprCodeDeref, type, 0, out)) return NULL;
+				++expr_next;
+				return compile_postfix_check(expr_next);
+			}
+			// Other patch values have to be looked up again on every evaluation
+			case '<': {
+				const patch_val_t* opt;
+				if (const char* expr_next = compile_option(expr, opt)) {
+					if (!cc.add(out, ExprCodeOpt, 0, (uint32_t)(uintptr_t)opt)) return NULL;
+					return compile_postfix_check(expr_next);
+				}
+				expr_symbol_t* sym;
+				const char* expr_next = compile_symbol(expr, sym);
+				if (!expr_next || !cc.add(out, ExprCodeSym, 0, (uint32_t)(uintptr_t)sym)) return NULL;
+				return compile_postfix_check(expr_next);
+			}
+			default:
+			case '&':
+RawValueOrRegister:
+				if (const char* expr_next = compile_reg_name(expr, cc, out)) {
+					return compile_postfix_check(expr_next);
+				}
+				{
+RawValue:
+					str_address_ret_t addr_ret;
+					size_t current = str_address_value(expr, nullptr, &addr_ret);
+					const char* expr_next = addr_ret.endptr;
+					if (expr == expr_next || (addr_ret.error && addr_ret.error != STR_ADDRESS_ERROR_GARBAGE)) {
+						return NULL;
+					}
+					if (!cc.add(out, ExprCodeImm, 0, current)) return NULL;
+					return compile_postfix_check(expr_next);
+				}
+		}
+	}
+}
+
+static const char* compile_expr_impl(const char* expr, char end, ExprCompiler& cc, uint16_t& out, const op_t start_op, const uint16_t start_value) {
+	uint16_t value = start_value;
+	op_t ops_cur = start_op;
+	op_t ops_next;
+	uint16_t cur_value;
+	if (!cc.add(cur_value, ExprCodeImm, 0, 0)) return NULL;
+
+	do {
+		if (ops_cur != NullOp) {
+			expr = compile_value_impl(expr, cc, cur_value);
+			if (!expr) return NULL;
+		}
+
+		const char* expr_next_op = find_next_op_impl(expr, &ops_next);
+		if (compile_op_rejected(ops_next)) return NULL;
+
+		switch (const uint8_t cur_prec = OpData.Precedence[ops_cur],
+							  next_prec = OpData.Precedence[ops_next];
+				(int8_t)((cur_prec > next_prec) - (cur_prec < next_prec))) {
+			default:
+				expr = compile_expr_impl(expr_next_op, end, cc, cur_value, ops_next, cur_value);
+				if (!expr || expr[0] == '?') return NULL;
+				if (expr[0] != end) {
+					ops_next = NullOp;
+				}
+				break;
+			case SameAsNext:
+				// The parser never gets past trailing whitespace
+				// in this case, so don't go around in circles either
+				if (ops_cur == NullOp && expr_next_op == expr) return NULL;
+				expr = expr_next_op;
+				break;
+			case HigherThanNext:
+				end = expr[0];
+		}
+
+		if (!compile_apply_op(cc, value, value, cur_value, ops_cur)) return NULL;
+		ops_cur = ops_next;
+
+	} while (expr[0] != end);
+	out = value;
+	return expr;
+}
+
+static bool compile_emit(const ExprCompiler& cc, const uint16_t node, std::vector<expr_insn_t>& insn, size_t depth, size_t& max_depth) {
+	const ExprNode& n = cc.nodes[node];
+	switch (n.code) {
+		case ExprCodeBinary:
+			if (!compile_emit(cc, n.lhs, insn, depth, max_depth)) return false;
+			if (!compile_emit(cc, n.rhs, insn, depth + 1, max_depth)) return false;
+			break;
+		case ExprCodeDeref: case ExprCodeCast: case ExprCodeUnary:
+			if (!compile_emit(cc, n.lhs, insn, depth, max_depth)) return false;
+			break;
+		default:
+			if (++depth > max_depth) max_depth = depth;
+	}
+	if (max_depth > EXPR_CODE_STACK_MAX) {
+		return false;
+	}
+	insn.push_back({ n.code, n.arg, n.imm });
+	return true;
+}
+
+expr_code_t* expr_compile(const char* expr, char end, const char** expr_next) {
+	if (!expr) {
+		return NULL;
+	}
+	ExprCompiler cc;
+	uint16_t zero;
+	uint16_t root;
+	const char* expr_end;
+	if (!cc.add(zero, ExprCodeImm, 0, 0)
+		|| !(expr_end = compile_expr_impl(expr, end, cc, root, StartNoOp, zero))
+	) {
+		return NULL;
+	}
+	std::vector<expr_insn_t> insn;
+	size_t max_depth = 0;
+	if (!compile_emit(cc, root, insn, 0, max_depth)) {
+		return NULL;
+	}
+	expr_code_t* code = (expr_code_t*)malloc(sizeof(expr_code_t) + insn.size() * sizeof(expr_insn_t));
+	code->native = NULL;
+	code->insn_count = insn.size();
+	memcpy(code->insn, insn.data(), insn.size() * sizeof(expr_insn_t));
+	if (expr_next) {
+		*expr_next = expr_end;
+	}
+	return code;
+}
+
+static inline size_t expr_code_deref(const size_t addr, const uint8_t type) {
+	switch (type) {
+		case VT_BYTE: return *(uint8_t*)addr;
+		case VT_WORD: return *(uint16_t*)addr;
+		case VT_QWORD: return (uint32_t)*(uint64_t*)addr;
+		case VT_FLOAT: return (uint32_t)*(float*)addr;
+		case VT_DOUBLE: return (uint32_t)*(double*)addr;
+		default: return *(uint32_t*)addr;
+	}
+}
+
+static inline size_t expr_code_cast(size_t value, const uint8_t type) {
+	switch (type) {
+		case VT_BYTE: return *(uint8_t*)&value;
+		case VT_SBYTE: return *(int8_t*)&value;
+		case VT_WORD: return *(uint16_t*)&value;
+		case VT_SWORD: return *(int16_t*)&value;
+		case VT_DWORD: return *(uint32_t*)&value;
+		case VT_SDWORD: return *(int32_t*)&value;
+		case VT_FLOAT: return (uint32_t)*(float*)&value;
+		default: return value;
+	}
+}
+
+size_t __fastcall expr_code_eval(const expr_code_t* code, x86_reg_t* regs) {
+	if (code->native) {
+		return code->native(regs);
+	}
+	size_t stack[EXPR_CODE_STACK_MAX];
+	size_t* top = stack - 1;
+	const expr_insn_t* insn = code->insn;
+	for (size_t i = code->insn_count; i; --i, ++insn) {
+		switch (insn->code) {
+			case ExprCodeImm:
+				*++top = insn->imm;
+				break;
+			case ExprCodeReg: {
+				const uint8_t* reg = (uint8_t*)regs + insn->imm;
+				switch (insn->arg) {
+					case 1: *++top = *reg; break;
+					case 2: *++top = *(uint16_t*)reg; break;
+					default: *++top = *(uint32_t*)reg; break;
+				}
+				break;
+			}
+			case ExprCodeRegAddr:
+				*++top = (size_t)regs + insn->imm;
+				break;
+			case ExprCodeSym:
+				*++top = expr_symbol_value((expr_symbol_t*)(uintptr_t)insn->imm);
+				break;
+			case ExprCodeOpt:
+				*++top = expr_option_value((const patch_val_t*)(uintptr_t)insn->imm);
+				break;
+			case ExprCodeDeref:
+				if (!*top) {
+					NullDerefWarningMessage();
+					break;
+				}
+				*top = expr_code_deref(*top, insn->arg);
+				break;
+			case ExprCodeCast:
+				*top = expr_code_cast(*top, insn->arg);
+				break;
+			case ExprCodeUnary:
+				switch (insn->arg) {
+					case ExprUnaryNot: *top = ~*top; break;
+					case ExprUnaryLogicalNot: *top = !*top; break;
+					case ExprUnaryNegate: *top *= -1; break;
+					case ExprUnaryBool: *top = (bool)*top; break;
+				}
+				break;
+			case ExprCodeBinary:
+				--top;
+				*top = ApplyOperator(top[0], top[1], insn->arg);
+				break;
+		}
+	}
+	return *top;
+}
+
+void expr_code_free(expr_code_t* code) {
+	free(code);
+}
+
+// Native code generation
+// ----------------------
+// Every instruction is translated on its own. The top of the bytecode stack
+// lives in EAX, everything below it is pushed onto the machine stack, and
+// ESI holds [regs]. Whatever isn't worth a few instructions of its own calls
+// one of the helpers below, which all take their arguments in ECX and EDX.
+
+static size_t __fastcall expr_jit_deref(size_t addr, uint8_t type) {
+	if (!addr) {
+		NullDerefWarningMessage();
+		return 0;
+	}
+	return expr_code_deref(addr, type);
+}
+
+static size_t __fastcall expr_jit_cast(size_t value, uint8_t type) {
+	return expr_code_cast(value, type);
+}
+
+static size_t __fastcall expr_jit_binary(size_t value, size_t arg, uint32_t op) {
+	return ApplyOperator(value, arg, (op_t)op);
+}
+
+static size_t __fastcall expr_jit_symbol(expr_symbol_t* sym) {
+	return expr_symbol_value(sym);
+}
+
+static size_t __fastcall expr_jit_option(const patch_val_t* opt) {
+	return expr_option_value(opt);
+}
+
+struct ExprJit {
+	std::vector<uint8_t> buf;
+	// Offsets of rel32 call operands, and the functions they call
+	std::vector<std::pair<size_t, const void*>> calls;
+
+	void emit(std::initializer_list<uint8_t> bytes) {
+		buf.insert(buf.end(), bytes);
+	}
+	void emit32(uint32_t val) {
+		emit({ (uint8_t)val, (uint8_t)(val >> 8), (uint8_t)(val >> 16), (uint8_t)(val >> 24) });
+	}
+	void call(const void* func) {
+		emit({ 0xE8 }); // CALL rel32
+		calls.push_back({ buf.size(), func });
+		emit32(0);
+	}
+	// Calls [func] with [ecx] in ECX.
+	void call_imm(const void* func, uint32_t ecx) {
+		emit({ 0xB9 }); emit32(ecx); // MOV ECX, imm32
+		call(func);
+	}
+	// Calls [func] with EAX in ECX and [edx] in EDX.
+	void call_eax(const void* func, uint32_t edx) {
+		emit({ 0x89, 0xC1 }); // MOV ECX, EAX
+		emit({ 0xBA }); emit32(edx); // MOV EDX, imm32
+		call(func);
+	}
+};
+
+static bool expr_jit_insn(ExprJit& jit, const expr_insn_t& insn, size_t& depth) {
+	switch (insn.code) {
+		case ExprCodeImm: case ExprCodeReg: case ExprCodeRegAddr: case ExprCodeSym: case ExprCodeOpt:
+			if (depth++) {
+				jit.emit({ 0x50 }); // PUSH EAX
+			}
+			break;
+		case ExprCodeBinary:
+			if (depth-- < 2) {
+				return false;
+			}
+			break;
+		default:
+			if (!depth) {
+				return false;
+			}
+	}
+	switch (insn.code) {
+		case ExprCodeImm:
+			jit.emit({ 0xB8 }); jit.emit32(insn.imm); // MOV EAX, imm32
+			return true;
+		case ExprCodeReg:
+			if (insn.imm >= sizeof(x86_reg_t)) {
+				return false;
+			}
+			switch (insn.arg) {
+				case 1: jit.emit({ 0x0F, 0xB6, 0x46, (uint8_t)insn.imm }); break; // MOVZX EAX, BYTE PTR [ESI+disp8]
+				case 2: jit.emit({ 0x0F, 0xB7, 0x46, (uint8_t)insn.imm }); break; // MOVZX EAX, WORD PTR [ESI+disp8]
+				default: jit.emit({ 0x8B, 0x46, (uint8_t)insn.imm }); break; // MOV EAX, [ESI+disp8]
+			}
+			return true;
+		case ExprCodeRegAddr:
+			if (insn.imm >= sizeof(x86_reg_t)) {
+				return false;
+			}
+			jit.emit({ 0x8D, 0x46, (uint8_t)insn.imm }); // LEA EAX, [ESI+disp8]
+			return true;
+		case ExprCodeSym:
+			jit.call_imm((const void*)&expr_jit_symbol, insn.imm);
+			return true;
+		case ExprCodeOpt:
+			jit.call_imm((const void*)&expr_jit_option, insn.imm);
+			return true;
+		case ExprCodeDeref: {
+			uint8_t load[3] = { 0x8B, 0x00 }; // MOV EAX, [EAX]
+			size_t load_len = 2;
+			switch (insn.arg) {
+				case VT_QWORD: case VT_FLOAT: case VT_DOUBLE:
+					jit.call_eax((const void*)&expr_jit_deref, insn.arg);
+					return true;
+				case VT_BYTE: load[0] = 0x0F; load[1] = 0xB6; load[2] = 0x00; load_len = 3; break; // MOVZX EAX, BYTE PTR [EAX]
+				case VT_WORD: load[0] = 0x0F; load[1] = 0xB7; load[2] = 0x00; load_len = 3; break; // MOVZX EAX, WORD PTR [EAX]
+			}
+			jit.emit({ 0x85, 0xC0 }); // TEST EAX, EAX
+			jit.emit({ 0x75, 9 }); // JNZ load
+			jit.call((const void*)&NullDerefWarningMessage);
+			jit.emit({ 0x31, 0xC0 }); // XOR EAX, EAX
+			jit.emit({ 0xEB, (uint8_t)load_len }); // JMP end
+			jit.buf.insert(jit.buf.end(), load, load + load_len);
+			return true;
+		}
+		case ExprCodeCast:
+			switch (insn.arg) {
+				case VT_BYTE: jit.emit({ 0x0F, 0xB6, 0xC0 }); break; // MOVZX EAX, AL
+				case VT_SBYTE: jit.emit({ 0x0F, 0xBE, 0xC0 }); break; // MOVSX EAX, AL
+				case VT_WORD: jit.emit({ 0x0F, 0xB7, 0xC0 }); break; // MOVZX EAX, AX
+				case VT_SWORD: jit.emit({ 0x0F, 0xBF, 0xC0 }); break; // MOVSX EAX, AX
+				case VT_FLOAT: jit.call_eax((const void*)&expr_jit_cast, insn.arg); break;
+			}
+			return true;
+		case ExprCodeUnary:
+			switch (insn.arg) {
+				case ExprUnaryNot: jit.emit({ 0xF7, 0xD0 }); break; // NOT EAX
+				case ExprUnaryNegate: jit.emit({ 0xF7, 0xD8 }); break; // NEG EAX
+				case ExprUnaryLogicalNot:
+					jit.emit({ 0x85, 0xC0 }); // TEST EAX, EAX
+					jit.emit({ 0x0F, 0x94, 0xC0 }); // SETZ AL
+					jit.emit({ 0x0F, 0xB6, 0xC0 }); // MOVZX EAX, AL
+					break;
+				case ExprUnaryBool:
+					jit.emit({ 0x85, 0xC0 }); // TEST EAX, EAX
+					jit.emit({ 0x0F, 0x95, 0xC0 }); // SETNZ AL
+					jit.emit({ 0x0F, 0xB6, 0xC0 }); // MOVZX EAX, AL
+					break;
+				default:
+					return false;
+			}
+			return true;
+		case ExprCodeBinary:
+			// The left operand is on the stack, the right one in EAX.
+			switch (insn.arg) {
+				case Add: jit.emit({ 0x59, 0x01, 0xC8 }); break; // POP ECX; ADD EAX, ECX
+				case Multiply: jit.emit({ 0x59, 0x0F, 0xAF, 0xC1 }); break; // POP ECX; IMUL EAX, ECX
+				case BitwiseAnd: jit.emit({ 0x59, 0x21, 0xC8 }); break; // POP ECX; AND EAX, ECX
+				case BitwiseOr: jit.emit({ 0x59, 0x09, 0xC8 }); break; // POP ECX; OR EAX, ECX
+				case BitwiseXor: jit.emit({ 0x59, 0x31, 0xC8 }); break; // POP ECX; XOR EAX, ECX
+				case Subtract: jit.emit({ 0x89, 0xC1, 0x58, 0x29, 0xC8 }); break; // MOV ECX, EAX; POP EAX; SUB EAX, ECX
+				default:
+					jit.emit({ 0x89, 0xC2, 0x59 }); // MOV EDX, EAX; POP ECX
+					jit.emit({ 0x68 }); jit.emit32(insn.arg); // PUSH imm32
+					jit.call((const void*)&expr_jit_binary);
+			}
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool expr_code_jit(expr_code_t* code) {
+#ifdef _WIN64
+	return false;
+#else
+	if (!code || code->native) {
+		return code != NULL;
+	}
+	ExprJit jit;
+	jit.emit({ 0x56 }); // PUSH ESI
+	jit.emit({ 0x8B, 0xF1 }); // MOV ESI, ECX
+	size_t depth = 0;
+	for (size_t i = 0; i < code->insn_count; ++i) {
+		if (!expr_jit_insn(jit, code->insn[i], depth)) {
+			return false;
+		}
+	}
+	if (depth != 1) {
+		return false;
+	}
+	jit.emit({ 0x5E }); // POP ESI
+	jit.emit({ 0xC3 }); // RET
+
+	BYTE* native = cave_arena_alloc(jit.buf.size(), EXECUTE_READ, NULL);
+	if (!native) {
+		return false;
+	}
+	memcpy(native, jit.buf.data(), jit.buf.size());
+	cave_arena_name(native, jit.buf.size(), "expression JIT");
+	for (const auto& call : jit.calls) {
+		*(uint32_t*)(native + call.first) = (uint32_t)((size_t)call.second - (size_t)(native + call.first + 4));
+	}
+	code->native = (size_t(__fastcall*)(x86_reg_t*))native;
+	return true;
+#endif
+}
+
+bool expr_deps_valid(const std::string& deps)
+{
+	size_t pos = 0;
+	while (pos < deps.length()) {
+		const size_t tab = deps.find('\t', pos);
+		const size_t eol = deps.find('\n', pos);
+		if (tab == std::string::npos || eol == std::string::npos || tab > eol) {
+			return false;
+		}
+		const char kind = deps[pos];
+		const std::string name = deps.substr(pos + 1, tab - pos - 1);
+		const std::string value = deps.substr(tab + 1, eol - tab - 1);
+		std::string cur;
+		switch (kind) {
+			case 'o':
+				cur = expr_dep_option(patch_opt_get(name.c_str()));
+				break;
+			case 'c':
+				cur = GetCPUFeatureTest(name.c_str(), name.length()) ? "1" : "0";
+				break;
+			case 'f':
+				cur = expr_dep_addr(func_get(name.c_str()));
+				break;
+			case 'm':
+				cur = CPUID_Data.Manufacturer == AMD ? "1" : "0";
+				break;
+			default:
+				return false;
+		}
+		if (cur != value) {
+			return false;
+		}
+		pos = eol + 1;
+	}
+	return true;
+}
+
+bool expr_deps_constant(const std::string& deps)
+{
+	size_t pos = 0;
+	while (pos < deps.length()) {
+		if (deps[pos] == 'f') {
+			return false;
+		}
+		const size_t eol = deps.find('\n', pos);
+		if (eol == std::string::npos) {
+			return false;
+		}
+		pos = eol + 1;
+	}
+	return true;
+}
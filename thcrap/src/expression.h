@@ -134,3 +134,52 @@ const char* parse_brackets(const char* str, char c);
 // [regs] is either the current register structure if called from a breakpoint or null.
 // [rel_source] is the address used when computing a relative value.
 const char* __fastcall eval_expr(const char* expr, char end, size_t* out, x86_reg_t* regs, size_t rel_source);
+
+/// Dependency recording
+/// --------------------
+// Starts recording every external value that expressions evaluated on the
+// current thread depend on (options, patch tests, CPU features and function
+// or codecave addresses) into [deps], until expr_deps_end() is called.
+void expr_deps_begin(std::string *deps);
+
+// Stops recording. Returns false if anything evaluated in the meantime
+// logged a warning or an error, in which case the result shouldn't be
+// reused.
+bool expr_deps_end(void);
+
+// Returns true if all values recorded in [deps] are still the same.
+bool expr_deps_valid(const std::string& deps);
+
+// Returns true if [deps] only contains values that are fixed once the
+// options are loaded (options, patch tests and CPU features), and not any
+// function or codecave addresses.
+bool expr_deps_constant(const std::string& deps);
+/// --------------------
+
+/// Precompiled expressions
+/// -----------------------
+// Bytecode form of an expression, for values that are evaluated repeatedly.
+typedef struct expr_code_t expr_code_t;
+
+// Compiles [expr], a breakpoint expression terminated by [end], into bytecode
+// that can be evaluated by expr_code_eval() without parsing it again.
+// [expr_next] receives the same pointer eval_expr() would return.
+// Returns NULL if [expr] contains anything whose evaluation can change
+// between calls or that eval_expr() warns about, such as patch values,
+// ternaries or assignments. eval_expr() has to be used for those.
+expr_code_t* expr_compile(const char* expr, char end, const char** expr_next);
+
+// Evaluates [code] using the registers in [regs].
+size_t __fastcall expr_code_eval(const expr_code_t* code, x86_reg_t* regs);
+
+void expr_code_free(expr_code_t* code);
+
+// Translates [code] into native x86 in the codecave arena, which
+// expr_code_eval() then calls instead of interpreting the bytecode. The
+// native code only becomes executable with the next cave_arena_seal(), so
+// [code] must not be evaluated before that. Returns false if [code] can't be
+// translated, in which case it keeps being interpreted.
+// The arena never frees anything, so this is only worth it for expressions
+// that live as long as the process.
+bool expr_code_jit(expr_code_t* code);
+/// -----------------------
@@ -8,6 +8,8 @@
   */
 
 #include "thcrap.h"
+#include <memory>
+#include <unordered_map>
 
 // List from https://msdn.microsoft.com/en-us/library/cc194829.aspx
 static const struct {
@@ -29,33 +31,112 @@ static const struct {
 	{UCHAR_MAX,           0}
 };
 
-int font_has_character(HDC hdc, WCHAR c)
+/// Coverage cache
+/// --------------
+/**
+  * GetFontUnicodeRanges() is way too slow to be called for every glyph, so
+  * the ranges of every font are turned into a bitmap of the BMP once. Fonts
+  * are looked up by handle, and the LOGFONT is compared as well, in case
+  * the handle has been deleted and reused for a different font since.
+  */
+struct font_coverage_t {
+	LOGFONTW lf;
+	uint32_t bits[0x10000 / 32];
+};
+
+// Plenty for any game, and it's only 8 KiB per font.
+#define FONT_COVERAGE_MAX 64
+
+static std::unordered_map<HFONT, std::unique_ptr<font_coverage_t>> font_coverage;
+static SRWLOCK font_coverage_srwlock = { SRWLOCK_INIT };
+
+static bool logfontw_equal(const LOGFONTW &a, const LOGFONTW &b)
+{
+	return !memcmp(&a, &b, offsetof(LOGFONTW, lfFaceName))
+		&& !wcsncmp(a.lfFaceName, b.lfFaceName, LF_FACESIZE);
+}
+
+static std::unique_ptr<font_coverage_t> font_coverage_build(HDC hdc, const LOGFONTW &lf)
 {
 	DWORD size = GetFontUnicodeRanges(hdc, nullptr);
+	if (!size) {
+		return nullptr;
+	}
 	LPGLYPHSET glyphset = (LPGLYPHSET)malloc(size);
-	GetFontUnicodeRanges(hdc, glyphset);
+	if (!glyphset || !GetFontUnicodeRanges(hdc, glyphset)) {
+		free(glyphset);
+		return nullptr;
+	}
+	auto ret = std::make_unique<font_coverage_t>();
+	ret->lf = lf;
+	memset(ret->bits, 0, sizeof(ret->bits));
 	for (DWORD i = 0; i < glyphset->cRanges; i++) {
-		if (c >= glyphset->ranges[i].wcLow && c < glyphset->ranges[i].wcLow + glyphset->ranges[i].cGlyphs) {
-			free(glyphset);
-			return 1;
+		const DWORD low = glyphset->ranges[i].wcLow;
+		const DWORD high = MIN(low + glyphset->ranges[i].cGlyphs, 0x10000u);
+		for (DWORD c = low; c < high; c++) {
+			ret->bits[c / 32] |= 1u << (c % 32);
 		}
 	}
 	free(glyphset);
-	return 0;
+	return ret;
+}
+
+int font_has_character(HDC hdc, WCHAR c)
+{
+	HFONT font = (HFONT)GetCurrentObject(hdc, OBJ_FONT);
+	LOGFONTW lf;
+	if (!font || !GetObjectW(font, sizeof(lf), &lf)) {
+		return 0;
+	}
+	int ret = -1;
+	AcquireSRWLockShared(&font_coverage_srwlock);
+	auto cached = font_coverage.find(font);
+	if (cached != font_coverage.end() && logfontw_equal(cached->second->lf, lf)) {
+		ret = (cached->second->bits[c / 32] >> (c % 32)) & 1;
+	}
+	ReleaseSRWLockShared(&font_coverage_srwlock);
+	if (ret != -1) {
+		return ret;
+	}
+
+	auto coverage = font_coverage_build(hdc, lf);
+	if (!coverage) {
+		return 0;
+	}
+	ret = (coverage->bits[c / 32] >> (c % 32)) & 1;
+	AcquireSRWLockExclusive(&font_coverage_srwlock);
+	if (font_coverage.size() >= FONT_COVERAGE_MAX) {
+		font_coverage.clear();
+	}
+	font_coverage[font] = std::move(coverage);
+	ReleaseSRWLockExclusive(&font_coverage_srwlock);
+	return ret;
 }
+/// --------------
+
+// 1 + the index into [charset_to_codepage] for every character, or 0 if
+// that hasn't been looked up yet.
+static BYTE character_charset_index[0x10000];
 
 BYTE character_to_charset(WCHAR c)
 {
 	const char *defaultChar = "?";
 	char dst[5];
 
-	for (int i = 0; charset_to_codepage[i].cp != 0; i++) {
+	BYTE cached = character_charset_index[c];
+	if (cached) {
+		return charset_to_codepage[cached - 1].charset;
+	}
+	int i;
+	for (i = 0; charset_to_codepage[i].cp != 0; i++) {
 		BOOL usedDefaultChar = FALSE;
 		if (WideCharToMultiByte(charset_to_codepage[i].cp, 0, &c, 1, dst, 5, defaultChar, &usedDefaultChar) > 0 && usedDefaultChar == FALSE) {
-			return charset_to_codepage[i].charset;
+			break;
 		}
 	}
-	return UCHAR_MAX;
+	// The terminating entry maps to UCHAR_MAX.
+	character_charset_index[c] = (BYTE)(i + 1);
+	return charset_to_codepage[i].charset;
 }
 
 HFONT font_create_for_character(const LOGFONTW *lplf, WORD c)
@@ -71,3 +152,60 @@ HFONT font_create_for_character(const LOGFONTW *lplf, WORD c)
 	memset(lf.lfFaceName, 0, sizeof(lf.lfFaceName));
 	return CreateFontIndirectW(&lf);
 }
+
+/// Fallback font cache
+/// -------------------
+// Keyed by the raw bytes of the LOGFONT passed to CreateFontIndirectW(),
+// which are fully defined since the face name is zeroed.
+static std::unordered_map<std::string, HFONT> fallback_fonts;
+static SRWLOCK fallback_fonts_srwlock = { SRWLOCK_INIT };
+
+HFONT font_get_for_character(const LOGFONTW *lplf, WORD c)
+{
+	BYTE charset = character_to_charset(c);
+	if (!lplf || charset == UCHAR_MAX) {
+		return NULL;
+	}
+
+	LOGFONTW lf;
+	memcpy(&lf, lplf, sizeof(*lplf));
+	lf.lfCharSet = charset;
+	memset(lf.lfFaceName, 0, sizeof(lf.lfFaceName));
+	std::string key((const char *)&lf, sizeof(lf));
+
+	HFONT ret = NULL;
+	AcquireSRWLockShared(&fallback_fonts_srwlock);
+	auto cached = fallback_fonts.find(key);
+	if (cached != fallback_fonts.end()) {
+		ret = cached->second;
+	}
+	ReleaseSRWLockShared(&fallback_fonts_srwlock);
+	if (ret) {
+		return ret;
+	}
+
+	AcquireSRWLockExclusive(&fallback_fonts_srwlock);
+	HFONT &font = fallback_fonts[key];
+	if (!font) {
+		font = CreateFontIndirectW(&lf);
+	}
+	ret = font;
+	ReleaseSRWLockExclusive(&fallback_fonts_srwlock);
+	return ret;
+}
+/// -------------------
+
+void fonts_charset_mod_exit(void)
+{
+	AcquireSRWLockExclusive(&fallback_fonts_srwlock);
+	for (auto& font : fallback_fonts) {
+		if (font.second) {
+			DeleteObject(font.second);
+		}
+	}
+	fallback_fonts.clear();
+	ReleaseSRWLockExclusive(&fallback_fonts_srwlock);
+	AcquireSRWLockExclusive(&font_coverage_srwlock);
+	font_coverage.clear();
+	ReleaseSRWLockExclusive(&font_coverage_srwlock);
+}
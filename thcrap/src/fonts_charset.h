@@ -9,5 +9,17 @@
 
 #pragma once
 
+// Returns 1 if the font selected into [hdc] has a glyph for [c]. The
+// Unicode coverage of every font is only retrieved once.
 int font_has_character(HDC hdc, WCHAR c);
+
+// Creates a font like [lplf], but without a face name and with the charset
+// that covers [c], for GDI to pick a font that can display [c].
+// The returned font has to be deleted by the caller.
 HFONT font_create_for_character(const LOGFONTW *lplf, WORD c);
+
+// Same as font_create_for_character(), but returns a font that is cached for
+// the lifetime of the process and must not be deleted.
+HFONT font_get_for_character(const LOGFONTW *lplf, WORD c);
+
+void fonts_charset_mod_exit(void);
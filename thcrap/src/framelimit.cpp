@@ -0,0 +1,129 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Frame limiter.
+  */
+
+#include "thcrap.h"
+#include <mmsystem.h>
+#include "framelimit.h"
+
+#pragma comment(lib, "winmm.lib")
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+# define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+// Time before the deadline at which we stop sleeping and start spinning.
+// High-resolution timers usually fire within 0.5 ms, regular ones within
+// the 1 ms timer resolution we request for them.
+static const double FRAMELIMIT_SPIN_MS_HIGHRES = 1.0;
+static const double FRAMELIMIT_SPIN_MS_REGULAR = 2.0;
+
+static struct {
+	// 0 = not checked yet, 1 = enabled, -1 = disabled
+	int state = 0;
+
+	HANDLE timer = nullptr;
+	bool timer_highres = false;
+	// Whether we called timeBeginPeriod() for the regular timer
+	bool time_period = false;
+
+	LARGE_INTEGER qpc_freq;
+	LONGLONG period = 0;
+	LONGLONG spin = 0;
+	// QPC time the next frame is due at, 0 before the first frame
+	LONGLONG deadline = 0;
+} fl;
+
+static bool framelimit_enabled(void)
+{
+	if(fl.state != 0) {
+		return fl.state > 0;
+	}
+	const double fps = runconfig_frame_limit_get();
+	fl.state = fps > 0.0 ? 1 : -1;
+	if(fl.state < 0) {
+		return false;
+	}
+	QueryPerformanceFrequency(&fl.qpc_freq);
+	fl.period = (LONGLONG)(fl.qpc_freq.QuadPart / fps);
+
+	fl.timer = CreateWaitableTimerExW(
+		nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS
+	);
+	fl.timer_highres = fl.timer != nullptr;
+	if(!fl.timer) {
+		fl.timer = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+		fl.time_period = timeBeginPeriod(1) == TIMERR_NOERROR;
+	}
+	const double spin_ms = fl.timer_highres ? FRAMELIMIT_SPIN_MS_HIGHRES : FRAMELIMIT_SPIN_MS_REGULAR;
+	fl.spin = (LONGLONG)(fl.qpc_freq.QuadPart * spin_ms / 1000.0);
+	log_printf(
+		"(Frame limit) Limiting to %g FPS using a %s timer\n",
+		fps, fl.timer_highres ? "high-resolution" : (fl.timer ? "regular" : "Sleep()")
+	);
+	return true;
+}
+
+// Sleeps for roughly [ticks] QPC ticks.
+static void framelimit_sleep(LONGLONG ticks)
+{
+	// Relative due times are negative, in 100 ns units.
+	const LONGLONG units = ticks * 10000000 / fl.qpc_freq.QuadPart;
+	if(fl.timer) {
+		LARGE_INTEGER due;
+		due.QuadPart = -units;
+		if(SetWaitableTimer(fl.timer, &due, 0, nullptr, nullptr, FALSE)) {
+			WaitForSingleObject(fl.timer, INFINITE);
+			return;
+		}
+	}
+	Sleep((DWORD)(units / 10000));
+}
+
+void framelimit_wait(void)
+{
+	if(!framelimit_enabled()) {
+		return;
+	}
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	if(fl.deadline == 0) {
+		fl.deadline = now.QuadPart + fl.period;
+		return;
+	}
+	const LONGLONG remaining = fl.deadline - now.QuadPart;
+	if(remaining > fl.spin) {
+		framelimit_sleep(remaining - fl.spin);
+	}
+	do {
+		YieldProcessor();
+		QueryPerformanceCounter(&now);
+	} while(now.QuadPart < fl.deadline);
+
+	// Advancing by exactly one period keeps the average frame rate exact,
+	// but after a hitch of more than a frame (loading, window dragging), we
+	// start over instead of rushing through the frames we missed.
+	fl.deadline += fl.period;
+	if(now.QuadPart - fl.deadline >= 0) {
+		fl.deadline = now.QuadPart + fl.period;
+	}
+}
+
+extern "C" __declspec(dllexport) void framelimit_mod_exit(void)
+{
+	if(fl.timer) {
+		CloseHandle(fl.timer);
+		fl.timer = nullptr;
+	}
+	if(fl.time_period) {
+		timeEndPeriod(1);
+		fl.time_period = false;
+	}
+	fl.state = 0;
+	fl.deadline = 0;
+}
@@ -0,0 +1,22 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Frame limiter, enabled with "frame_limit" in the run configuration.
+  * Paces EndScene() calls to the given frame rate by sleeping on a
+  * high-resolution waitable timer, and busy-waits only for the last
+  * fraction of a millisecond that the timer can't be trusted with. Falls
+  * back on a regular waitable timer at 1 ms timer resolution on systems
+  * before Windows 10 1803.
+  *
+  * The games still run their own limiter, which has to be disabled by a
+  * binhack for this one to make any difference.
+  */
+
+#pragma once
+
+// Waits until the next frame is due. Must be called at the start of the
+// EndScene() detours, before their time is measured.
+void framelimit_wait(void);
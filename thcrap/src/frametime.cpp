@@ -0,0 +1,339 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Frame time overlay.
+  */
+
+#include "thcrap.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "minid3d.h"
+#include "frametime.h"
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#include <intrin.h>
+#endif
+
+// Frames shown in the rolling graph, one pixel each.
+static const size_t FRAMETIME_HISTORY = 240;
+// Height of both the graph and the histogram, in pixels per millisecond.
+static const float FRAMETIME_PX_PER_MS = 3.0f;
+// Frame time covered by the graph.
+static const float FRAMETIME_GRAPH_MS = 50.0f;
+// Histogram buckets, 2 ms each. The last one collects all slower frames.
+static const float FRAMETIME_BUCKET_MS = 2.0f;
+static const size_t FRAMETIME_BUCKETS = 25;
+static const float FRAMETIME_HISTOGRAM_W = 100.0f;
+// The frame time budget of all games.
+static const float FRAMETIME_BUDGET_MS = 1000.0f / 60.0f;
+
+struct frametime_sample_t {
+	float frame_ms;
+	float thcrap_ms;
+};
+
+static struct {
+	// 0 = not checked yet, 1 = enabled, -1 = disabled
+	int state = 0;
+
+	LARGE_INTEGER qpc_freq;
+	LONGLONG qpc_last = 0;
+	uint64_t tsc_last = 0;
+	LONG64 bp_cycles_last = 0;
+	// Time spent in the previous EndScene() detour, which counts towards
+	// the next frame.
+	float detour_ms_last = 0.0f;
+
+	// Every frame, for the CSV file
+	std::vector<frametime_sample_t> frames;
+	uint64_t histogram[FRAMETIME_BUCKETS] = {};
+
+	d3d_version_t ver;
+	IDirect3DDevice *d3dd = nullptr;
+	IDirect3DStateBlock sb = 0;
+} ft;
+
+static bool frametime_enabled(void)
+{
+	if(ft.state == 0) {
+		ft.state = runconfig_frame_overlay_get() ? 1 : -1;
+		if(ft.state > 0) {
+			QueryPerformanceFrequency(&ft.qpc_freq);
+			ft.frames.reserve(60 * 60 * 10);
+			if(!runconfig_bp_profile_get()) {
+				log_print("(Frame overlay) \"bp_profile\" is disabled, breakpoint time won't be included.\n");
+			}
+		}
+	}
+	return ft.state > 0;
+}
+
+LONGLONG frametime_detour_start(void)
+{
+	if(!frametime_enabled()) {
+		return 0;
+	}
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+/// State block
+/// -----------
+// Records exactly the states changed by the overlay, in the same way as
+// the TL note renderer.
+static IDirect3DStateBlock frametime_stateblock_get(d3d_version_t ver, IDirect3DDevice *d3dd)
+{
+	if(ft.sb && ft.d3dd == d3dd && ft.ver == ver) {
+		return ft.sb;
+	}
+	ft.sb = 0;
+
+	const D3DVIEWPORT viewport = { 0 };
+	d3dd_BeginStateBlock(ver, d3dd);
+	d3dd_SetViewport(ver, d3dd, &viewport);
+	d3dd_SetRenderState(ver, d3dd, D3DRS_ALPHATESTENABLE, false);
+	d3dd_SetRenderState(ver, d3dd, D3DRS_ALPHABLENDENABLE, false);
+	d3dd_SetRenderState(ver, d3dd, D3DRS_SRCBLEND, D3DBLEND_SRCALPHA);
+	d3dd_SetRenderState(ver, d3dd, D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
+	d3dd_SetTextureStageState(ver, d3dd, 0, D3DTSS_ALPHAARG1, D3DTA_DIFFUSE);
+	d3dd_SetTextureStageState(ver, d3dd, 0, D3DTSS_COLORARG1, D3DTA_DIFFUSE);
+	d3dd_SetFVF(ver, d3dd, D3DFVF_XYZRHW | D3DFVF_DIFFUSE);
+	d3dd_SetTexture(ver, d3dd, 0, nullptr);
+	if(FAILED(d3dd_EndStateBlock(ver, d3dd, &ft.sb))) {
+		ft.sb = 0;
+	}
+	ft.ver = ver;
+	ft.d3dd = d3dd;
+	return ft.sb;
+}
+
+void frametime_reset(IDirect3DDevice *d3dd)
+{
+	if(ft.sb && ft.d3dd == d3dd) {
+		d3dd_DeleteStateBlock(ft.ver, d3dd, ft.sb);
+	}
+	ft.sb = 0;
+}
+/// -----------
+
+/// Rendering
+/// ---------
+struct frametime_vertex_t {
+	vector3_t pos;
+	float rhw;
+	uint32_t col_diffuse;
+};
+
+static void frametime_line(std::vector<frametime_vertex_t> &verts, float x1, float y1, float x2, float y2, uint32_t col)
+{
+	verts.push_back({ { x1, y1, 0.0f }, 1.0f, col });
+	verts.push_back({ { x2, y2, 0.0f }, 1.0f, col });
+}
+
+static void frametime_render(d3d_version_t ver, IDirect3DDevice *d3dd)
+{
+	IDirect3DStateBlock sb_game = frametime_stateblock_get(ver, d3dd);
+	const bool sb_temporary = !sb_game;
+	if(sb_temporary) {
+		d3dd_CreateStateBlock(ver, d3dd, D3DSBT_ALL, &sb_game);
+	}
+	d3dd_CaptureStateBlock(ver, d3dd, sb_game);
+	defer({
+		d3dd_ApplyStateBlock(ver, d3dd, sb_game);
+		if(sb_temporary) {
+			d3dd_DeleteStateBlock(ver, d3dd, sb_game);
+		}
+	});
+
+	IDirect3DSurface *backbuffer = nullptr;
+	D3DSURFACE_DESC backbuffer_desc;
+	if(FAILED(d3dd_GetBackBuffer(ver, d3dd, 0, D3DBACKBUFFER_TYPE_MONO, &backbuffer))) {
+		return;
+	}
+	HRESULT desc_ret = d3ds_GetDesc(ver, backbuffer, &backbuffer_desc);
+	backbuffer->Release();
+	if(FAILED(desc_ret)) {
+		return;
+	}
+	D3DVIEWPORT viewport;
+	viewport.X = 0;
+	viewport.Y = 0;
+	viewport.Width = backbuffer_desc.Width;
+	viewport.Height = backbuffer_desc.Height;
+	viewport.MinZ = 0.0f;
+	viewport.MaxZ = 1.0f;
+	d3dd_SetViewport(ver, d3dd, &viewport);
+	d3dd_SetFVF(ver, d3dd, D3DFVF_XYZRHW | D3DFVF_DIFFUSE);
+	d3dd_SetTexture(ver, d3dd, 0, nullptr);
+	d3dd_SetRenderState(ver, d3dd, D3DRS_ALPHATESTENABLE, false);
+	d3dd_SetRenderState(ver, d3dd, D3DRS_SRCBLEND, D3DBLEND_SRCALPHA);
+	d3dd_SetRenderState(ver, d3dd, D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
+	d3dd_SetTextureStageState(ver, d3dd, 0, D3DTSS_ALPHAARG1, D3DTA_DIFFUSE);
+	d3dd_SetTextureStageState(ver, d3dd, 0, D3DTSS_COLORARG1, D3DTA_DIFFUSE);
+
+	const float left = 8.0f;
+	const float bottom = 8.0f + FRAMETIME_GRAPH_MS * FRAMETIME_PX_PER_MS;
+	const float graph_right = left + FRAMETIME_HISTORY;
+	const float hist_left = graph_right + 8.0f;
+	const float hist_right = hist_left + FRAMETIME_HISTOGRAM_W;
+	auto ms_to_y = [bottom](float ms) {
+		return bottom - MIN(ms, FRAMETIME_GRAPH_MS) * FRAMETIME_PX_PER_MS;
+	};
+
+	// Translucent background
+	d3dd_SetRenderState(ver, d3dd, D3DRS_ALPHABLENDENABLE, true);
+	const uint32_t bg_col = D3DCOLOR_ARGB(0xA0, 0, 0, 0);
+	frametime_vertex_t bg[] = {
+		{ { left - 4.0f, ms_to_y(FRAMETIME_GRAPH_MS) - 4.0f, 0.0f }, 1.0f, bg_col },
+		{ { hist_right + 4.0f, ms_to_y(FRAMETIME_GRAPH_MS) - 4.0f, 0.0f }, 1.0f, bg_col },
+		{ { left - 4.0f, bottom + 4.0f, 0.0f }, 1.0f, bg_col },
+		{ { hist_right + 4.0f, bottom + 4.0f, 0.0f }, 1.0f, bg_col },
+	};
+	d3dd_DrawPrimitiveUP(ver, d3dd, D3DPT_TRIANGLESTRIP, elementsof(bg) - 2, bg, sizeof(bg[0]));
+	d3dd_SetRenderState(ver, d3dd, D3DRS_ALPHABLENDENABLE, false);
+
+	static std::vector<frametime_vertex_t> verts;
+	verts.clear();
+
+	// Rolling graph, with the thcrap part of each frame stacked at the
+	// bottom of its bar.
+	const size_t count = MIN(ft.frames.size(), FRAMETIME_HISTORY);
+	const frametime_sample_t *samples = ft.frames.data() + ft.frames.size() - count;
+	for(size_t i = 0; i < count; i++) {
+		const float x = graph_right - (float)(count - i) + 0.5f;
+		const float frame_ms = samples[i].frame_ms;
+		const float thcrap_ms = MIN(samples[i].thcrap_ms, frame_ms);
+		const uint32_t col = (frame_ms > FRAMETIME_BUDGET_MS * 1.5f)
+			? D3DCOLOR_ARGB(0xFF, 0xFF, 0x80, 0x00)
+			: D3DCOLOR_ARGB(0xFF, 0x60, 0x90, 0xFF);
+		frametime_line(verts, x, ms_to_y(thcrap_ms), x, ms_to_y(frame_ms), col);
+		if(thcrap_ms > 0.0f) {
+			frametime_line(verts, x, bottom, x, ms_to_y(thcrap_ms), D3DCOLOR_ARGB(0xFF, 0xFF, 0x20, 0x20));
+		}
+	}
+
+	// Histogram, from the fastest bucket at the bottom
+	uint64_t bucket_max = 1;
+	for(auto n : ft.histogram) {
+		bucket_max = MAX(bucket_max, n);
+	}
+	const float bucket_h = (FRAMETIME_GRAPH_MS * FRAMETIME_PX_PER_MS) / FRAMETIME_BUCKETS;
+	for(size_t i = 0; i < FRAMETIME_BUCKETS; i++) {
+		if(!ft.histogram[i]) {
+			continue;
+		}
+		const float w = FRAMETIME_HISTOGRAM_W * (float)ft.histogram[i] / (float)bucket_max;
+		const float y_top = bottom - (i + 1) * bucket_h;
+		const uint32_t col = ((i + 1) * FRAMETIME_BUCKET_MS > FRAMETIME_BUDGET_MS * 1.5f)
+			? D3DCOLOR_ARGB(0xFF, 0xFF, 0x80, 0x00)
+			: D3DCOLOR_ARGB(0xFF, 0x60, 0x90, 0xFF);
+		for(float y = y_top + 0.5f; y < y_top + bucket_h - 1.0f; y += 1.0f) {
+			frametime_line(verts, hist_left, y, hist_left + w, y, col);
+		}
+	}
+
+	// 60 and 30 FPS lines
+	const uint32_t budget_col = D3DCOLOR_ARGB(0xFF, 0x40, 0xFF, 0x40);
+	for(float ms : { FRAMETIME_BUDGET_MS, FRAMETIME_BUDGET_MS * 2.0f }) {
+		const float y = ms_to_y(ms) + 0.5f;
+		frametime_line(verts, left, y, graph_right, y, budget_col);
+		const float hist_y = bottom - (ms / FRAMETIME_BUCKET_MS) * bucket_h + 0.5f;
+		frametime_line(verts, hist_left - 4.0f, hist_y, hist_left, hist_y, budget_col);
+	}
+
+	if(!verts.empty()) {
+		d3dd_DrawPrimitiveUP(ver, d3dd, D3DPT_LINELIST, verts.size() / 2, verts.data(), sizeof(verts[0]));
+	}
+}
+/// ---------
+
+void frametime_frame(d3d_version_t ver, IDirect3DDevice *d3dd, LONGLONG detour_start)
+{
+	if(!detour_start || !frametime_enabled()) {
+		return;
+	}
+	LARGE_INTEGER qpc_now;
+	QueryPerformanceCounter(&qpc_now);
+	const uint64_t tsc_now = __rdtsc();
+	const LONG64 bp_cycles_now = breakpoint_profile_cycles_total();
+
+	if(ft.qpc_last) {
+		const double qpc_per_ms = (double)ft.qpc_freq.QuadPart / 1000.0;
+		const double frame_ms = (double)(qpc_now.QuadPart - ft.qpc_last) / qpc_per_ms;
+		const double tsc_per_ms = frame_ms > 0.0 ? (double)(tsc_now - ft.tsc_last) / frame_ms : 0.0;
+		const double bp_ms = tsc_per_ms > 0.0 ? (double)(bp_cycles_now - ft.bp_cycles_last) / tsc_per_ms : 0.0;
+		const double detour_ms = (double)(qpc_now.QuadPart - detour_start) / qpc_per_ms;
+
+		frametime_sample_t sample;
+		sample.frame_ms = (float)frame_ms;
+		sample.thcrap_ms = (float)(bp_ms + detour_ms + ft.detour_ms_last);
+		ft.frames.push_back(sample);
+		const size_t bucket = (size_t)(frame_ms / FRAMETIME_BUCKET_MS);
+		ft.histogram[MIN(bucket, FRAMETIME_BUCKETS - 1)]++;
+	}
+
+	ft.qpc_last = qpc_now.QuadPart;
+	ft.tsc_last = tsc_now;
+	ft.bp_cycles_last = bp_cycles_now;
+
+	frametime_render(ver, d3dd);
+
+	// Rendering the overlay counts towards the next frame.
+	LARGE_INTEGER qpc_rendered;
+	QueryPerformanceCounter(&qpc_rendered);
+	ft.detour_ms_last = (float)((double)(qpc_rendered.QuadPart - qpc_now.QuadPart) * 1000.0 / (double)ft.qpc_freq.QuadPart);
+}
+
+static void frametime_dump(void)
+{
+	if(ft.frames.empty()) {
+		return;
+	}
+	std::vector<float> sorted(ft.frames.size());
+	double frame_total = 0.0;
+	double thcrap_total = 0.0;
+	size_t over_budget = 0;
+	std::string csv = "frame,frame_ms,thcrap_ms\n";
+	char line[64];
+	for(size_t i = 0; i < ft.frames.size(); i++) {
+		const auto &f = ft.frames[i];
+		sorted[i] = f.frame_ms;
+		frame_total += f.frame_ms;
+		thcrap_total += f.thcrap_ms;
+		over_budget += f.frame_ms > FRAMETIME_BUDGET_MS * 1.5f;
+		snprintf(line, sizeof(line), "%u,%.3f,%.3f\n", (unsigned int)i, f.frame_ms, f.thcrap_ms);
+		csv += line;
+	}
+	std::sort(sorted.begin(), sorted.end());
+	const size_t n = sorted.size();
+	log_printf(
+		"--------------\n"
+		"Frame overlay:\n"
+		"--------------\n"
+		"%u frames, %.3f ms average, %.3f ms p50, %.3f ms p99\n"
+		"%.3f ms of thcrap time per frame on average (%.2f%%)\n"
+		"%u frames (%.2f%%) took longer than 1.5 frames at 60 FPS\n"
+		"--------------\n",
+		(unsigned int)n, frame_total / n, sorted[n / 2], sorted[MIN(n * 99 / 100, n - 1)],
+		thcrap_total / n, frame_total > 0.0 ? thcrap_total * 100.0 / frame_total : 0.0,
+		(unsigned int)over_budget, over_budget * 100.0 / n
+	);
+
+	const char *thcrap_dir = runconfig_thcrap_dir_get();
+	std::string fn = thcrap_dir ? std::string(thcrap_dir) + "/" : "";
+	fn += "logs/frametime.csv";
+	if(file_write(fn.c_str(), csv.data(), csv.size())) {
+		log_printf("(Frame overlay) Couldn't write %s\n", fn.c_str());
+	}
+}
+
+extern "C" __declspec(dllexport) void frametime_mod_exit(void)
+{
+	frametime_dump();
+	ft.frames.clear();
+	ft.frames.shrink_to_fit();
+}
@@ -0,0 +1,28 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Frame time overlay, enabled with "frame_overlay" in the run
+  * configuration. Shows the time of every frame together with the time
+  * thcrap spent in it, as a rolling graph and a histogram, and writes all
+  * frame times to logs/frametime.csv on exit.
+  *
+  * The thcrap part of a frame consists of the time spent in our EndScene()
+  * detours, and in all breakpoints if "bp_profile" is enabled as well.
+  */
+
+#pragma once
+
+// Returns the start time of an EndScene() detour, to be passed to
+// frametime_frame(), or 0 if the overlay is disabled.
+LONGLONG frametime_detour_start(void);
+
+// Ends the current frame and renders the overlay. Must be called at the end
+// of the EndScene() detours, after everything else has been rendered.
+void frametime_frame(d3d_version_t ver, IDirect3DDevice *d3dd, LONGLONG detour_start);
+
+// Releases all Direct3D objects of the overlay. Must be called before every
+// Reset() call.
+void frametime_reset(IDirect3DDevice *d3dd);
@@ -0,0 +1,181 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Glyph outline cache.
+  */
+
+#include "thcrap.h"
+#include <list>
+#include <unordered_map>
+
+// Upper limit for the glyph buffers kept in the cache, on top of the shared
+// cache budget. A 32-pixel glyph in GGO_GRAY8_BITMAP format takes about
+// 1 KiB.
+#define GLYPH_CACHE_SIZE (4 * 1024 * 1024)
+
+struct glyph_cached_t {
+	GLYPHMETRICS gm;
+	// Return value of GetGlyphOutline() without a buffer
+	DWORD size;
+	// Return value of GetGlyphOutline() with a buffer of [size] bytes
+	DWORD ret;
+	std::vector<BYTE> buf;
+};
+
+// Most recently used glyphs first.
+typedef std::list<std::pair<std::string, glyph_cached_t>> glyph_lru_t;
+
+static glyph_lru_t glyph_lru;
+static std::unordered_map<std::string, glyph_lru_t::iterator> glyph_cache;
+static size_t glyph_cache_bytes = 0;
+static SRWLOCK glyph_cache_srwlock = { SRWLOCK_INIT };
+static cache_mgr_entry_t *glyph_cache_mgr = NULL;
+
+static size_t glyph_cache_entry_bytes(const glyph_lru_t::value_type &entry)
+{
+	return entry.first.size() + entry.second.buf.size() + sizeof(glyph_cached_t);
+}
+
+// Must be called with [glyph_cache_srwlock] held exclusively. Returns the
+// number of bytes released.
+static size_t glyph_cache_evict_last(void)
+{
+	const auto &evicted = glyph_lru.back();
+	const size_t evicted_bytes = glyph_cache_entry_bytes(evicted);
+	glyph_cache.erase(evicted.first);
+	glyph_lru.pop_back();
+	glyph_cache_bytes -= evicted_bytes;
+	memstats_remove(MEMSTATS_FONT, evicted_bytes);
+	cache_mgr_remove(glyph_cache_mgr, evicted_bytes);
+	return evicted_bytes;
+}
+
+static size_t glyph_cache_evict(size_t bytes)
+{
+	size_t ret = 0;
+	AcquireSRWLockExclusive(&glyph_cache_srwlock);
+	while(ret < bytes && !glyph_lru.empty()) {
+		ret += glyph_cache_evict_last();
+	}
+	ReleaseSRWLockExclusive(&glyph_cache_srwlock);
+	return ret;
+}
+
+// Builds the key from the LOGFONT of the font selected into [hdc], and the
+// other parameters that affect the outline. Returns false if the font can't
+// be identified.
+static bool glyph_cache_key(std::string &key, HDC hdc, UINT uChar, UINT uFormat, const MAT2 *lpmat2)
+{
+	HFONT font = (HFONT)GetCurrentObject(hdc, OBJ_FONT);
+	LOGFONTW lf;
+	if(!font || !lpmat2 || !GetObjectW(font, sizeof(lf), &lf)) {
+		return false;
+	}
+	// GDI doesn't care about anything after the terminating \0.
+	const size_t face_len = wcsnlen(lf.lfFaceName, LF_FACESIZE);
+	memset(lf.lfFaceName + face_len, 0, (LF_FACESIZE - face_len) * sizeof(wchar_t));
+	key.reserve(sizeof(lf) + sizeof(uChar) + sizeof(uFormat) + sizeof(*lpmat2));
+	key.append((const char *)&lf, sizeof(lf));
+	key.append((const char *)&uChar, sizeof(uChar));
+	key.append((const char *)&uFormat, sizeof(uFormat));
+	key.append((const char *)lpmat2, sizeof(*lpmat2));
+	return true;
+}
+
+// Copies [glyph] into the caller's parameters, if it can fully answer the
+// call.
+static bool glyph_cache_answer(const glyph_cached_t &glyph, LPGLYPHMETRICS lpgm, DWORD cbBuffer, LPVOID lpvBuffer, DWORD *ret)
+{
+	if(!lpvBuffer || !cbBuffer) {
+		*lpgm = glyph.gm;
+		*ret = glyph.size;
+		return true;
+	}
+	if(cbBuffer < glyph.size) {
+		return false;
+	}
+	*lpgm = glyph.gm;
+	memcpy(lpvBuffer, glyph.buf.data(), glyph.size);
+	*ret = glyph.ret;
+	return true;
+}
+
+DWORD glyph_cache_get(
+	HDC hdc, UINT uChar, UINT uFormat, LPGLYPHMETRICS lpgm,
+	DWORD cbBuffer, LPVOID lpvBuffer, const MAT2 *lpmat2,
+	glyph_outline_func_t render
+)
+{
+	std::string key;
+	if(!lpgm || !glyph_cache_key(key, hdc, uChar, uFormat, lpmat2)) {
+		return render(hdc, uChar, uFormat, lpgm, cbBuffer, lpvBuffer, lpmat2);
+	}
+	// Rendering a glyph costs about as much as decoding the same amount of
+	// image data.
+	static cache_mgr_entry_t *mgr = glyph_cache_mgr = cache_mgr_register("Glyph outlines", 2, glyph_cache_evict);
+	(void)mgr;
+
+	DWORD ret;
+	bool hit = false;
+	AcquireSRWLockExclusive(&glyph_cache_srwlock);
+	auto cached = glyph_cache.find(key);
+	if(cached != glyph_cache.end()) {
+		hit = true;
+		glyph_lru.splice(glyph_lru.begin(), glyph_lru, cached->second);
+		cache_mgr_touch(glyph_cache_mgr);
+		if(glyph_cache_answer(cached->second->second, lpgm, cbBuffer, lpvBuffer, &ret)) {
+			ReleaseSRWLockExclusive(&glyph_cache_srwlock);
+			return ret;
+		}
+	}
+	ReleaseSRWLockExclusive(&glyph_cache_srwlock);
+	if(hit) {
+		// Buffer too small, GDI knows what to do with that.
+		return render(hdc, uChar, uFormat, lpgm, cbBuffer, lpvBuffer, lpmat2);
+	}
+
+	// Always render the full glyph on a miss, even if the game only asked
+	// for the size, since it will ask for the glyph itself right after.
+	glyph_cached_t glyph = {};
+	glyph.size = render(hdc, uChar, uFormat, &glyph.gm, 0, NULL, lpmat2);
+	if(glyph.size == GDI_ERROR) {
+		return render(hdc, uChar, uFormat, lpgm, cbBuffer, lpvBuffer, lpmat2);
+	}
+	// Blank glyphs still need a valid buffer to be rendered into.
+	glyph.buf.resize(MAX(glyph.size, 1));
+	glyph.ret = render(hdc, uChar, uFormat, &glyph.gm, glyph.size ? glyph.size : 1, glyph.buf.data(), lpmat2);
+	if(glyph.ret == GDI_ERROR) {
+		return render(hdc, uChar, uFormat, lpgm, cbBuffer, lpvBuffer, lpmat2);
+	}
+	if(!glyph_cache_answer(glyph, lpgm, cbBuffer, lpvBuffer, &ret)) {
+		ret = render(hdc, uChar, uFormat, lpgm, cbBuffer, lpvBuffer, lpmat2);
+	}
+
+	AcquireSRWLockExclusive(&glyph_cache_srwlock);
+	if(glyph_cache.find(key) == glyph_cache.end()) {
+		glyph_lru.emplace_front(key, std::move(glyph));
+		glyph_cache[std::move(key)] = glyph_lru.begin();
+		const size_t glyph_bytes = glyph_cache_entry_bytes(glyph_lru.front());
+		glyph_cache_bytes += glyph_bytes;
+		memstats_add(MEMSTATS_FONT, glyph_bytes);
+		cache_mgr_add(glyph_cache_mgr, glyph_bytes);
+		while(glyph_cache_bytes > GLYPH_CACHE_SIZE && glyph_lru.size() > 1) {
+			glyph_cache_evict_last();
+		}
+	}
+	ReleaseSRWLockExclusive(&glyph_cache_srwlock);
+	cache_mgr_trim();
+	return ret;
+}
+
+void glyph_cache_mod_exit(void)
+{
+	AcquireSRWLockExclusive(&glyph_cache_srwlock);
+	while(!glyph_lru.empty()) {
+		glyph_cache_evict_last();
+	}
+	ReleaseSRWLockExclusive(&glyph_cache_srwlock);
+}
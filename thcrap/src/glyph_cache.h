@@ -0,0 +1,32 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Glyph outline cache.
+  * Games that rasterize their text one character at a time keep asking GDI
+  * for the same few hundred glyphs. This cache keeps the GLYPHMETRICS and
+  * the buffer returned by GetGlyphOutline() for every combination of font,
+  * character, format and transformation matrix, and evicts the least
+  * recently used glyphs once it grows beyond a fixed size.
+  */
+
+#pragma once
+
+typedef DWORD (WINAPI *glyph_outline_func_t)(
+	HDC hdc, UINT uChar, UINT uFormat, LPGLYPHMETRICS lpgm,
+	DWORD cbBuffer, LPVOID lpvBuffer, const MAT2 *lpmat2
+);
+
+// Same as GetGlyphOutlineW(), but answers from the cache if possible, and
+// calls [render] with the font currently selected into [hdc] otherwise.
+// [render] must give the same result for the same font, character, format
+// and matrix every time.
+DWORD glyph_cache_get(
+	HDC hdc, UINT uChar, UINT uFormat, LPGLYPHMETRICS lpgm,
+	DWORD cbBuffer, LPVOID lpvBuffer, const MAT2 *lpmat2,
+	glyph_outline_func_t render
+);
+
+void glyph_cache_mod_exit(void);
@@ -0,0 +1,319 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Cache of patch hook outputs.
+  */
+
+#include "thcrap.h"
+#include <list>
+#include <unordered_map>
+
+#define HOOK_CACHE_DISK_NS "hooks"
+#define HOOK_CACHE_DISK_VERSION 1
+// Largest single entry kept in memory, relative to the cache budget
+#define HOOK_CACHE_ENTRY_MAX(budget) ((budget) / 4)
+// Number of JSON patches whose hash is remembered. Once exceeded, those
+// that aren't referenced anywhere else anymore are dropped.
+#define HOOK_CACHE_PATCH_HASHES_MAX 256
+
+struct hook_cache_entry_t {
+	hook_cache_key_t key;
+	int ret;
+	BYTE *data;
+};
+
+// Most recently used first
+static std::list<hook_cache_entry_t> hook_cache_lru;
+static std::unordered_map<uint64_t, std::list<hook_cache_entry_t>::iterator> hook_cache_map;
+static cache_mgr_entry_t *hook_cache_mgr = nullptr;
+static SRWLOCK hook_cache_srwlock = SRWLOCK_INIT;
+
+// Hashes of JSON patches by address. The resolved JSON cache hands out the
+// same object for every load of a file, and every entry holds a reference
+// to its patch, so that the address can't be reused while it exists.
+static std::unordered_map<json_t *, uint64_t> hook_cache_patch_hashes;
+static SRWLOCK hook_cache_patch_srwlock = SRWLOCK_INIT;
+
+static uint64_t hook_cache_stack_hash_value = 0;
+static bool hook_cache_stack_hashed = false;
+static SRWLOCK hook_cache_stack_srwlock = SRWLOCK_INIT;
+
+uint64_t hook_cache_hash(const void *data, size_t len, uint64_t h)
+{
+	const BYTE *p = (const BYTE *)data;
+	const uint64_t mul = 0x9E3779B97F4A7C15ull;
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * mul;
+		h ^= h >> 29;
+	}
+	for (; len; len--, p++) {
+		h = (h ^ *p) * mul;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+uint64_t hook_cache_hash_str(const char *str, uint64_t h)
+{
+	if (str) {
+		h = hook_cache_hash(str, strlen(str), h);
+	}
+	// Separator, so that "ab" + "c" and "a" + "bc" differ
+	return hook_cache_hash("\n", 1, h);
+}
+
+uint64_t hook_cache_stack_hash(void)
+{
+	AcquireSRWLockExclusive(&hook_cache_stack_srwlock);
+	if (!hook_cache_stack_hashed) {
+		uint64_t h = hook_cache_hash_str(runconfig_game_get(), 0);
+		h = hook_cache_hash_str(runconfig_build_get(), h);
+		// Some hooks read settings from the run configuration.
+		char *runcfg = json_dumps(runconfig_json_get(), JSON_COMPACT | JSON_SORT_KEYS);
+		h = hook_cache_hash_str(runcfg, h);
+		SAFE_FREE(runcfg);
+		stack_foreach_cpp([&h](const patch_t *patch) {
+			h = hook_cache_hash_str(patch->archive, h);
+			char *config = patch->config ? json_dumps(patch->config, JSON_COMPACT | JSON_SORT_KEYS) : NULL;
+			h = hook_cache_hash_str(config, h);
+			SAFE_FREE(config);
+		});
+		hook_cache_stack_hash_value = h;
+		hook_cache_stack_hashed = true;
+	}
+	const uint64_t ret = hook_cache_stack_hash_value;
+	ReleaseSRWLockExclusive(&hook_cache_stack_srwlock);
+	return ret;
+}
+
+static uint64_t hook_cache_patch_hash(json_t *patch)
+{
+	if (!patch) {
+		return hook_cache_hash_str(NULL, 0);
+	}
+	AcquireSRWLockShared(&hook_cache_patch_srwlock);
+	auto it = hook_cache_patch_hashes.find(patch);
+	const bool found = it != hook_cache_patch_hashes.end();
+	const uint64_t known = found ? it->second : 0;
+	ReleaseSRWLockShared(&hook_cache_patch_srwlock);
+	if (found) {
+		return known;
+	}
+
+	char *patch_str = json_dumps(patch, JSON_COMPACT | JSON_SORT_KEYS);
+	const uint64_t ret = hook_cache_hash_str(patch_str, 0);
+	SAFE_FREE(patch_str);
+
+	AcquireSRWLockExclusive(&hook_cache_patch_srwlock);
+	if (hook_cache_patch_hashes.size() >= HOOK_CACHE_PATCH_HASHES_MAX) {
+		for (auto it = hook_cache_patch_hashes.begin(); it != hook_cache_patch_hashes.end(); ) {
+			if (it->first->refcount <= 1) {
+				json_decref(it->first);
+				it = hook_cache_patch_hashes.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+	if (hook_cache_patch_hashes.try_emplace(patch, ret).second) {
+		json_incref(patch);
+	}
+	ReleaseSRWLockExclusive(&hook_cache_patch_srwlock);
+	return ret;
+}
+
+bool hook_cache_key(hook_cache_key_t *key, const char *fn, json_t *patch, const void *in, size_t size_in, size_t size_out)
+{
+	if (!key || !fn || !in || size_in > UINT32_MAX || size_out > UINT32_MAX) {
+		return false;
+	}
+	uint64_t h = hook_cache_hash_str(fn, 0);
+	h ^= hook_cache_patch_hash(patch);
+	key->hash = hook_cache_hash(in, size_in, h);
+	key->size_in = (uint32_t)size_in;
+	key->size_out = (uint32_t)size_out;
+	return true;
+}
+
+/// In-memory tier
+/// --------------
+static void hook_cache_unlink(std::list<hook_cache_entry_t>::iterator it)
+{
+	cache_mgr_remove(hook_cache_mgr, it->key.size_out);
+	memstats_remove(MEMSTATS_FILE_REP, it->key.size_out);
+	hook_cache_map.erase(it->key.hash);
+	free(it->data);
+	hook_cache_lru.erase(it);
+}
+
+static size_t hook_cache_evict(size_t bytes)
+{
+	size_t ret = 0;
+	AcquireSRWLockExclusive(&hook_cache_srwlock);
+	while (ret < bytes && !hook_cache_lru.empty()) {
+		auto it = std::prev(hook_cache_lru.end());
+		ret += it->key.size_out;
+		hook_cache_unlink(it);
+	}
+	ReleaseSRWLockExclusive(&hook_cache_srwlock);
+	return ret;
+}
+
+static bool hook_cache_memory_get(const hook_cache_key_t *key, void *out, int *ret)
+{
+	bool hit = false;
+	AcquireSRWLockExclusive(&hook_cache_srwlock);
+	auto it = hook_cache_map.find(key->hash);
+	if (it != hook_cache_map.end() && it->second->key.size_in == key->size_in && it->second->key.size_out == key->size_out) {
+		memcpy(out, it->second->data, key->size_out);
+		*ret = it->second->ret;
+		hook_cache_lru.splice(hook_cache_lru.begin(), hook_cache_lru, it->second);
+		cache_mgr_touch(hook_cache_mgr);
+		hit = true;
+	}
+	ReleaseSRWLockExclusive(&hook_cache_srwlock);
+	return hit;
+}
+
+static void hook_cache_memory_put(const hook_cache_key_t *key, const void *out, int ret)
+{
+	const size_t budget = cache_mgr_budget();
+	if (budget && key->size_out > HOOK_CACHE_ENTRY_MAX(budget)) {
+		return;
+	}
+	BYTE *data = (BYTE *)malloc(MAX(key->size_out, 1u));
+	if (!data) {
+		return;
+	}
+	memcpy(data, out, key->size_out);
+
+	AcquireSRWLockExclusive(&hook_cache_srwlock);
+	if (!hook_cache_mgr) {
+		// Patch hooks are mostly cheap, but still need the file and its
+		// patch to be loaded again.
+		hook_cache_mgr = cache_mgr_register("Patched files", 4, hook_cache_evict);
+	}
+	auto it = hook_cache_map.find(key->hash);
+	if (it != hook_cache_map.end()) {
+		hook_cache_unlink(it->second);
+	}
+	hook_cache_lru.push_front({ *key, ret, data });
+	hook_cache_map.emplace(key->hash, hook_cache_lru.begin());
+	cache_mgr_add(hook_cache_mgr, key->size_out);
+	memstats_add(MEMSTATS_FILE_REP, key->size_out);
+	ReleaseSRWLockExclusive(&hook_cache_srwlock);
+	cache_mgr_trim();
+}
+/// --------------
+
+/// On-disk tier
+/// ------------
+static std::string hook_cache_disk_key(const hook_cache_key_t *key)
+{
+	const char *game = runconfig_game_get();
+	const char *build = runconfig_build_get();
+	if (!game || !build) {
+		return "";
+	}
+	const uint64_t stack_hash = hook_cache_stack_hash();
+	char buf[96];
+	snprintf(buf, sizeof(buf), "/%u/%08x%08x/%08x%08x.%u.%u",
+		HOOK_CACHE_DISK_VERSION,
+		(uint32_t)(stack_hash >> 32), (uint32_t)stack_hash,
+		(uint32_t)(key->hash >> 32), (uint32_t)key->hash,
+		key->size_in, key->size_out
+	);
+	std::string ret = game;
+	ret += '.';
+	ret += build;
+	ret += buf;
+	return ret;
+}
+
+// Entries are the return value of the hooks, followed by the output.
+static bool hook_cache_disk_get(const hook_cache_key_t *key, void *out, int *ret)
+{
+	std::string disk_key = hook_cache_disk_key(key);
+	if (disk_key.empty()) {
+		return false;
+	}
+	size_t size = 0;
+	BYTE *data = (BYTE *)disk_cache_get(HOOK_CACHE_DISK_NS, disk_key.c_str(), &size);
+	const bool hit = data && size == sizeof(int32_t) + key->size_out;
+	if (hit) {
+		int32_t ret32;
+		memcpy(&ret32, data, sizeof(ret32));
+		*ret = ret32;
+		memcpy(out, data + sizeof(ret32), key->size_out);
+	}
+	free(data);
+	return hit;
+}
+
+static void hook_cache_disk_put(const hook_cache_key_t *key, const void *out, int ret)
+{
+	std::string disk_key = hook_cache_disk_key(key);
+	if (disk_key.empty()) {
+		return;
+	}
+	const int32_t ret32 = ret;
+	std::vector<BYTE> data(sizeof(ret32) + key->size_out);
+	memcpy(data.data(), &ret32, sizeof(ret32));
+	memcpy(data.data() + sizeof(ret32), out, key->size_out);
+	// Compressing and writing can wait until the game is done loading.
+	task_submit_func(TASK_PRIORITY_BACKGROUND, nullptr, [disk_key = std::move(disk_key), data = std::move(data)]() {
+		disk_cache_put(HOOK_CACHE_DISK_NS, disk_key.c_str(), data.data(), data.size(), 0);
+	});
+}
+/// ------------
+
+bool hook_cache_get(const hook_cache_key_t *key, void *out, int *ret)
+{
+	if (!key || !out || !ret) {
+		return false;
+	}
+	if (hook_cache_memory_get(key, out, ret)) {
+		return true;
+	}
+	if (shm_cache_get(key, out, ret)) {
+		hook_cache_memory_put(key, out, *ret);
+		return true;
+	}
+	if (hook_cache_disk_get(key, out, ret)) {
+		hook_cache_memory_put(key, out, *ret);
+		shm_cache_put(key, out, *ret);
+		return true;
+	}
+	return false;
+}
+
+void hook_cache_put(const hook_cache_key_t *key, const void *out, int ret)
+{
+	if (!key || !out) {
+		return;
+	}
+	hook_cache_memory_put(key, out, ret);
+	shm_cache_put(key, out, ret);
+	hook_cache_disk_put(key, out, ret);
+}
+
+void hook_cache_mod_exit(void)
+{
+	AcquireSRWLockExclusive(&hook_cache_srwlock);
+	while (!hook_cache_lru.empty()) {
+		hook_cache_unlink(hook_cache_lru.begin());
+	}
+	ReleaseSRWLockExclusive(&hook_cache_srwlock);
+
+	AcquireSRWLockExclusive(&hook_cache_patch_srwlock);
+	for (auto &it : hook_cache_patch_hashes) {
+		json_decref(it.first);
+	}
+	hook_cache_patch_hashes.clear();
+	ReleaseSRWLockExclusive(&hook_cache_patch_srwlock);
+}
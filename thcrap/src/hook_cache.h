@@ -0,0 +1,56 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Cache of patch hook outputs.
+  * The output of cacheable patch hooks (see patchhook_register_cacheable())
+  * only depends on the file name, its JSON patch and its unpatched contents.
+  * Keyed by a hash of all three, their results are kept in three tiers:
+  *
+  * • in memory, within the cache budget of the cache manager
+  * • in the cross-process shared cache, if enabled (see shm_cache.h)
+  * • in the on-disk cache, for the next start of the game
+  *
+  * A hit in any of them copies the stored bytes instead of running the hooks.
+  * Since the contents of a file and its patch are part of the key, edited
+  * files simply stop hitting their old entries, which are then evicted.
+  */
+
+#pragma once
+
+typedef struct {
+	// Hash of the file name, the JSON patch and the unpatched contents
+	uint64_t hash;
+	uint32_t size_in;
+	uint32_t size_out;
+} hook_cache_key_t;
+
+// Continues the hash [h] with [len] bytes at [data]. Start with 0.
+uint64_t hook_cache_hash(const void *data, size_t len, uint64_t h);
+
+// Continues the hash [h] with the null-terminated [str], which can be NULL,
+// and a separator.
+uint64_t hook_cache_hash_str(const char *str, uint64_t h);
+
+// Returns a hash of the game, its build, the run configuration and every
+// patch in the stack together with its configuration, which some hooks
+// depend on as well.
+uint64_t hook_cache_stack_hash(void);
+
+// Builds the key for patching [size_in] bytes of [in], loaded for the file
+// [fn] with the JSON patch [patch], into a buffer of [size_out] bytes.
+// Returns false if the sizes are too large to be cached.
+bool hook_cache_key(hook_cache_key_t *key, const char *fn, json_t *patch, const void *in, size_t size_in, size_t size_out);
+
+// Copies the patched file for [key] to [out], which must be at least
+// [key->size_out] bytes large, and stores the return value of the patch
+// hooks in [ret]. Returns false if no tier has the file.
+bool hook_cache_get(const hook_cache_key_t *key, void *out, int *ret);
+
+// Stores [key->size_out] bytes of [out] and the return value [ret] of the
+// patch hooks for [key] in every tier.
+void hook_cache_put(const hook_cache_key_t *key, const void *out, int ret);
+
+void hook_cache_mod_exit(void);
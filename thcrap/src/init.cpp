@@ -10,6 +10,7 @@
 #include "thcrap.h"
 #include "sha256.h"
 #include "win32_detour.h"
+#include <string>
 #include <vector>
 
 // Both thcrap_ExitProcess and DllMain will call ExitDll,
@@ -102,30 +103,233 @@ void oldbuild_show()
 		strings_replace(MSG_SLOT, "${project_short}", PROJECT_NAME_SHORT());
 		auto *msg = strings_replace(MSG_SLOT, "${url_update}", url_update);
 
-		log_mbox(oldbuild_title, MB_OK | msg_type, msg);
+		// Only a notification, since nothing here should hold up the game.
+		log_mbox_notify(oldbuild_title, MB_OK | msg_type, msg);
 	}
 }
 /// -------------------
 
-json_t* identify_by_hash(const char *fn, size_t *file_size, json_t *versions)
+/// Identification cache
+/// --------------------
+// Maps executable paths to the SHA-256 of the file, together with the
+// volume, file ID, size and last write time it had when it was hashed.
+// An entry is only used if all of these still match. The whole map is a
+// single JSON entry in the disk cache.
+#define IDENTIFY_CACHE_DISK_NS "identify"
+#define IDENTIFY_CACHE_DISK_KEY "executables"
+
+static json_t *identify_cache = NULL;
+static bool identify_cache_dirty = false;
+static SRWLOCK identify_cache_srwlock = { SRWLOCK_INIT };
+
+struct identify_cache_key_t {
+	DWORD volume;
+	char file_id[17];
+	size_t size;
+	json_int_t mtime;
+};
+
+static bool identify_cache_key(const char *fn, identify_cache_key_t *key)
 {
-	unsigned char *file_buffer = (unsigned char*)file_read(fn, file_size);
-	SHA256_CTX sha256_ctx;
-	BYTE hash[32];
-	char hash_str[65];
-	int i;
+	HANDLE hFile = CreateFile(
+		fn, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL
+	);
+	if(hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	BY_HANDLE_FILE_INFORMATION info;
+	BOOL ret = GetFileInformationByHandle(hFile, &info);
+	CloseHandle(hFile);
+	if(!ret || info.nFileSizeHigh) {
+		return false;
+	}
+	key->volume = info.dwVolumeSerialNumber;
+	sprintf(key->file_id, "%08x%08x", info.nFileIndexHigh, info.nFileIndexLow);
+	key->size = info.nFileSizeLow;
+	key->mtime = ((json_int_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+	return true;
+}
 
-	if(!file_buffer) {
-		return NULL;
+// Must be called with the lock held exclusively.
+static void identify_cache_load(void)
+{
+	if(identify_cache) {
+		return;
+	}
+	// A broken cache is simply rebuilt, no need to bother the user.
+	size_t cache_size;
+	char *cache_buffer = (char*)disk_cache_get(IDENTIFY_CACHE_DISK_NS, IDENTIFY_CACHE_DISK_KEY, &cache_size);
+	if(cache_buffer) {
+		identify_cache = json_loadb(cache_buffer, cache_size, 0, NULL);
+		free(cache_buffer);
+	}
+	if(!json_is_object(identify_cache)) {
+		json_decref_safe(identify_cache);
+		identify_cache = json_object();
 	}
+}
+
+// Copies the cached hash of [fn] to [hash_str] if [key] still matches.
+static bool identify_cache_lookup(const char *fn, const identify_cache_key_t *key, char *hash_str)
+{
+	AcquireSRWLockExclusive(&identify_cache_srwlock);
+	identify_cache_load();
+	json_t *entry = json_object_get(identify_cache, fn);
+	const char *hash = json_object_get_string(entry, "sha256");
+	const char *file_id = json_object_get_string(entry, "file_id");
+	bool ret = hash && file_id
+		&& strlen(hash) == 64
+		&& json_integer_value(json_object_get(entry, "volume")) == key->volume
+		&& !strcmp(file_id, key->file_id)
+		&& json_integer_value(json_object_get(entry, "size")) == (json_int_t)key->size
+		&& json_integer_value(json_object_get(entry, "mtime")) == key->mtime;
+	if(ret) {
+		memcpy(hash_str, hash, 65);
+	}
+	ReleaseSRWLockExclusive(&identify_cache_srwlock);
+	return ret;
+}
+
+static void identify_cache_store(const char *fn, const identify_cache_key_t *key, const char *hash_str)
+{
+	json_t *entry = json_pack("{s:I, s:s, s:I, s:I, s:s}",
+		"volume", (json_int_t)key->volume,
+		"file_id", key->file_id,
+		"size", (json_int_t)key->size,
+		"mtime", key->mtime,
+		"sha256", hash_str
+	);
+	AcquireSRWLockExclusive(&identify_cache_srwlock);
+	identify_cache_load();
+	json_object_set_new(identify_cache, fn, entry);
+	identify_cache_dirty = true;
+	ReleaseSRWLockExclusive(&identify_cache_srwlock);
+}
+
+void identify_cache_flush(void)
+{
+	AcquireSRWLockExclusive(&identify_cache_srwlock);
+	if(identify_cache && identify_cache_dirty) {
+		char *dump = json_dumps(identify_cache, JSON_COMPACT);
+		if(dump) {
+			if(disk_cache_put(IDENTIFY_CACHE_DISK_NS, IDENTIFY_CACHE_DISK_KEY, dump, strlen(dump), 0)) {
+				log_print("Couldn't write the identification cache\n");
+			}
+			free(dump);
+		}
+		identify_cache_dirty = false;
+	}
+	ReleaseSRWLockExclusive(&identify_cache_srwlock);
+}
+/// --------------------
+
+// Size of each of the two buffers used by identify_hash_file().
+#define IDENTIFY_CHUNK_SIZE (1024 * 1024)
+
+// Calculates the SHA-256 of [fn] into [hash_str] without loading the whole
+// file, reading the next chunk while the current one is hashed.
+// Sets [file_size] to the size of the file, or 0 if it couldn't be opened.
+static bool identify_hash_file(const char *fn, size_t *file_size, char *hash_str)
+{
+	*file_size = 0;
+	HANDLE hFile = CreateFile(
+		fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL
+	);
+	if(hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(hFile, &size) || size.HighPart || !size.LowPart) {
+		CloseHandle(hFile);
+		return false;
+	}
+	const DWORD total = size.LowPart;
+	*file_size = total;
+
+	BYTE *buffers = (BYTE*)malloc(IDENTIFY_CHUNK_SIZE * 2);
+	OVERLAPPED ov[2] = {};
+	ov[0].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	ov[1].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	auto read_start = [&](int i, DWORD offset) {
+		ov[i].Offset = offset;
+		ov[i].OffsetHigh = 0;
+		DWORD len = MIN(IDENTIFY_CHUNK_SIZE, total - offset);
+		return ReadFile(hFile, buffers + i * IDENTIFY_CHUNK_SIZE, len, NULL, &ov[i])
+			|| GetLastError() == ERROR_IO_PENDING;
+	};
+
+	SHA256_CTX sha256_ctx;
 	sha256_init(&sha256_ctx);
-	sha256_update(&sha256_ctx, file_buffer, *file_size);
-	sha256_final(&sha256_ctx, hash);
-	SAFE_FREE(file_buffer);
 
-	for(i = 0; i < 32; i++) {
-		sprintf(hash_str + (i * 2), "%02x", hash[i]);
+	DWORD offset = 0;
+	int cur = 0;
+	bool pending = read_start(cur, offset);
+	bool ret = pending;
+	while(pending) {
+		DWORD byte_ret;
+		pending = false;
+		if(!GetOverlappedResult(hFile, &ov[cur], &byte_ret, TRUE) || !byte_ret) {
+			ret = false;
+			break;
+		}
+		const DWORD next = offset + byte_ret;
+		if(next < total) {
+			pending = read_start(cur ^ 1, next);
+			if(!pending) {
+				ret = false;
+				break;
+			}
+		}
+		sha256_update(&sha256_ctx, buffers + cur * IDENTIFY_CHUNK_SIZE, byte_ret);
+		offset = next;
+		cur ^= 1;
+	}
+	ret = ret && offset == total;
+
+	CloseHandle(ov[0].hEvent);
+	CloseHandle(ov[1].hEvent);
+	CloseHandle(hFile);
+	free(buffers);
+
+	if(ret) {
+		BYTE hash[32];
+		sha256_final(&sha256_ctx, hash);
+		for(int i = 0; i < 32; i++) {
+			sprintf(hash_str + (i * 2), "%02x", hash[i]);
+		}
+	}
+	return ret;
+}
+
+json_t* identify_by_hash(const char *fn, size_t *file_size, json_t *versions)
+{
+	char hash_str[65];
+	identify_cache_key_t key;
+
+	size_t fn_len = strlen(fn) + 1;
+	VLA(char, fn_key, fn_len);
+	memcpy(fn_key, fn, fn_len);
+	str_slash_normalize(fn_key);
+
+	bool have_key = identify_cache_key(fn, &key);
+	if(have_key && identify_cache_lookup(fn_key, &key, hash_str)) {
+		*file_size = key.size;
+	} else {
+		startup_phase_begin("SHA-256");
+		bool hashed = identify_hash_file(fn, file_size, hash_str);
+		startup_phase_end();
+		if(!hashed) {
+			VLA_FREE(fn_key);
+			return NULL;
+		}
+		if(have_key && key.size == *file_size) {
+			identify_cache_store(fn_key, &key, hash_str);
+		}
 	}
+	VLA_FREE(fn_key);
 	return json_object_get(json_object_get(versions, "hashes"), hash_str);
 }
 
@@ -137,15 +341,16 @@ json_t* identify_by_size(size_t file_size, json_t *versions)
 json_t* stack_cfg_resolve(const char *fn, size_t *file_size)
 {
 	json_t *ret = json_object();
-	char **chain = resolve_chain(fn);
-	if(chain && chain[0]) {
+	chain_buf_t chain;
+	resolve_chain_build(chain, fn);
+	if(chain.get() && chain.get()[0]) {
 		std::vector<const char*> new_chain;
 		new_chain.push_back("global.js");
-		for (size_t i = 0; chain[i]; i++) {
-			new_chain.push_back(chain[i]);
+		for (size_t i = 0; i < chain.size(); i++) {
+			new_chain.push_back(chain.get()[i]);
 		}
 
-		log_printf("(JSON) Resolving configuration for %s... ", fn);
+		log_debugf("(JSON) Resolving configuration for %s... ", fn);
 		size_t tmp_file_size = 0;
 		stack_foreach_cpp([&new_chain, &ret, &tmp_file_size](const patch_t *patch) {
 			json_t *json_new = json_object();
@@ -153,68 +358,55 @@ json_t* stack_cfg_resolve(const char *fn, size_t *file_size)
 				tmp_file_size += patch_json_merge(&json_new, patch, file);
 			}
 			json_object_merge(json_new, patch->config);
-			json_object_merge(ret, json_new);
-			json_decref(json_new);
+			ret = json_object_merge_new(ret, json_new);
 		});
-		log_printf(tmp_file_size ? "\n" : "not found\n");
+		log_debugf(tmp_file_size ? "\n" : "not found\n");
 		if (file_size) *file_size = tmp_file_size;
 	}
-	chain_free(chain);
 	return ret;
 }
 
-json_t* identify(const char *exe_fn)
+// Looks up [exe_fn] in [versions_js], first by hash, then by size.
+// Returns the [game, build, variety, codepage] entry, or NULL if neither
+// is known. [by_size] is set if only the size matched.
+static json_t* identify_lookup(const char *exe_fn, json_t *versions_js, bool *by_size)
 {
-	size_t exe_size;
-	json_t *run_ver = NULL;
-	json_t *versions_js = stack_json_resolve("versions.js", NULL);
-	json_t *game_obj = NULL;
-	json_t *build_obj = NULL;
-	json_t *variety_obj = NULL;
-	json_t *codepage_obj = NULL;
-	const char *game = NULL;
-	const char *build = NULL;
-	const char *variety = NULL;
-	UINT codepage;
-
-	// Result of the EXE identification
-	json_t *id_array = NULL;
-	int size_cmp = 0;
-
-	if(!versions_js) {
-		goto end;
-	}
+	size_t exe_size = 0;
 	log_printf("Hashing executable... ");
 
-	id_array = identify_by_hash(exe_fn, &exe_size, versions_js);
+	json_t *id_array = identify_by_hash(exe_fn, &exe_size, versions_js);
+	identify_cache_flush();
+	*by_size = false;
 	if(!id_array) {
-		size_cmp = 1;
+		*by_size = true;
 		log_printf("failed!\n");
 		log_printf("File size lookup... ");
 		id_array = identify_by_size(exe_size, versions_js);
 
 		if(!id_array) {
 			log_printf("failed!\n");
-			goto end;
 		}
 	}
+	return id_array;
+}
+
+static UINT identify_codepage(json_t *id_array)
+{
+	return json_hex_value(json_array_get(id_array, 3));
+}
 
-	game_obj = json_array_get(id_array, 0);
-	build_obj = json_array_get(id_array, 1);
-	variety_obj = json_array_get(id_array, 2);
-	codepage_obj = json_array_get(id_array, 3);
-	game = json_string_value(game_obj);
-	build = json_string_value(build_obj);
-	variety = json_string_value(variety_obj);
-	codepage = json_hex_value(codepage_obj);
+// Sets the build of [id_array], and returns the configuration of its game.
+// This is [config] if given, otherwise it's resolved from the patch stack.
+static json_t* identify_apply(json_t *id_array, json_t *config)
+{
+	json_t *game_obj = json_array_get(id_array, 0);
+	const char *game = json_string_value(game_obj);
+	const char *build = json_string_value(json_array_get(id_array, 1));
+	const char *variety = json_string_value(json_array_get(id_array, 2));
 
 	if(!game || !build) {
 		log_printf("Invalid version format!");
-		goto end;
-	}
-
-	if(codepage) {
-		w32u8_set_fallback_codepage(codepage);
+		return NULL;
 	}
 
 	// Store build in the runconfig to be recalled later for version-
@@ -224,16 +416,19 @@ json_t* identify(const char *exe_fn)
 
 	// More robust than putting the UTF-8 character here directly,
 	// who knows which locale this might be compiled under...
-	log_printf("\xE2\x86\x92 %s %s %s (codepage %d)\n", game, build, variety, codepage);
-
-	if(stricmp(PathFindExtensionA(game), ".js")) {
-		size_t ver_fn_len = json_string_length(game_obj) + 1 + strlen(".js") + 1;
-		VLA(char, ver_fn, ver_fn_len);
-		sprintf(ver_fn, "%s.js", game);
-		run_ver = stack_cfg_resolve(ver_fn, NULL);
-		VLA_FREE(ver_fn);
-	} else {
-		run_ver = stack_cfg_resolve(game, NULL);
+	log_printf("\xE2\x86\x92 %s %s %s (codepage %d)\n", game, build, variety, identify_codepage(id_array));
+
+	json_t *run_ver = json_incref(config);
+	if(!run_ver) {
+		std::string ver_fn = game;
+		if(stricmp(PathFindExtensionA(game), ".js")) {
+			ver_fn += ".js";
+		}
+		run_ver = cfg_cache_load(ver_fn.c_str());
+		if(!run_ver) {
+			run_ver = stack_cfg_resolve(ver_fn.c_str(), NULL);
+			cfg_cache_store(ver_fn.c_str(), run_ver);
+		}
 	}
 
 	// Ensure that we have a configuration with a "game" key
@@ -243,8 +438,30 @@ json_t* identify(const char *exe_fn)
 	if(!json_object_get_string(run_ver, "game")) {
 		json_object_set(run_ver, "game", game_obj);
 	}
+	return run_ver;
+}
+
+json_t* identify(const char *exe_fn)
+{
+	json_t *run_ver = NULL;
+	json_t *versions_js = stack_json_resolve("versions.js", NULL);
+	json_t *id_array = NULL;
+	bool by_size;
+
+	if(!versions_js) {
+		goto end;
+	}
+	id_array = identify_lookup(exe_fn, versions_js, &by_size);
+	if(!id_array) {
+		goto end;
+	}
+	if(UINT codepage = identify_codepage(id_array)) {
+		w32u8_set_fallback_codepage(codepage);
+	}
+	run_ver = identify_apply(id_array, NULL);
 
-	if(size_cmp) {
+	if(run_ver && by_size) {
+		const char *game = json_string_value(json_array_get(id_array, 0));
 		const char *game_title = json_object_get_string(run_ver, "title");
 		int ret;
 		if(game_title) {
@@ -267,7 +484,10 @@ json_t* identify(const char *exe_fn)
 			"We will take a look at it, and add support if possible.\n"
 			"\n"
 			"Apply patches for the identified game version regardless (on your own risk)?",
-			PROJECT_NAME_SHORT(), game, build, variety, exe_fn
+			PROJECT_NAME_SHORT(), game,
+			json_string_value(json_array_get(id_array, 1)),
+			json_string_value(json_array_get(id_array, 2)),
+			exe_fn
 		);
 		if(ret == IDNO) {
 			run_ver = json_decref_safe(run_ver);
@@ -278,6 +498,36 @@ end:
 	return run_ver;
 }
 
+json_t* identify_precompute(const char *exe_fn)
+{
+	json_t *ret = NULL;
+	json_t *versions_js = stack_json_resolve("versions.js", NULL);
+	bool by_size;
+	json_t *id_array = versions_js ? identify_lookup(exe_fn, versions_js, &by_size) : NULL;
+	// Unknown versions need the message box, which belongs to the game.
+	if(id_array && !by_size) {
+		json_t *run_ver = identify_apply(id_array, NULL);
+		if(run_ver) {
+			ret = json_pack("{sOso}", "id", id_array, "config", run_ver);
+		}
+	}
+	json_decref(versions_js);
+	return ret;
+}
+
+json_t* identify_from_precomputed(json_t *precomputed)
+{
+	json_t *id_array = json_object_get(precomputed, "id");
+	json_t *config = json_object_get(precomputed, "config");
+	if(!json_is_array(id_array) || !json_is_object(config)) {
+		return NULL;
+	}
+	if(UINT codepage = identify_codepage(id_array)) {
+		w32u8_set_fallback_codepage(codepage);
+	}
+	return identify_apply(id_array, config);
+}
+
 void thcrap_detour(HMODULE hProc)
 {
 	size_t mod_name_len = GetModuleFileNameU(hProc, NULL, 0) + 1;
@@ -293,6 +543,8 @@ int thcrap_init(const char *run_cfg_fn)
 {
 	HMODULE hProc = GetModuleHandle(NULL);
 
+	startup_phase_begin("thcrap_init");
+
 	size_t exe_fn_len = GetModuleFileNameU(NULL, NULL, 0) + 1;
 	size_t game_dir_len = GetCurrentDirectory(0, NULL) + 1;
 	VLA(char, exe_fn, exe_fn_len);
@@ -303,32 +555,56 @@ int thcrap_init(const char *run_cfg_fn)
 	PathAppendU(dll_dir, "..");
 	SetCurrentDirectory(dll_dir);
 
-	runconfig_load_from_file(run_cfg_fn);
+	// Whatever the loader already did for us.
+	json_t *snapshot = init_snapshot_open();
+
+	startup_phase_begin("Run configuration");
+	if(json_t *snapshot_cfg = json_object_get(snapshot, "run_cfg")) {
+		runconfig_load(snapshot_cfg, 0);
+		runconfig_runcfg_fn_set(run_cfg_fn);
+	} else {
+		runconfig_load_from_file(run_cfg_fn);
+	}
 	runconfig_thcrap_dir_set(dll_dir);
+	startup_phase_end();
 
+	startup_phase_begin("Log");
 	log_init(runconfig_console_get());
+	startup_phase_end();
 	log_printf("Run configuration file: %s\n\n", run_cfg_fn);
 	stack_show_missing();
 
 	log_printf("EXE file name: %s\n", exe_fn);
 	{
-		json_t *full_cfg = identify(exe_fn);
+		startup_phase_begin("Identification");
+		json_t *precomputed = json_object_get(snapshot, "identify");
+		json_t *full_cfg = (precomputed && init_snapshot_exe_matches(snapshot, exe_fn))
+			? identify_from_precomputed(precomputed)
+			: identify(exe_fn);
 		if(full_cfg) {
 			runconfig_load(full_cfg, RUNCONFIG_NO_OVERWRITE);
 			json_decref(full_cfg);
+			startup_phase_end();
 
 			oldbuild_show();
+		} else {
+			startup_phase_end();
 		}
 	}
+	json_decref(snapshot);
 
 	log_printf("Game directory: %s\n", game_dir);
 	log_printf("Plug-in directory: %s\n", dll_dir);
 
 	log_printf("\nInitializing plug-ins...\n");
+	startup_phase_begin("Main DLL modules");
 	plugin_init(hThcrap);
+	startup_phase_end();
+	startup_phase_begin("Plug-ins");
 	PathAppendU(dll_dir, "bin");
 	plugins_load(dll_dir);
 	PathAppendU(dll_dir, "..");
+	startup_phase_end();
 
 	/**
 	  * Potentially dangerous stuff. Do not want!
@@ -351,12 +627,15 @@ int thcrap_init(const char *run_cfg_fn)
 	// We might want to move this to thcrap_init_binary() too to accommodate
 	// DRM that scrambles the original import table, but since we're not
 	// having any test cases right now...
+	startup_phase_begin("Detours");
 	thcrap_detour(hProc);
+	startup_phase_end();
 
 	SetCurrentDirectory(game_dir);
 	VLA_FREE(game_dir);
 	VLA_FREE(exe_fn);
 	bp_set.resize(runconfig_stage_count(), false);
+	startup_phase_end();
 	return thcrap_init_binary(0, nullptr);
 }
 
@@ -375,6 +654,7 @@ int thcrap_init_binary(size_t stage_num, HMODULE module)
 	size_t stages_total = runconfig_stage_count();
 
 	if (!stages_total) {
+		startup_profile_report();
 		return 0;
 	}
 
@@ -390,9 +670,13 @@ int thcrap_init_binary(size_t stage_num, HMODULE module)
 		);
 	}
 
+	char phase_name[32];
+	sprintf(phase_name, "Stage %u", stage_num);
+	startup_phase_begin(phase_name);
 	bool ret = runconfig_stage_apply(stage_num,
 		RUNCFG_STAGE_USE_MODULE | (bp_set[stage_num] ? RUNCFG_STAGE_SKIP_BREAKPOINTS : 0),
 		module);
+	startup_phase_end();
 
 	if(stages_total >= 2) {
 		if(ret == false && stage_num == 0 && stages_total >= 2) {
@@ -406,7 +690,11 @@ int thcrap_init_binary(size_t stage_num, HMODULE module)
 
 	if(stage_num + 1 == stages_total) {
 		runconfig_print();
+		startup_phase_begin("post_init");
 		mod_func_run_all("post_init", NULL);
+		startup_phase_end();
+		startup_profile_report();
+		memstats_print();
 	}
 	return 0;
 }
@@ -414,7 +702,7 @@ int thcrap_init_binary(size_t stage_num, HMODULE module)
 int InitDll(HMODULE hDll)
 {
 	HeapSetInformation(NULL, HeapEnableTerminationOnCorruption, NULL, 0);
-	json_set_alloc_funcs(malloc, free);
+	json_set_alloc_funcs(json_arena_malloc, json_arena_free);
 	w32u8_set_fallback_codepage(932);
 
 	exception_init();
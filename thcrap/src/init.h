@@ -9,9 +9,18 @@
 
 #pragma once
 
+// Looks up the SHA-256 of [fn] in versions.js. The hash is kept in the
+// "identify" namespace of the disk cache, and only recalculated if the
+// file's volume, file ID, size or last write time changed.
 json_t* identify_by_hash(const char *fn, size_t *exe_size, json_t *versions);
+// Writes all new entries of the hash cache to disk.
+void identify_cache_flush(void);
 json_t* identify_by_size(size_t exe_size, json_t *versions);
 
+// Resolves the game configuration [fn], merged on top of global.js and
+// the "config" object of every patch in the stack.
+json_t* stack_cfg_resolve(const char *fn, size_t *file_size);
+
 // Identifies the game, version and variety of [fn] by looking up its hash
 // and file size in versions.js.
 // Also shows a message box in case an unknown version was detected.
@@ -19,6 +28,14 @@ json_t* identify_by_size(size_t exe_size, json_t *versions);
 // NULL on failure or user cancellation.
 json_t* identify(const char *fn);
 
+// Identifies [fn] for the startup snapshot (see init_snapshot.h), without
+// showing any message box. Returns an object with the versions.js entry
+// and the game configuration, or NULL if the hash of [fn] is unknown.
+json_t* identify_precompute(const char *fn);
+// Applies the result of identify_precompute() to the current process, and
+// returns the same run configuration that identify() would have returned.
+json_t* identify_from_precomputed(json_t *precomputed);
+
 // Applies the detour cache to the module at [hProc].
 void thcrap_detour(HMODULE hProc);
 
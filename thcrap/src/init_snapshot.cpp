@@ -0,0 +1,151 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Startup snapshot, handed from the loader to the game.
+  */
+
+#include "thcrap.h"
+#include <thread>
+
+#define INIT_SNAPSHOT_NAME_FORMAT "thcrap_init_snapshot_%lu"
+
+static std::thread snapshot_thread;
+static json_t *pending_snapshot = NULL;
+
+static void init_snapshot_join(void)
+{
+	if(snapshot_thread.joinable()) {
+		snapshot_thread.join();
+	}
+}
+
+void init_snapshot_prepare(const char *exe_fn)
+{
+	init_snapshot_join();
+	pending_snapshot = json_decref_safe(pending_snapshot);
+	const json_t *run_cfg = runconfig_json_get();
+	if(!exe_fn || !run_cfg) {
+		return;
+	}
+
+	// The game process has a different current directory.
+	std::string exe_abs;
+	if(PathIsRelativeA(exe_fn)) {
+		size_t cur_dir_len = GetCurrentDirectory(0, NULL);
+		exe_abs.resize(cur_dir_len);
+		GetCurrentDirectory(cur_dir_len, &exe_abs[0]);
+		exe_abs.resize(strlen(exe_abs.c_str()));
+		exe_abs += '\\';
+	}
+	exe_abs += exe_fn;
+
+	// Copied here, since the caller might change the run configuration
+	// while the thread is running.
+	pending_snapshot = json_pack("{s:s, s:o}",
+		"exe", exe_abs.c_str(),
+		"run_cfg", json_deep_copy(run_cfg)
+	);
+	snapshot_thread = std::thread([exe_abs = std::move(exe_abs)]() {
+		if(json_t *id = identify_precompute(exe_abs.c_str())) {
+			json_object_set_new(pending_snapshot, "identify", id);
+		}
+	});
+}
+
+HANDLE init_snapshot_publish(DWORD pid)
+{
+	init_snapshot_join();
+	if(!pending_snapshot) {
+		return NULL;
+	}
+	char *text = json_dumps(pending_snapshot, JSON_COMPACT);
+	pending_snapshot = json_decref_safe(pending_snapshot);
+	if(!text) {
+		return NULL;
+	}
+	const uint32_t text_len = (uint32_t)strlen(text);
+
+	char name[sizeof(INIT_SNAPSHOT_NAME_FORMAT) + 16];
+	sprintf(name, INIT_SNAPSHOT_NAME_FORMAT, pid);
+	HANDLE hMap = CreateFileMappingA(
+		INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(text_len) + text_len, name
+	);
+	BYTE *view = hMap ? (BYTE *)MapViewOfFile(hMap, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+	if(view) {
+		memcpy(view, &text_len, sizeof(text_len));
+		memcpy(view + sizeof(text_len), text, text_len);
+		UnmapViewOfFile(view);
+	} else if(hMap) {
+		CloseHandle(hMap);
+		hMap = NULL;
+	}
+	free(text);
+	return hMap;
+}
+
+json_t* init_snapshot_open(void)
+{
+	char name[sizeof(INIT_SNAPSHOT_NAME_FORMAT) + 16];
+	sprintf(name, INIT_SNAPSHOT_NAME_FORMAT, GetCurrentProcessId());
+	HANDLE hMap = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+	if(!hMap) {
+		return NULL;
+	}
+	json_t *ret = NULL;
+	MEMORY_BASIC_INFORMATION mbi;
+	const BYTE *view = (const BYTE *)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+	if(view && VirtualQuery(view, &mbi, sizeof(mbi))) {
+		uint32_t text_len;
+		memcpy(&text_len, view, sizeof(text_len));
+		if(text_len <= mbi.RegionSize - sizeof(text_len)) {
+			ret = json_loadb((const char *)view + sizeof(text_len), text_len, 0, NULL);
+		}
+	}
+	if(view) {
+		UnmapViewOfFile(view);
+	}
+	CloseHandle(hMap);
+	if(!json_is_object(ret)) {
+		ret = json_decref_safe(ret);
+	}
+	return ret;
+}
+
+static bool file_id_get(const char *fn, BY_HANDLE_FILE_INFORMATION *info)
+{
+	HANDLE hFile = CreateFileU(
+		fn, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL
+	);
+	if(hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	bool ret = GetFileInformationByHandle(hFile, info) != 0;
+	CloseHandle(hFile);
+	return ret;
+}
+
+bool init_snapshot_exe_matches(json_t *snapshot, const char *exe_fn)
+{
+	// Compared by file ID, since the paths might be spelled differently.
+	const char *snapshot_exe = json_object_get_string(snapshot, "exe");
+	BY_HANDLE_FILE_INFORMATION a, b;
+	return snapshot_exe && exe_fn
+		&& file_id_get(snapshot_exe, &a) && file_id_get(exe_fn, &b)
+		&& a.dwVolumeSerialNumber == b.dwVolumeSerialNumber
+		&& a.nFileIndexHigh == b.nFileIndexHigh
+		&& a.nFileIndexLow == b.nFileIndexLow;
+}
+
+void init_snapshot_discard(void)
+{
+	init_snapshot_join();
+	pending_snapshot = json_decref_safe(pending_snapshot);
+}
+
+void init_snapshot_mod_exit(void)
+{
+	init_snapshot_discard();
+}
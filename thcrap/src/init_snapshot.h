@@ -0,0 +1,49 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Startup snapshot, handed from the loader to the game.
+  *
+  * When thcrap_loader starts a game, it already has the run configuration
+  * and the patch stack loaded, and then sits idle while thcrap_init() inside
+  * the suspended game loads them again. Instead, thcrap_inject_into_new()
+  * identifies the executable on a separate thread while the game process is
+  * created, and publishes the results in a named shared memory section for
+  * the new process, where thcrap_init() picks them up:
+  *
+  *	{
+  *		"exe": <absolute path of the identified executable>,
+  *		"run_cfg": <run configuration>,
+  *		"identify": <result of identify_precompute()>
+  *	}
+  *
+  * The section is named after the ID of the game process, so that the
+  * parameter of thcrap_init() stays the run configuration file name.
+  */
+
+#pragma once
+
+// Starts building the snapshot for [exe_fn] from the current run
+// configuration, in the background.
+void init_snapshot_prepare(const char *exe_fn);
+
+// Waits for the snapshot started by init_snapshot_prepare(), and publishes
+// it for the process with the ID [pid]. Returns the section, which has to
+// stay open until thcrap_init() returned in that process, or NULL if there
+// is no snapshot.
+HANDLE init_snapshot_publish(DWORD pid);
+
+// Throws away the snapshot started by init_snapshot_prepare(), if the game
+// couldn't be started.
+void init_snapshot_discard(void);
+
+// Returns the snapshot that was published for the current process, or
+// NULL if there is none.
+json_t* init_snapshot_open(void);
+
+// Returns true if [snapshot] was identified for the same file as [exe_fn].
+bool init_snapshot_exe_matches(json_t *snapshot, const char *exe_fn);
+
+void init_snapshot_mod_exit(void);
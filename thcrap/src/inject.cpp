@@ -8,6 +8,7 @@
   */
 
 #include "thcrap.h"
+#include <vector>
 
 /// Detour chains
 /// -------------
@@ -45,6 +46,150 @@ W32U8_DETOUR_CHAIN_DEF(LoadLibrary);
 DETOUR_CHAIN_DEF(LoadLibraryW);
 /// -------------
 
+/**
+  * The loader code that runs in the target process is a fixed x86 stub that
+  * doesn't depend on where it is placed. It receives a pointer to an
+  * [inject_params_t] block as its thread parameter, and does the equivalent
+  * of this C code:
+  *
+  *	DWORD WINAPI inject_stub(inject_params_t *P)
+  *	{
+  *		// In case the injected DLL depends on other DLLs,
+  *		// we need to change the current directory to the one given as parameter
+  *		wchar_t *cur_dir = NULL;
+  *		if(P->dll_dir) {
+  *			DWORD cur_dir_len = P->GetCurrentDirectoryW(0, NULL);
+  *			cur_dir = alloca(cur_dir_len * sizeof(wchar_t));
+  *			P->GetCurrentDirectoryW(cur_dir_len, cur_dir);
+  *			P->SetCurrentDirectoryW(P->dll_dir);
+  *		}
+  *
+  *		// Load the injected DLL into this process
+  *		HMODULE h = P->LoadLibraryExW(P->dll_fn, NULL, P->load_flags);
+  *		if(cur_dir) {
+  *			P->SetCurrentDirectoryW(cur_dir);
+  *		}
+  *		if(!h) {
+  *			MessageBox(P->error_load);
+  *			return 1;
+  *		}
+  *
+  *		// Get the address of the export function
+  *		auto func = (void (__cdecl *)(void *))P->GetProcAddress(h, P->func_name);
+  *		if(!func) {
+  *			P->FreeLibrary(h);
+  *			MessageBox(P->error_func);
+  *			return 2;
+  *		}
+  *		func(P->func_param);
+  *		return 0;
+  *	}
+  *
+  * where MessageBox() loads user32.dll on demand, and calls MessageBoxW()
+  * with [P->error_title] and MB_ICONHAND. Everything else, including all
+  * strings, lives in the parameter block, so that the whole workspace can be
+  * written into the process with a single WriteProcessMemory() call.
+  *
+  * Assembled from:
+  *
+  *	push ebp / push ebx / push esi / push edi
+  *	mov ebx, [esp + 20]               ; ebx = P
+  *	mov ebp, esp
+  *	xor esi, esi                      ; esi = cur_dir
+  *	cmp dword ptr [ebx + dll_dir], 0
+  *	je load
+  *	push 0 / push 0
+  *	call [ebx + GetCurrentDirectoryW]
+  *	lea ecx, [eax * 2 + 4]            ; DWORD-aligned byte size
+  *	and ecx, -4
+  *	sub esp, ecx
+  *	mov esi, esp
+  *	push esi / push eax
+  *	call [ebx + GetCurrentDirectoryW]
+  *	push [ebx + dll_dir]
+  *	call [ebx + SetCurrentDirectoryW]
+  * load:
+  *	push [ebx + load_flags] / push 0 / push [ebx + dll_fn]
+  *	call [ebx + LoadLibraryExW]
+  *	mov edi, eax                      ; edi = h
+  *	test esi, esi
+  *	jz loaded
+  *	push esi
+  *	call [ebx + SetCurrentDirectoryW]
+  * loaded:
+  *	mov esp, ebp
+  *	mov eax, 1
+  *	mov ecx, [ebx + error_load]
+  *	test edi, edi
+  *	jz error
+  *	push [ebx + func_name] / push edi
+  *	call [ebx + GetProcAddress]
+  *	test eax, eax
+  *	jz no_func
+  *	push [ebx + func_param]
+  *	call eax
+  *	mov esp, ebp
+  *	xor eax, eax
+  *	jmp done
+  * no_func:
+  *	push edi
+  *	call [ebx + FreeLibrary]
+  *	mov eax, 2
+  *	mov ecx, [ebx + error_func]
+  * error:
+  *	push eax / push ecx
+  *	push [ebx + user32_name]
+  *	call [ebx + LoadLibraryW]
+  *	push [ebx + msgbox_name] / push eax
+  *	call [ebx + GetProcAddress]
+  *	pop ecx
+  *	test eax, eax
+  *	jz no_msgbox
+  *	push 0x10 / push [ebx + error_title] / push ecx / push 0
+  *	call eax
+  * no_msgbox:
+  *	pop eax
+  * done:
+  *	pop edi / pop esi / pop ebx / pop ebp
+  *	ret 4
+  */
+struct inject_params_t
+{
+	uint32_t LoadLibraryW;
+	uint32_t LoadLibraryExW;
+	uint32_t GetProcAddress;
+	uint32_t GetCurrentDirectoryW;
+	uint32_t SetCurrentDirectoryW;
+	uint32_t FreeLibrary;
+	uint32_t dll_dir;
+	uint32_t dll_fn;
+	uint32_t load_flags;
+	uint32_t func_name;
+	uint32_t func_param;
+	uint32_t user32_name;
+	uint32_t msgbox_name;
+	uint32_t error_title;
+	uint32_t error_load;
+	uint32_t error_func;
+};
+static_assert(sizeof(inject_params_t) == 0x40, "the offsets are hardcoded in inject_stub");
+
+static const BYTE inject_stub[] = {
+	0x55, 0x53, 0x56, 0x57, 0x8B, 0x5C, 0x24, 0x14, 0x89, 0xE5, 0x31, 0xF6,
+	0x83, 0x7B, 0x18, 0x00, 0x74, 0x20, 0x6A, 0x00, 0x6A, 0x00, 0xFF, 0x53,
+	0x0C, 0x8D, 0x0C, 0x45, 0x04, 0x00, 0x00, 0x00, 0x83, 0xE1, 0xFC, 0x29,
+	0xCC, 0x89, 0xE6, 0x56, 0x50, 0xFF, 0x53, 0x0C, 0xFF, 0x73, 0x18, 0xFF,
+	0x53, 0x10, 0xFF, 0x73, 0x20, 0x6A, 0x00, 0xFF, 0x73, 0x1C, 0xFF, 0x53,
+	0x04, 0x89, 0xC7, 0x85, 0xF6, 0x74, 0x04, 0x56, 0xFF, 0x53, 0x10, 0x89,
+	0xEC, 0xB8, 0x01, 0x00, 0x00, 0x00, 0x8B, 0x4B, 0x38, 0x85, 0xFF, 0x74,
+	0x22, 0xFF, 0x73, 0x24, 0x57, 0xFF, 0x53, 0x08, 0x85, 0xC0, 0x74, 0x0B,
+	0xFF, 0x73, 0x28, 0xFF, 0xD0, 0x89, 0xEC, 0x31, 0xC0, 0xEB, 0x2A, 0x57,
+	0xFF, 0x53, 0x14, 0xB8, 0x02, 0x00, 0x00, 0x00, 0x8B, 0x4B, 0x3C, 0x50,
+	0x51, 0xFF, 0x73, 0x2C, 0xFF, 0x13, 0xFF, 0x73, 0x30, 0x50, 0xFF, 0x53,
+	0x08, 0x59, 0x85, 0xC0, 0x74, 0x0A, 0x6A, 0x10, 0xFF, 0x73, 0x34, 0x51,
+	0x6A, 0x00, 0xFF, 0xD0, 0x58, 0x5F, 0x5E, 0x5B, 0x5D, 0xC2, 0x04, 0x00,
+};
+
 /**
   * A more complete DLL injection solution.
   * Adapted from http://www.codeproject.com/Articles/20084/completeinject.
@@ -96,28 +241,6 @@ DETOUR_CHAIN_DEF(LoadLibraryW);
   * handling, so the end user knows if something went wrong.
   */
 
-unsigned char* memcpy_advance_dst(unsigned char *dst, const void *src, size_t num)
-{
-	memcpy(dst, src, num);
-	return dst + num;
-}
-
-// The C++ standard doesn't allow converting from a function to a void*.
-// So we can't take a generic void*, we need to take either a void*
-// or a function pointer of any type.
-template<typename T>
-unsigned char* ptrcpy_advance_dst(unsigned char *dst, T *src)
-{
-	*((uintptr_t*)dst) = (uintptr_t)src;
-	return dst + sizeof(void*);
-}
-
-unsigned char* StringToUTF16_advance_dst(unsigned char *dst, const char *src)
-{
-	size_t conv_len = StringToUTF16((wchar_t*)dst, src, -1);
-	return dst + (conv_len * sizeof(wchar_t));
-}
-
 int Inject(HANDLE hProcess, const char *dll_dir, const char *dll_fn, const char *func_name, const void *param, const size_t param_size)
 {
 	// String constants
@@ -129,580 +252,106 @@ int Inject(HANDLE hProcess, const char *dll_dir, const char *dll_fn, const char
 		"\thttp://support.microsoft.com/kb/2533623/";
 	const char *injectError2Format = "Could not load the function: %s";
 
-//------------------------------------------//
-// Function variables.                      //
-//------------------------------------------//
-
 	// Main DLL we will need to load
 	HMODULE kernel32 = GetModuleHandleA("kernel32.dll");
-
-	// Main functions we will need to import.
-	// If [dll_fn] is absolute, LoadLibraryEx() with the LOAD_LIBRARY_SEARCH_DLL_LOAD_DIR
-	// flag is used to guarantee that the injected DLL and its dependencies really
-	// are only loaded from the given directory. Otherwise, LoadLibrary() may load
-	// a possible other DLL with the same name from the directory of [hProcess].
-	FARPROC getcurrentdirectory = GetProcAddress(kernel32, "GetCurrentDirectoryW");
-	FARPROC setcurrentdirectory = GetProcAddress(kernel32, "SetCurrentDirectoryW");
-	FARPROC loadlibrary = GetProcAddress(kernel32, "LoadLibraryW");
-	FARPROC loadlibraryex = GetProcAddress(kernel32, "LoadLibraryExW");
-	FARPROC getprocaddress = GetProcAddress(kernel32, "GetProcAddress");
-	FARPROC exitthread = GetProcAddress(kernel32, "ExitThread");
-	FARPROC freelibraryandexitthread = GetProcAddress(kernel32, "FreeLibraryAndExitThread");
 	int have_kb2533623 = GetProcAddress(kernel32, "SetDefaultDllDirectories") != 0;
 
-	// The workspace we will build the codecave on locally.
-	// workspaceSize gets incremented with the final length of the error strings.
-	size_t workspaceSize = 2048;
-	LPBYTE workspace = NULL;
-	LPBYTE p = NULL;
-
-	// The memory in the process we write to
-	LPBYTE codecaveAddress = NULL;
-
-	// Strings we have to write into the process
 	size_t injectError1_len = _scprintf(injectError1Format, dll_fn) + 1;
 	size_t injectError2_len = _scprintf(injectError2Format, func_name) + 1;
-
-	const char *injectError0 = "Error";
 	VLA(char, injectError1, injectError1_len);
 	VLA(char, injectError2, injectError2_len);
-	const char *user32Name = "user32.dll";
-	const char *msgboxName = "MessageBoxW";
-
-	// Placeholder addresses to use the strings
-	LPBYTE user32NameAddr = 0;
-	LPBYTE user32Addr = 0;
-	LPBYTE msgboxNameAddr = 0;
-	LPBYTE msgboxAddr = 0;
-	LPBYTE dllAddr = 0;
-	LPBYTE dllDirAddr = 0;
-	LPBYTE dllNameAddr = 0;
-	LPBYTE funcNameAddr = 0;
-	LPBYTE funcParamAddr = 0;
-	LPBYTE error0Addr = 0;
-	LPBYTE error1Addr = 0;
-	LPBYTE error2Addr = 0;
-
-	// Where the codecave execution should begin at
-	LPTHREAD_START_ROUTINE codecaveExecAddr = 0;
-
-	// Handle to the thread we create in the process
-	HANDLE hThread = NULL;
-
-	// Old protection on page we are writing to in the process and the bytes written
-	DWORD oldProtect = 0;
-	SIZE_T byte_ret = 0;
-
-	// Return code of injection function
-	DWORD injRet;
-
-//------------------------------------------//
-// Variable initialization.                 //
-//------------------------------------------//
-
-// This section will cause compiler warnings on VS8,
-// you can upgrade the functions or ignore them
-
-	// Build error messages
 	sprintf(injectError1, injectError1Format, dll_fn);
 	sprintf(injectError2, injectError2Format, func_name);
 
-	workspaceSize += (
-		strlen(dll_dir) + 1 + strlen(dll_fn) + 1 + strlen(func_name) + 1 +
-		param_size + strlen(injectError1) + 1 + strlen(injectError2) + 1
-	) * sizeof(wchar_t);
-
-	// Create the workspace
-	workspace = (LPBYTE)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, workspaceSize);
-	p = workspace;
-
-	// Allocate space for the codecave in the process
-	codecaveAddress = (LPBYTE)VirtualAllocEx(hProcess, 0, workspaceSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-
-// Note there is no error checking done above for any functions that return a pointer/handle.
-// I could have added them, but it'd just add more messiness to the code and not provide any real
-// benefit. It's up to you though in your final code if you want it there or not.
-
-//------------------------------------------//
-// Data and string writing.                 //
-//------------------------------------------//
-
-	// Reserve space for the user32 dll address, the MessageBox address,
-	// and the address of the injected DLL's module.
-	user32Addr = (p - workspace) + codecaveAddress;
-	p += sizeof(LPBYTE);
-
-	msgboxAddr = (p - workspace) + codecaveAddress;
-	p += sizeof(LPBYTE);
-
-	dllAddr = (p - workspace) + codecaveAddress;
-	p += sizeof(LPBYTE);
-
-	// User32 Dll Name
-	user32NameAddr = (p - workspace) + codecaveAddress;
-	p = StringToUTF16_advance_dst(p, user32Name);
-
-	// MessageBox name
-	msgboxNameAddr = (p - workspace) + codecaveAddress;
-	p = memcpy_advance_dst(p, msgboxName, strlen(msgboxName) + 1);
-
-	// Directory name
-	if(dll_dir) {
-		dllDirAddr = (p - workspace) + codecaveAddress;
-		p = StringToUTF16_advance_dst(p, dll_dir);
-	}
-
-	// Dll Name
-	dllNameAddr = (p - workspace) + codecaveAddress;
-	p = StringToUTF16_advance_dst(p, dll_fn);
-
-	// Function Name
-	funcNameAddr = (p - workspace) + codecaveAddress;
-	p = memcpy_advance_dst(p, func_name, strlen(func_name) + 1);
-
-	// Function Parameter
-	funcParamAddr = (p - workspace) + codecaveAddress;
-	p = memcpy_advance_dst(p, param, param_size);
-
-	// Error Message 1
-	error0Addr = (p - workspace) + codecaveAddress;
-	p = StringToUTF16_advance_dst(p, injectError0);
-
-	// Error Message 2
-	error1Addr = (p - workspace) + codecaveAddress;
-	p = StringToUTF16_advance_dst(p, injectError1);
-
-	// Error Message 3
-	error2Addr = (p - workspace) + codecaveAddress;
-	p = StringToUTF16_advance_dst(p, injectError2);
-
-	// Pad a few INT3s after string data is written for seperation
-	*p++ = 0xCC;
-	*p++ = 0xCC;
-	*p++ = 0xCC;
-
-	// Store where the codecave execution should begin
-	codecaveExecAddr = (LPTHREAD_START_ROUTINE)((p - workspace) + codecaveAddress);
-
-// For debugging - infinite loop, attach onto process and step over
-	//*p++ = 0xEB;
-	//*p++ = 0xFE;
-
-//------------------------------------------//
-// User32.dll loading.                      //
-//------------------------------------------//
-
-// User32 DLL Loading
-	// PUSH 0x00000000 - Push the address of the DLL name to use in LoadLibrary
-	*p++ = 0x68;
-	p = ptrcpy_advance_dst(p, user32NameAddr);
-
-	// MOV EAX, ADDRESS - Move the address of LoadLibrary into EAX
-	*p++ = 0xB8;
-	p = ptrcpy_advance_dst(p, loadlibrary);
-
-	// CALL EAX - Call LoadLibrary
-	*p++ = 0xFF;
-	*p++ = 0xD0;
-
-// MessageBox Loading
-	// PUSH 0x000000 - Push the address of the function name to load
-	*p++ = 0x68;
-	p = ptrcpy_advance_dst(p, msgboxNameAddr);
-
-	// PUSH EAX, module to use in GetProcAddress
-	*p++ = 0x50;
-
-	// MOV EAX, ADDRESS - Move the address of GetProcAddress into EAX
-	*p++ = 0xB8;
-	p = ptrcpy_advance_dst(p, getprocaddress);
-
-	// CALL EAX - Call GetProcAddress
-	*p++ = 0xFF;
-	*p++ = 0xD0;
-
-	// MOV [ADDRESS], EAX - Save the address to our variable
-	*p++ = 0xA3;
-	p = ptrcpy_advance_dst(p, msgboxAddr);
-
-//------------------------------------------//
-// Injected dll loading.                    //
-//------------------------------------------//
-
-/*
-	// This is the way the following assembly code would look like in C/C++
-
-	// In case the injected DLL depends on other DLLs,
-	// we need to change the current directory to the one given as parameter
-	if(dll_dir) {
-		size_t cur_dir_len = GetCurrentDirectory(0, NULL) + 1;
-		VLA(wchar_t, cur_dir, cur_dir_len);
-		GetCurrentDirectory(cur_dir, cur_dir_len);
-		SetCurrentDirectory(dll_dir);
-	}
-
-	// Load the injected DLL into this process
-	HMODULE h = LoadLibraryEx(dll_fn, NULL, LOAD_LIBRARY_SEARCH_DLL_LOAD_DIR);
-	if(!h) {
-		MessageBox(0, injectError1, "Error", MB_ICONERROR);
-		ExitThread(1);
-	}
-
-	if(dll_dir) {
-		SetCurrentDirectory(cur_dir);
-	}
-
-	// Get the address of the export function
-	FARPROC p = GetProcAddress(h, func_name);
-	if(!p) {
-		MessageBox(0, injectError2, "Error", MB_ICONERROR);
-		FreeLibraryAndExitThread(h, 2);
-	}
-
-	// So we do not need a function pointer interface
-	__asm call p
-
-	// Exit the thread so the loader continues
-	ExitThread(0);
-*/
-
-// DLL Loading
-
-	if(dllDirAddr) {
-		// Registers:
-
-		// ebp: Base stack frame
-		// esi: GetCurrentDirectory / SetCurrentDirectory
-		// ebx: Current directory of process (on stack)
-		// ecx: byte length of string at ebx
-
-		// mov ebp, esp - Save stack frame
-		*p++ = 0x89;
-		*p++ = 0xe5;
-
-		// Get length for current directory
-
-		// push 0
-		// push 0
-		*p++ = 0x6a;
-		*p++ = 0x00;
-		*p++ = 0x6a;
-		*p++ = 0x00;
-		// mov esi, GetCurrentDirectory
-		*p++ = 0xbe;
-		p = ptrcpy_advance_dst(p, getcurrentdirectory);
-
-		// call esi
-		*p++ = 0xFF;
-		*p++ = 0xD6;
-
-		/// Calculate byte size of directory buffer.
-		/// Also do some DWORD boundary alignment
-		/// in order to not fuck up the stack
-
-		// mov ecx, eax
-		// shl ecx, 1
-		// and ecx, fffffff8
-		// add ecx, 4
-
-		*p++ = 0x89;
-		*p++ = 0xc1;
-		*p++ = 0xd1;
-		*p++ = 0xe1;
-		*p++ = 0x83;
-		*p++ = 0xe1;
-		*p++ = 0xf8;
-		*p++ = 0x83;
-		*p++ = 0xc1;
-		*p++ = 0x04;
-
-		/// "Allocate" ecx bytes on stack and store buffer pointer in ebx
-
-		// sub esp, ecx
-		// mov ebx, esp
-
-		*p++ = 0x29;
-		*p++ = 0xcc;
-		*p++ = 0x89;
-		*p++ = 0xe3;
-
-		/// Call GetCurrentDirectory
-		// push ebx
-		// push eax
-		// call esi
-		*p++ = 0x53;
-		*p++ = 0x50;
-		*p++ = 0xff;
-		*p++ = 0xd6;
-
-		/// PUSH 0x00000000 - Push the address of our directory
-		*p++ = 0x68;
-		p = ptrcpy_advance_dst(p, dllDirAddr);
-
-		// mov esi, SetCurrentDirectory
-		*p++ = 0xbe;
-		p = ptrcpy_advance_dst(p, setcurrentdirectory);
-
-		// call esi
-		*p++ = 0xFF;
-		*p++ = 0xD6;
-	}
-
-	if(PathIsRelativeA(dll_fn) || !have_kb2533623) {
-		// PUSH 0x00 (dwFlags = 0)
-		*p++ = 0x6a;
-		*p++ = 0x00;
-	} else {
-		// PUSH 0x00000900 (dwFlags = LOAD_LIBRARY_SEARCH_DLL_LOAD_DIR | LOAD_LIBRARY_SEARCH_SYSTEM32)
-		*p++ = 0x68;
-		*p++ = 0x00;
-		*p++ = 0x09;
-		*p++ = 0x00;
-		*p++ = 0x00;
+	// Workspace layout: parameter block, strings, and the stub, with the
+	// size of each UTF-16 string bounded by its UTF-8 length.
+	const size_t strings_size = (
+		(dll_dir ? strlen(dll_dir) + 1 : 0) + strlen(dll_fn) + 1 +
+		strlen("user32.dll") + 1 + strlen("Error") + 1 +
+		injectError1_len + injectError2_len
+	) * sizeof(wchar_t) + strlen(func_name) + 1 + strlen("MessageBoxW") + 1 + param_size;
+	const size_t workspace_size = sizeof(inject_params_t) + strings_size + 32 + sizeof(inject_stub);
+	std::vector<BYTE> workspace(workspace_size);
+
+	LPBYTE codecaveAddress = (LPBYTE)VirtualAllocEx(hProcess, 0, workspace_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+	if(!codecaveAddress) {
+		VLA_FREE(injectError1);
+		VLA_FREE(injectError2);
+		return -1;
 	}
 
-	// PUSH 0x00 (hFile = NULL)
-	*p++ = 0x6a;
-	*p++ = 0x00;
-
-	// PUSH 0x00000000 - Push the address of the DLL name to use in LoadLibraryEx
-	*p++ = 0x68;
-	p = ptrcpy_advance_dst(p, dllNameAddr);
+	size_t offset = sizeof(inject_params_t);
+	auto remote_addr = [codecaveAddress](size_t offset) {
+		return (uint32_t)(uintptr_t)(codecaveAddress + offset);
+	};
+	auto add_data = [&](const void *src, size_t size) {
+		uint32_t ret = remote_addr(offset);
+		memcpy(workspace.data() + offset, src, size);
+		offset += size;
+		return ret;
+	};
+	auto add_str = [&](const char *str) {
+		return add_data(str, strlen(str) + 1);
+	};
+	auto add_str_w = [&](const char *str) {
+		uint32_t ret = remote_addr(offset);
+		offset += StringToUTF16((wchar_t*)(workspace.data() + offset), str, -1) * sizeof(wchar_t);
+		return ret;
+	};
 
-	// MOV EAX, ADDRESS - Move the address of LoadLibraryEx into EAX
-	*p++ = 0xB8;
-	p = ptrcpy_advance_dst(p, loadlibraryex);
-
-	// CALL EAX - Call LoadLibraryEx
-	*p++ = 0xFF;
-	*p++ = 0xD0;
-
-	// mov edi, eax - Save return value
-	*p++ = 0x89;
-	*p++ = 0xc7;
+	// If [dll_fn] is absolute, LoadLibraryEx() with the LOAD_LIBRARY_SEARCH_DLL_LOAD_DIR
+	// flag is used to guarantee that the injected DLL and its dependencies really
+	// are only loaded from the given directory. Otherwise, LoadLibrary() may load
+	// a possible other DLL with the same name from the directory of [hProcess].
+	inject_params_t params = {};
+	params.LoadLibraryW = (uint32_t)(uintptr_t)GetProcAddress(kernel32, "LoadLibraryW");
+	params.LoadLibraryExW = (uint32_t)(uintptr_t)GetProcAddress(kernel32, "LoadLibraryExW");
+	params.GetProcAddress = (uint32_t)(uintptr_t)GetProcAddress(kernel32, "GetProcAddress");
+	params.GetCurrentDirectoryW = (uint32_t)(uintptr_t)GetProcAddress(kernel32, "GetCurrentDirectoryW");
+	params.SetCurrentDirectoryW = (uint32_t)(uintptr_t)GetProcAddress(kernel32, "SetCurrentDirectoryW");
+	params.FreeLibrary = (uint32_t)(uintptr_t)GetProcAddress(kernel32, "FreeLibrary");
+	params.dll_dir = dll_dir ? add_str_w(dll_dir) : 0;
+	params.dll_fn = add_str_w(dll_fn);
+	params.load_flags = (PathIsRelativeA(dll_fn) || !have_kb2533623)
+		? 0
+		: LOAD_LIBRARY_SEARCH_DLL_LOAD_DIR | LOAD_LIBRARY_SEARCH_SYSTEM32;
+	params.func_name = add_str(func_name);
+	params.func_param = add_data(param, param_size);
+	params.user32_name = add_str_w("user32.dll");
+	params.msgbox_name = add_str("MessageBoxW");
+	params.error_title = add_str_w("Error");
+	params.error_load = add_str_w(injectError1);
+	params.error_func = add_str_w(injectError2);
+	memcpy(workspace.data(), &params, sizeof(params));
+
+	// Pad a few INT3s after string data is written for seperation,
+	// and align the stub.
+	offset = (offset + 3 + 15) & ~(size_t)15;
+	memset(workspace.data() + offset - 3, 0xCC, 3);
+	auto codecaveExecAddr = (LPTHREAD_START_ROUTINE)(codecaveAddress + offset);
+	add_data(inject_stub, sizeof(inject_stub));
 
-	if(dllDirAddr) {
-		/// Reset directory to the original one of the process
-		// push ebx
-		// call esi
-		*p++ = 0x53;
-		*p++ = 0xFF;
-		*p++ = 0xD6;
+	VLA_FREE(injectError1);
+	VLA_FREE(injectError2);
 
-		/// Reset stack frame
-		// mov esp, ebp
-		*p++ = 0x89;
-		*p++ = 0xec;
+	SIZE_T byte_ret = 0;
+	DWORD injRet = (DWORD)-1;
+	if(
+		WriteProcessMemory(hProcess, codecaveAddress, workspace.data(), offset, &byte_ret)
+		&& FlushInstructionCache(hProcess, codecaveAddress, offset)
+	) {
+		// Execute the thread now and wait for it to exit. The parameter
+		// block is at the start of the codecave.
+		HANDLE hThread = CreateRemoteThread(hProcess, NULL, 0, codecaveExecAddr, codecaveAddress, 0, NULL);
+		if(hThread) {
+			WaitForSingleObject(hThread, INFINITE);
+			GetExitCodeThread(hThread, &injRet);
+			CloseHandle(hThread);
+		}
 	}
 
-// Error Checking
-	// CMP EDI, 0
-	*p++ = 0x83;
-	*p++ = 0xFF;
-	*p++ = 0x00;
-
-// JNZ EIP + 0x1E to skip over eror code
-	*p++ = 0x75;
-	*p++ = 0x1E;
-
-// Error Code 1
-	// MessageBox
-		// PUSH 0x10 (MB_ICONHAND)
-		*p++ = 0x6A;
-		*p++ = 0x10;
-
-		// PUSH 0x000000 - Push the address of the MessageBox title
-		*p++ = 0x68;
-		p = ptrcpy_advance_dst(p, error0Addr);
-
-		// PUSH 0x000000 - Push the address of the MessageBox message
-		*p++ = 0x68;
-		p = ptrcpy_advance_dst(p, error1Addr);
-
-		// PUSH 0
-		*p++ = 0x6A;
-		*p++ = 0x00;
-
-		// MOV EAX, [ADDRESS] - Move the address of MessageBox into EAX
-		*p++ = 0xA1;
-		p = ptrcpy_advance_dst(p, msgboxAddr);
-
-		// CALL EAX - Call MessageBoxW
-		*p++ = 0xFF;
-		*p++ = 0xD0;
-
-	// ExitThread
-		// PUSH 1
-		*p++ = 0x6A;
-		*p++ = 0x01;
-
-		// MOV EAX, ADDRESS - Move the address of ExitThread into EAX
-		*p++ = 0xB8;
-		p = ptrcpy_advance_dst(p, exitthread);
-
-		// CALL EAX - Call ExitThread
-		*p++ = 0xFF;
-		*p++ = 0xD0;
-
-//	Now we have the address of the injected DLL, so save the handle
-
-	// MOV [ADDRESS], EAX - Save the address to our variable
-	*p++ = 0x89;
-	*p++ = 0x3D;
-	p = ptrcpy_advance_dst(p, dllAddr);
-
-// Load the initilize function from it
-
-	// PUSH 0x000000 - Push the address of the function name to load
-	*p++ = 0x68;
-	p = ptrcpy_advance_dst(p, funcNameAddr);
-
-	// PUSH EDI - module to use in GetProcAddress
-	*p++ = 0x57;
-
-	// MOV EAX, ADDRESS - Move the address of GetProcAddress into EAX
-	*p++ = 0xB8;
-	p = ptrcpy_advance_dst(p, getprocaddress);
-
-	// CALL EAX - Call GetProcAddress
-	*p++ = 0xFF;
-	*p++ = 0xD0;
-
-// Error Checking
-	// CMP EAX, 0
-	*p++ = 0x83;
-	*p++ = 0xF8;
-	*p++ = 0x00;
-
-// JNZ EIP + 0x23 to skip eror code
-	*p++ = 0x75;
-	*p++ = 0x23;
-
-// Error Code 2
-	// MessageBox
-		// PUSH 0x10 (MB_ICONHAND)
-		*p++ = 0x6A;
-		*p++ = 0x10;
-
-		// PUSH 0x000000 - Push the address of the MessageBox title
-		*p++ = 0x68;
-		p = ptrcpy_advance_dst(p, error0Addr);
-
-		// PUSH 0x000000 - Push the address of the MessageBox message
-		*p++ = 0x68;
-		p = ptrcpy_advance_dst(p, error2Addr);
-
-		// PUSH 0
-		*p++ = 0x6A;
-		*p++ = 0x00;
-
-		// MOV EAX, ADDRESS - Move the address of MessageBox into EAX
-		*p++ = 0xA1;
-		p = ptrcpy_advance_dst(p, msgboxAddr);
-
-		// CALL EAX - Call MessageBoxA
-		*p++ = 0xFF;
-		*p++ = 0xD0;
-
-	// FreeLibraryAndExitThread
-		// PUSH 2
-		*p++ = 0x6A;
-		*p++ = 0x02;
-
-		// PUSH 0x000000 - Push the injected DLL's module handle
-		*p++ = 0x68;
-		p = ptrcpy_advance_dst(p, dllAddr);
-
-		// MOV EAX, ADDRESS - Move the address of FreeLibraryAndExitThread into EAX
-		*p++ = 0xB8;
-		p = ptrcpy_advance_dst(p, freelibraryandexitthread);
-
-		// CALL EAX - Call ExitThread function
-		*p++ = 0xFF;
-		*p++ = 0xD0;
-
-	// PUSH 0x000000 - Push the address of the function parameter
-	*p++ = 0x68;
-	p = ptrcpy_advance_dst(p, funcParamAddr);
-
-	// CALL EAX - Call [func_name]
-	*p++ = 0xFF;
-	*p++ = 0xD0;
-
-	// If we get here, [func_name] has been called,
-	// so it's time to close this thread and optionally unload the DLL.
-
-//------------------------------------------//
-// Exiting from the injected dll.           //
-//------------------------------------------//
-
-// Call ExitThread to leave the DLL loaded
-#if 1
-	// PUSH 0 (exit code)
-	*p++ = 0x6A;
-	*p++ = 0x00;
-
-	// MOV EAX, ADDRESS - Move the address of ExitThread into EAX
-	*p++ = 0xB8;
-	p = ptrcpy_advance_dst(p, exitthread);
-
-	// CALL EAX - Call ExitThread
-	*p++ = 0xFF;
-	*p++ = 0xD0;
-#endif
-
-// Call FreeLibraryAndExitThread to unload DLL
-#if 0
-	// PUSH 0 (exit code)
-	*p++ = 0x6A;
-	*p++ = 0x00;
-
-	// PUSH [0x000000] - Push the address of the DLL module to unload
-	*p++ = 0xFF;
-	*p++ = 0x35;
-	p = ptrcpy_advance_dst(p, dllAddr);
-
-	// MOV EAX, ADDRESS - Move the address of FreeLibraryAndExitThread into EAX
-	*p++ = 0xB8;
-	p = ptrcpy_advance_dst(p, freelibraryandexitthread);
-
-	// CALL EAX - Call FreeLibraryAndExitThread
-	*p++ = 0xFF;
-	*p++ = 0xD0;
-#endif
-
-//------------------------------------------//
-// Code injection and cleanup.              //
-//------------------------------------------//
-
-	// Change page protection so we can write executable code
-	VirtualProtectEx(hProcess, codecaveAddress, p - workspace, PAGE_EXECUTE_READWRITE, &oldProtect);
-
-	// Write out the patch
-	WriteProcessMemory(hProcess, codecaveAddress, workspace, p - workspace, &byte_ret);
-
-	// Restore page protection
-	VirtualProtectEx(hProcess, codecaveAddress, p - workspace, oldProtect, &oldProtect);
-
-	// Make sure our changes are written right away
-	FlushInstructionCache(hProcess, codecaveAddress, p - workspace);
-
-	// Free the workspace memory
-	HeapFree(GetProcessHeap(), 0, workspace);
-
-	// Execute the thread now and wait for it to exit, note we execute where the code starts, and not the codecave start
-	// (since we wrote strings at the start of the codecave)
-	hThread = CreateRemoteThread(hProcess, NULL, 0, codecaveExecAddr, 0, 0, NULL);
-	WaitForSingleObject(hThread, INFINITE);
-
-	GetExitCodeThread(hThread, &injRet);
-	CloseHandle(hThread);
-
 	// Free the memory in the process that we allocated
 	VirtualFreeEx(hProcess, codecaveAddress, 0, MEM_RELEASE);
-
-	VLA_FREE(injectError1);
-	VLA_FREE(injectError2);
 	return injRet;
 }
 
@@ -768,11 +417,13 @@ BOOL thcrap_inject_into_new(const char *exe_fn, char *args, HANDLE *hProcess, HA
 	  * initial startup, it really shouldn't be necessary for now - and
 	  * it really does run way too much unnecessary code for my taste.
 	  */
+	init_snapshot_prepare(exe_fn);
 	ret = W32_ERR_WRAP(inject_CreateProcessU(
 		exe_fn_local, args, NULL, NULL, TRUE, 0, NULL, exe_dir, &si, &pi
 	));
 	if(ret) {
 		char *msg_str = NULL;
+		init_snapshot_discard();
 
 		FormatMessage(
 			FORMAT_MESSAGE_FROM_SYSTEM |
@@ -823,45 +474,126 @@ void* entry_from_context(HANDLE hThread)
 }
 /// -------------------------
 
+/**
+  * Stub that the entry point is redirected to while waiting for the
+  * process to get there. It signals [event] to the waiting process, and
+  * then spins in place, with all registers and flags as they were at the
+  * entry point:
+  *
+  *	pushad
+  *	pushfd
+  *	call next
+  * next:
+  *	pop ebx
+  *	push [ebx + (event - next)]
+  *	call [ebx + (SetEvent - next)]
+  *	popfd
+  *	popad
+  * spin:
+  *	jmp spin
+  */
+struct entry_wait_stub_t
+{
+	BYTE code[28];
+	uint32_t event;
+	uint32_t SetEvent;
+};
+#define ENTRY_WAIT_SPIN_OFFSET 0x16
+
+static const BYTE entry_wait_code[] = {
+	0x60, 0x9C, 0xE8, 0x00, 0x00, 0x00, 0x00, 0x5B, 0xFF, 0xB3, 0x15, 0x00,
+	0x00, 0x00, 0xFF, 0x93, 0x19, 0x00, 0x00, 0x00, 0x9D, 0x61, 0xEB, 0xFE,
+	0xCC, 0xCC, 0xCC, 0xCC,
+};
+static_assert(sizeof(entry_wait_code) == sizeof(entry_wait_stub_t::code));
+static_assert(offsetof(entry_wait_stub_t, event) == 0x1C);
+
 int ThreadWaitUntil(HANDLE hProcess, HANDLE hThread, void *addr)
 {
-	CONTEXT context = {};
-	BYTE entry_asm_orig[2];
-	const BYTE entry_asm_delay[2] = {0xEB, 0xFE}; // JMP SHORT YADA YADA
+	BYTE entry_asm_orig[5];
+	BYTE entry_asm_jmp[5] = { 0xE9 }; // JMP entry_wait_stub
 	MEMORY_BASIC_INFORMATION mbi;
 	SIZE_T byte_ret;
 	DWORD old_prot;
+	int ret = 1;
 
 	if(!VirtualQueryEx(hProcess, addr, &mbi, sizeof(mbi))) {
 		return 1;
 	}
+	auto *stub = (BYTE*)VirtualAllocEx(hProcess, NULL, sizeof(entry_wait_stub_t), MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+	if(!stub) {
+		return 1;
+	}
+	HANDLE event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	HANDLE event_remote = NULL;
+	if(!event || !DuplicateHandle(
+		GetCurrentProcess(), event, hProcess, &event_remote, EVENT_MODIFY_STATE, FALSE, 0
+	)) {
+		if(event) {
+			CloseHandle(event);
+		}
+		VirtualFreeEx(hProcess, stub, 0, MEM_RELEASE);
+		return 1;
+	}
+
+	entry_wait_stub_t stub_local = {};
+	memcpy(stub_local.code, entry_wait_code, sizeof(entry_wait_code));
+	stub_local.event = (uint32_t)(uintptr_t)event_remote;
+	stub_local.SetEvent = (uint32_t)(uintptr_t)GetProcAddress(GetModuleHandleA("kernel32.dll"), "SetEvent");
+	const int32_t rel = (int32_t)((uintptr_t)stub - ((uintptr_t)addr + sizeof(entry_asm_jmp)));
+	memcpy(entry_asm_jmp + 1, &rel, sizeof(rel));
+
+	WriteProcessMemory(hProcess, stub, &stub_local, sizeof(stub_local), &byte_ret);
+	FlushInstructionCache(hProcess, stub, sizeof(stub_local));
 	VirtualProtectEx(hProcess, mbi.BaseAddress, mbi.RegionSize, PAGE_EXECUTE_READWRITE, &old_prot);
 	ReadProcessMemory(hProcess, addr, entry_asm_orig, sizeof(entry_asm_orig), &byte_ret);
-	WriteProcessMemory(hProcess, addr, entry_asm_delay, sizeof(entry_asm_delay), &byte_ret);
-	FlushInstructionCache(hProcess, addr, sizeof(entry_asm_delay));
-
-	while (true) {
-		context.ContextFlags = CONTEXT_CONTROL;
-		GetThreadContext(hThread, &context);
+	WriteProcessMemory(hProcess, addr, entry_asm_jmp, sizeof(entry_asm_jmp), &byte_ret);
+	FlushInstructionCache(hProcess, addr, sizeof(entry_asm_jmp));
+
+	// Let the process run until it signals that it reached the stub, or
+	// until it exits on its own because something went wrong before.
+	HANDLE events[] = { event, hProcess };
+	ResumeThread(hThread);
+	DWORD ret_wait = WaitForMultipleObjects(elementsof(events), events, FALSE, INFINITE);
+	SuspendThread(hThread);
+
+	if(ret_wait == WAIT_OBJECT_0) {
+		// The thread might still be a few instructions away from the
+		// spin loop.
+		const UINT_PTR spin = (UINT_PTR)stub + ENTRY_WAIT_SPIN_OFFSET;
+		CONTEXT context = {};
+		while(true) {
+			context.ContextFlags = CONTEXT_CONTROL;
+			if(!GetThreadContext(hThread, &context)) {
+				break;
+			}
 #ifdef __x86_64__
-		UINT_PTR ip = context.Rip;
+			UINT_PTR &ip = (UINT_PTR&)context.Rip;
 #else
-		UINT_PTR ip = context.Eip;
+			UINT_PTR &ip = (UINT_PTR&)context.Eip;
 #endif
-		if (ip != (UINT_PTR)addr) {
-			break ;
+			if(ip == spin) {
+				ip = (UINT_PTR)addr;
+				ret = !SetThreadContext(hThread, &context);
+				break;
+			}
+			ResumeThread(hThread);
+			Sleep(0);
+			SuspendThread(hThread);
 		}
-		ResumeThread(hThread);
-		Sleep(10);
-		SuspendThread(hThread);
 	}
 
 	// Write back the original code
 	WriteProcessMemory(hProcess, addr, entry_asm_orig, sizeof(entry_asm_orig), &byte_ret);
 	FlushInstructionCache(hProcess, addr, sizeof(entry_asm_orig));
-
 	VirtualProtectEx(hProcess, mbi.BaseAddress, mbi.RegionSize, old_prot, &old_prot);
-	return 0;
+
+	// The thread is back at the entry point and doesn't need the stub
+	// anymore. If it never made it there, the process is gone anyway.
+	VirtualFreeEx(hProcess, stub, 0, MEM_RELEASE);
+	DuplicateHandle(hProcess, event_remote, NULL, NULL, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+	CloseHandle(event);
+	return ret;
 }
 
 int WaitUntilEntryPoint(HANDLE hProcess, HANDLE hThread, const char *module)
@@ -920,7 +652,11 @@ static void inject_CreateProcess_helper(
 {
 	if(!WaitUntilEntryPoint(lpPI->hProcess, lpPI->hThread, lpAppName)) {
 		const char *run_cfg_fn = runconfig_runcfg_fn_get();
+		HANDLE hSnapshot = init_snapshot_publish(lpPI->dwProcessId);
 		thcrap_inject_into_running(lpPI->hProcess, run_cfg_fn);
+		if(hSnapshot) {
+			CloseHandle(hSnapshot);
+		}
 	}
 	if(~dwCreationFlags & CREATE_SUSPENDED) {
 		ResumeThread(lpPI->hThread);
@@ -19,6 +19,8 @@
 void* entry_from_context(HANDLE hThread);
 /// -------------------------
 
+// Lets the suspended [hThread] run until it reaches [addr], and suspends it
+// there again. Returns 0 on success.
 int ThreadWaitUntil(HANDLE hProcess, HANDLE hThread, void *addr);
 int WaitUntilEntryPoint(HANDLE hProcess, HANDLE hThread, const char *module);
 
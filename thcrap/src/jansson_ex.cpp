@@ -9,11 +9,8 @@
 
 #include "thcrap.h"
 #include <array>
-
-#pragma warning(push)
-#pragma warning(disable:4146)
-#include <json5pp.hpp>
-#pragma warning(pop)
+#include <cerrno>
+#include <cmath>
 
 json_t* json_decref_safe(json_t *json)
 {
@@ -153,6 +150,101 @@ const char* json_object_get_string(const json_t *object, const char *key)
 	return json_string_value(json_object_get(object, key));
 }
 
+/// Arena allocation
+/// ----------------
+// Allocation size of a chunk, unless a single allocation needs more.
+static const size_t JSON_ARENA_CHUNK_SIZE = 64 * 1024;
+static const size_t JSON_ARENA_ALIGN = 8;
+
+THREAD_LOCAL(json_arena_scope_t*, json_arena_tls, nullptr, nullptr);
+
+// Doesn't create the thread-local structure for threads that never entered
+// an arena scope.
+static json_arena_scope_t* json_arena_current(void)
+{
+	auto **arena = (json_arena_scope_t **)TlsGetValue(json_arena_tls.slot);
+	return arena ? *arena : nullptr;
+}
+
+void* __cdecl json_arena_malloc(size_t size)
+{
+	json_arena_scope_t *arena = json_arena_current();
+	if (arena) {
+		return arena->alloc(size);
+	}
+	void *ret = malloc(size);
+	memstats_heap_add(MEMSTATS_JSON, ret);
+	return ret;
+}
+
+void __cdecl json_arena_free(void *ptr)
+{
+	for (json_arena_scope_t *arena = json_arena_current(); arena; arena = arena->prev) {
+		if (arena->owns(ptr)) {
+			return;
+		}
+	}
+	memstats_heap_remove(MEMSTATS_JSON, ptr);
+	free(ptr);
+}
+
+json_arena_scope_t::json_arena_scope_t()
+	: prev(*json_arena_tls_get())
+{
+	*json_arena_tls_get() = this;
+}
+
+json_arena_scope_t::~json_arena_scope_t()
+{
+	*json_arena_tls_get() = prev;
+	while (chunks) {
+		chunk_t *next = chunks->next;
+		memstats_remove(MEMSTATS_JSON, chunks->size);
+		free(chunks);
+		chunks = next;
+	}
+}
+
+void* json_arena_scope_t::alloc(size_t size)
+{
+	size = (size + JSON_ARENA_ALIGN - 1) & ~(JSON_ARENA_ALIGN - 1);
+	if (!chunks || chunks->size - used < size) {
+		size_t chunk_size = MAX(JSON_ARENA_CHUNK_SIZE, sizeof(chunk_t) + size);
+		auto *chunk = (chunk_t *)malloc(chunk_size);
+		if (!chunk) {
+			return nullptr;
+		}
+		memstats_add(MEMSTATS_JSON, chunk_size);
+		chunk->next = chunks;
+		chunk->size = chunk_size;
+		chunks = chunk;
+		used = sizeof(chunk_t);
+	}
+	void *ret = (BYTE *)chunks + used;
+	used += size;
+	return ret;
+}
+
+bool json_arena_scope_t::owns(const void *ptr) const
+{
+	for (const chunk_t *chunk = chunks; chunk; chunk = chunk->next) {
+		if (ptr >= chunk && ptr < (const BYTE *)chunk + chunk->size) {
+			return true;
+		}
+	}
+	return false;
+}
+
+json_t* json_arena_scope_t::copy_out(const json_t *json)
+{
+	json_arena_scope_t **arena = json_arena_tls_get();
+	*arena = prev;
+	json_t *ret = json_deep_copy(json);
+	*arena = this;
+	return ret;
+}
+/// ----------------
+
 json_t* json_object_merge(json_t *old_obj, json_t *new_obj)
 {
 	const char *key;
@@ -177,6 +269,44 @@ json_t* json_object_merge(json_t *old_obj, json_t *new_obj)
 	return old_obj;
 }
 
+json_t* json_object_merge_new(json_t *old_obj, json_t *new_obj)
+{
+	const char *key;
+	void *tmp;
+	json_t *new_val;
+
+	if(!old_obj) {
+		return new_obj;
+	}
+	if(!new_obj) {
+		return old_obj;
+	}
+	if(!json_is_object(old_obj) || !json_is_object(new_obj)) {
+		json_decref(old_obj);
+		return new_obj;
+	}
+	if(new_obj->refcount != 1) {
+		// Someone else still sees [new_obj], so it must stay intact.
+		json_object_merge(old_obj, new_obj);
+		json_decref(new_obj);
+		return old_obj;
+	}
+	json_object_foreach_safe(new_obj, tmp, key, new_val) {
+		json_t *old_val = json_object_get(old_obj, key);
+		json_incref(new_val);
+		if(json_is_object(old_val) && json_is_object(new_val)) {
+			json_object_del(new_obj, key);
+			json_object_merge_new(old_val, new_val);
+		} else {
+			// [key] belongs to [new_obj]'s entry, so delete it last.
+			json_object_set_new_nocheck(old_obj, key, new_val);
+			json_object_del(new_obj, key);
+		}
+	}
+	json_decref(new_obj);
+	return old_obj;
+}
+
 static int __cdecl object_key_compare_keys(const void *key1, const void *key2)
 {
 	return strcmp(*(const char **)key1, *(const char **)key2);
@@ -270,47 +400,582 @@ json_xywh_t json_xywh_value(const json_t *arr)
 	);
 }
 
+/// JSON5 parser
+/// ------------
+/**
+  * Builds json_t values directly from JSON5 source in a single pass.
+  * Numbers follow jansson: integer literals (including hexadecimal ones)
+  * become JSON integers, everything with a fraction or an exponent becomes
+  * a real. Infinity and NaN can't be stored in a json_t and are rejected.
+  */
+struct json5_parser_t
+{
+	// Same as jansson's JSON_PARSER_MAX_DEPTH
+	static constexpr int DEPTH_MAX = 2048;
+
+	const char *start;
+	const char *p;
+	const char *end;
+	std::string error;
+	// Scratch buffer for strings and keys
+	std::string str;
+
+	json5_parser_t(const void *buffer, size_t size)
+		: start((const char *)buffer), p(start), end(start + size) {
+	}
+
+	bool fail(const char *msg) {
+		if (!error.empty()) {
+			return false;
+		}
+		int line = 1;
+		int column = 1;
+		for (const char *c = start; c < p && c < end; c++) {
+			if (*c == '\n') {
+				line++;
+				column = 1;
+			} else if ((*c & 0xC0) != 0x80) {
+				column++;
+			}
+		}
+		error.resize(_scprintf("line %d, column %d: %s", line, column, msg));
+		sprintf(&error[0], "line %d, column %d: %s", line, column, msg);
+		return false;
+	}
+
+	// Returns the length of the JSON5 whitespace or line terminator at [c],
+	// or 0 if there is none.
+	size_t ws_len(const char *c) const {
+		switch ((unsigned char)*c) {
+		case '\t': case '\n': case '\v': case '\f': case '\r': case ' ':
+			return 1;
+		case 0xC2: // U+00A0
+			return (c + 1 < end && (unsigned char)c[1] == 0xA0) ? 2 : 0;
+		case 0xE2: // U+2028, U+2029
+			return (
+				c + 2 < end && (unsigned char)c[1] == 0x80
+				&& ((unsigned char)c[2] == 0xA8 || (unsigned char)c[2] == 0xA9)
+			) ? 3 : 0;
+		case 0xEF: // U+FEFF
+			return (
+				c + 2 < end && (unsigned char)c[1] == 0xBB && (unsigned char)c[2] == 0xBF
+			) ? 3 : 0;
+		default:
+			return 0;
+		}
+	}
+
+	// Skips whitespace and comments.
+	bool skip() {
+		while (p < end) {
+			if (size_t len = ws_len(p)) {
+				p += len;
+			} else if (*p == '/' && p + 1 < end && p[1] == '/') {
+				while (p < end && *p != '\n' && *p != '\r') {
+					p++;
+				}
+			} else if (*p == '/' && p + 1 < end && p[1] == '*') {
+				const char *comment = p;
+				p += 2;
+				while (p + 1 < end && !(p[0] == '*' && p[1] == '/')) {
+					p++;
+				}
+				if (p + 1 >= end) {
+					p = comment;
+					return fail("unterminated comment");
+				}
+				p += 2;
+			} else {
+				break;
+			}
+		}
+		return true;
+	}
+
+	static int hex_digit(char c) {
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	}
+
+	bool hex(int digits, uint32_t& ret) {
+		ret = 0;
+		for (int i = 0; i < digits; i++) {
+			int digit = p < end ? hex_digit(*p) : -1;
+			if (digit < 0) {
+				return fail("invalid hexadecimal escape");
+			}
+			ret = (ret << 4) | digit;
+			p++;
+		}
+		return true;
+	}
+
+	void utf8_append(uint32_t c) {
+		if (c < 0x80) {
+			str += (char)c;
+		} else if (c < 0x800) {
+			str += (char)(0xC0 | (c >> 6));
+			str += (char)(0x80 | (c & 0x3F));
+		} else if (c < 0x10000) {
+			str += (char)(0xE0 | (c >> 12));
+			str += (char)(0x80 | ((c >> 6) & 0x3F));
+			str += (char)(0x80 | (c & 0x3F));
+		} else {
+			str += (char)(0xF0 | (c >> 18));
+			str += (char)(0x80 | ((c >> 12) & 0x3F));
+			str += (char)(0x80 | ((c >> 6) & 0x3F));
+			str += (char)(0x80 | (c & 0x3F));
+		}
+	}
+
+	// Parses the \u escape after the backslash and the u, including a
+	// following low surrogate.
+	bool unicode_escape() {
+		uint32_t c;
+		if (!hex(4, c)) {
+			return false;
+		}
+		if (c >= 0xD800 && c <= 0xDBFF) {
+			uint32_t low;
+			if (end - p < 6 || p[0] != '\\' || p[1] != 'u') {
+				return fail("invalid Unicode surrogate pair");
+			}
+			p += 2;
+			if (!hex(4, low)) {
+				return false;
+			}
+			if (low < 0xDC00 || low > 0xDFFF) {
+				return fail("invalid Unicode surrogate pair");
+			}
+			c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+		} else if (c >= 0xDC00 && c <= 0xDFFF) {
+			return fail("invalid Unicode surrogate pair");
+		}
+		if (c == 0) {
+			return fail("\\u0000 is not allowed");
+		}
+		utf8_append(c);
+		return true;
+	}
+
+	// Parses a string starting at the opening quote into [str].
+	bool string() {
+		const char quote = *p++;
+		str.clear();
+		while (true) {
+			const char *run = p;
+			while (p < end && *p != quote && *p != '\\' && *p != '\n' && *p != '\r') {
+				p++;
+			}
+			str.append(run, p);
+			if (p >= end) {
+				return fail("unterminated string");
+			}
+			if (*p == quote) {
+				p++;
+				return true;
+			}
+			if (*p != '\\') {
+				return fail("unescaped line break in string");
+			}
+			p++;
+			if (p >= end) {
+				return fail("unterminated string");
+			}
+			const char c = *p++;
+			switch (c) {
+			case 'b': str += '\b'; break;
+			case 'f': str += '\f'; break;
+			case 'n': str += '\n'; break;
+			case 'r': str += '\r'; break;
+			case 't': str += '\t'; break;
+			case 'v': str += '\v'; break;
+			case '0':
+				if (p < end && *p >= '0' && *p <= '9') {
+					return fail("octal escapes are not allowed");
+				}
+				return fail("\\0 is not allowed");
+			case 'x': {
+				uint32_t x;
+				if (!hex(2, x)) {
+					return false;
+				}
+				if (x == 0) {
+					return fail("\\x00 is not allowed");
+				}
+				utf8_append(x);
+				break;
+			}
+			case 'u':
+				if (!unicode_escape()) {
+					return false;
+				}
+				break;
+			// Line continuations
+			case '\r':
+				if (p < end && *p == '\n') {
+					p++;
+				}
+				break;
+			case '\n':
+				break;
+			default:
+				if (c >= '1' && c <= '9') {
+					p--;
+					return fail("octal escapes are not allowed");
+				}
+				if ((unsigned char)c == 0xE2 && ws_len(p - 1) == 3) {
+					// U+2028 and U+2029 continue the line, U+FEFF doesn't
+					// get here.
+					p += 2;
+					break;
+				}
+				// Any other character escapes to itself.
+				str += c;
+				break;
+			}
+		}
+	}
+
+	static bool ident_char(char c, bool first) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+			|| c == '_' || c == '$' || (unsigned char)c >= 0x80
+			|| (!first && c >= '0' && c <= '9');
+	}
+
+	// Parses an unquoted object key into [str].
+	bool identifier() {
+		str.clear();
+		bool first = true;
+		while (p < end) {
+			if (*p == '\\') {
+				if (end - p < 2 || p[1] != 'u') {
+					return fail("invalid escape in identifier");
+				}
+				p += 2;
+				if (!unicode_escape()) {
+					return false;
+				}
+			} else if (ident_char(*p, first) && !ws_len(p)) {
+				str += *p++;
+			} else {
+				break;
+			}
+			first = false;
+		}
+		if (str.empty()) {
+			return fail("expected a key");
+		}
+		return true;
+	}
+
+	bool literal(const char *word) {
+		const size_t len = strlen(word);
+		if ((size_t)(end - p) >= len && !memcmp(p, word, len)
+			&& (p + len == end || !ident_char(p[len], false))) {
+			p += len;
+			return true;
+		}
+		return false;
+	}
+
+	json_t* number() {
+		const char *num_start = p;
+		bool negative = false;
+		if (*p == '+' || *p == '-') {
+			negative = *p == '-';
+			p++;
+		}
+		if (literal("Infinity") || literal("NaN")) {
+			p = num_start;
+			fail("Infinity and NaN can't be represented in JSON");
+			return nullptr;
+		}
+		if (end - p >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+			p += 2;
+			uint64_t val = 0;
+			const char *digits = p;
+			int digit;
+			while (p < end && (digit = hex_digit(*p)) >= 0) {
+				if (val > (UINT64_MAX >> 4)) {
+					p = num_start;
+					fail("hexadecimal number too big");
+					return nullptr;
+				}
+				val = (val << 4) | digit;
+				p++;
+			}
+			if (p == digits) {
+				fail("invalid hexadecimal number");
+				return nullptr;
+			}
+			return json_integer(negative ? -(json_int_t)val : (json_int_t)val);
+		}
+
+		bool is_real = false;
+		const char *int_start = p;
+		while (p < end && *p >= '0' && *p <= '9') {
+			p++;
+		}
+		const bool has_int = p != int_start;
+		if (has_int && *int_start == '0' && p - int_start > 1) {
+			p = int_start;
+			fail("leading zeros are not allowed");
+			return nullptr;
+		}
+		bool has_frac = false;
+		if (p < end && *p == '.') {
+			is_real = true;
+			p++;
+			const char *frac_start = p;
+			while (p < end && *p >= '0' && *p <= '9') {
+				p++;
+			}
+			has_frac = p != frac_start;
+		}
+		if (!has_int && !has_frac) {
+			p = num_start;
+			fail("invalid number");
+			return nullptr;
+		}
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			is_real = true;
+			p++;
+			if (p < end && (*p == '+' || *p == '-')) {
+				p++;
+			}
+			const char *exp_start = p;
+			while (p < end && *p >= '0' && *p <= '9') {
+				p++;
+			}
+			if (p == exp_start) {
+				fail("invalid exponent");
+				return nullptr;
+			}
+		}
+		if (p < end && ident_char(*p, false)) {
+			fail("invalid number");
+			return nullptr;
+		}
+
+		// strtoll() and strtod() need a terminated string, and don't know
+		// about a leading '+'.
+		const char *conv_start = (*num_start == '+') ? num_start + 1 : num_start;
+		std::string num(conv_start, p);
+		errno = 0;
+		if (!is_real) {
+			json_int_t val = strtoll(num.c_str(), nullptr, 10);
+			if (errno == ERANGE) {
+				p = num_start;
+				fail("integer too big");
+				return nullptr;
+			}
+			return json_integer(val);
+		}
+		double val = strtod(num.c_str(), nullptr);
+		if (errno == ERANGE && (val == HUGE_VAL || val == -HUGE_VAL)) {
+			p = num_start;
+			fail("real number overflow");
+			return nullptr;
+		}
+		return json_real(val);
+	}
+
+	json_t* object(int depth) {
+		json_t *ret = json_object();
+		p++;
+		while (true) {
+			if (!skip()) {
+				break;
+			}
+			if (p >= end) {
+				fail("unterminated object");
+				break;
+			}
+			if (*p == '}') {
+				p++;
+				return ret;
+			}
+			if (*p == '"' || *p == '\'') {
+				if (!string()) {
+					break;
+				}
+			} else if (!identifier()) {
+				break;
+			}
+			if (str.find('\0') != std::string::npos) {
+				fail("NUL byte in object key");
+				break;
+			}
+			std::string key = str;
+			if (!skip()) {
+				break;
+			}
+			if (p >= end || *p != ':') {
+				fail("expected ':'");
+				break;
+			}
+			p++;
+			json_t *val = value(depth + 1);
+			if (!val) {
+				break;
+			}
+			json_object_set_new(ret, key.c_str(), val);
+			if (!skip()) {
+				break;
+			}
+			if (p < end && *p == ',') {
+				p++;
+			} else if (p >= end || *p != '}') {
+				fail("expected ',' or '}'");
+				break;
+			}
+		}
+		json_decref(ret);
+		return nullptr;
+	}
+
+	json_t* array(int depth) {
+		json_t *ret = json_array();
+		p++;
+		while (true) {
+			if (!skip()) {
+				break;
+			}
+			if (p >= end) {
+				fail("unterminated array");
+				break;
+			}
+			if (*p == ']') {
+				p++;
+				return ret;
+			}
+			json_t *val = value(depth + 1);
+			if (!val) {
+				break;
+			}
+			json_array_append_new(ret, val);
+			if (!skip()) {
+				break;
+			}
+			if (p < end && *p == ',') {
+				p++;
+			} else if (p >= end || *p != ']') {
+				fail("expected ',' or ']'");
+				break;
+			}
+		}
+		json_decref(ret);
+		return nullptr;
+	}
+
+	json_t* value(int depth) {
+		if (depth > DEPTH_MAX) {
+			fail("maximum parsing depth reached");
+			return nullptr;
+		}
+		if (!skip()) {
+			return nullptr;
+		}
+		if (p >= end) {
+			fail("unexpected end of input");
+			return nullptr;
+		}
+		switch (*p) {
+		case '{':
+			return object(depth);
+		case '[':
+			return array(depth);
+		case '"':
+		case '\'': {
+			const char *str_start = p;
+			if (!string()) {
+				return nullptr;
+			}
+			json_t *ret = json_stringn(str.data(), str.size());
+			if (!ret) {
+				p = str_start;
+				fail("invalid UTF-8 in string");
+			}
+			return ret;
+		}
+		default:
+			break;
+		}
+		if (literal("true")) {
+			return json_true();
+		} else if (literal("false")) {
+			return json_false();
+		} else if (literal("null")) {
+			return json_null();
+		} else if ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == '.' || *p == 'I' || *p == 'N') {
+			return number();
+		}
+		fail("unexpected character");
+		return nullptr;
+	}
+
+	json_t* parse() {
+		if (!skip()) {
+			return nullptr;
+		}
+		if (p >= end || (*p != '{' && *p != '[')) {
+			fail("'[' or '{' expected");
+			return nullptr;
+		}
+		json_t *ret = value(0);
+		if (ret && skip() && p < end) {
+			fail("end of file expected");
+		}
+		if (ret && !error.empty()) {
+			json_decref(ret);
+			ret = nullptr;
+		}
+		return ret;
+	}
+};
+
 json_t *json5_loadb(const void *buffer, size_t size, char **error)
 {
 	if (error) {
 		*error = nullptr;
 	}
 
-	json5pp::value json5;
-	try {
-		json5pp::impl::imemstream istream(buffer, size);
-		json5 = json5pp::parse5(istream, false);
+	// Most patch files are plain JSON, which jansson can take directly.
+	// Files that start with a comment are definitely not, and don't need to
+	// be tried.
+	json5_parser_t parser(buffer, size);
+	while (parser.p < parser.end && parser.ws_len(parser.p)) {
+		parser.p += parser.ws_len(parser.p);
 	}
-	catch (json5pp::syntax_error e) {
-		if (error) {
-			*error = strdup(e.what());
+	if (parser.p >= parser.end || *parser.p != '/') {
+		if (json_t *ret = json_loadb((const char *)buffer, size, 0, nullptr)) {
+			return ret;
 		}
-		return nullptr;
 	}
 
-	std::string json_string = json5.stringify();
-
-	json_t *jansson = json_loadb(json_string.c_str(), json_string.size(), 0, nullptr);
-	return jansson;
+	parser.p = parser.start;
+	json_t *ret = parser.parse();
+	if (!ret && error) {
+		*error = strdup(parser.error.c_str());
+	}
+	return ret;
 }
 
-json_t* json_load_file_report(const char *json_fn)
+// Parses [buffer], reporting errors in a message box of type [mb_type]
+// whose result is returned in [msgbox_ret].
+static json_t* json_loadb_report_box(const void *buffer, size_t json_size, const char *json_fn, UINT mb_type, int *msgbox_ret)
 {
-	size_t json_size;
 	const unsigned char utf8_bom[] = { 0xef, 0xbb, 0xbf };
 	const unsigned char utf16le_bom[] = { 0xff, 0xfe };
 	char *converted_buffer = nullptr;
 	char *error = nullptr;
 	json_t *ret;
-	int msgbox_ret;
-	void* file_buffer;
-	char *json_buffer;
-
-start:
-	msgbox_ret = 0;
-	file_buffer = file_read(json_fn, &json_size);
-	json_buffer = (char*)file_buffer;
+	const char *json_buffer = (const char*)buffer;
 
+	*msgbox_ret = 0;
 	if (!json_buffer || !json_size) {
 		return NULL;
 	}
@@ -344,7 +1009,7 @@ start:
 	}
 	ret = json5_loadb(json_buffer, json_size, &error);
 	if (!ret) {
-		msgbox_ret = log_mboxf(NULL, MB_RETRYCANCEL | MB_ICONSTOP,
+		*msgbox_ret = log_mboxf(NULL, mb_type | MB_ICONSTOP,
 			"JSON parsing error: %s\n"
 			"\n"
 			"(%s)",
@@ -352,13 +1017,26 @@ start:
 		);
 	}
 	SAFE_FREE(converted_buffer);
-	SAFE_FREE(file_buffer);
 	SAFE_FREE(error);
+	return ret;
+}
 
-	if (msgbox_ret == IDRETRY) {
-		goto start;
-	}
+json_t* json_loadb_report(const void *buffer, size_t size, const char *json_fn)
+{
+	int msgbox_ret;
+	return json_loadb_report_box(buffer, size, json_fn, MB_OK, &msgbox_ret);
+}
 
+json_t* json_load_file_report(const char *json_fn)
+{
+	json_t *ret;
+	int msgbox_ret;
+	do {
+		size_t json_size;
+		void *file_buffer = file_read(json_fn, &json_size);
+		ret = json_loadb_report_box(file_buffer, json_size, json_fn, MB_RETRYCANCEL, &msgbox_ret);
+		SAFE_FREE(file_buffer);
+	} while (msgbox_ret == IDRETRY);
 	return ret;
 }
 
@@ -96,6 +96,13 @@ const char* json_object_get_string(const json_t *object, const char *key);
 // [new_obj] otherwise.
 json_t* json_object_merge(json_t *old_obj, json_t *new_obj);
 
+// Like json_object_merge(), but steals the reference to [new_obj].
+// If the caller held the only reference to [new_obj], its child values are
+// moved into [old_obj] rather than shared with it, and [new_obj] is
+// dismantled in the process. Returns the merged value, which is [old_obj]
+// if both are JSON objects or [new_obj] otherwise.
+json_t* json_object_merge_new(json_t *old_obj, json_t *new_obj);
+
 // Return an alphabetically sorted JSON array of the keys in [object].
 json_t* json_object_get_keys_sorted(const json_t *object);
 /// -------
@@ -129,6 +136,57 @@ extern "C" {
 #endif
 /// --------------
 
+/// Arena allocation
+/// ----------------
+// jansson allocation functions that serve the allocations of a thread from
+// its innermost json_arena_scope_t, if it has one, and use malloc() and
+// free() otherwise. Set by InitDll().
+void* __cdecl json_arena_malloc(size_t size);
+void __cdecl json_arena_free(void *ptr);
+
+#ifdef __cplusplus
+}
+
+/**
+  * While an instance of this class is alive, all jansson allocations on the
+  * calling thread come from a private arena, freeing them does nothing, and
+  * the whole arena is released at once when the instance is destroyed.
+  *
+  * Meant for transient parse and merge work. No JSON value created inside
+  * the scope may be used after it ends, and no value created outside of it
+  * may be modified inside, since it would then point into the arena. Use
+  * copy_out() to keep a result. Scopes can be nested.
+  */
+class json_arena_scope_t
+{
+public:
+	json_arena_scope_t();
+	~json_arena_scope_t();
+	json_arena_scope_t(const json_arena_scope_t&) = delete;
+	json_arena_scope_t& operator=(const json_arena_scope_t&) = delete;
+
+	// Returns a deep copy of [json] allocated outside of this arena.
+	json_t* copy_out(const json_t *json);
+
+	void* alloc(size_t size);
+	bool owns(const void *ptr) const;
+
+	json_arena_scope_t *const prev;
+
+private:
+	struct chunk_t {
+		chunk_t *next;
+		size_t size;
+	};
+	chunk_t *chunks = nullptr;
+	// Bytes used in the first chunk
+	size_t used = 0;
+};
+
+extern "C" {
+#endif
+/// ----------------
+
 // Load a json file with the json5 syntax.
 json_t *json5_loadb(const void *buffer, size_t size, char **error);
 
@@ -136,6 +194,10 @@ json_t *json5_loadb(const void *buffer, size_t size, char **error);
 // indirect UTF-8 filename support and nice error reporting.
 json_t* json_load_file_report(const char *json_fn);
 
+// Same as json_load_file_report(), but for a file that has already been
+// read into [buffer]. [json_fn] is only used for error reporting.
+json_t* json_loadb_report(const void *buffer, size_t size, const char *json_fn);
+
 // log_print for json_dump
 int json_dump_log(const json_t *json, size_t flags);
 
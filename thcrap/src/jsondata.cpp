@@ -8,6 +8,8 @@
   */
 
 #include "thcrap.h"
+#include <unordered_map>
+#include <vector>
 
 /**
   * This module provides a simple container for other modules to store their
@@ -15,12 +17,12 @@
   * resolve, keep, and free their data in most cases, it also provides
   * automatic, transparent and thread-safe repatching.
   *
-  * Instead of simply storing the contents of every file directly as a value
-  * to its file name key, it is wrapped into a JSON array. To repatch a file,
-  * jsondata_mod_repatch() then simply inserts the new version to the front
-  * of the array. Because jsondata_get() always accesses the first element of
-  * this array, it therefore always returns a constant reference to the most
-  * current version of a file in memory.
+  * Every file is represented by an entry that holds a pointer to the most
+  * current version of its contents. Since the contents of a file version
+  * are never modified after they have been published, jsondata_get() can
+  * simply return that pointer without taking any lock. To repatch a file,
+  * jsondata_mod_repatch() resolves the new version in full, and then
+  * atomically swaps it into the entry.
   *
   * This is very important, given that passing constant memory addresses to
   * strings back to the game is one of the main uses of custom JSON data in
@@ -32,9 +34,36 @@
   * memory until jsondata_mod_exit() is called. I see no straightforward way
   * to safely clean up unused references, short of the heap inspection methods
   * used by garbage collectors.
+  *
+  * Files are only resolved on the first jsondata_get() call for them, since
+  * many of the registered ones are never used in a given session. With
+  * "jsondata_warmup" in the run configuration, a background thread resolves
+  * the rest once the game's window shows up.
+  *
+  * The file name → entry index, on the other hand, is only ever used for the
+  * duration of a jsondata_get() call. It is therefore copied on every
+  * addition of a new file, and old copies are freed as soon as a writer
+  * observes that no reader is inside jsondata_get().
   */
 
-json_t *jsondata = NULL;
+struct jsondata_entry_t {
+	// Most current version, read without locking
+	json_t *volatile current;
+	// All versions ever added, newest first
+	json_t *versions;
+	// Set once the file has been resolved for the first time
+	volatile bool resolved;
+	// Serializes resolving this file
+	SRWLOCK resolve_lock;
+};
+
+typedef std::unordered_map<std::string, jsondata_entry_t *> jsondata_index_t;
+
+static jsondata_index_t *volatile jsondata_index = nullptr;
+static std::vector<jsondata_index_t *> jsondata_index_retired;
+static volatile LONG jsondata_readers = 0;
+// Serializes writers, readers never take it.
+static SRWLOCK jsondata_srwlock = { SRWLOCK_INIT };
 
 template<typename T>
 T jsondata_game_func(const char *fn, T (*func)(const char *fn))
@@ -45,18 +74,81 @@ T jsondata_game_func(const char *fn, T (*func)(const char *fn))
 	return ret;
 }
 
+// Frees retired index snapshots if no reader can still be using them.
+// Must be called with [jsondata_srwlock] held.
+static void jsondata_index_reclaim(void)
+{
+	if(jsondata_index_retired.empty()) {
+		return;
+	}
+	if(InterlockedCompareExchange(&jsondata_readers, 0, 0) != 0) {
+		return;
+	}
+	for(auto *index : jsondata_index_retired) {
+		delete index;
+	}
+	jsondata_index_retired.clear();
+}
+
+// Returns the entry for [fn], creating and publishing a new index snapshot
+// if necessary. Must be called with [jsondata_srwlock] held.
+static jsondata_entry_t* jsondata_entry_get_create(const char *fn)
+{
+	jsondata_index_t *index = jsondata_index;
+	if(index) {
+		auto it = index->find(fn);
+		if(it != index->end()) {
+			return it->second;
+		}
+	}
+	auto *entry = new jsondata_entry_t{ nullptr, json_array(), false, SRWLOCK_INIT };
+	auto *index_new = index ? new jsondata_index_t(*index) : new jsondata_index_t;
+	index_new->emplace(fn, entry);
+	InterlockedExchangePointer((PVOID *)&jsondata_index, index_new);
+	if(index) {
+		jsondata_index_retired.push_back(index);
+	}
+	return entry;
+}
+
+// Resolves [fn] and publishes it as the newest version of [entry].
+// Must be called with [entry->resolve_lock] held.
+static void jsondata_entry_resolve(const char *fn, jsondata_entry_t *entry)
+{
+	// Resolve outside of the lock, this can take a while.
+	json_t *data = stack_json_resolve(fn, NULL);
+
+	AcquireSRWLockExclusive(&jsondata_srwlock);
+	if(data) {
+		json_array_insert(entry->versions, 0, data);
+		InterlockedExchangePointer((PVOID *)&entry->current, data);
+	}
+	ReleaseSRWLockExclusive(&jsondata_srwlock);
+	entry->resolved = true;
+
+	json_decref(data);
+}
+
+// Resolves [entry] if this is the first access to it.
+static void jsondata_entry_require(const char *fn, jsondata_entry_t *entry)
+{
+	if(entry->resolved) {
+		return;
+	}
+	AcquireSRWLockExclusive(&entry->resolve_lock);
+	if(!entry->resolved) {
+		jsondata_entry_resolve(fn, entry);
+	}
+	ReleaseSRWLockExclusive(&entry->resolve_lock);
+}
+
 int jsondata_add(const char *fn)
 {
-	json_t *data_array = NULL;
-	json_t *data = NULL;
-	// Since the order of the *_mod_init functions is undefined, [jsondata]
-	// needs to be created here - otherwise we'll miss some data!
-	if(!jsondata) {
-		jsondata = json_object();
-	}
-	data_array = json_object_get_create(jsondata, fn, JSON_ARRAY);
-	data = stack_json_resolve(fn, NULL);
-	return json_array_insert_new(data_array, 0, data);
+	AcquireSRWLockExclusive(&jsondata_srwlock);
+	jsondata_entry_get_create(fn);
+	jsondata_index_reclaim();
+	ReleaseSRWLockExclusive(&jsondata_srwlock);
+	return 0;
 }
 
 int jsondata_game_add(const char *fn)
@@ -66,26 +158,148 @@ int jsondata_game_add(const char *fn)
 
 json_t* jsondata_get(const char *fn)
 {
-	return json_array_get(json_object_get(jsondata, fn), 0);
+	jsondata_entry_t *entry = nullptr;
+	if(!fn) {
+		return NULL;
+	}
+	InterlockedIncrement(&jsondata_readers);
+	const jsondata_index_t *index = jsondata_index;
+	if(index) {
+		auto it = index->find(fn);
+		if(it != index->end()) {
+			entry = it->second;
+		}
+	}
+	InterlockedDecrement(&jsondata_readers);
+	if(!entry) {
+		return NULL;
+	}
+	// Entries themselves live until jsondata_mod_exit().
+	jsondata_entry_require(fn, entry);
+	return entry->current;
 }
 
 json_t* jsondata_game_get(const char *fn)
 {
-	return jsondata_game_func(fn, jsondata_get);
+	// Called from breakpoints, so don't allocate the file name.
+	return jsondata_get(fn_for_game_tls(fn));
 }
 
 void jsondata_mod_repatch(const json_t *files_changed)
 {
-	const char *key;
-	json_t *val;
-	json_object_foreach(jsondata, key, val) {
-		if(json_object_get(files_changed, key)) {
-			jsondata_add(key);
+	std::vector<std::pair<std::string, jsondata_entry_t *>> changed;
+
+	AcquireSRWLockShared(&jsondata_srwlock);
+	if(const jsondata_index_t *index = jsondata_index) {
+		for(const auto& it : *index) {
+			if(json_object_get(files_changed, it.first.c_str())) {
+				changed.emplace_back(it.first, it.second);
+			}
 		}
 	}
+	ReleaseSRWLockShared(&jsondata_srwlock);
+
+	// Files that haven't been accessed yet will pick up the new version
+	// once they are.
+	for(const auto& [fn, entry] : changed) {
+		AcquireSRWLockExclusive(&entry->resolve_lock);
+		if(entry->resolved) {
+			jsondata_entry_resolve(fn.c_str(), entry);
+		}
+		ReleaseSRWLockExclusive(&entry->resolve_lock);
+	}
+}
+
+/// Warm-up
+/// -------
+static HANDLE jsondata_warmup_thread = nullptr;
+static HANDLE jsondata_warmup_quit = nullptr;
+
+// How often the warm-up thread checks for the game window.
+#define JSONDATA_WARMUP_POLL_INTERVAL 100
+
+static BOOL CALLBACK jsondata_window_find(HWND hWnd, LPARAM lParam)
+{
+	DWORD pid = 0;
+	GetWindowThreadProcessId(hWnd, &pid);
+	if(pid == GetCurrentProcessId() && IsWindowVisible(hWnd)) {
+		*(bool *)lParam = true;
+		return FALSE;
+	}
+	return TRUE;
 }
 
+static DWORD WINAPI jsondata_warmup_proc(void *)
+{
+	// Resolving is best left until the game has done its own startup work.
+	bool window_found = false;
+	while(!window_found) {
+		if(WaitForSingleObject(jsondata_warmup_quit, JSONDATA_WARMUP_POLL_INTERVAL) != WAIT_TIMEOUT) {
+			return 0;
+		}
+		EnumWindows(jsondata_window_find, (LPARAM)&window_found);
+	}
+
+	std::vector<std::pair<std::string, jsondata_entry_t *>> pending;
+	AcquireSRWLockShared(&jsondata_srwlock);
+	if(const jsondata_index_t *index = jsondata_index) {
+		for(const auto& it : *index) {
+			if(!it.second->resolved) {
+				pending.emplace_back(it.first, it.second);
+			}
+		}
+	}
+	ReleaseSRWLockShared(&jsondata_srwlock);
+
+	for(const auto& [fn, entry] : pending) {
+		if(WaitForSingleObject(jsondata_warmup_quit, 0) != WAIT_TIMEOUT) {
+			break;
+		}
+		jsondata_entry_require(fn.c_str(), entry);
+	}
+	return 0;
+}
+
+void jsondata_mod_post_init(void)
+{
+	if(!json_is_true(json_object_get(runconfig_json_get(), "jsondata_warmup"))) {
+		return;
+	}
+	jsondata_warmup_quit = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	jsondata_warmup_thread = CreateThread(nullptr, 0, jsondata_warmup_proc, nullptr, 0, nullptr);
+	if(jsondata_warmup_thread) {
+		SetThreadPriority(jsondata_warmup_thread, THREAD_PRIORITY_BELOW_NORMAL);
+	}
+}
+/// -------
+
 void jsondata_mod_exit(void)
 {
-	jsondata = json_decref_safe(jsondata);
+	if(jsondata_warmup_thread) {
+		SetEvent(jsondata_warmup_quit);
+		WaitForSingleObject(jsondata_warmup_thread, INFINITE);
+		CloseHandle(jsondata_warmup_thread);
+		jsondata_warmup_thread = nullptr;
+	}
+	if(jsondata_warmup_quit) {
+		CloseHandle(jsondata_warmup_quit);
+		jsondata_warmup_quit = nullptr;
+	}
+
+	AcquireSRWLockExclusive(&jsondata_srwlock);
+	auto *index = (jsondata_index_t *)InterlockedExchangePointer(
+		(PVOID *)&jsondata_index, nullptr
+	);
+	if(index) {
+		for(auto& it : *index) {
+			json_decref(it.second->versions);
+			delete it.second;
+		}
+		jsondata_index_retired.push_back(index);
+	}
+	for(auto *retired : jsondata_index_retired) {
+		delete retired;
+	}
+	jsondata_index_retired.clear();
+	ReleaseSRWLockExclusive(&jsondata_srwlock);
 }
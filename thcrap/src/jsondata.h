@@ -9,12 +9,17 @@
 
 #pragma once
 
+// Registers [fn]. The file is only resolved on its first jsondata_get().
 int jsondata_add(const char *fn);
 int jsondata_game_add(const char *fn);
 
-// Returns a borrowed reference to the JSON data for [fn].
+// Returns a borrowed reference to the JSON data for [fn]. The first call for
+// a file resolves it, all later ones are wait-free. Safe to call from any
+// thread while other threads repatch. The returned version stays valid
+// until jsondata_mod_exit(), even after it has been replaced by a newer one.
 json_t* jsondata_get(const char *fn);
 json_t* jsondata_game_get(const char *fn);
 
+void jsondata_mod_post_init(void);
 void jsondata_mod_repatch(const json_t *files_changed);
 void jsondata_mod_exit(void);
@@ -96,15 +96,293 @@ void log_rotate(void)
 	/* vs*n*printf is not available in msvcrt.dll. Doesn't matter anyway. */ \
 	vsprintf(str##_full, str, va);
 
-void log_print(const char *str)
+/// Ring buffer
+/// -----------
+/**
+  * Logging threads only copy their message into a fixed-size ring of slots,
+  * which is drained into the console and the log file by a dedicated writer
+  * thread. Slots are reserved with a single compare-and-swap on the write
+  * position, so that a message spanning multiple slots stays contiguous,
+  * and committed by setting their sequence number, as in Dmitry Vyukov's
+  * bounded MPMC queue:
+  *
+  * • A slot is free for position [p] if its sequence number is [p].
+  * • Once written, its sequence number becomes [p + 1].
+  * • After draining, it becomes [p + LOG_RING_SLOTS], i.e. free for the same
+  *   slot on the next lap.
+  *
+  * Messages too large for the ring, and everything outside of the writer
+  * thread's lifetime, are written synchronously instead.
+  */
+#define LOG_RING_SLOTS 2048
+#define LOG_RING_MASK (LOG_RING_SLOTS - 1)
+#define LOG_RING_MAX_SLOTS_PER_MESSAGE 64
+// Milliseconds between two drains if nobody wakes up the writer earlier.
+#define LOG_RING_INTERVAL 20
+// Maximum milliseconds that log_flush() waits for the writer thread or for
+// messages that are still being written.
+#define LOG_FLUSH_TIMEOUT 50
+
+struct log_slot_t {
+	volatile LONG seq;
+	uint16_t len;
+	char data[128 - sizeof(LONG) - sizeof(uint16_t)];
+};
+
+static log_slot_t log_ring[LOG_RING_SLOTS];
+static volatile LONG log_ring_write = 0;
+static volatile LONG log_ring_read = 0;
+static bool log_ring_active = false;
+static volatile bool log_ring_shutdown = false;
+static HANDLE log_ring_thread = NULL;
+static HANDLE log_ring_event = NULL;
+// Held by whoever is draining the ring or writing synchronously.
+static CRITICAL_SECTION log_drain_cs;
+static bool log_drain_cs_initialized = false;
+
+static char log_batch[64 * 1024];
+static size_t log_batch_len = 0;
+
+// Writes directly to the console and log file. Requires [log_drain_cs].
+static void log_write(const char *str, size_t n)
 {
 	if(console_open) {
-		fprintf(stdout, "%s", str);
+		fwrite(str, n, 1, stdout);
+	}
+	if(log_file) {
+		fwrite(str, n, 1, log_file);
+	}
+}
+
+static void log_batch_flush(void)
+{
+	if(log_batch_len) {
+		log_write(log_batch, log_batch_len);
+		log_batch_len = 0;
+	}
+}
+
+// Moves all committed messages into the outputs. If [timeout] is nonzero,
+// this waits for up to that many milliseconds for messages that have been
+// reserved but not yet committed. Requires [log_drain_cs].
+static void log_ring_drain(DWORD timeout)
+{
+	DWORD start = GetTickCount();
+	LONG read = log_ring_read;
+	while(1) {
+		log_slot_t &slot = log_ring[read & LOG_RING_MASK];
+		if(slot.seq != read + 1) {
+			if(
+				timeout && (read - log_ring_write) < 0
+				&& (GetTickCount() - start) < timeout
+			) {
+				SwitchToThread();
+				continue;
+			}
+			break;
+		}
+		if(log_batch_len + slot.len > sizeof(log_batch)) {
+			log_batch_flush();
+		}
+		memcpy(log_batch + log_batch_len, slot.data, slot.len);
+		log_batch_len += slot.len;
+		InterlockedExchange(&slot.seq, read + LOG_RING_SLOTS);
+		read++;
+		log_ring_read = read;
+	}
+	log_batch_flush();
+	if(log_file) {
+		fflush(log_file);
+	}
+}
+
+static DWORD WINAPI log_ring_writer(void*)
+{
+	while(!log_ring_shutdown) {
+		WaitForSingleObject(log_ring_event, LOG_RING_INTERVAL);
+		EnterCriticalSection(&log_drain_cs);
+		log_ring_drain(0);
+		LeaveCriticalSection(&log_drain_cs);
+	}
+	return 0;
+}
+
+// Returns false if the message has to be written synchronously.
+static bool log_ring_push(const char *str, size_t n)
+{
+	const size_t payload = sizeof(log_ring[0].data);
+	LONG count = (LONG)MAX((n + payload - 1) / payload, 1);
+	if(!log_ring_active || count > LOG_RING_MAX_SLOTS_PER_MESSAGE) {
+		return false;
 	}
+	LONG pos;
+	while(1) {
+		pos = log_ring_write;
+		LONG last = pos + count - 1;
+		LONG seq = log_ring[last & LOG_RING_MASK].seq;
+		if(seq == last) {
+			if(InterlockedCompareExchange(&log_ring_write, pos + count, pos) == pos) {
+				break;
+			}
+		} else if((seq - last) < 0) {
+			// Full. Hurry up the writer.
+			SetEvent(log_ring_event);
+			SwitchToThread();
+		}
+	}
+	for(LONG i = 0; i < count; i++) {
+		log_slot_t &slot = log_ring[(pos + i) & LOG_RING_MASK];
+		size_t len = MIN(n, payload);
+		memcpy(slot.data, str, len);
+		slot.len = (uint16_t)len;
+		str += len;
+		n -= len;
+		InterlockedExchange(&slot.seq, pos + i + 1);
+	}
+	if((pos + count - log_ring_read) > LOG_RING_SLOTS / 2) {
+		SetEvent(log_ring_event);
+	}
+	return true;
+}
+
+static void log_ring_init(void)
+{
+	for(LONG i = 0; i < LOG_RING_SLOTS; i++) {
+		log_ring[i].seq = i;
+	}
+	log_ring_write = 0;
+	log_ring_read = 0;
+	log_ring_shutdown = false;
+	log_ring_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	log_ring_thread = CreateThread(NULL, 0, log_ring_writer, NULL, 0, NULL);
+	log_ring_active = log_ring_thread != NULL;
+}
+
+static void log_ring_exit(void)
+{
+	if(log_ring_thread) {
+		log_ring_shutdown = true;
+		SetEvent(log_ring_event);
+		// The thread might have already been terminated if we are called
+		// from DllMain() during process shutdown.
+		WaitForSingleObject(log_ring_thread, LOG_FLUSH_TIMEOUT * 2);
+		CloseHandle(log_ring_thread);
+		log_ring_thread = NULL;
+	}
+	log_flush();
+	log_ring_active = false;
+	if(log_ring_event) {
+		CloseHandle(log_ring_event);
+		log_ring_event = NULL;
+	}
+}
+
+void log_flush(void)
+{
+	if(!log_drain_cs_initialized) {
+		return;
+	}
+	// If some other thread died while holding the lock, we
+	// still want to get the log out.
+	DWORD start = GetTickCount();
+	BOOL locked;
+	while(
+		!(locked = TryEnterCriticalSection(&log_drain_cs))
+		&& (GetTickCount() - start) < LOG_FLUSH_TIMEOUT
+	) {
+		Sleep(1);
+	}
+	log_ring_drain(LOG_FLUSH_TIMEOUT);
+	if(locked) {
+		LeaveCriticalSection(&log_drain_cs);
+	}
+}
+/// -----------
+
+static void log_output(const char *str, size_t n)
+{
+	if(!console_open && !log_file) {
+		return;
+	}
+	if(log_ring_push(str, n)) {
+		return;
+	}
+	if(!log_drain_cs_initialized) {
+		log_write(str, n);
+		return;
+	}
+	// Keep the order with everything that's still in the ring.
+	EnterCriticalSection(&log_drain_cs);
+	log_ring_drain(0);
+	log_write(str, n);
 	if(log_file) {
-		fprintf(log_file, "%s", str);
 		fflush(log_file);
 	}
+	LeaveCriticalSection(&log_drain_cs);
+}
+
+/// Per-thread capturing
+/// --------------------
+struct log_capture_tls_t {
+	std::string *buf;
+};
+THREAD_LOCAL(log_capture_tls_t, log_capture_tls, nullptr, nullptr);
+// Number of threads currently capturing, so that everybody else doesn't
+// even have to look at the TLS slot.
+static volatile LONG log_capturing = 0;
+
+void log_capture_begin(void)
+{
+	log_capture_tls_t *tls = log_capture_tls_get();
+	if(tls && !tls->buf) {
+		tls->buf = new std::string;
+		InterlockedIncrement(&log_capturing);
+	}
+}
+
+char* log_capture_end(size_t *len)
+{
+	log_capture_tls_t *tls = log_capture_tls_get();
+	if(!tls || !tls->buf) {
+		return nullptr;
+	}
+	std::string *buf = tls->buf;
+	tls->buf = nullptr;
+	InterlockedDecrement(&log_capturing);
+
+	char *ret = (char *)malloc(buf->size() + 1);
+	if(ret) {
+		memcpy(ret, buf->c_str(), buf->size() + 1);
+		if(len) {
+			*len = buf->size();
+		}
+	}
+	delete buf;
+	return ret;
+}
+
+// Returns true if [str] was captured.
+static bool log_capture(const char *str, size_t n)
+{
+	if(!log_capturing) {
+		return false;
+	}
+	log_capture_tls_t *tls = log_capture_tls_get();
+	if(!tls || !tls->buf) {
+		return false;
+	}
+	tls->buf->append(str, n);
+	return true;
+}
+/// --------------------
+
+void log_print(const char *str)
+{
+	const size_t n = strlen(str);
+	if(log_capture(str, n)) {
+		return;
+	}
+	log_output(str, n);
 	if(log_print_hook) {
 		log_print_hook(str);
 	}
@@ -112,12 +390,10 @@ void log_print(const char *str)
 
 void log_nprint(const char *str, size_t n)
 {
-	if(console_open) {
-		fwrite(str, n, 1, stdout);
-	}
-	if(log_file) {
-		fwrite(str, n, 1, log_file);
+	if(log_capture(str, n)) {
+		return;
 	}
+	log_output(str, n);
 	if (log_nprint_hook) {
 		log_nprint_hook(str, n);
 	}
@@ -142,6 +418,38 @@ void log_printf(const char *str, ...)
 	}
 }
 
+/**
+  * Log levels.
+  */
+
+log_level_t log_level = LOG_LEVEL_DEBUG;
+
+static const char *const LOG_LEVEL_NAMES[] = {
+	"trace", "debug", "info", "warn"
+};
+
+int log_level_set(const char *name)
+{
+	if(!name) {
+		return -1;
+	}
+	for(size_t i = 0; i < elementsof(LOG_LEVEL_NAMES); i++) {
+		if(!stricmp(name, LOG_LEVEL_NAMES[i])) {
+			log_level = (log_level_t)i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char* log_level_name(log_level_t level)
+{
+	if((size_t)level < elementsof(LOG_LEVEL_NAMES)) {
+		return LOG_LEVEL_NAMES[level];
+	}
+	return "unknown";
+}
+
 /**
   * Message box functions.
   */
@@ -244,6 +552,50 @@ void log_mbox_set_owner(HWND hwnd)
 	mbox_owner_hwnd = hwnd;
 }
 
+// How long a notification waits for log_mbox_set_owner() before it is shown
+// anyway.
+#define LOG_NOTIFY_OWNER_WAIT 15000
+
+struct log_notify_t {
+	std::string caption;
+	std::string text;
+	UINT type;
+};
+
+static DWORD WINAPI log_notify_proc(void *param)
+{
+	auto *notify = (log_notify_t *)param;
+	// Wait for the game window, so that the box doesn't get lost behind the
+	// loading screen.
+	for(DWORD waited = 0; !mbox_owner_hwnd && waited < LOG_NOTIFY_OWNER_WAIT; waited += 100) {
+		Sleep(100);
+	}
+	// Not owned by the game window, since a message box disables its owner.
+	MessageBox(nullptr, notify->text.c_str(), notify->caption.c_str(), notify->type);
+	delete notify;
+	return 0;
+}
+
+void log_mbox_notify(const char *caption, const UINT type, const char *text)
+{
+	if(!text) {
+		return;
+	}
+	if(!caption) {
+		caption = PROJECT_NAME();
+	}
+	log_print("---------------------------\n");
+	log_printf("%s\n", text);
+	log_print("---------------------------\n");
+	auto *notify = new log_notify_t{ caption, text, type };
+	HANDLE thread = CreateThread(nullptr, 0, log_notify_proc, notify, 0, nullptr);
+	if(thread) {
+		CloseHandle(thread);
+	} else {
+		delete notify;
+	}
+}
+
 static void OpenConsole(void)
 {
 	if(console_open) {
@@ -291,6 +643,10 @@ std::nullptr_t logger_t::errorf(const char *text, ...) const
 
 void log_init(int console)
 {
+	if(!log_drain_cs_initialized) {
+		InitializeCriticalSection(&log_drain_cs);
+		log_drain_cs_initialized = true;
+	}
 	CreateDirectoryU("logs", NULL);
 	log_rotate();
 
@@ -372,10 +728,12 @@ void log_init(int console)
 			pExitProcess(-1);
 		}
 	}
+	log_ring_init();
 }
 
 void log_exit(void)
 {
+	log_ring_exit();
 	if(console_open) {
 		FreeConsole();
 	}
@@ -30,11 +30,21 @@ void log_nprint(const char *text, size_t n);
 // Formatted
 void log_vprintf(const char *text, va_list va);
 void log_printf(const char *text, ...);
-#ifdef _DEBUG
-# define log_debugf log_printf
-#else
-# define log_debugf(text, ...)
-#endif
+
+// Writes out everything that is still waiting in the log buffer, waiting at
+// most a few milliseconds for other threads. Safe to call from an exception
+// handler.
+void log_flush(void);
+
+// Diverts all log output of the calling thread into a buffer, until
+// log_capture_end() is called. Used by worker threads whose output should
+// show up in a deterministic order, rather than interleaved.
+void log_capture_begin(void);
+
+// Stops capturing, and returns everything that was logged in the meantime
+// as a malloc()'d, null-terminated string. If given, [len] receives its
+// length. Pass the result to log_nprint() to actually log it.
+char* log_capture_end(size_t *len);
 
 #ifdef _MSC_VER
 # define log_func_printf(text, ...) \
@@ -45,6 +55,53 @@ void log_printf(const char *text, ...);
 #endif
 /// ---------------
 
+/// ----------
+/// Log levels
+/// ----------
+typedef enum {
+	// Per-call noise that is only useful while working on the code itself.
+	LOG_LEVEL_TRACE,
+	// File resolution and similar per-file diagnostics.
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_WARN,
+} log_level_t;
+
+// Messages below this level are not compiled in at all.
+#ifndef LOG_LEVEL_MIN
+# ifdef _DEBUG
+#  define LOG_LEVEL_MIN LOG_LEVEL_TRACE
+# else
+#  define LOG_LEVEL_MIN LOG_LEVEL_DEBUG
+# endif
+#endif
+
+// Messages below this level are dropped at runtime. Set from the
+// "log_level" value of the run configuration.
+THCRAP_API extern log_level_t log_level;
+
+// Sets [log_level] from one of "trace", "debug", "info" or "warn".
+// Returns 0 on success, or -1 if the name is unknown.
+int log_level_set(const char *name);
+const char* log_level_name(log_level_t level);
+
+#define log_level_enabled(level) \
+	((level) >= LOG_LEVEL_MIN && (level) >= log_level)
+
+// Only evaluates the arguments if [level] is enabled.
+#define log_levelf(level, ...) \
+	do { \
+		if(log_level_enabled(level)) { \
+			log_printf(__VA_ARGS__); \
+		} \
+	} while(0)
+
+#define log_tracef(...) log_levelf(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define log_debugf(...) log_levelf(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_infof(...) log_levelf(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warnf(...) log_levelf(LOG_LEVEL_WARN, __VA_ARGS__)
+/// ----------
+
 /// -------------
 /// Message boxes
 // Technically not a "logging function", but hey, it has variable arguments.
@@ -56,6 +113,9 @@ int log_vmboxf(const char *caption, const UINT type, const char *text, va_list v
 int log_mboxf(const char *caption, const UINT type, const char *text, ...);
 // Set the owner hwnd for the log_mbox* functions
 void log_mbox_set_owner(HWND hwnd);
+// Non-blocking. Logs [text] and shows it in an ownerless message box on a
+// separate thread, once the game has created its window.
+void log_mbox_notify(const char *caption, const UINT type, const char *text);
 /// -------------
 
 /// Per-module loggers
@@ -8,17 +8,119 @@
   */
 
 #include "thcrap.h"
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
-static json_t *detours = NULL;
+/// Region cache
+/// ------------
+/**
+  * Startup checks the same few module sections thousands of times, and
+  * every check used to be a VirtualQuery() syscall. Therefore, accessible
+  * regions of mapped images (the game, its DLLs, and ours) are remembered
+  * after the first query. Image sections only disappear when their module
+  * is unloaded, so the whole cache is flushed whenever the loader reports a
+  * DLL being loaded or unloaded. Any other memory, which the game is free to
+  * allocate and release at any time, is still queried every time.
+  */
+struct region_cached_t {
+	size_t start;
+	size_t end;
+};
+
+// Sorted by [start], never overlapping.
+static std::vector<region_cached_t> region_cache;
+static SRWLOCK region_cache_srwlock = { SRWLOCK_INIT };
+static volatile LONG region_cache_state = 0; // 0 = not set up, 1 = enabled, -1 = unavailable
+
+typedef VOID (CALLBACK *LDR_DLL_NOTIFICATION_FUNCTION)(
+	ULONG NotificationReason, const void *NotificationData, PVOID Context
+);
+typedef LONG (NTAPI *LdrRegisterDllNotification_type)(
+	ULONG Flags, LDR_DLL_NOTIFICATION_FUNCTION NotificationFunction,
+	PVOID Context, PVOID *Cookie
+);
+
+static VOID CALLBACK region_cache_dll_notification(ULONG, const void*, PVOID)
+{
+	mempatch_region_cache_flush();
+}
+
+static bool region_cache_enabled(void)
+{
+	if(region_cache_state == 0) {
+		// Only available on Vista and later. Without it, we'd never know
+		// when to flush, so don't cache anything.
+		auto LdrRegisterDllNotification = (LdrRegisterDllNotification_type)GetProcAddress(
+			GetModuleHandleA("ntdll.dll"), "LdrRegisterDllNotification"
+		);
+		// If two threads race here, both register a callback, and the
+		// cache just gets flushed twice.
+		PVOID cookie;
+		LONG state = (
+			LdrRegisterDllNotification
+			&& LdrRegisterDllNotification(0, region_cache_dll_notification, nullptr, &cookie) >= 0
+		) ? 1 : -1;
+		InterlockedCompareExchange(&region_cache_state, state, 0);
+	}
+	return region_cache_state == 1;
+}
+
+void mempatch_region_cache_flush(void)
+{
+	AcquireSRWLockExclusive(&region_cache_srwlock);
+	region_cache.clear();
+	ReleaseSRWLockExclusive(&region_cache_srwlock);
+}
+
+static bool region_cache_lookup(size_t start, size_t end)
+{
+	bool ret = false;
+	AcquireSRWLockShared(&region_cache_srwlock);
+	auto it = std::upper_bound(region_cache.begin(), region_cache.end(), start, [](size_t addr, const region_cached_t &region) {
+		return addr < region.start;
+	});
+	if(it != region_cache.begin()) {
+		--it;
+		ret = start >= it->start && end <= it->end;
+	}
+	ReleaseSRWLockShared(&region_cache_srwlock);
+	return ret;
+}
+
+static void region_cache_add(size_t start, size_t end)
+{
+	AcquireSRWLockExclusive(&region_cache_srwlock);
+	auto it = std::lower_bound(region_cache.begin(), region_cache.end(), start, [](const region_cached_t &region, size_t addr) {
+		return region.start < addr;
+	});
+	// Regions returned by VirtualQuery() never overlap, but a region might
+	// have been split by a VirtualProtect() call since we cached it.
+	while(it != region_cache.end() && it->start < end) {
+		it = region_cache.erase(it);
+	}
+	if(it != region_cache.begin() && (it - 1)->end > start) {
+		(it - 1)->end = start;
+	}
+	region_cache.insert(it, { start, end });
+	ReleaseSRWLockExclusive(&region_cache_srwlock);
+}
+/// ------------
 
 BOOL VirtualCheckRegion(const void *ptr, const size_t len)
 {
+	auto ptr_end = (size_t)ptr + len;
+	const bool cache = region_cache_enabled();
+	if (cache && region_cache_lookup((size_t)ptr, ptr_end)) {
+		return TRUE;
+	}
+
 	MEMORY_BASIC_INFORMATION mbi;
 	if (VirtualQuery(ptr, &mbi, sizeof(MEMORY_BASIC_INFORMATION)) == 0) {
 		return FALSE;
 	}
 
-	auto ptr_end = (size_t)ptr + len;
 	auto page_end = (size_t)mbi.BaseAddress + mbi.RegionSize;
 	if (page_end < (ptr_end)) {
 		return FALSE;
@@ -28,6 +130,9 @@ BOOL VirtualCheckRegion(const void *ptr, const size_t len)
 		return FALSE;
 	}
 
+	if (cache && mbi.Type == MEM_IMAGE) {
+		region_cache_add((size_t)mbi.BaseAddress, page_end);
+	}
 	return TRUE;
 }
 
@@ -71,6 +176,91 @@ int PatchRegionEx(HANDLE hProcess, void *ptr, const void *Prev, const void *New,
 	return byte_ret != len;
 }
 
+size_t PatchRegions(patch_region_t *regions, size_t count)
+{
+	struct page_range_t {
+		size_t start;
+		size_t end;
+		DWORD oldProt;
+	};
+
+	if(!count) {
+		return 0;
+	}
+
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	const size_t page_mask = si.dwPageSize - 1;
+
+	// VirtualProtect() is infamously slow, so group everything by page
+	// first. Ranges never grow past the end of the memory region they
+	// started in, since pages in there all share the same protection.
+	std::vector<size_t> order;
+	order.reserve(count);
+	for(size_t i = 0; i < count; i++) {
+		regions[i].applied = 0;
+		if(regions[i].len && VirtualCheckRegion(regions[i].ptr, regions[i].len)) {
+			order.push_back(i);
+		}
+	}
+	std::stable_sort(order.begin(), order.end(), [regions](size_t a, size_t b) {
+		return (size_t)regions[a].ptr < (size_t)regions[b].ptr;
+	});
+
+	std::vector<page_range_t> ranges;
+	size_t region_end = 0;
+	for(size_t i : order) {
+		size_t start = (size_t)regions[i].ptr & ~page_mask;
+		const size_t end = ((size_t)regions[i].ptr + regions[i].len + page_mask) & ~page_mask;
+		if(!ranges.empty() && start <= ranges.back().end) {
+			if(end <= ranges.back().end) {
+				continue;
+			}
+			if(end <= region_end) {
+				ranges.back().end = end;
+				continue;
+			}
+			// Never protect a page twice, or we'd lose its original
+			// protection.
+			start = ranges.back().end;
+		}
+		MEMORY_BASIC_INFORMATION mbi;
+		VirtualQuery((void*)start, &mbi, sizeof(mbi));
+		region_end = (size_t)mbi.BaseAddress + mbi.RegionSize;
+		ranges.push_back({ start, end, 0 });
+	}
+
+	for(auto& range : ranges) {
+		VirtualProtect((void*)range.start, range.end - range.start, PAGE_READWRITE, &range.oldProt);
+	}
+
+	size_t ret = 0;
+	size_t lowest = (size_t)-1;
+	size_t highest = 0;
+	for(size_t i = 0; i < count; i++) {
+		auto& cur = regions[i];
+		if(!cur.len || !VirtualCheckRegion(cur.ptr, cur.len)) {
+			continue;
+		}
+		if(cur.Prev ? !memcmp(cur.ptr, cur.Prev, cur.len) : 1) {
+			memcpy(cur.ptr, cur.New, cur.len);
+			cur.applied = 1;
+			lowest = MIN(lowest, (size_t)cur.ptr);
+			highest = MAX(highest, (size_t)cur.ptr + cur.len);
+			ret++;
+		}
+	}
+
+	for(auto& range : ranges) {
+		DWORD idgaf;
+		VirtualProtect((void*)range.start, range.end - range.start, range.oldProt, &idgaf);
+	}
+	if(ret) {
+		FlushInstructionCache(GetCurrentProcess(), (void*)lowest, highest - lowest);
+	}
+	return ret;
+}
+
 /// Import Address Table detouring
 /// ==============================
 inline int func_detour(PIMAGE_THUNK_DATA pThunk, const void *new_ptr)
@@ -126,24 +316,80 @@ int iat_detour_func(HMODULE hMod, PIMAGE_IMPORT_DESCRIPTOR pImpDesc, const iat_d
 
 /// Detour chaining
 /// ---------------
-json_t* detour_get_create(const char *dll_name)
-{
-	json_t *ret = NULL;
-	STRLWR_DEC(dll_name);
-	STRLWR_CONV(dll_name);
-	if(!detours) {
-		detours = json_object();
+struct detour_func_t {
+	std::string name;
+	const void *ptr;
+};
+
+struct detour_dll_t {
+	// In registration order, for the log.
+	std::vector<detour_func_t> funcs;
+	std::unordered_map<std::string, size_t> by_name;
+
+	// Lookup tables for iat_detour_apply(), rebuilt whenever a detour is
+	// added or the DLL is loaded at a different address.
+	HMODULE resolved_for = NULL;
+	bool resolved_valid = false;
+	// Lowercased function name -> index into [funcs]
+	std::unordered_map<std::string, size_t> by_name_lower;
+	// Original function pointer -> index into [funcs]
+	std::unordered_map<const void*, size_t> by_ptr;
+
+	void set(const char *func_name, const void *func_ptr) {
+		auto it = by_name.find(func_name);
+		if(it != by_name.end()) {
+			funcs[it->second].ptr = func_ptr;
+		} else {
+			by_name.emplace(func_name, funcs.size());
+			funcs.push_back({ func_name, func_ptr });
+			resolved_valid = false;
+		}
 	}
-	ret = json_object_get_create(detours, dll_name_lower, JSON_OBJECT);
-	STRLWR_FREE(dll_name);
 
+	const void* get(const char *func_name) const {
+		auto it = by_name.find(func_name);
+		return it != by_name.end() ? funcs[it->second].ptr : NULL;
+	}
+
+	void resolve(HMODULE hDll) {
+		if(resolved_valid && resolved_for == hDll) {
+			return;
+		}
+		by_name_lower.clear();
+		by_ptr.clear();
+		for(size_t i = 0; i < funcs.size(); i++) {
+			std::string lower = funcs[i].name;
+			std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+			by_name_lower.emplace(std::move(lower), i);
+			const void *old_ptr = (const void*)GetProcAddress(hDll, funcs[i].name.c_str());
+			if(old_ptr) {
+				by_ptr.emplace(old_ptr, i);
+			}
+		}
+		resolved_for = hDll;
+		resolved_valid = true;
+	}
+};
+
+// Lowercased DLL name -> detours
+static std::unordered_map<std::string, detour_dll_t> detours;
+
+static std::string detour_dll_key(const char *dll_name)
+{
+	std::string ret = dll_name ? dll_name : "";
+	std::transform(ret.begin(), ret.end(), ret.begin(), ::tolower);
 	return ret;
 }
 
+static detour_dll_t& detour_get_create(const char *dll_name)
+{
+	return detours[detour_dll_key(dll_name)];
+}
+
 int detour_chain(const char *dll_name, int return_old_ptrs, ...)
 {
 	int ret = 0;
-	json_t *dll = detour_get_create(dll_name);
+	detour_dll_t& dll = detour_get_create(dll_name);
 	const char *func_name = NULL;
 	va_list va;
 
@@ -155,12 +401,12 @@ int detour_chain(const char *dll_name, int return_old_ptrs, ...)
 		if(
 			return_old_ptrs
 			&& (old_ptr = va_arg(va, FARPROC*))
-			&& (chain_ptr = (FARPROC)json_object_get_hex(dll, func_name))
+			&& (chain_ptr = (FARPROC)dll.get(func_name))
 			&& (chain_ptr != func_ptr)
 		) {
 			*old_ptr = chain_ptr;
 		}
-		json_object_set_new(dll, func_name, json_integer((size_t)func_ptr));
+		dll.set(func_name, func_ptr);
 	}
 	va_end(va);
 	return ret;
@@ -169,17 +415,14 @@ int detour_chain(const char *dll_name, int return_old_ptrs, ...)
 int detour_chain_w32u8(const w32u8_dll_t *dll)
 {
 	const w32u8_pair_t *pair = NULL;
-	json_t *detours_dll = NULL;
 
 	if(!dll || !dll->name || !dll->funcs) {
 		return -1;
 	}
-	detours_dll = detour_get_create(dll->name);
+	detour_dll_t& detours_dll = detour_get_create(dll->name);
 	pair = dll->funcs;
 	while(pair && pair->ansi_name && pair->utf8_ptr) {
-		json_object_set_new(
-			detours_dll, pair->ansi_name, json_integer((size_t)pair->utf8_ptr)
-		);
+		detours_dll.set(pair->ansi_name, pair->utf8_ptr);
 		pair++;
 	}
 	return 0;
@@ -195,52 +438,89 @@ int iat_detour_apply(HMODULE hMod)
 		return ret;
 	}
 
-	while(pImpDesc->Name) {
-		json_t *funcs;
-		size_t func_count;
-		char *dll_name = (char*)((UINT_PTR)hMod + (UINT_PTR)pImpDesc->Name);
-		HMODULE hDll = GetModuleHandleA(dll_name);
-		STRLWR_DEC(dll_name);
-
-		STRLWR_CONV(dll_name);
-		funcs = json_object_get(detours, dll_name_lower);
-		func_count = json_object_size(funcs);
-
-		if(hDll && func_count) {
-			const char *func_name;
-			json_t *ptr;
-			size_t i = 0;
-
-			log_printf("Detouring DLL functions (%s)...\n", dll_name_lower);
+	std::vector<patch_region_t> regions;
+	std::vector<const void*> new_ptrs;
+	// Thunk index per function, or -1 if it isn't imported
+	std::vector<size_t> func_thunks;
 
-			json_object_foreach(funcs, func_name, ptr) {
-				iat_detour_t detour;
-				int local_ret;
-
-				detour.old_func = func_name;
-				detour.old_ptr = (void*)GetProcAddress(hDll, detour.old_func);
-				detour.new_ptr = (void*)json_integer_value(ptr);
-
-				local_ret = iat_detour_func(hMod, pImpDesc, &detour);
-
-				log_printf(
-					"(%2d/%2d) %s... %s\n",
-					i + 1, func_count, detour.old_func,
-					local_ret ? "OK" : "not found"
-				);
-				i++;
+	for(; pImpDesc->Name; pImpDesc++) {
+		const char *dll_name = (char*)((UINT_PTR)hMod + (UINT_PTR)pImpDesc->Name);
+		auto it = detours.find(detour_dll_key(dll_name));
+		if(it == detours.end() || it->second.funcs.empty()) {
+			continue;
+		}
+		HMODULE hDll = GetModuleHandleA(dll_name);
+		if(!hDll) {
+			continue;
+		}
+		detour_dll_t& dll = it->second;
+		dll.resolve(hDll);
+
+		log_printf("Detouring DLL functions (%s)...\n", it->first.c_str());
+
+		// One pass over the thunks, matching each one against the lookup
+		// tables. As in iat_detour_func(), we go by exported name where
+		// possible, and by pointer for ordinal-only imports or if we lack
+		// the OriginalFirstThunk.
+		auto pOT = (PIMAGE_THUNK_DATA)((UINT_PTR)hMod + pImpDesc->OriginalFirstThunk);
+		auto pIT = (PIMAGE_THUNK_DATA)((UINT_PTR)hMod + pImpDesc->FirstThunk);
+		const bool by_name = pImpDesc->OriginalFirstThunk != 0;
+		std::string name_lower;
+
+		regions.clear();
+		new_ptrs.clear();
+		func_thunks.assign(dll.funcs.size(), (size_t)-1);
+		for(; by_name ? pOT->u1.Function : pIT->u1.Function; pOT++, pIT++) {
+			size_t func = (size_t)-1;
+			if(by_name && !(pOT->u1.Ordinal & IMAGE_ORDINAL_FLAG)) {
+				auto pByName = (PIMAGE_IMPORT_BY_NAME)((UINT_PTR)hMod + pOT->u1.AddressOfData);
+				if(pByName->Name[0] == '\0') {
+					break;
+				}
+				name_lower = (char*)pByName->Name;
+				std::transform(name_lower.begin(), name_lower.end(), name_lower.begin(), ::tolower);
+				auto found = dll.by_name_lower.find(name_lower);
+				if(found != dll.by_name_lower.end()) {
+					func = found->second;
+				}
+			} else {
+				auto found = dll.by_ptr.find((const void*)pIT->u1.Function);
+				if(found != dll.by_ptr.end()) {
+					func = found->second;
+				}
+			}
+			if(func == (size_t)-1 || func_thunks[func] != (size_t)-1) {
+				continue;
+			}
+			if(!dll.funcs[func].ptr || !VirtualCheckCode(dll.funcs[func].ptr)) {
+				continue;
 			}
+			func_thunks[func] = regions.size();
+			new_ptrs.push_back(dll.funcs[func].ptr);
+			regions.push_back({ &pIT->u1.Function, NULL, NULL, sizeof(void*), 0 });
+		}
+		// [new_ptrs] is complete now, so its addresses stay valid.
+		for(size_t i = 0; i < regions.size(); i++) {
+			regions[i].New = &new_ptrs[i];
+		}
+		PatchRegions(regions.data(), regions.size());
+
+		for(size_t i = 0; i < dll.funcs.size(); i++) {
+			const size_t thunk = func_thunks[i];
+			log_printf(
+				"(%2d/%2d) %s... %s\n",
+				i + 1, dll.funcs.size(), dll.funcs[i].name.c_str(),
+				(thunk != (size_t)-1 && regions[thunk].applied) ? "OK" : "not found"
+			);
 		}
-		STRLWR_FREE(dll_name);
-		pImpDesc++;
 	}
 	return ret;
 }
 
 FARPROC detour_top(const char *dll_name, const char *func_name, FARPROC fallback)
 {
-	json_t *funcs = json_object_get_create(detours, dll_name, JSON_OBJECT);
-	FARPROC ret = (FARPROC)json_object_get_hex(funcs, func_name);
+	auto it = detours.find(detour_dll_key(dll_name));
+	FARPROC ret = it != detours.end() ? (FARPROC)it->second.get(func_name) : NULL;
 	return ret ? ret : fallback;
 }
 
@@ -291,7 +571,7 @@ int vtable_detour(void **vtable, const vtable_detour_t *det, size_t det_count)
 
 void detour_exit(void)
 {
-	detours = json_decref_safe(detours);
+	detours.clear();
 }
 /// ----------
 
@@ -12,15 +12,37 @@
 // IsBadReadPtr() without the flawed implementation.
 // Returns TRUE if [ptr] points to at least [len] bytes of valid memory in the
 // address space of the current process.
+// Accessible regions of mapped images are cached, and the cache is flushed
+// whenever a DLL is loaded or unloaded.
 BOOL VirtualCheckRegion(const void *ptr, const size_t len);
 BOOL VirtualCheckCode(const void *ptr);
 
+// Makes VirtualCheckRegion() query every region again. Only necessary after
+// changing the protection of image memory to PAGE_NOACCESS.
+void mempatch_region_cache_flush(void);
+
 // Writes [len] bytes from [new] to [ptr] in the address space of the current
 // or another process if the current value in [ptr] equals [prev].
 // Returns TRUE on success, FALSE on failure.
 int PatchRegion(void *ptr, const void *Prev, const void *New, size_t len);
 int PatchRegionEx(HANDLE hProcess, void *ptr, const void *Prev, const void *New, size_t len);
 
+// A single write for PatchRegions().
+typedef struct {
+	void *ptr;
+	const void *Prev; // optional, verified like in PatchRegion()
+	const void *New;
+	size_t len;
+	int applied; // set by PatchRegions()
+} patch_region_t;
+
+// Applies a whole set of region patches in one go. Every affected range of
+// pages is unprotected and reprotected only once, the writes are done in
+// array order, and the instruction cache is flushed once at the end.
+// Sets the [applied] member of every entry and returns the number of
+// entries that were successfully written.
+size_t PatchRegions(patch_region_t *regions, size_t count);
+
 /// Import Address Table patching
 /// =============================
 
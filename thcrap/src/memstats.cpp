@@ -0,0 +1,117 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Memory accounting.
+  */
+
+#include "thcrap.h"
+#include <malloc.h>
+
+struct memstats_counter_t {
+	volatile LONG64 bytes;
+	volatile LONG64 peak;
+	volatile LONG64 allocs;
+};
+
+static memstats_counter_t memstats_counters[MEMSTATS_COUNT];
+
+static const char *const memstats_names[MEMSTATS_COUNT] = {
+	"JSON", "Replacement files", "Images", "Fonts", "Codecaves", "Buffer pool",
+};
+
+void memstats_add(memstats_tag_t tag, size_t size)
+{
+	memstats_counter_t &counter = memstats_counters[tag];
+	const LONG64 bytes = InterlockedExchangeAdd64(&counter.bytes, (LONG64)size) + (LONG64)size;
+	InterlockedIncrement64(&counter.allocs);
+	LONG64 peak_prev = counter.peak;
+	while (bytes > peak_prev) {
+		LONG64 peak_seen = InterlockedCompareExchange64(&counter.peak, bytes, peak_prev);
+		if (peak_seen == peak_prev) {
+			break;
+		}
+		peak_prev = peak_seen;
+	}
+}
+
+void memstats_remove(memstats_tag_t tag, size_t size)
+{
+	memstats_counter_t &counter = memstats_counters[tag];
+	InterlockedExchangeAdd64(&counter.bytes, -(LONG64)size);
+	InterlockedDecrement64(&counter.allocs);
+}
+
+void memstats_heap_add(memstats_tag_t tag, void *ptr)
+{
+	if (ptr) {
+		memstats_add(tag, _msize(ptr));
+	}
+}
+
+void memstats_heap_remove(memstats_tag_t tag, void *ptr)
+{
+	if (ptr) {
+		memstats_remove(tag, _msize(ptr));
+	}
+}
+
+static double memstats_mib(LONG64 bytes)
+{
+	return (double)bytes / (1024.0 * 1024.0);
+}
+
+void memstats_print(void)
+{
+	// Address space, the actual limit of a 32-bit game
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	size_t committed = 0;
+	size_t reserved = 0;
+	size_t free_total = 0;
+	size_t free_largest = 0;
+	MEMORY_BASIC_INFORMATION mbi;
+	for (
+		size_t addr = (size_t)si.lpMinimumApplicationAddress;
+		addr < (size_t)si.lpMaximumApplicationAddress && VirtualQuery((void*)addr, &mbi, sizeof(mbi));
+		addr = (size_t)mbi.BaseAddress + mbi.RegionSize
+	) {
+		switch (mbi.State) {
+		case MEM_COMMIT: committed += mbi.RegionSize; break;
+		case MEM_RESERVE: reserved += mbi.RegionSize; break;
+		case MEM_FREE:
+			free_total += mbi.RegionSize;
+			free_largest = MAX(free_largest, mbi.RegionSize);
+			break;
+		}
+	}
+
+	log_printf(
+		"---------------------------\n"
+		"Memory usage:\n"
+		"---------------------------\n"
+	);
+	LONG64 total = 0;
+	for (size_t i = 0; i < MEMSTATS_COUNT; i++) {
+		const memstats_counter_t &counter = memstats_counters[i];
+		total += counter.bytes;
+		log_printf("%-18s %9.2f MiB in %6lld blocks (peak %9.2f MiB)\n",
+			memstats_names[i],
+			memstats_mib(counter.bytes), counter.allocs, memstats_mib(counter.peak)
+		);
+	}
+	log_printf("%-18s %9.2f MiB\n", "Total", memstats_mib(total));
+	log_printf(
+		"Address space: %.2f MiB committed, %.2f MiB reserved, %.2f MiB free (largest block: %.2f MiB)\n",
+		memstats_mib(committed), memstats_mib(reserved), memstats_mib(free_total), memstats_mib(free_largest)
+	);
+	cache_mgr_print();
+	log_print("---------------------------\n");
+}
+
+void memstats_mod_exit(void)
+{
+	memstats_print();
+}
@@ -0,0 +1,45 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Memory accounting.
+  * Keeps track of how much memory the larger consumers inside thcrap are
+  * holding, to find out where the address space of a 32-bit game went.
+  * Reported in the log after initialization, on crashes and on exit.
+  */
+
+#pragma once
+
+typedef enum {
+	// Every allocation made by jansson, including JSON arenas
+	MEMSTATS_JSON,
+	// Replacement file buffers, both on the heap and mapped
+	MEMSTATS_FILE_REP,
+	// Decoded images kept around for patching
+	MEMSTATS_IMAGE,
+	// Font data handed to GDI, and cached glyphs
+	MEMSTATS_FONT,
+	// Codecave memory
+	MEMSTATS_CAVE,
+	// Free buffers kept by the large buffer pool for reuse
+	MEMSTATS_POOL,
+
+	MEMSTATS_COUNT
+} memstats_tag_t;
+
+// Adds or removes [size] bytes to or from [tag].
+void memstats_add(memstats_tag_t tag, size_t size);
+void memstats_remove(memstats_tag_t tag, size_t size);
+
+// Adds or removes the heap block at [ptr], which must come from malloc() or
+// realloc() in thcrap's C runtime, to or from [tag]. Does nothing for NULL.
+void memstats_heap_add(memstats_tag_t tag, void *ptr);
+void memstats_heap_remove(memstats_tag_t tag, void *ptr);
+
+// Logs the current and peak usage of every tag, together with the state of
+// the process address space.
+void memstats_print(void);
+
+void memstats_mod_exit(void);
@@ -21,13 +21,231 @@
 typedef DIRECT3DCREATE(Direct3DCreate_type);
 /// ------------
 
+/// Direct3D 9Ex upgrade
+/// --------------------
+/**
+  * With "d3d9ex" in the run configuration, Direct3DCreate9() returns an
+  * IDirect3D9Ex object instead, and IDirect3D9::CreateDevice() turns into
+  * IDirect3D9Ex::CreateDeviceEx(). Windowed devices then present using the
+  * flip model, and all devices queue at most one frame ahead. Ex devices
+  * never lose their video memory resources, so lost devices only have to
+  * be reset, not recreated.
+  *
+  * The price is that Ex devices don't support D3DPOOL_MANAGED, so all such
+  * resources are created as lockable D3DPOOL_DEFAULT ones instead.
+  */
+
+static const GUID IID_IDirect3D9Ex       = { 0x02177241, 0x69fc, 0x400c, 0x8f, 0xf1, 0x93, 0xa4, 0x4d, 0xf6, 0x86, 0x1d };
+static const GUID IID_IDirect3DDevice9Ex = { 0xb18b10ce, 0x2649, 0x405a, 0x87, 0x0f, 0x95, 0xf7, 0x77, 0xd4, 0x31, 0x3a };
+
+#define D3DSWAPEFFECT_FLIPEX 5
+#define D3DPRESENTFLAG_LOCKABLE_BACKBUFFER 0x00000001
+#define D3DSCANLINEORDERING_PROGRESSIVE 1
+#define D3DUSAGE_DYNAMIC 0x00000200
+
+// The full Direct3D 9 versions of these, which differ from Direct3D 8.
+typedef struct {
+	UINT BackBufferWidth;
+	UINT BackBufferHeight;
+	D3DFORMAT BackBufferFormat;
+	UINT BackBufferCount;
+	DWORD MultiSampleType;
+	DWORD MultiSampleQuality;
+	DWORD SwapEffect;
+	HWND hDeviceWindow;
+	BOOL Windowed;
+	BOOL EnableAutoDepthStencil;
+	D3DFORMAT AutoDepthStencilFormat;
+	DWORD Flags;
+	UINT FullScreen_RefreshRateInHz;
+	UINT PresentationInterval;
+} d3d9_present_parameters_t;
+
+typedef struct {
+	UINT Size;
+	UINT Width;
+	UINT Height;
+	UINT RefreshRate;
+	D3DFORMAT Format;
+	DWORD ScanLineOrdering;
+} d3d9_display_mode_ex_t;
+
+typedef HRESULT __stdcall Direct3DCreate9Ex_type(UINT SDKVersion, void ****ppD3D);
+typedef HRESULT __stdcall d3d9ex_CreateDeviceEx_type(
+	d3d_CreateDevice_(FULLDEC), d3d9_display_mode_ex_t *pFullscreenDisplayMode
+);
+typedef HRESULT __stdcall d3dd9ex_SetMaximumFrameLatency_type(IDirect3DDevice *that, UINT MaxLatency);
+
+// IDirect3D9Ex::CreateDeviceEx() and IDirect3DDevice9Ex::SetMaximumFrameLatency()
+#define D3D9EX_CREATEDEVICEEX 20
+#define D3DD9EX_SETMAXIMUMFRAMELATENCY 126
+
+static bool d3d9ex_enabled = false;
+
+static bool d3d9ex_is(IUnknown *that, const GUID &iid)
+{
+	IUnknown *ex = nullptr;
+	if(!that || FAILED(that->QueryInterface(iid, (void **)&ex)) || !ex) {
+		return false;
+	}
+	ex->Release();
+	return true;
+}
+
+// Switches windowed swap chains to the flip model, if they allow it.
+static void d3d9ex_present_params_adapt(d3d9_present_parameters_t *pp)
+{
+	if(
+		!pp->Windowed
+		|| pp->MultiSampleType != 0
+		|| (pp->Flags & D3DPRESENTFLAG_LOCKABLE_BACKBUFFER)
+	) {
+		return;
+	}
+	pp->SwapEffect = D3DSWAPEFFECT_FLIPEX;
+	pp->BackBufferCount = MAX(pp->BackBufferCount, 2u);
+}
+
+static void*** d3d9ex_Direct3DCreate9(Direct3DCreate_type *c_orig, UINT SDKVersion)
+{
+	auto *create_ex = (Direct3DCreate9Ex_type *)GetProcAddress(
+		GetModuleHandleA("d3d9.dll"), "Direct3DCreate9Ex"
+	);
+	void ***ret = nullptr;
+	if(create_ex && SUCCEEDED(create_ex(SDKVersion, &ret)) && ret) {
+		log_print("(D3D9Ex) Created an IDirect3D9Ex object\n");
+		return ret;
+	}
+	log_print("(D3D9Ex) Direct3DCreate9Ex() isn't available, staying on Direct3D 9\n");
+	return c_orig(SDKVersion);
+}
+
+static HRESULT d3d9ex_CreateDevice(d3d_CreateDevice_type *c_orig, d3d_CreateDevice_(FULLDEC))
+{
+	if(!pPresentationParameters || !d3d9ex_is(that, IID_IDirect3D9Ex)) {
+		return c_orig(d3d_CreateDevice_(VARNAMES));
+	}
+	auto *pp = (d3d9_present_parameters_t *)pPresentationParameters;
+	const d3d9_present_parameters_t pp_orig = *pp;
+	d3d9ex_present_params_adapt(pp);
+
+	d3d9_display_mode_ex_t mode = {
+		sizeof(mode), pp->BackBufferWidth, pp->BackBufferHeight,
+		pp->FullScreen_RefreshRateInHz, pp->BackBufferFormat,
+		D3DSCANLINEORDERING_PROGRESSIVE
+	};
+	auto *create_ex = (d3d9ex_CreateDeviceEx_type *)(*(FARPROC **)that)[D3D9EX_CREATEDEVICEEX];
+	HRESULT ret = create_ex(d3d_CreateDevice_(VARNAMES), pp->Windowed ? nullptr : &mode);
+	if(FAILED(ret)) {
+		log_printf("(D3D9Ex) CreateDeviceEx() failed (0x%x), falling back on CreateDevice()\n", ret);
+		*pp = pp_orig;
+		return c_orig(d3d_CreateDevice_(VARNAMES));
+	}
+	auto *dev = (IDirect3DDevice *)*ppReturnedDeviceInterface;
+	auto *set_latency = (d3dd9ex_SetMaximumFrameLatency_type *)(*(FARPROC **)dev)[D3DD9EX_SETMAXIMUMFRAMELATENCY];
+	set_latency(dev, 1);
+	log_printf(
+		"(D3D9Ex) Created an IDirect3DDevice9Ex (%s presentation)\n",
+		pp->SwapEffect == D3DSWAPEFFECT_FLIPEX ? "flip model" : "blt model"
+	);
+	return ret;
+}
+
+// D3DPOOL_MANAGED shims
+// ---------------------
+static D3DPOOL d3dd9ex_pool(IDirect3DDevice *that, D3DPOOL pool, DWORD &usage)
+{
+	if(pool != D3DPOOL_MANAGED || !d3d9ex_is(that, IID_IDirect3DDevice9Ex)) {
+		return pool;
+	}
+	// Keeps them lockable, which is all that D3DX and our own code need.
+	usage |= D3DUSAGE_DYNAMIC;
+	return D3DPOOL_DEFAULT;
+}
+
+static HRESULT (__stdcall *chain_d3dd9ex_Reset)(IDirect3DDevice *, D3DPRESENT_PARAMETERS *);
+static HRESULT (__stdcall *chain_d3dd9ex_CreateTexture)(IDirect3DDevice *, UINT, UINT, UINT, DWORD, D3DFORMAT, D3DPOOL, void **, HANDLE *);
+static HRESULT (__stdcall *chain_d3dd9ex_CreateVolumeTexture)(IDirect3DDevice *, UINT, UINT, UINT, UINT, DWORD, D3DFORMAT, D3DPOOL, void **, HANDLE *);
+static HRESULT (__stdcall *chain_d3dd9ex_CreateCubeTexture)(IDirect3DDevice *, UINT, UINT, DWORD, D3DFORMAT, D3DPOOL, void **, HANDLE *);
+static HRESULT (__stdcall *chain_d3dd9ex_CreateVertexBuffer)(IDirect3DDevice *, UINT, DWORD, DWORD, D3DPOOL, void **, HANDLE *);
+static HRESULT (__stdcall *chain_d3dd9ex_CreateIndexBuffer)(IDirect3DDevice *, UINT, DWORD, D3DFORMAT, D3DPOOL, void **, HANDLE *);
+
+static HRESULT __stdcall d3dd9ex_Reset(IDirect3DDevice *that, D3DPRESENT_PARAMETERS *pPresentationParameters)
+{
+	if(pPresentationParameters && d3d9ex_is(that, IID_IDirect3DDevice9Ex)) {
+		d3d9ex_present_params_adapt((d3d9_present_parameters_t *)pPresentationParameters);
+	}
+	return chain_d3dd9ex_Reset(that, pPresentationParameters);
+}
+
+static HRESULT __stdcall d3dd9ex_CreateTexture(
+	IDirect3DDevice *that, UINT Width, UINT Height, UINT Levels, DWORD Usage,
+	D3DFORMAT Format, D3DPOOL Pool, void **ppTexture, HANDLE *pSharedHandle
+)
+{
+	Pool = d3dd9ex_pool(that, Pool, Usage);
+	return chain_d3dd9ex_CreateTexture(
+		that, Width, Height, Levels, Usage, Format, Pool, ppTexture, pSharedHandle
+	);
+}
+
+static HRESULT __stdcall d3dd9ex_CreateVolumeTexture(
+	IDirect3DDevice *that, UINT Width, UINT Height, UINT Depth, UINT Levels,
+	DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, void **ppVolumeTexture,
+	HANDLE *pSharedHandle
+)
+{
+	Pool = d3dd9ex_pool(that, Pool, Usage);
+	return chain_d3dd9ex_CreateVolumeTexture(
+		that, Width, Height, Depth, Levels, Usage, Format, Pool, ppVolumeTexture, pSharedHandle
+	);
+}
+
+static HRESULT __stdcall d3dd9ex_CreateCubeTexture(
+	IDirect3DDevice *that, UINT EdgeLength, UINT Levels, DWORD Usage,
+	D3DFORMAT Format, D3DPOOL Pool, void **ppCubeTexture, HANDLE *pSharedHandle
+)
+{
+	Pool = d3dd9ex_pool(that, Pool, Usage);
+	return chain_d3dd9ex_CreateCubeTexture(
+		that, EdgeLength, Levels, Usage, Format, Pool, ppCubeTexture, pSharedHandle
+	);
+}
+
+static HRESULT __stdcall d3dd9ex_CreateVertexBuffer(
+	IDirect3DDevice *that, UINT Length, DWORD Usage, DWORD FVF, D3DPOOL Pool,
+	void **ppVertexBuffer, HANDLE *pSharedHandle
+)
+{
+	Pool = d3dd9ex_pool(that, Pool, Usage);
+	return chain_d3dd9ex_CreateVertexBuffer(
+		that, Length, Usage, FVF, Pool, ppVertexBuffer, pSharedHandle
+	);
+}
+
+static HRESULT __stdcall d3dd9ex_CreateIndexBuffer(
+	IDirect3DDevice *that, UINT Length, DWORD Usage, D3DFORMAT Format,
+	D3DPOOL Pool, void **ppIndexBuffer, HANDLE *pSharedHandle
+)
+{
+	Pool = d3dd9ex_pool(that, Pool, Usage);
+	return chain_d3dd9ex_CreateIndexBuffer(
+		that, Length, Usage, Format, Pool, ppIndexBuffer, pSharedHandle
+	);
+}
+// ---------------------
+/// --------------------
+
 // "Direct3D Device Detour" :P
 HRESULT __stdcall d3ddd_CreateDevice(
-	d3d_CreateDevice_type *c_orig, const std::vector<vtable_detour_t >& detours,
+	d3d_CreateDevice_type *c_orig, d3d_version_t ver,
+	const std::vector<vtable_detour_t >& detours,
 	d3d_CreateDevice_(FULLDEC)
 )
 {
-	auto ret = c_orig(d3d_CreateDevice_(VARNAMES));
+	auto ret = (ver == D3D9 && d3d9ex_enabled)
+		? d3d9ex_CreateDevice(c_orig, d3d_CreateDevice_(VARNAMES))
+		: c_orig(d3d_CreateDevice_(VARNAMES));
 	if(ret == D3D_OK && ppReturnedDeviceInterface && *ppReturnedDeviceInterface) {
 		vtable_detour(**ppReturnedDeviceInterface, detours.data(), detours.size());
 	}
@@ -35,7 +253,7 @@ HRESULT __stdcall d3ddd_CreateDevice(
 }
 
 void*** __stdcall d3ddd_Direct3DCreate(
-	Direct3DCreate_type *c_orig, size_t vtable_index,
+	Direct3DCreate_type *c_orig, d3d_version_t ver, size_t vtable_index,
 	d3d_CreateDevice_type *cd_new, d3d_CreateDevice_type **cd_old,
 	Direct3DCreate_(FULLDEC)
 )
@@ -43,7 +261,9 @@ void*** __stdcall d3ddd_Direct3DCreate(
 	if(!c_orig) {
 		return nullptr;
 	}
-	auto ret = c_orig(Direct3DCreate_(VARNAMES));
+	auto ret = (ver == D3D9 && d3d9ex_enabled)
+		? d3d9ex_Direct3DCreate9(c_orig, Direct3DCreate_(VARNAMES))
+		: c_orig(Direct3DCreate_(VARNAMES));
 	if(ret) {
 		vtable_detour_t my[] = {
 			{ vtable_index, (void*)cd_new, (void**)cd_old }
@@ -88,7 +308,7 @@ int d3d_device_detour(
 	HRESULT __stdcall d3ddd_CreateDevice##ver(d3d_CreateDevice_(FULLDEC)) \
 	{ \
 		return d3ddd_CreateDevice( \
-			chain_d3d_CreateDevice##ver, detours_d3dd##ver, \
+			chain_d3d_CreateDevice##ver, D3D##ver, detours_d3dd##ver, \
 			d3d_CreateDevice_(VARNAMES) \
 		); \
 	} \
@@ -96,7 +316,7 @@ int d3d_device_detour(
 	DIRECT3DCREATE(d3ddd_Direct3DCreate##ver) \
 	{ \
 		return d3ddd_Direct3DCreate( \
-			chain_Direct3DCreate##ver, vtable_index, \
+			chain_Direct3DCreate##ver, D3D##ver, vtable_index, \
 			d3ddd_CreateDevice##ver, &chain_d3d_CreateDevice##ver, \
 			Direct3DCreate_(VARNAMES) \
 		); \
@@ -115,3 +335,20 @@ int d3d_device_detour(
 
 D3D_DEVICE_DETOUR(8, 15);
 D3D_DEVICE_DETOUR(9, 16);
+
+extern "C" __declspec(dllexport) void minid3d_mod_detour(void)
+{
+	if(!runconfig_d3d9ex_get()) {
+		return;
+	}
+	vtable_detour_t d3d9ex[] = {
+		{ 16, (void*)d3dd9ex_Reset, (void**)&chain_d3dd9ex_Reset },
+		{ 23, (void*)d3dd9ex_CreateTexture, (void**)&chain_d3dd9ex_CreateTexture },
+		{ 24, (void*)d3dd9ex_CreateVolumeTexture, (void**)&chain_d3dd9ex_CreateVolumeTexture },
+		{ 25, (void*)d3dd9ex_CreateCubeTexture, (void**)&chain_d3dd9ex_CreateCubeTexture },
+		{ 26, (void*)d3dd9ex_CreateVertexBuffer, (void**)&chain_d3dd9ex_CreateVertexBuffer },
+		{ 27, (void*)d3dd9ex_CreateIndexBuffer, (void**)&chain_d3dd9ex_CreateIndexBuffer },
+	};
+	d3d9ex_enabled = true;
+	d3d9_device_detour(d3d9ex, elementsof(d3d9ex));
+}
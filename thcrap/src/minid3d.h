@@ -325,6 +325,8 @@ typedef struct _D3DLOCKED_RECT {
 	void* pBits;
 } D3DLOCKED_RECT;
 
+#define D3DLOCK_READONLY 0x00000010L
+
 typedef struct _D3DVIEWPORT {
 	DWORD X;
 	DWORD Y;
@@ -403,6 +405,10 @@ MINID3D_VTABLE_FUNC_DEF(HRESULT, d3ds_GetDesc, 8, 12)
 	d3dd8_CreateTexture_(x), \
 	x(HANDLE, *pSharedHandle)
 
+#define d3dd_Reset_(x) \
+	x(IDirect3DDevice*, that), \
+	x(D3DPRESENT_PARAMETERS*, pPresentationParameters)
+
 #define d3dd_EndScene_(x) \
 	x(IDirect3DDevice*, that)
 
@@ -415,6 +421,14 @@ MINID3D_VTABLE_FUNC_DEF(HRESULT, d3ds_GetDesc, 8, 12)
 	x(D3DRENDERSTATETYPE, State), \
 	x(DWORD, Value)
 
+#define d3dd_BeginStateBlock_(x) \
+	x(IDirect3DDevice*, that)
+
+#define d3dd_EndStateBlock_(x) \
+	x(IDirect3DDevice*, that), \
+	x(IDirect3DStateBlock*, pSB)
+	// (Yes, no double pointer here, due to Direct3D 8 compatibility)
+
 #define d3dd8_ApplyStateBlock_(x) \
 	x(IDirect3DDevice*, that), \
 	x(IDirect3DStateBlock, pSB)
@@ -480,6 +494,7 @@ __inline HRESULT d3dd_CreateTexture(d3d_version_t ver, d3dd8_CreateTexture_(FULL
 		((ft8*)NULL)(d3dd8_CreateTexture_(VARNAMES));
 }
 
+MINID3D_VTABLE_FUNC_DEF(HRESULT, d3dd_Reset, 14, 16)
 MINID3D_VTABLE_FUNC_DEF(HRESULT, d3dd_EndScene, 35, 42)
 MINID3D_VTABLE_FUNC_DEF(HRESULT, d3dd_SetViewport, 40, 47)
 
@@ -513,6 +528,8 @@ __inline HRESULT d3dd_DeleteStateBlock(d3d_version_t ver, d3dd8_DeleteStateBlock
 }
 
 MINID3D_VTABLE_FUNC_DEF(HRESULT, d3dd_SetRenderState, 50, 57)
+MINID3D_VTABLE_FUNC_DEF(HRESULT, d3dd_BeginStateBlock, 52, 60)
+MINID3D_VTABLE_FUNC_DEF(HRESULT, d3dd_EndStateBlock, 53, 61)
 MINID3D_VTABLE_FUNC_DEF(HRESULT, d3dd_CreateStateBlock, 57, 59)
 MINID3D_VTABLE_FUNC_DEF(HRESULT, d3dd_SetTexture, 61, 65)
 MINID3D_VTABLE_FUNC_DEF(HRESULT, d3dd_SetTextureStageState, 63, 67)
@@ -0,0 +1,636 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Read-only single-file patch packs.
+  */
+
+#include "thcrap.h"
+#include <zlib.h>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct patch_pack_t {
+	HANDLE hPack;
+	const BYTE *view;
+	size_t view_len;
+	const patch_pack_entry_t *entries;
+	uint32_t count;
+};
+
+// Keyed by the normalized archive path. Patches without a valid pack are
+// stored as nullptr, so that we only look for the pack file once.
+static std::unordered_map<std::string, patch_pack_t*> patch_packs;
+// Decompressed buffers handed out by patch_pack_map().
+static std::unordered_set<const void*> patch_pack_buffers;
+static SRWLOCK patch_pack_srwlock = SRWLOCK_INIT;
+// Result of patch_pack_prebaked(), valid once [patch_pack_prebaked_checked]
+// is set.
+static const patch_pack_t *patch_pack_prebaked_pack = nullptr;
+static volatile LONG patch_pack_prebaked_checked = 0;
+
+static bool patch_pack_range_valid(const patch_pack_t *pack, size_t offset, size_t len)
+{
+	return offset <= pack->view_len && len <= pack->view_len - offset;
+}
+
+static std::string_view patch_pack_name(const patch_pack_t *pack, const patch_pack_entry_t *entry)
+{
+	return std::string_view((const char *)pack->view + entry->name_offset, entry->name_len);
+}
+
+// Bounds-checks every entry, and makes sure that the index is actually
+// sorted, since lookups rely on that.
+static bool patch_pack_validate(const patch_pack_t *pack, const char *fn)
+{
+	auto fail = [fn](const char *reason) {
+		log_printf("%s: invalid patch pack (%s)\n", fn, reason);
+		return false;
+	};
+	if(!patch_pack_range_valid(pack, 0, sizeof(patch_pack_header_t))) {
+		return fail("truncated header");
+	}
+	const auto header = (const patch_pack_header_t *)pack->view;
+	if(header->magic != PATCH_PACK_MAGIC) {
+		return fail("wrong magic");
+	}
+	if(header->version != PATCH_PACK_VERSION) {
+		return fail("unsupported version");
+	}
+	if(
+		header->count > (pack->view_len / sizeof(patch_pack_entry_t))
+		|| !patch_pack_range_valid(pack, sizeof(patch_pack_header_t), header->count * sizeof(patch_pack_entry_t))
+	) {
+		return fail("truncated index");
+	}
+	const auto entries = (const patch_pack_entry_t *)(header + 1);
+	for(uint32_t i = 0; i < header->count; i++) {
+		const auto &entry = entries[i];
+		if(
+			entry.name_len == 0
+			|| !patch_pack_range_valid(pack, entry.name_offset, entry.name_len)
+			|| !patch_pack_range_valid(pack, entry.data_offset, entry.size_stored)
+		) {
+			return fail("entry out of bounds");
+		}
+		if(
+			(entry.method == PATCH_PACK_STORED && entry.size_stored != entry.size)
+			|| (entry.method != PATCH_PACK_STORED && entry.method != PATCH_PACK_DEFLATE)
+		) {
+			return fail("unsupported compression");
+		}
+		if(i > 0 && patch_pack_name(pack, &entries[i - 1]) >= patch_pack_name(pack, &entry)) {
+			return fail("index not sorted");
+		}
+	}
+	return true;
+}
+
+static patch_pack_t* patch_pack_open(const std::string &fn)
+{
+	// No FILE_SHARE_WRITE, since the mapping relies on nobody truncating the
+	// file under us.
+	HANDLE hPack = CreateFileU(
+		fn.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL
+	);
+	if(hPack == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+	LARGE_INTEGER pack_size;
+	HANDLE hMap = NULL;
+	if(
+		GetFileSizeEx(hPack, &pack_size)
+		&& pack_size.QuadPart > 0
+		&& pack_size.QuadPart <= 0xffffffff
+	) {
+		hMap = CreateFileMapping(hPack, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+	const BYTE *view = hMap ? (const BYTE *)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if(hMap) {
+		// The view keeps the mapping alive.
+		CloseHandle(hMap);
+	}
+	if(!view) {
+		CloseHandle(hPack);
+		return nullptr;
+	}
+
+	auto *pack = new patch_pack_t;
+	pack->hPack = hPack;
+	pack->view = view;
+	pack->view_len = (size_t)pack_size.QuadPart;
+	if(!patch_pack_validate(pack, fn.c_str())) {
+		UnmapViewOfFile(view);
+		CloseHandle(hPack);
+		delete pack;
+		return nullptr;
+	}
+	const auto header = (const patch_pack_header_t *)view;
+	pack->entries = (const patch_pack_entry_t *)(header + 1);
+	pack->count = header->count;
+	log_debugf("%s: %u files\n", fn.c_str(), pack->count);
+	return pack;
+}
+
+// Returns the pack cached under [key], opening [fn] if there is none yet.
+static const patch_pack_t* patch_pack_get_cached(const std::string &key, const std::string &fn)
+{
+	AcquireSRWLockShared(&patch_pack_srwlock);
+	auto it = patch_packs.find(key);
+	if(it != patch_packs.end()) {
+		auto *ret = it->second;
+		ReleaseSRWLockShared(&patch_pack_srwlock);
+		return ret;
+	}
+	ReleaseSRWLockShared(&patch_pack_srwlock);
+
+	auto *pack = patch_pack_open(fn);
+
+	AcquireSRWLockExclusive(&patch_pack_srwlock);
+	auto inserted = patch_packs.emplace(key, pack);
+	if(!inserted.second && pack) {
+		// Another thread opened the same pack in the meantime.
+		UnmapViewOfFile(pack->view);
+		CloseHandle(pack->hPack);
+		delete pack;
+	}
+	auto *ret = inserted.first->second;
+	ReleaseSRWLockExclusive(&patch_pack_srwlock);
+	return ret;
+}
+
+const patch_pack_t* patch_pack_get(const patch_t *patch_info)
+{
+	if(!patch_info || !patch_info->archive || !patch_info->archive[0]) {
+		return nullptr;
+	}
+	std::string archive = patch_info->archive;
+	str_slash_normalize(&archive[0]);
+	if(archive.back() != '/') {
+		archive += '/';
+	}
+	return patch_pack_get_cached(archive, archive + PATCH_PACK_FN);
+}
+
+const patch_pack_t* patch_pack_get_file(const char *fn)
+{
+	if(!fn || !fn[0]) {
+		return nullptr;
+	}
+	// Archive keys always end in a slash, so these can't collide with them.
+	std::string key = fn;
+	str_slash_normalize(&key[0]);
+	return patch_pack_get_cached(key, fn);
+}
+
+patch_index_result_t patch_pack_find(const patch_pack_t *pack, const char *key, size_t key_len, const patch_pack_entry_t **entry)
+{
+	if(!pack || !key) {
+		return PATCH_INDEX_UNKNOWN;
+	}
+	const auto *last = pack->entries + pack->count;
+	auto lower_bound = [pack, last](std::string_view k) {
+		return std::lower_bound(pack->entries, last, k, [pack](const patch_pack_entry_t &e, std::string_view k) {
+			return patch_pack_name(pack, &e) < k;
+		});
+	};
+
+	const std::string_view key_sv(key, key_len);
+	const auto *it = lower_bound(key_sv);
+	if(it != last && patch_pack_name(pack, it) == key_sv) {
+		if(entry) {
+			*entry = it;
+		}
+		return PATCH_INDEX_FILE;
+	}
+	// All files below a directory form one contiguous range that starts at
+	// the first name with the "[key]/" prefix.
+	std::string dir_key(key_sv);
+	dir_key += '/';
+	it = lower_bound(dir_key);
+	if(it != last && !patch_pack_name(pack, it).compare(0, dir_key.size(), dir_key)) {
+		return PATCH_INDEX_DIRECTORY;
+	}
+	return PATCH_INDEX_MISSING;
+}
+
+patch_index_result_t patch_pack_find_fn(const patch_pack_t *pack, const char *fn, const patch_pack_entry_t **entry)
+{
+	std::string key;
+	bool ascii;
+	if(!pack || !fn || !patch_index_key(key, fn, ascii)) {
+		return PATCH_INDEX_UNKNOWN;
+	}
+	return patch_pack_find(pack, key.c_str(), key.size(), entry);
+}
+
+const void* patch_pack_view(const patch_pack_t *pack, const patch_pack_entry_t *entry)
+{
+	if(!pack || !entry || entry->method != PATCH_PACK_STORED) {
+		return nullptr;
+	}
+	return pack->view + entry->data_offset;
+}
+
+// Same layout as WIN32_MEMORY_RANGE_ENTRY, which older SDKs don't declare.
+typedef struct {
+	void *VirtualAddress;
+	SIZE_T NumberOfBytes;
+} patch_pack_range_t;
+
+typedef BOOL WINAPI PrefetchVirtualMemory_type(
+	HANDLE hProcess, ULONG_PTR NumberOfEntries, patch_pack_range_t *VirtualAddresses, ULONG Flags
+);
+
+void patch_pack_prefetch(const patch_pack_t *pack, const patch_pack_entry_t *entry)
+{
+	if(!pack || !entry || !entry->size_stored) {
+		return;
+	}
+	static auto *prefetch_func = (PrefetchVirtualMemory_type *)GetProcAddress(
+		GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory"
+	);
+	patch_pack_range_t range = {
+		(void *)(pack->view + entry->data_offset), entry->size_stored
+	};
+	if(prefetch_func && prefetch_func(GetCurrentProcess(), 1, &range, 0)) {
+		return;
+	}
+	const size_t page_size = 4096;
+	volatile BYTE sink = 0;
+	const BYTE *p = pack->view + entry->data_offset;
+	for(size_t i = 0; i < entry->size_stored; i += page_size) {
+		sink += p[i];
+	}
+	sink += p[entry->size_stored - 1];
+}
+
+static int patch_pack_inflate(void *buf, const patch_pack_t *pack, const patch_pack_entry_t *entry)
+{
+	z_stream strm = {};
+	strm.next_in = (BYTE *)(pack->view + entry->data_offset);
+	strm.avail_in = entry->size_stored;
+	strm.next_out = (BYTE *)buf;
+	strm.avail_out = entry->size;
+	int ret = inflateInit2(&strm, -MAX_WBITS);
+	if(ret != Z_OK) {
+		return ret;
+	}
+	ret = inflate(&strm, Z_FINISH);
+	if(ret == Z_STREAM_END && strm.total_out != entry->size) {
+		ret = Z_DATA_ERROR;
+	}
+	inflateEnd(&strm);
+	return ret == Z_STREAM_END ? Z_OK : (ret == Z_OK ? Z_BUF_ERROR : ret);
+}
+
+void* patch_pack_load(const patch_pack_t *pack, const patch_pack_entry_t *entry, size_t *file_size)
+{
+	size_t file_size_tmp;
+	if(!file_size) {
+		file_size = &file_size_tmp;
+	}
+	*file_size = 0;
+	if(!pack || !entry || entry->size == 0) {
+		return nullptr;
+	}
+	void *ret = malloc(entry->size);
+	if(!ret) {
+		return nullptr;
+	}
+	if(entry->method == PATCH_PACK_STORED) {
+		memcpy(ret, pack->view + entry->data_offset, entry->size);
+	} else if(int err = patch_pack_inflate(ret, pack, entry)) {
+		log_printf(
+			"Error decompressing %.*s from patch pack (zlib error %d)\n",
+			(int)entry->name_len, pack->view + entry->name_offset, err
+		);
+		free(ret);
+		return nullptr;
+	}
+	*file_size = entry->size;
+	return ret;
+}
+
+const void* patch_pack_map(const patch_pack_t *pack, const patch_pack_entry_t *entry, size_t *file_size)
+{
+	size_t file_size_tmp;
+	if(!file_size) {
+		file_size = &file_size_tmp;
+	}
+	*file_size = 0;
+	if(!pack || !entry || entry->size == 0) {
+		return nullptr;
+	}
+	if(const void *view = patch_pack_view(pack, entry)) {
+		*file_size = entry->size;
+		return view;
+	}
+	void *ret = patch_pack_load(pack, entry, file_size);
+	if(ret) {
+		AcquireSRWLockExclusive(&patch_pack_srwlock);
+		patch_pack_buffers.insert(ret);
+		ReleaseSRWLockExclusive(&patch_pack_srwlock);
+	}
+	return ret;
+}
+
+bool patch_pack_unmap(const void *view)
+{
+	if(!view) {
+		return false;
+	}
+	AcquireSRWLockExclusive(&patch_pack_srwlock);
+	const bool buffer = patch_pack_buffers.erase(view) != 0;
+	// Views inside a pack stay valid until the pack is closed.
+	const bool inside = !buffer && std::any_of(patch_packs.begin(), patch_packs.end(), [view](const auto &it) {
+		const auto *pack = it.second;
+		return pack && view >= pack->view && view < pack->view + pack->view_len;
+	});
+	ReleaseSRWLockExclusive(&patch_pack_srwlock);
+	if(buffer) {
+		free((void *)view);
+	}
+	return buffer || inside;
+}
+
+/// Writing
+/// -------
+// Size of the buffer used to copy the data into the final pack.
+#define PATCH_PACK_COPY_CHUNK (1024 * 1024)
+
+struct patch_pack_writer_t {
+	std::string fn;
+	// Temporary file with the data of all files added so far
+	HANDLE data;
+	uint64_t data_size;
+	// [data_offset] is relative to the start of [data] until the pack is
+	// written.
+	std::vector<std::pair<std::string, patch_pack_entry_t>> entries;
+	std::unordered_set<std::string> names;
+	int error;
+	SRWLOCK lock;
+};
+
+patch_pack_writer_t* patch_pack_writer_open(const char *fn)
+{
+	if(!fn) {
+		return nullptr;
+	}
+	dir_create_for_fn(fn);
+	std::string data_fn = std::string(fn) + ".data.tmp";
+	HANDLE data = CreateFileU(
+		data_fn.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL
+	);
+	if(data == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+	auto *writer = new patch_pack_writer_t;
+	writer->fn = fn;
+	writer->data = data;
+	writer->data_size = 0;
+	writer->error = 0;
+	InitializeSRWLock(&writer->lock);
+	return writer;
+}
+
+int patch_pack_writer_add(patch_pack_writer_t *writer, const char *name, const void *data, size_t size, unsigned int flags)
+{
+	std::string key;
+	bool ascii;
+	if(!writer || !name || (!data && size) || !patch_index_key(key, name, ascii)) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	if(size > UINT32_MAX) {
+		return ERROR_FILE_TOO_LARGE;
+	}
+
+	patch_pack_entry_t entry = {};
+	entry.size = (uint32_t)size;
+	entry.size_stored = (uint32_t)size;
+	entry.method = PATCH_PACK_STORED;
+	std::vector<BYTE> deflated;
+	if((flags & PATCH_PACK_WRITE_DEFLATE) && size) {
+		const size_t limit = size - size / 10;
+		deflated.resize(limit);
+		z_stream strm = {};
+		strm.next_in = (BYTE *)data;
+		strm.avail_in = (uInt)size;
+		strm.next_out = deflated.data();
+		strm.avail_out = (uInt)limit;
+		if(deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+			if(deflate(&strm, Z_FINISH) == Z_STREAM_END) {
+				entry.method = PATCH_PACK_DEFLATE;
+				entry.size_stored = (uint32_t)strm.total_out;
+			}
+			deflateEnd(&strm);
+		}
+	}
+	const void *stored = entry.method == PATCH_PACK_DEFLATE ? deflated.data() : data;
+
+	AcquireSRWLockExclusive(&writer->lock);
+	int ret = 0;
+	if(!writer->names.insert(key).second) {
+		ret = ERROR_ALREADY_EXISTS;
+	} else if(writer->data_size + entry.size_stored > UINT32_MAX) {
+		ret = ERROR_FILE_TOO_LARGE;
+	} else {
+		DWORD byte_ret = 0;
+		if(entry.size_stored && (
+			!WriteFile(writer->data, stored, entry.size_stored, &byte_ret, NULL)
+			|| byte_ret != entry.size_stored
+		)) {
+			ret = ERROR_WRITE_FAULT;
+		} else {
+			entry.data_offset = (uint32_t)writer->data_size;
+			entry.name_len = (uint32_t)key.size();
+			writer->data_size += entry.size_stored;
+			writer->entries.emplace_back(std::move(key), entry);
+		}
+	}
+	if(ret && !writer->error) {
+		writer->error = ret;
+	}
+	ReleaseSRWLockExclusive(&writer->lock);
+	return ret;
+}
+
+// Writes the header, index and names of [writer], followed by its data.
+static int patch_pack_writer_commit(patch_pack_writer_t *writer)
+{
+	auto &entries = writer->entries;
+	std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) {
+		return a.first < b.first;
+	});
+	size_t names_size = 0;
+	for(const auto &it : entries) {
+		names_size += it.first.size();
+	}
+	const uint64_t prefix_size = sizeof(patch_pack_header_t)
+		+ entries.size() * sizeof(patch_pack_entry_t) + names_size;
+	if(prefix_size + writer->data_size > UINT32_MAX) {
+		return ERROR_FILE_TOO_LARGE;
+	}
+
+	std::vector<BYTE> prefix((size_t)prefix_size);
+	auto *header = (patch_pack_header_t *)prefix.data();
+	header->magic = PATCH_PACK_MAGIC;
+	header->version = PATCH_PACK_VERSION;
+	header->count = (uint32_t)entries.size();
+	auto *index = (patch_pack_entry_t *)(header + 1);
+	size_t name_offset = sizeof(patch_pack_header_t) + entries.size() * sizeof(patch_pack_entry_t);
+	for(size_t i = 0; i < entries.size(); i++) {
+		index[i] = entries[i].second;
+		index[i].name_offset = (uint32_t)name_offset;
+		index[i].data_offset += (uint32_t)prefix_size;
+		memcpy(prefix.data() + name_offset, entries[i].first.data(), entries[i].first.size());
+		name_offset += entries[i].first.size();
+	}
+
+	const std::string tmp_fn = writer->fn + ".tmp";
+	HANDLE out = CreateFileU(
+		tmp_fn.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL
+	);
+	if(out == INVALID_HANDLE_VALUE) {
+		return GetLastError();
+	}
+	auto write = [out](const void *buf, DWORD len) {
+		DWORD byte_ret;
+		return (WriteFile(out, buf, len, &byte_ret, NULL) && byte_ret == len) ? 0 : ERROR_WRITE_FAULT;
+	};
+	int ret = write(prefix.data(), (DWORD)prefix.size());
+	std::vector<BYTE> chunk(PATCH_PACK_COPY_CHUNK);
+	SetFilePointer(writer->data, 0, NULL, FILE_BEGIN);
+	uint64_t left = writer->data_size;
+	while(!ret && left) {
+		const DWORD len = (DWORD)MIN(left, (uint64_t)chunk.size());
+		DWORD byte_ret;
+		if(!ReadFile(writer->data, chunk.data(), len, &byte_ret, NULL) || byte_ret != len) {
+			ret = ERROR_READ_FAULT;
+			break;
+		}
+		ret = write(chunk.data(), len);
+		left -= len;
+	}
+	CloseHandle(out);
+	if(!ret && !MoveFileExU(tmp_fn.c_str(), writer->fn.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		ret = GetLastError();
+	}
+	if(ret) {
+		DeleteFileU(tmp_fn.c_str());
+	}
+	return ret;
+}
+
+int patch_pack_writer_close(patch_pack_writer_t *writer, bool commit)
+{
+	if(!writer) {
+		return ERROR_INVALID_PARAMETER;
+	}
+	int ret = writer->error;
+	if(commit && !ret) {
+		ret = patch_pack_writer_commit(writer);
+	}
+	// Also deletes the temporary file.
+	CloseHandle(writer->data);
+	delete writer;
+	return ret;
+}
+/// -------
+
+/// Pre-baked packs
+/// ---------------
+json_t* patch_pack_prebaked_manifest(void)
+{
+	json_t *patches = json_array();
+	stack_foreach_cpp([patches](const patch_t *patch) {
+		json_array_append_new(patches, json_pack("{s:s, s:I}",
+			"id", patch->id ? patch->id : "",
+			"version", (json_int_t)patch->version
+		));
+	});
+	const char *game = runconfig_game_get();
+	const char *build = runconfig_build_get();
+	return json_pack("{s:s, s:s, s:o}",
+		"game", game ? game : "",
+		"build", build ? build : "",
+		"patches", patches
+	);
+}
+
+static const patch_pack_t* patch_pack_prebaked_open(void)
+{
+	const char *prebaked = runconfig_prebaked_get();
+	if(!prebaked) {
+		return nullptr;
+	}
+	std::string fn = prebaked;
+	const char *thcrap_dir = runconfig_thcrap_dir_get();
+	if(PathIsRelativeU(prebaked) && thcrap_dir) {
+		fn = std::string(thcrap_dir) + "/" + fn;
+	}
+	const patch_pack_t *pack = patch_pack_get_file(fn.c_str());
+	if(!pack) {
+		log_printf("(Pre-baked) %s: not found or not a valid pack\n", fn.c_str());
+		return nullptr;
+	}
+	const patch_pack_entry_t *entry;
+	json_t *manifest = nullptr;
+	if(patch_pack_find_fn(pack, PATCH_PACK_PREBAKED_MANIFEST, &entry) == PATCH_INDEX_FILE) {
+		size_t size;
+		if(void *buf = patch_pack_load(pack, entry, &size)) {
+			manifest = json_loadb((const char *)buf, size, 0, nullptr);
+			free(buf);
+		}
+	}
+	json_t *current = patch_pack_prebaked_manifest();
+	const bool match = manifest && json_equal(manifest, current);
+	json_decref(current);
+	json_decref(manifest);
+	if(!match) {
+		log_printf("(Pre-baked) %s was baked for a different game, build or patch stack, ignoring it\n", fn.c_str());
+		return nullptr;
+	}
+	log_printf("(Pre-baked) Serving patched files from %s\n", fn.c_str());
+	return pack;
+}
+
+const patch_pack_t* patch_pack_prebaked(void)
+{
+	if(!patch_pack_prebaked_checked) {
+		// Opening it twice from two threads is harmless, the pack itself is
+		// cached.
+		patch_pack_prebaked_pack = patch_pack_prebaked_open();
+		InterlockedExchange(&patch_pack_prebaked_checked, 1);
+	}
+	return patch_pack_prebaked_pack;
+}
+/// ---------------
+
+void patch_pack_mod_exit(void)
+{
+	AcquireSRWLockExclusive(&patch_pack_srwlock);
+	patch_pack_prebaked_pack = nullptr;
+	patch_pack_prebaked_checked = 0;
+	for(auto &it : patch_packs) {
+		if(auto *pack = it.second) {
+			UnmapViewOfFile(pack->view);
+			CloseHandle(pack->hPack);
+			delete pack;
+		}
+	}
+	patch_packs.clear();
+	for(const void *buffer : patch_pack_buffers) {
+		free((void *)buffer);
+	}
+	patch_pack_buffers.clear();
+	ReleaseSRWLockExclusive(&patch_pack_srwlock);
+}
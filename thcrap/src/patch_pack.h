@@ -0,0 +1,153 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Read-only single-file patch packs.
+  *
+  * A patch directory can contain a [PATCH_PACK_FN] file, built by
+  * scripts/patch_pack.py, which holds any number of the patch's files. The
+  * pack is mapped into memory once, and its sorted index answers every
+  * lookup without touching the file system. Files that aren't in the pack
+  * are still looked up in the directory, so that a pack can be deleted or
+  * amended with loose files during development.
+  *
+  * Layout (all integers little-endian):
+  *
+  *	patch_pack_header_t
+  *	patch_pack_entry_t[count], sorted by name
+  *	Names, not null-terminated
+  *	File data, stored or raw Deflate
+  *
+  * Names are relative to the patch directory, with forward slashes and
+  * lowercase ASCII letters, matching the keys of the patch file index.
+  */
+
+#pragma once
+
+#define PATCH_PACK_FN "patch.thpack"
+#define PATCH_PACK_MAGIC 0x4b504854 // "THPK"
+#define PATCH_PACK_VERSION 1
+
+typedef enum {
+	PATCH_PACK_STORED = 0,
+	PATCH_PACK_DEFLATE = 8,
+} patch_pack_method_t;
+
+#pragma pack(push, 1)
+typedef struct {
+	uint32_t magic; // = PATCH_PACK_MAGIC
+	uint32_t version; // = PATCH_PACK_VERSION
+	uint32_t count;
+	uint32_t reserved;
+} patch_pack_header_t;
+
+typedef struct {
+	// Offsets are relative to the start of the pack.
+	uint32_t name_offset;
+	uint32_t name_len;
+	uint32_t data_offset;
+	uint32_t size_stored;
+	uint32_t size;
+	uint32_t method; // patch_pack_method_t
+} patch_pack_entry_t;
+#pragma pack(pop)
+
+typedef struct patch_pack_t patch_pack_t;
+
+// Returns the pack of [patch_info], opening it on the first call for this
+// patch, or NULL if the patch doesn't have a valid one. Packs stay mapped
+// until patch_pack_mod_exit(), so a pack that changes on disk is only
+// picked up after a restart.
+const patch_pack_t* patch_pack_get(const patch_t *patch_info);
+
+// Looks up the normalized [key] in [pack]. Returns PATCH_INDEX_FILE and the
+// entry in [entry] if it's a file, or PATCH_INDEX_DIRECTORY if any file in
+// the pack lies below it.
+patch_index_result_t patch_pack_find(const patch_pack_t *pack, const char *key, size_t key_len, const patch_pack_entry_t **entry);
+
+// Returns a pointer to the data of [entry] directly inside the mapped pack,
+// or NULL if the entry is compressed.
+const void* patch_pack_view(const patch_pack_t *pack, const patch_pack_entry_t *entry);
+
+// Asks the OS to read the data of [entry] into the file cache in the
+// background. Without PrefetchVirtualMemory() (Windows 8 and later), the
+// pages are touched instead, which blocks until they have been read.
+void patch_pack_prefetch(const patch_pack_t *pack, const patch_pack_entry_t *entry);
+
+// Returns the contents of [entry] in a new buffer that has to be free()d by
+// the caller, or NULL if the file is empty or corrupt.
+void* patch_pack_load(const patch_pack_t *pack, const patch_pack_entry_t *entry, size_t *file_size);
+
+// Returns a read-only view of [entry], either inside the mapped pack or in
+// a decompressed buffer, which has to be released with file_unmap().
+const void* patch_pack_map(const patch_pack_t *pack, const patch_pack_entry_t *entry, size_t *file_size);
+
+// Opens the pack at [fn], which doesn't have to belong to any patch, or
+// returns NULL if it isn't a valid pack. Stays open like the packs from
+// patch_pack_get().
+const patch_pack_t* patch_pack_get_file(const char *fn);
+
+// Looks up the file name [fn] in [pack], normalizing it like the keys of
+// the patch file index.
+patch_index_result_t patch_pack_find_fn(const patch_pack_t *pack, const char *fn, const patch_pack_entry_t **entry);
+
+// Looks up [fn] in the pack of [patch_info], respecting its blacklist.
+// Returns PATCH_INDEX_UNKNOWN if the patch has no pack or the pack doesn't
+// contain [fn], in which case the patch directory has to be checked.
+// Otherwise, [pack] and, for files, [entry] receive the pack and entry.
+patch_index_result_t patch_file_pack_lookup(const patch_t *patch_info, const char *fn, const patch_pack_t **pack, const patch_pack_entry_t **entry);
+
+// Releases [view] if it was returned by patch_pack_map(). Returns false if
+// [view] doesn't belong to any pack.
+bool patch_pack_unmap(const void *view);
+
+/// Writing
+/// -------
+typedef enum {
+	// Deflate the file if that saves at least 10% of its size, like
+	// scripts/patch_pack.py --compress.
+	PATCH_PACK_WRITE_DEFLATE = 0x1,
+} patch_pack_write_flags_t;
+
+typedef struct patch_pack_writer_t patch_pack_writer_t;
+
+// Starts writing a new pack to [fn]. The data of all files goes into a
+// temporary file until patch_pack_writer_close(), so that the caller
+// doesn't have to keep everything in memory.
+patch_pack_writer_t* patch_pack_writer_open(const char *fn);
+
+// Adds [size] bytes of [data] as [name], which is normalized like the keys
+// of the patch file index. Can be called from multiple threads at once.
+// Returns 0 on success, or a Win32 error code.
+int patch_pack_writer_add(patch_pack_writer_t *writer, const char *name, const void *data, size_t size, unsigned int flags);
+
+// Writes the pack if [commit] is true and every file could be added, then
+// frees [writer]. The pack replaces [fn] atomically. Returns 0 on success,
+// or a Win32 error code.
+int patch_pack_writer_close(patch_pack_writer_t *writer, bool commit);
+/// -------
+
+/// Pre-baked packs
+/// ---------------
+/**
+  * A pre-baked pack, written by thcrap_bake, holds the final output of the
+  * replacement and patch hook pipeline for every game file a stack changes.
+  * If the "prebaked" run configuration value points to one, its files are
+  * served as they are, without running any hooks. Its manifest records the
+  * game, build and patch stack it was baked for, and the pack is ignored if
+  * any of them differ.
+  */
+#define PATCH_PACK_PREBAKED_MANIFEST "thcrap_bake.js"
+
+// Describes the current game, build and patch stack, as stored in the
+// manifest of a pre-baked pack.
+json_t* patch_pack_prebaked_manifest(void);
+
+// Returns the pre-baked pack from the run configuration, or NULL if there
+// is none or it doesn't match the manifest of the current stack.
+const patch_pack_t* patch_pack_prebaked(void);
+/// ---------------
+
+void patch_pack_mod_exit(void);
@@ -0,0 +1,192 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Per-patch cost attribution.
+  */
+
+#include "thcrap.h"
+#include <algorithm>
+#include <unordered_map>
+#include <string_view>
+
+struct patch_stats_t {
+	std::string id;
+	// Stack level the patch was last seen at, for sorting the report
+	volatile LONG level;
+
+	volatile LONG64 files;
+	volatile LONG64 file_bytes;
+	volatile LONG64 json_layers;
+	volatile LONG64 json_bytes;
+	volatile LONG64 json_ticks;
+	volatile LONG64 hook_runs;
+	volatile LONG64 hook_ticks;
+	volatile LONG64 cache_hits;
+	volatile LONG64 cache_misses;
+};
+
+// Keyed by the ID stored in the entry itself, so that lookups don't have to
+// construct a string. Entries are never freed.
+static std::unordered_map<std::string_view, patch_stats_t*> patch_stats_map;
+static SRWLOCK patch_stats_srwlock = SRWLOCK_INIT;
+static patch_stats_t patch_stats_unattributed = { "(unattributed)", LONG_MAX };
+
+struct patch_stats_owner_tls_t {
+	patch_stats_t *owner;
+};
+THREAD_LOCAL(patch_stats_owner_tls_t, patch_stats_owner_tls, nullptr, nullptr);
+
+static void patch_stats_owner_set(patch_stats_t *stats)
+{
+	patch_stats_owner_tls_t *tls = patch_stats_owner_tls_get();
+	if (tls) {
+		tls->owner = stats;
+	}
+}
+
+patch_stats_t* patch_stats_get(const patch_t *patch_info)
+{
+	if (!patch_info || !patch_info->id) {
+		return &patch_stats_unattributed;
+	}
+	patch_stats_t *ret = nullptr;
+	const std::string_view id = patch_info->id;
+	AcquireSRWLockShared(&patch_stats_srwlock);
+	auto it = patch_stats_map.find(id);
+	if (it != patch_stats_map.end()) {
+		ret = it->second;
+	}
+	ReleaseSRWLockShared(&patch_stats_srwlock);
+	if (!ret) {
+		AcquireSRWLockExclusive(&patch_stats_srwlock);
+		it = patch_stats_map.find(id);
+		if (it != patch_stats_map.end()) {
+			ret = it->second;
+		} else {
+			ret = new patch_stats_t();
+			ret->id = patch_info->id;
+			patch_stats_map.emplace(ret->id, ret);
+		}
+		ReleaseSRWLockExclusive(&patch_stats_srwlock);
+	}
+	ret->level = (LONG)patch_info->level;
+	return ret;
+}
+
+LONGLONG patch_stats_now(void)
+{
+	LARGE_INTEGER ret;
+	QueryPerformanceCounter(&ret);
+	return ret.QuadPart;
+}
+
+void patch_stats_file(patch_stats_t *stats, size_t size)
+{
+	InterlockedIncrement64(&stats->files);
+	InterlockedExchangeAdd64(&stats->file_bytes, (LONG64)size);
+	patch_stats_owner_set(stats);
+}
+
+void patch_stats_json(patch_stats_t *stats, size_t size, LONGLONG start)
+{
+	const LONGLONG ticks = patch_stats_now() - start;
+	InterlockedIncrement64(&stats->json_layers);
+	InterlockedExchangeAdd64(&stats->json_bytes, (LONG64)size);
+	InterlockedExchangeAdd64(&stats->json_ticks, ticks);
+	patch_stats_owner_set(stats);
+}
+
+void patch_stats_hooks(patch_stats_t *stats, LONGLONG start)
+{
+	const LONGLONG ticks = patch_stats_now() - start;
+	if (!stats) {
+		stats = &patch_stats_unattributed;
+	}
+	InterlockedIncrement64(&stats->hook_runs);
+	InterlockedExchangeAdd64(&stats->hook_ticks, ticks);
+}
+
+void patch_stats_cache(patch_stats_t *stats, bool hit)
+{
+	if (!stats) {
+		stats = &patch_stats_unattributed;
+	}
+	InterlockedIncrement64(hit ? &stats->cache_hits : &stats->cache_misses);
+	if (hit) {
+		patch_stats_owner_set(stats);
+	}
+}
+
+patch_stats_t* patch_stats_owner_begin(void)
+{
+	patch_stats_owner_tls_t *tls = patch_stats_owner_tls_get();
+	if (!tls) {
+		return nullptr;
+	}
+	patch_stats_t *ret = tls->owner;
+	tls->owner = nullptr;
+	return ret;
+}
+
+patch_stats_t* patch_stats_owner_end(patch_stats_t *prev)
+{
+	patch_stats_owner_tls_t *tls = patch_stats_owner_tls_get();
+	if (!tls) {
+		return nullptr;
+	}
+	patch_stats_t *ret = tls->owner;
+	if (!ret) {
+		tls->owner = prev;
+	}
+	return ret;
+}
+
+void patch_stats_print(void)
+{
+	std::vector<patch_stats_t*> rows;
+	AcquireSRWLockShared(&patch_stats_srwlock);
+	for (const auto &it : patch_stats_map) {
+		rows.push_back(it.second);
+	}
+	ReleaseSRWLockShared(&patch_stats_srwlock);
+	std::sort(rows.begin(), rows.end(), [](const patch_stats_t *a, const patch_stats_t *b) {
+		return a->level != b->level ? a->level < b->level : a->id < b->id;
+	});
+	rows.push_back(&patch_stats_unattributed);
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	const double ticks_per_ms = (double)freq.QuadPart / 1000.0;
+
+	log_print(
+		"---------------------------\n"
+		"Per-patch costs:\n"
+		"Patch                  Files    Read MiB  JSON layers  JSON MiB   JSON ms   Hooks   Hook ms  Cache hits\n"
+	);
+	for (const patch_stats_t *stats : rows) {
+		const LONG64 lookups = stats->cache_hits + stats->cache_misses;
+		if (!stats->files && !stats->json_layers && !stats->hook_runs && !lookups) {
+			continue;
+		}
+		char hit_rate[16] = "-";
+		if (lookups) {
+			snprintf(hit_rate, sizeof(hit_rate), "%.1f%%", 100.0 * stats->cache_hits / lookups);
+		}
+		log_printf("%-20s %7lld %11.2f %12lld %9.2f %9.1f %7lld %9.1f %11s\n",
+			stats->id.c_str(),
+			stats->files, stats->file_bytes / (1024.0 * 1024.0),
+			stats->json_layers, stats->json_bytes / (1024.0 * 1024.0), stats->json_ticks / ticks_per_ms,
+			stats->hook_runs, stats->hook_ticks / ticks_per_ms,
+			hit_rate
+		);
+	}
+	log_print("---------------------------\n");
+}
+
+void patch_stats_mod_exit(void)
+{
+	patch_stats_print();
+}
@@ -0,0 +1,57 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Per-patch cost attribution.
+  * Charges the files served from a patch, the JSON layers it contributes and
+  * the patch hooks run on its files to the patch itself, to find out which
+  * patch in a stack is responsible for slow loading or high memory usage.
+  * Counters are kept by patch ID, so they survive repatching. Reported in
+  * the log on exit.
+  *
+  * A file patched by hooks is charged to its owner: the highest patch that
+  * contributed a .jdiff layer to it, or the patch that provided its
+  * replacement file if no patch did. Files that neither patch ever touched
+  * go into an "unattributed" row.
+  */
+
+#pragma once
+
+typedef struct patch_stats_t patch_stats_t;
+
+// Returns the counters of [patch_info], creating them if necessary. Never
+// NULL, and valid until the process exits.
+patch_stats_t* patch_stats_get(const patch_t *patch_info);
+
+// Returns a timestamp for the [ticks] parameters below.
+LONGLONG patch_stats_now(void);
+
+// Charges a file of [size] bytes served from the patch of [stats].
+void patch_stats_file(patch_stats_t *stats, size_t size);
+
+// Charges a JSON layer of [size] bytes, loaded and merged since [start].
+void patch_stats_json(patch_stats_t *stats, size_t size, LONGLONG start);
+
+// Charges the hooks run since [start]. [stats] can be NULL.
+void patch_stats_hooks(patch_stats_t *stats, LONGLONG start);
+
+// Records a hit or miss of a cache that saved work for the patch of
+// [stats]. [stats] can be NULL.
+void patch_stats_cache(patch_stats_t *stats, bool hit);
+
+// Starts recording the owner of the file about to be resolved on the
+// calling thread. Every patch_stats_file(), patch_stats_json() or cache hit
+// on the same thread replaces the owner. Returns the owner recorded so far,
+// which has to be passed to the matching patch_stats_owner_end().
+patch_stats_t* patch_stats_owner_begin(void);
+// Returns the owner recorded since patch_stats_owner_begin(), or NULL. In
+// the latter case, [prev] becomes the owner again, so that recordings can
+// be nested.
+patch_stats_t* patch_stats_owner_end(patch_stats_t *prev);
+
+// Logs the counters of every patch.
+void patch_stats_print(void);
+
+void patch_stats_mod_exit(void);
@@ -8,15 +8,27 @@
   */
 
 #include "thcrap.h"
+#include "wildcard.h"
 #include <algorithm>
+#include <deque>
 #include <list>
+#include <memory>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
 
 struct patchhook_t
 {
 	const char *wildcard;
 	func_patch_t patch_func;
 	func_patch_size_t patch_size_func;
+	func_patch_stream_t stream_func;
+	// Two-phase replacement for [patch_func].
+	func_patch_compile_t compile_func;
+	func_patch_apply_t apply_func;
+	func_patch_plan_free_t plan_free_func;
+	// Set if the result of [patch_func] only depends on its parameters.
+	bool cacheable;
 };
 
 std::vector<patchhook_t> patchhooks;
@@ -45,7 +57,14 @@ void* file_stream_read(HANDLE stream, size_t *file_size)
 	*file_size = GetFileSize(stream, nullptr);
 	if(*file_size != 0) {
 		ret = malloc(*file_size);
-		ReadFile(stream, ret, *file_size, &byte_ret, nullptr);
+		if(!ret && cache_mgr_reclaim(*file_size)) {
+			ret = malloc(*file_size);
+		}
+		if(ret) {
+			ReadFile(stream, ret, *file_size, &byte_ret, nullptr);
+		} else {
+			*file_size = 0;
+		}
 	}
 	CloseHandle(stream);
 	return ret;
@@ -56,6 +75,48 @@ void* file_read(const char *fn, size_t *file_size)
 	return file_stream_read(file_stream(fn), file_size);
 }
 
+const void* file_stream_map(HANDLE stream, size_t *file_size)
+{
+	const void *ret = nullptr;
+	size_t file_size_tmp;
+	if(!file_size) {
+		file_size = &file_size_tmp;
+	}
+	*file_size = 0;
+	if(stream == INVALID_HANDLE_VALUE) {
+		return ret;
+	}
+
+	DWORD size = GetFileSize(stream, nullptr);
+	if(size != 0 && size != INVALID_FILE_SIZE) {
+		HANDLE mapping = CreateFileMappingU(
+			stream, nullptr, PAGE_READONLY, 0, 0, nullptr
+		);
+		if(mapping) {
+			ret = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			// The view keeps the mapping alive on its own.
+			CloseHandle(mapping);
+		}
+		if(ret) {
+			*file_size = size;
+		}
+	}
+	CloseHandle(stream);
+	return ret;
+}
+
+const void* file_map(const char *fn, size_t *file_size)
+{
+	return file_stream_map(file_stream(fn), file_size);
+}
+
+void file_unmap(const void *view)
+{
+	if(view && !patch_pack_unmap(view)) {
+		UnmapViewOfFile(view);
+	}
+}
+
 int file_write(const char *fn, const void *file_buffer, const size_t file_size)
 {
 	if(!fn || !file_buffer || !file_size) {
@@ -79,52 +140,95 @@ int file_write(const char *fn, const void *file_buffer, const size_t file_size)
 	return ret;
 }
 
-char* fn_for_build(const char *fn)
+/// Thread-local file name buffers
+/// ------------------------------
+// One buffer per function, so that the result of one can be passed to
+// another.
+struct fn_tls_t {
+	std::string game;
+	std::string build;
+	std::string patch;
+};
+
+static void fn_tls_ctor(fn_tls_t *tls, size_t)
 {
-	const char *build = runconfig_build_get();
-	size_t name_len;
-	size_t ret_len;
-	const char *first_ext = fn;
-	char *ret;
+	new (tls) fn_tls_t{};
+}
+
+static void fn_tls_dtor(fn_tls_t *tls)
+{
+	tls->~fn_tls_t();
+}
+
+THREAD_LOCAL(fn_tls_t, fn_tls, fn_tls_ctor, fn_tls_dtor);
 
+const char* fn_for_build_tls(const char *fn)
+{
+	const char *build = runconfig_build_get();
 	if(!fn || !build) {
 		return NULL;
 	}
-	ret_len = strlen(fn) + 1 + strlen(build) + 1;
-	ret = (char*)malloc(ret_len);
-	if(!ret) {
-		return NULL;
-	}
+	std::string& ret = fn_tls_get()->build;
 
 	// We need to do this on our own here because the build ID should be placed
 	// *before* the first extension.
-	while(*first_ext && *first_ext != '.') {
-		first_ext++;
+	const char *first_ext = strchr(fn, '.');
+	if(!first_ext) {
+		first_ext = fn + strlen(fn);
 	}
-	name_len = (first_ext - fn);
-	strncpy(ret, fn, name_len);
-	sprintf(ret + name_len, ".%s%s", build, first_ext);
-	return ret;
+	ret.assign(fn, first_ext - fn);
+	ret += '.';
+	ret += build;
+	ret += first_ext;
+	return ret.c_str();
 }
 
-char* fn_for_game(const char *fn)
+const char* fn_for_game_tls(const char *fn)
 {
+	if(!fn) {
+		return NULL;
+	}
 	const char *game_id = runconfig_game_get();
-	if (!game_id) {
-		return strdup(fn);
-	} else if (!fn) {
+	if(!game_id) {
+		return fn;
+	}
+	std::string& ret = fn_tls_get()->game;
+	ret.assign(game_id);
+	ret += '/';
+	ret += fn;
+	return ret.c_str();
+}
+
+const char* fn_for_patch_tls(const patch_t *patch_info, const char *fn)
+{
+	if(!patch_info || !patch_info->archive || !fn) {
 		return NULL;
 	}
-	size_t game_id_len = strlen(game_id) + 1;
-	char *full_fn;
+	std::string& ret = fn_tls_get()->patch;
+	ret.assign(patch_info->archive);
+	if(ret.empty() || (ret.back() != '/' && ret.back() != '\\')) {
+		ret += '/';
+	}
+	ret += fn;
+	str_slash_normalize(&ret[0]);
+	return ret.c_str();
+}
+/// ------------------------------
 
-	full_fn = (char*)malloc(game_id_len + strlen(fn) + 1);
+char* fn_for_build(const char *fn)
+{
+	const char *ret = fn_for_build_tls(fn);
+	return ret ? strdup(ret) : NULL;
+}
 
-	full_fn[0] = 0; // Because strcat
-	strncpy(full_fn, game_id, game_id_len);
-	strcat(full_fn, "/");
-	strcat(full_fn, fn);
-	return full_fn;
+char* fn_for_game(const char *fn)
+{
+	const char *game_id = runconfig_game_get();
+	if (!game_id) {
+		return strdup(fn);
+	}
+	const char *ret = fn_for_game_tls(fn);
+	return ret ? strdup(ret) : NULL;
 }
 
 void patch_print_fn(const patch_t *patch_info, const char *fn)
@@ -166,27 +270,257 @@ int dir_create_for_fn(const char *fn)
 
 char* fn_for_patch(const patch_t *patch_info, const char *fn)
 {
-	size_t patch_fn_len;
-	char *patch_fn = NULL;
+	const char *ret = fn_for_patch_tls(patch_info, fn);
+	return ret ? strdup(ret) : NULL;
+}
 
-	if(!patch_info || !patch_info->archive || !fn) {
-		return NULL;
+/// Patch file index
+/// ----------------
+/**
+  * Every file lookup through the patch stack otherwise costs one file system
+  * probe per patch and chain entry, most of which are misses. While the
+  * repatch watcher is running, we instead enumerate each patch directory once
+  * and answer existence queries from memory. Any change reported by the
+  * watcher (see repatch_collector()), or made through patch_file_store() and patch_file_delete(), drops
+  * the indexes, which are then lazily rebuilt on the next lookup.
+  */
+struct patch_index_t
+{
+	// Relative to the archive, lowercase, with forward slashes. Files map to
+	// their size, so that size queries don't need to open them.
+	std::unordered_map<std::string, uint64_t> files;
+	std::unordered_set<std::string> dirs;
+	// False if the archive couldn't be enumerated.
+	bool valid = false;
+};
+
+static std::unordered_map<std::string, patch_index_t> patch_indexes;
+static SRWLOCK patch_index_srwlock = { SRWLOCK_INIT };
+static bool patch_index_enabled = false;
+// Incremented on every invalidation, so that an index that was enumerated
+// while the directory was changing doesn't get cached.
+static size_t patch_index_generation = 0;
+
+static void patch_index_enumerate(patch_index_t &index, const std::string &dir, const std::string &rel)
+{
+	WIN32_FIND_DATAA w32fd;
+	HANDLE hFind = FindFirstFile((dir + rel + "*").c_str(), &w32fd);
+	if(hFind == INVALID_HANDLE_VALUE) {
+		return;
 	}
-	/*
-	if(archive[archive_len - 1] != '\\' && archive[archive_len - 1] != '/') {
-		// ZIP archives not yet supported
-		return NULL;
+	BOOL ret = 0;
+	while(!ret) {
+		const char *name = w32fd.cFileName;
+		if(strcmp(name, ".") && strcmp(name, "..")) {
+			std::string key = rel + name;
+			for(auto &c : key) {
+				c = (c >= 'A' && c <= 'Z') ? (c + ('a' - 'A')) : c;
+			}
+			if(w32fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				index.dirs.insert(key);
+				patch_index_enumerate(index, dir, key + "/");
+			} else {
+				index.files.emplace(key, ((uint64_t)w32fd.nFileSizeHigh << 32) | w32fd.nFileSizeLow);
+			}
+		}
+		ret = W32_ERR_WRAP(FindNextFile(hFind, &w32fd));
 	}
-	*/
-	// patch_fn = archive + fn
-	patch_fn_len = strlen(patch_info->archive) + 1 + strlen(fn) + 1;
-	patch_fn = (char*)malloc(patch_fn_len * sizeof(char));
+	FindClose(hFind);
+}
 
-	strcpy(patch_fn, patch_info->archive);
-	PathAddBackslashU(patch_fn);
-	strcat(patch_fn, fn);
-	str_slash_normalize(patch_fn);
-	return patch_fn;
+// Turns [fn] into an index key. Returns false for names that could point
+// outside of the archive or can't be matched reliably, which are then left
+// to the file system.
+bool patch_index_key(std::string &key, const char *fn, bool &ascii)
+{
+	ascii = true;
+	key.clear();
+	for(const char *p = fn; *p; p++) {
+		char c = *p;
+		if(c == '\\') {
+			c = '/';
+		}
+		if(c == '/') {
+			if(key.empty() || key.back() == '/') {
+				if(p == fn) {
+					return false;
+				}
+				continue;
+			}
+		} else if(c == ':') {
+			return false;
+		} else if(c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		} else if((unsigned char)c >= 0x80) {
+			ascii = false;
+		}
+		key += c;
+	}
+	if(!key.empty() && key.back() == '/') {
+		key.pop_back();
+	}
+	if(
+		key.empty() || key == "." || key == ".."
+		|| !key.compare(0, 2, "./") || !key.compare(0, 3, "../")
+		|| key.find("/./") != std::string::npos
+		|| key.find("/../") != std::string::npos
+		|| (key.size() >= 3 && !key.compare(key.size() - 3, 3, "/.."))
+		|| (key.size() >= 2 && !key.compare(key.size() - 2, 2, "/."))
+	) {
+		return false;
+	}
+	return true;
+}
+
+static patch_index_result_t patch_index_find(const patch_index_t &index, const std::string &key, bool ascii, uint64_t *file_size = nullptr)
+{
+	if(!index.valid) {
+		return PATCH_INDEX_UNKNOWN;
+	}
+	auto file = index.files.find(key);
+	if(file != index.files.end()) {
+		if(file_size) {
+			*file_size = file->second;
+		}
+		return PATCH_INDEX_FILE;
+	} else if(index.dirs.count(key)) {
+		return PATCH_INDEX_DIRECTORY;
+	}
+	// We only fold ASCII case, so a miss on any other name might
+	// still be a hit on the file system.
+	return ascii ? PATCH_INDEX_MISSING : PATCH_INDEX_UNKNOWN;
+}
+
+static bool patch_index_archive(std::string &archive, const patch_t *patch_info)
+{
+	if(!patch_info || !patch_info->archive || !patch_info->archive[0]) {
+		return false;
+	}
+	archive = patch_info->archive;
+	str_slash_normalize(&archive[0]);
+	if(archive.back() != '/') {
+		archive += '/';
+	}
+	return true;
+}
+
+static void patch_index_fill(patch_index_t &index, const std::string &archive)
+{
+	DWORD attr = GetFileAttributesU(archive.c_str());
+	if(attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY)) {
+		patch_index_enumerate(index, archive, "");
+		index.valid = true;
+	}
+}
+
+// Same as patch_index_lookup(), but also returns the size of files.
+static patch_index_result_t patch_index_lookup_size(const patch_t *patch_info, const char *fn, uint64_t *file_size)
+{
+	if(!patch_index_enabled || !fn) {
+		return PATCH_INDEX_UNKNOWN;
+	}
+	std::string key;
+	bool ascii;
+	if(!patch_index_key(key, fn, ascii)) {
+		return PATCH_INDEX_UNKNOWN;
+	}
+	std::string archive;
+	if(!patch_index_archive(archive, patch_info)) {
+		return PATCH_INDEX_UNKNOWN;
+	}
+
+	auto lookup = [&key, ascii, file_size](const patch_index_t &index) {
+		return patch_index_find(index, key, ascii, file_size);
+	};
+
+	AcquireSRWLockShared(&patch_index_srwlock);
+	auto it = patch_indexes.find(archive);
+	if(it != patch_indexes.end()) {
+		auto ret = lookup(it->second);
+		ReleaseSRWLockShared(&patch_index_srwlock);
+		return ret;
+	}
+	size_t generation = patch_index_generation;
+	ReleaseSRWLockShared(&patch_index_srwlock);
+
+	patch_index_t index;
+	patch_index_fill(index, archive);
+	auto ret = lookup(index);
+
+	AcquireSRWLockExclusive(&patch_index_srwlock);
+	if(generation == patch_index_generation) {
+		patch_indexes.emplace(archive, std::move(index));
+	}
+	ReleaseSRWLockExclusive(&patch_index_srwlock);
+	return ret;
+}
+
+patch_index_result_t patch_index_lookup(const patch_t *patch_info, const char *fn)
+{
+	return patch_index_lookup_size(patch_info, fn, nullptr);
+}
+
+void patch_index_invalidate(void)
+{
+	AcquireSRWLockExclusive(&patch_index_srwlock);
+	patch_indexes.clear();
+	patch_index_generation++;
+	ReleaseSRWLockExclusive(&patch_index_srwlock);
+}
+
+void patch_index_enable(int enable)
+{
+	patch_index_invalidate();
+	patch_index_enabled = enable != 0;
+}
+
+patch_index_t* patch_index_snapshot(const patch_t *patch_info)
+{
+	std::string archive;
+	if(!patch_index_archive(archive, patch_info)) {
+		return nullptr;
+	}
+	patch_index_t *index = new patch_index_t;
+	patch_index_fill(*index, archive);
+	return index;
+}
+
+patch_index_result_t patch_index_snapshot_lookup(const patch_index_t *index, const char *fn)
+{
+	std::string key;
+	bool ascii;
+	if(!index || !fn || !patch_index_key(key, fn, ascii)) {
+		return PATCH_INDEX_UNKNOWN;
+	}
+	return patch_index_find(*index, key, ascii);
+}
+
+void patch_index_snapshot_free(patch_index_t *index)
+{
+	delete index;
+}
+/// ----------------
+
+patch_index_result_t patch_file_pack_lookup(const patch_t *patch_info, const char *fn, const patch_pack_t **pack, const patch_pack_entry_t **entry)
+{
+	*pack = nullptr;
+	*entry = nullptr;
+	if(!fn || patch_file_blacklisted(patch_info, fn)) {
+		return PATCH_INDEX_UNKNOWN;
+	}
+	const patch_pack_t *patch_pack = patch_pack_get(patch_info);
+	std::string key;
+	bool ascii;
+	if(!patch_pack || !patch_index_key(key, fn, ascii)) {
+		return PATCH_INDEX_UNKNOWN;
+	}
+	auto ret = patch_pack_find(patch_pack, key.data(), key.size(), entry);
+	if(ret == PATCH_INDEX_MISSING) {
+		// Not in the pack, but maybe in the directory.
+		return PATCH_INDEX_UNKNOWN;
+	}
+	*pack = patch_pack;
+	return ret;
 }
 
 int patch_file_exists(const patch_t *patch_info, const char *fn)
@@ -195,10 +529,22 @@ int patch_file_exists(const patch_t *patch_info, const char *fn)
 		return false;
 	}
 
-	char *patch_fn = fn_for_patch(patch_info, fn);
-	BOOL ret = PathFileExists(patch_fn);
-	SAFE_FREE(patch_fn);
-	return ret;
+	const patch_pack_t *pack;
+	const patch_pack_entry_t *entry;
+	if(patch_file_pack_lookup(patch_info, fn, &pack, &entry) != PATCH_INDEX_UNKNOWN) {
+		return true;
+	}
+
+	switch(patch_index_lookup(patch_info, fn)) {
+	case PATCH_INDEX_MISSING:
+		return false;
+	case PATCH_INDEX_FILE:
+	case PATCH_INDEX_DIRECTORY:
+		return true;
+	default:
+		break;
+	}
+	return PathFileExists(fn_for_patch_tls(patch_info, fn));
 }
 
 int patch_file_blacklisted(const patch_t *patch_info, const char *fn)
@@ -214,33 +560,142 @@ int patch_file_blacklisted(const patch_t *patch_info, const char *fn)
 	return 0;
 }
 
+int patch_file_size(const patch_t *patch_info, const char *fn, size_t *file_size)
+{
+	*file_size = 0;
+	const patch_pack_t *pack;
+	const patch_pack_entry_t *entry;
+	switch(patch_file_pack_lookup(patch_info, fn, &pack, &entry)) {
+	case PATCH_INDEX_FILE:
+		*file_size = entry->size;
+		return 1;
+	case PATCH_INDEX_DIRECTORY:
+		return 0;
+	default:
+		break;
+	}
+	if(!fn || patch_file_blacklisted(patch_info, fn)) {
+		return 0;
+	}
+	uint64_t index_size;
+	switch(patch_index_lookup_size(patch_info, fn, &index_size)) {
+	case PATCH_INDEX_FILE:
+		*file_size = (size_t)index_size;
+		return 1;
+	case PATCH_INDEX_MISSING:
+	case PATCH_INDEX_DIRECTORY:
+		return 0;
+	default:
+		break;
+	}
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	if(
+		!GetFileAttributesEx(fn_for_patch_tls(patch_info, fn), GetFileExInfoStandard, &attr)
+		|| (attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+	) {
+		return 0;
+	}
+	*file_size = attr.nFileSizeLow;
+	return 1;
+}
+
 HANDLE patch_file_stream(const patch_t *patch_info, const char *fn)
 {
 	if(patch_file_blacklisted(patch_info, fn)) {
 		return INVALID_HANDLE_VALUE;
 	}
-	auto *patch_fn = fn_for_patch(patch_info, fn);
-	auto ret = file_stream(patch_fn);
-	SAFE_FREE(patch_fn);
-	return ret;
+	auto index_ret = patch_index_lookup(patch_info, fn);
+	if(index_ret == PATCH_INDEX_MISSING || index_ret == PATCH_INDEX_DIRECTORY) {
+		SetLastError(ERROR_FILE_NOT_FOUND);
+		return INVALID_HANDLE_VALUE;
+	}
+	return file_stream(fn_for_patch_tls(patch_info, fn));
 }
 
 void* patch_file_load(const patch_t *patch_info, const char *fn, size_t *file_size)
 {
-	return file_stream_read(patch_file_stream(patch_info, fn), file_size);
+	const patch_pack_t *pack;
+	const patch_pack_entry_t *entry;
+	switch(patch_file_pack_lookup(patch_info, fn, &pack, &entry)) {
+	case PATCH_INDEX_FILE:
+		return patch_pack_load(pack, entry, file_size);
+	case PATCH_INDEX_DIRECTORY:
+		return file_stream_read(INVALID_HANDLE_VALUE, file_size);
+	default:
+		return file_stream_read(patch_file_stream(patch_info, fn), file_size);
+	}
+}
+
+const void* patch_file_map(const patch_t *patch_info, const char *fn, size_t *file_size)
+{
+	const patch_pack_t *pack;
+	const patch_pack_entry_t *entry;
+	switch(patch_file_pack_lookup(patch_info, fn, &pack, &entry)) {
+	case PATCH_INDEX_FILE:
+		return patch_pack_map(pack, entry, file_size);
+	case PATCH_INDEX_DIRECTORY:
+		return file_stream_map(INVALID_HANDLE_VALUE, file_size);
+	default:
+		return file_stream_map(patch_file_stream(patch_info, fn), file_size);
+	}
 }
 
 int patch_file_store(const patch_t *patch_info, const char *fn, const void *file_buffer, const size_t file_size)
 {
-	char *patch_fn = fn_for_patch(patch_info, fn);
-	int ret = file_write(patch_fn, file_buffer, file_size);
-	SAFE_FREE(patch_fn);
+	int ret = file_write(fn_for_patch_tls(patch_info, fn), file_buffer, file_size);
+	if(patch_index_enabled) {
+		patch_index_invalidate();
+	}
+	stack_json_cache_evict(fn);
+	return ret;
+}
+
+int patch_file_replace(const patch_t *patch_info, const char *fn, const char *src_fn)
+{
+	const char *patch_fn = fn_for_patch_tls(patch_info, fn);
+	int ret = -1;
+	if(patch_fn && src_fn && dir_create_for_fn(patch_fn) >= 0) {
+		ret = W32_ERR_WRAP(MoveFileExU(src_fn, patch_fn, MOVEFILE_REPLACE_EXISTING));
+	}
+	if(patch_index_enabled) {
+		patch_index_invalidate();
+	}
+	stack_json_cache_evict(fn);
 	return ret;
 }
 
 json_t* patch_json_load(const patch_t *patch_info, const char *fn, size_t *file_size)
 {
-	char *_fn = fn_for_patch(patch_info, fn);
+	const patch_pack_t *pack;
+	const patch_pack_entry_t *entry;
+	switch(patch_file_pack_lookup(patch_info, fn, &pack, &entry)) {
+	case PATCH_INDEX_FILE: {
+		size_t json_size;
+		const void *view = patch_pack_map(pack, entry, &json_size);
+		json_t *file_json = json_loadb_report(view, json_size, fn_for_patch_tls(patch_info, fn));
+		file_unmap(view);
+		if(file_size) {
+			*file_size = json_size;
+		}
+		return file_json;
+	}
+	case PATCH_INDEX_DIRECTORY:
+		if(file_size) {
+			*file_size = 0;
+		}
+		return NULL;
+	default:
+		break;
+	}
+
+	auto index_ret = patch_index_lookup(patch_info, fn);
+	if(index_ret == PATCH_INDEX_MISSING || index_ret == PATCH_INDEX_DIRECTORY) {
+		if(file_size) {
+			*file_size = 0;
+		}
+		return NULL;
+	}
+	const char *_fn = fn_for_patch_tls(patch_info, fn);
 	json_t *file_json = json_load_file_report(_fn);
 
 	if(file_size) {
@@ -253,7 +708,6 @@ json_t* patch_json_load(const patch_t *patch_info, const char *fn, size_t *file_
 			*file_size = 0;
 		}
 	}
-	SAFE_FREE(_fn);
 	return file_json;
 }
 
@@ -261,15 +715,14 @@ size_t patch_json_merge(json_t **json_inout, const patch_t *patch_info, const ch
 {
 	size_t file_size = 0;
 	if(fn && json_inout) {
+		const LONGLONG start = patch_stats_now();
 		json_t *json_new = patch_json_load(patch_info, fn, &file_size);
 		if(json_new) {
-			patch_print_fn(patch_info, fn);
-			if(!*json_inout) {
-				*json_inout = json_new;
-			} else {
-				json_object_merge(*json_inout, json_new);
-				json_decref(json_new);
+			if(log_level_enabled(LOG_LEVEL_DEBUG)) {
+				patch_print_fn(patch_info, fn);
 			}
+			*json_inout = json_object_merge_new(*json_inout, json_new);
+			patch_stats_json(patch_stats_get(patch_info), file_size, start);
 		}
 	}
 	return file_size;
@@ -291,9 +744,11 @@ int patch_json_store(const patch_t *patch_info, const char *fn, const json_t *js
 
 int patch_file_delete(const patch_t *patch_info, const char *fn)
 {
-	char *patch_fn = fn_for_patch(patch_info, fn);
-	int ret = W32_ERR_WRAP(DeleteFile(patch_fn));
-	SAFE_FREE(patch_fn);
+	int ret = W32_ERR_WRAP(DeleteFile(fn_for_patch_tls(patch_info, fn)));
+	if(patch_index_enabled) {
+		patch_index_invalidate();
+	}
+	stack_json_cache_evict(fn);
 	return ret;
 }
 
@@ -345,15 +800,15 @@ patch_desc_t patch_dep_to_desc(const char *dep_str)
 	return desc;
 }
 
-static std::unordered_map<std::string, patch_val_t> patch_options;
+// Options are interned on first use, and their slots are never removed, so
+// that compiled expressions can point straight at them.
+static std::unordered_map<std::string, size_t> patch_option_ids;
+static std::deque<patch_val_t> patch_option_slots;
+static SRWLOCK patch_options_srwlock = { SRWLOCK_INIT };
 
-patch_t patch_init(const char *patch_path, const json_t *patch_info, size_t level)
+// Returns the absolute archive path for [patch_path], with forward slashes.
+static char* patch_archive_from_path(const char *patch_path)
 {
-	patch_t patch = {};
-
-	if (patch_path == nullptr) {
-		return patch;
-	}
 	if (PathIsRelativeU(patch_path)) {
 		// Add the current directory to the patch archive field
 		size_t full_patch_path_len = strlen(patch_path) + GetCurrentDirectoryU(0, NULL) + 2;
@@ -361,16 +816,61 @@ patch_t patch_init(const char *patch_path, const json_t *patch_info, size_t leve
 		GetCurrentDirectoryU(full_patch_path_len, full_patch_path);
 		strcpy(PathAddBackslashU(full_patch_path), patch_path);
 		str_slash_normalize(full_patch_path);
-		patch.archive = full_patch_path;
+		return full_patch_path;
 	}
-	else {
-		patch.archive = strdup(patch_path);
-		str_slash_normalize(patch.archive);
+	char *archive = strdup(patch_path);
+	str_slash_normalize(archive);
+	return archive;
+}
+
+// Fills all fields of [patch] except for its archive from [patch_info] and
+// [patch_js], the already loaded patch.js, which is consumed.
+static void patch_init_from_js(patch_t &patch, const json_t *patch_info, size_t level, json_t *patch_js);
+
+patch_t patch_init(const char *patch_path, const json_t *patch_info, size_t level)
+{
+	patch_t patch = {};
+
+	if (patch_path == nullptr) {
+		return patch;
 	}
+	patch.archive = patch_archive_from_path(patch_path);
+	patch_init_from_js(patch, patch_info, level, patch_json_load(&patch, "patch.js", NULL));
+	return patch;
+}
+
+// Reading patch.js is the only part of patch_init() that touches the disk,
+// and everything after it can depend on the order of the patches (patch
+// test options, for example), so only the reading happens in parallel.
+#define PATCH_INIT_MAX_THREADS 8
+
+void patch_init_multiple(patch_t *out, json_t *const *patch_infos, size_t count, size_t level)
+{
+	std::vector<json_t*> patch_jses(count);
+	for (size_t i = 0; i < count; i++) {
+		out[i] = {};
+		const char *patch_path = json_object_get_string(patch_infos[i], "archive");
+		if (patch_path) {
+			out[i].archive = patch_archive_from_path(patch_path);
+		}
+	}
+	parallel_for(count, PATCH_INIT_MAX_THREADS, [out, &patch_jses](size_t i) {
+		if (out[i].archive) {
+			patch_jses[i] = patch_json_load(&out[i], "patch.js", NULL);
+		}
+	});
+	for (size_t i = 0; i < count; i++) {
+		if (out[i].archive) {
+			patch_init_from_js(out[i], patch_infos[i], level + i, patch_jses[i]);
+		}
+	}
+}
+
+static void patch_init_from_js(patch_t &patch, const json_t *patch_info, size_t level, json_t *patch_js)
+{
 	patch.config = json_object_get(patch_info, "config");
 	// Merge the runconfig patch array and the patch.js
 	json_t *runconfig_js = json_deep_copy(patch_info);
-	json_t *patch_js = patch_json_load(&patch, "patch.js", NULL);
 	patch_js = json_object_merge(patch_js, runconfig_js);
 	json_decref_safe(runconfig_js);
 
@@ -441,7 +941,7 @@ patch_t patch_init(const char *patch_path, const json_t *patch_info, size_t leve
 		patch_val_t patch_test_opt;
 		patch_test_opt.type = VT_DWORD;
 		patch_test_opt.i = patch.version;
-		patch_options[patch_test_opt_name] = patch_test_opt;
+		*patch_opt_slot(patch_test_opt_name, strlen(patch_test_opt_name)) = patch_test_opt;
 		free(patch_test_opt_name);
 	}
 
@@ -492,7 +992,6 @@ patch_t patch_init(const char *patch_path, const json_t *patch_info, size_t leve
 	}
 
 	json_decref(patch_js);
-	return patch;
 }
 
 json_t *patch_to_runconfig_json(const patch_t *patch)
@@ -589,7 +1088,81 @@ int patch_rel_to_abs(patch_t *patch_info, const char *base_path)
 	return 1;
 }
 
+/// Hook matching
+/// -------------
+// Compiled wildcard specs of every hook in [patchhooks], by index
+static std::vector<std::vector<wildcard_spec_t>> patchhook_specs;
+// Indices of hooks with a single "*.ext" spec, by their lowercase
+// extension, and indices of every other hook
+static std::unordered_map<std::string, std::vector<size_t>> patchhook_ext_buckets;
+static std::vector<size_t> patchhook_globs;
+
+// Hook arrays for every file name passed to patchhooks_build(). These are
+// retired rather than freed when a new hook is registered, since file
+// replacement states can still hold on to them.
+static std::unordered_map<std::string, patchhook_t*> patchhook_cache;
+static std::vector<patchhook_t*> patchhook_cache_retired;
+static SRWLOCK patchhook_srwlock = { SRWLOCK_INIT };
+
+// Returns the extension bucket key of a suffix spec or a file name,
+// or an empty string if it has none.
+static std::string patchhook_ext_key(const char *fn, size_t fn_len)
+{
+	for (size_t i = fn_len; i-- > 0;) {
+		if (fn[i] == '.') {
+			std::string key;
+			for (i++; i < fn_len; i++) {
+				key += wildcard_tolower(fn[i]);
+			}
+			return key;
+		}
+		else if (fn[i] == '/') {
+			break;
+		}
+	}
+	return std::string();
+}
+
+static void patchhook_add(const char *wildcard, patchhook_t hook);
+
 void patchhook_register(const char *wildcard, func_patch_t patch_func, func_patch_size_t patch_size_func)
+{
+	patchhook_t hook = {};
+	hook.patch_func = patch_func;
+	hook.patch_size_func = patch_size_func;
+	patchhook_add(wildcard, hook);
+}
+
+void patchhook_register_stream(const char *wildcard, func_patch_t patch_func, func_patch_size_t patch_size_func, func_patch_stream_t stream_func)
+{
+	patchhook_t hook = {};
+	hook.patch_func = patch_func;
+	hook.patch_size_func = patch_size_func;
+	hook.stream_func = stream_func;
+	patchhook_add(wildcard, hook);
+}
+
+void patchhook_register_cacheable(const char *wildcard, func_patch_t patch_func, func_patch_size_t patch_size_func)
+{
+	patchhook_t hook = {};
+	hook.patch_func = patch_func;
+	hook.patch_size_func = patch_size_func;
+	hook.cacheable = true;
+	patchhook_add(wildcard, hook);
+}
+
+void patchhook_register_compiled(const char *wildcard, func_patch_compile_t compile_func, func_patch_apply_t apply_func, func_patch_plan_free_t plan_free_func, func_patch_size_t patch_size_func)
+{
+	patchhook_t hook = {};
+	hook.patch_size_func = patch_size_func;
+	hook.compile_func = compile_func;
+	hook.apply_func = apply_func;
+	hook.plan_free_func = plan_free_func;
+	hook.cacheable = true;
+	patchhook_add(wildcard, hook);
+}
+
+static void patchhook_add(const char *wildcard, patchhook_t hook)
 {
 	char *wildcard_normalized = strdup(wildcard);
 	str_slash_normalize(wildcard_normalized);
@@ -598,35 +1171,93 @@ void patchhook_register(const char *wildcard, func_patch_t patch_func, func_patc
 	// pointers here! Some game support code might only want to hook
 	// [patch_size_func] to e.g. conveniently run some generic, non-
 	// file-related code as early as possible.
-	patchhook_t hook = {};
 	hook.wildcard = wildcard_normalized;
-	hook.patch_func = patch_func;
-	hook.patch_size_func = patch_size_func;
+
+	std::vector<wildcard_spec_t> specs = wildcard_specs_compile(wildcard_normalized);
+
+	AcquireSRWLockExclusive(&patchhook_srwlock);
+	const size_t index = patchhooks.size();
 	patchhooks.push_back(hook);
+
+	std::string ext;
+	if (specs.size() == 1 && specs[0].suffix_only) {
+		ext = patchhook_ext_key(specs[0].pattern.c_str(), specs[0].pattern.length());
+	}
+	if (!ext.empty()) {
+		patchhook_ext_buckets[ext].push_back(index);
+	}
+	else {
+		patchhook_globs.push_back(index);
+	}
+	patchhook_specs.push_back(std::move(specs));
+
+	for (auto& cached : patchhook_cache) {
+		if (cached.second) {
+			patchhook_cache_retired.push_back(cached.second);
+		}
+	}
+	patchhook_cache.clear();
+	ReleaseSRWLockExclusive(&patchhook_srwlock);
 }
 
-patchhook_t *patchhooks_build(const char *fn)
+static patchhook_t *patchhooks_match(const char *fn, size_t fn_len)
+{
+	std::vector<size_t> matches;
+	auto bucket = patchhook_ext_buckets.find(patchhook_ext_key(fn, fn_len));
+	if (bucket != patchhook_ext_buckets.end()) {
+		for (size_t i : bucket->second) {
+			if (wildcard_spec_match(patchhook_specs[i][0], fn, fn_len)) {
+				matches.push_back(i);
+			}
+		}
+	}
+	for (size_t i : patchhook_globs) {
+		if (wildcard_specs_match(patchhook_specs[i], fn, fn_len)) {
+			matches.push_back(i);
+		}
+	}
+	if (matches.empty()) {
+		return nullptr;
+	}
+	// Hooks run in the order they were registered
+	std::sort(matches.begin(), matches.end());
+
+	patchhook_t *hooks = (patchhook_t *)malloc((matches.size() + 1) * sizeof(patchhook_t));
+	for (size_t i = 0; i < matches.size(); i++) {
+		hooks[i] = patchhooks[matches[i]];
+	}
+	hooks[matches.size()].wildcard = nullptr;
+	return hooks;
+}
+
+const patchhook_t *patchhooks_build(const char *fn)
 {
 	if(!fn) {
 		return NULL;
 	}
-	VLA(char, fn_normalized, strlen(fn) + 1);
-	strcpy(fn_normalized, fn);
-	str_slash_normalize(fn_normalized);
-
-	patchhook_t *hooks = (patchhook_t *)malloc((patchhooks.size() + 1) * sizeof(patchhook_t));
-	patchhook_t *last = std::copy_if(patchhooks.begin(), patchhooks.end(), hooks, [fn_normalized](const patchhook_t& hook) {
-		return PathMatchSpec(fn_normalized, hook.wildcard);
-	});
-	last->wildcard = nullptr;
-	VLA_FREE(fn_normalized);
+	std::string fn_normalized = fn;
+	str_slash_normalize(fn_normalized.data());
+
+	AcquireSRWLockShared(&patchhook_srwlock);
+	auto cached = patchhook_cache.find(fn_normalized);
+	if (cached != patchhook_cache.end()) {
+		patchhook_t *hooks = cached->second;
+		ReleaseSRWLockShared(&patchhook_srwlock);
+		return hooks;
+	}
+	ReleaseSRWLockShared(&patchhook_srwlock);
 
-	if (hooks[0].wildcard == nullptr) {
-		free(hooks);
-		return nullptr;
+	AcquireSRWLockExclusive(&patchhook_srwlock);
+	// Another thread might have gotten here first
+	auto inserted = patchhook_cache.try_emplace(fn_normalized, nullptr);
+	if (inserted.second) {
+		inserted.first->second = patchhooks_match(fn_normalized.c_str(), fn_normalized.length());
 	}
+	patchhook_t *hooks = inserted.first->second;
+	ReleaseSRWLockExclusive(&patchhook_srwlock);
 	return hooks;
 }
+/// -------------
 
 json_t *patchhooks_load_diff(const patchhook_t *hook_array, const char *fn, size_t *size)
 {
@@ -658,6 +1289,72 @@ json_t *patchhooks_load_diff(const patchhook_t *hook_array, const char *fn, size
 	return patch;
 }
 
+/// Compiled patch plans
+/// --------------------
+// Plans of two-phase hooks, by compile function, file name and resolved JSON
+// patch. Since the resolved JSON cache hands out the same object for every
+// load of a file, the plan can be found by the patch's address, and every
+// entry holds a reference to its patch so that the address can't be reused
+// while the entry exists. Once there are more than PATCHHOOK_PLAN_CACHE_MAX
+// entries, those whose patch isn't referenced anywhere else anymore are
+// dropped.
+#define PATCHHOOK_PLAN_CACHE_MAX 256
+
+struct patchhook_plan_entry_t {
+	json_t *patch;
+	std::shared_ptr<void> plan;
+};
+
+static std::unordered_map<std::string, patchhook_plan_entry_t> patchhook_plans;
+static SRWLOCK patchhook_plans_srwlock = { SRWLOCK_INIT };
+
+static std::shared_ptr<void> patchhook_plan_get(const patchhook_t &hook, const char *fn, json_t *patch)
+{
+	std::string key((const char *)&hook.compile_func, sizeof(hook.compile_func));
+	key.append((const char *)&patch, sizeof(patch));
+	key += fn;
+
+	AcquireSRWLockShared(&patchhook_plans_srwlock);
+	auto it = patchhook_plans.find(key);
+	if (it != patchhook_plans.end()) {
+		std::shared_ptr<void> ret = it->second.plan;
+		ReleaseSRWLockShared(&patchhook_plans_srwlock);
+		return ret;
+	}
+	ReleaseSRWLockShared(&patchhook_plans_srwlock);
+
+	const func_patch_plan_free_t plan_free_func = hook.plan_free_func;
+	std::shared_ptr<void> ret(hook.compile_func(fn, patch), [patch, plan_free_func](void *plan) {
+		if (plan && plan_free_func) {
+			plan_free_func(plan);
+		}
+		json_decref(patch);
+	});
+	json_incref(patch);
+
+	AcquireSRWLockExclusive(&patchhook_plans_srwlock);
+	if (patchhook_plans.size() >= PATCHHOOK_PLAN_CACHE_MAX) {
+		for (auto it = patchhook_plans.begin(); it != patchhook_plans.end(); ) {
+			if (it->second.patch->refcount <= 1) {
+				it = patchhook_plans.erase(it);
+			} else {
+				++it;
+			}
+		}
+		if (patchhook_plans.size() >= PATCHHOOK_PLAN_CACHE_MAX) {
+			patchhook_plans.clear();
+		}
+	}
+	// Another thread might have compiled the same plan in the meantime.
+	auto inserted = patchhook_plans.try_emplace(key, patchhook_plan_entry_t{ patch, ret });
+	if (!inserted.second) {
+		ret = inserted.first->second.plan;
+	}
+	ReleaseSRWLockExclusive(&patchhook_plans_srwlock);
+	return ret;
+}
+/// --------------------
+
 int patchhooks_run(const patchhook_t *hook_array, void *file_inout, size_t size_out, size_t size_in, const char *fn, json_t *patch)
 {
 	int ret;
@@ -671,14 +1368,43 @@ int patchhooks_run(const patchhook_t *hook_array, void *file_inout, size_t size_
 	for (size_t i = 0; hook_array && hook_array[i].wildcard; i++) {
 		func_patch_t func = hook_array[i].patch_func;
 		if(func) {
+			trace_scope_t trace(TRACE_HOOK, fn, hook_array[i].wildcard);
 			if (func(file_inout, size_out, size_in, fn, patch) > 0) {
 				ret = 1;
 			}
+		} else if (hook_array[i].apply_func && patch) {
+			trace_scope_t trace(TRACE_HOOK, fn, hook_array[i].wildcard);
+			std::shared_ptr<void> plan = patchhook_plan_get(hook_array[i], fn, patch);
+			if (plan && hook_array[i].apply_func(plan.get(), file_inout, size_out, size_in, fn) > 0) {
+				ret = 1;
+			}
 		}
 	}
 	return ret;
 }
 
+bool patchhooks_cacheable(const patchhook_t *hook_array)
+{
+	if (!hook_array || !hook_array[0].wildcard) {
+		return false;
+	}
+	for (size_t i = 0; hook_array[i].wildcard; i++) {
+		if (hook_array[i].patch_func && !hook_array[i].cacheable) {
+			return false;
+		}
+	}
+	return true;
+}
+
+func_patch_stream_t patchhooks_stream_func(const patchhook_t *hook_array)
+{
+	// Chaining several streaming hooks isn't worth it for now.
+	if (!hook_array || !hook_array[0].wildcard || hook_array[1].wildcard) {
+		return nullptr;
+	}
+	return hook_array[0].stream_func;
+}
+
 void patch_opts_from_json(json_t *opts) {
 	const char *key;
 	json_t *j_val;
@@ -807,14 +1533,32 @@ void patch_opts_from_json(json_t *opts) {
 				break;
 			}
 		}
-		patch_options[key] = entry;
+		*patch_opt_slot(key, strlen(key)) = entry;
 	}
 }
 
-patch_val_t* patch_opt_get(const char *name) {
-	auto val = patch_options.find(name);
-	if (val == patch_options.end()) {
-		return NULL;
+patch_val_t* patch_opt_slot(const char *name, size_t name_len) {
+	std::string key(name, name_len);
+	AcquireSRWLockShared(&patch_options_srwlock);
+	auto id = patch_option_ids.find(key);
+	if (id != patch_option_ids.end()) {
+		patch_val_t *ret = &patch_option_slots[id->second];
+		ReleaseSRWLockShared(&patch_options_srwlock);
+		return ret;
+	}
+	ReleaseSRWLockShared(&patch_options_srwlock);
+
+	AcquireSRWLockExclusive(&patch_options_srwlock);
+	auto inserted = patch_option_ids.emplace(std::move(key), patch_option_slots.size());
+	if (inserted.second) {
+		patch_option_slots.emplace_back().type = VT_NONE;
 	}
-	return &val->second;
+	patch_val_t *ret = &patch_option_slots[inserted.first->second];
+	ReleaseSRWLockExclusive(&patch_options_srwlock);
+	return ret;
+}
+
+patch_val_t* patch_opt_get(const char *name) {
+	patch_val_t *slot = patch_opt_slot(name, strlen(name));
+	return slot->type != VT_NONE ? slot : NULL;
 }
@@ -53,6 +53,64 @@ typedef int (*func_patch_t)(void* file_inout, size_t size_out, size_t size_in, c
   */
 typedef size_t (*func_patch_size_t)(const char *fn, json_t *patch, size_t patch_size);
 
+// State of a streaming patch hook.
+typedef struct patch_stream_t {
+	const char *fn;
+	json_t *patch;
+	// Free for use by the hook. Zero when the stream starts.
+	size_t state;
+	// Appends [size] bytes of patched data to the output.
+	void (*write)(struct patch_stream_t *stream, const void *data, size_t size);
+	void *write_param;
+} patch_stream_t;
+
+/**
+  * Streaming patch function type, for formats that can be patched while
+  * reading the original file from front to back. Lets large files be patched
+  * as they are read, without ever holding all of them in memory.
+  * Must produce the same output as the regular patch function.
+  *
+  * Parameters
+  * ----------
+  *	patch_stream_t *stream
+  *		Stream state. Patched data is output through stream->write().
+  *
+  *	const BYTE *in
+  *		Next window of the original file, starting with the bytes that
+  *		weren't consumed by the previous call.
+  *
+  *	size_t in_size
+  *		Size of the window.
+  *
+  *	bool last
+  *		Set if the window ends at the end of the original file, in which
+  *		case all of it must be consumed.
+  *
+  * Returns the number of bytes of [in] that were consumed.
+  */
+typedef size_t (*func_patch_stream_t)(patch_stream_t *stream, const BYTE *in, size_t in_size, bool last);
+
+/**
+  * Two-phase patch function types, for formats whose JSON patch is worth
+  * turning into a more direct representation first. The compiled plan is
+  * cached for as long as the resolved JSON patch it was compiled from, so
+  * loading the same file again only runs [func_patch_apply_t].
+  *
+  * func_patch_compile_t receives the file name and the JSON patch, which is
+  * never NULL, and returns the plan. The plan may point into [patch], which
+  * stays alive until the plan is freed. NULL means that there is nothing to
+  * patch.
+  *
+  * func_patch_apply_t receives the plan together with the same buffer
+  * parameters as func_patch_t, and returns the same values. The same plan
+  * can be applied on several threads at once, and must not be modified.
+  *
+  * func_patch_plan_free_t frees a plan returned by func_patch_compile_t.
+  */
+typedef void* (*func_patch_compile_t)(const char *fn, json_t *patch);
+typedef int (*func_patch_apply_t)(const void *plan, void *file_inout, size_t size_out, size_t size_in, const char *fn);
+typedef void (*func_patch_plan_free_t)(void *plan);
+
 // Short description of a patch.
 // Used for patch selection in thcrap_configure, and for dependencies.
 typedef struct
@@ -104,6 +162,12 @@ void patch_opts_from_json(json_t *opts);
 // Obtains the value of a patch option
 patch_val_t* patch_opt_get(const char *name);
 
+// Returns the slot of the option [name] with a length of [name_len] bytes.
+// Options are interned on first use, so the slot stays valid for the rest
+// of the run, and is filled in if the option gets defined later. Its type
+// is VT_NONE as long as the option isn't set.
+patch_val_t* patch_opt_slot(const char *name, size_t name_len);
+
 // Opens the file [fn] for read operations. Just a lightweight wrapper around
 // CreateFile(): Returns INVALID_HANDLE_VALUE on failure, and the caller must
 // call CloseHandle() on the returned value.
@@ -117,6 +181,19 @@ void* file_stream_read(HANDLE stream, size_t *file_size);
 // Combines file_stream() and file_stream_read().
 void* file_read(const char *fn, size_t *file_size);
 
+// Maps the given file [stream] into memory as a read-only view, and optionally
+// returns its [file_size]. Saves the copy into a heap buffer done by
+// file_stream_read(), but the view can't be written to. [stream] is closed
+// in any case, and [file_size] is set to 0 on failure, which includes empty
+// files. The returned view has to be released with file_unmap()!
+const void* file_stream_map(HANDLE stream, size_t *file_size);
+
+// Combines file_stream() and file_stream_map().
+const void* file_map(const char *fn, size_t *file_size);
+
+// Releases a view returned by file_stream_map().
+void file_unmap(const void *view);
+
 // Writes [file_buffer] to a file named [fn]. The file is always overwritten!
 // Returns 0 on success, or a Win32 error code on failure.
 int file_write(const char *fn, const void *file_buffer, const size_t file_size);
@@ -136,6 +213,16 @@ char* fn_for_build(const char *fn);
 // Return value has to be free()d by the caller!
 char* fn_for_patch(const patch_t *patch_info, const char *fn);
 
+// Variants of the three functions above that build the name in a buffer
+// local to the calling thread, instead of allocating a new one every time.
+// Each function has its own buffer, which stays valid until the next call of
+// the same function on the same thread, so the result must not be freed, and
+// has to be copied if anything in between could call that function again.
+// fn_for_game_tls() returns [fn] itself if no game is set.
+const char* fn_for_game_tls(const char *fn);
+const char* fn_for_build_tls(const char *fn);
+const char* fn_for_patch_tls(const patch_t *patch_info, const char *fn);
+
 // Prints the full path of a patch-relative file name to the log.
 void patch_print_fn(const patch_t *patch_info, const char *fn);
 /// ----------
@@ -156,10 +243,20 @@ int patch_file_exists(const patch_t *patch_info, const char *fn);
 // Returns 1 if the file name [fn] is blacklisted by [patch_info].
 int patch_file_blacklisted(const patch_t *patch_info, const char *fn);
 
+// Returns 1 and the size of the file [fn] in [patch_info] without reading
+// it, using the pack or file index where possible, or 0 if there is no such
+// file. [file_size] is always set.
+int patch_file_size(const patch_t *patch_info, const char *fn, size_t *file_size);
+
 // Loads the file [fn] from [patch_info].
 // Used analogous to file_stream() and file_stream_read().
+// Streams can only be opened for loose files in the patch directory, while
+// patch_file_load() and patch_file_map() also serve files from the patch's
+// pack (see patch_pack.h).
 HANDLE patch_file_stream(const patch_t *patch_info, const char *fn);
 void* patch_file_load(const patch_t *patch_info, const char *fn, size_t *file_size);
+// Same as patch_file_load(), but returns a read-only view as per file_map().
+const void* patch_file_map(const patch_t *patch_info, const char *fn, size_t *file_size);
 
 // Loads the JSON file [fn] from [patch_info].
 // If given, [file_size] receives the size of the input file.
@@ -173,9 +270,59 @@ size_t patch_json_merge(json_t **json_inout, const patch_t *patch_info, const ch
 int patch_file_store(const patch_t *patch_info, const char *fn, const void *file_buffer, const size_t file_size);
 int patch_json_store(const patch_t *patch_info, const char *fn, const json_t *json);
 
+// Moves the file [src_fn] to [fn] in the patch [patch_info], replacing any
+// existing file. [src_fn] should be on the same volume for this to be atomic.
+// Returns 0 on success.
+int patch_file_replace(const patch_t *patch_info, const char *fn, const char *src_fn);
+
 int patch_file_delete(const patch_t *patch_info, const char *fn);
 /// ------------------------
 
+/// ----------------
+/// Patch file index
+/// ----------------
+typedef enum {
+	// The index can't answer this query, ask the file system.
+	PATCH_INDEX_UNKNOWN = -1,
+	PATCH_INDEX_MISSING = 0,
+	PATCH_INDEX_FILE,
+	PATCH_INDEX_DIRECTORY,
+} patch_index_result_t;
+
+// Looks up [fn] in the in-memory index of the files in [patch_info],
+// building it on the first call for this patch.
+patch_index_result_t patch_index_lookup(const patch_t *patch_info, const char *fn);
+
+// Drops the indexes of all patches.
+void patch_index_invalidate(void);
+
+// Turns index lookups on or off. Since the index is only kept up to date
+// by the repatch watcher, this is done by repatch_mod_init() and
+// repatch_mod_exit(). With the index disabled, patch_index_lookup() always
+// returns PATCH_INDEX_UNKNOWN.
+void patch_index_enable(int enable);
+
+// Enumerates [patch_info] into a standalone index that isn't affected by
+// patch_index_enable() or invalidations, for code that checks many files of
+// a patch in one go. Returns NULL if the patch has no archive.
+typedef struct patch_index_t patch_index_t;
+patch_index_t* patch_index_snapshot(const patch_t *patch_info);
+
+// Same as patch_index_lookup(), but on a snapshot. Doesn't check the
+// blacklist of the patch.
+patch_index_result_t patch_index_snapshot_lookup(const patch_index_t *index, const char *fn);
+
+void patch_index_snapshot_free(patch_index_t *index);
+
+#ifdef __cplusplus
+// Turns [fn] into the key used by indexes and patch packs: lowercase ASCII
+// letters and single forward slashes. Returns false for names that could
+// point outside of the archive. [ascii] is set to false if [fn] contains
+// any non-ASCII characters.
+bool patch_index_key(std::string &key, const char *fn, bool &ascii);
+#endif
+/// ----------------
+
 /// Information
 /// -----------
 // Shows the MOTD of the patch.
@@ -188,6 +335,12 @@ void patch_show_motd(const patch_t *patch_info);
 // file, and returns the result.
 patch_t patch_init(const char *patch_path, const json_t *patch_info, size_t level);
 
+// Initializes [count] patches into [out], exactly like calling patch_init()
+// in order for every patch object in [patch_infos] with its "archive" as
+// the path and levels starting at [level], but reads all patch.js files in
+// parallel.
+void patch_init_multiple(patch_t *out, json_t *const *patch_infos, size_t count, size_t level);
+
 // Converts a patch to json for runconfig.
 // Note that the resulting json doesn't contain all the
 // patch fields, only the ones we care about in the
@@ -217,9 +370,24 @@ struct patchhook_t;
 // If patch_size_func is null, a default implementation returning the size of the jdiff file is used instead.
 void patchhook_register(const char *ext, func_patch_t patch_func, func_patch_size_t patch_size_func);
 
-// Builds an array of patch hook functions for [fn].
-// Has to be free()'d by the caller!
-struct patchhook_t* patchhooks_build(const char *fn);
+// Same as patchhook_register(), with an additional streaming version of
+// [patch_func].
+void patchhook_register_stream(const char *ext, func_patch_t patch_func, func_patch_size_t patch_size_func, func_patch_stream_t stream_func);
+
+// Same as patchhook_register(), for hooks whose output only depends on the
+// file contents, its name and its JSON patch, and that have no other side
+// effects. Their results can be shared with other game processes, see
+// shm_cache.h.
+void patchhook_register_cacheable(const char *ext, func_patch_t patch_func, func_patch_size_t patch_size_func);
+
+// Same as patchhook_register_cacheable(), for a two-phase hook made up of
+// [compile_func] and [apply_func].
+void patchhook_register_compiled(const char *ext, func_patch_compile_t compile_func, func_patch_apply_t apply_func, func_patch_plan_free_t plan_free_func, func_patch_size_t patch_size_func);
+
+// Returns the array of patch hook functions matching [fn], or NULL if there
+// are none. The array is cached for further calls with the same [fn], and
+// must not be freed by the caller.
+const struct patchhook_t* patchhooks_build(const char *fn);
 
 // Loads the jdiff file for a hook, and guess the patched file size.
 json_t* patchhooks_load_diff(const struct patchhook_t *hook_array, const char *fn, size_t *size);
@@ -227,4 +395,12 @@ json_t* patchhooks_load_diff(const struct patchhook_t *hook_array, const char *f
 // Runs all hook functions in [hook_array] on the given data.
 // Returns 1 if one of the hook changed the file in file_inout, and 0 otherwise.
 int patchhooks_run(const struct patchhook_t *hook_array, void *file_inout, size_t size_out, size_t size_in, const char *fn, json_t *patch);
+
+// Returns true if all hook functions in [hook_array] were registered with
+// patchhook_register_cacheable().
+bool patchhooks_cacheable(const struct patchhook_t *hook_array);
+
+// Returns the streaming function that can replace patchhooks_run() for
+// [hook_array], or NULL if it has to be run on the whole file at once.
+func_patch_stream_t patchhooks_stream_func(const struct patchhook_t *hook_array);
 /// -----
@@ -11,7 +11,9 @@
 #include <algorithm>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <string_view>
+#include <queue>
 
 static std::unordered_map<std::string_view, UINT_PTR> funcs = {
 	{ "th_malloc", (size_t)&malloc },
@@ -55,28 +57,76 @@ static std::unordered_map<std::string_view, UINT_PTR> funcs = {
 };
 static mod_funcs_t mod_funcs = {};
 static mod_funcs_t patch_funcs = {};
+// Full export names of all module hook functions, for the startup profile
+static std::unordered_map<mod_call_type, std::string> mod_func_names;
+// Names of the functions added with func_add(), interned so that adding
+// the same codecave again after a repatch doesn't allocate it again.
+static std::unordered_set<std::string> func_names;
 static json_t *plugins = NULL;
+volatile LONG func_generation = 0;
+
+/**
+  * The exports of every DLL passed to plugin_init(), in load order. Rather
+  * than copying all of them into [funcs], which would mostly contain
+  * breakpoint and codecave functions that the run configuration never
+  * references, they are looked up on demand by func_get(), using a binary
+  * search over the lexically sorted name table of the export directory.
+  */
+struct func_module_t
+{
+	HMODULE hMod;
+	const DWORD *names;
+	const WORD *ordinals;
+	const DWORD *functions;
+	DWORD name_count;
+	DWORD func_count;
+};
+static std::vector<func_module_t> func_modules;
+
+static UINT_PTR func_module_get(const func_module_t& mod, const char *name)
+{
+	const UINT_PTR base = (UINT_PTR)mod.hMod;
+	const DWORD *names_end = mod.names + mod.name_count;
+	const DWORD *it = std::lower_bound(mod.names, names_end, name, [base](DWORD name_rva, const char *key) {
+		return strcmp((const char*)(base + name_rva), key) < 0;
+	});
+	if (it == names_end || strcmp((const char*)(base + *it), name) != 0) {
+		return 0;
+	}
+	const WORD ordinal = mod.ordinals[it - mod.names];
+	if (ordinal >= mod.func_count) {
+		return 0;
+	}
+	return base + mod.functions[ordinal];
+}
 
 UINT_PTR func_get(const char *name)
 {
 	auto existing = funcs.find(name);
-	if (existing == funcs.end()) {
-		return 0;
-	} else {
+	if (existing != funcs.end()) {
 		return existing->second;
 	}
+	// Later DLLs take priority, just like they used to overwrite [funcs].
+	for (auto mod = func_modules.rbegin(); mod != func_modules.rend(); ++mod) {
+		if (UINT_PTR ret = func_module_get(*mod, name)) {
+			return ret;
+		}
+	}
+	return 0;
 }
 
 int func_add(const char *name, size_t addr) {
 	// Can this use insert_or_assign somehow?
 	auto existing = funcs.find(name);
 	if (existing == funcs.end()) {
-		funcs[strdup(name)] = addr;
+		funcs[*func_names.emplace(name).first] = addr;
+		InterlockedIncrement(&func_generation);
 		return 0;
 	}
 	else {
-		log_printf("Overwriting function/codecave %s\n");
+		log_printf("Overwriting function/codecave %s\n", name);
 		existing->second = addr;
+		InterlockedIncrement(&func_generation);
 		return 1;
 	}
 	
@@ -85,45 +135,281 @@ int func_add(const char *name, size_t addr) {
 bool func_remove(const char *name) {
 	auto existing = funcs.find(name);
 	if (existing != funcs.end()) {
-		std::string_view a = existing->first;
 		funcs.erase(existing);
-		free((void*)a.data());
+		InterlockedIncrement(&func_generation);
 		return true;
 	}
 	return false;
 }
 
+// Appends the functions of [src] to the ones with the same suffix in [dst].
+// Unlike unordered_map::merge(), this keeps the functions of suffixes that
+// [dst] already has.
+static void mod_funcs_append(mod_funcs_t& dst, mod_funcs_t& src)
+{
+	for (auto& [suffix, funcs_src] : src) {
+		auto& funcs_dst = dst[suffix];
+		funcs_dst.insert(funcs_dst.end(), funcs_src.begin(), funcs_src.end());
+	}
+}
+
 int patch_func_init(exported_func_t *funcs_new, size_t func_count)
 {
 	if (func_count > 0) {
 		mod_funcs_t *patch_funcs_new = mod_func_build(funcs_new, "_patch_");
 		mod_func_run(patch_funcs_new, "init", NULL);
-		patch_funcs.merge(*patch_funcs_new);
+		mod_funcs_append(patch_funcs, *patch_funcs_new);
 		delete patch_funcs_new;
 		func_count = 0;
 	}
 	return func_count;
 }
 
+// Registers the exports of [hMod] for func_get(), and returns its module
+// functions without running any of them.
+static mod_funcs_t* plugin_register(HMODULE hMod)
+{
+	const IMAGE_EXPORT_DIRECTORY *ExportDesc = GetDllExportDesc(hMod);
+	if(!ExportDesc) {
+		return nullptr;
+	}
+	const UINT_PTR dll_base = (UINT_PTR)hMod;
+	func_module_t mod = {
+		hMod,
+		(const DWORD*)(dll_base + ExportDesc->AddressOfNames),
+		(const WORD*)(dll_base + ExportDesc->AddressOfNameOrdinals),
+		(const DWORD*)(dll_base + ExportDesc->AddressOfFunctions),
+		ExportDesc->NumberOfNames,
+		ExportDesc->NumberOfFunctions,
+	};
+
+	// Module functions are the only exports that have to be known up front.
+	std::vector<exported_func_t> mod_exports;
+	for (DWORD i = 0; i < mod.name_count; i++) {
+		const char *name = (const char*)(dll_base + mod.names[i]);
+		if (strstr(name, "_mod_") && mod.ordinals[i] < mod.func_count) {
+			mod_exports.push_back({ name, dll_base + mod.functions[mod.ordinals[i]] });
+		}
+	}
+	mod_exports.push_back({});
+
+	func_modules.push_back(mod);
+	InterlockedIncrement(&func_generation);
+	return mod_func_build(mod_exports.data(), "_mod_");
+}
+
 int plugin_init(HMODULE hMod)
 {
-	exported_func_t *funcs_new;
-	int func_count = GetExportedFunctions(&funcs_new, hMod);
-	if(func_count > 0) {
-		mod_funcs_t *mod_funcs_new = mod_func_build(funcs_new, "_mod_");
-		mod_func_run(mod_funcs_new, "init", NULL);
-		mod_func_run(mod_funcs_new, "detour", NULL);
-		mod_funcs.merge(*mod_funcs_new);
-		for (int i = 0; funcs_new[i].func != 0 && funcs_new[i].name != nullptr; i++) {
-			funcs[funcs_new[i].name] = funcs_new[i].func;
+	mod_funcs_t *mod_funcs_new = plugin_register(hMod);
+	if(!mod_funcs_new) {
+		return -2;
+	}
+	mod_func_run(mod_funcs_new, "init", NULL);
+	mod_func_run(mod_funcs_new, "detour", NULL);
+	mod_funcs_append(mod_funcs, *mod_funcs_new);
+	delete mod_funcs_new;
+	return 0;
+}
+
+/// Plug-in module initialization
+/// -----------------------------
+// A plug-in whose module functions haven't run yet.
+struct plugin_pending_t {
+	mod_funcs_t *mod_funcs;
+	const mod_init_decl_t *decls;
+};
+
+struct mod_init_task_t {
+	mod_call_type func;
+	bool thread_safe;
+	// Dependencies that aren't done yet
+	size_t deps_left;
+	std::vector<size_t> dependents;
+};
+
+struct mod_init_graph_t {
+	std::vector<mod_init_task_t> tasks;
+	CRITICAL_SECTION cs;
+	// Thread-safe tasks, submitted once their dependencies are done
+	task_group_t *group;
+	// Set whenever a task is done
+	HANDLE progress;
+};
+
+static void mod_func_call(mod_call_type func, const char *pattern, void *param);
+
+static void mod_init_submit(mod_init_graph_t& graph, size_t i);
+
+static void mod_init_task_done(mod_init_graph_t& graph, size_t i)
+{
+	std::vector<size_t> ready;
+	EnterCriticalSection(&graph.cs);
+	for (size_t dependent : graph.tasks[i].dependents) {
+		mod_init_task_t& task = graph.tasks[dependent];
+		if (--task.deps_left == 0 && task.thread_safe) {
+			ready.push_back(dependent);
 		}
-		delete mod_funcs_new;
-		func_count = 0;
-	}	
-	return func_count;
+	}
+	LeaveCriticalSection(&graph.cs);
+	SetEvent(graph.progress);
+	for (size_t dependent : ready) {
+		mod_init_submit(graph, dependent);
+	}
 }
 
-void plugin_load(const char *dir, const char *fn)
+static void mod_init_submit(mod_init_graph_t& graph, size_t i)
+{
+	task_submit_func(TASK_PRIORITY_CRITICAL, graph.group, [&graph, i]() {
+		mod_func_call(graph.tasks[i].func, "init", NULL);
+		mod_init_task_done(graph, i);
+	});
+}
+
+// Sorts the tasks topologically, preferring load order wherever the
+// dependencies allow it. Returns false if they contain a cycle.
+static bool mod_init_order(const mod_init_graph_t& graph, std::vector<size_t>& order)
+{
+	std::vector<size_t> deps_left;
+	std::priority_queue<size_t, std::vector<size_t>, std::greater<size_t>> next;
+	for (size_t i = 0; i < graph.tasks.size(); i++) {
+		deps_left.push_back(graph.tasks[i].deps_left);
+		if (deps_left[i] == 0) {
+			next.push(i);
+		}
+	}
+	while (!next.empty()) {
+		size_t i = next.top();
+		next.pop();
+		order.push_back(i);
+		for (size_t dependent : graph.tasks[i].dependents) {
+			if (--deps_left[dependent] == 0) {
+				next.push(dependent);
+			}
+		}
+	}
+	return order.size() == graph.tasks.size();
+}
+
+static const mod_init_decl_t* mod_init_decl_find(const mod_init_decl_t *decls, std::string_view module)
+{
+	for (; decls && decls->module; decls++) {
+		if (module == decls->module) {
+			return decls;
+		}
+	}
+	return nullptr;
+}
+
+static void mod_init_run(std::vector<plugin_pending_t>& pending)
+{
+	mod_init_graph_t graph;
+	std::vector<const mod_init_decl_t*> task_decls;
+	std::unordered_map<std::string_view, size_t> task_of_module;
+	for (auto& plugin : pending) {
+		for (mod_call_type func : (*plugin.mod_funcs)["init"]) {
+			if (!func) {
+				continue;
+			}
+			std::string_view name = mod_func_names[func];
+			std::string_view module = name.substr(0, name.find("_mod_"));
+			const mod_init_decl_t *decl = mod_init_decl_find(plugin.decls, module);
+			task_of_module[module] = graph.tasks.size();
+			task_decls.push_back(decl);
+			graph.tasks.push_back({ func, decl && decl->thread_safe });
+		}
+	}
+	const size_t task_count = graph.tasks.size();
+	if (task_count == 0) {
+		return;
+	}
+
+	auto depend = [&graph](size_t i, size_t dep) {
+		graph.tasks[dep].dependents.push_back(i);
+		graph.tasks[i].deps_left++;
+	};
+	for (size_t i = 0; i < task_count; i++) {
+		if (!task_decls[i]) {
+			for (size_t dep = 0; dep < i; dep++) {
+				depend(i, dep);
+			}
+			continue;
+		}
+		for (auto dep_name = task_decls[i]->deps; dep_name && *dep_name; dep_name++) {
+			auto dep = task_of_module.find(*dep_name);
+			if (dep != task_of_module.end() && dep->second != i) {
+				depend(i, dep->second);
+			}
+		}
+	}
+
+	std::vector<size_t> order;
+	if (!mod_init_order(graph, order)) {
+		log_printf("[Plugin] Circular module init dependencies, initializing modules in load order\n");
+		for (auto& task : graph.tasks) {
+			mod_func_call(task.func, "init", NULL);
+		}
+		return;
+	}
+
+	size_t thread_safe_count = 0;
+	for (const auto& task : graph.tasks) {
+		thread_safe_count += task.thread_safe;
+	}
+	const size_t worker_count = MIN(task_worker_count(), thread_safe_count);
+	if (worker_count == 0) {
+		// Run everything here, in dependency order.
+		for (auto& task : graph.tasks) {
+			task.thread_safe = false;
+		}
+	}
+	log_debugf("[Plugin] Initializing %zu modules, %zu of them on %zu task workers\n",
+		task_count, worker_count ? thread_safe_count : 0, worker_count
+	);
+
+	InitializeCriticalSection(&graph.cs);
+	graph.group = task_group_create();
+	graph.progress = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+
+	// Collected first, since the submitted tasks immediately start
+	// decrementing the dependency counts of the others.
+	std::vector<size_t> ready;
+	for (size_t i = 0; i < task_count; i++) {
+		if (graph.tasks[i].thread_safe && graph.tasks[i].deps_left == 0) {
+			ready.push_back(i);
+		}
+	}
+	for (size_t i : ready) {
+		mod_init_submit(graph, i);
+	}
+
+	// The remaining tasks run on this thread. Topological order guarantees
+	// that the thread-safe tasks they wait for never wait for them in turn.
+	for (size_t i : order) {
+		mod_init_task_t& task = graph.tasks[i];
+		if (task.thread_safe) {
+			continue;
+		}
+		for (;;) {
+			EnterCriticalSection(&graph.cs);
+			const bool blocked = task.deps_left != 0;
+			LeaveCriticalSection(&graph.cs);
+			if (!blocked) {
+				break;
+			}
+			WaitForSingleObject(graph.progress, INFINITE);
+		}
+		mod_func_call(task.func, "init", NULL);
+		mod_init_task_done(graph, i);
+	}
+	// Every remaining task is submitted by one of its dependencies before
+	// that one finishes, so the group only runs empty once all are done.
+	task_group_free(graph.group);
+	CloseHandle(graph.progress);
+	DeleteCriticalSection(&graph.cs);
+}
+/// -----------------------------
+
+static void plugin_load(const char *dir, const char *fn, std::vector<plugin_pending_t>& pending)
 {
 	// LoadLibraryEx() with LOAD_LIBRARY_SEARCH_DLL_LOAD_DIR
 	// requires an absolute path to not fail with GetLastError() == 87.
@@ -157,7 +443,10 @@ void plugin_load(const char *dir, const char *fn)
 	FARPROC func = GetProcAddress(plugin, "thcrap_plugin_init");
 	if(func && !func()) {
 		log_printf("[Plugin] %s: initialized and active\n", fn);
-		plugin_init(plugin);
+		if(mod_funcs_t *plugin_mod_funcs = plugin_register(plugin)) {
+			auto decls = (const mod_init_decl_t*)GetProcAddress(plugin, "thcrap_plugin_init_decls");
+			pending.push_back({ plugin_mod_funcs, decls });
+		}
 		json_object_set_new(plugins, fn, json_integer((size_t)plugin));
 	} else {
 		if(func) {
@@ -167,6 +456,62 @@ void plugin_load(const char *dir, const char *fn)
 	}
 }
 
+/**
+  * The optional plugins.json manifest in the plug-in directory tells which
+  * DLLs are worth loading, so that plugins_load() doesn't have to map and
+  * initialize every single one of them just to ask whether they apply to
+  * the current game.
+  *
+  * Keys are DLL file names, without the "_d" suffix of debug builds.
+  * [false] marks a DLL that isn't a plug-in. An object lists the "games"
+  * a plug-in supports, and the "patches" it depends on. Such a plug-in is
+  * only loaded if the current game is one of the former, or if any of the
+  * latter is on the stack, leaving the final decision to its
+  * thcrap_plugin_init(). DLLs that aren't listed are always loaded.
+  */
+static bool plugin_manifest_allows(const json_t *manifest, const char *fn)
+{
+	std::string key = fn;
+	for (auto& c : key) {
+		c = tolower((unsigned char)c);
+	}
+	const size_t debug_suffix = key.length() - strlen("_d.dll");
+	if (key.length() >= strlen("_d.dll") && key.compare(debug_suffix, std::string::npos, "_d.dll") == 0) {
+		key.erase(debug_suffix, 2);
+	}
+
+	const json_t *entry = json_object_get(manifest, key.c_str());
+	if (!entry) {
+		return true;
+	}
+	if (!json_is_object(entry)) {
+		return json_is_true(entry);
+	}
+
+	const char *game = runconfig_game_get();
+	const json_t *games = json_object_get(entry, "games");
+	size_t i;
+	json_t *val;
+	json_array_foreach(games, i, val) {
+		if (game && json_string_value(val) && !strcmp(game, json_string_value(val))) {
+			return true;
+		}
+	}
+
+	bool ret = false;
+	const json_t *patches = json_object_get(entry, "patches");
+	stack_foreach_cpp([patches, &ret](const patch_t *patch) {
+		size_t i;
+		json_t *val;
+		json_array_foreach(patches, i, val) {
+			if (patch->id && json_string_value(val) && !strcmp(patch->id, json_string_value(val))) {
+				ret = true;
+			}
+		}
+	});
+	return ret;
+}
+
 int plugins_load(const char *dir)
 {
 	BOOL ret = 0;
@@ -193,10 +538,25 @@ int plugins_load(const char *dir)
 		}
 		ret = W32_ERR_WRAP(FindNextFile(hFind, &w32fd));
 	}
+	std::string manifest_fn = std::string(dir) + "\\plugins.json";
+	json_t *manifest = json_load_file_report(manifest_fn.c_str());
+	std::vector<plugin_pending_t> pending;
 	for(auto dll : dlls) {
-		plugin_load(dir, dll.c_str());
+		if(!plugin_manifest_allows(manifest, dll.c_str())) {
+			log_debugf("[Plugin] %s: skipped, as per plugins.json\n", dll.c_str());
+			continue;
+		}
+		plugin_load(dir, dll.c_str(), pending);
 	}
+	json_decref(manifest);
 	FindClose(hFind);
+
+	mod_init_run(pending);
+	for(auto& plugin : pending) {
+		mod_func_run(plugin.mod_funcs, "detour", NULL);
+		mod_funcs_append(mod_funcs, *plugin.mod_funcs);
+		delete plugin.mod_funcs;
+	}
 	return 0;
 }
 
@@ -209,9 +569,13 @@ int plugins_close(void)
 	json_object_foreach(plugins, key, val) {
 		HINSTANCE hInst = (HINSTANCE)json_integer_value(val);
 		if(hInst) {
+			func_modules.erase(std::remove_if(func_modules.begin(), func_modules.end(), [hInst](const func_module_t& mod) {
+				return mod.hMod == hInst;
+			}), func_modules.end());
 			FreeLibrary(hInst);
 		}
 	}
+	InterlockedIncrement(&func_generation);
 	plugins = json_decref_safe(plugins);
 	return 0;
 }
@@ -227,18 +591,31 @@ mod_funcs_t* mod_func_build(exported_func_t *funcs, const char* infix)
 			p += infix_len;
 			if (p[0] != '\0') {
 				(*ret)[p].push_back((mod_call_type)funcs[i].func);
+				mod_func_names[(mod_call_type)funcs[i].func] = funcs[i].name;
 			}
 		}
 	}
 	return ret;
 }
 
+static void mod_func_call(mod_call_type func, const char *pattern, void *param)
+{
+	if (startup_profile_active()) {
+		auto name = mod_func_names.find(func);
+		startup_phase_begin(name != mod_func_names.end() ? name->second.c_str() : pattern);
+		func(param);
+		startup_phase_end();
+	} else {
+		func(param);
+	}
+}
+
 void mod_func_run(mod_funcs_t* mod_funcs, const char *pattern, void *param)
 {
 	std::vector<mod_call_type>& func_array = (*mod_funcs)[pattern];
 	for (mod_call_type &func : func_array) {
 		if (func) {
-			func(param);
+			mod_func_call(func, pattern, param);
 		}
 	}
 }
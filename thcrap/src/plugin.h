@@ -28,8 +28,13 @@ int func_add(const char *name, size_t addr);
 
 // Removes a function from the list of functions used by func_get
 // This function is nessesairy for plugins to be able to unload themselves
+// Only works for functions added with func_add(), not for DLL exports.
 bool func_remove(const char *name);
 
+// Incremented whenever the result of func_get() may have changed, so that
+// cached lookups know when to look again. Not exported.
+extern volatile LONG func_generation;
+
 /// Module functions
 /// ================
 /**
@@ -65,6 +70,37 @@ bool func_remove(const char *name);
 // Module function type.
 typedef void (__cdecl *mod_call_type)(void *param);
 
+/**
+  * A plug-in can also export an array of
+  *
+  * const mod_init_decl_t thcrap_plugin_init_decls[]
+  *
+  * terminated by an entry with a NULL [module], which declares how the "init"
+  * functions of its modules depend on the ones of other modules.
+  *
+  * plugins_load() runs the "init" functions of all loaded plug-ins before
+  * any of their "detour" functions. Declared functions start as soon as all
+  * of their dependencies are done; the thread-safe ones do so on a worker
+  * thread. Undeclared functions run on the injection thread, in load order,
+  * and wait for every "init" function that was loaded before them.
+  */
+typedef struct {
+	// Name of the module, i.e. the part of the export name before "_mod_".
+	const char *module;
+
+	// NULL-terminated array of the modules whose "init" function has to be
+	// done before this one starts, or NULL. The modules of the main DLL
+	// and modules that aren't loaded are ignored.
+	const char *const *deps;
+
+	// Whether the "init" function can run on any thread, concurrently to
+	// others. Such a function may only touch state that is either its own
+	// or guarded by a lock, like jsondata_add(), jsonvfs_add() or
+	// patchhook_register() do, and must not call func_add() or
+	// func_remove().
+	bool thread_safe;
+} mod_init_decl_t;
+
 // Removes a module hook function from the unordered map of module hook function
 // This function is nessesairy for plugins to be able to unload themselves
 void mod_func_remove(const char *pattern, mod_call_type func);
@@ -102,11 +138,15 @@ void patch_func_run_all(const char *pattern, void *param);
 
 // Initializes a plug-in DLL at [hMod]. This means registering all of its
 // exports, and calling its "init" and "detour" module functions.
+// Declarations in thcrap_plugin_init_decls are ignored.
 int plugin_init(HMODULE hMod);
 
 int patch_func_init(exported_func_t *funcs_new, size_t func_count);
 
-// Loads all thcrap plugins from the given directory.
+// Loads all thcrap plugins from the given directory, skipping the DLLs
+// that the plugins.json manifest in there rules out for the current game.
+// Then runs their "init" module functions as declared by their
+// thcrap_plugin_init_decls, followed by their "detour" ones in load order.
 int plugins_load(const char *dir);
 
 int plugins_close(void);
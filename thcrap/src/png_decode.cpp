@@ -0,0 +1,512 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Fast PNG decoding.
+  */
+
+#include "thcrap.h"
+#include <zlib.h>
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#include <intrin.h>
+#endif
+#include <emmintrin.h>
+#include <tmmintrin.h>
+
+#if defined(__GNUC__)
+# define PNG_DECODE_TARGET_SSE2 __attribute__((target("sse2")))
+# define PNG_DECODE_TARGET_SSSE3 __attribute__((target("ssse3")))
+#else
+# define PNG_DECODE_TARGET_SSE2
+# define PNG_DECODE_TARGET_SSSE3
+#endif
+
+// Same limits as libpng's defaults.
+#define PNG_DECODE_SIZE_MAX 1000000
+
+// Amount of filtered image data inflated in one go.
+#define PNG_DECODE_BATCH_SIZE (256 * 1024)
+
+// The value of a gAMA chunk for sRGB, and the largest difference that
+// libpng's simplified API still treats as sRGB.
+#define PNG_DECODE_GAMMA_SRGB 45455
+#define PNG_DECODE_GAMMA_THRESHOLD 1000
+
+typedef void (*png_unfilter_func_t)(uint8_t *row, const uint8_t *prev, size_t rowbytes);
+
+struct png_decode_state_t {
+	z_stream strm;
+	bool strm_init;
+	unsigned int flags;
+
+	// Chunk following the IDAT that is currently being inflated.
+	const uint8_t *chunk_next;
+	const uint8_t *file_end;
+
+	// Filter byte + row data.
+	size_t rowbytes;
+	uint8_t bpp;
+	png_unfilter_func_t unfilter[5];
+
+	// Row slot 0 holds the last unfiltered row of the previous batch,
+	// followed by [batch_rows] slots for the current one.
+	uint8_t *scratch;
+	uint32_t batch_rows;
+	bool first_row;
+};
+
+static bool png_decode_sse2_supported(void)
+{
+	int data[4];
+	__cpuid(data, 0);
+	if(data[0] < 1) {
+		return false;
+	}
+	__cpuid(data, 1);
+	return data[3] & 1 << 26;
+}
+
+static bool png_decode_ssse3_supported(void)
+{
+	int data[4];
+	__cpuid(data, 0);
+	if(data[0] < 1) {
+		return false;
+	}
+	__cpuid(data, 1);
+	return data[2] & 1 << 9;
+}
+
+static const bool PNG_DECODE_SSE2 = png_decode_sse2_supported();
+static const bool PNG_DECODE_SSSE3 = png_decode_ssse3_supported();
+
+static uint32_t png_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/// Unfiltering
+/// -----------
+// The [prev] row is all zeroes for the first row, as required by the spec.
+template <unsigned int bpp> static void png_unfilter_sub(uint8_t *row, const uint8_t *prev, size_t rowbytes)
+{
+	(void)prev;
+	for(size_t i = bpp; i < rowbytes; i++) {
+		row[i] += row[i - bpp];
+	}
+}
+
+static void png_unfilter_up(uint8_t *row, const uint8_t *prev, size_t rowbytes)
+{
+	for(size_t i = 0; i < rowbytes; i++) {
+		row[i] += prev[i];
+	}
+}
+
+template <unsigned int bpp> static void png_unfilter_avg(uint8_t *row, const uint8_t *prev, size_t rowbytes)
+{
+	size_t i;
+	for(i = 0; i < bpp; i++) {
+		row[i] += prev[i] >> 1;
+	}
+	for(; i < rowbytes; i++) {
+		row[i] += (row[i - bpp] + prev[i]) >> 1;
+	}
+}
+
+template <unsigned int bpp> static void png_unfilter_paeth(uint8_t *row, const uint8_t *prev, size_t rowbytes)
+{
+	size_t i;
+	for(i = 0; i < bpp; i++) {
+		row[i] += prev[i];
+	}
+	for(; i < rowbytes; i++) {
+		const int a = row[i - bpp];
+		const int b = prev[i];
+		const int c = prev[i - bpp];
+		const int pa = abs(b - c);
+		const int pb = abs(a - c);
+		const int pc = abs(a + b - 2 * c);
+		if(pa <= pb && pa <= pc) {
+			row[i] += a;
+		} else if(pb <= pc) {
+			row[i] += b;
+		} else {
+			row[i] += c;
+		}
+	}
+}
+
+// Every pixel depends on the one before it, so these work on one pixel at
+// a time, with all of its channels in one register.
+template <unsigned int bpp> PNG_DECODE_TARGET_SSE2 static __m128i png_load_px(const uint8_t *p)
+{
+	int32_t v = 0;
+	memcpy(&v, p, bpp);
+	return _mm_cvtsi32_si128(v);
+}
+
+template <unsigned int bpp> PNG_DECODE_TARGET_SSE2 static void png_store_px(uint8_t *p, __m128i v)
+{
+	const int32_t i = _mm_cvtsi128_si32(v);
+	memcpy(p, &i, bpp);
+}
+
+PNG_DECODE_TARGET_SSE2 static void png_unfilter_up_sse2(uint8_t *row, const uint8_t *prev, size_t rowbytes)
+{
+	size_t i;
+	for(i = 0; i + 16 <= rowbytes; i += 16) {
+		const __m128i r = _mm_loadu_si128((const __m128i*)(row + i));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+		_mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(r, b));
+	}
+	for(; i < rowbytes; i++) {
+		row[i] += prev[i];
+	}
+}
+
+template <unsigned int bpp> PNG_DECODE_TARGET_SSE2 static void png_unfilter_sub_sse2(uint8_t *row, const uint8_t *prev, size_t rowbytes)
+{
+	(void)prev;
+	__m128i a = _mm_setzero_si128();
+	for(size_t i = 0; i + bpp <= rowbytes; i += bpp) {
+		a = _mm_add_epi8(a, png_load_px<bpp>(row + i));
+		png_store_px<bpp>(row + i, a);
+	}
+}
+
+template <unsigned int bpp> PNG_DECODE_TARGET_SSE2 static void png_unfilter_avg_sse2(uint8_t *row, const uint8_t *prev, size_t rowbytes)
+{
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i a = _mm_setzero_si128();
+	for(size_t i = 0; i + bpp <= rowbytes; i += bpp) {
+		const __m128i b = png_load_px<bpp>(prev + i);
+		// _mm_avg_epu8() rounds up, PNG rounds down.
+		const __m128i avg = _mm_sub_epi8(
+			_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one)
+		);
+		a = _mm_add_epi8(avg, png_load_px<bpp>(row + i));
+		png_store_px<bpp>(row + i, a);
+	}
+}
+
+PNG_DECODE_TARGET_SSE2 static inline __m128i png_abs_epi16(__m128i x)
+{
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+PNG_DECODE_TARGET_SSE2 static inline __m128i png_select(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+template <unsigned int bpp> PNG_DECODE_TARGET_SSE2 static void png_unfilter_paeth_sse2(uint8_t *row, const uint8_t *prev, size_t rowbytes)
+{
+	const __m128i zero = _mm_setzero_si128();
+	// Channels of the previous pixel, and the pixels above and above-left,
+	// as 16-bit values.
+	__m128i a = zero;
+	__m128i c = zero;
+	for(size_t i = 0; i + bpp <= rowbytes; i += bpp) {
+		const __m128i b = _mm_unpacklo_epi8(png_load_px<bpp>(prev + i), zero);
+		const __m128i x = _mm_unpacklo_epi8(png_load_px<bpp>(row + i), zero);
+
+		const __m128i b_c = _mm_sub_epi16(b, c);
+		const __m128i a_c = _mm_sub_epi16(a, c);
+		const __m128i pa = png_abs_epi16(b_c);
+		const __m128i pb = png_abs_epi16(a_c);
+		const __m128i pc = png_abs_epi16(_mm_add_epi16(b_c, a_c));
+		const __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+		const __m128i pred = png_select(
+			_mm_cmpeq_epi16(smallest, pa), a, png_select(
+				_mm_cmpeq_epi16(smallest, pb), b, c
+			)
+		);
+		// Keeping only the low byte of each lane wraps the sum around.
+		a = _mm_and_si128(_mm_add_epi16(pred, x), _mm_set1_epi16(0xff));
+		c = b;
+		png_store_px<bpp>(row + i, _mm_packus_epi16(a, zero));
+	}
+}
+
+template <unsigned int bpp> static void png_unfilter_init(png_unfilter_func_t *unfilter)
+{
+	unfilter[0] = nullptr;
+	if(PNG_DECODE_SSE2) {
+		unfilter[1] = png_unfilter_sub_sse2<bpp>;
+		unfilter[2] = png_unfilter_up_sse2;
+		unfilter[3] = png_unfilter_avg_sse2<bpp>;
+		unfilter[4] = png_unfilter_paeth_sse2<bpp>;
+	} else {
+		unfilter[1] = png_unfilter_sub<bpp>;
+		unfilter[2] = png_unfilter_up;
+		unfilter[3] = png_unfilter_avg<bpp>;
+		unfilter[4] = png_unfilter_paeth<bpp>;
+	}
+}
+/// -----------
+
+/// Output
+/// ------
+PNG_DECODE_TARGET_SSE2 static void png_emit_swap_rb_4(uint8_t *out, const uint8_t *in, uint32_t width)
+{
+	uint32_t i = 0;
+	if(PNG_DECODE_SSE2) {
+		const __m128i ag_mask = _mm_set1_epi32(0xff00ff00);
+		for(; i + 4 <= width; i += 4) {
+			const __m128i x = _mm_loadu_si128((const __m128i*)(in + i * 4));
+			const __m128i rb = _mm_andnot_si128(ag_mask, x);
+			const __m128i swapped = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+			_mm_storeu_si128(
+				(__m128i*)(out + i * 4), _mm_or_si128(_mm_and_si128(ag_mask, x), swapped)
+			);
+		}
+	}
+	for(; i < width; i++) {
+		out[i * 4 + 0] = in[i * 4 + 2];
+		out[i * 4 + 1] = in[i * 4 + 1];
+		out[i * 4 + 2] = in[i * 4 + 0];
+		out[i * 4 + 3] = in[i * 4 + 3];
+	}
+}
+
+PNG_DECODE_TARGET_SSSE3 static void png_emit_rgb_to_4(uint8_t *out, const uint8_t *in, uint32_t width, bool bgr)
+{
+	uint32_t i = 0;
+	if(PNG_DECODE_SSSE3) {
+		const __m128i shuffle = bgr
+			? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+			: _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		const __m128i alpha = _mm_set1_epi32(0xff000000);
+		// Every iteration loads 16 bytes but only consumes 12, so stop
+		// before that would read past the end of the row.
+		for(; i + 6 <= width; i += 4) {
+			const __m128i x = _mm_loadu_si128((const __m128i*)(in + i * 3));
+			_mm_storeu_si128(
+				(__m128i*)(out + i * 4), _mm_or_si128(_mm_shuffle_epi8(x, shuffle), alpha)
+			);
+		}
+	}
+	const unsigned int r = bgr ? 2 : 0;
+	const unsigned int b = bgr ? 0 : 2;
+	for(out += i * 4, in += i * 3; i < width; i++, out += 4, in += 3) {
+		out[r] = in[0];
+		out[1] = in[1];
+		out[b] = in[2];
+		out[3] = 0xff;
+	}
+}
+
+static void png_emit_row(const png_decode_t *dec, uint8_t *out, const uint8_t *in)
+{
+	const unsigned int flags = dec->state->flags;
+	const bool bgr = (flags & PNG_DECODE_BGR) != 0;
+	if(dec->alpha) {
+		if(bgr) {
+			png_emit_swap_rb_4(out, in, dec->width);
+		} else {
+			memcpy(out, in, (size_t)dec->width * 4);
+		}
+		return;
+	}
+	if(dec->channels == 4) {
+		png_emit_rgb_to_4(out, in, dec->width, bgr);
+	} else if(bgr) {
+		for(uint32_t i = 0; i < dec->width; i++, out += 3, in += 3) {
+			out[0] = in[2];
+			out[1] = in[1];
+			out[2] = in[0];
+		}
+	} else {
+		memcpy(out, in, (size_t)dec->width * 3);
+	}
+}
+/// ------
+
+int png_decode_begin(png_decode_t *dec, const void *file_buffer, size_t file_size, unsigned int flags)
+{
+	static const uint8_t PNG_SIG[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+	if(!dec) {
+		return -1;
+	}
+	ZeroMemory(dec, sizeof(*dec));
+	const uint8_t *p = (const uint8_t *)file_buffer;
+	const uint8_t *end = p + file_size;
+	if(!p || file_size < sizeof(PNG_SIG) || memcmp(p, PNG_SIG, sizeof(PNG_SIG))) {
+		return -1;
+	}
+	p += sizeof(PNG_SIG);
+
+	bool ihdr_seen = false;
+	bool srgb = false;
+	bool gamma_valid = false;
+	uint32_t gamma = PNG_DECODE_GAMMA_SRGB;
+	while(end - p >= 12) {
+		const uint32_t len = png_be32(p);
+		const uint8_t *type = p + 4;
+		const uint8_t *data = p + 8;
+		if(len > (size_t)(end - data) - 4) {
+			return -1;
+		}
+		if(!ihdr_seen) {
+			if(memcmp(type, "IHDR", 4) || len != 13) {
+				return -1;
+			}
+			if(crc32(crc32(0, type, 4), data, len) != png_be32(data + len)) {
+				return -1;
+			}
+			dec->width = png_be32(data + 0);
+			dec->height = png_be32(data + 4);
+			const uint8_t bit_depth = data[8];
+			const uint8_t color_type = data[9];
+			if(
+				dec->width == 0 || dec->width > PNG_DECODE_SIZE_MAX
+				|| dec->height == 0 || dec->height > PNG_DECODE_SIZE_MAX
+				|| bit_depth != 8 || (color_type != 2 && color_type != 6)
+				// Compression, filter and interlace methods
+				|| data[10] != 0 || data[11] != 0 || data[12] != 0
+			) {
+				return -1;
+			}
+			dec->alpha = (color_type == 6);
+			ihdr_seen = true;
+		} else if(!memcmp(type, "IDAT", 4)) {
+			break;
+		} else if(!memcmp(type, "gAMA", 4) && len == 4) {
+			gamma = png_be32(data);
+			gamma_valid = true;
+		} else if(!memcmp(type, "sRGB", 4)) {
+			srgb = true;
+		} else if(!memcmp(type, "iCCP", 4)) {
+			if(flags & PNG_DECODE_SRGB_ONLY) {
+				return -1;
+			}
+		} else if(!memcmp(type, "tRNS", 4)) {
+			// Would need to be expanded to an alpha channel.
+			return -1;
+		} else if(!(type[0] & 0x20) && memcmp(type, "PLTE", 4)) {
+			// Unknown critical chunk, or an IEND before any IDAT.
+			return -1;
+		}
+		p = data + len + 4;
+	}
+	if(!ihdr_seen || end - p < 12 || memcmp(p + 4, "IDAT", 4)) {
+		return -1;
+	}
+	if((flags & PNG_DECODE_SRGB_ONLY) && gamma_valid && !srgb && (
+		gamma < PNG_DECODE_GAMMA_SRGB - PNG_DECODE_GAMMA_THRESHOLD
+		|| gamma > PNG_DECODE_GAMMA_SRGB + PNG_DECODE_GAMMA_THRESHOLD
+	)) {
+		return -1;
+	}
+
+	auto *state = new png_decode_state_t();
+	dec->state = state;
+	state->flags = flags;
+	state->chunk_next = p;
+	state->file_end = end;
+	state->bpp = dec->alpha ? 4 : 3;
+	state->rowbytes = (size_t)dec->width * state->bpp + 1;
+	state->first_row = true;
+	dec->channels = (dec->alpha || (flags & PNG_DECODE_ADD_ALPHA)) ? 4 : 3;
+	(state->bpp == 4)
+		? png_unfilter_init<4>(state->unfilter)
+		: png_unfilter_init<3>(state->unfilter);
+
+	state->batch_rows = (uint32_t)MAX(PNG_DECODE_BATCH_SIZE / state->rowbytes, 1);
+	state->batch_rows = MIN(state->batch_rows, dec->height);
+	state->scratch = (uint8_t *)malloc(state->rowbytes * (state->batch_rows + 1));
+	if(!state->scratch || inflateInit(&state->strm) != Z_OK) {
+		png_decode_end(dec);
+		return -1;
+	}
+	state->strm_init = true;
+	return 0;
+}
+
+// Points the inflate input at the next IDAT chunk.
+static bool png_decode_next_idat(png_decode_state_t *state)
+{
+	const uint8_t *p = state->chunk_next;
+	if(state->file_end - p < 12 || memcmp(p + 4, "IDAT", 4)) {
+		return false;
+	}
+	const uint32_t len = png_be32(p);
+	const uint8_t *data = p + 8;
+	if(len > (size_t)(state->file_end - data) - 4) {
+		return false;
+	}
+	if(crc32(crc32(0, p + 4, 4), data, len) != png_be32(data + len)) {
+		return false;
+	}
+	state->strm.next_in = (Bytef *)data;
+	state->strm.avail_in = len;
+	state->chunk_next = data + len + 4;
+	return true;
+}
+
+int png_decode_rows(png_decode_t *dec, uint8_t *out, ptrdiff_t stride, uint32_t rows)
+{
+	if(!dec || !dec->state || !out) {
+		return -1;
+	}
+	png_decode_state_t *state = dec->state;
+	const size_t rowbytes = state->rowbytes;
+	uint8_t *slot0 = state->scratch;
+
+	while(rows) {
+		const uint32_t batch = MIN(rows, state->batch_rows);
+		state->strm.next_out = slot0 + rowbytes;
+		state->strm.avail_out = (uInt)(rowbytes * batch);
+		while(state->strm.avail_out) {
+			if(state->strm.avail_in == 0 && !png_decode_next_idat(state)) {
+				return -1;
+			}
+			const int ret = inflate(&state->strm, Z_NO_FLUSH);
+			if(ret == Z_STREAM_END) {
+				if(state->strm.avail_out) {
+					return -1;
+				}
+			} else if(ret != Z_OK && ret != Z_BUF_ERROR) {
+				return -1;
+			}
+		}
+		if(state->first_row) {
+			ZeroMemory(slot0, rowbytes);
+			state->first_row = false;
+		}
+		uint8_t *prev = slot0;
+		for(uint32_t y = 0; y < batch; y++) {
+			uint8_t *row = prev + rowbytes;
+			const uint8_t filter = row[0];
+			if(filter > 4) {
+				return -1;
+			}
+			if(filter) {
+				state->unfilter[filter](row + 1, prev + 1, rowbytes - 1);
+			}
+			png_emit_row(dec, out, row + 1);
+			out += stride;
+			prev = row;
+		}
+		memcpy(slot0, prev, rowbytes);
+		rows -= batch;
+	}
+	return 0;
+}
+
+void png_decode_end(png_decode_t *dec)
+{
+	if(!dec || !dec->state) {
+		return;
+	}
+	if(dec->state->strm_init) {
+		inflateEnd(&dec->state->strm);
+	}
+	SAFE_FREE(dec->state->scratch);
+	delete dec->state;
+	dec->state = nullptr;
+}
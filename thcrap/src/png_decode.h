@@ -0,0 +1,57 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Fast PNG decoding.
+  * Almost all patch images are 8-bit, non-interlaced RGB or RGBA PNGs. For
+  * these, the filtered image data can be inflated right into the output rows
+  * and unfiltered with SIMD, without going through all of libpng's generic
+  * transformation machinery. Everything else is rejected, and has to be
+  * decoded by the plugin's libpng-based code instead.
+  */
+
+#pragma once
+
+typedef enum {
+	// Outputs 4 channels for RGB images as well, with an opaque alpha.
+	PNG_DECODE_ADD_ALPHA = 0x1,
+	// Swaps the red and blue channels.
+	PNG_DECODE_BGR = 0x2,
+	// Rejects images that would need any gamma correction or color
+	// management in libpng's simplified API, which treats everything as
+	// sRGB by default.
+	PNG_DECODE_SRGB_ONLY = 0x4,
+} png_decode_flags_t;
+
+struct png_decode_state_t;
+
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+	// Of every decoded pixel, 3 or 4.
+	uint8_t channels;
+	// Of the source image.
+	bool alpha;
+
+	struct png_decode_state_t *state;
+} png_decode_t;
+
+// Parses the header of the PNG in [file_buffer] and prepares [dec] for
+// decoding its rows with the given [flags]. [file_buffer] must stay valid
+// until png_decode_end() is called.
+// Returns 0 on success, or -1 if the image isn't supported by this decoder
+// and has to go through libpng instead. [dec] is cleaned up in the latter
+// case.
+int png_decode_begin(png_decode_t *dec, const void *file_buffer, size_t file_size, unsigned int flags);
+
+// Decodes the next [rows] rows of [dec] to [out], with [stride] bytes
+// between the start of each row. With a negative [stride], the image is
+// stored bottom-up, and [out] points to the last row in memory, which
+// receives the first decoded one. Returns 0 on success, or
+// -1 on any error, in which case libpng should decode the image instead in
+// order to properly report it.
+int png_decode_rows(png_decode_t *dec, uint8_t *out, ptrdiff_t stride, uint32_t rows);
+
+void png_decode_end(png_decode_t *dec);
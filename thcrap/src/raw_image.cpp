@@ -0,0 +1,164 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Pre-converted raw images.
+  */
+
+#include "thcrap.h"
+#include <zlib.h>
+
+// Same limit as the PNG decoder.
+#define RAW_IMAGE_SIZE_MAX 1000000
+
+uint8_t raw_image_channels(const raw_image_header_t *header)
+{
+	return header->format == RAW_IMAGE_BGR8 ? 3 : 4;
+}
+
+const raw_image_header_t* raw_image_header(const void *file_buffer, size_t file_size)
+{
+	if(!file_buffer || file_size < sizeof(raw_image_header_t)) {
+		return NULL;
+	}
+	const auto header = (const raw_image_header_t *)file_buffer;
+	if(
+		header->magic != RAW_IMAGE_MAGIC
+		|| (header->format != RAW_IMAGE_BGRA8 && header->format != RAW_IMAGE_BGR8)
+		|| (header->method != RAW_IMAGE_STORED && header->method != RAW_IMAGE_DEFLATE)
+		|| header->width == 0 || header->width > RAW_IMAGE_SIZE_MAX
+		|| header->height == 0 || header->height > RAW_IMAGE_SIZE_MAX
+		|| header->pitch < (uint64_t)header->width * raw_image_channels(header)
+		|| header->data_size > file_size - sizeof(raw_image_header_t)
+	) {
+		return NULL;
+	}
+	if(
+		header->method == RAW_IMAGE_STORED
+		&& header->data_size != (uint64_t)header->pitch * header->height
+	) {
+		return NULL;
+	}
+	return header;
+}
+
+static void raw_image_copy_row(uint8_t *dst, const uint8_t *src, uint32_t width, uint8_t channels, bool add_alpha)
+{
+	if(channels == 3 && add_alpha) {
+		for(uint32_t x = 0; x < width; x++, src += 3, dst += 4) {
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+			dst[3] = 0xff;
+		}
+	} else {
+		memcpy(dst, src, (size_t)width * channels);
+	}
+}
+
+// Inflates exactly [len] bytes from [strm] into [dst].
+static bool raw_image_inflate(z_stream &strm, uint8_t *dst, size_t len)
+{
+	strm.next_out = dst;
+	strm.avail_out = (uInt)len;
+	while(strm.avail_out) {
+		int ret = inflate(&strm, Z_NO_FLUSH);
+		if(ret == Z_STREAM_END) {
+			return strm.avail_out == 0;
+		} else if(ret != Z_OK) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int raw_image_rows(const void *file_buffer, size_t file_size, uint8_t *out, ptrdiff_t stride, uint32_t rows, unsigned int flags)
+{
+	const raw_image_header_t *header = raw_image_header(file_buffer, file_size);
+	if(!header || !out || rows > header->height) {
+		return -1;
+	}
+	const uint8_t channels = raw_image_channels(header);
+	const bool add_alpha = (flags & RAW_IMAGE_ADD_ALPHA) != 0;
+	const bool convert = channels == 3 && add_alpha;
+	const auto data = (const uint8_t *)(header + 1);
+
+	if(header->method == RAW_IMAGE_STORED) {
+		if(!convert && stride == (ptrdiff_t)header->pitch) {
+			memcpy(out, data, (size_t)header->pitch * rows);
+			return 0;
+		}
+		for(uint32_t y = 0; y < rows; y++) {
+			raw_image_copy_row(
+				out + (ptrdiff_t)y * stride, data + (size_t)y * header->pitch,
+				header->width, channels, add_alpha
+			);
+		}
+		return 0;
+	}
+
+	z_stream strm = {};
+	strm.next_in = (Bytef *)data;
+	strm.avail_in = header->data_size;
+	if(inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+		return -1;
+	}
+	// Rows that are laid out like the output can be inflated in place, the
+	// pitch padding then goes to the scratch row.
+	const size_t rowbytes = (size_t)header->width * channels;
+	uint8_t *scratch = (uint8_t *)malloc(header->pitch);
+	bool ok = scratch != NULL;
+	for(uint32_t y = 0; ok && y < rows; y++) {
+		uint8_t *dst = out + (ptrdiff_t)y * stride;
+		if(convert) {
+			ok = raw_image_inflate(strm, scratch, header->pitch);
+			if(ok) {
+				raw_image_copy_row(dst, scratch, header->width, channels, add_alpha);
+			}
+		} else {
+			ok = raw_image_inflate(strm, dst, rowbytes)
+				&& raw_image_inflate(strm, scratch, header->pitch - rowbytes);
+		}
+	}
+	free(scratch);
+	inflateEnd(&strm);
+	return ok ? 0 : -1;
+}
+
+char* raw_image_fn(const char *fn)
+{
+	if(!fn) {
+		return NULL;
+	}
+	const char *ext = strrchr(fn, '.');
+	const char *sep = ext ? strpbrk(ext, "/\\") : NULL;
+	size_t base_len = (ext && !sep) ? (size_t)(ext - fn) : strlen(fn);
+
+	char *ret = (char *)malloc(base_len + sizeof(RAW_IMAGE_EXT));
+	if(ret) {
+		memcpy(ret, fn, base_len);
+		memcpy(ret + base_len, RAW_IMAGE_EXT, sizeof(RAW_IMAGE_EXT));
+	}
+	return ret;
+}
+
+void* raw_image_load(const patch_t *patch_info, const char *fn, size_t *file_size)
+{
+	size_t raw_size = 0;
+	void *ret = NULL;
+	char *fn_raw = patch_info ? raw_image_fn(fn) : NULL;
+	if(fn_raw && patch_file_exists(patch_info, fn_raw)) {
+		ret = patch_file_load(patch_info, fn_raw, &raw_size);
+		if(ret && !raw_image_header(ret, raw_size)) {
+			log_printf("%s: invalid raw image, using the PNG instead\n", fn_raw);
+			SAFE_FREE(ret);
+		}
+	}
+	free(fn_raw);
+	if(file_size) {
+		*file_size = ret ? raw_size : 0;
+	}
+	return ret;
+}
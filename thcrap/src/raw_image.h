@@ -0,0 +1,77 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Pre-converted raw images.
+  *
+  * Created from PNGs by scripts/raw_image.py. Patchers that load a PNG from
+  * a patch first look for a file with the same name and the [RAW_IMAGE_EXT]
+  * extension in the same patch, whose pixels are already in the BGR(A)
+  * layout that the game wants and only have to be copied, or at most
+  * inflated, instead of going through a full PNG decoder.
+  *
+  * Layout (all integers little-endian):
+  *
+  *	raw_image_header_t
+  *	[height] rows of [pitch] bytes each, stored or as one raw Deflate
+  *	stream of [data_size] bytes
+  */
+
+#pragma once
+
+#define RAW_IMAGE_MAGIC 0x49524854 // "THRI"
+#define RAW_IMAGE_EXT ".thri"
+
+typedef enum {
+	RAW_IMAGE_BGRA8 = 0,
+	RAW_IMAGE_BGR8 = 1,
+} raw_image_format_t;
+
+typedef enum {
+	RAW_IMAGE_STORED = 0,
+	RAW_IMAGE_DEFLATE = 8,
+} raw_image_method_t;
+
+typedef enum {
+	// Outputs 4 channels for BGR8 images as well, with an opaque alpha.
+	RAW_IMAGE_ADD_ALPHA = 0x1,
+} raw_image_flags_t;
+
+#pragma pack(push, 1)
+typedef struct {
+	uint32_t magic; // = RAW_IMAGE_MAGIC
+	uint16_t format; // raw_image_format_t
+	uint16_t method; // raw_image_method_t
+	uint32_t width;
+	uint32_t height;
+	// Bytes between the start of each row, at least [width] pixels.
+	uint32_t pitch;
+	// Size of the pixel data following the header, as stored.
+	uint32_t data_size;
+} raw_image_header_t;
+#pragma pack(pop)
+
+// Returns the header of the raw image in [file_buffer], or NULL if it
+// isn't a valid one.
+const raw_image_header_t* raw_image_header(const void *file_buffer, size_t file_size);
+
+// Returns the number of bytes per pixel of [header], 3 or 4.
+uint8_t raw_image_channels(const raw_image_header_t *header);
+
+// Writes the first [rows] rows of the raw image in [file_buffer] to [out],
+// with [stride] bytes between the start of each row. With a negative
+// [stride], the image is stored bottom-up, and [out] points to the last
+// row in memory, just like png_decode_rows(). Returns 0 on success, or -1
+// if the image is invalid or truncated.
+int raw_image_rows(const void *file_buffer, size_t file_size, uint8_t *out, ptrdiff_t stride, uint32_t rows, unsigned int flags);
+
+// Returns the name of the raw image that replaces the PNG [fn], in a new
+// buffer that has to be free()d by the caller.
+char* raw_image_fn(const char *fn);
+
+// Loads the raw image that replaces the PNG [fn] in [patch_info]. Returns a
+// buffer that has to be free()d by the caller, or NULL if the patch has no
+// valid raw image for [fn].
+void* raw_image_load(const patch_t *patch_info, const char *fn, size_t *file_size);
@@ -9,6 +9,7 @@
 
 #include "thcrap.h"
 #include "repatch.h"
+#include <unordered_set>
 
 /**
   * This module monitors all patches for external changes to their files, then
@@ -35,136 +36,275 @@
   * actually use it properly. This implementation uses two separate threads to
   * achieve what seems to be a pretty decent performance.
   *
-  * • The "watcher" thread focuses exclusively on monitoring the changes by
-  *   repeatedly calling ReadDirectoryChangesW() for all patch directories and
-  *   buffering relevant changes in a performant way.
+  * • The "watcher" thread focuses exclusively on monitoring the changes. It
+  *   keeps one ReadDirectoryChangesW() call queued on every patch directory,
+  *   all of them completing to the same port. Every directory has two
+  *   buffers, and the next call is queued into the other one before a filled
+  *   buffer is even looked at. Changes in subtrees that never contain patch
+  *   data, as well as temporary files of editors, are dropped right there;
+  *   everything else goes into a hash set of changed file names.
   *   This is *very* important, as we must spend as little time as possible on
   *   one filled buffer.
   *
-  * • The separate "collector" thread waits for a fixed amount of time, then
-  *   calls mod_func_run("repatch"), passing the current repatch buffer before
-  *   flushing it.
+  * • The separate "collector" thread sleeps until the watcher reports a
+  *   change, then waits until no further changes have come in for a short
+  *   while, so that a single save in an editor that touches several files
+  *   only results in a single repatch. It then translates the buffer into
+  *   the names that were actually loaded through the patch stack (see
+  *   stack_deps_expand()), and calls mod_func_run("repatch") with that set,
+  *   if it isn't empty.
   */
 
-static HANDLE *dir_handles = NULL;
-static int dir_handles_num = 0;
+struct repatch_watch_t {
+	OVERLAPPED ol;
+	HANDLE dir;
+	// Double buffer, with [buf_cur] being the one the queued read writes to.
+	FILE_NOTIFY_INFORMATION *buf[2];
+	size_t buf_cur;
+};
+
+// One entry for every patch that is a directory. Never resized while the
+// watcher is running, since the OVERLAPPED structures live in there.
+static std::vector<repatch_watch_t> watches;
+static HANDLE watch_port = NULL;
 // Repatch buffer.
-// A JSON object that receives the names of all changed files as the changes
-// are detected.
-static json_t *files_changed = NULL;
-static CRITICAL_SECTION cs_changed = {};
+// Receives the names of all changed files as the changes are detected.
+static std::unordered_set<std::string> files_changed;
+static SRWLOCK files_changed_srwlock = { SRWLOCK_INIT };
 static HANDLE event_shutdown = NULL;
+// Auto-reset event, signaled by the watcher for every new change.
+static HANDLE event_changed = NULL;
 static HANDLE thread_watch = NULL;
 static HANDLE thread_collect = NULL;
 static volatile size_t changes_total = 0;
 
-// Amount of milliseconds to wait before triggering the collector thread
-#define COLLECT_THRESHOLD 1000
+// Completion key that tells the watcher thread to shut down.
+#define WATCH_KEY_SHUTDOWN ((ULONG_PTR)-1)
+
+#define WATCH_FILTER ( \
+	FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | \
+	FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE \
+)
+
+// Amount of milliseconds without further changes after which the collector
+// repatches, and the upper limit for how long it keeps coalescing changes.
+#define COLLECT_QUIET 150
+#define COLLECT_MAX_DELAY 2000
 
 // 64K is more than 8 times as much as my system would crank out in a single
 // watch loop while being bombarded with a cmd file creation FOR loop using
 // names being close to MAX_PATH in length - so I guess it 'ought to be enough
-// for anybody'™?
+// for anybody'™? It's also the limit for directories on network shares.
 #define WATCH_BUFFER_SIZE 65536
 
-void repatch_add(OVERLAPPED *ol)
+// Returns true if [fn] can't possibly be a patch file: anything inside a
+// directory starting with a dot (.git, .svn, .vs, …) or in a Python cache,
+// and the temporary and backup files written by editors and by ourselves.
+static bool repatch_ignored(std::string_view fn)
 {
-	FILE_NOTIFY_INFORMATION *p = (FILE_NOTIFY_INFORMATION*)ol->Pointer;
-	DWORD next_offset;
-	do {
-		size_t fn_utf16_len = (p->FileNameLength / 2);
-		size_t fn_utf8_len = fn_utf16_len * UTF8_MUL;
-		VLA(char, fn_utf8, fn_utf8_len);
-		next_offset = p->NextEntryOffset;
-		fn_utf8_len = WideCharToMultiByte(
-			CP_UTF8, 0, p->FileName, fn_utf16_len, fn_utf8, fn_utf8_len, NULL, NULL
-		);
-		fn_utf8[fn_utf8_len] = 0;
-		str_slash_normalize(fn_utf8);
-		EnterCriticalSection(&cs_changed);
-		// Marginally faster, and ensures correct counting of changes.
-		if(!json_object_get(files_changed, fn_utf8)) {
-			json_object_set_new(files_changed, fn_utf8, json_integer((json_int_t)ol->hEvent));
-			InterlockedIncrement(&changes_total);
+	std::string_view name;
+	size_t start = 0;
+	while(start <= fn.size()) {
+		size_t end = fn.find('/', start);
+		if(end == std::string_view::npos) {
+			end = fn.size();
+		}
+		name = fn.substr(start, end - start);
+		if(!name.empty() && (name[0] == '.' || name == "__pycache__")) {
+			return true;
+		}
+		start = end + 1;
+	}
+	auto ends_with = [&name](std::string_view suffix) {
+		return name.size() >= suffix.size()
+			&& !strnicmp(name.data() + name.size() - suffix.size(), suffix.data(), suffix.size());
+	};
+	return name.empty()
+		// Emacs auto-save files and vim's write test
+		|| (name.size() >= 2 && name.front() == '#' && name.back() == '#')
+		|| name == "4913"
+		|| ends_with("~")
+		|| ends_with(".tmp")
+		|| ends_with(".swp")
+		|| ends_with(".swo")
+		|| ends_with(".swx");
+}
+
+static void repatch_add(const FILE_NOTIFY_INFORMATION *p)
+{
+	// Converted outside the lock, which is then only taken once per buffer.
+	std::vector<std::string> fns;
+	for(;;) {
+		const int fn_utf16_len = p->FileNameLength / 2;
+		std::string fn(fn_utf16_len * UTF8_MUL, '\0');
+		fn.resize(WideCharToMultiByte(
+			CP_UTF8, 0, p->FileName, fn_utf16_len, &fn[0], (int)fn.size(), NULL, NULL
+		));
+		str_slash_normalize(&fn[0]);
+		if(!repatch_ignored(fn)) {
+			fns.push_back(std::move(fn));
+		}
+		if(!p->NextEntryOffset) {
+			break;
 		}
-		LeaveCriticalSection(&cs_changed);
-		VLA_FREE(fn_utf8);
-		if(next_offset) {
-			p = (FILE_NOTIFY_INFORMATION*)((BYTE*)p + next_offset);
+		p = (const FILE_NOTIFY_INFORMATION*)((const BYTE*)p + p->NextEntryOffset);
+	}
+	if(fns.empty()) {
+		return;
+	}
+	bool added = false;
+	AcquireSRWLockExclusive(&files_changed_srwlock);
+	for(auto &fn : fns) {
+		// Ensures correct counting of changes.
+		if(files_changed.insert(std::move(fn)).second) {
+			InterlockedIncrement(&changes_total);
+			added = true;
 		}
-	} while(next_offset);
+	}
+	ReleaseSRWLockExclusive(&files_changed_srwlock);
+	if(added) {
+		SetEvent(event_changed);
+	}
 }
 
 DWORD WINAPI repatch_collector(void*)
 {
-	while(WaitForSingleObject(event_shutdown, COLLECT_THRESHOLD) == WAIT_TIMEOUT) {
-		if(json_object_size(files_changed) > 0) {
-			json_t *files_changed_copy = NULL;
-			log_printf("Repatching...\n");
-
-			EnterCriticalSection(&cs_changed);
-			files_changed_copy = json_copy(files_changed);
-			json_object_clear(files_changed);
-			LeaveCriticalSection(&cs_changed);
-			mod_func_run_all("repatch", files_changed_copy);
-			json_decref(files_changed_copy);
+	HANDLE events[] = { event_shutdown, event_changed };
+	while(WaitForMultipleObjects(
+		elementsof(events), events, FALSE, INFINITE
+	) == WAIT_OBJECT_0 + 1) {
+		// Coalesce bursts of changes.
+		DWORD start = GetTickCount();
+		DWORD ret_wait;
+		while(
+			(ret_wait = WaitForMultipleObjects(
+				elementsof(events), events, FALSE, COLLECT_QUIET
+			)) == WAIT_OBJECT_0 + 1
+			&& (GetTickCount() - start) < COLLECT_MAX_DELAY
+		);
+		if(ret_wait == WAIT_OBJECT_0) {
+			break;
+		}
+
+		std::unordered_set<std::string> files_changed_set;
+		AcquireSRWLockExclusive(&files_changed_srwlock);
+		files_changed_set.swap(files_changed);
+		ReleaseSRWLockExclusive(&files_changed_srwlock);
+		if(files_changed_set.empty()) {
+			continue;
+		}
+		json_t *files_changed_copy = json_object();
+		for(const auto &fn : files_changed_set) {
+			json_object_set_new(files_changed_copy, fn.c_str(), json_true());
+		}
+		LONGLONG trace_start = trace_event_start(TRACE_REPATCH);
+
+		// Has to happen before any of the repatch handlers get to
+		// resolve their files again.
+		patch_index_invalidate();
+		stack_json_cache_repatch(files_changed_copy);
+
+		json_t *files_affected = stack_deps_expand(files_changed_copy);
+		if(json_object_size(files_affected) > 0) {
+			log_printf(
+				"Repatching (%u changed files, %u affected)...\n",
+				json_object_size(files_changed_copy), json_object_size(files_affected)
+			);
+			mod_func_run_all("repatch", files_affected);
 		}
+		if(trace_start) {
+			std::string changed;
+			for(const auto &fn : files_changed_set) {
+				changed += changed.empty() ? "" : ", ";
+				changed += fn;
+			}
+			trace_event_complete(TRACE_REPATCH, trace_start, "repatch", changed.c_str());
+		}
+		json_decref(files_affected);
+		json_decref(files_changed_copy);
 	}
 	return 0;
 }
 
+static bool repatch_watch_queue(repatch_watch_t &watch)
+{
+	// IMPORTANT. If we don't use a completion routine and [hEvent] is not
+	// NULL, ReadDirectoryChangesW() will think that we want to use the
+	// GetOverlappedResult() notification strategy, which requires a valid
+	// event handle.
+	ZeroMemory(&watch.ol, sizeof(watch.ol));
+	return ReadDirectoryChangesW(
+		watch.dir, watch.buf[watch.buf_cur], WATCH_BUFFER_SIZE, TRUE,
+		WATCH_FILTER, NULL, &watch.ol, NULL
+	) != 0;
+}
+
 DWORD WINAPI repatch_watcher(void*)
 {
-	DWORD ret_changes = TRUE;
-	DWORD ret_queue = FALSE;
-	DWORD ret_shutdown = WAIT_TIMEOUT;
-	BYTE buf[WATCH_BUFFER_SIZE];
-	int i;
+	DWORD ret_queue = 0;
+	DWORD ret_changes = 0;
 	DWORD byte_ret_max = 0;
+	size_t overflows = 0;
+	size_t pending = 0;
 
-	OVERLAPPED ol_changes = {};
-	HANDLE hIOCompPort = CreateIoCompletionPort(
-		INVALID_HANDLE_VALUE, NULL, PROJECT_VERSION(), 0
-	);
-	for(i = 0; i < dir_handles_num; i++) {
-		if(dir_handles[i] != INVALID_HANDLE_VALUE) {
-			CreateIoCompletionPort(dir_handles[i], hIOCompPort, i, 0);
+	for(auto &watch : watches) {
+		if(repatch_watch_queue(watch)) {
+			pending++;
+		} else {
+			ret_changes = GetLastError();
 		}
 	}
-	while(!ret_queue && ret_shutdown == WAIT_TIMEOUT) {
+	for(;;) {
 		DWORD byte_ret = 0;
-		ULONG_PTR key;
+		ULONG_PTR key = 0;
 		OVERLAPPED *ol = NULL;
-
-		// IMPORTANT. If we don't use a completion routine and this is not NULL,
-		// ReadDirectoryChangesW() will think that we want to use the
-		// GetOverlappedResult() notification strategy, which requires a valid
-		// event handle. Since the ID we put in there is something else entirely,
-		// the function *will fail* with ERROR_INVALID_HANDLE.
-		ol_changes.hEvent = NULL;
-		ol_changes.Pointer = buf;
-
-		ret_queue = W32_ERR_WRAP(GetQueuedCompletionStatus(
-			hIOCompPort, &byte_ret, &key, &ol, COLLECT_THRESHOLD
-		));
-		for(i = 0; i < dir_handles_num; i++) {
-			ret_changes = W32_ERR_WRAP(ReadDirectoryChangesW(
-				dir_handles[i], ol_changes.Pointer, sizeof(buf), TRUE,
-				FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
-				FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
-				&byte_ret, &ol_changes, NULL
-			));
-			if(byte_ret) {
-				byte_ret_max = MAX(byte_ret_max, byte_ret);
-			}
-			if(!ret_queue && ol) {
-				ol->hEvent = (HANDLE)key;
-				repatch_add(ol);
-			} else if(ret_queue == WAIT_TIMEOUT) {
-				ret_queue = 0;
+		BOOL ret = GetQueuedCompletionStatus(
+			watch_port, &byte_ret, &key, &ol, INFINITE
+		);
+		if(!ol) {
+			if(key != WATCH_KEY_SHUTDOWN) {
+				ret_queue = GetLastError();
 			}
+			break;
+		}
+		pending--;
+		repatch_watch_t &watch = watches[key];
+		if(!ret) {
+			// Most likely, the directory is gone. Stop watching it.
+			ret_changes = GetLastError();
+			continue;
 		}
-		ret_shutdown = WaitForSingleObject(event_shutdown, 0);
+		const FILE_NOTIFY_INFORMATION *info = watch.buf[watch.buf_cur];
+		watch.buf_cur ^= 1;
+		if(repatch_watch_queue(watch)) {
+			pending++;
+		} else {
+			ret_changes = GetLastError();
+		}
+		if(byte_ret == 0) {
+			// The buffer overflowed, and all of its changes are lost.
+			overflows++;
+			continue;
+		}
+		byte_ret_max = MAX(byte_ret_max, byte_ret);
+		repatch_add(info);
+	}
+
+	// CancelIo() only affects I/O started by the calling thread, which is
+	// this one. The buffers have to stay around until every read has
+	// actually completed.
+	for(auto &watch : watches) {
+		CancelIo(watch.dir);
+	}
+	while(pending) {
+		DWORD byte_ret;
+		ULONG_PTR key;
+		OVERLAPPED *ol = NULL;
+		GetQueuedCompletionStatus(watch_port, &byte_ret, &key, &ol, 1000);
+		if(!ol) {
+			break;
+		}
+		pending--;
 	}
 	log_printf(
 		"Shutting down repatch watcher thread.\n"
@@ -173,55 +313,83 @@ DWORD WINAPI repatch_watcher(void*)
 		"• Last error codes: %d (queue), %d (changes)\n"
 		"• Total number of file changes parsed: %d\n"
 		"• Maximum buffer fill state: %d/%d bytes\n"
+		"• Buffer overflows: %d\n"
 		"----\n",
-		ret_queue, ret_changes, changes_total, byte_ret_max, WATCH_BUFFER_SIZE
+		ret_queue, ret_changes, changes_total, byte_ret_max, WATCH_BUFFER_SIZE,
+		overflows
 	);
-	CloseHandle(hIOCompPort);
 	return 0;
 }
 
 int repatch_mod_init(void)
 {
 	DWORD thread_id;
-	dir_handles = (HANDLE *)calloc(sizeof(HANDLE), stack_get_size());
-	if(!dir_handles) {
+	watch_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if(!watch_port) {
 		return 2;
 	}
-	stack_foreach([](const patch_t *patch, void*) {
+	stack_foreach_cpp([](const patch_t *patch) {
 		const char *archive = patch->archive;
-		HANDLE hDir = INVALID_HANDLE_VALUE;
-		if (GetFileAttributes(archive) & FILE_ATTRIBUTE_DIRECTORY) {
-			hDir = CreateFile(archive, FILE_LIST_DIRECTORY,
-				FILE_SHARE_READ | FILE_SHARE_WRITE
-				// Yes. This would otherwise prevent *files* in the
-				// directory from being deleted or renamed, too.
-				| FILE_SHARE_DELETE,
-				NULL, OPEN_EXISTING,
-				FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL
-			);
+		DWORD attr = GetFileAttributes(archive);
+		if(attr == INVALID_FILE_ATTRIBUTES || !(attr & FILE_ATTRIBUTE_DIRECTORY)) {
+			return;
+		}
+		HANDLE hDir = CreateFile(archive, FILE_LIST_DIRECTORY,
+			FILE_SHARE_READ | FILE_SHARE_WRITE
+			// Yes. This would otherwise prevent *files* in the
+			// directory from being deleted or renamed, too.
+			| FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING,
+			FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL
+		);
+		if(hDir == INVALID_HANDLE_VALUE) {
+			return;
+		}
+		// The completion key is the index into [watches].
+		if(!CreateIoCompletionPort(hDir, watch_port, watches.size(), 0)) {
+			CloseHandle(hDir);
+			return;
 		}
-		dir_handles[dir_handles_num++] = hDir;
-	}, nullptr);
-	InitializeCriticalSection(&cs_changed);
-	files_changed = json_object();
+		repatch_watch_t watch = {};
+		watch.dir = hDir;
+		watch.buf[0] = (FILE_NOTIFY_INFORMATION *)malloc(WATCH_BUFFER_SIZE);
+		watch.buf[1] = (FILE_NOTIFY_INFORMATION *)malloc(WATCH_BUFFER_SIZE);
+		watches.push_back(watch);
+	});
 	event_shutdown = CreateEvent(NULL, TRUE, FALSE, NULL);
+	event_changed = CreateEvent(NULL, FALSE, FALSE, NULL);
 	thread_watch = CreateThread(NULL, 0, repatch_watcher, NULL, 0, &thread_id);
 	thread_collect = CreateThread(NULL, 0, repatch_collector, NULL, 0, &thread_id);
+	patch_index_enable(true);
+	stack_json_cache_enable(true);
+	stack_deps_enable(true);
 	return 0;
 }
 
 void repatch_mod_exit(void)
 {
+	patch_index_enable(false);
+	stack_json_cache_enable(false);
+	stack_deps_enable(false);
 	SetEvent(event_shutdown);
+	PostQueuedCompletionStatus(watch_port, 0, WATCH_KEY_SHUTDOWN, NULL);
 	WaitForSingleObject(thread_watch, INFINITE);
 	WaitForSingleObject(thread_collect, INFINITE);
 	CloseHandle(thread_watch);
 	CloseHandle(thread_collect);
 	thread_watch = NULL;
+	thread_collect = NULL;
 	CloseHandle(event_shutdown);
-	SAFE_FREE(dir_handles);
+	CloseHandle(event_changed);
 	event_shutdown = NULL;
-	dir_handles_num = 0;
-	files_changed = json_decref_safe(files_changed);
-	DeleteCriticalSection(&cs_changed);
+	event_changed = NULL;
+	for(auto &watch : watches) {
+		CloseHandle(watch.dir);
+		SAFE_FREE(watch.buf[0]);
+		SAFE_FREE(watch.buf[1]);
+	}
+	watches.clear();
+	CloseHandle(watch_port);
+	watch_port = NULL;
+	files_changed.clear();
 }
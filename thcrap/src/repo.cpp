@@ -189,13 +189,36 @@ repo_t *RepoLocalNext(HANDLE *hFind)
 
 repo_t **RepoLoad(void)
 {
-	HANDLE hFind = nullptr;
-	std::vector<repo_t*> repo_vector;
-	repo_t *repo;
-
-	while ((repo = RepoLocalNext(&hFind))) {
-		repo_vector.push_back(repo);
+	// Only the directory listing is serial, the repo.js files are then
+	// parsed on the task workers.
+	std::vector<std::string> repo_ids;
+	WIN32_FIND_DATAA w32fd;
+	HANDLE hFind = FindFirstFile("repos/*", &w32fd);
+	if (hFind != INVALID_HANDLE_VALUE) {
+		do {
+			if (
+				(w32fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				&& strcmp(w32fd.cFileName, ".")
+				&& strcmp(w32fd.cFileName, "..")
+			) {
+				repo_ids.push_back(w32fd.cFileName);
+			}
+		} while (FindNextFile(hFind, &w32fd));
+		FindClose(hFind);
 	}
+
+	std::vector<repo_t*> repo_vector(repo_ids.size(), nullptr);
+	parallel_for(repo_ids.size(), task_worker_count() + 1, [&repo_ids, &repo_vector](size_t i) {
+		char *repo_local_fn = RepoGetLocalFN(repo_ids[i].c_str());
+		json_t *repo_js = json_load_file_report(repo_local_fn);
+		free(repo_local_fn);
+		if (repo_js) {
+			repo_vector[i] = RepoLoadJson(repo_js);
+			json_decref(repo_js);
+		}
+	});
+	repo_vector.erase(std::remove(repo_vector.begin(), repo_vector.end(), nullptr), repo_vector.end());
+
 	std::sort(repo_vector.begin(), repo_vector.end(), [](repo_t *a, repo_t *b) {
 		return strcmp(a->id, b->id) < 0;
 	});
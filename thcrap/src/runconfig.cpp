@@ -9,6 +9,8 @@
 
 #include "thcrap.h"
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 struct stage_t
@@ -17,6 +19,13 @@ struct stage_t
 	std::vector<binhack_t> binhacks;
 	std::vector<codecave_t> codecaves;
 	std::vector<breakpoint_local_t> breakpoints;
+	// Folded hackpoint objects the stage was loaded from, for repatching
+	json_t *binhacks_json = nullptr;
+	json_t *codecaves_json = nullptr;
+	json_t *breakpoints_json = nullptr;
+	// Module the stage was applied with, valid if [applied] is set
+	HMODULE applied_module = nullptr;
+	bool applied = false;
 };
 
 struct runconfig_t
@@ -25,6 +34,32 @@ struct runconfig_t
 	json_t *json = nullptr;
 	// True if the console should be enabled (from runcfg)
 	bool console;
+	// True if file accesses should be recorded into a trace (from runcfg)
+	bool file_trace;
+	// True if breakpoints should count their hits and cycles (from runcfg)
+	bool bp_profile;
+	// Samples per second taken of the game's main thread, 0 if disabled (from runcfg)
+	unsigned int sample_profile;
+	// True if the frame time overlay should be shown (from runcfg)
+	bool frame_overlay;
+	// Frame rate the D3D detours limit the game to, 0 if disabled (from runcfg)
+	double frame_limit;
+	// True if Direct3D 9 games should get a Direct3D 9Ex device (from runcfg)
+	bool d3d9ex;
+	// True if breakpoint expressions should be compiled to native code (from runcfg)
+	bool expr_jit;
+	// Mask of trace_category_t values to record trace events for (from runcfg)
+	unsigned int trace_events;
+	// Size of the cross-process cache of patched files in MiB, 0 if disabled (from runcfg)
+	unsigned int shared_cache;
+	// Budget for the replacement buffers of all open files in MiB, 0 if unlimited (from runcfg)
+	unsigned int file_rep_budget = RUNCONFIG_FILE_REP_BUDGET_DEFAULT;
+	// Budget for the on-disk cache of derived data in MiB, 0 if unlimited (from runcfg)
+	unsigned int disk_cache_budget = RUNCONFIG_DISK_CACHE_BUDGET_DEFAULT;
+	// Budget for all in-memory caches together in MiB, 0 if unlimited (from runcfg)
+	unsigned int cache_budget = RUNCONFIG_CACHE_BUDGET_DEFAULT;
+	// Pre-baked pack written by thcrap_bake, empty if none (from runcfg)
+	std::string prebaked;
 	// Thcrap directory (from runtime)
 	std::string thcrap_dir;
 	// Run configuration path (from runtime)
@@ -44,12 +79,111 @@ struct runconfig_t
 	// Hackpoints (breakpoints, codecaves and binhacks) for stages (from game_id.js and game_id.build.js).
 	// The global hackpoints (those not in a stage) are put in the last stage.
 	std::vector<stage_t> stages;
+	// True if the stages come from the game configuration rather than the runcfg
+	bool stages_from_game;
 	// Boolean flag that tells the binhack parser if it should show a message box, should it fail to find a function
 	bool msgbox_invalid_func;
 };
 
 static runconfig_t run_cfg;
 
+// Replaces the expression string at [key] in [obj] with its value, if that
+// value only depends on options and CPU features. Those can't change once
+// the options of a stage are loaded, so nothing reading the run
+// configuration later has to evaluate the expression again.
+static void runconfig_fold_eval(json_t *obj, const char *key, bool is_bool)
+{
+	json_t *val = json_object_get(obj, key);
+	if (!json_is_string(val)) {
+		return;
+	}
+	std::string deps;
+	size_t result;
+	expr_deps_begin(&deps);
+	int ret = json_eval_int(val, &result, JEVAL_DEFAULT);
+	if (!expr_deps_end() || ret != JEVAL_SUCCESS || !expr_deps_constant(deps)) {
+		return;
+	}
+	json_object_set_new(obj, key, is_bool ? json_boolean(result) : json_integer(result));
+}
+
+// Folds the constant fields of every hackpoint in [stage_json], and removes
+// the ones that are ignored.
+static void runconfig_stage_fold(json_t *stage_json)
+{
+	static const struct {
+		const char *type;
+		const char *name;
+		// Both terminated by a nullptr
+		const char *int_fields[4];
+		const char *bool_fields[2];
+	} hackpoint_types[] = {
+		{ "binhacks", "binhack", {}, {} },
+		{ "codecaves", "codecave", { "size", "count", "fill" }, { "export" } },
+		{ "breakpoints", "breakpoint", { "cavesize" }, {} },
+	};
+
+	for (const auto& hackpoint_type : hackpoint_types) {
+		json_t *hackpoints = json_object_get(stage_json, hackpoint_type.type);
+		const char *key;
+		json_t *value;
+		void *tmp;
+		json_object_foreach_safe(hackpoints, tmp, key, value) {
+			if (!json_is_object(value)) {
+				continue;
+			}
+			runconfig_fold_eval(value, "ignore", true);
+			if (json_is_true(json_object_get(value, "ignore"))) {
+				log_printf("%s %s: ignored\n", hackpoint_type.name, key);
+				json_object_del(hackpoints, key);
+				continue;
+			}
+			for (const char *const *field = hackpoint_type.int_fields; *field; field++) {
+				runconfig_fold_eval(value, *field, false);
+			}
+			for (const char *const *field = hackpoint_type.bool_fields; *field; field++) {
+				runconfig_fold_eval(value, *field, true);
+			}
+		}
+	}
+}
+
+static bool runconfig_codecave_from_json(const char *key, json_t *value, codecave_t *out)
+{
+	if (strcmp(key, "protection") == 0) {
+		return false;
+	}
+
+	if (strchr(key, '+')) {
+		log_printf("Codecave %s contains illegal character +", key);
+		return false;
+	}
+
+	return codecave_from_json(key, value, out);
+}
+
+static void runconfig_binhack_free(binhack_t& binhack)
+{
+	free(binhack.name);
+	free(binhack.title);
+	free(binhack.code);
+	free(binhack.expected);
+	for (size_t i = 0; binhack.addr[i].type != END_ADDR; ++i) {
+		if (binhack.addr[i].type == STR_ADDR) {
+			free(binhack.addr[i].str);
+		} else if (binhack.addr[i].type == PATTERN_ADDR) {
+			sigscan_pattern_free(binhack.addr[i].pattern);
+		}
+	}
+	free(binhack.addr);
+}
+
+static void runconfig_codecave_free(codecave_t& codecave)
+{
+	free(codecave.name);
+	free(codecave.code);
+}
+
 static void runconfig_stage_load(json_t *stage_json)
 {
 	stage_t stage;
@@ -68,6 +202,10 @@ static void runconfig_stage_load(json_t *stage_json)
 	if (options) {
 		patch_opts_from_json(options);
 	}
+	runconfig_stage_fold(stage_json);
+	stage.binhacks_json = json_incref(json_object_get(stage_json, "binhacks"));
+	stage.codecaves_json = json_incref(json_object_get(stage_json, "codecaves"));
+	stage.breakpoints_json = json_incref(json_object_get(stage_json, "breakpoints"));
 
 	json_t *binhacks = json_object_get(stage_json, "binhacks");
 	json_object_foreach(binhacks, key, value) {
@@ -80,17 +218,8 @@ static void runconfig_stage_load(json_t *stage_json)
 
 	json_t *codecaves = json_object_get(stage_json, "codecaves");
 	json_object_foreach(codecaves, key, value) {
-		if (strcmp(key, "protection") == 0) {
-			continue;
-		}
-
-		if (strchr(key, '+')) {
-			log_printf("Codecave %s contains illegal character +", key);
-			continue;
-		}
-
 		codecave_t codecave;
-		if (!codecave_from_json(key, value, &codecave)) {
+		if (!runconfig_codecave_from_json(key, value, &codecave)) {
 			continue;
 		}
 		stage.codecaves.push_back(codecave);
@@ -146,6 +275,79 @@ void runconfig_load(json_t *file, int flags)
 	if (value) {
 		run_cfg.console = json_is_true(value);
 	}
+	value = json_object_get(file, "file_trace");
+	if (value) {
+		run_cfg.file_trace = json_is_true(value);
+	}
+	value = json_object_get(file, "bp_profile");
+	if (value) {
+		run_cfg.bp_profile = json_is_true(value);
+	}
+	value = json_object_get(file, "sample_profile");
+	if (json_is_integer(value)) {
+		run_cfg.sample_profile = (unsigned int)MAX(json_integer_value(value), 0);
+	} else if (value) {
+		run_cfg.sample_profile = json_is_true(value) ? RUNCONFIG_SAMPLE_PROFILE_DEFAULT : 0;
+	}
+	value = json_object_get(file, "frame_overlay");
+	if (value) {
+		run_cfg.frame_overlay = json_is_true(value);
+	}
+	value = json_object_get(file, "frame_limit");
+	if (json_is_number(value)) {
+		run_cfg.frame_limit = MAX(json_number_value(value), 0.0);
+	} else if (value) {
+		run_cfg.frame_limit = json_is_true(value) ? 60.0 : 0.0;
+	}
+	value = json_object_get(file, "d3d9ex");
+	if (value) {
+		run_cfg.d3d9ex = json_is_true(value);
+	}
+	value = json_object_get(file, "expr_jit");
+	if (value) {
+		run_cfg.expr_jit = json_is_true(value);
+	}
+	value = json_object_get(file, "trace_events");
+	if (json_is_array(value)) {
+		run_cfg.trace_events = 0;
+		size_t i;
+		json_t *cat_name;
+		json_array_foreach(value, i, cat_name) {
+			unsigned int cat = trace_category_from_name(json_string_value(cat_name));
+			if (!cat) {
+				log_printf("ERROR: unknown trace event category \"%s\"\n", json_string_value(cat_name));
+			}
+			run_cfg.trace_events |= cat;
+		}
+	} else if (value) {
+		run_cfg.trace_events = json_is_true(value) ? TRACE_DEFAULT : 0;
+	}
+	value = json_object_get(file, "shared_cache");
+	if (json_is_integer(value)) {
+		run_cfg.shared_cache = (unsigned int)json_integer_value(value);
+	} else if (value) {
+		run_cfg.shared_cache = json_is_true(value) ? 32 : 0;
+	}
+	value = json_object_get(file, "file_rep_budget");
+	if (json_is_integer(value)) {
+		run_cfg.file_rep_budget = (unsigned int)json_integer_value(value);
+	}
+	value = json_object_get(file, "disk_cache_budget");
+	if (json_is_integer(value)) {
+		run_cfg.disk_cache_budget = (unsigned int)json_integer_value(value);
+	}
+	value = json_object_get(file, "cache_budget");
+	if (json_is_integer(value)) {
+		run_cfg.cache_budget = (unsigned int)json_integer_value(value);
+	}
+	value = json_object_get(file, "prebaked");
+	if (json_is_string(value)) {
+		run_cfg.prebaked = json_string_value(value);
+	}
+	value = json_object_get(file, "log_level");
+	if (value && log_level_set(json_string_value(value))) {
+		log_print("ERROR: log_level must be one of \"trace\", \"debug\", \"info\" or \"warn\"\n");
+	}
 	run_cfg.msgbox_invalid_func = json_is_true(json_object_get(run_cfg.json, "msgbox_invalid_func"));
 	value = json_object_get(file, "dat_dump");
 	if (value && (run_cfg.dat_dump.empty() || can_overwrite)) {
@@ -175,11 +377,7 @@ void runconfig_load(json_t *file, int flags)
 
 	value = json_object_get(file, "patches");
 	if (value) {
-		size_t i;
-		json_t *patch;
-		json_array_foreach(value, i, patch) {
-			stack_add_patch_from_json(patch);
-		}
+		stack_add_patches_from_json(value);
 	}
 
 	if (load_binhacks) {
@@ -188,6 +386,7 @@ void runconfig_load(json_t *file, int flags)
 			(stages || json_object_get(file, "binhacks") || json_object_get(file, "codecaves") || json_object_get(file, "breakpoints")) || json_object_get(file, "options")
 			) {
 			run_cfg.stages.clear();
+			run_cfg.stages_from_game = !can_overwrite;
 			size_t i;
 			json_flex_array_foreach(stages, i, value) {
 				runconfig_stage_load(value);
@@ -211,6 +410,20 @@ void runconfig_print()
 	log_printf("Complete run configuration:\n");
 	log_printf("---------------------------\n");
 	log_printf("  console: %s\n",      run_cfg.console ? "true" : "false");
+	log_printf("  file trace: %s\n",   run_cfg.file_trace ? "true" : "false");
+	log_printf("  breakpoint profile: %s\n", run_cfg.bp_profile ? "true" : "false");
+	log_printf("  sample profile: %u Hz\n", run_cfg.sample_profile);
+	log_printf("  frame overlay: %s\n", run_cfg.frame_overlay ? "true" : "false");
+	log_printf("  frame limit: %g FPS\n", run_cfg.frame_limit);
+	log_printf("  Direct3D 9Ex: %s\n", run_cfg.d3d9ex ? "true" : "false");
+	log_printf("  expression JIT: %s\n", run_cfg.expr_jit ? "true" : "false");
+	log_printf("  trace events: 0x%x\n", run_cfg.trace_events);
+	log_printf("  shared cache: %u MiB\n", run_cfg.shared_cache);
+	log_printf("  file replacement budget: %u MiB\n", run_cfg.file_rep_budget);
+	log_printf("  disk cache budget: %u MiB\n", run_cfg.disk_cache_budget);
+	log_printf("  cache budget: %u MiB\n", run_cfg.cache_budget);
+	log_printf("  pre-baked pack: '%s'\n", run_cfg.prebaked.c_str());
+	log_printf("  log level: %s\n",    log_level_name(log_level));
 	log_printf("  thcrap dir: '%s'\n", run_cfg.thcrap_dir.c_str());
 	log_printf("  runcfg fn: '%s'\n",  run_cfg.runcfg_fn.c_str());
 	log_printf("  game id: '%s'\n",    run_cfg.game.c_str());
@@ -240,6 +453,20 @@ void runconfig_free()
 	json_decref_safe(run_cfg.json);
 	run_cfg.json = nullptr;
 	run_cfg.console = false;
+	run_cfg.file_trace = false;
+	run_cfg.bp_profile = false;
+	run_cfg.sample_profile = 0;
+	run_cfg.frame_overlay = false;
+	run_cfg.frame_limit = 0.0;
+	run_cfg.d3d9ex = false;
+	run_cfg.expr_jit = false;
+	run_cfg.trace_events = 0;
+	run_cfg.shared_cache = 0;
+	run_cfg.file_rep_budget = RUNCONFIG_FILE_REP_BUDGET_DEFAULT;
+	run_cfg.disk_cache_budget = RUNCONFIG_DISK_CACHE_BUDGET_DEFAULT;
+	run_cfg.cache_budget = RUNCONFIG_CACHE_BUDGET_DEFAULT;
+	run_cfg.prebaked.clear();
+	log_level = LOG_LEVEL_DEBUG;
 	run_cfg.thcrap_dir.clear();
 	run_cfg.runcfg_fn.clear();
 	run_cfg.game.clear();
@@ -250,21 +477,11 @@ void runconfig_free()
 	run_cfg.dat_dump.clear();
 	for (auto& stage : run_cfg.stages) {
 		for (auto& binhack : stage.binhacks) {
-			free(binhack.name);
-			free(binhack.title);
-			free(binhack.code);
-			free(binhack.expected);
-			for (size_t i = 0; binhack.addr[i].type != END_ADDR; ++i) {
-				if (binhack.addr[i].type == STR_ADDR) {
-					free(binhack.addr[i].str);
-				}
-			}
-			free(binhack.addr);
+			runconfig_binhack_free(binhack);
 		}
 		stage.binhacks.clear();
 		for (auto& codecave : stage.codecaves) {
-			free(codecave.name);
-			free(codecave.code);
+			runconfig_codecave_free(codecave);
 		}
 		stage.codecaves.clear();
 		for (auto& breakpoint : stage.breakpoints) {
@@ -272,14 +489,21 @@ void runconfig_free()
 			for (size_t i = 0; breakpoint.addr[i].type != END_ADDR; ++i) {
 				if (breakpoint.addr[i].type == STR_ADDR) {
 					free(breakpoint.addr[i].str);
+				} else if (breakpoint.addr[i].type == PATTERN_ADDR) {
+					sigscan_pattern_free(breakpoint.addr[i].pattern);
 				}
 			}
 			free(breakpoint.addr);
+			breakpoint_cache_free(&breakpoint);
 			json_decref(breakpoint.json_obj);
 		}
 		stage.breakpoints.clear();
+		json_decref(stage.binhacks_json);
+		json_decref(stage.codecaves_json);
+		json_decref(stage.breakpoints_json);
 	}
 	run_cfg.stages.clear();
+	run_cfg.stages_from_game = false;
 }
 
 const json_t *runconfig_json_get()
@@ -292,6 +516,71 @@ bool runconfig_console_get()
 	return run_cfg.console;
 }
 
+bool runconfig_file_trace_get()
+{
+	return run_cfg.file_trace;
+}
+
+bool runconfig_bp_profile_get()
+{
+	return run_cfg.bp_profile;
+}
+
+bool runconfig_frame_overlay_get()
+{
+	return run_cfg.frame_overlay;
+}
+
+unsigned int runconfig_sample_profile_get()
+{
+	return run_cfg.sample_profile;
+}
+
+double runconfig_frame_limit_get()
+{
+	return run_cfg.frame_limit;
+}
+
+bool runconfig_d3d9ex_get()
+{
+	return run_cfg.d3d9ex;
+}
+
+bool runconfig_expr_jit_get()
+{
+	return run_cfg.expr_jit;
+}
+
+unsigned int runconfig_trace_events_get()
+{
+	return run_cfg.trace_events;
+}
+
+unsigned int runconfig_shared_cache_get()
+{
+	return run_cfg.shared_cache;
+}
+
+unsigned int runconfig_file_rep_budget_get()
+{
+	return run_cfg.file_rep_budget;
+}
+
+unsigned int runconfig_disk_cache_budget_get()
+{
+	return run_cfg.disk_cache_budget;
+}
+
+unsigned int runconfig_cache_budget_get()
+{
+	return run_cfg.cache_budget;
+}
+
+const char *runconfig_prebaked_get()
+{
+	return run_cfg.prebaked.empty() == false ? run_cfg.prebaked.c_str() : nullptr;
+}
+
 const char *runconfig_thcrap_dir_get()
 {
 	return run_cfg.thcrap_dir.empty() == false ? run_cfg.thcrap_dir.c_str() : nullptr;
@@ -421,15 +710,265 @@ bool runconfig_stage_apply(size_t stage_num, int flags, HMODULE module)
 	else {
 		hMod = stage.module;
 	}
+	stage.applied_module = hMod;
+	stage.applied = true;
 
+	startup_phase_begin("Codecaves");
 	ret += codecaves_apply(stage.codecaves.data(), stage.codecaves.size());
+	startup_phase_end();
+	startup_phase_begin("Binary hacks");
 	ret += binhacks_apply(stage.binhacks.data(), stage.binhacks.size(), hMod);
+	startup_phase_end();
 	if (!(flags & RUNCFG_STAGE_SKIP_BREAKPOINTS)) {
 		// FIXME: this workaround is needed, because breakpoints don't check what they overwrite
 		if (!(ret != 0 && stage_num == 0 && run_cfg.stages.size() >= 2)) {
+			startup_phase_begin("Breakpoints");
 			ret += breakpoints_apply(stage.breakpoints.data(), stage.breakpoints.size(), hMod);
+			startup_phase_end();
 		}
 	}
 
 	return ret == 0;
 }
+
+/// Repatching
+/// ----------
+/**
+  * Changes to the game configuration are applied to the running game by
+  * diffing the folded hackpoint objects of every stage against the ones it
+  * was loaded from. Changed binary hacks are reverted to the original bytes
+  * and applied again, changed codecaves are moved to new memory in the
+  * arena, and everything that refers to a moved codecave is rendered again.
+  * The old caves are never freed, since the game might still be executing
+  * them.
+  */
+
+static std::string runconfig_game_fn()
+{
+	std::string ret = run_cfg.game;
+	if (stricmp(PathFindExtensionA(ret.c_str()), ".js")) {
+		ret += ".js";
+	}
+	return ret;
+}
+
+// Returns whether the code string [code] refers to any of the codecaves in
+// [caves].
+static bool runconfig_code_uses_caves(const char *code, const std::unordered_set<std::string>& caves)
+{
+	if (!code || caves.empty()) {
+		return false;
+	}
+	for (const char *p = strstr(code, "codecave:"); p; p = strstr(p, "codecave:")) {
+		p += strlen("codecave:");
+		const size_t len = strcspn(p, "]>+ ");
+		if (caves.count(std::string(p, len))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Adds the keys of all values that differ between [old_obj] and [new_obj]
+// to [out].
+static void runconfig_json_diff(json_t *old_obj, json_t *new_obj, std::unordered_set<std::string>& out)
+{
+	const char *key;
+	json_t *value;
+	json_object_foreach(old_obj, key, value) {
+		if (!json_equal(value, json_object_get(new_obj, key))) {
+			out.insert(key);
+		}
+	}
+	json_object_foreach(new_obj, key, value) {
+		if (!json_object_get(old_obj, key)) {
+			out.insert(key);
+		}
+	}
+}
+
+static void runconfig_stage_repatch(stage_t& stage, json_t *stage_json)
+{
+	const char *key;
+	json_t *value;
+
+	json_t *options = json_object_get(stage_json, "options");
+	if (options) {
+		patch_opts_from_json(options);
+	}
+	runconfig_stage_fold(stage_json);
+	json_t *binhacks_json = json_object_get(stage_json, "binhacks");
+	json_t *codecaves_json = json_object_get(stage_json, "codecaves");
+	json_t *breakpoints_json = json_object_get(stage_json, "breakpoints");
+
+	if ((stage.breakpoints_json || breakpoints_json) && !json_equal(stage.breakpoints_json, breakpoints_json)) {
+		log_print("(Repatch) Breakpoints have changed, restart the game to apply them.\n");
+	}
+
+	std::unordered_set<std::string> caves_changed;
+	std::unordered_set<std::string> binhacks_changed;
+	runconfig_json_diff(stage.codecaves_json, codecaves_json, caves_changed);
+	caves_changed.erase("protection");
+	runconfig_json_diff(stage.binhacks_json, binhacks_json, binhacks_changed);
+
+	// Everything that refers to a moved codecave has to be rendered again,
+	// which moves codecaves referring to it as well.
+	for (bool grown = true; grown; ) {
+		grown = false;
+		for (const auto& codecave : stage.codecaves) {
+			const char *name = codecave.name + strlen("codecave:");
+			if (!caves_changed.count(name) && runconfig_code_uses_caves(codecave.code, caves_changed)) {
+				caves_changed.insert(name);
+				grown = true;
+			}
+		}
+	}
+	for (const auto& binhack : stage.binhacks) {
+		if (!binhacks_changed.count(binhack.name) && (
+			runconfig_code_uses_caves(binhack.code, caves_changed) ||
+			runconfig_code_uses_caves(binhack.expected, caves_changed)
+		)) {
+			binhacks_changed.insert(binhack.name);
+		}
+	}
+
+	if (!caves_changed.empty() || !binhacks_changed.empty()) {
+		log_printf(
+			"(Repatch) %zu codecaves and %zu binary hacks have changed%s\n",
+			caves_changed.size(), binhacks_changed.size(),
+			stage.applied ? ", reapplying..." : ""
+		);
+
+		// Unchanged hackpoints are carried over from the old stage, which
+		// keeps the order of the new configuration.
+		std::unordered_map<std::string, size_t> codecaves_old;
+		std::unordered_map<std::string, size_t> binhacks_old;
+		for (size_t i = 0; i < stage.codecaves.size(); i++) {
+			codecaves_old[stage.codecaves[i].name + strlen("codecave:")] = i;
+		}
+		for (size_t i = 0; i < stage.binhacks.size(); i++) {
+			binhacks_old[stage.binhacks[i].name] = i;
+		}
+		std::vector<bool> codecaves_kept(stage.codecaves.size(), false);
+		std::vector<bool> binhacks_kept(stage.binhacks.size(), false);
+
+		std::vector<codecave_t> codecaves;
+		std::vector<codecave_t> codecaves_apply_new;
+		json_object_foreach(codecaves_json, key, value) {
+			if (!caves_changed.count(key)) {
+				auto it = codecaves_old.find(key);
+				if (it != codecaves_old.end()) {
+					codecaves.push_back(stage.codecaves[it->second]);
+					codecaves_kept[it->second] = true;
+				}
+				continue;
+			}
+			codecave_t codecave;
+			if (runconfig_codecave_from_json(key, value, &codecave)) {
+				codecaves.push_back(codecave);
+				codecaves_apply_new.push_back(codecave);
+			}
+		}
+
+		std::vector<binhack_t> binhacks;
+		std::vector<binhack_t> binhacks_apply_new;
+		json_object_foreach(binhacks_json, key, value) {
+			if (!binhacks_changed.count(key)) {
+				auto it = binhacks_old.find(key);
+				if (it != binhacks_old.end()) {
+					binhacks.push_back(stage.binhacks[it->second]);
+					binhacks_kept[it->second] = true;
+				}
+				continue;
+			}
+			binhack_t binhack;
+			if (binhack_from_json(key, value, &binhack)) {
+				binhacks.push_back(binhack);
+				binhacks_apply_new.push_back(binhack);
+			}
+		}
+
+		if (stage.applied) {
+			size_t reverted = 0;
+			for (const auto& name : binhacks_changed) {
+				reverted += binhacks_revert(name.c_str());
+			}
+			log_printf("(Repatch) Reverted %zu hackpoints\n", reverted);
+			for (const auto& name : caves_changed) {
+				if (!json_object_get(codecaves_json, name.c_str())) {
+					func_remove(("codecave:" + name).c_str());
+				}
+			}
+			codecaves_apply(codecaves_apply_new.data(), codecaves_apply_new.size());
+			if (!binhacks_apply_new.empty()) {
+				binhacks_apply(binhacks_apply_new.data(), binhacks_apply_new.size(), stage.applied_module);
+			}
+		}
+
+		for (size_t i = 0; i < stage.codecaves.size(); i++) {
+			if (!codecaves_kept[i]) {
+				runconfig_codecave_free(stage.codecaves[i]);
+			}
+		}
+		for (size_t i = 0; i < stage.binhacks.size(); i++) {
+			if (!binhacks_kept[i]) {
+				runconfig_binhack_free(stage.binhacks[i]);
+			}
+		}
+		stage.codecaves = std::move(codecaves);
+		stage.binhacks = std::move(binhacks);
+	}
+
+	json_decref(stage.binhacks_json);
+	json_decref(stage.codecaves_json);
+	json_decref(stage.breakpoints_json);
+	stage.binhacks_json = json_incref(binhacks_json);
+	stage.codecaves_json = json_incref(codecaves_json);
+	stage.breakpoints_json = json_incref(breakpoints_json);
+}
+
+void runconfig_mod_post_init()
+{
+	// The game configuration is resolved before the repatch module starts
+	// recording dependencies.
+	if (run_cfg.stages_from_game && !run_cfg.game.empty()) {
+		stack_deps_add("global.js");
+		stack_deps_add(runconfig_game_fn().c_str());
+	}
+}
+
+void runconfig_mod_repatch(json_t *files_changed)
+{
+	if (!run_cfg.stages_from_game || run_cfg.game.empty()) {
+		return;
+	}
+	const std::string game_fn = runconfig_game_fn();
+	if (!json_object_get(files_changed, game_fn.c_str()) && !json_object_get(files_changed, "global.js")) {
+		return;
+	}
+
+	json_t *cfg = stack_cfg_resolve(game_fn.c_str(), NULL);
+	cfg_cache_store(game_fn.c_str(), cfg);
+
+	std::vector<json_t*> stage_jsons;
+	json_t *stages = json_object_get(cfg, "init_stages");
+	size_t i;
+	json_t *value;
+	json_flex_array_foreach(stages, i, value) {
+		stage_jsons.push_back(value);
+	}
+	stage_jsons.push_back(cfg);
+
+	if (stage_jsons.size() != run_cfg.stages.size()) {
+		log_printf(
+			"(Repatch) The number of initialization stages has changed (%zu != %zu), restart the game to apply it.\n",
+			stage_jsons.size(), run_cfg.stages.size()
+		);
+	} else {
+		for (i = 0; i < stage_jsons.size(); i++) {
+			runconfig_stage_repatch(run_cfg.stages[i], stage_jsons[i]);
+		}
+	}
+	json_decref(cfg);
+}
+/// ----------
@@ -24,6 +24,63 @@ const char *runconfig_runcfg_fn_get();
 // Returns true if the console should be enabled.
 bool runconfig_console_get();
 
+// Returns true if file accesses should be recorded into a trace.
+bool runconfig_file_trace_get();
+
+// Returns true if breakpoint hits should be profiled.
+bool runconfig_bp_profile_get();
+
+#define RUNCONFIG_SAMPLE_PROFILE_DEFAULT 1000
+// Returns the number of samples per second that the sampling profiler takes
+// of the game's main thread, or 0 if it is disabled. true in the run
+// configuration means RUNCONFIG_SAMPLE_PROFILE_DEFAULT.
+unsigned int runconfig_sample_profile_get();
+
+// Returns true if the frame time overlay should be shown.
+bool runconfig_frame_overlay_get();
+
+// Returns the frame rate that the EndScene() detours limit the game to, or
+// 0 if the limiter is disabled. true in the run configuration means 60 FPS.
+double runconfig_frame_limit_get();
+
+// Returns true if Direct3D 9 games should get a Direct3D 9Ex device with
+// flip model presentation.
+bool runconfig_d3d9ex_get();
+
+// Returns true if breakpoint expressions should be compiled to native code.
+bool runconfig_expr_jit_get();
+
+// Returns the mask of trace_category_t values that trace events are
+// recorded for.
+unsigned int runconfig_trace_events_get();
+
+// Returns the size of the cross-process cache of patched files in MiB, or 0
+// if it is disabled. true in the run configuration means 32 MiB.
+unsigned int runconfig_shared_cache_get();
+
+#define RUNCONFIG_FILE_REP_BUDGET_DEFAULT 256
+
+// Returns the budget for the heap buffers of all currently open replacement
+// files in MiB, or 0 if it is unlimited. Defaults to
+// RUNCONFIG_FILE_REP_BUDGET_DEFAULT.
+unsigned int runconfig_file_rep_budget_get();
+
+#define RUNCONFIG_DISK_CACHE_BUDGET_DEFAULT 512
+
+// Returns the size limit of the on-disk cache of derived data in MiB, or 0
+// if it is unlimited. Defaults to RUNCONFIG_DISK_CACHE_BUDGET_DEFAULT.
+unsigned int runconfig_disk_cache_budget_get();
+
+#define RUNCONFIG_CACHE_BUDGET_DEFAULT 64
+
+// Returns the memory budget for all in-memory caches together in MiB, or 0
+// if it is unlimited. Defaults to RUNCONFIG_CACHE_BUDGET_DEFAULT.
+unsigned int runconfig_cache_budget_get();
+
+// Returns the path to the pre-baked pack, relative to the thcrap directory
+// unless absolute, or NULL if there is none.
+const char *runconfig_prebaked_get();
+
 // Returns the game id, for example "th06"
 const char *runconfig_game_get();
 
@@ -98,3 +155,8 @@ void runconfig_runcfg_fn_set(const char *runcfg_fn);
 
 // Set the game build
 void runconfig_build_set(const char *build);
+
+// Reapplies the binary hacks and codecaves that changed in the game
+// configuration, if any of its files are in [files_changed].
+void runconfig_mod_post_init();
+void runconfig_mod_repatch(json_t *files_changed);
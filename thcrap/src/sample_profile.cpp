@@ -0,0 +1,357 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Sampling profiler.
+  */
+
+#include "thcrap.h"
+#include <algorithm>
+#include <unordered_map>
+#include <tlhelp32.h>
+
+#pragma comment(lib, "winmm.lib")
+
+// The scheduler can't wake us up any more often than this anyway.
+#define SAMPLE_PROFILE_HZ_MAX 1000
+// How long sample_profile_stop() waits for the sampling thread.
+#define SAMPLE_PROFILE_EXIT_TIMEOUT 5000
+// Rows of the table written to the log.
+#define SAMPLE_PROFILE_LOG_ROWS 30
+
+struct sample_profile_t {
+	HANDLE thread;
+	HANDLE target;
+	HANDLE event_quit;
+	DWORD interval_ms;
+	LONGLONG start;
+	LONGLONG end;
+
+	// Only accessed by the sampling thread while it runs.
+	std::unordered_map<size_t, uint32_t> samples;
+	uint32_t failures;
+};
+
+static sample_profile_t sp;
+
+struct sample_row_t {
+	std::string module;
+	std::string symbol;
+	uint64_t count;
+};
+
+struct sample_module_t {
+	std::string name;
+	bool exe;
+	// Named exports, sorted by address
+	std::vector<std::pair<size_t, const char*>> exports;
+};
+
+// The thread that has been running the longest is the one that the process
+// was started with, no matter which thread calls us.
+static DWORD sample_profile_main_thread_id(void)
+{
+	HANDLE snap = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+	if(snap == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+	const DWORD pid = GetCurrentProcessId();
+	ULONGLONG earliest = ULLONG_MAX;
+	DWORD ret = 0;
+	THREADENTRY32 te;
+	te.dwSize = sizeof(te);
+	for(BOOL ok = Thread32First(snap, &te); ok; ok = Thread32Next(snap, &te)) {
+		if(te.th32OwnerProcessID != pid) {
+			continue;
+		}
+		HANDLE thread = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE, te.th32ThreadID);
+		if(!thread) {
+			continue;
+		}
+		FILETIME created, exited, kernel, user;
+		if(GetThreadTimes(thread, &created, &exited, &kernel, &user)) {
+			const ULONGLONG time = ((ULONGLONG)created.dwHighDateTime << 32) | created.dwLowDateTime;
+			if(time < earliest) {
+				earliest = time;
+				ret = te.th32ThreadID;
+			}
+		}
+		CloseHandle(thread);
+	}
+	CloseHandle(snap);
+	return ret;
+}
+
+static DWORD WINAPI sample_profile_proc(void *)
+{
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+	const bool period = timeBeginPeriod(1) == TIMERR_NOERROR;
+	CONTEXT ctx;
+	while(WaitForSingleObject(sp.event_quit, sp.interval_ms) == WAIT_TIMEOUT) {
+		// Nothing between suspending and resuming may allocate, since the
+		// main thread could be holding the heap lock.
+		if(SuspendThread(sp.target) == (DWORD)-1) {
+			// The main thread is gone, so is everything we could sample.
+			if(WaitForSingleObject(sp.target, 0) == WAIT_OBJECT_0) {
+				break;
+			}
+			sp.failures++;
+			continue;
+		}
+		ctx.ContextFlags = CONTEXT_CONTROL;
+		const BOOL ok = GetThreadContext(sp.target, &ctx);
+		ResumeThread(sp.target);
+		if(!ok) {
+			sp.failures++;
+			continue;
+		}
+#ifdef _WIN64
+		sp.samples[(size_t)ctx.Rip]++;
+#else
+		sp.samples[(size_t)ctx.Eip]++;
+#endif
+	}
+	if(period) {
+		timeEndPeriod(1);
+	}
+	return 0;
+}
+
+void sample_profile_start(unsigned int hz)
+{
+	if(sp.thread || !hz) {
+		return;
+	}
+	const DWORD main_id = sample_profile_main_thread_id();
+	sp.target = main_id ? OpenThread(
+		THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION | SYNCHRONIZE,
+		FALSE, main_id
+	) : NULL;
+	if(!sp.target) {
+		log_print("(Sample profile) Couldn't open the main thread\n");
+		return;
+	}
+	hz = MIN(hz, (unsigned int)SAMPLE_PROFILE_HZ_MAX);
+	sp.interval_ms = 1000 / hz;
+	sp.samples.clear();
+	sp.failures = 0;
+	sp.event_quit = CreateEvent(NULL, TRUE, FALSE, NULL);
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	sp.start = now.QuadPart;
+	sp.thread = sp.event_quit ? CreateThread(NULL, 0, sample_profile_proc, NULL, 0, NULL) : NULL;
+	if(!sp.thread) {
+		log_print("(Sample profile) Couldn't start the sampling thread\n");
+		if(sp.event_quit) {
+			CloseHandle(sp.event_quit);
+			sp.event_quit = NULL;
+		}
+		CloseHandle(sp.target);
+		sp.target = NULL;
+		return;
+	}
+	log_printf("(Sample profile) Sampling thread %u every %u ms\n", main_id, sp.interval_ms);
+}
+
+static void sample_module_init(sample_module_t &mod, HMODULE hMod)
+{
+	size_t fn_len = GetModuleFileNameU(hMod, NULL, 0) + 1;
+	VLA(char, fn, fn_len);
+	if(GetModuleFileNameU(hMod, fn, fn_len)) {
+		mod.name = PathFindFileNameU(fn);
+	} else {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "0x%p", hMod);
+		mod.name = buf;
+	}
+	VLA_FREE(fn);
+	mod.exe = hMod == GetModuleHandle(NULL);
+	if(mod.exe) {
+		return;
+	}
+
+	// GetExportedFunctions() also makes up names for unnamed exports, which
+	// we don't want to attribute anything to.
+	IMAGE_EXPORT_DIRECTORY *desc = GetDllExportDesc(hMod);
+	if(!desc) {
+		return;
+	}
+	const size_t base = (size_t)hMod;
+	auto *func_rvas = (DWORD*)(base + desc->AddressOfFunctions);
+	auto *name_rvas = (DWORD*)(base + desc->AddressOfNames);
+	auto *name_ordinals = (WORD*)(base + desc->AddressOfNameOrdinals);
+	for(DWORD i = 0; i < desc->NumberOfNames; i++) {
+		if(name_ordinals[i] < desc->NumberOfFunctions) {
+			mod.exports.push_back({
+				base + func_rvas[name_ordinals[i]], (const char*)(base + name_rvas[i])
+			});
+		}
+	}
+	std::sort(mod.exports.begin(), mod.exports.end());
+}
+
+// Fills the module and symbol of [row] for [addr].
+static void sample_symbolize(
+	sample_row_t &row, size_t addr,
+	std::unordered_map<HMODULE, sample_module_t> &modules
+) {
+	char buf[64];
+	if(const char *cave = cave_arena_lookup((void*)addr)) {
+		row.module = "[caves]";
+		row.symbol = cave[0] ? cave : "(unnamed)";
+		return;
+	}
+	HMODULE hMod = GetModuleContaining((void*)addr);
+	if(!hMod) {
+		row.module = "[unknown]";
+		snprintf(buf, sizeof(buf), "0x%p", (void*)addr);
+		row.symbol = buf;
+		return;
+	}
+	auto it = modules.find(hMod);
+	if(it == modules.end()) {
+		it = modules.emplace(hMod, sample_module_t()).first;
+		sample_module_init(it->second, hMod);
+	}
+	const sample_module_t &mod = it->second;
+	row.module = mod.name;
+	if(!mod.exe) {
+		auto sym = std::upper_bound(
+			mod.exports.begin(), mod.exports.end(), std::make_pair(addr, (const char*)UINTPTR_MAX)
+		);
+		if(sym != mod.exports.begin()) {
+			row.symbol = mod.name + "!" + (--sym)->second;
+			return;
+		}
+	}
+	snprintf(buf, sizeof(buf), "+0x%zx", addr - (size_t)hMod);
+	row.symbol = mod.name + buf;
+}
+
+static void sample_profile_dump(void)
+{
+	std::unordered_map<HMODULE, sample_module_t> modules;
+	std::unordered_map<std::string, size_t> row_index;
+	std::unordered_map<std::string, uint64_t> module_totals;
+	std::vector<sample_row_t> rows;
+	uint64_t total = 0;
+	for(const auto& sample : sp.samples) {
+		sample_row_t row;
+		sample_symbolize(row, sample.first, modules);
+		module_totals[row.module] += sample.second;
+		total += sample.second;
+		auto index = row_index.emplace(row.module + ";" + row.symbol, rows.size());
+		if(index.second) {
+			row.count = sample.second;
+			rows.push_back(std::move(row));
+		} else {
+			rows[index.first->second].count += sample.second;
+		}
+	}
+	std::sort(rows.begin(), rows.end(), [](const sample_row_t &a, const sample_row_t &b) {
+		return a.count != b.count ? a.count > b.count : a.symbol < b.symbol;
+	});
+	std::vector<std::pair<std::string, uint64_t>> modules_sorted(module_totals.begin(), module_totals.end());
+	std::sort(modules_sorted.begin(), modules_sorted.end(), [](const auto &a, const auto &b) {
+		return a.second != b.second ? a.second > b.second : a.first < b.first;
+	});
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	const double seconds = (double)(sp.end - sp.start) / (double)freq.QuadPart;
+	auto percent = [total](uint64_t count) {
+		return total ? 100.0 * (double)count / (double)total : 0.0;
+	};
+
+	char line[512];
+	snprintf(line, sizeof(line),
+		"%llu samples over %.1f s (%.0f Hz), %u failed\n",
+		(unsigned long long)total, seconds, seconds > 0.0 ? (double)total / seconds : 0.0, sp.failures
+	);
+	log_printf(
+		"---------------\n"
+		"Sample profile:\n"
+		"---------------\n"
+		"%s"
+		"   samples       %%  symbol\n",
+		line
+	);
+	std::string txt = line;
+	txt += "\n   samples       %  symbol\n";
+	for(size_t i = 0; i < rows.size(); i++) {
+		const sample_row_t &row = rows[i];
+		snprintf(line, sizeof(line), "%10llu %6.2f%%  %s%s%s\n",
+			(unsigned long long)row.count, percent(row.count),
+			row.module[0] == '[' ? row.module.c_str() : "",
+			row.module[0] == '[' ? " " : "",
+			row.symbol.c_str()
+		);
+		if(i < SAMPLE_PROFILE_LOG_ROWS) {
+			log_print(line);
+		}
+		txt += line;
+	}
+	log_print("\n   samples       %  module\n");
+	txt += "\n   samples       %  module\n";
+	for(const auto& mod : modules_sorted) {
+		snprintf(line, sizeof(line), "%10llu %6.2f%%  %s\n",
+			(unsigned long long)mod.second, percent(mod.second), mod.first.c_str()
+		);
+		log_print(line);
+		txt += line;
+	}
+	log_print("---------------\n");
+
+	std::string folded;
+	for(const sample_row_t &row : rows) {
+		snprintf(line, sizeof(line), "%s;%s %llu\n",
+			row.module.c_str(), row.symbol.c_str(), (unsigned long long)row.count
+		);
+		folded += line;
+	}
+
+	const char *thcrap_dir = runconfig_thcrap_dir_get();
+	const std::string dir = thcrap_dir ? std::string(thcrap_dir) + "/" : "";
+	for(const auto& out : { std::make_pair("logs/sample_profile.txt", &txt), std::make_pair("logs/sample_profile.folded", &folded) }) {
+		const std::string fn = dir + out.first;
+		if(file_write(fn.c_str(), out.second->data(), out.second->size())) {
+			log_printf("(Sample profile) Couldn't write %s\n", fn.c_str());
+		}
+	}
+}
+
+void sample_profile_stop(void)
+{
+	if(!sp.thread) {
+		return;
+	}
+	SetEvent(sp.event_quit);
+	if(WaitForSingleObject(sp.thread, SAMPLE_PROFILE_EXIT_TIMEOUT) != WAIT_OBJECT_0) {
+		// Might still be writing to [sp.samples], so leave everything alone.
+		log_print("(Sample profile) The sampling thread didn't stop, discarding its results\n");
+		return;
+	}
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	sp.end = now.QuadPart;
+	CloseHandle(sp.thread);
+	CloseHandle(sp.event_quit);
+	CloseHandle(sp.target);
+	sp.thread = NULL;
+	sp.event_quit = NULL;
+	sp.target = NULL;
+	sample_profile_dump();
+	sp.samples.clear();
+}
+
+void sample_profile_mod_post_init(void)
+{
+	sample_profile_start(runconfig_sample_profile_get());
+}
+
+void sample_profile_mod_exit(void)
+{
+	sample_profile_stop();
+}
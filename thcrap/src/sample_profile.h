@@ -0,0 +1,35 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Sampling profiler, enabled with "sample_profile" in the run
+  * configuration. A separate thread periodically suspends the game's main
+  * thread, records its instruction pointer and resumes it, which costs the
+  * game a few microseconds per sample, independent of what it is doing.
+  *
+  * On exit, the samples are attributed to
+  * • the name of the codecave, breakpoint or JIT-compiled expression they
+  *   hit, for addresses in the cave arena,
+  * • an offset into the game's executable, which has no symbols,
+  * • or the nearest preceding export of any other module, which can be wrong
+  *   for functions that aren't exported.
+  * The result is written to the log, to logs/sample_profile.txt, and to
+  * logs/sample_profile.folded in the "folded stacks" format that flame graph
+  * tools can read. Since the games aren't compiled with frame pointers, only
+  * the sampled address itself is recorded, not the stack leading up to it.
+  */
+
+#pragma once
+
+// Starts sampling the main thread at [hz] samples per second. Does nothing
+// if the profiler is already running.
+void sample_profile_start(unsigned int hz);
+
+// Stops the profiler and writes its results. Does nothing if the profiler
+// isn't running.
+void sample_profile_stop(void);
+
+void sample_profile_mod_post_init(void);
+void sample_profile_mod_exit(void);
@@ -8,165 +8,888 @@
   */
 
 #include <thcrap.h>
+#include <winioctl.h>
 #include <filesystem>
-
-typedef struct alignas(16) {
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+
+// Upper limit for the number of worker threads.
+#define SEARCH_WORKERS_MAX 8
+// Number of workers that may access a device at the same time. Devices that
+// don't report whether they incur a seek penalty are treated as hard disks.
+#define SEARCH_DEVICE_SLOTS_HDD 1
+#define SEARCH_DEVICE_SLOTS_SSD 4
+
+struct search_device_t {
+	std::wstring root;
+	// Semaphore limiting the number of concurrent accesses
+	HANDLE slots;
+	// True if the file system updates the last write time of a directory
+	// whenever an entry is added, removed or renamed in it
+	bool dir_mtime_reliable;
+};
+
+struct search_dir_task_t {
+	// With a trailing backslash
+	std::wstring dir;
+	size_t device;
+	// Last write time of [dir] if it was already known when the task was
+	// created, 0 otherwise
+	ULONGLONG mtime;
+};
+
+// Contents of a directory as of its last write time [mtime].
+struct search_index_dir_t {
+	ULONGLONG mtime;
+	std::vector<std::wstring> subdirs;
+	// All .exe files, regardless of their size
+	std::vector<std::wstring> exes;
+};
+typedef std::pair<std::wstring, search_index_dir_t> search_index_entry_t;
+
+struct search_candidate_t {
+	std::wstring exe_fn;
+	std::wstring dir;
+	size_t device;
+};
+
+struct search_result_t {
+	std::string key;
+	std::string exe_fn;
+	std::string id_str;
+	// Empty if the game has no vpatch
+	std::string vpatch_fn;
+};
+
+// Directory tasks are pushed to and popped from the back of the worker's own
+// deque, which makes every worker search depth-first. Idle workers steal from
+// the front of the deques of other workers, taking the directories closest to
+// the roots and thus the largest chunks of work.
+struct search_worker_t {
+	CRITICAL_SECTION cs;
+	std::deque<search_dir_task_t> tasks;
+	std::vector<search_candidate_t> candidates;
+	std::vector<search_result_t> results;
+	std::vector<search_index_entry_t> index;
+};
+
+struct search_state_t {
 	DWORD size_min;
 	DWORD size_max;
 	json_t *versions;
 	json_t *found;
 	json_t *result;
-	DWORD max_threads;
-	volatile DWORD cur_threads;
-	CRITICAL_SECTION cs_result;
-} search_state_t;
+
+	std::vector<search_device_t> devices;
+	std::vector<search_worker_t> workers;
+
+	// Directory tasks that were pushed but not finished yet
+	volatile LONG tasks_outstanding;
+	HANDLE tasks_event;
+
+	// All candidates of all workers, and the index of the next one to hash
+	std::vector<search_candidate_t> candidates;
+	volatile LONG candidate_next;
+
+	// Search index from the previous searches, keyed by directory path with
+	// a trailing backslash. Read-only while the workers are running.
+	std::unordered_map<std::wstring, search_index_dir_t> index;
+	std::vector<std::wstring> roots;
+};
 
 static search_state_t state;
 
-int SearchCheckExe(wchar_t *local_dir, WIN32_FIND_DATAW *w32fd)
-{
-	int ret = 0;
-	json_t *ver = identify_by_size(w32fd->nFileSizeLow, state.versions);
-	if(ver) {
-		WCSLEN_DEC(local_dir);
-		size_t exe_fn_len = local_dir_len + wcslen(w32fd->cFileName) + 2;
-		VLA(wchar_t, exe_fn, exe_fn_len);
-		const char *key;
-		json_t *game_val;
+/// Devices
+/// -------
+// Only exists in the Windows 7 SDK and later.
+#define SEARCH_STORAGE_DEVICE_SEEK_PENALTY_PROPERTY ((STORAGE_PROPERTY_ID)7)
 
-		wcsncpy(exe_fn, local_dir, local_dir_len);
-		exe_fn[local_dir_len - 1] = 0;
-		wcscat(exe_fn, w32fd->cFileName);
+typedef struct {
+	DWORD Version;
+	DWORD Size;
+	BOOLEAN IncursSeekPenalty;
+} search_seek_penalty_descriptor_t;
 
-		size_t exe_fn_a_len = wcslen(exe_fn)*UTF8_MUL + 1;
-		VLA(char, exe_fn_a, exe_fn_a_len);
-		StringToUTF8(exe_fn_a, exe_fn, exe_fn_a_len);
-		str_slash_normalize(exe_fn_a);
+static LONG search_device_slots(const std::wstring& root)
+{
+	// "\\.\C:", without the trailing backslash
+	std::wstring volume = L"\\\\.\\" + root;
+	if (!volume.empty() && volume.back() == L'\\') {
+		volume.pop_back();
+	}
+	HANDLE hVolume = CreateFileW(
+		volume.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL
+	);
+	if (hVolume == INVALID_HANDLE_VALUE) {
+		return SEARCH_DEVICE_SLOTS_HDD;
+	}
+	STORAGE_PROPERTY_QUERY query = {};
+	query.PropertyId = SEARCH_STORAGE_DEVICE_SEEK_PENALTY_PROPERTY;
+	query.QueryType = PropertyStandardQuery;
+	search_seek_penalty_descriptor_t desc = {};
+	DWORD byte_ret;
+	BOOL ret = DeviceIoControl(
+		hVolume, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &desc, sizeof(desc), &byte_ret, NULL
+	);
+	CloseHandle(hVolume);
+	if (!ret || byte_ret < sizeof(desc) || desc.IncursSeekPenalty) {
+		return SEARCH_DEVICE_SLOTS_HDD;
+	}
+	return SEARCH_DEVICE_SLOTS_SSD;
+}
 
-		ver = identify_by_hash(exe_fn_a, (size_t*)&w32fd->nFileSizeLow, state.versions);
-		if(!ver) {
-			return ret;
+// Returns the index of the device that [dir] is located on.
+static size_t search_device_for(const wchar_t *dir)
+{
+	wchar_t root[MAX_PATH];
+	if (!GetVolumePathNameW(dir, root, MAX_PATH)) {
+		wcsncpy(root, dir, MAX_PATH - 1);
+		root[MAX_PATH - 1] = 0;
+	}
+	for (size_t i = 0; i < state.devices.size(); i++) {
+		if (!_wcsicmp(state.devices[i].root.c_str(), root)) {
+			return i;
 		}
+	}
+	search_device_t device;
+	device.root = root;
+	LONG slots = search_device_slots(device.root);
+	device.slots = CreateSemaphore(NULL, slots, slots, NULL);
+	wchar_t fs_name[MAX_PATH + 1];
+	device.dir_mtime_reliable = GetVolumeInformationW(
+		root, NULL, 0, NULL, NULL, NULL, fs_name, MAX_PATH + 1
+	) && (!wcscmp(fs_name, L"NTFS") || !wcscmp(fs_name, L"ReFS"));
+	state.devices.push_back(device);
+	return state.devices.size() - 1;
+}
+/// -------
 
-		key = json_array_get_string(ver, 0);
+/// Directory enumeration
+/// ---------------------
+static void search_task_push(size_t self, search_dir_task_t&& task)
+{
+	search_worker_t& worker = state.workers[self];
+	InterlockedIncrement(&state.tasks_outstanding);
+	EnterCriticalSection(&worker.cs);
+	worker.tasks.push_back(std::move(task));
+	LeaveCriticalSection(&worker.cs);
+	SetEvent(state.tasks_event);
+}
 
-		// Check if user already selected a version of this game in a previous search
-		if(json_object_get(state.result, key)) {
-			return ret;
+static bool search_task_pop(size_t self, search_dir_task_t& task)
+{
+	const size_t worker_count = state.workers.size();
+	for (size_t n = 0; n < worker_count; n++) {
+		search_worker_t& worker = state.workers[(self + n) % worker_count];
+		EnterCriticalSection(&worker.cs);
+		if (!worker.tasks.empty()) {
+			if (n == 0) {
+				task = std::move(worker.tasks.back());
+				worker.tasks.pop_back();
+			} else {
+				task = std::move(worker.tasks.front());
+				worker.tasks.pop_front();
+			}
+			LeaveCriticalSection(&worker.cs);
+			return true;
 		}
+		LeaveCriticalSection(&worker.cs);
+	}
+	return false;
+}
 
-		// Alright, found a game!
-		// Check if it has a vpatch
-		auto vpatch_fn = std::filesystem::path(local_dir) / L"vpatch.exe";
-		bool use_vpatch = false;
-		if (strstr(key, "_custom") == nullptr && std::filesystem::is_regular_file(vpatch_fn)) {
-			use_vpatch = true;
-		}
+static ULONGLONG search_filetime(const FILETIME& ft)
+{
+	return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
 
-		// Add the game into the result object
-		game_val = json_object_get_create(state.found, key, JSON_OBJECT);
+static bool search_exe_size_matches(DWORD size)
+{
+	return
+		(size >= state.size_min) &&
+		(size <= state.size_max) &&
+		identify_by_size(size, state.versions);
+}
 
-		EnterCriticalSection(&state.cs_result);
-		{
-			const char *build = json_array_get_string(ver, 1);
-			const char *variety = json_array_get_string(ver, 2);
+// Takes the contents of [task.dir] from the search index entry [cached]
+// instead of enumerating the directory. Only the .exe files have to be
+// looked at again, since their size can change without touching the
+// directory.
+static void search_dir_cached(size_t self, const search_dir_task_t& task, const search_index_dir_t& cached)
+{
+	search_worker_t& worker = state.workers[self];
+	for (const auto& exe : cached.exes) {
+		std::wstring exe_fn = task.dir + exe;
+		WIN32_FILE_ATTRIBUTE_DATA attr;
+		if (
+			GetFileAttributesExW(exe_fn.c_str(), GetFileExInfoStandard, &attr)
+			&& !(attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			&& !attr.nFileSizeHigh
+			&& search_exe_size_matches(attr.nFileSizeLow)
+		) {
+			worker.candidates.push_back({ std::move(exe_fn), task.dir, task.device });
+		}
+	}
+	worker.index.emplace_back(task.dir, cached);
+}
 
-			json_t *id_str = json_pack("s++",
-				build ? build : "",
-				build && variety ? " " : "",
-				variety ? variety : ""
-			);
+static void search_dir(size_t self, const search_dir_task_t& task)
+{
+	search_worker_t& worker = state.workers[self];
+	const search_device_t& device = state.devices[task.device];
+	std::vector<search_dir_task_t> subdirs;
+	WIN32_FIND_DATAW w32fd;
+
+	HANDLE slots = device.slots;
+	WaitForSingleObject(slots, INFINITE);
 
-			json_object_set_new(game_val, exe_fn_a, id_str);
+	ULONGLONG mtime = 0;
+	if (device.dir_mtime_reliable) {
+		mtime = task.mtime;
+		WIN32_FILE_ATTRIBUTE_DATA attr;
+		if (!mtime && GetFileAttributesExW(task.dir.c_str(), GetFileExInfoStandard, &attr)) {
+			mtime = search_filetime(attr.ftLastWriteTime);
+		}
+	}
+	auto cached = mtime ? state.index.find(task.dir) : state.index.end();
+	if (cached != state.index.end() && cached->second.mtime == mtime) {
+		search_dir_cached(self, task, cached->second);
+		ReleaseSemaphore(slots, 1, NULL);
+		for (auto it = cached->second.subdirs.rbegin(); it != cached->second.subdirs.rend(); ++it) {
+			search_task_push(self, { task.dir + *it + L"\\", task.device, 0 });
+		}
+		return;
+	}
 
-			if (use_vpatch) {
-				json_object_set_new(
-					game_val,
-					vpatch_fn.generic_u8string().c_str(),
-					json_string("using vpatch")
-				);
+	search_index_dir_t entry;
+	entry.mtime = mtime;
+	std::wstring pattern = task.dir + L"*";
+	HANDLE hFind = FindFirstFileW(pattern.c_str(), &w32fd);
+	BOOL ret = hFind != INVALID_HANDLE_VALUE;
+	while (ret) {
+		if (
+			!wcscmp(w32fd.cFileName, L".") ||
+			!wcscmp(w32fd.cFileName, L"..")
+		) {
+			// Nothing
+		} else if (w32fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			entry.subdirs.push_back(w32fd.cFileName);
+			subdirs.push_back({
+				task.dir + w32fd.cFileName + L"\\", task.device, search_filetime(w32fd.ftLastWriteTime)
+			});
+		} else if (PathMatchSpecW(w32fd.cFileName, L"*.exe")) {
+			entry.exes.push_back(w32fd.cFileName);
+			if (search_exe_size_matches(w32fd.nFileSizeLow)) {
+				worker.candidates.push_back({ task.dir + w32fd.cFileName, task.dir, task.device });
 			}
 		}
-		LeaveCriticalSection(&state.cs_result);
-		VLA_FREE(exe_fn_a);
-		VLA_FREE(exe_fn);
-		ret = 1;
+		ret = FindNextFileW(hFind, &w32fd);
+	}
+	if (hFind != INVALID_HANDLE_VALUE) {
+		FindClose(hFind);
+		if (mtime) {
+			worker.index.emplace_back(task.dir, std::move(entry));
+		}
+	}
+	ReleaseSemaphore(slots, 1, NULL);
+
+	// Pushed in reverse, so that the first one is searched next.
+	for (auto it = subdirs.rbegin(); it != subdirs.rend(); ++it) {
+		search_task_push(self, std::move(*it));
 	}
-	return ret;
 }
 
+static DWORD WINAPI search_dir_thread(void *param)
+{
+	const size_t self = (size_t)param;
+	search_dir_task_t task;
+	while (state.tasks_outstanding) {
+		if (!search_task_pop(self, task)) {
+			// The timeout covers wakeups that went to another worker.
+			WaitForSingleObject(state.tasks_event, 10);
+			continue;
+		}
+		search_dir(self, task);
+		InterlockedDecrement(&state.tasks_outstanding);
+	}
+	// Let the others notice that we're done.
+	SetEvent(state.tasks_event);
+	return 0;
+}
+/// ---------------------
 
-DWORD WINAPI SearchThread(void *param)
+/// Hashing
+/// -------
+static void search_check_exe(size_t self, const search_candidate_t& candidate)
 {
-	HANDLE hFind;
-	WIN32_FIND_DATAW w32fd;
-	wchar_t *param_dir = (wchar_t*)param;
+	std::string exe_fn = utf8_buf_t(candidate.exe_fn.c_str()).c_str();
+	str_slash_normalize(&exe_fn[0]);
+
+	size_t exe_size;
+	json_t *ver = identify_by_hash(exe_fn.c_str(), &exe_size, state.versions);
+	if (!ver) {
+		return;
+	}
 
-	// Add the asterisk
-	size_t dir_len = wcslen(param_dir) + 2 + 1;
-	VLA(wchar_t, local_dir, dir_len);
+	const char *key = json_array_get_string(ver, 0);
 
-	BOOL ret = 1;
+	// Check if user already selected a version of this game in a previous search
+	if (!key || json_object_get(state.result, key)) {
+		return;
+	}
 
-	wcscpy(local_dir, param_dir);
-	wcscat(local_dir, L"*");
+	// Alright, found a game!
+	search_result_t result;
+	result.key = key;
+	result.exe_fn = exe_fn;
 
-	InterlockedIncrement(&state.cur_threads);
+	const char *build = json_array_get_string(ver, 1);
+	const char *variety = json_array_get_string(ver, 2);
+	result.id_str = build ? build : "";
+	if (build && variety) {
+		result.id_str += " ";
+	}
+	if (variety) {
+		result.id_str += variety;
+	}
 
-	SAFE_FREE(param_dir);
-	hFind = FindFirstFileW(local_dir, &w32fd);
-	while( (hFind != INVALID_HANDLE_VALUE) && ret ) {
-		if(
-			!wcscmp(w32fd.cFileName, L".") ||
-			!wcscmp(w32fd.cFileName, L"..")
+	// Check if it has a vpatch
+	auto vpatch_fn = std::filesystem::path(candidate.dir) / L"vpatch.exe";
+	if (strstr(key, "_custom") == nullptr && std::filesystem::is_regular_file(vpatch_fn)) {
+		result.vpatch_fn = vpatch_fn.generic_u8string();
+	}
+	state.workers[self].results.push_back(std::move(result));
+}
+
+static DWORD WINAPI search_hash_thread(void *param)
+{
+	const size_t self = (size_t)param;
+	const LONG candidate_count = (LONG)state.candidates.size();
+	LONG i;
+	while ((i = InterlockedIncrement(&state.candidate_next) - 1) < candidate_count) {
+		const search_candidate_t& candidate = state.candidates[i];
+		HANDLE slots = state.devices[candidate.device].slots;
+		WaitForSingleObject(slots, INFINITE);
+		search_check_exe(self, candidate);
+		ReleaseSemaphore(slots, 1, NULL);
+	}
+	return 0;
+}
+/// -------
+
+/// NTFS fast path
+/// --------------
+// Whole NTFS volumes can be searched a lot faster by enumerating the file
+// records in the master file table than by walking all directories. This
+// requires read access to the volume, which usually means administrator
+// rights; without it, we simply fall back to the directory walk.
+// The paths of all .exe files found this way are cached per volume, together
+// with the position in the volume's USN change journal. If the journal shows
+// that no .exe file was created, deleted or renamed, and no directory was
+// renamed since then, the next search reuses the cached paths instead.
+
+struct search_mft_dir_t {
+	DWORDLONG parent;
+	std::wstring name;
+};
+
+static bool search_is_exe_name(const wchar_t *name, size_t name_len)
+{
+	return name_len > 4 && !_wcsnicmp(name + name_len - 4, L".exe", 4);
+}
+
+static std::string search_mft_cache_fn(DWORD serial)
+{
+	char fn[32];
+	sprintf(fn, "cache/search_%08x.js", serial);
+	const char *thcrap_dir = runconfig_thcrap_dir_get();
+	std::string ret = thcrap_dir ? std::string(thcrap_dir) + "/" : "";
+	return ret + fn;
+}
+
+// Returns true if none of the changes in the journal of [hVolume] after [usn]
+// can affect the set of .exe paths on the volume.
+static bool search_usn_unchanged(HANDLE hVolume, const USN_JOURNAL_DATA& journal, USN usn)
+{
+	if (usn < journal.LowestValidUsn || usn > journal.NextUsn) {
+		return false;
+	}
+	READ_USN_JOURNAL_DATA_V0 read = {};
+	read.StartUsn = usn;
+	read.ReasonMask = USN_REASON_FILE_CREATE | USN_REASON_FILE_DELETE | USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME;
+	read.UsnJournalID = journal.UsnJournalID;
+
+	std::vector<BYTE> buffer(64 * 1024);
+	while (read.StartUsn < journal.NextUsn) {
+		DWORD byte_ret;
+		if (!DeviceIoControl(
+			hVolume, FSCTL_READ_USN_JOURNAL, &read, sizeof(read),
+			buffer.data(), (DWORD)buffer.size(), &byte_ret, NULL
+		) || byte_ret < sizeof(USN)) {
+			return false;
+		}
+		const USN next = *(USN*)buffer.data();
+		for (DWORD offset = sizeof(USN); offset + sizeof(USN_RECORD) <= byte_ret;) {
+			const USN_RECORD *record = (const USN_RECORD*)(buffer.data() + offset);
+			if (!record->RecordLength) {
+				return false;
+			}
+			const wchar_t *name = (const wchar_t*)((const BYTE*)record + record->FileNameOffset);
+			const size_t name_len = record->FileNameLength / sizeof(wchar_t);
+			if (record->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				// Deleting a directory also deletes all files in it first,
+				// and these have their own records.
+				if (record->Reason & (USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME)) {
+					return false;
+				}
+			} else if (search_is_exe_name(name, name_len)) {
+				return false;
+			}
+			offset += record->RecordLength;
+		}
+		if (next <= read.StartUsn) {
+			break;
+		}
+		read.StartUsn = next;
+	}
+	return true;
+}
+
+// Enumerates all file records on [hVolume] and returns the full paths of all
+// .exe files in [exes].
+static bool search_mft_enum(HANDLE hVolume, const std::wstring& root, USN high_usn, std::vector<std::wstring>& exes)
+{
+	struct exe_record_t {
+		DWORDLONG parent;
+		std::wstring name;
+	};
+	std::unordered_map<DWORDLONG, search_mft_dir_t> dirs;
+	std::vector<exe_record_t> exe_records;
+
+	MFT_ENUM_DATA_V0 med = {};
+	med.StartFileReferenceNumber = 0;
+	med.LowUsn = 0;
+	med.HighUsn = high_usn;
+
+	std::vector<BYTE> buffer(64 * 1024);
+	DWORD byte_ret;
+	while (DeviceIoControl(
+		hVolume, FSCTL_ENUM_USN_DATA, &med, sizeof(med),
+		buffer.data(), (DWORD)buffer.size(), &byte_ret, NULL
+	)) {
+		if (byte_ret < sizeof(DWORDLONG)) {
+			break;
+		}
+		for (DWORD offset = sizeof(DWORDLONG); offset + sizeof(USN_RECORD) <= byte_ret;) {
+			const USN_RECORD *record = (const USN_RECORD*)(buffer.data() + offset);
+			if (!record->RecordLength || record->MajorVersion != 2) {
+				return false;
+			}
+			const wchar_t *name = (const wchar_t*)((const BYTE*)record + record->FileNameOffset);
+			const size_t name_len = record->FileNameLength / sizeof(wchar_t);
+			if (record->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				dirs[record->FileReferenceNumber] = { record->ParentFileReferenceNumber, std::wstring(name, name_len) };
+			} else if (search_is_exe_name(name, name_len)) {
+				exe_records.push_back({ record->ParentFileReferenceNumber, std::wstring(name, name_len) });
+			}
+			offset += record->RecordLength;
+		}
+		med.StartFileReferenceNumber = *(DWORDLONG*)buffer.data();
+	}
+	if (GetLastError() != ERROR_HANDLE_EOF) {
+		return false;
+	}
+
+	// Full paths of directories, with a trailing backslash. The root
+	// directory is the only one that's not in [dirs].
+	std::unordered_map<DWORDLONG, std::wstring> dir_paths;
+	std::vector<DWORDLONG> chain;
+	auto dir_path = [&](DWORDLONG frn) -> const std::wstring& {
+		chain.clear();
+		auto known = dir_paths.find(frn);
+		while (known == dir_paths.end()) {
+			auto dir = dirs.find(frn);
+			if (dir == dirs.end() || dir->second.parent == frn || chain.size() > 512) {
+				known = dir_paths.emplace(frn, root).first;
+				break;
+			}
+			chain.push_back(frn);
+			frn = dir->second.parent;
+			known = dir_paths.find(frn);
+		}
+		for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+			std::wstring path = known->second + dirs[*it].name + L"\\";
+			known = dir_paths.emplace(*it, std::move(path)).first;
+		}
+		return known->second;
+	};
+	for (const auto& exe : exe_records) {
+		exes.push_back(dir_path(exe.parent) + exe.name);
+	}
+	return true;
+}
+
+static bool search_volume_mft(const std::wstring& root, size_t device)
+{
+	wchar_t fs_name[MAX_PATH + 1];
+	DWORD serial;
+	if (
+		!GetVolumeInformationW(root.c_str(), NULL, 0, &serial, NULL, NULL, fs_name, MAX_PATH + 1)
+		|| wcscmp(fs_name, L"NTFS")
+	) {
+		return false;
+	}
+	std::wstring volume = L"\\\\.\\" + root;
+	if (volume.back() == L'\\') {
+		volume.pop_back();
+	}
+	HANDLE hVolume = CreateFileW(
+		volume.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL
+	);
+	if (hVolume == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	USN_JOURNAL_DATA journal = {};
+	DWORD byte_ret;
+	bool have_journal = DeviceIoControl(
+		hVolume, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &journal, sizeof(journal), &byte_ret, NULL
+	);
+
+	std::vector<std::wstring> exes;
+	bool ret = false;
+	const std::string cache_fn = search_mft_cache_fn(serial);
+	if (have_journal) {
+		size_t cache_size;
+		char *cache_buffer = (char*)file_read(cache_fn.c_str(), &cache_size);
+		json_t *cache = cache_buffer ? json_loadb(cache_buffer, cache_size, 0, NULL) : NULL;
+		free(cache_buffer);
+		if (
+			json_integer_value(json_object_get(cache, "journal_id")) == (json_int_t)journal.UsnJournalID
+			&& search_usn_unchanged(hVolume, journal, json_integer_value(json_object_get(cache, "usn")))
+		) {
+			size_t i;
+			json_t *exe;
+			json_array_foreach(json_object_get(cache, "exes"), i, exe) {
+				const char *exe_fn = json_string_value(exe);
+				if (exe_fn) {
+					exes.push_back(utf16_buf_t(exe_fn).c_str());
+				}
+			}
+			ret = true;
+		}
+		json_decref(cache);
+	}
+	if (!ret) {
+		ret = search_mft_enum(hVolume, root, have_journal ? journal.NextUsn : MAXLONGLONG, exes);
+		if (ret && have_journal) {
+			json_t *exes_json = json_array();
+			for (const auto& exe : exes) {
+				json_array_append_new(exes_json, json_string(utf8_buf_t(exe.c_str()).c_str()));
+			}
+			json_t *cache = json_pack("{s:I, s:I, s:o}",
+				"journal_id", (json_int_t)journal.UsnJournalID,
+				"usn", (json_int_t)journal.NextUsn,
+				"exes", exes_json
+			);
+			char *dump = json_dumps(cache, JSON_COMPACT);
+			if (dump) {
+				file_write(cache_fn.c_str(), dump, strlen(dump));
+				free(dump);
+			}
+			json_decref(cache);
+		}
+	}
+	CloseHandle(hVolume);
+	if (!ret) {
+		return false;
+	}
+
+	// Only the attributes are needed for the size filter, the files
+	// themselves are only opened for hashing.
+	search_worker_t& worker = state.workers[0];
+	for (auto& exe : exes) {
+		WIN32_FILE_ATTRIBUTE_DATA attr;
+		if (
+			!GetFileAttributesExW(exe.c_str(), GetFileExInfoStandard, &attr)
+			|| (attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			|| attr.nFileSizeHigh
+			|| attr.nFileSizeLow < state.size_min
+			|| attr.nFileSizeLow > state.size_max
+			|| !identify_by_size(attr.nFileSizeLow, state.versions)
 		) {
-			ret = FindNextFileW(hFind, &w32fd);
 			continue;
 		}
-		local_dir[dir_len - 3] = 0;
+		std::wstring dir = exe.substr(0, exe.find_last_of(L'\\') + 1);
+		worker.candidates.push_back({ std::move(exe), std::move(dir), device });
+	}
+	log_printf("Searched %s using the master file table\n", utf8_buf_t(root.c_str()).c_str());
+	return true;
+}
+/// --------------
+
+/// Search index
+/// ------------
+// Binary file, since it can easily contain hundreds of thousands of
+// directories. After the header, the directories follow in sorted order,
+// with each path stored as the length of the prefix shared with the previous
+// one, followed by the remaining characters:
+//
+//	uint16_t prefix_len, suffix_len; wchar_t suffix[suffix_len];
+//	uint64_t mtime;
+//	uint16_t subdir_count, exe_count;
+//	{ uint16_t len; wchar_t name[len]; } names[subdir_count + exe_count];
+#define SEARCH_INDEX_MAGIC "THSI"
+#define SEARCH_INDEX_VERSION 1
+
+struct search_index_header_t {
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+};
+
+static std::string search_index_fn(void)
+{
+	const char *thcrap_dir = runconfig_thcrap_dir_get();
+	std::string ret = thcrap_dir ? std::string(thcrap_dir) + "/" : "";
+	return ret + "cache/search_index.bin";
+}
 
-		if(w32fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-			DWORD thread_id;
-			size_t cur_file_len = dir_len + wcslen(w32fd.cFileName) + 2;
-			wchar_t *cur_file = (wchar_t*)malloc(cur_file_len * sizeof(wchar_t));
+struct search_index_reader_t {
+	const BYTE *p;
+	const BYTE *end;
 
-			wcsncpy(cur_file, local_dir, dir_len);
-			wcscat(cur_file, w32fd.cFileName);
-			PathAddBackslashW(cur_file);
+	bool read(void *dst, size_t len) {
+		if ((size_t)(end - p) < len) {
+			return false;
+		}
+		memcpy(dst, p, len);
+		p += len;
+		return true;
+	}
 
-			// Execute the function normally if we're above the thread limit
-			if(InterlockedCompareExchange(&state.cur_threads, -1, -1) > state.max_threads) {
-				SearchThread(cur_file);
-			} else {
-				HANDLE hThread = CreateThread(NULL, 0, SearchThread, cur_file, 0, &thread_id);
-				if (hThread) CloseHandle(hThread);
-			}
-		} else if(
-			(PathMatchSpecW(w32fd.cFileName, L"*.exe")) &&
-			(w32fd.nFileSizeLow >= state.size_min) &&
-			(w32fd.nFileSizeLow <= state.size_max)
+	bool read_str(std::wstring& str, size_t len) {
+		if ((size_t)(end - p) < len * sizeof(wchar_t)) {
+			return false;
+		}
+		str.append((const wchar_t*)p, len);
+		p += len * sizeof(wchar_t);
+		return true;
+	}
+
+	bool read_name(std::wstring& name) {
+		uint16_t len;
+		return read(&len, sizeof(len)) && read_str(name, len);
+	}
+};
+
+static void search_index_load(void)
+{
+	state.index.clear();
+	size_t size;
+	BYTE *buffer = (BYTE*)file_read(search_index_fn().c_str(), &size);
+	if (!buffer) {
+		return;
+	}
+	search_index_reader_t reader = { buffer, buffer + size };
+	search_index_header_t header;
+	if (
+		!reader.read(&header, sizeof(header))
+		|| memcmp(header.magic, SEARCH_INDEX_MAGIC, sizeof(header.magic))
+		|| header.version != SEARCH_INDEX_VERSION
+	) {
+		free(buffer);
+		return;
+	}
+	state.index.reserve(header.count);
+	std::wstring path;
+	for (uint32_t i = 0; i < header.count; i++) {
+		uint16_t prefix_len, suffix_len, subdir_count, exe_count;
+		search_index_dir_t entry;
+		if (
+			!reader.read(&prefix_len, sizeof(prefix_len))
+			|| prefix_len > path.length()
+			|| !reader.read(&suffix_len, sizeof(suffix_len))
 		) {
-			SearchCheckExe(local_dir, &w32fd);
+			break;
 		}
-		ret = FindNextFileW(hFind, &w32fd);
+		path.resize(prefix_len);
+		bool ok =
+			reader.read_str(path, suffix_len)
+			&& reader.read(&entry.mtime, sizeof(entry.mtime))
+			&& reader.read(&subdir_count, sizeof(subdir_count))
+			&& reader.read(&exe_count, sizeof(exe_count));
+		entry.subdirs.resize(ok ? subdir_count : 0);
+		entry.exes.resize(ok ? exe_count : 0);
+		for (auto& name : entry.subdirs) {
+			ok = ok && reader.read_name(name);
+		}
+		for (auto& name : entry.exes) {
+			ok = ok && reader.read_name(name);
+		}
+		if (!ok) {
+			// Truncated file; everything read so far is still valid.
+			break;
+		}
+		state.index.emplace(path, std::move(entry));
 	}
-	FindClose(hFind);
-	InterlockedDecrement(&state.cur_threads);
-	VLA_FREE(local_dir);
-	return 0;
+	free(buffer);
+}
+
+// Returns true if [path] is inside one of the roots searched this time.
+static bool search_index_path_searched(const std::wstring& path)
+{
+	for (const auto& root : state.roots) {
+		if (path.length() >= root.length() && !_wcsnicmp(path.c_str(), root.c_str(), root.length())) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Replaces all entries inside the searched roots with the ones the workers
+// have collected, and writes the result back to disk.
+static void search_index_save(void)
+{
+	std::vector<std::pair<const std::wstring*, const search_index_dir_t*>> entries;
+	for (const auto& it : state.index) {
+		if (!search_index_path_searched(it.first)) {
+			entries.emplace_back(&it.first, &it.second);
+		}
+	}
+	for (const auto& worker : state.workers) {
+		for (const auto& it : worker.index) {
+			entries.emplace_back(&it.first, &it.second);
+		}
+	}
+	std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+		return *a.first < *b.first;
+	});
+
+	std::vector<BYTE> buffer;
+	auto write = [&buffer](const void *src, size_t len) {
+		buffer.insert(buffer.end(), (const BYTE*)src, (const BYTE*)src + len);
+	};
+	auto write_name = [&write](const std::wstring& name) {
+		uint16_t len = (uint16_t)name.length();
+		write(&len, sizeof(len));
+		write(name.c_str(), len * sizeof(wchar_t));
+	};
+	search_index_header_t header = { { 'T', 'H', 'S', 'I' }, SEARCH_INDEX_VERSION, 0 };
+	write(&header, sizeof(header));
+
+	const std::wstring *prev = NULL;
+	auto fits = [](const std::vector<std::wstring>& names) {
+		return names.size() <= 0xFFFF && std::all_of(names.begin(), names.end(), [](const std::wstring& name) {
+			return name.length() <= 0xFFFF;
+		});
+	};
+	for (const auto& it : entries) {
+		const std::wstring& path = *it.first;
+		const search_index_dir_t& entry = *it.second;
+		if (
+			(prev && path == *prev)
+			|| path.length() > 0xFFFF
+			|| !fits(entry.subdirs)
+			|| !fits(entry.exes)
+		) {
+			continue;
+		}
+		uint16_t prefix_len = 0;
+		if (prev) {
+			size_t max_len = MIN(prev->length(), path.length());
+			while (prefix_len < max_len && (*prev)[prefix_len] == path[prefix_len]) {
+				prefix_len++;
+			}
+		}
+		uint16_t suffix_len = (uint16_t)(path.length() - prefix_len);
+		uint16_t subdir_count = (uint16_t)entry.subdirs.size();
+		uint16_t exe_count = (uint16_t)entry.exes.size();
+		write(&prefix_len, sizeof(prefix_len));
+		write(&suffix_len, sizeof(suffix_len));
+		write(path.c_str() + prefix_len, suffix_len * sizeof(wchar_t));
+		write(&entry.mtime, sizeof(entry.mtime));
+		write(&subdir_count, sizeof(subdir_count));
+		write(&exe_count, sizeof(exe_count));
+		for (const auto& name : entry.subdirs) {
+			write_name(name);
+		}
+		for (const auto& name : entry.exes) {
+			write_name(name);
+		}
+		prev = &path;
+		header.count++;
+	}
+	memcpy(buffer.data(), &header, sizeof(header));
+	file_write(search_index_fn().c_str(), buffer.data(), buffer.size());
+	state.index.clear();
+	state.roots.clear();
 }
+/// ------------
 
-void LaunchSearchThread(const char *dir)
+// Runs [func] on all workers, and waits until all of them are done.
+static void search_workers_run(LPTHREAD_START_ROUTINE func)
 {
-	DWORD thread_id;
-	HANDLE initial_thread;
+	const size_t worker_count = state.workers.size();
+	std::vector<HANDLE> threads;
+	for (size_t i = 0; i < worker_count; i++) {
+		HANDLE hThread = CreateThread(NULL, 0, func, (void*)i, 0, NULL);
+		if (hThread) {
+			threads.push_back(hThread);
+		}
+	}
+	if (threads.empty()) {
+		// Better slow than nothing.
+		func((void*)0);
+	}
+	for (HANDLE hThread : threads) {
+		WaitForSingleObject(hThread, INFINITE);
+		CloseHandle(hThread);
+	}
+}
 
-	// Freed inside the thread
-	size_t cur_dir_len = strlen(dir) + 1;
-	wchar_t *cur_dir = (wchar_t*)malloc(cur_dir_len * sizeof(wchar_t));
-	StringToUTF16(cur_dir, dir, cur_dir_len);
-	initial_thread = CreateThread(NULL, 0, SearchThread, cur_dir, 0, &thread_id);
-	WaitForSingleObject(initial_thread, INFINITE);
+static void search_root_add(const wchar_t *dir)
+{
+	std::wstring root = dir;
+	if (!root.empty() && root.back() != L'\\' && root.back() != L'/') {
+		root += L'\\';
+	}
+	size_t device = search_device_for(root.c_str());
+	if (
+		!_wcsicmp(state.devices[device].root.c_str(), root.c_str())
+		&& search_volume_mft(root, device)
+	) {
+		return;
+	}
+	state.roots.push_back(root);
+	// Spread the roots over all workers.
+	search_task_push(state.tasks_outstanding % state.workers.size(), { root, device, 0 });
+}
+
+// Orders the candidates so that consecutive ones alternate between devices,
+// which keeps as many devices busy as possible while hashing.
+static void search_candidates_collect(void)
+{
+	std::vector<std::vector<search_candidate_t>> per_device(state.devices.size());
+	size_t total = 0;
+	for (auto& worker : state.workers) {
+		for (auto& candidate : worker.candidates) {
+			per_device[candidate.device].push_back(std::move(candidate));
+			total++;
+		}
+		worker.candidates.clear();
+	}
+	state.candidates.clear();
+	state.candidates.reserve(total);
+	for (size_t i = 0; state.candidates.size() < total; i++) {
+		for (auto& device_candidates : per_device) {
+			if (i < device_candidates.size()) {
+				state.candidates.push_back(std::move(device_candidates[i]));
+			}
+		}
+	}
 }
 
 json_t* SearchForGames(const char *dir, json_t *games_in)
@@ -191,11 +914,8 @@ json_t* SearchForGames(const char *dir, json_t *games_in)
 
 	state.size_min = 0xFFFFFFFF;
 	state.size_max = 0;
-	state.cur_threads = 0;
-	state.max_threads = 0;
 	state.found = json_object();
 	state.result = games_in ? games_in : json_object();
-	InitializeCriticalSection(&state.cs_result);
 
 	// Get file size limits
 	json_object_foreach(sizes, key, val) {
@@ -205,30 +925,62 @@ json_t* SearchForGames(const char *dir, json_t *games_in)
 		state.size_max = MAX(cur_size, state.size_max);
 	}
 
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	const size_t worker_count = MAX((DWORD)1, MIN(si.dwNumberOfProcessors, (DWORD)SEARCH_WORKERS_MAX));
+	state.workers = std::vector<search_worker_t>(worker_count);
+	for (auto& worker : state.workers) {
+		InitializeCriticalSection(&worker.cs);
+	}
+	state.tasks_outstanding = 0;
+	state.tasks_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	state.candidate_next = 0;
+	search_index_load();
+
 	if(dir && dir[0]) {
-		LaunchSearchThread(dir);
+		search_root_add(utf16_buf_t(dir).c_str());
 	} else {
-		char drive_strings[512];
-		char *p = drive_strings;
+		wchar_t drive_strings[512];
+		wchar_t *p = drive_strings;
 
-		GetLogicalDriveStringsA(512, drive_strings);
+		GetLogicalDriveStringsW(512, drive_strings);
 		while(p && p[0]) {
-			UINT drive_type = GetDriveTypeA(p);
+			UINT drive_type = GetDriveTypeW(p);
 			if(
 				(drive_type != DRIVE_CDROM) &&
-				(p[0] != 'A') &&
-				(p[0] != 'a')
+				(p[0] != L'A') &&
+				(p[0] != L'a')
 			) {
-				LaunchSearchThread(p);
+				search_root_add(p);
+			}
+			p += wcslen(p) + 1;
+		}
+	}
+
+	search_workers_run(search_dir_thread);
+	search_index_save();
+	search_candidates_collect();
+	search_workers_run(search_hash_thread);
+
+	for (auto& worker : state.workers) {
+		for (const auto& result : worker.results) {
+			json_t *game_val = json_object_get_create(state.found, result.key.c_str(), JSON_OBJECT);
+			json_object_set_new(game_val, result.exe_fn.c_str(), json_string(result.id_str.c_str()));
+			if (!result.vpatch_fn.empty()) {
+				json_object_set_new(game_val, result.vpatch_fn.c_str(), json_string("using vpatch"));
 			}
-			p += strlen(p) + 1;
 		}
+		DeleteCriticalSection(&worker.cs);
 	}
-	while(state.cur_threads) {
-		Sleep(100);
+	state.workers.clear();
+	state.candidates.clear();
+	for (auto& device : state.devices) {
+		CloseHandle(device.slots);
 	}
+	state.devices.clear();
+	CloseHandle(state.tasks_event);
 
-	DeleteCriticalSection(&state.cs_result);
+	identify_cache_flush();
 	json_decref(state.versions);
 	return state.found;
 }
@@ -6,12 +6,18 @@
   *
   * SHA-256 hash implementation
   * From http://bradconte.com/sha256_c.html
+  * SHA extensions code path based on the public domain implementation by
+  * Sean Gulley, Jeffrey Walton and others, which in turn follows the Intel
+  * SHA extensions white paper.
   */
 
 #include <string.h>
-#if defined _MSC_VER
+#include <stddef.h>
+#include <stdint.h>
+#if defined(_MSC_VER) || defined(__MINGW32__)
 #include <intrin.h>
 #endif
+#include <immintrin.h>
 #include "sha256.h"
 
 #if defined(__INTRIN_H_)
@@ -43,7 +49,7 @@ uint bswap_32(uint x)
 #define SIG0(x) (ROTRIGHT(x,7) ^ ROTRIGHT(x,18) ^ ((x) >> 3))
 #define SIG1(x) (ROTRIGHT(x,17) ^ ROTRIGHT(x,19) ^ ((x) >> 10))
 
-uint k[64] = {
+alignas(16) uint k[64] = {
 	0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
 	0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
 	0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
@@ -98,6 +104,92 @@ void sha256_transform(SHA256_CTX *ctx, uchar data[])
 	ctx->state[7] += h;
 }
 
+static void sha256_transform_blocks(SHA256_CTX *ctx, const uchar *data, size_t blocks)
+{
+	while(blocks--) {
+		sha256_transform(ctx, (uchar*)data);
+		data += 64;
+	}
+}
+
+/// SHA extensions
+/// --------------
+#if defined(__GNUC__)
+# define SHA256_TARGET_SHANI __attribute__((target("sha,sse4.1")))
+#else
+# define SHA256_TARGET_SHANI
+#endif
+
+static bool sha256_shani_supported(void)
+{
+	int data[4];
+	__cpuid(data, 0);
+	if(data[0] < 7) {
+		return false;
+	}
+	__cpuid(data, 1);
+	const bool ssse3 = data[2] & 1 << 9;
+	const bool sse41 = data[2] & 1 << 19;
+	__cpuidex(data, 7, 0);
+	const bool sha = data[1] & 1 << 29;
+	return ssse3 && sse41 && sha;
+}
+
+SHA256_TARGET_SHANI static void sha256_transform_blocks_shani(SHA256_CTX *ctx, const uchar *data, size_t blocks)
+{
+	const __m128i BSWAP_MASK = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m128i msg[4];
+
+	// The SHA instructions want the state as ABEF and CDGH.
+	__m128i tmp = _mm_loadu_si128((const __m128i*)&ctx->state[0]);
+	__m128i state1 = _mm_loadu_si128((const __m128i*)&ctx->state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1); // CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B); // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+
+	while(blocks--) {
+		const __m128i abef_prev = state0;
+		const __m128i cdgh_prev = state1;
+
+		// 16 groups of 4 rounds each. The first 4 groups take the message
+		// words, all others compute the next 4 words of the schedule from
+		// the previous 16.
+		for(int i = 0; i < 16; i++) {
+			__m128i *cur = &msg[i & 3];
+			if(i < 4) {
+				*cur = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), BSWAP_MASK);
+			} else {
+				const __m128i prev1 = msg[(i - 1) & 3];
+				const __m128i prev2 = msg[(i - 2) & 3];
+				tmp = _mm_sha256msg1_epu32(*cur, msg[(i - 3) & 3]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(prev1, prev2, 4));
+				*cur = _mm_sha256msg2_epu32(tmp, prev1);
+			}
+			tmp = _mm_add_epi32(*cur, _mm_load_si128((const __m128i*)&k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, tmp);
+			tmp = _mm_shuffle_epi32(tmp, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, tmp);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_prev);
+		state1 = _mm_add_epi32(state1, cdgh_prev);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8); // ABEF
+	_mm_storeu_si128((__m128i*)&ctx->state[0], state0);
+	_mm_storeu_si128((__m128i*)&ctx->state[4], state1);
+}
+/// --------------
+
+static void (*const sha256_blocks)(SHA256_CTX *ctx, const uchar *data, size_t blocks) = (
+	sha256_shani_supported() ? sha256_transform_blocks_shani : sha256_transform_blocks
+);
+
 void sha256_init(SHA256_CTX *ctx)
 {
 	ctx->datalen = 0;
@@ -115,16 +207,38 @@ void sha256_init(SHA256_CTX *ctx)
 
 void sha256_update(SHA256_CTX *ctx, uchar data[], uint len)
 {
-	uint i;
-	for(i = 0; i < len; ++i) {
-		ctx->data[ctx->datalen] = data[i];
-		ctx->datalen++;
-		if(ctx->datalen == 64) {
-			sha256_transform(ctx,ctx->data);
+	// Complete a previously buffered block first,
+	if(ctx->datalen) {
+		uint fill = 64 - ctx->datalen;
+		if(fill > len) {
+			fill = len;
+		}
+		memcpy(ctx->data + ctx->datalen, data, fill);
+		ctx->datalen += fill;
+		data += fill;
+		len -= fill;
+		if(ctx->datalen < 64) {
+			return;
+		}
+		sha256_blocks(ctx, ctx->data, 1);
+		DBL_INT_ADD(ctx->bitlen[0], ctx->bitlen[1], 512);
+		ctx->datalen = 0;
+	}
+
+	// then hash all whole blocks directly from the input,
+	uint blocks = len / 64;
+	if(blocks) {
+		sha256_blocks(ctx, data, blocks);
+		for(uint i = 0; i < blocks; i++) {
 			DBL_INT_ADD(ctx->bitlen[0], ctx->bitlen[1], 512);
-			ctx->datalen = 0;
 		}
+		data += blocks * 64;
+		len -= blocks * 64;
 	}
+
+	// and keep the rest for later.
+	memcpy(ctx->data, data, len);
+	ctx->datalen = len;
 }
 
 void sha256_final(SHA256_CTX *ctx, uchar hash[])
@@ -144,7 +258,7 @@ void sha256_final(SHA256_CTX *ctx, uchar hash[])
 		while(i < 64) {
 			ctx->data[i++] = 0x00;
 		}
-		sha256_transform(ctx, ctx->data);
+		sha256_blocks(ctx, ctx->data, 1);
 		memset(ctx->data, 0, 56);
 	}
 
@@ -152,7 +266,7 @@ void sha256_final(SHA256_CTX *ctx, uchar hash[])
 	DBL_INT_ADD(ctx->bitlen[0], ctx->bitlen[1], ctx->datalen * 8);
 	data_uint[15] = bswap_32(ctx->bitlen[0]);
 	data_uint[14] = bswap_32(ctx->bitlen[1]);
-	sha256_transform(ctx, ctx->data);
+	sha256_blocks(ctx, ctx->data, 1);
 
 	// Since this implementation uses little endian byte ordering and SHA uses big endian,
 	// reverse all the bytes when copying the final state to the output hash.
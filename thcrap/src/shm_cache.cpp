@@ -0,0 +1,229 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Cross-process cache of patched files.
+  */
+
+#include "thcrap.h"
+
+/**
+  * The section is named after the game, the build, and a hash of the run
+  * configuration and the patch stack (every patch archive together with its
+  * configuration), so that processes running different stacks never see
+  * each other's results.
+  * Within the section, files are looked up by a hash of their name, their
+  * JSON patch and their unpatched contents, which covers replacement files
+  * and jdiffs that changed on disk while both games were running.
+  *
+  * The section starts with a shm_cache_header_t, containing an
+  * open-addressing table of entries, followed by [capacity] bytes of file
+  * data that only ever grows. All accesses are serialized by a named mutex.
+  */
+
+#define SHM_CACHE_MAGIC 0x43534854 // "THSC"
+#define SHM_CACHE_VERSION 1
+
+static const uint32_t SHM_CACHE_ENTRIES = 4096;
+
+struct shm_cache_entry_t {
+	uint64_t hash;
+	uint32_t size_in;
+	uint32_t size_out;
+	// Relative to the start of the data area
+	uint32_t offset;
+	int32_t ret;
+	uint32_t used;
+	uint32_t pad;
+};
+
+struct shm_cache_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t stack_hash;
+	uint32_t capacity;
+	uint32_t data_used;
+	uint32_t entry_count;
+	uint32_t pad;
+	shm_cache_entry_t entries[SHM_CACHE_ENTRIES];
+};
+
+static HANDLE shm_cache_map = nullptr;
+static HANDLE shm_cache_mutex = nullptr;
+static shm_cache_header_t *shm_cache = nullptr;
+static volatile bool shm_cache_opened = false;
+static bool shm_cache_full = false;
+static SRWLOCK shm_cache_srwlock = { SRWLOCK_INIT };
+
+static void shm_cache_open(void)
+{
+	const size_t capacity = (size_t)runconfig_shared_cache_get() * 1024 * 1024;
+	const char *game = runconfig_game_get();
+	const char *build = runconfig_build_get();
+	if (!capacity || !game || !build) {
+		return;
+	}
+	const uint64_t stack_hash = hook_cache_stack_hash();
+	const size_t section_size = sizeof(shm_cache_header_t) + capacity;
+
+	// Local\ keeps the objects within the current session.
+	char name[128];
+	snprintf(name, sizeof(name), "Local\\thcrap_cache_%s_%s_%08x%08x_%zu",
+		game, build, (uint32_t)(stack_hash >> 32), (uint32_t)stack_hash, capacity
+	);
+	std::string mutex_name = std::string(name) + "_mutex";
+
+	shm_cache_mutex = CreateMutex(NULL, FALSE, mutex_name.c_str());
+	if (!shm_cache_mutex) {
+		log_printf("(Shared cache) Couldn't create mutex (error %lu)\n", GetLastError());
+		return;
+	}
+	WaitForSingleObject(shm_cache_mutex, INFINITE);
+	shm_cache_map = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)section_size, name);
+	const bool existed = GetLastError() == ERROR_ALREADY_EXISTS;
+	if (shm_cache_map) {
+		shm_cache = (shm_cache_header_t *)MapViewOfFile(shm_cache_map, FILE_MAP_ALL_ACCESS, 0, 0, section_size);
+	}
+	if (shm_cache) {
+		// Pagefile-backed sections start out zeroed.
+		if (shm_cache->magic != SHM_CACHE_MAGIC) {
+			shm_cache->version = SHM_CACHE_VERSION;
+			shm_cache->stack_hash = stack_hash;
+			shm_cache->capacity = (uint32_t)capacity;
+			shm_cache->magic = SHM_CACHE_MAGIC;
+		} else if (
+			shm_cache->version != SHM_CACHE_VERSION
+			|| shm_cache->stack_hash != stack_hash
+			|| shm_cache->capacity != capacity
+		) {
+			log_print("(Shared cache) Section belongs to a different patch stack, ignoring it\n");
+			UnmapViewOfFile(shm_cache);
+			shm_cache = nullptr;
+		}
+	}
+	ReleaseMutex(shm_cache_mutex);
+
+	if (!shm_cache) {
+		shm_cache_mod_exit();
+		return;
+	}
+	memstats_add(MEMSTATS_FILE_REP, section_size);
+	log_printf("(Shared cache) %s %s (%zu MiB)\n",
+		existed ? "Attached to" : "Created", name, capacity / (1024 * 1024)
+	);
+}
+
+static shm_cache_header_t* shm_cache_header(void)
+{
+	if (!shm_cache_opened) {
+		AcquireSRWLockExclusive(&shm_cache_srwlock);
+		if (!shm_cache_opened) {
+			shm_cache_open();
+			shm_cache_opened = true;
+		}
+		ReleaseSRWLockExclusive(&shm_cache_srwlock);
+	}
+	return shm_cache;
+}
+
+static BYTE* shm_cache_data(shm_cache_header_t *header)
+{
+	return (BYTE *)(header + 1);
+}
+
+// Returns the entry for [key], or the unused one where it would go.
+static shm_cache_entry_t* shm_cache_probe(shm_cache_header_t *header, const shm_cache_key_t *key)
+{
+	uint32_t i = (uint32_t)key->hash & (SHM_CACHE_ENTRIES - 1);
+	while (header->entries[i].used) {
+		const shm_cache_entry_t &entry = header->entries[i];
+		if (
+			entry.hash == key->hash
+			&& entry.size_in == key->size_in
+			&& entry.size_out == key->size_out
+		) {
+			break;
+		}
+		i = (i + 1) & (SHM_CACHE_ENTRIES - 1);
+	}
+	return &header->entries[i];
+}
+
+bool shm_cache_key(shm_cache_key_t *key, const char *fn, json_t *patch, const void *in, size_t size_in, size_t size_out)
+{
+	return shm_cache_header() && hook_cache_key(key, fn, patch, in, size_in, size_out);
+}
+
+bool shm_cache_get(const shm_cache_key_t *key, void *out, int *ret)
+{
+	shm_cache_header_t *header = shm_cache_header();
+	if (!header || !key || !out) {
+		return false;
+	}
+	bool hit = false;
+	WaitForSingleObject(shm_cache_mutex, INFINITE);
+	const shm_cache_entry_t *entry = shm_cache_probe(header, key);
+	if (entry->used) {
+		memcpy(out, shm_cache_data(header) + entry->offset, entry->size_out);
+		if (ret) {
+			*ret = entry->ret;
+		}
+		hit = true;
+	}
+	ReleaseMutex(shm_cache_mutex);
+	return hit;
+}
+
+void shm_cache_put(const shm_cache_key_t *key, const void *out, int ret)
+{
+	shm_cache_header_t *header = shm_cache_header();
+	if (!header || !key || !out) {
+		return;
+	}
+	WaitForSingleObject(shm_cache_mutex, INFINITE);
+	shm_cache_entry_t *entry = shm_cache_probe(header, key);
+	if (!entry->used) {
+		// Keep the table at most 3/4 full, so that misses stay short.
+		if (
+			(header->entry_count + 1) * 4 > SHM_CACHE_ENTRIES * 3
+			|| key->size_out > header->capacity - header->data_used
+		) {
+			if (!shm_cache_full) {
+				shm_cache_full = true;
+				log_print("(Shared cache) Cache is full, not storing any further files\n");
+			}
+		} else {
+			memcpy(shm_cache_data(header) + header->data_used, out, key->size_out);
+			entry->hash = key->hash;
+			entry->size_in = key->size_in;
+			entry->size_out = key->size_out;
+			entry->offset = header->data_used;
+			entry->ret = ret;
+			entry->used = 1;
+			// Keep the data area aligned for the next file.
+			header->data_used += (key->size_out + 15) & ~15u;
+			header->data_used = MIN(header->data_used, header->capacity);
+			header->entry_count++;
+		}
+	}
+	ReleaseMutex(shm_cache_mutex);
+}
+
+void shm_cache_mod_exit(void)
+{
+	if (shm_cache) {
+		memstats_remove(MEMSTATS_FILE_REP, sizeof(shm_cache_header_t) + shm_cache->capacity);
+		UnmapViewOfFile(shm_cache);
+		shm_cache = nullptr;
+	}
+	if (shm_cache_map) {
+		CloseHandle(shm_cache_map);
+		shm_cache_map = nullptr;
+	}
+	if (shm_cache_mutex) {
+		CloseHandle(shm_cache_mutex);
+		shm_cache_mutex = nullptr;
+	}
+}
@@ -0,0 +1,35 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Cross-process cache of patched files.
+  * With "shared_cache" in the run configuration, the results of running
+  * cacheable patch hooks (see patchhook_register_cacheable()) are stored in
+  * a named shared memory section. Other processes of the same game and
+  * build, running the same patch stack, open the same section and copy those
+  * results instead of patching the file again.
+  */
+
+#pragma once
+
+// Same as the keys of the in-process cache, which uses this one as its
+// second tier.
+typedef hook_cache_key_t shm_cache_key_t;
+
+// Builds the key for patching [size_in] bytes of [in], loaded for the file
+// [fn] with the JSON patch [patch], into a buffer of [size_out] bytes.
+// Returns false if the shared cache is disabled or unavailable.
+bool shm_cache_key(shm_cache_key_t *key, const char *fn, json_t *patch, const void *in, size_t size_in, size_t size_out);
+
+// Copies the patched file for [key] to [out], which must be at least
+// [key->size_out] bytes large, and stores the return value of the patch
+// hooks in [ret]. Returns false if there is no such file in the cache.
+bool shm_cache_get(const shm_cache_key_t *key, void *out, int *ret);
+
+// Stores [key->size_out] bytes of [out] and the return value [ret] of the
+// patch hooks for [key]. Does nothing once the cache is full.
+void shm_cache_put(const shm_cache_key_t *key, const void *out, int ret);
+
+void shm_cache_mod_exit(void);
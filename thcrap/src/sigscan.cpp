@@ -0,0 +1,376 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Byte signature scanning.
+  */
+
+#include "thcrap.h"
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#include <intrin.h>
+#endif
+#include <emmintrin.h>
+
+#if defined(__GNUC__)
+# define SIGSCAN_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+# define SIGSCAN_TARGET_SSE2
+#endif
+
+static bool sigscan_sse2_supported(void)
+{
+	int data[4];
+	__cpuid(data, 0);
+	if(data[0] < 1) {
+		return false;
+	}
+	__cpuid(data, 1);
+	return data[3] & 1 << 26;
+}
+
+static const bool SIGSCAN_SSE2 = sigscan_sse2_supported();
+
+/// Patterns
+/// --------
+static int sigscan_nibble(char c, BYTE *mask)
+{
+	*mask = 0xF;
+	if(c >= '0' && c <= '9') {
+		return c - '0';
+	} else if(c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	} else if(c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	} else if(c == '?') {
+		*mask = 0;
+		return 0;
+	}
+	return -1;
+}
+
+sigscan_pattern_t* sigscan_pattern_parse(const char *str, ptrdiff_t offset)
+{
+	if(!str) {
+		return NULL;
+	}
+	std::vector<BYTE> bytes;
+	std::vector<BYTE> mask;
+	bool have_fixed = false;
+	const char *p = str;
+	while(*p) {
+		if(*p == ' ' || *p == '\t') {
+			p++;
+			continue;
+		}
+		BYTE mask_hi, mask_lo;
+		const int hi = sigscan_nibble(p[0], &mask_hi);
+		if(hi < 0) {
+			log_printf("ERROR: invalid character '%c' in signature \"%s\"\n", p[0], str);
+			return NULL;
+		}
+		int lo = p[1] ? sigscan_nibble(p[1], &mask_lo) : -1;
+		if(lo < 0) {
+			// Single ? for a whole byte
+			if(p[0] != '?') {
+				log_printf("ERROR: incomplete byte in signature \"%s\"\n", str);
+				return NULL;
+			}
+			lo = 0;
+			mask_lo = 0;
+			p++;
+		} else {
+			p += 2;
+		}
+		const BYTE m = (mask_hi << 4) | mask_lo;
+		have_fixed |= m == 0xFF;
+		mask.push_back(m);
+		bytes.push_back(((hi << 4) | lo) & m);
+	}
+	if(!have_fixed) {
+		log_printf("ERROR: signature \"%s\" needs at least one fully specified byte\n", str);
+		return NULL;
+	}
+
+	auto *ret = (sigscan_pattern_t*)malloc(sizeof(sigscan_pattern_t));
+	ret->str = strdup(str);
+	ret->len = bytes.size();
+	ret->bytes = (BYTE*)malloc(ret->len * 2);
+	ret->mask = ret->bytes + ret->len;
+	memcpy(ret->bytes, bytes.data(), ret->len);
+	memcpy(ret->mask, mask.data(), ret->len);
+	ret->offset = offset;
+	return ret;
+}
+
+void sigscan_pattern_free(sigscan_pattern_t *pattern)
+{
+	if(pattern) {
+		free(pattern->str);
+		free(pattern->bytes);
+		free(pattern);
+	}
+}
+
+static bool sigscan_match(const BYTE *p, const sigscan_pattern_t *pattern)
+{
+	for(size_t i = 0; i < pattern->len; i++) {
+		if((p[i] & pattern->mask[i]) != pattern->bytes[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+/// --------
+
+/// Scanning
+/// --------
+// Candidates are filtered by the first and the last fully specified byte of
+// the pattern, 16 positions at a time, and only the survivors are compared
+// in full. Returns the number of matches within [size] bytes at [start],
+// stopping at 2, and stores the first one in [match].
+SIGSCAN_TARGET_SSE2 static size_t sigscan_range(
+	const BYTE *start, size_t size, const sigscan_pattern_t *pattern, const BYTE **match
+)
+{
+	if(size < pattern->len) {
+		return 0;
+	}
+	size_t a0 = 0;
+	while(pattern->mask[a0] != 0xFF) {
+		a0++;
+	}
+	size_t a1 = pattern->len - 1;
+	while(pattern->mask[a1] != 0xFF) {
+		a1--;
+	}
+	// Number of possible match positions
+	const size_t positions = size - pattern->len + 1;
+	size_t found = 0;
+
+	auto candidate = [&](size_t i) {
+		if(sigscan_match(start + i, pattern)) {
+			if(!found) {
+				*match = start + i;
+			}
+			found++;
+		}
+		return found < 2;
+	};
+
+	size_t i = 0;
+	if(SIGSCAN_SSE2) {
+		const __m128i b0 = _mm_set1_epi8((char)pattern->bytes[a0]);
+		const __m128i b1 = _mm_set1_epi8((char)pattern->bytes[a1]);
+		for(; (i + 16) <= positions; i += 16) {
+			const __m128i v0 = _mm_loadu_si128((const __m128i *)(start + i + a0));
+			const __m128i v1 = _mm_loadu_si128((const __m128i *)(start + i + a1));
+			unsigned int bits = _mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(v0, b0), _mm_cmpeq_epi8(v1, b1)
+			));
+			while(bits) {
+				unsigned long bit;
+				_BitScanForward(&bit, bits);
+				bits &= bits - 1;
+				if(!candidate(i + bit)) {
+					return found;
+				}
+			}
+		}
+	}
+	for(; i < positions; i++) {
+		if(start[i + a0] == pattern->bytes[a0] && !candidate(i)) {
+			return found;
+		}
+	}
+	return found;
+}
+
+// Calls [func] with the start and size of every executable section of
+// [hMod]. Not every compiler calls its code section ".text".
+template <typename F>
+static void sigscan_sections_foreach(HMODULE hMod, F func)
+{
+	PIMAGE_NT_HEADERS pNTH = GetNtHeader(hMod);
+	if(!pNTH) {
+		return;
+	}
+	PIMAGE_SECTION_HEADER pSH = IMAGE_FIRST_SECTION(pNTH);
+	if(!VirtualCheckRegion(pSH, sizeof(IMAGE_SECTION_HEADER) * pNTH->FileHeader.NumberOfSections)) {
+		return;
+	}
+	for(WORD c = 0; c < pNTH->FileHeader.NumberOfSections; c++, pSH++) {
+		if(!(pSH->Characteristics & IMAGE_SCN_MEM_EXECUTE)) {
+			continue;
+		}
+		const BYTE *start = (const BYTE*)hMod + pSH->VirtualAddress;
+		const size_t size = pSH->Misc.VirtualSize;
+		if(size && VirtualCheckRegion(start, size)) {
+			if(!func(start, size)) {
+				return;
+			}
+		}
+	}
+}
+/// --------
+
+/// Cache
+/// -----
+// The cache maps the patterns of every module to their resolved RVAs, and is
+// stored as one JSON entry per game build in the disk cache. Modules are
+// identified by their link timestamp and image size.
+#define SIGSCAN_CACHE_DISK_NS "sigscan"
+
+static json_t *sigscan_cache = NULL;
+static bool sigscan_cache_loaded = false;
+static bool sigscan_cache_dirty = false;
+static SRWLOCK sigscan_cache_srwlock = { SRWLOCK_INIT };
+
+static std::string sigscan_cache_disk_key(void)
+{
+	const char *game = runconfig_game_get();
+	const char *build = runconfig_build_get();
+	if(!game || !build) {
+		return "";
+	}
+	return std::string(game) + "." + build;
+}
+
+static std::string sigscan_module_key(HMODULE hMod)
+{
+	PIMAGE_NT_HEADERS pNTH = GetNtHeader(hMod);
+	if(!pNTH) {
+		return "";
+	}
+	char key[32];
+	snprintf(key, sizeof(key), "%08x_%08x",
+		(unsigned int)pNTH->FileHeader.TimeDateStamp,
+		(unsigned int)pNTH->OptionalHeader.SizeOfImage
+	);
+	return key;
+}
+
+// Must be called with the lock held exclusively.
+static void sigscan_cache_load(void)
+{
+	if(sigscan_cache_loaded) {
+		return;
+	}
+	sigscan_cache_loaded = true;
+	std::string disk_key = sigscan_cache_disk_key();
+	if(!disk_key.empty()) {
+		// A broken cache is simply rebuilt.
+		size_t cache_size;
+		char *cache_buffer = (char*)disk_cache_get(SIGSCAN_CACHE_DISK_NS, disk_key.c_str(), &cache_size);
+		if(cache_buffer) {
+			sigscan_cache = json_loadb(cache_buffer, cache_size, 0, NULL);
+			free(cache_buffer);
+		}
+	}
+	if(!json_is_object(sigscan_cache)) {
+		json_decref_safe(sigscan_cache);
+		sigscan_cache = json_object();
+	}
+}
+
+// Returns the cached RVA of [pattern], or -1 if there is none.
+static json_int_t sigscan_cache_get(const std::string& module_key, const sigscan_pattern_t *pattern)
+{
+	AcquireSRWLockExclusive(&sigscan_cache_srwlock);
+	sigscan_cache_load();
+	json_t *rva = json_object_get(json_object_get(sigscan_cache, module_key.c_str()), pattern->str);
+	json_int_t ret = json_is_integer(rva) ? json_integer_value(rva) : -1;
+	ReleaseSRWLockExclusive(&sigscan_cache_srwlock);
+	return ret;
+}
+
+static void sigscan_cache_put(const std::string& module_key, const sigscan_pattern_t *pattern, json_int_t rva)
+{
+	AcquireSRWLockExclusive(&sigscan_cache_srwlock);
+	sigscan_cache_load();
+	json_t *module = json_object_get(sigscan_cache, module_key.c_str());
+	if(!json_is_object(module)) {
+		module = json_object();
+		json_object_set_new(sigscan_cache, module_key.c_str(), module);
+	}
+	json_object_set_new(module, pattern->str, json_integer(rva));
+	sigscan_cache_dirty = true;
+	ReleaseSRWLockExclusive(&sigscan_cache_srwlock);
+}
+
+void sigscan_cache_store(void)
+{
+	AcquireSRWLockExclusive(&sigscan_cache_srwlock);
+	if(sigscan_cache && sigscan_cache_dirty) {
+		std::string disk_key = sigscan_cache_disk_key();
+		char *dump = json_dumps(sigscan_cache, JSON_COMPACT | JSON_SORT_KEYS);
+		if(dump && !disk_key.empty()) {
+			if(disk_cache_put(SIGSCAN_CACHE_DISK_NS, disk_key.c_str(), dump, strlen(dump), 0)) {
+				log_printf("Couldn't write the signature cache for %s\n", disk_key.c_str());
+			}
+		}
+		free(dump);
+		sigscan_cache_dirty = false;
+	}
+	ReleaseSRWLockExclusive(&sigscan_cache_srwlock);
+}
+/// -----
+
+size_t sigscan_find(HMODULE hMod, const sigscan_pattern_t *pattern)
+{
+	if(!hMod || !pattern) {
+		return 0;
+	}
+	const std::string module_key = sigscan_module_key(hMod);
+	if(module_key.empty()) {
+		return 0;
+	}
+
+	// A cached match is only trusted if the bytes still match.
+	const json_int_t cached_rva = sigscan_cache_get(module_key, pattern);
+	if(cached_rva >= 0) {
+		const BYTE *cached = (const BYTE*)hMod + cached_rva;
+		bool valid = false;
+		sigscan_sections_foreach(hMod, [&](const BYTE *start, size_t size) {
+			if(cached >= start && cached + pattern->len <= start + size) {
+				valid = sigscan_match(cached, pattern);
+				return false;
+			}
+			return true;
+		});
+		if(valid) {
+			return (size_t)cached + pattern->offset;
+		}
+	}
+
+	const BYTE *match = NULL;
+	size_t found = 0;
+	sigscan_sections_foreach(hMod, [&](const BYTE *start, size_t size) {
+		const BYTE *section_match = NULL;
+		const size_t section_found = sigscan_range(start, size, pattern, &section_match);
+		if(section_found && !found) {
+			match = section_match;
+		}
+		found += section_found;
+		return found < 2;
+	});
+
+	if(found != 1) {
+		log_printf("ERROR: signature \"%s\" %s\n",
+			pattern->str, found ? "matches more than once" : "not found"
+		);
+		return 0;
+	}
+	sigscan_cache_put(module_key, pattern, (json_int_t)(match - (const BYTE*)hMod));
+	return (size_t)match + pattern->offset;
+}
+
+void sigscan_mod_exit(void)
+{
+	sigscan_cache_store();
+	AcquireSRWLockExclusive(&sigscan_cache_srwlock);
+	sigscan_cache = json_decref_safe(sigscan_cache);
+	sigscan_cache_loaded = false;
+	ReleaseSRWLockExclusive(&sigscan_cache_srwlock);
+}
@@ -0,0 +1,52 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Byte signature scanning.
+  *
+  * Instead of a fixed address, binary hacks and breakpoints can locate their
+  * target by searching the executable sections of the game for a byte
+  * pattern, written as a string of hex bytes:
+  *
+  *	"8B 45 ?? 83 F8 1? 75"
+  *
+  * • Every byte is made up of two hex characters, or ? for a wildcard
+  *   nibble. A single ? stands for a whole wildcard byte.
+  * • Whitespace between bytes is optional and ignored.
+  * • The pattern must contain at least one fully specified byte, and must
+  *   match exactly once to resolve to an address.
+  *
+  * Resolved addresses are cached per game build, so that later launches
+  * only have to verify the bytes at the cached address.
+  */
+
+#pragma once
+
+typedef struct {
+	// Original pattern string, used as the cache key
+	char *str;
+	// Expected bytes, already ANDed with [mask]
+	BYTE *bytes;
+	BYTE *mask;
+	size_t len;
+	// Added to the start of the match
+	ptrdiff_t offset;
+} sigscan_pattern_t;
+
+// Parses [str] into a new pattern. Returns NULL and logs an error if [str]
+// is not a valid pattern.
+sigscan_pattern_t* sigscan_pattern_parse(const char *str, ptrdiff_t offset);
+
+void sigscan_pattern_free(sigscan_pattern_t *pattern);
+
+// Returns the address of the single match of [pattern] in the executable
+// sections of [hMod], plus the pattern's offset, or 0 if there is no match
+// or more than one. Thread-safe.
+size_t sigscan_find(HMODULE hMod, const sigscan_pattern_t *pattern);
+
+// Writes all newly resolved addresses back to the cache file.
+void sigscan_cache_store(void);
+
+void sigscan_mod_exit(void);
@@ -12,52 +12,165 @@
 #include <algorithm>
 #include <list>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
 
-std::vector<patch_t> stack;
+/// Snapshots
+/// ---------
+/**
+  * The stack is published as an immutable snapshot, which readers grab with
+  * a single pointer read and can then use from any thread, without taking
+  * any lock. Every change copies the current snapshot, modifies the copy,
+  * and atomically swaps it in.
+  *
+  * Readers such as stack_chain_iterate() can stop at any point and don't
+  * hold a reference, so replaced snapshots and removed patches are retired
+  * rather than freed, and only cleaned up by stack_free(). The stack only
+  * changes a handful of times per run, so this doesn't amount to much.
+  */
+struct stack_snapshot_t {
+	std::vector<patch_t> patches;
+};
+
+static stack_snapshot_t stack_empty;
+static const stack_snapshot_t *volatile stack_current = &stack_empty;
+static std::vector<const stack_snapshot_t *> stack_retired;
+static std::vector<patch_t> stack_removed;
+// Serializes writers, readers never take it.
+static SRWLOCK stack_write_srwlock = { SRWLOCK_INIT };
+
+static const std::vector<patch_t>& stack_patches(void)
+{
+	return stack_current->patches;
+}
+
+// Calls [func] on a copy of the current patches and publishes the result.
+// Returns the return value of [func].
+template <typename F> static auto stack_modify(F func)
+{
+	AcquireSRWLockExclusive(&stack_write_srwlock);
+	const stack_snapshot_t *prev = stack_current;
+	auto *next = new stack_snapshot_t{ prev->patches };
+	auto ret = func(next->patches);
+	InterlockedExchangePointer((PVOID *)&stack_current, next);
+	if(prev != &stack_empty) {
+		stack_retired.push_back(prev);
+	}
+	ReleaseSRWLockExclusive(&stack_write_srwlock);
+	stack_json_cache_clear();
+	return ret;
+}
+
+const patch_t* stack_snapshot_get(size_t *count)
+{
+	const stack_snapshot_t *snapshot = stack_current;
+	if(count) {
+		*count = snapshot->patches.size();
+	}
+	return snapshot->patches.data();
+}
+/// ---------
 
-static char **resolve_chain_default(const char *fn)
+static void resolve_chain_default(chain_buf_t& chain, const char *fn)
 {
 	if (!fn) {
-		return nullptr;
+		return;
 	}
-	char **chain = (char**)malloc(3 * sizeof(char *));
-	char *fn_build = fn_for_build(fn);
-	chain[0] = strdup(fn);
-	chain[1] = fn_build;
-	chain[2] = nullptr;
-	return chain;
+	chain.push(fn);
+	chain.push_build(fn);
 }
 
-static char **resolve_chain_game_default(const char *fn)
+static void resolve_chain_game_default(chain_buf_t& chain, const char *fn)
 {
-	char *fn_common = fn_for_game(fn);
-	const char *fn_common_ptr = fn_common ? fn_common : fn;
-	char **ret = resolve_chain(fn_common_ptr);
-	SAFE_FREE(fn_common);
-	return ret;
+	const char *game = runconfig_game_get();
+	if (!game || !fn) {
+		resolve_chain_build(chain, fn);
+		return;
+	}
+	chain_buf_t fn_common;
+	fn_common.push_prefixed(game, fn);
+	resolve_chain_build(chain, fn_common.get()[0]);
 }
 
-static resolve_chain_t resolve_chain_function      = resolve_chain_default;
-static resolve_chain_t resolve_chain_game_function = resolve_chain_game_default;
+static resolve_chain_build_t resolve_chain_function      = resolve_chain_default;
+static resolve_chain_build_t resolve_chain_game_function = resolve_chain_game_default;
+// Set if a heap-based chain function replaced the ones above.
+static resolve_chain_t resolve_chain_heap_function      = nullptr;
+static resolve_chain_t resolve_chain_game_heap_function = nullptr;
+
+void resolve_chain_build(chain_buf_t& chain, const char *fn)
+{
+	if (resolve_chain_heap_function) {
+		chain.adopt(resolve_chain_heap_function(fn));
+	} else {
+		resolve_chain_function(chain, fn);
+	}
+}
+
+void resolve_chain_game_build(chain_buf_t& chain, const char *fn)
+{
+	if (resolve_chain_game_heap_function) {
+		chain.adopt(resolve_chain_game_heap_function(fn));
+	} else {
+		resolve_chain_game_function(chain, fn);
+	}
+}
+
+void set_resolve_chain_build(resolve_chain_build_t function)
+{
+	resolve_chain_function = function;
+	resolve_chain_heap_function = nullptr;
+}
+
+void set_resolve_chain_game_build(resolve_chain_build_t function)
+{
+	resolve_chain_game_function = function;
+	resolve_chain_game_heap_function = nullptr;
+}
+
+// Copies [chain] into a chain that can be freed with chain_free().
+static char **chain_dup(chain_buf_t& chain)
+{
+	const size_t size = chain.size();
+	if (size == 0) {
+		return nullptr;
+	}
+	char **ret = (char**)malloc((size + 1) * sizeof(char *));
+	for (size_t i = 0; i < size; i++) {
+		ret[i] = strdup(chain.get()[i]);
+	}
+	ret[size] = nullptr;
+	return ret;
+}
 
 char **resolve_chain(const char *fn)
 {
-	return resolve_chain_function(fn);
+	if (resolve_chain_heap_function) {
+		return resolve_chain_heap_function(fn);
+	}
+	chain_buf_t chain;
+	resolve_chain_function(chain, fn);
+	return chain_dup(chain);
 }
 
 void set_resolve_chain(resolve_chain_t function)
 {
-	resolve_chain_function = function;
+	resolve_chain_heap_function = function;
 }
 
 char **resolve_chain_game(const char *fn)
 {
-	return resolve_chain_game_function(fn);
+	if (resolve_chain_game_heap_function) {
+		return resolve_chain_game_heap_function(fn);
+	}
+	chain_buf_t chain;
+	resolve_chain_game_function(chain, fn);
+	return chain_dup(chain);
 }
 
 void set_resolve_chain_game(resolve_chain_t function)
 {
-	resolve_chain_game_function = function;
+	resolve_chain_game_heap_function = function;
 }
 
 static size_t chain_get_size(char **chain)
@@ -82,6 +195,8 @@ void chain_free(char **chain)
 	free(chain);
 }
 
+static void stack_deps_record(char **chain, bool vfs);
+
 int stack_chain_iterate(stack_chain_iterate_t *sci, char **chain, sci_dir_t direction)
 {
 	size_t chain_size = chain_get_size(chain);
@@ -89,8 +204,8 @@ int stack_chain_iterate(stack_chain_iterate_t *sci, char **chain, sci_dir_t dire
 		int chain_idx;
 		// Setup
 		if(!sci->patches) {
-			sci->patches = stack.data();
-			sci->nb_patches = stack.size();
+			stack_deps_record(chain, false);
+			sci->patches = stack_snapshot_get(&sci->nb_patches);
 			sci->step =
 				(direction < 0) ? (sci->nb_patches * chain_size) - 1 : 0
 			;
@@ -110,71 +225,395 @@ int stack_chain_iterate(stack_chain_iterate_t *sci, char **chain, sci_dir_t dire
 	return 1;
 }
 
-json_t* stack_json_resolve_chain(char **chain, size_t *file_size)
+/// Resolved JSON cache
+/// -------------------
+/**
+  * Merging a JSON file means parsing every layer of it in every patch, and
+  * many files are resolved over and over again. While the repatch watcher
+  * is running, the merged result of every chain is therefore kept around
+  * and handed out as a new reference, until it is evicted by a change to
+  * any of the chain's files.
+  */
+struct stack_json_cache_entry_t
+{
+	json_t *json;
+	size_t size;
+	// Lowercase chain file names with forward slashes, to be matched
+	// against the changed files reported by the watcher.
+	std::vector<std::string> fns;
+	// Set if a jsonvfs generator contributed to the result. Since the input
+	// files of a generator are unknown here, such entries are evicted on
+	// every change.
+	bool vfs;
+	// Patch that contributed the highest layer, see patch_stats.h
+	patch_stats_t *owner;
+};
+
+static std::unordered_map<std::string, stack_json_cache_entry_t> stack_json_cache;
+static SRWLOCK stack_json_cache_srwlock = { SRWLOCK_INIT };
+static bool stack_json_cache_enabled = false;
+// Incremented on every eviction, so that a result that was resolved while
+// its files were changing doesn't get cached.
+static size_t stack_json_cache_generation = 0;
+
+static std::string stack_json_cache_fn(const char *fn)
+{
+	std::string ret = fn;
+	for (auto &c : ret) {
+		if (c == '\\') {
+			c = '/';
+		} else if (c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		}
+	}
+	return ret;
+}
+
+// Drops all entries for which [pred] returns true.
+template <typename P> static void stack_json_cache_evict_if(P pred)
+{
+	AcquireSRWLockExclusive(&stack_json_cache_srwlock);
+	for (auto it = stack_json_cache.begin(); it != stack_json_cache.end(); ) {
+		if (pred(it->second)) {
+			json_decref(it->second.json);
+			it = stack_json_cache.erase(it);
+		} else {
+			++it;
+		}
+	}
+	stack_json_cache_generation++;
+	ReleaseSRWLockExclusive(&stack_json_cache_srwlock);
+}
+
+void stack_json_cache_clear(void)
+{
+	stack_json_cache_evict_if([](const stack_json_cache_entry_t&) {
+		return true;
+	});
+}
+
+void stack_json_cache_enable(int enable)
+{
+	stack_json_cache_clear();
+	stack_json_cache_enabled = enable != 0;
+}
+
+void stack_json_cache_evict(const char *fn)
+{
+	if (!stack_json_cache_enabled || !fn) {
+		return;
+	}
+	std::string key = stack_json_cache_fn(fn);
+	stack_json_cache_evict_if([&key](const stack_json_cache_entry_t &entry) {
+		return entry.vfs
+			|| std::find(entry.fns.begin(), entry.fns.end(), key) != entry.fns.end();
+	});
+}
+
+void stack_json_cache_repatch(const json_t *files_changed)
+{
+	if (!stack_json_cache_enabled || !json_object_size(files_changed)) {
+		return;
+	}
+	std::unordered_set<std::string> changed;
+	const char *key;
+	json_t *val;
+	json_object_foreach((json_t *)files_changed, key, val) {
+		changed.insert(stack_json_cache_fn(key));
+	}
+	stack_json_cache_evict_if([&changed](const stack_json_cache_entry_t &entry) {
+		return entry.vfs
+			|| std::any_of(entry.fns.begin(), entry.fns.end(), [&changed](const std::string &fn) {
+				return changed.count(fn) != 0;
+			});
+	});
+}
+/// -------------------
+
+/// Repatch dependency graph
+/// ------------------------
+/**
+  * Maps every patch-relative file name that was part of an iterated chain to
+  * the names that were requested from the resolvers (i.e., the first chain
+  * element). This lets the repatch collector translate the raw names of
+  * changed files into exactly the names that modules loaded them as, and
+  * skip changes to files that nobody ever loaded.
+  */
+static std::unordered_map<std::string, std::unordered_set<std::string>> stack_deps;
+// Consumers fed by jsonvfs generators, whose inputs are unknown here.
+static std::unordered_set<std::string> stack_deps_vfs;
+static SRWLOCK stack_deps_srwlock = { SRWLOCK_INIT };
+static bool stack_deps_enabled = false;
+
+static void stack_deps_record(char **chain, bool vfs)
+{
+	if (!stack_deps_enabled || !chain || !chain[0]) {
+		return;
+	}
+	const char *consumer = chain[0];
+	std::vector<std::string> fns;
+	for (size_t n = 0; chain[n]; n++) {
+		fns.push_back(stack_json_cache_fn(chain[n]));
+	}
+
+	// Since a chain is always recorded as a whole, it's enough to check
+	// its last element.
+	AcquireSRWLockShared(&stack_deps_srwlock);
+	auto it = stack_deps.find(fns.back());
+	bool known = it != stack_deps.end() && it->second.count(consumer)
+		&& (!vfs || stack_deps_vfs.count(consumer));
+	ReleaseSRWLockShared(&stack_deps_srwlock);
+	if (known) {
+		return;
+	}
+
+	AcquireSRWLockExclusive(&stack_deps_srwlock);
+	for (const auto &fn : fns) {
+		stack_deps[fn].insert(consumer);
+	}
+	if (vfs) {
+		stack_deps_vfs.insert(consumer);
+	}
+	ReleaseSRWLockExclusive(&stack_deps_srwlock);
+}
+
+void stack_deps_enable(int enable)
+{
+	AcquireSRWLockExclusive(&stack_deps_srwlock);
+	stack_deps.clear();
+	stack_deps_vfs.clear();
+	stack_deps_enabled = enable != 0;
+	ReleaseSRWLockExclusive(&stack_deps_srwlock);
+}
+
+void stack_deps_add(const char *fn)
+{
+	chain_buf_t chain;
+	resolve_chain_build(chain, fn);
+	stack_deps_record(chain.get(), false);
+}
+
+json_t* stack_deps_expand(const json_t *files_changed)
+{
+	json_t *ret = json_object();
+	if (!stack_deps_enabled) {
+		json_object_update(ret, (json_t *)files_changed);
+		return ret;
+	}
+	const char *key;
+	json_t *val;
+	AcquireSRWLockShared(&stack_deps_srwlock);
+	json_object_foreach((json_t *)files_changed, key, val) {
+		auto it = stack_deps.find(stack_json_cache_fn(key));
+		if (it == stack_deps.end()) {
+			continue;
+		}
+		json_object_set(ret, key, val);
+		for (const auto &consumer : it->second) {
+			json_object_set(ret, consumer.c_str(), val);
+		}
+	}
+	if (json_object_size(ret)) {
+		for (const auto &consumer : stack_deps_vfs) {
+			json_object_set_new(ret, consumer.c_str(), json_true());
+		}
+	}
+	ReleaseSRWLockShared(&stack_deps_srwlock);
+	return ret;
+}
+/// ------------------------
+
+static json_t* stack_json_resolve_chain_uncached(char **chain, size_t *file_size, bool *vfs)
 {
-	json_t *ret = NULL;
 	stack_chain_iterate_t sci = {};
 	size_t json_size = 0;
 
+	// Virtual files can be memoized by their generators, so they have to be
+	// created outside of the arena.
+	std::vector<json_t*> vfs_jsons;
 	for (size_t n = 0; chain[n]; n++) {
 		const char *fn = chain[n];
 		size_t size = 0;
 		json_t *json_new = jsonvfs_get(fn, &size);
 		if (json_new) {
-			if (!ret) {
-				ret = json_new;
-			}
-			else {
-				json_object_merge(ret, json_new);
-				json_decref(json_new);
-			}
-			log_printf("\n+ vfs:%s", fn);
+			vfs_jsons.push_back(json_new);
+			log_debugf("\n+ vfs:%s", fn);
 			json_size += size;
+			*vfs = true;
 		}
 	}
 
+	// All intermediate layers only live until the merge is done.
+	json_arena_scope_t arena;
+	json_t *ret = NULL;
+	for (json_t *json_vfs : vfs_jsons) {
+		json_t *json_new = json_deep_copy(json_vfs);
+		json_decref(json_vfs);
+		ret = json_object_merge_new(ret, json_new);
+	}
+
 	while (stack_chain_iterate(&sci, chain, SCI_FORWARDS)) {
 		json_size += patch_json_merge(&ret, sci.patch_info, sci.fn);
 	}
 
-	log_printf(ret ? "\n" : "not found\n");
+	log_debugf(ret ? "\n" : "not found\n");
 	if(file_size) {
 		*file_size = json_size;
 	}
+	return ret ? arena.copy_out(ret) : NULL;
+}
+
+json_t* stack_json_resolve_chain(char **chain, size_t *file_size)
+{
+	bool vfs = false;
+	if (!stack_json_cache_enabled || !chain) {
+		json_t *ret = stack_json_resolve_chain_uncached(chain, file_size, &vfs);
+		if (vfs) {
+			stack_deps_record(chain, vfs);
+		}
+		return ret;
+	}
+
+	std::string key;
+	for (size_t n = 0; chain[n]; n++) {
+		key += chain[n];
+		key += '\n';
+	}
+
+	AcquireSRWLockShared(&stack_json_cache_srwlock);
+	auto it = stack_json_cache.find(key);
+	if (it != stack_json_cache.end()) {
+		json_t *ret = json_incref(it->second.json);
+		if (file_size) {
+			*file_size = it->second.size;
+		}
+		patch_stats_t *owner = it->second.owner;
+		ReleaseSRWLockShared(&stack_json_cache_srwlock);
+		if (owner) {
+			patch_stats_cache(owner, true);
+		}
+		log_debugf(ret ? "(cached)\n" : "not found\n");
+		return ret;
+	}
+	size_t generation = stack_json_cache_generation;
+	ReleaseSRWLockShared(&stack_json_cache_srwlock);
+
+	stack_json_cache_entry_t entry = {};
+	patch_stats_t *owner_prev = patch_stats_owner_begin();
+	entry.json = stack_json_resolve_chain_uncached(chain, &entry.size, &vfs);
+	entry.vfs = vfs;
+	entry.owner = patch_stats_owner_end(owner_prev);
+	if (entry.owner) {
+		patch_stats_cache(entry.owner, false);
+	}
+	if (vfs) {
+		stack_deps_record(chain, vfs);
+	}
+	for (size_t n = 0; chain[n]; n++) {
+		entry.fns.push_back(stack_json_cache_fn(chain[n]));
+	}
+	if (file_size) {
+		*file_size = entry.size;
+	}
+	json_t *ret = json_incref(entry.json);
+
+	AcquireSRWLockExclusive(&stack_json_cache_srwlock);
+	if (
+		generation != stack_json_cache_generation
+		|| !stack_json_cache.emplace(key, entry).second
+	) {
+		json_decref(entry.json);
+	}
+	ReleaseSRWLockExclusive(&stack_json_cache_srwlock);
 	return ret;
 }
 
 json_t* stack_json_resolve(const char *fn, size_t *file_size)
 {
 	json_t *ret = NULL;
-	char **chain = resolve_chain(fn);
-	if(chain && chain[0]) {
-		log_printf("(JSON) Resolving %s... ", fn);
-		ret = stack_json_resolve_chain(chain, file_size);
+	chain_buf_t chain;
+	resolve_chain_build(chain, fn);
+	if(chain.get() && chain.get()[0]) {
+		log_debugf("(JSON) Resolving %s... ", fn);
+		ret = stack_json_resolve_chain(chain.get(), file_size);
 	}
-	chain_free(chain);
 	return ret;
 }
 
-HANDLE stack_file_resolve_chain(char **chain)
+HANDLE stack_file_resolve_chain_packed(char **chain, const patch_pack_t **pack, const patch_pack_entry_t **entry)
 {
 	stack_chain_iterate_t sci = {};
+	trace_scope_t trace(TRACE_FILE, chain ? chain[0] : nullptr, "not found");
+
+	if(pack) {
+		*pack = nullptr;
+		*entry = nullptr;
+	}
 
 	// Both the patch stack and the chain have to be traversed backwards: Later
 	// patches take priority over earlier ones, and build-specific files are
 	// preferred over generic ones.
 	while(stack_chain_iterate(&sci, chain, SCI_BACKWARDS)) {
+		const patch_pack_t *sci_pack;
+		const patch_pack_entry_t *sci_entry;
+		if(pack && patch_file_pack_lookup(sci.patch_info, sci.fn, &sci_pack, &sci_entry) == PATCH_INDEX_FILE) {
+			*pack = sci_pack;
+			*entry = sci_entry;
+			patch_stats_file(patch_stats_get(sci.patch_info), sci_entry->size);
+			trace.detail = trace.start ? fn_for_patch_tls(sci.patch_info, sci.fn) : nullptr;
+			if(log_level_enabled(LOG_LEVEL_DEBUG)) {
+				patch_print_fn(sci.patch_info, sci.fn);
+				log_print(" (packed)\n");
+			}
+			return INVALID_HANDLE_VALUE;
+		}
 		auto ret = patch_file_stream(sci.patch_info, sci.fn);
 		if(ret != INVALID_HANDLE_VALUE) {
-			patch_print_fn(sci.patch_info, sci.fn);
-			log_print("\n");
+			patch_stats_file(patch_stats_get(sci.patch_info), GetFileSize(ret, nullptr));
+			trace.detail = trace.start ? fn_for_patch_tls(sci.patch_info, sci.fn) : nullptr;
+			if(log_level_enabled(LOG_LEVEL_DEBUG)) {
+				patch_print_fn(sci.patch_info, sci.fn);
+				log_print("\n");
+			}
 			return ret;
 		}
 	}
-	log_printf("not found\n");
+	log_debugf("not found\n");
 	return INVALID_HANDLE_VALUE;
 }
 
+HANDLE stack_file_resolve_chain(char **chain)
+{
+	return stack_file_resolve_chain_packed(chain, nullptr, nullptr);
+}
+
+void* stack_file_load_chain(char **chain, size_t *file_size)
+{
+	const patch_pack_t *pack;
+	const patch_pack_entry_t *entry;
+	HANDLE stream = stack_file_resolve_chain_packed(chain, &pack, &entry);
+	if(entry) {
+		return patch_pack_load(pack, entry, file_size);
+	}
+	return file_stream_read(stream, file_size);
+}
+
+int stack_file_size_chain(char **chain, size_t *file_size)
+{
+	stack_chain_iterate_t sci = {};
+	*file_size = 0;
+
+	// Both the patch stack and the chain have to be traversed backwards: Later
+	// patches take priority over earlier ones, and build-specific files are
+	// preferred over generic ones.
+	while(stack_chain_iterate(&sci, chain, SCI_BACKWARDS)) {
+		if(patch_file_size(sci.patch_info, sci.fn, file_size)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 char* stack_fn_resolve_chain(char **chain)
 {
 	stack_chain_iterate_t sci = {};
@@ -183,46 +622,83 @@ char* stack_fn_resolve_chain(char **chain)
 	// patches take priority over earlier ones, and build-specific files are
 	// preferred over generic ones.
 	while (stack_chain_iterate(&sci, chain, SCI_BACKWARDS)) {
-		char *fn = fn_for_patch(sci.patch_info, sci.fn);
+		switch (patch_index_lookup(sci.patch_info, sci.fn)) {
+		case PATCH_INDEX_FILE:
+			return fn_for_patch(sci.patch_info, sci.fn);
+		case PATCH_INDEX_MISSING:
+		case PATCH_INDEX_DIRECTORY:
+			continue;
+		default:
+			break;
+		}
+		const char *fn = fn_for_patch_tls(sci.patch_info, sci.fn);
 		DWORD attr = GetFileAttributesU(fn);
 		if (attr != INVALID_FILE_ATTRIBUTES && !(attr & FILE_ATTRIBUTE_DIRECTORY)) {
-			return fn;
+			return strdup(fn);
 		}
-		free(fn);
 	}
 	return nullptr;
 }
 
-HANDLE stack_game_file_stream(const char *fn)
+HANDLE stack_game_file_stream_packed(const char *fn, const patch_pack_t **pack, const patch_pack_entry_t **entry)
 {
 	HANDLE ret = INVALID_HANDLE_VALUE;
-	char **chain = resolve_chain_game(fn);
-	if (chain && chain[0]) {
-		log_printf("(Data) Resolving %s... ", chain[0]);
-		ret = stack_file_resolve_chain(chain);
+	if(pack) {
+		*pack = nullptr;
+		*entry = nullptr;
+	}
+	chain_buf_t chain;
+	resolve_chain_game_build(chain, fn);
+	if (chain.get() && chain.get()[0]) {
+		log_debugf("(Data) Resolving %s... ", chain.get()[0]);
+		ret = stack_file_resolve_chain_packed(chain.get(), pack, entry);
 	}
-	chain_free(chain);
 	return ret;
 }
 
+HANDLE stack_game_file_stream(const char *fn)
+{
+	return stack_game_file_stream_packed(fn, nullptr, nullptr);
+}
+
 void* stack_game_file_resolve(const char *fn, size_t *file_size)
 {
-	return file_stream_read(stack_game_file_stream(fn), file_size);
+	const patch_pack_t *pack;
+	const patch_pack_entry_t *entry;
+	HANDLE stream = stack_game_file_stream_packed(fn, &pack, &entry);
+	if(entry) {
+		return patch_pack_load(pack, entry, file_size);
+	}
+	return file_stream_read(stream, file_size);
+}
+
+int stack_game_file_size(const char *fn, size_t *file_size)
+{
+	*file_size = 0;
+	chain_buf_t chain;
+	resolve_chain_game_build(chain, fn);
+	if (chain.get() && chain.get()[0]) {
+		return stack_file_size_chain(chain.get(), file_size);
+	}
+	return 0;
 }
 
 json_t* stack_game_json_resolve(const char *fn, size_t *file_size)
 {
-	char *full_fn = fn_for_game(fn);
-	json_t *ret = stack_json_resolve(full_fn, file_size);
-	SAFE_FREE(full_fn);
-	return ret;
+	const char *game = runconfig_game_get();
+	if (!game || !fn) {
+		return stack_json_resolve(fn, file_size);
+	}
+	chain_buf_t full_fn;
+	full_fn.push_prefixed(game, fn);
+	return stack_json_resolve(full_fn.get()[0], file_size);
 }
 
 void stack_show_missing(void)
 {
 	std::list<const patch_t*> rem_arcs;
 
-	for (const patch_t& patch : stack) {
+	for (const patch_t& patch : stack_patches()) {
 		if(patch.archive && !PathFileExists(patch.archive)) {
 			rem_arcs.push_back(&patch);
 		}
@@ -248,7 +724,7 @@ void stack_show_missing(void)
 
 void stack_show_motds(void)
 {
-	for (const patch_t& patch : stack) {
+	for (const patch_t& patch : stack_patches()) {
 		patch_show_motd(&patch);
 	}
 }
@@ -261,12 +737,36 @@ extern "C" __declspec(dllexport) void motd_mod_post_init(void)
 
 void stack_add_patch_from_json(json_t *patch)
 {
-	stack.push_back(patch_init(json_object_get_string(patch, "archive"), patch, stack.size() + 1));
+	stack_modify([patch](std::vector<patch_t>& patches) {
+		patches.push_back(patch_init(json_object_get_string(patch, "archive"), patch, patches.size() + 1));
+		return 0;
+	});
+}
+
+void stack_add_patches_from_json(json_t *patches)
+{
+	const size_t count = json_array_size(patches);
+	if (!count) {
+		return;
+	}
+	std::vector<json_t*> patch_infos(count);
+	for (size_t i = 0; i < count; i++) {
+		patch_infos[i] = json_array_get(patches, i);
+	}
+	stack_modify([&patch_infos, count](std::vector<patch_t>& patches) {
+		std::vector<patch_t> new_patches(count);
+		patch_init_multiple(new_patches.data(), patch_infos.data(), count, patches.size() + 1);
+		patches.insert(patches.end(), new_patches.begin(), new_patches.end());
+		return 0;
+	});
 }
 
 void stack_add_patch(patch_t *patch)
 {
-	stack.push_back(*patch);
+	stack_modify([patch](std::vector<patch_t>& patches) {
+		patches.push_back(*patch);
+		return 0;
+	});
 }
 
 void stack_remove_patch(const char *patch_id)
@@ -276,26 +776,32 @@ void stack_remove_patch(const char *patch_id)
 		return strcmp(patch.id, patch_id) == 0;
 	};
 
-	std::vector<patch_t>::iterator patch = std::find_if(stack.begin(), stack.end(), check);
-	patch_free(&*patch);
-	stack.erase(patch);
+	stack_modify([&check](std::vector<patch_t>& patches) {
+		std::vector<patch_t>::iterator patch = std::find_if(patches.begin(), patches.end(), check);
+		if (patch != patches.end()) {
+			// Still referenced by older snapshots
+			stack_removed.push_back(*patch);
+			patches.erase(patch);
+		}
+		return 0;
+	});
 }
 
 size_t stack_get_size()
 {
-	return stack.size();
+	return stack_patches().size();
 }
 
 void stack_foreach(void(*callback)(const patch_t *path, void *userdata), void *userdata)
 {
-	for (const patch_t &patch : stack) {
+	for (const patch_t &patch : stack_patches()) {
 		callback(&patch, userdata);
 	}
 }
 
 void stack_foreach_cpp(std::function<void(const patch_t*)> callback)
 {
-	for (const patch_t &patch : stack) {
+	for (const patch_t &patch : stack_patches()) {
 		callback(&patch);
 	}
 }
@@ -303,6 +809,7 @@ void stack_foreach_cpp(std::function<void(const patch_t*)> callback)
 void stack_print()
 {
 	size_t i = 0;
+	const std::vector<patch_t>& stack = stack_patches();
 
 	log_print("Patches in the stack: ");
 	for (const patch_t& patch : stack) {
@@ -342,13 +849,14 @@ int stack_remove_if_unneeded(const char *patch_id)
 	// (No early return if we have no game name, since we want
 	//  to slice out the patch in that case too.)
 
+	const std::vector<patch_t>& stack = stack_patches();
 	auto patch_it = std::find_if(stack.begin(), stack.end(), [patch_id](const patch_t &patch) {
 		return patch.id != nullptr && strcmp(patch.id, patch_id) == 0;
 	});
 	if (patch_it == stack.end()) {
 		return -1;
 	}
-	patch_t& patch = *patch_it;
+	const patch_t& patch = *patch_it;
 
 	int game_found = 0;
 	if (!game.empty()) {
@@ -367,20 +875,40 @@ int stack_remove_if_unneeded(const char *patch_id)
 		}
 	}
 	if (!game_found) {
-		stack.erase(patch_it);
+		const size_t patch_idx = patch_it - stack.begin();
+		stack_modify([patch_idx](std::vector<patch_t>& patches) {
+			patches.erase(patches.begin() + patch_idx);
 
-		// Fix levels
-		for (size_t i = 0; i < stack.size(); i++) {
-			stack[i].level = i + 1;
-		}
+			// Fix levels
+			for (size_t i = 0; i < patches.size(); i++) {
+				patches[i].level = i + 1;
+			}
+			return 0;
+		});
 	}
 	return !game_found;
 }
 
 void stack_free()
 {
-	for (patch_t &patch : stack) {
+	AcquireSRWLockExclusive(&stack_write_srwlock);
+	auto *current = (const stack_snapshot_t *)InterlockedExchangePointer(
+		(PVOID *)&stack_current, (PVOID)&stack_empty
+	);
+	for (patch_t patch : current->patches) {
+		patch_free(&patch);
+	}
+	for (patch_t &patch : stack_removed) {
 		patch_free(&patch);
 	}
-	stack.clear();
+	stack_removed.clear();
+	if (current != &stack_empty) {
+		stack_retired.push_back(current);
+	}
+	for (const stack_snapshot_t *snapshot : stack_retired) {
+		delete snapshot;
+	}
+	stack_retired.clear();
+	ReleaseSRWLockExclusive(&stack_write_srwlock);
+	stack_json_cache_clear();
 }
@@ -27,6 +27,139 @@ typedef struct {
 
 typedef char** (*resolve_chain_t)(const char *fn);
 
+#ifdef __cplusplus
+/**
+  * Resolving chain that stores its file names inline, so that building the
+  * chain for a typical path length doesn't allocate anything. Meant to live
+  * on the stack of the resolving function. get() returns the chain in the
+  * same NULL-terminated form that resolve_chain() returns, or NULL if it's
+  * empty, and stays valid until the object is cleared or destroyed.
+  */
+struct chain_buf_t
+{
+	static constexpr size_t INLINE_FNS = 7;
+	static constexpr size_t INLINE_SIZE = 512;
+
+	chain_buf_t() = default;
+	chain_buf_t(const chain_buf_t&) = delete;
+	chain_buf_t& operator=(const chain_buf_t&) = delete;
+	~chain_buf_t() {
+		clear();
+	}
+
+	char **get() {
+		return count ? fns : nullptr;
+	}
+	size_t size() const {
+		return count;
+	}
+
+	// Appends a copy of the [len] bytes at [fn].
+	void push(const char *fn, size_t len) {
+		char *copy = reserve(len);
+		memcpy(copy, fn, len);
+		copy[len] = '\0';
+		push_ptr(copy);
+	}
+	void push(const char *fn) {
+		push(fn, strlen(fn));
+	}
+
+	// Appends "[prefix]/[fn]".
+	void push_prefixed(const char *prefix, const char *fn) {
+		const size_t prefix_len = strlen(prefix);
+		const size_t fn_len = strlen(fn);
+		char *copy = reserve(prefix_len + 1 + fn_len);
+		memcpy(copy, prefix, prefix_len);
+		copy[prefix_len] = '/';
+		memcpy(copy + prefix_len + 1, fn, fn_len + 1);
+		push_ptr(copy);
+	}
+
+	// Appends the build-specific name of [fn], with the build placed before
+	// the first extension, just like fn_for_build() does. Does nothing if
+	// there is no build.
+	void push_build(const char *fn) {
+		const char *build = runconfig_build_get();
+		if (!build) {
+			return;
+		}
+		const size_t fn_len = strlen(fn);
+		const size_t build_len = strlen(build);
+		const char *first_ext = (const char*)memchr(fn, '.', fn_len);
+		const size_t name_len = first_ext ? first_ext - fn : fn_len;
+		char *copy = reserve(fn_len + 1 + build_len);
+		memcpy(copy, fn, name_len);
+		copy[name_len] = '.';
+		memcpy(copy + name_len + 1, build, build_len);
+		memcpy(copy + name_len + 1 + build_len, fn + name_len, fn_len - name_len + 1);
+		push_ptr(copy);
+	}
+
+	// Appends all file names of a chain created by a resolve_chain_t
+	// function, and frees it.
+	void adopt(char **chain) {
+		for (size_t i = 0; chain && chain[i]; i++) {
+			heap_strs.push_back(chain[i]);
+			push_ptr(chain[i]);
+		}
+		free(chain);
+	}
+
+	void clear() {
+		for (char *str : heap_strs) {
+			free(str);
+		}
+		heap_strs.clear();
+		heap_fns.clear();
+		fns = inline_fns;
+		fns[0] = nullptr;
+		count = 0;
+		used = 0;
+	}
+
+private:
+	char *inline_fns[INLINE_FNS + 1] = {};
+	// Takes over once [inline_fns] is full.
+	std::vector<char*> heap_fns;
+	char **fns = inline_fns;
+	size_t count = 0;
+	// Strings that didn't fit into [buf].
+	std::vector<char*> heap_strs;
+	size_t used = 0;
+	char buf[INLINE_SIZE];
+
+	// Returns room for a string of [len] bytes plus its terminator.
+	char* reserve(size_t len) {
+		if (len < INLINE_SIZE - used) {
+			char *ret = buf + used;
+			used += len + 1;
+			return ret;
+		}
+		char *ret = (char*)malloc(len + 1);
+		heap_strs.push_back(ret);
+		return ret;
+	}
+
+	void push_ptr(char *fn) {
+		if (fns == inline_fns && count == INLINE_FNS) {
+			heap_fns.assign(inline_fns, inline_fns + count + 1);
+		}
+		if (fns != inline_fns || count == INLINE_FNS) {
+			heap_fns.back() = fn;
+			heap_fns.push_back(nullptr);
+			fns = heap_fns.data();
+		} else {
+			fns[count] = fn;
+			fns[count + 1] = nullptr;
+		}
+		count++;
+	}
+};
+
+typedef void (*resolve_chain_build_t)(chain_buf_t& chain, const char *fn);
+#endif
+
 /// File resolution
 /// ---------------
 // Creates a JSON array containing the the default resolving chain for [fn].
@@ -48,6 +181,17 @@ char **resolve_chain_game(const char *fn);
 // Set a user-defined function used to create the chain returned by resolve_chain_game.
 void set_resolve_chain_game(resolve_chain_t function);
 
+#ifdef __cplusplus
+// Variants of the functions above that build the chain into [chain] rather
+// than on the heap. resolve_chain() and resolve_chain_game() are wrappers
+// around these, and a function set with set_resolve_chain() or
+// set_resolve_chain_game() replaces the one set here, and vice versa.
+void resolve_chain_build(chain_buf_t& chain, const char *fn);
+void resolve_chain_game_build(chain_buf_t& chain, const char *fn);
+void set_resolve_chain_build(resolve_chain_build_t function);
+void set_resolve_chain_game_build(resolve_chain_build_t function);
+#endif
+
 // Repeatedly iterate through the stack using the given resolving [chain].
 // [sci] keeps the iteration state.
 int stack_chain_iterate(stack_chain_iterate_t *sci, char **chain, sci_dir_t direction);
@@ -66,18 +210,80 @@ json_t* stack_json_resolve(const char *fn, size_t *file_size);
 // Generic file resolver. Returns a stream of the file matching the [chain]
 // with the highest priority inside the patch stack, or INVALID_HANDLE_VALUE
 // if there is no such file in the stack.
+// Only considers loose files, since patch packs can't be streamed.
 HANDLE stack_file_resolve_chain(char **chain);
 
+// Same as stack_file_resolve_chain(), but also considers patch packs. If the
+// highest-priority file is inside a pack, INVALID_HANDLE_VALUE is returned,
+// and [pack] and [entry] receive its location. Otherwise, they are set to
+// NULL.
+HANDLE stack_file_resolve_chain_packed(char **chain, const patch_pack_t **pack, const patch_pack_entry_t **entry);
+
+// Resolves [chain] and reads the resulting file into a newly created buffer,
+// analogous to file_read().
+void* stack_file_load_chain(char **chain, size_t *file_size);
+
+// Resolves [chain] like stack_file_resolve_chain_packed(), but only returns
+// the size of the resulting file in [file_size], without opening or reading
+// it if the pack or file index already know it. Returns 1 if a file was
+// found, and 0 otherwise.
+int stack_file_size_chain(char **chain, size_t *file_size);
+
 // Searches the current patch stack for a replacement for the game data file
 // [fn] and returns either a stream or a newly created buffer, analogous to
-// file_stream() and file_stream_read().
+// file_stream() and file_stream_read(). Only the buffer variant and
+// stack_game_file_stream_packed() take patch packs into account.
 HANDLE stack_game_file_stream(const char *fn);
+HANDLE stack_game_file_stream_packed(const char *fn, const patch_pack_t **pack, const patch_pack_entry_t **entry);
 void* stack_game_file_resolve(const char *fn, size_t *file_size);
 
+// Returns 1 and the size of the replacement for the game data file [fn] in
+// [file_size], or 0 if there is none. Use this instead of
+// stack_game_file_resolve() if only the size is needed.
+int stack_game_file_size(const char *fn, size_t *file_size);
+
 // Resolves a game-local JSON file.
 json_t* stack_game_json_resolve(const char *fn, size_t *file_size);
 /// ---------------
 
+/// Resolved JSON cache
+/// -------------------
+// While enabled, stack_json_resolve_chain() and all functions based on it
+// return new references to a cached result if the same chain has been
+// resolved before. These results can be shared between callers, and must
+// therefore not be modified; use json_deep_copy() if necessary.
+// Enabled by repatch_mod_init(), since the repatch watcher is what keeps
+// the cache up to date.
+void stack_json_cache_enable(int enable);
+
+// Evicts all results that contain the patch-relative file name [fn].
+void stack_json_cache_evict(const char *fn);
+
+// Evicts all results that contain any of the file names in the keys of
+// [files_changed].
+void stack_json_cache_repatch(const json_t *files_changed);
+
+// Evicts all results.
+void stack_json_cache_clear(void);
+/// -------------------
+
+/// Repatch dependency graph
+/// ------------------------
+// While enabled, all chain resolvers record which patch-relative file names
+// were part of the chain for which requested file name. Enabled by
+// repatch_mod_init().
+void stack_deps_enable(int enable);
+
+// Records the chain of [fn] as if it had been resolved, for files that are
+// loaded by walking the stack without a chain resolver.
+void stack_deps_add(const char *fn);
+
+// Returns a new object containing those keys of [files_changed] that were
+// part of any resolved chain, together with the names of all files that
+// were resolved from them. Files that were never loaded are left out.
+json_t* stack_deps_expand(const json_t *files_changed);
+/// ------------------------
+
 // Generic file name resolver. Returns the file name of the existing file
 // matching the [chain] with the highest priority inside the patch stack.
 char* stack_fn_resolve_chain(char **chain);
@@ -103,12 +309,21 @@ void stack_add_patch(patch_t *patch);
 // Add a patch to the stack from a json description.
 void stack_add_patch_from_json(json_t *patch);
 
+// Add every patch in the JSON array [patches] to the stack, in order. See
+// patch_init_multiple().
+void stack_add_patches_from_json(json_t *patches);
+
 // Remove the patch patch_id from the stack.
 void stack_remove_patch(const char *patch_id);
 
 // Get the number of patches in the stack
 size_t stack_get_size();
 
+// Returns the current patch stack as an immutable array of [*count]
+// patches. Wait-free and safe to use from any thread, even while the stack
+// is being changed. The array stays valid until stack_free().
+const patch_t* stack_snapshot_get(size_t *count);
+
 // Iterate over the patches in the stack
 void stack_foreach(void (*callback)(const patch_t *patch, void *userdata), void *userdata);
 
@@ -0,0 +1,172 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Startup profiling.
+  */
+
+#include "thcrap.h"
+#include <vector>
+
+struct startup_phase_t {
+	std::string name;
+	LONGLONG start;
+	LONGLONG end;
+	size_t depth;
+};
+
+// Phases are stored in the order they were started, so that the children of
+// a phase directly follow it, with a higher [depth].
+static std::vector<startup_phase_t> startup_phases;
+static std::vector<size_t> startup_phase_stack;
+static bool startup_done = false;
+
+// Initialization stages can run on a different thread than thcrap_init(),
+// so the thread that owns the phase stack changes whenever it is empty.
+// Phases on other threads are ignored while it isn't.
+static DWORD startup_thread = 0;
+static SRWLOCK startup_srwlock = { SRWLOCK_INIT };
+
+// Phases shorter than this are only written to the JSON file, to keep the
+// log readable.
+static const double STARTUP_LOG_MIN_MS = 1.0;
+
+static LONGLONG startup_now(void)
+{
+	LARGE_INTEGER ret;
+	QueryPerformanceCounter(&ret);
+	return ret.QuadPart;
+}
+
+// Must be called with the lock held.
+static bool startup_owned(void)
+{
+	return !startup_done && !startup_phase_stack.empty() && startup_thread == GetCurrentThreadId();
+}
+
+bool startup_profile_active(void)
+{
+	AcquireSRWLockShared(&startup_srwlock);
+	bool ret = startup_owned();
+	ReleaseSRWLockShared(&startup_srwlock);
+	return ret;
+}
+
+void startup_phase_begin(const char *name)
+{
+	AcquireSRWLockExclusive(&startup_srwlock);
+	if (!startup_done && (startup_phase_stack.empty() || startup_owned())) {
+		startup_thread = GetCurrentThreadId();
+		startup_phase_stack.push_back(startup_phases.size());
+		startup_phases.push_back({ name ? name : "", startup_now(), 0, startup_phase_stack.size() - 1 });
+	}
+	ReleaseSRWLockExclusive(&startup_srwlock);
+}
+
+void startup_phase_end(void)
+{
+	std::string trace_name;
+	LONGLONG trace_start = 0;
+	AcquireSRWLockExclusive(&startup_srwlock);
+	if (startup_owned()) {
+		startup_phase_t& phase = startup_phases[startup_phase_stack.back()];
+		phase.end = startup_now();
+		startup_phase_stack.pop_back();
+		// The run configuration isn't loaded yet when the first phases
+		// start, so this can only be decided at the end.
+		if (trace_event_enabled(TRACE_INIT)) {
+			trace_name = phase.name;
+			trace_start = phase.start;
+		}
+	}
+	ReleaseSRWLockExclusive(&startup_srwlock);
+	trace_event_complete(TRACE_INIT, trace_start, trace_name.c_str(), nullptr);
+}
+
+// Converts the phases in [i, end) with the given [depth] and their
+// children into a JSON array.
+static json_t* startup_phases_to_json(size_t& i, size_t depth, LONGLONG origin, double ticks_per_ms)
+{
+	json_t *ret = json_array();
+	while (i < startup_phases.size() && startup_phases[i].depth == depth) {
+		const startup_phase_t& phase = startup_phases[i++];
+		json_t *phase_json = json_pack("{s:s, s:f, s:f}",
+			"name", phase.name.c_str(),
+			"start_ms", (double)(phase.start - origin) / ticks_per_ms,
+			"ms", (double)(phase.end - phase.start) / ticks_per_ms
+		);
+		if (i < startup_phases.size() && startup_phases[i].depth > depth) {
+			json_object_set_new(phase_json, "children", startup_phases_to_json(i, depth + 1, origin, ticks_per_ms));
+		}
+		json_array_append_new(ret, phase_json);
+	}
+	return ret;
+}
+
+void startup_profile_report(void)
+{
+	AcquireSRWLockExclusive(&startup_srwlock);
+	if (startup_done) {
+		ReleaseSRWLockExclusive(&startup_srwlock);
+		return;
+	}
+	const LONGLONG now = startup_now();
+	for (size_t i : startup_phase_stack) {
+		startup_phases[i].end = now;
+	}
+	startup_phase_stack.clear();
+	startup_done = true;
+	ReleaseSRWLockExclusive(&startup_srwlock);
+
+	if (startup_phases.empty()) {
+		return;
+	}
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	const double ticks_per_ms = (double)freq.QuadPart / 1000.0;
+	const LONGLONG origin = startup_phases.front().start;
+	const LONGLONG total = now - origin;
+
+	log_printf(
+		"---------------------------\n"
+		"Startup profile: %.1f ms\n"
+		"---------------------------\n",
+		(double)total / ticks_per_ms
+	);
+	for (const auto& phase : startup_phases) {
+		double ms = (double)(phase.end - phase.start) / ticks_per_ms;
+		if (phase.depth == 0 || ms >= STARTUP_LOG_MIN_MS) {
+			log_printf("%9.2f ms %*s%s\n", ms, (int)(phase.depth * 2), "", phase.name.c_str());
+		}
+	}
+	json_t *caves_json = cave_arena_stats();
+	log_printf(
+		"Cave arena: %u bytes reserved, %u bytes padding, %u bytes unused\n",
+		(unsigned)json_integer_value(json_object_get(caves_json, "reserved")),
+		(unsigned)json_integer_value(json_object_get(caves_json, "padding")),
+		(unsigned)json_integer_value(json_object_get(caves_json, "unused"))
+	);
+	log_print("---------------------------\n");
+
+	size_t i = 0;
+	json_t *phases_json = startup_phases_to_json(i, 0, origin, ticks_per_ms);
+	json_t *profile_json = json_pack("{s:f, s:o, s:o}",
+		"total_ms", (double)total / ticks_per_ms,
+		"phases", phases_json,
+		"caves", caves_json
+	);
+	const char *thcrap_dir = runconfig_thcrap_dir_get();
+	std::string fn = thcrap_dir ? std::string(thcrap_dir) + "/" : "";
+	fn += "logs/startup_profile.json";
+	if (json_dump_file(profile_json, fn.c_str(), JSON_INDENT(2))) {
+		log_printf("(Profile) Couldn't write %s\n", fn.c_str());
+	}
+	json_decref(profile_json);
+
+	startup_phases.clear();
+	startup_phases.shrink_to_fit();
+	startup_phase_stack.shrink_to_fit();
+}
@@ -0,0 +1,27 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Startup profiling.
+  * Times the phases of thcrap_init(), the initialization stages and the module
+  * functions run during them, and writes a summary once the last stage has
+  * been applied.
+  */
+
+#pragma once
+
+// Starts the phase [name], nested inside the currently running one. While a
+// phase is running, calls from threads other than the one that started it
+// are ignored.
+void startup_phase_begin(const char *name);
+// Ends the innermost running phase.
+void startup_phase_end(void);
+
+// Returns true if the calling thread is inside a running phase.
+bool startup_profile_active(void);
+
+// Ends all running phases, logs the phase tree and writes it to
+// logs/startup_profile.json. Stops profiling for the rest of the run.
+void startup_profile_report(void);
@@ -0,0 +1,123 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Fast UTF-8 ↔ UTF-16 conversion.
+  */
+
+#include "thcrap.h"
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#include <intrin.h>
+#endif
+#include <emmintrin.h>
+
+#if defined(__GNUC__)
+# define STRCONV_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+# define STRCONV_TARGET_SSE2
+#endif
+
+static bool strconv_sse2_supported(void)
+{
+	int data[4];
+	__cpuid(data, 0);
+	if(data[0] < 1) {
+		return false;
+	}
+	__cpuid(data, 1);
+	return data[3] & 1 << 26;
+}
+
+static const bool STRCONV_SSE2 = strconv_sse2_supported();
+
+// Widens the ASCII characters at the start of the [len] bytes at [src] into
+// [dst], and returns their number.
+STRCONV_TARGET_SSE2 static size_t ascii_widen(wchar_t *dst, const char *src, size_t len)
+{
+	size_t i = 0;
+	if(STRCONV_SSE2) {
+		const __m128i zero = _mm_setzero_si128();
+		for(; (i + 16) <= len; i += 16) {
+			const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+			if(_mm_movemask_epi8(v)) {
+				break;
+			}
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi8(v, zero));
+			_mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpackhi_epi8(v, zero));
+		}
+	}
+	for(; i < len && (unsigned char)src[i] < 0x80; i++) {
+		dst[i] = src[i];
+	}
+	return i;
+}
+
+// Narrows the ASCII characters at the start of the [len] code units at
+// [src] into [dst], and returns their number.
+STRCONV_TARGET_SSE2 static size_t ascii_narrow(char *dst, const wchar_t *src, size_t len)
+{
+	size_t i = 0;
+	if(STRCONV_SSE2) {
+		const __m128i non_ascii = _mm_set1_epi16((short)0xFF80);
+		const __m128i zero = _mm_setzero_si128();
+		for(; (i + 16) <= len; i += 16) {
+			const __m128i lo = _mm_loadu_si128((const __m128i *)(src + i));
+			const __m128i hi = _mm_loadu_si128((const __m128i *)(src + i + 8));
+			const __m128i high_bits = _mm_and_si128(_mm_or_si128(lo, hi), non_ascii);
+			if(_mm_movemask_epi8(_mm_cmpeq_epi16(high_bits, zero)) != 0xFFFF) {
+				break;
+			}
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+		}
+	}
+	for(; i < len && src[i] < 0x80; i++) {
+		dst[i] = (char)src[i];
+	}
+	return i;
+}
+
+int utf8_to_utf16(wchar_t *str_w, const char *str_mb, int str_len)
+{
+	if(!str_w || !str_mb || !str_len) {
+		return StringToUTF16(str_w, str_mb, str_len);
+	}
+	const size_t len = str_len < 0 ? strlen(str_mb) + 1 : (size_t)str_len;
+	const size_t ascii_len = ascii_widen(str_w, str_mb, len);
+	if(ascii_len == len) {
+		return (int)len;
+	}
+	// The first non-ASCII byte always starts a new character, both in UTF-8
+	// and in the fallback codepage, so the rest converts the same way it
+	// would have as part of the whole string.
+	const int rest = StringToUTF16(str_w + ascii_len, str_mb + ascii_len, (int)(len - ascii_len));
+	if(!rest) {
+		return StringToUTF16(str_w, str_mb, str_len);
+	}
+	return (int)ascii_len + rest;
+}
+
+int utf16_to_utf8(char *str_utf8, const wchar_t *str_w, int str_utf8_len)
+{
+	if(!str_utf8 || !str_w || str_utf8_len <= 0) {
+		return StringToUTF8(str_utf8, str_w, str_utf8_len);
+	}
+	const size_t len = wcslen(str_w) + 1;
+	const size_t ascii_len = ascii_narrow(str_utf8, str_w, MIN(len, (size_t)str_utf8_len));
+	if(ascii_len == len) {
+		return (int)len;
+	}
+	int rest = 0;
+	if(ascii_len < (size_t)str_utf8_len) {
+		rest = WideCharToMultiByte(
+			CP_UTF8, 0, str_w + ascii_len, (int)(len - ascii_len),
+			str_utf8 + ascii_len, str_utf8_len - (int)ascii_len, NULL, NULL
+		);
+	}
+	// Let StringToUTF8() handle strings that don't fit, the way it always did.
+	if(!rest) {
+		return StringToUTF8(str_utf8, str_w, str_utf8_len);
+	}
+	return (int)ascii_len + rest;
+}
@@ -0,0 +1,84 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Fast UTF-8 ↔ UTF-16 conversion.
+  * Drop-in replacements for win32_utf8's StringToUTF16() and StringToUTF8()
+  * that convert pure ASCII runs 16 characters at a time, which covers most
+  * file names and font faces, and only hand the rest of the string to the
+  * Win32 functions.
+  */
+
+#pragma once
+
+// Same as StringToUTF16(), including the fallback codepage for invalid
+// UTF-8. [str_w] has to hold [str_len] code units, or strlen([str_mb]) + 1
+// if [str_len] is -1. Returns the number of code units written.
+int utf8_to_utf16(wchar_t *str_w, const char *str_mb, int str_len);
+
+// Same as StringToUTF8(). Converts the null-terminated [str_w] into
+// [str_utf8], which holds [str_utf8_len] bytes, and returns the number of
+// bytes written, including the terminating \0.
+int utf16_to_utf8(char *str_utf8, const wchar_t *str_w, int str_utf8_len);
+
+#ifdef __cplusplus
+// Null-terminated UTF-16 version of a UTF-8 string, to replace the VLA()
+// pattern around StringToUTF16(). Stored on the stack for strings of up to
+// MAX_PATH code units, and on the heap only for longer ones.
+class utf16_buf_t {
+	wchar_t stack[MAX_PATH];
+	wchar_t *heap = nullptr;
+	wchar_t *buf = stack;
+
+public:
+	explicit utf16_buf_t(const char *str_mb) {
+		const size_t str_len = str_mb ? strlen(str_mb) + 1 : 0;
+		if(str_len > MAX_PATH) {
+			buf = heap = new wchar_t[str_len];
+		}
+		if(!utf8_to_utf16(buf, str_mb, (int)str_len)) {
+			buf[0] = L'\0';
+		}
+	}
+	~utf16_buf_t() {
+		delete[] heap;
+	}
+	utf16_buf_t(const utf16_buf_t&) = delete;
+	utf16_buf_t& operator=(const utf16_buf_t&) = delete;
+
+	const wchar_t* c_str() const {
+		return buf;
+	}
+};
+
+// Null-terminated UTF-8 version of a UTF-16 string, to replace the VLA()
+// pattern around StringToUTF8(). Stored on the stack for strings that fit
+// into MAX_PATH * UTF8_MUL bytes, and on the heap only for longer ones.
+class utf8_buf_t {
+	char stack[MAX_PATH * UTF8_MUL];
+	char *heap = nullptr;
+	char *buf = stack;
+
+public:
+	explicit utf8_buf_t(const wchar_t *str_w) {
+		const size_t str_utf8_len = str_w ? wcslen(str_w) * UTF8_MUL + 1 : 1;
+		if(str_utf8_len > sizeof(stack)) {
+			buf = heap = new char[str_utf8_len];
+		}
+		if(!utf16_to_utf8(buf, str_w, (int)str_utf8_len)) {
+			buf[0] = '\0';
+		}
+	}
+	~utf8_buf_t() {
+		delete[] heap;
+	}
+	utf8_buf_t(const utf8_buf_t&) = delete;
+	utf8_buf_t& operator=(const utf8_buf_t&) = delete;
+
+	const char* c_str() const {
+		return buf;
+	}
+};
+#endif
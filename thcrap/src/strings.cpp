@@ -8,7 +8,9 @@
   */
 
 #include "thcrap.h"
+#include <algorithm>
 #include <unordered_map>
+#include <vector>
 
 /// Detour chains
 /// -------------
@@ -36,6 +38,209 @@ std::unordered_map<const char *, const char *> stringlocs;
 
 #define addr_key_len 2 + (sizeof(void*) * 2) + 1
 
+/// Lookup table
+/// ------------
+/**
+  * strings_lookup() is called for pretty much every string the game prints,
+  * every frame. Instead of going through [stringlocs] and the stringdefs.js
+  * object for each call, it probes an immutable table that maps the original
+  * addresses directly to their translations.
+  *
+  * The table is rebuilt after stringlocs.js or stringdefs.js changed, and
+  * published by swapping a single pointer. Old tables are kept until
+  * strings_mod_exit(), since another thread might still be probing them.
+  * The strings themselves are owned by the jsondata module, which keeps
+  * every old version of stringdefs.js around anyway.
+  *
+  * The table is a two-level perfect hash ("hash and displace"): every
+  * address first picks a bucket, and each bucket stores a displacement that
+  * was chosen so that its addresses land in slots that no other address
+  * uses. Every lookup is therefore a single probe. If no such displacements
+  * can be found, the table falls back on linear probing.
+  */
+struct strings_table_entry_t {
+	const char *addr;
+	const char *str;
+	size_t len;
+};
+
+struct strings_table_t {
+	size_t mask;
+	size_t bucket_mask;
+	// Only the first probed slot has to be checked.
+	bool perfect;
+	uint32_t *disp;
+	strings_table_entry_t slots[1];
+};
+
+static strings_table_t *volatile strings_table = nullptr;
+static std::vector<strings_table_t *> strings_tables_retired;
+static volatile bool strings_table_stale = true;
+
+#define STRINGS_TABLE_MAX_DISP 0x10000
+
+static inline uint32_t strings_table_mix(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+static inline uint32_t strings_table_hash(const char *addr)
+{
+	const uint64_t a = (uint64_t)(uintptr_t)addr;
+	return strings_table_mix((uint32_t)a ^ (uint32_t)(a >> 32));
+}
+
+static inline size_t strings_table_slot(const strings_table_t *table, uint32_t hash, uint32_t disp)
+{
+	return strings_table_mix(hash ^ (disp * 0x9E3779B1 + 0x85EBCA6B)) & table->mask;
+}
+
+static strings_table_t* strings_table_alloc(size_t slot_count, size_t bucket_count)
+{
+	const size_t slots_size = sizeof(strings_table_t) + (slot_count - 1) * sizeof(strings_table_entry_t);
+	auto *ret = (strings_table_t *)calloc(1, slots_size + bucket_count * sizeof(uint32_t));
+	if(ret) {
+		ret->mask = slot_count - 1;
+		ret->bucket_mask = bucket_count - 1;
+		ret->disp = (uint32_t *)((BYTE *)ret + slots_size);
+	}
+	return ret;
+}
+
+// Finds a displacement for every bucket, largest buckets first.
+static bool strings_table_place_perfect(strings_table_t *table, const std::vector<strings_table_entry_t> &entries)
+{
+	std::vector<std::vector<size_t>> buckets(table->bucket_mask + 1);
+	for(size_t i = 0; i < entries.size(); i++) {
+		buckets[strings_table_hash(entries[i].addr) & table->bucket_mask].push_back(i);
+	}
+	std::vector<size_t> order(buckets.size());
+	for(size_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&buckets](size_t a, size_t b) {
+		return buckets[a].size() > buckets[b].size();
+	});
+
+	std::vector<size_t> placed;
+	for(size_t b : order) {
+		const auto &bucket = buckets[b];
+		if(bucket.empty()) {
+			break;
+		}
+		uint32_t disp = 0;
+		for(; disp < STRINGS_TABLE_MAX_DISP; disp++) {
+			placed.clear();
+			for(size_t i : bucket) {
+				const size_t slot = strings_table_slot(table, strings_table_hash(entries[i].addr), disp);
+				if(table->slots[slot].addr) {
+					break;
+				}
+				table->slots[slot] = entries[i];
+				placed.push_back(slot);
+			}
+			if(placed.size() == bucket.size()) {
+				break;
+			}
+			for(size_t slot : placed) {
+				table->slots[slot] = {};
+			}
+		}
+		if(disp == STRINGS_TABLE_MAX_DISP) {
+			return false;
+		}
+		table->disp[b] = disp;
+	}
+	return true;
+}
+
+static strings_table_t* strings_table_build(const std::vector<strings_table_entry_t> &entries)
+{
+	size_t slot_count = 16;
+	while(slot_count < entries.size() * 2) {
+		slot_count <<= 1;
+	}
+	const size_t bucket_count = slot_count / 4;
+
+	auto *table = strings_table_alloc(slot_count, bucket_count);
+	if(!table) {
+		return nullptr;
+	}
+	if(strings_table_place_perfect(table, entries)) {
+		table->perfect = true;
+		return table;
+	}
+
+	// Fall back on linear probing, with all displacements at 0.
+	memset(table->slots, 0, slot_count * sizeof(strings_table_entry_t));
+	memset(table->disp, 0, bucket_count * sizeof(uint32_t));
+	for(const auto &entry : entries) {
+		size_t i = strings_table_slot(table, strings_table_hash(entry.addr), 0);
+		while(table->slots[i].addr) {
+			i = (i + 1) & table->mask;
+		}
+		table->slots[i] = entry;
+	}
+	return table;
+}
+
+static const strings_table_entry_t* strings_table_find(const strings_table_t *table, const char *addr)
+{
+	const uint32_t hash = strings_table_hash(addr);
+	size_t i = strings_table_slot(table, hash, table->disp[hash & table->bucket_mask]);
+	while(1) {
+		const auto &slot = table->slots[i];
+		if(slot.addr == addr) {
+			return &slot;
+		}
+		if(!slot.addr || table->perfect) {
+			return nullptr;
+		}
+		i = (i + 1) & table->mask;
+	}
+}
+
+// Rebuilds the table from the current [stringlocs] and stringdefs.js.
+static void strings_table_rebuild(void)
+{
+	AcquireSRWLockExclusive(&stringlocs_srwlock);
+	if(!strings_table_stale) {
+		ReleaseSRWLockExclusive(&stringlocs_srwlock);
+		return;
+	}
+	strings_table_stale = false;
+
+	const json_t *stringdefs = jsondata_get("stringdefs.js");
+	std::vector<strings_table_entry_t> entries;
+	entries.reserve(stringlocs.size());
+	for(const auto &it : stringlocs) {
+		const json_t *str = json_object_get(stringdefs, it.second);
+		const char *str_val = json_string_value(str);
+		if(str_val && str_val[0]) {
+			entries.push_back({ it.first, str_val, json_string_length(str) });
+		}
+	}
+	strings_table_t *table = strings_table_build(entries);
+	if(table) {
+		auto *old = (strings_table_t *)InterlockedExchangePointer(
+			(void *volatile *)&strings_table, table
+		);
+		if(old) {
+			strings_tables_retired.push_back(old);
+		}
+	} else {
+		// Fall back on the maps for now, and try again next time.
+		strings_table_stale = true;
+	}
+	ReleaseSRWLockExclusive(&stringlocs_srwlock);
+}
+/// ------------
+
 void stringlocs_reparse(void)
 {
 	json_t* new_obj = stack_game_json_resolve("stringlocs.js", NULL);
@@ -76,6 +281,7 @@ void stringlocs_reparse(void)
 
 	json_decref(backing_obj);
 	backing_obj = new_obj;
+	strings_table_stale = true;
 
 	ReleaseSRWLockExclusive(&stringlocs_srwlock);
 }
@@ -114,6 +320,22 @@ const char* __cdecl strings_lookup(const char *in, size_t *out_len)
 		return in;
 	}
 
+	if(strings_table_stale) {
+		strings_table_rebuild();
+	}
+	if(const strings_table_t *table = strings_table) {
+		if(!strings_table_stale) {
+			const strings_table_entry_t *entry = strings_table_find(table, in);
+			if(entry) {
+				ret = entry->str;
+			}
+			if(out_len) {
+				*out_len = entry ? entry->len : strlen(ret);
+			}
+			return ret;
+		}
+	}
+
 	AcquireSRWLockShared(&stringlocs_srwlock);
 	auto id = strings_id(in);
 	if(id) {
@@ -130,15 +352,93 @@ const char* __cdecl strings_lookup(const char *in, size_t *out_len)
 	return ret;
 }
 
-void strings_va_lookup(va_list va, const char *format)
+/// Format string analysis
+/// ----------------------
+/**
+  * Games tend to call the sprintf hooks with the same format strings every
+  * frame, so the result of parsing them is cached per pointer. As the game
+  * might just as well build format strings in a reused buffer, every cached
+  * entry keeps a copy of the string it was parsed from, and is only used if
+  * that still matches.
+  */
+
+// Stands for "could be anything", forcing a call to _vscprintf().
+#define STRINGS_FORMAT_UNBOUNDED 0xFFFF
+
+struct strings_format_conv_t {
+	uint8_t argc_before_type;
+	uint8_t type_size_in_ints;
+	char type;
+	// Maximum output, excluding the string itself for %s
+	uint16_t bound;
+};
+
+struct strings_format_t {
+	std::string copy;
+	// Output length of everything outside of conversions
+	size_t literal_len;
+	bool bounded;
+	std::vector<strings_format_conv_t> convs;
+};
+
+static std::unordered_map<const char *, strings_format_t> strings_formats;
+static SRWLOCK strings_formats_srwlock = { SRWLOCK_INIT };
+
+// Worst-case output length of a single conversion, based on the flags,
+// width and precision between [spec] and [spec_end].
+static uint16_t strings_format_bound(char type, const char *spec, const char *spec_end)
 {
+	unsigned int width = 0;
+	unsigned int precision = 0;
+	unsigned int *num = &width;
+	for(const char *p = spec; p < spec_end; p++) {
+		if(*p == '*') {
+			return STRINGS_FORMAT_UNBOUNDED;
+		} else if((*p == 'l' || *p == 'w') && (type == 's' || type == 'c')) {
+			// Wide characters, which have to be converted
+			return STRINGS_FORMAT_UNBOUNDED;
+		} else if(*p == '.') {
+			num = &precision;
+		} else if(*p >= '0' && *p <= '9') {
+			*num = *num * 10 + (*p - '0');
+			if(*num > 1024) {
+				return STRINGS_FORMAT_UNBOUNDED;
+			}
+		}
+	}
+	switch(type) {
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'p':
+		return (uint16_t)(24 + width + precision);
+	case 'c': case 'C':
+		return (uint16_t)(4 + width);
+	case 's':
+		return (uint16_t)width;
+	case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+		return (uint16_t)(32 + width + precision);
+	case 'n':
+		return 0;
+	default:
+		// %f can print up to 300-something digits, and %S has to convert
+		// from UTF-16.
+		return STRINGS_FORMAT_UNBOUNDED;
+	}
+}
+
+static strings_format_t strings_format_parse(const char *format)
+{
+	strings_format_t ret;
+	ret.copy = format;
+	ret.literal_len = 0;
+	ret.bounded = true;
+
 	const char *p = format;
 	while(*p) {
 		printf_format_t fmt;
-		int i;
 
 		// Skip characters before '%'
+		const char *literal = p;
 		for(; *p && *p != '%'; p++);
+		ret.literal_len += p - literal;
 		if(!*p) {
 			break;
 		}
@@ -147,26 +447,97 @@ void strings_va_lookup(va_list va, const char *format)
 
 		// output a single '%' character
 		if(*p == '%') {
+			ret.literal_len++;
 			p++;
 			continue;
 		}
+		const char *spec = p;
 		p = printf_format_parse(&fmt, p);
-		for(i = 0; i < fmt.argc_before_type; i++) {
+		const uint16_t bound = strings_format_bound(fmt.type, spec, p);
+		ret.bounded &= (bound != STRINGS_FORMAT_UNBOUNDED);
+		ret.convs.push_back({
+			(uint8_t)fmt.argc_before_type, (uint8_t)fmt.type_size_in_ints, fmt.type, bound
+		});
+	}
+	return ret;
+}
+
+// Returns the cached analysis of [format]. Entries are never replaced once
+// inserted, so the returned reference stays valid until strings_mod_exit().
+// If [format] lives in a buffer whose contents changed since it was cached,
+// it is parsed into [tmp] instead.
+static const strings_format_t& strings_format_get(const char *format, strings_format_t& tmp)
+{
+	AcquireSRWLockShared(&strings_formats_srwlock);
+	auto it = strings_formats.find(format);
+	const bool found = it != strings_formats.end();
+	const bool valid = found && !strcmp(it->second.copy.c_str(), format);
+	ReleaseSRWLockShared(&strings_formats_srwlock);
+	if(valid) {
+		return it->second;
+	}
+	tmp = strings_format_parse(format);
+	if(found) {
+		return tmp;
+	}
+	AcquireSRWLockExclusive(&strings_formats_srwlock);
+	auto ins = strings_formats.emplace(format, tmp);
+	ReleaseSRWLockExclusive(&strings_formats_srwlock);
+	return ins.first->second;
+}
+
+// Translates every string parameter in [va] according to [fmt], and
+// returns the worst-case output length if [fmt] is bounded.
+static size_t strings_format_va_lookup(va_list va, const strings_format_t& fmt)
+{
+	size_t ret = fmt.literal_len;
+	for(const auto& conv : fmt.convs) {
+		int i;
+		for(i = 0; i < conv.argc_before_type; i++) {
 			va_arg(va, int);
 		}
-		if(fmt.type == 's' || fmt.type == 'S') {
+		if(conv.type == 's') {
+			// strlen("(null)")
+			size_t len = 6;
+			*(const char**)va = strings_lookup(*(const char**)va, &len);
+			ret += len;
+		} else if(conv.type == 'S') {
 			*(const char**)va = strings_lookup(*(const char**)va, NULL);
 		}
-		for(i = 0; i < fmt.type_size_in_ints; i++) {
+		ret += conv.bound;
+		for(i = 0; i < conv.type_size_in_ints; i++) {
 			va_arg(va, int);
 		}
 	}
+	return ret;
+}
+/// ----------------------
+
+void strings_va_lookup(va_list va, const char *format)
+{
+	if(format) {
+		strings_format_t tmp;
+		strings_format_va_lookup(va, strings_format_get(format, tmp));
+	}
+}
+
+// Slots below this number, which is what pretty much every patch uses, are
+// kept in a flat array. Higher ones go into [strings_storage].
+#define STRINGS_STORAGE_FLAT 256
+static storage_string_t *strings_storage_flat[STRINGS_STORAGE_FLAT];
+
+static storage_string_t*& strings_storage_ref(const size_t slot)
+{
+	if(slot < STRINGS_STORAGE_FLAT) {
+		return strings_storage_flat[slot];
+	}
+	return strings_storage[slot];
 }
 
 char* strings_storage_get(const size_t slot, size_t min_len)
 {
-	auto stored = strings_storage.find(slot);
-	auto *ret = stored != strings_storage.end() ? stored->second : nullptr;
+	storage_string_t *&stored = strings_storage_ref(slot);
+	auto *ret = stored;
 
 	// MSVCRT's realloc implementation moves the buffer every time, even if the
 	// new length is shorter...
@@ -178,7 +549,7 @@ char* strings_storage_get(const size_t slot, size_t min_len)
 			if(!ret) {
 				ret_new->str = 0;
 			}
-			strings_storage[slot] = ret_new;
+			stored = ret_new;
 			ret = ret_new;
 		}
 	}
@@ -194,12 +565,21 @@ const char* strings_vsprintf(const size_t slot, const char *format, va_list va)
 	size_t str_len;
 
 	format = strings_lookup(format, NULL);
-	strings_va_lookup(va, format);
-
 	if(!format) {
 		return NULL;
 	}
-	str_len = _vscprintf(format, va) + 1;
+	strings_format_t tmp;
+	const strings_format_t& fmt = strings_format_get(format, tmp);
+	const size_t bound = strings_format_va_lookup(va, fmt) + 1;
+
+	// Skip the size probe if the slot is large enough for anything this
+	// format could possibly produce.
+	const storage_string_t *stored = strings_storage_ref(slot);
+	if(fmt.bounded && stored && stored->len >= bound) {
+		str_len = bound;
+	} else {
+		str_len = _vscprintf(format, va) + 1;
+	}
 
 	ret = strings_storage_get(slot, str_len);
 	if(ret) {
@@ -352,6 +732,10 @@ void strings_mod_repatch(json_t *files_changed)
 	json_object_foreach(files_changed, key, val) {
 		if(strstr(key, "/stringlocs.")) {
 			stringlocs_reparse();
+		} else if(strstr(key, "/stringdefs.")) {
+			// jsondata_mod_repatch() might not have run yet, so the
+			// table is rebuilt on the next lookup instead.
+			strings_table_stale = true;
 		}
 	}
 }
@@ -362,6 +746,16 @@ void strings_mod_exit(void)
 		SAFE_FREE(i.second);
 	}
 	strings_storage.clear();
+	for(auto& i : strings_storage_flat) {
+		SAFE_FREE(i);
+	}
+	strings_formats.clear();
 	stringlocs.clear();
 	backing_obj = json_decref_safe(backing_obj);
+	for(auto *table : strings_tables_retired) {
+		free(table);
+	}
+	strings_tables_retired.clear();
+	free((void *)InterlockedExchangePointer((void *volatile *)&strings_table, nullptr));
+	strings_table_stale = true;
 }
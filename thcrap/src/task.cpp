@@ -0,0 +1,301 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Shared task scheduler.
+  */
+
+#include "thcrap.h"
+#include <deque>
+
+// Every worker reserves a stack, which adds up in a 32-bit address space.
+#define TASK_WORKERS_MAX 8
+// How long task_mod_exit() waits for the workers during process shutdown,
+// where they might have already been terminated.
+#define TASK_EXIT_TIMEOUT 5000
+
+struct task_t {
+	task_func_t func;
+	void *param;
+	task_group_t *group;
+	task_priority_t priority;
+};
+
+struct task_group_t {
+	// Only decremented with [lock] held.
+	volatile LONG pending;
+	// Highest priority of any task ever submitted to the group
+	volatile LONG priority;
+	SRWLOCK lock;
+	CONDITION_VARIABLE done_cv;
+};
+
+struct task_queue_t {
+	SRWLOCK lock;
+	std::deque<task_t> tasks[TASK_PRIORITY_COUNT];
+};
+
+// One per worker, followed by the one for all other threads.
+static task_queue_t *task_queues = nullptr;
+static std::vector<HANDLE> task_workers;
+static size_t task_worker_total = 0;
+static bool task_started = false;
+static bool task_quit = false;
+static SRWLOCK task_start_lock = SRWLOCK_INIT;
+// Worker index + 1 of the current thread, 0 for all other threads.
+static DWORD task_tls = TLS_OUT_OF_INDEXES;
+
+// Tasks in all queues. Briefly drops below the actual number while a task
+// is being pushed.
+static volatile LONG task_queued = 0;
+static SRWLOCK task_idle_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE task_idle_cv = CONDITION_VARIABLE_INIT;
+
+// Returns the index of the queue that belongs to the calling thread.
+static size_t task_queue_self(void)
+{
+	const size_t index = (size_t)TlsGetValue(task_tls);
+	return index ? index - 1 : task_worker_total;
+}
+
+static bool task_queue_pop(task_queue_t &queue, int priority, bool back, task_t &task)
+{
+	auto &tasks = queue.tasks[priority];
+	AcquireSRWLockExclusive(&queue.lock);
+	if(tasks.empty()) {
+		ReleaseSRWLockExclusive(&queue.lock);
+		return false;
+	}
+	if(back) {
+		task = tasks.back();
+		tasks.pop_back();
+	} else {
+		task = tasks.front();
+		tasks.pop_front();
+	}
+	ReleaseSRWLockExclusive(&queue.lock);
+	InterlockedDecrement(&task_queued);
+	return true;
+}
+
+// Takes the highest-priority task up to [priority_max], preferring the
+// newest one in the calling worker's own queue over the oldest ones in the
+// other queues.
+static bool task_pop(task_t &task, int priority_max)
+{
+	if(task_queued <= 0) {
+		return false;
+	}
+	const size_t queue_count = task_worker_total + 1;
+	const size_t self = task_queue_self();
+	for(int priority = 0; priority <= priority_max; priority++) {
+		if(task_queue_pop(task_queues[self], priority, self < task_worker_total, task)) {
+			return true;
+		}
+		for(size_t i = 1; i < queue_count; i++) {
+			if(task_queue_pop(task_queues[(self + i) % queue_count], priority, false, task)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static void task_run(const task_t &task)
+{
+	task.func(task.param);
+	if(task_group_t *group = task.group) {
+		AcquireSRWLockExclusive(&group->lock);
+		if(InterlockedDecrement(&group->pending) == 0) {
+			WakeAllConditionVariable(&group->done_cv);
+		}
+		ReleaseSRWLockExclusive(&group->lock);
+	}
+}
+
+static DWORD WINAPI task_worker_proc(void *param)
+{
+	TlsSetValue(task_tls, (void *)((size_t)param + 1));
+	int thread_priority = THREAD_PRIORITY_NORMAL;
+	task_t task;
+	for(;;) {
+		if(task_pop(task, TASK_PRIORITY_COUNT - 1)) {
+			const int wanted = task.priority == TASK_PRIORITY_BACKGROUND
+				? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_NORMAL;
+			if(wanted != thread_priority) {
+				SetThreadPriority(GetCurrentThread(), wanted);
+				thread_priority = wanted;
+			}
+			task_run(task);
+			continue;
+		}
+		AcquireSRWLockExclusive(&task_idle_lock);
+		while(task_queued <= 0 && !task_quit) {
+			SleepConditionVariableSRW(&task_idle_cv, &task_idle_lock, INFINITE, 0);
+		}
+		const bool quit = task_quit;
+		ReleaseSRWLockExclusive(&task_idle_lock);
+		if(quit) {
+			break;
+		}
+	}
+	return 0;
+}
+
+// Returns whether there are workers to submit to.
+static bool task_start(void)
+{
+	if(task_started) {
+		return task_worker_total != 0 && !task_quit;
+	}
+	AcquireSRWLockExclusive(&task_start_lock);
+	if(!task_started && !task_quit) {
+		task_tls = TlsAlloc();
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		// Leave one core to the game.
+		const size_t count = MIN(MAX((size_t)si.dwNumberOfProcessors, 2) - 1, TASK_WORKERS_MAX);
+		if(task_tls != TLS_OUT_OF_INDEXES) {
+			task_queues = new task_queue_t[count + 1];
+			for(size_t i = 0; i <= count; i++) {
+				InitializeSRWLock(&task_queues[i].lock);
+			}
+			// Queue indices have to be final before the first worker runs.
+			task_worker_total = count;
+			for(size_t i = 0; i < count; i++) {
+				HANDLE worker = CreateThread(nullptr, 0, task_worker_proc, (void *)i, 0, nullptr);
+				if(worker) {
+					task_workers.push_back(worker);
+				}
+			}
+			// Queues of workers that couldn't be created are still stolen
+			// from, but nothing is ever submitted to them.
+			if(task_workers.empty()) {
+				task_worker_total = 0;
+			}
+			log_printf("(Tasks) Started %zu workers\n", task_workers.size());
+		}
+		task_started = true;
+	}
+	ReleaseSRWLockExclusive(&task_start_lock);
+	return task_worker_total != 0 && !task_quit;
+}
+
+task_group_t* task_group_create(void)
+{
+	auto *group = new task_group_t;
+	group->pending = 0;
+	group->priority = TASK_PRIORITY_COUNT - 1;
+	InitializeSRWLock(&group->lock);
+	InitializeConditionVariable(&group->done_cv);
+	return group;
+}
+
+void task_group_wait(task_group_t *group)
+{
+	if(!group) {
+		return;
+	}
+	task_t task;
+	while(group->pending > 0) {
+		if(task_queues && task_pop(task, group->priority)) {
+			task_run(task);
+			continue;
+		}
+		AcquireSRWLockExclusive(&group->lock);
+		if(group->pending > 0) {
+			SleepConditionVariableSRW(&group->done_cv, &group->lock, INFINITE, 0);
+		}
+		ReleaseSRWLockExclusive(&group->lock);
+	}
+	// Makes sure that the last task_run() has released the lock.
+	AcquireSRWLockExclusive(&group->lock);
+	ReleaseSRWLockExclusive(&group->lock);
+}
+
+void task_group_free(task_group_t *group)
+{
+	task_group_wait(group);
+	delete group;
+}
+
+void task_submit(task_priority_t priority, task_group_t *group, task_func_t func, void *param)
+{
+	if(!func) {
+		return;
+	}
+	if(priority < 0 || priority >= TASK_PRIORITY_COUNT) {
+		priority = TASK_PRIORITY_BACKGROUND;
+	}
+	const task_t task = { func, param, group, priority };
+	if(group) {
+		InterlockedIncrement(&group->pending);
+		LONG prev = group->priority;
+		while(priority < prev) {
+			const LONG cur = InterlockedCompareExchange(&group->priority, priority, prev);
+			if(cur == prev) {
+				break;
+			}
+			prev = cur;
+		}
+	}
+	if(!task_start()) {
+		task_run(task);
+		return;
+	}
+	task_queue_t &queue = task_queues[task_queue_self()];
+	AcquireSRWLockExclusive(&queue.lock);
+	queue.tasks[priority].push_back(task);
+	ReleaseSRWLockExclusive(&queue.lock);
+	InterlockedIncrement(&task_queued);
+
+	AcquireSRWLockExclusive(&task_idle_lock);
+	WakeConditionVariable(&task_idle_cv);
+	ReleaseSRWLockExclusive(&task_idle_lock);
+}
+
+void task_submit_func(task_priority_t priority, task_group_t *group, std::function<void()> &&func)
+{
+	auto *heap_func = new std::function<void()>(std::move(func));
+	task_submit(priority, group, [](void *param) {
+		auto *func = (std::function<void()> *)param;
+		(*func)();
+		delete func;
+	}, heap_func);
+}
+
+size_t task_worker_count(void)
+{
+	task_start();
+	return task_worker_total;
+}
+
+void task_mod_exit(void)
+{
+	AcquireSRWLockExclusive(&task_start_lock);
+	AcquireSRWLockExclusive(&task_idle_lock);
+	task_quit = true;
+	WakeAllConditionVariable(&task_idle_cv);
+	ReleaseSRWLockExclusive(&task_idle_lock);
+	auto workers = std::move(task_workers);
+	task_workers.clear();
+	ReleaseSRWLockExclusive(&task_start_lock);
+
+	if(!workers.empty()) {
+		WaitForMultipleObjects((DWORD)workers.size(), workers.data(), TRUE, TASK_EXIT_TIMEOUT);
+		for(HANDLE worker : workers) {
+			CloseHandle(worker);
+		}
+	}
+
+	// Anything still queued runs on this thread, so that no group waits
+	// forever.
+	if(task_queues) {
+		task_t task;
+		while(task_pop(task, TASK_PRIORITY_COUNT - 1)) {
+			task_run(task);
+		}
+	}
+}
@@ -0,0 +1,61 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Shared task scheduler.
+  *
+  * A fixed set of worker threads, one less than the number of cores and
+  * started on the first submission, runs small tasks for all modules, so
+  * that plugins don't have to create threads of their own. Every worker has
+  * its own queue; tasks submitted from a worker go to the back of its queue
+  * and are run from there, while idle workers steal from the front of the
+  * others' queues. Tasks submitted from any other thread go into a shared
+  * queue. Higher-priority tasks always run first, regardless of the queue
+  * they are in.
+  *
+  * Tasks should not block on anything but other tasks, since every worker
+  * that waits takes one away from the rest of the process.
+  */
+
+#pragma once
+
+typedef enum {
+	// Something the game is waiting for right now.
+	TASK_PRIORITY_CRITICAL,
+	// Something the game will need soon.
+	TASK_PRIORITY_PREFETCH,
+	// Anything else. Runs on a lowered thread priority.
+	TASK_PRIORITY_BACKGROUND,
+
+	TASK_PRIORITY_COUNT
+} task_priority_t;
+
+typedef void (*task_func_t)(void *param);
+
+// Counts the pending tasks submitted to it, so that they can be waited for.
+typedef struct task_group_t task_group_t;
+
+task_group_t* task_group_create(void);
+
+// Runs tasks of the same or a higher priority than any in [group] on the
+// calling thread until all tasks in [group] have finished.
+void task_group_wait(task_group_t *group);
+
+// Waits for [group] and frees it.
+void task_group_free(task_group_t *group);
+
+// Queues [func] to be called with [param] on a worker thread. [group] can be
+// NULL. If there are no workers, [func] is called right away.
+void task_submit(task_priority_t priority, task_group_t *group, task_func_t func, void *param);
+
+#ifdef __cplusplus
+// Same as task_submit(), for anything callable.
+void task_submit_func(task_priority_t priority, task_group_t *group, std::function<void()> &&func);
+#endif
+
+// Returns the number of worker threads, starting them if necessary.
+size_t task_worker_count(void);
+
+void task_mod_exit(void);
@@ -8,14 +8,44 @@
   */
 
 #include "thcrap.h"
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
 #include "textdisp.h"
 
 /// Detour chains
 /// -------------
+typedef BOOL WINAPI DeleteObject_type(
+	HGDIOBJ obj
+);
+
 W32U8_DETOUR_CHAIN_DEF(CreateFont);
 W32U8_DETOUR_CHAIN_DEF(CreateFontIndirectEx);
+DETOUR_CHAIN_DEF(DeleteObject);
 /// -------------
 
+/// LOGFONT hashing
+/// ---------------
+// Everything after the terminating \0 of the face name is ignored.
+struct logfont_hash_t {
+	size_t operator()(const LOGFONTA &lf) const {
+		std::string_view fixed((const char *)&lf, offsetof(LOGFONTA, lfFaceName));
+		std::string_view face(lf.lfFaceName, strnlen(lf.lfFaceName, LF_FACESIZE));
+		return std::hash<std::string_view>{}(fixed) ^ (std::hash<std::string_view>{}(face) * 31);
+	}
+};
+
+struct logfont_equal_t {
+	bool operator()(const LOGFONTA &a, const LOGFONTA &b) const {
+		return !memcmp(&a, &b, offsetof(LOGFONTA, lfFaceName))
+			&& !strncmp(a.lfFaceName, b.lfFaceName, LF_FACESIZE);
+	}
+};
+
+template <typename T>
+using logfont_map_t = std::unordered_map<LOGFONTA, T, logfont_hash_t, logfont_equal_t>;
+/// ---------------
+
 /// Quality enum
 /// ------------
 #define UNSPECIFIED_QUALITY 0xFF
@@ -195,25 +225,55 @@ int fontrule_apply(LOGFONTA *dst, const LOGFONTA *rep, int priority)
 	return 1;
 }
 
-// Returns 1 if a font rule was applied, 0 otherwise.
-int fontrules_apply(LOGFONTA *lf)
+// Font rule with both sides parsed.
+struct fontrule_t {
+	LOGFONTA match;
+	LOGFONTA rep;
+	int score;
+	// Original strings, for the log
+	std::string match_str;
+	std::string rep_str;
+};
+
+// Parsed form of [fontrules_src], the "fontrules" object of the run
+// configuration, and the results of fontrules_apply() for every original
+// LOGFONT under these rules.
+static std::vector<fontrule_t> fontrules;
+static logfont_map_t<LOGFONTA> fontrules_cache;
+static const json_t *fontrules_src = NULL;
+static SRWLOCK fontrules_srwlock = { SRWLOCK_INIT };
+
+// Must be called with [fontrules_srwlock] held exclusively.
+static void fontrules_parse(const json_t *src)
+{
+	fontrules.clear();
+	fontrules_cache.clear();
+	fontrules_src = src;
+	const char *key;
+	json_t *val;
+	json_object_foreach((json_t *)src, key, val) {
+		const char *rep_str = json_string_value(val);
+		fontrule_t rule = {};
+		rule.score = fontrule_parse(&rule.match, key);
+		// Parsed on top of the match, same as it always was
+		rule.rep = rule.match;
+		fontrule_parse(&rule.rep, rep_str);
+		rule.match_str = key;
+		rule.rep_str = rep_str ? rep_str : "";
+		fontrules.push_back(std::move(rule));
+	}
+}
+
+// Must be called with [fontrules_srwlock] held exclusively.
+static int fontrules_apply_uncached(LOGFONTA *lf)
 {
-	json_t *fontrules = json_object_get(runconfig_json_get(), "fontrules");
 	LOGFONTA rep_full = {};
 	rep_full.lfQuality = UNSPECIFIED_QUALITY;
 	int rep_score = 0;
 	int log_header = 0;
-	const char *key;
-	json_t *val;
-	if(!lf) {
-		return -1;
-	}
-	json_object_foreach(fontrules, key, val) {
-		LOGFONTA rule = {};
-		int rule_score = fontrule_parse(&rule, key);
-		int priority = rule_score >= rep_score;
-		const char *rep_str = json_string_value(val);
-		if(!fontrule_match(&rule, lf)) {
+	for(const auto &rule : fontrules) {
+		int priority = rule.score >= rep_score;
+		if(!fontrule_match(&rule.match, lf)) {
 			continue;
 		}
 		if(!log_header) {
@@ -223,18 +283,268 @@ int fontrules_apply(LOGFONTA *lf)
 			);
 			log_header = 1;
 		}
-		fontrule_parse(&rule, rep_str);
 		log_printf(
 			"(Font) • (%s) → (%s)%s\n",
-			key, rep_str, priority ? " (priority)" : ""
+			rule.match_str.c_str(), rule.rep_str.c_str(), priority ? " (priority)" : ""
 		);
-		fontrule_apply(&rep_full, &rule, priority);
-		rep_score = MAX(rule_score, rep_score);
+		fontrule_apply(&rep_full, &rule.rep, priority);
+		rep_score = MAX(rule.score, rep_score);
 	}
 	return fontrule_apply(lf, &rep_full, 1);
 }
+
+// Returns 1 if a font rule was applied, 0 otherwise.
+int fontrules_apply(LOGFONTA *lf)
+{
+	const json_t *src = json_object_get(runconfig_json_get(), "fontrules");
+	if(!lf) {
+		return -1;
+	}
+	AcquireSRWLockShared(&fontrules_srwlock);
+	if(fontrules_src == src) {
+		auto cached = fontrules_cache.find(*lf);
+		if(cached != fontrules_cache.end()) {
+			*lf = cached->second;
+			ReleaseSRWLockShared(&fontrules_srwlock);
+			return 1;
+		}
+	}
+	ReleaseSRWLockShared(&fontrules_srwlock);
+
+	AcquireSRWLockExclusive(&fontrules_srwlock);
+	if(fontrules_src != src) {
+		fontrules_parse(src);
+	}
+	int ret = 1;
+	auto cached = fontrules_cache.find(*lf);
+	if(cached != fontrules_cache.end()) {
+		*lf = cached->second;
+	} else {
+		const LOGFONTA orig = *lf;
+		ret = fontrules_apply_uncached(lf);
+		fontrules_cache[orig] = *lf;
+	}
+	ReleaseSRWLockExclusive(&fontrules_srwlock);
+	return ret;
+}
 /// ------------------
 
+/// Deferred patch fonts
+/// ---------------------
+/**
+  * Translation patches can ship fonts of several megabytes each, not all of
+  * which a game will ever ask for. Instead of handing every font file to GDI
+  * at startup, only the name table of each file is read from a mapped view.
+  * The file is then registered once a CreateFont*() call asks for one of its
+  * face names after font rule application. Files that can't be parsed, and
+  * all files if "fonts_preload" is set in the run configuration, are still
+  * registered right away.
+  */
+struct font_pending_t {
+	const patch_t *patch;
+	const char *fn;
+	std::vector<std::string> faces;
+};
+
+static std::vector<font_pending_t> fonts_pending;
+static volatile LONG fonts_pending_count = 0;
+static SRWLOCK fonts_pending_srwlock = { SRWLOCK_INIT };
+
+static void patch_font_map_add(const patch_t *patch_info, const char *font_fn);
+
+static uint16_t sfnt_u16(const BYTE *p)
+{
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t sfnt_u32(const BYTE *p)
+{
+	return ((uint32_t)sfnt_u16(p) << 16) | sfnt_u16(p + 2);
+}
+
+// Adds the Windows family and full names of the TrueType/OpenType font
+// starting at [offset] in [font] to [faces]. Returns false if the font is
+// malformed or has no name table.
+static bool sfnt_faces_add(std::vector<std::string> &faces, const BYTE *font, size_t size, size_t offset)
+{
+	if(offset > size || size - offset < 12) {
+		return false;
+	}
+	const BYTE *dir = font + offset;
+	const uint16_t num_tables = sfnt_u16(dir + 4);
+	if((size - offset - 12) / 16 < num_tables) {
+		return false;
+	}
+	for(uint16_t i = 0; i < num_tables; i++) {
+		const BYTE *table = dir + 12 + i * 16;
+		if(memcmp(table, "name", 4)) {
+			continue;
+		}
+		const size_t name_offset = sfnt_u32(table + 8);
+		const size_t name_len = sfnt_u32(table + 12);
+		if(name_offset > size || size - name_offset < name_len || name_len < 6) {
+			return false;
+		}
+		const BYTE *name = font + name_offset;
+		const uint16_t count = sfnt_u16(name + 2);
+		const size_t strings = sfnt_u16(name + 4);
+		if((name_len - 6) / 12 < count || strings > name_len) {
+			return false;
+		}
+		for(uint16_t j = 0; j < count; j++) {
+			const BYTE *record = name + 6 + j * 12;
+			const uint16_t platform_id = sfnt_u16(record);
+			const uint16_t name_id = sfnt_u16(record + 6);
+			const size_t str_len = sfnt_u16(record + 8);
+			const size_t str_offset = strings + sfnt_u16(record + 10);
+			// Windows names are UTF-16BE.
+			if(platform_id != 3 || (name_id != 1 && name_id != 4)) {
+				continue;
+			}
+			if(str_offset > name_len || name_len - str_offset < str_len) {
+				continue;
+			}
+			wchar_t face_w[LF_FACESIZE] = {};
+			for(size_t k = 0; k < str_len / 2 && k < LF_FACESIZE - 1; k++) {
+				face_w[k] = sfnt_u16(name + str_offset + k * 2);
+			}
+			char face[LF_FACESIZE];
+			utf16_to_utf8(face, face_w, LF_FACESIZE);
+			if(face[0]) {
+				faces.push_back(face);
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+// Fills [faces] with the face names of every font in the font file or font
+// collection at [view]. Returns false if GDI has to figure them out itself.
+static bool font_faces_parse(std::vector<std::string> &faces, const void *view, size_t size)
+{
+	const BYTE *font = (const BYTE *)view;
+	if(!font || size < 12) {
+		return false;
+	}
+	if(!memcmp(font, "ttcf", 4)) {
+		const uint32_t num_fonts = sfnt_u32(font + 8);
+		if((size - 12) / 4 < num_fonts) {
+			return false;
+		}
+		for(uint32_t i = 0; i < num_fonts; i++) {
+			if(!sfnt_faces_add(faces, font, size, sfnt_u32(font + 12 + i * 4))) {
+				return false;
+			}
+		}
+	} else if(!sfnt_faces_add(faces, font, size, 0)) {
+		return false;
+	}
+	return !faces.empty();
+}
+
+// Registers every deferred font file that provides [face].
+static void fonts_pending_require(const char *face)
+{
+	if(!fonts_pending_count || !face || !face[0]) {
+		return;
+	}
+	// Held while registering, so that no other thread creates a font for
+	// [face] before GDI knows about it.
+	AcquireSRWLockExclusive(&fonts_pending_srwlock);
+	for(auto it = fonts_pending.begin(); it != fonts_pending.end(); ) {
+		bool provided = std::any_of(it->faces.begin(), it->faces.end(), [face](const std::string &f) {
+			return !strnicmp(f.c_str(), face, LF_FACESIZE - 1);
+		});
+		if(provided) {
+			log_printf("(Font) '%s' requested\n", face);
+			patch_font_map_add(it->patch, it->fn);
+			it = fonts_pending.erase(it);
+		} else {
+			++it;
+		}
+	}
+	fonts_pending_count = (LONG)fonts_pending.size();
+	ReleaseSRWLockExclusive(&fonts_pending_srwlock);
+}
+/// ---------------------
+
+/// Font cache
+/// ----------
+/**
+  * Games tend to create a new font for every string they render. Instead,
+  * fonts are shared between all CreateFont*() callers by their final
+  * LOGFONT after font rule application, with all returned handles being
+  * reference-counted through our DeleteObject() detour. Unreferenced fonts
+  * are kept around until more than FONT_CACHE_IDLE_MAX of them accumulate,
+  * and are then deleted in least recently used order.
+  */
+#define FONT_CACHE_IDLE_MAX 16
+
+struct font_cached_t {
+	HFONT font;
+	unsigned int refcount;
+};
+
+static logfont_map_t<font_cached_t> font_cache;
+static std::unordered_map<HFONT, LOGFONTA> font_cache_handles;
+// Unreferenced fonts, least recently used first.
+static std::vector<HFONT> font_cache_idle;
+static SRWLOCK font_cache_srwlock = { SRWLOCK_INIT };
+
+// Returns a new reference to the font created from [lpelfe] by the rest of
+// the chain.
+static HFONT font_cache_acquire(ENUMLOGFONTEXDVA *lpelfe)
+{
+	const LOGFONTA &lf = lpelfe->elfEnumLogfontEx.elfLogFont;
+	HFONT ret;
+	AcquireSRWLockExclusive(&font_cache_srwlock);
+	auto cached = font_cache.find(lf);
+	if(cached != font_cache.end()) {
+		auto &entry = cached->second;
+		if(entry.refcount++ == 0) {
+			auto idle = std::find(font_cache_idle.begin(), font_cache_idle.end(), entry.font);
+			font_cache_idle.erase(idle);
+		}
+		ret = entry.font;
+	} else {
+		log_printf("(Font) Creating %s...\n", logfont_stringify(&lf));
+		ret = (HFONT)chain_CreateFontIndirectExU(lpelfe);
+		if(ret) {
+			font_cache[lf] = { ret, 1 };
+			font_cache_handles[ret] = lf;
+		}
+	}
+	ReleaseSRWLockExclusive(&font_cache_srwlock);
+	return ret;
+}
+
+// Returns false if [font] didn't come from the cache.
+static bool font_cache_release(HFONT font)
+{
+	AcquireSRWLockExclusive(&font_cache_srwlock);
+	auto handle = font_cache_handles.find(font);
+	if(handle == font_cache_handles.end()) {
+		ReleaseSRWLockExclusive(&font_cache_srwlock);
+		return false;
+	}
+	auto &entry = font_cache[handle->second];
+	if(entry.refcount > 0 && --entry.refcount == 0) {
+		font_cache_idle.push_back(font);
+		if(font_cache_idle.size() > FONT_CACHE_IDLE_MAX) {
+			HFONT evicted = font_cache_idle.front();
+			font_cache_idle.erase(font_cache_idle.begin());
+			auto evicted_handle = font_cache_handles.find(evicted);
+			font_cache.erase(evicted_handle->second);
+			font_cache_handles.erase(evicted_handle);
+			chain_DeleteObject(evicted);
+		}
+	}
+	ReleaseSRWLockExclusive(&font_cache_srwlock);
+	return true;
+}
+/// ----------
+
 // This detour is kept for backwards compatibility to patch configurations
 // that replace multiple fonts via hardcoded string translation. Due to the
 // fact that lower levels copy [pszFaceName] into the LOGFONT structure,
@@ -285,9 +595,10 @@ HFONT WINAPI textdisp_CreateFontIndirectExA(
 	}
 	lf = &lpelfe->elfEnumLogfontEx.elfLogFont;
 	// Ensure that the font face is in UTF-8
-	StringToUTF16(face_w, lf->lfFaceName, LF_FACESIZE);
-	StringToUTF8(lf->lfFaceName, face_w, LF_FACESIZE);
+	utf8_to_utf16(face_w, lf->lfFaceName, LF_FACESIZE);
+	utf16_to_utf8(lf->lfFaceName, face_w, LF_FACESIZE);
 	fontrules_apply(lf);
+	fonts_pending_require(lf->lfFaceName);
 	/**
 	  * CreateFont() prioritizes [lfCharSet] and ensures that the font
 	  * created can display the given charset. If the font given in
@@ -311,28 +622,106 @@ HFONT WINAPI textdisp_CreateFontIndirectExA(
 	if(lf->lfFaceName[0]) {
 		lf->lfCharSet = DEFAULT_CHARSET;
 	}
-	log_printf("(Font) Creating %s...\n", logfont_stringify(lf));
-	return chain_CreateFontIndirectExU(lpelfe);
+	// Fonts with variation axes would need the design vector in the key.
+	if(lpelfe->elfDesignVector.dvNumAxes != 0) {
+		log_printf("(Font) Creating %s...\n", logfont_stringify(lf));
+		return chain_CreateFontIndirectExU(lpelfe);
+	}
+	return font_cache_acquire(lpelfe);
+}
+
+BOOL WINAPI textdisp_DeleteObject(HGDIOBJ obj)
+{
+	if(GetObjectType(obj) == OBJ_FONT && font_cache_release((HFONT)obj)) {
+		return 1;
+	}
+	return chain_DeleteObject(obj);
+}
+
+// Hands [font_buffer] to GDI, which keeps its own copy.
+static void patch_font_add(const char *font_fn, const void *font_buffer, size_t font_size)
+{
+	if(font_buffer) {
+		DWORD ret;
+		log_printf("(Font) Loading %s (%d bytes)...\n", font_fn, font_size);
+		if(AddFontMemResourceEx((void *)font_buffer, font_size, NULL, &ret)) {
+			memstats_add(MEMSTATS_FONT, font_size);
+		}
+		/**
+		  * "However, when the process goes away, the system will unload the fonts
+		  * even if the process did not call RemoveFontMemResource."
+		  * http://msdn.microsoft.com/en-us/library/windows/desktop/dd183325%28v=vs.85%29.aspx
+		  */
+	}
+}
+
+static void patch_font_map_add(const patch_t *patch_info, const char *font_fn)
+{
+	size_t font_size;
+	const void *font_view = patch_file_map(patch_info, font_fn, &font_size);
+	patch_font_add(font_fn, font_view, font_size);
+	file_unmap(font_view);
 }
 
 void patch_fonts_load(const patch_t *patch_info)
 {
 	for (size_t i = 0; patch_info->fonts && patch_info->fonts[i]; i++) {
-		size_t font_size;
-		void *font_buffer = patch_file_load(patch_info, patch_info->fonts[i], &font_size);
-
-		if(font_buffer) {
-			DWORD ret;
-			log_printf("(Font) Loading %s (%d bytes)...\n", patch_info->fonts[i], font_size);
-			AddFontMemResourceEx(font_buffer, font_size, NULL, &ret);
-			SAFE_FREE(font_buffer);
-			/**
-			  * "However, when the process goes away, the system will unload the fonts
-			  * even if the process did not call RemoveFontMemResource."
-			  * http://msdn.microsoft.com/en-us/library/windows/desktop/dd183325%28v=vs.85%29.aspx
-			  */
+		patch_font_map_add(patch_info, patch_info->fonts[i]);
+	}
+}
+
+// Reads the name tables of the font files of all patches in parallel, and
+// defers registering them until they are requested. Preloaded fonts, and
+// fonts whose names couldn't be read, are loaded in parallel as well, and
+// are still added in stack order.
+#define FONTS_LOAD_MAX_THREADS 8
+
+static void stack_fonts_load(bool preload)
+{
+	struct font_load_t {
+		const patch_t *patch;
+		const char *fn;
+		void *buffer;
+		size_t size;
+		std::vector<std::string> faces;
+	};
+	std::vector<font_load_t> fonts;
+	stack_foreach_cpp([&fonts](const patch_t *patch) {
+		for (size_t i = 0; patch->fonts && patch->fonts[i]; i++) {
+			fonts.push_back({ patch, patch->fonts[i], nullptr, 0 });
+		}
+	});
+	parallel_for(fonts.size(), FONTS_LOAD_MAX_THREADS, [&fonts, preload](size_t i) {
+		font_load_t &font = fonts[i];
+		if (!preload) {
+			// Only the pages of the table directory and the name table
+			// are ever touched.
+			size_t view_size;
+			const void *view = patch_file_map(font.patch, font.fn, &view_size);
+			if (!view) {
+				return;
+			}
+			const bool parsed = font_faces_parse(font.faces, view, view_size);
+			file_unmap(view);
+			if (parsed) {
+				return;
+			}
+			font.faces.clear();
+		}
+		font.buffer = patch_file_load(font.patch, font.fn, &font.size);
+	});
+	AcquireSRWLockExclusive(&fonts_pending_srwlock);
+	for (auto& font : fonts) {
+		if (font.buffer) {
+			patch_font_add(font.fn, font.buffer, font.size);
+			SAFE_FREE(font.buffer);
+		} else if (!font.faces.empty()) {
+			log_printf("(Font) Deferring %s until '%s' is requested\n", font.fn, font.faces[0].c_str());
+			fonts_pending.push_back({ font.patch, font.fn, std::move(font.faces) });
 		}
 	}
+	fonts_pending_count = (LONG)fonts_pending.size();
+	ReleaseSRWLockExclusive(&fonts_pending_srwlock);
 }
 
 void textdisp_mod_detour(void)
@@ -340,13 +729,15 @@ void textdisp_mod_detour(void)
 	detour_chain("gdi32.dll", 1,
 		"CreateFontA", textdisp_CreateFontA, &chain_CreateFontU,
 		"CreateFontIndirectExA", textdisp_CreateFontIndirectExA, &chain_CreateFontIndirectExU,
+		"DeleteObject", textdisp_DeleteObject, &chain_DeleteObject,
 		NULL
 	);
 }
 
 void textdisp_mod_init(void)
 {
-	stack_foreach([](const patch_t *patch, void*) {
-		patch_fonts_load(patch);
-	}, nullptr);
+	AcquireSRWLockExclusive(&fontrules_srwlock);
+	fontrules_parse(json_object_get(runconfig_json_get(), "fontrules"));
+	ReleaseSRWLockExclusive(&fontrules_srwlock);
+	stack_fonts_load(json_is_true(json_object_get(runconfig_json_get(), "fonts_preload")));
 }
@@ -20,6 +20,7 @@
 #ifdef __cplusplus
 #include <string>
 #include <functional>
+#include <vector>
 
 extern "C" {
 #endif
@@ -29,14 +30,20 @@ extern "C" {
 #include <jansson.h>
 #include "exception.h"
 #include "util.h"
+#include "strconv.h"
 #include "jansson_ex.h"
 #include "expression.h"
 #include "global.h"
 #include "runconfig.h"
 #include "log.h"
 #include "patchfile.h"
+#include "patch_pack.h"
+#include "delta.h"
 #include "stack.h"
+#include "sigscan.h"
 #include "binhack.h"
+#include "binhack_cache.h"
+#include "cave_arena.h"
 #include "breakpoint.h"
 #include "mempatch.h"
 #include "pe.h"
@@ -45,6 +52,7 @@ extern "C" {
 #include "strings_array.h"
 #include "inject.h"
 #include "init.h"
+#include "init_snapshot.h"
 #include "jsondata.h"
 #include "zip.h"
 #include "bp_file.h"
@@ -53,6 +61,24 @@ extern "C" {
 #include "search.h"
 #include "shelllink.h"
 #include "fonts_charset.h"
+#include "glyph_cache.h"
+#include "startup_profile.h"
+#include "trace.h"
+#include "sample_profile.h"
+#include "memstats.h"
+#include "patch_stats.h"
+#include "cache_mgr.h"
+#include "task.h"
+#include "async_io.h"
+#include "buffer_pool.h"
+#include "hook_cache.h"
+#include "shm_cache.h"
+#include "dump_queue.h"
+#include "cfg_cache.h"
+#include "disk_cache.h"
+#include "png_decode.h"
+#include "raw_image.h"
+#include "xor_crypt.h"
 
 #ifdef __cplusplus
 }
@@ -93,20 +119,20 @@ public:
 	Option(T val) : valid(true), val(val) {}
 	Option() : valid(false) {}
 
-	bool is_none() {
+	bool is_none() const {
 		return !valid;
 	}
 
-	bool is_some() {
+	bool is_some() const {
 		return valid;
 	}
 
-	const T& unwrap() {
+	const T& unwrap() const {
 		assert(valid);
 		return val;
 	}
 
-	const T& unwrap_or(const T &def) {
+	const T& unwrap_or(const T &def) const {
 		return valid ? val : def;
 	}
 };
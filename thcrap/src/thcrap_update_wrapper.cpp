@@ -54,8 +54,24 @@ int update_filter_games_wrapper(const char *fn, void *games)
 }
 void stack_update_wrapper(update_filter_func_t filter_func, void *filter_data, progress_callback_t progress_callback, void *progress_param)
 {
+	// stack_update() only recognizes the real game filter, and replaces it
+	// with a faster equivalent.
+	if (filter_func == update_filter_games_wrapper) {
+		if (auto func = (update_filter_func_t)load_thcrap_update_function("update_filter_games")) {
+			filter_func = func;
+		}
+	}
 	CALL_WRAPPED_FUNCTION(stack_update, filter_func, filter_data, progress_callback, progress_param)
 }
+void patch_update_wrapper(const patch_t *patch, update_filter_func_t filter_func, void *filter_data, progress_callback_t progress_callback, void *progress_param)
+{
+	if (filter_func == update_filter_games_wrapper) {
+		if (auto func = (update_filter_func_t)load_thcrap_update_function("update_filter_games")) {
+			filter_func = func;
+		}
+	}
+	CALL_WRAPPED_FUNCTION(patch_update, patch, filter_func, filter_data, progress_callback, progress_param)
+}
 BOOL loader_update_with_UI_wrapper(const char *exe_fn, char *args, const char *game_id_fallback)
 {
 	CALL_WRAPPED_FUNCTION(loader_update_with_UI, exe_fn, args, game_id_fallback)
@@ -68,6 +84,16 @@ repo_t **RepoDiscover_wrapper(const char *start_url)
 	return RepoLoad();
 }
 
+repo_t **RepoDiscoverWithCallback_wrapper(const char *start_url, repo_discovery_callback_t callback, void *param)
+{
+	CALL_WRAPPED_FUNCTION(RepoDiscoverWithCallback, start_url, callback, param)
+	repo_t **repo_list = RepoLoad();
+	for (size_t i = 0; callback && repo_list && repo_list[i]; i++) {
+		callback(repo_list[i], param);
+	}
+	return repo_list;
+}
+
 patch_t patch_bootstrap_wrapper(const patch_desc_t *sel, const repo_t *repo)
 {
 	CALL_WRAPPED_FUNCTION(patch_bootstrap, sel, repo)
@@ -22,9 +22,11 @@ HMODULE thcrap_update_module(void);
 int update_filter_global_wrapper(const char *fn, void*);
 int update_filter_games_wrapper(const char *fn, void *games);
 void stack_update_wrapper(update_filter_func_t filter_func, void *filter_data, progress_callback_t progress_callback, void *progress_param);
+void patch_update_wrapper(const patch_t *patch, update_filter_func_t filter_func, void *filter_data, progress_callback_t progress_callback, void *progress_param);
 BOOL loader_update_with_UI_wrapper(const char *exe_fn, char *args, const char *game_id_fallback);
 
 repo_t ** RepoDiscover_wrapper(const char *start_url);
+repo_t ** RepoDiscoverWithCallback_wrapper(const char *start_url, repo_discovery_callback_t callback, void *param);
 
 patch_t patch_bootstrap_wrapper(const patch_desc_t *sel, const repo_t *repo);
 
@@ -12,6 +12,18 @@
 #include "minid3d.h"
 #include "textdisp.h"
 #include "tlnote.hpp"
+#include "frametime.h"
+#include "framelimit.h"
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#include <intrin.h>
+#endif
+#include <emmintrin.h>
+
+#if defined(__GNUC__)
+# define TLNOTE_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+# define TLNOTE_TARGET_SSE2
+#endif
 
 #pragma comment(lib, "winmm.lib")
 
@@ -41,6 +53,57 @@
 logger_t tlnote_log("TL note error");
 /// -----------------------------
 
+/// Codepoint scanning
+/// ------------------
+// Since pretty much every string shown by the game goes through
+// tlnote_find(), and hardly any of them contain a TL note, it's worth
+// skipping over the rest of the string 16 bytes at a time.
+
+static bool tlnote_sse2_supported(void)
+{
+	int data[4];
+	__cpuid(data, 0);
+	if(data[0] < 1) {
+		return false;
+	}
+	__cpuid(data, 1);
+	return data[3] & 1 << 26;
+}
+
+static const bool TLNOTE_SSE2 = tlnote_sse2_supported();
+
+// Returns the offset of the first TLNOTE_INLINE or TLNOTE_INDEX byte in
+// [str], or [len] if there is none. Since both are ASCII, they can't
+// appear as part of any other UTF-8 sequence.
+TLNOTE_TARGET_SSE2 static size_t tlnote_codepoint_scan(const char *str, size_t len)
+{
+	size_t i = 0;
+	if(TLNOTE_SSE2) {
+		const __m128i inline_v = _mm_set1_epi8(TLNOTE_INLINE);
+		const __m128i index_v = _mm_set1_epi8(TLNOTE_INDEX);
+		for(; (i + 16) <= len; i += 16) {
+			const __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+			unsigned int mask = _mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(v, inline_v), _mm_cmpeq_epi8(v, index_v)
+			));
+			if(mask) {
+				while(!(mask & 1)) {
+					mask >>= 1;
+					i++;
+				}
+				return i;
+			}
+		}
+	}
+	for(; i < len; i++) {
+		if(str[i] == TLNOTE_INLINE || str[i] == TLNOTE_INDEX) {
+			break;
+		}
+	}
+	return i;
+}
+/// ------------------
+
 /// Structures
 /// ----------
 tlnote_t::tlnote_t(const stringref_t str)
@@ -232,16 +295,32 @@ tlnote_env_t& tlnote_env()
 }
 /// ----------------
 
-/// Direct3D pointers
-/// -----------------
-// Game support modules might want to pre-render TL notes before the game
-// created its IDirect3DDevice instance.
-d3d_version_t d3d_ver = D3D_NONE;
-IDirect3DDevice *d3dd = nullptr;
-/// -----------------
-
 /// Texture creation
 /// ----------------
+/**
+  * Rasterizing a note with GDI is way too slow to do inside EndScene() on
+  * the frame the note first appears. tlnote_render() therefore only queues
+  * the note for a worker thread, which rasterizes it into a plain bitmap.
+  * The next frame then copies all finished bitmaps into shared atlas
+  * textures, from which the notes are drawn as simple quads.
+  */
+
+// Size of a shared atlas page. Notes that are larger get their own page.
+#define TLNOTE_ATLAS_SIZE 1024
+// Transparent border around every note in the atlas, to keep filtering
+// from bleeding in neighboring notes.
+#define TLNOTE_ATLAS_PADDING 1
+
+struct d3d_pixel_t {
+	uint8_t b, g, r, a;
+};
+
+struct tlnote_bitmap_t {
+	std::vector<d3d_pixel_t> pixels;
+	unsigned int w = 0;
+	unsigned int h = 0;
+};
+
 struct tlnote_rendered_t {
 	// "Primary key" data
 	// -------------------
@@ -251,13 +330,19 @@ struct tlnote_rendered_t {
 
 	// Runtime stuff
 	// -------------
+	// Identifies the rasterization job for this note, to discard results
+	// for notes that were replaced in the meantime.
+	unsigned int job = 0;
+	// Atlas page and position.
 	IDirect3DTexture *tex = nullptr;
+	unsigned int tex_x;
+	unsigned int tex_y;
 	unsigned int tex_w;
 	unsigned int tex_h;
+	unsigned int page_w;
+	unsigned int page_h;
 	// -------------
 
-	IDirect3DTexture* render(d3d_version_t ver, IDirect3DDevice *d3dd);
-
 	bool matches(const stringref_t &n2, const tlnote_env_render_t &r2) const {
 		return
 			(note.size() == n2.len)
@@ -270,23 +355,16 @@ struct tlnote_rendered_t {
 	}
 };
 
-IDirect3DTexture* tlnote_rendered_t::render(d3d_version_t ver, IDirect3DDevice *d3dd)
+// Rasterizes [note] into [bmp], with the outline in the alpha channel.
+// Doesn't touch any Direct3D state, and can therefore run on any thread.
+bool tlnote_rasterize(tlnote_bitmap_t &bmp, const std::string &note, const tlnote_env_render_t &render_env)
 {
-	if(tex) {
-		return tex;
-	}
-
 	const stringref_t formatted_note = { note.c_str(), note.length() };
 
-	auto fail = [formatted_note] (const char *func, HRESULT ret) {
-		log_printf(
-			"(TL notes) Error rendering \"%.*s\": %s returned 0x%x\n",
-			formatted_note.len, formatted_note.str, func, ret
-		);
-		return nullptr;
-	};
-
-	auto hDC = CreateCompatibleDC(GetDC(0));
+	auto hDCScreen = GetDC(0);
+	auto hDC = CreateCompatibleDC(hDCScreen);
+	ReleaseDC(0, hDCScreen);
+	defer({ DeleteDC(hDC); });
 	SelectObject(hDC, render_env.font());
 
 	RECT gdi_rect = { 0, 0, (LONG)render_env.region_w(), 0 };
@@ -315,8 +393,13 @@ IDirect3DTexture* tlnote_rendered_t::render(d3d_version_t ver, IDirect3DDevice *
 		(BITMAPINFO *)&bmi, 0, (void**)&dib_bits, nullptr, 0
 	);
 	if(!hBitmap) {
-		return fail("CreateDIBSection", GetLastError());
+		log_printf(
+			"(TL notes) Error rendering \"%.*s\": CreateDIBSection returned 0x%x\n",
+			formatted_note.len, formatted_note.str, GetLastError()
+		);
+		return false;
 	}
+	defer({ DeleteObject(hBitmap); });
 	SelectObject(hDC, hBitmap);
 
 	SetTextColor(hDC, 0xFFFFFF);
@@ -327,73 +410,263 @@ IDirect3DTexture* tlnote_rendered_t::render(d3d_version_t ver, IDirect3DDevice *
 		formatted_note.str, formatted_note.len,
 		&gdi_rect, DT_WORDBREAK | DT_CENTER
 	);
+	GdiFlush();
 
-	BITMAP bmp;
-	GetObject(hBitmap, sizeof(bmp), &bmp);
+	BITMAP gdi_bmp;
+	GetObject(hBitmap, sizeof(gdi_bmp), &gdi_bmp);
 
 	const auto &outline_radius = render_env.outline_radius;
-	tex_w = gdi_rect.right + (outline_radius * 2);
-	tex_h = gdi_rect.bottom + (outline_radius * 2);
-
-	// TODO: Is there still 3dfx Voodoo-style limited 3D hardware
-	// out there today that needs to be worked around?
-	COM_ERR_WRAP(d3dd_CreateTexture, ver, d3dd,
-		tex_w, tex_h, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &tex
-	);
-
-	struct d3d_pixel_t {
-		uint8_t b, g, r, a;
-	};
-
-	D3DSURFACE_DESC tex_desc;
-	D3DLOCKED_RECT lockedrect;
-	COM_ERR_WRAP(d3dtex_GetLevelDesc, ver, tex, 0, &tex_desc);
-	COM_ERR_WRAP(d3dtex_LockRect, ver, tex, 0, &lockedrect, nullptr, 0);
-
-	auto tex_bits = (uint8_t *)lockedrect.pBits;
-
-	// Shift the texture write pointer by the outline height
-	tex_bits += lockedrect.Pitch * outline_radius;
+	bmp.w = gdi_rect.right + (outline_radius * 2);
+	bmp.h = gdi_rect.bottom + (outline_radius * 2);
+	bmp.pixels.assign(bmp.w * bmp.h, d3d_pixel_t{});
+	const int pitch = bmp.w;
 
 	auto outside_circle = [] (int x, int y, int radius) {
 		return (x * x) + (y * y) > (radius * radius);
 	};
 
+	// Shift the write pointer by the outline height
+	auto *bmp_row = bmp.pixels.data() + (pitch * outline_radius);
+
 	for(LONG y = 0; y < gdi_rect.bottom; y++) {
 		auto dib_col = ((dib_pixel_t *)dib_bits);
-		// Shift the texture write pointer by the outline width
-		auto tex_col = ((d3d_pixel_t *)tex_bits) + outline_radius;
+		// Shift the write pointer by the outline width
+		auto bmp_col = bmp_row + outline_radius;
 
 		for(LONG x = 0; x < gdi_rect.right; x++) {
 			auto alpha = MAX(MAX(dib_col->r, dib_col->g), dib_col->b);
-			tex_col->r = dib_col->r;
-			tex_col->g = dib_col->g;
-			tex_col->b = dib_col->b;
+			bmp_col->r = dib_col->r;
+			bmp_col->g = dib_col->g;
+			bmp_col->b = dib_col->b;
 			if(alpha > 0) {
 				for(int oy = -outline_radius; oy <= outline_radius; oy++) {
 					for(int ox = -outline_radius; ox <= outline_radius; ox++) {
 						if(outside_circle(ox, oy, outline_radius)) {
 							continue;
 						}
-						auto *outline_p = (d3d_pixel_t*)(
-							((uint8_t*)tex_col) - (lockedrect.Pitch * oy)
-						) + ox;
+						auto *outline_p = bmp_col - (pitch * oy) + ox;
 						outline_p->a = MAX(outline_p->a, alpha);
 					}
 				}
 			}
 			dib_col++;
-			tex_col++;
+			bmp_col++;
+		}
+		bmp_row += pitch;
+		dib_bits += gdi_bmp.bmWidthBytes;
+	}
+	return true;
+}
+
+/// Rasterization thread
+/// --------------------
+struct tlnote_job_t {
+	unsigned int id;
+	size_t index;
+	std::string note;
+	tlnote_env_render_t render_env;
+
+	bool ok = false;
+	tlnote_bitmap_t bmp;
+};
+
+static SRWLOCK tlnote_jobs_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE tlnote_jobs_queued_cv = CONDITION_VARIABLE_INIT;
+static std::vector<tlnote_job_t> tlnote_jobs_queued;
+static std::vector<tlnote_job_t> tlnote_jobs_done;
+static unsigned int tlnote_job_last = 0;
+static HANDLE tlnote_worker = nullptr;
+static bool tlnote_worker_quit = false;
+
+static DWORD WINAPI tlnote_worker_proc(void *)
+{
+	AcquireSRWLockExclusive(&tlnote_jobs_lock);
+	while(!tlnote_worker_quit) {
+		if(tlnote_jobs_queued.empty()) {
+			SleepConditionVariableSRW(&tlnote_jobs_queued_cv, &tlnote_jobs_lock, INFINITE, 0);
+			continue;
+		}
+		auto job = std::move(tlnote_jobs_queued.front());
+		tlnote_jobs_queued.erase(tlnote_jobs_queued.begin());
+		ReleaseSRWLockExclusive(&tlnote_jobs_lock);
+
+		job.ok = tlnote_rasterize(job.bmp, job.note, job.render_env);
+
+		AcquireSRWLockExclusive(&tlnote_jobs_lock);
+		tlnote_jobs_done.emplace_back(std::move(job));
+	}
+	ReleaseSRWLockExclusive(&tlnote_jobs_lock);
+	return 0;
+}
+
+// Queues [r], stored at [index], for rasterization.
+static void tlnote_job_queue(tlnote_rendered_t &r, size_t index)
+{
+	tlnote_job_t job = { ++tlnote_job_last, index, r.note, r.render_env };
+	r.job = job.id;
+	r.tex = nullptr;
+
+	AcquireSRWLockExclusive(&tlnote_jobs_lock);
+	if(!tlnote_worker && !tlnote_worker_quit) {
+		tlnote_worker = CreateThread(nullptr, 0, tlnote_worker_proc, nullptr, 0, nullptr);
+	}
+	if(tlnote_worker) {
+		tlnote_jobs_queued.emplace_back(std::move(job));
+		WakeConditionVariable(&tlnote_jobs_queued_cv);
+		ReleaseSRWLockExclusive(&tlnote_jobs_lock);
+		return;
+	}
+	ReleaseSRWLockExclusive(&tlnote_jobs_lock);
+
+	job.ok = tlnote_rasterize(job.bmp, job.note, job.render_env);
+	AcquireSRWLockExclusive(&tlnote_jobs_lock);
+	tlnote_jobs_done.emplace_back(std::move(job));
+	ReleaseSRWLockExclusive(&tlnote_jobs_lock);
+}
+
+static void tlnote_worker_stop()
+{
+	AcquireSRWLockExclusive(&tlnote_jobs_lock);
+	tlnote_worker_quit = true;
+	WakeConditionVariable(&tlnote_jobs_queued_cv);
+	auto worker = tlnote_worker;
+	tlnote_worker = nullptr;
+	ReleaseSRWLockExclusive(&tlnote_jobs_lock);
+	if(worker) {
+		WaitForSingleObject(worker, INFINITE);
+		CloseHandle(worker);
+	}
+}
+/// --------------------
+
+/// Atlas
+/// -----
+struct tlnote_atlas_page_t {
+	IDirect3DTexture *tex;
+	unsigned int w;
+	unsigned int h;
+	// Notes are packed into horizontal shelves, from top to bottom.
+	unsigned int shelf_x;
+	unsigned int shelf_y;
+	unsigned int shelf_h;
+};
+
+static std::vector<tlnote_atlas_page_t> tlnote_atlas;
+
+static tlnote_atlas_page_t* tlnote_atlas_page_new(
+	d3d_version_t ver, IDirect3DDevice *d3dd, unsigned int w, unsigned int h
+)
+{
+	// TODO: Is there still 3dfx Voodoo-style limited 3D hardware
+	// out there today that needs to be worked around?
+	IDirect3DTexture *tex = nullptr;
+	auto ret = d3dd_CreateTexture(ver, d3dd,
+		w, h, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &tex
+	);
+	if(FAILED(ret)) {
+		log_printf("(TL notes) Rendering error: d3dd_CreateTexture returned 0x%x\n", ret);
+		return nullptr;
+	}
+	D3DLOCKED_RECT lockedrect;
+	if(SUCCEEDED(d3dtex_LockRect(ver, tex, 0, &lockedrect, nullptr, 0))) {
+		for(unsigned int y = 0; y < h; y++) {
+			memset((uint8_t *)lockedrect.pBits + (lockedrect.Pitch * y), 0, w * sizeof(d3d_pixel_t));
+		}
+		d3dtex_UnlockRect(ver, tex, 0);
+	}
+	tlnote_atlas.push_back({ tex, w, h, 0, 0, 0 });
+	return &tlnote_atlas.back();
+}
+
+// Finds space for a [w]×[h] rectangle in the atlas, creating a new page
+// if necessary.
+static tlnote_atlas_page_t* tlnote_atlas_alloc(
+	d3d_version_t ver, IDirect3DDevice *d3dd,
+	unsigned int w, unsigned int h, unsigned int &x, unsigned int &y
+)
+{
+	if(w > TLNOTE_ATLAS_SIZE || h > TLNOTE_ATLAS_SIZE) {
+		auto *page = tlnote_atlas_page_new(ver, d3dd, w, h);
+		if(page) {
+			page->shelf_y = page->h;
+			x = 0;
+			y = 0;
+		}
+		return page;
+	}
+	auto fits = [&] (tlnote_atlas_page_t &page) {
+		if(page.w != TLNOTE_ATLAS_SIZE || page.h != TLNOTE_ATLAS_SIZE) {
+			return false;
 		}
-		tex_bits += lockedrect.Pitch;
-		dib_bits += bmp.bmWidthBytes;
+		auto shelf_x = page.shelf_x;
+		auto shelf_y = page.shelf_y;
+		auto shelf_h = page.shelf_h;
+		if((shelf_x + w) > page.w) {
+			shelf_y += shelf_h;
+			shelf_x = 0;
+			shelf_h = 0;
+		}
+		if((shelf_y + h) > page.h) {
+			return false;
+		}
+		x = shelf_x;
+		y = shelf_y;
+		page.shelf_x = shelf_x + w;
+		page.shelf_y = shelf_y;
+		page.shelf_h = MAX(shelf_h, h);
+		return true;
+	};
+	if(!tlnote_atlas.empty() && fits(tlnote_atlas.back())) {
+		return &tlnote_atlas.back();
+	}
+	auto *page = tlnote_atlas_page_new(ver, d3dd, TLNOTE_ATLAS_SIZE, TLNOTE_ATLAS_SIZE);
+	if(!page || !fits(*page)) {
+		return nullptr;
+	}
+	return page;
+}
+
+// Copies [bmp] into the atlas, and points [r] to its position there.
+static bool tlnote_atlas_upload(
+	d3d_version_t ver, IDirect3DDevice *d3dd,
+	tlnote_rendered_t &r, const tlnote_bitmap_t &bmp
+)
+{
+	const auto padding = TLNOTE_ATLAS_PADDING * 2;
+	unsigned int x;
+	unsigned int y;
+	auto *page = tlnote_atlas_alloc(ver, d3dd, bmp.w + padding, bmp.h + padding, x, y);
+	if(!page) {
+		return false;
 	}
-	COM_ERR_WRAP(d3dtex_UnlockRect, ver, tex, 0);
+	x += TLNOTE_ATLAS_PADDING;
+	y += TLNOTE_ATLAS_PADDING;
 
-	DeleteObject(hBitmap);
-	DeleteDC(hDC);
-	return tex;
+	const RECT rect = { (LONG)x, (LONG)y, (LONG)(x + bmp.w), (LONG)(y + bmp.h) };
+	D3DLOCKED_RECT lockedrect;
+	auto ret = d3dtex_LockRect(ver, page->tex, 0, &lockedrect, &rect, 0);
+	if(FAILED(ret)) {
+		log_printf("(TL notes) Rendering error: d3dtex_LockRect returned 0x%x\n", ret);
+		return false;
+	}
+	for(unsigned int row = 0; row < bmp.h; row++) {
+		memcpy(
+			(uint8_t *)lockedrect.pBits + (lockedrect.Pitch * row),
+			&bmp.pixels[row * bmp.w], bmp.w * sizeof(d3d_pixel_t)
+		);
+	}
+	d3dtex_UnlockRect(ver, page->tex, 0);
+
+	r.tex = page->tex;
+	r.tex_x = x;
+	r.tex_y = y;
+	r.tex_w = bmp.w;
+	r.tex_h = bmp.h;
+	r.page_w = page->w;
+	r.page_h = page->h;
+	return true;
 }
+/// -----
 /// ----------------
 
 /// Indexing of rendered TL notes
@@ -523,25 +796,90 @@ int32_t tlnote_render(const stringref_t &note)
 	}
 	rendered.emplace_back(r);
 
-	// Render any outstanding TL notes that were created
-	// while we didn't have an IDirect3DDevice.
-	static bool got_unrendered_notes = false;
-	if(d3d_ver == D3D_NONE || d3dd == nullptr) {
-		got_unrendered_notes = true;
-	} else if(got_unrendered_notes) {
-		for(auto &v : rendered) {
-			v.render(d3d_ver, d3dd);
+	// Uploaded on the next frame, once we have an IDirect3DDevice.
+	tlnote_job_queue(rendered[index], index);
+	return index;
+}
+
+// Uploads all rasterized TL notes to the atlas.
+void tlnote_upload_done(d3d_version_t ver, IDirect3DDevice *d3dd)
+{
+	std::vector<tlnote_job_t> done;
+	AcquireSRWLockExclusive(&tlnote_jobs_lock);
+	done.swap(tlnote_jobs_done);
+	ReleaseSRWLockExclusive(&tlnote_jobs_lock);
+
+	for(const auto &job : done) {
+		if(job.index >= rendered.size() || rendered[job.index].job != job.id) {
+			continue;
+		}
+		if(job.ok) {
+			tlnote_atlas_upload(ver, d3dd, rendered[job.index], job.bmp);
 		}
-		got_unrendered_notes = false;
-	} else {
-		rendered.back().render(d3d_ver, d3dd);
 	}
-	return index;
 }
 /// -----------------------------
 
+/// State block cache
+/// -----------------
+// Records exactly the states changed by tlnote_frame(). Capturing such a
+// block only saves those states, which is a lot cheaper than capturing a
+// D3DSBT_ALL block on every frame. IDirect3DDevice9::Reset() would fail
+// with D3DERR_INVALIDCALL if any state blocks still exist though, so the
+// block is released before every Reset() call, and recorded again on
+// the next frame.
+struct tlnote_stateblock_t {
+	d3d_version_t ver;
+	IDirect3DDevice *d3dd = nullptr;
+	IDirect3DStateBlock sb = 0;
+
+	IDirect3DStateBlock get(d3d_version_t ver, IDirect3DDevice *d3dd);
+	void release(IDirect3DDevice *d3dd);
+} tlnote_sb;
+
+IDirect3DStateBlock tlnote_stateblock_t::get(d3d_version_t ver, IDirect3DDevice *d3dd)
+{
+	if(sb && this->d3dd == d3dd && this->ver == ver) {
+		return sb;
+	}
+	// A block from a different device is gone together with its device.
+	sb = 0;
+
+	// The values don't matter, they are replaced on every capture.
+	const D3DVIEWPORT viewport = { 0 };
+	d3dd_BeginStateBlock(ver, d3dd);
+	d3dd_SetViewport(ver, d3dd, &viewport);
+	d3dd_SetRenderState(ver, d3dd, D3DRS_ALPHATESTENABLE, false);
+	d3dd_SetRenderState(ver, d3dd, D3DRS_ALPHABLENDENABLE, false);
+	d3dd_SetRenderState(ver, d3dd, D3DRS_SRCBLEND, D3DBLEND_SRCALPHA);
+	d3dd_SetRenderState(ver, d3dd, D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
+	d3dd_SetTextureStageState(ver, d3dd, 0, D3DTSS_ALPHAARG1, D3DTA_DIFFUSE);
+	d3dd_SetTextureStageState(ver, d3dd, 0, D3DTSS_ALPHAARG2, D3DTA_DIFFUSE);
+	d3dd_SetTextureStageState(ver, d3dd, 0, D3DTSS_COLORARG1, D3DTA_DIFFUSE);
+	d3dd_SetTextureStageState(ver, d3dd, 0, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
+	d3dd_SetFVF(ver, d3dd, D3DFVF_XYZRHW | D3DFVF_DIFFUSE);
+	d3dd_SetTexture(ver, d3dd, 0, nullptr);
+	if(FAILED(d3dd_EndStateBlock(ver, d3dd, &sb))) {
+		sb = 0;
+	}
+	this->ver = ver;
+	this->d3dd = d3dd;
+	return sb;
+}
+
+void tlnote_stateblock_t::release(IDirect3DDevice *d3dd)
+{
+	if(sb && this->d3dd == d3dd) {
+		d3dd_DeleteStateBlock(ver, d3dd, sb);
+	}
+	sb = 0;
+}
+/// -----------------
+
 /// Render calls and detoured functions
 /// -----------------------------------
+d3dd_Reset_type *chain_d3dd8_Reset;
+d3dd_Reset_type *chain_d3dd9_Reset;
 d3dd_EndScene_type *chain_d3dd8_EndScene;
 d3dd_EndScene_type *chain_d3dd9_EndScene;
 
@@ -549,14 +887,12 @@ int32_t id_active = RENDERED_NONE;
 
 bool tlnote_frame(d3d_version_t ver, IDirect3DDevice *d3dd)
 {
-	d3d_ver = ver;
-	::d3dd = d3dd;
-
 	// What do we render?
 	// ------------------
 	static decltype(id_active) id_last = RENDERED_NONE;
 	static DWORD time_birth = 0;
 	defer({ id_last = id_active; });
+	tlnote_upload_done(ver, d3dd);
 	if(id_active == RENDERED_NONE) {
 		return true;
 	}
@@ -564,6 +900,12 @@ bool tlnote_frame(d3d_version_t ver, IDirect3DDevice *d3dd)
 	if(id_last != id_active) {
 		time_birth = now;
 	}
+	auto tlr = &rendered[id_active];
+	if(!tlr->tex) {
+		// Still being rasterized, so let it fade in once it's done.
+		time_birth = now;
+		return true;
+	}
 	// OK, *something.*
 	// ------------------
 
@@ -579,13 +921,20 @@ bool tlnote_frame(d3d_version_t ver, IDirect3DDevice *d3dd)
 		return false;
 	};
 
-	// IDirect3DDevice9::Reset() would fail with D3DERR_INVALIDCALL if any
-	// state blocks still exist, so we couldn't just have a single static
-	// one that we create once. It's fast enough to do this every frame
-	// anyway.
-	IDirect3DStateBlock sb_game;
-	d3dd_CreateStateBlock(ver, d3dd, D3DSBT_ALL, &sb_game);
+	// Falls back on capturing everything if the block couldn't be
+	// recorded.
+	IDirect3DStateBlock sb_game = tlnote_sb.get(ver, d3dd);
+	const bool sb_temporary = !sb_game;
+	if(sb_temporary) {
+		d3dd_CreateStateBlock(ver, d3dd, D3DSBT_ALL, &sb_game);
+	}
 	d3dd_CaptureStateBlock(ver, d3dd, sb_game);
+	defer({
+		d3dd_ApplyStateBlock(ver, d3dd, sb_game);
+		if(sb_temporary) {
+			d3dd_DeleteStateBlock(ver, d3dd, sb_game);
+		}
+	});
 
 	// Retrieve back buffer and set viewport
 	// -------------------------------------
@@ -628,9 +977,17 @@ bool tlnote_frame(d3d_version_t ver, IDirect3DDevice *d3dd)
 			  right(xywh.x + xywh.w), bottom(xywh.y + xywh.h) {
 		}
 	};
+	// Texture coordinates are relative to the note's rectangle in the
+	// atlas.
 	auto render_textured_quad = [&] (
 		const quad_t &q, uint32_t col_diffuse, float texcoord_y, float texcoord_h
 	) {
+		const float page_w = (float)tlr->page_w;
+		const float page_h = (float)tlr->page_h;
+		auto texcoord_left = tlr->tex_x / page_w;
+		auto texcoord_right = (tlr->tex_x + tlr->tex_w) / page_w;
+		texcoord_y = (tlr->tex_y + (texcoord_y * tlr->tex_h)) / page_h;
+		texcoord_h = (texcoord_h * tlr->tex_h) / page_h;
 		d3dd_SetFVF(ver, d3dd, D3DFVF_XYZRHW | D3DFVF_DIFFUSE | D3DFVF_TEX1);
 		d3dd_SetRenderState(ver, d3dd, D3DRS_ALPHABLENDENABLE, true);
 		d3dd_SetTextureStageState(ver, d3dd, 0, D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
@@ -644,10 +1001,10 @@ bool tlnote_frame(d3d_version_t ver, IDirect3DDevice *d3dd)
 		auto texcoord_top = texcoord_y;
 		auto texcoord_bottom = texcoord_y + texcoord_h;
 		fvf_xyzrhw_diffuse_tex1_t verts[] = {
-			{ {q.left, q.top, 0.0f}, 1.0f, col_diffuse, {0.0f, texcoord_top} },
-			{ {q.right, q.top, 0.0f}, 1.0f, col_diffuse, {1.0f, texcoord_top} },
-			{ {q.left, q.bottom, 0.0f}, 1.0f, col_diffuse, {0.0f, texcoord_bottom} },
-			{ {q.right, q.bottom, 0.0f}, 1.0f, col_diffuse, {1.0f, texcoord_bottom} },
+			{ {q.left, q.top, 0.0f}, 1.0f, col_diffuse, {texcoord_left, texcoord_top} },
+			{ {q.right, q.top, 0.0f}, 1.0f, col_diffuse, {texcoord_right, texcoord_top} },
+			{ {q.left, q.bottom, 0.0f}, 1.0f, col_diffuse, {texcoord_left, texcoord_bottom} },
+			{ {q.right, q.bottom, 0.0f}, 1.0f, col_diffuse, {texcoord_right, texcoord_bottom} },
 		};
 		d3dd_DrawPrimitiveUP(ver, d3dd, D3DPT_TRIANGLESTRIP,
 			elementsof(verts) - 2, verts, sizeof(verts[0])
@@ -680,13 +1037,12 @@ bool tlnote_frame(d3d_version_t ver, IDirect3DDevice *d3dd)
 	// ------------
 
 	auto &env = tlnote_env();
-	auto tlr = &rendered[id_active];
 	auto region_unscaled = env.region();
 	float margin_x = (region_unscaled.w - tlr->tex_w);
 	region_unscaled.x += margin_x / 2.0f;
 	region_unscaled.w -= margin_x;
 
-	d3dd_SetTexture(ver, d3dd, 0, tlr->render(ver, d3dd));
+	d3dd_SetTexture(ver, d3dd, 0, tlr->tex);
 
 	auto age = now - time_birth;
 	float texcoord_y = 0.0f;
@@ -734,20 +1090,38 @@ bool tlnote_frame(d3d_version_t ver, IDirect3DDevice *d3dd)
 	auto tlr_quad = env.scale_to(res, region_unscaled);
 	auto tlr_col = D3DCOLOR_ARGB((uint8_t)(alpha * 255.0f), 0xFF, 0xFF, 0xFF);
 	render_textured_quad(tlr_quad, tlr_col, texcoord_y, texcoord_h);
-	d3dd_ApplyStateBlock(ver, d3dd, sb_game);
-	d3dd_DeleteStateBlock(ver, d3dd, sb_game);
 	return true;
 }
 
+HRESULT __stdcall tlnote_d3dd8_Reset(IDirect3DDevice *that, D3DPRESENT_PARAMETERS *pPresentationParameters)
+{
+	tlnote_sb.release(that);
+	frametime_reset(that);
+	return chain_d3dd8_Reset(that, pPresentationParameters);
+}
+
+HRESULT __stdcall tlnote_d3dd9_Reset(IDirect3DDevice *that, D3DPRESENT_PARAMETERS *pPresentationParameters)
+{
+	tlnote_sb.release(that);
+	frametime_reset(that);
+	return chain_d3dd9_Reset(that, pPresentationParameters);
+}
+
 HRESULT __stdcall tlnote_d3dd8_EndScene(IDirect3DDevice *that)
 {
+	framelimit_wait();
+	const LONGLONG detour_start = frametime_detour_start();
 	tlnote_frame(D3D8, that);
+	frametime_frame(D3D8, that, detour_start);
 	return chain_d3dd8_EndScene(that);
 }
 
 HRESULT __stdcall tlnote_d3dd9_EndScene(IDirect3DDevice *that)
 {
+	framelimit_wait();
+	const LONGLONG detour_start = frametime_detour_start();
 	tlnote_frame(D3D9, that);
+	frametime_frame(D3D9, that, detour_start);
 	return chain_d3dd9_EndScene(that);
 }
 /// -----------------------------------
@@ -782,7 +1156,9 @@ THCRAP_API tlnote_split_t tlnote_find(stringref_t text, bool inline_only)
 {
 	const char *p = text.str;
 	const char *sepchar_ptr = nullptr;
-	for(decltype(text.len) i = 0; i < text.len; i++) {
+	decltype(text.len) i = tlnote_codepoint_scan(text.str, text.len);
+	p += i;
+	for(; i < text.len; i++) {
 		if(*p == TLNOTE_INLINE) {
 			if(sepchar_ptr) {
 				tlnote_log.errorf(
@@ -826,7 +1202,10 @@ THCRAP_API tlnote_split_t tlnote_find(stringref_t text, bool inline_only)
 			}
 #undef FAIL_IF
 		}
-		p++;
+		// Skip ahead to the next codepoint we care about.
+		const auto skip = tlnote_codepoint_scan(p + 1, text.len - (i + 1));
+		p += skip + 1;
+		i += skip;
 	}
 	if(sepchar_ptr) {
 		tlnote_t tlnote = { { sepchar_ptr, (size_t)(p - sepchar_ptr) } };
@@ -854,12 +1233,19 @@ THCRAP_API tlnote_encoded_index_t tlnote_removal_index()
 extern "C" __declspec(dllexport) void tlnote_mod_detour(void)
 {
 	vtable_detour_t d3d8[] = {
+		{ 14, (void*)tlnote_d3dd8_Reset, (void**)&chain_d3dd8_Reset },
 		{ 35, (void*)tlnote_d3dd8_EndScene, (void**)&chain_d3dd8_EndScene },
 	};
 	vtable_detour_t d3d9[] = {
+		{ 16, (void*)tlnote_d3dd9_Reset, (void**)&chain_d3dd9_Reset },
 		{ 42, (void*)tlnote_d3dd9_EndScene, (void**)&chain_d3dd9_EndScene },
 	};
 	d3d8_device_detour(d3d8, elementsof(d3d8));
 	d3d9_device_detour(d3d9, elementsof(d3d9));
 }
+
+extern "C" __declspec(dllexport) void tlnote_mod_exit(void)
+{
+	tlnote_worker_stop();
+}
 /// ----------------
@@ -0,0 +1,172 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Trace events.
+  */
+
+#include "thcrap.h"
+#include <vector>
+
+struct trace_event_t {
+	std::string name;
+	std::string detail;
+	LONGLONG start;
+	LONGLONG end;
+	DWORD tid;
+	trace_category_t cat;
+};
+
+static const struct {
+	trace_category_t cat;
+	const char *name;
+} trace_categories[] = {
+	{ TRACE_INIT, "init" },
+	{ TRACE_FILE, "file" },
+	{ TRACE_HOOK, "hook" },
+	{ TRACE_BP, "bp" },
+	{ TRACE_REPATCH, "repatch" },
+	{ TRACE_UPDATE, "update" },
+};
+
+static std::vector<trace_event_t> trace_events;
+static bool trace_full = false;
+static SRWLOCK trace_srwlock = { SRWLOCK_INIT };
+
+// At roughly 100 bytes per event in memory and twice that in the JSON file,
+// this is as much as chrome://tracing can still open.
+static const size_t TRACE_EVENTS_MAX = 1000000;
+
+static LONGLONG trace_now(void)
+{
+	LARGE_INTEGER ret;
+	QueryPerformanceCounter(&ret);
+	return ret.QuadPart;
+}
+
+unsigned int trace_category_from_name(const char *name)
+{
+	if (name) {
+		for (const auto& category : trace_categories) {
+			if (!strcmp(category.name, name)) {
+				return category.cat;
+			}
+		}
+	}
+	return 0;
+}
+
+static const char* trace_category_name(trace_category_t cat)
+{
+	for (const auto& category : trace_categories) {
+		if (category.cat == cat) {
+			return category.name;
+		}
+	}
+	return "";
+}
+
+bool trace_event_enabled(trace_category_t cat)
+{
+	return (runconfig_trace_events_get() & cat) != 0;
+}
+
+LONGLONG trace_event_start(trace_category_t cat)
+{
+	return trace_event_enabled(cat) ? trace_now() : 0;
+}
+
+void trace_event_complete(trace_category_t cat, LONGLONG start, const char *name, const char *detail)
+{
+	if (!start) {
+		return;
+	}
+	const LONGLONG end = trace_now();
+	AcquireSRWLockExclusive(&trace_srwlock);
+	if (trace_events.size() < TRACE_EVENTS_MAX) {
+		trace_events.push_back({
+			name ? name : "", detail ? detail : "", start, end, GetCurrentThreadId(), cat
+		});
+	} else if (!trace_full) {
+		trace_full = true;
+		log_printf("(Trace) Event limit of %zu reached, ignoring all further events\n", TRACE_EVENTS_MAX);
+	}
+	ReleaseSRWLockExclusive(&trace_srwlock);
+}
+
+static void trace_json_escape(std::string& out, const std::string& str)
+{
+	for (unsigned char c : str) {
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if (c < 0x20) {
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				out += buf;
+			} else {
+				out += (char)c;
+			}
+		}
+	}
+}
+
+void trace_mod_exit(void)
+{
+	std::vector<trace_event_t> events;
+	AcquireSRWLockExclusive(&trace_srwlock);
+	events.swap(trace_events);
+	ReleaseSRWLockExclusive(&trace_srwlock);
+	if (events.empty()) {
+		return;
+	}
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	const double ticks_per_us = (double)freq.QuadPart / 1000000.0;
+	LONGLONG origin = events.front().start;
+	for (const auto& event : events) {
+		origin = MIN(origin, event.start);
+	}
+
+	// Written by hand, since building a jansson tree for a million events
+	// would need a multiple of the memory of the events themselves.
+	std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	const DWORD pid = GetCurrentProcessId();
+	for (size_t i = 0; i < events.size(); i++) {
+		const trace_event_t& event = events[i];
+		char buf[192];
+		json += "{\"name\":\"";
+		trace_json_escape(json, event.name);
+		snprintf(buf, sizeof(buf),
+			"\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%lu,\"tid\":%lu",
+			trace_category_name(event.cat),
+			(double)(event.start - origin) / ticks_per_us,
+			(double)(event.end - event.start) / ticks_per_us,
+			pid, event.tid
+		);
+		json += buf;
+		if (!event.detail.empty()) {
+			json += ",\"args\":{\"detail\":\"";
+			trace_json_escape(json, event.detail);
+			json += "\"}";
+		}
+		json += (i + 1 < events.size()) ? "},\n" : "}\n";
+	}
+	json += "]}\n";
+
+	const char *thcrap_dir = runconfig_thcrap_dir_get();
+	std::string fn = thcrap_dir ? std::string(thcrap_dir) + "/" : "";
+	fn += "logs/trace.json";
+	if (file_write(fn.c_str(), json.data(), json.size())) {
+		log_printf("(Trace) Couldn't write %s\n", fn.c_str());
+	} else {
+		log_printf("(Trace) Wrote %zu events to %s\n", events.size(), fn.c_str());
+	}
+}
@@ -0,0 +1,69 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Trace events.
+  * Records the duration of file resolutions, patch hooks, breakpoints,
+  * repatch cycles and update downloads, and writes them to logs/trace.json
+  * on exit, in the Chrome trace event format that can be opened in
+  * chrome://tracing or https://ui.perfetto.dev.
+  *
+  * Enabled with "trace_events" in the run configuration, either as true for
+  * all categories except breakpoints, or as an array of category names.
+  */
+
+#pragma once
+
+typedef enum {
+	TRACE_INIT = 1 << 0,
+	TRACE_FILE = 1 << 1,
+	TRACE_HOOK = 1 << 2,
+	// Every single breakpoint hit, which adds up quickly
+	TRACE_BP = 1 << 3,
+	TRACE_REPATCH = 1 << 4,
+	TRACE_UPDATE = 1 << 5,
+
+	TRACE_DEFAULT = TRACE_INIT | TRACE_FILE | TRACE_HOOK | TRACE_REPATCH | TRACE_UPDATE,
+} trace_category_t;
+
+// Returns the category called [name] ("init", "file", "hook", "bp",
+// "repatch" or "update"), or 0 if there is none.
+unsigned int trace_category_from_name(const char *name);
+
+// Returns true if events of [cat] are recorded.
+bool trace_event_enabled(trace_category_t cat);
+
+// Returns the start time of an event of [cat], to be passed to
+// trace_event_complete(), or 0 if [cat] isn't recorded.
+LONGLONG trace_event_start(trace_category_t cat);
+
+// Records an event from [start] until now. [detail] is optional and shows
+// up as an argument of the event. Does nothing if [start] is 0.
+void trace_event_complete(trace_category_t cat, LONGLONG start, const char *name, const char *detail);
+
+// Writes all recorded events to logs/trace.json.
+void trace_mod_exit(void);
+
+#ifdef __cplusplus
+}
+
+// Records an event for the lifetime of the object.
+struct trace_scope_t {
+	trace_category_t cat;
+	LONGLONG start;
+	const char *name;
+	const char *detail;
+
+	trace_scope_t(trace_category_t cat, const char *name, const char *detail = nullptr)
+		: cat(cat), start(trace_event_start(cat)), name(name), detail(detail) {}
+	~trace_scope_t() {
+		trace_event_complete(cat, start, name, detail);
+	}
+	trace_scope_t(const trace_scope_t&) = delete;
+	trace_scope_t& operator=(const trace_scope_t&) = delete;
+};
+
+extern "C" {
+#endif
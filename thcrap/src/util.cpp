@@ -137,3 +137,32 @@ int8_t hex_value(char c) {
 	if ((uint8_t)c < 6) return c + 10;
 	return -1;
 }
+
+struct parallel_for_job_t {
+	const std::function<void(size_t)> *func;
+	size_t count;
+	volatile LONG next;
+};
+
+static void parallel_for_worker(void *param)
+{
+	auto *job = (parallel_for_job_t*)param;
+	LONG i;
+	while ((size_t)(i = InterlockedIncrement(&job->next) - 1) < job->count) {
+		(*job->func)((size_t)i);
+	}
+}
+
+void parallel_for(size_t count, size_t max_threads, const std::function<void(size_t)> &func)
+{
+	parallel_for_job_t job = { &func, count, 0 };
+
+	task_group_t *group = task_group_create();
+	for (size_t i = 1; i < MIN(count, max_threads); i++) {
+		task_submit(TASK_PRIORITY_CRITICAL, group, parallel_for_worker, &job);
+	}
+	// The calling thread helps out, and does everything by itself if all
+	// workers are busy. Tasks that only start afterwards return right away.
+	parallel_for_worker(&job);
+	task_group_free(group);
+}
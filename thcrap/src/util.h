@@ -169,6 +169,12 @@ constexpr uint32_t TextInt(uint8_t c1, uint8_t c2 = 0, uint8_t c3 = 0, uint8_t c
 	return c4 << 24 | c3 << 16 | c2 << 8 | c1;
 }
 
+// Calls [func] once for every index in [0, count), spread over up to
+// [max_threads] threads including the calling one, and returns once all of
+// these calls have finished. The other threads are workers of the shared
+// task scheduler.
+void parallel_for(size_t count, size_t max_threads, const std::function<void(size_t)> &func);
+
 /// Geometry
 /// --------
 struct vector2_t {
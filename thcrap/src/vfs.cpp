@@ -9,33 +9,69 @@
 
 #include "thcrap.h"
 #include "vfs.h"
+#include "wildcard.h"
 #include <vector>
 
-typedef struct
+/**
+  * Generators are expensive, and jsonvfs_get() is called for every element
+  * of every resolved chain. The output of a generator is therefore kept for
+  * every file name it was called with, together with the jsondata versions
+  * of its input files. Since these versions are never modified after they
+  * have been published, a changed input is detected by simply comparing
+  * pointers, and the output is only generated again in that case.
+  *
+  * The only other file a generator reads is the map file of
+  * map_generator(), which is not part of [in_fns]. Changes to it are
+  * handled by jsonvfs_mod_repatch().
+  */
+struct jsonvfs_output_t
+{
+	json_t *json;
+	size_t size;
+	// jsondata_get() results for [in_fns] that [json] was generated from,
+	// in iteration order.
+	std::vector<json_t *> in_data;
+};
+
+struct jsonvfs_handler_t
 {
 	std::string out_pattern;
+	std::vector<wildcard_spec_t> out_specs;
 	std::unordered_set<std::string> in_fns;
 	jsonvfs_generator_t *gen;
-} jsonvfs_handler_t;
+	// Generated outputs, by normalized file name
+	std::unordered_map<std::string, jsonvfs_output_t> outputs;
+};
 
 static std::vector<jsonvfs_handler_t> vfs_handlers;
+// Protects the outputs of all handlers.
+static SRWLOCK vfs_outputs_srwlock = { SRWLOCK_INIT };
+// Incremented on every eviction, so that an output that was generated
+// while the map files were changing doesn't get stored.
+static size_t vfs_outputs_generation = 0;
+
+static void jsonvfs_handler_push(jsonvfs_handler_t &handler)
+{
+	handler.out_specs = wildcard_specs_compile(handler.out_pattern.c_str());
+	vfs_handlers.push_back(std::move(handler));
+	stack_json_cache_clear();
+}
 
 void jsonvfs_add(const std::string out_pattern, std::unordered_set<std::string> in_fns, jsonvfs_generator_t *gen)
 {
-	jsonvfs_handler_t handler {
-		out_pattern,
-		in_fns,
-		gen
-	};
-	size_t i = handler.out_pattern.find('\\');
-	while (i != std::string::npos) {
-		handler.out_pattern[i] = '/';
-		i = out_pattern.find('\\');
+	jsonvfs_handler_t handler;
+	handler.out_pattern = out_pattern;
+	handler.in_fns = in_fns;
+	handler.gen = gen;
+	for (auto& c : handler.out_pattern) {
+		if (c == '\\') {
+			c = '/';
+		}
 	}
 	for (auto& s : in_fns) {
 		jsondata_add(s.c_str());
 	}
-	vfs_handlers.push_back(handler);
+	jsonvfs_handler_push(handler);
 }
 
 void jsonvfs_game_add(const std::string out_pattern, std::unordered_set<std::string> in_fns, jsonvfs_generator_t *gen)
@@ -56,7 +92,54 @@ void jsonvfs_game_add(const std::string out_pattern, std::unordered_set<std::str
 	}
 	handler.gen = gen;
 
-	vfs_handlers.push_back(handler);
+	jsonvfs_handler_push(handler);
+}
+
+// Returns a new reference to the output of [handler] for [fn], generating
+// it if there is none or if any of its input files have changed.
+static json_t *jsonvfs_handler_get(jsonvfs_handler_t& handler, const char *fn, size_t *size)
+{
+	std::vector<json_t *> in_data;
+	in_data.reserve(handler.in_fns.size());
+	for (auto& s : handler.in_fns) {
+		in_data.push_back(jsondata_get(s.c_str()));
+	}
+
+	AcquireSRWLockShared(&vfs_outputs_srwlock);
+	auto it = handler.outputs.find(fn);
+	if (it != handler.outputs.end() && it->second.in_data == in_data) {
+		// The caller merges other files into the returned object.
+		json_t *ret = json_deep_copy(it->second.json);
+		*size = it->second.size;
+		ReleaseSRWLockShared(&vfs_outputs_srwlock);
+		return ret;
+	}
+	size_t generation = vfs_outputs_generation;
+	ReleaseSRWLockShared(&vfs_outputs_srwlock);
+
+	std::unordered_map<std::string, json_t *> in_map;
+	size_t i = 0;
+	for (auto& s : handler.in_fns) {
+		in_map[s] = in_data[i++];
+	}
+
+	jsonvfs_output_t output = {};
+	output.json = handler.gen(in_map, fn, &output.size);
+	output.in_data = std::move(in_data);
+	*size = output.size;
+	json_t *ret = json_deep_copy(output.json);
+
+	AcquireSRWLockExclusive(&vfs_outputs_srwlock);
+	if (generation == vfs_outputs_generation) {
+		auto& slot = handler.outputs[fn];
+		json_decref(slot.json);
+		slot = std::move(output);
+	}
+	else {
+		json_decref(output.json);
+	}
+	ReleaseSRWLockExclusive(&vfs_outputs_srwlock);
+	return ret;
 }
 
 json_t *jsonvfs_get(const std::string fn, size_t* size)
@@ -70,29 +153,74 @@ json_t *jsonvfs_get(const std::string fn, size_t* size)
 	strcpy(fn_normalized, fn.c_str());
 	str_slash_normalize(fn_normalized);
 	for (auto& handler : vfs_handlers) {
-		if (PathMatchSpec(fn_normalized, handler.out_pattern.c_str())) {
-			std::unordered_map<std::string, json_t *> in_data;
-			for (auto& s : handler.in_fns) {
-				in_data[s] = jsondata_get(s.c_str());
+		if (!wildcard_specs_match(handler.out_specs, fn_normalized, fn.length())) {
+			continue;
+		}
+		size_t cur_size = 0;
+		json_t *new_obj = jsonvfs_handler_get(handler, fn_normalized, &cur_size);
+		obj = json_object_merge_new(obj, new_obj);
+		if (size) {
+			*size += cur_size;
+		}
+	}
+
+	VLA_FREE(fn_normalized);
+	return obj;
+}
+
+void jsonvfs_mod_repatch(const json_t *files_changed)
+{
+	// Changes to input files are picked up by jsonvfs_handler_get() on its
+	// own. Map files, however, are named after the file they generate.
+	std::unordered_set<std::string> maps_changed;
+	const char *key;
+	json_t *val;
+	json_object_foreach((json_t *)files_changed, key, val) {
+		size_t len = strlen(key);
+		if (len > 4 && !stricmp(key + len - 4, ".map")) {
+			std::string out_fn(key, len - 4);
+			out_fn += ".jdiff";
+			for (auto& c : out_fn) {
+				c = wildcard_tolower(c == '\\' ? '/' : c);
 			}
+			maps_changed.insert(out_fn);
+		}
+	}
+	if (maps_changed.empty()) {
+		return;
+	}
 
-			size_t cur_size = 0;
-			json_t *new_obj = handler.gen(in_data, fn_normalized, &cur_size);
-			if (!obj) {
-				obj = new_obj;
+	AcquireSRWLockExclusive(&vfs_outputs_srwlock);
+	for (auto& handler : vfs_handlers) {
+		for (auto it = handler.outputs.begin(); it != handler.outputs.end(); ) {
+			std::string out_fn = it->first;
+			for (auto& c : out_fn) {
+				c = wildcard_tolower(c);
 			}
-			else {
-				json_object_merge(obj, new_obj);
-				json_decref(new_obj);
+			if (maps_changed.count(out_fn)) {
+				json_decref(it->second.json);
+				it = handler.outputs.erase(it);
 			}
-			if (size) {
-				*size += cur_size;
+			else {
+				++it;
 			}
 		}
 	}
+	vfs_outputs_generation++;
+	ReleaseSRWLockExclusive(&vfs_outputs_srwlock);
+}
 
-	VLA_FREE(fn_normalized);
-	return obj;
+void jsonvfs_mod_exit(void)
+{
+	AcquireSRWLockExclusive(&vfs_outputs_srwlock);
+	for (auto& handler : vfs_handlers) {
+		for (auto& it : handler.outputs) {
+			json_decref(it.second.json);
+		}
+		handler.outputs.clear();
+	}
+	vfs_outputs_generation++;
+	ReleaseSRWLockExclusive(&vfs_outputs_srwlock);
 }
 
 
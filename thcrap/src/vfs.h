@@ -49,4 +49,8 @@ extern "C" {
 
 	// Return a file from the vfs if it exists.
 	json_t *jsonvfs_get(const std::string fn, size_t* size);
+
+	// Drops the generated files whose map file has changed.
+	void jsonvfs_mod_repatch(const json_t *files_changed);
+	void jsonvfs_mod_exit(void);
 }
\ No newline at end of file
@@ -0,0 +1,126 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * Precompiled wildcard matching.
+  */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <string.h>
+
+// Wildcards are compiled into one of these per ';'-separated spec, keeping
+// PathMatchSpec()'s semantics: case-insensitive ASCII, and '?' matching a
+// single (UTF-8) character.
+struct wildcard_spec_t
+{
+	// Lowercase pattern. For suffix specs, this excludes the leading '*'.
+	std::string pattern;
+	bool suffix_only;
+};
+
+inline char wildcard_tolower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+inline const char* wildcard_utf8_char_next(const char *str)
+{
+	do {
+		++str;
+	} while ((*str & 0xC0) == 0x80);
+	return str;
+}
+
+inline bool wildcard_glob_match(const char *str, const char *pattern)
+{
+	const char *star_pattern = nullptr;
+	const char *star_str = nullptr;
+	while (*str) {
+		if (*pattern == '*') {
+			star_pattern = ++pattern;
+			star_str = str;
+		}
+		else if (*pattern == '?') {
+			str = wildcard_utf8_char_next(str);
+			++pattern;
+		}
+		else if (*pattern && *pattern == wildcard_tolower(*str)) {
+			++str;
+			++pattern;
+		}
+		else if (star_pattern) {
+			pattern = star_pattern;
+			str = star_str = wildcard_utf8_char_next(star_str);
+		}
+		else {
+			return false;
+		}
+	}
+	while (*pattern == '*') {
+		++pattern;
+	}
+	return !*pattern;
+}
+
+inline bool wildcard_spec_match(const wildcard_spec_t& spec, const char *fn, size_t fn_len)
+{
+	if (spec.suffix_only) {
+		const size_t len = spec.pattern.length();
+		if (fn_len < len) {
+			return false;
+		}
+		const char *tail = fn + fn_len - len;
+		for (size_t i = 0; i < len; i++) {
+			if (wildcard_tolower(tail[i]) != spec.pattern[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+	return wildcard_glob_match(fn, spec.pattern.c_str());
+}
+
+inline std::vector<wildcard_spec_t> wildcard_specs_compile(const char *wildcard)
+{
+	std::vector<wildcard_spec_t> specs;
+	while (*wildcard) {
+		while (*wildcard == ' ') {
+			wildcard++;
+		}
+		const char *end = strchr(wildcard, ';');
+		const size_t len = end ? end - wildcard : strlen(wildcard);
+		if (len) {
+			wildcard_spec_t spec;
+			for (size_t i = 0; i < len; i++) {
+				spec.pattern += wildcard_tolower(wildcard[i]);
+			}
+			// PathMatchSpec() special-cases this one to match everything
+			if (spec.pattern == "*.*") {
+				spec.pattern = "*";
+			}
+			spec.suffix_only = spec.pattern[0] == '*' && spec.pattern.find_first_of("*?", 1) == std::string::npos;
+			if (spec.suffix_only) {
+				spec.pattern.erase(0, 1);
+			}
+			specs.push_back(std::move(spec));
+		}
+		wildcard += len + (end != nullptr);
+	}
+	return specs;
+}
+
+// Returns true if [fn] matches any of the compiled [specs].
+inline bool wildcard_specs_match(const std::vector<wildcard_spec_t>& specs, const char *fn, size_t fn_len)
+{
+	for (const auto& spec : specs) {
+		if (wildcard_spec_match(spec, fn, fn_len)) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,84 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * XOR-based encryption kernels shared by the game support plugins.
+  */
+
+#include "thcrap.h"
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#include <intrin.h>
+#endif
+#include <emmintrin.h>
+
+#if defined(__GNUC__)
+# define XOR_CRYPT_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+# define XOR_CRYPT_TARGET_SSE2
+#endif
+
+// Both the linear and the triangular part of a progressive key repeat
+// after this many bytes.
+#define XOR_CRYPT_PROGRESSIVE_PERIOD 512
+
+static bool xor_crypt_sse2_supported(void)
+{
+	int data[4];
+	__cpuid(data, 0);
+	if(data[0] < 1) {
+		return false;
+	}
+	__cpuid(data, 1);
+	return data[3] & 1 << 26;
+}
+
+static const bool XOR_CRYPT_SSE2 = xor_crypt_sse2_supported();
+
+// XORs [data] with the repeating [stream] of [period] bytes, which must be
+// a multiple of 16.
+XOR_CRYPT_TARGET_SSE2 static void xor_crypt_stream(
+	uint8_t *data, size_t data_len, const uint8_t *stream, size_t period
+)
+{
+	size_t i = 0;
+	if(XOR_CRYPT_SSE2) {
+		size_t s = 0;
+		for(; (i + 16) <= data_len; i += 16) {
+			const __m128i k = _mm_loadu_si128((const __m128i *)(stream + s));
+			const __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+			_mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, k));
+			s += 16;
+			if(s == period) {
+				s = 0;
+			}
+		}
+	}
+	for(; i < data_len; i++) {
+		data[i] ^= stream[i % period];
+	}
+}
+
+void xor_crypt_byte(uint8_t *data, size_t data_len, uint8_t key)
+{
+	uint8_t key16[16];
+	memset(key16, key, sizeof(key16));
+	xor_crypt_stream(data, data_len, key16, sizeof(key16));
+}
+
+void xor_crypt_key16(uint8_t *data, size_t data_len, const uint8_t key[16])
+{
+	xor_crypt_stream(data, data_len, key, 16);
+}
+
+void xor_crypt_progressive(uint8_t *data, size_t data_len, uint8_t key, uint8_t step, uint8_t step2)
+{
+	uint8_t stream[XOR_CRYPT_PROGRESSIVE_PERIOD];
+	for(auto &k : stream) {
+		k = key;
+		key += step;
+		step += step2;
+	}
+	xor_crypt_stream(data, data_len, stream, sizeof(stream));
+}
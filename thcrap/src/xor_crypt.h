@@ -0,0 +1,22 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Main DLL
+  *
+  * ----
+  *
+  * XOR-based encryption kernels shared by the game support plugins.
+  * All of these are their own inverse.
+  */
+
+#pragma once
+
+// XORs every byte of [data] with [key].
+void xor_crypt_byte(uint8_t *data, size_t data_len, uint8_t key);
+
+// XORs [data] with the repeating 16-byte [key].
+void xor_crypt_key16(uint8_t *data, size_t data_len, const uint8_t key[16]);
+
+// XORs [data] with a key that starts at [key], and is incremented by a
+// step that starts at [step] and is itself incremented by [step2] after
+// every byte.
+void xor_crypt_progressive(uint8_t *data, size_t data_len, uint8_t key, uint8_t step, uint8_t step2);
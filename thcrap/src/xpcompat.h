@@ -47,11 +47,21 @@ THCRAP_API extern srwlock_func_t *srwlock_funcs[4];
 // kinda want to keep the macro part of this as small as possible.)
 // Passing a nullptr for these falls back on the default behavior: zeroing the
 // memory on creation, and doing nothing on destruction.
+//
+// Since these accessors are called on every hit of some of the hottest
+// breakpoints, existing instances are read straight from the TLS array in
+// the Thread Environment Block. This is exactly what TlsGetValue() does for
+// the first TLS_MINIMUM_AVAILABLE slots, minus the call and the
+// SetLastError() that comes with it, and works on every Windows version.
 #define THREAD_LOCAL(type, name, ctor, dtor) \
 	TLSSlot name; \
 	\
 	type* name##_get(void) \
 	{ \
+		void *ret = tls_slot_peek(name.slot); \
+		if(ret) { \
+			return (type *)ret; \
+		} \
 		return (type *)tlsstruct_get(name.slot, sizeof(type), (tlsstruct_ctor_t *)ctor); \
 	} \
 	\
@@ -67,6 +77,40 @@ typedef void tlsstruct_dtor_t(void *instance);
 THCRAP_API void* tlsstruct_get(DWORD slot, size_t struct_size, tlsstruct_ctor_t *ctor);
 THCRAP_API void tlsstruct_free(DWORD slot, tlsstruct_dtor_t *dtor);
 
+// Offset of TEB::TlsSlots.
+#ifdef _WIN64
+# define TEB_TLS_SLOTS_OFFSET 0x1480
+#else
+# define TEB_TLS_SLOTS_OFFSET 0xE10
+#endif
+
+// Returns the value of the TLS [slot] of the current thread, or nullptr if
+// it isn't set or is one of the expansion slots outside the TEB, which are
+// only reachable through TlsGetValue().
+inline void* tls_slot_peek(DWORD slot)
+{
+	if(slot >= TLS_MINIMUM_AVAILABLE) {
+		return nullptr;
+	}
+	return ((void **)((BYTE *)NtCurrentTeb() + TEB_TLS_SLOTS_OFFSET))[slot];
+}
+
+// Same as TlsGetValue() and TlsSetValue(), but without the call for the
+// slots in the TEB.
+inline void* tls_slot_get(DWORD slot)
+{
+	return slot < TLS_MINIMUM_AVAILABLE ? tls_slot_peek(slot) : TlsGetValue(slot);
+}
+
+inline void tls_slot_set(DWORD slot, void *value)
+{
+	if(slot >= TLS_MINIMUM_AVAILABLE) {
+		TlsSetValue(slot, value);
+		return;
+	}
+	((void **)((BYTE *)NtCurrentTeb() + TEB_TLS_SLOTS_OFFSET))[slot] = value;
+}
+
 struct TLSSlot {
 	DWORD slot = TlsAlloc();
 
@@ -9,6 +9,9 @@
 
 #include "thcrap.h"
 #include <zlib.h>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 /**
   * Zip is a bad format. It may have had its benefits in the age of MS-DOS and
@@ -40,8 +43,6 @@
   * exactly common either.
   */
 
-#define DEFLATE_CHUNK 16384
-
 /// Zip structures
 /// --------------
 #define ZIP_MAGIC_FILE 0x04034b50
@@ -131,69 +132,72 @@ typedef struct {
 } zip_file_info_t;
 // ----
 
-// Readability.
-DWORD TellFilePointer(HANDLE hFile)
-{
-	return SetFilePointer(hFile, 0, NULL, FILE_CURRENT);
-}
+// Central directory index entry. Everything here has been bounds-checked
+// against the mapped archive when building the index.
+typedef struct {
+	// Offset of the central directory record
+	uint32_t dir_offset;
+	// Offset of the (compressed) file data, after the local file header
+	uint32_t data_offset;
+	uint32_t size_compressed;
+	uint32_t size_uncompressed;
+	uint16_t compression;
+} zip_entry_t;
+
+// Names point straight into the central directory of the mapped archive.
+struct zip_index_t {
+	std::vector<std::pair<std::string_view, zip_entry_t>> entries;
+	std::unordered_map<std::string_view, size_t> by_name;
+};
 
 /// Compression methods
 /// -------------------
-typedef int (*zip_comp_func_t)(void *buf, HANDLE hArc, zip_file_info_t *file);
+typedef int (*zip_comp_func_t)(void *buf, const BYTE *src, const zip_entry_t *entry);
 
-static int zip_file_copy(void *buf, HANDLE hArc, zip_file_info_t *file)
+static int zip_file_copy(void *buf, const BYTE *src, const zip_entry_t *entry)
 {
-	DWORD byte_ret;
-	if(!file || !buf || file->size_compressed != file->size_uncompressed) {
+	if(!entry || !buf || entry->size_compressed != entry->size_uncompressed) {
 		return -1;
 	}
-	return ReadFile(hArc, buf, file->size_uncompressed, &byte_ret, NULL) == 0;
+	memcpy(buf, src, entry->size_uncompressed);
+	return 0;
 }
 
-static int zip_file_inflate(void *buf, HANDLE hArc, zip_file_info_t *file)
+static int zip_file_inflate(void *buf, const BYTE *src, const zip_entry_t *entry)
 {
 	int ret;
 	z_stream strm;
-	BYTE in[DEFLATE_CHUNK];
-	if(!file || !buf) {
+	if(!entry || !buf) {
 		return -1;
 	}
 
 	strm.zalloc = NULL;
 	strm.zfree = NULL;
 	strm.opaque = NULL;
-	strm.avail_in = 0;
+	strm.next_in = (BYTE*)src;
+	strm.avail_in = entry->size_compressed;
 	strm.next_out = (BYTE*)buf;
-	strm.avail_out = file->size_uncompressed;
+	strm.avail_out = entry->size_uncompressed;
 	// Use inflateInit2 with negative window bits to indicate raw data
 	// (http://codeandlife.com/2014/01/01/unzip-library-for-c/)
 	ret = inflateInit2(&strm, -MAX_WBITS);
 	if(ret != Z_OK) {
 		return ret;
 	}
-	do {
-		DWORD byte_ret;
-		ReadFile(hArc, in, DEFLATE_CHUNK, &byte_ret, NULL);
-		if(!byte_ret) {
-			ret = Z_ERRNO;
-			break;
-		}
-		strm.avail_in = byte_ret;
-		strm.next_in = in;
-		ret = inflate(&strm, Z_NO_FLUSH);
-		if(ret != Z_OK) {
-			break;
-		}
-	} while(ret != Z_STREAM_END);
+	// Both buffers are complete, so this either finishes in one go or fails.
+	ret = inflate(&strm, Z_FINISH);
+	if(ret == Z_STREAM_END && strm.total_out != entry->size_uncompressed) {
+		ret = Z_DATA_ERROR;
+	}
 	inflateEnd(&strm);
-	return ret == Z_STREAM_END ? Z_OK : ret;
+	return ret == Z_STREAM_END ? Z_OK : (ret == Z_OK ? Z_BUF_ERROR : ret);
 }
 /// -------------------
 
 /// File data
 /// ---------
 // Updates [file] with the data from [s].
-static int zip_file_info_set(zip_file_info_t *file, zip_file_shared_t *s)
+static int zip_file_info_set(zip_file_info_t *file, const zip_file_shared_t *s)
 {
 	if(!file || !s) {
 		return -1;
@@ -209,18 +213,21 @@ static int zip_file_info_set(zip_file_info_t *file, zip_file_shared_t *s)
 	return 0;
 }
 
-static void zip_file_extra_parse(zip_file_info_t *file, const char *buf, size_t len)
+static void zip_file_extra_parse(zip_file_info_t *file, const BYTE *buf, size_t len)
 {
 	assert(file);
 	assert(buf);
 
 	auto p = buf;
-	while(p < buf + len) {
-		const auto extra = (zip_extra_t *)p;
+	while(p + sizeof(zip_extra_t) <= buf + len) {
+		const auto extra = (const zip_extra_t *)p;
 		p += sizeof(zip_extra_t);
+		if(extra->len > buf + len - p) {
+			break;
+		}
 
 		if(extra->id == ZIP_EXTRA_NTFS && extra->len >= sizeof(zip_extra_ntfs1_t)) {
-			const auto ntfs = (zip_extra_ntfs1_t *)p;
+			const auto ntfs = (const zip_extra_ntfs1_t *)p;
 			if(ntfs->tag == ZIP_EXTRA_NTFS_TAG && ntfs->tag_size == 24) {
 				file->ctime = ntfs->ctime;
 				file->mtime = ntfs->mtime;
@@ -231,100 +238,67 @@ static void zip_file_extra_parse(zip_file_info_t *file, const char *buf, size_t
 	}
 }
 
-static int zip_file_extra_read(zip_file_info_t *file, zip_t *zip, int extra_len)
+// Returns the index entry of [fn] in [zip], or NULL if there is none.
+static const zip_entry_t* zip_entry_get(zip_t *zip, const char *fn)
 {
-	assert(file);
-	assert(zip);
-
-	VLA(char, extra_buf, extra_len);
-	DWORD byte_ret;
-	int ret = W32_ERR_WRAP(ReadFile(
-		zip->hArc, extra_buf, extra_len, &byte_ret, NULL
-	));
-	if(!ret) {
-		zip_file_extra_parse(file, extra_buf, byte_ret);
+	if(!zip || !zip->index || !fn) {
+		return NULL;
 	}
-	VLA_FREE(extra_buf);
-	return 0;
-}
-
-// Seeks [zip->hArc] to the central directory record of [fn] in [zip].
-static int zip_file_seek(zip_t *zip, const char *fn)
-{
-	int ret = -1;
-	if(zip && fn) {
-		json_t *offset_json = json_object_get(zip->files, fn);
-		ret = 1;
-		if(json_is_integer(offset_json)) {
-			json_int_t pos = json_integer_value(offset_json);
-			ret = SetFilePointer(
-				zip->hArc, (LONG)pos, NULL, FILE_BEGIN
-			) == INVALID_SET_FILE_POINTER ? GetLastError() : 0;
-		}
+	auto it = zip->index->by_name.find(fn);
+	if(it == zip->index->by_name.end()) {
+		return NULL;
 	}
-	return ret;
+	return &zip->index->entries[it->second].second;
 }
 
-// Fills [file] with all the necessary information to unzip [fn] from [zip].
-// Seeks the file to the beginning of the zipped data.
-static int zip_file_prepare(zip_file_info_t *file, zip_t *zip, const char *fn)
+// Fills [file] with the timestamps and sizes of [entry], prioritizing the
+// local file header over the central directory record, as always.
+static void zip_file_info_get(zip_file_info_t *file, zip_t *zip, const zip_entry_t *entry)
 {
-	int ret = -1;
-	if(file && !zip_file_seek(zip, fn)) {
-		DWORD byte_ret;
-		zip_dir_t zd;
-		zip_file_t zf;
-		ZeroMemory(file, sizeof(zip_file_info_t));
-		if(
-			ReadFile(zip->hArc, &zd, sizeof(zd), &byte_ret, NULL)
-			&& zd.sig == ZIP_MAGIC_DIR
-			&& zd.offset_header != 0xffffffff
-		) {
-			zip_file_info_set(file, &zd.s);
-			SetFilePointer(zip->hArc, zd.s.fn_len, NULL, FILE_CURRENT);
-			zip_file_extra_read(file, zip, zd.s.extra_len);
-			SetFilePointer(zip->hArc, zd.offset_header, NULL, FILE_BEGIN);
-		} else {
-			return 1;
-		}
-		ret = !(
-			ReadFile(zip->hArc, &zf, sizeof(zf), &byte_ret, NULL)
-			&& zf.sig == ZIP_MAGIC_FILE
-		);
-		if(!ret) {
-			zip_file_info_set(file, &zf.s);
-			SetFilePointer(zip->hArc, zf.s.fn_len, NULL, FILE_CURRENT);
-			zip_file_extra_read(file, zip, zf.s.extra_len);
-		}
-	}
-	return ret;
+	const auto zd = (const zip_dir_t *)(zip->view + entry->dir_offset);
+	const BYTE *zd_extra = (const BYTE *)(zd + 1) + zd->s.fn_len;
+	ZeroMemory(file, sizeof(zip_file_info_t));
+	zip_file_info_set(file, &zd->s);
+	zip_file_extra_parse(file, zd_extra, zd->s.extra_len);
+
+	const auto zf = (const zip_file_t *)(zip->view + zd->offset_header);
+	const BYTE *zf_extra = (const BYTE *)(zf + 1) + zf->s.fn_len;
+	zip_file_info_set(file, &zf->s);
+	zip_file_extra_parse(file, zf_extra, zf->s.extra_len);
+
+	file->offset = entry->data_offset;
+	file->compression = entry->compression;
+	file->size_compressed = entry->size_compressed;
+	file->size_uncompressed = entry->size_uncompressed;
 }
 /// ---------
 
 /// Decompression helpers
 /// ---------------------
-static void* zip_file_decompress(zip_file_info_t *file, zip_t *zip, const char *fn)
+static int zip_entry_decompress(void *buf, zip_t *zip, const zip_entry_t *entry)
+{
+	zip_comp_func_t comp_func = NULL;
+	switch(entry->compression) {
+		case 0:
+			comp_func = zip_file_copy;
+			break;
+		case Z_DEFLATED:
+			comp_func = zip_file_inflate;
+			break;
+	}
+	if(!comp_func) {
+		log_func_printf("Unsupported compression method (%d)\n", entry->compression);
+		return 1;
+	}
+	return comp_func(buf, zip->view + entry->data_offset, entry);
+}
+
+static void* zip_file_decompress(zip_t *zip, const zip_entry_t *entry)
 {
 	void *file_buffer = NULL;
-	if(!zip_file_prepare(file, zip, fn) && file->size_uncompressed) {
-		int ret = 0;
-		zip_comp_func_t comp_func = NULL;
-		file_buffer = malloc(file->size_uncompressed);
-		switch(file->compression) {
-			case 0:
-				comp_func = zip_file_copy;
-				break;
-			case Z_DEFLATED:
-				comp_func = zip_file_inflate;
-				break;
-		}
-		if(comp_func) {
-			ret = comp_func(file_buffer, zip->hArc, file);
-		} else {
-			log_func_printf("Unsupported compression method (%d)\n", file->compression);
-			ret = 1;
-		}
-		if(ret) {
+	if(entry && entry->size_uncompressed) {
+		file_buffer = malloc(entry->size_uncompressed);
+		if(file_buffer && zip_entry_decompress(file_buffer, zip, entry)) {
 			SAFE_FREE(file_buffer);
 		}
 	}
@@ -334,114 +308,114 @@ static void* zip_file_decompress(zip_file_info_t *file, zip_t *zip, const char *
 
 /// Indexing helpers
 /// ----------------
-// Adds an individual zipped file to the index.
-// Expects the file name at the current file pointer of [zip->hArc].
-static int zip_file_add(zip_t *zip, zip_file_shared_t *zf, json_int_t offset)
+// Returns true if [len] bytes starting at [offset] lie within [zip]'s view.
+static bool zip_range_valid(const zip_t *zip, size_t offset, size_t len)
 {
-	int ret = -1;
-	if(zip && zf) {
-		DWORD byte_ret;
-		VLA(char, fn, zf->fn_len + 1);
-		ReadFile(zip->hArc, fn, zf->fn_len, &byte_ret, NULL);
-		fn[zf->fn_len] = 0;
-		SetFilePointer(zip->hArc, zf->extra_len, NULL, FILE_CURRENT);
-		if(zf->fn_len) {
-			if(zf->size_compressed != 0) {
-				json_object_set_new(zip->files, fn, json_integer(offset));
-			} else {
-				char last = fn[zf->fn_len - 1];
-				if(last != '/' && last != '\\') {
-					json_array_append_new(zip->files_empty, json_string(fn));
-				}
-			}
-		}
-		VLA_FREE(fn);
-		ret = 0;
-	}
-	return ret;
+	return offset <= zip->view_len && len <= zip->view_len - offset;
 }
 
-// Adds an individual zipped file from the central directory at [zip->hArc]'s
-// file pointer to the index.
-int zip_file_add_from_dir(zip_t *zip)
+// Adds the central directory record at [*offset] to the index and advances
+// [*offset] to the next one.
+static int zip_file_add_from_dir(zip_t *zip, size_t *offset)
 {
-	int ret = -1;
-	if(zip) {
-		zip_dir_t dir = {};
-		DWORD byte_ret = 0;
-		json_int_t offset = TellFilePointer(zip->hArc);
-		ret = 1;
-		if(
-			ReadFile(zip->hArc, &dir, sizeof(dir), &byte_ret, NULL)
-			&& dir.sig == ZIP_MAGIC_DIR
-		) {
-			ret = zip_file_add(zip, &dir.s, offset);
-			SetFilePointer(zip->hArc, dir.cmt_len, NULL, FILE_CURRENT);
+	const size_t dir_offset = *offset;
+	if(!zip_range_valid(zip, dir_offset, sizeof(zip_dir_t))) {
+		return 1;
+	}
+	const auto zd = (const zip_dir_t *)(zip->view + dir_offset);
+	const size_t zd_len = sizeof(zip_dir_t) + zd->s.fn_len + zd->s.extra_len + zd->cmt_len;
+	if(zd->sig != ZIP_MAGIC_DIR || !zip_range_valid(zip, dir_offset, zd_len)) {
+		return 1;
+	}
+	*offset += zd_len;
+
+	std::string_view fn((const char *)(zd + 1), zd->s.fn_len);
+	if(fn.empty()) {
+		return 0;
+	}
+	if(zd->s.size_compressed == 0) {
+		char last = fn.back();
+		if(last != '/' && last != '\\') {
+			json_array_append_new(zip->files_empty, json_stringn(fn.data(), fn.length()));
 		}
+		return 0;
 	}
-	return ret;
+
+	// Files that can't be unzipped are simply left out of the index.
+	if(
+		zd->offset_header == 0xffffffff
+		|| !zip_range_valid(zip, zd->offset_header, sizeof(zip_file_t))
+	) {
+		return 0;
+	}
+	const auto zf = (const zip_file_t *)(zip->view + zd->offset_header);
+	if(zf->sig != ZIP_MAGIC_FILE) {
+		return 0;
+	}
+	// The local header doesn't know the sizes if they follow the data in a
+	// data descriptor.
+	const zip_file_shared_t *s = (zf->s.flag & 0x8) ? &zd->s : &zf->s;
+	const size_t zf_len = sizeof(zip_file_t) + zf->s.fn_len + zf->s.extra_len;
+	if(
+		!zip_range_valid(zip, zd->offset_header, zf_len)
+		|| !zip_range_valid(zip, zd->offset_header + zf_len, s->size_compressed)
+	) {
+		return 0;
+	}
+	zip_entry_t entry;
+	entry.dir_offset = (uint32_t)dir_offset;
+	entry.data_offset = (uint32_t)(zd->offset_header + zf_len);
+	entry.compression = zf->s.compression;
+	entry.size_compressed = s->size_compressed;
+	entry.size_uncompressed = s->size_uncompressed;
+
+	auto inserted = zip->index->by_name.emplace(fn, zip->index->entries.size());
+	if(inserted.second) {
+		zip->index->entries.emplace_back(fn, entry);
+	} else {
+		zip->index->entries[inserted.first->second].second = entry;
+	}
+	return 0;
 }
 
 // Locates the end of central directory record in the ZIP file and optionally
 // copies it to [end]. Also stores the archive comment in [zip].
 static size_t zip_dir_end_prepare(zip_dir_end_t *dir_end, zip_t *zip)
 {
-	size_t read_back = 0;
-	const int ZDE_SIZE = sizeof(zip_dir_end_t);
-	DWORD zip_size;
-	size_t CMT_MAX;
-	if(!zip) {
+	const size_t ZDE_SIZE = sizeof(zip_dir_end_t);
+	const size_t zip_size = zip ? zip->view_len : 0;
+	if(zip_size < ZDE_SIZE) {
 		return SIZE_MAX;
 	}
-	zip_size = SetFilePointer(zip->hArc, 0, NULL, FILE_END);
 	// ZIP comments have a maximum size of 64K
-	CMT_MAX = MIN(zip_size, 0xffff);
-	do {
-		DWORD byte_ret;
-		BYTE test[sizeof(zip_dir_end_t) * 2];
-		int step = sizeof(test);
-		int i = 0;
-
-		SetFilePointer(zip->hArc, -step, NULL, FILE_CURRENT);
-		ReadFile(zip->hArc, test, step, &byte_ret, NULL);
-		read_back += byte_ret;
-		for(i = 0; i <= step - ZDE_SIZE; i++) {
-			// Verification.
-			// Note that we check the offset and its length separately,
-			// because the addition might overflow.
-			zip_dir_end_t *end = (zip_dir_end_t*)(test + i);
-			if(
-				(end->sig == ZIP_MAGIC_DIR_END)
-				&& (end->cmt_len <= read_back - i - ZDE_SIZE)
-				&& (end->dir_start_offset < zip_size)
-				&& (end->dir_start_offset + end->dir_len < zip_size)
-			) {
-				size_t end_pos = zip_size - read_back + i;
-				if(end->disk_num != 0 || end->dir_start_disk != 0) {
-					log_func_printf("Multi-part archives are unsupported\n");
-					return SIZE_MAX;
-				}
-				if(dir_end) {
-					memcpy(dir_end, end, ZDE_SIZE);
-				}
-				// Load the archive comment.
-				// Yeah, it's stylistically questionable to shove in this functionality
-				// here, but I'm *really* not in the mood for another round of checks...
-				SetFilePointer(zip->hArc, end_pos + ZDE_SIZE, NULL, FILE_BEGIN);
-				zip->cmt_len = end->cmt_len;
-				if(end->cmt_len) {
-					zip->cmt = (BYTE *)malloc(end->cmt_len);
-					ReadFile(zip->hArc, zip->cmt, end->cmt_len, &byte_ret, NULL);
-				}
-				return end_pos;
+	const size_t search_start = zip_size - ZDE_SIZE - MIN(zip_size - ZDE_SIZE, (size_t)0xffff);
+	for(size_t i = zip_size - ZDE_SIZE + 1; i-- > search_start; ) {
+		// Verification.
+		// Note that we check the offset and its length separately,
+		// because the addition might overflow.
+		const auto end = (const zip_dir_end_t*)(zip->view + i);
+		if(
+			(end->sig == ZIP_MAGIC_DIR_END)
+			&& (end->cmt_len <= zip_size - i - ZDE_SIZE)
+			&& (end->dir_start_offset < zip_size)
+			&& (end->dir_len < zip_size - end->dir_start_offset)
+		) {
+			if(end->disk_num != 0 || end->dir_start_disk != 0) {
+				log_func_printf("Multi-part archives are unsupported\n");
+				return SIZE_MAX;
+			}
+			if(dir_end) {
+				memcpy(dir_end, end, ZDE_SIZE);
 			}
+			zip->cmt_len = end->cmt_len;
+			zip->cmt = end->cmt_len ? zip->view + i + ZDE_SIZE : NULL;
+			return i;
 		}
-		SetFilePointer(zip->hArc, -step, NULL, FILE_CURRENT);
-	} while(read_back < CMT_MAX);
+	}
 	return SIZE_MAX;
 }
 
-// Fills [zip->files] with pointers to all the files in the archive.
+// Builds [zip->index] from the central directory.
 static int zip_prepare(zip_t *zip)
 {
 	zip_dir_end_t dir_end;
@@ -450,7 +424,6 @@ static int zip_prepare(zip_t *zip)
 	if(!zip) {
 		return -1;
 	}
-	json_object_clear(zip->files);
 	end_pos = zip_dir_end_prepare(&dir_end, zip);
 	if(end_pos == SIZE_MAX) {
 		log_func_printf(
@@ -458,12 +431,13 @@ static int zip_prepare(zip_t *zip)
 		);
 		return 1;
 	}
-	SetFilePointer(zip->hArc, dir_end.dir_start_offset, NULL, FILE_BEGIN);
+	size_t offset = dir_end.dir_start_offset;
+	zip->index->entries.reserve(dir_end.dir_num_total);
+	zip->index->by_name.reserve(dir_end.dir_num_total);
 	for(i = 0; i < dir_end.dir_num_total; i++) {
-		if(zip_file_add_from_dir(zip) != 0) {
+		if(zip_file_add_from_dir(zip, &offset) != 0) {
 			log_func_printf(
-				"Invalid ZIP directory entry at offset 0x%08x\n",
-				TellFilePointer(zip->hArc)
+				"Invalid ZIP directory entry at offset 0x%08x\n", (unsigned int)offset
 			);
 			return 2;
 		}
@@ -476,7 +450,18 @@ static int zip_prepare(zip_t *zip)
 /// ----------
 json_t* zip_list(zip_t *zip)
 {
-	return zip ? zip->files : NULL;
+	if(!zip) {
+		return NULL;
+	}
+	// Only built on demand, since nothing else needs it.
+	if(!zip->files) {
+		zip->files = json_object();
+		for(const auto& it : zip->index->entries) {
+			std::string fn(it.first);
+			json_object_set_new(zip->files, fn.c_str(), json_integer(it.second.dir_offset));
+		}
+	}
+	return zip->files;
 }
 
 json_t* zip_list_empty(zip_t *zip)
@@ -486,7 +471,7 @@ json_t* zip_list_empty(zip_t *zip)
 
 const BYTE* zip_comment(zip_t *zip, size_t *cmt_len)
 {
-	BYTE *ret = NULL;
+	const BYTE *ret = NULL;
 	if(zip && cmt_len) {
 		ret = zip->cmt;
 		*cmt_len = zip->cmt_len;
@@ -494,13 +479,47 @@ const BYTE* zip_comment(zip_t *zip, size_t *cmt_len)
 	return ret;
 }
 
+size_t zip_file_size(zip_t *zip, const char *fn)
+{
+	const zip_entry_t *entry = zip_entry_get(zip, fn);
+	return entry ? entry->size_uncompressed : 0;
+}
+
+const void* zip_file_view(zip_t *zip, const char *fn, size_t *file_size)
+{
+	const zip_entry_t *entry = zip_entry_get(zip, fn);
+	if(
+		!entry
+		|| entry->compression != 0
+		|| entry->size_compressed != entry->size_uncompressed
+	) {
+		return NULL;
+	}
+	if(file_size) {
+		*file_size = entry->size_uncompressed;
+	}
+	return zip->view + entry->data_offset;
+}
+
+int zip_file_load_into(zip_t *zip, const char *fn, void *buf, size_t buf_size)
+{
+	const zip_entry_t *entry = zip_entry_get(zip, fn);
+	if(!entry || !buf) {
+		return -1;
+	}
+	if(buf_size < entry->size_uncompressed) {
+		return 1;
+	}
+	return zip_entry_decompress(buf, zip, entry);
+}
+
 void* zip_file_load(zip_t *zip, const char *fn, size_t *file_size)
 {
-	zip_file_info_t file = {};
 	void *ret = NULL;
 	if(file_size) {
-		ret = zip_file_decompress(&file, zip, fn);
-		*file_size = file.size_uncompressed;
+		const zip_entry_t *entry = zip_entry_get(zip, fn);
+		ret = zip_file_decompress(zip, entry);
+		*file_size = entry ? entry->size_uncompressed : 0;
 	}
 	return ret;
 }
@@ -509,9 +528,16 @@ int zip_file_unzip(zip_t *zip, const char *fn)
 {
 	int ret = -1;
 	zip_file_info_t file = {};
-	void* file_buffer = zip_file_decompress(&file, zip, fn);
-	if(file_buffer && dir_create_for_fn(fn) >= 0) {
+	const zip_entry_t *entry = zip_entry_get(zip, fn);
+	// Stored files are written straight from the mapped archive.
+	const void *file_data = zip_file_view(zip, fn, NULL);
+	void *file_buffer = NULL;
+	if(!file_data) {
+		file_data = file_buffer = zip_file_decompress(zip, entry);
+	}
+	if(file_data && dir_create_for_fn(fn) >= 0) {
 		DWORD byte_ret;
+		zip_file_info_get(&file, zip, entry);
 		HANDLE handle = CreateFile(
 			fn, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
 			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL
@@ -520,7 +546,7 @@ int zip_file_unzip(zip_t *zip, const char *fn)
 		if(!ret) {
 			SetFileTime(handle, &file.ctime, &file.atime, &file.mtime);
 			ret = W32_ERR_WRAP(WriteFile(
-				handle, file_buffer, file.size_uncompressed, &byte_ret, NULL
+				handle, file_data, file.size_uncompressed, &byte_ret, NULL
 			));
 			CloseHandle(handle);
 		}
@@ -537,24 +563,49 @@ zip_t* zip_open(const char *fn)
 		return NULL;
 	}
 	// Disabling FILE_SHARE_WRITE until we've figured out ZIP repatching...
+	// (The mapping also relies on nobody truncating the file under us.)
 	hArc = CreateFile(
 		fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
 		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL
 	);
-	if(hArc != INVALID_HANDLE_VALUE) {
-		ret = (zip_t *)malloc(sizeof(zip_t));
-		if(!ret) {
-			return NULL;
-		}
-		ret->hArc = hArc;
-		ret->files = json_object();
-		ret->files_empty = json_array();
-		ret->cmt_len = 0;
-		ret->cmt = NULL;
-		log_printf("(Zip) Preparing %s...\n", fn);
-		if(zip_prepare(ret)) {
-			ret = zip_close(ret);
-		}
+	if(hArc == INVALID_HANDLE_VALUE) {
+		return NULL;
+	}
+	LARGE_INTEGER arc_size;
+	HANDLE hMap = NULL;
+	if(
+		GetFileSizeEx(hArc, &arc_size)
+		&& arc_size.QuadPart > 0
+		&& arc_size.QuadPart <= 0xffffffff
+	) {
+		hMap = CreateFileMapping(hArc, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+	BYTE *view = hMap ? (BYTE *)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if(hMap) {
+		// The view keeps the mapping alive.
+		CloseHandle(hMap);
+	}
+	if(!view) {
+		CloseHandle(hArc);
+		return NULL;
+	}
+	ret = (zip_t *)malloc(sizeof(zip_t));
+	if(!ret) {
+		UnmapViewOfFile(view);
+		CloseHandle(hArc);
+		return NULL;
+	}
+	ret->hArc = hArc;
+	ret->view = view;
+	ret->view_len = (size_t)arc_size.QuadPart;
+	ret->index = new zip_index_t;
+	ret->files = NULL;
+	ret->files_empty = json_array();
+	ret->cmt_len = 0;
+	ret->cmt = NULL;
+	log_printf("(Zip) Preparing %s...\n", fn);
+	if(zip_prepare(ret)) {
+		ret = zip_close(ret);
 	}
 	return ret;
 }
@@ -562,9 +613,10 @@ zip_t* zip_open(const char *fn)
 zip_t* zip_close(zip_t *zip)
 {
 	if(zip) {
-		SAFE_FREE(zip->cmt);
+		delete zip->index;
 		json_decref(zip->files_empty);
 		json_decref(zip->files);
+		UnmapViewOfFile(zip->view);
 		CloseHandle(zip->hArc);
 		SAFE_FREE(zip);
 	}
@@ -9,17 +9,26 @@
 
 #pragma once
 
+struct zip_index_t;
+
 // TODO: This shouldn't be publicly visible
 typedef struct {
+	// Built on the first call to zip_list()
 	json_t *files;
 	json_t *files_empty;
 	HANDLE hArc;
-	BYTE *cmt;
+	// Read-only view of the whole archive
+	const BYTE *view;
+	size_t view_len;
+	struct zip_index_t *index;
+	// Points into [view]
+	const BYTE *cmt;
 	size_t cmt_len;
 } zip_t;
 
 // Returns a JSON object that maps the names of all non-empty files in [zip]
-// to the position of their file header.
+// to the position of their file header. Prefer the functions below for
+// accessing individual files, which don't involve JSON at all.
 json_t* zip_list(zip_t *zip);
 
 // Returns a JSON array containing the names of all empty files in [zip].
@@ -28,12 +37,26 @@ json_t* zip_list_empty(zip_t *zip);
 // Returns the archive comment.
 const BYTE* zip_comment(zip_t *zip, size_t *cmt_len);
 
+// Returns the uncompressed size of [fn] in [zip], or 0 if [zip] doesn't
+// contain a non-empty file with that name.
+size_t zip_file_size(zip_t *zip, const char *fn);
+
+// Returns a pointer to the contents of [fn] directly inside the mapped
+// archive, and its size in [file_size]. Only works for stored
+// (uncompressed) files, and returns NULL for everything else. The pointer
+// is valid until [zip] is closed.
+const void* zip_file_view(zip_t *zip, const char *fn, size_t *file_size);
+
+// Unzips [fn] in [zip] to [buf], which must be at least
+// zip_file_size(zip, fn) bytes large. Returns 0 on success.
+int zip_file_load_into(zip_t *zip, const char *fn, void *buf, size_t buf_size);
+
 // Unzips [fn] in [zip] to a newly created buffer and returns its file size in
 // [file_size]. Return value has to be free()d by the caller!
 void* zip_file_load(zip_t *zip, const char *fn, size_t *file_size);
 
 // Unzips [fn] in [zip] to the current directory while preserving the original
-// timestamp.
+// timestamp. Safe to call for different files of [zip] from several threads.
 int zip_file_unzip(zip_t *zip, const char *fn);
 
 zip_t* zip_open(const char *fn);
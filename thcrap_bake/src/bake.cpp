@@ -0,0 +1,199 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Pre-bake tool
+  *
+  * ----
+  *
+  * Usage: thcrap_bake <run configuration> <game exe> <extracted files>
+  *	[--out=file] [--threads=n] [--compress]
+  *
+  * Runs every file in the directory of extracted game files through the
+  * same replacement and patch hook pipeline that file_rep_init() and
+  * file_rep_hooks_run() use at runtime, and writes every file that the
+  * stack changes into a pre-baked patch pack, together with a manifest of
+  * the game, build and patch stack. Setting the run configuration's
+  * "prebaked" value to the resulting pack then serves these files without
+  * running any hooks. The pack has to be baked again whenever the stack
+  * changes, which the manifest only partly detects, since it records patch
+  * versions rather than their contents.
+  *
+  * The output defaults to prebaked/<game>.thpack in the thcrap directory.
+  * Files are stored uncompressed unless --compress is given, so that they
+  * can be mapped without copying.
+  */
+
+#include "thcrap.h"
+#include <filesystem>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct bake_stats_t {
+	volatile LONG baked;
+	volatile LONG failed;
+	volatile LONG64 bytes;
+};
+
+// Returns the names of all files below [dir], relative to it, with forward
+// slashes.
+static std::vector<std::string> bake_file_list(const fs::path &dir)
+{
+	std::vector<std::string> ret;
+	std::error_code ec;
+	for(fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+		if(it->is_regular_file(ec)) {
+			std::string fn = it->path().lexically_relative(dir).u8string();
+			str_slash_normalize(&fn[0]);
+			ret.push_back(std::move(fn));
+		}
+	}
+	return ret;
+}
+
+// Patches [fn] exactly like file_rep_init() and file_rep_hooks_run() would,
+// and adds the result to [writer] if the stack changes the file.
+static void bake_file(patch_pack_writer_t *writer, unsigned int flags, const fs::path &dir, const std::string &fn, bake_stats_t &stats)
+{
+	const patchhook_t *hooks = patchhooks_build(fn.c_str());
+	size_t rep_size = 0;
+	void *rep = stack_game_file_resolve(fn.c_str(), &rep_size);
+	if(!hooks && !rep) {
+		return;
+	}
+	size_t game_size = 0;
+	void *game = nullptr;
+	if(!rep) {
+		game = file_read((dir / fs::u8path(fn)).u8string().c_str(), &game_size);
+		if(!game) {
+			fprintf(stderr, "%s: couldn't read the original file\n", fn.c_str());
+			InterlockedIncrement(&stats.failed);
+			return;
+		}
+	}
+	size_t patch_size = 0;
+	json_t *patch = hooks ? patchhooks_load_diff(hooks, fn.c_str(), &patch_size) : nullptr;
+
+	const size_t size_in = rep ? rep_size : game_size;
+	const size_t size_out = size_in + patch_size;
+	BYTE *buf = (BYTE *)malloc(size_out);
+	memcpy(buf, rep ? rep : game, size_in);
+	memset(buf + size_in, 0, size_out - size_in);
+	const bool changed = hooks
+		? patchhooks_run(hooks, buf, size_out, size_in, fn.c_str(), patch) > 0
+		: false;
+	if(rep || changed) {
+		const int ret = patch_pack_writer_add(writer, fn.c_str(), buf, size_out, flags);
+		if(ret) {
+			fprintf(stderr, "%s: couldn't add to the pack (error %d)\n", fn.c_str(), ret);
+			InterlockedIncrement(&stats.failed);
+		} else {
+			InterlockedIncrement(&stats.baked);
+			InterlockedAdd64(&stats.bytes, (LONG64)size_out);
+		}
+	}
+	free(buf);
+	json_decref(patch);
+	SAFE_FREE(game);
+	SAFE_FREE(rep);
+}
+
+int main(int argc, char **argv)
+{
+	const char *out_arg = nullptr;
+	size_t threads = 0;
+	unsigned int flags = 0;
+	std::vector<const char *> positional;
+	for(int i = 1; i < argc; i++) {
+		if(!strncmp(argv[i], "--out=", 6)) {
+			out_arg = argv[i] + 6;
+		} else if(!strncmp(argv[i], "--threads=", 10)) {
+			threads = (size_t)atoi(argv[i] + 10);
+		} else if(!strcmp(argv[i], "--compress")) {
+			flags |= PATCH_PACK_WRITE_DEFLATE;
+		} else if(argv[i][0] != '-') {
+			positional.push_back(argv[i]);
+		} else {
+			positional.clear();
+			break;
+		}
+	}
+	if(positional.size() != 3) {
+		fprintf(stderr,
+			"Usage: %s <run configuration> <game exe> <extracted files> [--out=file] [--threads=n] [--compress]\n",
+			argv[0]
+		);
+		return 1;
+	}
+	// Everything below runs from the thcrap directory, like the patched game.
+	const fs::path run_cfg_fn = fs::absolute(fs::u8path(positional[0]));
+	const fs::path exe_fn = fs::absolute(fs::u8path(positional[1]));
+	const fs::path files_dir = fs::absolute(fs::u8path(positional[2]));
+	const fs::path out_fn = out_arg ? fs::absolute(fs::u8path(out_arg)) : fs::path();
+
+	char self_fn[MAX_PATH];
+	GetModuleFileNameU(NULL, self_fn, sizeof(self_fn));
+	const fs::path bin_dir = fs::u8path(self_fn).parent_path();
+	const std::string thcrap_dir = bin_dir.parent_path().u8string() + "\\";
+	SetCurrentDirectoryU(thcrap_dir.c_str());
+
+	runconfig_load_from_file(run_cfg_fn.u8string().c_str());
+	runconfig_thcrap_dir_set(thcrap_dir.c_str());
+	log_init(0);
+	stack_show_missing();
+
+	json_t *full_cfg = identify(exe_fn.u8string().c_str());
+	if(!full_cfg) {
+		fprintf(stderr, "%s: unknown game\n", exe_fn.u8string().c_str());
+		log_exit();
+		return 1;
+	}
+	runconfig_load(full_cfg, RUNCONFIG_NO_OVERWRITE);
+	json_decref(full_cfg);
+
+	// Registers the same patch hooks as in the game, without detouring
+	// anything in this process.
+	HMODULE hThcrap = NULL;
+	GetModuleHandleEx(
+		GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+		(LPCSTR)&plugin_init, &hThcrap
+	);
+	plugin_init(hThcrap);
+	plugins_load(bin_dir.u8string().c_str());
+
+	const std::string fn = out_arg
+		? out_fn.u8string()
+		: thcrap_dir + "prebaked/" + runconfig_game_get() + ".thpack";
+	patch_pack_writer_t *writer = patch_pack_writer_open(fn.c_str());
+	if(!writer) {
+		fprintf(stderr, "%s: couldn't create the pack\n", fn.c_str());
+		log_exit();
+		return 1;
+	}
+
+	const std::vector<std::string> files = bake_file_list(files_dir);
+	printf("Baking %zu files for %s...\n", files.size(), runconfig_game_get());
+	bake_stats_t stats = {};
+	const DWORD start = GetTickCount();
+	parallel_for(files.size(), threads ? threads : SIZE_MAX, [&](size_t i) {
+		bake_file(writer, flags, files_dir, files[i], stats);
+	});
+
+	json_t *manifest = patch_pack_prebaked_manifest();
+	char *manifest_str = json_dumps(manifest, JSON_COMPACT | JSON_SORT_KEYS);
+	json_decref(manifest);
+	int ret = patch_pack_writer_add(writer, PATCH_PACK_PREBAKED_MANIFEST, manifest_str, strlen(manifest_str), 0);
+	free(manifest_str);
+	ret = patch_pack_writer_close(writer, !ret && !stats.failed);
+	if(ret || stats.failed) {
+		fprintf(stderr, "Baking failed, %ld files with errors (error %d)\n", stats.failed, ret);
+		log_exit();
+		return 1;
+	}
+	printf(
+		"%ld files (%.1f MiB) baked into %s in %.1f s.\n"
+		"Set \"prebaked\" in the run configuration to this file to use it.\n",
+		stats.baked, stats.bytes / (1024.0 * 1024.0), fn.c_str(), (GetTickCount() - start) / 1000.0
+	);
+	log_exit();
+	return 0;
+}
@@ -0,0 +1,139 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Benchmarks
+  *
+  * ----
+  *
+  * Harness and entry point.
+  *
+  * Usage: thcrap_bench [--filter=substring] [--min-time=seconds] [--out=file.json]
+  *        thcrap_bench load [options], see load.cpp
+  *
+  * Results are printed to the console, and optionally written as JSON, so
+  * that runs on different commits can be compared with any JSON tool.
+  */
+
+#include "bench.h"
+#include <vector>
+
+struct bench_t {
+	const char *name;
+	bench_func_t *func;
+};
+
+static std::vector<bench_t>& bench_list()
+{
+	static std::vector<bench_t> list;
+	return list;
+}
+
+bench_registrar_t::bench_registrar_t(const char *name, bench_func_t *func)
+{
+	bench_list().push_back({ name, func });
+}
+
+double bench_state_t::seconds() const
+{
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	return (double)(end.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+}
+
+// Runs [bench] with an increasing number of iterations until one run takes
+// at least [min_time] seconds, and returns the result of that run.
+static json_t* bench_run(const bench_t &bench, double min_time)
+{
+	size_t iterations = 1;
+	for(;;) {
+		bench_state_t state(iterations);
+		bench.func(state);
+		if(state.skip_reason) {
+			printf("%-40s skipped: %s\n", bench.name, state.skip_reason);
+			return json_pack("{s:s, s:s}", "name", bench.name, "skipped", state.skip_reason);
+		}
+		const double seconds = state.seconds();
+		if(seconds >= min_time || iterations >= ((size_t)1 << 30)) {
+			const double ns = seconds * 1e9 / (double)iterations;
+			json_t *ret = json_pack("{s:s, s:I, s:f}",
+				"name", bench.name,
+				"iterations", (json_int_t)iterations,
+				"ns_per_iter", ns
+			);
+			printf("%-40s %14.1f ns %12zu iterations", bench.name, ns, iterations);
+			if(state.bytes) {
+				const double mb_per_s = (double)state.bytes * iterations / seconds / (1024 * 1024);
+				json_object_set_new(ret, "bytes_per_iter", json_integer(state.bytes));
+				json_object_set_new(ret, "mib_per_second", json_real(mb_per_s));
+				printf(" %10.1f MiB/s", mb_per_s);
+			}
+			printf("\n");
+			return ret;
+		}
+		// Aim a bit past [min_time] for the next run, based on this one.
+		size_t next = (seconds > 0)
+			? (size_t)(iterations * (min_time * 1.4 / seconds))
+			: iterations * 10;
+		iterations = MAX(iterations * 2, MIN(next, iterations * 100));
+	}
+}
+
+int load_main(int argc, char **argv);
+
+int main(int argc, char **argv)
+{
+	if(argc > 1 && !strcmp(argv[1], "load")) {
+		log_init(0);
+		int ret = load_main(argc - 1, argv + 1);
+		log_exit();
+		return ret;
+	}
+
+	const char *filter = nullptr;
+	const char *out_fn = nullptr;
+	double min_time = 0.5;
+
+	for(int i = 1; i < argc; i++) {
+		if(!strncmp(argv[i], "--filter=", 9)) {
+			filter = argv[i] + 9;
+		} else if(!strncmp(argv[i], "--out=", 6)) {
+			out_fn = argv[i] + 6;
+		} else if(!strncmp(argv[i], "--min-time=", 11)) {
+			min_time = atof(argv[i] + 11);
+		} else {
+			fprintf(stderr, "Usage: %s [--filter=substring] [--min-time=seconds] [--out=file.json]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	log_init(0);
+
+	json_t *results = json_array();
+	for(const auto &bench : bench_list()) {
+		if(filter && !strstr(bench.name, filter)) {
+			continue;
+		}
+		json_array_append_new(results, bench_run(bench, min_time));
+	}
+
+	int ret = 0;
+	if(out_fn) {
+		SYSTEMTIME time;
+		GetSystemTime(&time);
+		char date[32];
+		snprintf(date, sizeof(date), "%04u-%02u-%02uT%02u:%02u:%02uZ",
+			time.wYear, time.wMonth, time.wDay, time.wHour, time.wMinute, time.wSecond
+		);
+		ScopedJson out = json_pack("{s:{s:s, s:s, s:f}, s:o}",
+			"context",
+				"date", date,
+				"thcrap_version", PROJECT_VERSION_STRING(),
+				"min_time", min_time,
+			"benchmarks", results
+		);
+		ret = json_dump_file(*out, out_fn, JSON_INDENT(2)) ? 1 : 0;
+	} else {
+		json_decref(results);
+	}
+	log_exit();
+	return ret;
+}
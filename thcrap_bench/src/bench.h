@@ -0,0 +1,83 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Benchmarks
+  *
+  * ----
+  *
+  * Minimal microbenchmark harness.
+  */
+
+#pragma once
+
+#include "thcrap.h"
+
+/**
+  * Every benchmark is a function that repeats the measured operation for as
+  * long as bench_state_t::keep_running() returns true:
+  *
+  *	BENCH(example)
+  *	{
+  *		// Setup, not measured
+  *		while(state.keep_running()) {
+  *			// Measured
+  *		}
+  *	}
+  *
+  * The harness calls the function again with more iterations until a run
+  * takes long enough to give a stable timing, and reports the time per
+  * iteration of that last run.
+  */
+class bench_state_t
+{
+	size_t iterations_left;
+	LARGE_INTEGER start;
+	LARGE_INTEGER end;
+
+public:
+	const size_t iterations;
+	// Bytes processed per iteration, for throughput reporting
+	size_t bytes = 0;
+	// Set by benchmarks that can't run in this environment
+	const char *skip_reason = nullptr;
+
+	bench_state_t(size_t iterations)
+		: iterations_left(iterations), iterations(iterations) {
+		start.QuadPart = 0;
+		end.QuadPart = 0;
+	}
+
+	bool keep_running() {
+		if(iterations_left == iterations) {
+			QueryPerformanceCounter(&start);
+		}
+		if(iterations_left-- == 0) {
+			QueryPerformanceCounter(&end);
+			return false;
+		}
+		return true;
+	}
+
+	void skip(const char *reason) {
+		skip_reason = reason;
+	}
+
+	double seconds() const;
+};
+
+typedef void bench_func_t(bench_state_t &state);
+
+struct bench_registrar_t {
+	bench_registrar_t(const char *name, bench_func_t *func);
+};
+
+#define BENCH(name) \
+	static void bench_##name(bench_state_t &state); \
+	static bench_registrar_t bench_registrar_##name(#name, bench_##name); \
+	static void bench_##name(bench_state_t &state)
+
+// Keeps the compiler from optimizing away a result.
+template <typename T> inline void bench_keep(T &&value)
+{
+	static volatile size_t sink;
+	sink = (size_t)value;
+}
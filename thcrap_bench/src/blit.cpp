@@ -0,0 +1,50 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Benchmarks
+  *
+  * ----
+  *
+  * ANM blitting.
+  */
+
+#include "bench.h"
+#include <png.h>
+#include "thcrap_tsa/src/anm.hpp"
+#include <vector>
+
+// One row of a 1024-pixel wide texture, blended 256 times.
+static const unsigned int BLIT_BENCH_WIDTH = 1024;
+static const unsigned int BLIT_BENCH_ROWS = 256;
+
+static void bench_blit(bench_state_t &state, BlitFunc_t func, format_t format, unsigned int Bpp)
+{
+	std::vector<png_byte> dst(BLIT_BENCH_WIDTH * BLIT_BENCH_ROWS * Bpp);
+	std::vector<png_byte> rep(dst.size());
+	for(size_t i = 0; i < dst.size(); i++) {
+		dst[i] = (png_byte)(i * 7);
+		rep[i] = (png_byte)(i * 13 + 5);
+	}
+	state.bytes = dst.size();
+	while(state.keep_running()) {
+		for(unsigned int row = 0; row < BLIT_BENCH_ROWS; row++) {
+			const size_t offset = row * BLIT_BENCH_WIDTH * Bpp;
+			func(dst.data() + offset, rep.data() + offset, BLIT_BENCH_WIDTH, format);
+		}
+	}
+	bench_keep(dst[0]);
+}
+
+BENCH(blit_blend_bgra8888)
+{
+	bench_blit(state, blit_blend, FORMAT_BGRA8888, 4);
+}
+
+BENCH(blit_blend_argb4444)
+{
+	bench_blit(state, blit_blend, FORMAT_ARGB4444, 2);
+}
+
+BENCH(blit_overwrite_bgra8888)
+{
+	bench_blit(state, blit_overwrite, FORMAT_BGRA8888, 4);
+}
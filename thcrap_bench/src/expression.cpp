@@ -0,0 +1,62 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Benchmarks
+  *
+  * ----
+  *
+  * Expression evaluation and binary hack rendering.
+  */
+
+#include "bench.h"
+
+static x86_reg_t bench_regs = { 0 };
+
+static void bench_eval(bench_state_t &state, const char *expr)
+{
+	size_t out = 0;
+	while(state.keep_running()) {
+		eval_expr(expr, '\0', &out, &bench_regs, 0);
+		bench_keep(out);
+	}
+}
+
+BENCH(eval_expr_ternary)
+{
+	bench_eval(state, "10 + 1 ? 2 : 3");
+}
+
+BENCH(eval_expr_registers)
+{
+	bench_regs.eax = 0x1234;
+	bench_regs.ecx = 0x10;
+	bench_eval(state, "eax * 4 + ecx - 0x10");
+}
+
+BENCH(eval_expr_nested)
+{
+	bench_eval(state, "((1 << 4) | (0x20 & 0xFF)) * (3 + (7 % 4)) - ((100 / 5) ^ 0x0F)");
+}
+
+static void bench_binhack(bench_state_t &state, const char *binhack_str)
+{
+	const size_t size = binhack_calc_size(binhack_str);
+	if(!size) {
+		state.skip("binhack_calc_size() failed");
+		return;
+	}
+	VLA(BYTE, buf, size);
+	while(state.keep_running()) {
+		bench_keep(binhack_render(buf, 0x401000, binhack_str));
+	}
+	VLA_FREE(buf);
+}
+
+BENCH(binhack_render_hex)
+{
+	bench_binhack(state, "8B4424 04 83C0 10 C3 90909090 31C0 C3");
+}
+
+BENCH(binhack_render_expressions)
+{
+	bench_binhack(state, "68 (0x12345678) B8 (0x1000 + 0x234) 05 (0x10 * 4) 8B0D (0x400000 + 0x1234) FFD0 C3");
+}
@@ -0,0 +1,231 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Benchmarks
+  *
+  * ----
+  *
+  * Load path benchmark.
+  *
+  * Usage: thcrap_bench load [--patches=n] [--files=n] [--keys=n] [--depth=n]
+  *	[--images=n] [--png=WxH] [--rounds=n] [--out=file.json]
+  *
+  * Generates a synthetic patch stack, and then runs every one of its game
+  * files through the same steps as file_rep_init() and file_rep_hooks_run():
+  * replacement file resolution, patch hook lookup, jdiff loading, and a
+  * hook that works like patch_anm(), resolving and decoding the replacement
+  * images named by the jdiff. Reports the per-file latency percentiles of
+  * the first (cold) round and all further (warm) rounds, together with the
+  * memory used by the process.
+  */
+
+#include "bench.h"
+#include "synthetic_stack.h"
+#include "png_decode.h"
+#include <algorithm>
+#include <vector>
+#include <psapi.h>
+
+// Size of every original game file
+static const size_t LOAD_GAME_FILE_SIZE = 64 * 1024;
+
+// Resolves and decodes every image in [patch]["images"], and mixes the
+// pixels into the file, so that nothing can be skipped.
+static int load_patch_images(void *file_inout, size_t size_out, size_t, const char*, json_t *patch)
+{
+	json_t *images = json_object_get(patch, "images");
+	size_t i;
+	json_t *image;
+	std::vector<uint8_t> pixels;
+	json_array_foreach(images, i, image) {
+		size_t png_size;
+		void *png = stack_game_file_resolve(json_string_value(image), &png_size);
+		if(!png) {
+			continue;
+		}
+		png_decode_t dec;
+		if(!png_decode_begin(&dec, png, png_size, PNG_DECODE_ADD_ALPHA | PNG_DECODE_BGR)) {
+			const size_t stride = dec.width * 4;
+			pixels.resize(stride * dec.height);
+			if(!png_decode_rows(&dec, pixels.data(), stride, dec.height)) {
+				uint8_t *out = (uint8_t *)file_inout;
+				for(size_t j = 0; j < pixels.size(); j += 4096) {
+					out[j % size_out] ^= pixels[j];
+				}
+			}
+			png_decode_end(&dec);
+		}
+		SAFE_FREE(png);
+	}
+	return 1;
+}
+
+// Does everything that happens between a game's CreateFile() and ReadFile()
+// calls for [fn].
+static void load_file(const char *fn, const uint8_t *game_file)
+{
+	const patchhook_t *hooks = patchhooks_build(fn);
+	size_t rep_size = 0;
+	void *rep = stack_game_file_resolve(fn, &rep_size);
+	size_t patch_size = 0;
+	json_t *patch = patchhooks_load_diff(hooks, fn, &patch_size);
+
+	const size_t size_in = rep ? rep_size : LOAD_GAME_FILE_SIZE;
+	const size_t size_out = size_in + patch_size;
+	uint8_t *buf = (uint8_t *)malloc(size_out);
+	memcpy(buf, rep ? rep : game_file, size_in);
+	patchhooks_run(hooks, buf, size_out, size_in, fn, patch);
+	bench_keep(buf[0]);
+
+	free(buf);
+	json_decref(patch);
+	SAFE_FREE(rep);
+}
+
+static json_t* load_percentiles(std::vector<double> &samples)
+{
+	if(samples.empty()) {
+		return json_null();
+	}
+	std::sort(samples.begin(), samples.end());
+	auto percentile = [&samples](double p) {
+		return samples[MIN((size_t)(p * samples.size()), samples.size() - 1)];
+	};
+	double sum = 0;
+	for(double s : samples) {
+		sum += s;
+	}
+	return json_pack("{s:I, s:f, s:f, s:f, s:f}",
+		"files", (json_int_t)samples.size(),
+		"p50_us", percentile(0.50),
+		"p99_us", percentile(0.99),
+		"max_us", samples.back(),
+		"total_ms", sum / 1000.0
+	);
+}
+
+static void load_memory_get(PROCESS_MEMORY_COUNTERS_EX &pmc)
+{
+	pmc = {};
+	pmc.cb = sizeof(pmc);
+	GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS *)&pmc, sizeof(pmc));
+}
+
+static void load_print(const char *name, json_t *stats)
+{
+	if(!json_is_object(stats)) {
+		return;
+	}
+	printf("%-6s %8zu files   p50 %10.1f us   p99 %10.1f us   max %10.1f us   total %10.1f ms\n",
+		name,
+		(size_t)json_integer_value(json_object_get(stats, "files")),
+		json_real_value(json_object_get(stats, "p50_us")),
+		json_real_value(json_object_get(stats, "p99_us")),
+		json_real_value(json_object_get(stats, "max_us")),
+		json_real_value(json_object_get(stats, "total_ms"))
+	);
+}
+
+int load_main(int argc, char **argv)
+{
+	synthetic_stack_params_t params;
+	params.patches = 8;
+	params.files = 0;
+	params.game_files = 256;
+	params.images = 2;
+	params.png_w = 256;
+	params.png_h = 256;
+	size_t rounds = 5;
+	const char *out_fn = nullptr;
+
+	for(int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if(!strncmp(arg, "--patches=", 10)) {
+			params.patches = strtoul(arg + 10, nullptr, 10);
+		} else if(!strncmp(arg, "--files=", 8)) {
+			params.game_files = strtoul(arg + 8, nullptr, 10);
+		} else if(!strncmp(arg, "--keys=", 7)) {
+			params.keys = strtoul(arg + 7, nullptr, 10);
+		} else if(!strncmp(arg, "--depth=", 8)) {
+			params.depth = strtoul(arg + 8, nullptr, 10);
+		} else if(!strncmp(arg, "--images=", 9)) {
+			params.images = strtoul(arg + 9, nullptr, 10);
+		} else if(!strncmp(arg, "--png=", 6)) {
+			if(sscanf(arg + 6, "%ux%u", &params.png_w, &params.png_h) != 2) {
+				params.png_w = params.png_h = 0;
+			}
+		} else if(!strncmp(arg, "--rounds=", 9)) {
+			rounds = MAX(strtoul(arg + 9, nullptr, 10), 1ul);
+		} else if(!strncmp(arg, "--out=", 6)) {
+			out_fn = arg + 6;
+		} else {
+			fprintf(stderr,
+				"Usage: thcrap_bench load [--patches=n] [--files=n] [--keys=n] [--depth=n]\n"
+				"\t[--images=n] [--png=WxH] [--rounds=n] [--out=file.json]\n"
+			);
+			return 1;
+		}
+	}
+
+	patchhook_register("entry_*.bench", load_patch_images, nullptr);
+
+	PROCESS_MEMORY_COUNTERS_EX mem_before;
+	PROCESS_MEMORY_COUNTERS_EX mem_after;
+	load_memory_get(mem_before);
+
+	int ret = 0;
+	{
+		printf("Generating %zu patches with %zu files each...\n", params.patches, params.game_files);
+		synthetic_stack_t stack(params);
+		if(!stack.ok()) {
+			fprintf(stderr, "Couldn't create the synthetic stack.\n");
+			return 1;
+		}
+		std::vector<uint8_t> game_file(LOAD_GAME_FILE_SIZE, 0x5a);
+		std::vector<double> cold;
+		std::vector<double> warm;
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+
+		for(size_t r = 0; r < rounds; r++) {
+			auto &samples = (r == 0) ? cold : warm;
+			for(size_t f = 0; f < params.game_files; f++) {
+				char fn[32];
+				snprintf(fn, sizeof(fn), "entry_%zu.bench", f);
+				LARGE_INTEGER start, end;
+				QueryPerformanceCounter(&start);
+				load_file(fn, game_file.data());
+				QueryPerformanceCounter(&end);
+				samples.push_back((double)(end.QuadPart - start.QuadPart) * 1e6 / (double)freq.QuadPart);
+			}
+		}
+		load_memory_get(mem_after);
+		const ptrdiff_t private_bytes = (ptrdiff_t)mem_after.PrivateUsage - (ptrdiff_t)mem_before.PrivateUsage;
+
+		ScopedJson result = json_pack("{s:{s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I}, s:o, s:o, s:{s:I, s:I}}",
+			"params",
+				"patches", (json_int_t)params.patches,
+				"files", (json_int_t)params.game_files,
+				"keys", (json_int_t)params.keys,
+				"depth", (json_int_t)params.depth,
+				"images", (json_int_t)params.images,
+				"png_w", (json_int_t)params.png_w,
+				"png_h", (json_int_t)params.png_h,
+				"rounds", (json_int_t)rounds,
+			"cold", load_percentiles(cold),
+			"warm", load_percentiles(warm),
+			"memory",
+				"private_bytes", (json_int_t)private_bytes,
+				"peak_working_set", (json_int_t)mem_after.PeakWorkingSetSize
+		);
+		load_print("cold", json_object_get(*result, "cold"));
+		load_print("warm", json_object_get(*result, "warm"));
+		printf("memory: %.1f MiB private bytes added, %.1f MiB peak working set\n",
+			(double)private_bytes / (1024 * 1024),
+			(double)mem_after.PeakWorkingSetSize / (1024 * 1024)
+		);
+		if(out_fn) {
+			ret = json_dump_file(*result, out_fn, JSON_INDENT(2)) ? 1 : 0;
+		}
+	}
+	return ret;
+}
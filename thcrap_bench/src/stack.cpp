@@ -0,0 +1,76 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Benchmarks
+  *
+  * ----
+  *
+  * Patch stack resolution and patch hook lookup.
+  */
+
+#include "bench.h"
+#include "synthetic_stack.h"
+
+static void bench_stack_json_resolve(bench_state_t &state, size_t patches)
+{
+	synthetic_stack_params_t params;
+	params.patches = patches;
+	synthetic_stack_t stack(params);
+	if(!stack.ok()) {
+		state.skip("couldn't create the synthetic stack");
+		return;
+	}
+	size_t f = 0;
+	while(state.keep_running()) {
+		char fn[32];
+		snprintf(fn, sizeof(fn), "file_%zu.js", f++ % params.files);
+		json_t *json = stack_json_resolve(fn, nullptr);
+		bench_keep(json);
+		json_decref(json);
+	}
+}
+
+BENCH(stack_json_resolve_1)
+{
+	bench_stack_json_resolve(state, 1);
+}
+
+BENCH(stack_json_resolve_8)
+{
+	bench_stack_json_resolve(state, 8);
+}
+
+BENCH(stack_json_resolve_32)
+{
+	bench_stack_json_resolve(state, 32);
+}
+
+static int bench_patch_noop(void*, size_t, size_t, const char*, json_t*)
+{
+	return 0;
+}
+
+BENCH(patchhooks_build)
+{
+	// Registered once, since hooks can't be unregistered.
+	static bool registered = false;
+	static const char *WILDCARDS[] = {
+		"*.anm", "*.msg", "*.std", "*.ecl", "*.png", "*.jdiff", "*.cv0",
+		"*.cv1", "*.cv2", "*.dat", "*.nut", "*.act", "data/font/*.bmp",
+		"*.csv", "*.pl", "*.txt", "*/music.txt", "th*.dat", "*.wav", "*.ogg",
+	};
+	if(!registered) {
+		for(const char *wildcard : WILDCARDS) {
+			patchhook_register(wildcard, bench_patch_noop, nullptr);
+		}
+		registered = true;
+	}
+	static const char *FILES[] = {
+		"stgenm01.anm", "st01.msg", "stage1.std", "ecldata1.ecl", "front.png",
+		"data/csv/system/music.cv1", "data/font/font1.bmp", "bgm/th06_01.wav",
+		"title.nut", "unknown.bin", "data/scene/title/title.act", "e01.msg",
+	};
+	size_t i = 0;
+	while(state.keep_running()) {
+		bench_keep(patchhooks_build(FILES[i++ % elementsof(FILES)]));
+	}
+}
@@ -0,0 +1,50 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Benchmarks
+  *
+  * ----
+  *
+  * UTF-8 ↔ UTF-16 conversion of typical file names.
+  */
+
+#include "bench.h"
+#include <vector>
+
+static const char STRCONV_BENCH_FN[] = "thcrap/repos/thpatch/lang_en/th17/stgenm01.anm";
+static const wchar_t STRCONV_BENCH_FN_W[] = L"thcrap/repos/thpatch/lang_en/th17/stgenm01.anm";
+
+BENCH(strconv_utf16_win32)
+{
+	wchar_t buf[MAX_PATH];
+	state.bytes = sizeof(STRCONV_BENCH_FN);
+	while(state.keep_running()) {
+		bench_keep(StringToUTF16(buf, STRCONV_BENCH_FN, -1));
+	}
+}
+
+BENCH(strconv_utf16)
+{
+	wchar_t buf[MAX_PATH];
+	state.bytes = sizeof(STRCONV_BENCH_FN);
+	while(state.keep_running()) {
+		bench_keep(utf8_to_utf16(buf, STRCONV_BENCH_FN, -1));
+	}
+}
+
+BENCH(strconv_utf8_win32)
+{
+	char buf[MAX_PATH * UTF8_MUL];
+	state.bytes = sizeof(STRCONV_BENCH_FN_W);
+	while(state.keep_running()) {
+		bench_keep(StringToUTF8(buf, STRCONV_BENCH_FN_W, sizeof(buf)));
+	}
+}
+
+BENCH(strconv_utf8)
+{
+	char buf[MAX_PATH * UTF8_MUL];
+	state.bytes = sizeof(STRCONV_BENCH_FN_W);
+	while(state.keep_running()) {
+		bench_keep(utf16_to_utf8(buf, STRCONV_BENCH_FN_W, sizeof(buf)));
+	}
+}
@@ -0,0 +1,55 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Benchmarks
+  *
+  * ----
+  *
+  * Hardcoded string translation.
+  */
+
+#include "bench.h"
+#include "synthetic_stack.h"
+#include <string>
+
+static const char BENCH_STRING_HIT[] = "Translated string";
+static const char BENCH_STRING_MISS[] = "Untranslated string";
+
+static void bench_strings_lookup(bench_state_t &state, const char *str)
+{
+	synthetic_stack_params_t params;
+	params.patches = 1;
+	params.files = 0;
+	synthetic_stack_t stack(params);
+	if(!stack.ok()) {
+		state.skip("couldn't create the synthetic stack");
+		return;
+	}
+	// A few hundred translated addresses, like a typical game patch
+	std::string stringlocs = "{";
+	char entry[64];
+	for(size_t i = 0; i < 512; i++) {
+		snprintf(entry, sizeof(entry), "\"0x%zx\": \"bench_%zu\",", (size_t)0x400000 + i * 0x10, i);
+		stringlocs += entry;
+	}
+	snprintf(entry, sizeof(entry), "\"0x%zx\": \"bench_hit\"}", (size_t)BENCH_STRING_HIT);
+	stringlocs += entry;
+	const char stringdefs[] = "{\"bench_hit\": \"Übersetzter String\"}";
+	stack.write(0, "stringlocs.js", stringlocs.c_str(), stringlocs.size());
+	stack.write(0, "stringdefs.js", stringdefs, sizeof(stringdefs) - 1);
+	strings_mod_init();
+
+	size_t len;
+	while(state.keep_running()) {
+		bench_keep(strings_lookup(str, &len));
+	}
+}
+
+BENCH(strings_lookup_hit)
+{
+	bench_strings_lookup(state, BENCH_STRING_HIT);
+}
+
+BENCH(strings_lookup_miss)
+{
+	bench_strings_lookup(state, BENCH_STRING_MISS);
+}
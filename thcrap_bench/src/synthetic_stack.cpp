@@ -0,0 +1,151 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Benchmarks
+  *
+  * ----
+  *
+  * Synthetic patch stacks.
+  */
+
+#include "thcrap.h"
+#include "synthetic_stack.h"
+#include <filesystem>
+#include <png.h>
+#include "thcrap_tsa/src/png_ex.h"
+
+static json_t* synthetic_object(size_t patch, size_t keys, size_t depth)
+{
+	json_t *ret = json_object();
+	for(size_t i = 0; i < keys; i++) {
+		char key[32];
+		snprintf(key, sizeof(key), "key_%zu", i);
+		json_t *val;
+		if(depth > 0 && i == 0) {
+			val = synthetic_object(patch, keys, depth - 1);
+		} else if(i % 2) {
+			// Overridden by every patch
+			val = json_sprintf("patch %zu, key %zu", patch, i);
+		} else {
+			val = json_integer(i);
+		}
+		json_object_set_new(ret, key, val);
+	}
+	return ret;
+}
+
+// Writes an RGBA gradient of the given size to [fn], to give the PNGs a
+// realistic compression ratio.
+static bool synthetic_png_store(const char *fn, unsigned int w, unsigned int h)
+{
+	png_image_ex png = {};
+	if(png_image_new(png, w, h, PNG_FORMAT_RGBA)) {
+		return false;
+	}
+	png_bytep p = png.buf;
+	for(unsigned int y = 0; y < h; y++) {
+		for(unsigned int x = 0; x < w; x++) {
+			*p++ = (png_byte)x;
+			*p++ = (png_byte)y;
+			*p++ = (png_byte)(x ^ y);
+			*p++ = (x + y) & 0x40 ? 0xff : 0x80;
+		}
+	}
+	bool ret = png_image_store(fn, png) == 0;
+	png_image_clear(png);
+	return ret;
+}
+
+synthetic_stack_t::synthetic_stack_t(const synthetic_stack_params_t &params)
+	: params(params)
+{
+	std::error_code ec;
+	auto dir = std::filesystem::temp_directory_path(ec);
+	if(ec) {
+		return;
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "thcrap_bench_%lu_%llu",
+		GetCurrentProcessId(), (unsigned long long)GetTickCount64()
+	);
+	dir /= name;
+	if(!std::filesystem::create_directories(dir, ec)) {
+		return;
+	}
+	root = dir.u8string();
+	str_slash_normalize(root.data());
+	if(root.back() != '/') {
+		root += '/';
+	}
+
+	for(size_t p = 0; p < params.patches; p++) {
+		char patch_id[32];
+		snprintf(patch_id, sizeof(patch_id), "bench_%zu", p);
+		std::string patch_dir = root + patch_id + "/";
+		CreateDirectoryU(patch_dir.c_str(), nullptr);
+
+		ScopedJson patch_js = json_pack("{s:s}", "id", patch_id);
+		json_dump_file(*patch_js, (patch_dir + "patch.js").c_str(), 0);
+
+		for(size_t f = 0; f < params.files; f++) {
+			char fn[32];
+			snprintf(fn, sizeof(fn), "file_%zu.js", f);
+			ScopedJson file = synthetic_object(p, params.keys, params.depth);
+			json_dump_file(*file, (patch_dir + fn).c_str(), 0);
+		}
+
+		for(size_t f = 0; f < params.game_files; f++) {
+			char fn[48];
+			snprintf(fn, sizeof(fn), "entry_%zu.bench.jdiff", f);
+			ScopedJson jdiff = synthetic_object(p, params.keys, params.depth);
+			json_t *images = json_array();
+			for(size_t i = 0; i < params.images; i++) {
+				json_array_append_new(images, json_sprintf("img_%zu_%zu.png", f, i));
+			}
+			json_object_set_new(*jdiff, "images", images);
+			json_dump_file(*jdiff, (patch_dir + fn).c_str(), 0);
+		}
+
+		ScopedJson patch_info = json_pack("{s:s}", "archive", patch_dir.c_str());
+		patch_t patch = patch_init(patch_dir.c_str(), *patch_info, p);
+		stack_add_patch(&patch);
+	}
+
+	if(params.png_w && params.png_h && params.images && params.patches) {
+		// Encoded once, then copied everywhere.
+		std::string png_fn = root + "img.png";
+		if(!synthetic_png_store(png_fn.c_str(), params.png_w, params.png_h)) {
+			return;
+		}
+		for(size_t f = 0; f < params.game_files; f++) {
+			char patch_id[32];
+			snprintf(patch_id, sizeof(patch_id), "bench_%zu/", f % params.patches);
+			for(size_t i = 0; i < params.images; i++) {
+				char fn[48];
+				snprintf(fn, sizeof(fn), "img_%zu_%zu.png", f, i);
+				std::error_code ec;
+				std::filesystem::copy_file(
+					std::filesystem::u8path(png_fn),
+					std::filesystem::u8path(root + patch_id + fn), ec
+				);
+			}
+		}
+		std::error_code ec;
+		std::filesystem::remove(std::filesystem::u8path(png_fn), ec);
+	}
+}
+
+synthetic_stack_t::~synthetic_stack_t()
+{
+	stack_free();
+	if(!root.empty()) {
+		std::error_code ec;
+		std::filesystem::remove_all(std::filesystem::u8path(root), ec);
+	}
+}
+
+void synthetic_stack_t::write(size_t patch, const char *fn, const void *contents, size_t size)
+{
+	char patch_id[32];
+	snprintf(patch_id, sizeof(patch_id), "bench_%zu/", patch);
+	file_write((root + patch_id + fn).c_str(), contents, size);
+}
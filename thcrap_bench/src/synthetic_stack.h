@@ -0,0 +1,58 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Benchmarks
+  *
+  * ----
+  *
+  * Synthetic patch stacks.
+  */
+
+#pragma once
+
+#include <string>
+
+struct synthetic_stack_params_t {
+	size_t patches = 8;
+	// JSON files per patch, named file_<n>.js
+	size_t files = 16;
+	// Keys per object in every file
+	size_t keys = 16;
+	// Nesting depth of objects in every file
+	size_t depth = 2;
+
+	// Game files, named entry_<n>.bench. Every patch contains a jdiff for
+	// every one of them, with the same keys and depth as the JSON files
+	// above, and an "images" array naming the replacement images used by
+	// that file.
+	size_t game_files = 0;
+	// Replacement images per game file, named img_<file>_<n>.png, and
+	// stored in only one patch each. No images are generated if either
+	// dimension is 0.
+	size_t images = 0;
+	unsigned int png_w = 0;
+	unsigned int png_h = 0;
+};
+
+// Creates a stack of patches in a temporary directory and adds it to the
+// patch stack. Every patch contains every file, with different values for
+// half of the keys, so resolving a file always merges all patches.
+// Replacement images are RGBA PNGs written through libpng, so creating a
+// stack with images requires thcrap_tsa.
+// The stack is removed from disk and freed on destruction.
+class synthetic_stack_t
+{
+	std::string root;
+
+public:
+	const synthetic_stack_params_t params;
+
+	synthetic_stack_t(const synthetic_stack_params_t &params);
+	~synthetic_stack_t();
+
+	// Writes [contents] to [fn] in patch number [patch].
+	void write(size_t patch, const char *fn, const void *contents, size_t size);
+
+	bool ok() const {
+		return !root.empty();
+	}
+};
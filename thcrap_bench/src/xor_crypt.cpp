@@ -0,0 +1,47 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Benchmarks
+  *
+  * ----
+  *
+  * XOR crypt kernels.
+  */
+
+#include "bench.h"
+#include <vector>
+
+static const size_t XOR_BENCH_SIZE = 1024 * 1024;
+
+BENCH(xor_crypt_byte)
+{
+	std::vector<uint8_t> data(XOR_BENCH_SIZE, 0x5A);
+	state.bytes = data.size();
+	while(state.keep_running()) {
+		xor_crypt_byte(data.data(), data.size(), 0x77);
+	}
+	bench_keep(data[0]);
+}
+
+BENCH(xor_crypt_key16)
+{
+	static const uint8_t key[16] = {
+		0x1B, 0x37, 0xAA, 0x55, 0x01, 0x02, 0x03, 0x04,
+		0xF0, 0x0F, 0xC3, 0x3C, 0x99, 0x66, 0x11, 0xEE,
+	};
+	std::vector<uint8_t> data(XOR_BENCH_SIZE, 0x5A);
+	state.bytes = data.size();
+	while(state.keep_running()) {
+		xor_crypt_key16(data.data(), data.size(), key);
+	}
+	bench_keep(data[0]);
+}
+
+BENCH(xor_crypt_progressive)
+{
+	std::vector<uint8_t> data(XOR_BENCH_SIZE, 0x5A);
+	state.bytes = data.size();
+	while(state.keep_running()) {
+		xor_crypt_progressive(data.data(), data.size(), 0x1B, 0x37, 0x40);
+	}
+	bench_keep(data[0]);
+}
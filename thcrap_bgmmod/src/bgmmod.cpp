@@ -11,6 +11,23 @@
 #include <thcrap.h>
 #include <vector>
 #include "bgmmod.hpp"
+#include <intrin.h>
+
+/// CPU features
+/// ------------
+static bool sse2_supported(void)
+{
+	int data[4];
+	__cpuid(data, 0);
+	if(data[0] < 1) {
+		return false;
+	}
+	__cpuid(data, 1);
+	return data[3] & 1 << 26;
+}
+
+const bool BGMMOD_SSE2 = sse2_supported();
+/// ------------
 
 /// String constants
 /// ----------------
@@ -54,10 +71,26 @@ bool track_t::decode(void *buf, size_t size)
 	return true;
 }
 
+size_t pcm_part_t::part_decode(void *_buf, size_t size)
+{
+	auto *buf = (uint8_t*)_buf;
+	size_t ret = 0;
+	while(ret < size) {
+		auto single_ret = part_decode_single(buf + ret, size - ret);
+		if(single_ret == (size_t)-1) {
+			return -1;
+		} else if(single_ret == 0) {
+			break;
+		}
+		ret += single_ret;
+	}
+	return ret;
+}
+
 size_t track_pcm_t::decode_single(void *_buf, size_t size)
 {
 	auto *buf = (uint8_t*)_buf;
-	auto ret = cur->part_decode_single(buf, size);
+	auto ret = cur->part_decode(buf, size);
 	if(ret == 0) {
 		if((cur == intro.get()) && (loop != nullptr)) {
 			cur = loop.get();
@@ -81,6 +114,248 @@ void track_pcm_t::seek_to_byte(size_t byte)
 	cur->part_seek_to_sample(byte / (pcmf.bitdepth / 8) / pcmf.channels);
 }
 
+static LONGLONG qpc_freq()
+{
+	static const LONGLONG ret = [] {
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		return freq.QuadPart;
+	}();
+	return ret;
+}
+
+LONGLONG decode_stats_t::now()
+{
+	LARGE_INTEGER ret;
+	QueryPerformanceCounter(&ret);
+	return ret.QuadPart;
+}
+
+void decode_stats_t::decoded(size_t bytes, LONGLONG ticks)
+{
+	decode_calls++;
+	decode_bytes += bytes;
+	decode_ticks += ticks;
+	decode_ticks_max = max(decode_ticks_max, ticks);
+	const auto us = (uint64_t)ticks * 1000000 / qpc_freq();
+	latency[(size_t)min(us / LATENCY_BUCKET_US, (uint64_t)LATENCY_BUCKETS - 1)]++;
+}
+
+void decode_stats_t::read(size_t margin)
+{
+	const auto t = now();
+	if(reads) {
+		const auto interval = t - read_last;
+		read_interval_ticks += interval;
+		read_interval_ticks_max = max(read_interval_ticks_max, interval);
+	}
+	read_last = t;
+	reads++;
+	if(margin != SIZE_MAX) {
+		margin_min = min(margin_min, margin);
+	}
+}
+
+void decode_stats_t::waited(bool after_seek, LONGLONG ticks)
+{
+	if(after_seek) {
+		seek_waits++;
+		seek_wait_ticks += ticks;
+	} else {
+		underruns++;
+		underrun_ticks += ticks;
+	}
+}
+
+void decode_stats_t::print(const std::string &name, const pcm_format_t &pcmf, size_t buffer_size) const
+{
+	if(decode_calls == 0) {
+		return;
+	}
+	const double ms_per_tick = 1000.0 / qpc_freq();
+	const double bytes_per_ms = (
+		(double)pcmf.samplingrate * (pcmf.bitdepth / 8) * pcmf.channels
+	) / 1000.0;
+
+	// Upper bound of the bucket that contains the 99th percentile.
+	const uint64_t p99_rank = decode_calls - (decode_calls / 100);
+	uint64_t seen = 0;
+	size_t p99_bucket = 0;
+	for(; p99_bucket < (LATENCY_BUCKETS - 1); p99_bucket++) {
+		seen += latency[p99_bucket];
+		if(seen >= p99_rank) {
+			break;
+		}
+	}
+	const bool p99_over = (p99_bucket == (LATENCY_BUCKETS - 1));
+	const double p99_ms = (p99_bucket + !p99_over) * LATENCY_BUCKET_US / 1000.0;
+
+	log_printf(
+		"(BGM) %s: %llu decode calls, %.1f KiB per call, %.2f ms avg / %s%.2f ms p99 / %.2f ms max per call\n",
+		name.c_str(), decode_calls, (decode_bytes / 1024.0) / decode_calls,
+		(decode_ticks * ms_per_tick) / decode_calls,
+		p99_over ? ">" : "", p99_ms, decode_ticks_max * ms_per_tick
+	);
+	if(reads == 0) {
+		return;
+	}
+	const double margin_ms = (margin_min != SIZE_MAX) ? (margin_min / bytes_per_ms) : 0.0;
+	log_printf(
+		"(BGM) %s: %llu reads, every %.1f ms (longest gap %.1f ms), "
+		"lowest margin %.1f of %.1f ms buffered; "
+		"%llu underruns (%.1f ms stalled), %llu waits after seeking (%.1f ms)\n",
+		name.c_str(), reads,
+		(reads > 1) ? ((read_interval_ticks * ms_per_tick) / (reads - 1)) : 0.0,
+		read_interval_ticks_max * ms_per_tick,
+		margin_ms, buffer_size / bytes_per_ms,
+		underruns, underrun_ticks * ms_per_tick,
+		seek_waits, seek_wait_ticks * ms_per_tick
+	);
+}
+
+track_ahead_t::track_ahead_t(track_t &track, size_t start_byte, unsigned int ahead_ms, const stringref_t &name)
+	: track(track), ring_size([&] {
+		const auto &pcmf = track.pcmf;
+		const size_t sample_size = (pcmf.bitdepth / 8) * pcmf.channels;
+		const size_t samples = ((size_t)pcmf.samplingrate * ahead_ms) / 1000;
+		return max(samples, (size_t)1) * sample_size;
+	}()), name(name.str, name.len)
+{
+	ring = std::make_unique<uint8_t[]>(ring_size);
+	seek_pending = true;
+	seek_byte = start_byte;
+	thread = CreateThread(nullptr, 0, worker, this, 0, nullptr);
+	if(!thread) {
+		track.seek_to_byte(start_byte);
+		seek_pending = false;
+	}
+}
+
+track_ahead_t::~track_ahead_t()
+{
+	if(thread) {
+		AcquireSRWLockExclusive(&lock);
+		quit = true;
+		WakeAllConditionVariable(&drained);
+		ReleaseSRWLockExclusive(&lock);
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+	}
+	stats.print(name, track.pcmf, ring_size);
+}
+
+DWORD WINAPI track_ahead_t::worker(void *param)
+{
+	((track_ahead_t *)param)->work();
+	return 0;
+}
+
+void track_ahead_t::work()
+{
+	// Small enough to quickly get the first bytes after a seek.
+	const size_t chunk_size = max(ring_size / 8, (size_t)1);
+
+	AcquireSRWLockExclusive(&lock);
+	while(!quit) {
+		if(seek_pending) {
+			seek_pending = false;
+			const auto byte = seek_byte;
+			ReleaseSRWLockExclusive(&lock);
+			track.seek_to_byte(byte);
+			AcquireSRWLockExclusive(&lock);
+			continue;
+		}
+		const size_t used = write_total - read_total;
+		if(failed || used == ring_size) {
+			SleepConditionVariableSRW(&drained, &lock, INFINITE, 0);
+			continue;
+		}
+		// Nothing else writes to the free part of the ring.
+		const size_t offset = write_total % ring_size;
+		const size_t size = min(min(ring_size - used, ring_size - offset), chunk_size);
+		const auto gen = generation;
+		ReleaseSRWLockExclusive(&lock);
+		const auto start = decode_stats_t::now();
+		const auto ret = track.decode_single(&ring[offset], size);
+		const auto ticks = decode_stats_t::now() - start;
+		AcquireSRWLockExclusive(&lock);
+		if(ret != (size_t)-1) {
+			stats.decoded(ret, ticks);
+		}
+		if(gen != generation) {
+			continue;
+		}
+		if(ret == (size_t)-1) {
+			failed = true;
+		} else {
+			write_total += ret;
+		}
+		WakeAllConditionVariable(&filled);
+	}
+	ReleaseSRWLockExclusive(&lock);
+}
+
+bool track_ahead_t::decode(void *buf, size_t size)
+{
+	if(!thread) {
+		const auto start = decode_stats_t::now();
+		const auto ret = track.decode(buf, size);
+		stats.decoded(size, decode_stats_t::now() - start);
+		return ret;
+	}
+	auto *p = (uint8_t*)buf;
+	auto size_left = size;
+	bool ret = true;
+	LONGLONG wait_start = 0;
+	assert(p);
+	AcquireSRWLockExclusive(&lock);
+	const bool after_seek = (read_total == 0);
+	stats.read(after_seek ? SIZE_MAX : (write_total - read_total));
+	while(size_left > 0) {
+		const size_t used = write_total - read_total;
+		if(used == 0) {
+			if(failed) {
+				ZeroMemory(buf, size);
+				ret = false;
+				break;
+			}
+			if(!wait_start) {
+				wait_start = decode_stats_t::now();
+			}
+			SleepConditionVariableSRW(&filled, &lock, INFINITE, 0);
+			continue;
+		}
+		const size_t offset = read_total % ring_size;
+		const size_t copy_size = min(min(used, size_left), ring_size - offset);
+		memcpy(p, &ring[offset], copy_size);
+		p += copy_size;
+		size_left -= copy_size;
+		read_total += copy_size;
+		WakeAllConditionVariable(&drained);
+	}
+	if(wait_start) {
+		stats.waited(after_seek, decode_stats_t::now() - wait_start);
+	}
+	ReleaseSRWLockExclusive(&lock);
+	return ret;
+}
+
+void track_ahead_t::seek_to_byte(size_t byte)
+{
+	if(!thread) {
+		track.seek_to_byte(byte);
+		return;
+	}
+	AcquireSRWLockExclusive(&lock);
+	seek_pending = true;
+	seek_byte = byte;
+	generation++;
+	write_total = 0;
+	read_total = 0;
+	WakeAllConditionVariable(&drained);
+	ReleaseSRWLockExclusive(&lock);
+}
+
 std::unique_ptr<track_pcm_t> pcm_open(
 	pcm_part_open_t &codec_open, HANDLE &&intro, HANDLE &&loop
 )
@@ -203,16 +478,22 @@ std::unique_ptr<track_t> stack_bgm_resolve(const stringref_t &basename)
 			stringref_copy_advance_dst(mod_fn_p, codec.ext);
 
 			loop = patch_file_stream(sci.patch_info, mod_fn);
-			if(loop != INVALID_HANDLE_VALUE) {
+			const bool has_loop = (loop != INVALID_HANDLE_VALUE);
+			if(has_loop) {
 				patch_print_fn(sci.patch_info, mod_fn);
 			}
 			log_print("\n");
 
+			auto track = pcm_cache_track(
+				pcm_open(codec.open, std::move(intro), std::move(loop)),
+				codec.open, sci.patch_info, sci.fn, has_loop ? mod_fn : nullptr
+			);
+
 			for (char *&chain_entry : chain) {
 				SAFE_FREE(chain_entry);
 			}
 
-			return pcm_open(codec.open, std::move(intro), std::move(loop));
+			return track;
 		}
 	}
 	log_print("not found\n");
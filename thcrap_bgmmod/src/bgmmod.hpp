@@ -10,12 +10,19 @@
 #pragma once
 
 #include <memory>
+#include <string>
+#include <vector>
 
 /// String constants
 /// ----------------
 extern const stringref_t LOOP_INFIX;
 /// ----------------
 
+/// CPU features
+/// ------------
+extern const bool BGMMOD_SSE2;
+/// ------------
+
 /// Sampling rate / bit depth / channel structure
 /// ---------------------------------------------
 #define PCM_FORMAT_DESC_FMT "%u Hz / %u Bit / %uch"
@@ -106,6 +113,12 @@ struct pcm_part_t : public pcm_part_info_t {
 	// decoded, which can be less than [size]. If an error occured, it
 	// should return -1, and show a message box.
 	virtual size_t part_decode_single(void *buf, size_t size) = 0;
+	// Bulk decoding call, which fills as much of [buf] as possible before
+	// returning, and only returns 0 at the end of the part. Errors are
+	// reported the same way as for part_decode_single(). The default
+	// implementation simply calls part_decode_single() in a loop; codecs
+	// that can decode straight into large buffers should override it.
+	virtual size_t part_decode(void *buf, size_t size);
 	// Seeks to the raw decoded, non-interleaved audio sample (byte
 	// divided by bitdepth and number of channels). Guaranteed to be
 	// less than the total number of samples in the stream.
@@ -143,6 +156,88 @@ struct track_pcm_t : public track_t {
 	virtual ~track_pcm_t() {}
 };
 
+// Decode timing and underrun statistics of a decode-ahead buffer.
+struct decode_stats_t {
+	// Decode latencies are counted in buckets of this many microseconds,
+	// up to 100 ms. The last bucket collects everything slower.
+	static constexpr unsigned int LATENCY_BUCKET_US = 50;
+	static constexpr size_t LATENCY_BUCKETS = (100000 / LATENCY_BUCKET_US) + 1;
+
+	std::unique_ptr<uint32_t[]> latency = std::make_unique<uint32_t[]>(LATENCY_BUCKETS);
+	uint64_t decode_calls = 0;
+	uint64_t decode_bytes = 0;
+	LONGLONG decode_ticks = 0;
+	LONGLONG decode_ticks_max = 0;
+
+	// Game reads, and the time between them
+	uint64_t reads = 0;
+	LONGLONG read_last = 0;
+	LONGLONG read_interval_ticks = 0;
+	LONGLONG read_interval_ticks_max = 0;
+	// Smallest amount of decoded audio that was left in the buffer when
+	// the game read, in bytes. Reads right after a seek are not counted.
+	size_t margin_min = SIZE_MAX;
+
+	// Reads that had to wait for the decoder, after a seek and otherwise.
+	uint64_t seek_waits = 0;
+	LONGLONG seek_wait_ticks = 0;
+	uint64_t underruns = 0;
+	LONGLONG underrun_ticks = 0;
+
+	static LONGLONG now();
+
+	void decoded(size_t bytes, LONGLONG ticks);
+	void read(size_t margin);
+	void waited(bool after_seek, LONGLONG ticks);
+
+	// Logs all statistics for the track [name], played in [pcmf] from a
+	// buffer of [buffer_size] bytes.
+	void print(const std::string &name, const pcm_format_t &pcmf, size_t buffer_size) const;
+};
+
+// Decodes a track on a background thread into a ring buffer, which is then
+// simply copied out of when streaming. The track must not be used by
+// anything else for the lifetime of this object. Decode times, the buffered
+// audio at every read, and underruns are logged when it is destroyed.
+class track_ahead_t {
+	track_t &track;
+	std::unique_ptr<uint8_t[]> ring;
+	const size_t ring_size;
+	const std::string name;
+	decode_stats_t stats;
+
+	SRWLOCK lock = SRWLOCK_INIT;
+	CONDITION_VARIABLE filled = CONDITION_VARIABLE_INIT;
+	CONDITION_VARIABLE drained = CONDITION_VARIABLE_INIT;
+	// Total number of bytes written to and read from [ring] since the
+	// last seek.
+	size_t write_total = 0;
+	size_t read_total = 0;
+	// Incremented on every seek, to discard anything decoded before.
+	unsigned int generation = 0;
+	bool seek_pending = false;
+	size_t seek_byte = 0;
+	bool failed = false;
+	bool quit = false;
+	HANDLE thread = nullptr;
+
+	static DWORD WINAPI worker(void *param);
+	void work();
+
+public:
+	// Same semantics as track_t::decode().
+	bool decode(void *buf, size_t size);
+	// Flushes the buffer and refills it starting at [byte].
+	void seek_to_byte(size_t byte);
+
+	// [ahead_ms] is the amount of audio to keep decoded. [name] is only
+	// used for the statistics.
+	track_ahead_t(track_t &track, size_t start_byte, unsigned int ahead_ms, const stringref_t &name);
+	track_ahead_t(const track_ahead_t &) = delete;
+	track_ahead_t& operator =(const track_ahead_t &) = delete;
+	~track_ahead_t();
+};
+
 // Opens [stream] as a part of a modded track, using a specific codec.
 // Should show a message box if [stream] is not a valid file for this codec.
 typedef std::unique_ptr<pcm_part_t> pcm_part_open_t(HANDLE &&stream);
@@ -152,6 +247,37 @@ std::unique_ptr<track_pcm_t> pcm_open(
 );
 /// -----------
 
+/// Seek indices
+/// ------------
+// Codecs that can't seek in constant time can save an index of sample
+// positions to file offsets the first time a file is opened, and reuse it
+// on every later open of the same file.
+struct seek_index_id_t {
+	uint64_t codec_hash;
+	uint64_t head_hash;
+	uint64_t size;
+	uint64_t mtime;
+};
+
+// Identifies the file behind [stream] for the given [codec] name. The file
+// pointer of [stream] is left unchanged.
+bool seek_index_identify(seek_index_id_t &id, HANDLE stream, const char *codec);
+
+// Both the layout and the meaning of the index values are up to the codec.
+bool seek_index_load(std::vector<uint64_t> &index, const seek_index_id_t &id);
+void seek_index_save(const std::vector<uint64_t> &index, const seek_index_id_t &id);
+/// ------------
+
+/// Format conversion
+/// -----------------
+// Returns a track that plays [track] in [pcmf], converting the channel
+// count, bit depth, and sampling rate as necessary. If [track] already is
+// in [pcmf], or the conversion isn't supported, [track] is returned as-is.
+std::unique_ptr<track_t> track_convert(
+	std::unique_ptr<track_t> &&track, const pcm_format_t &pcmf
+);
+/// -----------------
+
 /// Codecs
 /// ------
 struct codec_t {
@@ -167,6 +293,20 @@ extern const codec_t CODECS[3];
 std::unique_ptr<track_t> stack_bgm_resolve(const stringref_t &basename);
 /// ---------------------
 
+/// Decoded PCM cache
+/// -----------------
+// Returns a track playing the cached decoded PCM of [track], which was
+// opened from [intro_fn] and the optional [loop_fn] in [patch_info] using
+// [codec_open]. On a cache miss, [track] is returned, and the cache entry
+// is created in the background. Does nothing unless enabled in the run
+// configuration.
+std::unique_ptr<track_t> pcm_cache_track(
+	std::unique_ptr<track_pcm_t> &&track,
+	pcm_part_open_t &codec_open,
+	const patch_t *patch_info, const char *intro_fn, const char *loop_fn
+);
+/// -----------------
+
 /// Streaming APIs
 /// --------------
 // MMIO implementation
@@ -0,0 +1,400 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * BGM modding library for games using uncompressed PCM music
+  *
+  * ----
+  *
+  * Conversion of modded tracks to the PCM format the game expects.
+  */
+
+#include <thcrap.h>
+#include <numeric>
+#include <vector>
+#include "bgmmod.hpp"
+#include <emmintrin.h>
+
+/**
+  * Everything is converted in blocks of at most CONVERT_BLOCK_FRAMES output
+  * frames, which keeps all buffers small enough to stay in cache when this
+  * runs on the decode-ahead thread.
+  *
+  * Sample rate conversion uses a polyphase windowed-sinc FIR filter. For a
+  * reduced rate ratio of L/M (output/input), the filter has one phase for
+  * each of the L possible positions of an output sample between two input
+  * samples, which makes the conversion exact for all common rates. Ratios
+  * with a larger L round the position to the nearest of CONVERT_PHASES_MAX
+  * phases instead.
+  *
+  * Anything that has to be requantized to 16 bits (a 32-bit source, or any
+  * resampled track) is dithered with triangular noise of ±1 LSB.
+  */
+
+/// Constants
+/// ---------
+#define CONVERT_BLOCK_FRAMES 4096
+#define CONVERT_TAPS 32
+#define CONVERT_PHASES_MAX 1024
+// Keeps the transition band of the low-pass filter below Nyquist.
+#define CONVERT_CUTOFF 0.95
+/// ---------
+
+/// SIMD helpers
+/// ------------
+static float convert_dot(const float *h, const float *x)
+{
+	if(BGMMOD_SSE2) {
+		__m128 acc = _mm_setzero_ps();
+		for(size_t k = 0; k < CONVERT_TAPS; k += 4) {
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(h + k), _mm_loadu_ps(x + k)));
+		}
+		acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+		acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+		return _mm_cvtss_f32(acc);
+	}
+	float ret = 0.0f;
+	for(size_t k = 0; k < CONVERT_TAPS; k++) {
+		ret += h[k] * x[k];
+	}
+	return ret;
+}
+
+// Advances the four xorshift32 generators in [state] and returns their
+// new values, mapped to [0, 1).
+static __m128 dither_next(__m128i &state)
+{
+	state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+	state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+	state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+	const __m128i one = _mm_set1_epi32(0x3F800000);
+	const __m128 f = _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(state, 9), one));
+	return _mm_sub_ps(f, _mm_set1_ps(1.0f));
+}
+
+static float dither_next(uint32_t &state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+// Dithers and converts [count] samples, already scaled to the 16-bit
+// range, from [in] to [out].
+static void float_to_s16_dither(int16_t *out, const float *in, size_t count, uint32_t state[4])
+{
+	size_t i = 0;
+	if(BGMMOD_SSE2) {
+		__m128i s = _mm_loadu_si128((const __m128i *)state);
+		const __m128 lo = _mm_set1_ps(-32768.0f);
+		const __m128 hi = _mm_set1_ps(32767.0f);
+		auto conv = [&](const float *p) {
+			const __m128 r1 = dither_next(s);
+			const __m128 r2 = dither_next(s);
+			__m128 v = _mm_add_ps(_mm_loadu_ps(p), _mm_sub_ps(r1, r2));
+			v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+			return _mm_cvtps_epi32(v);
+		};
+		for(; (i + 8) <= count; i += 8) {
+			const __m128i v = _mm_packs_epi32(conv(in + i), conv(in + i + 4));
+			_mm_storeu_si128((__m128i *)(out + i), v);
+		}
+		_mm_storeu_si128((__m128i *)state, s);
+	}
+	for(; i < count; i++) {
+		auto &s = state[i % 4];
+		const float r1 = dither_next(s);
+		const float r2 = dither_next(s);
+		auto val = lrintf(in[i] + (r1 - r2));
+		out[i] = (int16_t)min(max(val, -32768L), 32767L);
+	}
+}
+/// ------------
+
+/// Track class
+/// -----------
+class track_convert_t : public track_t {
+	std::unique_ptr<track_t> src;
+	const size_t src_frame_size;
+	const size_t frame_size;
+	// Output/input sample rate ratio, reduced.
+	const uint32_t L;
+	const uint32_t M;
+	const bool resample;
+
+	// Filter coefficients, CONVERT_TAPS for each phase.
+	std::vector<float> filter;
+	uint32_t phases = 0;
+
+	// Planar history of converted input frames for the filter, starting
+	// at the (possibly negative, and therefore silent) input frame
+	// [hist_start].
+	std::vector<float> hist[2];
+	int64_t hist_start = 0;
+	size_t hist_len = 0;
+	// Position of the next output frame on the input timeline, in units
+	// of 1/L input frames.
+	uint64_t in_num = 0;
+
+	std::vector<uint8_t> src_buf;
+	std::vector<float> mix;
+	uint32_t dither_state[4] = {
+		0x9E3779B9, 0x7F4A7C15, 0x85EBCA6B, 0xC2B2AE35
+	};
+
+	void filter_init();
+	// Converts [frames] frames from [src_buf] to the output channel
+	// layout, as floats in the 16-bit range. Writes them either planar to
+	// [hist] at [offset], or interleaved to [mix] if [planar] is false.
+	void src_to_float(size_t frames, bool planar, size_t offset);
+	// Discards all history before [first], and refills it.
+	bool hist_fill(int64_t first);
+
+	size_t decode_resample(int16_t *out, size_t frames);
+	size_t decode_direct(int16_t *out, size_t frames);
+
+public:
+	size_t decode_single(void *buf, size_t size);
+	void seek_to_byte(size_t byte);
+
+	track_convert_t(
+		std::unique_ptr<track_t> &&src, const pcm_format_t &pcmf,
+		uint32_t L, uint32_t M, size_t intro_size, size_t total_size
+	);
+	virtual ~track_convert_t() {}
+};
+
+track_convert_t::track_convert_t(
+	std::unique_ptr<track_t> &&src_in, const pcm_format_t &pcmf,
+	uint32_t L, uint32_t M, size_t intro_size, size_t total_size
+)
+	: track_t(pcmf, intro_size, total_size),
+	src(std::move(src_in)),
+	src_frame_size((src->pcmf.bitdepth / 8) * src->pcmf.channels),
+	frame_size((pcmf.bitdepth / 8) * pcmf.channels),
+	L(L), M(M), resample(L != M)
+{
+	src_buf.resize(CONVERT_BLOCK_FRAMES * src_frame_size);
+	mix.resize(CONVERT_BLOCK_FRAMES * pcmf.channels);
+	if(resample) {
+		filter_init();
+		for(size_t c = 0; c < pcmf.channels; c++) {
+			hist[c].resize(CONVERT_BLOCK_FRAMES + CONVERT_TAPS);
+		}
+		hist_start = 1 - (CONVERT_TAPS / 2);
+	}
+}
+
+void track_convert_t::filter_init()
+{
+	const double PI = 3.14159265358979323846;
+	const double half = CONVERT_TAPS / 2;
+	// Relative to the input rate.
+	const double cutoff = CONVERT_CUTOFF * min(1.0, (double)L / M);
+
+	phases = min(L, (uint32_t)CONVERT_PHASES_MAX);
+	filter.resize(phases * CONVERT_TAPS);
+	for(uint32_t p = 0; p < phases; p++) {
+		float *h = &filter[p * CONVERT_TAPS];
+		double sum = 0.0;
+		for(size_t k = 0; k < CONVERT_TAPS; k++) {
+			// Distance of this tap from the exact output position.
+			const double t = ((double)k - half + 1.0) - ((double)p / phases);
+			const double x = cutoff * t;
+			const double sinc = (x == 0.0) ? 1.0 : (sin(PI * x) / (PI * x));
+			const double w = t / half;
+			const double blackman = (fabs(w) >= 1.0) ? 0.0 : (
+				0.42 + 0.5 * cos(PI * w) + 0.08 * cos(2.0 * PI * w)
+			);
+			const double v = cutoff * sinc * blackman;
+			h[k] = (float)v;
+			sum += v;
+		}
+		// Unity gain at DC for every phase.
+		for(size_t k = 0; k < CONVERT_TAPS; k++) {
+			h[k] = (float)(h[k] / sum);
+		}
+	}
+}
+
+void track_convert_t::src_to_float(size_t frames, bool planar, size_t offset)
+{
+	const size_t src_ch = src->pcmf.channels;
+	const size_t ch = pcmf.channels;
+	const auto *s16 = (const int16_t *)src_buf.data();
+	const auto *s32 = (const int32_t *)src_buf.data();
+	const bool is_s32 = (src->pcmf.bitdepth == 32);
+	auto sample = [&](size_t i) {
+		return is_s32 ? (s32[i] * (1.0f / 65536.0f)) : (float)s16[i];
+	};
+	for(size_t f = 0; f < frames; f++) {
+		float v[2];
+		if(src_ch == ch) {
+			for(size_t c = 0; c < ch; c++) {
+				v[c] = sample((f * ch) + c);
+			}
+		} else if(src_ch == 1) {
+			v[0] = v[1] = sample(f);
+		} else {
+			v[0] = (sample(f * 2) + sample((f * 2) + 1)) * 0.5f;
+		}
+		for(size_t c = 0; c < ch; c++) {
+			if(planar) {
+				hist[c][offset + f] = v[c];
+			} else {
+				mix[(f * ch) + c] = v[c];
+			}
+		}
+	}
+}
+
+bool track_convert_t::hist_fill(int64_t first)
+{
+	const size_t ch = pcmf.channels;
+	const auto drop = (size_t)min(first - hist_start, (int64_t)hist_len);
+	for(size_t c = 0; c < ch; c++) {
+		memmove(hist[c].data(), hist[c].data() + drop, (hist_len - drop) * sizeof(float));
+	}
+	hist_len -= drop;
+	hist_start = first;
+
+	const size_t hist_cap = hist[0].size();
+	// Silence before the start of the track.
+	while(hist_len < hist_cap && (hist_start + (int64_t)hist_len) < 0) {
+		for(size_t c = 0; c < ch; c++) {
+			hist[c][hist_len] = 0.0f;
+		}
+		hist_len++;
+	}
+	const size_t frames = min(hist_cap - hist_len, (size_t)CONVERT_BLOCK_FRAMES);
+	if(frames > 0) {
+		if(!src->decode(src_buf.data(), frames * src_frame_size)) {
+			return false;
+		}
+		src_to_float(frames, true, hist_len);
+		hist_len += frames;
+	}
+	return true;
+}
+
+size_t track_convert_t::decode_resample(int16_t *out, size_t frames)
+{
+	const size_t ch = pcmf.channels;
+	for(size_t f = 0; f < frames; f++) {
+		const auto i = (int64_t)(in_num / L);
+		const auto frac = (uint32_t)(in_num % L);
+		const int64_t first = i - (CONVERT_TAPS / 2) + 1;
+		if((first + CONVERT_TAPS) > (hist_start + (int64_t)hist_len)) {
+			if(!hist_fill(first)) {
+				return -1;
+			}
+		}
+		const uint32_t phase = (phases == L)
+			? frac
+			: (uint32_t)(((uint64_t)frac * phases) / L);
+		const float *h = &filter[phase * CONVERT_TAPS];
+		const auto offset = (size_t)(first - hist_start);
+		for(size_t c = 0; c < ch; c++) {
+			mix[(f * ch) + c] = convert_dot(h, &hist[c][offset]);
+		}
+		in_num += M;
+	}
+	float_to_s16_dither(out, mix.data(), frames * ch, dither_state);
+	return frames * frame_size;
+}
+
+size_t track_convert_t::decode_direct(int16_t *out, size_t frames)
+{
+	if(!src->decode(src_buf.data(), frames * src_frame_size)) {
+		return -1;
+	}
+	const size_t ch = pcmf.channels;
+	if(src->pcmf.bitdepth == 32) {
+		src_to_float(frames, false, 0);
+		float_to_s16_dither(out, mix.data(), frames * ch, dither_state);
+		return frames * frame_size;
+	}
+	// Only the channel count differs, which doesn't need any requantizing.
+	const auto *in = (const int16_t *)src_buf.data();
+	size_t f = 0;
+	if(ch == 2) {
+		if(BGMMOD_SSE2) {
+			for(; (f + 8) <= frames; f += 8) {
+				const __m128i v = _mm_loadu_si128((const __m128i *)(in + f));
+				_mm_storeu_si128((__m128i *)(out + (f * 2)), _mm_unpacklo_epi16(v, v));
+				_mm_storeu_si128((__m128i *)(out + (f * 2) + 8), _mm_unpackhi_epi16(v, v));
+			}
+		}
+		for(; f < frames; f++) {
+			out[(f * 2) + 0] = in[f];
+			out[(f * 2) + 1] = in[f];
+		}
+	} else {
+		for(; f < frames; f++) {
+			out[f] = (int16_t)((in[f * 2] + in[(f * 2) + 1]) >> 1);
+		}
+	}
+	return frames * frame_size;
+}
+
+size_t track_convert_t::decode_single(void *buf, size_t size)
+{
+	const size_t frames = min(size / frame_size, (size_t)CONVERT_BLOCK_FRAMES);
+	if(resample) {
+		return decode_resample((int16_t *)buf, frames);
+	}
+	return decode_direct((int16_t *)buf, frames);
+}
+
+void track_convert_t::seek_to_byte(size_t byte)
+{
+	const uint64_t frame = byte / frame_size;
+	if(!resample) {
+		src->seek_to_byte((size_t)frame * src_frame_size);
+		return;
+	}
+	in_num = frame * M;
+	const int64_t first = (int64_t)(in_num / L) - (CONVERT_TAPS / 2) + 1;
+	hist_start = first;
+	hist_len = 0;
+	src->seek_to_byte((size_t)max(first, (int64_t)0) * src_frame_size);
+}
+/// -----------
+
+std::unique_ptr<track_t> track_convert(
+	std::unique_ptr<track_t> &&track, const pcm_format_t &pcmf
+)
+{
+	const auto &src_pcmf = track->pcmf;
+	if(
+		src_pcmf == pcmf
+		|| (src_pcmf.bitdepth != 16 && src_pcmf.bitdepth != 32)
+		|| (src_pcmf.channels != 1 && src_pcmf.channels != 2)
+		|| (pcmf.bitdepth != 16)
+		|| (pcmf.channels != 1 && pcmf.channels != 2)
+		|| (src_pcmf.samplingrate == 0 || pcmf.samplingrate == 0)
+	) {
+		return std::move(track);
+	}
+	const auto gcd = std::gcd(pcmf.samplingrate, src_pcmf.samplingrate);
+	const uint32_t L = pcmf.samplingrate / gcd;
+	const uint32_t M = src_pcmf.samplingrate / gcd;
+
+	const size_t src_frame_size = (src_pcmf.bitdepth / 8) * src_pcmf.channels;
+	const size_t frame_size = (pcmf.bitdepth / 8) * pcmf.channels;
+	auto frames_convert = [&](size_t bytes) {
+		const uint64_t frames = bytes / src_frame_size;
+		return (size_t)(((frames * L) + (M / 2)) / M) * frame_size;
+	};
+	const size_t intro_size = frames_convert(track->intro_size);
+	const size_t total_size = intro_size + frames_convert(
+		track->total_size - track->intro_size
+	);
+
+	log_printf(
+		"(BGM) Converting %s to %s\n",
+		src_pcmf.to_string().str, pcmf.to_string().str
+	);
+	return std::make_unique<track_convert_t>(
+		std::move(track), pcmf, L, M, intro_size, total_size
+	);
+}
@@ -9,6 +9,7 @@
 
 #include <thcrap.h>
 #include "bgmmod.hpp"
+#include <algorithm>
 
 static MMRESULT (WINAPI *chain_mmioAdvance)(HMMIO, LPMMIOINFO, UINT);
 static MMRESULT (WINAPI *chain_mmioAscend)(HMMIO, LPMMCKINFO, UINT);
@@ -30,17 +31,23 @@ struct mmio_wrap_t
 	char buffer[MMIO_DEFAULTBUFFER];
 };
 
-mmio_wrap_t mmio_wrap;
+// Every open modded file. The HMMIO we return is the address of the
+// wrapper, which is only ever dereferenced after it was found in here.
+static std::vector<std::unique_ptr<mmio_wrap_t>> mmio_wraps;
+static SRWLOCK mmio_wraps_srwlock = { SRWLOCK_INIT };
 
-// Using a separate function to decide whether [handle] points to a MMIO
-// wrapper structure makes it easier to later handle multiple files
-// simultaneously.
 mmio_wrap_t* find_mmio_wrap(void* handle)
 {
-	if(handle == &mmio_wrap) {
-		return &mmio_wrap;
+	mmio_wrap_t *ret = nullptr;
+	AcquireSRWLockShared(&mmio_wraps_srwlock);
+	for(const auto &wrap : mmio_wraps) {
+		if(handle == wrap.get()) {
+			ret = wrap.get();
+			break;
+		}
 	}
-	return nullptr;
+	ReleaseSRWLockShared(&mmio_wraps_srwlock);
+	return ret;
 }
 
 #define FALLBACK_ON_SYSTEM_HANDLE(func, ...) \
@@ -77,6 +84,14 @@ MMRESULT WINAPI bgmmod_mmioAscend(HMMIO hmmio, LPMMCKINFO pmmcki, UINT fuAscend)
 MMRESULT WINAPI bgmmod_mmioClose(HMMIO hmmio, UINT fuClose)
 {
 	FALLBACK_ON_SYSTEM_HANDLE(mmioClose, fuClose);
+	AcquireSRWLockExclusive(&mmio_wraps_srwlock);
+	auto elm = std::find_if(mmio_wraps.begin(), mmio_wraps.end(), [mod](const auto &wrap) {
+		return wrap.get() == mod;
+	});
+	if(elm != mmio_wraps.end()) {
+		mmio_wraps.erase(elm);
+	}
+	ReleaseSRWLockExclusive(&mmio_wraps_srwlock);
 	return 0;
 }
 
@@ -131,7 +146,6 @@ MMRESULT WINAPI bgmmod_mmioGetInfo(HMMIO hmmio, LPMMIOINFO pmmioinfo, UINT fuInf
 HMMIO WINAPI bgmmod_mmioOpenA(LPSTR pszFileName, LPMMIOINFO pmmioinfo, DWORD fdwOpen)
 {
 	auto fallback = [&] {
-		mmio_wrap.track.reset(nullptr);
 		return chain_mmioOpenA(pszFileName, pmmioinfo, fdwOpen);
 	};
 
@@ -164,12 +178,17 @@ HMMIO WINAPI bgmmod_mmioOpenA(LPSTR pszFileName, LPMMIOINFO pmmioinfo, DWORD fdw
 		return fallback();
 	}
 
-	mmio_wrap.track = std::move(modtrack);
-	mmio_wrap.open_flags = fdwOpen;
-	mmio_wrap.next = (fdwOpen & MMIO_ALLOCBUF)
-		? mmio_wrap.buffer
+	auto wrap = std::make_unique<mmio_wrap_t>();
+	wrap->track = std::move(modtrack);
+	wrap->open_flags = fdwOpen;
+	wrap->next = (fdwOpen & MMIO_ALLOCBUF)
+		? wrap->buffer
 		: pmmioinfo->pchBuffer;
-	return (HMMIO)&mmio_wrap;
+	auto *ret = wrap.get();
+	AcquireSRWLockExclusive(&mmio_wraps_srwlock);
+	mmio_wraps.emplace_back(std::move(wrap));
+	ReleaseSRWLockExclusive(&mmio_wraps_srwlock);
+	return (HMMIO)ret;
 }
 
 LONG WINAPI bgmmod_mmioRead(HMMIO hmmio, HPSTR pch, LONG cch)
@@ -8,6 +8,7 @@
   */
 
 #include <thcrap.h>
+#include <vector>
 #include "bgmmod.hpp"
 
 #include <libmpg123/ports/MSVC++/mpg123.h>
@@ -111,6 +112,9 @@ std::unique_ptr<pcm_part_t> mp3_open(HANDLE &&stream)
 		return nullptr;
 	}
 
+	seek_index_id_t index_id;
+	const bool index_identified = seek_index_identify(index_id, stream, "mp3");
+
 	mh = mpg123_new(nullptr, &err);
 	if(err != MPG123_OK) {
 		return fail("Error creating mpg123 handle", err);
@@ -131,7 +135,37 @@ std::unique_ptr<pcm_part_t> mp3_open(HANDLE &&stream)
 		return fail("Error initializing file", err);
 	}
 
-	auto sample_length = mpg123_length(mh);
+	// mpg123 only seeks accurately within its frame index, which it would
+	// otherwise only build while decoding. A saved index consists of the
+	// exact sample length, the frame step, and the frame offsets.
+	off_t sample_length = -1;
+	std::vector<uint64_t> index;
+	if(index_identified && seek_index_load(index, index_id) && index.size() >= 3) {
+		std::vector<off_t> offsets(index.begin() + 2, index.end());
+		err = mpg123_set_index(mh, offsets.data(), (off_t)index[1], offsets.size());
+		if(err == MPG123_OK) {
+			sample_length = (off_t)index[0];
+		}
+	}
+	if(sample_length <= 0) {
+		off_t *offsets;
+		off_t step;
+		size_t fill;
+		if(mpg123_scan(mh) == MPG123_OK) {
+			sample_length = mpg123_length(mh);
+			if(
+				index_identified && sample_length > 0
+				&& mpg123_index(mh, &offsets, &step, &fill) == MPG123_OK
+				&& fill > 0
+			) {
+				index.assign({ (uint64_t)sample_length, (uint64_t)step });
+				index.insert(index.end(), offsets, offsets + fill);
+				seek_index_save(index, index_id);
+			}
+		} else {
+			sample_length = mpg123_length(mh);
+		}
+	}
 	if(sample_length <= 0) {
 		return fail("File not seekable?", MPG123_OK);
 	}
@@ -0,0 +1,385 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * BGM modding library for games using uncompressed PCM music
+  *
+  * ----
+  *
+  * On-disk cache of decoded tracks.
+  */
+
+#include <thcrap.h>
+#include <string>
+#include <vector>
+#include "bgmmod.hpp"
+
+/**
+  * If "bgm_pcm_cache" is true in the run configuration, every modded track
+  * is decoded once in the background and stored as raw PCM in the "bgm"
+  * namespace of the disk cache, keyed by hashes of its source files and its
+  * PCM format. Later resolutions of the same track then play straight from
+  * a sliding memory-mapped view of that entry, without running any decoder.
+  * Like every other entry, it is evicted once the disk cache exceeds its
+  * budget.
+  *
+  * Only a window of each file is mapped at a time, since all modded tracks
+  * of a game are resolved at once, and would otherwise easily exhaust the
+  * address space of a 32-bit process.
+  */
+
+/// File format
+/// -----------
+// The data of an entry consists of [intro_bytes] bytes of the intro part,
+// followed by [loop_bytes] bytes of the loop part and the trailer, which
+// comes last because the sizes are only known after decoding.
+#define PCM_CACHE_DISK_NS "bgm"
+#define PCM_CACHE_VERSION 2
+
+struct pcm_cache_key_t {
+	uint64_t intro_hash;
+	uint64_t loop_hash; // 0 if there is no loop part
+	uint32_t intro_size;
+	uint32_t loop_size;
+	pcm_format_t pcmf;
+};
+
+struct pcm_cache_trailer_t {
+	uint32_t intro_bytes;
+	uint32_t loop_bytes;
+};
+/// -----------
+
+// Size of the mapped view into a cache file.
+#define PCM_CACHE_WINDOW_SIZE (1024 * 1024)
+
+static uint64_t pcm_cache_hash(const void *data, size_t len, uint64_t h)
+{
+	const BYTE *p = (const BYTE *)data;
+	const uint64_t mul = 0x9E3779B97F4A7C15ull;
+	for(; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * mul;
+		h ^= h >> 29;
+	}
+	for(; len; len--, p++) {
+		h = (h ^ *p) * mul;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+static bool pcm_cache_enabled(void)
+{
+	return json_is_true(json_object_get(runconfig_json_get(), "bgm_pcm_cache"));
+}
+
+static std::string pcm_cache_disk_key(const pcm_cache_key_t &key)
+{
+	char ret[128];
+	snprintf(ret, sizeof(ret), "%u/%08x%08x.%u/%08x%08x.%u/%u.%u.%u",
+		PCM_CACHE_VERSION,
+		(uint32_t)(key.intro_hash >> 32), (uint32_t)key.intro_hash, key.intro_size,
+		(uint32_t)(key.loop_hash >> 32), (uint32_t)key.loop_hash, key.loop_size,
+		key.pcmf.samplingrate, key.pcmf.bitdepth, key.pcmf.channels
+	);
+	return ret;
+}
+
+// Hashes the source file [fn] in [patch_info]. Returns false if it can't
+// be read.
+static bool pcm_cache_source_hash(uint64_t &hash, uint32_t &size, const patch_t *patch_info, const char *fn)
+{
+	size_t file_size;
+	const void *view = patch_file_map(patch_info, fn, &file_size);
+	if(!view) {
+		return false;
+	}
+	hash = pcm_cache_hash(view, file_size, file_size) | 1;
+	size = (uint32_t)file_size;
+	file_unmap(view);
+	return true;
+}
+
+/// Mapped parts
+/// ------------
+struct pcm_cache_file_t {
+	HANDLE file;
+	HANDLE mapping;
+
+	pcm_cache_file_t(HANDLE file, HANDLE mapping)
+		: file(file), mapping(mapping) {
+	}
+	~pcm_cache_file_t() {
+		CloseHandle(mapping);
+		CloseHandle(file);
+	}
+};
+
+struct pcm_cache_part_t : public pcm_part_t {
+	// Shared between the intro and loop parts.
+	std::shared_ptr<pcm_cache_file_t> file;
+	// Offset of this part's first byte in the file.
+	const uint64_t data_offset;
+	// Current position, in bytes from the start of this part.
+	size_t pos = 0;
+
+	const uint8_t *window = nullptr;
+	uint64_t window_start = 0;
+	size_t window_size = 0;
+
+	size_t part_decode_single(void *buf, size_t size);
+	void part_seek_to_sample(size_t sample);
+
+	pcm_cache_part_t(
+		std::shared_ptr<pcm_cache_file_t> file,
+		uint64_t data_offset,
+		pcm_part_info_t &&info
+	) : pcm_part_t(std::move(info)), file(file), data_offset(data_offset) {
+	}
+	virtual ~pcm_cache_part_t();
+};
+
+size_t pcm_cache_part_t::part_decode_single(void *buf, size_t size)
+{
+	if(pos >= part_bytes) {
+		return 0;
+	}
+	const uint64_t abs = data_offset + pos;
+	if(!window || abs < window_start || abs >= (window_start + window_size)) {
+		static const DWORD granularity = [] {
+			SYSTEM_INFO si;
+			GetSystemInfo(&si);
+			return si.dwAllocationGranularity;
+		}();
+		if(window) {
+			UnmapViewOfFile(window);
+		}
+		window_start = abs - (abs % granularity);
+		const uint64_t data_end = data_offset + part_bytes;
+		window_size = (size_t)min(data_end - window_start, (uint64_t)PCM_CACHE_WINDOW_SIZE);
+		window = (const uint8_t *)MapViewOfFile(
+			file->mapping, FILE_MAP_READ,
+			(DWORD)(window_start >> 32), (DWORD)window_start, window_size
+		);
+		if(!window) {
+			bgmmod_log.errorf("Could not map cached PCM data (error %u)", GetLastError());
+			return (size_t)-1;
+		}
+	}
+	const auto window_offset = (size_t)(abs - window_start);
+	size = min(size, part_bytes - pos);
+	size = min(size, window_size - window_offset);
+	memcpy(buf, window + window_offset, size);
+	pos += size;
+	return size;
+}
+
+void pcm_cache_part_t::part_seek_to_sample(size_t sample)
+{
+	pos = sample * (pcmf.bitdepth / 8) * pcmf.channels;
+}
+
+pcm_cache_part_t::~pcm_cache_part_t()
+{
+	if(window) {
+		UnmapViewOfFile(window);
+	}
+}
+
+static std::unique_ptr<track_pcm_t> pcm_cache_open(const std::string &disk_key, const pcm_format_t &pcmf)
+{
+	uint64_t data_offset;
+	size_t data_size;
+	HANDLE hFile = disk_cache_open(PCM_CACHE_DISK_NS, disk_key.c_str(), &data_offset, &data_size);
+	if(hFile == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+	pcm_cache_trailer_t trailer;
+	LARGE_INTEGER trailer_offset;
+	trailer_offset.QuadPart = data_offset + data_size - sizeof(trailer);
+	DWORD byte_ret;
+	if(
+		data_size < sizeof(trailer)
+		|| !SetFilePointerEx(hFile, trailer_offset, nullptr, FILE_BEGIN)
+		|| !ReadFile(hFile, &trailer, sizeof(trailer), &byte_ret, nullptr)
+		|| byte_ret != sizeof(trailer)
+		|| trailer.intro_bytes == 0
+		|| (uint64_t)data_size != (
+			sizeof(trailer) + (uint64_t)trailer.intro_bytes + trailer.loop_bytes
+		)
+	) {
+		CloseHandle(hFile);
+		return nullptr;
+	}
+	HANDLE hMap = CreateFileMapping(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if(!hMap) {
+		CloseHandle(hFile);
+		return nullptr;
+	}
+	auto file = std::make_shared<pcm_cache_file_t>(hFile, hMap);
+
+	std::unique_ptr<pcm_part_t> intro = std::make_unique<pcm_cache_part_t>(
+		file, data_offset, pcm_part_info_t{ pcmf, trailer.intro_bytes }
+	);
+	std::unique_ptr<pcm_part_t> loop;
+	if(trailer.loop_bytes) {
+		loop = std::make_unique<pcm_cache_part_t>(
+			file, data_offset + trailer.intro_bytes,
+			pcm_part_info_t{ pcmf, trailer.loop_bytes }
+		);
+	}
+	return std::make_unique<track_pcm_t>(std::move(intro), std::move(loop));
+}
+/// ------------
+
+/// Background decoding
+/// -------------------
+struct pcm_cache_job_t {
+	std::string disk_key;
+	pcm_part_open_t *codec_open;
+	HANDLE intro;
+	HANDLE loop;
+};
+
+static std::vector<pcm_cache_job_t> pcm_cache_jobs;
+static SRWLOCK pcm_cache_srwlock = { SRWLOCK_INIT };
+static CONDITION_VARIABLE pcm_cache_cv = { CONDITION_VARIABLE_INIT };
+static HANDLE pcm_cache_thread = nullptr;
+
+// Decodes [part] to the end of [writer].
+// Returns the number of bytes written, or -1 on failure.
+static size_t pcm_cache_write_part(disk_cache_writer_t *writer, pcm_part_t &part, std::vector<uint8_t> &buf)
+{
+	size_t ret = 0;
+	part.part_seek_to_sample(0);
+	while(true) {
+		auto decoded = part.part_decode_single(buf.data(), buf.size());
+		if(decoded == (size_t)-1) {
+			return (size_t)-1;
+		} else if(decoded == 0) {
+			return ret;
+		}
+		// Also fails once the entry would exceed 4 GiB.
+		if(disk_cache_write(writer, buf.data(), decoded)) {
+			return (size_t)-1;
+		}
+		ret += decoded;
+	}
+}
+
+static void pcm_cache_job_run(pcm_cache_job_t &job)
+{
+	auto intro = job.codec_open(std::move(job.intro));
+	std::unique_ptr<pcm_part_t> loop;
+	if(job.loop != INVALID_HANDLE_VALUE) {
+		loop = job.codec_open(std::move(job.loop));
+		if(!loop) {
+			return;
+		}
+	}
+	if(!intro) {
+		return;
+	}
+	auto *writer = disk_cache_write_begin(PCM_CACHE_DISK_NS, job.disk_key.c_str());
+	if(!writer) {
+		return;
+	}
+
+	std::vector<uint8_t> buf(256 * 1024);
+	bool ok = true;
+	size_t intro_bytes = pcm_cache_write_part(writer, *intro, buf);
+	size_t loop_bytes = 0;
+	if(intro_bytes == (size_t)-1 || intro_bytes == 0) {
+		ok = false;
+	} else if(loop) {
+		loop_bytes = pcm_cache_write_part(writer, *loop, buf);
+		ok = (loop_bytes != (size_t)-1);
+	}
+	if(ok) {
+		const pcm_cache_trailer_t trailer = { (uint32_t)intro_bytes, (uint32_t)loop_bytes };
+		ok = !disk_cache_write(writer, &trailer, sizeof(trailer));
+	}
+	if(!disk_cache_write_end(writer, ok)) {
+		bgmmod_debugf("Cached decoded PCM for %s\n", job.disk_key.c_str());
+	}
+}
+
+static DWORD WINAPI pcm_cache_worker(void *)
+{
+	AcquireSRWLockExclusive(&pcm_cache_srwlock);
+	while(true) {
+		if(pcm_cache_jobs.empty()) {
+			SleepConditionVariableSRW(&pcm_cache_cv, &pcm_cache_srwlock, INFINITE, 0);
+			continue;
+		}
+		auto job = std::move(pcm_cache_jobs.front());
+		pcm_cache_jobs.erase(pcm_cache_jobs.begin());
+		ReleaseSRWLockExclusive(&pcm_cache_srwlock);
+		pcm_cache_job_run(job);
+		AcquireSRWLockExclusive(&pcm_cache_srwlock);
+	}
+	return 0;
+}
+
+static void pcm_cache_queue(pcm_cache_job_t &&job)
+{
+	AcquireSRWLockExclusive(&pcm_cache_srwlock);
+	if(!pcm_cache_thread) {
+		pcm_cache_thread = CreateThread(nullptr, 0, pcm_cache_worker, nullptr, 0, nullptr);
+	}
+	if(pcm_cache_thread) {
+		pcm_cache_jobs.emplace_back(std::move(job));
+		WakeConditionVariable(&pcm_cache_cv);
+	} else {
+		CloseHandle(job.intro);
+		if(job.loop != INVALID_HANDLE_VALUE) {
+			CloseHandle(job.loop);
+		}
+	}
+	ReleaseSRWLockExclusive(&pcm_cache_srwlock);
+}
+/// -------------------
+
+std::unique_ptr<track_t> pcm_cache_track(
+	std::unique_ptr<track_pcm_t> &&track,
+	pcm_part_open_t &codec_open,
+	const patch_t *patch_info, const char *intro_fn, const char *loop_fn
+)
+{
+	if(!track || !pcm_cache_enabled()) {
+		return std::move(track);
+	}
+	pcm_cache_key_t key = {};
+	key.pcmf = track->pcmf;
+	if(!pcm_cache_source_hash(key.intro_hash, key.intro_size, patch_info, intro_fn)) {
+		return std::move(track);
+	}
+	if(loop_fn && !pcm_cache_source_hash(key.loop_hash, key.loop_size, patch_info, loop_fn)) {
+		return std::move(track);
+	}
+	auto disk_key = pcm_cache_disk_key(key);
+	auto cached = pcm_cache_open(disk_key, key.pcmf);
+	if(cached) {
+		log_printf("(BGM) Playing decoded PCM for %s from the disk cache\n", intro_fn);
+		return std::move(cached);
+	}
+
+	// The decoder of [track] will be busy with streaming, so the
+	// background thread needs its own.
+	pcm_cache_job_t job = {
+		disk_key, &codec_open,
+		patch_file_stream(patch_info, intro_fn), INVALID_HANDLE_VALUE
+	};
+	if(job.intro == INVALID_HANDLE_VALUE) {
+		return std::move(track);
+	}
+	if(loop_fn) {
+		job.loop = patch_file_stream(patch_info, loop_fn);
+		if(job.loop == INVALID_HANDLE_VALUE) {
+			CloseHandle(job.intro);
+			return std::move(track);
+		}
+	}
+	pcm_cache_queue(std::move(job));
+	return std::move(track);
+}
@@ -0,0 +1,112 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * BGM modding library for games using uncompressed PCM music
+  *
+  * ----
+  *
+  * Persistent seek indices for codecs that can't seek in constant time.
+  */
+
+#include <thcrap.h>
+#include <string>
+#include <vector>
+#include "bgmmod.hpp"
+
+/**
+  * Indices are stored in the "bgmseek" namespace of the disk cache, keyed by
+  * a hash of the codec name and the identity of the source file, as an
+  * array of 64-bit values. A file is identified by its size,
+  * its last write time, and a hash of its first 64 KiB, which is cheap to
+  * compute on every open, yet still catches files that were replaced while
+  * keeping their timestamp.
+  */
+
+#define SEEK_INDEX_DISK_NS "bgmseek"
+#define SEEK_INDEX_VERSION 2
+#define SEEK_INDEX_HEAD_SIZE (64 * 1024)
+
+static uint64_t seek_index_hash(const void *data, size_t len, uint64_t h)
+{
+	const BYTE *p = (const BYTE *)data;
+	const uint64_t mul = 0x9E3779B97F4A7C15ull;
+	for(; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * mul;
+		h ^= h >> 29;
+	}
+	for(; len; len--, p++) {
+		h = (h ^ *p) * mul;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+static std::string seek_index_disk_key(const seek_index_id_t &id)
+{
+	char ret[96];
+	snprintf(ret, sizeof(ret), "%u/%08x%08x/%08x%08x.%llu.%llu",
+		SEEK_INDEX_VERSION,
+		(uint32_t)(id.codec_hash >> 32), (uint32_t)id.codec_hash,
+		(uint32_t)(id.head_hash >> 32), (uint32_t)id.head_hash,
+		id.size, id.mtime
+	);
+	return ret;
+}
+
+bool seek_index_identify(seek_index_id_t &id, HANDLE stream, const char *codec)
+{
+	id = {};
+	LARGE_INTEGER size;
+	FILETIME mtime;
+	LARGE_INTEGER pos_zero = {};
+	LARGE_INTEGER pos_prev;
+	if(
+		!GetFileSizeEx(stream, &size)
+		|| !GetFileTime(stream, nullptr, nullptr, &mtime)
+		|| !SetFilePointerEx(stream, pos_zero, &pos_prev, FILE_CURRENT)
+	) {
+		return false;
+	}
+	auto head_size = (DWORD)min(size.QuadPart, (LONGLONG)SEEK_INDEX_HEAD_SIZE);
+	std::vector<uint8_t> head(head_size);
+	DWORD byte_ret = 0;
+	bool ret = SetFilePointerEx(stream, pos_zero, nullptr, FILE_BEGIN)
+		&& ReadFile(stream, head.data(), head_size, &byte_ret, nullptr)
+		&& (byte_ret == head_size);
+	SetFilePointerEx(stream, pos_prev, nullptr, FILE_BEGIN);
+	if(!ret) {
+		return false;
+	}
+	id.codec_hash = seek_index_hash(codec, strlen(codec), 0);
+	id.head_hash = seek_index_hash(head.data(), head.size(), 0);
+	id.size = size.QuadPart;
+	id.mtime = ((uint64_t)mtime.dwHighDateTime << 32) | mtime.dwLowDateTime;
+	return true;
+}
+
+bool seek_index_load(std::vector<uint64_t> &index, const seek_index_id_t &id)
+{
+	size_t size;
+	auto *values = (uint64_t *)disk_cache_get(SEEK_INDEX_DISK_NS, seek_index_disk_key(id).c_str(), &size);
+	if(!values) {
+		return false;
+	}
+	bool ret = (size % sizeof(uint64_t)) == 0;
+	if(ret) {
+		index.assign(values, values + (size / sizeof(uint64_t)));
+	}
+	free(values);
+	return ret;
+}
+
+void seek_index_save(const std::vector<uint64_t> &index, const seek_index_id_t &id)
+{
+	if(index.empty()) {
+		return;
+	}
+	disk_cache_put(
+		SEEK_INDEX_DISK_NS, seek_index_disk_key(id).c_str(),
+		index.data(), index.size() * sizeof(uint64_t), 0
+	);
+}
@@ -8,7 +8,9 @@
   */
 
 #include <thcrap.h>
+#include <vector>
 #include "bgmmod.hpp"
+#include <emmintrin.h>
 
 #define OV_EXCLUDE_STATIC_CALLBACKS
 #include <vorbis/vorbisfile.h>
@@ -71,14 +73,125 @@ const char* ov_strerror(int ret)
 }
 /// --------------------
 
+/// Sample conversion
+/// -----------------
+// Interleaves and converts [frames] float samples of each of the
+// [channels] in [pcm] to 16-bit PCM in [out]. Rounds and clips exactly
+// like ov_read().
+static void vorbis_float_to_s16(int16_t *out, float **pcm, size_t frames, size_t channels)
+{
+	size_t i = 0;
+	if(BGMMOD_SSE2 && (channels == 1 || channels == 2)) {
+		const __m128 scale = _mm_set1_ps(32768.0f);
+		const __m128 lo = _mm_set1_ps(-32768.0f);
+		const __m128 hi = _mm_set1_ps(32767.0f);
+		auto conv = [&](const float *p) {
+			__m128 v = _mm_mul_ps(_mm_loadu_ps(p), scale);
+			v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+			return _mm_cvtps_epi32(v);
+		};
+		if(channels == 2) {
+			for(; (i + 4) <= frames; i += 4) {
+				const __m128i l = conv(pcm[0] + i);
+				const __m128i r = conv(pcm[1] + i);
+				const __m128i lr = _mm_unpacklo_epi16(
+					_mm_packs_epi32(l, l), _mm_packs_epi32(r, r)
+				);
+				_mm_storeu_si128((__m128i *)(out + (i * 2)), lr);
+			}
+		} else {
+			for(; (i + 8) <= frames; i += 8) {
+				const __m128i s = _mm_packs_epi32(conv(pcm[0] + i), conv(pcm[0] + i + 4));
+				_mm_storeu_si128((__m128i *)(out + i), s);
+			}
+		}
+	}
+	for(; i < frames; i++) {
+		for(size_t c = 0; c < channels; c++) {
+			auto val = lrintf(pcm[c][i] * 32768.0f);
+			val = min(max(val, -32768L), 32767L);
+			out[(i * channels) + c] = (int16_t)val;
+		}
+	}
+}
+/// -----------------
+
+/// Seek index
+/// ----------
+// Ogg Vorbis streams don't contain any index, which makes ov_pcm_seek()
+// bisect the file on every seek. Instead, we build our own index by just
+// walking all Ogg pages once, and then jump straight to the right page.
+// The index consists of granule position and file offset pairs.
+
+// Returns an empty index for anything unusual, which ov_pcm_seek() should
+// rather handle on its own.
+static std::vector<uint64_t> vorbis_index_build(HANDLE stream)
+{
+	std::vector<uint64_t> ret;
+	LARGE_INTEGER file_size;
+	if(!GetFileSizeEx(stream, &file_size)) {
+		return ret;
+	}
+	HANDLE hMap = CreateFileMapping(stream, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if(!hMap) {
+		return ret;
+	}
+	auto *view = (const uint8_t *)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(hMap);
+	if(!view) {
+		return ret;
+	}
+	const auto size = (size_t)file_size.QuadPart;
+	size_t pos = 0;
+	uint32_t serial = 0;
+	while(pos < size) {
+		const uint8_t *page = view + pos;
+		if((size - pos) < 27 || memcmp(page, "OggS", 4) || page[4] != 0) {
+			ret.clear();
+			break;
+		}
+		uint32_t page_serial;
+		int64_t granulepos;
+		memcpy(&page_serial, page + 14, sizeof(page_serial));
+		memcpy(&granulepos, page + 6, sizeof(granulepos));
+		if(pos == 0) {
+			serial = page_serial;
+		} else if(page_serial != serial) {
+			// Chained or multiplexed streams
+			ret.clear();
+			break;
+		}
+		const size_t segments = page[26];
+		if((size - pos) < (27 + segments)) {
+			ret.clear();
+			break;
+		}
+		size_t body_size = 0;
+		for(size_t i = 0; i < segments; i++) {
+			body_size += page[27 + i];
+		}
+		if(granulepos != -1) {
+			ret.push_back((uint64_t)granulepos);
+			ret.push_back(pos);
+		}
+		pos += 27 + segments + body_size;
+	}
+	UnmapViewOfFile(view);
+	return ret;
+}
+/// ----------
+
 struct vorbis_part_t : public pcm_part_t {
 	OggVorbis_File vf;
+	std::vector<uint64_t> index;
 
 	size_t part_decode_single(void *buf, size_t size);
+	size_t part_decode(void *buf, size_t size);
 	void part_seek_to_sample(size_t sample);
+	bool index_seek_to_sample(size_t sample);
 
-	vorbis_part_t(OggVorbis_File &&vf, pcm_part_info_t &&info)
-		: vf(vf), pcm_part_t(std::move(info)) {
+	vorbis_part_t(OggVorbis_File &&vf, std::vector<uint64_t> &&index, pcm_part_info_t &&info)
+		: vf(vf), index(std::move(index)), pcm_part_t(std::move(info)) {
 	};
 	virtual ~vorbis_part_t();
 };
@@ -96,8 +209,90 @@ size_t vorbis_part_t::part_decode_single(void *buf, size_t size)
 	return ret;
 }
 
+// Decodes straight into [buf] for as long as there is space left, instead
+// of going through ov_read() and its per-packet copies.
+size_t vorbis_part_t::part_decode(void *buf, size_t size)
+{
+	auto *out = (int16_t *)buf;
+	const size_t channels = pcmf.channels;
+	size_t frames_left = size / (channels * sizeof(int16_t));
+	size_t ret = 0;
+	while(frames_left > 0) {
+		float **pcm;
+		const int frames_max = (int)min(frames_left, (size_t)INT_MAX);
+		const auto frames = ov_read_float(&vf, &pcm, frames_max, nullptr);
+		if(frames < 0) {
+			vorbis_l.errorf(
+				"Error %d at sample %lld: %s",
+				frames, ov_pcm_tell(&vf), ov_strerror(frames)
+			);
+			return -1;
+		} else if(frames == 0) {
+			break;
+		}
+		vorbis_float_to_s16(out, pcm, frames, channels);
+		out += frames * channels;
+		frames_left -= frames;
+		ret += frames * channels * sizeof(int16_t);
+	}
+	return ret;
+}
+
+bool vorbis_part_t::index_seek_to_sample(size_t sample)
+{
+	const size_t pages = index.size() / 2;
+	const auto target = (uint64_t)(sample + vf.pcmlengths[0]);
+	auto granulepos = [this](size_t page) {
+		return index[page * 2];
+	};
+
+	// Find the first page that ends at or after [target]...
+	size_t lo = 0;
+	size_t hi = pages;
+	while(lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if(granulepos(mid) < target) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	// ...and start two pages before, so that the decoder is primed by
+	// the time it arrives at [sample]. Seeks into the first few pages are
+	// cheap for ov_pcm_seek() anyway.
+	if(lo < 2 || granulepos(lo - 2) == 0) {
+		return false;
+	}
+	if(ov_raw_seek(&vf, (ogg_int64_t)index[(lo - 2) * 2 + 1]) != 0) {
+		return false;
+	}
+	const auto cur = ov_pcm_tell(&vf);
+	const auto max_skip = (ogg_int64_t)pcmf.samplingrate * 10;
+	if(cur < 0 || (size_t)cur > sample || (ogg_int64_t)(sample - cur) > max_skip) {
+		return false;
+	}
+
+	// Decode and throw away everything up to [sample].
+	const size_t frame_size = (pcmf.bitdepth / 8) * pcmf.channels;
+	std::vector<char> scratch(frame_size * 1024);
+	size_t skip_left = (sample - (size_t)cur) * frame_size;
+	while(skip_left > 0) {
+		const auto ret = ov_read(
+			&vf, scratch.data(), min(skip_left, scratch.size()), 0, 2, 1, nullptr
+		);
+		if(ret <= 0) {
+			return false;
+		}
+		skip_left -= min((size_t)ret, skip_left);
+	}
+	return true;
+}
+
 void vorbis_part_t::part_seek_to_sample(size_t sample)
 {
+	if(!index.empty() && index_seek_to_sample(sample)) {
+		return;
+	}
 	auto ret = ov_pcm_seek(&vf, sample);
 	assert(ret == 0);
 }
@@ -111,6 +306,9 @@ std::unique_ptr<pcm_part_t> vorbis_open(HANDLE &&stream)
 {
 	OggVorbis_File vf = { 0 };
 
+	seek_index_id_t index_id;
+	const bool index_identified = seek_index_identify(index_id, stream, "ogg");
+
 	auto fail = [&] (int ret) {
 		vorbis_l.errorf("%s", ov_strerror(ret));
 		ov_clear(&vf);
@@ -134,7 +332,15 @@ std::unique_ptr<pcm_part_t> vorbis_open(HANDLE &&stream)
 	auto bits_per_sample = (pcmf.bitdepth / 8) * pcmf.channels;
 	auto byte_size = (size_t)(sample_length * bits_per_sample);
 
-	return std::make_unique<vorbis_part_t>(std::move(vf), pcm_part_info_t{
+	std::vector<uint64_t> index;
+	if(!index_identified || !seek_index_load(index, index_id)) {
+		index = vorbis_index_build(stream);
+		if(index_identified && !index.empty()) {
+			seek_index_save(index, index_id);
+		}
+	}
+
+	return std::make_unique<vorbis_part_t>(std::move(vf), std::move(index), pcm_part_info_t{
 		pcmf, byte_size
 	});
 }
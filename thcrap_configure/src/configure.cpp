@@ -123,8 +123,9 @@ bool progress_callback(progress_callback_status_t *status, void *param)
                 file_time = now;
             }
             else if (now - file_time > 5s) {
-                log_printf("[%u/%u] %s: in progress (%ub/%ub)...\n", status->nb_files_downloaded, status->nb_files_total,
-                           status->url, status->file_progress, status->file_size);
+                log_printf("[%u/%u] %s: in progress (%ub/%ub, %u streams at %u KiB/s)...\n", status->nb_files_downloaded, status->nb_files_total,
+                           status->url, status->file_progress, status->file_size,
+                           status->concurrency, (unsigned int)(status->throughput / 1024));
                 file_time = now;
             }
             return true;
@@ -152,6 +153,18 @@ bool progress_callback(progress_callback_status_t *status, void *param)
 }
 
 
+// Lists the repositories while the discovery is still running
+void repo_discovered(const repo_t *repo, void*)
+{
+    if (repo->title) {
+        log_printf("%s: %s\n", repo->id, repo->title);
+    }
+    else {
+        log_printf("%s\n", repo->id);
+    }
+}
+
+
 char **games_json_to_array(json_t *games)
 {
     char **array;
@@ -265,7 +278,7 @@ int __cdecl win32_utf8_main(int argc, const char *argv[])
 	pause();
 
 	CreateDirectoryU("repos", NULL);
-    repo_list = RepoDiscover_wrapper(start_repo);
+    repo_list = RepoDiscoverWithCallback_wrapper(start_repo, repo_discovered, nullptr);
 	if (!repo_list || !repo_list[0]) {
 		log_printf(_A("No patch repositories available...\n"));
 		pause();
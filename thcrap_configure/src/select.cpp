@@ -7,6 +7,14 @@
 #include <thcrap/src/thcrap_update_wrapper.h>
 #include "configure.h"
 #include "search.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 // Returns 1 if the selectors [a] and [b] refer to the same patch.
 // The repository IDs can be NULLs to ignore them.
@@ -93,16 +101,287 @@ std::string SearchPatch(repo_t **repo_list, const char *orig_repo_id, const patc
 	return "";
 }
 
+static std::string patch_full_id(const patch_desc_t& sel)
+{
+	return std::string(sel.repo_id) + "/" + sel.patch_id;
+}
+
+/// Dependency graph cache
+/// ----------------------
+/*
+ * The dependencies of a patch are only known after its patch.js has been
+ * downloaded, which used to happen one patch at a time while walking the
+ * dependency graph. To download them in parallel instead, the resolved
+ * dependencies of every patch that was ever added are cached in
+ * [DEP_CACHE_FN]:
+ *
+ * {
+ *	"<repo ID>": {
+ *		"mtime": <last write time of the repo's repo.js>,
+ *		"patches": {
+ *			"<patch ID>": ["<repo ID>/<patch ID>", ...]
+ *		}
+ *	}
+ * }
+ *
+ * A repository's entries are dropped once its repo.js is rewritten by a
+ * repository update. The cache only decides what to prefetch, while the
+ * stack itself is still built from the freshly downloaded patch.js files,
+ * so an outdated entry merely costs a wasted or missed download.
+ */
+
+static const char DEP_CACHE_FN[] = "repos/dependencies.js";
+
+static json_int_t dep_cache_repo_mtime(const char *repo_id)
+{
+	char *repo_fn = RepoGetLocalFN(repo_id);
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	json_int_t ret = 0;
+	if(GetFileAttributesEx(repo_fn, GetFileExInfoStandard, &attr)) {
+		ret = ((json_int_t)attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime;
+	}
+	free(repo_fn);
+	return ret;
+}
+
+static json_t* dep_cache_load(repo_t **repo_list)
+{
+	json_t *ret = json_object();
+	ScopedJson cache = json_load_file(DEP_CACHE_FN, 0, nullptr);
+	if(!json_is_object(*cache)) {
+		return ret;
+	}
+	for(size_t i = 0; repo_list[i]; i++) {
+		json_t *repo_cache = json_object_get(*cache, repo_list[i]->id);
+		json_int_t mtime = json_integer_value(json_object_get(repo_cache, "mtime"));
+		if(mtime && mtime == dep_cache_repo_mtime(repo_list[i]->id)) {
+			json_object_set(ret, repo_list[i]->id, repo_cache);
+		}
+	}
+	return ret;
+}
+
+// Stores the dependencies of [patch], which have already been resolved to
+// absolute ones, in [dep_cache].
+static void dep_cache_add(json_t *dep_cache, const patch_t *patch, const char *repo_id)
+{
+	json_t *deps = json_array();
+	for(size_t i = 0; patch->dependencies && patch->dependencies[i].patch_id; i++) {
+		const patch_desc_t& dep = patch->dependencies[i];
+		if(dep.repo_id) {
+			json_array_append_new(deps, json_string(patch_full_id(dep).c_str()));
+		}
+	}
+	json_t *repo_cache = json_object_get(dep_cache, repo_id);
+	if(!repo_cache) {
+		repo_cache = json_pack("{s:o}", "patches", json_object());
+		json_object_set_new(dep_cache, repo_id, repo_cache);
+	}
+	json_object_set_new(json_object_get(repo_cache, "patches"), patch->id, deps);
+}
+
+// Writes [dep_cache], stamping every repository with the current
+// modification time of its repo.js, which patch_bootstrap() rewrites.
+static void dep_cache_save(json_t *dep_cache)
+{
+	const char *repo_id;
+	json_t *repo_cache;
+	json_object_foreach(dep_cache, repo_id, repo_cache) {
+		json_object_set_new(repo_cache, "mtime", json_integer(dep_cache_repo_mtime(repo_id)));
+	}
+	json_dump_file(dep_cache, DEP_CACHE_FN, JSON_INDENT(2));
+}
+/// ----------------------
+
+// Patches that are being bootstrapped in the background, keyed by
+// "<repo ID>/<patch ID>".
+typedef std::unordered_map<std::string, std::future<patch_t>> patch_prefetch_t;
+
+static void patch_prefetch(patch_prefetch_t& prefetch, repo_t **repo_list, const patch_desc_t& sel)
+{
+	std::string full_id = patch_full_id(sel);
+	if(prefetch.count(full_id)) {
+		return;
+	}
+	const repo_t *repo = find_repo_in_list(repo_list, sel.repo_id);
+	if(!repo) {
+		return;
+	}
+	prefetch.emplace(full_id, std::async(std::launch::async,
+		[repo, repo_id = std::string(sel.repo_id), patch_id = std::string(sel.patch_id)]() {
+			patch_desc_t desc = { (char *)repo_id.c_str(), (char *)patch_id.c_str() };
+			return patch_bootstrap_wrapper(&desc, repo);
+		}
+	));
+}
+
+// Bootstraps [sel] and all of its dependencies that aren't part of
+// [sel_stack] yet, as a concurrent traversal of the dependency graph. Every
+// patch.js is requested as soon as an edge to it is known, either from
+// [dep_cache] or from the freshly downloaded patch.js of a dependent, so
+// this only takes as many round trips as the graph is deep. Returns once
+// every reachable patch has been bootstrapped.
+static void patch_prefetch_graph(patch_prefetch_t& prefetch, repo_t **repo_list, const json_t *dep_cache, const patch_sel_stack_t& sel_stack, const patch_desc_t& sel)
+{
+	std::mutex mutex;
+	std::condition_variable done_cv;
+	size_t pending = 0;
+	std::unordered_set<std::string> seen;
+
+	// Always called with [mutex] held.
+	std::function<void(const patch_desc_t&)> visit = [&](const patch_desc_t& desc) {
+		std::string full_id = patch_full_id(desc);
+		if(!seen.insert(full_id).second || IsSelected(sel_stack, desc) || prefetch.count(full_id)) {
+			return;
+		}
+		const repo_t *repo = find_repo_in_list(repo_list, desc.repo_id);
+		if(!repo) {
+			return;
+		}
+		pending++;
+		prefetch.emplace(full_id, std::async(std::launch::async,
+			[&, repo, repo_id = std::string(desc.repo_id), patch_id = std::string(desc.patch_id)]() {
+				patch_desc_t node = { (char *)repo_id.c_str(), (char *)patch_id.c_str() };
+				patch_t patch_info = patch_bootstrap_wrapper(&node, repo);
+				patch_t patch_full = patch_init(patch_info.archive, nullptr, 0);
+
+				std::scoped_lock lock(mutex);
+				for(size_t i = 0; patch_full.dependencies && patch_full.dependencies[i].patch_id; i++) {
+					const patch_desc_t& dep = patch_full.dependencies[i];
+					std::string target_repo = SearchPatch(repo_list, repo_id.c_str(), dep);
+					if(!target_repo.empty()) {
+						visit({ (char *)target_repo.c_str(), dep.patch_id });
+					}
+				}
+				patch_free(&patch_full);
+				if(--pending == 0) {
+					done_cv.notify_all();
+				}
+				return patch_info;
+			}
+		));
+
+		json_t *repo_cache = json_object_get(dep_cache, desc.repo_id);
+		json_t *deps = json_object_get(json_object_get(repo_cache, "patches"), desc.patch_id);
+		size_t i;
+		json_t *dep;
+		json_array_foreach(deps, i, dep) {
+			const char *dep_id = json_string_value(dep);
+			if(!dep_id) {
+				continue;
+			}
+			patch_desc_t dep_desc = patch_dep_to_desc(dep_id);
+			if(dep_desc.repo_id) {
+				visit(dep_desc);
+			}
+			free(dep_desc.repo_id);
+			free(dep_desc.patch_id);
+		}
+	};
+
+	std::unique_lock lock(mutex);
+	visit(sel);
+	done_cv.wait(lock, [&pending] { return pending == 0; });
+}
+
+static void patch_prefetch_free(patch_prefetch_t& prefetch)
+{
+	for(auto& [full_id, patch_info] : prefetch) {
+		patch_t unused = patch_info.get();
+		patch_free(&unused);
+	}
+	prefetch.clear();
+}
+
+/// Speculative updates
+/// -------------------
+/*
+ * While the user is still picking patches, the game-independent files of
+ * every selected patch are already downloaded on a background thread, one
+ * patch at a time. Once the selection is confirmed, the final update then
+ * mostly has to confirm that these files are current.
+ * Since bootstrapping a patch rewrites its patch.js, the background update
+ * is cancelled before every change to the selection, and restarted with the
+ * patches that haven't been completed yet afterwards.
+ */
+struct patch_speculate_t {
+	std::thread thread;
+	std::atomic<bool> cancel{ false };
+	// Full IDs of the patches that were updated without being cancelled.
+	// Only accessed by the thread while it's running.
+	std::unordered_set<std::string> done;
+};
+
+static bool patch_speculate_progress(progress_callback_status_t *, void *param)
+{
+	return !((patch_speculate_t *)param)->cancel;
+}
+
+static void patch_speculate_stop(patch_speculate_t& spec)
+{
+	spec.cancel = true;
+	if(spec.thread.joinable()) {
+		spec.thread.join();
+	}
+	spec.cancel = false;
+}
+
+static void patch_speculate_start(patch_speculate_t& spec, const patch_sel_stack_t& sel_stack)
+{
+	patch_speculate_stop(spec);
+	std::vector<std::string> queue;
+	for(const patch_desc_t& sel : sel_stack) {
+		std::string full_id = patch_full_id(sel);
+		if(!spec.done.count(full_id)) {
+			queue.push_back(std::move(full_id));
+		}
+	}
+	if(queue.empty()) {
+		return;
+	}
+	spec.thread = std::thread([&spec, queue = std::move(queue)]() {
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+		for(const std::string& full_id : queue) {
+			if(spec.cancel) {
+				break;
+			}
+			patch_desc_t desc = patch_dep_to_desc(full_id.c_str());
+			patch_t patch_info = patch_build(&desc);
+			patch_t patch_full = patch_init(patch_info.archive, nullptr, 0);
+			patch_update_wrapper(&patch_full, update_filter_global_wrapper, nullptr, patch_speculate_progress, &spec);
+			if(!spec.cancel) {
+				spec.done.insert(full_id);
+			}
+			patch_free(&patch_full);
+			patch_free(&patch_info);
+			free(desc.repo_id);
+			free(desc.patch_id);
+		}
+	});
+}
+/// -------------------
+
 // Adds a patch and, recursively, all of its required dependencies. These are
 // resolved first on the repository the patch originated, then globally.
+// Patches that patch_prefetch_graph() already bootstrapped are taken from
+// [prefetch], and anything it missed is bootstrapped in parallel, one level
+// of the graph at a time.
 // Returns the number of missing dependencies.
-int AddPatch(patch_sel_stack_t& sel_stack, repo_t **repo_list, patch_desc_t sel)
+int AddPatch(patch_sel_stack_t& sel_stack, repo_t **repo_list, patch_desc_t sel, patch_prefetch_t& prefetch, json_t *dep_cache)
 {
 	int ret = 0;
-	const repo_t *repo = find_repo_in_list(repo_list, sel.repo_id);
-	patch_t patch_info = patch_bootstrap_wrapper(&sel, repo);
+	patch_t patch_info;
+	auto prefetched = prefetch.find(patch_full_id(sel));
+	if(prefetched != prefetch.end()) {
+		patch_info = prefetched->second.get();
+		prefetch.erase(prefetched);
+	} else {
+		const repo_t *repo = find_repo_in_list(repo_list, sel.repo_id);
+		patch_info = patch_bootstrap_wrapper(&sel, repo);
+	}
 	patch_t patch_full = patch_init(patch_info.archive, nullptr, 0);
 	patch_desc_t *dependencies = patch_full.dependencies;
+	std::vector<size_t> resolved;
 
 	for (size_t i = 0; dependencies && dependencies[i].patch_id; i++) {
 		patch_desc_t dep_sel = dependencies[i];
@@ -116,10 +395,20 @@ int AddPatch(patch_sel_stack_t& sel_stack, repo_t **repo_list, patch_desc_t sel)
 				free(dep_sel.repo_id);
 				dep_sel.repo_id = strdup(target_repo.c_str());
 				dependencies[i] = dep_sel;
-				ret += AddPatch(sel_stack, repo_list, dep_sel);
+				patch_prefetch(prefetch, repo_list, dep_sel);
+				resolved.push_back(i);
 			}
 		}
 	}
+	if(patch_full.id) {
+		dep_cache_add(dep_cache, &patch_full, sel.repo_id);
+	}
+	for (size_t i : resolved) {
+		// Might have been pulled in by an earlier dependency in the meantime.
+		if(!IsSelected(sel_stack, dependencies[i])) {
+			ret += AddPatch(sel_stack, repo_list, dependencies[i], prefetch, dep_cache);
+		}
+	}
 
 	stack_add_patch(&patch_full);
 	sel_stack.push_back({strdup(sel.repo_id), strdup(sel.patch_id)});
@@ -275,6 +564,8 @@ patch_sel_stack_t SelectPatchStack(repo_t **repo_list)
 	patch_sel_stack_t sel_stack;
 	// Total number of required lines in the console buffer
 	size_t patches_count = 0;
+	json_t *dep_cache = NULL;
+	patch_speculate_t speculate;
 
 	if(!repo_list[0]) {
 		log_printf("\nNo repositories available -.-\n");
@@ -290,6 +581,7 @@ patch_sel_stack_t SelectPatchStack(repo_t **repo_list)
 	}
 
 	stack_free();
+	dep_cache = dep_cache_load(repo_list);
 	while(1) {
 		char buf[16];
 		size_t list_pick;
@@ -347,10 +639,16 @@ patch_sel_stack_t SelectPatchStack(repo_t **repo_list)
 		}
 		list_pick--;
 		patch_desc_t sel = list_order[list_pick];
+		patch_speculate_stop(speculate);
 		if(list_pick < stack_offset) {
 			int ret;
 			log_printf("Resolving dependencies for %s/%s...\n", sel.repo_id, sel.patch_id);
-			ret = AddPatch(sel_stack, repo_list, sel);
+			patch_prefetch_t prefetch;
+			patch_prefetch_graph(prefetch, repo_list, dep_cache, sel_stack, sel);
+			ret = AddPatch(sel_stack, repo_list, sel, prefetch, dep_cache);
+			patch_prefetch_free(prefetch);
+			dep_cache_save(dep_cache);
+			patch_speculate_start(speculate, sel_stack);
 			if(ret) {
 				log_printf(
 					"\n"
@@ -361,8 +659,11 @@ patch_sel_stack_t SelectPatchStack(repo_t **repo_list)
 			}
 		} else {
 			RemovePatch(sel_stack, sel.patch_id);
+			patch_speculate_start(speculate, sel_stack);
 		}
 	}
 end:
+	patch_speculate_stop(speculate);
+	json_decref(dep_cache);
 	return sel_stack;
 }
@@ -12,10 +12,20 @@
 #include "thcrap_tasofro.h"
 #include "act-nut.h"
 
+// Returns true if [patch] has anything to apply, so that the file only gets
+// parsed if it's actually going to be changed.
+static bool act_nut_patch_needed(json_t *patch)
+{
+	return json_object_size(patch) > 0;
+}
+
 int patch_act_nut(ActNut::Object *actnutobj, void *file_out, size_t size_out, json_t *patch)
 {
-	if (patch == nullptr) {
+	if (!act_nut_patch_needed(patch)) {
 		// Nothing to do
+		if (actnutobj) {
+			ActNut::delete_object(actnutobj);
+		}
 		return 0;
 	}
 
@@ -24,6 +34,7 @@ int patch_act_nut(ActNut::Object *actnutobj, void *file_out, size_t size_out, js
 		return -1;
 	}
 
+	bool changed = false;
 	const char *key;
 	json_t *flexarray;
 	json_object_foreach(patch, key, flexarray) {
@@ -40,12 +51,19 @@ int patch_act_nut(ActNut::Object *actnutobj, void *file_out, size_t size_out, js
 		ActNut::Object *child = actnutobj->getChild(key);
 		if (child) {
 			*child = text;
+			changed = true;
 		}
 		else {
 			log_printf("Act/Nut: key %s not found\n", key);
 		}
 	}
 
+	if (!changed) {
+		// The input is still in [file_out], no need to serialize it again.
+		ActNut::delete_object(actnutobj);
+		return 0;
+	}
+
 	ActNut::MemoryBuffer *buf = ActNut::new_MemoryBuffer(ActNut::MemoryBuffer::SHARE, (uint8_t *)file_out, size_out, false);
 	if (!actnutobj->writeValue(*buf)) {
 		log_print("Act/Nut: writing failed\n");
@@ -60,12 +78,18 @@ int patch_act_nut(ActNut::Object *actnutobj, void *file_out, size_t size_out, js
 
 int patch_act(void *file_inout, size_t size_out, size_t size_in, const char*, json_t *patch)
 {
+	if (!act_nut_patch_needed(patch)) {
+		return 0;
+	}
 	Act::File *file = Act::read_act_from_bytes((uint8_t *)file_inout, size_in);
 	return patch_act_nut(file, file_inout, size_out, patch);
 }
 
 int patch_nut(void *file_inout, size_t size_out, size_t size_in, const char*, json_t *patch)
 {
+	if (!act_nut_patch_needed(patch)) {
+		return 0;
+	}
 	Nut::Stream *stream = Nut::read_nut_from_bytes((uint8_t *)file_inout, size_in);
 	return patch_act_nut(stream, file_inout, size_out, patch);
 }
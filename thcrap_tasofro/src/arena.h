@@ -0,0 +1,134 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Tasogare Frontier support plugin
+  *
+  * ----
+  *
+  * Per-file allocator for the line-based patchers.
+  */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include <string.h>
+#include <stdint.h>
+
+// Bump allocator for everything that lives exactly as long as a single file
+// is being patched: the lines, and the strings they point to. Objects made
+// with create() are destroyed together with the arena, in reverse order.
+class FileArena
+{
+private:
+	static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+	struct object_t {
+		void (*destroy)(void *obj);
+		void *obj;
+	};
+
+	std::vector<std::unique_ptr<char[]>> blocks;
+	std::vector<object_t> objects;
+	char *cur = nullptr;
+	size_t left = 0;
+
+	static size_t padding(const char *p, size_t align)
+	{
+		return (align - ((uintptr_t)p % align)) % align;
+	}
+
+public:
+	FileArena() = default;
+	FileArena(const FileArena&) = delete;
+	FileArena& operator=(const FileArena&) = delete;
+
+	~FileArena()
+	{
+		for (auto it = this->objects.rbegin(); it != this->objects.rend(); ++it) {
+			it->destroy(it->obj);
+		}
+	}
+
+	void *alloc(size_t size, size_t align = alignof(std::max_align_t))
+	{
+		size_t pad = padding(this->cur, align);
+		if (!this->cur || pad + size > this->left) {
+			const size_t block_size = size + align > BLOCK_SIZE ? size + align : BLOCK_SIZE;
+			this->blocks.emplace_back(new char[block_size]);
+			this->cur = this->blocks.back().get();
+			this->left = block_size;
+			pad = padding(this->cur, align);
+		}
+		char *ret = this->cur + pad;
+		this->cur += pad + size;
+		this->left -= pad + size;
+		return ret;
+	}
+
+	// Returns a buffer for a string of up to [size] bytes.
+	char *alloc_str(size_t size)
+	{
+		return (char*)this->alloc(size, 1);
+	}
+
+	std::string_view copy(std::string_view str)
+	{
+		char *ret = this->alloc_str(str.size());
+		std::copy(str.begin(), str.end(), ret);
+		return std::string_view(ret, str.size());
+	}
+
+	std::string_view concat(std::initializer_list<std::string_view> strs)
+	{
+		size_t size = 0;
+		for (std::string_view str : strs) {
+			size += str.size();
+		}
+		char *ret = this->alloc_str(size);
+		char *p = ret;
+		for (std::string_view str : strs) {
+			p = std::copy(str.begin(), str.end(), p);
+		}
+		return std::string_view(ret, size);
+	}
+
+	// Returns [str] followed by [tail]. [str] is extended in place when it
+	// ends where the next allocation would start, so building a string
+	// piece by piece doesn't copy it every time. Views of the old [str]
+	// stay valid either way.
+	std::string_view append(std::string_view str, std::string_view tail)
+	{
+		if (!str.empty() && str.data() + str.size() == this->cur && tail.size() <= this->left) {
+			std::copy(tail.begin(), tail.end(), this->cur);
+			this->cur += tail.size();
+			this->left -= tail.size();
+			return std::string_view(str.data(), str.size() + tail.size());
+		}
+		return this->concat({ str, tail });
+	}
+
+	template<typename T> T *copy_array(const T *src, size_t count)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		T *ret = (T*)this->alloc(sizeof(T) * count, alignof(T));
+		if (count) {
+			memcpy(ret, src, sizeof(T) * count);
+		}
+		return ret;
+	}
+
+	template<typename T, typename... Args> T *create(Args&&... args)
+	{
+		T *obj = new(this->alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if constexpr (!std::is_trivially_destructible_v<T>) {
+			this->objects.push_back({ [](void *obj) { ((T*)obj)->~T(); }, obj });
+		}
+		return obj;
+	}
+};
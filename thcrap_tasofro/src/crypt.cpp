@@ -8,31 +8,99 @@
   */
 
 #include <thcrap.h>
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#include <intrin.h>
+#endif
+#include <emmintrin.h>
 #include "thcrap_tasofro.h"
 #include "crypt.h"
 
+#if defined(__GNUC__)
+# define CRYPT_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+# define CRYPT_TARGET_SSE2
+#endif
+
 ICrypt* ICrypt::instance = nullptr;
 
-DWORD CryptTh135::cryptBlock(BYTE* Data, DWORD FileSize, const DWORD* Key)
+static bool crypt_sse2_supported(void)
 {
-	for (DWORD j = 0; j < FileSize / 4; j++)
-	{
-		*((DWORD*)Data + j) ^= Key[j % 4];
+	int data[4];
+	__cpuid(data, 0);
+	if (data[0] < 1) {
+		return false;
 	}
+	__cpuid(data, 1);
+	return data[3] & 1 << 26;
+}
 
-	DWORD remain = FileSize % 4;
-	if (remain)
-	{
-		DWORD tk = Key[FileSize / 4 % 4];
-		for (DWORD j = 0; j < remain; j++)
-		{
-			Data[FileSize - remain + j] ^= tk & 0xFF;
-			tk >>= 8;
+static const bool CRYPT_SSE2 = crypt_sse2_supported();
+
+// Longest name that goes through the ASCII fast path of the hashes.
+#define FNV_ASCII_MAX 512
+
+// Writes [begin, end) to [out], lowercased and with slashes turned into
+// backslashes, which is what the games' hashes do for ASCII characters.
+// Returns false if the name isn't pure ASCII, in which case the contents of
+// [out] are undefined and the slow, MBCS-aware path has to be used.
+CRYPT_TARGET_SSE2 static bool fnv_normalize_ascii(const char *begin, const char *end, char *out)
+{
+	size_t len = end - begin;
+	size_t i = 0;
+	if (CRYPT_SSE2) {
+		const __m128i upper_min = _mm_set1_epi8('A' - 1);
+		const __m128i upper_max = _mm_set1_epi8('Z' + 1);
+		const __m128i case_bit = _mm_set1_epi8(0x20);
+		const __m128i slash = _mm_set1_epi8('/');
+		const __m128i slash_xor = _mm_set1_epi8('/' ^ '\\');
+		for (; i + 16 <= len; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(begin + i));
+			if (_mm_movemask_epi8(v)) {
+				return false;
+			}
+			// Signed comparisons, but we know that every byte is positive.
+			const __m128i is_upper = _mm_and_si128(_mm_cmpgt_epi8(v, upper_min), _mm_cmpgt_epi8(upper_max, v));
+			v = _mm_or_si128(v, _mm_and_si128(is_upper, case_bit));
+			v = _mm_xor_si128(v, _mm_and_si128(_mm_cmpeq_epi8(v, slash), slash_xor));
+			_mm_storeu_si128((__m128i *)(out + i), v);
 		}
 	}
+	for (; i < len; i++) {
+		char c = begin[i];
+		if ((unsigned char)c >= 0x80) {
+			return false;
+		}
+		if (c >= 'A' && c <= 'Z') {
+			c |= 0x20;
+		}
+		else if (c == '/') {
+			c = '\\';
+		}
+		out[i] = c;
+	}
+	return true;
+}
+
+DWORD CryptTh135::cryptBlock(BYTE* Data, DWORD FileSize, const DWORD* Key)
+{
+	// The 4 DWORDs of the key, repeated over the whole file, with the
+	// trailing bytes using the low bytes of the next key DWORD. On a
+	// little-endian machine, that's just a 16-byte repeating key.
+	xor_crypt_key16(Data, FileSize, (const uint8_t *)Key);
 	return 0;
 }
 
+void CryptTh135::cryptChunk(BYTE* Data, DWORD Size, DWORD Offset, const DWORD* Key)
+{
+	// Rotate the key to start at [Offset].
+	const BYTE *key = (const BYTE*)Key;
+	uint8_t key_rotated[16];
+	for (DWORD i = 0; i < 16; i++) {
+		key_rotated[i] = key[(Offset + i) % 16];
+	}
+	xor_crypt_key16(Data, Size, key_rotated);
+}
+
 void CryptTh135::uncryptBlock(BYTE* Data, DWORD FileSize, const DWORD* Key)
 {
 	this->cryptBlock(Data, FileSize, Key);
@@ -44,6 +112,16 @@ DWORD CryptTh135::SpecialFNVHash(const char *begin, const char *end, DWORD initH
 	DWORD hash; // eax@1
 	DWORD ch; // esi@2
 
+	char ascii[FNV_ASCII_MAX];
+	size_t len = end - begin;
+	if (len <= sizeof(ascii) && fnv_normalize_ascii(begin, end, ascii)) {
+		hash = initHash;
+		for (size_t i = 0; i < len; i++) {
+			hash = ascii[i] ^ 0x1000193 * hash;
+		}
+		return hash;
+	}
+
 	int inMBCS = 0;
 	for (hash = initHash; begin != end; hash = ch ^ 0x1000193 * hash)
 	{
@@ -130,6 +208,16 @@ DWORD CryptTh145::SpecialFNVHash(const char *begin, const char *end, DWORD initH
 	DWORD hash; // eax@1
 	DWORD ch; // esi@2
 
+	char ascii[FNV_ASCII_MAX];
+	size_t len = end - begin;
+	if (len <= sizeof(ascii) && fnv_normalize_ascii(begin, end, ascii)) {
+		hash = initHash;
+		for (size_t i = 0; i < len; i++) {
+			hash = (hash ^ ascii[i]) * 0x1000193;
+		}
+		return hash * -1;
+	}
+
 	int inMBCS = 0;
 	for (hash = initHash; begin != end; hash = (hash ^ ch) * 0x1000193)
 	{
@@ -20,6 +20,11 @@ public:
 	virtual void uncryptBlock(BYTE* Data, DWORD FileSize, const DWORD* Key) = 0;
 	virtual DWORD SpecialFNVHash(const char *begin, const char *end, DWORD initHash = 0x811C9DC5u) = 0;
 	virtual void convertKey(DWORD *key) = 0;
+	// Encrypts or decrypts [Size] bytes at [Offset] into a file, for
+	// ciphers where this doesn't depend on any other byte of the file.
+	// Only valid if canCryptChunks() returns true.
+	virtual bool canCryptChunks() { return false; }
+	virtual void cryptChunk(BYTE*, DWORD, DWORD, const DWORD*) {}
 
 	static ICrypt *instance;
 };
@@ -31,6 +36,8 @@ public:
 	virtual void uncryptBlock(BYTE* Data, DWORD FileSize, const DWORD* Key);
 	virtual DWORD SpecialFNVHash(const char *begin, const char *end, DWORD initHash = 0x811C9DC5u);
 	virtual void convertKey(DWORD *key);
+	virtual bool canCryptChunks() { return true; }
+	virtual void cryptChunk(BYTE* Data, DWORD Size, DWORD Offset, const DWORD* Key);
 };
 
 class CryptTh145 : public ICrypt
@@ -10,103 +10,269 @@
   */
 
 #include <thcrap.h>
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#include <intrin.h>
+#endif
+#include <emmintrin.h>
+#include <algorithm>
+#include <vector>
 #include "thcrap_tasofro.h"
 #include "tfcs.h"
 
-static int next_line(char *in, size_t size_in, char *out, int copy)
+#if defined(__GNUC__)
+# define CSV_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+# define CSV_TARGET_SSE2
+#endif
+
+static bool csv_sse2_supported(void)
 {
-	size_t i = 0;
-
-	while (i < size_in && in[i] && in[i] != ',' && in[i] != '\r' && in[i] != '\n') {
-		if (in[i] == '"') {
-			if (copy) { out[i] = in[i]; }
-			i++;
-			while (i < size_in && in[i] && (in[i] != '"' || in[i + 1] == '"')) {
-				if (copy) { out[i] = in[i]; }
-				i++;
+	int data[4];
+	__cpuid(data, 0);
+	if (data[0] < 1) {
+		return false;
+	}
+	__cpuid(data, 1);
+	return data[3] & 1 << 26;
+}
+
+static const bool CSV_SSE2 = csv_sse2_supported();
+
+static bool csv_is_special(char c)
+{
+	return c == ',' || c == '"' || c == '\r' || c == '\n' || c == '\0';
+}
+
+// Returns the first of [,"\r\n\0] in [p, end), or [end] if there is none.
+CSV_TARGET_SSE2 static const char* csv_find_special(const char *p, const char *end)
+{
+	if (CSV_SSE2) {
+		const __m128i comma = _mm_set1_epi8(',');
+		const __m128i quote = _mm_set1_epi8('"');
+		const __m128i cr = _mm_set1_epi8('\r');
+		const __m128i lf = _mm_set1_epi8('\n');
+		const __m128i zero = _mm_setzero_si128();
+		for (; end - p >= 16; p += 16) {
+			const __m128i v = _mm_loadu_si128((const __m128i *)p);
+			const __m128i hits = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, quote)),
+				_mm_or_si128(
+					_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)),
+					_mm_cmpeq_epi8(v, zero)
+				)
+			);
+			unsigned int bits = _mm_movemask_epi8(hits);
+			if (bits) {
+				unsigned long bit;
+				_BitScanForward(&bit, bits);
+				return p + bit;
 			}
-			if (copy) { out[i] = in[i]; }
-			i++;
 		}
-		else {
-			if (copy) { out[i] = in[i]; }
-			i++;
+	}
+	while (p < end && !csv_is_special(*p)) {
+		p++;
+	}
+	return p;
+}
+
+// Returns the end of the field starting at [p]. Inside quotes, only the last
+// quote of a run of quotes closes the quoted part, and a \0 ends it as well.
+static const char* csv_field_end(const char *p, const char *end)
+{
+	while (1) {
+		p = csv_find_special(p, end);
+		if (p == end || *p != '"') {
+			return p;
+		}
+		p++;
+		while (1) {
+			p = csv_find_special(p, end);
+			if (p == end) {
+				return p;
+			} else if (*p == '\0') {
+				p++;
+				break;
+			} else if (*p == '"') {
+				while (p + 1 < end && p[1] == '"') {
+					p++;
+				}
+				p++;
+				break;
+			}
+			p++;
 		}
 	}
-	return i;
 }
 
-int patch_csv(void *file_inout, size_t size_out, size_t size_in, const char*, json_t *patch)
+// Replacement cell. Points into the JSON patch the plan was compiled from.
+struct csv_cell_t {
+	size_t row;
+	size_t col;
+	const char *str;
+
+	bool operator<(const csv_cell_t &other) const {
+		return row < other.row || (row == other.row && col < other.col);
+	}
+};
+
+// Compiled CSV patch: all replacement cells, sorted in file order.
+typedef std::vector<csv_cell_t> csv_plan_t;
+
+// Parses a row or column key, which has to be written exactly like
+// json_object_numkey_get() would print it.
+static bool csv_patch_key(const char *key, size_t *index)
+{
+	size_t ret = 0;
+	if (!key[0] || (key[0] == '0' && key[1])) {
+		return false;
+	}
+	for (; *key; key++) {
+		if (*key < '0' || *key > '9' || ret > (SIZE_MAX - 9) / 10) {
+			return false;
+		}
+		ret = ret * 10 + (*key - '0');
+	}
+	*index = ret;
+	return true;
+}
+
+void* csv_plan_compile(const char*, json_t *patch)
+{
+	auto *ret = new csv_plan_t();
+	const char *row_key;
+	json_t *row;
+	json_object_foreach(patch, row_key, row) {
+		size_t r;
+		if (!json_is_object(row) || !csv_patch_key(row_key, &r)) {
+			continue;
+		}
+		const char *col_key;
+		json_t *col;
+		json_object_foreach(row, col_key, col) {
+			size_t c;
+			if (json_is_string(col) && csv_patch_key(col_key, &c)) {
+				ret->push_back({ r, c, json_string_value(col) });
+			}
+		}
+	}
+	if (ret->empty()) {
+		delete ret;
+		return nullptr;
+	}
+	std::sort(ret->begin(), ret->end());
+	return ret;
+}
+
+void csv_plan_free(void *plan)
+{
+	delete (csv_plan_t*)plan;
+}
+
+int patch_csv(void *file_inout, size_t size_out, size_t size_in, const char *fn, json_t *patch)
 {
 	if (!patch) {
 		return 0;
 	}
+	void *plan = csv_plan_compile(fn, patch);
+	int ret = plan ? csv_plan_apply(plan, file_inout, size_out, size_in, fn) : 0;
+	csv_plan_free(plan);
+	return ret;
+}
 
-	char *file_in = (char*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, size_in);
-	memcpy(file_in, file_inout, size_in);
+int csv_plan_apply(const void *plan, void *file_inout, size_t size_out, size_t size_in, const char*)
+{
+	const csv_plan_t &cells = *(const csv_plan_t*)plan;
+	// Next replacement cell that the scan hasn't passed yet.
+	auto cell = cells.begin();
 	char *file_out = (char*)file_inout;
 
-	json_t *patch_row = json_object_numkey_get(patch, 0);
-	json_t *patch_col = NULL;
-	int row = 0;
-	int col = 0;
-	size_t i = 0;
+	// Until the first replaced cell, the output is identical to the input,
+	// so we only need to copy the input from there on.
+	std::vector<char> tail;
+	const char *in = file_out;
+	const char *in_end = file_out + size_in;
+	// Start of the unchanged input that hasn't been written yet.
+	const char *run = in;
 	size_t j = 0;
-	while (i < size_in && file_in[i]) {
-		if (!json_is_object(patch_row) || !json_is_string(patch_col = json_object_numkey_get(patch_row, col))) {
-			int n = next_line(file_in + i, size_in - i, file_out + j, 1);
-			i += n;
-			j += n;
+	size_t row = 0;
+	size_t col = 0;
+
+	auto out_write = [&](const char *src, size_t len) {
+		if (j > size_out || len > size_out - j) {
+			return false;
+		}
+		memcpy(file_out + j, src, len);
+		j += len;
+		return true;
+	};
+	auto overflow = [&]() {
+		log_printf("WARNING: buffer overflow in tasofro CSV patching (buffer of %d bytes)!\n", size_out);
+		return -1;
+	};
+
+	const char *p = in;
+	while (p < in_end && *p && cell != cells.end()) {
+		const char *field = nullptr;
+		while (cell != cells.end() && (cell->row < row || (cell->row == row && cell->col < col))) {
+			cell++;
 		}
-		else {
-			const char* field = json_string_value(patch_col);
-			int k;
-			file_out[j] = '"';
-			j++;
-			for (k = 0; field[k]; j++, k++) {
-				if (field[k] == '"') {
-					file_out[j] = '"';
-					j++;
+		if (cell != cells.end() && cell->row == row && cell->col == col) {
+			field = cell->str;
+		}
+		const char *field_end = csv_field_end(p, in_end);
+		if (field) {
+			if (in == file_out) {
+				tail.assign(p, in_end);
+				j = p - file_out;
+				in = tail.data();
+				in_end = in + tail.size();
+				field_end = in + (field_end - p);
+				p = in;
+				run = in;
+			}
+			if (!out_write(run, p - run) || !out_write("\"", 1)) {
+				return overflow();
+			}
+			while (const char *q = strchr(field, '"')) {
+				if (!out_write(field, q + 1 - field) || !out_write("\"", 1)) {
+					return overflow();
 				}
-				file_out[j] = field[k];
+				field = q + 1;
 			}
-			file_out[j] = '"';
-			j++;
-			i += next_line(file_in + i, size_in - i, NULL, 0);
+			if (!out_write(field, strlen(field)) || !out_write("\"", 1)) {
+				return overflow();
+			}
+			run = field_end;
 		}
-		if (file_in[i] == ',') {
-			file_out[j] = file_in[i];
-			i++;
-			j++;
+		p = field_end;
+		if (p == in_end) {
+			break;
+		} else if (*p == ',') {
+			p++;
 			col++;
-		}
-		else if (file_in[i] == '\r' || file_in[i] == '\n') {
-			file_out[j] = file_in[i];
-			i++;
-			j++;
-			if (file_in[i - 1] == '\r' && file_in[i] == '\n') {
-				file_out[j] = file_in[i];
-				i++;
-				j++;
+		} else if (*p == '\r' || *p == '\n') {
+			if (*p == '\r' && p + 1 < in_end && p[1] == '\n') {
+				p++;
 			}
+			p++;
 			row++;
 			col = 0;
-			patch_row = json_object_numkey_get(patch, row);
 		}
 	}
-	if (j > size_out) {
-		log_printf("WARNING: buffer overflow in tasofro CSV patching (wrote %d bytes in a %d buffer)!\n", j, size_out);
+	// Everything after the last replaced cell stays the same.
+	const char *nul = (const char*)memchr(p, '\0', in_end - p);
+	p = nul ? nul : in_end;
+	if (in != file_out && !out_write(run, p - run)) {
+		return overflow();
 	}
 
 #ifdef _DEBUG
 	FILE* fd = fopen("out.csv", "wb");
 	if (fd) {
-		fwrite(file_out, j, 1, fd);
+		fwrite(file_out, in == file_out ? p - file_out : j, 1, fd);
 		fclose(fd);
 	}
 #endif
-
-	HeapFree(GetProcessHeap(), 0, file_in);
 	return 1;
 }
 
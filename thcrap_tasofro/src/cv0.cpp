@@ -11,6 +11,12 @@
 #include "thcrap_tasofro.h"
 #include "cv0.h"
 
+void TasofroCv0::File::insert(size_t& it, ALine *line)
+{
+	this->lines.insert(this->lines.begin() + it, line);
+	it++;
+}
+
 TasofroCv0::LineType TasofroCv0::guessLineType(const char* file, size_t size)
 {
 	for (size_t i = 0; i < size && file[i] != '\n'; i++) {
@@ -29,15 +35,15 @@ TasofroCv0::LineType TasofroCv0::guessLineType(const char* file, size_t size)
 	return EMPTY;
 }
 
-TasofroCv0::ALine* TasofroCv0::readLine(const char*& file, size_t& size)
+TasofroCv0::ALine* TasofroCv0::readLine(FileArena& arena, const char*& file, size_t& size)
 {
 	switch (guessLineType(file, size)) {
 	case EMPTY:
-		return Empty::read(file, size);
+		return Empty::read(arena, file, size);
 	case COMMAND:
-		return Command::read(file, size);
+		return Command::read(arena, file, size);
 	case TEXT:
-		return Text::read(file, size);
+		return Text::read(arena, file, size);
 	default:
 		return nullptr; // Can't happen
 	}
@@ -45,18 +51,18 @@ TasofroCv0::ALine* TasofroCv0::readLine(const char*& file, size_t& size)
 
 
 
-std::string TasofroCv0::ALine::readLine(const char*& file, size_t& size)
+std::string_view TasofroCv0::ALine::readLine(const char*& file, size_t& size)
 {
-	std::string out;
+	std::string_view out;
 	size_t i = 0;
 	while (i < size && file[i] != '\n') {
 		i++;
 	}
 	if (i > 0 && file[i - 1] == '\r') {
-		out.assign(file, i - 1);
+		out = std::string_view(file, i - 1);
 	}
 	else {
-		out.assign(file, i);
+		out = std::string_view(file, i);
 	}
 	if (i < size) {
 		i++;
@@ -83,85 +89,96 @@ TasofroCv0::LineType TasofroCv0::Text::getType() const
 }
 
 
-TasofroCv0::ALine::ALine()
+TasofroCv0::ALine::ALine(FileArena& arena)
+	: arena(arena)
 {}
 
-std::string TasofroCv0::ALine::unescape(const std::string& in) const
+std::string_view TasofroCv0::ALine::unescape(std::string_view in) const
 {
-	std::string out;
+	char *out = this->arena.alloc_str(in.size());
+	size_t out_size = 0;
 
 	for (size_t pos = 0; pos < in.size(); pos++) {
-		if (in[pos] == '\\' && in[pos + 1] == ',') {
+		if (in[pos] == '\\' && pos + 1 < in.size() && in[pos + 1] == ',') {
 			pos++;
 		}
 
-		out += in[pos];
+		out[out_size++] = in[pos];
 	}
-	return out;
+	return std::string_view(out, out_size);
 }
 
-std::string TasofroCv0::ALine::escape(const std::string& in) const
+std::string_view TasofroCv0::ALine::escape(std::string_view in) const
 {
-	std::string out;
+	// Commas double in size, and a ruby tag never grows by more than the
+	// length of its source, plus the fixed "<ruby >" / "</ruby>" overhead.
+	char *out = this->arena.alloc_str(in.size() * 2 + 16);
+	size_t out_size = 0;
+	auto put = [&out, &out_size](std::string_view str) {
+		std::copy(str.begin(), str.end(), out + out_size);
+		out_size += str.size();
+	};
 
 	for (size_t i = 0; i < in.size(); i++) {
 		if (in[i] == ',') {
-			out += "\\,";
+			put("\\,");
 		}
 		else if (in.compare(i, 7, "{{ruby|") == 0) {
 			i += 7;
-			std::string top;
-			std::string bot;
+			size_t bot_start = i;
 			while (i < in.size() && in[i] != '|') {
-				bot += in[i];
 				i++;
 			}
+			std::string_view bot = in.substr(bot_start, i - bot_start);
 			i++;
+			size_t top_start = MIN(i, in.size());
 			while (i < in.size() && in.compare(i, 2, "}}") != 0) {
-				top += in[i];
 				i++;
 			}
-			out += std::string("<ruby ") + top + ">" + bot + "</ruby>";
+			std::string_view top = in.substr(top_start, MIN(i, in.size()) - top_start);
+			put("<ruby ");
+			put(top);
+			put(">");
+			put(bot);
+			put("</ruby>");
 			i++; // Actually i += 2, because it will be incremented once again in the for loop.
 		}
 		else {
-			out += in[i];
+			out[out_size++] = in[i];
 		}
 	}
 
-	return out;
+	return std::string_view(out, out_size);
 }
 
 
 
-TasofroCv0::Empty::Empty()
+TasofroCv0::Empty::Empty(FileArena& arena, std::string_view content)
+	: ALine(arena), content(content)
 {}
 
-TasofroCv0::Empty* TasofroCv0::Empty::read(const char*& file, size_t& size)
+TasofroCv0::Empty* TasofroCv0::Empty::read(FileArena& arena, const char*& file, size_t& size)
 {
-	Empty* line = new Empty();
-	line->content = ALine::readLine(file, size);
-	return line;
+	return arena.create<Empty>(arena, ALine::readLine(file, size));
 }
 
-std::string TasofroCv0::Empty::toString() const
+std::string_view TasofroCv0::Empty::toString() const
 {
 	return content;
 }
 
 
-TasofroCv0::Command::Command()
+TasofroCv0::Command::Command(FileArena& arena, std::string_view content)
+	: ALine(arena), content(content)
 {}
 
-TasofroCv0::Command* TasofroCv0::Command::read(const char*& file, size_t& size)
+TasofroCv0::Command* TasofroCv0::Command::read(FileArena& arena, const char*& file, size_t& size)
 {
-	Command* line = new Command();
-	line->content = ALine::readLine(file, size);
-	return line;
+	return arena.create<Command>(arena, ALine::readLine(file, size));
 }
 
 
-std::string TasofroCv0::Command::toString() const
+std::string_view TasofroCv0::Command::toString() const
 {
 	return content;
 }
@@ -169,19 +186,16 @@ std::string TasofroCv0::Command::toString() const
 
 
 
-TasofroCv0::Text::Text()
+TasofroCv0::Text::Text(FileArena& arena, std::string_view content)
+	: ALine(arena), content(content)
 {}
 
-TasofroCv0::Text::Text(const std::string& content)
-	: content(content)
-{}
-
-TasofroCv0::Text* TasofroCv0::Text::read(const char*& file, size_t& size)
+TasofroCv0::Text* TasofroCv0::Text::read(FileArena& arena, const char*& file, size_t& size)
 {
-	Text* line = new Text();
-	line->content = ALine::readLine(file, size);
+	Text* line = arena.create<Text>(arena, ALine::readLine(file, size));
 	while (guessLineType(file, size) == TEXT) {
-		line->content += "\n" + ALine::readLine(file, size);
+		line->content = arena.append(line->content, "\n");
+		line->content = arena.append(line->content, ALine::readLine(file, size));
 		size_t i = line->content.length() - 1;
 		while (i > 0 && (line->content[i] == '\r' || line->content[i] == '\n')) {
 			i--;
@@ -194,17 +208,17 @@ TasofroCv0::Text* TasofroCv0::Text::read(const char*& file, size_t& size)
 }
 
 
-std::string TasofroCv0::Text::toString() const
+std::string_view TasofroCv0::Text::toString() const
 {
 	return content;
 }
 
-void TasofroCv0::Text::patch(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it, int textbox_size, json_t *patch)
+void TasofroCv0::Text::patch(File& file, size_t& file_it, int textbox_size, json_t *patch)
 {
 	this->cur_line = 1;
 	this->nb_lines = 0;
 
-	this->content = "";
+	this->content = {};
 	size_t json_line_num;
 	json_t *json_line;
 	json_array_foreach(patch, json_line_num, json_line) {
@@ -254,26 +268,24 @@ bool TasofroCv0::Text::parseCommand(json_t *patch, int json_line_num, int textbo
 	return false;
 }
 
-void TasofroCv0::Text::beginLine(std::list<ALine*>& file, const std::list<ALine*>::iterator& it)
+void TasofroCv0::Text::beginLine(File& file, size_t& it)
 {
 	if (this->cur_line == 1) {
-		this->content = this->escape(this->content);
-		file.insert(it, new Text(this->content));
-		this->content = "";
+		file.insert(it, this->arena.create<Text>(this->arena, this->escape(this->content)));
+		this->content = {};
 	}
 }
 
 void TasofroCv0::Text::patchLine(const char *text)
 {
-	std::string formattedText = text;
+	std::string_view formattedText = text;
+	this->content = this->arena.append(this->content, formattedText);
 	if (this->cur_line != this->nb_lines) {
-		formattedText += "\n";
+		this->content = this->arena.append(this->content, "\n");
 	}
-	else if (formattedText.length() == 0 || (formattedText[formattedText.length() - 1] != '@' && formattedText[formattedText.length() - 1] != '\\')) {
-		formattedText += "\\\n";
+	else if (formattedText.length() == 0 || (formattedText.back() != '@' && formattedText.back() != '\\')) {
+		this->content = this->arena.append(this->content, "\\\n");
 	}
-
-	this->content += formattedText;
 }
 
 void TasofroCv0::Text::endLine()
@@ -313,18 +325,21 @@ int patch_cv0(void *file_inout, size_t size_out, size_t size_in, const char*, js
 		return 0;
 	}
 
-	std::list<TasofroCv0::ALine*> lines;
-	const char *file_in = (const char*)file_inout;
+	TasofroCv0::File file;
+	// The lines point into the input, which we overwrite with the output.
+	char *file_copy = file.arena.alloc_str(size_in);
+	memcpy(file_copy, file_inout, size_in);
+	const char *file_in = file_copy;
 	char *file_out = (char*)file_inout;
 
 	while (size_in > 0) {
-		lines.push_back(TasofroCv0::readLine(file_in, size_in));
+		file.lines.push_back(TasofroCv0::readLine(file.arena, file_in, size_in));
 	}
 
 	size_t balloon_number = 1;
 	int textbox_size = 3;
-	for (std::list<TasofroCv0::ALine*>::iterator it = lines.begin(); it != lines.end(); ++it) {
-		TasofroCv0::ALine *line = *it;
+	for (size_t it = 0; it < file.lines.size(); ++it) {
+		TasofroCv0::ALine *line = file.lines[it];
 		if (line->getType() == TasofroCv0::COMMAND && textbox_size != 4 && line->toString().compare(0, 3, "CG:") == 0) {
 			textbox_size = 4;
 			continue;
@@ -338,18 +353,16 @@ int patch_cv0(void *file_inout, size_t size_out, size_t size_in, const char*, js
 		if (json_lines == nullptr) {
 			continue;
 		}
-		dynamic_cast<TasofroCv0::Text*>(line)->patch(lines, it, textbox_size, json_lines);
+		dynamic_cast<TasofroCv0::Text*>(line)->patch(file, it, textbox_size, json_lines);
 	}
 
-	std::string str;
-	for (TasofroCv0::ALine* line : lines) {
-		str = line->toString();
+	for (TasofroCv0::ALine* line : file.lines) {
+		std::string_view str = line->toString();
 		if (str.size() > size_out + 3) {
 			log_print("Output file too small\n");
 			break;
 		}
-		memcpy(file_out, str.c_str(), str.size());
-		file_out += str.size();
+		file_out = std::copy(str.begin(), str.end(), file_out);
 		size_out -= str.size();
 		*file_out = '\n';
 		file_out++;
@@ -10,10 +10,11 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
-#include <list>
 #include <string.h>
 #include <jansson.h>
+#include "arena.h"
 
 namespace TasofroCv0
 {
@@ -24,55 +25,72 @@ namespace TasofroCv0
 		TEXT
 	};
 
+	class ALine;
+
+	// Same model as TasofroPl::File.
+	struct File
+	{
+		FileArena arena;
+		std::vector<ALine*> lines;
+
+		// Inserts [line] before the one at [it], and moves [it] to keep
+		// pointing to the same line.
+		void insert(size_t& it, ALine *line);
+	};
+
 	class ALine
 	{
+	protected:
+		FileArena& arena;
+
 	public:
-		ALine();
+		ALine(FileArena& arena);
 		virtual ~ALine() {}
 
 		virtual LineType getType() const = 0;
-		virtual std::string toString() const = 0;
+		virtual std::string_view toString() const = 0;
 
-		static std::string readLine(const char*& file, size_t& size);
+		static std::string_view readLine(const char*& file, size_t& size);
 
-		std::string unescape(const std::string& in) const;
-		std::string escape(const std::string& in) const;
+		// Return strings allocated from [arena].
+		std::string_view unescape(std::string_view in) const;
+		std::string_view escape(std::string_view in) const;
 	};
 
 	class Empty : public ALine
 	{
 	private:
-		std::string content; // whitespaces and comments
+		std::string_view content; // whitespaces and comments
 
 	public:
-		Empty();
+		Empty(FileArena& arena, std::string_view content);
 		~Empty() {}
 
 		LineType getType() const;
-		std::string toString() const;
+		std::string_view toString() const;
 
-		static Empty* read(const char*& file, size_t& size);
+		static Empty* read(FileArena& arena, const char*& file, size_t& size);
 	};
 
 	class Command : public ALine
 	{
 	private:
-		std::string content; // Should be an array of fields, but we don't need to parse commands for now, so we don't need it.
+		std::string_view content; // Should be an array of fields, but we don't need to parse commands for now, so we don't need it.
 
 	public:
-		Command();
+		Command(FileArena& arena, std::string_view content);
 		~Command() {}
 
 		LineType getType() const;
-		std::string toString() const;
+		std::string_view toString() const;
 
-		static Command* read(const char*& file, size_t& size);
+		static Command* read(FileArena& arena, const char*& file, size_t& size);
 	};
 
 	class Text : public ALine
 	{
 	private:
-		std::string content;
+		std::string_view content;
 
 		// Patcher state
 		int cur_line;
@@ -80,24 +98,24 @@ namespace TasofroCv0
 
 		// Functions used by the patcher
 		bool parseCommand(json_t *patch, int json_line_num, int textbox_size);
-		void beginLine(std::list<ALine*>& file, const std::list<ALine*>::iterator& it);
+		void beginLine(File& file, size_t& it);
 		void patchLine(const char *text);
 		void endLine();
 
 	public:
-		Text();
-		Text(const std::string& content);
+		Text(FileArena& arena, std::string_view content = {});
 		~Text() {}
 
 		LineType getType() const;
-		std::string toString() const;
-		void patch(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it, int textbox_size, json_t *patch);
+		std::string_view toString() const;
+		void patch(File& file, size_t& file_it, int textbox_size, json_t *patch);
 
-		static Text* read(const char*& file, size_t& size);
+		static Text* read(FileArena& arena, const char*& file, size_t& size);
 	};
 
 	LineType guessLineType(const char* file, size_t size);
-	ALine* readLine(const char*& file, size_t& size);
+	// Returns a line pointing into [file], which must live as long as [arena].
+	ALine* readLine(FileArena& arena, const char*& file, size_t& size);
 	json_t *balloonNumberToLines(json_t *patch, size_t balloon_number);
 }
 
@@ -10,16 +10,126 @@
 #include <thcrap.h>
 #include <condition_variable>
 #include <filesystem>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <set>
 #include <thread>
-#include <unordered_map>
+#include <vector>
 #include "thcrap_tasofro.h"
 #include "files_list.h"
 #include "crypt.h"
 
-std::unordered_map<DWORD, FileHeader> fileHashToName;
+// Open-addressing table from file hashes to headers. The headers live in
+// blocks that never move, since pointers to them are kept around (in
+// file_rep_t::object, for example). The whole files list goes in a single
+// block.
+class FileHeaderTable
+{
+private:
+	struct slot_t {
+		DWORD hash;
+		FileHeader *header;
+	};
+
+	static constexpr size_t BLOCK_SIZE = 256;
+
+	std::vector<slot_t> slots;
+	unsigned int bits = 0;
+	size_t count = 0;
+
+	std::vector<std::unique_ptr<FileHeader[]>> blocks;
+	FileHeader *block_next = nullptr;
+	size_t block_left = 0;
+
+	size_t index(DWORD hash) const
+	{
+		hash ^= hash >> 16;
+		return (DWORD)(hash * 0x9E3779B1u) >> (32 - this->bits);
+	}
+
+	void rehash(unsigned int bits)
+	{
+		std::vector<slot_t> old_slots(1 << bits);
+		old_slots.swap(this->slots);
+		this->bits = bits;
+		const size_t mask = this->slots.size() - 1;
+		for (const slot_t& slot : old_slots) {
+			if (slot.header) {
+				size_t i = this->index(slot.hash);
+				while (this->slots[i].header) {
+					i = (i + 1) & mask;
+				}
+				this->slots[i] = slot;
+			}
+		}
+	}
+
+	void alloc_block(size_t size)
+	{
+		this->blocks.emplace_back(new FileHeader[size]());
+		this->block_next = this->blocks.back().get();
+		this->block_left = size;
+	}
+
+public:
+	// Makes room for [n] more headers, allocated together.
+	void reserve(size_t n)
+	{
+		unsigned int bits = MAX(this->bits, 4u);
+		while (((size_t)1 << bits) < (this->count + n) * 2) {
+			bits++;
+		}
+		if (bits != this->bits) {
+			this->rehash(bits);
+		}
+		if (this->block_left < n) {
+			this->alloc_block(n);
+		}
+	}
+
+	FileHeader *find(DWORD hash) const
+	{
+		if (this->slots.empty()) {
+			return nullptr;
+		}
+		const size_t mask = this->slots.size() - 1;
+		for (size_t i = this->index(hash); this->slots[i].header; i = (i + 1) & mask) {
+			if (this->slots[i].hash == hash) {
+				return this->slots[i].header;
+			}
+		}
+		return nullptr;
+	}
+
+	// Returns the header for [hash], creating a zeroed one if needed.
+	FileHeader *get(DWORD hash)
+	{
+		FileHeader *header = this->find(hash);
+		if (header) {
+			return header;
+		}
+		if ((this->count + 1) * 2 > this->slots.size()) {
+			this->rehash(MAX(this->bits + 1, 4u));
+		}
+		if (this->block_left == 0) {
+			this->alloc_block(BLOCK_SIZE);
+		}
+		header = this->block_next++;
+		this->block_left--;
+
+		const size_t mask = this->slots.size() - 1;
+		size_t i = this->index(hash);
+		while (this->slots[i].header) {
+			i = (i + 1) & mask;
+		}
+		this->slots[i] = { hash, header };
+		this->count++;
+		return header;
+	}
+};
+
+static FileHeaderTable fileHashToName;
 
 // Used if dat_dump != false.
 // Contains fileslist.js plus all the files found while the game was running.
@@ -107,16 +217,142 @@ public:
 };
 FileslistDump *FileslistDump::instance;
 
-void register_filename(const char *path)
+static void register_hashed_filename(DWORD hash, const char *path)
+{
+	strcpy(fileHashToName.get(hash)->path, path);
+
+	FileslistDump::add(path);
+}
+
+/// Hash cache
+/// ----------
+// Converting and hashing every name in fileslist.js gives the same result on
+// every launch, so the result is stored in the "fileslist" namespace of the
+// disk cache, along with a hash of the list it was made from, and loaded on
+// the next launches.
+#define FILESLIST_CACHE_DISK_NS "fileslist"
+#define FILESLIST_CACHE_MAGIC "TFFL"
+#define FILESLIST_CACHE_VERSION 1
+
+// After the header, the file contains [count] entries, followed by
+// [names_size] bytes of null-terminated Shift-JIS names.
+struct fileslist_cache_header_t {
+	char magic[4];
+	uint32_t version;
+	uint64_t list_hash;
+	uint32_t count;
+	uint32_t names_size;
+};
+
+struct fileslist_cache_entry_t {
+	DWORD hash;
+	uint32_t name_offset;
+};
+
+struct fileslist_cache_t {
+	std::vector<fileslist_cache_entry_t> entries;
+	std::string names;
+};
+
+static std::string fileslist_cache_disk_key()
+{
+	const char *game = runconfig_game_get();
+	return game ? game : "";
+}
+
+// FNV-1a over the names, seeded with the game, since that also selects the
+// hash function.
+static uint64_t fileslist_hash(json_t *fileslist)
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	auto hash_bytes = [&hash](const void *data, size_t len) {
+		for (size_t i = 0; i < len; i++) {
+			hash = (hash ^ ((const BYTE*)data)[i]) * 0x100000001B3ull;
+		}
+	};
+	const uint32_t game = game_id;
+	hash_bytes(&game, sizeof(game));
+
+	size_t i;
+	json_t *file;
+	json_array_foreach(fileslist, i, file) {
+		const char *str = json_string_value(file);
+		if (str) {
+			hash_bytes(str, strlen(str) + 1);
+		}
+	}
+	return hash;
+}
+
+static bool fileslist_cache_load(const std::string& disk_key, uint64_t list_hash)
+{
+	size_t size;
+	BYTE *view = (BYTE*)disk_cache_get(FILESLIST_CACHE_DISK_NS, disk_key.c_str(), &size);
+	if (!view) {
+		return false;
+	}
+	const auto *header = (const fileslist_cache_header_t*)view;
+	const auto *entries = (const fileslist_cache_entry_t*)(view + sizeof(*header));
+	bool valid = size >= sizeof(*header)
+		&& !memcmp(header->magic, FILESLIST_CACHE_MAGIC, sizeof(header->magic))
+		&& header->version == FILESLIST_CACHE_VERSION
+		&& header->list_hash == list_hash
+		&& header->count <= (size - sizeof(*header)) / sizeof(*entries)
+		&& size == sizeof(*header) + header->count * sizeof(*entries) + header->names_size;
+
+	const char *names = (const char*)(entries + (valid ? header->count : 0));
+	if (valid && header->names_size) {
+		valid = names[header->names_size - 1] == '\0';
+	}
+	for (uint32_t i = 0; valid && i < header->count; i++) {
+		const uint32_t offset = entries[i].name_offset;
+		valid = offset < header->names_size && strnlen(names + offset, MAX_PATH) < MAX_PATH;
+	}
+
+	if (valid) {
+		fileHashToName.reserve(header->count);
+		for (uint32_t i = 0; i < header->count; i++) {
+			register_hashed_filename(entries[i].hash, names + entries[i].name_offset);
+		}
+	}
+	free(view);
+	return valid;
+}
+
+static void fileslist_cache_save(const std::string& disk_key, uint64_t list_hash, const fileslist_cache_t& cache)
+{
+	fileslist_cache_header_t header = {};
+	memcpy(header.magic, FILESLIST_CACHE_MAGIC, sizeof(header.magic));
+	header.version = FILESLIST_CACHE_VERSION;
+	header.list_hash = list_hash;
+	header.count = cache.entries.size();
+	header.names_size = cache.names.size();
+
+	const size_t entries_size = cache.entries.size() * sizeof(fileslist_cache_entry_t);
+	std::vector<BYTE> buffer(sizeof(header) + entries_size + cache.names.size());
+	memcpy(buffer.data(), &header, sizeof(header));
+	memcpy(buffer.data() + sizeof(header), cache.entries.data(), entries_size);
+	memcpy(buffer.data() + sizeof(header) + entries_size, cache.names.data(), cache.names.size());
+	disk_cache_put(FILESLIST_CACHE_DISK_NS, disk_key.c_str(), buffer.data(), buffer.size(), 0);
+}
+/// ----------
+
+// Returns false if [path] is ignored.
+static bool register_filename_get_hash(const char *path, DWORD *hash)
 {
 	if (!path || path[1] == ':') {
-		return;
+		return false;
 	}
 
-	DWORD hash = ICrypt::instance->SpecialFNVHash(path, path + strlen(path));
-	strcpy(fileHashToName[hash].path, path);
+	*hash = filename_to_hash(path);
+	register_hashed_filename(*hash, path);
+	return true;
+}
 
-	FileslistDump::add(path);
+void register_filename(const char *path)
+{
+	DWORD hash;
+	register_filename_get_hash(path, &hash);
 }
 
 int LoadFileNameList(const char* FileName)
@@ -156,29 +392,62 @@ int LoadFileNameListFromMemory(char* list, size_t size)
 	return 0;
 }
 
-void register_utf8_filename(const char* file)
+static void register_utf8_filename(const char* file, fileslist_cache_t *cache)
 {
 	WCHAR_T_DEC(file);
 	WCHAR_T_CONV(file);
 	VLA(char, file_sjis, file_len);
 	WideCharToMultiByte(932, 0, file_w, wcslen(file_w) + 1, file_sjis, file_len, nullptr, nullptr);
-	register_filename(file_sjis);
+	DWORD hash;
+	if (register_filename_get_hash(file_sjis, &hash) && cache) {
+		cache->entries.push_back({ hash, (uint32_t)cache->names.size() });
+		cache->names.append(file_sjis, strlen(file_sjis) + 1);
+	}
 	VLA_FREE(file_sjis);
 	WCHAR_T_FREE(file);
 }
 
 // Convert fileslist.txt to fileslist.js:
-// iconv -f sjis fileslist.txt | sed -e 'y|¥/|\\\\|' | jq -Rs '. | split("\n") | sort' > fileslist.js
+// iconv -f sjis fileslist.txt | sed -e 'y|/|\\\\|' | jq -Rs '. | split("\n") | sort' > fileslist.js
 int LoadFileNameListFromJson(json_t *fileslist)
 {
+	if (!json_is_array(fileslist)) {
+		return 0;
+	}
+
+	const uint64_t list_hash = fileslist_hash(fileslist);
+	const std::string cache_key = fileslist_cache_disk_key();
+	if (!cache_key.empty() && fileslist_cache_load(cache_key, list_hash)) {
+		return 0;
+	}
+
+	fileslist_cache_t cache;
+	cache.entries.reserve(json_array_size(fileslist));
+	fileHashToName.reserve(json_array_size(fileslist));
 	size_t i;
 	json_t *file;
 	json_array_foreach(fileslist, i, file) {
-		register_utf8_filename(json_string_value(file));
+		register_utf8_filename(json_string_value(file), &cache);
+	}
+
+	if (!cache_key.empty()) {
+		fileslist_cache_save(cache_key, list_hash, cache);
 	}
 	return 0;
 }
 
+// Not part of th135_init() and th175_init(), so that it can run on a worker
+// thread while the other plug-ins initialize.
+extern "C" void fileslist_mod_init(void)
+{
+	if (game_id < TH135) {
+		return;
+	}
+	json_t *fileslist = stack_game_json_resolve("fileslist.js", nullptr);
+	LoadFileNameListFromJson(fileslist);
+	json_decref(fileslist);
+}
+
 DWORD filename_to_hash(const char* filename)
 {
 	return ICrypt::instance->SpecialFNVHash(filename, filename + strlen(filename));
@@ -186,10 +455,5 @@ DWORD filename_to_hash(const char* filename)
 
 struct FileHeader* hash_to_file_header(DWORD hash)
 {
-	std::unordered_map<DWORD, FileHeader>::iterator it = fileHashToName.find(hash);
-
-	if (it != fileHashToName.end())
-		return &it->second;
-	else
-		return NULL;
+	return fileHashToName.find(hash);
 }
@@ -14,23 +14,18 @@ size_t get_nhtex_size(const char *fn, json_t*, size_t)
 {
 	char rep_fn[MAX_PATH];
 	char *rep_fn_end;
-	void *rep_file;
 	size_t rep_size;
 
 	strcpy(rep_fn, fn);
 	rep_fn_end = rep_fn + strlen(rep_fn);
 
 	strcpy(rep_fn_end, ".png");
-	rep_file = stack_game_file_resolve(rep_fn, &rep_size);
-	if (rep_file) {
-		free(rep_file);
+	if (stack_game_file_size(rep_fn, &rep_size) && rep_size) {
 		return rep_size;
 	}
 
 	strcpy(rep_fn_end, ".dds");
-	rep_file = stack_game_file_resolve(rep_fn, &rep_size);
-	if (rep_file) {
-		free(rep_file);
+	if (stack_game_file_size(rep_fn, &rep_size) && rep_size) {
 		return rep_size;
 	}
 
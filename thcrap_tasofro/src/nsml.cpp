@@ -44,48 +44,27 @@ static char* fn_for_th105(const char *fn)
 	return full_fn;
 }
 
-size_t get_chain_size(char **chain)
+void th123_resolve_chain_game(chain_buf_t& chain, const char *fn)
 {
-	size_t i;
-	for (i = 0; chain && chain[i]; i++) {
+	if (!fn) {
+		return;
 	}
-	return i;
-}
+	chain_buf_t fn_game;
 
-char **th123_resolve_chain_game(const char *fn)
-{
 	// First, th105
-	char **th105_chain = nullptr;
-	defer(free(th105_chain));
 	if (game_fallback_ignore_list.find(fn) == game_fallback_ignore_list.end()) {
-		char *fn_game = fn_for_th105(fn);
-		th105_chain = resolve_chain(fn_game);
-		SAFE_FREE(fn_game);
+		fn_game.push_prefixed("th105", fn);
+		resolve_chain_build(chain, fn_game.get()[0]);
+		fn_game.clear();
 	}
 
 	// Then, th123
-	char *fn_common = fn_for_game(fn);
-	const char *fn_common_ptr = fn_common ? fn_common : fn;
-	char **th123_chain = resolve_chain(fn_common_ptr);
-	defer(free(th123_chain));
-	SAFE_FREE(fn_common);
-
-	// Merge the 2 chains
-	size_t chain_size = get_chain_size(th105_chain) + get_chain_size(th123_chain);
-	if (chain_size == 0) {
-		return nullptr;
+	const char *game = runconfig_game_get();
+	if (game) {
+		fn_game.push_prefixed(game, fn);
+		fn = fn_game.get()[0];
 	}
-	char **chain = (char**)malloc(sizeof(char*) * (chain_size + 1));
-	size_t i = 0;
-	for (size_t j = 0; th105_chain && th105_chain[j]; i++, j++) {
-		chain[i] = th105_chain[j];
-	}
-	for (size_t j = 0; th123_chain && th123_chain[j]; i++, j++) {
-		chain[i] = th123_chain[j];
-	}
-	chain[i] = nullptr;
-
-	return chain;
+	resolve_chain_build(chain, fn);
 }
 
 int nsml_init()
@@ -98,8 +77,8 @@ int nsml_init()
 		patchhook_register("*.cv2", patch_cv2, nullptr);
 	}
 	else if (game_id == TH105 || game_id == TH123) {
-		patchhook_register("*.cv0", patch_cv0, nullptr);
-		patchhook_register("*.cv1", patch_csv, get_csv_size);
+		patchhook_register_cacheable("*.cv0", patch_cv0, nullptr);
+		patchhook_register_compiled("*.cv1", csv_plan_compile, csv_plan_apply, csv_plan_free, get_csv_size);
 		patchhook_register("*.cv2", patch_cv2, get_cv2_size);
 		patchhook_register("*.dat", patch_dat_for_png, [](const char*, json_t*, size_t) -> size_t { return 0; });
 	}
@@ -113,7 +92,7 @@ int nsml_init()
 		jsonvfs_game_add_map("data/csv/*/storyspell.cv1.jdiff", "spells.js");
 	}
 	else if (game_id == TH123) {
-		set_resolve_chain_game(th123_resolve_chain_game);
+		set_resolve_chain_game_build(th123_resolve_chain_game);
 		json_t *list = stack_game_json_resolve("game_fallback_ignore_list.js", nullptr);
 		size_t i;
 		json_t *value;
@@ -149,7 +128,7 @@ int nsml_init()
   * After the call, uFilename will contain a pointer to the utf-8 file name.
   * The caller have to free() it.
   */
-json_t *convert_file_name_in_bp(x86_reg_t *regs, json_t *bp_info, char **uFilename)
+static char *convert_file_name(x86_reg_t *regs, json_t *bp_info)
 {
 	// Parameters
 	// ----------
@@ -157,13 +136,20 @@ json_t *convert_file_name_in_bp(x86_reg_t *regs, json_t *bp_info, char **uFilena
 	size_t fn_size = json_object_get_immediate(bp_info, regs, "fn_size");
 	// ----------
 
+	char *uFilename;
 	if (fn_size) {
-		*uFilename = EnsureUTF8(filename, fn_size);
+		uFilename = EnsureUTF8(filename, fn_size);
 	}
 	else {
-		*uFilename = EnsureUTF8(filename, strlen(filename));
+		uFilename = EnsureUTF8(filename, strlen(filename));
 	}
-	CharLowerA(*uFilename);
+	CharLowerA(uFilename);
+	return uFilename;
+}
+
+json_t *convert_file_name_in_bp(x86_reg_t *regs, json_t *bp_info, char **uFilename)
+{
+	*uFilename = convert_file_name(regs, bp_info);
 
 	json_t *new_bp_info = json_copy(bp_info);
 	json_object_set_new(new_bp_info, "file_name", json_integer((json_int_t)*uFilename));
@@ -220,26 +206,22 @@ static void th105_patch(const file_rep_t *fr, BYTE *buffer, size_t size)
 extern "C" int BP_nsml_read_file(x86_reg_t *regs, json_t *bp_info)
 {
 	EnterCriticalSection(&cs);
-	// bp_info may be used by several threads at the same time, so we can't change its values.
-	char *uFilename = nullptr;
-	json_t *new_bp_info = convert_file_name_in_bp(regs, bp_info, &uFilename);
+	char *uFilename = convert_file_name(regs, bp_info);
 
+	fragmented_read_file_hook_t patch;
 	if (game_id == TH_MEGAMARI) {
-		json_object_set_new(new_bp_info, "post_read", json_integer((json_int_t)megamari_patch));
-		json_object_set_new(new_bp_info, "post_patch", json_integer((json_int_t)megamari_patch));
+		patch = megamari_patch;
 	}
 	else if (game_id == TH105 || game_id == TH123) {
-		json_object_set_new(new_bp_info, "post_read", json_integer((json_int_t)th105_patch));
-		json_object_set_new(new_bp_info, "post_patch", json_integer((json_int_t)th105_patch));
+		patch = th105_patch;
 	}
 	else {
-		json_object_set_new(new_bp_info, "post_read", json_integer((json_int_t)nsml_patch));
-		json_object_set_new(new_bp_info, "post_patch", json_integer((json_int_t)nsml_patch));
+		patch = nsml_patch;
 	}
-	int ret = BP_fragmented_read_file(regs, new_bp_info);
+	fragmented_read_file_t ctx = { file_rep_get(uFilename), patch, patch };
+	int ret = fragmented_read_file(regs, &ctx);
 	LeaveCriticalSection(&cs);
 
-	json_decref(new_bp_info);
 	free(uFilename);
 	return ret;
 }
@@ -284,9 +266,8 @@ extern "C" int BP_th105_font_spacing(x86_reg_t *regs, json_t *bp_info)
 	return 1;
 }
 
-DWORD WINAPI th105_GetGlyphOutlineU(HDC hdc, UINT uChar, UINT uFormat, LPGLYPHMETRICS lpgm, DWORD cbBuffer, LPVOID lpvBuffer, const MAT2 *lpmat2)
+static DWORD WINAPI th105_GetGlyphOutline_uncached(HDC hdc, UINT uChar, UINT uFormat, LPGLYPHMETRICS lpgm, DWORD cbBuffer, LPVOID lpvBuffer, const MAT2 *lpmat2)
 {
-	uChar = CharToUTF16(uChar);
 
 	if (uChar & 0xFFFF0000 ||
 		font_has_character(hdc, uChar)) {
@@ -298,18 +279,26 @@ DWORD WINAPI th105_GetGlyphOutlineU(HDC hdc, UINT uChar, UINT uFormat, LPGLYPHME
 	HFONT origFont = (HFONT)GetCurrentObject(hdc, OBJ_FONT);
 	LOGFONTW lf;
 	GetObjectW(origFont, sizeof(lf), &lf);
-	HFONT newFont = font_create_for_character(&lf, uChar);
+	// Cached, and shared between all calls for the same font and charset.
+	HFONT newFont = font_get_for_character(&lf, uChar);
 	if (newFont) {
 		origFont = (HFONT)SelectObject(hdc, newFont);
 	}
 	int ret = GetGlyphOutlineW(hdc, uChar, uFormat, lpgm, cbBuffer, lpvBuffer, lpmat2);
 	if (newFont) {
 		SelectObject(hdc, origFont);
-		DeleteObject(newFont);
 	}
 	return ret;
 }
 
+DWORD WINAPI th105_GetGlyphOutlineU(HDC hdc, UINT uChar, UINT uFormat, LPGLYPHMETRICS lpgm, DWORD cbBuffer, LPVOID lpvBuffer, const MAT2 *lpmat2)
+{
+	uChar = CharToUTF16(uChar);
+	// The fallback font only depends on the selected font and the
+	// character, so the cache can sit in front of that as well.
+	return glyph_cache_get(hdc, uChar, uFormat, lpgm, cbBuffer, lpvBuffer, lpmat2, th105_GetGlyphOutline_uncached);
+}
+
 extern "C" int nsml_mod_init()
 {
 	InitializeCriticalSection(&cs);
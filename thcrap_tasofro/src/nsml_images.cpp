@@ -12,31 +12,47 @@
 #include "thcrap_tasofro.h"
 #include "nsml_images.h"
 
-size_t get_image_data_size(const char *fn, bool fill_alpha_for_24bpp)
+// The PNG opened by the last size callback on this thread, kept around so
+// that the following patch callback for the same file doesn't have to
+// resolve and load it again.
+THREAD_LOCAL(png_image_file_t, nsml_image_tls, nullptr, png_image_file_close);
+
+// Size callbacks always load the file again, patch callbacks take the one
+// from the size callback if it was for the same file.
+static png_image_file_t* nsml_image_open(const char *fn, bool reuse)
 {
 	VLA(char, fn_png, strlen(fn) + 1);
 	strcpy(fn_png, fn);
 	strcpy(PathFindExtensionA(fn_png), ".png");
 
-	uint32_t width, height, rowbytes;
-	uint8_t bpp;
-	bool IHDR_read = png_image_get_IHDR(fn_png, &width, &height, &bpp);
+	png_image_file_t *img = nsml_image_tls_get();
+	if (!img) {
+		VLA_FREE(fn_png);
+		return nullptr;
+	}
+	bool ok = (reuse && img->fn && !strcmp(img->fn, fn_png)) || png_image_file_open(img, fn_png);
 	VLA_FREE(fn_png);
+	return ok ? img : nullptr;
+}
 
-	if (!IHDR_read) {
+size_t get_image_data_size(const char *fn, bool fill_alpha_for_24bpp)
+{
+	png_image_file_t *img = nsml_image_open(fn, false);
+	if (!img) {
 		return 0;
 	}
 
+	uint32_t rowbytes;
 	if (fill_alpha_for_24bpp) {
-		rowbytes = width * 4;
+		rowbytes = img->width * 4;
 	}
 	else {
-		rowbytes = width * bpp / 8;
+		rowbytes = img->width * img->bpp / 8;
 		if (rowbytes % 4 != 0) {
 			rowbytes += 4 - (rowbytes % 4);
 		}
 	}
-	return rowbytes * height;
+	return rowbytes * img->height;
 }
 
 size_t get_cv2_size(const char *fn, json_t*, size_t)
@@ -47,46 +63,32 @@ size_t get_cv2_size(const char *fn, json_t*, size_t)
 int patch_cv2(void *file_inout, size_t size_out, size_t, const char *fn, json_t*)
 {
 	BYTE *file_out = (BYTE*)file_inout;
-	VLA(char, fn_png, strlen(fn) + 1);
-	strcpy(fn_png, fn);
-	strcpy(PathFindExtensionA(fn_png), ".png");
-
-	uint32_t width, height;
-	uint8_t bpp;
-	BYTE** row_pointers = png_image_read(fn_png, &width, &height, &bpp);
-	VLA_FREE(fn_png);
-
-	if (!row_pointers) {
+	png_image_file_t *img = nsml_image_open(fn, true);
+	if (!img) {
 		return 0;
 	}
 
+	uint32_t width = img->width;
+	uint32_t height = img->height;
 	if (17 + width * height * 4 > size_out) {
 		log_print("Destination buffer too small!\n");
-		free(row_pointers);
+		png_image_file_close(img);
 		return -1;
 	}
 
+	bool decoded = png_image_file_decode(img, file_out + 17, width * 4, true);
+	uint8_t bpp = img->bpp;
+	png_image_file_close(img);
+	if (!decoded) {
+		return 0;
+	}
+
 	file_out[0] = bpp;
 	DWORD *header = (DWORD*)(file_out + 1);
 	header[0] = width;
 	header[1] = height;
 	header[2] = width;
 	header[3] = 0;
-	for (unsigned int h = 0; h < height; h++) {
-		for (unsigned int w = 0; w < width; w++) {
-			file_out[17 + h * width * 4 + w * 4 + 0] = row_pointers[h][w * bpp / 8 + 2];
-			file_out[17 + h * width * 4 + w * 4 + 1] = row_pointers[h][w * bpp / 8 + 1];
-			file_out[17 + h * width * 4 + w * 4 + 2] = row_pointers[h][w * bpp / 8 + 0];
-			if (bpp == 32) {
-				file_out[17 + h * width * 4 + w * 4 + 3] = row_pointers[h][w * bpp / 8 + 3];
-			}
-			else {
-				file_out[17 + h * width * 4 + w * 4 + 3] = 0xFF;
-			}
-		}
-	}
-
-	free(row_pointers);
 	return 1;
 }
 
@@ -162,32 +164,44 @@ size_t get_bmp_size(const char *fn, json_t*, size_t)
 
 int patch_bmp(void *file_inout, size_t size_out, size_t, const char *fn, json_t*)
 {
-	VLA(char, fn_png, strlen(fn) + 1);
-	strcpy(fn_png, fn);
-	strcpy(PathFindExtensionA(fn_png), ".png");
-
-	uint32_t width, height, rowbytes;
-	uint8_t bpp;
-	BYTE** row_pointers = png_image_read(fn_png, &width, &height, &bpp);
-	VLA_FREE(fn_png);
-
-	if (!row_pointers) {
+	png_image_file_t *img = nsml_image_open(fn, true);
+	if (!img) {
 		return 0;
 	}
 
-	rowbytes = width * bpp / 8;
+	uint32_t width = img->width;
+	uint32_t height = img->height;
+	uint8_t bpp = img->bpp;
+	uint32_t pixelbytes = width * bpp / 8;
+	uint32_t rowbytes = pixelbytes;
 	if (rowbytes % 4 != 0) {
 		rowbytes += 4 - (rowbytes % 4);
 	}
 	if (size_out < sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + rowbytes * height) {
 		log_print("Destination buffer too small!\n");
-		free(row_pointers);
+		png_image_file_close(img);
 		return -1;
 	}
 
 	BITMAPFILEHEADER *bpFile = (BITMAPFILEHEADER*)file_inout;
 	BITMAPINFOHEADER *bpInfo = (BITMAPINFOHEADER*)(bpFile + 1);
 	BYTE *bpData = (BYTE*)(bpInfo + 1);
+
+	// Bitmaps are stored bottom-up.
+	bool decoded = png_image_file_decode(
+		img, bpData + (height - 1) * rowbytes, -(ptrdiff_t)rowbytes, false
+	);
+	png_image_file_close(img);
+	if (!decoded) {
+		return 0;
+	}
+	// Padding
+	if (rowbytes != pixelbytes) {
+		for (unsigned int h = 0; h < height; h++) {
+			memset(bpData + h * rowbytes + pixelbytes, 0, rowbytes - pixelbytes);
+		}
+	}
+
 	bpFile->bfType = 0x4D42;
 	bpFile->bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + rowbytes * height;
 	bpFile->bfReserved1 = 0;
@@ -205,25 +219,5 @@ int patch_bmp(void *file_inout, size_t size_out, size_t, const char *fn, json_t*
 	bpInfo->biYPelsPerMeter = 65535;
 	bpInfo->biClrUsed = 0;
 	bpInfo->biClrImportant = 0;
-
-	for (unsigned int h = 0; h < height; h++) {
-		unsigned int pos = 0;
-		for (unsigned int w = 0; w < width; w++) {
-			bpData[h * rowbytes + pos + 0] = row_pointers[height - h - 1][w * bpp / 8 + 2];
-			bpData[h * rowbytes + pos + 1] = row_pointers[height - h - 1][w * bpp / 8 + 1];
-			bpData[h * rowbytes + pos + 2] = row_pointers[height - h - 1][w * bpp / 8 + 0];
-			if (bpp == 32) {
-				bpData[h * rowbytes + pos + 3] = row_pointers[height - h - 1][w * bpp / 8 + 3];
-			}
-			pos += bpp / 8;
-		}
-		// Padding
-		while (pos % 4) {
-			bpData[h * rowbytes + pos] = 0;
-			pos++;
-		}
-	}
-
-	free(row_pointers);
 	return 1;
 }
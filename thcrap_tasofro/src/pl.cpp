@@ -11,15 +11,27 @@
 #include "thcrap_tasofro.h"
 #include "pl.h"
 
-void TasofroPl::readField(const char *in, size_t& pos, size_t size, std::string& out)
+void TasofroPl::File::insert(size_t& it, ALine *line)
+{
+	this->lines.insert(this->lines.begin() + it, line);
+	it++;
+}
+
+void TasofroPl::File::erase(size_t it)
+{
+	this->lines.erase(this->lines.begin() + it);
+}
+
+std::string_view TasofroPl::readField(const char *in, size_t& pos, size_t size)
 {
 	bool is_in_quote = false;
+	size_t start = pos;
 
 	for (; pos < size; pos++) {
 		if (in[pos] == '"') {
 			if (is_in_quote && (pos + 1 < size && in[pos + 1] == '"')) {
-				out += in[pos];
 				pos++;
+				continue;
 			}
 			else {
 				is_in_quote = !is_in_quote;
@@ -31,30 +43,40 @@ void TasofroPl::readField(const char *in, size_t& pos, size_t size, std::string&
 				in[pos] == '#' ||
 				in[pos] == '\n' ||
 				(in[pos] == '\r' && pos + 1 < size && in[pos + 1] == '\n')) {
-				return;
+				break;
 			}
 		}
-
-		out += in[pos];
 	}
+	return std::string_view(in + start, pos - start);
 }
 
-TasofroPl::ALine* TasofroPl::readLine(const char*& file, size_t& size)
+TasofroPl::ALine* TasofroPl::readLine(FileArena& arena, const char*& file, size_t& size)
 {
-	std::vector<std::string> fields;
-	std::string comment;
+	// Almost every line fits in there, and the line copies it to the arena anyway.
+	std::string_view fields_local[32];
+	std::vector<std::string_view> fields_more;
+	size_t field_count = 0;
+	std::string_view comment;
 
 	size_t pos = 0;
-	std::string field;
 	while (true) {
-		field.clear();
-		readField(file, pos, size, field);
-		fields.push_back(field);
+		std::string_view field = readField(file, pos, size);
+		if (field_count < std::size(fields_local)) {
+			fields_local[field_count] = field;
+		}
+		else {
+			if (fields_more.empty()) {
+				fields_more.assign(std::begin(fields_local), std::end(fields_local));
+			}
+			fields_more.push_back(field);
+		}
+		field_count++;
 		if (pos == size || file[pos] != ',') {
 			break;
 		}
 		pos++;
 	}
+	const std::string_view *fields = fields_more.empty() ? fields_local : fields_more.data();
 	file += pos;
 	size -= pos;
 
@@ -66,7 +88,7 @@ TasofroPl::ALine* TasofroPl::readLine(const char*& file, size_t& size)
 		if (pos > 0 && file[pos - 1] == '\r') {
 			pos--;
 		}
-		comment.assign(file, pos);
+		comment = std::string_view(file, pos);
 		file += pos;
 		size -= pos;
 	}
@@ -96,35 +118,33 @@ TasofroPl::ALine* TasofroPl::readLine(const char*& file, size_t& size)
 
 	switch (first_char) {
 	case '\0':
-		if (fields.size() > 1)
-			return new Command(fields, comment);
+		if (field_count > 1)
+			return arena.create<Command>(arena, fields, field_count, comment);
 		else
-			return new Empty(fields, comment);
+			return arena.create<Empty>(arena, fields, field_count, comment);
 	case ':':
-		return new Label(fields, comment);
+		return arena.create<Label>(arena, fields, field_count, comment);
 	default:
-		return AText::createText(fields, comment);
+		return AText::createText(arena, fields, field_count, comment);
 	}
 }
 
-TasofroPl::ALine* TasofroPl::readLineStrictEol(const char*& file, size_t& size)
+TasofroPl::ALine* TasofroPl::readLineStrictEol(FileArena& arena, const char*& file, size_t& size)
 {
-	std::string line;
+	const char *line = file;
+	const char *line_end = (const char*)memchr(file, '\n', size);
+	size_t line_size = line_end ? line_end - file : size;
 
-	while (size > 0 && *file != '\n') {
-		line += *file;
-		file++; size--;
-	}
+	file += line_size;
+	size -= line_size;
 	if (size > 0) {
 		file++; size--;
 	}
-	if (line.length() >= 1 && line[line.length() - 1] == '\r') {
-		line.erase(line.length() - 1);
+	if (line_size >= 1 && line[line_size - 1] == '\r') {
+		line_size--;
 	}
 
-	const char *line_ptr = line.c_str();
-	size_t line_size = line.length();
-	return readLine(line_ptr, line_size);
+	return readLine(arena, line, line_size);
 }
 
 
@@ -147,21 +167,31 @@ TasofroPl::LineType TasofroPl::AText::getType() const
 }
 
 
-TasofroPl::ALine::ALine(const std::vector<std::string>& fields, const std::string& comment)
-	: fields(fields), comment(comment)
+TasofroPl::ALine::ALine(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment)
+	: arena(arena), fields(arena.copy_array(fields, field_count)), field_count(field_count), comment(comment)
 {}
 
-std::string TasofroPl::ALine::toString() const
+size_t TasofroPl::ALine::length() const
 {
-	std::string str;
-	for (size_t i = 0; i < this->fields.size(); i++) {
-		str += this->fields[i];
-		if (i < this->fields.size() - 1) {
-			str += ",";
+	size_t len = this->comment.size();
+	for (size_t i = 0; i < this->field_count; i++) {
+		len += this->fields[i].size();
+	}
+	if (this->field_count > 1) {
+		len += this->field_count - 1;
+	}
+	return len;
+}
+
+char *TasofroPl::ALine::write(char *out) const
+{
+	for (size_t i = 0; i < this->field_count; i++) {
+		out = std::copy(this->fields[i].begin(), this->fields[i].end(), out);
+		if (i < this->field_count - 1) {
+			*out++ = ',';
 		}
 	}
-	str += this->comment;
-	return str;
+	return std::copy(this->comment.begin(), this->comment.end(), out);
 }
 
 bool TasofroPl::ALine::isStaffroll() const
@@ -169,10 +199,11 @@ bool TasofroPl::ALine::isStaffroll() const
 	return false;
 }
 
-std::string TasofroPl::ALine::unquote(const std::string& in) const
+std::string_view TasofroPl::ALine::unquote(std::string_view in) const
 {
 	bool is_in_quote = false;
-	std::string out;
+	char *out = this->arena.alloc_str(in.size());
+	size_t out_size = 0;
 
 	for (size_t pos = 0; pos < in.size(); pos++) {
 		if (in[pos] == '"') {
@@ -185,106 +216,110 @@ std::string TasofroPl::ALine::unquote(const std::string& in) const
 			}
 		}
 
-		out += in[pos];
+		out[out_size++] = in[pos];
 	}
-	return out;
+	return std::string_view(out, out_size);
 }
 
-std::string TasofroPl::ALine::quote(const std::string& in) const
+std::string_view TasofroPl::ALine::quote(std::string_view in) const
 {
-	std::string out;
+	// Worst case: a quote at the beginning, and only quotes after it.
+	char *out = this->arena.alloc_str(in.size() * 2 + 3);
+	size_t out_size = 0;
 
-	out = '"';
+	out[out_size++] = '"';
 	for (size_t i = 0; i < in.size(); i++) {
 		if (in[i] == '"') {
 			// If we're at the beginning of the line, the game engine will confuse our escaping with the surrounding quotes.
 			// I'll put a space to ensure it doesn't.
 			if (i == 0) {
-				out += ' ';
+				out[out_size++] = ' ';
 			}
-			out += "\"\"";
+			out[out_size++] = '"';
+			out[out_size++] = '"';
 		}
 		else if (in.compare(i, 7, "{{ruby|") == 0) {
 			i += 7;
-			out += "\\R[";
+			memcpy(out + out_size, "\\R[", 3);
+			out_size += 3;
 			while (i < in.size() && in.compare(i, 2, "}}") != 0) {
-				out += in[i];
+				out[out_size++] = in[i];
 				i++;
 			}
-			out += ']';
+			out[out_size++] = ']';
 			i++; // Actually i += 2, because it will be incremented once again in the for loop.
 		}
 		else {
-			out += in[i];
+			out[out_size++] = in[i];
 		}
 	}
-	out += '"';
+	out[out_size++] = '"';
 
-	return out;
+	return std::string_view(out, out_size);
 }
 
-const std::string& TasofroPl::ALine::get(int n) const
+std::string_view TasofroPl::ALine::get(int n) const
 {
 	return this->fields[n];
 }
 
-void TasofroPl::ALine::set(int n, const std::string& value)
+void TasofroPl::ALine::set(int n, std::string_view value)
 {
-	this->fields[n] = value;
+	this->fields[n] = this->arena.copy(value);
 }
 
-std::string& TasofroPl::ALine::operator[](int n)
+void TasofroPl::ALine::append(int n, std::string_view value)
 {
-	return this->fields[n];
+	this->fields[n] = this->arena.append(this->fields[n], value);
 }
 
 size_t TasofroPl::ALine::size() const
 {
-	return this->fields.size();
+	return this->field_count;
 }
 
 
 
-TasofroPl::Empty::Empty(const std::vector<std::string>& fields, const std::string& comment)
-	: ALine(fields, comment)
+TasofroPl::Empty::Empty(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment)
+	: ALine(arena, fields, field_count, comment)
 {}
 
 
 
-TasofroPl::Label::Label(const std::vector<std::string>& fields, const std::string& comment)
-	: ALine(fields, comment), label(fields[0].substr(1))
+TasofroPl::Label::Label(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment)
+	: ALine(arena, fields, field_count, comment), label(fields[0].substr(1))
 {}
 
-const std::string& TasofroPl::Label::get() const
+std::string_view TasofroPl::Label::get() const
 {
 	return this->label;
 }
 
-void TasofroPl::Label::set(const std::string& label)
+void TasofroPl::Label::set(std::string_view label)
 {
-	this->label = label;
-	this->fields[0] = std::string(":") + label;
+	this->fields[0] = this->arena.concat({ ":", label });
+	this->label = this->fields[0].substr(1);
 }
 
 
 
-TasofroPl::Command::Command(const std::vector<std::string>& fields, const std::string& comment)
-	: ALine(fields, comment)
+TasofroPl::Command::Command(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment)
+	: ALine(arena, fields, field_count, comment)
 {}
 
-const std::string& TasofroPl::Command::get(int n) const
+std::string_view TasofroPl::Command::get(int n) const
 {
 	return this->ALine::get(n + 1);
 }
 
-void TasofroPl::Command::set(int n, const std::string& value)
+void TasofroPl::Command::set(int n, std::string_view value)
 {
 	this->ALine::set(n + 1, value);
 }
 
-std::string& TasofroPl::Command::operator[](int n)
+void TasofroPl::Command::append(int n, std::string_view value)
 {
-	return this->ALine::operator[](n + 1);
+	this->ALine::append(n + 1, value);
 }
 
 size_t TasofroPl::Command::size() const
@@ -299,10 +334,10 @@ bool TasofroPl::Command::isStaffroll() const
 
 
 
-TasofroPl::AText *TasofroPl::AText::createText(const std::vector<std::string>& fields, const std::string& comment, Syntax syntax)
+TasofroPl::AText *TasofroPl::AText::createText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment, Syntax syntax)
 {
 	if (syntax == UNKNOWN) {
-		if (fields.size() > 1) {
+		if (field_count > 1) {
 			syntax = STORY;
 		}
 		else {
@@ -313,57 +348,57 @@ TasofroPl::AText *TasofroPl::AText::createText(const std::vector<std::string>& f
 	switch (syntax) {
 	case STORY:
 		if (game_id < TH155) {
-			return new StoryText(fields, comment);
+			return arena.create<StoryText>(arena, fields, field_count, comment);
 		}
 		else {
 			bool strict_eol = json_boolean_value(json_object_get(runconfig_json_get(), "pl_parsing_strict_eol"));
 			if (strict_eol) {
-				return new Th155_110StoryText(fields, comment);
+				return arena.create<Th155_110StoryText>(arena, fields, field_count, comment);
 			}
 			else {
-				return new Th155StoryText(fields, comment);
+				return arena.create<Th155StoryText>(arena, fields, field_count, comment);
 			}
 		}
 	case ENDINGS:
-		return new EndingText(fields, comment);
+		return arena.create<EndingText>(arena, fields, field_count, comment);
 	case WIN:
-		return new WinText(fields, comment);
+		return arena.create<WinText>(arena, fields, field_count, comment);
 	default:
 		return nullptr;
 	}
 }
 
-TasofroPl::AText::AText(const std::vector<std::string>& fields, const std::string& comment)
-	: ALine(fields, comment)
+TasofroPl::AText::AText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment)
+	: ALine(arena, fields, field_count, comment)
 {
 }
 
-TasofroPl::StoryText::StoryText(const std::vector<std::string>& fields, const std::string& comment)
-	: AText(fields, comment)
+TasofroPl::StoryText::StoryText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment)
+	: AText(arena, fields, field_count, comment)
 {
 }
 
-TasofroPl::Th155StoryText::Th155StoryText(const std::vector<std::string>& fields, const std::string& comment)
-	: StoryText(fields, comment)
+TasofroPl::Th155StoryText::Th155StoryText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment)
+	: StoryText(arena, fields, field_count, comment)
 {
 }
 
-TasofroPl::Th155_110StoryText::Th155_110StoryText(const std::vector<std::string>& fields, const std::string& comment)
-	: Th155StoryText(fields, comment)
+TasofroPl::Th155_110StoryText::Th155_110StoryText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment)
+	: Th155StoryText(arena, fields, field_count, comment)
 {
 }
 
-TasofroPl::EndingText::EndingText(const std::vector<std::string>& fields, const std::string& comment)
-	: AText(fields, comment)
+TasofroPl::EndingText::EndingText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment)
+	: AText(arena, fields, field_count, comment)
 {
 }
 
-TasofroPl::WinText::WinText(const std::vector<std::string>& fields, const std::string& comment)
-	: AText(fields, comment)
+TasofroPl::WinText::WinText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment)
+	: AText(arena, fields, field_count, comment)
 {
 }
 
-void TasofroPl::AText::patch(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it, const std::string& balloonOwner, json_t *patch)
+void TasofroPl::AText::patch(File& file, size_t& file_it, std::string_view balloonOwner, json_t *patch)
 {
 	this->fields[0] = this->unquote(this->fields[0]);
 	this->owner = balloonOwner;
@@ -371,14 +406,15 @@ void TasofroPl::AText::patch(std::list<ALine*>& file, std::list<ALine*>::iterato
 	this->nb_lines = 0;
 	this->is_first_balloon = true;
 
-	if (this->fields[0].length() >= 2 && this->fields[0].compare(this->fields[0].length() - 2, 2, "\\.") == 0)
+	std::string_view text = this->fields[0];
+	if (text.length() >= 2 && text.compare(text.length() - 2, 2, "\\.") == 0)
 		this->last_char = "\\.";
-	else if (this->fields[0].length() >= 1 && (this->fields[0].back() == '\\' || this->fields[0].back() == '@'))
-		this->last_char = this->fields[0].back();
+	else if (text.length() >= 1 && (text.back() == '\\' || text.back() == '@'))
+		this->last_char = text.substr(text.length() - 1);
 
 	this->_patchInit(file, file_it);
 
-	this->fields[0] = "";
+	this->fields[0] = {};
 	size_t json_line_num;
 	json_t *json_line;
 	json_array_foreach(patch, json_line_num, json_line) {
@@ -394,55 +430,58 @@ void TasofroPl::AText::patch(std::list<ALine*>& file, std::list<ALine*>::iterato
 	this->_patchExit(file, file_it);
 }
 
-void TasofroPl::StoryText::_patchInit(std::list<ALine*>&, std::list<ALine*>::iterator&)
+void TasofroPl::StoryText::_patchInit(File&, size_t&)
 {
 	this->balloonName = this->fields[1];
 }
 
-void TasofroPl::EndingText::_patchInit(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it)
+void TasofroPl::EndingText::_patchInit(File& file, size_t& file_it)
 {
 	this->is_staffroll = false;
 
-	std::list<ALine*>::iterator next_it = file_it;
-	while (next_it != file.end() && (*next_it)->getType() == TEXT &&
+	size_t next_it = file_it;
+	while (next_it < file.lines.size() && file.lines[next_it]->getType() == TEXT &&
 		!(this->fields[0].length() >= 1 && this->fields[0].back() == '\\')) {
 		++next_it;
 	}
-	if (next_it != file.end() && (*next_it)->isStaffroll()) {
+	if (next_it < file.lines.size() && file.lines[next_it]->isStaffroll()) {
 		this->is_staffroll = true;
 	}
 }
 
-void TasofroPl::WinText::_patchInit(std::list<ALine*>&, std::list<ALine*>::iterator&)
+void TasofroPl::WinText::_patchInit(File&, size_t&)
 {
 	this->balloonName = this->fields[1];
 }
 
-void TasofroPl::AText::_patchExit(std::list<ALine*>&, std::list<ALine*>::iterator&)
+void TasofroPl::AText::_patchExit(File&, size_t&)
 {
 }
 
-void TasofroPl::StoryText::_patchExit(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it)
+void TasofroPl::StoryText::_patchExit(File& file, size_t& file_it)
 {
-	file_it = file.erase(file_it);
+	// The caller increments [file_it], which then points to the line after
+	// this one (wrapping around if this was the first line).
+	file.erase(file_it);
 	--file_it;
-	delete this;
 }
 
-void TasofroPl::Th155StoryText::_patchExit(std::list<ALine*>&, std::list<ALine*>::iterator&)
+void TasofroPl::Th155StoryText::_patchExit(File&, size_t&)
 {
 	this->fields[0] = this->quote(this->fields[0]);
 }
 
-void TasofroPl::EndingText::_patchExit(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it)
+void TasofroPl::EndingText::_patchExit(File& file, size_t& file_it)
 {
 	if (this->is_staffroll) {
 		++file_it;
-		while ((*file_it)->getType() == TEXT) {
-			file_it = file.erase(file_it);
+		while (file_it < file.lines.size() && file.lines[file_it]->getType() == TEXT) {
+			file.erase(file_it);
 		}
 		++file_it;
-		file_it = file.erase(file_it);
+		if (file_it < file.lines.size()) {
+			file.erase(file_it);
+		}
 		--file_it;
 		--file_it;
 	}
@@ -527,32 +566,33 @@ bool TasofroPl::Th155StoryText::parseCommand(json_t *patch, int json_line_num)
 	return this->AText::parseCommand(patch, json_line_num);
 }
 
-void TasofroPl::StoryText::beginLine(std::list<ALine*>& file, const std::list<ALine*>::iterator& it)
+void TasofroPl::StoryText::beginLine(File& file, size_t& it)
 {
 	if (this->is_first_balloon == false && this->cur_line == 1) {
-		file.insert(it, new Command(std::vector<std::string>({
+		const std::string_view clear_fields[] = {
 			"",
 			"ClearBalloon",
 			this->owner
-			})));
+		};
+		file.insert(it, this->arena.create<Command>(this->arena, clear_fields, std::size(clear_fields)));
 	}
 }
 
-void TasofroPl::Th155_110StoryText::beginLine(std::list<ALine*>& file, const std::list<ALine*>::iterator& it)
+void TasofroPl::Th155_110StoryText::beginLine(File& file, size_t& it)
 {
 	if (this->is_first_balloon == false && this->cur_line == 1) {
 		this->fields[0] = this->quote(this->fields[0]);
-		file.insert(it, new Th155_110StoryText(this->fields));
-		this->fields[0] = "";
+		file.insert(it, this->arena.create<Th155_110StoryText>(this->arena, this->fields, this->field_count));
+		this->fields[0] = {};
 	}
 }
 
-void TasofroPl::EndingText::beginLine(std::list<ALine*>& file, const std::list<ALine*>::iterator& it)
+void TasofroPl::EndingText::beginLine(File& file, size_t& it)
 {
 	if (this->is_first_balloon == false && this->cur_line == 1) {
 		this->fields[0] = this->quote(this->fields[0]);
-		file.insert(it, new EndingText(this->fields));
-		this->fields[0] = "";
+		file.insert(it, this->arena.create<EndingText>(this->arena, this->fields, this->field_count));
+		this->fields[0] = {};
 	}
 
 	if (this->is_staffroll) {
@@ -565,15 +605,15 @@ void TasofroPl::EndingText::beginLine(std::list<ALine*>& file, const std::list<A
 	}
 }
 
-void TasofroPl::WinText::beginLine(std::list<ALine*>& file, const std::list<ALine*>::iterator& it)
+void TasofroPl::WinText::beginLine(File& file, size_t& it)
 {
 	if (this->is_first_balloon == false && this->cur_line == 1) {
-		file.insert(it, new WinText(this->fields));
-		this->fields[0] = "";
+		file.insert(it, this->arena.create<WinText>(this->arena, this->fields, this->field_count));
+		this->fields[0] = {};
 	}
 }
 
-void TasofroPl::AText::patchLine(const char *text, std::list<ALine*>& file, const std::list<ALine*>::iterator& it)
+void TasofroPl::AText::patchLine(const char *text, File& file, size_t& it)
 {
 	std::string formattedText = text;
 	if (this->cur_line == this->nb_lines) {
@@ -588,24 +628,24 @@ void TasofroPl::AText::patchLine(const char *text, std::list<ALine*>& file, cons
 	this->_patchLine(formattedText, file, it);
 }
 
-void TasofroPl::StoryText::_patchLine(std::string& text, std::list<ALine*>& file, const std::list<ALine*>::iterator& it)
+void TasofroPl::StoryText::_patchLine(std::string& text, File& file, size_t& it)
 {
-	std::vector<std::string> new_fields = this->fields;
-	new_fields[0] = this->quote(text);
-	new_fields[1] = this->balloonName;
-	file.insert(it, new StoryText(new_fields));
+	StoryText *line = this->arena.create<StoryText>(this->arena, this->fields, this->field_count);
+	line->fields[0] = this->quote(text);
+	line->fields[1] = this->arena.copy(this->balloonName);
+	file.insert(it, line);
 }
 
-void TasofroPl::Th155StoryText::_patchLine(std::string& text, std::list<ALine*>&, const std::list<ALine*>::iterator&)
+void TasofroPl::Th155StoryText::_patchLine(std::string& text, File&, size_t&)
 {
 	if (this->cur_line != this->nb_lines) {
 		text += "\\n";
 	}
-	this->fields[0] += text;
-	this->fields[1] = this->balloonName;
+	this->append(0, text);
+	this->set(1, this->balloonName);
 }
 
-void TasofroPl::EndingText::_patchLine(std::string& text, std::list<ALine*>&, const std::list<ALine*>::iterator&)
+void TasofroPl::EndingText::_patchLine(std::string& text, File&, size_t&)
 {
 	if (this->cur_line != this->nb_lines) {
 		text += "\\n";
@@ -616,16 +656,16 @@ void TasofroPl::EndingText::_patchLine(std::string& text, std::list<ALine*>&, co
 			text.erase(break_pos, 2);
 		}
 	}
-	this->fields[0] += text;
+	this->append(0, text);
 }
 
-void TasofroPl::WinText::_patchLine(std::string& text, std::list<ALine*>&, const std::list<ALine*>::iterator&)
+void TasofroPl::WinText::_patchLine(std::string& text, File&, size_t&)
 {
 	if (this->cur_line != this->nb_lines) {
 		text += "\\n";
 	}
-	this->fields[0] += text;
-	this->fields[1] = this->balloonName;
+	this->append(0, text);
+	this->set(1, this->balloonName);
 }
 
 void TasofroPl::AText::endLine()
@@ -675,33 +715,37 @@ json_t *TasofroPl::balloonNumberToLines(json_t *patch, size_t balloon_number)
 	return json_lines;
 }
 
-static bool storyLineIsFinished(TasofroPl::ALine& line)
+static bool storyLineIsFinished(const TasofroPl::ALine& line)
 {
-	std::string& text = line[0];
-	return text[text.size() - 1] == '\\';
+	std::string_view text = line.get(0);
+	return !text.empty() && text.back() == '\\';
 }
 
-static void stickStoryLines(std::list<TasofroPl::ALine*>& lines)
+static void stickStoryLines(TasofroPl::File& file)
 {
-	for (std::list<TasofroPl::ALine*>::iterator it = lines.begin(); it != lines.end(); ++it) {
-		if ((*it)->getType() == TasofroPl::TEXT) {
-			while (storyLineIsFinished(**it) == false) {
-				std::list<TasofroPl::ALine*>::iterator next = it;
-				++next;
-				if ((*next)->getType() == TasofroPl::TEXT) {
-					(**it)[0] += "\n" + (**next)[0];
-					lines.erase(next);
+	std::vector<TasofroPl::ALine*>& lines = file.lines;
+	size_t out = 0;
+	for (size_t it = 0; it < lines.size(); ) {
+		TasofroPl::ALine *line = lines[it++];
+		if (line->getType() == TasofroPl::TEXT) {
+			while (storyLineIsFinished(*line) == false && it < lines.size()) {
+				TasofroPl::ALine *next = lines[it];
+				if (next->getType() == TasofroPl::TEXT) {
+					line->set(0, file.arena.concat({ line->get(0), "\n", next->get(0) }));
+					it++;
 				}
-				else if ((*next)->getType() == TasofroPl::EMPTY) {
-					(**it)[0] += "\n";
-					lines.erase(next);
+				else if (next->getType() == TasofroPl::EMPTY) {
+					line->append(0, "\n");
+					it++;
 				}
 				else {
 					break;
 				}
 			}
 		}
+		lines[out++] = line;
 	}
+	lines.resize(out);
 }
 
 int patch_pl(void *file_inout, size_t size_out, size_t size_in, const char *, json_t *patch)
@@ -710,35 +754,38 @@ int patch_pl(void *file_inout, size_t size_out, size_t size_in, const char *, js
 		return 0;
 	}
 
-	std::list<TasofroPl::ALine*> lines;
-	const char *file_in = (const char*)file_inout;
+	TasofroPl::File file;
+	// The lines point into the input, which we overwrite with the output.
+	char *file_copy = file.arena.alloc_str(size_in);
+	memcpy(file_copy, file_inout, size_in);
+	const char *file_in = file_copy;
 	char *file_out = (char*)file_inout;
 	bool strict_eol = json_boolean_value(json_object_get(runconfig_json_get(), "pl_parsing_strict_eol"));
 
 	while (size_in > 0) {
 		if (strict_eol) {
 			// th155 v1.10
-			lines.push_back(TasofroPl::readLineStrictEol(file_in, size_in));
+			file.lines.push_back(TasofroPl::readLineStrictEol(file.arena, file_in, size_in));
 		}
 		else {
 			// th155 older versions, or just th135/th145.
-			lines.push_back(TasofroPl::readLine(file_in, size_in));
+			file.lines.push_back(TasofroPl::readLine(file.arena, file_in, size_in));
 		}
 	}
 	if (game_id == TH155) {
 		// Don't split ending lines by line endings.
 		// Instead, try to do a semantic splitting by sticking together the lines belonging to the same text box.
-		stickStoryLines(lines);
+		stickStoryLines(file);
 	}
 
-	std::string balloonOwner;
+	std::string_view balloonOwner;
 	size_t balloon_number = 1;
-	for (std::list<TasofroPl::ALine*>::iterator it = lines.begin(); it != lines.end(); ++it) {
-		TasofroPl::ALine *line = *it;
+	for (size_t it = 0; it < file.lines.size(); ++it) {
+		TasofroPl::ALine *line = file.lines[it];
 		if (line->getType() == TasofroPl::COMMAND) {
 			TasofroPl::Command& command = dynamic_cast<TasofroPl::Command&>(*line);
-			if (command[0] == "SetFocus") {
-				balloonOwner = command[1];
+			if (command.size() >= 2 && command.get(0) == "SetFocus") {
+				balloonOwner = command.get(1);
 			}
 		}
 		if (line->getType() != TasofroPl::TEXT) {
@@ -750,23 +797,21 @@ int patch_pl(void *file_inout, size_t size_out, size_t size_in, const char *, js
 		if (json_lines == nullptr) {
 			continue;
 		}
-		dynamic_cast<TasofroPl::AText*>(line)->patch(lines, it, balloonOwner, json_lines);
+		dynamic_cast<TasofroPl::AText*>(line)->patch(file, it, balloonOwner, json_lines);
 	}
 
 #if 0
 	size_t size_out_orig = size_out;
 #endif
 
-	std::string str;
-	for (TasofroPl::ALine* line : lines) {
-		str = line->toString();
-		if (str.size() > size_out + 3) {
+	for (TasofroPl::ALine* line : file.lines) {
+		size_t len = line->length();
+		if (len > size_out + 3) {
 			log_print("Output file too small\n");
 			break;
 		}
-		memcpy(file_out, str.c_str(), str.size());
-		file_out += str.size();
-		size_out -= str.size();
+		file_out = line->write(file_out);
+		size_out -= len;
 		memcpy(file_out, "\r\n", 2);
 		file_out += 2;
 		size_out -= 2;
@@ -10,10 +10,11 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
-#include <list>
 #include <string.h>
 #include <jansson.h>
+#include "arena.h"
 
 namespace TasofroPl
 {
@@ -25,34 +26,62 @@ namespace TasofroPl
 		TEXT
 	};
 
+	class ALine;
+
+	// A parsed file. Lines point into [arena], which also holds a copy of
+	// the input file, and are only referenced by their index in [lines].
+	// Lines removed from [lines] stay valid until the file is destroyed.
+	struct File
+	{
+		FileArena arena;
+		std::vector<ALine*> lines;
+
+		// Inserts [line] before the one at [it], and moves [it] to keep
+		// pointing to the same line.
+		void insert(size_t& it, ALine *line);
+		// Removes the line at [it]. [it] then points to the next one.
+		void erase(size_t it);
+	};
+
 	class ALine
 	{
 	protected:
-		std::vector<std::string> fields;
-		std::string comment;
+		FileArena& arena;
+		std::string_view *fields;
+		size_t field_count;
+		std::string_view comment;
 
 	public:
-		ALine(const std::vector<std::string>& fields, const std::string& comment = "");
+		// Copies the [fields] array, but not the strings it points to,
+		// which must live at least as long as [arena].
+		ALine(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment = {});
 		virtual ~ALine() {}
 
 		virtual LineType getType() const = 0;
-		virtual std::string toString() const;
 		virtual bool isStaffroll() const;
 
-		std::string unquote(const std::string& in) const;
-		std::string quote(const std::string& in) const;
-
-		// Access/update the members in fields.
-		virtual const std::string& get(int n) const;
-		virtual void set(int n, const std::string& value);
-		virtual std::string& operator[](int n);
+		// Length of the serialized line, without the line ending.
+		size_t length() const;
+		// Serializes the line to [out], which must have room for length()
+		// bytes. Returns the end of the written data.
+		char *write(char *out) const;
+
+		// Return strings allocated from [arena].
+		std::string_view unquote(std::string_view in) const;
+		std::string_view quote(std::string_view in) const;
+
+		// Access/update the members in fields. set() and append() copy
+		// [value] into the arena.
+		virtual std::string_view get(int n) const;
+		virtual void set(int n, std::string_view value);
+		virtual void append(int n, std::string_view value);
 		virtual size_t size() const;
 	};
 
 	class Empty : public ALine
 	{
 	public:
-		Empty(const std::vector<std::string>& fields, const std::string& comment = "");
+		Empty(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment = {});
 		~Empty() {}
 
 		LineType getType() const;
@@ -61,29 +90,29 @@ namespace TasofroPl
 	class Label : public ALine
 	{
 	private:
-		std::string label;
+		std::string_view label;
 	public:
-		Label(const std::vector<std::string>& fields, const std::string& comment = "");
+		Label(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment = {});
 		~Label() {}
 
 		LineType getType() const;
-		const std::string& get() const;
-		void set(const std::string& label);
+		std::string_view get() const;
+		void set(std::string_view label);
 	};
 
 	class Command : public ALine
 	{
 	public:
-		Command(const std::vector<std::string>& fields, const std::string& comment = "");
+		Command(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment = {});
 		~Command() {}
 
 		LineType getType() const;
 		bool isStaffroll() const;
 
 		// Access/update the command name (index 0) or a parameter (index 1->size).
-		const std::string& get(int n) const;
-		void set(int n, const std::string& value);
-		std::string& operator[](int n);
+		std::string_view get(int n) const;
+		void set(int n, std::string_view value);
+		void append(int n, std::string_view value);
 		size_t size() const;
 	};
 
@@ -99,46 +128,46 @@ namespace TasofroPl
 
 	protected:
 		// Patcher state
-		std::string owner;
+		std::string_view owner;
 		std::string balloonName;
 
-		std::string last_char;
+		std::string_view last_char;
 		bool is_first_balloon;
 		bool is_last_balloon;
 
 		int cur_line;
 		int nb_lines;
 
-		virtual void _patchInit(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it) = 0;
+		virtual void _patchInit(File& file, size_t& file_it) = 0;
 		// Functions used by the patcher
 		virtual bool parseCommand(json_t *patch, int json_line_num);
-		virtual void beginLine(std::list<ALine*>& file, const std::list<ALine*>::iterator& it) = 0;
-		void patchLine(const char *text, std::list<ALine*>& file, const std::list<ALine*>::iterator& it);
-		virtual void _patchLine(std::string& text, std::list<ALine*>& file, const std::list<ALine*>::iterator& it) = 0;
+		virtual void beginLine(File& file, size_t& it) = 0;
+		void patchLine(const char *text, File& file, size_t& it);
+		virtual void _patchLine(std::string& text, File& file, size_t& it) = 0;
 		virtual void endLine();
-		virtual void _patchExit(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it);
+		virtual void _patchExit(File& file, size_t& file_it);
 
 	public:
-		static AText *createText(const std::vector<std::string>& fields, const std::string& comment = "", Syntax syntax = UNKNOWN);
+		static AText *createText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment = {}, Syntax syntax = UNKNOWN);
 
-		AText(const std::vector<std::string>& fields, const std::string& comment = "");
+		AText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment = {});
 		~AText() {}
 
 		LineType getType() const;
-		void patch(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it, const std::string& balloonOwner, json_t *patch);
+		void patch(File& file, size_t& file_it, std::string_view balloonOwner, json_t *patch);
 	};
 
 	class StoryText : public AText
 	{
 	protected:
-		void _patchInit(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it);
+		void _patchInit(File& file, size_t& file_it);
 		bool parseCommand(json_t *patch, int json_line_num);
-		void beginLine(std::list<ALine*>& file, const std::list<ALine*>::iterator& it);
-		void _patchLine(std::string& text, std::list<ALine*>& file, const std::list<ALine*>::iterator& it);
-		void _patchExit(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it);
+		void beginLine(File& file, size_t& it);
+		void _patchLine(std::string& text, File& file, size_t& it);
+		void _patchExit(File& file, size_t& file_it);
 
 	public:
-		StoryText(const std::vector<std::string>& fields, const std::string& comment = "");
+		StoryText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment = {});
 		~StoryText() {}
 	};
 
@@ -146,21 +175,21 @@ namespace TasofroPl
 	{
 	protected:
 		bool parseCommand(json_t *patch, int json_line_num);
-		void _patchLine(std::string& text, std::list<ALine*>& file, const std::list<ALine*>::iterator& it);
-		void _patchExit(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it);
+		void _patchLine(std::string& text, File& file, size_t& it);
+		void _patchExit(File& file, size_t& file_it);
 
 	public:
-		Th155StoryText(const std::vector<std::string>& fields, const std::string& comment = "");
+		Th155StoryText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment = {});
 		~Th155StoryText() {}
 	};
 
 	class Th155_110StoryText : public Th155StoryText
 	{
 	protected:
-		void beginLine(std::list<ALine*>& file, const std::list<ALine*>::iterator& it);
+		void beginLine(File& file, size_t& it);
 
 	public:
-		Th155_110StoryText(const std::vector<std::string>& fields, const std::string& comment = "");
+		Th155_110StoryText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment = {});
 		~Th155_110StoryText() {}
 	};
 
@@ -170,32 +199,34 @@ namespace TasofroPl
 		bool is_staffroll;
 
 	protected:
-		void _patchInit(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it);
-		void beginLine(std::list<ALine*>& file, const std::list<ALine*>::iterator& it);
-		void _patchLine(std::string& text, std::list<ALine*>& file, const std::list<ALine*>::iterator& it);
+		void _patchInit(File& file, size_t& file_it);
+		void beginLine(File& file, size_t& it);
+		void _patchLine(std::string& text, File& file, size_t& it);
 		void endLine();
-		void _patchExit(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it);
+		void _patchExit(File& file, size_t& file_it);
 
 	public:
-		EndingText(const std::vector<std::string>& fields, const std::string& comment = "");
+		EndingText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment = {});
 		~EndingText() {}
 	};
 
 	class WinText : public AText
 	{
 	protected:
-		void _patchInit(std::list<ALine*>& file, std::list<ALine*>::iterator& file_it);
-		void beginLine(std::list<ALine*>& file, const std::list<ALine*>::iterator& it);
-		void _patchLine(std::string& text, std::list<ALine*>& file, const std::list<ALine*>::iterator& it);
+		void _patchInit(File& file, size_t& file_it);
+		void beginLine(File& file, size_t& it);
+		void _patchLine(std::string& text, File& file, size_t& it);
 
 	public:
-		WinText(const std::vector<std::string>& fields, const std::string& comment = "");
+		WinText(FileArena& arena, const std::string_view *fields, size_t field_count, std::string_view comment = {});
 		~WinText() {}
 	};
 
-	ALine* readLine(const char*& file, size_t& size);
-	ALine* readLineStrictEol(const char*& file, size_t& size);
-	void readField(const char *in, size_t& pos, size_t size, std::string& out);
+	// Both return lines pointing into [file], which must live as long as
+	// [arena].
+	ALine* readLine(FileArena& arena, const char*& file, size_t& size);
+	ALine* readLineStrictEol(FileArena& arena, const char*& file, size_t& size);
+	std::string_view readField(const char *in, size_t& pos, size_t size);
 	json_t *balloonNumberToLines(json_t *patch, size_t balloon_number);
 }
 
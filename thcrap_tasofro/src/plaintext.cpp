@@ -10,6 +10,38 @@
 #include <thcrap.h>
 #include "thcrap_tasofro.h"
 
+// Appends line number [line], going from [begin] to [end], to [file_out],
+// replacing it if [patch] has something for it.
+static void plaintext_line(std::string& file_out, json_t *patch, size_t line, const char *begin, const char *end)
+{
+	json_t *lines = json_object_numkey_get(patch, line);
+	if (json_flex_array_size(lines) > 0) {
+		file_out += '"';
+
+		size_t ind;
+		json_t *val;
+		json_flex_array_foreach(lines, ind, val) {
+			if (ind > 0) {
+				file_out += "\\n";
+			}
+			const char* str = json_string_value(val);
+			for (size_t i = 0; i < strlen(str); i++) {
+				if (str[i] == '"') {
+					if (ind == 0 && i == 0) {
+						file_out += ' ';
+					}
+					file_out += '"';
+				}
+				file_out += str[i];
+			}
+		}
+		file_out += "\"\r\n";
+	}
+	else {
+		file_out.append(begin, end - begin);
+	}
+}
+
 int patch_plaintext(void *file_inout, size_t size_out, size_t size_in, const char *fn, json_t *patch)
 {
 	char* file_in = (char*)file_inout;
@@ -28,32 +60,7 @@ int patch_plaintext(void *file_inout, size_t size_out, size_t size_in, const cha
 			size_in--;
 		}
 
-		json_t *lines = json_object_numkey_get(patch, line);
-		if (json_flex_array_size(lines) > 0) {
-			file_out += '"';
-
-			size_t ind;
-			json_t *val;
-			json_flex_array_foreach(lines, ind, val) {
-				if (ind > 0) {
-					file_out += "\\n";
-				}
-				const char* str = json_string_value(val);
-				for (size_t i = 0; i < strlen(str); i++) {
-					if (str[i] == '"') {
-						if (ind == 0 && i == 0) {
-							file_out += ' ';
-						}
-						file_out += '"';
-					}
-					file_out += str[i];
-				}
-			}
-			file_out += "\"\r\n";
-		}
-		else {
-			file_out.append(file_in, end_line - file_in);
-		}
+		plaintext_line(file_out, patch, line, file_in, end_line);
 		file_in = end_line;
 		line++;
 	}
@@ -65,3 +72,24 @@ int patch_plaintext(void *file_inout, size_t size_out, size_t size_in, const cha
 	memcpy(file_inout, file_out.c_str(), file_out.size());
 	return 1;
 }
+
+size_t patch_plaintext_stream(patch_stream_t *stream, const BYTE *in, size_t in_size, bool last)
+{
+	const char *p = (const char*)in;
+	const char *end = p + in_size;
+	std::string file_out;
+	while (p < end) {
+		const char *end_line = (const char*)memchr(p, '\n', end - p);
+		if (!end_line && !last) {
+			// Wait for the rest of the line.
+			break;
+		}
+		end_line = end_line ? end_line + 1 : end;
+
+		// [state] is the number of the previous line.
+		plaintext_line(file_out, stream->patch, ++stream->state, p, end_line);
+		p = end_line;
+	}
+	stream->write(stream, file_out.data(), file_out.size());
+	return p - (const char*)in;
+}
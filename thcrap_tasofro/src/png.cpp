@@ -39,34 +39,75 @@ void png_error_callback(png_structp png_ptr, png_const_charp msg)
 	longjmp(png_jmpbuf(png_ptr), 1);
 }
 
-// PNG reading core is adapted from http://www.libpng.org/pub/png/book/chapter13.html
-BYTE **png_image_read(const char *fn, uint32_t *width, uint32_t *height, uint8_t *bpp, bool gray_to_rgb)
+// Decodes 8-bit RGB and RGBA images without going through libpng at all.
+// Returns nullptr for everything else.
+static BYTE **png_image_read_fast(const BYTE *file_buffer, size_t file_size, uint32_t *width, uint32_t *height, uint8_t *bpp)
+{
+	png_decode_t dec;
+	if (png_decode_begin(&dec, file_buffer, file_size, 0)) {
+		return nullptr;
+	}
+	size_t rowbytes = (size_t)dec.width * dec.channels;
+	BYTE **row_pointers = (BYTE**)malloc(sizeof(BYTE*) * dec.height + rowbytes * dec.height);
+	if (row_pointers) {
+		BYTE* image_data = ((BYTE*)row_pointers) + sizeof(BYTE*) * dec.height;
+		for (uint32_t i = 0; i < dec.height; i++)
+			row_pointers[i] = image_data + i * rowbytes;
+		if (png_decode_rows(&dec, image_data, rowbytes, dec.height) == 0) {
+			*width = dec.width;
+			*height = dec.height;
+			*bpp = dec.channels * 8;
+		} else {
+			SAFE_FREE(row_pointers);
+		}
+	}
+	png_decode_end(&dec);
+	return row_pointers;
+}
+
+// Resolves [fn] on the patch stack and loads the first file found. With
+// [allow_raw], a pre-converted raw image next to the PNG in the same patch
+// is taken instead.
+static BYTE *png_file_load(const char *fn, size_t *file_size, bool allow_raw)
 {
 	stack_chain_iterate_t sci = {};
 	BYTE *file_buffer = nullptr;
-	file_buffer_t file = {};
 
-	char **chain = resolve_chain_game(fn);
+	chain_buf_t chain;
+	resolve_chain_game_build(chain, fn);
 
-	if (chain && chain[0]) {
-		log_printf("(PNG) Resolving %s...", chain[0]);
-		while (file_buffer == nullptr && stack_chain_iterate(&sci, chain, SCI_BACKWARDS) != 0) {
-			file_buffer = (BYTE*)patch_file_load(sci.patch_info, sci.fn, &file.size);
+	if (chain.get() && chain.get()[0]) {
+		log_printf("(PNG) Resolving %s...", chain.get()[0]);
+		while (file_buffer == nullptr && stack_chain_iterate(&sci, chain.get(), SCI_BACKWARDS) != 0) {
+			if (allow_raw) {
+				file_buffer = (BYTE*)raw_image_load(sci.patch_info, sci.fn, file_size);
+			}
+			if (!file_buffer) {
+				file_buffer = (BYTE*)patch_file_load(sci.patch_info, sci.fn, file_size);
+			}
 		}
 	}
 	if (!file_buffer) {
 		log_print("not found\n");
-		free(chain);
 		return nullptr;
 	}
 	patch_print_fn(sci.patch_info, sci.fn);
 	log_print("\n");
-	free(chain);
-	file.buffer = file_buffer;
-	
-	if (!png_check_sig(file.buffer, 8)) {
+	return file_buffer;
+}
+
+// PNG reading core is adapted from http://www.libpng.org/pub/png/book/chapter13.html
+static BYTE **png_image_read_buffer(BYTE *file_buffer, size_t file_size, uint32_t *width, uint32_t *height, uint8_t *bpp, bool gray_to_rgb)
+{
+	file_buffer_t file = { file_buffer, file_size };
+
+	BYTE **fast_rows = png_image_read_fast(file_buffer, file.size, width, height, bpp);
+	if (fast_rows) {
+		return fast_rows;
+	}
+
+	if (file.size < 8 || !png_check_sig(file.buffer, 8)) {
 		log_print("Bad PNG signature!\n");
-		free(file_buffer);
 		return nullptr;
 	}
 	file.buffer += 8;
@@ -76,7 +117,6 @@ BYTE **png_image_read(const char *fn, uint32_t *width, uint32_t *height, uint8_t
 	png_infop info_ptr = png_create_info_struct(png_ptr);
 	if (setjmp(png_jmpbuf(png_ptr))) {
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-		free(file_buffer);
 		return nullptr;
 	}
 	png_set_read_fn(png_ptr, &file, read_bytes);
@@ -108,37 +148,37 @@ BYTE **png_image_read(const char *fn, uint32_t *width, uint32_t *height, uint8_t
 	png_read_image(png_ptr, row_pointers);
 
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-	free(file_buffer);
 	return row_pointers;
 }
 
-bool png_image_get_IHDR(const char *fn, uint32_t *width, uint32_t *height, uint8_t *bpp)
+BYTE **png_image_read(const char *fn, uint32_t *width, uint32_t *height, uint8_t *bpp, bool gray_to_rgb)
 {
-	stack_chain_iterate_t sci = {};
-	BYTE *file_buffer = nullptr;
-	file_buffer_t file = {};
-
-	char **chain = resolve_chain_game(fn);
+	size_t file_size = 0;
+	BYTE *file_buffer = png_file_load(fn, &file_size, false);
+	if (!file_buffer) {
+		return nullptr;
+	}
+	BYTE **row_pointers = png_image_read_buffer(file_buffer, file_size, width, height, bpp, gray_to_rgb);
+	free(file_buffer);
+	return row_pointers;
+}
 
-	if (chain && chain[0]) {
-		log_printf("(PNG) Resolving %s...", chain[0]);
-		while (file_buffer == nullptr && stack_chain_iterate(&sci, chain, SCI_BACKWARDS) != 0) {
-			file_buffer = (BYTE*)patch_file_load(sci.patch_info, sci.fn, &file.size);
+static bool png_read_IHDR_buffer(BYTE *file_buffer, size_t file_size, uint32_t *width, uint32_t *height, uint8_t *bpp)
+{
+	const raw_image_header_t *raw = raw_image_header(file_buffer, file_size);
+	if (raw) {
+		*width = raw->width;
+		*height = raw->height;
+		if (bpp) {
+			*bpp = raw_image_channels(raw) * 8;
 		}
+		return true;
 	}
-	if (!file_buffer) {
-		log_print("not found\n");
-		free(chain);
-		return false;
-	}
-	patch_print_fn(sci.patch_info, sci.fn);
-	log_print("\n");
-	free(chain);
-	file.buffer = file_buffer;
 
-	if (!png_check_sig(file.buffer, 8)) {
+	file_buffer_t file = { file_buffer, file_size };
+
+	if (file.size < 8 || !png_check_sig(file.buffer, 8)) {
 		log_print("Bad PNG signature!\n");
-		free(file_buffer);
 		return false;
 	}
 	file.buffer += 8;
@@ -148,7 +188,6 @@ bool png_image_get_IHDR(const char *fn, uint32_t *width, uint32_t *height, uint8
 	png_infop info_ptr = png_create_info_struct(png_ptr);
 	if (setjmp(png_jmpbuf(png_ptr))) {
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-		free(file_buffer);
 		return false;
 	}
 	png_set_read_fn(png_ptr, &file, read_bytes);
@@ -162,6 +201,103 @@ bool png_image_get_IHDR(const char *fn, uint32_t *width, uint32_t *height, uint8
 	}
 
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	return true;
+}
+
+bool png_image_get_IHDR(const char *fn, uint32_t *width, uint32_t *height, uint8_t *bpp)
+{
+	size_t file_size = 0;
+	BYTE *file_buffer = png_file_load(fn, &file_size, true);
+	if (!file_buffer) {
+		return false;
+	}
+	bool ret = png_read_IHDR_buffer(file_buffer, file_size, width, height, bpp);
 	free(file_buffer);
+	return ret;
+}
+
+bool png_image_file_open(png_image_file_t *img, const char *fn)
+{
+	png_image_file_close(img);
+	img->file_buffer = png_file_load(fn, &img->file_size, true);
+	if (!img->file_buffer) {
+		return false;
+	}
+	if (!png_read_IHDR_buffer(img->file_buffer, img->file_size, &img->width, &img->height, &img->bpp)) {
+		png_image_file_close(img);
+		return false;
+	}
+	img->fn = strdup(fn);
 	return true;
 }
+
+bool png_image_file_decode(png_image_file_t *img, BYTE *out, ptrdiff_t stride, bool add_alpha)
+{
+	if (!img->file_buffer) {
+		return false;
+	}
+
+	if (raw_image_header(img->file_buffer, img->file_size)) {
+		unsigned int flags = add_alpha ? RAW_IMAGE_ADD_ALPHA : 0;
+		return raw_image_rows(img->file_buffer, img->file_size, out, stride, img->height, flags) == 0;
+	}
+
+	png_decode_t dec;
+	unsigned int flags = PNG_DECODE_BGR | (add_alpha ? PNG_DECODE_ADD_ALPHA : 0);
+	if (png_decode_begin(&dec, img->file_buffer, img->file_size, flags) == 0) {
+		bool decoded = dec.width == img->width && dec.height == img->height
+			&& png_decode_rows(&dec, out, stride, dec.height) == 0;
+		png_decode_end(&dec);
+		if (decoded) {
+			return true;
+		}
+	}
+
+	// Everything else goes through libpng, which also reports any errors.
+	uint32_t width, height;
+	uint8_t bpp;
+	BYTE **row_pointers = png_image_read_buffer(img->file_buffer, img->file_size, &width, &height, &bpp, true);
+	if (!row_pointers) {
+		return false;
+	}
+	if (width != img->width || height != img->height || bpp != img->bpp) {
+		free(row_pointers);
+		return false;
+	}
+	for (uint32_t h = 0; h < height; h++) {
+		const BYTE *in = row_pointers[h];
+		BYTE *p = out + (ptrdiff_t)h * stride;
+		if (bpp == 32) {
+			for (uint32_t w = 0; w < width; w++, in += 4, p += 4) {
+				p[0] = in[2];
+				p[1] = in[1];
+				p[2] = in[0];
+				p[3] = in[3];
+			}
+		}
+		else if (add_alpha) {
+			for (uint32_t w = 0; w < width; w++, in += 3, p += 4) {
+				p[0] = in[2];
+				p[1] = in[1];
+				p[2] = in[0];
+				p[3] = 0xFF;
+			}
+		}
+		else {
+			for (uint32_t w = 0; w < width; w++, in += 3, p += 3) {
+				p[0] = in[2];
+				p[1] = in[1];
+				p[2] = in[0];
+			}
+		}
+	}
+	free(row_pointers);
+	return true;
+}
+
+void png_image_file_close(png_image_file_t *img)
+{
+	SAFE_FREE(img->fn);
+	SAFE_FREE(img->file_buffer);
+	img->file_size = 0;
+}
@@ -19,10 +19,38 @@ extern "C" {
 // If this function is successful, bpp will be either 24 or 32.
 BYTE **png_image_read(const char *fn, uint32_t *width, uint32_t *height, uint8_t *bpp, bool gray_to_rgb = true);
 
-// Reads the IHDR chunk in the PNG file [fn], and extract some informations.
+// Reads the IHDR chunk in the PNG file [fn], or the header of the raw image
+// replacing it, and extract some informations.
 // If this function is successful, bpp will be either 24 or 32.
 bool png_image_get_IHDR(const char *fn, uint32_t *width, uint32_t *height, uint8_t *bpp);
 
+// A PNG file from the patch stack, loaded once, whose header has been read
+// and whose image data can be decoded later.
+typedef struct {
+	// Name it was resolved for.
+	char *fn;
+	BYTE *file_buffer;
+	size_t file_size;
+	uint32_t width;
+	uint32_t height;
+	// Either 24 or 32.
+	uint8_t bpp;
+} png_image_file_t;
+
+// Resolves and loads the PNG file [fn] into [img], and reads its header.
+// A raw image that replaces the PNG (see raw_image.h) is loaded instead if
+// the patch has one. Any file previously held by [img] is released first.
+bool png_image_file_open(png_image_file_t *img, const char *fn);
+
+// Decodes [img] to [out] as BGR or BGRA, with [stride] bytes between the
+// start of each row, or bottom-up with a negative [stride] as in
+// png_decode_rows(). Pixels take [bpp] / 8 bytes, or always 4 if
+// [add_alpha] is true, in which case 24-bit images get an opaque alpha
+// channel.
+bool png_image_file_decode(png_image_file_t *img, BYTE *out, ptrdiff_t stride, bool add_alpha);
+
+void png_image_file_close(png_image_file_t *img);
+
 #ifdef __cplusplus
 }
 #endif
@@ -18,62 +18,183 @@
 #include "pl.h"
 #include <zlib.h>
 #include <vector>
-#include <list>
 #include <algorithm>
 
-static int inflate_bytes(BYTE* file_in, size_t size_in, BYTE* file_out, size_t size_out)
+/// Streaming state
+/// ---------------
+// Files are inflated, patched and deflated again a chunk at a time. The
+// z_streams and the buffers are kept around for the next file patched by
+// the same thread.
+#define TFCS_CHUNK (64 * 1024)
+
+struct tfcs_stream_t {
+	z_stream inflate_strm;
+	bool inflate_init;
+	bool inflate_done;
+	z_stream deflate_strm;
+	bool deflate_init;
+	int deflate_level;
+
+	// Copy of the compressed input, since we write the output over it.
+	std::vector<BYTE> comp_in;
+	// Inflated data, parsed from [window_pos] to [window_end].
+	std::vector<BYTE> window;
+	size_t window_pos;
+	size_t window_end;
+	// Uncompressed output, waiting to be deflated.
+	std::vector<BYTE> pending;
+	// Fields of the row being patched.
+	std::vector<std::string> line;
+};
+
+static void tfcs_stream_ctor(tfcs_stream_t *s, size_t)
 {
-	int ret;
-	z_stream strm;
-
-	strm.zalloc = NULL;
-	strm.zfree = NULL;
-	strm.opaque = NULL;
-	strm.next_in = file_in;
-	strm.avail_in = size_in;
-	strm.next_out = file_out;
-	strm.avail_out = size_out;
-	ret = inflateInit(&strm);
-	if (ret != Z_OK) {
-		return ret;
+	new (s) tfcs_stream_t{};
+}
+
+static void tfcs_stream_dtor(tfcs_stream_t *s)
+{
+	if (s->inflate_init) {
+		inflateEnd(&s->inflate_strm);
 	}
-	do {
-		ret = inflate(&strm, Z_NO_FLUSH);
-		if (ret != Z_OK) {
-			break;
+	if (s->deflate_init) {
+		deflateEnd(&s->deflate_strm);
+	}
+	s->~tfcs_stream_t();
+}
+
+THREAD_LOCAL(tfcs_stream_t, tfcs_tls, tfcs_stream_ctor, tfcs_stream_dtor);
+
+// Makes sure that at least [size] inflated bytes are available after [window_pos].
+static bool tfcs_stream_need(tfcs_stream_t *s, size_t size)
+{
+	while (s->window_end - s->window_pos < size) {
+		if (s->inflate_done) {
+			return false;
+		}
+		if (s->window_pos) {
+			memmove(s->window.data(), s->window.data() + s->window_pos, s->window_end - s->window_pos);
+			s->window_end -= s->window_pos;
+			s->window_pos = 0;
+		}
+		if (s->window.size() - s->window_end < std::max<size_t>(size, TFCS_CHUNK)) {
+			s->window.resize(s->window_end + std::max<size_t>(size, TFCS_CHUNK));
+		}
+		z_stream& strm = s->inflate_strm;
+		strm.next_out = s->window.data() + s->window_end;
+		strm.avail_out = s->window.size() - s->window_end;
+		int ret = inflate(&strm, Z_NO_FLUSH);
+		s->window_end = s->window.size() - strm.avail_out;
+		if (ret == Z_STREAM_END) {
+			s->inflate_done = true;
 		}
-	} while (ret != Z_STREAM_END);
-	inflateEnd(&strm);
-	return ret == Z_STREAM_END ? Z_OK : ret;
+		else if (ret != Z_OK) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool tfcs_stream_read_dword(tfcs_stream_t *s, DWORD& val)
+{
+	if (!tfcs_stream_need(s, sizeof(DWORD))) {
+		return false;
+	}
+	memcpy(&val, s->window.data() + s->window_pos, sizeof(DWORD));
+	s->window_pos += sizeof(DWORD);
+	return true;
 }
 
-static int deflate_bytes(BYTE* file_in, size_t size_in, BYTE* file_out, size_t* size_out)
+static void tfcs_stream_write(tfcs_stream_t *s, const void *data, size_t size)
 {
+	s->pending.insert(s->pending.end(), (const BYTE*)data, (const BYTE*)data + size);
+}
+
+static int tfcs_stream_deflate(tfcs_stream_t *s, int flush)
+{
+	if (s->pending.empty() && flush == Z_NO_FLUSH) {
+		return Z_OK;
+	}
+	z_stream& strm = s->deflate_strm;
+	strm.next_in = s->pending.data();
+	strm.avail_in = s->pending.size();
 	int ret;
-	z_stream strm;
-
-	strm.zalloc = NULL;
-	strm.zfree = NULL;
-	strm.opaque = NULL;
-	strm.next_in = file_in;
-	strm.avail_in = size_in;
-	strm.next_out = file_out;
-	strm.avail_out = *size_out;
-	ret = deflateInit(&strm, Z_BEST_COMPRESSION);
+	do {
+		ret = deflate(&strm, flush);
+	} while (ret == Z_OK && strm.avail_out > 0 && (strm.avail_in > 0 || flush == Z_FINISH));
+	s->pending.clear();
+	if (flush == Z_FINISH) {
+		return ret == Z_STREAM_END ? Z_OK : (ret == Z_OK ? Z_BUF_ERROR : ret);
+	}
+	if (ret == Z_OK && strm.avail_in > 0) {
+		// Out of output space
+		return Z_BUF_ERROR;
+	}
+	return ret;
+}
+
+static int tfcs_stream_level(tfcs_stream_t *s, int level)
+{
+	if (s->deflate_level == level) {
+		return Z_OK;
+	}
+	int ret = tfcs_stream_deflate(s, Z_NO_FLUSH);
 	if (ret != Z_OK) {
 		return ret;
 	}
-	do {
-		ret = deflate(&strm, Z_FINISH);
+	ret = deflateParams(&s->deflate_strm, level, Z_DEFAULT_STRATEGY);
+	if (ret == Z_OK) {
+		s->deflate_level = level;
+	}
+	return ret;
+}
+
+// Starts patching [comp_in] into [out].
+static int tfcs_stream_begin(tfcs_stream_t *s, BYTE *out, size_t out_size, int level)
+{
+	int ret;
+
+	if (!s->inflate_init) {
+		s->inflate_strm = {};
+		ret = inflateInit(&s->inflate_strm);
 		if (ret != Z_OK) {
-			break;
+			return ret;
 		}
-	} while (ret != Z_STREAM_END);
-	deflateEnd(&strm);
-	*size_out -= strm.avail_out;
-	return ret == Z_STREAM_END ? Z_OK : ret;
+		s->inflate_init = true;
+	}
+	else {
+		inflateReset(&s->inflate_strm);
+	}
+	s->inflate_strm.next_in = s->comp_in.data();
+	s->inflate_strm.avail_in = s->comp_in.size();
+	s->inflate_done = false;
+
+	if (!s->deflate_init) {
+		s->deflate_strm = {};
+		ret = deflateInit(&s->deflate_strm, level);
+		if (ret != Z_OK) {
+			return ret;
+		}
+		s->deflate_init = true;
+		s->deflate_level = level;
+	}
+	else {
+		deflateReset(&s->deflate_strm);
+	}
+	s->deflate_strm.next_out = out;
+	s->deflate_strm.avail_out = out_size;
+
+	if (s->window.size() < TFCS_CHUNK) {
+		s->window.resize(TFCS_CHUNK);
+	}
+	s->window_pos = 0;
+	s->window_end = 0;
+	s->pending.clear();
+	return tfcs_stream_level(s, level);
 }
 
+/// ---------------
+
 std::string patch_ruby(std::string str)
 {
 	const std::string ruby_begin = "{{ruby|";
@@ -103,19 +224,21 @@ static void patch_win_message(std::vector<std::string>& line, json_t *patch_row,
 {
 	json_t *patch_lines = json_object_get(patch_row, "lines");
 	if (patch_lines && line.size() >= line_start + 12 && line[line_start + 3].empty() == false) {
-		std::list<TasofroPl::ALine*> texts;
+		TasofroPl::File texts;
 		// We want to overwrite all the balloons with the user-provided ones,
 		// so we only need to put the 1st one, we can ignore the others.
-		TasofroPl::AText *text = new TasofroPl::WinText(std::vector<std::string>({
-			line[line_start + 3],
-			line[line_start + 2]
-			}));
-		texts.push_back(text);
-		auto begin = texts.begin();
+		// [func] writes back into [line], so the texts can't point into it.
+		const std::string_view fields[] = {
+			texts.arena.copy(line[line_start + 3]),
+			texts.arena.copy(line[line_start + 2])
+		};
+		TasofroPl::AText *text = texts.arena.create<TasofroPl::WinText>(texts.arena, fields, std::size(fields));
+		texts.lines.push_back(text);
+		size_t begin = 0;
 		text->patch(texts, begin, "", patch_lines);
 
 		size_t i = 0;
-		for (TasofroPl::ALine* it : texts) {
+		for (TasofroPl::ALine* it : texts.lines) {
 			if (func(line, it, i) == false) {
 				break;
 			}
@@ -124,17 +247,22 @@ static void patch_win_message(std::vector<std::string>& line, json_t *patch_row,
 	}
 }
 
-void patch_line(BYTE *&in, BYTE *&out, DWORD nb_col, json_t *patch_row)
+static bool read_line(tfcs_stream_t *s, std::vector<std::string>& line, DWORD nb_col)
 {
-	// Read input
-	std::vector<std::string> line;
+	line.resize(nb_col);
 	for (DWORD col = 0; col < nb_col; col++) {
-		DWORD field_size = *(DWORD*)in;
-		in += sizeof(DWORD);
-		line.push_back(std::string((const char*)in, field_size));
-		in += field_size;
+		DWORD field_size;
+		if (!tfcs_stream_read_dword(s, field_size) || !tfcs_stream_need(s, field_size)) {
+			return false;
+		}
+		line[col].assign((const char*)s->window.data() + s->window_pos, field_size);
+		s->window_pos += field_size;
 	}
+	return true;
+}
 
+void patch_line(std::vector<std::string>& line, json_t *patch_row)
+{
 	// Patch as data/win/message/*.csv
 	if (game_id <= TH145) {
 		patch_win_message(line, patch_row, 1,
@@ -163,7 +291,7 @@ void patch_line(BYTE *&in, BYTE *&out, DWORD nb_col, json_t *patch_row)
 
 	// Patch each column independently
 	json_t *patch_col;
-	for (DWORD col = 0; col < nb_col; col++) {
+	for (DWORD col = 0; col < line.size(); col++) {
 		patch_col = json_object_numkey_get(patch_row, col);
 		if (patch_col) {
 			if (json_is_string(patch_col)) {
@@ -186,87 +314,136 @@ void patch_line(BYTE *&in, BYTE *&out, DWORD nb_col, json_t *patch_row)
 			}
 		}
 	}
+}
 
-	// Write output
+static void write_line(tfcs_stream_t *s, const std::vector<std::string>& line)
+{
 	for (const std::string& col : line) {
 		DWORD field_size = col.length();
-		*(DWORD*)out = field_size;
-		out += sizeof(DWORD);
-		memcpy(out, col.c_str(), field_size);
-		out += field_size;
+		tfcs_stream_write(s, &field_size, sizeof(field_size));
+		tfcs_stream_write(s, col.data(), field_size);
 	}
 }
 
-void skip_line(BYTE *&in, BYTE *&out, DWORD nb_col)
+static bool skip_line(tfcs_stream_t *s, DWORD nb_col)
 {
 	for (DWORD col = 0; col < nb_col; col++) {
-		DWORD field_size = *(DWORD*)in; in += sizeof(DWORD);
-		*(DWORD*)out = field_size;      out += sizeof(DWORD);
-
-		memcpy(out, in, field_size);
-		in  += field_size;
-		out += field_size;
+		DWORD field_size;
+		if (!tfcs_stream_need(s, sizeof(DWORD))) {
+			return false;
+		}
+		memcpy(&field_size, s->window.data() + s->window_pos, sizeof(DWORD));
+		if (!tfcs_stream_need(s, sizeof(DWORD) + field_size)) {
+			return false;
+		}
+		tfcs_stream_write(s, s->window.data() + s->window_pos, sizeof(DWORD) + field_size);
+		s->window_pos += sizeof(DWORD) + field_size;
 	}
+	return true;
 }
 
-int patch_tfcs(void *file_inout, size_t size_out, size_t size_in, const char *fn, json_t *patch)
+static int patch_tfcs_stream(tfcs_stream_t *s, tfcs_header_t *header, size_t size_out, json_t *patch, bool fast)
 {
-	if (!patch) {
-		return 0;
-	}
+	// With [fast], unchanged rows are only stored, and patched rows get the
+	// fastest compression level.
+	const int level_unchanged = fast ? Z_NO_COMPRESSION : Z_BEST_COMPRESSION;
+	const int level_patched = fast ? Z_BEST_SPEED : Z_BEST_COMPRESSION;
 
-	tfcs_header_t *header;
-
-	// Read TFCS header
-	header = (tfcs_header_t*)file_inout;
-	if (size_in < sizeof(*header) || memcmp(header->magic, "TFCS\0", 5) != 0) {
-		// Invalid TFCS file (probably a regular CSV file)
-		return patch_csv(file_inout, size_out, size_in, fn, patch);
+	int ret = tfcs_stream_begin(s, header->data, size_out - (sizeof(*header) - 1), level_unchanged);
+	if (ret != Z_OK) {
+		return ret;
 	}
 
-	BYTE *file_in_uncomp = (BYTE*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, header->uncomp_size);
-	inflate_bytes(header->data, header->comp_size, file_in_uncomp, header->uncomp_size);
-
-	// We don't have patch_size here, but it is equal to size_out - size_in.
-	DWORD file_out_uncomp_size = header->uncomp_size + (size_out - size_in);
-	BYTE *file_out_uncomp = (BYTE*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, file_out_uncomp_size);
-
-	BYTE *ptr_in  = file_in_uncomp;
-	BYTE *ptr_out = file_out_uncomp;
-
 	DWORD nb_row;
 	DWORD nb_col;
 	DWORD row;
 
-	nb_row = *(DWORD*)ptr_in;  ptr_in  += sizeof(DWORD);
-	*(DWORD*)ptr_out = nb_row; ptr_out += sizeof(DWORD);
+	if (!tfcs_stream_read_dword(s, nb_row)) {
+		return Z_DATA_ERROR;
+	}
+	tfcs_stream_write(s, &nb_row, sizeof(nb_row));
 
 	for (row = 0; row < nb_row; row++) {
-		nb_col = *(DWORD*)ptr_in;  ptr_in  += sizeof(DWORD);
-		*(DWORD*)ptr_out = nb_col; ptr_out += sizeof(DWORD);
+		if (!tfcs_stream_read_dword(s, nb_col)) {
+			return Z_DATA_ERROR;
+		}
 		json_t *patch_row = json_object_numkey_get(patch, row);
 
+		ret = tfcs_stream_level(s, patch_row ? level_patched : level_unchanged);
+		if (ret != Z_OK) {
+			return ret;
+		}
+		tfcs_stream_write(s, &nb_col, sizeof(nb_col));
 		if (patch_row) {
-			patch_line(ptr_in, ptr_out, nb_col, patch_row);
+			if (!read_line(s, s->line, nb_col)) {
+				return Z_DATA_ERROR;
+			}
+			patch_line(s->line, patch_row);
+			write_line(s, s->line);
 		}
-		else {
-			skip_line(ptr_in, ptr_out, nb_col);
+		else if (!skip_line(s, nb_col)) {
+			return Z_DATA_ERROR;
+		}
+
+		if (s->pending.size() >= TFCS_CHUNK) {
+			ret = tfcs_stream_deflate(s, Z_NO_FLUSH);
+			if (ret != Z_OK) {
+				return ret;
+			}
 		}
 	}
 
-	// Write result
-	file_out_uncomp_size = ptr_out - file_out_uncomp;
-	header->uncomp_size = file_out_uncomp_size;
-	size_out -= sizeof(*header) - 1;
-	int ret = deflate_bytes(file_out_uncomp, file_out_uncomp_size, header->data, &size_out);
-	header->comp_size = size_out;
+	ret = tfcs_stream_deflate(s, Z_FINISH);
 	if (ret != Z_OK) {
-		log_printf("WARNING: tasofro CSV patching: compression failed with zlib error %d\n", ret);
+		return ret;
 	}
+	header->uncomp_size = s->deflate_strm.total_in;
+	header->comp_size = s->deflate_strm.total_out;
+	return Z_OK;
+}
 
-	HeapFree(GetProcessHeap(), 0, file_in_uncomp);
-	HeapFree(GetProcessHeap(), 0, file_out_uncomp);
+int patch_tfcs(void *file_inout, size_t size_out, size_t size_in, const char *fn, json_t *patch)
+{
+	if (!patch) {
+		return 0;
+	}
 
+	tfcs_header_t *header;
+
+	// Read TFCS header
+	header = (tfcs_header_t*)file_inout;
+	if (size_in < sizeof(*header) || memcmp(header->magic, "TFCS\0", 5) != 0) {
+		// Invalid TFCS file (probably a regular CSV file)
+		return patch_csv(file_inout, size_out, size_in, fn, patch);
+	}
+
+	tfcs_stream_t *s = tfcs_tls_get();
+	if (!s) {
+		return 0;
+	}
+	const tfcs_header_t header_orig = *header;
+	const size_t comp_size = std::min<size_t>(header->comp_size, size_in - (sizeof(*header) - 1));
+	s->comp_in.assign(header->data, header->data + comp_size);
+
+	bool fast = json_boolean_value(json_object_get(runconfig_json_get(), "tfcs_fast_deflate"));
+	int ret = patch_tfcs_stream(s, header, size_out, patch, fast);
+	if (ret == Z_BUF_ERROR && fast) {
+		// Stored rows don't fit in what get_tfcs_size() reserved, which
+		// only accounts for the patch size.
+		ret = patch_tfcs_stream(s, header, size_out, patch, false);
+	}
+	if (ret != Z_OK) {
+		if (ret == Z_DATA_ERROR) {
+			log_printf("WARNING: tasofro CSV patching: %s is corrupted\n", fn);
+		}
+		else {
+			log_printf("WARNING: tasofro CSV patching: compression failed with zlib error %d\n", ret);
+		}
+		// Put the original file back
+		*header = header_orig;
+		memcpy(header->data, s->comp_in.data(), s->comp_in.size());
+		return 0;
+	}
 	return 1;
 }
 
@@ -27,6 +27,10 @@ extern "C" {
 
 int patch_tfcs(void *file_inout, size_t size_out, size_t size_in, const char*, json_t *patch);
 int patch_csv(void *file_inout, size_t size_out, size_t size_in, const char*, json_t *patch);
+// Two-phase version of patch_csv(), see patchhook_register_compiled().
+void* csv_plan_compile(const char*, json_t *patch);
+int csv_plan_apply(const void *plan, void *file_inout, size_t size_out, size_t size_in, const char*);
+void csv_plan_free(void *plan);
 size_t get_tfcs_size(const char*, json_t*, size_t patch_size);
 size_t get_csv_size(const char*, json_t*, size_t patch_size);
 
@@ -30,13 +30,13 @@ int th135_init()
 		ICrypt::instance = new CryptTh135();
 	}
 	
-	patchhook_register("*/stage*.pl", patch_pl, nullptr);
-	patchhook_register("*/ed*.pl", patch_pl, nullptr);
-	patchhook_register("*.csv", patch_tfcs, get_tfcs_size);
+	patchhook_register_cacheable("*/stage*.pl", patch_pl, nullptr);
+	patchhook_register_cacheable("*/ed*.pl", patch_pl, nullptr);
+	patchhook_register_cacheable("*.csv", patch_tfcs, get_tfcs_size);
 	patchhook_register("*.dll", patch_dll, [](const char*, json_t*, size_t) -> size_t { return 0; });
-	patchhook_register("*.act", patch_act, nullptr);
-	patchhook_register("*.nut", patch_nut, nullptr);
-	patchhook_register("*.txt", patch_plaintext, nullptr);
+	patchhook_register_cacheable("*.act", patch_act, nullptr);
+	patchhook_register_cacheable("*.nut", patch_nut, nullptr);
+	patchhook_register_stream("*.txt", patch_plaintext, nullptr, patch_plaintext_stream);
 	patchhook_register("*.nhtex", patch_nhtex, get_nhtex_size);
 
 	if (game_id >= TH155) {
@@ -67,10 +67,6 @@ int th135_init()
 		jsonvfs_add_map(staffroll_fn, "themes.js");
 		SAFE_FREE(staffroll_fn);
 	}
-
-	json_t *fileslist = stack_game_json_resolve("fileslist.js", nullptr);
-	LoadFileNameListFromJson(fileslist);
-	json_decref(fileslist);
 	return 0;
 }
 
@@ -168,6 +164,14 @@ static void post_patch(const file_rep_t *fr, BYTE *buffer, size_t size)
 	}
 }
 
+static void crypt_chunk(const file_rep_t *fr, size_t offset, BYTE *buffer, size_t size)
+{
+	const FileHeader *header = (const FileHeader*)fr->object;
+	if (header) {
+		ICrypt::instance->cryptChunk(buffer, size, offset, header->key);
+	}
+}
+
 /**
   * Replace file, 3rd attempt - hopefully I won't have to write a 4th one.
   * This breakpoint takes care of patching the files.
@@ -213,11 +217,10 @@ extern "C" int BP_th135_read_file(x86_reg_t *regs, json_t *bp_info)
 		return 1;
 	}
 
-	json_t *new_bp_info = json_copy(bp_info);
-	json_object_set_new(new_bp_info, "file_name",  json_integer((json_int_t)header->fr->name));
-	json_object_set_new(new_bp_info, "post_read",  json_integer((json_int_t)post_read));
-	json_object_set_new(new_bp_info, "post_patch", json_integer((json_int_t)post_patch));
-	int ret = BP_fragmented_read_file(regs, new_bp_info);
-	json_decref(new_bp_info);
-	return ret;
+	fragmented_read_file_t ctx = { header->fr, post_read, post_patch };
+	if (ICrypt::instance->canCryptChunks()) {
+		ctx.post_read_chunk = crypt_chunk;
+		ctx.post_patch_chunk = crypt_chunk;
+	}
+	return fragmented_read_file(regs, &ctx);
 }
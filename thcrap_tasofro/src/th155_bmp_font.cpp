@@ -8,13 +8,16 @@
   */
 
 #include <thcrap.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
 #include "./png.h"
 #include "thcrap_tasofro.h"
 #include "th155_bmp_font.h"
 #include <libs/135tk/bmpfont/bmpfont_create.h>
 
 // Increment this number to force a bmpfont cache refresh
-static const int cache_version = 2;
+static const int cache_version = 3;
 
 size_t get_bmp_font_size(const char *fn, json_t *patch, size_t)
 {
@@ -40,9 +43,7 @@ size_t get_bmp_font_size(const char *fn, json_t *patch, size_t)
 	strcat(fn_bin, ".bin");
 
 	size_t bin_size;
-	void *bin_data = stack_game_file_resolve(fn_bin, &bin_size);
-	if (bin_data) {
-		free(bin_data);
+	if (stack_game_file_size(fn_bin, &bin_size)) {
 		size += bin_size;
 	}
 
@@ -85,7 +86,213 @@ void add_json_file(char *chars_list, int& chars_list_count, json_t *file)
 	json_decref(file);
 }
 
-static void add_files_in_directory(char *chars_list, int& chars_list_count, std::string basedir, bool recurse)
+/**
+  * Scanning every patch file for characters is the slow part of font
+  * patching. The files are parsed in parallel, and the characters used by
+  * each of them are cached in the "bmpfontchars" namespace of the disk
+  * cache, keyed by the file's path, size and last write time, so that a
+  * rescan only parses the files that changed.
+  */
+#define CHARS_CACHE_DISK_NS "bmpfontchars"
+#define CHARS_CACHE_DISK_KEY "files"
+#define CHARS_CACHE_MAGIC "BFCS"
+#define CHARS_CACHE_VERSION 1
+#define CHARS_SCAN_THREADS_MAX 8
+
+struct chars_file_t {
+	std::string fn;
+	uint64_t mtime;
+	uint64_t size;
+	// Sorted UTF-16 code units used in the file.
+	std::vector<uint16_t> chars;
+	bool cached;
+};
+
+struct chars_scan_t {
+	std::vector<chars_file_t> *files;
+	volatile LONG next;
+};
+
+// Fills [cache] with the entries of the cache file.
+static void chars_cache_load(std::unordered_map<std::string, chars_file_t>& cache)
+{
+	size_t size;
+	BYTE *buffer = (BYTE*)disk_cache_get(CHARS_CACHE_DISK_NS, CHARS_CACHE_DISK_KEY, &size);
+	if (!buffer) {
+		return;
+	}
+	const BYTE *p = buffer;
+	const BYTE *end = buffer + size;
+	auto read = [&p, end](void *out, size_t len) {
+		if ((size_t)(end - p) < len) {
+			return false;
+		}
+		memcpy(out, p, len);
+		p += len;
+		return true;
+	};
+
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+	if (
+		read(magic, sizeof(magic)) && !memcmp(magic, CHARS_CACHE_MAGIC, sizeof(magic))
+		&& read(&version, sizeof(version)) && version == CHARS_CACHE_VERSION
+		&& read(&count, sizeof(count))
+	) {
+		for (uint32_t i = 0; i < count; i++) {
+			chars_file_t entry;
+			uint32_t fn_len;
+			uint32_t chars_count;
+			if (!read(&fn_len, sizeof(fn_len)) || (size_t)(end - p) < fn_len) {
+				break;
+			}
+			entry.fn.assign((const char*)p, fn_len);
+			p += fn_len;
+			if (
+				!read(&entry.mtime, sizeof(entry.mtime))
+				|| !read(&entry.size, sizeof(entry.size))
+				|| !read(&chars_count, sizeof(chars_count))
+				|| (size_t)(end - p) / sizeof(uint16_t) < chars_count
+			) {
+				break;
+			}
+			entry.chars.resize(chars_count);
+			read(entry.chars.data(), chars_count * sizeof(uint16_t));
+			std::string key = entry.fn;
+			cache[std::move(key)] = std::move(entry);
+		}
+	}
+	free(buffer);
+}
+
+static void chars_cache_save(const std::unordered_map<std::string, chars_file_t>& cache)
+{
+	std::vector<BYTE> buffer;
+	auto write = [&buffer](const void *data, size_t len) {
+		buffer.insert(buffer.end(), (const BYTE*)data, (const BYTE*)data + len);
+	};
+	const uint32_t version = CHARS_CACHE_VERSION;
+	const uint32_t count = cache.size();
+	write(CHARS_CACHE_MAGIC, 4);
+	write(&version, sizeof(version));
+	write(&count, sizeof(count));
+	for (const auto& it : cache) {
+		const chars_file_t& entry = it.second;
+		const uint32_t fn_len = entry.fn.length();
+		const uint32_t chars_count = entry.chars.size();
+		write(&fn_len, sizeof(fn_len));
+		write(entry.fn.data(), fn_len);
+		write(&entry.mtime, sizeof(entry.mtime));
+		write(&entry.size, sizeof(entry.size));
+		write(&chars_count, sizeof(chars_count));
+		write(entry.chars.data(), chars_count * sizeof(uint16_t));
+	}
+	disk_cache_put(CHARS_CACHE_DISK_NS, CHARS_CACHE_DISK_KEY, buffer.data(), buffer.size(), 0);
+}
+
+static void chars_collect(char *seen, json_t *json)
+{
+	if (json_is_object(json)) {
+		const char *key;
+		json_t *it;
+		json_object_foreach(json, key, it) {
+			chars_collect(seen, it);
+		}
+	}
+	else if (json_is_array(json)) {
+		size_t i;
+		json_t *it;
+		json_array_foreach(json, i, it) {
+			chars_collect(seen, it);
+		}
+	}
+	else if (json_is_string(json)) {
+		const char *str = json_string_value(json);
+		WCHAR_T_DEC(str);
+		WCHAR_T_CONV(str);
+		for (int i = 0; str_w[i]; i++) {
+			seen[str_w[i]] = 1;
+		}
+		WCHAR_T_FREE(str);
+	}
+}
+
+static DWORD WINAPI chars_scan_proc(void *param)
+{
+	auto *scan = (chars_scan_t*)param;
+	std::vector<char> seen(65536);
+	LONG i;
+	while ((size_t)(i = InterlockedIncrement(&scan->next) - 1) < scan->files->size()) {
+		chars_file_t& file = (*scan->files)[i];
+		if (file.cached) {
+			continue;
+		}
+		std::fill(seen.begin(), seen.end(), 0);
+		json_t *json = json_load_file(file.fn.c_str(), 0, nullptr);
+		chars_collect(seen.data(), json);
+		json_decref(json);
+		for (size_t c = 0; c < seen.size(); c++) {
+			if (seen[c]) {
+				file.chars.push_back((uint16_t)c);
+			}
+		}
+	}
+	return 0;
+}
+
+// Adds the characters used in [files] to [chars_list].
+static void chars_files_scan(char *chars_list, int& chars_list_count, std::vector<chars_file_t>& files)
+{
+	std::unordered_map<std::string, chars_file_t> cache;
+	chars_cache_load(cache);
+
+	size_t pending = 0;
+	for (auto& file : files) {
+		auto cached = cache.find(file.fn);
+		if (cached != cache.end() && cached->second.mtime == file.mtime && cached->second.size == file.size) {
+			file.chars = cached->second.chars;
+			file.cached = true;
+		}
+		else {
+			pending++;
+		}
+	}
+
+	if (pending) {
+		size_t thread_count = MIN(MIN(task_worker_count() + 1, (size_t)CHARS_SCAN_THREADS_MAX), pending);
+		chars_scan_t scan = { &files, 0 };
+		task_group_t *group = task_group_create();
+		for (size_t i = 1; i < thread_count; i++) {
+			task_submit(TASK_PRIORITY_CRITICAL, group, [](void *param) {
+				chars_scan_proc(param);
+			}, &scan);
+		}
+		// The calling thread works too, which also covers the case where
+		// there are no workers.
+		chars_scan_proc(&scan);
+		task_group_free(group);
+	}
+
+	for (auto& file : files) {
+		log_printf(" + %s%s\n", file.fn.c_str(), file.cached ? " (cached)" : "");
+		for (uint16_t c : file.chars) {
+			if (!chars_list[c]) {
+				chars_list[c] = 1;
+				chars_list_count++;
+			}
+		}
+		if (!file.cached) {
+			std::string key = file.fn;
+			cache[std::move(key)] = std::move(file);
+		}
+	}
+	if (pending) {
+		chars_cache_save(cache);
+	}
+}
+
+static void add_files_in_directory(std::vector<chars_file_t>& files, std::string basedir, bool recurse)
 {
 	std::string pattern = basedir + "\\*";
 	WIN32_FIND_DATAA ffd;
@@ -102,14 +309,16 @@ static void add_files_in_directory(char *chars_list, int& chars_list_count, std:
 		else if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
 			if (recurse) {
 				std::string dirname = basedir + "\\" + ffd.cFileName;
-				add_files_in_directory(chars_list, chars_list_count, dirname, recurse);
+				add_files_in_directory(files, dirname, recurse);
 			}
 		}
 		else if (strcmp(PathFindExtensionA(ffd.cFileName), ".js") == 0 ||
 				 strcmp(PathFindExtensionA(ffd.cFileName), ".jdiff") == 0) {
-			std::string filename = basedir + "\\" + ffd.cFileName;
-			log_printf(" + %s\n", filename.c_str());
-			add_json_file(chars_list, chars_list_count, json_load_file(filename.c_str(), 0, nullptr));
+			chars_file_t file = {};
+			file.fn = basedir + "\\" + ffd.cFileName;
+			file.mtime = ((uint64_t)ffd.ftLastWriteTime.dwHighDateTime << 32) | ffd.ftLastWriteTime.dwLowDateTime;
+			file.size = ((uint64_t)ffd.nFileSizeHigh << 32) | ffd.nFileSizeLow;
+			files.push_back(std::move(file));
 		}
 	} while (FindNextFile(hFind, &ffd));
 
@@ -180,15 +389,17 @@ int fill_chars_list_from_files(char *chars_list, json_t *files)
 		}
 		else if (strcmp(fn, "*") == 0) {
 			log_print("(Font) Searching in every js file for characters...\n");
+			std::vector<chars_file_t> files;
 			stack_foreach_cpp([&](const patch_t *patch) {
 				if (patch->archive) {
-					add_files_in_directory(chars_list, chars_list_count, patch->archive, false);
+					add_files_in_directory(files, patch->archive, false);
 					const char *game = runconfig_game_get();
 					if (game) {
-						add_files_in_directory(chars_list, chars_list_count, std::string(patch->archive) + "\\" + game, true);
+						add_files_in_directory(files, std::string(patch->archive) + "\\" + game, true);
 					}
 				}
 			});
+			chars_files_scan(chars_list, chars_list_count, files);
 		}
 		else {
 			add_json_file(chars_list, chars_list_count, stack_json_resolve(fn, nullptr));
@@ -206,71 +417,103 @@ int fill_chars_list(char *chars_list, void *file_inout, size_t size_in, json_t *
 	return chars_list_count;
 }
 
-void bmpfont_update_cache(std::string fn, char *chars_list, int chars_count, BYTE *buffer, size_t buffer_size, json_t *patch)
+/**
+  * Generated fonts are stored in the "bmpfont" namespace of the disk cache,
+  * keyed by game and file name, as this header followed by the font. The
+  * header holds everything the font is generated from, so that validating
+  * the cache is a memcmp() and a bitset comparison. Patches can also ship a
+  * pregenerated <file name>.cache in the same format, which is used if the
+  * disk cache doesn't have a valid entry.
+  */
+#define BMPFONT_CACHE_MAGIC "BMFC"
+
+struct bmpfont_cache_header_t {
+	char magic[4];
+	uint32_t version;
+	// 64-bit FNV-1a of the patch JSON, dumped with sorted keys.
+	uint64_t patch_hash;
+	uint32_t chars_count;
+	uint32_t reserved;
+	// 1 bit per UTF-16 code unit
+	uint8_t chars[65536 / 8];
+};
+
+static void bmpfont_cache_header_build(bmpfont_cache_header_t *header, const char *chars_list, int chars_count, json_t *patch)
 {
-	json_t *cache_patch = json_object();
-	json_object_set_new(cache_patch, "cache_version", json_integer(cache_version));
-	json_object_set(cache_patch, "patch", patch);
-	json_object_set_new(cache_patch, "chars_count", json_integer(chars_count));
-	json_t *chars_list_json = json_array();
-	for (WCHAR i = 0; i < 65535; i++) {
-		json_array_append_new(chars_list_json, json_boolean(chars_list[i]));
-	}
-	json_object_set(cache_patch, "chars_list", chars_list_json);
-	chars_list_json = json_decref_safe(chars_list_json);
-
-	std::string full_path;
-	{
-		std::string fn_jdiff = fn + ".jdiff";
-		char **chain = resolve_chain_game(fn_jdiff.c_str());
-		char *c_full_path = stack_fn_resolve_chain(chain);
-		chain_free(chain);
-		full_path.assign(c_full_path, strlen(c_full_path) - strlen(".jdiff")); // Remove ".jdiff"
-		free(c_full_path);
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, BMPFONT_CACHE_MAGIC, sizeof(header->magic));
+	header->version = cache_version;
+	header->chars_count = chars_count;
+	for (size_t i = 0; i < 65536; i++) {
+		if (chars_list[i]) {
+			header->chars[i / 8] |= 1 << (i % 8);
+		}
 	}
 
-	full_path += ".cache";
-	file_write(full_path.c_str(), buffer, buffer_size);
+	uint64_t hash = 0xcbf29ce484222325ull;
+	char *patch_str = json_dumps(patch, JSON_COMPACT | JSON_SORT_KEYS);
+	for (const char *p = patch_str; p && *p; p++) {
+		hash = (hash ^ (BYTE)*p) * 0x100000001b3ull;
+	}
+	free(patch_str);
+	header->patch_hash = hash;
+}
 
-	full_path += ".jdiff";
-	FILE *fp = fopen_u(full_path.c_str(), "w");
-	json_dumpf(cache_patch, fp, JSON_INDENT(2));
-	fclose(fp);
+static std::string bmpfont_cache_key(const std::string& fn)
+{
+	const char *game = runconfig_game_get();
+	return std::string(game ? game : "") + "/" + fn;
+}
 
-	json_decref(cache_patch);
+void bmpfont_update_cache(std::string fn, char *chars_list, int chars_count, BYTE *buffer, size_t buffer_size, json_t *patch)
+{
+	std::vector<BYTE> cache(sizeof(bmpfont_cache_header_t) + buffer_size);
+	bmpfont_cache_header_build((bmpfont_cache_header_t*)cache.data(), chars_list, chars_count, patch);
+	memcpy(cache.data() + sizeof(bmpfont_cache_header_t), buffer, buffer_size);
+	disk_cache_put("bmpfont", bmpfont_cache_key(fn).c_str(), cache.data(), cache.size(), 0);
 }
 
-BYTE *read_bmpfont_from_cache(std::string fn, char *chars_list, int chars_count, json_t *patch, size_t *file_size)
+// Returns the font in [cache] if it was generated from [header], moved to
+// the start of the buffer, or frees [cache] and returns nullptr.
+static BYTE *bmpfont_cache_validate(BYTE *cache, size_t cache_size, const bmpfont_cache_header_t& header, size_t *file_size)
 {
-	std::string cache_patch_fn = fn + ".cache.jdiff";
-	json_t *cache_patch = stack_game_json_resolve(cache_patch_fn.c_str(), nullptr);
-	if (!cache_patch) {
+	if (!cache) {
 		return nullptr;
 	}
+	const size_t header_size = sizeof(bmpfont_cache_header_t);
+	bool valid = cache_size >= header_size && memcmp(cache, &header, offsetof(bmpfont_cache_header_t, chars_count)) == 0;
 
-	if (json_equal(patch, json_object_get(cache_patch, "patch")) == 0) {
-		json_decref(cache_patch);
-		return nullptr;
+	// A font with more characters than we need is just as good. This
+	// saves a regeneration whenever a translation update only removes
+	// characters.
+	const auto *cache_header = (const bmpfont_cache_header_t*)cache;
+	for (size_t i = 0; valid && i < sizeof(header.chars); i++) {
+		valid = (header.chars[i] & ~cache_header->chars[i]) == 0;
 	}
-
-	if (chars_count   != json_integer_value(json_object_get(cache_patch, "chars_count")) ||
-		cache_version != json_integer_value(json_object_get(cache_patch, "cache_version"))) {
-		json_decref(cache_patch);
+	if (!valid) {
+		free(cache);
 		return nullptr;
 	}
-	json_t *chars_list_cache = json_object_get(cache_patch, "chars_list");
-	for (WCHAR i = 0; i < 65535; i++) {
-		if (chars_list[i] != json_boolean_value(json_array_get(chars_list_cache, i))) {
-			json_decref(chars_list_cache);
-			json_decref(cache_patch);
-			return nullptr;
-		}
-	}
-	json_decref(chars_list_cache);
-	json_decref(cache_patch);
 
-	std::string cache_fn = fn + ".cache";
-	return (BYTE*)stack_game_file_resolve(cache_fn.c_str(), file_size);
+	*file_size = cache_size - header_size;
+	memmove(cache, cache + header_size, *file_size);
+	return cache;
+}
+
+BYTE *read_bmpfont_from_cache(std::string fn, char *chars_list, int chars_count, json_t *patch, size_t *file_size)
+{
+	bmpfont_cache_header_t header;
+	bmpfont_cache_header_build(&header, chars_list, chars_count, patch);
+
+	size_t cache_size = 0;
+	BYTE *cache = (BYTE*)disk_cache_get("bmpfont", bmpfont_cache_key(fn).c_str(), &cache_size);
+	BYTE *ret = bmpfont_cache_validate(cache, cache_size, header, file_size);
+	if (!ret) {
+		std::string cache_fn = fn + ".cache";
+		cache = (BYTE*)stack_game_file_resolve(cache_fn.c_str(), &cache_size);
+		ret = bmpfont_cache_validate(cache, cache_size, header, file_size);
+	}
+	return ret;
 }
 
 int bmpfont_add_option_int(void *bmpfont, const char *name, int value)
@@ -343,14 +586,14 @@ bool generate_bitmap_font(void *bmpfont, char *chars_list, json_t *patch, BYTE *
 	}
 
 	// Font
-	char **chain = resolve_chain(json_string_value(json_object_get(patch, "font_file")));
-	if (chain && chain[0]) {
+	chain_buf_t chain;
+	resolve_chain_build(chain, json_string_value(json_object_get(patch, "font_file")));
+	if (chain.get() && chain.get()[0]) {
 		size_t font_file_size;
-		log_printf("(Data) Resolving %s... ", chain[0]);
-		font_file = file_stream_read(stack_file_resolve_chain(chain), &font_file_size);
+		log_debugf("(Data) Resolving %s... ", chain.get()[0]);
+		font_file = stack_file_load_chain(chain.get(), &font_file_size);
 		ret &= bmpfont_add_option_binary(bmpfont, "--font-memory", font_file, font_file_size);
 	}
-	chain_free(chain);
 	if ((json_value = json_object_get(patch, "font_name"))) {
 		ret &= bmpfont_add_option(bmpfont, "--font-name", json_string_value(json_value));
 	}
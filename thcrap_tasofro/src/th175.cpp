@@ -22,11 +22,6 @@ struct file_desc_t
 int th175_init()
 {
 	ICrypt::instance = new CryptTh175();
-
-	json_t *fileslist = stack_game_json_resolve("fileslist.js", nullptr);
-	LoadFileNameListFromJson(fileslist);
-	json_decref(fileslist);
-
 	return 0;
 }
 
@@ -70,7 +65,7 @@ extern "C" int BP_th175_read_file(x86_reg_t *regs, json_t *bp_info)
 
 	memset(buffer, 0, size);
 	if (offset < fh->fr->pre_json_size) {
-		memcpy(buffer, (char*)fh->fr->rep_buffer + offset, MAX(size, fh->fr->pre_json_size - offset));
+		memcpy(buffer, (char*)fh->fr->rep_buffer + offset, MIN(size, fh->fr->pre_json_size - offset));
 	}
 
 	return 1;
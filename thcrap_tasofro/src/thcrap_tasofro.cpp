@@ -58,6 +58,12 @@ extern "C" __declspec(dllexport) const char* steam_appid(void)
 	}
 }
 
+extern "C" __declspec(dllexport) const mod_init_decl_t thcrap_plugin_init_decls[] = {
+	{ "fileslist", nullptr, true },
+	{ "nsml", nullptr, true },
+	{},
+};
+
 int __stdcall thcrap_plugin_init()
 {
 	int base_tasofro_removed = stack_remove_if_unneeded("base_tasofro");
@@ -63,6 +63,7 @@ int th135_init();
 int th175_init();
 
 int patch_plaintext(void *file_inout, size_t size_out, size_t size_in, const char*, json_t *patch);
+size_t patch_plaintext_stream(patch_stream_t *stream, const BYTE *in, size_t in_size, bool last);
 
 #ifdef __cplusplus
 }
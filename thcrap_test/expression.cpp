@@ -323,3 +323,66 @@ TEST(ExpressionTest, ExpressionTesting18B) {
 	}
 	EXPECT_EQ(expr_ret, 4);
 }
+
+TEST(ExpressionTest, CompiledExpression1) {
+	uint32_t stack_data[4] = { 1, 2, 3, 4 };
+	x86_reg_t regs = { 0 };
+	regs.ebp = (uint32_t)&stack_data[3];
+	regs.ecx = 5;
+	const char* expr_next = NULL;
+	expr_code_t* code = expr_compile("[ebp - 8] + ecx * 4", '\0', &expr_next);
+	ASSERT_NE(code, nullptr);
+	size_t expr_ret = 0;
+	const char* interpreted_next = eval_expr("[ebp - 8] + ecx * 4", '\0', &expr_ret, &regs, NULL);
+	EXPECT_EQ(expr_ret, 22);
+	EXPECT_EQ(expr_next, interpreted_next);
+	ExprRepeatTest{
+		expr_ret = expr_code_eval(code, &regs);
+	}
+	EXPECT_EQ(expr_ret, 22);
+	expr_code_free(code);
+}
+
+TEST(ExpressionTest, CompiledExpression2) {
+	x86_reg_t regs = { 0 };
+	regs.eax = 0x1234;
+	expr_code_t* code = expr_compile("(u8)eax) | byte ptr [&ah] << 8", '\0', NULL);
+	ASSERT_NE(code, nullptr);
+	EXPECT_EQ(expr_code_eval(code, &regs), 0x1234);
+	expr_code_free(code);
+}
+
+TEST(ExpressionTest, CompiledExpressionJit) {
+	uint32_t stack_data[4] = { 1, 2, 3, 0x1234 };
+	x86_reg_t regs = { 0 };
+	regs.ebp = (uint32_t)&stack_data[3];
+	regs.ecx = 5;
+	regs.eax = 0x1234;
+	const char* exprs[] = {
+		"[ebp - 8] + ecx * 4",
+		"(u8)eax) | byte ptr [&ah] << 8",
+		"-(ecx - 7) / 2 ^ ~ecx",
+		"!!eax + !ecx - word ptr [ebp] % 3",
+		"(ecx <=> 6) + (ecx >> 1 | eax) & 0xFF00",
+	};
+	expr_code_t* codes[elementsof(exprs)];
+	size_t expected[elementsof(exprs)];
+	for (size_t i = 0; i < elementsof(exprs); ++i) {
+		codes[i] = expr_compile(exprs[i], '\0', NULL);
+		ASSERT_NE(codes[i], nullptr);
+		expected[i] = expr_code_eval(codes[i], &regs);
+		EXPECT_TRUE(expr_code_jit(codes[i]));
+	}
+	cave_arena_seal();
+	for (size_t i = 0; i < elementsof(exprs); ++i) {
+		EXPECT_EQ(expr_code_eval(codes[i], &regs), expected[i]);
+		expr_code_free(codes[i]);
+	}
+}
+
+TEST(ExpressionTest, CompiledExpressionFallback) {
+	EXPECT_EQ(expr_compile("1 ? 2 : 3", '\0', NULL), nullptr);
+	EXPECT_EQ(expr_compile("eax = 4", '\0', NULL), nullptr);
+	EXPECT_EQ(expr_compile("<option:test>", '\0', NULL), nullptr);
+	EXPECT_EQ(expr_compile("eax++", '\0', NULL), nullptr);
+}
@@ -0,0 +1,249 @@
+#include "thcrap.h"
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+// Replays breakpoints on fake register snapshots, without a game, to
+// measure the per-call latency of breakpoint functions.
+// Breakpoints are parsed from a runconfig-style "breakpoints" object, the
+// same way runconfig_load() does, and resolved through func_get(), so
+// breakpoints from plugins work as well once their DLL has been loaded.
+class BreakpointReplay
+{
+    std::vector<breakpoint_local_t> bps;
+
+public:
+    // breakpoint_process() moves [regs] along with the stack, so it needs
+    // some space after it.
+    struct Regs
+    {
+        x86_reg_t regs;
+        uint8_t slack[64];
+    };
+
+    struct Latency
+    {
+        std::vector<double> samples;
+
+        void report(const char *name)
+        {
+            ASSERT_FALSE(samples.empty());
+            std::sort(samples.begin(), samples.end());
+            double p50 = samples[samples.size() / 2];
+            double p99 = samples[MIN(samples.size() * 99 / 100, samples.size() - 1)];
+            printf("[ REPLAY   ] %-28s %8zu calls   p50 %8.2f us   p99 %8.2f us\n",
+                name, samples.size(), p50, p99
+            );
+            ::testing::Test::RecordProperty(std::string(name) + "_p50_ns", (int)(p50 * 1000));
+            ::testing::Test::RecordProperty(std::string(name) + "_p99_ns", (int)(p99 * 1000));
+        }
+    };
+
+    BreakpointReplay(json_t *runconfig)
+    {
+        const char *key;
+        json_t *value;
+        json_object_foreach(json_object_get(runconfig, "breakpoints"), key, value) {
+            breakpoint_local_t bp = {};
+            if (breakpoint_from_json(key, value, &bp)) {
+                bps.push_back(bp);
+                EXPECT_TRUE(breakpoint_local_init(&bps.back())) << key;
+            }
+        }
+    }
+
+    ~BreakpointReplay()
+    {
+        for (auto& bp : bps) {
+            free(bp.name);
+            for (size_t i = 0; bp.addr[i].type != END_ADDR; ++i) {
+                if (bp.addr[i].type == STR_ADDR) {
+                    free(bp.addr[i].str);
+                } else if (bp.addr[i].type == PATTERN_ADDR) {
+                    sigscan_pattern_free(bp.addr[i].pattern);
+                }
+            }
+            free(bp.addr);
+            breakpoint_cache_free(&bp);
+            json_decref(bp.json_obj);
+        }
+    }
+
+    breakpoint_local_t *get(const char *name)
+    {
+        for (auto& bp : bps) {
+            if (!strcmp(bp.name, name)) {
+                return &bp;
+            }
+        }
+        return nullptr;
+    }
+
+    static constexpr size_t CAVE_ADDR = 0xC0DE;
+
+    // Runs [bp] on a copy of [in], and returns the registers afterwards.
+    // Whether the codecave would have been executed can be checked by
+    // comparing retaddr to CAVE_ADDR.
+    static x86_reg_t run(breakpoint_local_t *bp, const x86_reg_t& in, Latency& latency)
+    {
+        Regs regs = {};
+        regs.regs = in;
+        regs.regs.retaddr = 0;
+
+        LARGE_INTEGER freq, start, end;
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&start);
+        size_t esp_diff = breakpoint_process(bp, CAVE_ADDR, &regs.regs);
+        QueryPerformanceCounter(&end);
+
+        latency.samples.push_back((double)(end.QuadPart - start.QuadPart) * 1e6 / (double)freq.QuadPart);
+        return *(x86_reg_t*)((uint8_t*)&regs.regs + esp_diff);
+    }
+};
+
+class BreakpointReplayTest : public ::testing::Test
+{
+protected:
+    patch_t patch;
+
+    void SetUp() override
+    {
+        std::filesystem::create_directory("bp_replay");
+        ScopedJson patch_js = json_pack("{s:s}", "id", "bp_replay");
+        json_dump_file(*patch_js, "bp_replay/patch.js", 0);
+        ScopedJson patch_info = json_object();
+        this->patch = patch_init("bp_replay", *patch_info, 0);
+        stack_add_patch(&this->patch);
+    }
+
+    void TearDown() override
+    {
+        stack_free();
+        std::filesystem::remove_all("bp_replay");
+    }
+};
+
+TEST_F(BreakpointReplayTest, FileLoad)
+{
+    const char rep[] = "replacement file";
+    file_write("bp_replay/replay.dat", rep, sizeof(rep));
+
+    ScopedJson runconfig = json_pack("{s:{s:{s:s, s:i, s:s, s:s, s:s}}}",
+        "breakpoints",
+            "file_load",
+                "addr", "0x401000",
+                "cavesize", 5,
+                "file_name", "[esp+4]",
+                "file_size", "[esp+8]",
+                "file_buffer", "[esp+0xc]"
+    );
+    BreakpointReplay replay(*runconfig);
+    auto bp = replay.get("file_load");
+    ASSERT_NE(bp, nullptr);
+
+    BreakpointReplay::Latency hit;
+    BreakpointReplay::Latency miss;
+    char buffer[64];
+    for (int i = 0; i < 2000; i++) {
+        const bool is_hit = i % 2;
+        uint32_t stack[4] = {
+            0,
+            (uint32_t)(is_hit ? "replay.dat" : "missing.dat"),
+            4,
+            (uint32_t)buffer,
+        };
+        x86_reg_t regs = {};
+        regs.esp = (uint32_t)stack;
+        memset(buffer, 0, sizeof(buffer));
+
+        x86_reg_t out = BreakpointReplay::run(bp, regs, is_hit ? hit : miss);
+        if (is_hit) {
+            // Fully replaced, skipping the codecave
+            EXPECT_NE(out.retaddr, BreakpointReplay::CAVE_ADDR);
+            EXPECT_EQ(stack[2], sizeof(rep));
+            EXPECT_STREQ(buffer, rep);
+        } else {
+            EXPECT_EQ(out.retaddr, BreakpointReplay::CAVE_ADDR);
+            EXPECT_EQ(stack[2], 4u);
+        }
+    }
+    hit.report("BP_file_load (replaced)");
+    miss.report("BP_file_load (not replaced)");
+}
+
+TEST_F(BreakpointReplayTest, FragmentedReadFile)
+{
+    const size_t FILE_SIZE = 64 * 1024;
+    const DWORD READ_SIZE = 4096;
+    std::vector<uint8_t> orig(FILE_SIZE, 'o');
+    std::vector<uint8_t> rep(FILE_SIZE, 'r');
+    file_write("bp_replay/orig.dat", orig.data(), orig.size());
+    file_write("bp_replay/frag.dat", rep.data(), rep.size());
+
+    ScopedJson runconfig = json_pack("{s:{s:{s:s, s:i, s:s, s:s}, s:{s:s, s:i}, s:{s:s, s:i}}}",
+        "breakpoints",
+            "fragmented_open_file",
+                "addr", "0x401000",
+                "cavesize", 5,
+                "file_name", "[esp+4]",
+                "file_size", "[esp+8]",
+            "fragmented_read_file",
+                "addr", "0x402000",
+                "cavesize", 6,
+            "fragmented_close_file",
+                "addr", "0x403000",
+                "cavesize", 5
+    );
+    BreakpointReplay replay(*runconfig);
+    auto bp_open = replay.get("fragmented_open_file");
+    auto bp_read = replay.get("fragmented_read_file");
+    auto bp_close = replay.get("fragmented_close_file");
+    ASSERT_NE(bp_open, nullptr);
+    ASSERT_NE(bp_read, nullptr);
+    ASSERT_NE(bp_close, nullptr);
+
+    HANDLE hFile = CreateFileU("bp_replay/orig.dat", GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
+    ASSERT_NE(hFile, INVALID_HANDLE_VALUE);
+
+    BreakpointReplay::Latency open_latency;
+    BreakpointReplay::Latency first_read_latency;
+    BreakpointReplay::Latency read_latency;
+    BreakpointReplay::Latency close_latency;
+    std::vector<uint8_t> buffer(READ_SIZE);
+    for (int i = 0; i < 100; i++) {
+        SetFilePointer(hFile, 0, nullptr, FILE_BEGIN);
+
+        uint32_t open_stack[3] = { 0, (uint32_t)"frag.dat", FILE_SIZE };
+        x86_reg_t regs = {};
+        regs.esp = (uint32_t)open_stack;
+        BreakpointReplay::run(bp_open, regs, open_latency);
+
+        for (size_t pos = 0; pos < FILE_SIZE; pos += READ_SIZE) {
+            DWORD read = 0;
+            uint32_t read_stack[6] = {
+                0, (uint32_t)hFile, (uint32_t)buffer.data(), READ_SIZE, (uint32_t)&read, 0
+            };
+            regs = {};
+            regs.esp = (uint32_t)read_stack;
+            x86_reg_t out = BreakpointReplay::run(bp_read, regs, pos ? read_latency : first_read_latency);
+
+            // Replaces the ReadFile() call
+            EXPECT_EQ(out.eax, 1u);
+            EXPECT_EQ(out.esp, regs.esp + 5 * sizeof(DWORD));
+            EXPECT_NE(out.retaddr, BreakpointReplay::CAVE_ADDR);
+            ASSERT_EQ(read, READ_SIZE);
+            ASSERT_EQ(memcmp(buffer.data(), rep.data() + pos, READ_SIZE), 0);
+        }
+
+        regs = {};
+        BreakpointReplay::run(bp_close, regs, close_latency);
+    }
+    CloseHandle(hFile);
+
+    open_latency.report("BP_fragmented_open_file");
+    first_read_latency.report("BP_fragmented_read_file (1st)");
+    read_latency.report("BP_fragmented_read_file");
+    close_latency.report("BP_fragmented_close_file");
+}
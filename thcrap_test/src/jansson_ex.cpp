@@ -0,0 +1,93 @@
+#include "thcrap.h"
+#include "gtest/gtest.h"
+
+static json_t *json5_load(const char *str, char **error = nullptr)
+{
+    return json5_loadb(str, strlen(str), error);
+}
+
+TEST(Json5, StrictJson)
+{
+    ScopedJson json = json5_load("{\"a\": [1, 2.5, \"x\"], \"b\": null}");
+    ASSERT_NE(*json, nullptr);
+    json_t *a = json_object_get(*json, "a");
+    EXPECT_EQ(json_integer_value(json_array_get(a, 0)), 1);
+    EXPECT_EQ(json_real_value(json_array_get(a, 1)), 2.5);
+    EXPECT_STREQ(json_string_value(json_array_get(a, 2)), "x");
+    EXPECT_TRUE(json_is_null(json_object_get(*json, "b")));
+}
+
+TEST(Json5, Syntax)
+{
+    ScopedJson json = json5_load(
+        "// Comment\n"
+        "{\n"
+        "    unquoted: 'single \\'quoted\\'',\n"
+        "    /* Block comment */\n"
+        "    hex: 0x1F,\n"
+        "    reals: [.5, 5., +1e3,],\n"
+        "    cont: 'line \\\n"
+        "continued',\n"
+        "    unicode: \"\\u00e9\\uD83D\\uDE00\",\n"
+        "}\n"
+    );
+    ASSERT_NE(*json, nullptr);
+    EXPECT_STREQ(json_object_get_string(*json, "unquoted"), "single 'quoted'");
+    EXPECT_EQ(json_integer_value(json_object_get(*json, "hex")), 0x1F);
+    json_t *reals = json_object_get(*json, "reals");
+    ASSERT_EQ(json_array_size(reals), 3);
+    EXPECT_EQ(json_real_value(json_array_get(reals, 0)), 0.5);
+    EXPECT_EQ(json_real_value(json_array_get(reals, 1)), 5.0);
+    EXPECT_EQ(json_real_value(json_array_get(reals, 2)), 1000.0);
+    EXPECT_STREQ(json_object_get_string(*json, "cont"), "line continued");
+    EXPECT_STREQ(json_object_get_string(*json, "unicode"), u8"é\U0001F600");
+}
+
+TEST(Json5, Errors)
+{
+    const char *invalid[] = {
+        "{a: 01}",
+        "{a: Infinity}",
+        "{a: 'unterminated}",
+        "{a: 1 b: 2}",
+        "42",
+        "{ /* unterminated",
+        "{a: 1} garbage",
+    };
+    for (const char *str : invalid) {
+        char *error = nullptr;
+        json_t *json = json5_load(str, &error);
+        EXPECT_EQ(json, nullptr) << str;
+        EXPECT_NE(error, nullptr) << str;
+        json_decref(json);
+        free(error);
+    }
+}
+
+TEST(JsonObjectMerge, MergeNew)
+{
+    json_t *old_obj = json_pack("{s:i, s:{s:i, s:i}, s:[]}", "a", 1, "b", "x", 1, "y", 2, "c");
+    json_t *new_obj = json_pack("{s:{s:i, s:i}, s:i, s:s}", "b", "y", 3, "z", 4, "c", 5, "d", "e");
+    json_t *expected = json_pack("{s:i, s:{s:i, s:i, s:i}, s:i, s:s}", "a", 1, "b", "x", 1, "y", 3, "z", 4, "c", 5, "d", "e");
+
+    json_t *ret = json_object_merge_new(old_obj, new_obj);
+    EXPECT_EQ(ret, old_obj);
+    EXPECT_TRUE(json_equal(ret, expected));
+    json_decref(ret);
+
+    // A shared source must survive the merge unchanged.
+    old_obj = json_pack("{s:{s:i}}", "b", "x", 1);
+    new_obj = json_pack("{s:{s:i}}", "b", "y", 2);
+    json_t *new_copy = json_deep_copy(new_obj);
+    ret = json_object_merge_new(old_obj, json_incref(new_obj));
+    EXPECT_TRUE(json_equal(new_obj, new_copy));
+    EXPECT_EQ(json_integer_value(json_object_get(json_object_get(ret, "b"), "y")), 2);
+    json_decref(ret);
+    json_decref(new_obj);
+    json_decref(new_copy);
+
+    // Non-objects replace the old value.
+    ret = json_object_merge_new(json_object(), json_integer(7));
+    EXPECT_EQ(json_integer_value(ret), 7);
+    json_decref(ret);
+}
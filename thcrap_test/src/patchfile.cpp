@@ -113,6 +113,32 @@ TEST(PatchFile, FnForPatch)
     free(patch.archive);
 }
 
+TEST(PatchFile, FnForTls)
+{
+    patch_t patch = {};
+
+    EXPECT_STREQ(fn_for_game_tls("test.js"), "test.js");
+    EXPECT_EQ(fn_for_build_tls("test.js"), nullptr);
+    EXPECT_EQ(fn_for_patch_tls(&patch, "test.js"), nullptr);
+
+    ScopedJson runcfg = json_pack("{s:s}", "game", "th06");
+    runconfig_load(*runcfg, 0);
+    runconfig_build_set("v1.2.3");
+    patch.archive = strdup("C:\\Path\\to\\patch_name");
+
+    // Each function has its own buffer, so results can be chained.
+    const char *game_fn = fn_for_game_tls("test.js");
+    const char *build_fn = fn_for_build_tls(game_fn);
+    EXPECT_STREQ(game_fn, "th06/test.js");
+    EXPECT_STREQ(build_fn, "th06/test.v1.2.3.js");
+    EXPECT_STREQ(fn_for_patch_tls(&patch, build_fn), "C:/Path/to/patch_name/th06/test.v1.2.3.js");
+    EXPECT_STREQ(fn_for_build_tls("test"), "test.v1.2.3");
+
+    free(patch.archive);
+    runconfig_build_set(nullptr);
+    runconfig_free();
+}
+
 TEST(PatchFile, DirCreateForFn)
 {
     if (std::filesystem::exists("test_dir")) {
@@ -159,6 +185,8 @@ protected:
     void TearDown() override
     {
         patch_free(&this->patch);
+        // Closes any pack that a test has opened.
+        patch_pack_mod_exit();
         std::filesystem::remove_all("testdir");
     }
 };
@@ -225,6 +253,48 @@ TEST_F(PatchFileTest, PatchFileExists)
     EXPECT_FALSE(patch_file_exists(&patch, "test_blacklist.bmp"));
 }
 
+TEST_F(PatchFileTest, PatchFileIndex)
+{
+    std::ofstream file;
+
+    std::filesystem::create_directory("testdir/Subdir");
+    file.open("testdir/Subdir/Test_Exist.js");
+    file.close();
+
+    // Disabled by default
+    EXPECT_EQ(patch_index_lookup(&patch, "subdir/test_exist.js"), PATCH_INDEX_UNKNOWN);
+
+    patch_index_enable(true);
+    EXPECT_EQ(patch_index_lookup(&patch, "subdir/test_exist.js"), PATCH_INDEX_FILE);
+    EXPECT_EQ(patch_index_lookup(&patch, "SUBDIR\\test_exist.js"), PATCH_INDEX_FILE);
+    EXPECT_EQ(patch_index_lookup(&patch, "subdir//test_exist.js"), PATCH_INDEX_FILE);
+    EXPECT_EQ(patch_index_lookup(&patch, "subdir"), PATCH_INDEX_DIRECTORY);
+    EXPECT_EQ(patch_index_lookup(&patch, "subdir/"), PATCH_INDEX_DIRECTORY);
+    EXPECT_EQ(patch_index_lookup(&patch, "subdir/test_missing.js"), PATCH_INDEX_MISSING);
+    EXPECT_EQ(patch_index_lookup(&patch, "../testdir/subdir"), PATCH_INDEX_UNKNOWN);
+    EXPECT_EQ(patch_index_lookup(&patch, "subdir/../subdir"), PATCH_INDEX_UNKNOWN);
+    EXPECT_EQ(patch_index_lookup(&patch, "/subdir"), PATCH_INDEX_UNKNOWN);
+    EXPECT_EQ(patch_index_lookup(&patch, "C:/subdir"), PATCH_INDEX_UNKNOWN);
+    EXPECT_TRUE (patch_file_exists(&patch, "subdir/test_exist.js"));
+    EXPECT_FALSE(patch_file_exists(&patch, "subdir/test_missing.js"));
+
+    // Files created behind the index's back need an invalidation...
+    file.open("testdir/subdir/test_new.js");
+    file.close();
+    EXPECT_EQ(patch_index_lookup(&patch, "subdir/test_new.js"), PATCH_INDEX_MISSING);
+    patch_index_invalidate();
+    EXPECT_EQ(patch_index_lookup(&patch, "subdir/test_new.js"), PATCH_INDEX_FILE);
+
+    // ... while our own writes take care of it themselves.
+    patch_file_store(&patch, "subdir/test_stored.js", "{}", 2);
+    EXPECT_EQ(patch_index_lookup(&patch, "subdir/test_stored.js"), PATCH_INDEX_FILE);
+    patch_file_delete(&patch, "subdir/test_stored.js");
+    EXPECT_EQ(patch_index_lookup(&patch, "subdir/test_stored.js"), PATCH_INDEX_MISSING);
+
+    patch_index_enable(false);
+    EXPECT_EQ(patch_index_lookup(&patch, "subdir/test_exist.js"), PATCH_INDEX_UNKNOWN);
+}
+
 TEST_F(PatchFileTest, PatchFileBlacklisted)
 {
     EXPECT_TRUE (patch_file_blacklisted(&patch, "file.bmp"));
@@ -275,6 +345,112 @@ TEST_F(PatchFileTest, PatchFileLoad)
     free(buffer);
 }
 
+TEST_F(PatchFileTest, PatchFileMap)
+{
+    std::ofstream file;
+    const char *view;
+    size_t file_size;
+
+    file.open("testdir/test_exist.txt");
+    file.write("abcde", 6);
+    file.close();
+    view = (const char*)patch_file_map(&patch, "test_exist.txt", &file_size);
+    ASSERT_NE(view, nullptr);
+    EXPECT_STREQ(view, "abcde");
+    EXPECT_EQ(file_size, 6u);
+    file_unmap(view);
+
+    EXPECT_EQ(patch_file_map(&patch, "test_missing.txt", &file_size), nullptr);
+    EXPECT_EQ(file_size, 0u);
+
+    // Empty files can't be mapped
+    file.open("testdir/test_empty.txt");
+    file.close();
+    EXPECT_EQ(patch_file_map(&patch, "test_empty.txt", &file_size), nullptr);
+    EXPECT_EQ(file_size, 0u);
+
+    // Test blacklist
+    file.open("testdir/test_blacklist.bmp");
+    file.write("abcde", 6);
+    file.close();
+    EXPECT_EQ(patch_file_map(&patch, "test_blacklist.bmp", &file_size), nullptr);
+    EXPECT_EQ(file_size, 0u);
+}
+
+TEST_F(PatchFileTest, PatchPack)
+{
+    // Names must be sorted.
+    const std::pair<std::string, std::string> files[] = {
+        { "dir/packed.txt", "fghij" },
+        { "test_exist.txt", "packed" },
+    };
+    std::string names;
+    std::string data;
+    for (const auto& [name, content] : files) {
+        names += name;
+    }
+    const size_t names_offset = sizeof(patch_pack_header_t) + std::size(files) * sizeof(patch_pack_entry_t);
+    const size_t data_offset = names_offset + names.size();
+    std::vector<patch_pack_entry_t> entries;
+    size_t name_offset = names_offset;
+    for (const auto& [name, content] : files) {
+        patch_pack_entry_t entry;
+        entry.name_offset = (uint32_t)name_offset;
+        entry.name_len = (uint32_t)name.size();
+        entry.data_offset = (uint32_t)(data_offset + data.size());
+        entry.size_stored = (uint32_t)content.size();
+        entry.size = (uint32_t)content.size();
+        entry.method = PATCH_PACK_STORED;
+        entries.push_back(entry);
+        name_offset += name.size();
+        data += content;
+    }
+    patch_pack_header_t header = { PATCH_PACK_MAGIC, PATCH_PACK_VERSION, (uint32_t)entries.size(), 0 };
+
+    std::ofstream file("testdir/" PATCH_PACK_FN, std::ios::binary);
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)entries.data(), entries.size() * sizeof(patch_pack_entry_t));
+    file.write(names.data(), names.size());
+    file.write(data.data(), data.size());
+    file.close();
+    file.open("testdir/test_exist.txt");
+    file.write("loose", 5);
+    file.close();
+    file.open("testdir/test_loose.txt");
+    file.write("loose", 5);
+    file.close();
+    // Forget that the patch had no pack when it was initialized.
+    patch_pack_mod_exit();
+
+    size_t file_size;
+    char *buffer;
+
+    // The pack takes priority over loose files...
+    buffer = (char*)patch_file_load(&patch, "test_exist.txt", &file_size);
+    ASSERT_NE(buffer, nullptr);
+    EXPECT_EQ(std::string(buffer, file_size), "packed");
+    free(buffer);
+
+    // ...which are still used if the pack doesn't have them.
+    buffer = (char*)patch_file_load(&patch, "test_loose.txt", &file_size);
+    ASSERT_NE(buffer, nullptr);
+    EXPECT_EQ(std::string(buffer, file_size), "loose");
+    free(buffer);
+
+    // Lookups are case-insensitive and accept backslashes, like the index.
+    const char *view = (const char*)patch_file_map(&patch, "DIR\\Packed.txt", &file_size);
+    ASSERT_NE(view, nullptr);
+    EXPECT_EQ(std::string(view, file_size), "fghij");
+    file_unmap(view);
+
+    EXPECT_TRUE(patch_file_exists(&patch, "dir"));
+    EXPECT_TRUE(patch_file_exists(&patch, "dir/packed.txt"));
+    EXPECT_FALSE(patch_file_exists(&patch, "dir/missing.txt"));
+    EXPECT_FALSE(patch_file_exists(&patch, "di"));
+    EXPECT_EQ(patch_file_load(&patch, "dir", &file_size), nullptr);
+    EXPECT_EQ(file_size, 0u);
+}
+
 // TODO: patch_json_load, patch_json_merge, patch_file_store, patch_json_store, patch_file_delete
 
 TEST_F(PatchFileTest, PatchToRunconfigJson)
@@ -336,4 +512,49 @@ TEST(PatchFile, PatchDepToDesc)
     free(desc.patch_id);
 }
 
-// TODO: patchhook
+static std::string patchhook_test_order;
+
+static int patchhook_test_a(void*, size_t, size_t, const char*, json_t*)
+{
+    patchhook_test_order += 'a';
+    return 0;
+}
+
+static int patchhook_test_b(void*, size_t, size_t, const char*, json_t*)
+{
+    patchhook_test_order += 'b';
+    return 1;
+}
+
+TEST(PatchFile, PatchHooks)
+{
+    char buf[1];
+    patchhook_register("*.hooktest", patchhook_test_a, nullptr);
+    patchhook_register("data\\hooktest_??.bin", patchhook_test_b, nullptr);
+    patchhook_register("*.hooktest2; data/*test*", patchhook_test_b, nullptr);
+
+    EXPECT_EQ(patchhooks_build(nullptr), nullptr);
+    EXPECT_EQ(patchhooks_build("data/file.unhooked"), nullptr);
+    EXPECT_EQ(patchhooks_build("data/hooktes_12.bin"), nullptr);
+
+    // Matching is case-insensitive, and results are cached
+    const patchhook_t *hooks = patchhooks_build("sub/file.HookTest");
+    ASSERT_NE(hooks, nullptr);
+    EXPECT_EQ(patchhooks_build("sub/file.HookTest"), hooks);
+    patchhook_test_order.clear();
+    EXPECT_EQ(patchhooks_run(hooks, buf, 1, 1, "sub/file.HookTest", nullptr), 0);
+    EXPECT_EQ(patchhook_test_order, "a");
+
+    // '?' matches a full UTF-8 character, and hooks run in registration order
+    hooks = patchhooks_build("data\\hooktest_\xE3\x81\x82\xE3\x81\x84.bin");
+    ASSERT_NE(hooks, nullptr);
+    patchhook_test_order.clear();
+    EXPECT_EQ(patchhooks_run(hooks, buf, 1, 1, "", nullptr), 1);
+    EXPECT_EQ(patchhook_test_order, "bb");
+
+    hooks = patchhooks_build("sub/file.hooktest2");
+    ASSERT_NE(hooks, nullptr);
+    patchhook_test_order.clear();
+    patchhooks_run(hooks, buf, 1, 1, "", nullptr);
+    EXPECT_EQ(patchhook_test_order, "b");
+}
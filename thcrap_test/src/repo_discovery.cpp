@@ -1,5 +1,6 @@
 #include "thcrap.h"
 #include <filesystem>
+#include <set>
 #include "gtest/gtest.h"
 #include "repo_discovery.h"
 #include "server.h"
@@ -41,6 +42,17 @@ public:
         }, &writeCallback, 0);
         return HttpStatus::makeOk();
     }
+
+    // Every file has the same ETag, and never changes
+    HttpStatus downloadConditional(const std::string& url, const HttpValidators& validators, HttpValidators& responseValidators,
+                                   std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback) override
+    {
+        if (validators.etag == "\"v1\"") {
+            return HttpStatus::makeNotModified();
+        }
+        responseValidators.etag = "\"v1\"";
+        return this->download(url, writeCallback, progressCallback);
+    }
 };
 std::map<std::string, ScopedJson> FakeHttpHandle::files;
 
@@ -115,3 +127,41 @@ TEST_F(RepoDiscoveryTest, TestNeighbors)
     EXPECT_STREQ(repos[0]->id, "nmlgc");
     EXPECT_STREQ(repos[1]->id, "thpatch");
 }
+
+TEST_F(RepoDiscoveryTest, TestCallback)
+{
+    FakeHttpHandle::addFiles({
+        { "https://srv.thpatch.net/repo.js", json_pack("{s:s,s:[s]}",
+            "id", "thpatch",
+            "neighbors", "https://mirrors.thpatch.net/nmlgc/"
+        )},
+        { "https://mirrors.thpatch.net/nmlgc/repo.js", json_pack("{s:s}", "id", "nmlgc") },
+    });
+
+    std::set<std::string> found;
+    repos = RepoDiscoverWithCallback("https://srv.thpatch.net/", [](const repo_t *repo, void *param) {
+        static_cast<std::set<std::string>*>(param)->insert(repo->id);
+    }, &found);
+    ASSERT_NE(repos, nullptr);
+    EXPECT_EQ(found, std::set<std::string>({ "nmlgc", "thpatch" }));
+}
+
+TEST_F(RepoDiscoveryTest, TestCache)
+{
+    FakeHttpHandle::addFile("https://srv.thpatch.net/repo.js", json_pack("{s:s}", "id", "thpatch"));
+
+    repos = RepoDiscover("https://srv.thpatch.net/");
+    ASSERT_NE(repos, nullptr);
+    for (size_t i = 0; repos[i]; i++) {
+        RepoFree(repos[i]);
+    }
+    free(repos);
+
+    // The server only confirms that the cached repo.js is still valid
+    FakeHttpHandle::clear();
+    repos = RepoDiscover("https://srv.thpatch.net/");
+    ASSERT_NE(repos, nullptr);
+    ASSERT_NE(repos[0], nullptr);
+    EXPECT_EQ(repos[1], nullptr);
+    EXPECT_STREQ(repos[0]->id, "thpatch");
+}
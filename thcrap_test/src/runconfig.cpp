@@ -326,3 +326,22 @@ TEST(RunconfigTest, Latest)
 }
 
 // TODO: test stages
+
+TEST(RunconfigTest, LogLevel)
+{
+    ScopedJson cfg = json_pack("{s:s}", "log_level", "warn");
+    {
+        ScopedRunconfig runconfig(cfg);
+        EXPECT_EQ(log_level, LOG_LEVEL_WARN);
+        EXPECT_FALSE(log_level_enabled(LOG_LEVEL_INFO));
+        EXPECT_TRUE(log_level_enabled(LOG_LEVEL_WARN));
+    }
+    EXPECT_EQ(log_level, LOG_LEVEL_DEBUG);
+
+    EXPECT_EQ(log_level_set("INFO"), 0);
+    EXPECT_EQ(log_level, LOG_LEVEL_INFO);
+    EXPECT_EQ(log_level_set("verbose"), -1);
+    EXPECT_EQ(log_level, LOG_LEVEL_INFO);
+    EXPECT_STREQ(log_level_name(LOG_LEVEL_TRACE), "trace");
+    log_level = LOG_LEVEL_DEBUG;
+}
@@ -0,0 +1,44 @@
+#include "thcrap.h"
+#include "gtest/gtest.h"
+
+static void task_test_add(void *param)
+{
+	InterlockedIncrement((volatile LONG *)param);
+}
+
+TEST(TaskTest, GroupWait) {
+	volatile LONG count = 0;
+	task_group_t *group = task_group_create();
+	for (int i = 0; i < 1000; i++) {
+		task_submit((task_priority_t)(i % TASK_PRIORITY_COUNT), group, task_test_add, (void *)&count);
+	}
+	task_group_wait(group);
+	EXPECT_EQ(count, 1000);
+	task_group_free(group);
+}
+
+TEST(TaskTest, NestedSubmit) {
+	std::vector<int> results(64);
+	task_group_t *group = task_group_create();
+	for (size_t i = 0; i < results.size(); i++) {
+		task_submit_func(TASK_PRIORITY_CRITICAL, group, [&results, group, i]() {
+			task_submit_func(TASK_PRIORITY_CRITICAL, group, [&results, i]() {
+				results[i] = (int)i * 2;
+			});
+		});
+	}
+	task_group_free(group);
+	for (size_t i = 0; i < results.size(); i++) {
+		EXPECT_EQ(results[i], (int)i * 2);
+	}
+}
+
+TEST(TaskTest, ParallelFor) {
+	std::vector<int> results(100);
+	parallel_for(results.size(), 4, [&results](size_t i) {
+		results[i] = (int)i + 1;
+	});
+	for (size_t i = 0; i < results.size(); i++) {
+		EXPECT_EQ(results[i], (int)i + 1);
+	}
+}
@@ -46,3 +46,48 @@ TEST(Win32Utf8Test, GetModuleHandleEx)
 	std::filesystem::remove(dll_path);
 	std::filesystem::remove(dll_dir);
 }
+
+static void ExpectSameUTF16(const char *str)
+{
+	const size_t len = strlen(str) + 1;
+	std::vector<wchar_t> expected(len, L'?');
+	std::vector<wchar_t> actual(len, L'?');
+	int expected_len = StringToUTF16(expected.data(), str, -1);
+	EXPECT_EQ(utf8_to_utf16(actual.data(), str, -1), expected_len);
+	EXPECT_EQ(actual, expected);
+}
+
+static void ExpectSameUTF8(const wchar_t *str)
+{
+	const size_t len = wcslen(str) * UTF8_MUL + 1;
+	std::vector<char> expected(len, '?');
+	std::vector<char> actual(len, '?');
+	int expected_len = StringToUTF8(expected.data(), str, len);
+	EXPECT_EQ(utf16_to_utf8(actual.data(), str, len), expected_len);
+	EXPECT_EQ(actual, expected);
+}
+
+TEST(Win32Utf8Test, StrconvMatchesWin32)
+{
+	ExpectSameUTF16("");
+	ExpectSameUTF16("th06/stage1.anm");
+	ExpectSameUTF16("a fairly long pure ASCII path/with/several/directories.js");
+	ExpectSameUTF16(u8"thcrap/patches/東方/0123456789abcdef_éè.png");
+	ExpectSameUTF16(u8"0123456789abcdef東");
+	// Shift-JIS, which isn't valid UTF-8 and goes through the fallback
+	ExpectSameUTF16("0123456789abcdef\x93\x8c\x95\xfb");
+
+	ExpectSameUTF8(L"");
+	ExpectSameUTF8(L"th06/stage1.anm");
+	ExpectSameUTF8(L"a fairly long pure ASCII path/with/several/directories.js");
+	ExpectSameUTF8(L"thcrap/patches/東方/0123456789abcdef_éè.png");
+	ExpectSameUTF8(L"0123456789abcdef東");
+
+	utf16_buf_t w("0123456789abcdef/東方.js");
+	EXPECT_STREQ(w.c_str(), L"0123456789abcdef/東方.js");
+	utf8_buf_t u(L"0123456789abcdef/東方.js");
+	EXPECT_STREQ(u.c_str(), u8"0123456789abcdef/東方.js");
+	std::string long_str(MAX_PATH * 2, 'x');
+	utf16_buf_t long_w(long_str.c_str());
+	EXPECT_EQ(wcslen(long_w.c_str()), long_str.size());
+}
@@ -0,0 +1,110 @@
+#include "thcrap.h"
+#include "gtest/gtest.h"
+#include <fstream>
+#include <filesystem>
+
+// Contains a stored "stored.txt", a deflated "dir/deflated.txt", and an empty
+// "empty.txt".
+static const unsigned char zip_data[] = {
+    0x50, 0x4b, 0x03, 0x04, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x21, 0x00, 0x89, 0x9f,
+    0x22, 0x26, 0x14, 0x00, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x73, 0x74,
+    0x6f, 0x72, 0x65, 0x64, 0x2e, 0x74, 0x78, 0x74, 0x53, 0x74, 0x6f, 0x72, 0x65, 0x64, 0x20, 0x66,
+    0x69, 0x6c, 0x65, 0x20, 0x63, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x73, 0x50, 0x4b, 0x03, 0x04,
+    0x14, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x21, 0x00, 0xb0, 0x2d, 0x66, 0xbc, 0x0d, 0x00,
+    0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x64, 0x69, 0x72, 0x2f, 0x64, 0x65,
+    0x66, 0x6c, 0x61, 0x74, 0x65, 0x64, 0x2e, 0x74, 0x78, 0x74, 0x4b, 0x49, 0x4d, 0xcb, 0x49, 0x2c,
+    0x49, 0x55, 0x48, 0x19, 0x20, 0x1a, 0x00, 0x50, 0x4b, 0x03, 0x04, 0x14, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x21, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x09, 0x00, 0x00, 0x00, 0x65, 0x6d, 0x70, 0x74, 0x79, 0x2e, 0x74, 0x78, 0x74, 0x50, 0x4b,
+    0x01, 0x02, 0x14, 0x03, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x21, 0x00, 0x89, 0x9f,
+    0x22, 0x26, 0x14, 0x00, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0x00, 0x00, 0x00, 0x00, 0x73, 0x74, 0x6f, 0x72,
+    0x65, 0x64, 0x2e, 0x74, 0x78, 0x74, 0x50, 0x4b, 0x01, 0x02, 0x14, 0x03, 0x14, 0x00, 0x00, 0x00,
+    0x08, 0x00, 0x00, 0x00, 0x21, 0x00, 0xb0, 0x2d, 0x66, 0xbc, 0x0d, 0x00, 0x00, 0x00, 0x80, 0x00,
+    0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01,
+    0x3c, 0x00, 0x00, 0x00, 0x64, 0x69, 0x72, 0x2f, 0x64, 0x65, 0x66, 0x6c, 0x61, 0x74, 0x65, 0x64,
+    0x2e, 0x74, 0x78, 0x74, 0x50, 0x4b, 0x01, 0x02, 0x14, 0x03, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x21, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0x77, 0x00,
+    0x00, 0x00, 0x65, 0x6d, 0x70, 0x74, 0x79, 0x2e, 0x74, 0x78, 0x74, 0x50, 0x4b, 0x05, 0x06, 0x00,
+    0x00, 0x00, 0x00, 0x03, 0x00, 0x03, 0x00, 0xad, 0x00, 0x00, 0x00, 0x9e, 0x00, 0x00, 0x00, 0x00,
+    0x00
+};
+
+class ZipTest : public ::testing::Test
+{
+protected:
+    const char *fn = "ZipTest.zip";
+    zip_t *zip = nullptr;
+
+    void SetUp() override
+    {
+        {
+            std::ofstream f(fn, std::ios::binary);
+            f.write((const char*)zip_data, sizeof(zip_data));
+        }
+        zip = zip_open(fn);
+        ASSERT_NE(zip, nullptr);
+    }
+
+    void TearDown() override
+    {
+        zip_close(zip);
+        std::filesystem::remove(fn);
+    }
+};
+
+TEST_F(ZipTest, View)
+{
+    size_t size = 0;
+    const char *view = (const char*)zip_file_view(zip, "stored.txt", &size);
+    ASSERT_NE(view, nullptr);
+    EXPECT_EQ(std::string(view, size), "Stored file contents");
+
+    // Compressed and missing files can't be viewed.
+    EXPECT_EQ(zip_file_view(zip, "dir/deflated.txt", &size), nullptr);
+    EXPECT_EQ(zip_file_view(zip, "missing.txt", &size), nullptr);
+}
+
+TEST_F(ZipTest, LoadInto)
+{
+    std::string expected;
+    for (int i = 0; i < 16; i++) {
+        expected += "deflate ";
+    }
+    size_t size = zip_file_size(zip, "dir/deflated.txt");
+    ASSERT_EQ(size, expected.length());
+
+    std::string buf(size, '\0');
+    EXPECT_EQ(zip_file_load_into(zip, "dir/deflated.txt", buf.data(), buf.size()), 0);
+    EXPECT_EQ(buf, expected);
+
+    // Buffer too small
+    EXPECT_NE(zip_file_load_into(zip, "dir/deflated.txt", buf.data(), size - 1), 0);
+    EXPECT_NE(zip_file_load_into(zip, "missing.txt", buf.data(), buf.size()), 0);
+    EXPECT_EQ(zip_file_size(zip, "missing.txt"), 0u);
+}
+
+TEST_F(ZipTest, Load)
+{
+    size_t size = 0;
+    char *buf = (char*)zip_file_load(zip, "stored.txt", &size);
+    ASSERT_NE(buf, nullptr);
+    EXPECT_EQ(std::string(buf, size), "Stored file contents");
+    free(buf);
+
+    EXPECT_EQ(zip_file_load(zip, "missing.txt", &size), nullptr);
+    EXPECT_EQ(size, 0u);
+}
+
+TEST_F(ZipTest, List)
+{
+    json_t *files = zip_list(zip);
+    EXPECT_EQ(json_object_size(files), 2u);
+    EXPECT_NE(json_object_get(files, "stored.txt"), nullptr);
+    EXPECT_NE(json_object_get(files, "dir/deflated.txt"), nullptr);
+
+    json_t *files_empty = zip_list_empty(zip);
+    ASSERT_EQ(json_array_size(files_empty), 1u);
+    EXPECT_STREQ(json_string_value(json_array_get(files_empty, 0)), "empty.txt");
+}
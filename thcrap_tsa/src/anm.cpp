@@ -12,9 +12,239 @@
 
 #include <thcrap.h>
 #include <png.h>
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
 #include "png_ex.h"
 #include "thcrap_tsa.h"
 #include "anm.hpp"
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+/// SIMD kernels
+/// ------------
+/**
+  * Vectorized versions of the per-pixel loops below. Every kernel processes
+  * as many whole vectors as fit into [pixels] and returns the number of
+  * pixels it handled, leaving the rest to the scalar code. The results are
+  * bit-identical to the scalar versions.
+  */
+#if defined(__GNUC__)
+# define ANM_TARGET_XSAVE __attribute__((target("xsave")))
+# define ANM_TARGET_SSE2 __attribute__((target("sse2")))
+# define ANM_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+# define ANM_TARGET_XSAVE
+# define ANM_TARGET_SSE2
+# define ANM_TARGET_AVX2
+#endif
+
+struct anm_simd_t {
+	bool sse2;
+	bool avx2;
+};
+
+ANM_TARGET_XSAVE static anm_simd_t anm_simd_detect(void)
+{
+	anm_simd_t ret = {};
+	int data[4];
+	__cpuid(data, 0);
+	const int max_leaf = data[0];
+	if(max_leaf < 1) {
+		return ret;
+	}
+	__cpuid(data, 1);
+	ret.sse2 = data[3] & 1 << 26;
+	const bool osxsave = data[2] & 1 << 27;
+	const bool avx = data[2] & 1 << 28;
+	if(max_leaf >= 7 && osxsave && avx) {
+		// The OS also has to save the upper halves of the YMM registers.
+		const bool ymm_state = (_xgetbv(0) & 0x6) == 0x6;
+		__cpuidex(data, 7, 0);
+		ret.avx2 = ymm_state && (data[1] & 1 << 5);
+	}
+	return ret;
+}
+
+static const anm_simd_t ANM_SIMD = anm_simd_detect();
+
+// Blends 4 BGRA8888 pixels.
+ANM_TARGET_SSE2 static inline __m128i blend_bgra8888_x4_sse2(__m128i d, __m128i r)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ff = _mm_set1_epi16(0xff);
+	const __m128i alpha_mask = _mm_set1_epi32(0xff000000);
+
+	__m128i d_lo = _mm_unpacklo_epi8(d, zero);
+	__m128i d_hi = _mm_unpackhi_epi8(d, zero);
+	__m128i r_lo = _mm_unpacklo_epi8(r, zero);
+	__m128i r_hi = _mm_unpackhi_epi8(r, zero);
+	// Broadcast the replacement alpha to all 4 channels of each pixel
+	__m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(r_lo, 0xff), 0xff);
+	__m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(r_hi, 0xff), 0xff);
+	// (dst * (0xff - a) + rep * a) >> 8. The sum can't exceed 0xfe01.
+	d_lo = _mm_srli_epi16(_mm_add_epi16(
+		_mm_mullo_epi16(d_lo, _mm_sub_epi16(ff, a_lo)), _mm_mullo_epi16(r_lo, a_lo)
+	), 8);
+	d_hi = _mm_srli_epi16(_mm_add_epi16(
+		_mm_mullo_epi16(d_hi, _mm_sub_epi16(ff, a_hi)), _mm_mullo_epi16(r_hi, a_hi)
+	), 8);
+	const __m128i color = _mm_packus_epi16(d_lo, d_hi);
+	const __m128i alpha = _mm_adds_epu8(d, r);
+	return _mm_or_si128(
+		_mm_andnot_si128(alpha_mask, color), _mm_and_si128(alpha_mask, alpha)
+	);
+}
+
+ANM_TARGET_SSE2 static unsigned int blend_bgra8888_sse2(png_byte *dst, const png_byte *rep, unsigned int pixels)
+{
+	unsigned int i;
+	for(i = 0; i + 4 <= pixels; i += 4, dst += 16, rep += 16) {
+		const __m128i d = _mm_loadu_si128((const __m128i*)dst);
+		const __m128i r = _mm_loadu_si128((const __m128i*)rep);
+		_mm_storeu_si128((__m128i*)dst, blend_bgra8888_x4_sse2(d, r));
+	}
+	return i;
+}
+
+ANM_TARGET_AVX2 static unsigned int blend_bgra8888_avx2(png_byte *dst, const png_byte *rep, unsigned int pixels)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ff = _mm256_set1_epi16(0xff);
+	const __m256i alpha_mask = _mm256_set1_epi32(0xff000000);
+	unsigned int i;
+	for(i = 0; i + 8 <= pixels; i += 8, dst += 32, rep += 32) {
+		const __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+		const __m256i r = _mm256_loadu_si256((const __m256i*)rep);
+		// The unpacks work within 128-bit lanes, and so does the pack below,
+		// which puts everything back in order.
+		__m256i d_lo = _mm256_unpacklo_epi8(d, zero);
+		__m256i d_hi = _mm256_unpackhi_epi8(d, zero);
+		__m256i r_lo = _mm256_unpacklo_epi8(r, zero);
+		__m256i r_hi = _mm256_unpackhi_epi8(r, zero);
+		__m256i a_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(r_lo, 0xff), 0xff);
+		__m256i a_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(r_hi, 0xff), 0xff);
+		d_lo = _mm256_srli_epi16(_mm256_add_epi16(
+			_mm256_mullo_epi16(d_lo, _mm256_sub_epi16(ff, a_lo)), _mm256_mullo_epi16(r_lo, a_lo)
+		), 8);
+		d_hi = _mm256_srli_epi16(_mm256_add_epi16(
+			_mm256_mullo_epi16(d_hi, _mm256_sub_epi16(ff, a_hi)), _mm256_mullo_epi16(r_hi, a_hi)
+		), 8);
+		const __m256i color = _mm256_packus_epi16(d_lo, d_hi);
+		const __m256i alpha = _mm256_adds_epu8(d, r);
+		_mm256_storeu_si256((__m256i*)dst, _mm256_or_si256(
+			_mm256_andnot_si256(alpha_mask, color), _mm256_and_si256(alpha_mask, alpha)
+		));
+	}
+	return i;
+}
+
+ANM_TARGET_SSE2 static unsigned int blend_argb4444_sse2(png_byte *dst, const png_byte *rep, unsigned int pixels)
+{
+	const __m128i nibble = _mm_set1_epi16(0xf);
+	unsigned int i;
+	for(i = 0; i + 8 <= pixels; i += 8, dst += 16, rep += 16) {
+		const __m128i d = _mm_loadu_si128((const __m128i*)dst);
+		const __m128i r = _mm_loadu_si128((const __m128i*)rep);
+		const __m128i rep_a = _mm_srli_epi16(r, 12);
+		const __m128i dst_a = _mm_srli_epi16(d, 12);
+		const __m128i dst_alpha = _mm_sub_epi16(nibble, rep_a);
+		// min(dst_a + rep_a, 0xf), without SSE4.1's _mm_min_epu16()
+		const __m128i new_a = _mm_min_epi16(_mm_add_epi16(dst_a, rep_a), nibble);
+
+		__m128i ret = _mm_slli_epi16(new_a, 12);
+		for(int shift = 0; shift < 12; shift += 4) {
+			const __m128i shift_v = _mm_cvtsi32_si128(shift);
+			const __m128i dst_c = _mm_and_si128(_mm_srl_epi16(d, shift_v), nibble);
+			const __m128i rep_c = _mm_and_si128(_mm_srl_epi16(r, shift_v), nibble);
+			const __m128i c = _mm_srli_epi16(_mm_add_epi16(
+				_mm_mullo_epi16(dst_c, dst_alpha), _mm_mullo_epi16(rep_c, rep_a)
+			), 4);
+			ret = _mm_or_si128(ret, _mm_sll_epi16(c, shift_v));
+		}
+		_mm_storeu_si128((__m128i*)dst, ret);
+	}
+	return i;
+}
+
+// Packs the low 16 bits of the 32-bit values in [a] and [b], without
+// SSE4.1's _mm_packus_epi32().
+ANM_TARGET_SSE2 static inline __m128i pack_lo16_sse2(__m128i a, __m128i b)
+{
+	a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+	b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+	return _mm_packs_epi32(a, b);
+}
+
+ANM_TARGET_SSE2 static inline __m128i bgra_to_argb4444_x4_sse2(__m128i v)
+{
+	const __m128i t = _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi32(0x0f0f0f0f));
+	const __m128i w = _mm_or_si128(t, _mm_srli_epi32(t, 4));
+	return _mm_or_si128(
+		_mm_and_si128(w, _mm_set1_epi32(0xff)),
+		_mm_and_si128(_mm_srli_epi32(w, 8), _mm_set1_epi32(0xff00))
+	);
+}
+
+ANM_TARGET_SSE2 static inline __m128i bgra_to_rgb565_x4_sse2(__m128i v)
+{
+	return _mm_or_si128(_mm_or_si128(
+		_mm_and_si128(_mm_srli_epi32(v, 3), _mm_set1_epi32(0x001f)),
+		_mm_and_si128(_mm_srli_epi32(v, 5), _mm_set1_epi32(0x07e0))),
+		_mm_and_si128(_mm_srli_epi32(v, 8), _mm_set1_epi32(0xf800))
+	);
+}
+
+// Converts in place, like format_from_bgra(). Both input vectors are
+// loaded before the output is stored, and the output always trails the
+// input, so this never overwrites pixels that haven't been read yet.
+ANM_TARGET_SSE2 static unsigned int format_from_bgra_sse2(png_bytep data, unsigned int pixels, format_t format)
+{
+	png_bytep in = data;
+	png_bytep out = data;
+	unsigned int i;
+	for(i = 0; i + 8 <= pixels; i += 8, in += 32, out += 16) {
+		const __m128i v0 = _mm_loadu_si128((const __m128i*)in);
+		const __m128i v1 = _mm_loadu_si128((const __m128i*)(in + 16));
+		__m128i ret;
+		if(format == FORMAT_ARGB4444) {
+			ret = pack_lo16_sse2(bgra_to_argb4444_x4_sse2(v0), bgra_to_argb4444_x4_sse2(v1));
+		} else {
+			ret = pack_lo16_sse2(bgra_to_rgb565_x4_sse2(v0), bgra_to_rgb565_x4_sse2(v1));
+		}
+		_mm_storeu_si128((__m128i*)out, ret);
+	}
+	return i;
+}
+
+// Returns the number of handled pixels, and adds their alpha values to [sum].
+ANM_TARGET_SSE2 static unsigned int format_alpha_sum_sse2(png_bytep data, unsigned int pixels, format_t format, size_t &sum)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	unsigned int i = 0;
+	if(format == FORMAT_BGRA8888) {
+		for(; i + 4 <= pixels; i += 4, data += 16) {
+			const __m128i v = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)data), 24);
+			acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+		}
+	} else if(format == FORMAT_ARGB4444) {
+		for(; i + 8 <= pixels; i += 8, data += 16) {
+			const __m128i v = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)data), 12);
+			acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+		}
+	}
+	sum += (size_t)(
+		_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc))
+	);
+	return i;
+}
+/// ------------
 
 /// Blitting modes
 /// --------------
@@ -29,9 +259,16 @@ void blit_blend(png_byte *dst, const png_byte *rep, unsigned int pixels, format_
 	// flaw in the blending algorithm, which may decrease the alpha value even if
 	// both target and replacement pixels are fully opaque.
 	// (This also seems to be what the default composition mode in GIMP does.)
-	unsigned int i;
+	unsigned int i = 0;
 	if(format == FORMAT_BGRA8888) {
-		for(i = 0; i < pixels; ++i, dst += 4, rep += 4) {
+		if(ANM_SIMD.avx2) {
+			i = blend_bgra8888_avx2(dst, rep, pixels);
+		} else if(ANM_SIMD.sse2) {
+			i = blend_bgra8888_sse2(dst, rep, pixels);
+		}
+		dst += i * 4;
+		rep += i * 4;
+		for(; i < pixels; ++i, dst += 4, rep += 4) {
 			const int new_alpha = dst[3] + rep[3];
 			const int dst_alpha = 0xff - rep[3];
 
@@ -41,7 +278,12 @@ void blit_blend(png_byte *dst, const png_byte *rep, unsigned int pixels, format_
 			dst[3] = MIN(new_alpha, 0xff);
 		}
 	} else if(format == FORMAT_ARGB4444) {
-		for(i = 0; i < pixels; ++i, dst += 2, rep += 2) {
+		if(ANM_SIMD.sse2) {
+			i = blend_argb4444_sse2(dst, rep, pixels);
+		}
+		dst += i * 2;
+		rep += i * 2;
+		for(; i < pixels; ++i, dst += 2, rep += 2) {
 			const unsigned char rep_a = (rep[1] & 0xf0) >> 4;
 			const unsigned char rep_r = (rep[1] & 0x0f) >> 0;
 			const unsigned char rep_g = (rep[0] & 0xf0) >> 4;
@@ -179,13 +421,16 @@ png_byte format_alpha_max(format_t format)
 size_t format_alpha_sum(png_bytep data, unsigned int pixels, format_t format)
 {
 	size_t ret = 0;
-	unsigned int i;
+	unsigned int i = 0;
+	if(ANM_SIMD.sse2) {
+		i = format_alpha_sum_sse2(data, pixels, format, ret);
+	}
 	if(format == FORMAT_BGRA8888) {
-		for(i = 0; i < pixels; ++i, data += 4) {
+		for(data += i * 4; i < pixels; ++i, data += 4) {
 			ret += data[3];
 		}
 	} else if(format == FORMAT_ARGB4444) {
-		for(i = 0; i < pixels; ++i, data += 2) {
+		for(data += i * 2; i < pixels; ++i, data += 2) {
 			ret += (data[1] & 0xf0) >> 4;
 		}
 	}
@@ -194,12 +439,16 @@ size_t format_alpha_sum(png_bytep data, unsigned int pixels, format_t format)
 
 void format_from_bgra(png_bytep data, unsigned int pixels, format_t format)
 {
-	unsigned int i;
+	unsigned int i = 0;
 	png_bytep in = data;
 
+	if(ANM_SIMD.sse2 && (format == FORMAT_ARGB4444 || format == FORMAT_RGB565)) {
+		i = format_from_bgra_sse2(data, pixels, format);
+		in += i * 4;
+	}
 	if(format == FORMAT_ARGB4444) {
-		png_bytep out = data;
-		for(i = 0; i < pixels; ++i, in += 4, out += 2) {
+		png_bytep out = data + i * 2;
+		for(; i < pixels; ++i, in += 4, out += 2) {
 			// I don't see the point in doing any "rounding" here. Let's rather focus on
 			// writing understandable code independent of endianness assumptions.
 			const unsigned char b = in[0] >> 4;
@@ -211,8 +460,8 @@ void format_from_bgra(png_bytep data, unsigned int pixels, format_t format)
 			out[0] = (g << 4) | b;
 		}
 	} else if(format == FORMAT_RGB565) {
-		png_uint_16p out16 = (png_uint_16p)data;
-		for(i = 0; i < pixels; ++i, in += 4, ++out16) {
+		png_uint_16p out16 = (png_uint_16p)data + i;
+		for(; i < pixels; ++i, in += 4, ++out16) {
 			const unsigned char b = in[0] >> 3;
 			const unsigned char g = in[1] >> 2;
 			const unsigned char r = in[2] >> 3;
@@ -353,7 +602,58 @@ int sprite_patch(const sprite_patch_t &sp)
 /// -------------------
 logger_t header_mod_log("ANM header patching error");
 
-Option<BlitFunc_t> blitmode_parse(json_t *blitmode_j, const char *context, ...)
+static std::string mod_strf(const char *format, ...)
+{
+	va_list va;
+	va_start(va, format);
+	std::string ret(_vscprintf(format, va), '\0');
+	vsprintf(&ret[0], format, va);
+	va_end(va);
+	return ret;
+}
+
+void mod_errors_t::warn(std::string msg)
+{
+	msgs.emplace_back(std::move(msg));
+}
+
+void mod_errors_t::fail(std::string msg)
+{
+	msgs.emplace_back(std::move(msg));
+	fatal = true;
+}
+
+bool mod_errors_t::report() const
+{
+	for(const auto &msg : msgs) {
+		header_mod_log.errorf("%s", msg.c_str());
+	}
+	return fatal;
+}
+
+// Parses [key] as one of the numbers that json_object_numkey_get() would
+// have looked up.
+static bool mod_key_parse(const char *key, long long &num)
+{
+	char *endptr = nullptr;
+	num = strtoll(key, &endptr, 10);
+	if(endptr == key || endptr[0] != '\0') {
+		return false;
+	}
+	char key_str[DECIMAL_DIGITS_BOUND(num) + 1];
+	snprintf(key_str, sizeof(key_str), "%lld", num);
+	return !strcmp(key_str, key);
+}
+
+template <typename T> static const T* mod_find(const std::vector<T> &progs, size_t num)
+{
+	auto it = std::lower_bound(progs.begin(), progs.end(), num, [](const T &prog, size_t num) {
+		return prog.num < num;
+	});
+	return (it != progs.end() && it->num == num) ? &*it : nullptr;
+}
+
+Option<BlitFunc_t> blitmode_parse(mod_errors_t &errors, json_t *blitmode_j, const char *context, ...)
 {
 	if(!blitmode_j) {
 		return Option<BlitFunc_t>{};
@@ -382,65 +682,41 @@ Option<BlitFunc_t> blitmode_parse(json_t *blitmode_j, const char *context, ...)
 	size_t ctx_len = _vscprintf(context, va);
 	VLA(char, ctx, ctx_len + 1);
 	vsprintf(ctx, context, va);
-	header_mod_log.errorf(
+	errors.warn(mod_strf(
 		"%s: Invalid blitting mode. Must be one of the following:%s",
 		ctx, modes
-	);
+	));
 	VLA_FREE(ctx);
 	va_end(va);
 	VLA_FREE(modes);
 	return Option<BlitFunc_t>{};
 }
 
-script_mods_t entry_mods_t::script_mods(uint8_t *in, anm_offset_t &offset, uint32_t version)
+#define SCRIPT_MOD_ERROR(context, text) \
+	"{\"entries\"{\"%u\": {\"scripts\": {\"%d\"" context "}}}}: " text "%s"
+#define SCRIPT_MOD_ERROR_TAIL \
+	"\nIgnoring remaining script modifications for this entry..."
+
+static script_prog_t script_prog_compile(size_t entry_num, int32_t script_num, json_t *mod_j)
 {
-	script_mods_t ret = { num, offset.id };
+	script_prog_t ret;
+	ret.script_num = script_num;
 
+	// Any error discards all modifications of this script, rather than
+	// applying the ones that happened to come before.
 #define FAIL(context, text, ...) \
-	scripts = nullptr; \
-	header_mod_log.errorf( \
-		"{\"entries\"{\"%u\": {\"scripts\": {\"%d\"" context "}}}}: " text "%s", \
-		num, ret.script_num, ##__VA_ARGS__, \
-		"\nIgnoring remaining script modifications for this entry..." \
-	); \
+	ret.deletions.clear(); \
+	ret.changes.clear(); \
+	ret.errors.fail(mod_strf( \
+		SCRIPT_MOD_ERROR(context, text), \
+		entry_num, script_num, ##__VA_ARGS__, SCRIPT_MOD_ERROR_TAIL \
+	)); \
 	return ret;
 
-#define CHECK_LINE_NUMBER(context, ...) \
-	if(line_i >= ret.script.num_instrs) { \
-		FAIL( \
-			context, \
-			"Line number %u out of range, script only has %u instructions.", \
-			##__VA_ARGS__, (unsigned int)line_i, ret.script.num_instrs \
-		) \
-	}
-
-#define CHECK_LINE_NUMBER_AFTER_DELETIONS(context, ...) \
-	if(deletions_count == 0) { \
-		CHECK_LINE_NUMBER(context, ##__VA_ARGS__); \
-	} else if(line_i >= (ret.script.num_instrs - deletions_count)) { \
-		FAIL( \
-			context, \
-			"Line number %u out of range, script only has %u instructions after %u deletions.", \
-			##__VA_ARGS__, \
-			(unsigned int)line_i, \
-			ret.script.num_instrs - deletions_count, \
-			deletions_count \
-		) \
-	}
-
-	auto mod_j = json_object_numkey_get(scripts, ret.script_num);
-	if(!mod_j) {
-		return ret;
-	}
 	if(!json_is_object(mod_j)) {
 		FAIL("", "Must be a JSON object.");
 	}
 
-	auto first_instr = in + offset.offset;
-	(version == 0)
-		? ret.script.init((anm_instr0_t *)(first_instr))
-		: ret.script.init((anm_instr_t *)(first_instr));
-
 	auto deletions_j = json_object_get(mod_j, "deletions");
 	if(deletions_j && !json_is_array(deletions_j) && !json_is_integer(deletions_j)) {
 		FAIL(": {\"deletions\"}", "Must be a flexible JSON array of integers.");
@@ -456,25 +732,27 @@ script_mods_t entry_mods_t::script_mods(uint8_t *in, anm_offset_t &offset, uint3
 	for(decltype(deletions_count) i = 0; i < deletions_count; i++) {
 		auto line_j = json_flex_array_get(deletions_j, i);
 		auto line_i = json_integer_value(line_j);
-		if(!json_is_integer(line_j) || line_i < 0) {
+		if(!json_is_integer(line_j) || line_i < 0 || line_i > UINT_MAX) {
 			FAIL(": {\"deletions\"[%u]}", "Must be a positive JSON integer.", i);
 		}
-		CHECK_LINE_NUMBER(": {\"deletions\"[%u]}", i);
-		auto line = (unsigned int)line_i;
-		for(const auto &l : ret.deletions) {
-			if(l == line) {
-				FAIL(
-					": {\"deletions\"[%u]}",
-					"Duplicate deletion of line %u.",
-					i, l
-				);
-			}
-		}
-		ret.deletions.emplace_back(line);
+		ret.deletions.emplace_back(script_deletion_t{
+			(unsigned int)line_i, (unsigned int)i
+		});
 	}
-	// Make the line numbers relative to the previous deletion
-	for(decltype(deletions_count) i = 1; i < deletions_count; i++) {
-		ret.deletions[i] -= i;
+	std::sort(ret.deletions.begin(), ret.deletions.end(), [](
+		const script_deletion_t &a, const script_deletion_t &b
+	) {
+		return a.line < b.line;
+	});
+	for(size_t i = 1; i < ret.deletions.size(); i++) {
+		const auto &del = ret.deletions[i];
+		if(del.line == ret.deletions[i - 1].line) {
+			FAIL(
+				": {\"deletions\"[%u]}",
+				"Duplicate deletion of line %u.",
+				MAX(del.index, ret.deletions[i - 1].index), del.line
+			);
+		}
 	}
 
 	const char *key;
@@ -500,9 +778,10 @@ script_mods_t entry_mods_t::script_mods(uint8_t *in, anm_offset_t &offset, uint3
 		if(endptr != key_sep || line < 0) {
 			return fail_key_syntax();
 		}
-		unsigned int line_i = line;
-		CHECK_LINE_NUMBER_AFTER_DELETIONS(": {\"changes\": {\"%s\"}", key);
 
+		script_change_t change = {};
+		change.line = line;
+		change.key = key;
 		if(!strcmp(key_sep + 1, "time")) {
 			auto time = json_integer_value(val_j);
 			if(!json_is_integer(val_j) || (time < INT16_MIN) | (time > INT16_MAX)) {
@@ -511,12 +790,10 @@ script_mods_t entry_mods_t::script_mods(uint8_t *in, anm_offset_t &offset, uint3
 					key, INT16_MIN, INT16_MAX
 				);
 			}
-			ret.time_changes.emplace_back(script_time_change_t{
-				line_i - deletions_count, (uint16_t)time
-			});
+			change.time = (uint16_t)time;
 		} else {
 			auto addr = strtol(key_sep + 1, &endptr, 10);
-			if(endptr == (key_sep + 1) || endptr[0] != '\0' || addr < 0) {
+			if(endptr == (key_sep + 1) || endptr[0] != '\0' || addr < 0 || addr > UINT16_MAX) {
 				return fail_key_syntax();
 			}
 
@@ -528,83 +805,42 @@ script_mods_t entry_mods_t::script_mods(uint8_t *in, anm_offset_t &offset, uint3
 					key
 				);
 			}
-
-			auto param_length = ((ret.script).*(ret.script.param_length_of))(line_i);
-			if((size_t)addr > (param_length - code_size)) {
+			change.param_addr = (uint16_t)addr;
+			change.code.resize(code_size);
+			if(binhack_render(change.code.data(), 0, code)) {
 				FAIL(
-					": {\"changes\": {\"%s\"}",
-					"Address %u + binary hack of length %u exceeds the parameter length of line %u (%u).",
-					key, addr, code_size, line, param_length
+					": {\"changes\": {\"%s\"}", "Must be a binary hack string.",
+					key
 				);
 			}
-
-			ret.param_changes.emplace_back(script_param_change_t{
-				line_i - deletions_count, (uint16_t)addr, code, code_size
-			});
 		}
+		ret.changes.emplace_back(std::move(change));
 	}
+	std::stable_sort(ret.changes.begin(), ret.changes.end(), [](
+		const script_change_t &a, const script_change_t &b
+	) {
+		if(a.line != b.line) {
+			return a.line < b.line;
+		}
+		return a.time.is_none() && b.time.is_some();
+	});
 	return ret;
 
 #undef FAIL
 }
 
-void script_mods_t::apply_orig()
+static entry_prog_t entry_prog_compile(size_t num, json_t *mod_j)
 {
-#define LOG(text, ...) \
-	log_printf("(Header) Entry #%u, Script #%d: " text "\n", \
-		entry_num, script_num, ##__VA_ARGS__ \
-	);
-
-	for(size_t i = 0; i < deletions.size(); i++) {
-		decltype(i) line = deletions[i];
-		LOG("Deleting line %u", line + i);
-		((script).*(script.delete_line))(line);
-	}
-	for(size_t i = 0; i < param_changes.size(); i++) {
-		const auto &pc = param_changes[i];
-		VLA(uint8_t, code, pc.code_size);
-
-		// Should have failed in the size calculation already.
-		assert(binhack_render(code, 0, pc.code) == 0);
-
-		LOG(
-			"Changing parameter data at offset %u on line %u",
-			pc.param_addr, deletions.size() + pc.line
-		);
-		((script).*(script.apply_param_change))(
-			pc.line, pc.param_addr, code, pc.code_size
-		);
-		VLA_FREE(code);
-	}
-	for(const auto &tc : time_changes) {
-		LOG("Changing time on line %u", deletions.size() + tc.line);
-		((script).*(script.apply_time_change))(tc);
-	}
-
-#undef LOG
-}
-
-entry_mods_t header_mods_t::entry_mods()
-{
-	entry_mods_t ret;
-	if(!entries) {
-		return ret;
-	}
-
-	ret.num = entries_seen++;
+	entry_prog_t ret;
+	ret.num = num;
 
 #define FAIL(context, text) \
-	entries = nullptr; \
-	header_mod_log.errorf( \
-		"\"entries\"{\"%u\"%s}: %s%s", ret.num, context, text, \
+	ret.errors.fail(mod_strf( \
+		"\"entries\"{\"%u\"%s}: %s%s", num, context, text, \
 		"\nIgnoring remaining entry modifications for this file..." \
-	); \
+	)); \
 	return ret;
 
-	auto mod_j = json_object_numkey_get(entries, ret.num);
-	if(!mod_j) {
-		return ret;
-	}
 	if(!json_is_object(mod_j)) {
 		FAIL("", "Must be a JSON object.");
 	}
@@ -614,12 +850,14 @@ entry_mods_t header_mods_t::entry_mods()
 	if(name_j && !json_is_string(name_j)) {
 		FAIL(": {\"name\"}", "Must be a JSON string.");
 	}
-	ret.name = json_string_value(name_j);
+	if(name_j) {
+		ret.name = std::string(json_string_value(name_j));
+	}
 
 	// Blitting mode
 	auto blitmode_j = json_object_get(mod_j, "blitmode");
 	ret.blitmode = blitmode_parse(
-		blitmode_j, "\"entries\"{\"%u\": {\"blitmode\"}}", ret.num
+		ret.errors, blitmode_j, "\"entries\"{\"%u\": {\"blitmode\"}}", num
 	);
 
 	// Scripts
@@ -627,55 +865,50 @@ entry_mods_t header_mods_t::entry_mods()
 	if(scripts_j && !json_is_object(scripts_j)) {
 		FAIL(": {\"scripts\"}", "Must be a JSON object.");
 	}
-	ret.scripts = scripts_j;
-
+	const char *key;
+	json_t *script_j;
+	json_object_foreach(scripts_j, key, script_j) {
+		long long script_num;
+		if(
+			!mod_key_parse(key, script_num)
+			|| script_num < INT32_MIN || script_num > INT32_MAX
+		) {
+			continue;
+		}
+		ret.scripts.emplace_back(script_prog_compile(num, (int32_t)script_num, script_j));
+	}
+	std::sort(ret.scripts.begin(), ret.scripts.end(), [](
+		const script_prog_t &a, const script_prog_t &b
+	) {
+		return a.script_num < b.script_num;
+	});
 	return ret;
 
 #undef FAIL
 }
 
-void entry_mods_t::apply_ourdata(anm_entry_t &entry)
+static sprite_prog_t sprite_prog_compile(size_t num, json_t *mod_j)
 {
-	if(name) {
-		log_printf(
-			"(Header) Entry #%u: %s \xE2\x86\x92 %s\n",
-			num, entry.name, name
-		);
-		entry.name = name;
-	}
-}
-
-sprite_mods_t header_mods_t::sprite_mods()
-{
-	sprite_mods_t ret;
-	if(!sprites) {
-		return ret;
-	}
-
-	ret.num = sprites_seen++;
+	sprite_prog_t ret;
+	ret.num = num;
 
 #define FAIL(context, text, ...) \
-	sprites = nullptr; \
-	header_mod_log.errorf( \
+	ret.errors.fail(mod_strf( \
 		"\"sprites\"{\"%u\"%s}: " text "%s", \
-		ret.num, context, ##__VA_ARGS__, \
+		num, context, ##__VA_ARGS__, \
 		"\nIgnoring remaining sprite mods for this file..." \
-	);
-
-#define RETURN_FAIL(context, text, ...) \
-	FAIL(context, text, ##__VA_ARGS__); \
-	return false;
+	));
 
 	auto bounds_parse = [&](const char *context, const json_t *bounds_j) {
 		auto rect = json_xywh_value(bounds_j);
 		if(!rect.err.empty()) {
-			RETURN_FAIL(context, "(Bounds) %s", rect.err.c_str());
+			FAIL(context, "(Bounds) %s", rect.err.c_str());
+			return false;
 		}
 		ret.bounds = rect.v;
 		return true;
 	};
 
-	auto mod_j = json_object_numkey_get(sprites, ret.num);
 	if(json_is_object(mod_j)) {
 		auto bounds_j = json_object_get(mod_j, "bounds");
 		if(bounds_j) {
@@ -683,24 +916,177 @@ sprite_mods_t header_mods_t::sprite_mods()
 		}
 		auto blitmode_j = json_object_get(mod_j, "blitmode");
 		ret.blitmode = blitmode_parse(
-			blitmode_j, "\"sprites\"{\"%u\": {\"blitmode\"}}", ret.num
+			ret.errors, blitmode_j, "\"sprites\"{\"%u\": {\"blitmode\"}}", num
 		);
 	} else if(json_is_array(mod_j)) {
 		bounds_parse("", mod_j);
 	} else if(json_is_string(mod_j)) {
 		ret.blitmode = blitmode_parse(
-			mod_j, "\"sprites\"{\"%u\"}", ret.num
+			ret.errors, mod_j, "\"sprites\"{\"%u\"}", num
 		);
-	} else if(mod_j) {
+	} else {
 		FAIL("", "Invalid data type. See anm.hpp for documentation on ANM header patching.");
 	}
 	return ret;
 
-#undef RETURN_FAIL
 #undef FAIL
 }
 
-void sprite_mods_t::apply_orig(sprite_t &orig)
+static std::shared_ptr<const anm_prog_t> anm_prog_compile(json_t *patch)
+{
+	auto ret = std::make_shared<anm_prog_t>();
+
+	auto object_get = [&ret, patch] (const char *key) -> json_t* {
+		auto obj = json_object_get(patch, key);
+		if(obj && !json_is_object(obj)) {
+			ret->errors.warn(mod_strf("\"%s\" must be a JSON object.", key));
+			return nullptr;
+		}
+		return obj;
+	};
+
+	auto entries_j = object_get("entries");
+	auto sprites_j = object_get("sprites");
+
+	auto blitmode_j = json_object_get(patch, "blitmode");
+	auto blitmode_o = blitmode_parse(ret->errors, blitmode_j, "\"blitmode\"");
+	ret->blitmode = blitmode_o.unwrap_or(nullptr);
+
+	const char *key;
+	json_t *mod_j;
+	long long num;
+	json_object_foreach(entries_j, key, mod_j) {
+		if(mod_key_parse(key, num) && num >= 0) {
+			ret->entries.emplace_back(entry_prog_compile((size_t)num, mod_j));
+		}
+	}
+	json_object_foreach(sprites_j, key, mod_j) {
+		if(mod_key_parse(key, num) && num >= 0) {
+			ret->sprites.emplace_back(sprite_prog_compile((size_t)num, mod_j));
+		}
+	}
+	std::sort(ret->entries.begin(), ret->entries.end(), [](
+		const entry_prog_t &a, const entry_prog_t &b
+	) {
+		return a.num < b.num;
+	});
+	std::sort(ret->sprites.begin(), ret->sprites.end(), [](
+		const sprite_prog_t &a, const sprite_prog_t &b
+	) {
+		return a.num < b.num;
+	});
+	return ret;
+}
+
+// Compiled header patches, keyed by the resolved JSON they were compiled
+// from. Every entry holds a reference to its JSON, so that the address
+// can't be reused for a different object while the entry is alive.
+static std::unordered_map<json_t *, std::shared_ptr<const anm_prog_t>> anm_prog_cache;
+static SRWLOCK anm_prog_cache_srwlock = { SRWLOCK_INIT };
+
+// Drops all compiled patches whose JSON is no longer referenced by anyone
+// else. Must be called with the exclusive lock held.
+static void anm_prog_cache_sweep(void)
+{
+	for(auto it = anm_prog_cache.begin(); it != anm_prog_cache.end(); ) {
+		if(it->first->refcount == 1) {
+			json_decref(it->first);
+			it = anm_prog_cache.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+static void anm_prog_cache_clear(void)
+{
+	AcquireSRWLockExclusive(&anm_prog_cache_srwlock);
+	for(auto &it : anm_prog_cache) {
+		json_decref(it.first);
+	}
+	anm_prog_cache.clear();
+	ReleaseSRWLockExclusive(&anm_prog_cache_srwlock);
+}
+
+static std::shared_ptr<const anm_prog_t> anm_prog_get(json_t *patch)
+{
+	static const auto prog_empty = std::make_shared<const anm_prog_t>();
+	if(!patch) {
+		return prog_empty;
+	}
+
+	AcquireSRWLockShared(&anm_prog_cache_srwlock);
+	auto it = anm_prog_cache.find(patch);
+	if(it != anm_prog_cache.end()) {
+		auto ret = it->second;
+		ReleaseSRWLockShared(&anm_prog_cache_srwlock);
+		return ret;
+	}
+	ReleaseSRWLockShared(&anm_prog_cache_srwlock);
+
+	auto ret = anm_prog_compile(patch);
+
+	AcquireSRWLockExclusive(&anm_prog_cache_srwlock);
+	anm_prog_cache_sweep();
+	auto ins = anm_prog_cache.emplace(patch, ret);
+	if(ins.second) {
+		json_incref(patch);
+	} else {
+		ret = ins.first->second;
+	}
+	ReleaseSRWLockExclusive(&anm_prog_cache_srwlock);
+	return ret;
+}
+
+void entry_mods_t::script_mods(uint8_t *in, anm_offset_t &offset, uint32_t version)
+{
+	if(scripts_failed) {
+		return;
+	}
+	auto it = std::lower_bound(
+		prog->scripts.begin(), prog->scripts.end(), offset.id, [](
+			const script_prog_t &script, int32_t num
+		) {
+			return script.script_num < num;
+		}
+	);
+	if(it == prog->scripts.end() || it->script_num != offset.id) {
+		return;
+	}
+	if(it->errors.report()) {
+		scripts_failed = true;
+		return;
+	}
+	if(it->deletions.empty() && it->changes.empty()) {
+		return;
+	}
+
+	script_t script;
+	auto first_instr = in + offset.offset;
+	(version == 0)
+		? script.init((anm_instr0_t *)(first_instr))
+		: script.init((anm_instr_t *)(first_instr));
+
+	if(!(script.*(script.check))(prog->num, *it)) {
+		scripts_failed = true;
+		return;
+	}
+	(script.*(script.apply))(prog->num, *it);
+}
+
+void entry_mods_t::apply_ourdata(anm_entry_t &entry)
+{
+	if(prog->name.is_some()) {
+		const auto &name = prog->name.unwrap();
+		log_printf(
+			"(Header) Entry #%u: %s \xE2\x86\x92 %s\n",
+			prog->num, entry.name, name.c_str()
+		);
+		entry.name = name.c_str();
+	}
+}
+
+void sprite_prog_t::apply_orig(sprite_t &orig) const
 {
 	if(bounds.is_some()) {
 		const auto &b = bounds.unwrap();
@@ -717,22 +1103,42 @@ void sprite_mods_t::apply_orig(sprite_t &orig)
 	}
 }
 
-header_mods_t::header_mods_t(json_t *patch)
+static const entry_prog_t ENTRY_PROG_NONE = {};
+static const sprite_prog_t SPRITE_PROG_NONE = {};
+
+entry_mods_t header_mods_t::entry_mods()
 {
-	auto object_get = [this, patch] (const char *key) -> json_t* {
-		auto ret = json_object_get(patch, key);
-		if(ret && !json_is_object(ret)) {
-			return header_mod_log.errorf("\"%s\" must be a JSON object.", key);
-		}
+	entry_mods_t ret = { &ENTRY_PROG_NONE };
+	auto num = entries_seen++;
+	if(entries_failed) {
 		return ret;
-	};
+	}
+	auto *ent_p = mod_find(prog->entries, num);
+	if(ent_p) {
+		ret.prog = ent_p;
+		entries_failed = ent_p->errors.report();
+	}
+	return ret;
+}
 
-	entries = object_get("entries");
-	sprites = object_get("sprites");
+const sprite_prog_t& header_mods_t::sprite_mods()
+{
+	auto num = sprites_seen++;
+	if(sprites_failed) {
+		return SPRITE_PROG_NONE;
+	}
+	auto *spr_p = mod_find(prog->sprites, num);
+	if(!spr_p) {
+		return SPRITE_PROG_NONE;
+	}
+	sprites_failed = spr_p->errors.report();
+	return *spr_p;
+}
 
-	auto blitmode_j = json_object_get(patch, "blitmode");
-	auto blitmode_o = blitmode_parse(blitmode_j, "\"blitmode\"");
-	blitmode = blitmode_o.unwrap_or(nullptr);
+header_mods_t::header_mods_t(json_t *patch)
+	: prog(anm_prog_get(patch))
+{
+	prog->errors.report();
 }
 /// -------------------
 
@@ -769,66 +1175,136 @@ inline anm_instr_t* instr_next(anm_instr_t *instr)
 	return (anm_instr_t*)((char *)instr + instr->length);
 }
 
-template <typename T> T* script_t::_instr_at_line(unsigned int line)
+template <typename T> bool script_t::_check(size_t entry_num, const script_prog_t &prog)
 {
-	assert(line < num_instrs);
+#define FAIL(context, text, ...) \
+	header_mod_log.errorf( \
+		SCRIPT_MOD_ERROR(context, text), \
+		entry_num, prog.script_num, ##__VA_ARGS__, SCRIPT_MOD_ERROR_TAIL \
+	); \
+	return false;
+
+	auto del = prog.deletions.begin();
+	auto change = prog.changes.begin();
 	auto instr = (T *)first_instr;
-	unsigned int i = 0;
-	while(i < line) {
-		instr = instr_next(instr);
-		i++;
+	for(unsigned int line = 0; line < num_instrs; line++) {
+		auto instr_after = instr_next(instr);
+		bool deleted = (del != prog.deletions.end()) && (del->line == line);
+		if(deleted) {
+			del++;
+		}
+		for(; (change != prog.changes.end()) && (change->line == line); change++) {
+			if(deleted) {
+				FAIL(
+					": {\"changes\": {\"%s\"}", "Line %u is deleted.",
+					change->key.c_str(), line
+				);
+			}
+			if(change->time.is_some()) {
+				continue;
+			}
+			auto param_length = ((uint8_t *)instr_after - (uint8_t *)instr) - sizeof(T);
+			if((change->param_addr + change->code.size()) > param_length) {
+				FAIL(
+					": {\"changes\": {\"%s\"}",
+					"Address %u + binary hack of length %u exceeds the parameter length of line %u (%u).",
+					change->key.c_str(), change->param_addr, change->code.size(), line, param_length
+				);
+			}
+		}
+		instr = instr_after;
 	}
-	return instr;
-}
+	if(del != prog.deletions.end()) {
+		FAIL(
+			": {\"deletions\"[%u]}",
+			"Line number %u out of range, script only has %u instructions.",
+			del->index, del->line, num_instrs
+		);
+	}
+	if(change != prog.changes.end()) {
+		FAIL(
+			": {\"changes\": {\"%s\"}",
+			"Line number %u out of range, script only has %u instructions.",
+			change->key.c_str(), change->line, num_instrs
+		);
+	}
+	return true;
 
-template <typename T> uint16_t script_t::_param_length_of(unsigned int line)
-{
-	auto instr = _instr_at_line<T>(line);
-	auto instr_diff = ((uint8_t *)instr_next(instr) - (uint8_t *)instr);
-	return (uint16_t)(instr_diff - sizeof(T));
+#undef FAIL
 }
 
-template <typename T> void script_t::_delete_line(unsigned int line)
+template <typename T> void script_t::_apply(size_t entry_num, const script_prog_t &prog)
 {
-	auto instr = _instr_at_line<T>(line);
-	auto instr_after = instr_next(instr);
-	size_t bytes_removed = (uint8_t *)instr_after - (uint8_t *)instr;
-	memmove(instr, instr_after, after_last - (uint8_t *)instr_after);
-	after_last -= bytes_removed;
-	instr_make_last((T *)after_last);
-	num_instrs--;
-}
+#define LOG(text, ...) \
+	log_printf("(Header) Entry #%u, Script #%d: " text "\n", \
+		entry_num, prog.script_num, ##__VA_ARGS__ \
+	);
 
-template <typename T> void script_t::_apply_time_change(script_time_change_t change)
-{
-	auto instr = _instr_at_line<T>(change.line);
-	instr->time = change.time;
-}
+	// Deleted instructions are skipped while moving every remaining one
+	// to its final position, so that each byte is moved at most once.
+	auto del = prog.deletions.begin();
+	auto change = prog.changes.begin();
+	auto instr = (T *)first_instr;
+	auto out = first_instr;
+	for(unsigned int line = 0; line < num_instrs; line++) {
+		auto instr_after = instr_next(instr);
+		size_t instr_len = (uint8_t *)instr_after - (uint8_t *)instr;
+		if((del != prog.deletions.end()) && (del->line == line)) {
+			LOG("Deleting line %u", line);
+			del++;
+			instr = instr_after;
+			continue;
+		}
+		if(out != (uint8_t *)instr) {
+			memmove(out, instr, instr_len);
+		}
+		auto instr_out = (T *)out;
+		for(; (change != prog.changes.end()) && (change->line == line); change++) {
+			if(change->time.is_some()) {
+				LOG("Changing time on line %u", line);
+				instr_out->time = change->time.unwrap();
+			} else {
+				LOG(
+					"Changing parameter data at offset %u on line %u",
+					change->param_addr, line
+				);
+				memcpy(
+					instr_out->data + change->param_addr,
+					change->code.data(), change->code.size()
+				);
+			}
+		}
+		out += instr_len;
+		instr = instr_after;
+	}
+	if(out != (uint8_t *)instr) {
+		// Move the terminating instruction, and terminate the freed
+		// space after it as well.
+		size_t last_len = (uint8_t *)instr_next(instr) - (uint8_t *)instr;
+		memmove(out, instr, last_len);
+		instr_make_last((T *)(out + last_len));
+	}
+	num_instrs -= prog.deletions.size();
 
-template <typename T> void script_t::_apply_param_change(
-	unsigned int line, uint16_t param_addr,
-	const uint8_t *code, size_t code_size
-)
-{
-	auto instr = _instr_at_line<T>(line);
-	memcpy(instr->data + param_addr, code, code_size);
+#undef LOG
 }
 
 template <typename T> void script_t::init(T *first)
 {
 	auto instr = first;
+	num_instrs = 0;
 	while(instr_is_last(instr) == false) {
 		num_instrs++;
 		instr = instr_next(instr);
 	}
 	first_instr = (uint8_t *)first;
-	after_last = (uint8_t *)instr_next(instr);
-	param_length_of = &script_t::_param_length_of<T>;
-	delete_line = &script_t::_delete_line<T>;
-	apply_time_change = &script_t::_apply_time_change<T>;
-	apply_param_change = &script_t::_apply_param_change<T>;
+	check = &script_t::_check<T>;
+	apply = &script_t::_apply<T>;
 }
 
+#undef SCRIPT_MOD_ERROR_TAIL
+#undef SCRIPT_MOD_ERROR
+
 #define ANM_ENTRY_FILTER(in, type) \
 	type *header = (type *)in; \
 	version = header->version; \
@@ -856,7 +1332,7 @@ int anm_entry_init(header_mods_t &hdr_m, anm_entry_t &entry, BYTE *in, json_t *p
 
 	anm_entry_clear(entry);
 	auto ent_m = hdr_m.entry_mods();
-	auto entry_blitmode = ent_m.blitmode.unwrap_or(hdr_m.blitmode);
+	auto entry_blitmode = ent_m.prog->blitmode.unwrap_or(hdr_m.prog->blitmode);
 	if(game_id >= TH11) {
 		ANM_ENTRY_FILTER(in, anm_header11_t);
 		entry.x = header->x;
@@ -891,7 +1367,7 @@ int anm_entry_init(header_mods_t &hdr_m, anm_entry_t &entry, BYTE *in, json_t *p
 			// to not mess up its internal counter! Which is why we have
 			// to duplicate the condition from above, not only to keep
 			// that one sprite moddable for the game itself.
-			auto spr_m = hdr_m.sprite_mods();
+			const auto &spr_m = hdr_m.sprite_mods();
 			spr_m.apply_orig(*s_orig);
 
 			auto blitmode = spr_m.blitmode.unwrap_or(entry_blitmode);
@@ -915,7 +1391,7 @@ int anm_entry_init(header_mods_t &hdr_m, anm_entry_t &entry, BYTE *in, json_t *p
 		in + headersize + sprite_orig_num * sizeof(uint32_t)
 	);
 	for(size_t i = 0; i < script_num; i++) {
-		ent_m.script_mods(in, script_offsets[i], version).apply_orig();
+		ent_m.script_mods(in, script_offsets[i], version);
 	}
 	ent_m.apply_ourdata(entry);
 	return 0;
@@ -937,61 +1413,426 @@ void anm_entry_clear(anm_entry_t &entry)
 }
 /// -------------
 
-int patch_png_load_for_thtx(png_image_ex &image, const patch_t *patch_info, const char *fn, thtx_header_t *thtx)
+struct png_mem_reader_t {
+	const png_byte *p;
+	size_t left;
+};
+
+static void png_mem_read(png_structp png, png_bytep out, png_size_t len)
+{
+	auto *reader = (png_mem_reader_t *)png_get_io_ptr(png);
+	if(len > reader->left) {
+		png_error(png, "unexpected end of file");
+	}
+	memcpy(out, reader->p, len);
+	reader->p += len;
+	reader->left -= len;
+}
+
+// Decodes only the first [rows] rows of a PNG to BGRA, stopping libpng once
+// all of them have been read. This only works for the non-interlaced, 8-bit,
+// sRGB images that make up the vast majority of patch images, for which the
+// result is identical to what the simplified API produces.
+// Returns 0 on success, -1 if the image has to go through the simplified
+// API instead, and 1 on decoding errors.
+static int png_load_rows_bgra(png_image_ex &image, const void *file_buffer, size_t file_size, png_uint_32 *rows)
+{
+	png_mem_reader_t reader = { (const png_byte *)file_buffer, file_size };
+	png_structp png = NULL;
+	png_infop info = NULL;
+	volatile int ret = 1;
+
+	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if(png) {
+		info = png_create_info_struct(png);
+	}
+	if(!info) {
+		png_destroy_read_struct(&png, NULL, NULL);
+		return -1;
+	}
+	if(!setjmp(png_jmpbuf(png))) {
+		png_uint_32 w, h;
+		int bit_depth, color_type, interlace;
+
+		png_set_read_fn(png, &reader, png_mem_read);
+		png_read_info(png, info);
+		png_get_IHDR(png, info, &w, &h, &bit_depth, &color_type, &interlace, NULL, NULL);
+		// The simplified API would only apply a gamma correction for values
+		// that are significantly different from sRGB's 1/2.2.
+		const png_fixed_point gamma_srgb = 45455;
+		png_fixed_point gamma = gamma_srgb;
+		png_get_gAMA_fixed(png, info, &gamma);
+		if(
+			interlace != PNG_INTERLACE_NONE || bit_depth > 8
+			|| png_get_valid(png, info, PNG_INFO_iCCP)
+			|| gamma < gamma_srgb - 1000 || gamma > gamma_srgb + 1000
+		) {
+			ret = -1;
+		} else {
+			png_set_expand(png);
+			if(color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+				png_set_gray_to_rgb(png);
+			}
+			png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+			png_set_bgr(png);
+			png_read_update_info(png, info);
+			if(png_get_rowbytes(png, info) != w * 4) {
+				ret = -1;
+			} else {
+				const png_uint_32 rows_read = (*rows && *rows < h) ? *rows : h;
+				image.img.width = w;
+				image.img.height = rows_read;
+				image.img.format = PNG_FORMAT_BGRA;
+				image.buf = (png_bytep)buffer_pool_alloc((size_t)w * 4 * rows_read);
+				if(image.buf) {
+					for(png_uint_32 y = 0; y < rows_read; y++) {
+						png_read_row(png, image.buf + (size_t)y * w * 4, NULL);
+					}
+					*rows = h;
+					ret = 0;
+				}
+			}
+		}
+	} else {
+		buffer_pool_free(image.buf);
+		image.buf = NULL;
+	}
+	png_destroy_read_struct(&png, &info, NULL);
+	return ret;
+}
+
+// Same as png_load_rows_bgra(), but through thcrap's own decoder, which
+// skips libpng entirely for 8-bit RGB and RGBA images.
+static int png_load_rows_fast(png_image_ex &image, const void *file_buffer, size_t file_size, png_uint_32 *rows)
+{
+	png_decode_t dec;
+	const unsigned int flags = PNG_DECODE_ADD_ALPHA | PNG_DECODE_BGR | PNG_DECODE_SRGB_ONLY;
+	if(png_decode_begin(&dec, file_buffer, file_size, flags)) {
+		return -1;
+	}
+	int ret = -1;
+	const png_uint_32 rows_read = (*rows && *rows < dec.height) ? *rows : dec.height;
+	const size_t stride = (size_t)dec.width * 4;
+	image.buf = (png_bytep)buffer_pool_alloc(stride * rows_read);
+	if(image.buf && !png_decode_rows(&dec, image.buf, stride, rows_read)) {
+		image.img.width = dec.width;
+		image.img.height = rows_read;
+		image.img.format = PNG_FORMAT_BGRA;
+		*rows = dec.height;
+		ret = 0;
+	} else {
+		buffer_pool_free(image.buf);
+		image.buf = NULL;
+	}
+	png_decode_end(&dec);
+	return ret;
+}
+
+// Copies the first rows of a pre-converted raw image, which is already in
+// BGRA or at least BGR.
+static int png_load_rows_raw(png_image_ex &image, const void *file_buffer, size_t file_size, png_uint_32 *rows)
+{
+	const raw_image_header_t *raw = raw_image_header(file_buffer, file_size);
+	if(!raw) {
+		return -1;
+	}
+	const png_uint_32 rows_read = (*rows && *rows < raw->height) ? *rows : raw->height;
+	const size_t stride = (size_t)raw->width * 4;
+	image.buf = (png_bytep)buffer_pool_alloc(stride * rows_read);
+	if(!image.buf || raw_image_rows(file_buffer, file_size, image.buf, stride, rows_read, RAW_IMAGE_ADD_ALPHA)) {
+		buffer_pool_free(image.buf);
+		image.buf = NULL;
+		return 1;
+	}
+	image.img.width = raw->width;
+	image.img.height = rows_read;
+	image.img.format = PNG_FORMAT_BGRA;
+	*rows = raw->height;
+	return 0;
+}
+
+// Decoders for the first rows of a PNG in BGRA, tried in order. Each one
+// returns -1 to pass the image on to the next one, and the simplified API
+// handles everything that none of them supports.
+typedef int (*png_rows_decoder_t)(png_image_ex &image, const void *file_buffer, size_t file_size, png_uint_32 *rows);
+
+static const png_rows_decoder_t PNG_ROWS_DECODERS[] = {
+	png_load_rows_raw,
+	png_load_rows_fast,
+	png_load_rows_bgra,
+};
+
+int patch_png_load_for_thtx(png_image_ex &image, const patch_t *patch_info, const char *fn, thtx_header_t *thtx, png_uint_32 *rows)
 {
 	void *file_buffer = NULL;
 	size_t file_size;
+	png_uint_32 rows_wanted = rows ? *rows : 0;
 
 	if(!thtx) {
 		return -1;
 	}
 
-	SAFE_FREE(image.buf);
+	buffer_pool_free(image.buf);
+	image.buf = NULL;
 	png_image_free(&image.img);
 	ZeroMemory(&image.img, sizeof(png_image));
 	image.img.version = PNG_IMAGE_VERSION;
 
-	file_buffer = patch_file_load(patch_info, fn, &file_size);
+	// Raw images are always BGR(A), so formats that aren't converted from
+	// BGRA still need the PNG.
+	const png_uint_32 png_format = format_png_equiv((format_t)thtx->format);
+	if(png_format == PNG_FORMAT_BGRA) {
+		file_buffer = raw_image_load(patch_info, fn, &file_size);
+	}
+	if(!file_buffer) {
+		file_buffer = patch_file_load(patch_info, fn, &file_size);
+	}
 	if(!file_buffer) {
 		return 2;
 	}
 
-	if(png_image_begin_read_from_memory(&image.img, file_buffer, file_size)) {
-		image.img.format = format_png_equiv((format_t)thtx->format);
+	// Only the rows that will actually be blitted need to be decoded and
+	// converted. Since format_from_bgra() works in place and front to back,
+	// converting the first n rows gives exactly the first n rows of the
+	// fully converted image.
+	int ret_rows = -1;
+	if(png_format == PNG_FORMAT_BGRA) {
+		for(const auto &decoder : PNG_ROWS_DECODERS) {
+			ret_rows = decoder(image, file_buffer, file_size, &rows_wanted);
+			if(ret_rows != -1) {
+				break;
+			}
+		}
+	}
+	if(ret_rows == -1 && png_image_begin_read_from_memory(&image.img, file_buffer, file_size)) {
+		image.img.format = png_format;
 		if(image.img.format != PNG_FORMAT_INVALID) {
 			size_t png_size = PNG_IMAGE_SIZE(image.img);
-			image.buf = (png_bytep)malloc(png_size);
+			image.buf = (png_bytep)buffer_pool_alloc(png_size);
 
 			if(image.buf) {
 				png_image_finish_read(&image.img, 0, image.buf, 0, NULL);
 			}
 		}
+		rows_wanted = image.img.height;
 	}
 	SAFE_FREE(file_buffer);
 	if(image.buf) {
 		unsigned int pixels = image.img.width * image.img.height;
 		format_from_bgra(image.buf, pixels, (format_t)thtx->format);
 	}
+	if(rows) {
+		// Full height of the image
+		*rows = rows_wanted;
+	}
 	return !image.buf;
 }
 
+/// Decoded PNG cache
+/// -----------------
+/**
+  * Many ANM files reference the same PNG multiple times, and games reload
+  * their ANMs on every stage or menu transition. Decoding and converting a
+  * PNG is by far the most expensive part of ANM patching, so the converted
+  * pixel buffers are kept around, keyed by patch, patch-relative file name
+  * and THTX format, and evicted in least-recently-used order whenever the
+  * shared cache manager asks for memory. Entries are reference-counted, so
+  * an eviction never frees a buffer that is currently being blitted.
+  */
+
+// Images larger than this fraction of the shared cache budget are never
+// cached, since they would push out everything else.
+#define PNG_CACHE_ENTRY_MAX(budget) ((budget) / 4)
+
+struct png_cache_entry_t {
+	std::string key;
+	// Lowercased with forward slashes, matched against repatched files.
+	std::string fn;
+	// Only the first [image.img.height] rows are decoded, out of [height].
+	png_image_ex image;
+	png_uint_32 height;
+	size_t size;
+	// One for the cache itself, one for every current user.
+	volatile LONG refs;
+};
+
+static std::list<png_cache_entry_t *> png_cache_lru;
+static std::unordered_map<std::string, std::list<png_cache_entry_t *>::iterator> png_cache;
+static size_t png_cache_size = 0;
+static SRWLOCK png_cache_srwlock = { SRWLOCK_INIT };
+static cache_mgr_entry_t *png_cache_mgr = NULL;
+
+static std::string png_cache_fn(const char *fn)
+{
+	std::string ret = fn;
+	for(auto &c : ret) {
+		if(c == '\\') {
+			c = '/';
+		} else if(c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		}
+	}
+	return ret;
+}
+
+static void png_cache_release(png_cache_entry_t *entry)
+{
+	if(entry && InterlockedDecrement(&entry->refs) == 0) {
+		memstats_remove(MEMSTATS_IMAGE, entry->size);
+		buffer_pool_free(entry->image.buf);
+		delete entry;
+	}
+}
+
+// Removes [it] from the cache. Must be called with [png_cache_srwlock] held.
+static void png_cache_unlink(std::list<png_cache_entry_t *>::iterator it)
+{
+	png_cache_entry_t *entry = *it;
+	png_cache_size -= entry->size;
+	cache_mgr_remove(png_cache_mgr, entry->size);
+	png_cache.erase(entry->key);
+	png_cache_lru.erase(it);
+	png_cache_release(entry);
+}
+
+static size_t png_cache_evict(size_t bytes)
+{
+	size_t ret = 0;
+	AcquireSRWLockExclusive(&png_cache_srwlock);
+	while(ret < bytes && !png_cache_lru.empty()) {
+		auto it = std::prev(png_cache_lru.end());
+		ret += (*it)->size;
+		png_cache_unlink(it);
+	}
+	ReleaseSRWLockExclusive(&png_cache_srwlock);
+	return ret;
+}
+
+// Returns a new reference to the converted image for [fn] in [patch_info],
+// with at least the first [rows] rows decoded, loading it if necessary, or
+// nullptr if there is no such usable image.
+static png_cache_entry_t* png_cache_get(const patch_t *patch_info, const char *fn, thtx_header_t *thtx, png_uint_32 rows)
+{
+	std::string key = patch_info->archive;
+	key += '\n';
+	key += fn;
+	key += '\n';
+	key += std::to_string(thtx->format);
+
+	// Decoding is by far the most expensive thing any cache saves.
+	static cache_mgr_entry_t *mgr = png_cache_mgr = cache_mgr_register("Decoded PNGs", 8, png_cache_evict);
+	(void)mgr;
+
+	AcquireSRWLockExclusive(&png_cache_srwlock);
+	auto it = png_cache.find(key);
+	bool partial = false;
+	if(it != png_cache.end()) {
+		png_cache_entry_t *ret = *it->second;
+		partial = ret->image.img.height < MIN(rows, ret->height);
+		if(!partial) {
+			png_cache_lru.splice(png_cache_lru.begin(), png_cache_lru, it->second);
+			cache_mgr_touch(png_cache_mgr);
+			InterlockedIncrement(&ret->refs);
+			ReleaseSRWLockExclusive(&png_cache_srwlock);
+			return ret;
+		}
+	}
+	ReleaseSRWLockExclusive(&png_cache_srwlock);
+
+	// If a previous user needed fewer rows, chances are that further ones
+	// will need even more, so the image is decoded in full this time.
+	png_uint_32 height = partial ? 0 : rows;
+	auto *entry = new png_cache_entry_t{ key, png_cache_fn(fn), {}, 0, 0, 1 };
+	if(patch_png_load_for_thtx(entry->image, patch_info, fn, thtx, &height)) {
+		buffer_pool_free(entry->image.buf);
+		delete entry;
+		return nullptr;
+	}
+	// The decoded pixels are all we need.
+	png_image_free(&entry->image.img);
+	entry->height = height;
+	entry->size = (size_t)entry->image.img.width * entry->image.img.height * PNG_IMAGE_PIXEL_SIZE(entry->image.img.format);
+	memstats_add(MEMSTATS_IMAGE, entry->size);
+	const size_t budget = cache_mgr_budget();
+	if(budget && entry->size > PNG_CACHE_ENTRY_MAX(budget)) {
+		return entry;
+	}
+
+	AcquireSRWLockExclusive(&png_cache_srwlock);
+	it = png_cache.find(key);
+	if(it != png_cache.end() && (*it->second)->image.img.height < entry->image.img.height) {
+		png_cache_unlink(it->second);
+		it = png_cache.end();
+	}
+	if(it == png_cache.end()) {
+		InterlockedIncrement(&entry->refs);
+		png_cache_lru.push_front(entry);
+		png_cache.emplace(key, png_cache_lru.begin());
+		png_cache_size += entry->size;
+		cache_mgr_add(png_cache_mgr, entry->size);
+	}
+	ReleaseSRWLockExclusive(&png_cache_srwlock);
+	cache_mgr_trim();
+	return entry;
+}
+
+extern "C" __declspec(dllexport) void anm_mod_repatch(json_t *files_changed)
+{
+	std::unordered_set<std::string> changed;
+	const char *fn;
+	json_t *val;
+	json_object_foreach(files_changed, fn, val) {
+		std::string key = png_cache_fn(fn);
+		// Raw images are cached under the name of the PNG they replace.
+		const size_t ext_len = strlen(RAW_IMAGE_EXT);
+		if(key.size() > ext_len && !key.compare(key.size() - ext_len, ext_len, RAW_IMAGE_EXT)) {
+			changed.insert(key.substr(0, key.size() - ext_len) + ".png");
+		}
+		changed.insert(std::move(key));
+	}
+	AcquireSRWLockExclusive(&png_cache_srwlock);
+	for(auto it = png_cache_lru.begin(); it != png_cache_lru.end(); ) {
+		auto cur = it++;
+		if(changed.count((*cur)->fn)) {
+			png_cache_unlink(cur);
+		}
+	}
+	ReleaseSRWLockExclusive(&png_cache_srwlock);
+}
+
+extern "C" __declspec(dllexport) void anm_mod_exit(void)
+{
+	anm_prog_cache_clear();
+	AcquireSRWLockExclusive(&png_cache_srwlock);
+	while(!png_cache_lru.empty()) {
+		png_cache_unlink(png_cache_lru.begin());
+	}
+	ReleaseSRWLockExclusive(&png_cache_srwlock);
+}
+/// -----------------
+
 // Helper function for stack_game_png_apply.
 int patch_png_apply(anm_entry_t &entry, const patch_t *patch_info, const char *fn)
 {
 	int ret = -1;
-	if(patch_info && fn) {
-		png_image_ex png = {};
-		ret = patch_png_load_for_thtx(png, patch_info, fn, entry.thtx);
-		if(!ret && png.buf) {
+	if(patch_info && fn && entry.thtx) {
+		// Rows below the lowest sprite are never blitted. (0 = all rows)
+		png_uint_32 rows = 0;
+		for(const auto &sprite : entry.sprites) {
+			rows = MAX(rows, entry.y + sprite.y + sprite.h);
+		}
+		png_cache_entry_t *png = png_cache_get(patch_info, fn, entry.thtx, rows);
+		ret = png ? 0 : 2;
+		if(png) {
 			for(const auto &sprite : entry.sprites) {
 				sprite_patch_t sp;
-				if(!sprite_patch_set(sp, entry, sprite, png)) {
+				if(!sprite_patch_set(sp, entry, sprite, png->image)) {
 					sprite_patch(sp);
 				}
 			}
 			patch_print_fn(patch_info, fn);
 		}
-		SAFE_FREE(png.buf);
+		png_cache_release(png);
 	}
 	return ret;
 }
@@ -1001,22 +1842,73 @@ int stack_game_png_apply(anm_entry_t &entry)
 	int ret = -1;
 	if(entry.thtx && entry.name) {
 		stack_chain_iterate_t sci = {};
-		char **chain = resolve_chain_game(entry.name);
+		chain_buf_t chain;
+		resolve_chain_game_build(chain, entry.name);
 		ret = 0;
-		if(chain && chain[0]) {
-			log_printf("(PNG) Resolving %s... ", chain[0]);
+		if(chain.get() && chain.get()[0]) {
+			log_printf("(PNG) Resolving %s... ", chain.get()[0]);
 		}
-		while(stack_chain_iterate(&sci, chain, SCI_FORWARDS)) {
+		while(stack_chain_iterate(&sci, chain.get(), SCI_FORWARDS)) {
 			if(!patch_png_apply(entry, sci.patch_info, sci.fn)) {
 				ret = 1;
 			}
 		}
 		log_printf(ret ? "\n" : "not found\n");
-		free(chain);
 	}
 	return ret;
 }
 
+/// Entry patching
+/// --------------
+/**
+  * Distinct ANM entries always have distinct THTX buffers, so the expensive
+  * part of ANM patching (resolving, decoding and blitting the replacement
+  * PNGs) is distributed across the task workers once an ANM has enough
+  * entries. The log output of every entry is captured and printed in entry
+  * order afterwards, so it looks exactly like it would with a single thread.
+  */
+#define ANM_PATCH_MIN_PER_WORKER 2
+
+static void anm_entry_patch(anm_entry_t &entry)
+{
+	// Do the patching, unless we've done it before
+	std::string thtx_key;
+	if(!thtx_cache_load(entry, thtx_key)) {
+		if(stack_game_png_apply(entry) > 0 && !thtx_key.empty()) {
+			thtx_cache_store(entry, thtx_key);
+		}
+	}
+}
+
+static void anm_entries_patch(std::vector<anm_entry_t> &entries)
+{
+	const size_t max_threads = entries.size() / ANM_PATCH_MIN_PER_WORKER;
+	if(max_threads <= 1) {
+		for(auto &entry : entries) {
+			anm_entry_patch(entry);
+		}
+		return;
+	}
+
+	// The loading thread helps out, and takes care of everything by itself
+	// if all workers are busy.
+	std::vector<std::string> logs(entries.size());
+	parallel_for(entries.size(), max_threads, [&entries, &logs](size_t i) {
+		size_t log_len = 0;
+		log_capture_begin();
+		anm_entry_patch(entries[i]);
+		char *log = log_capture_end(&log_len);
+		if(log) {
+			logs[i].assign(log, log_len);
+			free(log);
+		}
+	});
+	for(const auto &log : logs) {
+		log_nprint(log.c_str(), log.size());
+	}
+}
+/// --------------
+
 int patch_anm(void *file_inout, size_t size_out, size_t size_in, const char *fn, json_t *patch)
 {
 	(void)fn;
@@ -1029,12 +1921,14 @@ int patch_anm(void *file_inout, size_t size_out, size_t size_in, const char *fn,
 	anm_entry_t entry = {};
 	png_image_ex png = {};
 	png_image_ex bounds = {};
+	std::vector<anm_entry_t> entries;
 
 	auto *anm_entry_out = (uint8_t *)file_inout;
 	auto *endptr = (uint8_t *)(file_inout) + size_in;
 
 	log_printf("---- ANM ----\n");
 
+	// First collect all entries, generating the bounds on the way...
 	while(anm_entry_out && anm_entry_out < endptr) {
 		if(anm_entry_init(hdr_m, entry, anm_entry_out, patch)) {
 			log_printf("Corrupt ANM file or format definition, aborting ...\n");
@@ -1052,8 +1946,9 @@ int patch_anm(void *file_inout, size_t size_out, size_t size_in, const char *fn,
 			for(const auto &sprite : entry.sprites) {
 				bounds_draw_rect(bounds, entry.x, entry.y, sprite);
 			}
-			// Do the patching
-			stack_game_png_apply(entry);
+			if(entry.thtx) {
+				entries.push_back(entry);
+			}
 		}
 		if(!entry.next) {
 			bounds_store(name_prev, bounds);
@@ -1064,6 +1959,9 @@ int patch_anm(void *file_inout, size_t size_out, size_t size_in, const char *fn,
 	png_image_clear(bounds);
 	png_image_clear(png);
 
+	// ...then do the patching.
+	anm_entries_patch(entries);
+
 	log_printf("-------------\n");
 	return 1;
 }
@@ -10,6 +10,8 @@
 #pragma once
 
 #include <thtypes/anm_types.h>
+#include <memory>
+#include <string>
 #include <vector>
 
 /// Blitting modes
@@ -17,10 +19,13 @@
 // These blit a row with length [pixels] from [rep] to [dst], using [format].
 typedef void(*BlitFunc_t)(png_byte *dst, const png_byte *rep, unsigned int pixels, format_t format);
 
+// Exported for the benchmarks.
+extern "C" {
 // Simply overwrites a number of [pixels] in [rep] with [dst].
 void blit_overwrite(png_byte *dst, const png_byte *rep, unsigned int pixels, format_t format);
 // Alpha-blends a number of [pixels] from [rep] on top of [dst].
 void blit_blend(png_byte *dst, const png_byte *rep, unsigned int pixels, format_t format);
+}
 /// --------------
 
 /// Patching types
@@ -193,79 +198,84 @@ void format_from_bgra(png_bytep data, unsigned int pixels, format_t format);
  *   }
  */
 
-struct script_param_change_t {
+// Errors found while compiling the patch for one entry, sprite or script.
+// They are reported every time the patched structure is reached, while
+// [fatal] also ignores all further structures of the same kind.
+struct mod_errors_t {
+	std::vector<std::string> msgs;
+	bool fatal = false;
+
+	void warn(std::string msg);
+	void fail(std::string msg);
+	// Returns [fatal].
+	bool report() const;
+};
+
+struct script_deletion_t {
 	unsigned int line;
-	uint16_t param_addr;
-	const char *code;
-	size_t code_size;
+	// Index in the "deletions" array, for error messages.
+	unsigned int index;
 };
 
-struct script_time_change_t {
+struct script_change_t {
 	unsigned int line;
-	uint16_t time;
+	// Time changes if set, parameter changes otherwise.
+	Option<uint16_t> time;
+	uint16_t param_addr;
+	std::vector<uint8_t> code;
+	// JSON key, for error messages.
+	std::string key;
+};
+
+// Compiled modifications of a single script. Line numbers can only be
+// range-checked against the actual script once it's loaded.
+struct script_prog_t {
+	int32_t script_num;
+	mod_errors_t errors;
+
+	// Sorted by line number, without duplicates.
+	std::vector<script_deletion_t> deletions;
+	// Sorted by line number, with parameter changes before time changes.
+	std::vector<script_change_t> changes;
 };
 
 class script_t {
 	uint8_t *first_instr;
-	uint8_t *after_last;
 
-	template <typename T> T* _instr_at_line(unsigned int line);
-	template <typename T> uint16_t _param_length_of(unsigned int line);
-	template <typename T> void _delete_line(unsigned int line);
-	template <typename T> void _apply_time_change(script_time_change_t change);
-	template <typename T> void _apply_param_change(
-		unsigned int line, uint16_t param_addr,
-		const uint8_t *code, size_t code_size
-	);
+	template <typename T> bool _check(size_t entry_num, const script_prog_t &prog);
+	template <typename T> void _apply(size_t entry_num, const script_prog_t &prog);
 
 public:
 	// Excluding the terminating instruction, as in thanm -l.
 	unsigned int num_instrs;
 
 	// Version-dependent operations
-	uint16_t (script_t::*param_length_of)(unsigned int line);
-	void (script_t::*delete_line)(unsigned int line);
-	void (script_t::*apply_time_change)(script_time_change_t change);
-	void (script_t::*apply_param_change)(
-		unsigned int line, uint16_t param_addr,
-		const uint8_t *code, size_t code_size
-	);
+	// Validates all of [prog] against this script, without changing it.
+	bool (script_t::*check)(size_t entry_num, const script_prog_t &prog);
+	// Applies all deletions and changes of a checked [prog] in a single
+	// pass over the instructions.
+	void (script_t::*apply)(size_t entry_num, const script_prog_t &prog);
 
 	template <typename T> void init(T *first);
 };
 
-struct script_mods_t {
-	uint32_t entry_num;
-	int32_t script_num;
-	script_t script;
-
-	std::vector<unsigned int> deletions;
-	std::vector<script_time_change_t> time_changes;
-	std::vector<script_param_change_t> param_changes;
-	void apply_orig();
-};
-
-struct entry_mods_t {
+struct entry_prog_t {
 	// Entry number
 	size_t num;
+	mod_errors_t errors;
 
 	// Applied directly to our structures, not patched into the game memory
-	const char *name = nullptr;
+	Option<std::string> name;
 	Option<BlitFunc_t> blitmode;
 
-	// For parsing script mods later
-	json_t *scripts = nullptr;
-
-	// Type-checks and prepares script-specific mods for the script in
-	// this specific ANM [version] at the given [offset].
-	script_mods_t script_mods(uint8_t *in, anm_offset_t &offset, uint32_t version);
-
-	void apply_ourdata(anm_entry_t &entry);
+	// Sorted by script number.
+	std::vector<script_prog_t> scripts;
 };
 
-struct sprite_mods_t {
+struct sprite_prog_t {
 	// Sprite number
 	size_t num;
+	mod_errors_t errors;
 
 	// Applied directly to our structures, not patched into the game memory
 	Option<BlitFunc_t> blitmode;
@@ -273,28 +283,50 @@ struct sprite_mods_t {
 	// Applied onto the original sprite
 	Option<xywh_t> bounds;
 
-	void apply_orig(sprite_t &orig);
+	void apply_orig(sprite_t &orig) const;
 };
 
-// ANM header patching data
+// An ANM header patch, compiled once from the JSON and then cached for as
+// long as the resolved JSON object is alive.
+struct anm_prog_t {
+	mod_errors_t errors;
+	// No Option<> here, since we want to default to "auto" (= nullptr).
+	BlitFunc_t blitmode = nullptr;
+
+	// Sorted by entry and sprite number, respectively.
+	std::vector<entry_prog_t> entries;
+	std::vector<sprite_prog_t> sprites;
+};
+
+struct entry_mods_t {
+	const entry_prog_t *prog;
+	// Set after a script failed to apply.
+	bool scripts_failed = false;
+
+	// Applies the script-specific mods for the script in this specific
+	// ANM [version] at the given [offset].
+	void script_mods(uint8_t *in, anm_offset_t &offset, uint32_t version);
+
+	void apply_ourdata(anm_entry_t &entry);
+};
+
+// ANM header patching state for a single file
 struct header_mods_t {
+	std::shared_ptr<const anm_prog_t> prog;
+
 	// Number of entries/sprites seen so far. Necessary to maintain global,
 	// absolute entry/sprite IDs, consistent with the output of thanm -l.
 	size_t entries_seen = 0;
 	size_t sprites_seen = 0;
+	bool entries_failed = false;
+	bool sprites_failed = false;
 
-	// Top-level JSON objects
-	json_t *entries;
-	json_t *sprites;
-	// No Option<> here, since we want to default to "auto" (= nullptr).
-	BlitFunc_t blitmode;
-
-	// Type-checks and prepares entry-specific mods for the entry
-	// with the ID <entries_seen>.
+	// Returns the entry-specific mods for the entry with the ID
+	// <entries_seen>, reporting any errors in them.
 	entry_mods_t entry_mods();
-	// Type-checks and prepares sprite-specific mods for the sprite
-	// with the ID <sprites_seen>.
-	sprite_mods_t sprite_mods();
+	// Returns the sprite-specific mods for the sprite with the ID
+	// <sprites_seen>, reporting any errors in them.
+	const sprite_prog_t& sprite_mods();
 
 	header_mods_t(json_t *patch);
 };
@@ -344,6 +376,18 @@ int sprite_patch(const sprite_patch_t &sp);
 int stack_game_png_apply(anm_entry_t *entry);
 /// ---------------------
 
+/// Patched texture cache
+/// ---------------------
+// Restores the patched texture of [entry] from the on-disk cache, returning
+// true on success. Otherwise, [key] receives the cache key to pass to
+// thtx_cache_store() after patching, or an empty string if [entry] can't be
+// cached.
+bool thtx_cache_load(const anm_entry_t &entry, std::string &key);
+
+// Stores the patched texture of [entry] under [key].
+void thtx_cache_store(const anm_entry_t &entry, const std::string &key);
+/// ---------------------
+
 /// Sprite boundary dumping
 /// -----------------------
 char* fn_for_bounds(const char *fn);
@@ -20,7 +20,7 @@ void bounds_init(png_image_ex &image, png_uint_32 w, png_uint_32 h, const char *
 	if(fn) {
 		// Still needing this one?
 		char *bounds_fn = fn_for_bounds(fn);
-		int ret = PathFileExists(bounds_fn);
+		int ret = dump_queue_exists(bounds_fn);
 		SAFE_FREE(bounds_fn);
 		if(!ret) {
 			png_image_new(image, w, h, PNG_FORMAT_RGBA);
@@ -129,7 +129,21 @@ int bounds_store(const char *fn, png_image_ex &image)
 	if(!bounds_fn) {
 		return 1;
 	}
-	png_image_store(bounds_fn, image);
-	SAFE_FREE(bounds_fn);
+	// Encoding takes much longer than drawing, so the queue takes over the
+	// image and encodes it on a worker thread.
+	png_image_ex *job_image = (png_image_ex *)malloc(sizeof(png_image_ex));
+	*job_image = image;
+	ZeroMemory(&image, sizeof(image));
+	bool queued = dump_queue_run(bounds_fn, PNG_IMAGE_SIZE(job_image->img), [bounds_fn, job_image]() {
+		png_image_store(bounds_fn, *job_image);
+		png_image_clear(*job_image);
+		free(job_image);
+		free(bounds_fn);
+	});
+	if(!queued) {
+		png_image_clear(*job_image);
+		free(job_image);
+		SAFE_FREE(bounds_fn);
+	}
 	return 0;
 }
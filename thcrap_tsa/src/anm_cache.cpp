@@ -0,0 +1,221 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Team Shanghai Alice support plugin
+  *
+  * ----
+  *
+  * On-disk cache of patched THTX textures.
+  */
+
+#include <thcrap.h>
+#include <png.h>
+#include "png_ex.h"
+#include "thcrap_tsa.h"
+#include "anm.hpp"
+
+/**
+  * The result of patching a THTX only depends on its original pixels, its
+  * sprites, and the replacement PNGs found in the patch stack. All of those
+  * make up a key, and the final texture bytes are stored under a hash of
+  * that key in the "thtx" namespace of the disk cache. Later loads copy the
+  * texture straight into the ANM, without decoding a single PNG.
+  *
+  * Replacement PNGs are identified by their patch, file name, size and last
+  * write time, so that checking the cache only requires opening them.
+  */
+
+/// File format
+/// -----------
+// After the header, the file contains [key_len] bytes of the full key,
+// followed by [data_size] bytes of texture data.
+#define THTX_CACHE_MAGIC "THTC"
+#define THTX_CACHE_VERSION 1
+#define THTX_CACHE_DISK_NS "thtx"
+
+struct thtx_cache_header_t {
+	char magic[4];
+	uint32_t version;
+	uint32_t key_len;
+	uint32_t data_size;
+};
+/// -----------
+
+static uint64_t thtx_cache_hash(const void *data, size_t len, uint64_t h)
+{
+	const BYTE *p = (const BYTE *)data;
+	const uint64_t mul = 0x9E3779B97F4A7C15ull;
+	for(; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * mul;
+		h ^= h >> 29;
+	}
+	for(; len; len--, p++) {
+		h = (h ^ *p) * mul;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+template <typename T> static void thtx_cache_key_add(std::string &key, const T &val)
+{
+	key.append((const char *)&val, sizeof(val));
+}
+
+static size_t thtx_cache_data_size(const anm_entry_t &entry)
+{
+	return (size_t)entry.w * entry.h * format_Bpp((format_t)entry.thtx->format);
+}
+
+// The full key is binary, so the disk cache only gets its hash, and the
+// key itself is compared after loading the entry.
+static std::string thtx_cache_disk_key(const std::string &key)
+{
+	const char *game = runconfig_game_get();
+	const char *build = runconfig_build_get();
+	if(!game || !build) {
+		return "";
+	}
+	const uint64_t hash = thtx_cache_hash(key.data(), key.size(), 0);
+	char hash_str[17];
+	snprintf(hash_str, sizeof(hash_str), "%08x%08x", (uint32_t)(hash >> 32), (uint32_t)hash);
+
+	std::string ret = game;
+	ret += '.';
+	ret += build;
+	ret += '/';
+	ret += hash_str;
+	return ret;
+}
+
+// Builds the cache key for the unpatched [entry]. Returns an empty string
+// if nothing in the patch stack would replace it, or if any of the
+// replacement files can't be identified.
+static std::string thtx_cache_key(const anm_entry_t &entry)
+{
+	std::string key;
+	if(!entry.thtx || !entry.name) {
+		return key;
+	}
+	const format_t format = (format_t)entry.thtx->format;
+	const size_t data_size = thtx_cache_data_size(entry);
+	if(!data_size) {
+		return key;
+	}
+
+	thtx_cache_key_add(key, entry.x);
+	thtx_cache_key_add(key, entry.y);
+	thtx_cache_key_add(key, entry.w);
+	thtx_cache_key_add(key, entry.h);
+	thtx_cache_key_add(key, format);
+	thtx_cache_key_add(key, thtx_cache_hash(entry.thtx->data, data_size, 0));
+	for(const auto &sprite : entry.sprites) {
+		// Function pointers differ between runs.
+		const uint8_t blitmode =
+			sprite.blitmode == blit_blend ? 1 :
+			sprite.blitmode == blit_overwrite ? 2 :
+			0;
+		thtx_cache_key_add(key, blitmode);
+		thtx_cache_key_add(key, sprite.x);
+		thtx_cache_key_add(key, sprite.y);
+		thtx_cache_key_add(key, sprite.w);
+		thtx_cache_key_add(key, sprite.h);
+	}
+
+	// Same iteration as stack_game_png_apply().
+	bool found = false;
+	bool valid = true;
+	stack_chain_iterate_t sci = {};
+	chain_buf_t chain;
+	resolve_chain_game_build(chain, entry.name);
+	auto file_add = [&](const patch_t *patch_info, const char *fn) {
+		HANDLE hFile = patch_file_stream(patch_info, fn);
+		if(hFile == INVALID_HANDLE_VALUE) {
+			return;
+		}
+		LARGE_INTEGER size;
+		FILETIME mtime;
+		if(GetFileSizeEx(hFile, &size) && GetFileTime(hFile, NULL, NULL, &mtime)) {
+			key += patch_info->archive;
+			key += '\0';
+			key += fn;
+			key += '\0';
+			thtx_cache_key_add(key, size.QuadPart);
+			thtx_cache_key_add(key, mtime);
+			found = true;
+		} else {
+			valid = false;
+		}
+		CloseHandle(hFile);
+	};
+	while(valid && stack_chain_iterate(&sci, chain.get(), SCI_FORWARDS)) {
+		// A raw image replaces the PNG, which may not even exist then.
+		char *fn_raw = raw_image_fn(sci.fn);
+		if(fn_raw) {
+			file_add(sci.patch_info, fn_raw);
+			free(fn_raw);
+		}
+		file_add(sci.patch_info, sci.fn);
+	}
+	if(!found || !valid) {
+		key.clear();
+	}
+	return key;
+}
+
+bool thtx_cache_load(const anm_entry_t &entry, std::string &key)
+{
+	key = thtx_cache_key(entry);
+	if(key.empty()) {
+		return false;
+	}
+	std::string disk_key = thtx_cache_disk_key(key);
+	if(disk_key.empty()) {
+		key.clear();
+		return false;
+	}
+
+	size_t file_size;
+	BYTE *view = (BYTE *)disk_cache_get(THTX_CACHE_DISK_NS, disk_key.c_str(), &file_size);
+	if(!view) {
+		return false;
+	}
+	bool ret = false;
+	const size_t data_size = thtx_cache_data_size(entry);
+	const auto *header = (const thtx_cache_header_t *)view;
+	if(
+		file_size >= sizeof(*header)
+		&& !memcmp(header->magic, THTX_CACHE_MAGIC, sizeof(header->magic))
+		&& header->version == THTX_CACHE_VERSION
+		&& header->key_len == key.size()
+		&& header->data_size == data_size
+		&& file_size == sizeof(*header) + key.size() + data_size
+		&& !memcmp(view + sizeof(*header), key.data(), key.size())
+	) {
+		memcpy(entry.thtx->data, view + sizeof(*header) + key.size(), data_size);
+		log_printf("(PNG) %s: restored from the disk cache\n", entry.name);
+		ret = true;
+	}
+	free(view);
+	return ret;
+}
+
+void thtx_cache_store(const anm_entry_t &entry, const std::string &key)
+{
+	std::string disk_key = thtx_cache_disk_key(key);
+	if(disk_key.empty()) {
+		return;
+	}
+	const size_t data_size = thtx_cache_data_size(entry);
+	thtx_cache_header_t header;
+	memcpy(header.magic, THTX_CACHE_MAGIC, sizeof(header.magic));
+	header.version = THTX_CACHE_VERSION;
+	header.key_len = key.size();
+	header.data_size = data_size;
+
+	std::vector<BYTE> buffer(sizeof(header) + key.size() + data_size);
+	memcpy(buffer.data(), &header, sizeof(header));
+	memcpy(buffer.data() + sizeof(header), key.data(), key.size());
+	memcpy(buffer.data() + sizeof(header) + key.size(), entry.thtx->data, data_size);
+	disk_cache_put(THTX_CACHE_DISK_NS, disk_key.c_str(), buffer.data(), buffer.size(), 0);
+}
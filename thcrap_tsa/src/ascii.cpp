@@ -106,6 +106,118 @@ float ascii_align_right(float x, const char *str)
 	return x - ascii_extent(str);
 }
 
+/// Layout cache
+/// ------------
+/**
+  * The game calls ascii_vpatchf() for every HUD string on every frame,
+  * usually with the same few format strings in its own read-only memory.
+  * Which layout applies to a format only depends on its string ID, so the
+  * result of looking that up and matching it against all the special IDs
+  * below is remembered per format pointer, in a tiny direct-mapped cache.
+  * Since string IDs can change when patches are reloaded, all caches are
+  * invalidated whenever stringlocs or stringdefs are repatched.
+  */
+
+enum ascii_layout_kind_t : uint8_t {
+	// No special handling
+	AL_PLAIN = 0,
+	AL_TH06_PLAIN,
+	AL_TH06_SCORE,
+	AL_TH06_PRACTICE,
+	AL_TH06_RESULT_SCORE,
+	AL_TH06_RESULT_RANK,
+	AL_TH06_CENTERED,
+	AL_TH06_FULLPOWER,
+	AL_TH06_BONUS,
+	AL_TH165_REPLAY_SAVE,
+};
+
+struct ascii_layout_t {
+	const char *fmt;
+	// String ID, after the prefix matched for [kind].
+	const char *id;
+	ascii_layout_kind_t kind;
+};
+
+#define ASCII_LAYOUT_CACHE_SIZE 16
+
+struct ascii_layout_cache_t {
+	LONG generation;
+	ascii_layout_t entries[ASCII_LAYOUT_CACHE_SIZE];
+};
+
+THREAD_LOCAL(ascii_layout_cache_t, ascii_layout_tls, nullptr, nullptr);
+
+// Starts at 1 so that zero-initialized caches are invalid.
+static volatile LONG ascii_layout_generation = 1;
+
+const stringref_t TH06_ASCII_PREFIX = "th06_ascii_";
+const stringref_t TH06_ID_RESULT = "result_score_format";
+const stringref_t TH06_ID_RESULT_RANK = "result_rank_";
+
+static ascii_layout_t ascii_layout_classify(const char *fmt)
+{
+	ascii_layout_t ret = { fmt, strings_id(fmt), AL_PLAIN };
+	auto &id = ret.id;
+	if(!id) {
+		return ret;
+	}
+	if(game_id == TH165) {
+		if(!strncmp(id, "th165_ascii_replay_save", strlen("th165_ascii_replay_save"))) {
+			ret.kind = AL_TH165_REPLAY_SAVE;
+		}
+		return ret;
+	}
+	if(strncmp(id, TH06_ASCII_PREFIX.str, TH06_ASCII_PREFIX.len)) {
+		return ret;
+	}
+	id += TH06_ASCII_PREFIX.len;
+	if(!strcmp(id, "score_format")) {
+		ret.kind = AL_TH06_SCORE;
+	} else if(!strcmp(id, "practice_format")) {
+		ret.kind = AL_TH06_PRACTICE;
+	} else if(!strncmp(id, TH06_ID_RESULT.str, TH06_ID_RESULT.len)) {
+		ret.kind = AL_TH06_RESULT_SCORE;
+		id += TH06_ID_RESULT.len;
+	} else if(!strncmp(id, TH06_ID_RESULT_RANK.str, TH06_ID_RESULT_RANK.len)) {
+		ret.kind = AL_TH06_RESULT_RANK;
+		id += TH06_ID_RESULT_RANK.len;
+	} else if(!strncmp(id, "centered", strlen("centered"))) {
+		ret.kind = AL_TH06_CENTERED;
+	} else if(!strcmp(id, "fullpower")) {
+		ret.kind = AL_TH06_FULLPOWER;
+	} else if(!strcmp(id, "bonus_format")) {
+		ret.kind = AL_TH06_BONUS;
+	} else {
+		ret.kind = AL_TH06_PLAIN;
+	}
+	return ret;
+}
+
+static ascii_layout_t ascii_layout_get(const char *fmt)
+{
+	auto *cache = ascii_layout_tls_get();
+	if(!cache) {
+		return ascii_layout_classify(fmt);
+	}
+	const LONG generation = ascii_layout_generation;
+	if(cache->generation != generation) {
+		ZeroMemory(cache->entries, sizeof(cache->entries));
+		cache->generation = generation;
+	}
+	auto &entry = cache->entries[((size_t)fmt >> 2) % ASCII_LAYOUT_CACHE_SIZE];
+	if(entry.fmt != fmt) {
+		entry = ascii_layout_classify(fmt);
+	}
+	return entry;
+}
+
+static void ascii_layout_invalidate()
+{
+	InterlockedIncrement(&ascii_layout_generation);
+}
+/// ------------
+
 // Note that we don't pass [pos] by reference. Copying it is more convenient,
 // because ZUN often subtracts the expected width from [pos.x] before going to
 // the next line...
@@ -131,20 +243,15 @@ int ascii_vpatchf_th06(
 		return 0;
 	};
 
-	const stringref_t TH06_ASCII_PREFIX = "th06_ascii_";
-
-	auto id = strings_id(fmt);
-	if(!id || strncmp(id, TH06_ASCII_PREFIX.str, TH06_ASCII_PREFIX.len)) {
-		auto single_str = strings_vsprintf((size_t)&pos, fmt, va);
-		return putfunc(ClassPtr, pos, single_str);
-	}
-	id += TH06_ASCII_PREFIX.len;
+	const auto layout = ascii_layout_get(fmt);
+	auto id = layout.id;
 
+	switch(layout.kind) {
 	/// Specially rendered strings that ignore the original format
 	/// ----------------------------------------------------------
 	// Score format - make sure to scale the numbers to the same on-screen
 	// width even if it hits 10 digits or more, as done by TH07.
-	if(!strcmp(id, "score_format")) {
+	case AL_TH06_SCORE: {
 		// Compensate for high score and current score being rendered
 		// using the same format string, since we want to use the same
 		// scaling for both so that the numbers line up nicely.
@@ -167,7 +274,7 @@ int ascii_vpatchf_th06(
 	}
 	// Practice format - reuse the translations for the in-game
 	// stage string, right-align, and print the score separately
-	if(!strcmp(id, "practice_format")) {
+	case AL_TH06_PRACTICE: {
 		const float SPLIT_POINT = pos.x + (ascii_char_width() * 7);
 		auto stage_id = va_arg(va, int);
 		auto score = va_arg(va, int);
@@ -186,8 +293,7 @@ int ascii_vpatchf_th06(
 	}
 	// Result format - print name and the (bracketed stage) separately,
 	// and scale the score to always fit into 9 digits
-	const stringref_t ID_RESULT = "result_score_format";
-	if(!strncmp(id, ID_RESULT.str, ID_RESULT.len)) {
+	case AL_TH06_RESULT_SCORE: {
 		auto name = va_arg(va, const char*);
 		auto score = va_arg(va, int);
 
@@ -196,8 +302,6 @@ int ascii_vpatchf_th06(
 
 		put_10_digit_score_and_advance_x(pos, false, score);
 
-		id += ID_RESULT.len;
-
 		if(!strcmp(id, "_clear")) {
 			auto str = strings_get_fallback({ "th06_ascii_result_clear", "(C)" });
 			return putfunc(ClassPtr, pos, str.str);
@@ -211,9 +315,8 @@ int ascii_vpatchf_th06(
 	}
 	// Ranks in the Result screen after clearing the game - use the
 	// regular translations rather than these right-aligned duplicates.
-	const stringref_t ID_RESULT_RANK = "result_rank_";
-	if(!strncmp(id, ID_RESULT_RANK.str, ID_RESULT_RANK.len)) {
-		stringref_t rank = id + ID_RESULT_RANK.len;
+	case AL_TH06_RESULT_RANK: {
+		stringref_t rank = id;
 		const char *fallback = fmt;
 		while(*fallback == ' ') {
 			fallback++;
@@ -231,18 +334,20 @@ int ascii_vpatchf_th06(
 		return putfunc(ClassPtr, pos, str.str);
 	}
 	/// ----------------------------------------------------------
+	default:
+		break;
+	}
 
 	auto single_str = strings_vsprintf((size_t)&pos, fmt, va);
 
 	// Strings centered inside the playfield
 	const auto PLAYFIELD_CENTER = 224.0f;
-	const stringref_t ID_CENTERED = "centered";
-	if(!strncmp(id, ID_CENTERED.str, ID_CENTERED.len)) {
+	if(layout.kind == AL_TH06_CENTERED) {
 		pos.x = ascii_align_center(PLAYFIELD_CENTER, single_str);
-	} else if(!strcmp(id, "fullpower")) {
+	} else if(layout.kind == AL_TH06_FULLPOWER) {
 		auto center_cur = pos.x + (ascii_extent("Full Power Mode!!") / 2.0f);
 		pos.x = ascii_align_center(center_cur, single_str);
-	} else if(!strcmp(id, "bonus_format")) {
+	} else if(layout.kind == AL_TH06_BONUS) {
 		auto source_w = ascii_extent("BONUS 12345678");
 		auto source_w_half = source_w / 2.0f;
 		auto shift = PLAYFIELD_CENTER - source_w_half - 104.0f;
@@ -260,11 +365,9 @@ int ascii_vpatchf_th165(
 )
 {
 	auto single_str = strings_vsprintf((size_t)&pos, fmt, va);
-	const stringref_t REPLAY_SAVE_PREFIX = "th165_ascii_replay_save";
 
 	// Center the replay save menu inside the playfield
-	auto id = strings_id(fmt);
-	if(id && !strncmp(id, REPLAY_SAVE_PREFIX.str, REPLAY_SAVE_PREFIX.len)) {
+	if(ascii_layout_get(fmt).kind == AL_TH165_REPLAY_SAVE) {
 		const auto PLAYFIELD_CENTER = 320.0f;
 		pos.x = ascii_align_center(PLAYFIELD_CENTER, single_str);
 	}
@@ -385,6 +488,9 @@ extern "C" __declspec(dllexport) void ascii_mod_repatch(json_t *files_changed)
 	json_object_foreach(files_changed, fn, val) {
 		if(strstr(fn, "stringdefs.")) {
 			ascii_repatch();
+			ascii_layout_invalidate();
+		} else if(strstr(fn, "stringlocs.")) {
+			ascii_layout_invalidate();
 		}
 	}
 }
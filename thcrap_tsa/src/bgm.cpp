@@ -110,12 +110,24 @@ HMMIO WINAPI th06_mmioOpenA(LPSTR pszFileName, LPMMIOINFO pmmioinfo, DWORD fdwOp
 /// =====================
 // Let's be correct, and support more than one handle to thbgm.dat.
 std::vector<HANDLE> thbgm_handles;
+// Since ReadFile(), SetFilePointer() and CloseHandle() are detoured for
+// every file the game touches, [thbgm_handles] is only searched if the bit
+// of the handle is set in this filter of all handles in there.
+uint64_t thbgm_handle_filter = 0;
 std::unique_ptr<std::unique_ptr<track_t>[]> thbgm_mods;
 // Index into both [thbgm_mods] and the bgm_fmt_t array.
 // Negative if no track is playing.
 int thbgm_cur_bgmid = -1;
 size_t thbgm_modtrack_bytes_read = 0;
 
+// Decoding happens on a separate thread, ahead of the game's streaming
+// thread, to keep codec spikes from causing stutter.
+#define THBGM_DECODE_AHEAD_MS 2000
+
+// Decode-ahead buffer for the modded track at [thbgm_ahead_bgmid].
+std::unique_ptr<track_ahead_t> thbgm_ahead;
+int thbgm_ahead_bgmid = -1;
+
 static auto chain_CreateFileA = CreateFileU;
 static auto chain_CloseHandle = CloseHandle;
 static auto chain_ReadFile = ReadFile;
@@ -128,6 +140,32 @@ track_t* thbgm_modtrack_for_current_bgmid()
 		: nullptr;
 }
 
+// Returns the decode-ahead buffer for [bgmid], which must have a modded
+// track, after seeking it to [byte]. A buffer for a different track is
+// replaced.
+track_ahead_t* thbgm_ahead_seek(int bgmid, size_t byte)
+{
+	if(thbgm_ahead_bgmid != bgmid || !thbgm_ahead) {
+		thbgm_ahead = nullptr;
+		const auto &fn = bgm_fmt[bgmid].fn;
+		thbgm_ahead = std::make_unique<track_ahead_t>(
+			*thbgm_mods[bgmid], byte, THBGM_DECODE_AHEAD_MS,
+			stringref_t{ fn, strnlen(fn, sizeof(fn)) }
+		);
+		thbgm_ahead_bgmid = bgmid;
+	} else {
+		thbgm_ahead->seek_to_byte(byte);
+	}
+	return thbgm_ahead.get();
+}
+
+// Stops decoding ahead. Must be called before destroying the track.
+void thbgm_ahead_clear()
+{
+	thbgm_ahead = nullptr;
+	thbgm_ahead_bgmid = -1;
+}
+
 // "Trance seeking" support
 // ------------------------
 // Pretty much the entire challenge of ≥TH07: For the BGM switches that occur
@@ -172,8 +210,17 @@ int BP_bgmmod_tranceseek_byte_offset(x86_reg_t *regs, json_t *bp_info)
 }
 // ------------------------
 
+// Handle values are multiples of 4.
+static uint64_t thbgm_handle_bit(HANDLE h)
+{
+	return 1ull << (((uintptr_t)h >> 2) & 63);
+}
+
 bool is_bgm_handle(HANDLE hFile)
 {
+	if(!(thbgm_handle_filter & thbgm_handle_bit(hFile))) {
+		return false;
+	}
 	for(const auto &h : thbgm_handles) {
 		if(h == hFile) {
 			return true;
@@ -198,6 +245,7 @@ HANDLE WINAPI thbgm_CreateFileA(
 	);
 	if(PathMatchSpecU(PathFindFileNameU(lpFileName), "*bgm*.dat")) {
 		thbgm_handles.emplace_back(ret);
+		thbgm_handle_filter |= thbgm_handle_bit(ret);
 		bgmmod_debugf("CreateFileA(%s) -> %p\n", lpFileName, ret);
 	}
 	return ret;
@@ -207,9 +255,15 @@ BOOL WINAPI thbgm_CloseHandle(
 	HANDLE hObject
 )
 {
-	auto elm = std::find(thbgm_handles.begin(), thbgm_handles.end(), hObject);
+	auto elm = is_bgm_handle(hObject)
+		? std::find(thbgm_handles.begin(), thbgm_handles.end(), hObject)
+		: thbgm_handles.end();
 	if(elm != thbgm_handles.end()) {
 		thbgm_handles.erase(elm);
+		thbgm_handle_filter = 0;
+		for(const auto &h : thbgm_handles) {
+			thbgm_handle_filter |= thbgm_handle_bit(h);
+		}
 		bgmmod_debugf("CloseHandle(%p)\n", hObject);
 	}
 	return chain_CloseHandle(hObject);
@@ -227,7 +281,11 @@ BOOL WINAPI thbgm_ReadFile(
 		auto *modtrack = thbgm_modtrack_for_current_bgmid();
 		if(modtrack) {
 			bgmmod_debugf("ReadFile(%p, %u)\n", hFile, nNumberOfBytesToRead);
-			if(!modtrack->decode(lpBuffer, nNumberOfBytesToRead)) {
+			auto *ahead = (thbgm_ahead_bgmid == thbgm_cur_bgmid)
+				? thbgm_ahead.get()
+				: thbgm_ahead_seek(thbgm_cur_bgmid, thbgm_modtrack_bytes_read);
+			if(!ahead->decode(lpBuffer, nNumberOfBytesToRead)) {
+				thbgm_ahead_clear();
 				thbgm_mods[thbgm_cur_bgmid] = nullptr;
 			}
 			if(lpNumberOfBytesRead) {
@@ -264,7 +322,7 @@ DWORD WINAPI thbgm_SetFilePointer(
 
 	bool is_tell = (lDistanceToMove == 0 && dwMoveMethod == FILE_CURRENT);
 	if(is_tell) {
-		log_debugf("Tell\n");
+		log_tracef("Tell\n");
 	}
 
 	// Make sure to always consume the trance seek offset!
@@ -298,7 +356,7 @@ DWORD WINAPI thbgm_SetFilePointer(
 			dwMoveMethod == FILE_BEGIN
 			&& lDistanceToMove == cur_thbgm_pos
 		) {
-			log_debugf("Ignored seek-after-tell\n");
+			log_tracef("Ignored seek-after-tell\n");
 			return lDistanceToMove;
 		}
 	}
@@ -314,23 +372,23 @@ DWORD WINAPI thbgm_SetFilePointer(
 	if(new_modtrack) {
 		auto seek_offset = lDistanceToMove - new_fmt.track_offset;
 		if(new_bgmid != thbgm_cur_bgmid) {
-			log_debugf("Track switch, seek to byte #%u\n", seek_offset);
+			log_tracef("Track switch, seek to byte #%u\n", seek_offset);
 		} else if(seekblock) {
-			log_debugf("Blocked seek attempt to byte #%u\n", seek_offset);
+			log_tracef("Blocked seek attempt to byte #%u\n", seek_offset);
 			seekblock = false;
 			return lDistanceToMove;
 		} else if(seek_offset == 0) {
-			log_debugf("Rewind\n");
+			log_tracef("Rewind\n");
 		} else if(seek_offset == new_modtrack->intro_size) {
-			log_debugf("Loop\n");
+			log_tracef("Loop\n");
 		} else {
-			log_debugf("Seek to byte #%u\n", seek_offset);
+			log_tracef("Seek to byte #%u\n", seek_offset);
 		}
 		thbgm_modtrack_bytes_read = seek_offset;
-		new_modtrack->seek_to_byte(seek_offset);
+		thbgm_ahead_seek(new_bgmid, seek_offset);
 		return lDistanceToMove;
 	}
-	log_debugf("Unmodded seek\n");
+	log_tracef("Unmodded seek\n");
 	return fallback();
 }
 /// =====================
@@ -442,6 +500,7 @@ int patch_fmt(void *file_inout, size_t size_out, size_t size_in, const char *fn,
 		}
 	}
 
+	thbgm_ahead_clear();
 	thbgm_mods = std::make_unique<std::unique_ptr<track_t>[]>(bgm_count);
 	for(decltype(bgm_count) i = 0; i < bgm_count; i++) {
 		auto &fmt_ingame = bgm_fmt[i];
@@ -449,6 +508,13 @@ int patch_fmt(void *file_inout, size_t size_out, size_t size_in, const char *fn,
 		const stringref_t basename = { fmt_ingame.fn, basename_len };
 
 		auto mod = stack_bgm_resolve(basename);
+		if(mod && !is_allowed(mod->pcmf)) {
+			// Convert to the format the game itself uses for this track.
+			const auto &wfx = fmt_ingame.wfx;
+			mod = track_convert(std::move(mod), pcm_format_t{
+				wfx.nSamplesPerSec, wfx.wBitsPerSample, wfx.nChannels
+			});
+		}
 		if(mod) {
 			if(!is_allowed(mod->pcmf)) {
 				stringref_t PCMF_LINE_FMT = "\n\xE2\x80\xA2 ";
@@ -894,6 +960,12 @@ extern "C" __declspec(dllexport) void bgm_mod_detour(void)
 	}
 }
 
+extern "C" __declspec(dllexport) void bgm_mod_exit(void)
+{
+	// Has to happen before the DLL is unloaded.
+	thbgm_ahead_clear();
+}
+
 extern "C" __declspec(dllexport) void bgm_mod_repatch(json_t *files_changed)
 {
 	if(!bgm_fmt) {
@@ -11,6 +11,8 @@
 #include <bp_file.h>
 #include "thcrap_tsa.h"
 #include "layout.h"
+#include <algorithm>
+#include <vector>
 
 /* pseudocode for how th125 calls the breakpoints:
  *
@@ -27,6 +29,137 @@
 static int32_t mission_furi_a = -2;
 static size_t laststage, lastscene, lastchara;
 
+/// Lookup table
+/// ------------
+/**
+  * missions.js is compiled into an array of missions sorted by their
+  * (chara, stage, scene) key whenever it's (re)loaded, so that the
+  * breakpoints don't need to format and look up JSON keys. Works just like
+  * the spell tables: strings point into the jsondata version of the file,
+  * and replaced tables are retired rather than deleted.
+  */
+
+// Larger key components are ignored.
+#define MISSION_KEY_MAX 0xFFFF
+
+struct mission_furi_t {
+	// Used if [begin] is NULL.
+	int32_t offset;
+	const char *begin;
+	const char *target;
+};
+
+struct mission_t {
+	uint64_t key;
+	std::vector<const char*> lines;
+	// Empty if the mission has no "furi" array.
+	std::vector<mission_furi_t> furi;
+};
+
+struct missions_table_t {
+	std::vector<mission_t> missions;
+
+	const mission_t* get(size_t chara, size_t stage, size_t scene) const;
+};
+
+static missions_table_t *volatile missions_table = nullptr;
+static std::vector<missions_table_t*> missions_tables_retired;
+
+static uint64_t mission_key(size_t chara, size_t stage, size_t scene)
+{
+	return ((uint64_t)chara << 32) | ((uint64_t)stage << 16) | scene;
+}
+
+static bool mission_key_less(const mission_t &a, uint64_t key)
+{
+	return a.key < key;
+}
+
+const mission_t* missions_table_t::get(size_t chara, size_t stage, size_t scene) const
+{
+	if(chara > MISSION_KEY_MAX || stage > MISSION_KEY_MAX || scene > MISSION_KEY_MAX) {
+		return nullptr;
+	}
+	const uint64_t key = mission_key(chara, stage, scene);
+	auto it = std::lower_bound(missions.begin(), missions.end(), key, mission_key_less);
+	return (it != missions.end() && it->key == key) ? &*it : nullptr;
+}
+
+// Parses a key of missions.js, only accepting what the "%u_%u_%u" format
+// used by the lookups would produce.
+static bool mission_key_parse(const char *str, uint64_t *key)
+{
+	unsigned int chara, stage, scene;
+	char dummy;
+	if(sscanf(str, "%u_%u_%u%c", &chara, &stage, &scene, &dummy) != 3) {
+		return false;
+	}
+	char key_check[DECIMAL_DIGITS_BOUND(unsigned int) * 3 + 3];
+	snprintf(key_check, sizeof(key_check), "%u_%u_%u", chara, stage, scene);
+	if(strcmp(str, key_check) || chara > MISSION_KEY_MAX || stage > MISSION_KEY_MAX || scene > MISSION_KEY_MAX) {
+		return false;
+	}
+	*key = mission_key(chara, stage, scene);
+	return true;
+}
+
+static missions_table_t* missions_table_compile(const json_t *missions)
+{
+	auto *table = new missions_table_t;
+	const char *key;
+	json_t *val;
+
+	json_object_foreach((json_t *)missions, key, val) {
+		mission_t mission = {};
+		if(!json_is_object(val) || !mission_key_parse(key, &mission.key)) {
+			continue;
+		}
+		json_t *lines = json_object_get(val, "lines");
+		mission.lines.resize(json_array_size(lines));
+		for(size_t i = 0; i < mission.lines.size(); i++) {
+			mission.lines[i] = json_array_get_string(lines, i);
+		}
+		json_t *furi = json_object_get(val, "furi");
+		mission.furi.resize(json_array_size(furi));
+		for(size_t i = 0; i < mission.furi.size(); i++) {
+			json_t *furiline = json_array_get(furi, i);
+			mission_furi_t &f = mission.furi[i];
+			if(json_is_integer(furiline)) {
+				f.offset = (int32_t)json_integer_value(furiline);
+			} else if(json_is_array(furiline) && json_array_size(furiline) == 2) {
+				f.begin = json_array_get_string(furiline, 0);
+				f.target = json_array_get_string(furiline, 1);
+				if(!f.begin || !f.target) {
+					f = { -1 };
+				}
+			} else {
+				f.offset = -1;
+			}
+		}
+		table->missions.push_back(std::move(mission));
+	}
+	std::sort(table->missions.begin(), table->missions.end(), [](const mission_t &a, const mission_t &b) {
+		return a.key < b.key;
+	});
+	return table;
+}
+
+static void missions_table_update(void)
+{
+	auto *table = missions_table_compile(jsondata_game_get("missions.js"));
+	auto *prev = (missions_table_t *)InterlockedExchangePointer((PVOID *)&missions_table, table);
+	if(prev) {
+		missions_tables_retired.push_back(prev);
+	}
+}
+
+static const mission_t* mission_get(size_t chara, size_t stage, size_t scene)
+{
+	const missions_table_t *table = missions_table;
+	return table ? table->get(chara, stage, scene) : nullptr;
+}
+/// ------------
+
 int BP_mission(x86_reg_t *regs, json_t *bp_info)
 {
 	// This breakpoint is supposed to replace mission string decryption proc in th95 and th125.
@@ -56,23 +189,17 @@ int BP_mission(x86_reg_t *regs, json_t *bp_info)
 		mission_furi_a = -2;
 	}
 
-	json_t *missions = jsondata_game_get("missions.js");
-	VLA(char, mission_key_str, 16*3 + 2 + 1);
-	sprintf(mission_key_str, "%u_%u_%u", chara, stage, scene);
-	json_t *mission = json_object_get(missions, mission_key_str);
-	VLA_FREE(mission_key_str);
-
+	const mission_t *mission = mission_get(chara, stage, scene);
 	if (!mission) {
 		return 1;
 	}
 
 	// return the lines
-	json_t *lines = json_object_get(mission, "lines");
-	if (!lines || line >= json_array_size(lines)) {
+	if (line >= mission->lines.size()) {
 		regs->eax = (size_t)" ";
 	}
 	else{
-		regs->eax = (size_t)json_array_get_string(lines, line);
+		regs->eax = (size_t)mission->lines[line];
 	}
 
 	// return one function higher
@@ -94,39 +221,29 @@ int BP_mission_check_furi_a(x86_reg_t *regs, json_t *bp_info)
 	// ----------
 
 	// prepare furi_a
-	json_t *missions = jsondata_game_get("missions.js");
-	VLA(char, mission_key_str, 16 * 3 + 2 + 1);
-	sprintf(mission_key_str, "%u_%u_%u", lastchara, laststage, lastscene);
-	json_t *mission = json_object_get(missions, mission_key_str);
-	VLA_FREE(mission_key_str);
+	const mission_t *mission = mission_get(lastchara, laststage, lastscene);
 	if (!mission) {
 		mission_furi_a = -2;
 		return 1; // original string
 	}
-	json_t *furi = json_object_get(mission, "furi");
-	if (!furi || line - 3 >= json_array_size(furi)) {
+	if (line - 3 >= mission->furi.size()) {
 		mission_furi_a = -1;
 	}
 	else {
-		json_t* furiline = json_array_get(furi, line - 3);
-		if (json_is_integer(furiline)) {
-			mission_furi_a = (int32_t)json_integer_value(furiline);
+		const mission_furi_t &furiline = mission->furi[line - 3];
+		if (!furiline.begin) {
+			mission_furi_a = furiline.offset;
 		}
 		else {
-			assert(json_is_array(furiline));
-			assert(json_array_size(furiline) == 2);
-			const char* begin = json_array_get_string(furiline, 0);
-			const char* target = json_array_get_string(furiline, 1);
 			const char* str = " ";
-			json_t *lines = json_object_get(mission, "lines");
-			if (lines && line < json_array_size(lines)) {
-				str = json_array_get_string(lines, line);
+			if (line < mission->lines.size()) {
+				str = mission->lines[line];
 			}
 
 			auto font_bottom = font_block_get(0).unwrap_or(nullptr);
 			auto font_ruby = font_block_get(2).unwrap_or(nullptr);
 
-			mission_furi_a = ruby_offset_half(begin, target, str, font_bottom, font_ruby);
+			mission_furi_a = ruby_offset_half(furiline.begin, furiline.target, str, font_bottom, font_ruby);
 		}
 	}
 
@@ -162,4 +279,27 @@ int BP_mission_printf_hook(x86_reg_t *regs, json_t *bp_info)
 void missions_mod_init(void)
 {
 	jsondata_game_add("missions.js");
+	missions_table_update();
+}
+
+void missions_mod_repatch(json_t *files_changed)
+{
+	// jsondata has already loaded the new version at this point.
+	const char *fn;
+	json_t *val;
+	json_object_foreach(files_changed, fn, val) {
+		if(strstr(fn, "missions.")) {
+			missions_table_update();
+			return;
+		}
+	}
+}
+
+void missions_mod_exit(void)
+{
+	delete (missions_table_t *)InterlockedExchangePointer((PVOID *)&missions_table, nullptr);
+	for(auto *table : missions_tables_retired) {
+		delete table;
+	}
+	missions_tables_retired.clear();
 }
@@ -8,36 +8,123 @@
   */
 
 #include <thcrap.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+  * Every gentext file version is compiled into a table the first time a
+  * breakpoint uses it. The table maps the tuple of IDs in each key (for
+  * example, "3_1_12") to the already extracted line strings, so that a hit
+  * only hashes a few integers instead of formatting and looking up a string
+  * key. Since jsondata keeps every version of a file alive until exit, the
+  * tables can point into the JSON and be keyed by its address.
+  */
+
+#define GENTEXT_IDS_MAX 8
+
+struct gentext_key_t {
+	// GENTEXT_IDS_MAX + 1 for keys that are too long to ever match.
+	size_t count;
+	size_t ids[GENTEXT_IDS_MAX];
+
+	bool operator ==(const gentext_key_t &other) const {
+		return count == other.count
+			&& !memcmp(ids, other.ids, MIN(count, GENTEXT_IDS_MAX) * sizeof(ids[0]));
+	}
+};
+
+struct gentext_key_hash_t {
+	size_t operator ()(const gentext_key_t &key) const {
+		size_t ret = key.count;
+		for(size_t i = 0; i < MIN(key.count, GENTEXT_IDS_MAX); i++) {
+			ret = (ret ^ key.ids[i]) * 16777619;
+		}
+		return ret;
+	}
+};
+
+typedef std::vector<const char*> gentext_lines_t;
+typedef std::unordered_map<gentext_key_t, gentext_lines_t, gentext_key_hash_t> gentext_table_t;
+
+static std::unordered_map<const json_t*, gentext_table_t*> gentext_tables;
+static SRWLOCK gentext_tables_srwlock = { SRWLOCK_INIT };
 
 typedef struct {
 	const json_t *file;
-	size_t key_len;
-	char *key;
+	const gentext_table_t *table;
+	gentext_key_t key;
+	// Entry for [key] in [table], valid if [lines_found] is true.
+	const gentext_lines_t *lines;
+	bool lines_found;
 	size_t line;
 } gentext_cache_t;
 
 THREAD_LOCAL(gentext_cache_t, gc_tls, nullptr, nullptr);
 
-int gentext_cache_key_set(gentext_cache_t *gc, const char *key, size_t key_len)
+// Parses a key of decimal IDs separated by underscores, as BP_gentext
+// would have formatted it.
+static bool gentext_key_parse(gentext_key_t &key, const char *str)
 {
-	if(gc->key && !strncmp(gc->key, key, gc->key_len)) {
-		return 1;
-	}
-	if(key_len > gc->key_len) {
-		char *key_realloc = (char *)realloc(gc->key, key_len);
-		if(key_realloc) {
-			gc->key = key_realloc;
-			gc->key_len = key_len;
-		} else {
-			SAFE_FREE(gc->key);
-			gc->key_len = 0;
+	key.count = 0;
+	do {
+		if(key.count >= GENTEXT_IDS_MAX || !isdigit((unsigned char)*str)) {
+			return false;
+		}
+		if(str[0] == '0' && isdigit((unsigned char)str[1])) {
+			return false;
 		}
+		char *end;
+		errno = 0;
+		key.ids[key.count++] = strtoul(str, &end, 10);
+		if(errno || (*end && *end != '_')) {
+			return false;
+		}
+		str = end;
+	} while(*str++);
+	return true;
+}
+
+static gentext_table_t* gentext_table_compile(const json_t *file)
+{
+	auto *table = new gentext_table_t;
+	const char *key_str;
+	json_t *val;
+	json_object_foreach((json_t *)file, key_str, val) {
+		gentext_key_t key;
+		size_t size = json_flex_array_size(val);
+		if(size == 0 || !gentext_key_parse(key, key_str)) {
+			continue;
+		}
+		gentext_lines_t lines(size);
+		for(size_t i = 0; i < size; i++) {
+			lines[i] = json_flex_array_get_string_safe(val, i);
+		}
+		table->emplace(key, std::move(lines));
 	}
-	if(gc->key) {
-		strncpy(gc->key, key, key_len);
+	return table;
+}
+
+static const gentext_table_t* gentext_table_get(const json_t *file)
+{
+	if(!file) {
+		return nullptr;
 	}
-	gc->line = 0;
-	return 0;
+	AcquireSRWLockShared(&gentext_tables_srwlock);
+	auto it = gentext_tables.find(file);
+	gentext_table_t *ret = it != gentext_tables.end() ? it->second : nullptr;
+	ReleaseSRWLockShared(&gentext_tables_srwlock);
+	if(ret) {
+		return ret;
+	}
+	gentext_table_t *table = gentext_table_compile(file);
+	AcquireSRWLockExclusive(&gentext_tables_srwlock);
+	auto ins = gentext_tables.emplace(file, table);
+	ReleaseSRWLockExclusive(&gentext_tables_srwlock);
+	if(!ins.second) {
+		// Another thread was faster.
+		delete table;
+	}
+	return ins.first->second;
 }
 
 int BP_gentext(x86_reg_t *regs, json_t *bp_info)
@@ -52,47 +139,58 @@ int BP_gentext(x86_reg_t *regs, json_t *bp_info)
 	json_t *line_obj = json_object_get(bp_info, "line");
 	// ----------
 	if(file) {
-		gc->file = jsondata_game_get(file);
+		const json_t *file_json = jsondata_game_get(file);
+		if(file_json != gc->file) {
+			gc->file = file_json;
+			gc->table = gentext_table_get(file_json);
+			gc->lines_found = false;
+		}
 	}
 	if(ids) {
-		const size_t value_len = DECIMAL_DIGITS_BOUND(size_t);
-		size_t key_new_len = value_len * json_flex_array_size(ids) + 1;
-		VLA(char, key_new, key_new_len);
-		char *p = key_new;
+		gentext_key_t key = {};
 		size_t i;
 		json_t *id;
+		key.count = MIN(json_flex_array_size(ids), GENTEXT_IDS_MAX + 1);
 		json_flex_array_foreach(ids, i, id) {
-			char id_str[value_len + 1];
-			const char *q = id_str;
-			size_t id_val = json_immediate_value(id, regs);
-			snprintf(id_str, sizeof(id_str), "%u", id_val);
-			if(i > 0) {
-				*p++ = '_';
+			if(i >= GENTEXT_IDS_MAX) {
+				break;
 			}
-			while(*p++ = *q++);
-			p--;
+			key.ids[i] = json_immediate_value(id, regs);
+		}
+		if(!(key == gc->key)) {
+			gc->key = key;
+			gc->line = 0;
+			gc->lines_found = false;
 		}
-		gentext_cache_key_set(gc, key_new, key_new_len);
-		VLA_FREE(key_new);
 	}
 	if(line_obj) {
 		gc->line = json_immediate_value(line_obj, regs);
 	}
 	if(strs) {
-		json_t *id_val = json_object_get(gc->file, gc->key);
+		if(!gc->lines_found) {
+			gc->lines = nullptr;
+			if(gc->table) {
+				auto it = gc->table->find(gc->key);
+				if(it != gc->table->end()) {
+					gc->lines = &it->second;
+				}
+			}
+			gc->lines_found = true;
+		}
+		const gentext_lines_t *lines = gc->lines;
 		size_t i;
 		json_t *str;
 
 		// More straightforward if we ensure that everything below is valid.
-		if(json_flex_array_size(id_val) == 0) {
+		if(!lines) {
 			return 1;
 		}
 
 		json_flex_array_foreach(strs, i, str) {
 			const char **target = (const char **)json_pointer_value(str, regs);
-			const char *line = json_flex_array_get_string_safe(id_val, gc->line++);
-			assert(line);
-			*target = line;
+			size_t line = gc->line++;
+			*target = line < lines->size() ? (*lines)[line] : "";
+			assert(*target);
 		}
 		return breakpoint_cave_exec_flag(bp_info);
 	}
@@ -113,7 +211,16 @@ int gentext_mod_init(void)
 			if(!jsondata_game_get(file)) {
 				jsondata_game_add(file);
 			}
+			gentext_table_get(jsondata_game_get(file));
 		}
 	}
 	return 0;
 }
+
+void gentext_mod_exit(void)
+{
+	for(auto& it : gentext_tables) {
+		delete it.second;
+	}
+	gentext_tables.clear();
+}
@@ -4,7 +4,8 @@
   *
   * ----
   *
-  * Input detours. Currently providing POV hat → X/Y axis mapping.
+  * Input detours. Currently providing POV hat → X/Y axis mapping, and an
+  * optional thread that polls joypads ahead of the game.
   */
 
 #include <thcrap.h>
@@ -55,6 +56,94 @@ template <typename T> bool pov_to_xy(T &x, T& y, Ranges<T> &ranges, DWORD pov)
 }
 /// ---------------------------
 
+/// Input thread
+/// ------------
+/*
+ * Some controller drivers block inside joyGetPosEx() or Poll() for long
+ * enough to cost the game frames. If the "tsa_input_thread_hz" run
+ * configuration value is set, a separate thread polls every joypad the
+ * game has used at that rate, applies the POV hat mapping, and publishes
+ * the result. The detours then simply return the latest published state.
+ * Until the thread has published the state of a device, its detours keep
+ * calling the original function.
+ */
+
+// Latest state of a device. Written by the input thread only, and read
+// without ever blocking it: readers retry if the state changed while they
+// were copying it.
+template <typename T> struct latest_state_t
+{
+	// Odd while the writer is busy, 0 until the first state is published.
+	volatile LONG seq = 0;
+	T state;
+
+	void publish(const T &new_state) {
+		InterlockedIncrement(&seq);
+		state = new_state;
+		InterlockedIncrement(&seq);
+	}
+
+	bool read(T &out) {
+		for(;;) {
+			const LONG before = seq;
+			MemoryBarrier();
+			if(before == 0) {
+				return false;
+			}
+			if(before & 1) {
+				YieldProcessor();
+				continue;
+			}
+			out = state;
+			MemoryBarrier();
+			if(seq == before) {
+				return true;
+			}
+		}
+	}
+};
+
+// Joypads are rarely more than one, and never more than a handful.
+#define INPUT_DI_DEVICES_MAX 4
+// How long input_mod_exit() waits for the thread.
+#define INPUT_THREAD_EXIT_TIMEOUT 1000
+
+static HANDLE input_thread = nullptr;
+static volatile LONG input_thread_quit = 0;
+static DWORD input_thread_interval_ms = 0;
+
+struct joy_state_t
+{
+	MMRESULT ret;
+	JOYINFOEX ji;
+};
+
+struct joy_slot_t
+{
+	// Set once the game has successfully polled this joystick ID.
+	volatile LONG polled = 0;
+	latest_state_t<joy_state_t> latest;
+};
+
+struct di_state_t
+{
+	HRESULT ret;
+	DIJOYSTATE2 js;
+};
+
+struct di_slot_t
+{
+	// IDirectInputDevice8 the game has polled, referenced by us until the
+	// thread has stopped.
+	void*** volatile device = nullptr;
+	latest_state_t<di_state_t> latest;
+};
+
+static std::unique_ptr<joy_slot_t[]> joy_slots;
+static UINT joy_count = 0;
+static di_slot_t di_slots[INPUT_DI_DEVICES_MAX];
+/// ------------
+
 /// WinMM joystick API
 /// ------------------
 /*
@@ -100,6 +189,18 @@ MMRESULT __stdcall my_joyGetPosEx(UINT uJoyID, JOYINFOEX *pji)
 	}
 	pji->dwFlags |= JOY_RETURNPOV;
 
+	if(input_thread && uJoyID < joy_count) {
+		joy_state_t state;
+		if(joy_slots[uJoyID].latest.read(state)) {
+			const auto size = pji->dwSize;
+			const auto flags = pji->dwFlags;
+			memcpy(pji, &state.ji, min((size_t)size, sizeof(state.ji)));
+			pji->dwSize = size;
+			pji->dwFlags = flags;
+			return state.ret;
+		}
+	}
+
 	auto ret_pos = chain_joyGetPosEx(uJoyID, pji);
 	if(ret_pos != JOYERR_NOERROR) {
 		return ret_pos;
@@ -117,7 +218,11 @@ MMRESULT __stdcall my_joyGetPosEx(UINT uJoyID, JOYINFOEX *pji)
 		jc->range.x_max = caps.wXmax;
 		jc->range.y_min = caps.wYmin;
 		jc->range.y_max = caps.wYmax;
-	} else if(!jc->has_pov) {
+		if(input_thread && uJoyID < joy_count) {
+			InterlockedExchange(&joy_slots[uJoyID].polled, 1);
+		}
+	}
+	if(!jc->has_pov) {
 		return ret_pos;
 	}
 	pov_to_xy(pji->dwXpos, pji->dwYpos, jc->range, pji->dwPOV);
@@ -160,17 +265,25 @@ MMRESULT __stdcall my_joyGetPosEx(UINT uJoyID, JOYINFOEX *pji)
 	void **lpvData \
 )
 
+#define DID8_POLL(name) HRESULT __stdcall name( \
+	void*** that \
+)
+
 typedef DIRECTINPUT8CREATE(DirectInput8Create_type);
 typedef DI8_CREATEDEVICE(DI8_CreateDevice_type);
 typedef DID8_GETPROPERTY(DID8_GetProperty_type);
 typedef DID8_SETPROPERTY(DID8_SetProperty_type);
 typedef DID8_GETDEVICESTATE(DID8_GetDeviceState_type);
+typedef DID8_POLL(DID8_Poll_type);
+// IUnknown::AddRef() and IUnknown::Release()
+typedef ULONG __stdcall DID8_Refcount_type(void*** that);
 
 DirectInput8Create_type *chain_DirectInput8Create;
 DI8_CreateDevice_type *chain_di8_CreateDevice;
 DID8_GetProperty_type *chain_did8_GetProperty;
 DID8_SetProperty_type *chain_did8_SetProperty;
 DID8_GetDeviceState_type *chain_did8_GetDeviceState;
+DID8_Poll_type *chain_did8_Poll;
 
 // That disconnect between axes as enumerable "device objects" and the fixed
 // DIJOYSTATE structure is pretty weird and confusing. Fingers crossed that
@@ -200,15 +313,59 @@ DID8_SETPROPERTY(my_did8_SetProperty)
 		);
 		vtable_detour_t my[] = {
 			{ 6, chain_did8_SetProperty, nullptr },
-			{ 9, chain_did8_GetDeviceState, nullptr }
+			{ 9, chain_did8_GetDeviceState, nullptr },
+			{ 25, chain_did8_Poll, nullptr }
 		};
-		vtable_detour(*that, my, elementsof(my));
+		// The input thread keeps polling, but the game has to see the
+		// unmapped state from now on.
+		vtable_detour(*that, my, elementsof(my) - (chain_did8_Poll ? 0 : 1));
 	}
 	return ret;
 }
 
+// Returns the input thread slot for [device], claiming a free one if
+// necessary, or nullptr if all of them are taken.
+static di_slot_t* di_slot_get(void ***device)
+{
+	for(auto &slot : di_slots) {
+		if(slot.device == device) {
+			return &slot;
+		}
+	}
+	for(auto &slot : di_slots) {
+		if(!InterlockedCompareExchangePointer((void* volatile*)&slot.device, device, nullptr)) {
+			((DID8_Refcount_type *)(*device)[1])(device);
+			return &slot;
+		}
+	}
+	return nullptr;
+}
+
+DID8_POLL(my_did8_Poll)
+{
+	if(input_thread) {
+		for(auto &slot : di_slots) {
+			if(slot.device == that) {
+				// Already done by the input thread.
+				return DI_OK;
+			}
+		}
+	}
+	return chain_did8_Poll(that);
+}
+
 DID8_GETDEVICESTATE(my_did8_GetDeviceState)
 {
+	if(input_thread && (cbData == sizeof(DIJOYSTATE) || cbData == sizeof(DIJOYSTATE2))) {
+		di_slot_t *slot = di_slot_get(that);
+		di_state_t state;
+		if(slot && slot->latest.read(state)) {
+			if(SUCCEEDED(state.ret)) {
+				memcpy(lpvData, &state.js, cbData);
+			}
+			return state.ret;
+		}
+	}
 	auto ret_state = chain_did8_GetDeviceState(that, cbData, lpvData);
 	if(
 		ret_state != DI_OK
@@ -246,9 +403,10 @@ DI8_CREATEDEVICE(my_di8_CreateDevice)
 	}
 	vtable_detour_t my[] = {
 		{ 6, my_did8_SetProperty, (void**)&chain_did8_SetProperty },
-		{ 9, my_did8_GetDeviceState, (void**)&chain_did8_GetDeviceState }
+		{ 9, my_did8_GetDeviceState, (void**)&chain_did8_GetDeviceState },
+		{ 25, my_did8_Poll, (void**)&chain_did8_Poll }
 	};
-	vtable_detour(**ppDevice, my, elementsof(my));
+	vtable_detour(**ppDevice, my, elementsof(my) - (input_thread ? 0 : 1));
 	return ret;
 }
 
@@ -271,6 +429,77 @@ DIRECTINPUT8CREATE(my_DirectInput8Create)
 }
 /// ---------------
 
+/// Input thread
+/// ------------
+static void input_thread_poll_joy(UINT id)
+{
+	joy_state_t state = {};
+	state.ji.dwSize = sizeof(state.ji);
+	state.ji.dwFlags = JOY_RETURNALL;
+	state.ret = chain_joyGetPosEx(id, &state.ji);
+	// Only read after the game thread has initialized it.
+	const auto *jc = &joy_info[id];
+	if(state.ret == JOYERR_NOERROR && jc->has_pov) {
+		pov_to_xy(state.ji.dwXpos, state.ji.dwYpos, jc->range, state.ji.dwPOV);
+	}
+	joy_slots[id].latest.publish(state);
+}
+
+static void input_thread_poll_di(di_slot_t &slot)
+{
+	void ***device = slot.device;
+	di_state_t state = {};
+	if(chain_did8_Poll) {
+		chain_did8_Poll(device);
+	}
+	state.ret = chain_did8_GetDeviceState(device, sizeof(state.js), (void **)&state.js);
+	if(state.ret == DI_OK) {
+		bool ret_map = false;
+		for(int i = 0; i < elementsof(state.js.rgdwPOV) && !ret_map; i++) {
+			ret_map = pov_to_xy(state.js.lX, state.js.lY, di_range, state.js.rgdwPOV[i]);
+		}
+	}
+	slot.latest.publish(state);
+}
+
+static DWORD WINAPI input_thread_proc(void *)
+{
+	while(!input_thread_quit) {
+		for(UINT id = 0; id < joy_count; id++) {
+			if(joy_slots[id].polled) {
+				input_thread_poll_joy(id);
+			}
+		}
+		for(auto &slot : di_slots) {
+			if(slot.device && chain_did8_GetDeviceState) {
+				input_thread_poll_di(slot);
+			}
+		}
+		Sleep(input_thread_interval_ms);
+	}
+	return 0;
+}
+
+static void input_thread_start(void)
+{
+	const json_t *hz = json_object_get(runconfig_json_get(), "tsa_input_thread_hz");
+	if(!json_is_integer(hz) || json_integer_value(hz) <= 0) {
+		return;
+	}
+	input_thread_interval_ms = (DWORD)max(1000 / json_integer_value(hz), 1);
+	joy_slots = std::make_unique<joy_slot_t[]>(joy_count);
+	// Sleep() would otherwise be limited to the default timer resolution.
+	timeBeginPeriod(1);
+	input_thread = CreateThread(nullptr, 0, input_thread_proc, nullptr, 0, nullptr);
+	if(!input_thread) {
+		timeEndPeriod(1);
+		return;
+	}
+	SetThreadPriority(input_thread, THREAD_PRIORITY_ABOVE_NORMAL);
+	log_printf("(Input) Polling joypads every %u ms on a separate thread\n", input_thread_interval_ms);
+}
+/// ------------
+
 extern "C" __declspec(dllexport) void input_mod_detour(void)
 {
 	// This conveniently returns the number of *possible* joysticks, *not* the
@@ -283,6 +512,8 @@ extern "C" __declspec(dllexport) void input_mod_detour(void)
 	if(!joy_info) {
 		return;
 	}
+	joy_count = num_devs;
+	input_thread_start();
 
 	detour_chain("winmm.dll", 1,
 		"joyGetPosEx", my_joyGetPosEx, &chain_joyGetPosEx,
@@ -298,3 +529,24 @@ extern "C" __declspec(dllexport) void input_mod_detour(void)
 		);
 	}
 }
+
+extern "C" __declspec(dllexport) void input_mod_exit(void)
+{
+	if(!input_thread) {
+		return;
+	}
+	InterlockedExchange(&input_thread_quit, 1);
+	const bool stopped = WaitForSingleObject(input_thread, INPUT_THREAD_EXIT_TIMEOUT) == WAIT_OBJECT_0;
+	CloseHandle(input_thread);
+	input_thread = nullptr;
+	timeEndPeriod(1);
+	// A thread stuck inside a driver might still use the devices.
+	if(stopped) {
+		for(auto &slot : di_slots) {
+			if(slot.device) {
+				((DID8_Refcount_type *)(*slot.device)[2])(slot.device);
+				slot.device = nullptr;
+			}
+		}
+	}
+}
@@ -9,6 +9,8 @@
 
 #include <thcrap.h>
 #include <unordered_map>
+#include <string>
+#include <vector>
 #include <tlnote.hpp>
 #include "thcrap_tsa.h"
 #include "layout.h"
@@ -45,6 +47,10 @@ W32U8_DETOUR_CHAIN_DEF(TextOut);
 
 /// TH06-TH09 font cache
 /// --------------------
+// These games delete and recreate their fonts all the time, and binary
+// hacks need them to stay valid, so this holds on to one reference per
+// height. The fonts themselves are shared with everyone else through
+// thcrap's font cache.
 static std::unordered_map<LONG, HFONT> fontcache;
 
 HFONT fontcache_get(LONG height)
@@ -217,25 +223,43 @@ int BP_ruby_offset(x86_reg_t *regs, json_t *bp_info)
 
 /// Tokenization
 /// ------------
-// Matches at most [len] bytes of layout markup at [str].
-// Returns an array with the layout parameters and, optionally,
-// the full length of the layout markup in [str] in [match_len].
-json_t* layout_match(size_t &match_len, const char *str, size_t len)
+typedef struct {
+	uint32_t offset;
+	uint32_t len;
+} layout_span_t;
+
+typedef struct {
+	// Plain text if false, with the text in the only parameter.
+	bool cmd;
+	uint32_t param_first;
+	uint32_t param_count;
+} layout_token_t;
+
+// Compact tokenization result. All spans are relative to the start of the
+// tokenized string.
+typedef struct {
+	std::vector<layout_span_t> params;
+	std::vector<layout_token_t> tokens;
+} layout_tokens_t;
+
+// Matches at most [len] bytes of layout markup at [str], which starts
+// [offset] bytes into the tokenized string, and appends the layout
+// parameters to [params]. Returns the full length of the layout markup in
+// [str], or 0 if [str] doesn't start with any.
+static size_t layout_match(std::vector<layout_span_t> &params, const char *str, size_t len, size_t offset)
 {
 	size_t i = 1;
 	const char *p = NULL;
 	const char *s = str + i; // argument start
-	json_t *ret = NULL;
 	int n = 0; // nesting level
 
 	if(!str || !len) {
-		return ret;
+		return 0;
 	}
 	if(str[0] != '<') {
-		return ret;
+		return 0;
 	}
 
-	ret = json_array();
 	for(p = s; (i < len) && (n >= 0); i++, p++) {
 		n += (*p == '<');
 		n -= (*p == '>');
@@ -243,45 +267,106 @@ json_t* layout_match(size_t &match_len, const char *str, size_t len)
 			(n == 0 && *p == '$')
 			|| (n == -1 && *p == '>')
 		) {
-			json_array_append_new(ret, json_stringn_nocheck(s, p - s));
+			params.push_back({ (uint32_t)(offset + (s - str)), (uint32_t)(p - s) });
 			s = p + 1;
 		}
 	}
-	match_len = s - str;
-	return ret;
+	return s - str;
 }
 
-json_t* layout_tokenize(const char *str, size_t len)
+static void layout_tokenize_compact(layout_tokens_t &ret, const char *str, size_t len)
 {
-	json_t *ret;
 	size_t i = 0;
-	if(!str || !len) {
-		return NULL;
-	}
-	ret = json_array();
+	ret.params.clear();
+	ret.tokens.clear();
 	while(i < len) {
 		const char *cur_str = str + i;
 		size_t cur_len = len - i;
 
-		json_t *match = layout_match(cur_len, cur_str, cur_len);
+		const auto param_first = ret.params.size();
+		const auto match_len = layout_match(ret.params, cur_str, cur_len, i);
+		const auto param_count = ret.params.size() - param_first;
+		if(match_len) {
+			cur_len = match_len;
+		}
 
 		// Requiring at least 2 parameters (meaning, a single $)
 		// for a layout command still lets people write "<text>"
 		// without that being swallowed by the layout parser.
-		if(json_array_size(match) > 1) {
-			json_array_append(ret, match);
+		if(param_count > 1) {
+			ret.tokens.push_back({ true, (uint32_t)param_first, (uint32_t)param_count });
 		} else {
+			ret.params.resize(param_first);
 			char *cmd_start = (char*)memchr(cur_str + 1, '<', cur_len - 1);
 			if(cmd_start) {
 				cur_len = cmd_start - cur_str;
 			}
 			if(cur_str[0]) {
-				json_array_append_new(ret, json_stringn_nocheck(cur_str, cur_len));
+				ret.params.push_back({ (uint32_t)i, (uint32_t)cur_len });
+				ret.tokens.push_back({ false, (uint32_t)param_first, 1 });
 			}
 		}
-		json_decref(match);
 		i += cur_len;
 	}
+}
+
+// Number of tokenized strings to keep around. Mostly relevant for games
+// that render changing numbers through the layout code.
+#define LAYOUT_TOKEN_CACHE_MAX 1024
+
+static std::unordered_map<std::string, layout_tokens_t> layout_token_cache;
+
+// Returns the cached tokenization of [str]. The reference stays valid
+// until the next call.
+static const layout_tokens_t& layout_tokens_get(const char *str, size_t len)
+{
+	// Most strings don't contain any markup, and don't need to be cached.
+	if(!memchr(str, '<', len)) {
+		static layout_tokens_t plain;
+		plain.params.assign(1, { 0, (uint32_t)len });
+		plain.tokens.assign(1, { false, 0, 1 });
+		if(!str[0]) {
+			plain.tokens.clear();
+		}
+		return plain;
+	}
+	std::string key(str, len);
+	auto cached = layout_token_cache.find(key);
+	if(cached != layout_token_cache.end()) {
+		return cached->second;
+	}
+	if(layout_token_cache.size() >= LAYOUT_TOKEN_CACHE_MAX) {
+		layout_token_cache.clear();
+	}
+	auto &ret = layout_token_cache[std::move(key)];
+	layout_tokenize_compact(ret, str, len);
+	return ret;
+}
+
+json_t* layout_tokenize(const char *str, size_t len)
+{
+	if(!str || !len) {
+		return NULL;
+	}
+	layout_tokens_t tokens;
+	layout_tokenize_compact(tokens, str, len);
+
+	auto span_json = [&](const layout_span_t &span) {
+		return json_stringn_nocheck(str + span.offset, span.len);
+	};
+	json_t *ret = json_array();
+	for(const auto &token : tokens.tokens) {
+		const auto *params = &tokens.params[token.param_first];
+		if(token.cmd) {
+			json_t *cmd = json_array();
+			for(uint32_t i = 0; i < token.param_count; i++) {
+				json_array_append_new(cmd, span_json(params[i]));
+			}
+			json_array_append_new(ret, cmd);
+		} else {
+			json_array_append_new(ret, span_json(params[0]));
+		}
+	}
 	return ret;
 }
 /// ------------
@@ -295,7 +380,8 @@ typedef struct {
 	LONG bitmap_width;
 
 	/// State
-	json_t *tokens;
+	const char *str; // Tokenized string
+	const layout_tokens_t *tokens;
 	size_t cur_tab;
 	// After layout processing completed, this contains
 	// the total rendered width of the full string.
@@ -304,91 +390,157 @@ typedef struct {
 
 	/// Current pass
 	size_t token_id;
-	json_t *draw_str; // String to draw
+	std::string_view draw_str; // String to draw, nothing if data() is NULL
 	size_t cur_w; // Amount of pixels to advance [cur_x] after drawing
+
+	/// Text run, collected by layout_textout_raw()
+	std::wstring run_str;
+	std::vector<INT> run_dx; // Horizontal advance of every character
+	POINT run_orig;
+	LONG run_end_x;
 } layout_state_t;
 
 // A function to be called for every substring to be rendered.
 // [lay->draw_str] points to the string, [p] is the absolute drawing position.
 typedef BOOL (*layout_func_t)(layout_state_t *lay, POINT p);
 
+static std::string_view layout_param(const layout_state_t *lay, const layout_token_t &token, size_t i)
+{
+	if(i >= token.param_count) {
+		return {};
+	}
+	const auto &span = lay->tokens->params[token.param_first + i];
+	return { lay->str + span.offset, span.len };
+}
+
+static size_t text_extent_base(HDC hdc, std::string_view str)
+{
+	SIZE size = {0};
+	GetTextExtentPoint32(hdc, str.data(), str.size(), &size);
+	return size.cx;
+}
+
+// Draws the collected text run, if any, in one call.
+BOOL layout_run_flush(layout_state_t *lay)
+{
+	BOOL ret = 1;
+	if(!lay->run_str.empty()) {
+		ret = ExtTextOutW(
+			lay->hdc, lay->run_orig.x, lay->run_orig.y, 0, NULL,
+			lay->run_str.data(), lay->run_str.size(), lay->run_dx.data()
+		);
+		lay->run_str.clear();
+		lay->run_dx.clear();
+	}
+	return ret;
+}
+
+// Appends [lay->draw_str] to the text run, which is then drawn by
+// layout_run_flush() with the exact glyph positions of all substrings.
+// All substrings in a run must use the same font.
 BOOL layout_textout_raw(layout_state_t *lay, POINT p)
 {
-	if(lay) {
-		const char *str = json_string_value(lay->draw_str);
-		const size_t len = json_string_length(lay->draw_str);
-		return chain_TextOutU(lay->hdc, p.x, p.y, str, len);
+	if(!lay) {
+		return 0;
 	}
-	return 0;
+	BOOL ret = 1;
+	if(!lay->run_str.empty() && (p.y != lay->run_orig.y || p.x < lay->run_end_x)) {
+		ret = layout_run_flush(lay);
+	}
+	const auto &str = lay->draw_str;
+	if(str.empty()) {
+		return ret;
+	}
+	// UTF-16 never needs more code units than there are bytes in
+	// either UTF-8 or the Shift-JIS fallback.
+	const size_t run_len = lay->run_str.size();
+	lay->run_str.resize(run_len + str.size());
+	int w_len = utf8_to_utf16(&lay->run_str[run_len], str.data(), str.size());
+	SIZE size = {0};
+	lay->run_dx.resize(run_len + max(w_len, 0));
+	if(w_len <= 0 || !GetTextExtentExPointW(
+		lay->hdc, &lay->run_str[run_len], w_len, 0, NULL, &lay->run_dx[run_len], &size
+	)) {
+		lay->run_str.resize(run_len);
+		lay->run_dx.resize(run_len);
+		return 0;
+	}
+	lay->run_str.resize(run_len + w_len);
+
+	// Partial extents → per-character advances
+	auto *dx = &lay->run_dx[run_len];
+	for(int i = w_len - 1; i > 0; i--) {
+		dx[i] -= dx[i - 1];
+	}
+	if(run_len == 0) {
+		lay->run_orig = p;
+	} else {
+		// Skip over any space left by tabs or alignment.
+		dx[-1] += p.x - lay->run_end_x;
+	}
+	lay->run_end_x = p.x + size.cx;
+	return ret;
 }
 
 // Modifies [lf] according to the font-related commands in [cmd].
 // Returns 1 if anything in [lf] was changed.
-int layout_parse_font(LOGFONT &lf, const json_t *token)
+int layout_parse_font(LOGFONT &lf, std::string_view cmd)
 {
 	int ret = 0;
-	const char *cmd = json_array_get_string(token, 0);
-	if(cmd) {
-		while(*cmd) {
-			if(*cmd == 'b') {
-				// Bold font
-				lf.lfWeight *= 2;
-				ret = 1;
-			} else if(*cmd == 'i') {
-				// Italic font
-				lf.lfItalic = true;
-				ret = 1;
-			} else if(*cmd == 'u') {
-				// Underlined font
-				lf.lfUnderline = true;
-				ret = 1;
-			}
-			cmd++;
+	for(char c : cmd) {
+		if(c == 'b') {
+			// Bold font
+			lf.lfWeight *= 2;
+			ret = 1;
+		} else if(c == 'i') {
+			// Italic font
+			lf.lfItalic = true;
+			ret = 1;
+		} else if(c == 'u') {
+			// Underlined font
+			lf.lfUnderline = true;
+			ret = 1;
 		}
 	}
 	return ret;
 }
 
 // Returns the number of tab commands parsed.
-int layout_parse_tabs(layout_state_t *lay, const json_t *token)
+int layout_parse_tabs(layout_state_t *lay, const layout_token_t &token)
 {
 	size_t tabs_count = json_array_size(Layout_Tabs);
 	size_t tab_end; // Absolute x-end position of the current tab
-	const json_t *cmd_json = json_array_get(token, 0);
-	const char *cmd = json_string_value(cmd_json);
-	int ret = json_string_length(cmd_json);
-	const json_t *p2 = json_array_get(token, 2);
-	if(p2) {
-		const char *p2_str = json_string_value(p2);
+	const auto cmd = layout_param(lay, token, 0);
+	int ret = cmd.size();
+	if(token.param_count > 2) {
+		const auto p2 = layout_param(lay, token, 2);
 		// Use full bitmap with empty second parameter
-		if(p2_str && !p2_str[0]) {
+		if(p2.empty()) {
 			tab_end = lay->bitmap_width;
 		} else {
-			tab_end = lay->cur_x + GetTextExtentBase(lay->hdc, p2);
+			tab_end = lay->cur_x + text_extent_base(lay->hdc, p2);
 		}
 	} else if(lay->cur_tab < tabs_count) {
 		tab_end = json_array_get_hex(Layout_Tabs, lay->cur_tab);
-	} else if(tabs_count > 0 && lay->token_id == (json_array_size(lay->tokens) - 1)) {
+	} else if(tabs_count > 0 && lay->token_id == (lay->tokens->tokens.size() - 1)) {
 		tab_end = lay->bitmap_width;
 	} else {
 		tab_end = lay->cur_x + lay->cur_w;
 	}
 
-	while(*cmd) {
-		size_t j = 2;
-		const json_t *str_obj = NULL;
-		switch(cmd[0]) {
+	for(char c : cmd) {
+		switch(c) {
 			case 's':
 				// Don't actually print anything
 				tab_end = lay->cur_x;
-				lay->draw_str = NULL;
+				lay->draw_str = {};
 				break;
 			case 't':
 				// Tabstop definition
 				// The width of the first parameter is already in cur_w, so...
 				tab_end = lay->cur_w;
-				while(str_obj = json_array_get(token, j++)) {
-					size_t new_w = GetTextExtentBase(lay->hdc, str_obj);
+				for(size_t j = 2; j < token.param_count; j++) {
+					size_t new_w = text_extent_base(lay->hdc, layout_param(lay, token, j));
 					tab_end = max(new_w, tab_end);
 				}
 				tab_end += lay->cur_x;
@@ -410,7 +562,6 @@ int layout_parse_tabs(layout_state_t *lay, const json_t *token)
 				ret--;
 				break;
 		}
-		cmd++;
 	}
 	if(ret) {
 		lay->cur_tab++;
@@ -428,7 +579,6 @@ int layout_process(layout_state_t *lay, layout_func_t func, const char *str, siz
 	HBITMAP hBitmap;
 	HFONT hFontOrig;
 	LOGFONT font_orig;
-	json_t *token;
 	if(!lay || !lay->hdc || !str || !len) {
 		return -1;
 	}
@@ -443,6 +593,9 @@ int layout_process(layout_state_t *lay, layout_func_t func, const char *str, siz
 	str = tln.regular.str;
 	len = tln.regular.len;
 	lay->tlnote = tln.tlnote;
+	if(!str || !len) {
+		return ret;
+	}
 
 	if(hBitmap) {
 		// TODO: This gets the full width of the text bitmap. The
@@ -457,40 +610,52 @@ int layout_process(layout_state_t *lay, layout_func_t func, const char *str, siz
 		GetObject(hFontOrig, sizeof(LOGFONT), &font_orig);
 	}
 
-	lay->tokens = layout_tokenize(str, len);
+	lay->str = str;
+	lay->tokens = &layout_tokens_get(str, len);
 
-	json_array_foreach(lay->tokens, lay->token_id, token) {
+	const auto &tokens = lay->tokens->tokens;
+	for(lay->token_id = 0; lay->token_id < tokens.size(); lay->token_id++) {
+		const auto &token = tokens[lay->token_id];
 		HFONT hFontNew = NULL;
-		if(json_is_array(token)) {
+		if(token.cmd) {
 			LOGFONT font_new = font_orig;
-			lay->draw_str = json_array_get(token, 1);
+			lay->draw_str = layout_param(lay, token, 1);
 
 			// If requested, derive a bold/italic font from the current one.
 			// This is done before evaluating tab commmands to guarantee that
 			// any calls to GetTextExtent() return the correct widths.
-			if(layout_parse_font(font_new, token)) {
+			if(layout_parse_font(font_new, layout_param(lay, token, 0))) {
+				if(!layout_run_flush(lay)) {
+					ret = 0;
+				}
 				hFontNew = CreateFontIndirectW(&font_new);
 				SelectObject(lay->hdc, hFontNew);
 			}
 
-			lay->cur_w = GetTextExtentBase(lay->hdc, lay->draw_str);
+			lay->cur_w = text_extent_base(lay->hdc, lay->draw_str);
 			layout_parse_tabs(lay, token);
-		} else if(json_is_string(token)) {
-			lay->draw_str = token;
-			lay->cur_w = GetTextExtentBase(lay->hdc, lay->draw_str);
+		} else {
+			lay->draw_str = layout_param(lay, token, 0);
+			lay->cur_w = text_extent_base(lay->hdc, lay->draw_str);
 		}
-		if(lay->draw_str && func) {
+		if(lay->draw_str.data() && func) {
 			POINT p = {lay->orig.x + lay->cur_x, lay->orig.y};
 			ret = func(lay, p);
 		}
 		if(hFontNew) {
+			if(!layout_run_flush(lay)) {
+				ret = 0;
+			}
 			SelectObject(lay->hdc, hFontOrig);
 			DeleteObject(hFontNew);
 			hFontNew = NULL;
 		}
 		lay->cur_x += lay->cur_w;
 	}
-	lay->tokens = json_decref_safe(lay->tokens);
+	if(!layout_run_flush(lay)) {
+		ret = 0;
+	}
+	lay->tokens = NULL;
 	return ret;
 }
 /// -----------------
@@ -598,11 +763,9 @@ BOOL WINAPI layout_TextOutU(
 
 size_t GetTextExtentBase(HDC hdc, const json_t *str_obj)
 {
-	SIZE size = {0};
-	const char *str = json_string_value(str_obj);
-	const size_t str_len = json_string_length(str_obj);
-	GetTextExtentPoint32(hdc, str, str_len, &size);
-	return size.cx;
+	return text_extent_base(hdc, {
+		json_string_value(str_obj), json_string_length(str_obj)
+	});
 }
 
 size_t __stdcall text_extent_full(const char *str)
@@ -733,4 +896,5 @@ void layout_mod_exit(void)
 		DeleteObject((HGDIOBJ)font.second);
 	}
 	fontcache.clear();
+	layout_token_cache.clear();
 }
@@ -9,25 +9,124 @@
 
 #include <thcrap.h>
 #include "thcrap_tsa.h"
+#include <vector>
 
 size_t track_id_internal = 0;
 int track_id_displayed = 0; // int because it's an argument for a printf() %d
 
-const char* music_title_get(size_t track)
+/// Lookup tables
+/// -------------
+/**
+  * The current game's titles from themes.js and its musiccmt.js are compiled
+  * into arrays indexed by track number, just like the spell tables. Strings
+  * point into the jsondata versions of the files, and replaced tables are
+  * retired rather than deleted.
+  */
+
+// Larger track numbers are ignored, rather than blowing up the arrays.
+#define MUSIC_TRACK_MAX 0xFFFF
+
+struct music_cmt_t {
+	bool present;
+	// "@" lines, which are replaced with the formatted title, are NULL.
+	std::vector<const char*> lines;
+};
+
+struct music_table_t {
+	std::vector<const char*> titles;
+	std::vector<music_cmt_t> cmts;
+
+	const char* title_get(size_t track) const {
+		return track < titles.size() ? titles[track] : nullptr;
+	}
+	const music_cmt_t* cmt_get(size_t track) const {
+		return (track < cmts.size() && cmts[track].present) ? &cmts[track] : nullptr;
+	}
+};
+
+static music_table_t *volatile music_table = nullptr;
+static std::vector<music_table_t*> music_tables_retired;
+
+// Parses the decimal number at [str], which has to make up the rest of the
+// string, has at least [digits_min] digits, and no more leading zeroes than
+// are needed for that. This only accepts the keys that the printf() formats
+// used for the lookups would produce. Returns -1 on failure.
+static int music_track_parse(const char *str, size_t digits_min)
 {
-	const char *ret = NULL;
-	const char *game = runconfig_game_get();
-	if(game) {
-		json_t *themes = jsondata_get("themes.js");
-		size_t key_len = strlen(game) + 1 + 2 + str_num_digits(track) + 1;
-		VLA(char, key, key_len);
-		sprintf(key, "%s_%02u", game, track);
-		ret = json_object_get_string(themes, key);
-		VLA_FREE(key);
+	size_t len = strlen(str);
+	if(len < digits_min || (len > digits_min && str[0] == '0')) {
+		return -1;
+	}
+	int ret = 0;
+	for(; *str; str++) {
+		if(!isdigit((unsigned char)*str)) {
+			return -1;
+		}
+		ret = ret * 10 + (*str - '0');
+		if(ret > MUSIC_TRACK_MAX) {
+			return -1;
+		}
 	}
 	return ret;
 }
 
+static music_table_t* music_table_compile(const char *game, const json_t *themes, const json_t *musiccmt)
+{
+	auto *table = new music_table_t;
+	const char *key;
+	json_t *val;
+
+	// Titles are keyed as "<game>_%02u".
+	const size_t game_len = game ? strlen(game) : 0;
+	json_object_foreach((json_t *)(game ? themes : nullptr), key, val) {
+		if(strncmp(key, game, game_len) || key[game_len] != '_' || !json_is_string(val)) {
+			continue;
+		}
+		int track = music_track_parse(key + game_len + 1, 2);
+		if(track >= 0) {
+			if(table->titles.size() <= (size_t)track) {
+				table->titles.resize(track + 1);
+			}
+			table->titles[track] = json_string_value(val);
+		}
+	}
+	json_object_foreach((json_t *)musiccmt, key, val) {
+		int track = music_track_parse(key, 1);
+		if(track < 0 || !json_is_array(val)) {
+			continue;
+		}
+		if(table->cmts.size() <= (size_t)track) {
+			table->cmts.resize(track + 1);
+		}
+		music_cmt_t &cmt = table->cmts[track];
+		cmt.present = true;
+		cmt.lines.resize(json_array_size(val));
+		for(size_t i = 0; i < cmt.lines.size(); i++) {
+			const char *line = json_array_get_string_safe(val, i);
+			cmt.lines[i] = strcmp(line, "@") ? line : nullptr;
+		}
+	}
+	return table;
+}
+
+static void music_table_update(void)
+{
+	auto *table = music_table_compile(
+		runconfig_game_get(), jsondata_get("themes.js"), jsondata_game_get("musiccmt.js")
+	);
+	auto *prev = (music_table_t *)InterlockedExchangePointer((PVOID *)&music_table, table);
+	if(prev) {
+		music_tables_retired.push_back(prev);
+	}
+}
+/// -------------
+
+const char* music_title_get(size_t track)
+{
+	const music_table_t *table = music_table;
+	return table ? table->title_get(track) : NULL;
+}
+
 void music_title_print(const char **str, const char *format_id, size_t track_id_internal, int track_id_displayed)
 {
 	if(str) {
@@ -84,12 +183,12 @@ int BP_music_cmt(x86_reg_t *regs, json_t *bp_info)
 		cache_cmt_line = json_immediate_value(line_num, regs);
 	}
 	if(str && *str) {
-		json_t *musiccmt = jsondata_game_get("musiccmt.js");
-		json_t *cmt = json_object_numkey_get(musiccmt, track_id_internal);
-		if(json_is_array(cmt)) {
-			const char* str_rep = json_array_get_string_safe(cmt, cache_cmt_line);
+		const music_table_t *table = music_table;
+		const music_cmt_t *cmt = table ? table->cmt_get(track_id_internal) : nullptr;
+		if(cmt) {
+			const char* str_rep = cache_cmt_line < cmt->lines.size() ? cmt->lines[cache_cmt_line] : "";
 			// Resolve "@" to a music title format string
-			if(!strcmp(str_rep, "@")) {
+			if(!str_rep) {
 				music_title_print(str, format_id, track_id_internal, track_id_displayed);
 			} else {
 				*str = str_rep;
@@ -103,4 +202,27 @@ void music_mod_init(void)
 {
 	jsondata_add("themes.js");
 	jsondata_game_add("musiccmt.js");
+	music_table_update();
+}
+
+void music_mod_repatch(json_t *files_changed)
+{
+	// jsondata has already loaded the new versions at this point.
+	const char *fn;
+	json_t *val;
+	json_object_foreach(files_changed, fn, val) {
+		if(strstr(fn, "themes.") || strstr(fn, "musiccmt.")) {
+			music_table_update();
+			return;
+		}
+	}
+}
+
+void music_mod_exit(void)
+{
+	delete (music_table_t *)InterlockedExchangePointer((PVOID *)&music_table, nullptr);
+	for(auto *table : music_tables_retired) {
+		delete table;
+	}
+	music_tables_retired.clear();
 }
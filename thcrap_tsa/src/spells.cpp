@@ -11,11 +11,139 @@
 // (TL notes should be removed before every spell card declaration)
 #include <tlnote.hpp>
 #include "thcrap_tsa.h"
+#include <vector>
 
 // Lookup cache
 static int cache_spell_id = 0;
 static int cache_spell_id_real = 0;
 
+/// Lookup tables
+/// -------------
+/**
+  * spells.js and spellcomments.js are compiled into arrays indexed by spell
+  * ID whenever they are (re)loaded, so that the breakpoints don't need any
+  * JSON lookups. All strings point into the jsondata versions of the files,
+  * which stay alive until exit. Old tables are kept around as well, since
+  * another thread could still be reading them.
+  */
+
+// Larger IDs are ignored, rather than blowing up the arrays.
+#define SPELL_ID_MAX 0xFFFF
+
+struct spell_comment_t {
+	bool present;
+	std::vector<const char*> lines;
+};
+
+struct spell_t {
+	const char *name;
+	const char *owner;
+	// Indexed by comment number
+	std::vector<spell_comment_t> comments;
+};
+
+struct spells_table_t {
+	std::vector<spell_t> spells;
+
+	const spell_t* get(int id) const {
+		return (id >= 0 && (size_t)id < spells.size()) ? &spells[id] : nullptr;
+	}
+};
+
+static spells_table_t *volatile spells_table = nullptr;
+static std::vector<spells_table_t*> spells_tables_retired;
+
+// Returns the spell ID for a key of spells.js or spellcomments.js, or -1 if
+// json_object_numkey_get() would never look it up.
+static int spell_id_parse(const char *key)
+{
+	if(!isdigit((unsigned char)key[0]) || (key[0] == '0' && key[1])) {
+		return -1;
+	}
+	int ret = 0;
+	for(; *key; key++) {
+		if(!isdigit((unsigned char)*key)) {
+			return -1;
+		}
+		ret = ret * 10 + (*key - '0');
+		if(ret > SPELL_ID_MAX) {
+			return -1;
+		}
+	}
+	return ret;
+}
+
+static spell_t& spells_table_at(spells_table_t *table, int id)
+{
+	if(table->spells.size() <= (size_t)id) {
+		table->spells.resize(id + 1);
+	}
+	return table->spells[id];
+}
+
+static spells_table_t* spells_table_compile(const json_t *spells, const json_t *spellcomments)
+{
+	auto *table = new spells_table_t;
+	const char *key;
+	json_t *val;
+
+	json_object_foreach((json_t *)spells, key, val) {
+		int id = spell_id_parse(key);
+		if(id >= 0 && json_is_string(val)) {
+			spells_table_at(table, id).name = json_string_value(val);
+		}
+	}
+	json_object_foreach((json_t *)spellcomments, key, val) {
+		int id = spell_id_parse(key);
+		if(id < 0 || !json_is_object(val)) {
+			continue;
+		}
+		spell_t &spell = spells_table_at(table, id);
+		const char *cmt_key;
+		json_t *cmt;
+		json_object_foreach(val, cmt_key, cmt) {
+			if(!strcmp(cmt_key, "owner")) {
+				spell.owner = json_string_value(cmt);
+				continue;
+			}
+			unsigned int comment_num;
+			char dummy;
+			if(!json_is_array(cmt) || sscanf(cmt_key, "comment_%u%c", &comment_num, &dummy) != 1) {
+				continue;
+			}
+			// Only match what the sprintf() in BP_spell_comment_line()
+			// used to produce.
+			char cmt_key_check[DECIMAL_DIGITS_BOUND(unsigned int) + 9];
+			snprintf(cmt_key_check, sizeof(cmt_key_check), "comment_%u", comment_num);
+			if(strcmp(cmt_key, cmt_key_check) || comment_num > SPELL_ID_MAX) {
+				continue;
+			}
+			if(spell.comments.size() <= comment_num) {
+				spell.comments.resize(comment_num + 1);
+			}
+			spell_comment_t &comment = spell.comments[comment_num];
+			comment.present = true;
+			comment.lines.resize(json_array_size(cmt));
+			for(size_t i = 0; i < comment.lines.size(); i++) {
+				comment.lines[i] = json_array_get_string_safe(cmt, i);
+			}
+		}
+	}
+	return table;
+}
+
+static void spells_table_update(void)
+{
+	auto *table = spells_table_compile(
+		jsondata_game_get("spells.js"), jsondata_game_get("spellcomments.js")
+	);
+	auto *prev = (spells_table_t *)InterlockedExchangePointer((PVOID *)&spells_table, table);
+	if(prev) {
+		spells_tables_retired.push_back(prev);
+	}
+}
+/// -------------
+
 int BP_spell_id(x86_reg_t *regs, json_t *bp_info)
 {
 	// Parameters
@@ -56,12 +184,13 @@ int BP_spell_name(x86_reg_t *regs, json_t *bp_info)
 	if(spell_name && cache_spell_id_real >= cache_spell_id) {
 		const char *new_name = NULL;
 		int i = cache_spell_id_real;
-		json_t *spells = jsondata_game_get("spells.js");
+		const spells_table_t *table = spells_table;
 
 		// Count down from the real number to the given number
 		// until we find something
 		do {
-			new_name = json_string_value(json_object_numkey_get(spells, i));
+			const spell_t *spell = table ? table->get(i) : nullptr;
+			new_name = spell ? spell->name : nullptr;
 		} while( (i-- > cache_spell_id) && i >= 0 && !new_name );
 
 		if(new_name) {
@@ -87,24 +216,21 @@ int BP_spell_comment_line(x86_reg_t *regs, json_t *bp_info)
 	// -----------------
 
 	if(str && comment_num) {
-		json_t *json_cmt = NULL;
+		const spell_comment_t *cmt = nullptr;
 		int i = cache_spell_id_real;
-		json_t *spellcomments = jsondata_game_get("spellcomments.js");
-
-		size_t cmt_key_str_len = strlen("comment_") + 16 + 1;
-		VLA(char, cmt_key_str, cmt_key_str_len);
-		defer({ VLA_FREE(cmt_key_str); });
-		sprintf(cmt_key_str, "comment_%u", comment_num);
+		const spells_table_t *table = spells_table;
 
 		// Count down from the real number to the given number
 		// until we find something
 		do {
-			json_cmt = json_object_numkey_get(spellcomments, i);
-			json_cmt = json_object_get(json_cmt, cmt_key_str);
-		} while( (i-- > cache_spell_id) && !json_is_array(json_cmt) );
+			const spell_t *spell = table ? table->get(i) : nullptr;
+			if(spell && comment_num < spell->comments.size() && spell->comments[comment_num].present) {
+				cmt = &spell->comments[comment_num];
+			}
+		} while( (i-- > cache_spell_id) && !cmt );
 
-		if(json_is_array(json_cmt)) {
-			*str = json_array_get_string_safe(json_cmt, line_num);
+		if(cmt) {
+			*str = line_num < cmt->lines.size() ? cmt->lines[line_num] : "";
 			return breakpoint_cave_exec_flag(bp_info);
 		}
 	}
@@ -126,12 +252,13 @@ int BP_spell_owner(x86_reg_t *regs, json_t *bp_info)
 	if (spell_owner && cache_spell_id_real >= cache_spell_id) {
 		const char *new_owner = NULL;
 		int i = cache_spell_id_real;
-		json_t *spellcomments = jsondata_game_get("spellcomments.js");
+		const spells_table_t *table = spells_table;
 
 		// Count down from the real number to the given number
 		// until we find something
 		do {
-			new_owner = json_string_value(json_object_get(json_object_numkey_get(spellcomments, i), "owner"));
+			const spell_t *spell = table ? table->get(i) : nullptr;
+			new_owner = spell ? spell->owner : nullptr;
 		} while ((i-- > cache_spell_id) && i >= 0 && !new_owner);
 
 		if (new_owner) {
@@ -146,4 +273,27 @@ void spells_mod_init(void)
 {
 	jsondata_game_add("spells.js");
 	jsondata_game_add("spellcomments.js");
+	spells_table_update();
+}
+
+void spells_mod_repatch(json_t *files_changed)
+{
+	// jsondata has already loaded the new versions at this point.
+	const char *fn;
+	json_t *val;
+	json_object_foreach(files_changed, fn, val) {
+		if(strstr(fn, "spells.") || strstr(fn, "spellcomments.")) {
+			spells_table_update();
+			return;
+		}
+	}
+}
+
+void spells_mod_exit(void)
+{
+	delete (spells_table_t *)InterlockedExchangePointer((PVOID *)&spells_table, nullptr);
+	for(auto *table : spells_tables_retired) {
+		delete table;
+	}
+	spells_tables_retired.clear();
 }
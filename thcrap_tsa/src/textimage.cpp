@@ -51,6 +51,198 @@ void** SpriteScripts;
 bool Initialized;
 /// ====================
 
+/// Texture pool
+/// ============
+/**
+  * Creating a managed texture makes the driver allocate video memory, which
+  * causes noticeable hitches when images are reloaded in the middle of the
+  * game. Therefore, image files are only decoded into system memory, and
+  * then copied into a texture we already own: either the one currently in
+  * the image's texture slot, which only receives the rows that actually
+  * changed, or an unused one of the same size and format.
+  *
+  * 8-bit RGB(A) PNGs are decoded by thcrap's own decoder, right into
+  * A8R8G8B8 rows. Only all other images still go through the game's D3DX.
+  */
+struct texture_pool_key_t {
+	UINT w;
+	UINT h;
+	D3DFORMAT format;
+	D3DPOOL pool;
+
+	bool operator ==(const texture_pool_key_t &other) const {
+		return (w == other.w) && (h == other.h)
+			&& (format == other.format) && (pool == other.pool);
+	}
+};
+
+struct texture_pooled_t {
+	texture_pool_key_t key;
+	IDirect3DTexture *tex;
+};
+
+// Maximum number of unused textures to keep around.
+#define TEXTURE_POOL_MAX 8
+
+// Textures created by us that are currently in a texture slot.
+std::unordered_map<IDirect3DTexture *, texture_pool_key_t> TexturesInUse;
+
+// Unused textures, oldest first.
+std::vector<texture_pooled_t> TexturePool;
+
+// Returns 0 for formats we can't copy row by row.
+size_t texture_format_bpp(D3DFORMAT format)
+{
+	switch(format) {
+	case D3DFMT_A8R8G8B8:
+	case D3DFMT_X8R8G8B8:
+		return 4;
+	case D3DFMT_R8G8B8:
+		return 3;
+	case D3DFMT_R5G6B5:
+	case D3DFMT_X1R5G5B5:
+	case D3DFMT_A1R5G5B5:
+	case D3DFMT_A4R4G4B4:
+	case D3DFMT_X4R4G4B4:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+// Returns an unused texture matching [key], or creates a new one.
+IDirect3DTexture* texture_pool_get(const texture_pool_key_t &key)
+{
+	IDirect3DTexture *tex = nullptr;
+	for(auto it = TexturePool.begin(); it != TexturePool.end(); it++) {
+		if(it->key == key) {
+			tex = it->tex;
+			TexturePool.erase(it);
+			break;
+		}
+	}
+	if(!tex && FAILED(d3dd_CreateTexture(
+		D3D8, pD3DDevice, key.w, key.h, 1, 0, key.format, key.pool, &tex
+	))) {
+		return nullptr;
+	}
+	TexturesInUse[tex] = key;
+	return tex;
+}
+
+// Takes [*tex] out of its texture slot, keeping it for later reuse if we
+// created it.
+void texture_pool_put(IDirect3DTexture **tex)
+{
+	if(*tex == nullptr) {
+		return;
+	}
+	auto in_use = TexturesInUse.find(*tex);
+	if(in_use == TexturesInUse.end()) {
+		auto refcount = (*tex)->Release();
+		assert(refcount == 0);
+	} else {
+		if(TexturePool.size() >= TEXTURE_POOL_MAX) {
+			TexturePool.front().tex->Release();
+			TexturePool.erase(TexturePool.begin());
+		}
+		TexturePool.push_back({ in_use->second, *tex });
+		TexturesInUse.erase(in_use);
+	}
+	*tex = nullptr;
+}
+
+void texture_pool_clear()
+{
+	for(auto &pooled : TexturePool) {
+		pooled.tex->Release();
+	}
+	TexturePool.clear();
+	TexturesInUse.clear();
+}
+
+// Copies the [key.h] rows of [src], [src_pitch] bytes apart, into the first
+// mip level of [dst], which must have the size and format of [key]. If
+// [changed_only] is set, only the rows that differ are locked for writing,
+// which keeps the driver from uploading the rest.
+HRESULT texture_copy(IDirect3DTexture *dst, const uint8_t *src, size_t src_pitch, const texture_pool_key_t &key, bool changed_only)
+{
+	const size_t row_size = key.w * texture_format_bpp(key.format);
+	D3DLOCKED_RECT dst_lr;
+	HRESULT ret;
+
+	auto src_row = [&](UINT y) {
+		return src + (size_t)y * src_pitch;
+	};
+
+	RECT rect = { 0, 0, (LONG)key.w, (LONG)key.h };
+	if(changed_only) {
+		ret = d3dtex_LockRect(D3D8, dst, 0, &dst_lr, nullptr, D3DLOCK_READONLY);
+		if(FAILED(ret)) {
+			return ret;
+		}
+		auto dst_row_same = [&](UINT y) {
+			return !memcmp((const uint8_t *)dst_lr.pBits + (size_t)y * dst_lr.Pitch, src_row(y), row_size);
+		};
+		while(rect.top < rect.bottom && dst_row_same(rect.top)) {
+			rect.top++;
+		}
+		while(rect.bottom > rect.top && dst_row_same(rect.bottom - 1)) {
+			rect.bottom--;
+		}
+		d3dtex_UnlockRect(D3D8, dst, 0);
+		if(rect.top == rect.bottom) {
+			return D3D_OK;
+		}
+	}
+	// With a rectangle, the returned pointer points to its first row.
+	ret = d3dtex_LockRect(D3D8, dst, 0, &dst_lr, &rect, 0);
+	if(FAILED(ret)) {
+		return ret;
+	}
+	auto *dst_p = (uint8_t *)dst_lr.pBits;
+	for(LONG y = rect.top; y < rect.bottom; y++) {
+		memcpy(dst_p, src_row(y), row_size);
+		dst_p += dst_lr.Pitch;
+	}
+	return d3dtex_UnlockRect(D3D8, dst, 0);
+}
+
+// Same as above, with the first mip level of another texture as the source.
+HRESULT texture_copy(IDirect3DTexture *dst, IDirect3DTexture *src, const texture_pool_key_t &key, bool changed_only)
+{
+	D3DLOCKED_RECT src_lr;
+	HRESULT ret = d3dtex_LockRect(D3D8, src, 0, &src_lr, nullptr, D3DLOCK_READONLY);
+	if(FAILED(ret)) {
+		return ret;
+	}
+	ret = texture_copy(dst, (const uint8_t *)src_lr.pBits, src_lr.Pitch, key, changed_only);
+	d3dtex_UnlockRect(D3D8, src, 0);
+	return ret;
+}
+
+// Decodes [image_buf] into new BGRA rows from the buffer pool, if thcrap's
+// own decoder supports it. Returns nullptr otherwise.
+uint8_t* texture_decode(const void *image_buf, size_t image_size, UINT &w, UINT &h)
+{
+	png_decode_t dec;
+	const unsigned int flags = PNG_DECODE_ADD_ALPHA | PNG_DECODE_BGR | PNG_DECODE_SRGB_ONLY;
+	if(png_decode_begin(&dec, image_buf, image_size, flags)) {
+		return nullptr;
+	}
+	const size_t stride = (size_t)dec.width * 4;
+	auto *ret = (uint8_t *)buffer_pool_alloc(stride * dec.height);
+	if(ret && png_decode_rows(&dec, ret, stride, dec.height)) {
+		buffer_pool_free(ret);
+		ret = nullptr;
+	}
+	w = dec.width;
+	h = dec.height;
+	png_decode_end(&dec);
+	return ret;
+}
+/// ============
+
 /// Text image info
 /// ===============
 struct textimage_t {
@@ -299,13 +491,13 @@ HRESULT textimage_t::reload(bool fallback_on_failure)
 		safe_release(&tex);
 		if(lower) {
 			if(fallback_on_failure) {
-				safe_release(&TextureSlots[texture_slot]);
+				texture_pool_put(&TextureSlots[texture_slot]);
 				sr.active_ti = nullptr;
 				log_printf("(Text image) Falling back to %s\n", lower->fn);
 				return lower->reload(fallback_on_failure);
 			}
 		} else {
-			safe_release(&TextureSlots[texture_slot]);
+			texture_pool_put(&TextureSlots[texture_slot]);
 			sr.active_ti = nullptr;
 		}
 		return ret;
@@ -318,13 +510,30 @@ HRESULT textimage_t::reload(bool fallback_on_failure)
 	if(!image_buf) {
 		return release_and_fallback(-1);
 	}
-	D3DXIMAGE_INFO srcinfo;
-	HRESULT ret = D3DXCreateTextureFromFileInMemoryEx(
-		pD3DDevice, image_buf, image_size,
-		0, 0, 1, 0, D3DFMT_UNKNOWN, D3DPOOL_MANAGED, 0xFFFFFFFF, 0xFFFFFFFF, 0, &srcinfo, nullptr,
-		&tex
-	);
-	free(image_buf);
+	defer(free(image_buf));
+
+	auto load = [&](D3DPOOL pool, D3DXIMAGE_INFO *srcinfo, IDirect3DTexture **ret_tex) -> HRESULT {
+		if(!D3DXCreateTextureFromFileInMemoryEx) {
+			textimage_log.errorf("%s: Only 8-bit RGB and RGBA PNGs are supported for this game", fn);
+			return -3;
+		}
+		return D3DXCreateTextureFromFileInMemoryEx(
+			pD3DDevice, image_buf, image_size,
+			0, 0, 1, 0, D3DFMT_UNKNOWN, pool, 0xFFFFFFFF, 0xFFFFFFFF, 0, srcinfo, nullptr,
+			ret_tex
+		);
+	};
+
+	// Decoded into system memory first, see the texture pool.
+	D3DXIMAGE_INFO srcinfo = {};
+	IDirect3DTexture *staging = nullptr;
+	defer(safe_release(&staging));
+	uint8_t *pixels = texture_decode(image_buf, image_size, srcinfo.Width, srcinfo.Height);
+	defer(buffer_pool_free(pixels));
+	HRESULT ret = D3D_OK;
+	if(!pixels) {
+		ret = load(D3DPOOL_SYSTEMMEM, &srcinfo, &staging);
+	}
 	// Yes, invalid images are a valid fallback condition.
 	if(FAILED(ret)) {
 		return release_and_fallback(ret);
@@ -343,6 +552,41 @@ HRESULT textimage_t::reload(bool fallback_on_failure)
 		return release_and_fallback(-2);
 	}
 
+	D3DSURFACE_DESC staging_desc;
+	texture_pool_key_t key = {};
+	if(pixels) {
+		key = { srcinfo.Width, srcinfo.Height, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED };
+	} else if(SUCCEEDED(d3dtex_GetLevelDesc(D3D8, staging, 0, &staging_desc))) {
+		key = { staging_desc.Width, staging_desc.Height, staging_desc.Format, D3DPOOL_MANAGED };
+	}
+	auto copy = [&](IDirect3DTexture *dst, bool changed_only) {
+		return pixels
+			? texture_copy(dst, pixels, (size_t)key.w * 4, key, changed_only)
+			: texture_copy(dst, staging, key, changed_only);
+	};
+	if(texture_format_bpp(key.format) != 0) {
+		auto *slot_tex = TextureSlots[texture_slot];
+		auto slot_in_use = TexturesInUse.find(slot_tex);
+		if(slot_tex && slot_in_use != TexturesInUse.end() && slot_in_use->second == key) {
+			if(SUCCEEDED(copy(slot_tex, true))) {
+				tex = slot_tex;
+			}
+		} else {
+			tex = texture_pool_get(key);
+			if(tex && FAILED(copy(tex, false))) {
+				texture_pool_put(&tex);
+			}
+		}
+	}
+	// Also covers devices that can't create textures in the exact size of
+	// the image, which D3DX would round up to the next power of two.
+	if(!tex) {
+		ret = load(D3DPOOL_MANAGED, nullptr, &tex);
+		if(FAILED(ret)) {
+			return release_and_fallback(ret);
+		}
+	}
+
 	D3DSURFACE_DESC hw;
 	if(FAILED(d3dtex_GetLevelDesc(D3D8, tex, 0, &hw))) {
 		// This will probably only ever give different values
@@ -406,8 +650,10 @@ HRESULT textimage_t::reload(bool fallback_on_failure)
 		"(Text image) Got %u sprites (%u rows \xC3\x97 %u columns)\n",
 		rows * cols, rows, cols
 	);
-	safe_release(&TextureSlots[texture_slot]);
-	TextureSlots[texture_slot] = tex;
+	if(TextureSlots[texture_slot] != tex) {
+		texture_pool_put(&TextureSlots[texture_slot]);
+		TextureSlots[texture_slot] = tex;
+	}
 	sr.active_ti = this;
 	return 0;
 }
@@ -558,12 +804,15 @@ int BP_textimage_init(x86_reg_t *regs, json_t *bp_info)
 			Initialized = false; \
 		}
 
-	P(D3DXCreateTextureFromFileInMemoryEx);
 	P(pD3DDevice);
 	P(TextureSlots);
 	P(SpriteSpecs);
 	P(SpriteScripts);
 #undef P
+	// Only needed for images that our own decoder doesn't support.
+	*(size_t*)&D3DXCreateTextureFromFileInMemoryEx = json_object_get_immediate(
+		bp_info, regs, "D3DXCreateTextureFromFileInMemoryEx"
+	);
 	// ----------
 
 	groups_clear();
@@ -771,4 +1020,5 @@ void textimage_mod_exit()
 	Images.clear();
 	SpriteRuntimeMap.clear();
 	groups_clear();
+	texture_pool_clear();
 }
@@ -42,6 +42,18 @@ const size_t pngsplit_max_image_size =
 th06_pngsplit_t pngsplit_state;
 void *pngsplit_rep_buffer;
 void *pngsplit_png = NULL;
+// Cache key of the current replacement PNG, and its alpha mask if it came
+// from the cache.
+char pngsplit_key[32];
+void *pngsplit_mask = NULL;
+size_t pngsplit_mask_size = 0;
+
+static void pngsplit_release(void)
+{
+	PNGSPLIT_SAFE_FREE(pngsplit_png);
+	SAFE_FREE(pngsplit_mask);
+	pngsplit_mask_size = 0;
+}
 
 int BP_th06_file_name(x86_reg_t *regs, json_t *bp_info)
 {
@@ -56,7 +68,7 @@ int BP_th06_file_name(x86_reg_t *regs, json_t *bp_info)
 		}
 	}
 	else {
-		PNGSPLIT_SAFE_FREE(pngsplit_png);
+		pngsplit_release();
 		pngsplit_state = TH06_PNGSPLIT_NONE;
 	}
 	return BP_file_name(regs, bp_info);
@@ -86,7 +98,7 @@ int BP_th06_file_load(x86_reg_t *regs, json_t *bp_info)
 		file_rep_t *fr = fr_tls_get();
 
 		if (fr->rep_buffer != NULL) { // If the original image is an alpha mask, the file will be replaced without conversion.
-			PNGSPLIT_SAFE_FREE(pngsplit_png);
+			pngsplit_release();
 			pngsplit_state = TH06_PNGSPLIT_RGB;
 		} else {
 			pngsplit_rep_buffer = fr->rep_buffer;
@@ -97,7 +109,7 @@ int BP_th06_file_load(x86_reg_t *regs, json_t *bp_info)
 		file_rep_t *fr = fr_tls_get();
 
 		if (fr->rep_buffer == NULL) { // Nothing to do.
-			PNGSPLIT_SAFE_FREE(pngsplit_png);
+			pngsplit_release();
 			pngsplit_state = TH06_PNGSPLIT_NONE;
 			return BP_file_load(regs, bp_info);
 		}
@@ -122,7 +134,7 @@ int BP_th06_file_loaded(x86_reg_t *regs, json_t *bp_info)
 
 		// If we don't have a game buffer, we can't do anything.
 		if (!fr->game_buffer) {
-			PNGSPLIT_SAFE_FREE(pngsplit_png);
+			pngsplit_release();
 			pngsplit_state = TH06_PNGSPLIT_NONE;
 			return BP_file_loaded(regs, bp_info);
 		}
@@ -130,31 +142,59 @@ int BP_th06_file_loaded(x86_reg_t *regs, json_t *bp_info)
 		if (pngsplit_state == TH06_PNGSPLIT_ALPHA) {
 			if (fr->name && strlen(fr->name) >= 6 &&
 				!strcmp(fr->name + strlen(fr->name) - 6, "_a.png")) {
-				// Compute the alpha mask
-				log_print("(PNG) Computing alpha mask\n");
-				void *dst;
-				dst = pngsplit_create_png_mask(pngsplit_png);
-				if (!dst) {
-					log_print("(PNG) Error\n");
-					PNGSPLIT_SAFE_FREE(pngsplit_png);
-					pngsplit_state = TH06_PNGSPLIT_NONE;
-					return BP_file_loaded(regs, bp_info);
+				if (pngsplit_mask) {
+					log_print("(PNG) Restored alpha mask from cache\n");
+					memcpy(fr->game_buffer, pngsplit_mask, pngsplit_mask_size);
+				} else {
+					// Compute the alpha mask
+					log_print("(PNG) Computing alpha mask\n");
+					void *dst;
+					dst = pngsplit_create_png_mask(pngsplit_png);
+					if (!dst) {
+						log_print("(PNG) Error\n");
+						pngsplit_release();
+						pngsplit_state = TH06_PNGSPLIT_NONE;
+						return BP_file_loaded(regs, bp_info);
+					}
+					size_t written = pngsplit_write(fr->game_buffer, dst);
+					dst = NULL;
+					pngsplit_cache_store(pngsplit_key, PNGSPLIT_PART_ALPHA, fr->game_buffer, written);
 				}
-				pngsplit_write(fr->game_buffer, dst);
-				dst = NULL;
 
-				PNGSPLIT_SAFE_FREE(pngsplit_png);
+				pngsplit_release();
 				pngsplit_state = TH06_PNGSPLIT_NONE;
 				file_rep_clear(fr);
 				return 1;
 			} else { // The original image may be a RGB image. Let's try that.
-				PNGSPLIT_SAFE_FREE(pngsplit_png);
+				pngsplit_release();
 				pngsplit_state = TH06_PNGSPLIT_RGB;
 			}
 		}
 
 		if (pngsplit_state == TH06_PNGSPLIT_RGB)
 		{
+			// Both halves have to be cached, since the replacement PNG is
+			// gone by the time the game loads the alpha mask.
+			pngsplit_cache_key(pngsplit_key, sizeof(pngsplit_key), fr->rep_buffer, fr->pre_json_size);
+			size_t rgb_size = 0;
+			void *rgb = pngsplit_cache_load(pngsplit_key, PNGSPLIT_PART_RGB, &rgb_size);
+			if (rgb) {
+				pngsplit_mask = pngsplit_cache_load(pngsplit_key, PNGSPLIT_PART_ALPHA, &pngsplit_mask_size);
+			}
+			// The game buffer was enlarged by BP_th06_file_size() to hold
+			// at least this much.
+			const size_t buffer_size = MAX(pngsplit_max_image_size, fr->pre_json_size);
+			if (rgb && pngsplit_mask && rgb_size <= buffer_size && pngsplit_mask_size <= pngsplit_max_image_size) {
+				log_print("(PNG) Restored indexed image from cache\n");
+				memcpy(fr->game_buffer, rgb, rgb_size);
+				free(rgb);
+				file_rep_clear(fr);
+				pngsplit_state = TH06_PNGSPLIT_ALPHA;
+				return 1;
+			}
+			SAFE_FREE(rgb);
+			pngsplit_release();
+
 			// Do the splitting
 			pngsplit_png = pngsplit_read(fr->rep_buffer);
 			if (!pngsplit_png) {
@@ -169,12 +209,13 @@ int BP_th06_file_loaded(x86_reg_t *regs, json_t *bp_info)
 			dst = pngsplit_create_rgb_file(pngsplit_png);
 			if (!dst) {
 				log_print("(PNG) Error\n");
-				PNGSPLIT_SAFE_FREE(pngsplit_png);
+				pngsplit_release();
 				pngsplit_state = TH06_PNGSPLIT_NONE;
 				return BP_file_loaded(regs, bp_info);
 			}
-			pngsplit_write(fr->game_buffer, dst);
+			size_t written = pngsplit_write(fr->game_buffer, dst);
 			dst = NULL;
+			pngsplit_cache_store(pngsplit_key, PNGSPLIT_PART_RGB, fr->game_buffer, written);
 
 			file_rep_clear(fr);
 			pngsplit_state = TH06_PNGSPLIT_ALPHA;
@@ -11,6 +11,7 @@
   */
 
 #include <thcrap.h>
+#include <unordered_map>
 #include <tlnote.hpp>
 #include "thcrap_tsa.h"
 #include "layout.h"
@@ -83,37 +84,14 @@ typedef struct {
   */
 typedef void(*EncryptionFunc_t)(uint8_t *data, size_t data_len);
 
-void simple_xor(uint8_t *data, size_t data_len, const uint8_t param)
-{
-	size_t i;
-	for(i = 0; i < data_len; i++) {
-		data[i] ^= param;
-	}
-}
-
-void util_xor(
-	uint8_t *data,
-	size_t data_len,
-	unsigned char key,
-	unsigned char step,
-	unsigned char step2
-)
-{
-	size_t i;
-	for(i = 0; i < data_len; i++) {
-		const int ip = i - 1;
-		data[i] ^= key + i * step + (ip * ip + ip) / 2 * step2;
-	}
-}
-
 void msg_crypt_th08(uint8_t *data, size_t data_len)
 {
-	simple_xor(data, data_len, 0x77);
+	xor_crypt_byte(data, data_len, 0x77);
 }
 
 void msg_crypt_th09(uint8_t *data, size_t data_len)
 {
-	util_xor(data, data_len, 0x77, 0x7, 0x10);
+	xor_crypt_progressive(data, data_len, 0x77, 0x7, 0x10);
 }
 /// --------------------
 
@@ -157,16 +135,27 @@ struct replacer_t {
 	);
 };
 
+// Distinct [type] strings of a format's opcodes, including nullptr.
+#define MSG_TYPES_MAX 8
+
 struct patch_msg_state_t {
 	const msg_format_t *format;
 
 	// Can be any value, 0, negative, ... So, a pointer it is.
 	json_t *font_dialog_id;
 
+	// Lookup tables for [format], built once per file
+	const op_info_t *op_table[256];
+	const char *types[MSG_TYPES_MAX];
+	size_t type_count;
+
 	// JSON objects in the diff file
 	const json_t *diff_entry;
 	const json_t *diff_lines;
 
+	// All diff slots of [diff_entry], indexed by slot_key().
+	std::unordered_map<uint64_t, const json_t *> diff_slots;
+
 	// Current input / output
 	th06_msg_t* cmd_in;
 	th06_msg_t* cmd_out;
@@ -189,8 +178,101 @@ struct patch_msg_state_t {
 	patch_line_t diff_line_cur(int extra_param_len);
 
 	void replace_line(th06_msg_t &cmd_out, replacer_t replacer, const patch_line_t &pl);
+
+	void format_tables_build();
+	const op_info_t* op_info(uint8_t op) const {
+		return op_table[op];
+	}
+
+	// Integer version of the "<time>_<type>_<index>" or "<time>_<index>"
+	// keys in the diff file. Returns false if [type] isn't used by any
+	// opcode in [format].
+	bool slot_key(uint64_t &key, int time, const char *type, int ind) const;
+	// Parses all keys of [diff_entry] into [diff_slots].
+	void diff_slots_build();
 };
 
+void patch_msg_state_t::format_tables_build()
+{
+	memset(op_table, 0, sizeof(op_table));
+	types[0] = nullptr;
+	type_count = 1;
+	for(const op_info_t *opcode = format->opcodes; opcode->op != 0; opcode++) {
+		if(!op_table[opcode->op]) {
+			op_table[opcode->op] = opcode;
+		}
+		uint64_t key;
+		if(!slot_key(key, 0, opcode->type, 0)) {
+			assert(type_count < MSG_TYPES_MAX);
+			types[type_count++] = opcode->type;
+		}
+	}
+}
+
+bool patch_msg_state_t::slot_key(uint64_t &key, int time, const char *type, int ind) const
+{
+	size_t type_id = 0;
+	if(type) {
+		for(type_id = 1; type_id < type_count; type_id++) {
+			if(!strcmp(types[type_id], type)) {
+				break;
+			}
+		}
+		if(type_id == type_count) {
+			return false;
+		}
+	}
+	key = ((uint64_t)(uint32_t)time << 32) | ((uint64_t)(uint32_t)ind << 8) | type_id;
+	return true;
+}
+
+void patch_msg_state_t::diff_slots_build()
+{
+	diff_slots.clear();
+	if(!json_is_object(diff_entry)) {
+		return;
+	}
+	const char *key_str;
+	json_t *slot;
+	json_object_foreach((json_t *)diff_entry, key_str, slot) {
+		// Only accept the exact strings that format_slot_key() would
+		// have generated for the slot.
+		char *end;
+		auto time = strtol(key_str, &end, 10);
+		if(end == key_str || *end != '_') {
+			continue;
+		}
+		const char *type_start = end + 1;
+		const char *ind_start = strrchr(type_start, '_');
+		std::string type;
+		if(ind_start) {
+			type.assign(type_start, ind_start - type_start);
+			ind_start++;
+		} else {
+			ind_start = type_start;
+		}
+		auto ind = strtol(ind_start, &end, 10);
+		if(end == ind_start || *end != '\0') {
+			continue;
+		}
+		char key_str_expected[64];
+		if(type.empty()) {
+			snprintf(key_str_expected, sizeof(key_str_expected), "%ld_%ld", time, ind);
+		} else {
+			snprintf(key_str_expected, sizeof(key_str_expected), "%ld_%s_%ld", time, type.c_str(), ind);
+		}
+		uint64_t key;
+		if(
+			strcmp(key_str, key_str_expected)
+			|| time != (uint16_t)time || ind < 0 || ind > 0xFFFFFF
+			|| !slot_key(key, time, type.empty() ? nullptr : type.c_str(), ind)
+		) {
+			continue;
+		}
+		diff_slots.emplace(key, slot);
+	}
+}
+
 patch_line_t patch_msg_state_t::diff_line_cur(int extra_param_len)
 {
 	tlnote_encoded_index_t tli;
@@ -259,21 +341,6 @@ void patch_msg_state_t::replace_line(th06_msg_t &cmd_out, replacer_t replacer, c
 	last_line_cmd = &cmd_out;
 }
 
-const op_info_t* get_op_info(const msg_format_t* format, uint8_t op)
-{
-	const op_info_t *opcode = format->opcodes;
-	if(!opcode) {
-		return NULL;
-	}
-	while(opcode->op != 0) {
-		if(opcode->op == op) {
-			return opcode;
-		}
-		opcode++;
-	}
-	return NULL;
-}
-
 size_t th06_msg_full_len(const th06_msg_t* msg)
 {
 	if(!msg) {
@@ -331,31 +398,25 @@ const replacer_t REP_AUTO_LINE = {
 	}
 };
 
-void format_slot_key(char *key_str, int time, const char *msg_type, int time_ind)
-{
-	if(msg_type) {
-		sprintf(key_str, "%d_%s_%d", time, msg_type, time_ind);
-	} else {
-		sprintf(key_str, "%d_%d", time, time_ind);
-	}
-}
-
 // Returns 1 if the output buffer should advance, 0 if it shouldn't.
 int replace_next_diff_line(th06_msg_t *cmd_out, patch_msg_state_t *state, replacer_t replacer)
 {
-	const op_info_t* cur_op = get_op_info(state->format, cmd_out->type);
+	const op_info_t* cur_op = state->op_info(cmd_out->type);
 
 	// If we don't have a diff_lines pointer, this is the first line of a new box.
 	if(cur_op && !json_is_array(state->diff_lines)) {
-		size_t key_str_len = strlen(cur_op->type) + 32;
-		VLA(char, key_str, key_str_len);
 		state->ind++;
-		format_slot_key(key_str, state->time, cur_op->type, state->ind);
-		state->diff_lines = json_object_get(state->diff_entry, key_str);
+		state->diff_lines = nullptr;
+		uint64_t key;
+		if(state->slot_key(key, state->time, cur_op->type, state->ind)) {
+			auto slot = state->diff_slots.find(key);
+			if(slot != state->diff_slots.end()) {
+				state->diff_lines = slot->second;
+			}
+		}
 		if(json_is_object(state->diff_lines)) {
 			state->diff_lines = json_object_get(state->diff_lines, "lines");
 		}
-		VLA_FREE(key_str);
 	}
 
 	if(json_is_array(state->diff_lines)) {
@@ -574,6 +635,7 @@ int patch_msg(void *file_inout, size_t size_out, size_t size_in, json_t *patch,
 	if(!msg_out || !patch) {
 		return 0;
 	}
+	state.format_tables_build();
 
 	// Make a copy of the input buffer
 	msg_in = (uint32_t*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, size_in);
@@ -645,6 +707,7 @@ int patch_msg(void *file_inout, size_t size_out, size_t size_in, json_t *patch,
 				if(offset_in == entry_offsets_in[i * format->entry_offset_mul]) {
 					state.entry = i;
 					state.diff_entry = json_object_numkey_get(patch, state.entry);
+					state.diff_slots_build();
 					entry_offsets_out[i * format->entry_offset_mul] = offset_out;
 					break;
 				}
@@ -671,7 +734,7 @@ int patch_msg(void *file_inout, size_t size_out, size_t size_in, json_t *patch,
 		memcpy(state.cmd_out, state.cmd_in, sizeof(th06_msg_t) + state.cmd_in->length);
 
 		// Look up what to do with the opcode...
-		cur_op = get_op_info(state.format, state.cmd_in->type);
+		cur_op = state.op_info(state.cmd_in->type);
 
 		if(cur_op && json_is_object(state.diff_entry)) {
 			advance_out = process_op(cur_op, &state);
@@ -178,21 +178,30 @@ void pngsplit_write_flush_callback(png_struct *png)
 	(void)png;
 }
 
-void pngsplit_write(char *buff, pngsplit_png_t *png)
+size_t pngsplit_write(char *buff, pngsplit_png_t *png)
 {
+	// Has to survive a longjmp()
+	volatile size_t ret = 0;
 	if (!setjmp(png_jmpbuf(png->png))) {
 		pngsplit_io_t io;
 		io.buff = buff;
 		io.pos = 0;
 		png_set_write_fn(png->png, &io, pngsplit_write_callback, pngsplit_write_flush_callback);
 
+		// The game decodes these again right away, so the encoding
+		// doesn't need to be any smaller than the uncompressed image.
+		png_set_compression_level(png->png, 1);
+		png_set_filter(png->png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+
 		png_write_info(png->png, png->info);
 
 		png_write_image(png->png, png->row_pointers);
 		png_write_end(png->png, NULL);
+		ret = io.pos;
 	}
 
 	pngsplit_free(png);
+	return ret;
 }
 
 
@@ -9,8 +9,14 @@
 
 #pragma once
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 void *pngsplit_read(void *buff);
-void pngsplit_write(char *buff, void *png);
+// Encodes [png] into [buff] and frees it. Returns the number of bytes
+// written, or 0 on failure.
+size_t pngsplit_write(char *buff, void *png);
 
 void *pngsplit_create_png_mask_plt(void *in);
 void *pngsplit_create_png_mask(void *in);
@@ -18,3 +24,25 @@ void *pngsplit_create_rgb_file_plt(void *in);
 void *pngsplit_create_rgb_file(void *in);
 
 void pngsplit_free(void *png);
+
+/// Cache
+/// -----
+typedef enum {
+	PNGSPLIT_PART_RGB = 0,
+	PNGSPLIT_PART_ALPHA = 1,
+} pngsplit_part_t;
+
+// Builds the cache key of the replacement PNG [src] into [key].
+// 32 bytes are always enough.
+int pngsplit_cache_key(char *key, size_t key_len, const void *src, size_t src_size);
+
+// Returns the cached [part] of the PNG identified by [key] in a buffer that
+// has to be free()d, or NULL if there is none.
+void* pngsplit_cache_load(const char *key, pngsplit_part_t part, size_t *size);
+
+void pngsplit_cache_store(const char *key, pngsplit_part_t part, const void *png, size_t size);
+/// -----
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,84 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * Team Shanghai Alice support plugin
+  *
+  * ----
+  *
+  * On-disk cache of split th06 PNG files.
+  */
+
+#include <thcrap.h>
+#include "th06_pngsplit.h"
+
+/**
+  * Splitting a replacement PNG takes one full decode and two encodes, and
+  * the result only depends on the bytes of that PNG. Both halves are stored
+  * as plain PNG files in the "pngsplit" namespace of the disk cache, keyed
+  * by game, build, and a hash and the size of the source file, and are
+  * copied straight into the game's buffer on later loads.
+  */
+
+static uint64_t pngsplit_cache_hash(const void *data, size_t len)
+{
+	const BYTE *p = (const BYTE *)data;
+	const uint64_t mul = 0x9E3779B97F4A7C15ull;
+	uint64_t h = 0;
+	for(; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * mul;
+		h ^= h >> 29;
+	}
+	for(; len; len--, p++) {
+		h = (h ^ *p) * mul;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+int pngsplit_cache_key(char *key, size_t key_len, const void *src, size_t src_size)
+{
+	if(!key || !key_len || !src || !src_size) {
+		return -1;
+	}
+	const uint64_t hash = pngsplit_cache_hash(src, src_size);
+	snprintf(key, key_len, "%08x%08x_%zu",
+		(uint32_t)(hash >> 32), (uint32_t)hash, src_size
+	);
+	return 0;
+}
+
+static std::string pngsplit_cache_entry_key(const char *key, pngsplit_part_t part)
+{
+	const char *game = runconfig_game_get();
+	const char *build = runconfig_build_get();
+	if(!key || !key[0] || !game || !build) {
+		return "";
+	}
+	std::string ret = game;
+	ret += '.';
+	ret += build;
+	ret += '/';
+	ret += key;
+	ret += part == PNGSPLIT_PART_ALPHA ? ".a" : ".rgb";
+	return ret;
+}
+
+void* pngsplit_cache_load(const char *key, pngsplit_part_t part, size_t *size)
+{
+	std::string entry_key = pngsplit_cache_entry_key(key, part);
+	if(entry_key.empty()) {
+		return NULL;
+	}
+	return disk_cache_get("pngsplit", entry_key.c_str(), size);
+}
+
+void pngsplit_cache_store(const char *key, pngsplit_part_t part, const void *png, size_t size)
+{
+	std::string entry_key = pngsplit_cache_entry_key(key, part);
+	if(entry_key.empty() || !png || !size) {
+		return;
+	}
+	// PNGs are already compressed.
+	disk_cache_put("pngsplit", entry_key.c_str(), png, size, DISK_CACHE_STORED);
+}
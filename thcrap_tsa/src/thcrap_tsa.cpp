@@ -147,6 +147,18 @@ size_t tlnote_remove_size_hook(const char *fn, json_t *patch, size_t patch_size)
 	return 0;
 }
 
+// ascii_mod_init() writes to the string definitions, and stays on the
+// injection thread.
+extern "C" __declspec(dllexport) const mod_init_decl_t thcrap_plugin_init_decls[] = {
+	{ "bgm", nullptr, true },
+	{ "gentext", nullptr, true },
+	{ "layout", nullptr, true },
+	{ "missions", nullptr, true },
+	{ "music", nullptr, true },
+	{ "spells", nullptr, true },
+	{},
+};
+
 int __stdcall thcrap_plugin_init()
 {
 	if(stack_remove_if_unneeded("base_tsa")) {
@@ -158,7 +170,7 @@ int __stdcall thcrap_plugin_init()
 
 	// th06_msg
 	patchhook_register("msg*.dat", patch_msg_dlg, NULL); // th06-08
-	patchhook_register("*.end", patch_end_th06, NULL); // th06 endings
+	patchhook_register_cacheable("*.end", patch_end_th06, NULL); // th06 endings
 	patchhook_register("p*.msg", patch_msg_dlg, NULL); // th09
 	patchhook_register("s*.msg", patch_msg_dlg, NULL); // lowest common denominator for th10+
 	patchhook_register("msg*.msg", patch_msg_dlg, NULL); // th143
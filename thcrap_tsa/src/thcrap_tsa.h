@@ -210,6 +210,7 @@ int BP_spell_comment_line(x86_reg_t *regs, json_t *bp_info);
 int BP_spell_owner(x86_reg_t *regs, json_t *bp_info);
 
 void spells_mod_init(void);
+void spells_mod_repatch(json_t *files_changed);
 void spells_mod_exit(void);
 /// ------
 
@@ -272,6 +273,7 @@ int BP_music_cmt(x86_reg_t *regs, json_t *bp_info);
 int BP_music_cmt(x86_reg_t *regs, json_t *bp_info);
 
 void music_mod_init(void);
+void music_mod_repatch(json_t *files_changed);
 void music_mod_exit(void);
 /// ----------
 
@@ -0,0 +1,168 @@
+/**
+  * Touhou Community Reliant Automatic Patcher
+  * File name recovery tool
+  *
+  * ----
+  *
+  * Usage: thcrap_unhash <game> <fileslist.js> <directory> [--out=directory]
+  *	[--threads=n]
+  *
+  * The archives of the th135 engine and later only store the hashes of
+  * their file names. Archive unpackers therefore name every file they
+  * can't name themselves after its hash, as 8 hexadecimal digits with an
+  * optional 0x prefix and any extension. This tool hashes every name in a
+  * fileslist.js with the same function as the game and thcrap_tasofro, and
+  * moves (or, with --out, copies) every file named after one of these
+  * hashes to its real path, so that a full unpack can be used just like a
+  * dat_dump. Hashing and file operations run in parallel.
+  *
+  * <game> is one of th135, th145, th155, th175 or marilega, and selects the
+  * hash function.
+  */
+
+#include <thcrap.h>
+#include <filesystem>
+#include <unordered_map>
+#include <vector>
+#include "../../thcrap_tasofro/src/crypt.h"
+
+namespace fs = std::filesystem;
+
+static ICrypt* unhash_crypt_for_game(const char *game)
+{
+	if (!strcmp(game, "th135")) {
+		return new CryptTh135();
+	}
+	if (!strcmp(game, "th145") || !strcmp(game, "th155") || !strcmp(game, "marilega")) {
+		return new CryptTh145();
+	}
+	if (!strcmp(game, "th175")) {
+		return new CryptTh175();
+	}
+	return nullptr;
+}
+
+// Converts [name] to Shift-JIS, like thcrap_tasofro does before hashing.
+static std::string unhash_sjis(const char *name)
+{
+	WCHAR_T_DEC(name);
+	WCHAR_T_CONV(name);
+	const int len = WideCharToMultiByte(932, 0, name_w, -1, nullptr, 0, nullptr, nullptr);
+	std::string ret(MAX(len, 1), '\0');
+	WideCharToMultiByte(932, 0, name_w, -1, &ret[0], len, nullptr, nullptr);
+	ret.resize(strlen(ret.c_str()));
+	WCHAR_T_FREE(name);
+	return ret;
+}
+
+// Returns true and the hash in [hash] if [stem] is a hash-named file.
+static bool unhash_parse(std::string stem, DWORD *hash)
+{
+	if (stem.size() == 10 && (stem[0] == '0') && (stem[1] == 'x' || stem[1] == 'X')) {
+		stem.erase(0, 2);
+	}
+	if (stem.size() != 8 || stem.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+		return false;
+	}
+	*hash = (DWORD)strtoul(stem.c_str(), nullptr, 16);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	const char *out_arg = nullptr;
+	size_t threads = 0;
+	std::vector<const char *> positional;
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--out=", 6)) {
+			out_arg = argv[i] + 6;
+		}
+		else if (!strncmp(argv[i], "--threads=", 10)) {
+			threads = (size_t)atoi(argv[i] + 10);
+		}
+		else if (argv[i][0] != '-') {
+			positional.push_back(argv[i]);
+		}
+		else {
+			positional.clear();
+			break;
+		}
+	}
+	ICrypt *crypt = positional.size() == 3 ? unhash_crypt_for_game(positional[0]) : nullptr;
+	if (!crypt) {
+		fprintf(stderr,
+			"Usage: %s <th135|th145|th155|th175|marilega> <fileslist.js> <directory> [--out=directory] [--threads=n]\n",
+			argv[0]
+		);
+		return 1;
+	}
+	const fs::path in_dir = fs::u8path(positional[2]);
+	const fs::path out_dir = out_arg ? fs::u8path(out_arg) : in_dir;
+	const size_t max_threads = threads ? threads : SIZE_MAX;
+	log_init(0);
+
+	ScopedJson fileslist = json_load_file_report(positional[1]);
+	if (!json_is_array(*fileslist)) {
+		fprintf(stderr, "%s: not a files list\n", positional[1]);
+		return 1;
+	}
+	const size_t name_count = json_array_size(*fileslist);
+	std::vector<DWORD> hashes(name_count);
+	parallel_for(name_count, max_threads, [&](size_t i) {
+		const char *name = json_string_value(json_array_get(*fileslist, i));
+		if (name) {
+			const std::string sjis = unhash_sjis(name);
+			hashes[i] = crypt->SpecialFNVHash(sjis.c_str(), sjis.c_str() + sjis.size());
+		}
+	});
+	std::unordered_map<DWORD, const char *> names;
+	names.reserve(name_count);
+	for (size_t i = 0; i < name_count; i++) {
+		if (const char *name = json_string_value(json_array_get(*fileslist, i))) {
+			names.emplace(hashes[i], name);
+		}
+	}
+
+	std::vector<std::pair<fs::path, const char *>> jobs;
+	size_t unknown = 0;
+	std::error_code ec;
+	for (fs::recursive_directory_iterator it(in_dir, ec), end; !ec && it != end; it.increment(ec)) {
+		DWORD hash;
+		if (!it->is_regular_file(ec) || !unhash_parse(it->path().stem().u8string(), &hash)) {
+			continue;
+		}
+		auto name = names.find(hash);
+		if (name == names.end()) {
+			unknown++;
+			continue;
+		}
+		jobs.emplace_back(it->path(), name->second);
+	}
+
+	volatile LONG failed = 0;
+	parallel_for(jobs.size(), max_threads, [&](size_t i) {
+		std::string name = jobs[i].second;
+		str_slash_normalize(&name[0]);
+		const fs::path &src = jobs[i].first;
+		const fs::path dst = out_dir / fs::u8path(name);
+		std::error_code ec;
+		fs::create_directories(dst.parent_path(), ec);
+		if (out_arg) {
+			fs::copy_file(src, dst, fs::copy_options::overwrite_existing, ec);
+		}
+		else {
+			fs::rename(src, dst, ec);
+		}
+		if (ec) {
+			fprintf(stderr, "%s: %s\n", name.c_str(), ec.message().c_str());
+			InterlockedIncrement(&failed);
+		}
+	});
+
+	printf("%zu files named, %zu hashes not in the files list, %ld errors.\n",
+		jobs.size() - failed, unknown, failed
+	);
+	delete crypt;
+	log_exit();
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,62 @@
+#include "thcrap.h"
+#include "blob_store.h"
+#include "crc32.h"
+
+#define BLOB_STORE_DIR "blobs"
+
+std::filesystem::path BlobStore::blobPath(uint32_t crc32)
+{
+    // Split into 256 directories, so that none of them gets too large.
+    char fn[sizeof(BLOB_STORE_DIR "/xx/xxxxxxxx")];
+    snprintf(fn, sizeof(fn), BLOB_STORE_DIR "/%02x/%08x", crc32 >> 24, crc32);
+    return fn;
+}
+
+bool BlobStore::enabled()
+{
+    return globalconfig_get_boolean("update_blob_store", TRUE) != FALSE;
+}
+
+bool BlobStore::fetch(uint32_t crc32, const std::filesystem::path& dst)
+{
+    std::filesystem::path blob = blobPath(crc32);
+    std::string blob_fn = blob.u8string();
+
+    // Checked every time, in case a patch file has been edited in place
+    // despite being a link.
+    size_t size;
+    const void *view = file_map(blob_fn.c_str(), &size);
+    if (!view) {
+        return false;
+    }
+    bool valid = Crc32::compute(0, view, size) == crc32;
+    file_unmap(view);
+    std::error_code ec;
+    if (!valid) {
+        log_printf("%s is corrupt, removing it\n", blob_fn.c_str());
+        std::filesystem::remove(blob, ec);
+        return false;
+    }
+
+    std::filesystem::create_directories(dst.parent_path(), ec);
+    std::filesystem::remove(dst, ec);
+    std::filesystem::create_hard_link(blob, dst, ec);
+    if (ec) {
+        // FAT32, or the patch is on another drive.
+        std::filesystem::copy_file(blob, dst, std::filesystem::copy_options::overwrite_existing, ec);
+    }
+    return !ec;
+}
+
+void BlobStore::add(uint32_t crc32, const std::filesystem::path& src)
+{
+    std::filesystem::path blob = blobPath(crc32);
+    std::error_code ec;
+    if (std::filesystem::exists(blob, ec)) {
+        return;
+    }
+    // Not worth a copy if we can't link, since the store wouldn't save
+    // anything then.
+    std::filesystem::create_directories(blob.parent_path(), ec);
+    std::filesystem::create_hard_link(src, blob, ec);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <filesystem>
+
+// Content-addressed copies of downloaded patch files, shared by all patches
+// under the thcrap directory.
+// Every verified download is hard-linked into the store under its CRC32,
+// and any other patch that needs a file with the same CRC32 links to it
+// instead of downloading it again. Besides the bandwidth, this also saves
+// the disk space, and lets the OS cache the file only once.
+// Since blobs are shared, patch files must never be rewritten in place,
+// only replaced.
+class BlobStore
+{
+private:
+    static std::filesystem::path blobPath(uint32_t crc32);
+
+public:
+    // Can be turned off through the "update_blob_store" global config option.
+    static bool enabled();
+
+    // Creates [dst] as a link to, or a copy of, the blob with [crc32].
+    // Returns false if the store doesn't have a valid one.
+    static bool fetch(uint32_t crc32, const std::filesystem::path& dst);
+    // Adds [src], whose contents have been verified to match [crc32], to
+    // the store, unless it already has a blob with that CRC32.
+    static void add(uint32_t crc32, const std::filesystem::path& src);
+};
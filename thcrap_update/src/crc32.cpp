@@ -0,0 +1,188 @@
+#include "thcrap.h"
+#include "crc32.h"
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+// All functions work on the inverted state of the CRC.
+
+/// Slice-by-8
+/// ----------
+// table[0] is the usual byte-at-a-time table, and table[n] advances the CRC
+// by n more zero bytes on top of that.
+struct Crc32Tables
+{
+    uint32_t table[8][256];
+
+    Crc32Tables()
+    {
+        const uint32_t polynomial = 0xEDB88320;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (size_t j = 0; j < 8; j++) {
+                c = (c & 1) ? (polynomial ^ (c >> 1)) : (c >> 1);
+            }
+            table[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (size_t n = 1; n < 8; n++) {
+                const uint32_t prev = table[n - 1][i];
+                table[n][i] = table[0][prev & 0xFF] ^ (prev >> 8);
+            }
+        }
+    }
+};
+
+static const Crc32Tables tables;
+
+static uint32_t crc32_bytes(uint32_t c, const uint8_t *p, size_t len)
+{
+    while (len--) {
+        c = tables.table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+    }
+    return c;
+}
+
+static uint32_t crc32_slice8(uint32_t c, const uint8_t *p, size_t len)
+{
+    const auto& t = tables.table;
+    while (len >= 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c =
+            t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+            t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    return crc32_bytes(c, p, len);
+}
+/// ----------
+
+/// PCLMULQDQ folding
+/// -----------------
+// Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+// Instruction", with the constants for the bit-reflected polynomial given
+// at the end of the paper.
+#if defined(__GNUC__)
+# define CRC32_TARGET_CLMUL __attribute__((target("pclmul,sse4.1")))
+#else
+# define CRC32_TARGET_CLMUL
+#endif
+
+// Minimum length for the folding path.
+#define CRC32_CLMUL_MIN 64
+
+static bool crc32_clmul_supported()
+{
+    int data[4];
+    __cpuid(data, 1);
+    const bool pclmul = data[2] & 1 << 1;
+    const bool sse41 = data[2] & 1 << 19;
+    return pclmul && sse41;
+}
+
+// Folds [x] over the next 128 bits of input using the pair of constants in [k].
+CRC32_TARGET_CLMUL static inline __m128i crc32_clmul_fold(__m128i x, __m128i k, __m128i next)
+{
+    const __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+    const __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(hi, lo), next);
+}
+
+// [len] must be at least CRC32_CLMUL_MIN and a multiple of 16.
+CRC32_TARGET_CLMUL static uint32_t crc32_clmul_blocks(uint32_t c, const uint8_t *p, size_t len)
+{
+    alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+    p += 64;
+    len -= 64;
+
+    // Fold 4 lanes of 128 bits in parallel
+    __m128i k = _mm_load_si128((const __m128i *)k1k2);
+    while (len >= 64) {
+        x1 = crc32_clmul_fold(x1, k, _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = crc32_clmul_fold(x2, k, _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = crc32_clmul_fold(x3, k, _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = crc32_clmul_fold(x4, k, _mm_loadu_si128((const __m128i *)(p + 0x30)));
+        p += 64;
+        len -= 64;
+    }
+
+    // Fold the lanes into one, then any remaining 16-byte blocks into that
+    k = _mm_load_si128((const __m128i *)k3k4);
+    x1 = crc32_clmul_fold(x1, k, x2);
+    x1 = crc32_clmul_fold(x1, k, x3);
+    x1 = crc32_clmul_fold(x1, k, x4);
+    while (len >= 16) {
+        x1 = crc32_clmul_fold(x1, k, _mm_loadu_si128((const __m128i *)p));
+        p += 16;
+        len -= 16;
+    }
+
+    // 128 → 64 bits
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    k = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    k = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, k, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_clmul(uint32_t c, const uint8_t *p, size_t len)
+{
+    if (len >= CRC32_CLMUL_MIN) {
+        const size_t blocks_len = len & ~(size_t)15;
+        c = crc32_clmul_blocks(c, p, blocks_len);
+        p += blocks_len;
+        len -= blocks_len;
+    }
+    return crc32_slice8(c, p, len);
+}
+/// -----------------
+
+static uint32_t (*const crc32_engine)(uint32_t c, const uint8_t *p, size_t len) = (
+    crc32_clmul_supported() ? crc32_clmul : crc32_slice8
+);
+
+Crc32::Crc32(uint32_t initial)
+    : crc(initial)
+{}
+
+void Crc32::update(const void *buf, size_t len)
+{
+    this->crc = Crc32::compute(this->crc, buf, len);
+}
+
+uint32_t Crc32::value() const
+{
+    return this->crc;
+}
+
+uint32_t Crc32::compute(uint32_t initial, const void *buf, size_t len)
+{
+    return ~crc32_engine(~initial, static_cast<const uint8_t*>(buf), len);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-32 with the reflected 0xEDB88320 polynomial, as used by files.js
+// (and ZIP, PNG and zlib).
+class Crc32
+{
+private:
+    uint32_t crc;
+
+public:
+    Crc32(uint32_t initial = 0);
+
+    // Adds [len] more bytes from [buf] to the CRC, for data that arrives in
+    // several pieces.
+    void update(const void *buf, size_t len);
+    uint32_t value() const;
+
+    // Continues [initial], the CRC of any previous data, with [len] bytes
+    // from [buf]. Use 0 for the first piece.
+    static uint32_t compute(uint32_t initial, const void *buf, size_t len);
+};
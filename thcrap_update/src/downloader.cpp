@@ -1,11 +1,47 @@
 #include "thcrap.h"
+#include <algorithm>
 #include "downloader.h"
 #include "server.h"
 
+#define DOWNLOADER_STREAMS_DEFAULT 8
+#define DOWNLOADER_STREAMS_MIN_DEFAULT 2
+#define DOWNLOADER_STREAMS_MAX_DEFAULT 32
+#define DOWNLOADER_STREAMS_MAX 64
+// Shortest measurement window, so that a burst of tiny files doesn't
+// count as a change in throughput.
+#define DOWNLOADER_WINDOW_MIN std::chrono::milliseconds(500)
+// A window has to be this much faster than the previous one to earn
+// another slot, and this much slower to lose one.
+#define DOWNLOADER_RATE_GAIN 1.05
+#define DOWNLOADER_RATE_LOSS 0.8
+
 Downloader::Downloader()
-    : pool(8), current_(0), total_(0)
+    : pool(Downloader::maxStreamCount()), current_(0), total_(0),
+    minStreams(Downloader::minStreamCount()), maxStreams(Downloader::maxStreamCount()),
+    limit(std::clamp(Downloader::streamCount(), minStreams, maxStreams)),
+    windowStart(std::chrono::steady_clock::now()), concurrency_(limit), throughput_(0.0)
 {}
 
+size_t Downloader::streamCount()
+{
+    long long streams = globalconfig_get_integer("update_streams", DOWNLOADER_STREAMS_DEFAULT);
+    return (size_t)std::clamp(streams, 1LL, (long long)DOWNLOADER_STREAMS_MAX);
+}
+
+size_t Downloader::minStreamCount()
+{
+    long long streams = globalconfig_get_integer("update_streams_min", DOWNLOADER_STREAMS_MIN_DEFAULT);
+    return (size_t)std::clamp(streams, 1LL, (long long)DOWNLOADER_STREAMS_MAX);
+}
+
+size_t Downloader::maxStreamCount()
+{
+    long long streams = globalconfig_get_integer("update_streams_max", DOWNLOADER_STREAMS_MAX_DEFAULT);
+    const size_t ret = (size_t)std::clamp(streams, 1LL, (long long)DOWNLOADER_STREAMS_MAX);
+    const size_t minStreams = Downloader::minStreamCount();
+    return MAX(ret, minStreams);
+}
+
 Downloader::~Downloader()
 {
     this->wait();
@@ -31,15 +67,140 @@ void Downloader::addFile(const std::list<std::string>& serversUrl, std::string f
         current_++;
         return successCallback(url, data);
     };
-    std::shared_ptr<File> file = std::make_unique<File>(std::move(urls), successLambda, failureCallback, progressCallback);
+    this->enqueue(std::make_unique<File>(std::move(urls), successLambda, failureCallback, progressCallback));
+}
+
+void Downloader::addFile(const std::list<std::string>& serversUrl, std::string filePath, std::filesystem::path streamPath, uint32_t crc32, int priority,
+                         File::streamed_success_t successCallback, File::failure_t failureCallback, File::progress_t progressCallback)
+{
+    std::scoped_lock lock(this->mutex);
+
+    std::list<DownloadUrl> urls = this->serversListToDownloadUrlList(serversUrl, filePath);
+    auto successLambda = [successCallback, &current_ = this->current_](const DownloadUrl& url, StreamedFile& file) {
+        current_++;
+        return successCallback(url, file);
+    };
+    this->enqueue(std::make_unique<File>(std::move(urls), std::move(streamPath), crc32, successLambda, failureCallback, progressCallback), priority);
+}
+
+void Downloader::addFile(const std::list<std::string>& serversUrl, std::string filePath, File::validators_t validators,
+                         File::conditional_success_t successCallback, File::failure_t failureCallback, File::progress_t progressCallback)
+{
+    std::scoped_lock lock(this->mutex);
+
+    std::list<DownloadUrl> urls = this->serversListToDownloadUrlList(serversUrl, filePath);
+    auto successLambda = [successCallback, &current_ = this->current_](const DownloadUrl& url, std::vector<uint8_t>& data, const HttpValidators& validators) {
+        current_++;
+        return successCallback(url, data, validators);
+    };
+    // An unchanged file counts as downloaded.
+    auto failureLambda = [failureCallback, &current_ = this->current_](const DownloadUrl& url, HttpStatus status) {
+        if (status == HttpStatus::NotModified) {
+            current_++;
+        }
+        return failureCallback(url, status);
+    };
+    this->enqueue(std::make_unique<File>(std::move(urls), std::move(validators), successLambda, failureLambda, progressCallback));
+}
 
-    this->futuresList.push_back(this->pool.enqueue([file]() {
-        file->download();
+bool Downloader::Pending::operator<(const Pending& other) const
+{
+    // std::priority_queue pops the largest element first.
+    // Within a priority, the oldest file goes first.
+    if (this->priority != other.priority) {
+        return this->priority < other.priority;
+    }
+    return this->order > other.order;
+}
+
+// Must be called with [mutex] held.
+void Downloader::enqueue(std::shared_ptr<File> file, int priority)
+{
+    {
+        std::scoped_lock lock(this->pendingMutex);
+        this->pending.push({ priority, this->pendingOrder++, std::move(file) });
+    }
+    // One task per file, so every task finds a file to download.
+    this->futuresList.push_back(this->pool.enqueue([this]() {
+        this->downloadNext();
     }));
 
     this->total_++;
 }
 
+void Downloader::acquireSlot()
+{
+    std::unique_lock lock(this->concurrencyMutex);
+    this->slotFreed.wait(lock, [this]() {
+        return this->inFlight < this->limit;
+    });
+    this->inFlight++;
+}
+
+void Downloader::releaseSlot(const File& file)
+{
+    std::scoped_lock lock(this->concurrencyMutex);
+    this->inFlight--;
+
+    auto now = std::chrono::steady_clock::now();
+    auto resetWindow = [this, now]() {
+        this->windowStart = now;
+        this->windowFiles = 0;
+        this->windowBytes = 0;
+    };
+    this->windowFiles++;
+    this->windowBytes += file.transferred();
+
+    if (file.serverErrors() > 0) {
+        // All downloads that were running at the same time probably failed
+        // for the same reason, so this only counts once per window.
+        if (now - this->lastDecrease >= DOWNLOADER_WINDOW_MIN) {
+            this->limit = MAX(this->limit / 2, this->minStreams);
+            this->lastDecrease = now;
+            // The old rates were measured with more slots.
+            this->lastFileRate = 0.0;
+            this->lastByteRate = 0.0;
+            resetWindow();
+        }
+    }
+    else if (this->windowFiles >= this->limit && now - this->windowStart >= DOWNLOADER_WINDOW_MIN) {
+        std::chrono::duration<double> elapsed = now - this->windowStart;
+        double fileRate = this->windowFiles / elapsed.count();
+        double byteRate = this->windowBytes / elapsed.count();
+        // Files per second matter for lots of tiny files, where latency
+        // dominates, and bytes per second for the large ones.
+        if (
+            this->lastFileRate == 0.0
+            || fileRate > this->lastFileRate * DOWNLOADER_RATE_GAIN
+            || byteRate > this->lastByteRate * DOWNLOADER_RATE_GAIN
+        ) {
+            this->limit = MIN(this->limit + 1, this->maxStreams);
+        }
+        else if (fileRate < this->lastFileRate * DOWNLOADER_RATE_LOSS && byteRate < this->lastByteRate * DOWNLOADER_RATE_LOSS) {
+            this->limit = MAX(this->limit - 1, this->minStreams);
+        }
+        this->lastFileRate = fileRate;
+        this->lastByteRate = byteRate;
+        this->throughput_ = byteRate;
+        resetWindow();
+    }
+    this->concurrency_ = this->limit;
+    this->slotFreed.notify_all();
+}
+
+void Downloader::downloadNext()
+{
+    this->acquireSlot();
+    std::shared_ptr<File> file;
+    {
+        std::scoped_lock lock(this->pendingMutex);
+        file = this->pending.top().file;
+        this->pending.pop();
+    }
+    file->download();
+    this->releaseSlot(*file);
+}
+
 void Downloader::addFile(char** serversUrl, std::string filePath,
                          File::success_t successCallback, File::failure_t failureCallback, File::progress_t progressCallback)
 {
@@ -61,10 +222,30 @@ size_t Downloader::total() const
     return this->total_;
 }
 
+size_t Downloader::concurrency() const
+{
+    return this->concurrency_;
+}
+
+double Downloader::throughput() const
+{
+    return this->throughput_;
+}
+
 void Downloader::wait()
 {
-    for (auto& it : this->futuresList) {
-        it.get();
+    // Callbacks of running downloads can add more files, so the list is
+    // checked again after every file until it's empty.
+    for (;;) {
+        std::future<void> future;
+        {
+            std::scoped_lock lock(this->mutex);
+            if (this->futuresList.empty()) {
+                break;
+            }
+            future = std::move(this->futuresList.back());
+            this->futuresList.pop_back();
+        }
+        future.get();
     }
-    this->futuresList.clear();
 }
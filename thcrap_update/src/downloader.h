@@ -1,9 +1,12 @@
 #pragma once
 
 #include <list>
+#include <queue>
 #include <string>
 #include <vector>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include "3rdparty/ThreadPool.h"
 #include "file.h"
 
@@ -16,11 +19,63 @@ private:
     std::atomic<size_t> current_;
     size_t total_;
 
+    // Files waiting for a thread. The pool tasks don't own a file, they
+    // pick the one with the highest priority when they start running, so
+    // that files added later can still go first.
+    struct Pending
+    {
+        int priority;
+        size_t order;
+        std::shared_ptr<File> file;
+
+        bool operator<(const Pending& other) const;
+    };
+    std::priority_queue<Pending> pending;
+    std::mutex pendingMutex;
+    size_t pendingOrder = 0;
+
+    // Adaptive number of files downloaded at the same time. The pool has
+    // one thread for each of [maxStreams], and every download first waits
+    // for one of the [limit] slots.
+    // The limit is raised by one whenever a measurement window of [limit]
+    // files was faster than the previous one, and halved whenever a server
+    // fails with a network or server error (AIMD).
+    std::mutex concurrencyMutex;
+    std::condition_variable slotFreed;
+    size_t minStreams;
+    size_t maxStreams;
+    size_t limit;
+    size_t inFlight = 0;
+    std::chrono::steady_clock::time_point windowStart;
+    std::chrono::steady_clock::time_point lastDecrease;
+    size_t windowFiles = 0;
+    size_t windowBytes = 0;
+    // Files and bytes per second of the last complete window
+    double lastFileRate = 0.0;
+    double lastByteRate = 0.0;
+    std::atomic<size_t> concurrency_;
+    std::atomic<double> throughput_;
+
+    void acquireSlot();
+    void releaseSlot(const File& file);
+
     std::list<DownloadUrl> serversListToDownloadUrlList(const std::list<std::string>& serversUrl, const std::string& filePath);
+    void enqueue(std::shared_ptr<File> file, int priority = 0);
+    void downloadNext();
 
 public:
     Downloader();
     ~Downloader();
+
+    // Number of files downloaded at the same time at the start, set through
+    // the "update_streams" global config option. From there, it's adjusted
+    // between the "update_streams_min" and "update_streams_max" options.
+    static size_t streamCount();
+    static size_t minStreamCount();
+    // With curl, this is also the limit for streams multiplexed over a
+    // single HTTP/2 connection.
+    static size_t maxStreamCount();
+
     void addFile(const std::list<std::string>& servers, std::string filename,
                  File::success_t successCallback = File::defaultSuccessFunction,
                  File::failure_t failureCallback = File::defaultFailureFunction,
@@ -29,7 +84,29 @@ public:
                  File::success_t successCallback = File::defaultSuccessFunction,
                  File::failure_t failureCallback = File::defaultFailureFunction,
                  File::progress_t progressCallback = File::defaultProgressFunction);
+    // Streams the file into [streamPath] instead of keeping it in memory.
+    // [crc32] is the expected CRC32 of the file, see File.
+    // Files with a higher [priority] are downloaded first.
+    void addFile(const std::list<std::string>& servers, std::string filename,
+                 std::filesystem::path streamPath, uint32_t crc32, int priority,
+                 File::streamed_success_t successCallback,
+                 File::failure_t failureCallback = File::defaultFailureFunction,
+                 File::progress_t progressCallback = File::defaultProgressFunction);
+    // Only downloads the file if it doesn't match [validators] anymore.
+    // Otherwise, [failureCallback] is called with HttpStatus::NotModified.
+    void addFile(const std::list<std::string>& servers, std::string filename,
+                 File::validators_t validators,
+                 File::conditional_success_t successCallback,
+                 File::failure_t failureCallback = File::defaultFailureFunction,
+                 File::progress_t progressCallback = File::defaultProgressFunction);
     size_t current() const;
     size_t total() const;
+    // Current number of download slots
+    size_t concurrency() const;
+    // Bytes per second over the last measurement window, 0 before the
+    // first one is complete.
+    double throughput() const;
+    // Waits until all files are done, including those that were added by
+    // the callbacks of other files in the meantime.
     void wait();
 };
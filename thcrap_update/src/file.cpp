@@ -1,12 +1,135 @@
 #include "thcrap.h"
 #include <stdexcept>
+#include <chrono>
 #include <fstream>
+#include <optional>
 #include "random.h"
 #include "server.h"
 #include "file.h"
 
 using namespace std::string_literals;
 
+StreamedFile::StreamedFile(std::filesystem::path path)
+    : path_(std::move(path)), handle(INVALID_HANDLE_VALUE), size_(0), preallocated(false), keep_(false)
+{}
+
+StreamedFile::~StreamedFile()
+{
+    this->close();
+    if (!this->keep_) {
+        DeleteFileW(this->path_.c_str());
+    }
+}
+
+bool StreamedFile::open()
+{
+    this->close();
+    std::error_code ec;
+    std::filesystem::create_directories(this->path_.parent_path(), ec);
+    this->handle = CreateFileW(
+        this->path_.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr
+    );
+    this->crc = Crc32();
+    this->size_ = 0;
+    this->preallocated = false;
+    this->keep_ = false;
+    return this->handle != INVALID_HANDLE_VALUE;
+}
+
+bool StreamedFile::resume()
+{
+    this->close();
+    std::error_code ec;
+    std::filesystem::create_directories(this->path_.parent_path(), ec);
+    this->handle = CreateFileW(
+        this->path_.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr
+    );
+    this->crc = Crc32();
+    this->size_ = 0;
+    this->preallocated = false;
+    this->keep_ = false;
+    if (this->handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    std::vector<uint8_t> buffer(64 * 1024);
+    DWORD byte_ret;
+    while (ReadFile(this->handle, buffer.data(), (DWORD)buffer.size(), &byte_ret, nullptr) && byte_ret != 0) {
+        this->crc.update(buffer.data(), byte_ret);
+        this->size_ += byte_ret;
+    }
+    // Drop anything we couldn't read, and continue writing after the rest
+    LARGE_INTEGER pos;
+    pos.QuadPart = this->size_;
+    if (!SetFilePointerEx(this->handle, pos, nullptr, FILE_BEGIN) || !SetEndOfFile(this->handle)) {
+        return this->open();
+    }
+    return true;
+}
+
+void StreamedFile::keep()
+{
+    this->keep_ = true;
+}
+
+void StreamedFile::preallocate(size_t size)
+{
+    if (this->handle == INVALID_HANDLE_VALUE || this->preallocated || this->size_ != 0 || size == 0) {
+        return ;
+    }
+    // Just a hint for the file system, so failures don't matter.
+    LARGE_INTEGER pos;
+    pos.QuadPart = size;
+    if (SetFilePointerEx(this->handle, pos, nullptr, FILE_BEGIN)) {
+        SetEndOfFile(this->handle);
+    }
+    pos.QuadPart = 0;
+    SetFilePointerEx(this->handle, pos, nullptr, FILE_BEGIN);
+    this->preallocated = true;
+}
+
+bool StreamedFile::write(const uint8_t *data, size_t size)
+{
+    DWORD byte_ret;
+    if (this->handle == INVALID_HANDLE_VALUE
+        || !WriteFile(this->handle, data, size, &byte_ret, nullptr)
+        || byte_ret != size) {
+        return false;
+    }
+    this->crc.update(data, size);
+    this->size_ += size;
+    return true;
+}
+
+bool StreamedFile::close()
+{
+    if (this->handle == INVALID_HANDLE_VALUE) {
+        return true;
+    }
+    // The file pointer is at the end of the written data.
+    bool ret = !this->preallocated || SetEndOfFile(this->handle);
+    ret = CloseHandle(this->handle) && ret;
+    this->handle = INVALID_HANDLE_VALUE;
+    return ret;
+}
+
+const std::filesystem::path& StreamedFile::path() const
+{
+    return this->path_;
+}
+
+uint32_t StreamedFile::crc32() const
+{
+    return this->crc.value();
+}
+
+size_t StreamedFile::size() const
+{
+    return this->size_;
+}
+
 File::File(std::list<DownloadUrl>&& urls,
            success_t successCallback,
            failure_t failureCallback,
@@ -19,6 +142,35 @@ File::File(std::list<DownloadUrl>&& urls,
     }
 }
 
+File::File(std::list<DownloadUrl>&& urls,
+           std::filesystem::path streamPath,
+           uint32_t crc32,
+           streamed_success_t successCallback,
+           failure_t failureCallback,
+           progress_t progressCallback)
+    : status(Status::Todo), urls(urls), streamPath(std::move(streamPath)), crc32(crc32),
+    userSuccessCallback(defaultSuccessFunction), userStreamedSuccessCallback(successCallback),
+    userFailureCallback(failureCallback), userProgressCallback(progressCallback)
+{
+    if (urls.empty()) {
+        throw new std::invalid_argument("Input URL list must not be empty");
+    }
+}
+
+File::File(std::list<DownloadUrl>&& urls,
+           validators_t validators,
+           conditional_success_t successCallback,
+           failure_t failureCallback,
+           progress_t progressCallback)
+    : status(Status::Todo), urls(urls), validators(std::move(validators)),
+    userSuccessCallback(defaultSuccessFunction), userConditionalSuccessCallback(successCallback),
+    userFailureCallback(failureCallback), userProgressCallback(progressCallback)
+{
+    if (urls.empty()) {
+        throw new std::invalid_argument("Input URL list must not be empty");
+    }
+}
+
 size_t File::writeCallback(std::vector<uint8_t>& buffer, const uint8_t *data, size_t size)
 {
     buffer.insert(buffer.end(), data, data + size);
@@ -51,16 +203,88 @@ void File::download(IHttpHandle& http, const DownloadUrl& url)
         userFailureCallback(url, HttpStatus::makeCancelled());
         return ;
     }
+    trace_scope_t trace(TRACE_UPDATE, url.getUrl().c_str());
 
     std::vector<uint8_t> out;
-    HttpStatus status = http.download(url.getUrl(),
-        [this, &out](const uint8_t *in, size_t size) {
-            return this->writeCallback(out, in, size);
-        },
-        [this, &url](size_t dlnow, size_t dltotal) {
-            return this->progressCallback(url, dlnow, dltotal);
+    std::optional<StreamedFile> stream;
+    // Size of the partial download we continue from
+    size_t offset = 0;
+    if (!this->streamPath.empty()) {
+        stream.emplace(this->streamPath);
+        if (!stream->resume()) {
+            userFailureCallback(url, HttpStatus::makeSystemError(GetLastError(), "could not create temporary file"));
+            return ;
         }
-    );
+        offset = stream->size();
+    }
+    // Transfer statistics for the server, see Server::estimate()
+    auto start = std::chrono::steady_clock::now();
+    std::optional<std::chrono::steady_clock::time_point> firstByte;
+    size_t bytes = 0;
+    auto writeLambda = [this, &out, &stream, &firstByte, &bytes](const uint8_t *in, size_t size) -> size_t {
+        if (!firstByte) {
+            firstByte = std::chrono::steady_clock::now();
+        }
+        bytes += size;
+        this->transferred_ += size;
+        if (stream) {
+            return stream->write(in, size) ? size : 0;
+        }
+        return this->writeCallback(out, in, size);
+    };
+    auto progressLambda = [this, &url, &out, &stream](size_t dlnow, size_t dltotal) {
+        // Make room for the whole file as soon as we know its size
+        if (dlnow == 0 && dltotal != 0) {
+            if (stream) {
+                stream->preallocate(dltotal);
+            } else if (out.empty()) {
+                out.reserve(dltotal);
+            }
+        }
+        return this->progressCallback(url, dlnow, dltotal);
+    };
+
+    HttpStatus status = HttpStatus::makeOk();
+    HttpValidators responseValidators;
+    if (this->userConditionalSuccessCallback) {
+        auto it = this->validators.find(url.getServer().getUrl());
+        status = http.downloadConditional(url.getUrl(),
+            it != this->validators.end() ? it->second : HttpValidators(), responseValidators,
+            writeLambda, progressLambda
+        );
+    } else if (offset && stream->crc32() == this->crc32) {
+        // An earlier attempt got the whole file, but didn't get to move it
+    } else if (offset) {
+        status = http.downloadRange(url.getUrl(), offset, writeLambda, progressLambda);
+    } else {
+        status = http.download(url.getUrl(), writeLambda, progressLambda);
+    }
+    if (status && stream && !stream->close()) {
+        status = HttpStatus::makeSystemError(GetLastError(), "writing error");
+    }
+    // If the partial download belonged to another version of the file, or
+    // if it's longer than the file, start over from the beginning.
+    if (offset && (status ? stream->crc32() != this->crc32 : (status == HttpStatus::ClientError && status.getCode() == 416))) {
+        log_printf("%s: partial download is outdated, downloading it again\n", url.getUrl().c_str());
+        if (!stream->open()) {
+            userFailureCallback(url, HttpStatus::makeSystemError(GetLastError(), "could not create temporary file"));
+            return ;
+        }
+        offset = 0;
+        start = std::chrono::steady_clock::now();
+        firstByte.reset();
+        bytes = 0;
+        status = http.download(url.getUrl(), writeLambda, progressLambda);
+        if (status && !stream->close()) {
+            status = HttpStatus::makeSystemError(GetLastError(), "writing error");
+        }
+    }
+    if (status == HttpStatus::NotModified) {
+        // As good as a download, no need to try any other server
+        this->status = Status::Done;
+        userFailureCallback(url, status);
+        return ;
+    }
     if (!status) {
         if (status.get() == HttpStatus::ServerError || status.get() == HttpStatus::SystemError) {
             // If the server is dead, we don't want to continue using it.
@@ -68,20 +292,54 @@ void File::download(IHttpHandle& http, const DownloadUrl& url)
             // same server are also likely to fail.
             // If it's only a 404, other downloads might work.
             url.getServer().fail();
+            url.getServer().recordFailure(true);
+            this->serverErrors_++;
+        }
+        else if (status.get() != HttpStatus::Cancelled) {
+            url.getServer().recordFailure(false);
+        }
+        if (stream && stream->size() != 0) {
+            // The next server (or the next update) continues from there
+            stream->keep();
         }
         userFailureCallback(url, status);
         return ;
     }
 
+    if (firstByte) {
+        std::chrono::duration<double> latency = *firstByte - start;
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        url.getServer().recordTransfer(latency.count(), duration.count(), bytes);
+    }
+
     this->status = Status::Done;
-    userSuccessCallback(url, out);
+    if (stream) {
+        userStreamedSuccessCallback(url, *stream);
+    } else if (this->userConditionalSuccessCallback) {
+        userConditionalSuccessCallback(url, out, responseValidators);
+    } else {
+        userSuccessCallback(url, out);
+    }
 }
 
 DownloadUrl File::pickUrl()
 {
-    int n = Random::get() % this->urls.size();
-    auto it = this->urls.begin();
-    std::advance(it, n);
+    // Pick the server that should be done first, and a random one
+    // among the ones with the same estimate.
+    auto it = this->urls.end();
+    double bestEstimate = 0.0;
+    unsigned int ties = 0;
+    for (auto candidate = this->urls.begin(); candidate != this->urls.end(); ++candidate) {
+        double estimate = candidate->getServer().estimate();
+        if (it == this->urls.end() || estimate < bestEstimate) {
+            it = candidate;
+            bestEstimate = estimate;
+            ties = 1;
+        }
+        else if (estimate == bestEstimate && Random::get() % ++ties == 0) {
+            it = candidate;
+        }
+    }
     DownloadUrl url = *it;
     this->urls.erase(it);
     return url;
@@ -89,9 +347,24 @@ DownloadUrl File::pickUrl()
 
 void File::download()
 {
+    bool retry = false;
     do {
         DownloadUrl url = this->pickUrl();
+        if (retry) {
+            url.getServer().recordRetry();
+        }
         BorrowedHttpHandle handle = url.getServer().borrowHandle();
         this->download(*handle, url);
+        retry = true;
     } while (this->status != Status::Done && this->urls.size() > 0);
 }
+
+size_t File::transferred() const
+{
+    return this->transferred_;
+}
+
+size_t File::serverErrors() const
+{
+    return this->serverErrors_;
+}
@@ -3,15 +3,67 @@
 #include <atomic>
 #include <filesystem>
 #include <list>
+#include <map>
 #include <mutex>
 #include <vector>
+#include "crc32.h"
 #include "download_url.h"
 #include "http_interface.h"
 
+// Temporary file that a download is streamed into, with the CRC32 of
+// everything written so far. The file is deleted along with this object if
+// it hasn't been moved somewhere else by then, unless keep() was called.
+class StreamedFile
+{
+private:
+    std::filesystem::path path_;
+    HANDLE handle;
+    Crc32 crc;
+    size_t size_;
+    bool preallocated;
+    bool keep_;
+
+public:
+    StreamedFile(std::filesystem::path path);
+    ~StreamedFile();
+    StreamedFile(const StreamedFile&) = delete;
+    StreamedFile(StreamedFile&&) = delete;
+    StreamedFile& operator=(const StreamedFile&) = delete;
+    StreamedFile& operator=(StreamedFile&&) = delete;
+
+    // Creates the file, or truncates it if it already exists.
+    bool open();
+    // Opens the file and continues after its current contents, or creates
+    // it if it doesn't exist yet.
+    bool resume();
+    // Leaves the partial file on disk, so that a later download can
+    // resume() it.
+    void keep();
+    // Reserves [size] bytes on disk, if nothing has been written yet.
+    void preallocate(size_t size);
+    bool write(const uint8_t *data, size_t size);
+    // Cuts off any unused preallocated space and closes the file,
+    // so that it can be moved.
+    bool close();
+
+    const std::filesystem::path& path() const;
+    uint32_t crc32() const;
+    size_t size() const;
+};
+
 class File
 {
 public:
     typedef std::function<void (const DownloadUrl& url, std::vector<uint8_t>& data)> success_t;
+    // Success callback for downloads streamed to disk. The callback should
+    // move [file] to its final place.
+    typedef std::function<void (const DownloadUrl& url, StreamedFile& file)> streamed_success_t;
+    // Validators to send with conditional requests, by server URL.
+    typedef std::map<std::string, HttpValidators> validators_t;
+    // Success callback for conditional downloads, with the validators of
+    // the downloaded file. If the file didn't change, the failure callback
+    // is called with HttpStatus::NotModified instead.
+    typedef std::function<void (const DownloadUrl& url, std::vector<uint8_t>& data, const HttpValidators& validators)> conditional_success_t;
     typedef std::function<void (const DownloadUrl& url, HttpStatus status)> failure_t;
     typedef std::function<bool (const DownloadUrl& url, size_t file_progress, size_t file_size)> progress_t;
     static void defaultSuccessFunction(const DownloadUrl&, std::vector<uint8_t>&) {}
@@ -33,9 +85,20 @@ private:
     // different servers.
     // When starting a download, we remove the corresponding URL from the list.
     std::list<DownloadUrl> urls;
+    // If not empty, the file is downloaded to this path rather than to memory.
+    std::filesystem::path streamPath;
+    // Expected CRC32 of streamed files, used to check resumed downloads
+    uint32_t crc32 = 0;
+    // Only used for conditional downloads
+    validators_t validators;
+    // Statistics over all attempts, see transferred() and serverErrors()
+    size_t transferred_ = 0;
+    size_t serverErrors_ = 0;
 
     // User-provided callbacks
     success_t userSuccessCallback;
+    streamed_success_t userStreamedSuccessCallback;
+    conditional_success_t userConditionalSuccessCallback;
     failure_t userFailureCallback;
     progress_t userProgressCallback;
 
@@ -49,6 +112,22 @@ public:
          success_t successCallback = defaultSuccessFunction,
          failure_t failureCallback = defaultFailureFunction,
          progress_t progressCallback = defaultProgressFunction);
+    // Streams the download into [streamPath] instead of memory.
+    // A partial download left in [streamPath] by an earlier attempt is
+    // continued with a Range request. If the result doesn't match [crc32],
+    // it is downloaded again from the beginning.
+    File(std::list<DownloadUrl>&& urls,
+         std::filesystem::path streamPath,
+         uint32_t crc32,
+         streamed_success_t successCallback,
+         failure_t failureCallback = defaultFailureFunction,
+         progress_t progressCallback = defaultProgressFunction);
+    // Sends a conditional request with the [validators] of each server.
+    File(std::list<DownloadUrl>&& urls,
+         validators_t validators,
+         conditional_success_t successCallback,
+         failure_t failureCallback = defaultFailureFunction,
+         progress_t progressCallback = defaultProgressFunction);
     File(const File&) = delete;
     File(File&&) = delete;
     File& operator=(const File&) = delete;
@@ -58,4 +137,10 @@ public:
     // The status of the download will be returned in the callbacks given
     // in the constructor.
     void download();
+
+    // Bytes received so far, over all servers that were tried.
+    size_t transferred() const;
+    // Number of servers that failed with a server or network error, as
+    // opposed to a missing file or a cancelled download.
+    size_t serverErrors() const;
 };
@@ -0,0 +1,191 @@
+#include "thcrap.h"
+#include <filesystem>
+#include <string_view>
+#include "files_journal.h"
+
+using namespace std::string_literals;
+
+#define FILES_JS_FN "files.js"
+#define FILES_JS_TMP_FN "files.js.tmp"
+#define FILES_JOURNAL_FN "files.journal"
+// Number of journal entries after which files.js is rewritten
+#define FILES_JOURNAL_COMPACT_ENTRIES 256
+
+// The journal is a text file with one change per line:
+//   <8 hex digits> <fn>  Set the CRC32 of fn
+//   null <fn>            fn has been deleted
+//   - <fn>               Remove fn from files.js
+// A line without its \n has been cut off by a crash and is ignored.
+
+FilesJsJournal::FilesJsJournal(const patch_t *patch)
+    : patch(patch), json(patch_json_load(patch, FILES_JS_FN, nullptr)), journal(INVALID_HANDLE_VALUE), entries(0)
+{
+    if (!json_is_object(*this->json)) {
+        this->json = json_object();
+    }
+
+    char *journal_fn = fn_for_patch(patch, FILES_JOURNAL_FN);
+    if (!journal_fn) {
+        return ;
+    }
+    std::filesystem::path journal_path = std::filesystem::u8path(journal_fn);
+    SAFE_FREE(journal_fn);
+
+    std::error_code ec;
+    std::filesystem::create_directories(journal_path.parent_path(), ec);
+    this->journal = CreateFileW(
+        journal_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, nullptr
+    );
+    if (this->journal == INVALID_HANDLE_VALUE) {
+        log_printf("%s: could not open " FILES_JOURNAL_FN ", progress won't survive a crash\n", patch->id);
+        return ;
+    }
+    if (this->replay() > 0) {
+        std::scoped_lock<std::mutex> lock(this->mutex);
+        this->compactLocked();
+    }
+}
+
+FilesJsJournal::~FilesJsJournal()
+{
+    bool compacted;
+    {
+        std::scoped_lock<std::mutex> lock(this->mutex);
+        compacted = this->compactLocked();
+    }
+    if (this->journal != INVALID_HANDLE_VALUE) {
+        CloseHandle(this->journal);
+    }
+    if (compacted) {
+        // Not needed anymore after the compaction
+        char *journal_fn = fn_for_patch(this->patch, FILES_JOURNAL_FN);
+        if (journal_fn) {
+            DeleteFileU(journal_fn);
+            SAFE_FREE(journal_fn);
+        }
+    }
+}
+
+size_t FilesJsJournal::replay()
+{
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(this->journal, &size) || size.QuadPart == 0) {
+        return 0;
+    }
+    std::string buffer((size_t)size.QuadPart, '\0');
+    DWORD byte_ret;
+    if (!ReadFile(this->journal, buffer.data(), (DWORD)buffer.size(), &byte_ret, nullptr)) {
+        return 0;
+    }
+    buffer.resize(byte_ret);
+
+    size_t count = 0;
+    std::string_view rest = buffer;
+    size_t end;
+    while ((end = rest.find('\n')) != std::string_view::npos) {
+        std::string_view line = rest.substr(0, end);
+        rest.remove_prefix(end + 1);
+
+        size_t space = line.find(' ');
+        if (space == std::string_view::npos || space + 1 == line.length()) {
+            continue;
+        }
+        std::string_view op = line.substr(0, space);
+        std::string fn(line.substr(space + 1));
+        if (op == "-") {
+            json_object_del(*this->json, fn.c_str());
+        }
+        else if (op == "null") {
+            json_object_set_new(*this->json, fn.c_str(), json_null());
+        }
+        else if (op.length() == 8) {
+            char *endptr;
+            std::string crc(op);
+            unsigned long value = strtoul(crc.c_str(), &endptr, 16);
+            if (*endptr != '\0') {
+                continue;
+            }
+            json_object_set_new(*this->json, fn.c_str(), json_integer(value));
+        }
+        else {
+            continue;
+        }
+        count++;
+    }
+    return count;
+}
+
+void FilesJsJournal::append(const std::string& line)
+{
+    if (this->journal == INVALID_HANDLE_VALUE) {
+        return ;
+    }
+    LARGE_INTEGER pos;
+    pos.QuadPart = 0;
+    SetFilePointerEx(this->journal, pos, nullptr, FILE_END);
+    DWORD byte_ret;
+    WriteFile(this->journal, line.data(), (DWORD)line.length(), &byte_ret, nullptr);
+    this->entries++;
+    if (this->entries >= FILES_JOURNAL_COMPACT_ENTRIES) {
+        this->compactLocked();
+    }
+}
+
+ScopedJson FilesJsJournal::get(const char *fn)
+{
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    return json_incref(json_object_get(*this->json, fn));
+}
+
+void FilesJsJournal::set(const char *fn, json_t *value)
+{
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    json_object_set(*this->json, fn, value);
+    if (json_is_integer(value)) {
+        char crc[10];
+        snprintf(crc, sizeof(crc), "%08x ", (uint32_t)json_integer_value(value));
+        this->append(crc + std::string(fn) + "\n");
+    }
+    else {
+        this->append("null "s + fn + "\n");
+    }
+}
+
+void FilesJsJournal::remove(const char *fn)
+{
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    json_object_del(*this->json, fn);
+    this->append("- "s + fn + "\n");
+}
+
+void FilesJsJournal::compact()
+{
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    this->compactLocked();
+}
+
+bool FilesJsJournal::compactLocked()
+{
+    // Written next to files.js and moved over it, so that a crash can't
+    // leave a half-written files.js behind. Until the journal is emptied,
+    // replaying it again is harmless.
+    if (patch_json_store(this->patch, FILES_JS_TMP_FN, *this->json) != 0) {
+        return false;
+    }
+    char *tmp_fn = fn_for_patch(this->patch, FILES_JS_TMP_FN);
+    int ret = patch_file_replace(this->patch, FILES_JS_FN, tmp_fn);
+    SAFE_FREE(tmp_fn);
+    if (ret != 0) {
+        return false;
+    }
+    if (this->journal != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER pos;
+        pos.QuadPart = 0;
+        if (SetFilePointerEx(this->journal, pos, nullptr, FILE_BEGIN)) {
+            SetEndOfFile(this->journal);
+        }
+    }
+    this->entries = 0;
+    return true;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <windows.h>
+#include "thcrap.h"
+
+// The local files.js of a patch, with an append-only journal of the
+// changes made since it was last written.
+// Every change is appended to files.journal right away, so that an update
+// that gets interrupted doesn't have to download the same files again.
+// The journal is only merged into files.js every few changes and when the
+// object is destroyed, rather than rewriting the whole files.js every time.
+// Can be used from any thread.
+class FilesJsJournal
+{
+private:
+    const patch_t *patch;
+    ScopedJson json;
+    std::mutex mutex;
+    HANDLE journal;
+    size_t entries;
+
+    void append(const std::string& line);
+    // Applies the journal left behind by an earlier update to [json].
+    // Returns the number of entries.
+    size_t replay();
+    // Must be called with [mutex] held.
+    bool compactLocked();
+
+public:
+    FilesJsJournal(const patch_t *patch);
+    ~FilesJsJournal();
+    FilesJsJournal(const FilesJsJournal&) = delete;
+    FilesJsJournal(FilesJsJournal&&) = delete;
+    FilesJsJournal& operator=(const FilesJsJournal&) = delete;
+    FilesJsJournal& operator=(FilesJsJournal&&) = delete;
+
+    // Returns the files.js entry of [fn], or nullptr if there is none.
+    ScopedJson get(const char *fn);
+    // Sets the entry of [fn] to [value], which is either a CRC32 or null
+    // for a deleted file.
+    void set(const char *fn, json_t *value);
+    // Removes the entry of [fn].
+    void remove(const char *fn);
+    // Writes files.js and empties the journal.
+    void compact();
+};
@@ -1,5 +1,98 @@
 #include "thcrap.h"
+#include <string_view>
 #include "http_curl.h"
+#include "downloader.h"
+
+std::unique_ptr<CurlMulti> CurlMulti::instance;
+std::mutex CurlMulti::instanceMutex;
+
+CurlMulti::CurlMulti(long maxStreams)
+    : multi(curl_multi_init()), quit(false)
+{
+    curl_multi_setopt(this->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(this->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, maxStreams);
+    // Servers without HTTP/2 still get a few parallel HTTP/1.1 connections.
+    curl_multi_setopt(this->multi, CURLMOPT_MAX_HOST_CONNECTIONS, MIN(maxStreams, 4L));
+    this->thread = std::thread(&CurlMulti::run, this);
+}
+
+CurlMulti::~CurlMulti()
+{
+    {
+        std::scoped_lock lock(this->mutex);
+        this->quit = true;
+    }
+    curl_multi_wakeup(this->multi);
+    this->thread.join();
+    curl_multi_cleanup(this->multi);
+}
+
+CurlMulti& CurlMulti::get()
+{
+    std::scoped_lock lock(CurlMulti::instanceMutex);
+    if (!CurlMulti::instance) {
+        CurlMulti::instance = std::make_unique<CurlMulti>((long)Downloader::maxStreamCount());
+    }
+    return *CurlMulti::instance;
+}
+
+void CurlMulti::shutdown()
+{
+    std::scoped_lock lock(CurlMulti::instanceMutex);
+    CurlMulti::instance.reset();
+}
+
+void CurlMulti::run()
+{
+    for (;;) {
+        {
+            std::scoped_lock lock(this->mutex);
+            if (this->quit) {
+                break;
+            }
+            for (Transfer *transfer : this->pending) {
+                curl_easy_setopt(transfer->easy, CURLOPT_PRIVATE, transfer);
+                curl_multi_add_handle(this->multi, transfer->easy);
+            }
+            this->pending.clear();
+        }
+
+        int running;
+        curl_multi_perform(this->multi, &running);
+
+        CURLMsg *msg;
+        int msgs_left;
+        while ((msg = curl_multi_info_read(this->multi, &msgs_left))) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            Transfer *transfer = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&transfer);
+            // Has to be read before the handle is removed
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(this->multi, msg->easy_handle);
+            if (transfer) {
+                std::scoped_lock lock(this->mutex);
+                transfer->result = result;
+                transfer->done = true;
+            }
+            this->doneCondition.notify_all();
+        }
+
+        // Returns early when perform() calls curl_multi_wakeup().
+        curl_multi_poll(this->multi, nullptr, 0, 1000, nullptr);
+    }
+}
+
+CURLcode CurlMulti::perform(CURL *easy)
+{
+    Transfer transfer = { easy, CURLE_OK, false };
+    std::unique_lock lock(this->mutex);
+    this->pending.push_back(&transfer);
+    curl_multi_wakeup(this->multi);
+    this->doneCondition.wait(lock, [&transfer]() { return transfer.done; });
+    return transfer.result;
+}
 
 CurlHandle::CurlHandle()
     : curl(curl_easy_init())
@@ -20,13 +113,13 @@ CurlHandle::~CurlHandle()
 
 size_t CurlHandle::writeCallbackStatic(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-    auto callback = *static_cast<std::function<size_t(const uint8_t*, size_t)>*>(userdata);
+    auto& callback = *static_cast<std::function<size_t(const uint8_t*, size_t)>*>(userdata);
     return callback(reinterpret_cast<const uint8_t*>(ptr), size * nmemb);
 };
 
 int CurlHandle::progressCallbackStatic(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t /* ultotal */, curl_off_t /* ulnow */)
 {
-    auto callback = *static_cast<std::function<bool(size_t, size_t)>*>(userdata);
+    auto& callback = *static_cast<std::function<bool(size_t, size_t)>*>(userdata);
     if (callback(dlnow, dltotal)) {
         return 0;
     }
@@ -35,32 +128,150 @@ int CurlHandle::progressCallbackStatic(void *userdata, curl_off_t dltotal, curl_
     }
 };
 
+size_t CurlHandle::headerCallbackStatic(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+    auto& validators = *static_cast<HttpValidators*>(userdata);
+    std::string_view line(buffer, size * nitems);
+    // Only keep the headers of the final response after any redirects
+    if (line.compare(0, 5, "HTTP/") == 0) {
+        validators = HttpValidators();
+        return size * nitems;
+    }
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos) {
+        return size * nitems;
+    }
+    std::string_view name = line.substr(0, colon);
+    std::string_view value = line.substr(colon + 1);
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == '\r' || value.back() == '\n' || value.back() == ' ')) {
+        value.remove_suffix(1);
+    }
+    if (name.length() == 4 && _strnicmp(name.data(), "ETag", 4) == 0) {
+        validators.etag = value;
+    }
+    else if (name.length() == 13 && _strnicmp(name.data(), "Last-Modified", 13) == 0) {
+        validators.lastModified = value;
+    }
+    return size * nitems;
+}
+
 HttpStatus CurlHandle::download(const std::string& url, std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback)
+{
+    HttpValidators responseValidators;
+    return this->downloadConditional(url, HttpValidators(), responseValidators, writeCallback, progressCallback);
+}
+
+HttpStatus CurlHandle::downloadConditional(const std::string& url, const HttpValidators& validators, HttpValidators& responseValidators,
+                                           std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback)
+{
+    return this->request(url, validators, responseValidators, 0, writeCallback, progressCallback);
+}
+
+HttpStatus CurlHandle::downloadRange(const std::string& url, size_t offset,
+                                     std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback)
+{
+    HttpValidators responseValidators;
+    return this->request(url, HttpValidators(), responseValidators, offset, writeCallback, progressCallback);
+}
+
+HttpStatus CurlHandle::request(const std::string& url, const HttpValidators& validators, HttpValidators& responseValidators, size_t offset,
+                               std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback)
 {
     curl_easy_setopt(this->curl, CURLOPT_FOLLOWLOCATION, 1);
 
+    struct curl_slist *headers = nullptr;
+    if (!validators.etag.empty()) {
+        headers = curl_slist_append(headers, ("If-None-Match: " + validators.etag).c_str());
+    }
+    if (!validators.lastModified.empty()) {
+        headers = curl_slist_append(headers, ("If-Modified-Since: " + validators.lastModified).c_str());
+    }
+    const bool conditional = headers != nullptr;
+    curl_easy_setopt(this->curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(this->curl, CURLOPT_HEADERFUNCTION, CurlHandle::headerCallbackStatic);
+    curl_easy_setopt(this->curl, CURLOPT_HEADERDATA, &responseValidators);
+
     // Format according to RFC 7231, section 5.5.3
     std::string userAgent = std::string(PROJECT_NAME_SHORT()) + "/" + PROJECT_VERSION_STRING() + " (" + windows_version() + ")";
     curl_easy_setopt(this->curl, CURLOPT_USERAGENT, userAgent.c_str());
 
+    std::string range;
+    if (offset) {
+        range = std::to_string(offset) + "-";
+        curl_easy_setopt(this->curl, CURLOPT_RANGE, range.c_str());
+    }
+    else {
+        // An empty string offers every encoding this libcurl build can
+        // decode (gzip and deflate, plus brotli and zstd if available).
+        // The write callback only ever sees the decoded bytes, so the CRC32
+        // check of files.js still applies. Ranges refer to the encoded
+        // representation, so we don't mix the two.
+        curl_easy_setopt(this->curl, CURLOPT_ACCEPT_ENCODING, "");
+    }
+    auto responseCode = [this]() {
+        long code = 0;
+        curl_easy_getinfo(this->curl, CURLINFO_RESPONSE_CODE, &code);
+        return code;
+    };
+    // Error pages aren't part of the file. With a 200, the server ignored
+    // the range, and we have to skip the data we already have.
+    size_t skip = offset;
+    std::function<size_t(const uint8_t*, size_t)> rangeWriteCallback =
+        [&writeCallback, &responseCode, &skip](const uint8_t *data, size_t size) -> size_t {
+            long code = responseCode();
+            if (code != 200 && code != 206) {
+                return size;
+            }
+            if (code == 200 && skip) {
+                size_t skipped = MIN(skip, size);
+                skip -= skipped;
+                if (skipped == size) {
+                    return size;
+                }
+                return skipped + writeCallback(data + skipped, size - skipped);
+            }
+            return writeCallback(data, size);
+        };
+    std::function<bool(size_t, size_t)> rangeProgressCallback =
+        [&progressCallback, &responseCode, offset](size_t dlnow, size_t dltotal) {
+            if (offset && responseCode() == 206) {
+                return progressCallback(offset + dlnow, dltotal ? offset + dltotal : 0);
+            }
+            return progressCallback(dlnow, dltotal);
+        };
+
     curl_easy_setopt(this->curl, CURLOPT_WRITEFUNCTION, CurlHandle::writeCallbackStatic);
-    curl_easy_setopt(this->curl, CURLOPT_WRITEDATA, &writeCallback);
+    curl_easy_setopt(this->curl, CURLOPT_WRITEDATA, &rangeWriteCallback);
 
     curl_easy_setopt(this->curl, CURLOPT_NOPROGRESS, 0);
     curl_easy_setopt(this->curl, CURLOPT_XFERINFOFUNCTION, CurlHandle::progressCallbackStatic);
-    curl_easy_setopt(this->curl, CURLOPT_XFERINFODATA, &progressCallback);
+    curl_easy_setopt(this->curl, CURLOPT_XFERINFODATA, &rangeProgressCallback);
 
     char errbuf[CURL_ERROR_SIZE];
     curl_easy_setopt(this->curl, CURLOPT_ERRORBUFFER, errbuf);
     errbuf[0] = 0;
     curl_easy_setopt(this->curl, CURLOPT_URL, url.c_str());
 
-    CURLcode res = curl_easy_perform(this->curl);
+    // Prefer waiting for a stream on an existing HTTP/2 connection over
+    // opening a new one.
+    curl_easy_setopt(this->curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(this->curl, CURLOPT_PIPEWAIT, 1L);
+
+    CURLcode res = CurlMulti::get().perform(this->curl);
 
     curl_easy_setopt(this->curl, CURLOPT_WRITEFUNCTION, nullptr);
     curl_easy_setopt(this->curl, CURLOPT_WRITEDATA, nullptr);
     curl_easy_setopt(this->curl, CURLOPT_XFERINFOFUNCTION, nullptr);
     curl_easy_setopt(this->curl, CURLOPT_XFERINFODATA, nullptr);
+    curl_easy_setopt(this->curl, CURLOPT_HEADERFUNCTION, nullptr);
+    curl_easy_setopt(this->curl, CURLOPT_HEADERDATA, nullptr);
+    curl_easy_setopt(this->curl, CURLOPT_HTTPHEADER, nullptr);
+    curl_easy_setopt(this->curl, CURLOPT_RANGE, nullptr);
+    curl_easy_setopt(this->curl, CURLOPT_ACCEPT_ENCODING, nullptr);
+    curl_slist_free_all(headers);
 
     std::string error;
     if (res != CURLE_OK) {
@@ -82,7 +293,10 @@ HttpStatus CurlHandle::download(const std::string& url, std::function<size_t(con
 
     long response_code = 0;
     curl_easy_getinfo(this->curl, CURLINFO_RESPONSE_CODE, &response_code);
-    if (response_code != 200) {
+    if (response_code == 304 && conditional) {
+        return HttpStatus::makeNotModified();
+    }
+    if (response_code != 200 && !(response_code == 206 && offset)) {
         return HttpStatus::makeNetworkError(response_code);
     }
 
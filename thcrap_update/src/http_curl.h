@@ -1,10 +1,57 @@
 #pragma once
 
+#include <condition_variable>
 #include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <curl/curl.h>
 #include "http_interface.h"
 
+// Event loop running the transfers of all CurlHandles on a single multi
+// handle. Transfers to the same server share the connection cache, and get
+// multiplexed over one HTTP/2 connection when the server supports it.
+class CurlMulti
+{
+private:
+    struct Transfer
+    {
+        CURL *easy;
+        CURLcode result;
+        bool done;
+    };
+
+    static std::unique_ptr<CurlMulti> instance;
+    static std::mutex instanceMutex;
+
+    CURLM *multi;
+    std::mutex mutex;
+    std::condition_variable doneCondition;
+    // Added by the threads calling perform(), picked up by the event loop
+    std::list<Transfer*> pending;
+    bool quit;
+    std::thread thread;
+
+    void run();
+
+public:
+    CurlMulti(long maxStreams);
+    CurlMulti(const CurlMulti&) = delete;
+    CurlMulti& operator=(const CurlMulti&) = delete;
+    ~CurlMulti();
+
+    static CurlMulti& get();
+    // Stops the event loop. Must not be called while transfers are running.
+    static void shutdown();
+
+    // Runs the transfer configured in [easy] on the event loop, and blocks
+    // until it's done. All callbacks of [easy] are called from the event
+    // loop thread.
+    CURLcode perform(CURL *easy);
+};
+
 class CurlHandle : public IHttpHandle
 {
 private:
@@ -12,6 +59,10 @@ private:
 
     static size_t writeCallbackStatic(char *ptr, size_t size, size_t nmemb, void *userdata);
     static int progressCallbackStatic(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+    static size_t headerCallbackStatic(char *buffer, size_t size, size_t nitems, void *userdata);
+
+    HttpStatus request(const std::string& url, const HttpValidators& validators, HttpValidators& responseValidators, size_t offset,
+                       std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback);
 
 public:
     CurlHandle();
@@ -21,4 +72,8 @@ public:
     ~CurlHandle();
 
     HttpStatus download(const std::string& url, std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback) override;
+    HttpStatus downloadConditional(const std::string& url, const HttpValidators& validators, HttpValidators& responseValidators,
+                                   std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback) override;
+    HttpStatus downloadRange(const std::string& url, size_t offset,
+                             std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback) override;
 };
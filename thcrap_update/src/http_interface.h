@@ -1,10 +1,53 @@
 #pragma once
 
+#include <functional>
 #include "http_status.h"
 
+// Cache validators of a downloaded file, for conditional requests.
+struct HttpValidators
+{
+    // ETag header
+    std::string etag;
+    // Last-Modified header
+    std::string lastModified;
+
+    bool empty() const
+    {
+        return this->etag.empty() && this->lastModified.empty();
+    }
+};
+
 class IHttpHandle
 {
 public:
     virtual ~IHttpHandle() {}
     virtual HttpStatus download(const std::string& url, std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback) = 0;
+    // Only downloads [url] if it doesn't match [validators] anymore, and
+    // returns HttpStatus::NotModified otherwise. The validators of the
+    // downloaded file are returned in [responseValidators].
+    // Handles that don't support conditional requests simply download the
+    // file.
+    virtual HttpStatus downloadConditional(const std::string& url, const HttpValidators& /* validators */, HttpValidators& /* responseValidators */,
+                                           std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback)
+    {
+        return this->download(url, writeCallback, progressCallback);
+    }
+    // Downloads [url] starting at byte [offset], using a Range request.
+    // [writeCallback] only receives the data from [offset] onwards, even if
+    // the server ignores the range and sends the whole file. The progress
+    // values count from the beginning of the file.
+    // Handles that don't support ranges download the whole file and skip
+    // the first [offset] bytes.
+    virtual HttpStatus downloadRange(const std::string& url, size_t offset,
+                                     std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback)
+    {
+        return this->download(url, [&writeCallback, skip = offset](const uint8_t *data, size_t size) mutable -> size_t {
+            size_t skipped = MIN(skip, size);
+            skip -= skipped;
+            if (skipped == size) {
+                return size;
+            }
+            return skipped + writeCallback(data + skipped, size - skipped);
+        }, progressCallback);
+    }
 };
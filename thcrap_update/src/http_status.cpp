@@ -41,6 +41,7 @@ HttpStatus HttpStatus::makeNetworkError(unsigned int httpCode)
         { 403, "forbidden" },
         { 404, "not found" },
         { 409, "request timeout" },
+        { 416, "range not satisfiable" },
         { 429, "too many requests" },
         { 500, "internal server error" },
         // As a user, I used to be really confused by these errors. I didn't know what a "gateway" or CDN is.
@@ -70,11 +71,21 @@ HttpStatus HttpStatus::makeSystemError(unsigned int systemCode, std::string text
     return HttpStatus(SystemError, systemCode, text);
 }
 
+HttpStatus HttpStatus::makeNotModified()
+{
+    return HttpStatus(NotModified, 0, "not modified");
+}
+
 HttpStatus::Status HttpStatus::get() const
 {
     return this->status;
 }
 
+unsigned int HttpStatus::getCode() const
+{
+    return this->code;
+}
+
 HttpStatus::operator bool() const
 {
     return this->status == Ok;
@@ -18,7 +18,10 @@ public:
         // Also covers weird error codes like 1XX and 2XX which we shouldn't see.
         ServerError,
         // Error returned by the download library or by the write callback
-        SystemError
+        SystemError,
+        // 304 - the file still matches the validators sent with a
+        // conditional request, nothing was downloaded
+        NotModified
     };
 
 private:
@@ -36,8 +39,12 @@ public:
     static THCRAP_UPDATE_API HttpStatus makeCancelled();
     static THCRAP_UPDATE_API HttpStatus makeNetworkError(unsigned int httpCode);
     static THCRAP_UPDATE_API HttpStatus makeSystemError(unsigned int systemCode, std::string text);
+    static THCRAP_UPDATE_API HttpStatus makeNotModified();
 
     Status get() const;
+    // HTTP status code for network errors, system error code for system
+    // errors, and 0 otherwise.
+    unsigned int getCode() const;
     operator bool() const;
     bool operator==(Status status) const;
     bool operator!=(Status status) const;
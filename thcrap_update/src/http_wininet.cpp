@@ -1,5 +1,6 @@
 #include "thcrap.h"
 #include <windows.h>
+#include <algorithm>
 #include <stdexcept>
 #include <vector>
 #include "http_wininet.h"
@@ -30,6 +31,11 @@ WininetHandle::WininetHandle()
     // will essentially block all wininet HTTP accesses on handles that do not
     // explicitly ignore this setting.
     InternetSetOption(this->internet, INTERNET_OPTION_IGNORE_OFFLINE, &ignore, sizeof(DWORD));
+
+    // Transparently decodes gzip and deflate responses. Only has an effect
+    // if we ask for them with Accept-Encoding.
+    BOOL decoding = TRUE;
+    InternetSetOption(this->internet, INTERNET_OPTION_HTTP_DECODING, &decoding, sizeof(decoding));
 }
 
 WininetHandle::WininetHandle(WininetHandle&& other)
@@ -72,6 +78,36 @@ public:
 };
 
 HttpStatus WininetHandle::download(const std::string& url, std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback)
+{
+    HttpValidators responseValidators;
+    return this->downloadConditional(url, HttpValidators(), responseValidators, writeCallback, progressCallback);
+}
+
+static std::string WininetQueryString(HINTERNET hFile, DWORD info)
+{
+    char buf[256];
+    DWORD len = sizeof(buf);
+    if (!HttpQueryInfoA(hFile, info, buf, &len, 0)) {
+        return "";
+    }
+    return std::string(buf, len);
+}
+
+HttpStatus WininetHandle::downloadConditional(const std::string& url, const HttpValidators& validators, HttpValidators& responseValidators,
+                                              std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback)
+{
+    return this->request(url, validators, responseValidators, 0, writeCallback, progressCallback);
+}
+
+HttpStatus WininetHandle::downloadRange(const std::string& url, size_t offset,
+                                        std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback)
+{
+    HttpValidators responseValidators;
+    return this->request(url, HttpValidators(), responseValidators, offset, writeCallback, progressCallback);
+}
+
+HttpStatus WininetHandle::request(const std::string& url, const HttpValidators& validators, HttpValidators& responseValidators, size_t offset,
+                                  std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback)
 {
 	DWORD byte_ret = sizeof(DWORD);
 	DWORD http_stat = 0;
@@ -84,8 +120,24 @@ HttpStatus WininetHandle::download(const std::string& url, std::function<size_t(
         return HttpStatus::makeSystemError(0, "Wininet is not initialized");
     }
 
+	std::string headers;
+	if (!validators.etag.empty()) {
+		headers += "If-None-Match: " + validators.etag + "\r\n";
+	}
+	if (!validators.lastModified.empty()) {
+		headers += "If-Modified-Since: " + validators.lastModified + "\r\n";
+	}
+	const bool conditional = !headers.empty();
+	if (offset) {
+		headers += "Range: bytes=" + std::to_string(offset) + "-\r\n";
+	}
+	else {
+		// Ranges refer to the encoded representation, so we only ask for
+		// compression on full downloads.
+		headers += "Accept-Encoding: gzip, deflate\r\n";
+	}
 	ScopedHInternet hFile = InternetOpenUrlA(
-		this->internet, url.c_str(), NULL, 0,
+		this->internet, url.c_str(), headers.empty() ? NULL : headers.c_str(), (DWORD)headers.length(),
 		INTERNET_FLAG_RELOAD | INTERNET_FLAG_KEEP_CONNECTION, 0
 	);
 	if (!hFile) {
@@ -118,40 +170,71 @@ HttpStatus WininetHandle::download(const std::string& url, std::function<size_t(
 	HttpQueryInfo(hFile, HTTP_QUERY_FLAG_NUMBER | HTTP_QUERY_STATUS_CODE,
 		&http_stat, &byte_ret, 0
 	);
-	if (http_stat != 200) {
+	if (http_stat == 304 && conditional) {
+		return HttpStatus::makeNotModified();
+	}
+	// With a 206, Content-Length only covers the requested range. With a
+	// 200, the server ignored the range, and we have to skip the data we
+	// already have.
+	size_t base = 0;
+	size_t skip = 0;
+	if (http_stat == 206 && offset) {
+		base = offset;
+	}
+	else if (http_stat == 200) {
+		skip = offset;
+	}
+	else {
 		return HttpStatus::makeNetworkError(http_stat);
 	}
-
-	DWORD file_size;
-	HttpQueryInfo(hFile, HTTP_QUERY_FLAG_NUMBER | HTTP_QUERY_CONTENT_LENGTH,
+	responseValidators.etag = WininetQueryString(hFile, HTTP_QUERY_ETAG);
+	responseValidators.lastModified = WininetQueryString(hFile, HTTP_QUERY_LAST_MODIFIED);
+
+	// For encoded responses, Content-Length counts the encoded bytes, while
+	// InternetReadFile() returns the decoded ones, whose total we don't know.
+	const bool encoded = !WininetQueryString(hFile, HTTP_QUERY_CONTENT_ENCODING).empty();
+	DWORD file_size = 0;
+	byte_ret = sizeof(DWORD);
+	if (encoded || !HttpQueryInfo(hFile, HTTP_QUERY_FLAG_NUMBER | HTTP_QUERY_CONTENT_LENGTH,
 		&file_size, &byte_ret, 0
-	);
+	)) {
+		file_size = 0;
+	}
+	const size_t total = file_size ? base + file_size : 0;
 	std::vector<uint8_t> buffer;
-	if (!progressCallback(0, file_size)) {
+	if (!progressCallback(base, total)) {
 		return HttpStatus::makeCancelled();
 	}
-	auto rem_size = file_size;
 
-	while (rem_size) {
+	size_t received = 0;
+	for (;;) {
 		DWORD read_size = 0;
-		if (!InternetQueryDataAvailable(hFile, &read_size, 0, 0)) {
-			read_size = rem_size;
-		}
-		if (read_size == 0) {
-			return HttpStatus::makeSystemError(0, "disconnected");
+		if (!InternetQueryDataAvailable(hFile, &read_size, 0, 0) || read_size == 0) {
+			// Either the end of the response, or a read that blocks until
+			// more data arrives.
+			read_size = 64 * 1024;
 		}
 		buffer.resize(read_size);
 		if (InternetReadFile(hFile, buffer.data(), read_size, &byte_ret) == FALSE) {
 			return HttpStatus::makeSystemError(GetLastError(), "reading error");
 		}
-		rem_size -= byte_ret;
-		if (progressCallback(file_size - rem_size, file_size) == false) {
+		if (byte_ret == 0) {
+			break;
+		}
+		received += byte_ret;
+		if (progressCallback(base + received, total) == false) {
 			return HttpStatus::makeCancelled();
 		}
-        if (writeCallback(buffer.data(), read_size) != read_size) {
+		DWORD skipped = (DWORD)std::min<size_t>(skip, byte_ret);
+		skip -= skipped;
+		DWORD write_size = byte_ret - skipped;
+		if (write_size && writeCallback(buffer.data() + skipped, write_size) != write_size) {
 			return HttpStatus::makeSystemError(GetLastError(), "writing error");
 		}
 	}
+	if (file_size && received < file_size) {
+		return HttpStatus::makeSystemError(0, "disconnected");
+	}
 
 	return HttpStatus::makeOk();
 }
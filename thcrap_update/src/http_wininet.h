@@ -11,6 +11,9 @@ class WininetHandle : public IHttpHandle
 private:
     HINTERNET internet;
 
+    HttpStatus request(const std::string& url, const HttpValidators& validators, HttpValidators& responseValidators, size_t offset,
+                       std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback);
+
 public:
     WininetHandle();
     WininetHandle(WininetHandle&& other);
@@ -19,6 +22,10 @@ public:
     ~WininetHandle();
 
     HttpStatus download(const std::string& url, std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback) override;
+    HttpStatus downloadConditional(const std::string& url, const HttpValidators& validators, HttpValidators& responseValidators,
+                                   std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback) override;
+    HttpStatus downloadRange(const std::string& url, size_t offset,
+                             std::function<size_t(const uint8_t*, size_t)> writeCallback, std::function<bool(size_t, size_t)> progressCallback) override;
 };
 
 
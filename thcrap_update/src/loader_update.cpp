@@ -52,6 +52,9 @@ typedef struct {
 	bool settings_visible;
 	bool game_started;
 	bool update_at_exit;
+	// Start the game with the patch files we already have, and update them
+	// while it's running
+	bool launch_before_update;
 	bool background_updates;
 	bool update_others;
 	int time_between_updates;
@@ -555,11 +558,34 @@ void log_ncallback(const char* text, size_t len)
 	VLA_FREE(ntext);
 }
 
+static DWORD WINAPI loader_self_update_proc(void*)
+{
+	return (DWORD)update_notify_thcrap();
+}
+
+// Re-runs the loader with the same command line.
+static void loader_rerun(void)
+{
+	LPSTR commandLine = GetCommandLine();
+	log_printf("Update found! Re-running %s\n", commandLine);
+
+	STARTUPINFOA sa;
+	PROCESS_INFORMATION pi;
+	memset(&sa, 0, sizeof(sa));
+	memset(&pi, 0, sizeof(pi));
+	sa.cb = sizeof(sa);
+	CreateProcess(nullptr, commandLine, nullptr, nullptr, FALSE, 0, nullptr, nullptr, &sa, &pi);
+	CloseHandle(pi.hProcess);
+	CloseHandle(pi.hThread);
+}
+
 BOOL loader_update_with_UI(const char *exe_fn, char *args, const char *game_id_fallback)
 {
 	loader_update_state_t state;
 	bool game_started;
 	BOOL ret = 0;
+	HANDLE self_update_thread = nullptr;
+	DWORD self_update_ret;
 
 	log_print("Updates are enabled. Initializing update UI\n");
 	stack_show_missing();
@@ -583,6 +609,7 @@ BOOL loader_update_with_UI(const char *exe_fn, char *args, const char *game_id_f
 	state.state = STATE_SELF;
 
 	state.update_at_exit = globalconfig_get_boolean("update_at_exit", false);
+	state.launch_before_update = globalconfig_get_boolean("launch_before_update", false);
 	state.background_updates = globalconfig_get_boolean("background_updates", true);
 	state.time_between_updates = (int)globalconfig_get_integer("time_between_updates", 5);
 	state.update_others = globalconfig_get_boolean("update_others", true);
@@ -632,29 +659,31 @@ BOOL loader_update_with_UI(const char *exe_fn, char *args, const char *game_id_f
 		CloseHandle(hProcess);
 		log_print("done.\n");
 	}
+	else if (state.launch_before_update) {
+		EnterCriticalSection(&state.cs);
+		state.game_started = true;
+		LeaveCriticalSection(&state.cs);
+
+		log_printf("'launch_before_update' setting is set. Starting %s with arguments %s... ", exe_fn, args);
+		ret = thcrap_inject_into_new(exe_fn, args, NULL, NULL);
+		log_print("done.\n");
+		// The game picks up every file we replace through its repatch
+		// watcher. Until then, it should get the CPU and the disk first.
+		SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+	}
 
-	// Update the thcrap engine
-	log_print("Looking for thcrap updates...\n");
+	// Update the thcrap engine. This depends on the network, so it runs
+	// next to the patch updates, and never holds up the game.
+	log_print("Looking for thcrap updates in the background...\n");
 	size_t cur_dir_len = GetCurrentDirectory(0, nullptr);
 	VLA(char, cur_dir, cur_dir_len);
 	GetCurrentDirectory(cur_dir_len, cur_dir);
 	runconfig_thcrap_dir_set(cur_dir);
-	if (update_notify_thcrap() == SELF_OK && state.game_started == false) {
-		// Re-run an up-to-date loader
-		LPSTR commandLine = GetCommandLine();
-		log_printf("Update found! Re-running %s\n", commandLine);
-
-		STARTUPINFOA sa;
-		PROCESS_INFORMATION pi;
-		memset(&sa, 0, sizeof(sa));
-		memset(&pi, 0, sizeof(pi));
-		sa.cb = sizeof(sa);
-		CreateProcess(nullptr, commandLine, nullptr, nullptr, FALSE, 0, nullptr, nullptr, &sa, &pi);
-		CloseHandle(pi.hProcess);
-		CloseHandle(pi.hThread);
+	self_update_thread = CreateThread(nullptr, 0, loader_self_update_proc, nullptr, 0, nullptr);
+	if (!self_update_thread && update_notify_thcrap() == SELF_OK && state.game_started == false) {
+		loader_rerun();
 		goto end;
 	}
-	log_print("thcrap is up to date.\n");
 
 	log_print("Updating patches with global filter (don't download game-specific files)...\n");
 	loader_update_progress_init(&state, STATE_CORE_UPDATE);
@@ -683,6 +712,17 @@ BOOL loader_update_with_UI(const char *exe_fn, char *args, const char *game_id_f
 	game_started = state.game_started;
 	state.game_started = true;
 	LeaveCriticalSection(&state.cs);
+	if (game_started == false
+		&& self_update_thread
+		&& WaitForSingleObject(self_update_thread, 0) == WAIT_OBJECT_0
+		&& GetExitCodeThread(self_update_thread, &self_update_ret)
+		&& self_update_ret == SELF_OK
+	) {
+		// The update finished in time, so the game can already start with
+		// the new version.
+		loader_rerun();
+		goto end;
+	}
 	if (game_started == false) {
 		log_printf("Starting %s with arguments %s... ", exe_fn, args);
 		ret = thcrap_inject_into_new(exe_fn, args, NULL, NULL);
@@ -747,6 +787,11 @@ BOOL loader_update_with_UI(const char *exe_fn, char *args, const char *game_id_f
 	}
 
 	end:	
+	if (self_update_thread) {
+		// The message box with the result may still be open.
+		WaitForSingleObject(self_update_thread, INFINITE);
+		CloseHandle(self_update_thread);
+	}
 	globalconfig_set_boolean("update_at_exit", state.update_at_exit);
 	globalconfig_set_boolean("background_updates", state.background_updates);
 	globalconfig_set_integer("time_between_updates", state.time_between_updates);
@@ -9,6 +9,7 @@
 
 #include <thcrap.h>
 #include "self.h"
+#include "notify.h"
 
 /// Self-updating messages
 /// ----------------------
@@ -120,14 +121,24 @@ const char *self_sig_error =
 	"this problem has been resolved.";
 /// ----------------------
 
+// Same as strings_replace(), but without a global slot, since this can run
+// on any thread.
+static void notify_replace(std::string &str, const char *src, const char *dst)
+{
+	const size_t src_len = strlen(src);
+	dst = dst ? dst : "";
+	const size_t dst_len = strlen(dst);
+	for(size_t pos = str.find(src); pos != std::string::npos; pos = str.find(src, pos + dst_len)) {
+		str.replace(pos, src_len, dst);
+	}
+}
+
 int update_notify_thcrap(void)
 {
-	const size_t SELF_MSG_SLOT = (size_t)self_body;
 	self_result_t ret = SELF_NO_UPDATE;
 	const char *thcrap_dir = runconfig_thcrap_dir_get();
 	
 	char *arc_fn = NULL;
-	const char *self_msg = NULL;
 	ret = self_update(thcrap_dir, &arc_fn);
 	if (ret == SELF_NO_UPDATE) {
 		return ret;
@@ -143,31 +154,27 @@ int update_notify_thcrap(void)
 		self_header = self_header_failure;
 	}
 	
-	strings_sprintf(SELF_MSG_SLOT,
-		"%s%s",
-		self_header,
-		self_body[ret]
-	);
+	std::string self_msg = std::string(self_header) + self_body[ret];
 	
 	if(ret == SELF_NO_SIG || ret == SELF_SIG_FAIL) {
-		strings_strcat(SELF_MSG_SLOT, self_sig_error);
+		self_msg += self_sig_error;
 	}
-	strings_replace(SELF_MSG_SLOT, "${project}", PROJECT_NAME());
-	strings_replace(SELF_MSG_SLOT, "${project_short}", PROJECT_NAME_SHORT());
-	strings_replace(SELF_MSG_SLOT, "${build}", self_get_target_version());
-	strings_replace(SELF_MSG_SLOT, "${thcrap_dir}", thcrap_dir);
-	strings_replace(SELF_MSG_SLOT, "${desc_url}", PROJECT_URL());
-	self_msg = strings_replace(SELF_MSG_SLOT, "${arc_fn}", arc_fn);
+	notify_replace(self_msg, "${project}", PROJECT_NAME());
+	notify_replace(self_msg, "${project_short}", PROJECT_NAME_SHORT());
+	notify_replace(self_msg, "${build}", self_get_target_version());
+	notify_replace(self_msg, "${thcrap_dir}", thcrap_dir);
+	notify_replace(self_msg, "${desc_url}", PROJECT_URL());
+	notify_replace(self_msg, "${arc_fn}", arc_fn);
 
 	// Write message
 	// Default is false, and the value is going to be written later anyway. Doing it now would result in a useless IO write
 	if (ret != SELF_OK && globalconfig_get_boolean("skip_check_mbox", false)) {
 		log_print("---------------------------\n");
-		log_printf("%s\n", self_msg);
+		log_printf("%s\n", self_msg.c_str());
 		log_print("---------------------------\n");
 	}
 	else {
-		log_mboxf(NULL, MB_OK | self_msg_type[ret], self_msg);
+		log_mbox(NULL, MB_OK | self_msg_type[ret], self_msg.c_str());
 	}
 
 	// This isn't meant to be used by the user. skip_check_mbox just persists the last vcheck_error
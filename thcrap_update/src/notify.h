@@ -9,4 +9,7 @@
 
 #pragma once
 
+// Checks for a new thcrap version, updates if possible, and shows the
+// result in a message box. Blocks on the network and on the message box,
+// and is therefore run on a separate thread.
 int update_notify_thcrap(void);
@@ -1,13 +1,28 @@
 #include "thcrap.h"
 #include <filesystem>
 #include <functional>
-#include <thread>
 #include "server.h"
 #include "repo_discovery.h"
 
-RepoDiscovery::RepoDiscovery()
-    : downloading(0)
-{}
+#define REPO_DISCOVERY_CACHE_FN "repos/repo_cache.js"
+#define REPO_DISCOVERY_DEPTH_DEFAULT 8
+
+RepoDiscovery::RepoDiscovery(repo_discovery_callback_t callback, void *callbackParam)
+    : downloading(0), callback(callback), callbackParam(callbackParam)
+{
+    long long depth = globalconfig_get_integer("repo_discovery_depth", REPO_DISCOVERY_DEPTH_DEFAULT);
+    this->maxDepth = (size_t)MAX(depth, 0LL);
+
+    size_t cache_size;
+    void *cache_buffer = file_read(REPO_DISCOVERY_CACHE_FN, &cache_size);
+    if (cache_buffer) {
+        this->cache = json5_loadb(cache_buffer, cache_size, nullptr);
+        free(cache_buffer);
+    }
+    if (!json_is_object(*this->cache)) {
+        this->cache = json_object();
+    }
+}
 
 RepoDiscovery::~RepoDiscovery()
 {
@@ -18,6 +33,11 @@ RepoDiscovery::~RepoDiscovery()
 }
 
 void RepoDiscovery::addRepo(repo_t *repo)
+{
+    this->addRepo(repo, 0);
+}
+
+void RepoDiscovery::addRepo(repo_t *repo, size_t depth)
 {
     {
         std::scoped_lock<std::mutex> lock(this->mutex);
@@ -27,19 +47,29 @@ void RepoDiscovery::addRepo(repo_t *repo)
             return ;
         }
         this->repos[repo->id] = repo;
-        log_printf("%s\n", repo->id);
+        if (this->callback) {
+            this->callback(repo, this->callbackParam);
+        }
+        else {
+            log_printf("%s\n", repo->id);
+        }
     }
     // Unlock the mutex. The addServer function will relock it.
 
+    // The servers of a repo serve the same repo.js, so they don't count
+    // as a step further away.
     for (size_t i = 0; repo->servers && repo->servers[i]; i++) {
-        this->addServer(repo->servers[i]);
+        this->addServer(repo->servers[i], depth);
+    }
+    if (depth >= this->maxDepth) {
+        return ;
     }
     for (size_t i = 0; repo->neighbors && repo->neighbors[i]; i++) {
-        this->addServer(repo->neighbors[i]);
+        this->addServer(repo->neighbors[i], depth + 1);
     }
 }
 
-bool RepoDiscovery::addRepo(ScopedJson repo_js)
+bool RepoDiscovery::addRepo(ScopedJson repo_js, size_t depth)
 {
     if (!repo_js) {
         return false;
@@ -50,11 +80,16 @@ bool RepoDiscovery::addRepo(ScopedJson repo_js)
         return false;
     }
 
-    this->addRepo(repo);
+    this->addRepo(repo, depth);
     return true;
 }
 
 void RepoDiscovery::addServer(std::string url)
+{
+    this->addServer(std::move(url), 0);
+}
+
+void RepoDiscovery::addServer(std::string url, size_t depth)
 {
     std::scoped_lock<std::mutex> lock(this->mutex);
 
@@ -68,20 +103,63 @@ void RepoDiscovery::addServer(std::string url)
     this->urls.insert(url);
     this->downloading++;
 
-    std::thread([this, url]() {
-        auto [repo_js, status] = ServerCache::get().downloadJsonFile(url + "repo.js");
-        if (status) {
-            if (!this->addRepo(repo_js)) {
+    // The downloader runs the files in the order they were added, so all
+    // repos at one depth are requested before the ones behind them.
+    json_t *cached = json_object_get(*this->cache, url.c_str());
+    File::validators_t validators;
+    if (json_is_object(json_object_get(cached, "repo"))) {
+        const char *etag = json_string_value(json_object_get(cached, "etag"));
+        const char *lastModified = json_string_value(json_object_get(cached, "last_modified"));
+        HttpValidators v;
+        v.etag = etag ? etag : "";
+        v.lastModified = lastModified ? lastModified : "";
+        if (!v.empty()) {
+            auto [server, path] = ServerCache::get().urlToServer(url);
+            validators[server.getUrl()] = v;
+        }
+    }
+
+    this->downloader.addFile({ url }, "repo.js", std::move(validators),
+        [this, url, depth](const DownloadUrl&, std::vector<uint8_t>& data, const HttpValidators& validators) {
+            ScopedJson repo_js = json5_loadb(data.data(), data.size(), nullptr);
+            if (this->addRepo(repo_js, depth)) {
+                json_t *entry = json_pack("{s:O}", "repo", *repo_js);
+                if (!validators.etag.empty()) {
+                    json_object_set_new(entry, "etag", json_string(validators.etag.c_str()));
+                }
+                if (!validators.lastModified.empty()) {
+                    json_object_set_new(entry, "last_modified", json_string(validators.lastModified.c_str()));
+                }
+                std::scoped_lock<std::mutex> lock(this->mutex);
+                json_object_set_new(*this->cache, url.c_str(), entry);
+            }
+            else {
                 log_printf("%s: invalid repo!\n", url.c_str());
             }
+            this->onServerDone();
+        },
+        [this, url, depth](const DownloadUrl&, HttpStatus status) {
+            if (status == HttpStatus::NotModified) {
+                ScopedJson entry;
+                {
+                    std::scoped_lock<std::mutex> lock(this->mutex);
+                    entry = json_incref(json_object_get(*this->cache, url.c_str()));
+                }
+                this->addRepo(json_incref(json_object_get(*entry, "repo")), depth);
+            }
+            else {
+                log_printf("%s: %s\n", url.c_str(), status.toString().c_str());
+            }
+            this->onServerDone();
         }
-        else {
-            log_printf("%s: %s\n", url.c_str(), status.toString().c_str());
-        }
+    );
+}
 
-        this->downloading--;
-        this->condVar.notify_one();
-    }).detach();
+void RepoDiscovery::onServerDone()
+{
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    this->downloading--;
+    this->condVar.notify_all();
 }
 
 void RepoDiscovery::wait()
@@ -108,9 +186,17 @@ repo_t **RepoDiscovery::transferRepoList()
     return repo_list;
 }
 
-repo_t **RepoDiscover(const char *start_url)
+void RepoDiscovery::saveCache()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    std::error_code ec;
+    std::filesystem::create_directories("repos", ec);
+    json_dump_file(*this->cache, REPO_DISCOVERY_CACHE_FN, JSON_INDENT(2) | JSON_SORT_KEYS);
+}
+
+repo_t **RepoDiscoverWithCallback(const char *start_url, repo_discovery_callback_t callback, void *param)
 {
-    RepoDiscovery discover;
+    RepoDiscovery discover(callback, param);
 
     // Start with the remote discovery
     discover.addServer(start_url);
@@ -126,6 +212,12 @@ repo_t **RepoDiscover(const char *start_url)
         free(repo_list);
         discover.wait();
     }
+    discover.saveCache();
 
     return discover.transferRepoList();
 }
+
+repo_t **RepoDiscover(const char *start_url)
+{
+    return RepoDiscoverWithCallback(start_url, nullptr, nullptr);
+}
@@ -3,6 +3,8 @@
 #include "thcrap.h"
 #include <jansson.h>
 
+typedef void (*repo_discovery_callback_t)(const repo_t *repo, void *param);
+
 #ifdef __cplusplus
 
 #include <atomic>
@@ -11,6 +13,7 @@
 #include <mutex>
 #include <set>
 #include <string>
+#include "downloader.h"
 
 class RepoDiscovery
 {
@@ -20,9 +23,25 @@ private:
     std::atomic<size_t> downloading;
     std::set<std::string> urls;
     std::map<std::string, repo_t*> repos;
+    // Neighbors further away than this aren't followed
+    size_t maxDepth;
+
+    // Cached repo.js files and their validators, by URL.
+    // Entries of servers that couldn't be reached are kept.
+    ScopedJson cache;
+
+    repo_discovery_callback_t callback;
+    void *callbackParam;
+
+    // Destroyed first, so that the threads are done before the rest goes away
+    Downloader downloader;
+
+    void addServer(std::string url, size_t depth);
+    void addRepo(repo_t *repo, size_t depth);
+    void onServerDone();
 
 public:
-    RepoDiscovery();
+    RepoDiscovery(repo_discovery_callback_t callback = nullptr, void *callbackParam = nullptr);
     ~RepoDiscovery();
 
     // Start a discovery from an url.
@@ -35,18 +54,24 @@ public:
     void addRepo(repo_t *repo);
     // Parse repo_js and call addRepo() on the resulting repo_t.
     // Return false if the json file is not a valid repo.
-    bool addRepo(ScopedJson repo_js);
+    bool addRepo(ScopedJson repo_js, size_t depth = 0);
     // Wait until all running discoveries are finished.
     void wait();
     // Return the repos found by this discovery.
     // The ownership of the repos is transfered to the caller.
     repo_t **transferRepoList();
+    // Writes the repo.js files downloaded by this discovery to the cache,
+    // so that the next discovery only has to revalidate them.
+    void saveCache();
 };
 
 extern "C" {
 #endif // __cplusplus
 
 repo_t **RepoDiscover(const char *start_url);
+// Same as RepoDiscover, but calls [callback] for every repo as soon as it
+// has been found, from any thread. [repo] is only valid during the call.
+repo_t **RepoDiscoverWithCallback(const char *start_url, repo_discovery_callback_t callback, void *param);
 
 #ifdef __cplusplus
 }
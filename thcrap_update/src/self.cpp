@@ -326,14 +326,12 @@ char* self_sprint_hash(char *buf, size_t len, HCRYPTHASH hHash)
 	return p;
 }
 
-static int self_verify_buffer(
-	HCRYPTHASH *hHash,
-	const void *file_buf,
-	const size_t file_len,
+// Checks the Base64-encoded signature [sig] against [hHash], which already
+// received all of the signed data.
+static int self_verify_hash(
+	HCRYPTHASH hHash,
 	const json_t *sig,
-	HCRYPTPROV hCryptProv,
-	HCRYPTKEY hPubKey,
-	ALG_ID hash_alg
+	HCRYPTKEY hPubKey
 )
 {
 	int ret = -1;
@@ -343,8 +341,7 @@ static int self_verify_buffer(
 	DWORD sig_len = 0;
 	BYTE *sig_buf = NULL;
 
-	assert(hHash);
-	if(!file_buf || !file_len || !sig_base64 || !sig_base64_len) {
+	if(!hHash || !sig_base64 || !sig_base64_len) {
 		goto end;
 	}
 	ret = W32_ERR_WRAP(CryptStringToBinaryA(
@@ -367,19 +364,9 @@ static int self_verify_buffer(
 		sig_buf[i] = sig_buf[j];
 		sig_buf[j] = t;
 	}
-	ret = W32_ERR_WRAP(CryptCreateHash(hCryptProv, hash_alg, 0, 0, hHash));
-	if(ret) {
-		log_printf("couldn't create hash object\n");
-		goto end;
-	}
-	ret = W32_ERR_WRAP(CryptHashData(*hHash, (BYTE*)file_buf, file_len, 0));
-	if(ret) {
-		log_printf("couldn't hash the file data?!?\n");
-		goto end;
-	}
 
 	ret = W32_ERR_WRAP(CryptVerifySignature(
-		*hHash, sig_buf, sig_len, hPubKey, NULL, 0
+		hHash, sig_buf, sig_len, hPubKey, NULL, 0
 	));
 
 	log_printf(ret ? "invalid\n" : "valid\n");
@@ -400,13 +387,40 @@ static ALG_ID self_alg_from_str(const char *hash)
 	return 0;
 }
 
+// Creates the hash object for the algorithm named in [sig], which then gets
+// fed with the archive while it's being downloaded.
+static self_result_t self_hash_create(
+	HCRYPTPROV hCryptProv,
+	HCRYPTHASH *hHash,
+	const json_t *sig
+)
+{
+	assert(hCryptProv);
+	assert(hHash);
+
+	const char *sig_alg = json_object_get_string(sig, "alg");
+	ALG_ID hash_alg = self_alg_from_str(sig_alg);
+
+	if(!json_is_string(json_object_get(sig, "sig")) || !sig_alg) {
+		return SELF_NO_SIG;
+	}
+	if(!hash_alg) {
+		log_func_printf("Unsupported hash algorithm ('%s')!\n", sig_alg);
+		return SELF_NO_SIG;
+	}
+	if(W32_ERR_WRAP(CryptCreateHash(hCryptProv, hash_alg, 0, 0, hHash))) {
+		log_func_printf("Couldn't create hash object\n");
+		return SELF_NO_SIG;
+	}
+	return SELF_OK;
+}
+
 // We can't directly create and release the HCRYPTPROV in this function because
 // calling CryptReleaseContext() invalidates *all* objects that were created
 // from this CSP handle.
 static self_result_t self_verify(
 	HCRYPTPROV hCryptProv,
-	HCRYPTHASH *hHash,
-	const void *zip_buf,
+	HCRYPTHASH hHash,
 	size_t zip_len,
 	json_t *sig,
 	PCCERT_CONTEXT context
@@ -415,18 +429,12 @@ static self_result_t self_verify(
 	assert(hCryptProv);
 
 	const json_t *sig_sig = json_object_get(sig, "sig");
-	const char *sig_alg = json_object_get_string(sig, "alg");
-	ALG_ID hash_alg = self_alg_from_str(sig_alg);
 	HCRYPTKEY hPubKey = 0;
 
-	if(!zip_buf || !zip_len || !json_is_string(sig_sig) || !context || !sig_alg) {
+	if(!hHash || !zip_len || !json_is_string(sig_sig) || !context) {
 		return SELF_NO_SIG;
 	}
 	log_printf("Verifying archive signature... ");
-	if(!hash_alg) {
-		log_func_printf("Unsupported hash algorithm ('%s')!\n", sig_alg);
-		return SELF_NO_SIG;
-	}
 	if(W32_ERR_WRAP(CryptImportPublicKeyInfo(
 		hCryptProv, X509_ASN_ENCODING | PKCS_7_ASN_ENCODING,
 		&context->pCertInfo->SubjectPublicKeyInfo, &hPubKey
@@ -434,9 +442,9 @@ static self_result_t self_verify(
 		log_func_printf("Invalid public key!\n");
 		return SELF_NO_PUBLIC_KEY;
 	}
-	return self_verify_buffer(
-		hHash, zip_buf, zip_len, sig_sig, hCryptProv, hPubKey, hash_alg
-	) ? SELF_SIG_FAIL : SELF_OK;
+	int ret = self_verify_hash(hHash, sig_sig, hPubKey);
+	CryptDestroyKey(hPubKey);
+	return ret ? SELF_SIG_FAIL : SELF_OK;
 }
 
 static int self_move_to_dir(const char *dst_dir, const char *fn)
@@ -486,7 +494,25 @@ static self_result_t self_replace(zip_t *zip)
 			) {
 				local_ret = 0;
 			}
-			if(local_ret || zip_file_unzip(zip, fn)) {
+			if(local_ret) {
+				goto end;
+			}
+		}
+
+		// Everything is out of the way now, so the entries can be
+		// decompressed and written in parallel.
+		{
+			std::vector<const char*> fns;
+			json_object_foreach(zip_list(zip), fn, val) {
+				fns.push_back(fn);
+			}
+			volatile LONG unzip_failed = 0;
+			parallel_for(fns.size(), task_worker_count() + 1, [zip, &fns, &unzip_failed](size_t i) {
+				if(zip_file_unzip(zip, fns[i]) != 0) {
+					InterlockedExchange(&unzip_failed, 1);
+				}
+			});
+			if(unzip_failed) {
 				goto end;
 			}
 		}
@@ -594,21 +620,69 @@ self_result_t self_update(const char *thcrap_dir, char **arc_fn_ptr)
 	);
 	WaitForSingleObject(window.event_created, INFINITE);
 
-	auto [arc_dl, arc_dl_status] = ServerCache::get().downloadFile(SELF_SERVER + netpath);
-	if(!arc_dl_status || arc_dl.empty()) {
-		log_printf("%s%s: %s\n", SELF_SERVER.c_str(), netpath, arc_dl_status.toString().c_str());
-		return SELF_SERVER_ERROR;
-	}
-
+	// The signature comes first, so that we know the hash algorithm and can
+	// hash the archive as it arrives, instead of keeping all of it in memory.
 	auto [sig, sig_status] = ServerCache::get().downloadJsonFile(SELF_SERVER + netpath + ".sig");
 	if(!sig_status || !sig) {
 		log_printf("%s%s%s: %s\n", SELF_SERVER.c_str(), netpath, ".sig", sig_status.toString().c_str());
 		return SELF_NO_SIG;
 	}
 
-	ret = self_verify(hCryptProv, &hHash, arc_dl.data(), arc_dl.size(), *sig, context);
+	ret = self_hash_create(hCryptProv, &hHash, *sig);
+	if(ret != SELF_OK) {
+		return ret;
+	}
 	defer(CryptDestroyHash(hHash));
+
+	char part_fn[TEMP_FN_LEN];
+	strcpy(self_tempname(part_fn, TEMP_FN_LEN - 5, PREFIX_NEW), ".part");
+
+	HANDLE hPart = CreateFileU(
+		part_fn, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL
+	);
+	if(hPart == INVALID_HANDLE_VALUE) {
+		return SELF_DISK_ERROR;
+	}
+
+	size_t arc_len = 0;
+	bool arc_write_failed = false;
+	bool arc_hash_failed = false;
+	auto arc_dl_status = ServerCache::get().downloadFile(SELF_SERVER + netpath,
+		[&](const uint8_t *data, size_t size) -> size_t {
+			DWORD byte_ret;
+			if(!WriteFile(hPart, data, size, &byte_ret, NULL) || byte_ret != size) {
+				arc_write_failed = true;
+				return 0;
+			}
+			if(!CryptHashData(hHash, data, size, 0)) {
+				arc_hash_failed = true;
+				return 0;
+			}
+			arc_len += size;
+			return size;
+		}
+	);
+	CloseHandle(hPart);
+
+	if(arc_write_failed) {
+		DeleteFileU(part_fn);
+		return SELF_DISK_ERROR;
+	}
+	if(arc_hash_failed) {
+		log_func_printf("Couldn't hash the archive data?!?\n");
+		DeleteFileU(part_fn);
+		return SELF_SIG_FAIL;
+	}
+	if(!arc_dl_status || !arc_len) {
+		log_printf("%s%s: %s\n", SELF_SERVER.c_str(), netpath, arc_dl_status.toString().c_str());
+		DeleteFileU(part_fn);
+		return SELF_SERVER_ERROR;
+	}
+
+	ret = self_verify(hCryptProv, hHash, arc_len, *sig, context);
 	if(ret != SELF_OK) {
+		DeleteFileU(part_fn);
 		return ret;
 	}
 
@@ -624,7 +698,8 @@ self_result_t self_update(const char *thcrap_dir, char **arc_fn_ptr)
 	}
 	memcpy(ext, EXT_NEW, ext_new_len);
 
-	if(file_write(arc_fn, arc_dl.data(), arc_dl.size())) {
+	if(!MoveFileExU(part_fn, arc_fn, MOVEFILE_REPLACE_EXISTING)) {
+		DeleteFileU(part_fn);
 		return SELF_DISK_ERROR;
 	}
 	if(arc_fn_ptr) {
@@ -1,4 +1,5 @@
 #include "thcrap.h"
+#include <algorithm>
 #include "server.h"
 
 #if defined(USE_HTTP_CURL)
@@ -11,6 +12,14 @@
 
 std::unique_ptr<ServerCache> ServerCache::instance;
 
+#define SERVER_CONNECTIONS_DEFAULT 6
+#define SERVER_CONNECTIONS_MAX 64
+// Weight of a new transfer in the smoothed statistics
+#define SERVER_STATS_WEIGHT 0.25
+// Size of the file used for the estimate. Most patch files are small, so
+// latency usually matters more than throughput.
+#define SERVER_ESTIMATE_SIZE (64 * 1024)
+
 
 BorrowedHttpHandle::BorrowedHttpHandle(std::unique_ptr<IHttpHandle> handle, Server& server)
     : handle(std::move(handle)), server(server)
@@ -36,6 +45,8 @@ IHttpHandle& BorrowedHttpHandle::operator*()
 Server::Server(HttpHandleFactory handleFactory, std::string baseUrl)
     : handleFactory(handleFactory), baseUrl(std::move(baseUrl))
 {
+    long long connections = globalconfig_get_integer("update_server_connections", SERVER_CONNECTIONS_DEFAULT);
+    this->maxConnections = (size_t)std::clamp(connections, 1LL, (long long)SERVER_CONNECTIONS_MAX);
     if (this->baseUrl[this->baseUrl.length() - 1] != '/') {
         this->baseUrl.append("/");
     }
@@ -56,6 +67,76 @@ const std::string& Server::getUrl() const
     return this->baseUrl;
 }
 
+void Server::recordTransfer(double latency, double duration, size_t bytes)
+{
+    double transferTime = MAX(duration - latency, 0.001);
+    double throughput = bytes / transferTime;
+
+    std::scoped_lock<std::mutex> lock(this->statsMutex);
+    this->totals.files++;
+    this->totals.bytes += bytes;
+    this->totals.transfer_time += duration;
+    this->totals.first_byte_time += latency;
+    if (this->throughput == 0.0) {
+        this->latency = latency;
+        this->throughput = throughput;
+    }
+    else {
+        this->latency += (latency - this->latency) * SERVER_STATS_WEIGHT;
+        this->throughput += (throughput - this->throughput) * SERVER_STATS_WEIGHT;
+    }
+}
+
+void Server::recordFailure(bool fatal)
+{
+    std::scoped_lock<std::mutex> lock(this->statsMutex);
+    this->totals.failures++;
+    if (fatal) {
+        this->totals.fatal_failures++;
+    }
+}
+
+void Server::recordRetry()
+{
+    std::scoped_lock<std::mutex> lock(this->statsMutex);
+    this->totals.retries++;
+}
+
+update_server_stats_t Server::getStats() const
+{
+    update_server_stats_t ret;
+    {
+        std::scoped_lock<std::mutex> lock(this->statsMutex);
+        ret = this->totals;
+    }
+    ret.url = this->baseUrl.c_str();
+    ret.alive = this->alive;
+    return ret;
+}
+
+double Server::estimate() const
+{
+    double latency;
+    double throughput;
+    {
+        std::scoped_lock<std::mutex> lock(this->statsMutex);
+        latency = this->latency;
+        throughput = this->throughput;
+    }
+    size_t active;
+    {
+        std::scoped_lock<std::mutex> lock(this->mutex);
+        active = this->activeHandles;
+    }
+    if (throughput == 0.0) {
+        return 0.001 * active;
+    }
+    // Running downloads share the bandwidth, and the ones beyond the
+    // connection limit have to wait.
+    double single = latency + SERVER_ESTIMATE_SIZE / throughput;
+    return single * (1 + active / (double)this->maxConnections);
+}
+
 std::pair<std::vector<uint8_t>, HttpStatus> Server::downloadFile(const std::string& name)
 {
     std::list<DownloadUrl> urls {
@@ -77,6 +158,23 @@ std::pair<std::vector<uint8_t>, HttpStatus> Server::downloadFile(const std::stri
     return std::make_pair(std::move(ret), status);
 }
 
+HttpStatus Server::downloadFile(const std::string& name, std::function<size_t(const uint8_t*, size_t)> writeCallback)
+{
+    DownloadUrl url(*this, name);
+    BorrowedHttpHandle handle = this->borrowHandle();
+    HttpStatus status = (*handle).download(url.getUrl(), writeCallback, [](size_t, size_t) {
+        return true;
+    });
+    if (status.get() == HttpStatus::ServerError || status.get() == HttpStatus::SystemError) {
+        this->fail();
+        this->recordFailure(true);
+    }
+    else if (!status && status.get() != HttpStatus::Cancelled) {
+        this->recordFailure(false);
+    }
+    return status;
+}
+
 std::pair<ScopedJson, HttpStatus> Server::downloadJsonFile(const std::string& name)
 {
     auto [data, status] = this->downloadFile(name);
@@ -90,7 +188,9 @@ std::pair<ScopedJson, HttpStatus> Server::downloadJsonFile(const std::string& na
 
 BorrowedHttpHandle Server::borrowHandle()
 {
-    std::scoped_lock<std::mutex> lock(this->mutex);
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->handleReturned.wait(lock, [this]() { return this->activeHandles < this->maxConnections; });
+    this->activeHandles++;
     if (!this->httpHandles.empty()) {
         BorrowedHttpHandle handle(std::move(this->httpHandles.front()), *this);
         this->httpHandles.pop_front();
@@ -102,8 +202,12 @@ BorrowedHttpHandle Server::borrowHandle()
 
 void Server::giveBackHandle(std::unique_ptr<IHttpHandle> handle)
 {
-    std::scoped_lock<std::mutex> lock(this->mutex);
-    this->httpHandles.push_back(std::move(handle));
+    {
+        std::scoped_lock<std::mutex> lock(this->mutex);
+        this->httpHandles.push_back(std::move(handle));
+        this->activeHandles--;
+    }
+    this->handleReturned.notify_one();
 }
 
 
@@ -179,8 +283,57 @@ std::pair<std::vector<uint8_t>, HttpStatus> ServerCache::downloadFile(const std:
     return server.downloadFile(path);
 }
 
+HttpStatus ServerCache::downloadFile(const std::string& url, std::function<size_t(const uint8_t*, size_t)> writeCallback)
+{
+    auto [server, path] = this->urlToServer(url);
+    return server.downloadFile(path, writeCallback);
+}
+
 std::pair<ScopedJson, HttpStatus> ServerCache::downloadJsonFile(const std::string& url)
 {
     auto [server, path] = this->urlToServer(url);
     return server.downloadJsonFile(path);
 }
+
+std::vector<update_server_stats_t> ServerCache::getStats()
+{
+    std::vector<update_server_stats_t> ret;
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    for (auto& [origin, server] : this->cache) {
+        update_server_stats_t stats = server.getStats();
+        if (stats.files || stats.failures || stats.retries) {
+            ret.push_back(stats);
+        }
+    }
+    return ret;
+}
+
+void ServerCache::printStats()
+{
+    std::vector<update_server_stats_t> stats = this->getStats();
+    if (stats.empty()) {
+        return;
+    }
+    log_print("Download statistics per server:\n");
+    for (const update_server_stats_t& server : stats) {
+        double transferTime = server.transfer_time - server.first_byte_time;
+        log_printf(
+            "%s: %zu files, %.2f MiB, %.1f KiB/s, %.0f ms to first byte on average, "
+            "%zu retries, %zu failures (%zu fatal)%s\n",
+            server.url, server.files, server.bytes / (1024.0 * 1024.0),
+            transferTime > 0.0 ? (server.bytes / 1024.0) / transferTime : 0.0,
+            server.files ? (server.first_byte_time * 1000.0) / server.files : 0.0,
+            server.retries, server.failures, server.fatal_failures,
+            server.alive ? "" : ", dead"
+        );
+    }
+}
+
+size_t update_server_stats_get(update_server_stats_t *out, size_t count)
+{
+    std::vector<update_server_stats_t> stats = ServerCache::get().getStats();
+    if (out) {
+        std::copy_n(stats.begin(), MIN(count, stats.size()), out);
+    }
+    return stats.size();
+}
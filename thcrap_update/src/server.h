@@ -1,5 +1,6 @@
 #pragma once
 
+#include <condition_variable>
 #include <list>
 #include <map>
 #include <memory>
@@ -37,8 +38,22 @@ private:
     std::string baseUrl;
     // false if the server is dead (network timeout, 5XX error code, etc).
     std::atomic<bool> alive = true;
-    std::mutex mutex;
+    mutable std::mutex mutex;
     std::list<std::unique_ptr<IHttpHandle>> httpHandles;
+    // Number of borrowed handles, limited to maxConnections
+    size_t activeHandles = 0;
+    size_t maxConnections;
+    std::condition_variable handleReturned;
+
+    // Smoothed transfer statistics, used to pick the fastest mirror.
+    // Both are 0 until the first transfer finished.
+    mutable std::mutex statsMutex;
+    // Seconds until the first byte
+    double latency = 0.0;
+    // Bytes per second after the first byte
+    double throughput = 0.0;
+    // Totals for update_server_stats_get(), [url] is unused.
+    update_server_stats_t totals = {};
 
 public:
     Server(HttpHandleFactory handleFactory, std::string baseUrl);
@@ -51,13 +66,36 @@ public:
     void fail();
     const std::string& getUrl() const;
 
+    // Adds a successful transfer of [bytes] bytes to the statistics.
+    // [latency] and [duration] are in seconds.
+    void recordTransfer(double latency, double duration, size_t bytes);
+    // Adds a failed transfer to the statistics. [fatal] is true if the
+    // server was set as failed because of it.
+    void recordFailure(bool fatal);
+    // Adds a download attempt of a file that failed on another server.
+    void recordRetry();
+    // Returns the totals of all recorded transfers. [url] points to
+    // getUrl().
+    update_server_stats_t getStats() const;
+    // Estimated time in seconds until a new download from this server would
+    // be done, taking the downloads that are already running into account.
+    // Servers without statistics get a tiny estimate, so that they are
+    // tried (and measured) first.
+    double estimate() const;
+
     // Download a single file from this server.
     std::pair<std::vector<uint8_t>, HttpStatus> downloadFile(const std::string& name);
+    // Download a single file from this server, passing the data to
+    // [writeCallback] as it arrives rather than keeping it in memory.
+    HttpStatus downloadFile(const std::string& name, std::function<size_t(const uint8_t*, size_t)> writeCallback);
     // Download a single json file from this server.
     std::pair<ScopedJson, HttpStatus> downloadJsonFile(const std::string& name);
 
     // Borrow a HttpHandle from the server.
     // You own it until the BorrowedHttpHandle is destroyed.
+    // Blocks while the server already has its maximum number of
+    // connections, set through the "update_server_connections" global config
+    // option.
     BorrowedHttpHandle borrowHandle();
     // Give the HttpHandle back to the server.
     // You should not call it, it is called automatically when the BorrowedHttpHandle
@@ -98,6 +136,12 @@ public:
 
     // Find the server for url and call downloadFile on it
     std::pair<std::vector<uint8_t>, HttpStatus> downloadFile(const std::string& url);
+    HttpStatus downloadFile(const std::string& url, std::function<size_t(const uint8_t*, size_t)> writeCallback);
     // Find the server for url and call downloadJsonFile on it
     std::pair<ScopedJson, HttpStatus> downloadJsonFile(const std::string& url);
+
+    // Returns the statistics of every server that was used so far.
+    std::vector<update_server_stats_t> getStats();
+    // Writes the statistics of every server to the log.
+    void printStats();
 };
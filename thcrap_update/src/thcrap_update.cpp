@@ -7,9 +7,16 @@
   * Plugin setup
   */
 
+#if defined(USE_HTTP_CURL)
+# include "thcrap.h"
+# include "http_curl.h"
+#endif
+
 extern "C" void http_mod_exit(void)
 {
-	// TODO: cleanup
+#if defined(USE_HTTP_CURL)
+	CurlMulti::shutdown();
+#endif
 }
 
 extern "C" void thcrap_update_exit(void)
@@ -5,3 +5,51 @@
 #else
 # define THCRAP_UPDATE_API __declspec(dllimport)
 #endif
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Download statistics of a single server, since it was first used.
+typedef struct {
+    // Protocol and domain name of the server
+    const char *url;
+    // Successful transfers, their total size, and the seconds they took in
+    // total and until their first byte
+    size_t files;
+    size_t bytes;
+    double transfer_time;
+    double first_byte_time;
+    // Attempts to download a file that had already failed on another server
+    size_t retries;
+    // Failed attempts, and how many of them were server or network errors
+    // that made us stop using the server
+    size_t failures;
+    size_t fatal_failures;
+    bool alive;
+} update_server_stats_t;
+
+// Totals of a single patch during the last update.
+typedef struct {
+    const char *patch_id;
+    // Files that were updated, and their total size
+    size_t files;
+    size_t bytes;
+    // Files that couldn't be updated
+    size_t failures;
+    // Seconds between the first and the last file of the patch
+    double time;
+} update_patch_stats_t;
+
+// Copy the statistics of up to [count] servers or patches into [out], and
+// return the total number of servers or patches. Server URLs stay valid
+// until the server cache is cleared, patch IDs until the next update.
+THCRAP_UPDATE_API size_t update_server_stats_get(update_server_stats_t *out, size_t count);
+THCRAP_UPDATE_API size_t update_patch_stats_get(update_patch_stats_t *out, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
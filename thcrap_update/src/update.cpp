@@ -1,17 +1,73 @@
 #include "thcrap.h"
+#include <algorithm>
 #include <sstream>
 #include <cstring>
+#include <memory>
+#include <atomic>
+#include <unordered_set>
+#include "files_journal.h"
+#include "blob_store.h"
 #include "update.h"
 #include "server.h"
 #include "strings_array.h"
-#include "3rdparty/crc32.h"
+
+// Next to the local files.js in every patch
+#define REMOTE_FILES_JS_CACHE_FN "files.remote.js"
+
+// Optional, in the patch directory on the server. bundle.js describes
+// bundle.zip, which contains the whole patch:
+// {
+//     "crc32": <CRC32 of bundle.zip>,
+//     "files": { <file name>: <CRC32 of the file in the bundle>, ... }
+// }
+#define BUNDLE_JS_FN "bundle.js"
+#define BUNDLE_ZIP_FN "bundle.zip"
+// Only worth the extra request for bundle.js if there's a lot to download.
+#define BUNDLE_MIN_FILES 32
+// Default percentage of the files of a patch that have to be outdated for
+// the bundle to be used, overridable through the "update_bundle_threshold"
+// global config option. Values above 100 disable bundles.
+#define BUNDLE_THRESHOLD_DEFAULT 50
+
+// Optional, next to every file on the server:
+// <file name>.<old CRC32>-<new CRC32>.delta, see delta.h.
+// Smaller files are always downloaded in full, since a delta wouldn't save
+// much more than the extra request costs.
+#define DELTA_MIN_SIZE (64 * 1024)
+
+// Only loose files that are big enough are updated through deltas.
+static bool localDeltaCandidate(const patch_t *patch, const char *fn)
+{
+    HANDLE hFile = patch_file_stream(patch, fn);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    bool ret = GetFileSizeEx(hFile, &size) && size.QuadPart >= DELTA_MIN_SIZE;
+    CloseHandle(hFile);
+    return ret;
+}
+
+static std::filesystem::path patchFilePath(const patch_t *patch, const std::string& fn)
+{
+    char *patch_fn = fn_for_patch(patch, fn.c_str());
+    std::filesystem::path ret = std::filesystem::u8path(patch_fn ? patch_fn : fn.c_str());
+    SAFE_FREE(patch_fn);
+    return ret;
+}
+
+// Shares a verified patch file with all other patches.
+static void blobStoreAdd(const patch_t *patch, const std::string& fn, uint32_t crc32)
+{
+    if (BlobStore::enabled()) {
+        BlobStore::add(crc32, patchFilePath(patch, fn));
+    }
+}
 
 Update::Update(Update::filter_t filterCallback,
                progress_callback_t progressCallback, void *progressData)
     : filterCallback(filterCallback), progressCallback(progressCallback), progressData(progressData)
-{
-    crc32::generate_table(this->crc32Table);
-}
+{}
 
 get_status_t Update::httpStatusToGetStatus(HttpStatus status)
 {
@@ -26,14 +82,99 @@ get_status_t Update::httpStatusToGetStatus(HttpStatus status)
             return GET_SERVER_ERROR;
         case HttpStatus::SystemError:
             return GET_SYSTEM_ERROR;
+        case HttpStatus::NotModified:
+            return GET_OK;
         default:
             throw std::invalid_argument("Invalid status");
     }
 }
 
+void Update::recordPatchStats(const patch_t *patch, const std::string& fn, get_status_t getStatus, size_t file_size)
+{
+    auto now = std::chrono::steady_clock::now();
+    std::scoped_lock<std::mutex> lock(this->statsMutex);
+    PatchStats& stats = this->patchStats[patch];
+    if (stats.first == std::chrono::steady_clock::time_point()) {
+        stats.first = now;
+    }
+    stats.last = now;
+    switch (getStatus) {
+    case GET_OK:
+        // Its files are counted on their own.
+        if (fn != BUNDLE_ZIP_FN) {
+            stats.files++;
+            stats.bytes += file_size;
+        }
+        break;
+    case GET_CLIENT_ERROR:
+    case GET_CRC32_ERROR:
+    case GET_SERVER_ERROR:
+    case GET_SYSTEM_ERROR:
+        stats.failures++;
+        break;
+    default:
+        break;
+    }
+}
+
+// Statistics of the last update, see update_patch_stats_get()
+static std::mutex lastPatchStatsMutex;
+static std::list<std::string> lastPatchIds;
+static std::vector<update_patch_stats_t> lastPatchStats;
+
+void Update::publishStats(const std::list<const patch_t*>& patchs)
+{
+    std::list<std::string> ids;
+    std::vector<update_patch_stats_t> stats;
+    {
+        std::scoped_lock<std::mutex> lock(this->statsMutex);
+        for (const patch_t *patch : patchs) {
+            auto it = this->patchStats.find(patch);
+            if (it == this->patchStats.end()) {
+                continue;
+            }
+            const PatchStats& patchStats = it->second;
+            update_patch_stats_t out;
+            out.patch_id = ids.emplace_back(patch->id ? patch->id : "").c_str();
+            out.files = patchStats.files;
+            out.bytes = patchStats.bytes;
+            out.failures = patchStats.failures;
+            out.time = std::chrono::duration<double>(patchStats.last - patchStats.first).count();
+            stats.push_back(out);
+        }
+    }
+
+    if (!stats.empty()) {
+        log_print("Update statistics per patch:\n");
+        for (const update_patch_stats_t& patch : stats) {
+            log_printf("%s: %zu files, %.2f MiB in %.1f s, %zu failures\n",
+                patch.patch_id, patch.files, patch.bytes / (1024.0 * 1024.0), patch.time, patch.failures
+            );
+        }
+    }
+    ServerCache::get().printStats();
+
+    std::scoped_lock<std::mutex> lock(lastPatchStatsMutex);
+    lastPatchIds = std::move(ids);
+    lastPatchStats = std::move(stats);
+}
+
+size_t update_patch_stats_get(update_patch_stats_t *out, size_t count)
+{
+    std::scoped_lock<std::mutex> lock(lastPatchStatsMutex);
+    if (out) {
+        std::copy_n(lastPatchStats.begin(), MIN(count, lastPatchStats.size()), out);
+    }
+    return lastPatchStats.size();
+}
+
 bool Update::callProgressCallback(const patch_t *patch, const std::string& fn, const DownloadUrl& url, get_status_t getStatus, std::string error,
                                   size_t file_progress, size_t file_size)
 {
+    // Every download starts with an empty progress report.
+    if (getStatus != GET_DOWNLOADING || (file_progress == 0 && file_size == 0)) {
+        this->recordPatchStats(patch, fn, getStatus, file_size);
+    }
     if (this->progressCallback == nullptr) {
         return true;
     }
@@ -61,40 +202,12 @@ bool Update::callProgressCallback(const patch_t *patch, const std::string& fn, c
     else {
         status.nb_files_total = 0;
     }
+    status.concurrency = this->mainDownloader.concurrency();
+    status.throughput = this->mainDownloader.throughput();
 
     return this->progressCallback(&status, this->progressData);
 }
 
-class AutoWriteJson
-{
-private:
-    json_t *json;
-    const patch_t *patch;
-    const char *fn;
-
-public:
-    AutoWriteJson(const patch_t *patch, const char *fn)
-        : json(patch_json_load(patch, fn, nullptr)), patch(patch), fn(fn)
-    {
-        if (!this->json) {
-            this->json = json_object();
-        }
-    }
-    ~AutoWriteJson()
-    {
-        patch_json_store(this->patch, fn, this->json);
-        json_decref(this->json);
-    }
-    operator json_t*() {
-        return this->json;
-    }
-
-    AutoWriteJson(const AutoWriteJson&) = delete;
-    AutoWriteJson(AutoWriteJson&&) = delete;
-    AutoWriteJson& operator=(const AutoWriteJson&) = delete;
-    AutoWriteJson& operator=(AutoWriteJson&&) = delete;
-};
-
 std::string Update::fnToUrl(const std::string& url, uint32_t crc32)
 {
     // Formatting with streams is trash. Hopefully we can replace this
@@ -133,20 +246,40 @@ std::string Update::fnToUrl(const std::string& url, uint32_t crc32)
     return ss.str();
 }
 
-void Update::onFilesJsComplete(const patch_t *patch, const std::vector<uint8_t>& data)
+void Update::onFilesJsComplete(const patch_t *patch, json_t *remoteFilesJs)
 {
-    auto localFilesJs = std::make_shared<AutoWriteJson>(patch, "files.js");
-    ScopedJson remoteFilesJs = json5_loadb(data.data(), data.size(), nullptr);
+    auto localFilesJs = std::make_shared<FilesJsJournal>(patch);
 
-    if (*remoteFilesJs == nullptr) {
-        log_printf("%s: files.js isn't a valid json file!\n", patch->id);
-        return ;
-    }
+    // Enumerated once, rather than probing the file system for every file
+    // that is listed in both files.js.
+    std::unique_ptr<patch_index_t, decltype(&patch_index_snapshot_free)> localIndex(
+        patch_index_snapshot(patch), patch_index_snapshot_free
+    );
+    auto localFileExists = [patch, &localIndex](const char *fn) {
+        if (patch_file_blacklisted(patch, fn)) {
+            return false;
+        }
+        switch (patch_index_snapshot_lookup(localIndex.get(), fn)) {
+            case PATCH_INDEX_MISSING:
+                return false;
+            case PATCH_INDEX_FILE:
+            case PATCH_INDEX_DIRECTORY:
+                return true;
+            default:
+                return patch_file_exists(patch, fn) != 0;
+        }
+    };
+
+    downloads_t downloads;
+    size_t filesTotal = 0;
 
     const char *fn;
     json_t *value;
-    json_object_foreach(*remoteFilesJs, fn, value) {
-        json_t *localValue = json_object_get(*localFilesJs, fn);
+    json_object_foreach(remoteFilesJs, fn, value) {
+        if (!json_is_null(value)) {
+            filesTotal++;
+        }
+        ScopedJson localValue = localFilesJs->get(fn);
         // Did someone simply drop a full files.js into a standalone
         // package that doesn't actually come with the files for
         // every game?
@@ -154,11 +287,11 @@ void Update::onFilesJsComplete(const patch_t *patch, const std::vector<uint8_t>&
         // cover more games. If the remote files haven't changed by
         // then, they wouldn't be downloaded if files.js pretends
         // that these versions already exist locally.)
-        if (localValue && !patch_file_exists(patch, fn)) {
-            json_object_del(*localFilesJs, fn);
+        if (localValue && !localFileExists(fn)) {
+            localFilesJs->remove(fn);
             localValue = nullptr;
         }
-        if (localValue && json_equal(value, localValue)) {
+        if (localValue && json_equal(value, *localValue)) {
             // The file didn't change since our last update, no need to update or delete it
             continue;
         }
@@ -168,43 +301,298 @@ void Update::onFilesJsComplete(const patch_t *patch, const std::vector<uint8_t>&
         }
         if (json_is_null(value)) {
             // Delete file
-            if (patch_file_exists(patch, fn)) {
+            if (localFileExists(fn)) {
                 log_printf("Deleting %s/%s\n", patch->id, fn);
                 patch_file_delete(patch, fn);
             }
-            json_object_set(*localFilesJs, fn, json_null());
+            localFilesJs->set(fn, json_null());
             continue;
         }
+        downloads.emplace_back(fn, value);
+    }
+
+    // Files that another patch already downloaded.
+    if (BlobStore::enabled()) {
+        size_t out = 0;
+        for (size_t i = 0; i < downloads.size(); i++) {
+            if (!this->installFromBlobStore(patch, downloads[i].first, downloads[i].second, localFilesJs)) {
+                downloads[out++] = std::move(downloads[i]);
+            }
+        }
+        downloads.resize(out);
+    }
+
+    // A fresh install, or an update that touches most of the patch, is
+    // faster as one big download than as thousands of small ones.
+    long long threshold = globalconfig_get_integer("update_bundle_threshold", BUNDLE_THRESHOLD_DEFAULT);
+    if (
+        downloads.size() >= BUNDLE_MIN_FILES && threshold >= 0 && threshold <= 100
+        && downloads.size() * 100 >= filesTotal * (size_t)threshold
+    ) {
+        this->installFromBundle(patch, downloads, localFilesJs);
+    }
+
+    for (const auto& download : downloads) {
+        const std::string& fn = download.first;
+        ScopedJson localValue = localFilesJs->get(fn.c_str());
+        if (json_is_integer(*localValue) && localDeltaCandidate(patch, fn.c_str())) {
+            this->startDeltaDownload(patch, fn, *localValue, download.second, localFilesJs);
+        }
+        else {
+            this->startFullDownload(patch, fn, download.second, localFilesJs);
+        }
+    }
+}
+
+void Update::startFullDownload(const patch_t *patch, const std::string& fn, json_t *value,
+                               const std::shared_ptr<FilesJsJournal>& localFilesJs)
+{
+    // Downloaded next to the final file, so that it can be atomically
+    // moved in place once it passed the CRC check.
+    char *patch_fn = fn_for_patch(patch, fn.c_str());
+    std::filesystem::path streamPath = std::filesystem::u8path(patch_fn ? patch_fn : fn.c_str());
+    streamPath += ".part";
+    SAFE_FREE(patch_fn);
+
+    uint32_t crc32 = (uint32_t)json_integer_value(value);
+    this->mainDownloader.addFile(patch->servers, this->fnToUrl(fn, crc32),
+        std::move(streamPath), crc32, this->filePriority(fn.c_str()),
+
+        // Success callback
+        [this, patch, fn, localFilesJs, value = ScopedJson(json_incref(value))]
+        (const DownloadUrl& url, StreamedFile& file) mutable {
+            if (file.crc32() != json_integer_value(*value)) {
+                this->callProgressCallback(patch, fn, url, GET_CRC32_ERROR);
+                return ;
+            }
+            if (patch_file_replace(patch, fn.c_str(), file.path().u8string().c_str()) != 0) {
+                this->callProgressCallback(patch, fn, url, GET_SYSTEM_ERROR, "file write failed");
+                return ;
+            }
+            this->callProgressCallback(patch, fn, url, GET_OK, "", file.size(), file.size());
+            localFilesJs->set(fn.c_str(), *value);
+            blobStoreAdd(patch, fn, file.crc32());
+        },
+
+        // Failure callback
+        [this, patch, fn](const DownloadUrl& url, HttpStatus httpStatus) {
+            get_status_t getStatus = this->httpStatusToGetStatus(httpStatus);
+            this->callProgressCallback(patch, fn, url, getStatus, httpStatus.toString());
+        },
+
+        // Progress callback
+        [this, patch, fn](const DownloadUrl& url, size_t file_progress, size_t file_size) {
+            return this->callProgressCallback(patch, fn, url, GET_DOWNLOADING, "", file_progress, file_size);
+        }
+    );
+}
+
+void Update::startDeltaDownload(const patch_t *patch, const std::string& fn, json_t *oldValue, json_t *value,
+                                const std::shared_ptr<FilesJsJournal>& localFilesJs)
+{
+    uint32_t oldCrc = (uint32_t)json_integer_value(oldValue);
+    uint32_t newCrc = (uint32_t)json_integer_value(value);
+    char deltaSuffix[32];
+    snprintf(deltaSuffix, sizeof(deltaSuffix), ".%08x-%08x.delta", oldCrc, newCrc);
+    std::string deltaFn = fn + deltaSuffix;
+
+    // The File tries the next server after every failure, but one server
+    // not having the delta is enough to fall back to the full file. Once
+    // that happened, any other attempt is cancelled or ignored.
+    auto settled = std::make_shared<std::atomic<bool>>(false);
+    auto fallback = [this, patch, fn, settled, localFilesJs, value = ScopedJson(json_incref(value))]() {
+        if (!settled->exchange(true)) {
+            this->startFullDownload(patch, fn, *value, localFilesJs);
+        }
+    };
+
+    this->mainDownloader.addFile(patch->servers, this->fnToUrl(deltaFn, newCrc),
+        // Success callback
+        [this, patch, fn, oldCrc, newCrc, settled, fallback, localFilesJs, value = ScopedJson(json_incref(value))]
+        (const DownloadUrl& url, std::vector<uint8_t>& data) {
+            if (settled->load()) {
+                return ;
+            }
+            if (!this->applyDelta(patch, fn, oldCrc, newCrc, data)) {
+                log_printf("%s/%s: delta doesn't apply, downloading the full file\n", patch->id, fn.c_str());
+                fallback();
+                return ;
+            }
+            settled->store(true);
+            this->callProgressCallback(patch, fn, url, GET_OK, "", data.size(), data.size());
+            localFilesJs->set(fn.c_str(), *value);
+            blobStoreAdd(patch, fn, newCrc);
+        },
 
-        this->mainDownloader.addFile(patch->servers, this->fnToUrl(fn, (uint32_t)json_integer_value(value)),
+        // Failure callback
+        [fallback](const DownloadUrl&, HttpStatus) {
+            fallback();
+        },
 
-            // Success callback
-            [this, patch, fn = std::string(fn), localFilesJs, value = ScopedJson(json_incref(value))]
-            (const DownloadUrl& url, std::vector<uint8_t>& data) mutable {
-                if (crc32::update(this->crc32Table, 0, data.data(), data.size()) != json_integer_value(*value)) {
-                    this->callProgressCallback(patch, fn, url, GET_CRC32_ERROR);
-                    return ;
+        // Progress callback
+        [this, patch, fn, settled](const DownloadUrl& url, size_t file_progress, size_t file_size) {
+            if (settled->load()) {
+                return false;
+            }
+            return this->callProgressCallback(patch, fn, url, GET_DOWNLOADING, "", file_progress, file_size);
+        }
+    );
+}
+
+bool Update::applyDelta(const patch_t *patch, const std::string& fn, uint32_t oldCrc, uint32_t newCrc,
+                        const std::vector<uint8_t>& data)
+{
+    size_t oldSize;
+    void *oldBuffer = patch_file_load(patch, fn.c_str(), &oldSize);
+    if (!oldBuffer || Crc32::compute(0, oldBuffer, oldSize) != oldCrc) {
+        // Modified since the last update
+        SAFE_FREE(oldBuffer);
+        return false;
+    }
+    size_t newSize;
+    void *newBuffer = delta_apply(oldBuffer, oldSize, data.data(), data.size(), &newSize);
+    free(oldBuffer);
+    if (!newBuffer || Crc32::compute(0, newBuffer, newSize) != newCrc) {
+        SAFE_FREE(newBuffer);
+        return false;
+    }
+
+    // Same atomic replacement as for full downloads.
+    char *patch_fn = fn_for_patch(patch, fn.c_str());
+    std::string partFn = patch_fn ? patch_fn : fn;
+    partFn += ".part";
+    SAFE_FREE(patch_fn);
+    bool ret = file_write(partFn.c_str(), newBuffer, newSize) == 0
+        && patch_file_replace(patch, fn.c_str(), partFn.c_str()) == 0;
+    free(newBuffer);
+    return ret;
+}
+
+bool Update::installFromBlobStore(const patch_t *patch, const std::string& fn, json_t *value,
+                                  const std::shared_ptr<FilesJsJournal>& localFilesJs)
+{
+    std::filesystem::path partPath = patchFilePath(patch, fn);
+    partPath += ".part";
+    uint32_t crc32 = (uint32_t)json_integer_value(value);
+    if (!BlobStore::fetch(crc32, partPath)) {
+        return false;
+    }
+    if (patch_file_replace(patch, fn.c_str(), partPath.u8string().c_str()) != 0) {
+        std::error_code ec;
+        std::filesystem::remove(partPath, ec);
+        return false;
+    }
+    localFilesJs->set(fn.c_str(), value);
+    return true;
+}
+
+void Update::installFromBundle(const patch_t *patch, downloads_t& downloads,
+                               const std::shared_ptr<FilesJsJournal>& localFilesJs)
+{
+    // Runs on a files.js thread, which can block until the bundle is done,
+    // since the main downloader only starts after all files.js are in.
+    Downloader bundleDownloader;
+
+    ScopedJson bundleJs;
+    bundleDownloader.addFile(patch->servers, BUNDLE_JS_FN,
+        [&bundleJs](const DownloadUrl&, std::vector<uint8_t>& data) {
+            bundleJs = json5_loadb(data.data(), data.size(), nullptr);
+        }
+    );
+    bundleDownloader.wait();
+    json_t *bundleFiles = json_object_get(*bundleJs, "files");
+    json_t *bundleCrc = json_object_get(*bundleJs, "crc32");
+    if (!json_is_object(bundleFiles) || !json_is_integer(bundleCrc)) {
+        // No bundle on this server, which is fine.
+        return;
+    }
+
+    // Only files whose version in the bundle is the one we want.
+    std::vector<size_t> fromBundle;
+    for (size_t i = 0; i < downloads.size(); i++) {
+        if (json_equal(json_object_get(bundleFiles, downloads[i].first.c_str()), downloads[i].second)) {
+            fromBundle.push_back(i);
+        }
+    }
+    if (fromBundle.size() < BUNDLE_MIN_FILES) {
+        return;
+    }
+    log_printf("%s: installing %zu files from %s\n", patch->id, fromBundle.size(), BUNDLE_ZIP_FN);
+
+    char *patch_fn = fn_for_patch(patch, BUNDLE_ZIP_FN);
+    std::filesystem::path streamPath = std::filesystem::u8path(patch_fn ? patch_fn : BUNDLE_ZIP_FN);
+    streamPath += ".part";
+    SAFE_FREE(patch_fn);
+
+    std::vector<uint8_t> installed(downloads.size(), false);
+    uint32_t crc32 = (uint32_t)json_integer_value(bundleCrc);
+    bundleDownloader.addFile(patch->servers, this->fnToUrl(BUNDLE_ZIP_FN, crc32),
+        std::move(streamPath), crc32, 1,
+
+        [this, patch, crc32, &downloads, &fromBundle, &installed, &localFilesJs]
+        (const DownloadUrl& url, StreamedFile& file) {
+            if (file.crc32() != crc32) {
+                this->callProgressCallback(patch, BUNDLE_ZIP_FN, url, GET_CRC32_ERROR);
+                return;
+            }
+            zip_t *zip = zip_open(file.path().u8string().c_str());
+            if (!zip) {
+                this->callProgressCallback(patch, BUNDLE_ZIP_FN, url, GET_SYSTEM_ERROR, "invalid archive");
+                return;
+            }
+            this->callProgressCallback(patch, BUNDLE_ZIP_FN, url, GET_OK, "", file.size(), file.size());
+
+            // Decompression and writing are independent for every file.
+            parallel_for(fromBundle.size(), task_worker_count() + 1, [this, patch, zip, &url, &downloads, &fromBundle, &installed, &localFilesJs](size_t j) {
+                const size_t i = fromBundle[j];
+                const std::string& fn = downloads[i].first;
+                json_t *crc = downloads[i].second;
+                size_t size;
+                void *buffer = zip_file_load(zip, fn.c_str(), &size);
+                if (!buffer || Crc32::compute(0, buffer, size) != (uint32_t)json_integer_value(crc)) {
+                    // Left to the regular download.
+                    SAFE_FREE(buffer);
+                    return;
                 }
-                if (patch_file_store(patch, fn.c_str(), data.data(), data.size()) != 0) {
-                    this->callProgressCallback(patch, fn, url, GET_SYSTEM_ERROR, "file write failed");
-                    return ;
+                // The old file might be a link into the blob store,
+                // which must not be overwritten.
+                patch_file_delete(patch, fn.c_str());
+                if (patch_file_store(patch, fn.c_str(), buffer, size) == 0) {
+                    localFilesJs->set(fn.c_str(), crc);
+                    this->callProgressCallback(patch, fn, url, GET_OK, "", size, size);
+                    blobStoreAdd(patch, fn, (uint32_t)json_integer_value(crc));
+                    installed[i] = true;
                 }
-                this->callProgressCallback(patch, fn, url, GET_OK, "", data.size(), data.size());
-                json_object_set(*localFilesJs, fn.c_str(), *value);
-            },
-
-            // Failure callback
-            [this, patch, fn = std::string(fn)](const DownloadUrl& url, HttpStatus httpStatus) {
-                get_status_t getStatus = this->httpStatusToGetStatus(httpStatus);
-                this->callProgressCallback(patch, fn, url, getStatus, httpStatus.toString());
-            },
-
-            // Progress callback
-            [this, patch, fn = std::string(fn)](const DownloadUrl& url, size_t file_progress, size_t file_size) {
-                return this->callProgressCallback(patch, fn, url, GET_DOWNLOADING, "", file_progress, file_size);
-            }
-        );
+                free(buffer);
+            });
+            zip_close(zip);
+        },
+
+        [patch](const DownloadUrl&, HttpStatus) {
+            log_printf("%s: downloading %s failed, falling back to single files\n", patch->id, BUNDLE_ZIP_FN);
+        },
+
+        [this, patch](const DownloadUrl& url, size_t file_progress, size_t file_size) {
+            return this->callProgressCallback(patch, BUNDLE_ZIP_FN, url, GET_DOWNLOADING, "", file_progress, file_size);
+        }
+    );
+    bundleDownloader.wait();
+
+    size_t out = 0;
+    for (size_t i = 0; i < downloads.size(); i++) {
+        if (!installed[i]) {
+            downloads[out++] = std::move(downloads[i]);
+        }
     }
+    downloads.resize(out);
+}
+
+int Update::filePriority(const char *fn)
+{
+    // Global files and the files of the running game are needed first,
+    // the files for other games can wait.
+    const char *games[] = { runconfig_game_get(), nullptr };
+    return update_filter_games(fn, games[0] ? games : nullptr) ? 1 : 0;
 }
 
 void Update::startPatchUpdate(const patch_t *patch)
@@ -230,11 +618,57 @@ void Update::startPatchUpdate(const patch_t *patch)
         return ;
     }
 
-    this->filesJsDownloader.addFile(patch->servers, "files.js",
-        [this, patch](const DownloadUrl&, std::vector<uint8_t>& data) {
-            this->onFilesJsComplete(patch, data);
+    // The last remote files.js, together with the validators that each
+    // server sent for it. If it's still the current one, the server only
+    // has to confirm that with a 304.
+    ScopedJson remoteCache = patch_json_load(patch, REMOTE_FILES_JS_CACHE_FN, nullptr);
+    json_t *cachedFilesJs = json_object_get(*remoteCache, "files");
+    File::validators_t validators;
+    if (json_is_object(cachedFilesJs)) {
+        const char *serverUrl;
+        json_t *serverValidators;
+        json_object_foreach(json_object_get(*remoteCache, "validators"), serverUrl, serverValidators) {
+            const char *etag = json_string_value(json_object_get(serverValidators, "etag"));
+            const char *lastModified = json_string_value(json_object_get(serverValidators, "last_modified"));
+            HttpValidators v;
+            v.etag = etag ? etag : "";
+            v.lastModified = lastModified ? lastModified : "";
+            if (!v.empty()) {
+                validators[serverUrl] = v;
+            }
+        }
+    }
+
+    this->filesJsDownloader.addFile(patch->servers, "files.js", std::move(validators),
+        [this, patch](const DownloadUrl& url, std::vector<uint8_t>& data, const HttpValidators& validators) {
+            ScopedJson remoteFilesJs = json5_loadb(data.data(), data.size(), nullptr);
+            if (*remoteFilesJs == nullptr) {
+                log_printf("%s: files.js isn't a valid json file!\n", patch->id);
+                return ;
+            }
+            this->onFilesJsComplete(patch, *remoteFilesJs);
+
+            ScopedJson newCache = json_object();
+            if (!validators.empty()) {
+                json_t *serverValidators = json_object();
+                if (!validators.etag.empty()) {
+                    json_object_set_new(serverValidators, "etag", json_string(validators.etag.c_str()));
+                }
+                if (!validators.lastModified.empty()) {
+                    json_object_set_new(serverValidators, "last_modified", json_string(validators.lastModified.c_str()));
+                }
+                json_object_set_new(*newCache, "validators", json_pack("{s:o}", url.getServer().getUrl().c_str(), serverValidators));
+                json_object_set(*newCache, "files", *remoteFilesJs);
+            }
+            patch_json_store(patch, REMOTE_FILES_JS_CACHE_FN, *newCache);
         },
-        [patch_id = std::string(patch->id)](const DownloadUrl& url, HttpStatus httpStatus) {
+        [this, patch, remoteCache](const DownloadUrl& url, HttpStatus httpStatus) {
+            if (httpStatus.get() == HttpStatus::NotModified) {
+                // Still diffed against the local files.js, in case the last
+                // update didn't get all files, or used a different filter.
+                this->onFilesJsComplete(patch, json_object_get(*remoteCache, "files"));
+                return ;
+            }
             if (httpStatus.get() == HttpStatus::Cancelled) {
                 // Another file finished before
                 return ;
@@ -253,6 +687,7 @@ void Update::run(const std::list<const patch_t*>& patchs)
     this->filesJsDownloader.wait();
     // At this point, dlPatchFiles have been fully populated
     this->mainDownloader.wait();
+    this->publishStats(patchs);
 }
 
 patch_t patch_bootstrap(const patch_desc_t *sel, const repo_t *repo)
@@ -266,7 +701,13 @@ patch_t patch_bootstrap(const patch_desc_t *sel, const repo_t *repo)
     url += "/patch.js";
     auto [patch_js, _] = ServerCache::get().downloadJsonFile(url);
 
-    RepoWrite(repo);
+    {
+        // thcrap_configure bootstraps several patches of the same repository
+        // in parallel.
+        static std::mutex repo_write_mutex;
+        std::scoped_lock<std::mutex> lock(repo_write_mutex);
+        RepoWrite(repo);
+    }
 	patch_t patch_info = patch_build(sel);
 	patch_json_store(&patch_info, "patch.js", *patch_js);
 	// TODO: Nice, friendly error
@@ -282,34 +723,56 @@ int update_filter_global(const char *fn, void*)
 int update_filter_games(const char *fn, void *param)
 {
     const char **games = static_cast<const char **>(param);
-	size_t fn_len = strlen(fn);
+    const char *slash = strchr(fn, '/');
 
-    if (!games) {
-	    return update_filter_global(fn, nullptr);
+    if (!games || !slash) {
+        return update_filter_global(fn, nullptr);
     }
 
+    // We will need to match "th14", but not "th143", so the whole
+    // directory name has to be equal.
+    const size_t dir_len = slash - fn;
     for (size_t i = 0; games[i]; i++) {
-		// We will need to match "th14", but not "th143".
-		size_t game_len = strlen(games[i]);
-		if(
-			fn_len > game_len
-			&& !strncmp(fn, games[i], game_len)
-			&& fn[game_len] == '/'
-		) {
-			return 1;
-		}
+        if (!strncmp(fn, games[i], dir_len) && games[i][dir_len] == '\0') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Same as update_filter_games(), but with the games put into a set once,
+// so that filtering every file of every files.js is a single lookup of the
+// directory name, no matter how many games are selected.
+static std::function<bool(const std::string&)> update_games_filter(const char **games)
+{
+    if (!games) {
+        return [](const std::string& fn) {
+            return update_filter_global(fn.c_str(), nullptr) != 0;
+        };
+    }
+    std::unordered_set<std::string> dirs;
+    for (size_t i = 0; games[i]; i++) {
+        dirs.emplace(games[i]);
     }
+    return [dirs = std::move(dirs)](const std::string& fn) {
+        size_t slash = fn.find('/');
+        return slash == std::string::npos || dirs.count(fn.substr(0, slash)) != 0;
+    };
+}
 
-	return update_filter_global(fn, NULL);
+static std::function<bool(const std::string&)> update_filter_lambda(update_filter_func_t filter_func, void *filter_data)
+{
+    if (filter_func == update_filter_games) {
+        return update_games_filter(static_cast<const char **>(filter_data));
+    }
+    return [filter_func, filter_data](const std::string& fn) -> bool {
+        return filter_func(fn.c_str(), filter_data) != 0;
+    };
 }
 
 void stack_update(update_filter_func_t filter_func, void *filter_data, progress_callback_t progress_callback, void *progress_param)
 {
-    auto filter_lambda =
-        [filter_func, filter_data](const std::string& fn) -> bool {
-            return filter_func(fn.c_str(), filter_data) != 0;
-        };
-    Update update(filter_lambda, progress_callback, progress_param);
+    Update update(update_filter_lambda(filter_func, filter_data), progress_callback, progress_param);
 
     std::list<const patch_t*> patches;
     stack_foreach_cpp([&patches](const patch_t *patch) {
@@ -318,6 +781,12 @@ void stack_update(update_filter_func_t filter_func, void *filter_data, progress_
     update.run(patches);
 }
 
+void patch_update(const patch_t *patch, update_filter_func_t filter_func, void *filter_data, progress_callback_t progress_callback, void *progress_param)
+{
+    Update update(update_filter_lambda(filter_func, filter_data), progress_callback, progress_param);
+    update.run({ patch });
+}
+
 // Helper class to free a patch automatically when it goes out of scope
 class ScopedPatch
 {
@@ -419,10 +888,7 @@ void global_update(progress_callback_t progress_callback, void *progress_param)
         }
     }
 
-    auto filter_lambda =
-        [games](const std::string& fn) -> bool {
-            return update_filter_games(fn.c_str(), games);
-        };
+    auto filter_lambda = update_games_filter(const_cast<const char **>(games));
     Update update(filter_lambda, progress_callback, progress_param);
     update.run(patches);
 
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <chrono>
 #include <list>
+#include <map>
+#include <mutex>
 #include <string>
 #include <jansson.h>
 #include "downloader.h"
@@ -55,6 +58,13 @@ typedef struct {
     // Number of files to download. Note that it will be 0 if
     // all the files.js haven't been downloaded yet.
     size_t nb_files_total;
+
+    // Number of files that are currently downloaded at the same time.
+    // Adjusted automatically during the update.
+    size_t concurrency;
+    // Overall download speed in bytes per second, or 0 if it hasn't been
+    // measured yet.
+    double throughput;
 } progress_callback_status_t;
 
 // Callback called when the download progresses.
@@ -83,6 +93,9 @@ int update_filter_games(const char *fn, void *games);
 patch_t patch_bootstrap(const patch_desc_t *sel, const repo_t *repo);
 
 void stack_update(update_filter_func_t filter_func, void *filter_data, progress_callback_t progress_callback, void *progress_param);
+// Same as stack_update(), but only for [patch], which doesn't need to be
+// part of the stack.
+void patch_update(const patch_t *patch, update_filter_func_t filter_func, void *filter_data, progress_callback_t progress_callback, void *progress_param);
 void global_update(progress_callback_t progress_callback, void *progress_param);
 
 void http_mod_exit(void);
@@ -93,10 +106,14 @@ void thcrap_update_exit(void);
 #ifdef __cplusplus
 }
 
+class FilesJsJournal;
+
 class Update
 {
 private:
     typedef std::function<bool(const std::string&)> filter_t;
+    // Patch file name and its remote files.js entry
+    typedef std::vector<std::pair<std::string, json_t*>> downloads_t;
 
     // Downloader used for the files.js downloads
     Downloader filesJsDownloader;
@@ -110,15 +127,51 @@ private:
     progress_callback_t progressCallback;
     void *progressData;
 
-    uint32_t crc32Table[256];
+    // Totals per patch, for update_patch_stats_get()
+    struct PatchStats
+    {
+        size_t files = 0;
+        size_t bytes = 0;
+        size_t failures = 0;
+        std::chrono::steady_clock::time_point first;
+        std::chrono::steady_clock::time_point last;
+    };
+    std::mutex statsMutex;
+    std::map<const patch_t*, PatchStats> patchStats;
 
     void startPatchUpdate(const patch_t *patch);
-    void onFilesJsComplete(const patch_t *patch, const std::vector<uint8_t>& file);
+    void onFilesJsComplete(const patch_t *patch, json_t *remoteFilesJs);
+    // Installs [fn] from the blob store if another patch already has the
+    // version [value]. Returns false if it has to be downloaded.
+    bool installFromBlobStore(const patch_t *patch, const std::string& fn, json_t *value,
+                              const std::shared_ptr<FilesJsJournal>& localFilesJs);
+    // Installs as many of [downloads] as possible from the bundle of
+    // [patch], and removes them from the list.
+    void installFromBundle(const patch_t *patch, downloads_t& downloads,
+                           const std::shared_ptr<FilesJsJournal>& localFilesJs);
+    // Downloads the version [value] of [fn] in full.
+    void startFullDownload(const patch_t *patch, const std::string& fn, json_t *value,
+                           const std::shared_ptr<FilesJsJournal>& localFilesJs);
+    // Tries to update the local file from the version [oldValue] to [value]
+    // through a delta, falling back to startFullDownload() if the server
+    // doesn't have one or if it doesn't apply.
+    void startDeltaDownload(const patch_t *patch, const std::string& fn, json_t *oldValue, json_t *value,
+                            const std::shared_ptr<FilesJsJournal>& localFilesJs);
+    // Applies the delta in [data] to the local version [oldCrc] of [fn].
+    // Returns false if the result isn't [newCrc].
+    bool applyDelta(const patch_t *patch, const std::string& fn, uint32_t oldCrc, uint32_t newCrc,
+                    const std::vector<uint8_t>& data);
     bool callProgressCallback(const patch_t *patch, const std::string& fn, const DownloadUrl& url,
                               get_status_t getStatus, std::string error = "",
                               size_t file_progress = 0, size_t file_size = 0);
+    void recordPatchStats(const patch_t *patch, const std::string& fn, get_status_t getStatus, size_t file_size);
+    // Writes the statistics of [patchs] and of every server to the log,
+    // and keeps them for update_patch_stats_get().
+    void publishStats(const std::list<const patch_t*>& patchs);
     get_status_t httpStatusToGetStatus(HttpStatus status);
     std::string fnToUrl(const std::string& url, uint32_t crc32);
+    // Download priority of a patch file, see Downloader::addFile()
+    int filePriority(const char *fn);
 
 public:
     Update(filter_t filterCallback, progress_callback_t progressCallback, void *progressData);